@@ -0,0 +1,326 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bitops.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace dfly {
+
+namespace {
+
+inline uint64_t LoadWord(const uint8_t* src) {
+  uint64_t res;
+  memcpy(&res, src, sizeof(res));
+  return res;
+}
+
+inline void StoreWord(uint64_t val, uint8_t* dest) {
+  memcpy(dest, &val, sizeof(val));
+}
+
+template <BitOpType op> inline uint64_t ApplyOp(uint64_t left, uint64_t right) {
+  if constexpr (op == BitOpType::AND) {
+    return left & right;
+  } else if constexpr (op == BitOpType::OR) {
+    return left | right;
+  } else {
+    return left ^ right;
+  }
+}
+
+// The scalar kernels work on 64 bit words, and finish the vector kernels on their tails.
+
+uint64_t CountSetBitsScalar(const uint8_t* data, size_t len) {
+  uint64_t res = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    res += absl::popcount(LoadWord(data + i));
+  }
+  for (; i < len; ++i) {
+    res += absl::popcount(data[i]);
+  }
+  return res;
+}
+
+template <BitOpType op> void BitOpScalar(const uint8_t* src, size_t len, uint8_t* dest) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    StoreWord(ApplyOp<op>(LoadWord(dest + i), LoadWord(src + i)), dest + i);
+  }
+  for (; i < len; ++i) {
+    dest[i] = ApplyOp<op>(dest[i], src[i]);
+  }
+}
+
+void BitNotScalar(uint8_t* data, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    StoreWord(~LoadWord(data + i), data + i);
+  }
+  for (; i < len; ++i) {
+    data[i] = ~data[i];
+  }
+}
+
+size_t FindFirstByteNotEqualScalar(const uint8_t* data, size_t len, uint8_t val) {
+  const uint64_t pattern = 0x0101010101010101ULL * val;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    // The lowest differing byte of a little endian word is the first one in memory.
+    if (uint64_t diff = LoadWord(data + i) ^ pattern; diff) {
+      return i + absl::countr_zero(diff) / 8;
+    }
+  }
+  for (; i < len; ++i) {
+    if (data[i] != val)
+      return i;
+  }
+  return len;
+}
+
+#if defined(__x86_64__)
+
+// Counts the bits of every nibble with a lookup table in a shuffle, and sums the byte counters
+// into 64 bit lanes before they may overflow (Mula's algorithm).
+constexpr size_t kMaxByteSums = 31;  // 31 * 8 bits fit in a byte counter.
+
+__attribute__((target("avx2"))) uint64_t CountSetBitsAvx2(const uint8_t* data, size_t len) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                                          2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+
+  size_t i = 0;
+  while (i + 32 <= len) {
+    __m256i local = _mm256_setzero_si256();
+    for (size_t j = 0; j < kMaxByteSums && i + 32 <= len; ++j, i += 32) {
+      __m256i vec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+      __m256i lo = _mm256_and_si256(vec, low_mask);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(vec, 4), low_mask);
+      local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, lo));
+      local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, hi));
+    }
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, _mm256_setzero_si256()));
+  }
+
+  uint64_t res = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                 _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+  return res + CountSetBitsScalar(data + i, len - i);
+}
+
+// Sums the 64-bit lanes. Unlike _mm512_reduce_add_epi64 it does not trip -Wuninitialized in
+// the gcc headers.
+__attribute__((target("avx512f"))) uint64_t SumLanes(__m512i acc) {
+  alignas(64) uint64_t lanes[8];
+  _mm512_store_si512(lanes, acc);
+  uint64_t res = 0;
+  for (uint64_t lane : lanes) {
+    res += lane;
+  }
+  return res;
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t CountSetBitsAvx512(const uint8_t* data,
+                                                                       size_t len) {
+  // The popcounts of the nibbles 0..15 in every 128-bit lane.
+  const __m512i lookup = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+  const __m512i low_mask = _mm512_set1_epi8(0x0f);
+  __m512i acc = _mm512_setzero_si512();
+
+  size_t i = 0;
+  while (i + 64 <= len) {
+    __m512i local = _mm512_setzero_si512();
+    for (size_t j = 0; j < kMaxByteSums && i + 64 <= len; ++j, i += 64) {
+      __m512i vec = _mm512_loadu_si512(data + i);
+      __m512i lo = _mm512_and_si512(vec, low_mask);
+      __m512i hi = _mm512_and_si512(_mm512_srli_epi16(vec, 4), low_mask);
+      local = _mm512_add_epi8(local, _mm512_shuffle_epi8(lookup, lo));
+      local = _mm512_add_epi8(local, _mm512_shuffle_epi8(lookup, hi));
+    }
+    acc = _mm512_add_epi64(acc, _mm512_sad_epu8(local, _mm512_setzero_si512()));
+  }
+
+  return SumLanes(acc) + CountSetBitsScalar(data + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) uint64_t CountSetBitsVpopcnt(
+    const uint8_t* data, size_t len) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(data + i)));
+  }
+
+  return SumLanes(acc) + CountSetBitsScalar(data + i, len - i);
+}
+
+template <BitOpType op>
+__attribute__((target("avx2"))) void BitOpAvx2(const uint8_t* src, size_t len, uint8_t* dest) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest + i));
+    __m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i res;
+    if constexpr (op == BitOpType::AND) {
+      res = _mm256_and_si256(left, right);
+    } else if constexpr (op == BitOpType::OR) {
+      res = _mm256_or_si256(left, right);
+    } else {
+      res = _mm256_xor_si256(left, right);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), res);
+  }
+
+  BitOpScalar<op>(src + i, len - i, dest + i);
+}
+
+template <BitOpType op>
+__attribute__((target("avx512f"))) void BitOpAvx512(const uint8_t* src, size_t len,
+                                                    uint8_t* dest) {
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m512i left = _mm512_loadu_si512(dest + i);
+    __m512i right = _mm512_loadu_si512(src + i);
+    __m512i res;
+    if constexpr (op == BitOpType::AND) {
+      res = _mm512_and_si512(left, right);
+    } else if constexpr (op == BitOpType::OR) {
+      res = _mm512_or_si512(left, right);
+    } else {
+      res = _mm512_xor_si512(left, right);
+    }
+    _mm512_storeu_si512(dest + i, res);
+  }
+
+  BitOpScalar<op>(src + i, len - i, dest + i);
+}
+
+__attribute__((target("avx2"))) void BitNotAvx2(uint8_t* data, size_t len) {
+  const __m256i ones = _mm256_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i vec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(vec, ones));
+  }
+
+  BitNotScalar(data + i, len - i);
+}
+
+__attribute__((target("avx512f"))) void BitNotAvx512(uint8_t* data, size_t len) {
+  const __m512i ones = _mm512_set1_epi32(-1);
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    _mm512_storeu_si512(data + i, _mm512_xor_si512(_mm512_loadu_si512(data + i), ones));
+  }
+
+  BitNotScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) size_t FindFirstByteNotEqualAvx2(const uint8_t* data, size_t len,
+                                                                 uint8_t val) {
+  const __m256i pattern = _mm256_set1_epi8(val);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i vec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    uint32_t diff = ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(vec, pattern)));
+    if (diff)
+      return i + absl::countr_zero(diff);
+  }
+
+  return i + FindFirstByteNotEqualScalar(data + i, len - i, val);
+}
+
+__attribute__((target("avx512f,avx512bw"))) size_t FindFirstByteNotEqualAvx512(
+    const uint8_t* data, size_t len, uint8_t val) {
+  const __m512i pattern = _mm512_set1_epi8(val);
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    uint64_t diff = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(data + i), pattern);
+    if (diff)
+      return i + absl::countr_zero(diff);
+  }
+
+  return i + FindFirstByteNotEqualScalar(data + i, len - i, val);
+}
+
+#endif
+
+struct Kernels {
+  uint64_t (*count_set_bits)(const uint8_t*, size_t);
+  void (*bit_op[3])(const uint8_t*, size_t, uint8_t*);  // indexed by BitOpType.
+  void (*bit_not)(uint8_t*, size_t);
+  size_t (*find_first_byte_not_equal)(const uint8_t*, size_t, uint8_t);
+};
+
+SimdLevel SupportedSimdLevel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return SimdLevel::AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SimdLevel::AVX2;
+#endif
+  return SimdLevel::SCALAR;
+}
+
+Kernels MakeKernels(SimdLevel level) {
+  Kernels res{CountSetBitsScalar,
+              {BitOpScalar<BitOpType::AND>, BitOpScalar<BitOpType::OR>,
+               BitOpScalar<BitOpType::XOR>},
+              BitNotScalar,
+              FindFirstByteNotEqualScalar};
+
+#if defined(__x86_64__)
+  if (level == SimdLevel::AVX2) {
+    res = Kernels{CountSetBitsAvx2,
+                  {BitOpAvx2<BitOpType::AND>, BitOpAvx2<BitOpType::OR>, BitOpAvx2<BitOpType::XOR>},
+                  BitNotAvx2,
+                  FindFirstByteNotEqualAvx2};
+  } else if (level == SimdLevel::AVX512) {
+    res = Kernels{__builtin_cpu_supports("avx512vpopcntdq") ? CountSetBitsVpopcnt
+                                                             : CountSetBitsAvx512,
+                  {BitOpAvx512<BitOpType::AND>, BitOpAvx512<BitOpType::OR>,
+                   BitOpAvx512<BitOpType::XOR>},
+                  BitNotAvx512,
+                  FindFirstByteNotEqualAvx512};
+  }
+#endif
+
+  return res;
+}
+
+Kernels kernels = MakeKernels(SupportedSimdLevel());
+
+}  // namespace
+
+uint64_t CountSetBits(const uint8_t* data, size_t len) {
+  return kernels.count_set_bits(data, len);
+}
+
+void BitOpInPlace(BitOpType op, const uint8_t* src, size_t len, uint8_t* dest) {
+  kernels.bit_op[static_cast<uint8_t>(op)](src, len, dest);
+}
+
+void BitNotInPlace(uint8_t* data, size_t len) {
+  kernels.bit_not(data, len);
+}
+
+size_t FindFirstByteNotEqual(const uint8_t* data, size_t len, uint8_t val) {
+  return kernels.find_first_byte_not_equal(data, len, val);
+}
+
+SimdLevel SetBitOpsSimdLevel(SimdLevel level) {
+  level = std::min(level, SupportedSimdLevel());
+  kernels = MakeKernels(level);
+  return level;
+}
+
+}  // namespace dfly
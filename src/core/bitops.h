@@ -0,0 +1,36 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dfly {
+
+// Kernels over bitmaps for BITCOUNT, BITOP and BITPOS. They pick at runtime the widest vector
+// instructions that the CPU supports.
+
+enum class BitOpType : uint8_t { AND, OR, XOR };
+
+// The instruction sets of the kernels, from the narrowest to the widest.
+enum class SimdLevel : uint8_t { SCALAR, AVX2, AVX512 };
+
+// Returns the number of set bits in data.
+uint64_t CountSetBits(const uint8_t* data, size_t len);
+
+// dest[i] = dest[i] op src[i] for every i < len.
+void BitOpInPlace(BitOpType op, const uint8_t* src, size_t len, uint8_t* dest);
+
+// data[i] = ~data[i] for every i < len.
+void BitNotInPlace(uint8_t* data, size_t len);
+
+// Returns the index of the first byte of data that is not equal to val, or len if none.
+size_t FindFirstByteNotEqual(const uint8_t* data, size_t len, uint8_t val);
+
+// Limits the kernels to the given instruction set, for tests and benchmarks. Returns the level
+// that is used, which is lower than the requested one if the CPU does not support it.
+SimdLevel SetBitOpsSimdLevel(SimdLevel level);
+
+}  // namespace dfly
@@ -0,0 +1,321 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom_filter.h"
+
+#include <absl/base/config.h>
+#include <xxhash.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+static_assert(ABSL_IS_LITTLE_ENDIAN, "the serialized words are copied as is");
+
+// The serialized form: the header, followed by every sub-filter as its header and its blocks.
+constexpr char kMagic[8] = {'D', 'F', 'B', 'L', 'O', 'O', 'M', '1'};
+
+struct Header {
+  char magic[8];
+  double error_rate;
+  uint64_t capacity;
+  uint32_t expansion;
+  uint32_t num_filters;
+};
+
+struct FilterHeader {
+  uint64_t capacity;
+  uint64_t num_items;
+  uint64_t num_blocks;
+};
+
+static_assert(sizeof(Header) == 32 && sizeof(FilterHeader) == 24);
+
+// The sub-filter error rates shrink by this ratio, which bounds the total error rate by
+// 2 * error_rate.
+constexpr double kTighteningRatio = 0.5;
+
+// The odd constants of the split block Bloom filters of Parquet, which derive the bit of every
+// word of a block from the same 32 bits of the hash.
+constexpr uint32_t kSalt[BloomFilter::kBlockWords] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                                                      0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                                                      0x9efc4947U, 0x5c6bfb31U};
+
+// Fills mask with the bit of hash in every word of a block. The loop has a fixed trip count and
+// no branches, so that the compiler vectorizes it together with the block loops below.
+inline void BlockMask(uint32_t hash, uint64_t mask[]) {
+  for (unsigned i = 0; i < BloomFilter::kBlockWords; ++i)
+    mask[i] = 1ULL << ((hash * kSalt[i]) >> 26);
+}
+
+// The bits that give the error rate with kBlockWords hashes, i.e. the m of
+// p = (1 - e^(-k * n / m))^k, and an allowance for the uneven load of the blocks.
+uint32_t NumBlocks(uint64_t capacity, double error_rate) {
+  constexpr double kBlockingOverhead = 1.1;
+  constexpr double k = BloomFilter::kBlockWords;
+  double bits = -k * double(capacity) / log1p(-pow(error_rate, 1 / k)) * kBlockingOverhead;
+  double blocks = ceil(bits / (BloomFilter::kBlockSize * 8));
+  return clamp<double>(blocks, 1, UINT32_MAX);
+}
+
+}  // namespace
+
+bool BloomFilter::SubFilter::Contains(uint64_t hash) const {
+  uint64_t mask[kBlockWords];
+  BlockMask(hash, mask);
+  const uint64_t* block = Block(hash);
+  uint64_t missing = 0;
+  for (unsigned i = 0; i < kBlockWords; ++i)
+    missing |= mask[i] & ~block[i];
+  return missing == 0;
+}
+
+void BloomFilter::SubFilter::Insert(uint64_t hash) {
+  uint64_t mask[kBlockWords];
+  BlockMask(hash, mask);
+  uint64_t* block = Block(hash);
+  for (unsigned i = 0; i < kBlockWords; ++i)
+    block[i] |= mask[i];
+}
+
+BloomFilter::BloomFilter(pmr::memory_resource* mr) : mr_(mr), filters_(mr) {
+}
+
+BloomFilter::~BloomFilter() {
+  Clear();
+}
+
+void BloomFilter::Clear() {
+  for (const SubFilter& filter : filters_)
+    mr_->deallocate(filter.words, size_t(filter.num_blocks) * kBlockSize, kBlockSize);
+  filters_.clear();
+  size_ = sizeof(Header);
+}
+
+void BloomFilter::Init(double error_rate, uint64_t capacity, unsigned expansion) {
+  DCHECK(error_rate > 0 && error_rate < 1);
+  DCHECK_GT(capacity, 0u);
+
+  Clear();
+  error_rate_ = error_rate;
+  capacity_ = capacity;
+  expansion_ = expansion;
+  AddFilter(capacity, error_rate);
+}
+
+void BloomFilter::AddFilter(uint64_t capacity, double error_rate) {
+  SubFilter filter;
+  filter.capacity = capacity;
+  filter.num_items = 0;
+  filter.num_blocks = NumBlocks(capacity, error_rate);
+
+  size_t bytes = size_t(filter.num_blocks) * kBlockSize;
+  filter.words = static_cast<uint64_t*>(mr_->allocate(bytes, kBlockSize));
+  memset(filter.words, 0, bytes);
+
+  filters_.push_back(filter);
+  size_ += sizeof(FilterHeader) + bytes;
+}
+
+size_t BloomFilter::FilterSize(double error_rate, uint64_t capacity) {
+  return size_t(NumBlocks(capacity, error_rate)) * kBlockSize;
+}
+
+bool BloomFilter::HasMagic(string_view str) {
+  return str.size() >= sizeof(Header) && memcmp(str.data(), kMagic, sizeof(kMagic)) == 0;
+}
+
+bool BloomFilter::Parse(string_view str) {
+  Clear();
+  if (!HasMagic(str))
+    return false;
+
+  Header header;
+  memcpy(&header, str.data(), sizeof(header));
+  if (!(header.error_rate > 0 && header.error_rate < 1) || header.capacity == 0 ||
+      header.num_filters == 0) {
+    return false;
+  }
+
+  error_rate_ = header.error_rate;
+  capacity_ = header.capacity;
+  expansion_ = header.expansion;
+
+  str.remove_prefix(sizeof(header));
+  for (uint32_t i = 0; i < header.num_filters; ++i) {
+    FilterHeader fh;
+    if (str.size() < sizeof(fh))
+      break;
+    memcpy(&fh, str.data(), sizeof(fh));
+    str.remove_prefix(sizeof(fh));
+
+    if (fh.num_blocks == 0 || fh.num_blocks > UINT32_MAX ||
+        str.size() / kBlockSize < fh.num_blocks) {
+      break;
+    }
+
+    size_t bytes = size_t(fh.num_blocks) * kBlockSize;
+    SubFilter filter{fh.capacity, fh.num_items, uint32_t(fh.num_blocks), nullptr};
+    filter.words = static_cast<uint64_t*>(mr_->allocate(bytes, kBlockSize));
+    memcpy(filter.words, str.data(), bytes);
+    str.remove_prefix(bytes);
+
+    filters_.push_back(filter);
+    size_ += sizeof(fh) + bytes;
+  }
+
+  if (filters_.size() != header.num_filters || !str.empty()) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+uint64_t BloomFilter::Hash(string_view item) {
+  return XXH3_64bits(item.data(), item.size());
+}
+
+uint64_t BloomFilter::SubHash(uint64_t hash, size_t i) {
+  if (i == 0)
+    return hash;
+
+  // The finalizer of murmur3 over the hash mixed with the index of the sub-filter.
+  hash = (hash ^ i) * 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+BloomFilter::AddResult BloomFilter::AddHash(uint64_t hash) {
+  if (ExistsHash(hash))
+    return EXISTS;
+
+  if (filters_.back().num_items >= filters_.back().capacity) {
+    if (expansion_ == 0)
+      return FULL;
+
+    double error_rate = error_rate_ * pow(kTighteningRatio, filters_.size());
+    AddFilter(filters_.back().capacity * expansion_, error_rate);
+  }
+
+  SubFilter& filter = filters_.back();
+  filter.Insert(SubHash(hash, filters_.size() - 1));
+  ++filter.num_items;
+  return ADDED;
+}
+
+bool BloomFilter::ExistsHash(uint64_t hash) const {
+  // The latest sub-filter is the largest one, so it is the most likely to hold the item.
+  for (size_t i = filters_.size(); i-- > 0;) {
+    if (filters_[i].Contains(SubHash(hash, i)))
+      return true;
+  }
+  return false;
+}
+
+void BloomFilter::Prefetch(uint64_t hash) const {
+  for (size_t i = 0; i < filters_.size(); ++i)
+    __builtin_prefetch(filters_[i].Block(SubHash(hash, i)));
+}
+
+BloomFilter::AddResult BloomFilter::Add(string_view item) {
+  return AddHash(Hash(item));
+}
+
+bool BloomFilter::Exists(string_view item) const {
+  return ExistsHash(Hash(item));
+}
+
+// The batches are processed in windows, so that the prefetched blocks are not evicted before
+// they are probed.
+constexpr size_t kPrefetchWindow = 16;
+
+void BloomFilter::AddMany(absl::Span<const string_view> items, AddResult* res) {
+  uint64_t hashes[kPrefetchWindow];
+  for (size_t start = 0; start < items.size(); start += kPrefetchWindow) {
+    size_t len = min(kPrefetchWindow, items.size() - start);
+    for (size_t i = 0; i < len; ++i) {
+      hashes[i] = Hash(items[start + i]);
+      Prefetch(hashes[i]);
+    }
+
+    // Sequentially, since an item may repeat within the batch or make the filter scale.
+    for (size_t i = 0; i < len; ++i)
+      res[start + i] = AddHash(hashes[i]);
+  }
+}
+
+void BloomFilter::ExistsMany(absl::Span<const string_view> items, bool* res) const {
+  uint64_t hashes[kPrefetchWindow];
+  for (size_t start = 0; start < items.size(); start += kPrefetchWindow) {
+    size_t len = min(kPrefetchWindow, items.size() - start);
+    for (size_t i = 0; i < len; ++i) {
+      hashes[i] = Hash(items[start + i]);
+      Prefetch(hashes[i]);
+    }
+    for (size_t i = 0; i < len; ++i)
+      res[start + i] = ExistsHash(hashes[i]);
+  }
+}
+
+uint64_t BloomFilter::NumItems() const {
+  uint64_t res = 0;
+  for (const SubFilter& filter : filters_)
+    res += filter.num_items;
+  return res;
+}
+
+uint64_t BloomFilter::TotalCapacity() const {
+  uint64_t res = 0;
+  for (const SubFilter& filter : filters_)
+    res += filter.capacity;
+  return res;
+}
+
+void BloomFilter::Materialize(size_t offset, size_t len, char* dest) const {
+  DCHECK_LE(offset + len, size_);
+
+  // Copies the part of [src, src + n) at position pos of the serialized form that is in range.
+  size_t pos = 0;
+  auto emit = [&](const void* src, size_t n) {
+    size_t begin = max(pos, offset), end = min(pos + n, offset + len);
+    if (begin < end)
+      memcpy(dest + (begin - offset), static_cast<const char*>(src) + (begin - pos), end - begin);
+    pos += n;
+  };
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.error_rate = error_rate_;
+  header.capacity = capacity_;
+  header.expansion = expansion_;
+  header.num_filters = filters_.size();
+  emit(&header, sizeof(header));
+
+  for (const SubFilter& filter : filters_) {
+    if (pos >= offset + len)
+      break;
+
+    FilterHeader fh{filter.capacity, filter.num_items, filter.num_blocks};
+    emit(&fh, sizeof(fh));
+    emit(filter.words, size_t(filter.num_blocks) * kBlockSize);
+  }
+}
+
+size_t BloomFilter::MallocUsed() const {
+  size_t res = filters_.capacity() * sizeof(SubFilter);
+  for (const SubFilter& filter : filters_)
+    res += size_t(filter.num_blocks) * kBlockSize;
+  return res;
+}
+
+}  // namespace dfly
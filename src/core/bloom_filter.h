@@ -0,0 +1,140 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// A scalable Bloom filter. Every sub-filter is a split block Bloom filter: an item is hashed to
+// a single block of one cache line, in which it sets one bit in each of the kBlockWords words,
+// so that a lookup costs one cache miss per sub-filter. Once the last sub-filter holds its
+// capacity, a new one is added with expansion times its capacity and half its error rate, so
+// that the total error rate stays bounded. See "Scalable Bloom Filters" by Almeida et al. and
+// the split block Bloom filters of Apache Parquet.
+//
+// The filter is stored as a string value (see CompactObj::GetBloomFilter), whose raw bytes are
+// its serialized form, i.e. the RDB files and the replication transfer it as a string.
+class BloomFilter {
+ public:
+  static constexpr unsigned kBlockWords = 8;
+  static constexpr size_t kBlockSize = kBlockWords * sizeof(uint64_t);
+
+  // The defaults of RedisBloom.
+  static constexpr double kDefaultErrorRate = 0.01;
+  static constexpr uint64_t kDefaultCapacity = 100;
+  static constexpr unsigned kDefaultExpansion = 2;
+
+  enum AddResult : uint8_t { ADDED, EXISTS, FULL };
+
+  explicit BloomFilter(std::pmr::memory_resource* mr);
+  ~BloomFilter();
+
+  BloomFilter(const BloomFilter&) = delete;
+  void operator=(const BloomFilter&) = delete;
+
+  // Resets the filter to an empty one. error_rate must be in (0, 1) and capacity positive.
+  // An expansion of 0 makes the filter non scaling, so that it rejects the items above capacity.
+  void Init(double error_rate, uint64_t capacity, unsigned expansion);
+
+  // Replaces the filter with the one serialized in str. Returns false if str is not a valid
+  // serialized filter, in which case the filter is left empty.
+  bool Parse(std::string_view str);
+
+  // The bytes of a sub-filter with the given capacity and error rate.
+  static size_t FilterSize(double error_rate, uint64_t capacity);
+
+  // Whether str starts like a serialized filter.
+  static bool HasMagic(std::string_view str);
+
+  // ADDED if the item was added, EXISTS if it may be a member already and FULL if it is not
+  // a member and a non scaling filter holds its capacity.
+  AddResult Add(std::string_view item);
+  bool Exists(std::string_view item) const;
+
+  // Like Add and Exists for every item. The items are hashed upfront and their blocks are
+  // prefetched, so that the cache misses of a batch overlap.
+  void AddMany(absl::Span<const std::string_view> items, AddResult* res);
+  void ExistsMany(absl::Span<const std::string_view> items, bool* res) const;
+
+  double error_rate() const {
+    return error_rate_;
+  }
+
+  // The capacity of the first sub-filter.
+  uint64_t capacity() const {
+    return capacity_;
+  }
+
+  unsigned expansion() const {
+    return expansion_;
+  }
+
+  size_t num_filters() const {
+    return filters_.size();
+  }
+
+  // The number of items that were added.
+  uint64_t NumItems() const;
+
+  // The number of items the filter holds before it scales or, if non scaling, becomes full.
+  uint64_t TotalCapacity() const;
+
+  // The length of the serialized form.
+  size_t Size() const {
+    return size_;
+  }
+
+  // Writes len bytes of the serialized form from offset to dest.
+  // offset + len must not exceed Size().
+  void Materialize(size_t offset, size_t len, char* dest) const;
+
+  size_t MallocUsed() const;
+
+ private:
+  struct SubFilter {
+    uint64_t capacity;
+    uint64_t num_items;
+    uint32_t num_blocks;
+    uint64_t* words;  // num_blocks blocks, aligned to kBlockSize.
+
+    const uint64_t* Block(uint64_t hash) const {
+      return words + ((hash >> 32) * num_blocks >> 32) * kBlockWords;
+    }
+
+    uint64_t* Block(uint64_t hash) {
+      return words + ((hash >> 32) * num_blocks >> 32) * kBlockWords;
+    }
+
+    bool Contains(uint64_t hash) const;
+    void Insert(uint64_t hash);
+  };
+
+  static uint64_t Hash(std::string_view item);
+
+  // The hash of an item in sub-filter i, so that the sub-filters probe independent bits.
+  static uint64_t SubHash(uint64_t hash, size_t i);
+
+  AddResult AddHash(uint64_t hash);
+  bool ExistsHash(uint64_t hash) const;
+  void Prefetch(uint64_t hash) const;
+
+  void AddFilter(uint64_t capacity, double error_rate);
+  void Clear();
+
+  std::pmr::memory_resource* mr_;
+  std::pmr::vector<SubFilter> filters_;
+  double error_rate_ = kDefaultErrorRate;
+  uint64_t capacity_ = 0;
+  unsigned expansion_ = 0;
+  size_t size_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,145 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom_filter.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+class BloomFilterTest : public ::testing::Test {
+ protected:
+  BloomFilterTest() : filter_(pmr::get_default_resource()) {
+  }
+
+  // Adds the items [from, to) and returns how many were reported as added.
+  unsigned AddRange(unsigned from, unsigned to) {
+    unsigned added = 0;
+    for (unsigned i = from; i < to; ++i)
+      added += filter_.Add(absl::StrCat("item:", i)) == BloomFilter::ADDED;
+    return added;
+  }
+
+  // The ratio of the items [from, to) that are reported as members.
+  double ExistsRatio(unsigned from, unsigned to) const {
+    unsigned found = 0;
+    for (unsigned i = from; i < to; ++i)
+      found += filter_.Exists(absl::StrCat("item:", i));
+    return double(found) / (to - from);
+  }
+
+  string Serialize() const {
+    string res(filter_.Size(), '\0');
+    filter_.Materialize(0, res.size(), res.data());
+    return res;
+  }
+
+  BloomFilter filter_;
+};
+
+TEST_F(BloomFilterTest, Basic) {
+  filter_.Init(0.01, 100, 2);
+  EXPECT_EQ(0u, filter_.NumItems());
+  EXPECT_FALSE(filter_.Exists("a"));
+
+  EXPECT_EQ(BloomFilter::ADDED, filter_.Add("a"));
+  EXPECT_EQ(BloomFilter::EXISTS, filter_.Add("a"));
+  EXPECT_TRUE(filter_.Exists("a"));
+  EXPECT_FALSE(filter_.Exists("b"));
+  EXPECT_EQ(1u, filter_.NumItems());
+}
+
+TEST_F(BloomFilterTest, ErrorRate) {
+  filter_.Init(0.01, 10000, 2);
+  AddRange(0, 10000);
+  EXPECT_EQ(1u, filter_.num_filters());
+  EXPECT_EQ(1.0, ExistsRatio(0, 10000));
+
+  double fp_rate = ExistsRatio(10000, 110000);
+  EXPECT_LT(fp_rate, 0.012);
+  EXPECT_GT(fp_rate, 0.001);
+}
+
+TEST_F(BloomFilterTest, Scaling) {
+  filter_.Init(0.01, 1000, 2);
+  AddRange(0, 15000);
+  EXPECT_EQ(4u, filter_.num_filters());
+  EXPECT_EQ(15000u, filter_.TotalCapacity());
+  EXPECT_EQ(1.0, ExistsRatio(0, 15000));
+
+  // The error rate of the sub-filters shrinks, so that the total one stays bounded.
+  EXPECT_LT(ExistsRatio(100000, 200000), 0.02);
+}
+
+TEST_F(BloomFilterTest, NonScaling) {
+  filter_.Init(0.01, 100, 0);
+  unsigned added = AddRange(0, 200);
+  EXPECT_GE(added, 100u);
+  EXPECT_EQ(100u, filter_.NumItems());
+  EXPECT_EQ(1u, filter_.num_filters());
+  EXPECT_EQ(BloomFilter::FULL, filter_.Add("new item"));
+}
+
+TEST_F(BloomFilterTest, Batch) {
+  filter_.Init(0.001, 100, 2);
+  vector<string> items;
+  for (unsigned i = 0; i < 1000; ++i)
+    items.push_back(absl::StrCat("item:", i % 500));
+  vector<string_view> views(items.begin(), items.end());
+
+  vector<BloomFilter::AddResult> added(views.size());
+  filter_.AddMany(views, added.data());
+
+  // The second half repeats the first one.
+  unsigned num_added = 0;
+  for (unsigned i = 0; i < 500; ++i)
+    num_added += added[i] == BloomFilter::ADDED;
+  EXPECT_GE(num_added, 499u);
+  for (unsigned i = 500; i < 1000; ++i)
+    EXPECT_EQ(BloomFilter::EXISTS, added[i]);
+
+  auto exists = make_unique<bool[]>(views.size());
+  filter_.ExistsMany(views, exists.get());
+  for (unsigned i = 0; i < 1000; ++i)
+    EXPECT_TRUE(exists[i]);
+  EXPECT_EQ(1.0, ExistsRatio(0, 500));
+}
+
+TEST_F(BloomFilterTest, Serialize) {
+  filter_.Init(0.01, 100, 4);
+  AddRange(0, 1000);
+  ASSERT_GT(filter_.num_filters(), 1u);
+
+  string data = Serialize();
+  EXPECT_TRUE(BloomFilter::HasMagic(data));
+
+  // Materializes any range of the serialized form.
+  string part(100, '\0');
+  filter_.Materialize(30, part.size(), part.data());
+  EXPECT_EQ(data.substr(30, 100), part);
+
+  BloomFilter parsed(pmr::get_default_resource());
+  ASSERT_TRUE(parsed.Parse(data));
+  EXPECT_EQ(filter_.num_filters(), parsed.num_filters());
+  EXPECT_EQ(filter_.NumItems(), parsed.NumItems());
+  EXPECT_EQ(filter_.expansion(), parsed.expansion());
+  EXPECT_EQ(filter_.Size(), parsed.Size());
+  for (unsigned i = 0; i < 1000; ++i)
+    EXPECT_TRUE(parsed.Exists(absl::StrCat("item:", i)));
+
+  EXPECT_FALSE(parsed.Parse("foo"));
+  EXPECT_FALSE(parsed.Parse(data.substr(0, data.size() - 1)));
+  EXPECT_FALSE(parsed.Parse(data + "x"));
+  EXPECT_EQ(0u, parsed.num_filters());
+}
+
+}  // namespace dfly
@@ -0,0 +1,567 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <type_traits>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+// BPTree is a B+ tree of unique items ordered by Compare, meant as the ordered index of large
+// sorted sets. Compared to a skiplist it keeps the items in arrays of fixed size nodes, which
+// costs about 12 bytes per 8 byte item instead of 40+ bytes of skiplist node and levels, and
+// scans them sequentially. Leaves are linked in both directions for range scans.
+// Inner nodes keep the number of items under each of their children, so that the rank of an
+// item and the item at a rank are found in O(log n).
+// Items must be trivially copyable, typically pointers or integers. Not thread safe.
+template <typename T, typename Compare = std::less<T>> class BPTree {
+  static_assert(std::is_trivially_copyable_v<T>, "BPTree items are copied with memmove");
+
+  struct Leaf;
+  struct Inner;
+
+ public:
+  static constexpr size_t kNodeSize = 256;
+
+  class Iterator {
+   public:
+    const T& operator*() const {
+      return leaf_->keys[pos_];
+    }
+
+    const T* operator->() const {
+      return &leaf_->keys[pos_];
+    }
+
+    Iterator& operator++() {
+      if (++pos_ == leaf_->num) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+
+    // Decrementing end() moves to the last item and decrementing begin() to end().
+    Iterator& operator--() {
+      if (!leaf_) {
+        leaf_ = tree_->last_leaf_;
+        pos_ = leaf_ ? leaf_->num - 1 : 0;
+      } else if (pos_ == 0) {
+        leaf_ = leaf_->prev;
+        pos_ = leaf_ ? leaf_->num - 1 : 0;
+      } else {
+        --pos_;
+      }
+      return *this;
+    }
+
+    bool operator==(const Iterator& o) const {
+      return leaf_ == o.leaf_ && pos_ == o.pos_;
+    }
+
+    bool operator!=(const Iterator& o) const {
+      return !(*this == o);
+    }
+
+   private:
+    friend class BPTree;
+
+    Iterator(const BPTree* tree, const Leaf* leaf, unsigned pos)
+        : tree_(tree), leaf_(leaf), pos_(pos) {
+    }
+
+    const BPTree* tree_;
+    const Leaf* leaf_;
+    unsigned pos_;
+  };
+
+  explicit BPTree(std::pmr::memory_resource* mr = std::pmr::get_default_resource(),
+                  Compare comp = Compare{})
+      : mr_(mr), comp_(comp) {
+  }
+
+  ~BPTree() {
+    Clear();
+  }
+
+  BPTree(const BPTree&) = delete;
+  BPTree& operator=(const BPTree&) = delete;
+
+  size_t Size() const {
+    return size_;
+  }
+
+  bool Empty() const {
+    return size_ == 0;
+  }
+
+  unsigned Height() const {
+    return height_;
+  }
+
+  size_t MallocUsed() const {
+    return num_nodes_ * kNodeSize;
+  }
+
+  // Inserts item unless an equal one is already in the tree. Returns whether it was inserted.
+  bool Insert(T item);
+
+  // Deletes the item equal to item. Returns whether it was found.
+  bool Delete(const T& item);
+
+  bool Contains(const T& item) const {
+    return GetRank(item).has_value();
+  }
+
+  // Returns the 0-based rank of the item equal to item, if there is one.
+  std::optional<uint32_t> GetRank(const T& item) const;
+
+  // Returns the iterator to the item of the given rank or end() if rank >= Size().
+  Iterator FromRank(uint32_t rank) const;
+
+  // Returns the iterator to the first item that is not less than item.
+  Iterator LowerBound(const T& item) const;
+
+  Iterator begin() const {
+    return Iterator{this, first_leaf_, 0};
+  }
+
+  Iterator end() const {
+    return Iterator{this, nullptr, 0};
+  }
+
+  void Clear();
+
+ private:
+  static constexpr unsigned kLeafMax = (kNodeSize - 3 * sizeof(void*)) / sizeof(T);
+  static constexpr unsigned kInnerMax =
+      (kNodeSize - 2 * sizeof(void*) - sizeof(uint32_t)) / (sizeof(T) + sizeof(void*) + 4);
+  static constexpr unsigned kLeafMin = kLeafMax / 2;
+  static constexpr unsigned kInnerMin = kInnerMax / 2;
+  static constexpr unsigned kMaxHeight = 32;
+
+  struct Leaf {
+    uint32_t num;
+    Leaf* prev;
+    Leaf* next;
+    T keys[kLeafMax];
+  };
+
+  // Has num separators and num + 1 children. The items of children[i] are not less than
+  // keys[i - 1] and less than keys[i]. counts[i] is the number of items under children[i].
+  struct Inner {
+    uint32_t num;
+    T keys[kInnerMax];
+    void* children[kInnerMax + 1];
+    uint32_t counts[kInnerMax + 1];
+  };
+
+  static_assert(kLeafMax >= 4 && kInnerMax >= 4, "T is too large for the node size");
+  static_assert(sizeof(Leaf) <= kNodeSize && sizeof(Inner) <= kNodeSize);
+
+  // The inner nodes from the root to a leaf and the child taken in each of them.
+  struct Path {
+    std::array<std::pair<Inner*, unsigned>, kMaxHeight> nodes;
+    unsigned depth = 0;
+  };
+
+  template <typename U> static void InsertAt(U* arr, unsigned len, unsigned pos, U val) {
+    std::copy_backward(arr + pos, arr + len, arr + len + 1);
+    arr[pos] = val;
+  }
+
+  template <typename U> static void EraseAt(U* arr, unsigned len, unsigned pos) {
+    std::copy(arr + pos + 1, arr + len, arr + pos);
+  }
+
+  static uint32_t SumCounts(const Inner* inner) {
+    uint32_t sum = 0;
+    for (unsigned i = 0; i <= inner->num; ++i)
+      sum += inner->counts[i];
+    return sum;
+  }
+
+  template <typename Node> Node* NewNode() {
+    ++num_nodes_;
+    return new (mr_->allocate(kNodeSize, alignof(std::max_align_t))) Node{};
+  }
+
+  void FreeNode(void* node) {
+    --num_nodes_;
+    mr_->deallocate(node, kNodeSize, alignof(std::max_align_t));
+  }
+
+  void FreeTree(void* node, unsigned height);
+
+  Leaf* Descend(const T& item, Path* path) const;
+  unsigned LeafLowerBound(const Leaf* leaf, const T& item) const {
+    return std::lower_bound(leaf->keys, leaf->keys + leaf->num, item, comp_) - leaf->keys;
+  }
+
+  // Adds the node that was split from the child at the end of path to its parent, splitting
+  // the ancestors that overflow. left_cnt and right_cnt are the items under the two halves.
+  void InsertChild(const Path& path, T sep, void* right, uint32_t left_cnt, uint32_t right_cnt);
+
+  // Fixes the underflow of the leaf at the end of path by borrowing from a sibling or merging
+  // with it.
+  void RebalanceLeaf(Leaf* leaf, const Path& path);
+
+  // Fixes the underflow of path.nodes[level] after one of its children was merged.
+  void RebalanceInner(const Path& path, unsigned level);
+
+  std::pmr::memory_resource* mr_;
+  Compare comp_;
+  void* root_ = nullptr;
+  Leaf* first_leaf_ = nullptr;
+  Leaf* last_leaf_ = nullptr;
+  size_t size_ = 0;
+  size_t num_nodes_ = 0;
+  unsigned height_ = 0;  // 0 when empty, 1 when the root is a leaf.
+};
+
+template <typename T, typename Compare> bool BPTree<T, Compare>::Insert(T item) {
+  if (!root_) {
+    Leaf* leaf = NewNode<Leaf>();
+    leaf->keys[0] = item;
+    leaf->num = 1;
+    root_ = first_leaf_ = last_leaf_ = leaf;
+    height_ = 1;
+    size_ = 1;
+    return true;
+  }
+
+  Path path;
+  Leaf* leaf = Descend(item, &path);
+  unsigned pos = LeafLowerBound(leaf, item);
+  if (pos < leaf->num && !comp_(item, leaf->keys[pos]))
+    return false;
+
+  for (unsigned i = 0; i < path.depth; ++i)
+    ++path.nodes[i].first->counts[path.nodes[i].second];
+  ++size_;
+
+  if (leaf->num < kLeafMax) {
+    InsertAt(leaf->keys, leaf->num++, pos, item);
+    return true;
+  }
+
+  Leaf* right = NewNode<Leaf>();
+  unsigned mid = leaf->num / 2;
+  right->num = leaf->num - mid;
+  std::copy(leaf->keys + mid, leaf->keys + leaf->num, right->keys);
+  leaf->num = mid;
+
+  right->prev = leaf;
+  right->next = leaf->next;
+  if (right->next)
+    right->next->prev = right;
+  else
+    last_leaf_ = right;
+  leaf->next = right;
+
+  if (pos <= mid)
+    InsertAt(leaf->keys, leaf->num++, pos, item);
+  else
+    InsertAt(right->keys, right->num++, pos - mid, item);
+
+  InsertChild(path, right->keys[0], right, leaf->num, right->num);
+  return true;
+}
+
+template <typename T, typename Compare>
+void BPTree<T, Compare>::InsertChild(const Path& path, T sep, void* right, uint32_t left_cnt,
+                                     uint32_t right_cnt) {
+  for (unsigned level = path.depth; level-- > 0;) {
+    auto [parent, ci] = path.nodes[level];
+    if (parent->num < kInnerMax) {
+      InsertAt(parent->keys, parent->num, ci, sep);
+      InsertAt(parent->children, parent->num + 1, ci + 1, right);
+      InsertAt(parent->counts, parent->num + 1, ci + 1, right_cnt);
+      parent->counts[ci] = left_cnt;
+      ++parent->num;
+      return;
+    }
+
+    // Split the parent as if sep and right had been added to it.
+    T keys[kInnerMax + 1];
+    void* children[kInnerMax + 2];
+    uint32_t counts[kInnerMax + 2];
+    unsigned n = parent->num;
+    std::copy(parent->keys, parent->keys + n, keys);
+    std::copy(parent->children, parent->children + n + 1, children);
+    std::copy(parent->counts, parent->counts + n + 1, counts);
+    InsertAt(keys, n, ci, sep);
+    InsertAt(children, n + 1, ci + 1, right);
+    InsertAt(counts, n + 1, ci + 1, right_cnt);
+    counts[ci] = left_cnt;
+    ++n;
+
+    unsigned mid = n / 2;
+    Inner* sibling = NewNode<Inner>();
+    parent->num = mid;
+    std::copy(keys, keys + mid, parent->keys);
+    std::copy(children, children + mid + 1, parent->children);
+    std::copy(counts, counts + mid + 1, parent->counts);
+
+    sibling->num = n - mid - 1;
+    std::copy(keys + mid + 1, keys + n, sibling->keys);
+    std::copy(children + mid + 1, children + n + 1, sibling->children);
+    std::copy(counts + mid + 1, counts + n + 1, sibling->counts);
+
+    sep = keys[mid];
+    right = sibling;
+    left_cnt = SumCounts(parent);
+    right_cnt = SumCounts(sibling);
+  }
+
+  DCHECK_LT(height_, kMaxHeight);
+  Inner* root = NewNode<Inner>();
+  root->num = 1;
+  root->keys[0] = sep;
+  root->children[0] = root_;
+  root->children[1] = right;
+  root->counts[0] = left_cnt;
+  root->counts[1] = right_cnt;
+  root_ = root;
+  ++height_;
+}
+
+template <typename T, typename Compare> bool BPTree<T, Compare>::Delete(const T& item) {
+  if (!root_)
+    return false;
+
+  Path path;
+  Leaf* leaf = Descend(item, &path);
+  unsigned pos = LeafLowerBound(leaf, item);
+  if (pos == leaf->num || comp_(item, leaf->keys[pos]))
+    return false;
+
+  for (unsigned i = 0; i < path.depth; ++i)
+    --path.nodes[i].first->counts[path.nodes[i].second];
+  --size_;
+  EraseAt(leaf->keys, leaf->num--, pos);
+
+  if (path.depth == 0) {
+    if (leaf->num == 0) {
+      FreeNode(leaf);
+      root_ = first_leaf_ = last_leaf_ = nullptr;
+      height_ = 0;
+    }
+    return true;
+  }
+
+  if (leaf->num < kLeafMin)
+    RebalanceLeaf(leaf, path);
+  return true;
+}
+
+template <typename T, typename Compare>
+void BPTree<T, Compare>::RebalanceLeaf(Leaf* leaf, const Path& path) {
+  auto [parent, ci] = path.nodes[path.depth - 1];
+
+  Leaf* left = ci > 0 ? static_cast<Leaf*>(parent->children[ci - 1]) : nullptr;
+  if (left && left->num > kLeafMin) {
+    InsertAt(leaf->keys, leaf->num++, 0, left->keys[--left->num]);
+    parent->keys[ci - 1] = leaf->keys[0];
+    --parent->counts[ci - 1];
+    ++parent->counts[ci];
+    return;
+  }
+
+  Leaf* right = ci < parent->num ? static_cast<Leaf*>(parent->children[ci + 1]) : nullptr;
+  if (right && right->num > kLeafMin) {
+    leaf->keys[leaf->num++] = right->keys[0];
+    EraseAt(right->keys, right->num--, 0);
+    parent->keys[ci] = right->keys[0];
+    ++parent->counts[ci];
+    --parent->counts[ci + 1];
+    return;
+  }
+
+  // Merge the right one of the two leaves into the left one.
+  unsigned li = left ? ci - 1 : ci;
+  if (left) {
+    right = leaf;
+  } else {
+    left = leaf;
+  }
+
+  std::copy(right->keys, right->keys + right->num, left->keys + left->num);
+  left->num += right->num;
+  left->next = right->next;
+  if (left->next)
+    left->next->prev = left;
+  else
+    last_leaf_ = left;
+  FreeNode(right);
+
+  EraseAt(parent->keys, parent->num, li);
+  EraseAt(parent->children, parent->num + 1, li + 1);
+  parent->counts[li] += parent->counts[li + 1];
+  EraseAt(parent->counts, parent->num + 1, li + 1);
+  --parent->num;
+
+  RebalanceInner(path, path.depth - 1);
+}
+
+template <typename T, typename Compare>
+void BPTree<T, Compare>::RebalanceInner(const Path& path, unsigned level) {
+  Inner* node = path.nodes[level].first;
+  if (level == 0) {
+    if (node->num == 0) {  // the root has a single child.
+      root_ = node->children[0];
+      FreeNode(node);
+      --height_;
+    }
+    return;
+  }
+
+  if (node->num >= kInnerMin)
+    return;
+
+  auto [parent, ci] = path.nodes[level - 1];
+  Inner* left = ci > 0 ? static_cast<Inner*>(parent->children[ci - 1]) : nullptr;
+  if (left && left->num > kInnerMin) {
+    uint32_t moved = left->counts[left->num];
+    InsertAt(node->keys, node->num, 0, parent->keys[ci - 1]);
+    InsertAt(node->children, node->num + 1, 0, left->children[left->num]);
+    InsertAt(node->counts, node->num + 1, 0, moved);
+    ++node->num;
+    parent->keys[ci - 1] = left->keys[--left->num];
+    parent->counts[ci - 1] -= moved;
+    parent->counts[ci] += moved;
+    return;
+  }
+
+  Inner* right = ci < parent->num ? static_cast<Inner*>(parent->children[ci + 1]) : nullptr;
+  if (right && right->num > kInnerMin) {
+    uint32_t moved = right->counts[0];
+    node->keys[node->num] = parent->keys[ci];
+    node->children[node->num + 1] = right->children[0];
+    node->counts[node->num + 1] = moved;
+    ++node->num;
+    parent->keys[ci] = right->keys[0];
+    EraseAt(right->keys, right->num, 0);
+    EraseAt(right->children, right->num + 1, 0);
+    EraseAt(right->counts, right->num + 1, 0);
+    --right->num;
+    parent->counts[ci] += moved;
+    parent->counts[ci + 1] -= moved;
+    return;
+  }
+
+  // Merge the right one of the two nodes and their separator into the left one.
+  unsigned li = left ? ci - 1 : ci;
+  if (left) {
+    right = node;
+  } else {
+    left = node;
+  }
+
+  left->keys[left->num] = parent->keys[li];
+  std::copy(right->keys, right->keys + right->num, left->keys + left->num + 1);
+  std::copy(right->children, right->children + right->num + 1, left->children + left->num + 1);
+  std::copy(right->counts, right->counts + right->num + 1, left->counts + left->num + 1);
+  left->num += right->num + 1;
+  FreeNode(right);
+
+  EraseAt(parent->keys, parent->num, li);
+  EraseAt(parent->children, parent->num + 1, li + 1);
+  parent->counts[li] += parent->counts[li + 1];
+  EraseAt(parent->counts, parent->num + 1, li + 1);
+  --parent->num;
+
+  RebalanceInner(path, level - 1);
+}
+
+template <typename T, typename Compare>
+auto BPTree<T, Compare>::Descend(const T& item, Path* path) const -> Leaf* {
+  void* node = root_;
+  for (unsigned h = height_; h > 1; --h) {
+    Inner* inner = static_cast<Inner*>(node);
+    unsigned ci =
+        std::upper_bound(inner->keys, inner->keys + inner->num, item, comp_) - inner->keys;
+    path->nodes[path->depth++] = {inner, ci};
+    node = inner->children[ci];
+  }
+  return static_cast<Leaf*>(node);
+}
+
+template <typename T, typename Compare>
+std::optional<uint32_t> BPTree<T, Compare>::GetRank(const T& item) const {
+  if (!root_)
+    return std::nullopt;
+
+  Path path;
+  const Leaf* leaf = Descend(item, &path);
+  unsigned pos = LeafLowerBound(leaf, item);
+  if (pos == leaf->num || comp_(item, leaf->keys[pos]))
+    return std::nullopt;
+
+  uint32_t rank = pos;
+  for (unsigned i = 0; i < path.depth; ++i) {
+    auto [inner, ci] = path.nodes[i];
+    for (unsigned j = 0; j < ci; ++j)
+      rank += inner->counts[j];
+  }
+  return rank;
+}
+
+template <typename T, typename Compare>
+auto BPTree<T, Compare>::FromRank(uint32_t rank) const -> Iterator {
+  if (rank >= size_)
+    return end();
+
+  void* node = root_;
+  for (unsigned h = height_; h > 1; --h) {
+    Inner* inner = static_cast<Inner*>(node);
+    unsigned ci = 0;
+    while (rank >= inner->counts[ci]) {
+      rank -= inner->counts[ci++];
+    }
+    node = inner->children[ci];
+  }
+  return Iterator{this, static_cast<Leaf*>(node), rank};
+}
+
+template <typename T, typename Compare>
+auto BPTree<T, Compare>::LowerBound(const T& item) const -> Iterator {
+  if (!root_)
+    return end();
+
+  Path path;
+  const Leaf* leaf = Descend(item, &path);
+  unsigned pos = LeafLowerBound(leaf, item);
+  if (pos == leaf->num)
+    return Iterator{this, leaf->next, 0};
+  return Iterator{this, leaf, pos};
+}
+
+template <typename T, typename Compare> void BPTree<T, Compare>::Clear() {
+  if (root_)
+    FreeTree(root_, height_);
+  root_ = first_leaf_ = last_leaf_ = nullptr;
+  size_ = 0;
+  height_ = 0;
+}
+
+template <typename T, typename Compare>
+void BPTree<T, Compare>::FreeTree(void* node, unsigned height) {
+  if (height > 1) {
+    Inner* inner = static_cast<Inner*>(node);
+    for (unsigned i = 0; i <= inner->num; ++i)
+      FreeTree(inner->children[i], height - 1);
+  }
+  FreeNode(node);
+}
+
+}  // namespace dfly
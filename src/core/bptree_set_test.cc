@@ -0,0 +1,150 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bptree_set.h"
+
+#include <absl/random/random.h>
+
+#include <set>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class BPTreeSetTest : public ::testing::Test {
+ protected:
+  // Checks the ranks, the iteration in both directions and the lower bounds against ref.
+  template <typename Tree, typename Ref> static void Verify(const Tree& tree, const Ref& ref) {
+    ASSERT_EQ(ref.size(), tree.Size());
+
+    uint32_t rank = 0;
+    auto it = tree.begin();
+    for (const auto& item : ref) {
+      ASSERT_TRUE(it != tree.end());
+      ASSERT_EQ(item, *it);
+      ASSERT_EQ(rank, tree.GetRank(item));
+      ASSERT_TRUE(tree.FromRank(rank) == it);
+      ++it;
+      ++rank;
+    }
+    EXPECT_TRUE(it == tree.end());
+    EXPECT_TRUE(tree.FromRank(rank) == tree.end());
+
+    for (auto rit = ref.rbegin(); rit != ref.rend(); ++rit) {
+      --it;
+      ASSERT_EQ(*rit, *it);
+    }
+    EXPECT_TRUE(it == tree.begin());
+  }
+};
+
+TEST_F(BPTreeSetTest, Basic) {
+  BPTree<uint64_t> tree;
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_TRUE(tree.begin() == tree.end());
+  EXPECT_FALSE(tree.GetRank(1));
+
+  EXPECT_TRUE(tree.Insert(10));
+  EXPECT_TRUE(tree.Insert(5));
+  EXPECT_FALSE(tree.Insert(10));
+  EXPECT_EQ(2u, tree.Size());
+  EXPECT_EQ(1u, tree.GetRank(10));
+  EXPECT_EQ(10u, *tree.LowerBound(6));
+  EXPECT_TRUE(tree.LowerBound(11) == tree.end());
+
+  EXPECT_FALSE(tree.Delete(7));
+  EXPECT_TRUE(tree.Delete(5));
+  EXPECT_TRUE(tree.Delete(10));
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_EQ(0u, tree.MallocUsed());
+}
+
+TEST_F(BPTreeSetTest, Sequential) {
+  constexpr uint64_t kNum = 100000;
+  BPTree<uint64_t> tree;
+  set<uint64_t> ref;
+  for (uint64_t i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(tree.Insert(i * 2));
+    ref.insert(i * 2);
+  }
+  Verify(tree, ref);
+  EXPECT_GT(tree.Height(), 2u);
+
+  // Much less than the 40+ bytes per item of a skiplist.
+  EXPECT_LT(tree.MallocUsed(), kNum * 24);
+
+  EXPECT_EQ(1002u, *tree.LowerBound(1001));
+  EXPECT_EQ(501u, tree.GetRank(1002));
+
+  for (uint64_t i = 0; i < kNum; i += 2) {
+    ASSERT_TRUE(tree.Delete(i * 2));
+    ref.erase(i * 2);
+  }
+  Verify(tree, ref);
+}
+
+TEST_F(BPTreeSetTest, Random) {
+  absl::InsecureBitGen gen;
+  BPTree<uint32_t> tree;
+  set<uint32_t> ref;
+
+  for (unsigned round = 0; round < 5; ++round) {
+    for (unsigned i = 0; i < 20000; ++i) {
+      uint32_t val = absl::Uniform(gen, 0u, 50000u);
+      ASSERT_EQ(ref.insert(val).second, tree.Insert(val));
+    }
+    Verify(tree, ref);
+
+    for (unsigned i = 0; i < 30000; ++i) {
+      uint32_t val = absl::Uniform(gen, 0u, 50000u);
+      ASSERT_EQ(ref.erase(val) > 0, tree.Delete(val));
+    }
+    Verify(tree, ref);
+  }
+
+  while (!ref.empty()) {
+    ASSERT_TRUE(tree.Delete(*ref.begin()));
+    ref.erase(ref.begin());
+  }
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_EQ(0u, tree.Height());
+  EXPECT_EQ(0u, tree.MallocUsed());
+}
+
+TEST_F(BPTreeSetTest, ScoreMember) {
+  // Ordered like a sorted set, by score and then by member.
+  struct Entry {
+    double score;
+    uint32_t member;
+
+    bool operator<(const Entry& o) const {
+      return score < o.score || (score == o.score && member < o.member);
+    }
+
+    bool operator==(const Entry& o) const {
+      return score == o.score && member == o.member;
+    }
+  };
+
+  BPTree<Entry> tree;
+  set<Entry> ref;
+  for (uint32_t i = 0; i < 5000; ++i) {
+    Entry entry{double(i % 100), i};
+    tree.Insert(entry);
+    ref.insert(entry);
+  }
+  Verify(tree, ref);
+
+  // The members of score 42 in a range scan.
+  unsigned num = 0;
+  for (auto it = tree.LowerBound({42, 0}); it != tree.end() && it->score == 42; ++it)
+    ++num;
+  EXPECT_EQ(50u, num);
+  EXPECT_EQ(42u * 50, tree.GetRank({42, 42}));
+}
+
+}  // namespace dfly
@@ -17,12 +17,19 @@ extern "C" {
 #include "redis/zset.h"
 }
 
+#include <absl/container/node_hash_map.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
 #include "base/pod_array.h"
+#include "core/bloom_filter.h"
+#include "core/frequency_sketch.h"
+#include "core/sparse_bitmap.h"
+#include "core/string_map.h"
 #include "core/string_set.h"
+#include "core/time_series.h"
 
 #if defined(__aarch64__)
 #include "base/sse2neon.h"
@@ -93,8 +100,10 @@ size_t MallocUsedHSet(unsigned encoding, void* ptr) {
   switch (encoding) {
     case kEncodingListPack:
       return lpBytes(reinterpret_cast<uint8_t*>(ptr));
-    case kEncodingStrMap:
-      return DictMallocSize((dict*)ptr);
+    case kEncodingStrMap2: {
+      StringMap* sm = (StringMap*)ptr;
+      return sm->ObjMallocUsed() + sm->SetMallocUsed();
+    }
   }
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
   return 0;
@@ -120,8 +129,8 @@ size_t MallocUsedStream(unsigned encoding, void* streamv) {
 
 inline void FreeObjHash(unsigned encoding, void* ptr) {
   switch (encoding) {
-    case kEncodingStrMap:
-      dictRelease((dict*)ptr);
+    case kEncodingStrMap2:
+      delete (StringMap*)ptr;
       break;
     case kEncodingListPack:
       lpFree((uint8_t*)ptr);
@@ -205,11 +214,79 @@ static_assert(ascii_len(15) == 17);
 static_assert(ascii_len(16) == 18);
 static_assert(ascii_len(17) == 19);
 
+constexpr size_t kHexBinLen = 16;
+constexpr size_t kHexStrLen = kHexBinLen * 2;
+constexpr size_t kUuidStrLen = kHexStrLen + 4;
+
+inline bool IsUuidDash(size_t pos) {
+  return pos == 8 || pos == 13 || pos == 18 || pos == 23;
+}
+
+inline int HexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Parses lowercase hex string (optionally in the uuid form) into 16 bytes.
+// Uppercase digits are rejected, otherwise we could not restore the original string.
+bool hex_pack(string_view str, bool uuid, uint8_t* bin) {
+  unsigned j = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (uuid && IsUuidDash(i)) {
+      if (str[i] != '-')
+        return false;
+      continue;
+    }
+
+    int d = HexDigit(str[i]);
+    if (d < 0)
+      return false;
+
+    if (j % 2 == 0) {
+      bin[j / 2] = d << 4;
+    } else {
+      bin[j / 2] |= d;
+    }
+    ++j;
+  }
+
+  return j == kHexStrLen;
+}
+
+void hex_unpack(const uint8_t* bin, bool uuid, char* dest) {
+  constexpr char kDigits[] = "0123456789abcdef";
+  for (size_t i = 0; i < kHexBinLen; ++i) {
+    if (uuid && (i == 4 || i == 6 || i == 8 || i == 10))
+      *dest++ = '-';
+
+    *dest++ = kDigits[bin[i] >> 4];
+    *dest++ = kDigits[bin[i] & 0xF];
+  }
+}
+
+// Prefixes shorter than that are not worth a dictionary lookup.
+constexpr size_t kMinPrefixLen = 4;
+constexpr uint32_t kMaxPrefixes = 1 << 16;
+constexpr uint32_t kNoPrefix = UINT32_MAX;
+
+struct PrefixEntry {
+  string_view str;  // points to the key in TL::prefix_ids.
+  uint32_t refcnt = 0;
+};
+
 struct TL {
   robj tmp_robj{
       .type = 0, .encoding = 0, .lru = 0, .refcount = OBJ_STATIC_REFCOUNT, .ptr = nullptr};
 
   pmr::memory_resource* local_mr = pmr::get_default_resource();
+
+  // Prefix dictionary of prefix-encoded keys, indexed by prefix id.
+  vector<PrefixEntry> prefixes;
+  absl::node_hash_map<string, uint32_t> prefix_ids;
+  vector<uint32_t> free_prefix_ids;
   size_t small_str_bytes;
   base::PODArray<uint8_t> tmp_buf;
   string tmp_str;
@@ -217,6 +294,44 @@ struct TL {
 
 thread_local TL tl;
 
+// Returns the id of prefix, adding it to the dictionary if needed, or kNoPrefix if the
+// dictionary is full.
+uint32_t AcquirePrefix(string_view prefix) {
+  auto it = tl.prefix_ids.find(prefix);
+  if (it != tl.prefix_ids.end()) {
+    ++tl.prefixes[it->second].refcnt;
+    return it->second;
+  }
+
+  uint32_t id;
+  if (!tl.free_prefix_ids.empty()) {
+    id = tl.free_prefix_ids.back();
+    tl.free_prefix_ids.pop_back();
+  } else {
+    if (tl.prefixes.size() >= kMaxPrefixes)
+      return kNoPrefix;
+    id = tl.prefixes.size();
+    tl.prefixes.emplace_back();
+  }
+
+  it = tl.prefix_ids.emplace(prefix, id).first;
+  tl.prefixes[id] = PrefixEntry{it->first, 1};
+  return id;
+}
+
+void ReleasePrefix(uint32_t id) {
+  PrefixEntry& entry = tl.prefixes[id];
+  DCHECK_GT(entry.refcnt, 0u);
+  if (--entry.refcnt > 0)
+    return;
+
+  auto it = tl.prefix_ids.find(entry.str);
+  DCHECK(it != tl.prefix_ids.end());
+  entry.str = string_view{};
+  tl.prefix_ids.erase(it);
+  tl.free_prefix_ids.push_back(id);
+}
+
 constexpr bool kUseSmallStrings = true;
 
 /// TODO: Ascii encoding becomes slow for large blobs. We should factor it out into a separate
@@ -226,6 +341,7 @@ constexpr bool kUseAsciiEncoding = true;
 }  // namespace
 
 static_assert(sizeof(CompactObj) == 18);
+static_assert(CompactObj::TOPK_TAG < 32, "the tags must fit in the 5 bits of taglen_");
 
 namespace detail {
 
@@ -380,12 +496,73 @@ void RobjWrapper::SetString(string_view s, pmr::memory_resource* mr) {
   }
 }
 
+void RobjWrapper::SetRange(size_t offset, string_view s, pmr::memory_resource* mr) {
+  DCHECK_EQ(OBJ_STRING, type_);
+  DCHECK_EQ(OBJ_ENCODING_RAW, encoding_);
+
+  size_t end = offset + s.size();
+  if (end > sz_) {
+    size_t cur_cap = InnerObjMallocUsed();
+    if (end > cur_cap) {
+      MakeInnerRoom(cur_cap, end, mr);
+    }
+    char* dest = reinterpret_cast<char*>(inner_obj_);
+    if (offset > sz_)
+      memset(dest + sz_, 0, offset - sz_);
+    sz_ = end;
+  }
+
+  if (!s.empty())
+    memcpy(reinterpret_cast<char*>(inner_obj_) + offset, s.data(), s.size());
+}
+
 void RobjWrapper::Init(unsigned type, unsigned encoding, void* inner) {
   type_ = type;
   encoding_ = encoding;
   Set(inner, 0);
 }
 
+bool RobjWrapper::DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse,
+                                 pmr::memory_resource* mr) {
+  if (!inner_obj_ || !is_sparse(inner_obj_))
+    return false;
+
+  // The new block is allocated while the old one is alive, so it can not take its place.
+  if (type_ == OBJ_STRING) {
+    DCHECK_EQ(OBJ_ENCODING_RAW, encoding());
+    size_t cap = InnerObjMallocUsed();
+    void* newp = mr->allocate(cap, 8);
+    if (is_sparse(newp)) {
+      mr->deallocate(newp, cap, 8);
+      return false;
+    }
+    memcpy(newp, inner_obj_, sz_);
+    mr->deallocate(inner_obj_, cap, 8);
+    inner_obj_ = newp;
+    return true;
+  }
+
+  size_t blob_len = 0;
+  if ((type_ == OBJ_HASH && encoding_ == kEncodingListPack) ||
+      (type_ == OBJ_ZSET && encoding_ == OBJ_ENCODING_LISTPACK)) {
+    blob_len = lpBytes((uint8_t*)inner_obj_);
+  } else if (type_ == OBJ_SET && encoding_ == kEncodingIntSet) {
+    blob_len = intsetBlobLen((intset*)inner_obj_);
+  } else {
+    return false;  // multi-allocation objects are not moved.
+  }
+
+  void* newp = zmalloc(blob_len);
+  if (is_sparse(newp)) {
+    zfree(newp);
+    return false;
+  }
+  memcpy(newp, inner_obj_, blob_len);
+  zfree(inner_obj_);
+  inner_obj_ = newp;
+  return true;
+}
+
 inline size_t RobjWrapper::InnerObjMallocUsed() const {
   return zmalloc_size(inner_obj_);
 }
@@ -521,10 +698,12 @@ CompactObj& CompactObj::operator=(CompactObj&& o) noexcept {
 
   SetMeta(o.taglen_, o.mask_);  // Frees underlying resources if needed.
   memcpy(&u_, &o.u_, sizeof(u_));
+  idle_ = o.idle_;
 
   // SetMeta deallocates the object and we only want reset it.
   o.taglen_ = 0;
   o.mask_ = 0;
+  o.idle_ = 0;
 
   return *this;
 }
@@ -550,6 +729,30 @@ size_t CompactObj::Size() const {
       case ROBJ_TAG:
         raw_size = u_.r_obj.Size();
         break;
+      case UUID_TAG:
+        raw_size = kUuidStrLen;
+        break;
+      case HEX_TAG:
+        raw_size = kHexStrLen;
+        break;
+      case PREFIX_TAG:
+        raw_size = GetPrefix().size() + u_.pref_str.suffix_len;
+        break;
+      case BITMAP_TAG:
+        raw_size = u_.bitmap->Size();
+        break;
+      case BLOOM_TAG:
+        raw_size = u_.bloom->Size();
+        break;
+      case TS_TAG:
+        raw_size = u_.ts->Size();
+        break;
+      case CMS_TAG:
+        raw_size = u_.cms->Size();
+        break;
+      case TOPK_TAG:
+        raw_size = u_.topk->Size();
+        break;
       default:
         LOG(DFATAL) << "Should not reach " << int(taglen_);
     }
@@ -585,6 +788,20 @@ uint64_t CompactObj::HashCode() const {
       absl::AlphaNum an(u_.ival);
       return XXH3_64bits_withSeed(an.data(), an.size(), kHashSeed);
     }
+    case UUID_TAG:
+    case HEX_TAG: {
+      char buf[kUuidStrLen];
+      hex_unpack(to_byte(u_.inline_str), taglen_ == UUID_TAG, buf);
+      return XXH3_64bits_withSeed(buf, Size(), kHashSeed);
+    }
+    case PREFIX_TAG:
+    case BITMAP_TAG:
+    case BLOOM_TAG:
+    case TS_TAG:
+    case CMS_TAG:
+    case TOPK_TAG:
+      GetString(&tl.tmp_str);
+      return XXH3_64bits_withSeed(tl.tmp_str.data(), tl.tmp_str.size(), kHashSeed);
   }
   // We need hash only for keys.
   LOG(DFATAL) << "Should not reach " << int(taglen_);
@@ -597,9 +814,14 @@ uint64_t CompactObj::HashCode(string_view str) {
 }
 
 unsigned CompactObj::ObjType() const {
-  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || taglen_ == EXTERNAL_TAG)
+  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || IsHex() ||
+      taglen_ == PREFIX_TAG || taglen_ == BITMAP_TAG || taglen_ == BLOOM_TAG || taglen_ == TS_TAG ||
+      taglen_ == CMS_TAG || taglen_ == TOPK_TAG)
     return OBJ_STRING;
 
+  if (taglen_ == EXTERNAL_TAG)
+    return u_.ext_ptr.obj_type;
+
   if (taglen_ == ROBJ_TAG)
     return u_.r_obj.type();
 
@@ -613,11 +835,64 @@ unsigned CompactObj::Encoding() const {
       return u_.r_obj.encoding();
     case INT_TAG:
       return OBJ_ENCODING_INT;
+    case EXTERNAL_TAG:
+      return u_.ext_ptr.encoding;
     default:
       return OBJ_ENCODING_RAW;
   }
 }
 
+const char* CompactObj::EncodingName() const {
+  if (IsInline())
+    return "inline";
+
+  switch (taglen_) {
+    case INT_TAG:
+      return "int";
+    case SMALL_TAG:
+      return "small";
+    case EXTERNAL_TAG:
+      return "external";
+    case UUID_TAG:
+    case HEX_TAG:
+      return "hex";
+    case PREFIX_TAG:
+      return "prefixed";
+    case BITMAP_TAG:
+      return "sparse_bitmap";
+    case BLOOM_TAG:
+      return "bloom";
+    case TS_TAG:
+      return "timeseries";
+    case CMS_TAG:
+      return "cms";
+    case TOPK_TAG:
+      return "topk";
+    case ROBJ_TAG:
+      break;
+    default:
+      return "unknown";
+  }
+
+  unsigned encoding = u_.r_obj.encoding();
+  switch (u_.r_obj.type()) {
+    case OBJ_STRING:
+      return "raw";
+    case OBJ_LIST:
+      return "quicklist";
+    case OBJ_SET:
+      return encoding == kEncodingIntSet ? "intset"
+                                         : (encoding == kEncodingStrMap ? "dict" : "stringset");
+    case OBJ_HASH:
+      return encoding == kEncodingListPack ? "listpack" : "stringmap";
+    case OBJ_ZSET:
+      return encoding == OBJ_ENCODING_LISTPACK ? "listpack" : "skiplist";
+    case OBJ_STREAM:
+      return "stream";
+  }
+  return "unknown";
+}
+
 // Takes ownership over o.
 void CompactObj::ImportRObj(robj* o) {
   CHECK(1 == o->refcount || o->refcount == OBJ_STATIC_REFCOUNT);
@@ -640,12 +915,13 @@ void CompactObj::ImportRObj(robj* o) {
       }
     } else if (o->type == OBJ_HASH) {
       if (o->encoding == OBJ_ENCODING_HT) {
-        enc = kEncodingStrMap;
+        enc = kEncodingStrMap2;
       } else {
         enc = kEncodingListPack;
       }
     }
     u_.r_obj.Init(type, enc, o->ptr);
+    u_.r_obj.ResetAccess();
     if (o->refcount == 1)
       zfree(o);
   }
@@ -677,6 +953,7 @@ void CompactObj::InitRobj(unsigned type, unsigned encoding, void* obj) {
   DCHECK_NE(type, OBJ_STRING);
   SetMeta(ROBJ_TAG);
   u_.r_obj.Init(type, encoding, obj);
+  u_.r_obj.ResetAccess();
 }
 
 void CompactObj::SyncRObj() {
@@ -688,7 +965,7 @@ void CompactObj::SyncRObj() {
 
   unsigned enc = obj->encoding;
   if (obj->type == OBJ_HASH) {
-    enc = (obj->encoding == OBJ_ENCODING_LISTPACK) ? kEncodingListPack : kEncodingStrMap;
+    enc = (obj->encoding == OBJ_ENCODING_LISTPACK) ? kEncodingListPack : kEncodingStrMap2;
   }
   u_.r_obj.Init(obj->type, enc, obj->ptr);
 }
@@ -734,6 +1011,9 @@ void CompactObj::SetString(std::string_view str) {
 
   DCHECK_GT(str.size(), kInlineLen);
 
+  if ((str.size() == kUuidStrLen || str.size() == kHexStrLen) && TrySetHex(str, mask))
+    return;
+
   string_view encoded = str;
   bool is_ascii = kUseAsciiEncoding && validate_ascii_fast(str.data(), str.size());
 
@@ -780,6 +1060,117 @@ void CompactObj::SetString(std::string_view str) {
   u_.r_obj.SetString(encoded, tl.local_mr);
 }
 
+void CompactObj::SetRange(size_t offset, string_view str) {
+  DCHECK(!IsExternal());
+  uint8_t mask = mask_ & ~kEncMask;
+
+  bool is_raw = taglen_ == ROBJ_TAG && u_.r_obj.type() == OBJ_STRING && (mask_ & kEncMask) == 0;
+  if (is_raw) {
+    u_.r_obj.SetRange(offset, str, tl.local_mr);
+    return;
+  }
+
+  string val;
+  GetString(&val);
+  if (val.size() < offset + str.size())
+    val.resize(offset + str.size());
+  if (!str.empty())
+    memcpy(val.data() + offset, str.data(), str.size());
+
+  if (val.size() < kMinInPlaceLen) {
+    SetString(val);
+    return;
+  }
+
+  SetMeta(ROBJ_TAG, mask);
+  u_.r_obj.SetString(val, tl.local_mr);
+}
+
+void CompactObj::SetPrefixedString(string_view str) {
+  // Shorter strings are inlined by SetString.
+  constexpr size_t kMaxInlineAsciiLen = 18;
+
+  size_t pos = str.rfind(':');
+  if (str.size() <= kMaxInlineAsciiLen || pos == string_view::npos || pos + 1 < kMinPrefixLen) {
+    SetString(str);
+    return;
+  }
+
+  uint8_t mask = mask_ & ~kEncMask;
+  if ((str.size() == kUuidStrLen || str.size() == kHexStrLen) && TrySetHex(str, mask))
+    return;
+
+  string_view suffix = str.substr(pos + 1);
+  uint32_t id = AcquirePrefix(str.substr(0, pos + 1));
+  if (id == kNoPrefix) {
+    SetString(str);
+    return;
+  }
+
+  SetMeta(PREFIX_TAG, mask);
+  u_.pref_str.prefix_id = id;
+  u_.pref_str.suffix_len = suffix.size();
+  if (suffix.size() <= PrefixedStr::kInlineSuffixLen) {
+    memcpy(u_.pref_str.suffix_inline, suffix.data(), suffix.size());
+  } else {
+    char* ptr = reinterpret_cast<char*>(tl.local_mr->allocate(suffix.size(), 1));
+    memcpy(ptr, suffix.data(), suffix.size());
+    u_.pref_str.suffix_ptr = ptr;
+  }
+}
+
+SparseBitmap* CompactObj::InitSparseBitmap() {
+  SetMeta(BITMAP_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(SparseBitmap), alignof(SparseBitmap));
+  u_.bitmap = new (ptr) SparseBitmap(tl.local_mr);
+  return u_.bitmap;
+}
+
+BloomFilter* CompactObj::InitBloomFilter() {
+  SetMeta(BLOOM_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(BloomFilter), alignof(BloomFilter));
+  u_.bloom = new (ptr) BloomFilter(tl.local_mr);
+  return u_.bloom;
+}
+
+TimeSeries* CompactObj::InitTimeSeries() {
+  SetMeta(TS_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(TimeSeries), alignof(TimeSeries));
+  u_.ts = new (ptr) TimeSeries(tl.local_mr);
+  return u_.ts;
+}
+
+CmsSketch* CompactObj::InitCmsSketch() {
+  SetMeta(CMS_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(CmsSketch), alignof(CmsSketch));
+  u_.cms = new (ptr) CmsSketch(tl.local_mr);
+  return u_.cms;
+}
+
+TopKSketch* CompactObj::InitTopKSketch() {
+  SetMeta(TOPK_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(TopKSketch), alignof(TopKSketch));
+  u_.topk = new (ptr) TopKSketch(tl.local_mr);
+  return u_.topk;
+}
+
+string_view CompactObj::GetPrefix() const {
+  if (taglen_ != PREFIX_TAG)
+    return string_view{};
+  return tl.prefixes[u_.pref_str.prefix_id].str;
+}
+
+bool CompactObj::TrySetHex(string_view str, uint8_t mask) {
+  uint8_t bin[kHexBinLen];
+  bool uuid = str.size() == kUuidStrLen;
+  if (!hex_pack(str, uuid, bin))
+    return false;
+
+  SetMeta(uuid ? UUID_TAG : HEX_TAG, mask);
+  memcpy(u_.inline_str, bin, kHexBinLen);
+  return true;
+}
+
 string_view CompactObj::GetSlice(string* scratch) const {
   uint8_t is_encoded = mask_ & kEncMask;
 
@@ -806,6 +1197,18 @@ string_view CompactObj::GetSlice(string* scratch) const {
     return *scratch;
   }
 
+  if (IsHex()) {
+    scratch->resize(Size());
+    hex_unpack(to_byte(u_.inline_str), taglen_ == UUID_TAG, scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == PREFIX_TAG || taglen_ == BITMAP_TAG || taglen_ == BLOOM_TAG ||
+      taglen_ == TS_TAG || taglen_ == CMS_TAG || taglen_ == TOPK_TAG) {
+    GetString(scratch);
+    return *scratch;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -850,12 +1253,61 @@ string_view CompactObj::GetSlice(string* scratch) const {
   return string_view{};
 }
 
+string_view CompactObj::GetSlice(size_t offset, size_t len, string* scratch) const {
+  DCHECK_LE(offset + len, Size());
+
+  if (taglen_ == BITMAP_TAG) {
+    scratch->resize(len);
+    u_.bitmap->Materialize(offset, len, scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == BLOOM_TAG) {
+    scratch->resize(len);
+    u_.bloom->Materialize(offset, len, scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == TS_TAG) {
+    scratch->resize(len);
+    u_.ts->Materialize(offset, len, scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == CMS_TAG || taglen_ == TOPK_TAG) {
+    scratch->resize(len);
+    if (taglen_ == CMS_TAG)
+      u_.cms->Materialize(offset, len, scratch->data());
+    else
+      u_.topk->Materialize(offset, len, scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ != ROBJ_TAG || u_.r_obj.type() != OBJ_STRING)
+    return GetSlice(scratch).substr(offset, len);
+
+  if ((mask_ & kEncMask) == 0)
+    return u_.r_obj.AsView().substr(offset, len);
+
+  // Every 8 chars are packed into 7 bytes, so only the groups overlapping the range are unpacked.
+  // The partial group at the end of the string is stored as is.
+  size_t first = offset / 8 * 8;
+  size_t last = std::min(Size(), (offset + len + 7) / 8 * 8);
+  scratch->resize(last - first);
+  detail::ascii_unpack(to_byte(u_.r_obj.inner_obj()) + first / 8 * 7, last - first,
+                       scratch->data());
+
+  return string_view{*scratch}.substr(offset - first, len);
+}
+
 bool CompactObj::HasAllocated() const {
-  if (IsRef() || taglen_ == INT_TAG || IsInline() || taglen_ == EXTERNAL_TAG ||
+  if (IsRef() || taglen_ == INT_TAG || IsInline() || taglen_ == EXTERNAL_TAG || IsHex() ||
       (taglen_ == ROBJ_TAG && u_.r_obj.inner_obj() == nullptr))
     return false;
 
-  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG);
+  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG || taglen_ == PREFIX_TAG ||
+         taglen_ == BITMAP_TAG || taglen_ == BLOOM_TAG || taglen_ == TS_TAG ||
+         taglen_ == CMS_TAG || taglen_ == TOPK_TAG);
   return true;
 }
 
@@ -889,6 +1341,43 @@ void CompactObj::GetString(char* dest) const {
     return;
   }
 
+  if (IsHex()) {
+    hex_unpack(to_byte(u_.inline_str), taglen_ == UUID_TAG, dest);
+    return;
+  }
+
+  if (taglen_ == PREFIX_TAG) {
+    string_view prefix = GetPrefix(), suffix = u_.pref_str.suffix();
+    memcpy(dest, prefix.data(), prefix.size());
+    memcpy(dest + prefix.size(), suffix.data(), suffix.size());
+    return;
+  }
+
+  if (taglen_ == BITMAP_TAG) {
+    u_.bitmap->Materialize(0, u_.bitmap->Size(), dest);
+    return;
+  }
+
+  if (taglen_ == BLOOM_TAG) {
+    u_.bloom->Materialize(0, u_.bloom->Size(), dest);
+    return;
+  }
+
+  if (taglen_ == TS_TAG) {
+    u_.ts->Materialize(0, u_.ts->Size(), dest);
+    return;
+  }
+
+  if (taglen_ == CMS_TAG) {
+    u_.cms->Materialize(0, u_.cms->Size(), dest);
+    return;
+  }
+
+  if (taglen_ == TOPK_TAG) {
+    u_.topk->Materialize(0, u_.topk->Size(), dest);
+    return;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -937,10 +1426,16 @@ void CompactObj::GetString(char* dest) const {
 }
 
 void CompactObj::SetExternal(size_t offset, size_t sz) {
+  SetExternal(offset, sz, OBJ_STRING, OBJ_ENCODING_RAW);
+}
+
+void CompactObj::SetExternal(size_t offset, size_t sz, unsigned obj_type, unsigned encoding) {
   SetMeta(EXTERNAL_TAG, mask_ & ~kEncMask);
 
   u_.ext_ptr.offset = offset;
   u_.ext_ptr.size = sz;
+  u_.ext_ptr.obj_type = obj_type;
+  u_.ext_ptr.encoding = encoding;
 }
 
 std::pair<size_t, size_t> CompactObj::GetExternalPtr() const {
@@ -965,6 +1460,26 @@ void CompactObj::Free() {
   } else if (taglen_ == SMALL_TAG) {
     tl.small_str_bytes -= u_.small_str.MallocUsed();
     u_.small_str.Free();
+  } else if (taglen_ == PREFIX_TAG) {
+    size_t len = u_.pref_str.suffix_len;
+    if (len > PrefixedStr::kInlineSuffixLen)
+      tl.local_mr->deallocate(u_.pref_str.suffix_ptr, len, 1);
+    ReleasePrefix(u_.pref_str.prefix_id);
+  } else if (taglen_ == BITMAP_TAG) {
+    u_.bitmap->~SparseBitmap();
+    tl.local_mr->deallocate(u_.bitmap, sizeof(SparseBitmap), alignof(SparseBitmap));
+  } else if (taglen_ == BLOOM_TAG) {
+    u_.bloom->~BloomFilter();
+    tl.local_mr->deallocate(u_.bloom, sizeof(BloomFilter), alignof(BloomFilter));
+  } else if (taglen_ == TS_TAG) {
+    u_.ts->~TimeSeries();
+    tl.local_mr->deallocate(u_.ts, sizeof(TimeSeries), alignof(TimeSeries));
+  } else if (taglen_ == CMS_TAG) {
+    u_.cms->~CmsSketch();
+    tl.local_mr->deallocate(u_.cms, sizeof(CmsSketch), alignof(CmsSketch));
+  } else if (taglen_ == TOPK_TAG) {
+    u_.topk->~TopKSketch();
+    tl.local_mr->deallocate(u_.topk, sizeof(TopKSketch), alignof(TopKSketch));
   } else {
     LOG(FATAL) << "Unsupported tag " << int(taglen_);
   }
@@ -984,11 +1499,68 @@ size_t CompactObj::MallocUsed() const {
     return u_.small_str.MallocUsed();
   }
 
+  if (taglen_ == PREFIX_TAG) {
+    size_t len = u_.pref_str.suffix_len;
+    return len > PrefixedStr::kInlineSuffixLen ? len : 0;
+  }
+
+  if (taglen_ == BITMAP_TAG) {
+    return sizeof(SparseBitmap) + u_.bitmap->MallocUsed();
+  }
+
+  if (taglen_ == BLOOM_TAG) {
+    return sizeof(BloomFilter) + u_.bloom->MallocUsed();
+  }
+
+  if (taglen_ == TS_TAG) {
+    return sizeof(TimeSeries) + u_.ts->MallocUsed();
+  }
+
+  if (taglen_ == CMS_TAG) {
+    return sizeof(CmsSketch) + u_.cms->MallocUsed();
+  }
+
+  if (taglen_ == TOPK_TAG) {
+    return sizeof(TopKSketch) + u_.topk->MallocUsed();
+  }
+
   LOG(DFATAL) << "should not reach";
   return 0;
 }
 
 bool CompactObj::operator==(const CompactObj& o) const {
+  if (taglen_ == BITMAP_TAG || o.taglen_ == BITMAP_TAG) {
+    std::string tmp;
+    return taglen_ == BITMAP_TAG ? o == GetSlice(&tmp) : *this == o.GetSlice(&tmp);
+  }
+
+  if (taglen_ == BLOOM_TAG || o.taglen_ == BLOOM_TAG) {
+    std::string tmp;
+    return taglen_ == BLOOM_TAG ? o == GetSlice(&tmp) : *this == o.GetSlice(&tmp);
+  }
+
+  if (taglen_ == TS_TAG || o.taglen_ == TS_TAG) {
+    std::string tmp;
+    return taglen_ == TS_TAG ? o == GetSlice(&tmp) : *this == o.GetSlice(&tmp);
+  }
+
+  bool is_sketch = taglen_ == CMS_TAG || taglen_ == TOPK_TAG;
+  if (is_sketch || o.taglen_ == CMS_TAG || o.taglen_ == TOPK_TAG) {
+    std::string tmp;
+    return is_sketch ? o == GetSlice(&tmp) : *this == o.GetSlice(&tmp);
+  }
+
+  // The same key may be stored with or without a prefix, e.g. if the dictionary was full.
+  if (taglen_ == PREFIX_TAG || o.taglen_ == PREFIX_TAG) {
+    if (taglen_ == o.taglen_) {
+      return u_.pref_str.prefix_id == o.u_.pref_str.prefix_id &&
+             u_.pref_str.suffix() == o.u_.pref_str.suffix();
+    }
+
+    std::string tmp;
+    return taglen_ == PREFIX_TAG ? *this == o.GetSlice(&tmp) : o == GetSlice(&tmp);
+  }
+
   uint8_t m1 = mask_ & kEncMask;
   uint8_t m2 = mask_ & kEncMask;
   if (m1 != m2)
@@ -1009,6 +1581,9 @@ bool CompactObj::operator==(const CompactObj& o) const {
   if (taglen_ == SMALL_TAG)
     return u_.small_str.Equal(o.u_.small_str);
 
+  if (IsHex())
+    return memcmp(u_.inline_str, o.u_.inline_str, kHexBinLen) == 0;
+
   DCHECK(IsInline() && o.IsInline());
 
   return memcmp(u_.inline_str, o.u_.inline_str, taglen_) == 0;
@@ -1025,6 +1600,40 @@ bool CompactObj::EqualNonInline(std::string_view sv) const {
       return u_.r_obj.Equal(sv);
     case SMALL_TAG:
       return u_.small_str.Equal(sv);
+    case UUID_TAG:
+    case HEX_TAG: {
+      uint8_t bin[kHexBinLen];
+      bool uuid = taglen_ == UUID_TAG;
+      if (sv.size() != (uuid ? kUuidStrLen : kHexStrLen) || !hex_pack(sv, uuid, bin))
+        return false;
+      return memcmp(u_.inline_str, bin, kHexBinLen) == 0;
+    }
+    case PREFIX_TAG: {
+      string_view prefix = GetPrefix();
+      return sv.size() == prefix.size() + u_.pref_str.suffix_len &&
+             absl::StartsWith(sv, prefix) && sv.substr(prefix.size()) == u_.pref_str.suffix();
+    }
+    case BITMAP_TAG:
+      if (sv.size() != u_.bitmap->Size())
+        return false;
+      GetString(&tl.tmp_str);
+      return sv == tl.tmp_str;
+    case BLOOM_TAG:
+      if (sv.size() != u_.bloom->Size())
+        return false;
+      GetString(&tl.tmp_str);
+      return sv == tl.tmp_str;
+    case TS_TAG:
+      if (sv.size() != u_.ts->Size())
+        return false;
+      GetString(&tl.tmp_str);
+      return sv == tl.tmp_str;
+    case CMS_TAG:
+    case TOPK_TAG:
+      if (sv.size() != Size())
+        return false;
+      GetString(&tl.tmp_str);
+      return sv == tl.tmp_str;
     default:
       break;
   }
@@ -1106,6 +1715,22 @@ size_t CompactObj::DecodedLen(size_t sz) const {
   return ascii_len(sz) - ((mask_ & ASCII1_ENC_BIT) ? 1 : 0);
 }
 
+bool CompactObj::DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse) {
+  if (taglen_ == SMALL_TAG) {
+    size_t prev = u_.small_str.MallocUsed();
+    if (!u_.small_str.DefragIfNeeded(is_sparse))
+      return false;
+    tl.small_str_bytes += u_.small_str.MallocUsed();
+    tl.small_str_bytes -= prev;
+    return true;
+  }
+
+  if (taglen_ != ROBJ_TAG)
+    return false;
+
+  return u_.r_obj.DefragIfNeeded(is_sparse, tl.local_mr);
+}
+
 pmr::memory_resource* CompactObj::memory_resource() {
   return tl.local_mr;
 }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <absl/base/internal/endian.h>
+#include <absl/functional/function_ref.h>
 
 #include <memory_resource>
 #include <optional>
@@ -15,6 +16,12 @@ typedef struct redisObject robj;
 
 namespace dfly {
 
+class BloomFilter;
+class CmsSketch;
+class SparseBitmap;
+class TimeSeries;
+class TopKSketch;
+
 constexpr unsigned kEncodingIntSet = 0;
 constexpr unsigned kEncodingStrMap = 1;  // for set/map encodings of strings
 constexpr unsigned kEncodingStrMap2 = 2;  // for set/map encodings of strings using DenseSet
@@ -36,8 +43,16 @@ class RobjWrapper {
   void Free(std::pmr::memory_resource* mr);
 
   void SetString(std::string_view s, std::pmr::memory_resource* mr);
+
+  // Writes s at offset of the string, zero padding the gap after its end. The buffer grows
+  // geometrically, so that appends take amortized constant time.
+  void SetRange(size_t offset, std::string_view s, std::pmr::memory_resource* mr);
   void Init(unsigned type, unsigned encoding, void* inner);
 
+  // See CompactObj::DefragIfNeeded.
+  bool DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse,
+                      std::pmr::memory_resource* mr);
+
   unsigned type() const {
     return type_;
   }
@@ -52,6 +67,31 @@ class RobjWrapper {
     return std::string_view{reinterpret_cast<char*>(inner_obj_), sz_};
   }
 
+  // Saturating counters of the lookups and the writes of a container. Both are halved once
+  // one of them saturates, so that they follow its recent access mix.
+  void RecordAccess(bool write) {
+    if (lookups_ == 0xFF || writes_ == 0xFF) {
+      lookups_ >>= 1;
+      writes_ >>= 1;
+    }
+    if (write)
+      ++writes_;
+    else
+      ++lookups_;
+  }
+
+  void ResetAccess() {
+    lookups_ = writes_ = 0;
+  }
+
+  unsigned lookups() const {
+    return lookups_;
+  }
+
+  unsigned writes() const {
+    return writes_;
+  }
+
  private:
   size_t InnerObjMallocUsed() const;
   void MakeInnerRoom(size_t current_cap, size_t desired, std::pmr::memory_resource* mr);
@@ -68,7 +108,9 @@ class RobjWrapper {
 
   uint32_t type_ : 4;
   uint32_t encoding_ : 4;
-  uint32_t unneeded_ : 24;
+  uint32_t lookups_ : 8;
+  uint32_t writes_ : 8;
+  uint32_t unneeded_ : 8;
 
 } __attribute__((packed));
 
@@ -96,40 +138,73 @@ class CompactObj {
     SMALL_TAG = 18,
     ROBJ_TAG = 19,
     EXTERNAL_TAG = 20,
+
+    // Lowercase hex strings of 16 bytes stored in binary form inside inline_str.
+    UUID_TAG = 21,  // canonical 8-4-4-4-12 uuid form, 36 chars.
+    HEX_TAG = 22,   // 32 hex chars without dashes, e.g. md5 digests.
+
+    // A key whose prefix is stored in the thread-local prefix dictionary - see SetPrefixedString.
+    PREFIX_TAG = 23,
+
+    // A string value that is a sparse bitmap - see SparseBitmap.
+    BITMAP_TAG = 24,
+
+    // A string value that is a Bloom filter - see BloomFilter.
+    BLOOM_TAG = 25,
+
+    // A string value that is a time series - see TimeSeries.
+    TS_TAG = 26,
+
+    // String values that are count-min or top-k sketches - see CmsSketch and TopKSketch.
+    CMS_TAG = 27,
+    TOPK_TAG = 28,
   };
 
+  // The lower nibble holds bits that are relevant both for keys and values.
+  // The upper nibble holds value-only bits for values, and the frequency counter for keys
+  // (see GetFreq).
   enum MaskBit {
     REF_BIT = 1,
-    EXPIRE_BIT = 2,
-    FLAG_BIT = 4,
 
     // ascii encoding is not an injective function. it compresses 8 bytes to 7 but also 7 to 7.
     // therefore, in order to know the original length we introduce 2 flags that
     // correct the length upon decoding. ASCII1_ENC_BIT rounds down the decoded length,
     // while ASCII2_ENC_BIT rounds it up. See DecodedLen implementation for more info.
-    ASCII1_ENC_BIT = 8,
-    ASCII2_ENC_BIT = 0x10,
-    IO_PENDING = 0x20,
-    STICKY = 0x40,
+    ASCII1_ENC_BIT = 2,
+    ASCII2_ENC_BIT = 4,
+    STICKY = 8,
+
+    // value-only bits.
+    EXPIRE_BIT = 0x10,
+    FLAG_BIT = 0x20,
+    IO_PENDING = 0x40,
+
+    // Set when a container value is looked up, cleared by the tiered storage scan that
+    // offloads the containers that were not touched since its previous pass.
+    TOUCHED_BIT = 0x80,
   };
 
   static constexpr uint8_t kEncMask = ASCII1_ENC_BIT | ASCII2_ENC_BIT;
+  static constexpr unsigned kFreqShift = 4;
 
  public:
   using PrefixArray = std::vector<std::string_view>;
 
-  CompactObj() {  // By default - empty string.
+  // Strings of at least this size are kept unencoded by SetRange, see below.
+  static constexpr size_t kMinInPlaceLen = 4096;
+
+  CompactObj() : taglen_(0), idle_(0) {  // By default - empty string.
   }
 
-  explicit CompactObj(robj* o) {
+  explicit CompactObj(robj* o) : taglen_(0), idle_(0) {
     ImportRObj(o);
   }
 
-  explicit CompactObj(std::string_view str) {
+  explicit CompactObj(std::string_view str) : taglen_(0), idle_(0) {
     SetString(str);
   }
 
-  CompactObj(CompactObj&& cs) noexcept {
+  CompactObj(CompactObj&& cs) noexcept : taglen_(0), idle_(0) {
     operator=(std::move(cs));
   };
 
@@ -159,6 +234,10 @@ class CompactObj {
 
   std::string_view GetSlice(std::string* scratch) const;
 
+  // Returns len bytes of the string from offset. Large packed strings are unpacked only around
+  // the range. offset + len must not exceed Size().
+  std::string_view GetSlice(size_t offset, size_t len, std::string* scratch) const;
+
   std::string ToString() const {
     std::string res;
     GetString(&res);
@@ -180,6 +259,10 @@ class CompactObj {
     return o.operator==(sl);
   }
 
+  friend bool operator!=(std::string_view sl, const CompactObj& o) {
+    return !o.operator==(sl);
+  }
+
   bool HasExpire() const {
     return mask_ & EXPIRE_BIT;
   }
@@ -216,6 +299,18 @@ class CompactObj {
     }
   }
 
+  bool IsTouched() const {
+    return mask_ & TOUCHED_BIT;
+  }
+
+  void SetTouched(bool b) {
+    if (b) {
+      mask_ |= TOUCHED_BIT;
+    } else {
+      mask_ &= ~TOUCHED_BIT;
+    }
+  }
+
   bool IsSticky() const {
     return mask_ & STICKY;
   }
@@ -228,13 +323,76 @@ class CompactObj {
     }
   }
 
+  // Approximate access frequency of a key, used by cache eviction. Keys only.
+  // The counter is logarithmic (Morris counter): its value c approximates 2^c accesses.
+  static constexpr unsigned kFreqInit = 1;
+  static constexpr unsigned kFreqMax = 0xF;
+
+  unsigned GetFreq() const {
+    return mask_ >> kFreqShift;
+  }
+
+  void SetFreq(unsigned freq) const {
+    mask_ = (mask_ & ((1u << kFreqShift) - 1)) | (freq << kFreqShift);
+  }
+
+  // Increments the frequency counter with probability 2^-freq.
+  // rnd must be uniformly distributed.
+  void IncrFreq(uint32_t rnd) const {
+    unsigned freq = GetFreq();
+    if (freq < kFreqMax && (rnd & ((1u << freq) - 1)) == 0)
+      SetFreq(freq + 1);
+  }
+
+  void DecayFreq() const {
+    unsigned freq = GetFreq();
+    if (freq > 0)
+      SetFreq(freq - 1);
+  }
+
+  // Coarse idle clock of a key, kept in the spare bits of the tag. Reset on lookups and aged
+  // by DbSlice::DecayFreqStep, see DbSlice::IdleSeconds for the meaning of its levels.
+  static constexpr unsigned kIdleMax = 7;
+
+  unsigned GetIdle() const {
+    return idle_;
+  }
+
+  void SetIdle(unsigned idle) const {
+    idle_ = idle;
+  }
+
   unsigned Encoding() const;
   unsigned ObjType() const;
 
+  // A short name of the way the object is stored, e.g. "inline" or "small" for strings and
+  // "listpack" or "skiplist" for sorted sets. Offloaded objects are "external".
+  const char* EncodingName() const;
+
   void* RObjPtr() const {
     return u_.r_obj.inner_obj();
   }
 
+  // Records a lookup or a write of a container value. Used to tune the encodings of hashes and
+  // sorted sets by their access mix, see container_utils::ListpackLimit.
+  void RecordAccess(bool write) {
+    if (taglen_ == ROBJ_TAG)
+      u_.r_obj.RecordAccess(write);
+  }
+
+  // Returns the recent (lookups, writes) of a container value.
+  std::pair<unsigned, unsigned> AccessMix() const {
+    if (taglen_ != ROBJ_TAG)
+      return {0, 0};
+    return {u_.r_obj.lookups(), u_.r_obj.writes()};
+  }
+
+  // Moves the heap payload of a string or of a single blob container (listpack, intset) to
+  // a new allocation if is_sparse(payload) returns true, unless the new allocation lands on
+  // a sparse page as well. Used by the defragmentation to drain underutilized heap pages.
+  // Returns true if the payload was moved.
+  bool DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse);
+
   void SetRObjPtr(void* ptr) {
     u_.r_obj.Init(u_.r_obj.type(), u_.r_obj.encoding(), ptr);
   }
@@ -260,13 +418,74 @@ class CompactObj {
   void SetString(std::string_view str);
   void GetString(std::string* res) const;
 
+  // For STR object. Writes str at offset, zero padding the gap after the end of the string, like
+  // SETRANGE. Strings of at least kMinInPlaceLen bytes are kept unencoded, so that the following
+  // writes update them in place. Must not be called on external objects.
+  void SetRange(size_t offset, std::string_view str);
+  void AppendString(std::string_view str) {
+    SetRange(Size(), str);
+  }
+
   // dest must have at least Size() bytes available
   void GetString(char* dest) const;
 
+  // For keys. Like SetString, but the part of str up to and including its last ':' may be
+  // stored once in the thread-local prefix dictionary and shared by all the keys with that
+  // prefix. Such objects must be accessed only from the thread that created them.
+  void SetPrefixedString(std::string_view str);
+
+  // Returns the dictionary prefix of the object, or an empty string if it has none.
+  std::string_view GetPrefix() const;
+
+  // For STR object. Large bitmaps with few set bits can be stored compressed, while the string
+  // accessors keep returning their raw bytes. Returns nullptr if the object is not such bitmap.
+  SparseBitmap* GetSparseBitmap() const {
+    return taglen_ == BITMAP_TAG ? u_.bitmap : nullptr;
+  }
+
+  // Resets the object to an empty sparse bitmap and returns it.
+  SparseBitmap* InitSparseBitmap();
+
+  // For STR object. The Bloom filters of the BF commands, whose raw bytes are their serialized
+  // form. Returns nullptr if the object is not a parsed filter.
+  BloomFilter* GetBloomFilter() const {
+    return taglen_ == BLOOM_TAG ? u_.bloom : nullptr;
+  }
+
+  // Resets the object to an empty filter, which must be initialized, and returns it.
+  BloomFilter* InitBloomFilter();
+
+  // For STR object. The series of the TS commands, whose raw bytes are their serialized form.
+  // Returns nullptr if the object is not a parsed series.
+  TimeSeries* GetTimeSeries() const {
+    return taglen_ == TS_TAG ? u_.ts : nullptr;
+  }
+
+  // Resets the object to an empty series, which must be initialized, and returns it.
+  TimeSeries* InitTimeSeries();
+
+  // For STR object. The sketches of the CMS and the TOPK commands, whose raw bytes are their
+  // serialized form. Return nullptr if the object is not a parsed sketch of that kind.
+  CmsSketch* GetCmsSketch() const {
+    return taglen_ == CMS_TAG ? u_.cms : nullptr;
+  }
+
+  TopKSketch* GetTopKSketch() const {
+    return taglen_ == TOPK_TAG ? u_.topk : nullptr;
+  }
+
+  // Reset the object to an empty sketch, which must be initialized, and return it.
+  CmsSketch* InitCmsSketch();
+  TopKSketch* InitTopKSketch();
+
   bool IsExternal() const {
     return taglen_ == EXTERNAL_TAG;
   }
   void SetExternal(size_t offset, size_t sz);
+
+  // Offloaded container. ObjType() and Encoding() keep reporting the original ones, and sz is
+  // the length of its serialized blob.
+  void SetExternal(size_t offset, size_t sz, unsigned obj_type, unsigned encoding);
   std::pair<size_t, size_t> GetExternalPtr() const;
 
   // In case this object a single blob, returns number of bytes allocated on heap
@@ -298,6 +517,12 @@ class CompactObj {
 
   bool EqualNonInline(std::string_view sv) const;
 
+  // Tries to pack str as a 16 byte hex string - see UUID_TAG.
+  bool TrySetHex(std::string_view str, uint8_t mask);
+  bool IsHex() const {
+    return taglen_ == UUID_TAG || taglen_ == HEX_TAG;
+  }
+
   // Requires: HasAllocated() - true.
   void Free();
 
@@ -318,7 +543,25 @@ class CompactObj {
   struct ExternalPtr {
     size_t offset;
     uint32_t size;
-    uint32_t unneeded;
+    uint8_t obj_type;
+    uint8_t encoding;
+    uint16_t unneeded;
+  } __attribute__((packed));
+
+  struct PrefixedStr {
+    static constexpr unsigned kInlineSuffixLen = 8;
+
+    uint32_t prefix_id;
+    uint32_t suffix_len;
+    union {
+      char* suffix_ptr;
+      char suffix_inline[kInlineSuffixLen];
+    };
+
+    std::string_view suffix() const {
+      return suffix_len <= kInlineSuffixLen ? std::string_view{suffix_inline, suffix_len}
+                                            : std::string_view{suffix_ptr, suffix_len};
+    }
   } __attribute__((packed));
 
   // My main data structure. Union of representations.
@@ -332,6 +575,12 @@ class CompactObj {
     detail::RobjWrapper r_obj;
     int64_t ival __attribute__((packed));
     ExternalPtr ext_ptr;
+    PrefixedStr pref_str;
+    SparseBitmap* bitmap;
+    BloomFilter* bloom;
+    TimeSeries* ts;
+    CmsSketch* cms;
+    TopKSketch* topk;
 
     U() : r_obj() {
     }
@@ -343,7 +592,10 @@ class CompactObj {
   // Maybe it's possible to merge those 2 together and gain another byte
   // but lets postpone it to 2023.
   mutable uint8_t mask_ = 0;
-  uint8_t taglen_ = 0;
+
+  // The tags and the inline lengths fit in 5 bits, the rest holds the idle clock of keys.
+  uint8_t taglen_ : 5;
+  mutable uint8_t idle_ : 3;
 };
 
 inline bool CompactObj::operator==(std::string_view sv) const {
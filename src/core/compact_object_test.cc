@@ -7,10 +7,16 @@
 #include <xxhash.h>
 #include <absl/strings/str_cat.h>
 
+#include <thread>
+
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "core/bloom_filter.h"
 #include "core/flat_set.h"
+#include "core/frequency_sketch.h"
 #include "core/mi_memory_resource.h"
+#include "core/sparse_bitmap.h"
+#include "core/time_series.h"
 
 extern "C" {
 #include "redis/dict.h"
@@ -110,6 +116,114 @@ TEST_F(CompactObjectTest, InlineAsciiEncoded) {
   EXPECT_EQ(s.size(), obj.Size());
 }
 
+TEST_F(CompactObjectTest, HexEncoded) {
+  const char* kStrings[] = {"0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0",
+                            "d41d8cd98f00b204e9800998ecf8427e"};
+  for (string_view s : kStrings) {
+    CompactObj obj{s};
+    EXPECT_EQ(0, obj.MallocUsed());
+    EXPECT_EQ(s.size(), obj.Size());
+    EXPECT_EQ(XXH3_64bits_withSeed(s.data(), s.size(), kSeed), obj.HashCode());
+    EXPECT_EQ(s, obj);
+    EXPECT_EQ(s, obj.ToString());
+    EXPECT_EQ(s, obj.GetSlice(&tmp_));
+    EXPECT_EQ(CompactObj{s}, obj);
+
+    string other(s);
+    other.back() = 'a';
+    EXPECT_NE(other, obj);
+    EXPECT_NE(CompactObj{other}, obj);
+  }
+
+  // Uppercase and malformed strings are stored as is.
+  for (string_view s : {"0F1E2D3C-4B5A-6978-8796-A5B4C3D2E1F0",
+                        "0f1e2d3c14b5a-6978-8796-a5b4c3d2e1f0", "d41d8cd98f00b204e9800998ecf8427z"}) {
+    CompactObj obj{s};
+    EXPECT_EQ(s, obj);
+    EXPECT_EQ(s, obj.ToString());
+  }
+}
+
+TEST_F(CompactObjectTest, PrefixEncoded) {
+  string k1 = "tenant:1234:session:abcdefghijkl";
+  string k2 = "tenant:1234:session:xyz";
+  CompactObj a, b, plain{k1};
+  a.SetPrefixedString(k1);
+  b.SetPrefixedString(k2);
+
+  EXPECT_EQ("tenant:1234:session:", a.GetPrefix());
+  EXPECT_EQ(a.GetPrefix().data(), b.GetPrefix().data());
+  EXPECT_EQ(k1.size(), a.Size());
+  EXPECT_EQ(k1, a.ToString());
+  EXPECT_EQ(k2, b.GetSlice(&tmp_));
+  EXPECT_EQ(XXH3_64bits_withSeed(k1.data(), k1.size(), kSeed), a.HashCode());
+  EXPECT_EQ(k1, a);
+  EXPECT_NE(k2, a);
+  EXPECT_NE(a, b);
+
+  // Equality does not depend on the representation.
+  EXPECT_TRUE(plain.GetPrefix().empty());
+  EXPECT_EQ(plain, a);
+  EXPECT_EQ(a, plain);
+  CompactObj c;
+  c.SetPrefixedString(k1);
+  EXPECT_EQ(a, c);
+
+  // Short keys and keys without a separator are stored as usual.
+  c.SetPrefixedString("a:b");
+  EXPECT_TRUE(c.GetPrefix().empty());
+  c.SetPrefixedString("keyspace_without_separator");
+  EXPECT_TRUE(c.GetPrefix().empty());
+  EXPECT_EQ("keyspace_without_separator", c);
+
+  a.Reset();
+  b.Reset();
+  a.SetPrefixedString("other:prefix:value");
+  EXPECT_EQ("other:prefix:", a.GetPrefix());
+  EXPECT_EQ("other:prefix:value", a);
+}
+
+TEST_F(CompactObjectTest, Freq) {
+  string s = "key:0000000000000";
+  CompactObj obj{s};
+  obj.SetSticky(true);
+  EXPECT_EQ(0, obj.GetFreq());
+
+  // With a zero "random" number the counter always increments.
+  for (unsigned i = 0; i < 20; ++i) {
+    obj.IncrFreq(0);
+  }
+  EXPECT_EQ(CompactObj::kFreqMax, obj.GetFreq());
+
+  obj.SetFreq(3);
+  obj.IncrFreq(1);  // probability 1/8: 1 & 7 != 0.
+  EXPECT_EQ(3, obj.GetFreq());
+  obj.DecayFreq();
+  EXPECT_EQ(2, obj.GetFreq());
+
+  // The counter does not interfere with the rest of the metadata.
+  EXPECT_TRUE(obj.IsSticky());
+  EXPECT_EQ(s, obj);
+  EXPECT_EQ(s.size(), obj.Size());
+}
+
+TEST_F(CompactObjectTest, Idle) {
+  // Both the inline lengths and the tags share the byte of the idle clock.
+  for (string s : {string("k"), string(16, 'a'), string(40, 'x'), string("12345")}) {
+    CompactObj obj{s};
+    EXPECT_EQ(0, obj.GetIdle());
+    obj.SetIdle(CompactObj::kIdleMax);
+    EXPECT_EQ(CompactObj::kIdleMax, obj.GetIdle());
+    EXPECT_EQ(s, obj);
+    EXPECT_EQ(s.size(), obj.Size());
+
+    // The clock moves with the key.
+    CompactObj moved{std::move(obj)};
+    EXPECT_EQ(CompactObj::kIdleMax, moved.GetIdle());
+    EXPECT_EQ(0, obj.GetIdle());
+    EXPECT_EQ(s, moved);
+  }
+}
 
 TEST_F(CompactObjectTest, Int) {
   cobj_.SetString("0");
@@ -123,6 +237,7 @@ TEST_F(CompactObjectTest, Int) {
   cobj_.SetString("42");
   EXPECT_EQ(8181779779123079347, cobj_.HashCode());
   EXPECT_EQ(OBJ_ENCODING_INT, cobj_.Encoding());
+  EXPECT_STREQ("int", cobj_.EncodingName());
   EXPECT_EQ(2, cobj_.Size());
   EXPECT_TRUE(cobj_.HasExpire());
 }
@@ -132,6 +247,7 @@ TEST_F(CompactObjectTest, MediumString) {
 
   cobj_.SetString(tmp);
   EXPECT_EQ(tmp.size(), cobj_.Size());
+  EXPECT_STREQ("small", cobj_.EncodingName());
 
   cobj_.SetString(tmp);
   EXPECT_EQ(tmp.size(), cobj_.Size());
@@ -142,6 +258,172 @@ TEST_F(CompactObjectTest, MediumString) {
   EXPECT_EQ(27463, cobj_.Size());
 }
 
+TEST_F(CompactObjectTest, SetRange) {
+  cobj_.SetString("hello");
+  cobj_.SetRange(7, "world");
+  EXPECT_EQ(string_view("hello\0\0world", 12), cobj_.ToString());
+
+  // Large strings are unpacked once and then updated in place.
+  string expected(CompactObj::kMinInPlaceLen, 'a');
+  cobj_.SetString(expected);
+  for (unsigned i = 0; i < 1000; ++i) {
+    cobj_.AppendString("b");
+    expected.append("b");
+  }
+  cobj_.SetRange(0, "x");
+  expected[0] = 'x';
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_EQ(expected.size(), cobj_.Size());
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, GetSliceRange) {
+  string val;
+  for (unsigned i = 0; i < 50003; ++i)
+    val.push_back('a' + i % 26);
+  cobj_.SetString(val);
+
+  string tmp;
+  for (size_t offset : {0, 1, 7, 8, 4095, 49990}) {
+    for (size_t len : {0, 1, 9, 13}) {
+      EXPECT_EQ(val.substr(offset, len), cobj_.GetSlice(offset, len, &tmp));
+    }
+  }
+  EXPECT_LT(tmp.size(), 32u);  // only the groups around the range are unpacked.
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, SparseBitmap) {
+  SparseBitmap* bm = cobj_.InitSparseBitmap();
+  ASSERT_EQ(bm, cobj_.GetSparseBitmap());
+  bm->Set(1 << 20, true);
+  bm->Set(9, true);
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_LT(cobj_.MallocUsed(), 512u);
+
+  // The string accessors see the raw bytes.
+  string expected((1 << 17) + 1, 0);
+  expected[1] = 0x40;
+  expected[1 << 17] = char(0x80);
+  EXPECT_EQ(expected.size(), cobj_.Size());
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_EQ(expected.substr(1, 2), cobj_.GetSlice(1, 2, &tmp_));
+  EXPECT_TRUE(cobj_ == expected);
+  EXPECT_TRUE(cobj_ == CompactObj{expected});
+
+  // Other writes store the raw string.
+  cobj_.SetRange(0, "a");
+  expected[0] = 'a';
+  EXPECT_EQ(nullptr, cobj_.GetSparseBitmap());
+  EXPECT_EQ(expected, cobj_.ToString());
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, BloomFilter) {
+  BloomFilter* bf = cobj_.InitBloomFilter();
+  ASSERT_EQ(bf, cobj_.GetBloomFilter());
+  bf->Init(0.01, 1000, 2);
+  bf->Add("foo");
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_STREQ("bloom", cobj_.EncodingName());
+  EXPECT_GT(cobj_.MallocUsed(), bf->Size() - 100);
+
+  // The string accessors see the serialized filter.
+  string expected(bf->Size(), 0);
+  bf->Materialize(0, expected.size(), expected.data());
+  EXPECT_EQ(expected.size(), cobj_.Size());
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_EQ(expected.substr(10, 40), cobj_.GetSlice(10, 40, &tmp_));
+  EXPECT_TRUE(cobj_ == expected);
+  EXPECT_TRUE(cobj_ == CompactObj{expected});
+
+  cobj_.SetString(expected);
+  EXPECT_EQ(nullptr, cobj_.GetBloomFilter());
+  EXPECT_EQ(expected, cobj_.ToString());
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, TimeSeries) {
+  TimeSeries* ts = cobj_.InitTimeSeries();
+  ASSERT_EQ(ts, cobj_.GetTimeSeries());
+  ts->Init(0, 64, TimeSeries::BLOCK);
+  for (int64_t i = 0; i < 100; ++i)
+    ts->Add(i * 1000, i % 7);
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_STREQ("timeseries", cobj_.EncodingName());
+  EXPECT_GE(cobj_.MallocUsed(), ts->Size() - 100);
+
+  // The string accessors see the serialized series.
+  string expected(ts->Size(), 0);
+  ts->Materialize(0, expected.size(), expected.data());
+  EXPECT_EQ(expected.size(), cobj_.Size());
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_EQ(expected.substr(10, 40), cobj_.GetSlice(10, 40, &tmp_));
+  EXPECT_TRUE(cobj_ == expected);
+  EXPECT_TRUE(cobj_ == CompactObj{expected});
+
+  cobj_.SetString(expected);
+  EXPECT_EQ(nullptr, cobj_.GetTimeSeries());
+  EXPECT_EQ(expected, cobj_.ToString());
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, Sketches) {
+  CmsSketch* cms = cobj_.InitCmsSketch();
+  ASSERT_EQ(cms, cobj_.GetCmsSketch());
+  EXPECT_EQ(nullptr, cobj_.GetTopKSketch());
+  cms->Init(100, 3);
+  uint32_t incr = 5;
+  uint64_t count;
+  cms->IncrBy({"foo"}, &incr, &count);
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_STREQ("cms", cobj_.EncodingName());
+
+  string expected(cms->Size(), 0);
+  cms->Materialize(0, expected.size(), expected.data());
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_EQ(expected.substr(10, 40), cobj_.GetSlice(10, 40, &tmp_));
+  EXPECT_TRUE(cobj_ == CompactObj{expected});
+
+  TopKSketch* topk = cobj_.InitTopKSketch();
+  ASSERT_EQ(topk, cobj_.GetTopKSketch());
+  EXPECT_EQ(nullptr, cobj_.GetCmsSketch());
+  topk->Init(3, 8, 7, 0.9);
+  optional<string> expelled;
+  topk->IncrBy({"foo"}, &incr, &expelled);
+  EXPECT_STREQ("topk", cobj_.EncodingName());
+
+  expected.assign(topk->Size(), 0);
+  topk->Materialize(0, expected.size(), expected.data());
+  EXPECT_EQ(expected.size(), cobj_.Size());
+  EXPECT_EQ(expected, cobj_.ToString());
+  EXPECT_TRUE(cobj_ == expected);
+
+  cobj_.SetString(expected);
+  EXPECT_EQ(nullptr, cobj_.GetTopKSketch());
+  EXPECT_EQ(expected, cobj_.ToString());
+  cobj_.Reset();
+}
+
+TEST_F(CompactObjectTest, SmallStringOtherThread) {
+  string val(200, '\xff');  // not ascii, so it's kept as is.
+  val.append("suffix");
+  cobj_.SetString(val);
+
+  // Small strings can be read from threads that did not allocate them.
+  string res;
+  bool equal = false;
+  std::thread reader([&] {
+    cobj_.GetString(&res);
+    equal = cobj_ == val;
+  });
+  reader.join();
+
+  EXPECT_EQ(val, res);
+  EXPECT_TRUE(equal);
+  cobj_.Reset();
+}
+
 TEST_F(CompactObjectTest, AsciiUtil) {
   std::string_view data{"aaaaaabb"};
   uint8_t buf[32];
@@ -160,6 +442,7 @@ TEST_F(CompactObjectTest, IntSet) {
   cobj_.ImportRObj(src);
   EXPECT_EQ(OBJ_SET, cobj_.ObjType());
   EXPECT_EQ(kEncodingIntSet, cobj_.Encoding());
+  EXPECT_STREQ("intset", cobj_.EncodingName());
 
   EXPECT_EQ(0, cobj_.Size());
   intset* is = (intset*)cobj_.RObjPtr();
@@ -180,6 +463,7 @@ TEST_F(CompactObjectTest, HSet) {
 
   EXPECT_EQ(OBJ_HASH, cobj_.ObjType());
   EXPECT_EQ(kEncodingListPack, cobj_.Encoding());
+  EXPECT_STREQ("listpack", cobj_.EncodingName());
 
   robj* os = cobj_.AsRObj();
 
@@ -191,6 +475,28 @@ TEST_F(CompactObjectTest, HSet) {
   cobj_.SyncRObj();
 }
 
+TEST_F(CompactObjectTest, AccessMix) {
+  cobj_.ImportRObj(createHashObject());
+  EXPECT_EQ(make_pair(0u, 0u), cobj_.AccessMix());
+
+  for (unsigned i = 0; i < 10; ++i) {
+    cobj_.RecordAccess(false);
+  }
+  cobj_.RecordAccess(true);
+  cobj_.AsRObj();
+  cobj_.SyncRObj();
+  EXPECT_EQ(make_pair(10u, 1u), cobj_.AccessMix());
+
+  // Both counters are halved once the lookups saturate.
+  for (unsigned i = 0; i < 300; ++i) {
+    cobj_.RecordAccess(false);
+  }
+  auto [lookups, writes] = cobj_.AccessMix();
+  EXPECT_LT(lookups, 256u);
+  EXPECT_GT(lookups, 127u);
+  EXPECT_EQ(0u, writes);
+}
+
 TEST_F(CompactObjectTest, ZSet) {
   // unrelated, checking that sds static encoding works.
   // it is used in zset special strings.
@@ -204,6 +510,54 @@ TEST_F(CompactObjectTest, ZSet) {
 
   EXPECT_EQ(OBJ_ZSET, cobj_.ObjType());
   EXPECT_EQ(OBJ_ENCODING_LISTPACK, cobj_.Encoding());
+  EXPECT_STREQ("listpack", cobj_.EncodingName());
+}
+
+TEST_F(CompactObjectTest, ExternalContainer) {
+  cobj_.ImportRObj(createHashObject());
+  cobj_.SetExpire(true);
+
+  cobj_.SetExternal(8192, 100, OBJ_HASH, kEncodingListPack);
+  EXPECT_TRUE(cobj_.IsExternal());
+  EXPECT_TRUE(cobj_.HasExpire());
+  EXPECT_EQ(OBJ_HASH, cobj_.ObjType());
+  EXPECT_EQ(kEncodingListPack, cobj_.Encoding());
+  EXPECT_STREQ("external", cobj_.EncodingName());
+  EXPECT_EQ(0, cobj_.MallocUsed());
+  EXPECT_EQ((pair<size_t, size_t>(8192, 100)), cobj_.GetExternalPtr());
+
+  cobj_.SetExternal(4096, 200);
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(OBJ_ENCODING_RAW, cobj_.Encoding());
+
+  EXPECT_FALSE(cobj_.IsTouched());
+  cobj_.SetTouched(true);
+  EXPECT_TRUE(cobj_.IsTouched());
+  EXPECT_TRUE(cobj_.HasExpire());
+}
+
+TEST_F(CompactObjectTest, Defrag) {
+  // Only the current block is on a sparse page.
+  bool first = true;
+  auto only_current = [&](const void*) { return std::exchange(first, false); };
+
+  string val(200, 'x');
+  cobj_.SetString(val);
+  EXPECT_FALSE(cobj_.DefragIfNeeded([](const void*) { return false; }));
+
+  // The new allocation is considered sparse as well, hence the value stays.
+  EXPECT_FALSE(cobj_.DefragIfNeeded([](const void*) { return true; }));
+
+  EXPECT_TRUE(cobj_.DefragIfNeeded(only_current));
+  EXPECT_EQ(val, cobj_.ToString());
+
+  cobj_.ImportRObj(createIntsetObject());
+  void* old_ptr = cobj_.RObjPtr();
+  first = true;
+  EXPECT_TRUE(cobj_.DefragIfNeeded(only_current));
+  EXPECT_NE(old_ptr, cobj_.RObjPtr());
+  EXPECT_EQ(OBJ_SET, cobj_.ObjType());
+  EXPECT_EQ(kEncodingIntSet, cobj_.Encoding());
 }
 
 TEST_F(CompactObjectTest, FlatSet) {
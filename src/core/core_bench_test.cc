@@ -0,0 +1,448 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Benchmarks of the core data structures next to absl::flat_hash_map and redis dict, under
+// uniform and zipfian keys. Run with --bench, e.g.
+//   ./core_bench_test --bench --benchmark_filter=Find
+// The tables report items_per_second and bytes_per_entry, the memory they use divided by the
+// number of their entries.
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+#include <xxhash.h>
+
+#include <algorithm>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "base/zipf_gen.h"
+#include "core/compact_object.h"
+#include "core/dash.h"
+#include "core/extent_tree.h"
+#include "core/external_alloc.h"
+#include "core/string_set.h"
+#include "core/tx_queue.h"
+
+extern "C" {
+#include "redis/dict.h"
+#include "redis/redis_aux.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+enum KeyDist { kUniform = 0, kZipf = 1 };
+
+constexpr int64_t kNumKeys = 1 << 20;
+constexpr unsigned kLookupBatch = 1024;
+
+void InitAlloc() {
+  static bool initialized = [] {
+    InitRedisTables();
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+    SmallString::InitThreadLocal(tlh);
+    CompactObj::InitThreadLocal(pmr::get_default_resource());
+    return true;
+  }();
+  (void)initialized;
+}
+
+// n keys in [0, range), either uniform or skewed towards the low ones.
+vector<uint64_t> GenKeys(KeyDist dist, size_t n, uint64_t range) {
+  default_random_engine rnd(42);
+  vector<uint64_t> res(n);
+  if (dist == kZipf) {
+    base::ZipfianGenerator zipf(0, range - 1, 0.99);
+    for (auto& k : res)
+      k = zipf.Next(rnd);
+  } else {
+    uniform_int_distribution<uint64_t> udist(0, range - 1);
+    for (auto& k : res)
+      k = udist(rnd);
+  }
+  return res;
+}
+
+// The keys 0..n-1 in random order.
+vector<uint64_t> ShuffledKeys(size_t n) {
+  vector<uint64_t> res(n);
+  for (size_t i = 0; i < n; ++i)
+    res[i] = i;
+  shuffle(res.begin(), res.end(), default_random_engine(42));
+  return res;
+}
+
+string StrKey(uint64_t k) {
+  return absl::StrCat("key:", k);
+}
+
+struct UInt64Policy : public BasicDashPolicy {
+  static uint64_t HashFn(uint64_t v) {
+    return XXH3_64bits(&v, sizeof(v));
+  }
+};
+
+using Dash64 = DashTable<uint64_t, uint64_t, UInt64Policy>;
+using FlatMap = absl::flat_hash_map<uint64_t, uint64_t>;
+
+uint64_t DictIntHash(const void* key) {
+  return XXH3_64bits(&key, sizeof(key));
+}
+
+dictType IntDict = {DictIntHash, NULL, NULL, NULL, NULL, NULL, NULL};
+
+// The tables below share the benchmark bodies through these adapters.
+struct DashAdapter {
+  Dash64 table;
+
+  void Insert(uint64_t k) {
+    table.Insert(k, k);
+  }
+  bool Find(uint64_t k) {
+    return !table.Find(k).is_done();
+  }
+  void Erase(uint64_t k) {
+    table.Erase(k);
+  }
+  size_t Iterate() {
+    size_t cnt = 0;
+    Dash64::Cursor cursor;
+    do {
+      cursor = table.Traverse(cursor, [&](Dash64::iterator it) { cnt += it->second & 1; });
+    } while (cursor);
+    return cnt;
+  }
+  size_t Bytes() const {
+    return table.mem_usage();
+  }
+};
+
+struct FlatMapAdapter {
+  FlatMap table;
+
+  void Insert(uint64_t k) {
+    table.emplace(k, k);
+  }
+  bool Find(uint64_t k) {
+    return table.contains(k);
+  }
+  void Erase(uint64_t k) {
+    table.erase(k);
+  }
+  size_t Iterate() {
+    size_t cnt = 0;
+    for (const auto& k_v : table)
+      cnt += k_v.second & 1;
+    return cnt;
+  }
+  size_t Bytes() const {
+    return table.capacity() * (sizeof(FlatMap::value_type) + 1);  // a control byte per slot.
+  }
+};
+
+struct DictAdapter {
+  dict* table;
+  size_t base_bytes;
+
+  DictAdapter() : base_bytes(zmalloc_used_memory_tl) {
+    table = dictCreate(&IntDict);
+  }
+  ~DictAdapter() {
+    dictRelease(table);
+  }
+
+  void Insert(uint64_t k) {
+    dictAdd(table, (void*)k, nullptr);
+  }
+  bool Find(uint64_t k) {
+    return dictFind(table, (void*)k) != nullptr;
+  }
+  void Erase(uint64_t k) {
+    dictDelete(table, (void*)k);
+  }
+  size_t Iterate() {
+    size_t cnt = 0;
+    dictIterator* it = dictGetIterator(table);
+    while (dictEntry* de = dictNext(it))
+      cnt += uint64_t(dictGetKey(de)) & 1;
+    dictReleaseIterator(it);
+    return cnt;
+  }
+  size_t Bytes() const {
+    return zmalloc_used_memory_tl - base_bytes;
+  }
+};
+
+struct StringSetAdapter {
+  StringSet table;
+
+  void Insert(uint64_t k) {
+    table.Add(StrKey(k));
+  }
+  bool Find(uint64_t k) {
+    return table.Contains(StrKey(k));
+  }
+  void Erase(uint64_t k) {
+    table.Erase(StrKey(k));
+  }
+  size_t Iterate() {
+    size_t cnt = 0;
+    for (sds s : table)
+      cnt += sdslen(s) & 1;
+    return cnt;
+  }
+  size_t Bytes() const {
+    return table.ObjMallocUsed() + table.SetMallocUsed();
+  }
+};
+
+struct FlatStrSetAdapter {
+  absl::flat_hash_set<string> table;
+
+  void Insert(uint64_t k) {
+    table.insert(StrKey(k));
+  }
+  bool Find(uint64_t k) {
+    return table.contains(StrKey(k));
+  }
+  void Erase(uint64_t k) {
+    table.erase(StrKey(k));
+  }
+  size_t Iterate() {
+    size_t cnt = 0;
+    for (const string& s : table)
+      cnt += s.size() & 1;
+    return cnt;
+  }
+  size_t Bytes() const {
+    // The keys are short enough for the small string optimization.
+    return table.capacity() * (sizeof(string) + 1);
+  }
+};
+
+template <typename T> void SetBytesPerEntry(const T& t, size_t n, benchmark::State& state) {
+  state.counters["bytes_per_entry"] = double(t.Bytes()) / n;
+}
+
+// Inserts range(0) distinct keys into an empty table.
+template <typename T> void BM_Insert(benchmark::State& state) {
+  InitAlloc();
+  size_t n = state.range(0);
+  vector<uint64_t> keys = ShuffledKeys(n);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto table = make_unique<T>();
+    state.ResumeTiming();
+
+    for (uint64_t k : keys)
+      table->Insert(k);
+
+    state.PauseTiming();
+    SetBytesPerEntry(*table, n, state);
+    table.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Looks up keys of the distribution range(1) in [0, 2 * range(0)), in a table of the keys
+// [0, range(0)). Half of the uniform lookups miss, the zipfian ones mostly hit the low keys.
+template <typename T> void BM_Find(benchmark::State& state) {
+  InitAlloc();
+  size_t n = state.range(0);
+  T table;
+  for (uint64_t k : ShuffledKeys(n))
+    table.Insert(k);
+  SetBytesPerEntry(table, n, state);
+
+  vector<uint64_t> lookups = GenKeys(KeyDist(state.range(1)), kLookupBatch * 64, n * 2);
+  size_t pos = 0, found = 0;
+  for (auto _ : state) {
+    for (unsigned i = 0; i < kLookupBatch; ++i) {
+      found += table.Find(lookups[pos++ % lookups.size()]);
+    }
+  }
+  benchmark::DoNotOptimize(found);
+  state.SetItemsProcessed(state.iterations() * kLookupBatch);
+}
+
+// Erases all range(0) keys of a table.
+template <typename T> void BM_Erase(benchmark::State& state) {
+  InitAlloc();
+  size_t n = state.range(0);
+  vector<uint64_t> keys = ShuffledKeys(n);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto table = make_unique<T>();
+    for (uint64_t k : keys)
+      table->Insert(k);
+    state.ResumeTiming();
+
+    for (uint64_t k : keys)
+      table->Erase(k);
+
+    state.PauseTiming();
+    table.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Visits all range(0) entries of a table.
+template <typename T> void BM_Iterate(benchmark::State& state) {
+  InitAlloc();
+  size_t n = state.range(0);
+  T table;
+  for (uint64_t k : ShuffledKeys(n))
+    table.Insert(k);
+
+  size_t cnt = 0;
+  for (auto _ : state) {
+    cnt += table.Iterate();
+  }
+  benchmark::DoNotOptimize(cnt);
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+#define TABLE_BENCHMARKS(T)                                                            \
+  BENCHMARK_TEMPLATE(BM_Insert, T)->Arg(kNumKeys);                                     \
+  BENCHMARK_TEMPLATE(BM_Find, T)->Args({kNumKeys, kUniform})->Args({kNumKeys, kZipf}); \
+  BENCHMARK_TEMPLATE(BM_Erase, T)->Arg(kNumKeys);                                      \
+  BENCHMARK_TEMPLATE(BM_Iterate, T)->Arg(kNumKeys)
+
+TABLE_BENCHMARKS(DashAdapter);
+TABLE_BENCHMARKS(FlatMapAdapter);
+TABLE_BENCHMARKS(DictAdapter);
+TABLE_BENCHMARKS(StringSetAdapter);
+TABLE_BENCHMARKS(FlatStrSetAdapter);
+
+// Encodes and decodes strings of the kinds that CompactObj stores differently.
+void BM_CompactObjString(benchmark::State& state) {
+  InitAlloc();
+  string val;
+  switch (state.range(0)) {
+    case 0:
+      val = "1234567890";  // an integer
+      break;
+    case 1:
+      val = "short:abc";  // inline
+      break;
+    case 2:
+      val = string(64, 'a');  // ascii packed
+      break;
+    default:
+      val = string(256, '\xff');  // raw
+  }
+
+  CompactObj obj;
+  string res;
+  for (auto _ : state) {
+    obj.SetString(val);
+    obj.GetString(&res);
+    benchmark::DoNotOptimize(res);
+  }
+  state.counters["bytes_per_entry"] = sizeof(obj) + obj.MallocUsed();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompactObjString)->DenseRange(0, 3);
+
+// Allocates blocks of range(0) bytes until the storage is full, then frees them.
+void BM_ExternalAlloc(benchmark::State& state) {
+  constexpr size_t kStorage = 4 * ExternalAllocator::kExtAlignment;
+  size_t sz = state.range(0);
+  vector<int64_t> offsets;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto alloc = make_unique<ExternalAllocator>();
+    alloc->AddStorage(0, kStorage);
+    offsets.clear();
+    state.ResumeTiming();
+
+    for (int64_t offs = alloc->Malloc(sz); offs >= 0; offs = alloc->Malloc(sz))
+      offsets.push_back(offs);
+    for (int64_t offs : offsets)
+      alloc->Free(offs, sz);
+  }
+  state.SetItemsProcessed(state.iterations() * offsets.size() * 2);
+}
+// Small and medium blocks, the large ones are taken from the extent tree.
+BENCHMARK(BM_ExternalAlloc)->Arg(4096)->Arg(20000)->Arg(200000);
+
+// Takes ranges of random lengths from a fragmented tree and returns them.
+void BM_ExtentTree(benchmark::State& state) {
+  constexpr size_t kExtents = 1 << 16;
+  constexpr size_t kBlock = 4096;
+
+  ExtentTree tree;
+  for (size_t i = 0; i < kExtents; ++i)
+    tree.Add(i * kBlock * 8, kBlock * (1 + i % 4));
+
+  default_random_engine rnd(42);
+  uniform_int_distribution<size_t> udist(1, kBlock * 2);
+  vector<pair<size_t, size_t>> taken;
+  for (auto _ : state) {
+    for (unsigned i = 0; i < kLookupBatch; ++i) {
+      if (auto range = tree.GetRange(udist(rnd), 8))
+        taken.push_back(*range);
+    }
+    for (auto [start, end] : taken)
+      tree.Add(start, end - start);
+    taken.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * kLookupBatch * 2);
+}
+BENCHMARK(BM_ExtentTree);
+
+// Pushes range(0) scores in ascending order and pops them, as the shard tx-queue does.
+void BM_TxQueue(benchmark::State& state) {
+  size_t n = state.range(0);
+  TxQueue queue;
+  uint64_t score = 0;
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < n; ++i)
+      queue.Insert(++score);
+    while (!queue.Empty())
+      queue.PopFront();
+  }
+  state.SetItemsProcessed(state.iterations() * n * 2);
+}
+BENCHMARK(BM_TxQueue)->Arg(16)->Arg(1024);
+
+}  // namespace
+
+TEST(CoreBenchTest, Keys) {
+  constexpr uint64_t kRange = 1000;
+  auto max_freq = [](const vector<uint64_t>& keys) {
+    vector<unsigned> freq(kRange);
+    for (uint64_t k : keys) {
+      CHECK_LT(k, kRange);
+      ++freq[k];
+    }
+    return *max_element(freq.begin(), freq.end());
+  };
+
+  // The hottest key gets ~0.1% of the uniform accesses and ~13% of the zipfian ones.
+  EXPECT_LT(max_freq(GenKeys(kUniform, 100000, kRange)), 500u);
+  EXPECT_GT(max_freq(GenKeys(kZipf, 100000, kRange)), 5000u);
+
+  vector<uint64_t> shuffled = ShuffledKeys(kRange);
+  EXPECT_FALSE(is_sorted(shuffled.begin(), shuffled.end()));
+  sort(shuffled.begin(), shuffled.end());
+  EXPECT_EQ(kRange - 1, shuffled.back());
+  EXPECT_EQ(shuffled.end(), unique(shuffled.begin(), shuffled.end()));
+}
+
+}  // namespace dfly
@@ -0,0 +1,65 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/count_min_sketch.h"
+
+#include <algorithm>
+
+namespace dfly {
+
+namespace {
+
+// Every word holds 16 counters.
+constexpr unsigned kCountersPerWord = 16;
+constexpr uint64_t kResetMask = 0x7777777777777777ULL;
+
+}  // namespace
+
+CountMinSketch::CountMinSketch(uint32_t width, unsigned sample_factor) {
+  // Each of kDepth rows uses 4 counters in every word.
+  uint32_t words = std::max<uint32_t>(1, width * kDepth / kCountersPerWord);
+  num_words_ = 1;
+  while (num_words_ < words)
+    num_words_ *= 2;
+  sample_limit_ = num_words_ * kCountersPerWord / kDepth * sample_factor;
+  table_.reset(new uint64_t[num_words_]());
+}
+
+void CountMinSketch::Increment(uint64_t hash) {
+  uint64_t* word = Word(hash);
+
+  // Conservative update: increments only the counters equal to the current minimum.
+  unsigned min = Estimate(hash);
+  if (min == kMaxCount)
+    return;
+
+  for (unsigned i = 0; i < kDepth; ++i) {
+    unsigned shift = CounterIndex(hash, i) * 4;
+    if (((*word >> shift) & 0xF) == min)
+      *word += (1ULL << shift);
+  }
+
+  if (++increments_ >= sample_limit_) {
+    Reset();
+  }
+}
+
+unsigned CountMinSketch::Estimate(uint64_t hash) const {
+  uint64_t word = *Word(hash);
+  unsigned res = kMaxCount;
+  for (unsigned i = 0; i < kDepth; ++i) {
+    unsigned val = (word >> (CounterIndex(hash, i) * 4)) & 0xF;
+    res = std::min(res, val);
+  }
+  return res;
+}
+
+void CountMinSketch::Reset() {
+  for (uint32_t i = 0; i < num_words_; ++i) {
+    table_[i] = (table_[i] >> 1) & kResetMask;
+  }
+  increments_ /= 2;
+}
+
+}  // namespace dfly
@@ -0,0 +1,53 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+namespace dfly {
+
+// Count-min sketch with small saturating counters and periodic aging, as described in
+// "TinyLFU: A Highly Efficient Cache Admission Policy" (Einziger, Friedman, Manes).
+// Every row holds 4-bit counters packed into uint64_t words; all rows share a single word per
+// key, so an update or an estimate touches a single cache line.
+class CountMinSketch {
+ public:
+  static constexpr unsigned kDepth = 4;
+  static constexpr unsigned kMaxCount = 15;
+
+  // width is rounded up to a power of 2 and specifies number of counters per row.
+  // Once the number of increments reaches sample_factor * width, all counters are halved.
+  explicit CountMinSketch(uint32_t width, unsigned sample_factor = 10);
+
+  void Increment(uint64_t hash);
+  unsigned Estimate(uint64_t hash) const;
+
+  // Halves all the counters.
+  void Reset();
+
+  size_t MallocUsed() const {
+    return num_words_ * sizeof(uint64_t);
+  }
+
+ private:
+  // Returns the index of the counter of row i within the word for hash.
+  static unsigned CounterIndex(uint64_t hash, unsigned i) {
+    // Every row uses a different 4-bit chunk of the upper half of the hash, selecting one of 4
+    // counters in its 16-bit quarter of the word.
+    return i * 4 + ((hash >> (32 + i * 8)) & 3);
+  }
+
+  uint64_t* Word(uint64_t hash) const {
+    return &table_[hash & (num_words_ - 1)];
+  }
+
+  std::unique_ptr<uint64_t[]> table_;
+  uint32_t num_words_;
+  uint32_t sample_limit_;
+  uint32_t increments_ = 0;
+};
+
+}  // namespace dfly
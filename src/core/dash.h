@@ -3,6 +3,7 @@
 //
 #pragma once
 
+#include <algorithm>
 #include <memory_resource>
 #include <vector>
 
@@ -146,6 +147,15 @@ class DashTable : public detail::DashTableBase {
   template <typename U> const_iterator Find(U&& key) const;
   template <typename U> iterator Find(U&& key);
 
+  // Batched lookup: dest[i] = Find(keys[i]) for every i < count.
+  // Hashes a group of keys and prefetches their buckets before resolving any of them,
+  // so that cache misses of different keys overlap instead of being paid one by one.
+  template <typename U> void FindBatch(const U* keys, size_t count, iterator* dest);
+
+  // Returns the first entry with hash key_hash for which pred(key) is true. Allows to look up
+  // the entries by hash, e.g. from the indices that keep only the hashes of the keys.
+  template <typename Pred> iterator FindByHash(uint64_t key_hash, Pred&& pred);
+
   // it must be valid.
   void Erase(iterator it);
 
@@ -252,6 +262,15 @@ class DashTable : public detail::DashTableBase {
 
   void Clear();
 
+  // Performs a single step of incremental shrinking: examines the segment at directory index
+  // `cursor` and merges it with its buddy if together they hold at most
+  // max_fill * kSegCapacity entries. Decreases the depth of the directory once no segment
+  // requires it. Returns the cursor for the next step or 0 when the pass is complete.
+  // Invalidates iterators but not traversal cursors: merged entries keep their logical bucket,
+  // and a cursor that pointed to the right buddy visits the merged segment again at its bucket,
+  // so an ongoing traversal may return them twice but does not skip them.
+  size_t ShrinkStep(size_t cursor, double max_fill);
+
   // Returns true if an element was deleted i.e the rightmost slot was busy.
   bool ShiftRight(bucket_iterator it);
 
@@ -277,13 +296,19 @@ class DashTable : public detail::DashTableBase {
   void IncreaseDepth(unsigned new_depth);
   void Split(uint32_t seg_id);
 
+  // Halves the directory for as long as no segment has local depth equal to global depth.
+  // Returns by how much the depth has decreased.
+  unsigned DecreaseDepthIfPossible();
+
   // Segment directory contains multiple segment pointers, some of them pointing to
   // the same object. IterateDistinct goes over all distinct segments in the table.
   template <typename Cb> void IterateDistinct(Cb&& cb);
 
+  // sid may point into the middle of the directory range of its segment if the segment has
+  // been merged with its buddy after a traversal cursor was issued, see ShrinkStep.
   size_t NextSeg(size_t sid) const {
     size_t delta = (1u << (global_depth_ - segment_[sid]->local_depth()));
-    return sid + delta;
+    return (sid | (delta - 1)) + 1;
   }
 
   auto EqPred() const {
@@ -426,6 +451,14 @@ class DashTable<_Key, _Value, Policy>::Iterator {
     return seg_id_;
   }
 
+  // Returns true if the slot this iterator points to is still occupied.
+  // Useful when an iterator might have been erased through its copy, or when the table might
+  // have been shrunk since the iterator was obtained.
+  bool IsOccupied() const {
+    return owner_ && seg_id_ < owner_->segment_.size() &&
+           owner_->segment_[seg_id_]->GetBucket(bucket_id_).IsBusy(slot_id_);
+  }
+
  private:
   void Seek2Occupied();
 };  // Iterator
@@ -666,6 +699,45 @@ auto DashTable<_Key, _Value, Policy>::Find(U&& key) -> iterator {
   return iterator{};
 }
 
+template <typename _Key, typename _Value, typename Policy>
+template <typename Pred>
+auto DashTable<_Key, _Value, Policy>::FindByHash(uint64_t key_hash, Pred&& pred) -> iterator {
+  uint32_t segid = SegmentId(key_hash);
+  const auto* target = segment_[segid];
+
+  auto cf = [&](const Key_t& key, uint64_t) { return pred(key); };
+  auto seg_it = target->FindIt(key_hash, key_hash, cf);
+  if (seg_it.found()) {
+    return iterator{this, segid, seg_it.index, seg_it.slot};
+  }
+  return iterator{};
+}
+
+template <typename _Key, typename _Value, typename Policy>
+template <typename U>
+void DashTable<_Key, _Value, Policy>::FindBatch(const U* keys, size_t count, iterator* dest) {
+  // Large enough to cover the memory latency, small enough for the prefetched lines
+  // to stay in L1.
+  constexpr size_t kGroupSize = 16;
+  uint64_t hashes[kGroupSize];
+
+  for (size_t start = 0; start < count; start += kGroupSize) {
+    size_t group_size = std::min(kGroupSize, count - start);
+
+    for (size_t i = 0; i < group_size; ++i) {
+      hashes[i] = DoHash(keys[start + i]);
+      segment_[SegmentId(hashes[i])]->Prefetch(hashes[i]);
+    }
+
+    for (size_t i = 0; i < group_size; ++i) {
+      uint32_t seg_id = SegmentId(hashes[i]);
+      auto seg_it = segment_[seg_id]->FindIt(keys[start + i], hashes[i], EqPred());
+      dest[start + i] =
+          seg_it.found() ? iterator{this, seg_id, seg_it.index, seg_it.slot} : iterator{};
+    }
+  }
+}
+
 template <typename _Key, typename _Value, typename Policy>
 size_t DashTable<_Key, _Value, Policy>::Erase(const Key_t& key) {
   uint64_t key_hash = DoHash(key);
@@ -705,7 +777,7 @@ void DashTable<_Key, _Value, Policy>::Reserve(size_t size) {
   if (sg_floor < segment_.size()) {
     return;
   }
-  assert(sg_floor > 1u);
+  assert(sg_floor >= 1u);
   unsigned new_depth = 1 + (63 ^ __builtin_clzll(sg_floor));
 
   IncreaseDepth(new_depth);
@@ -851,6 +923,79 @@ void DashTable<_Key, _Value, Policy>::Split(uint32_t seg_id) {
   }
 }
 
+template <typename _Key, typename _Value, typename Policy>
+size_t DashTable<_Key, _Value, Policy>::ShrinkStep(size_t cursor, double max_fill) {
+  if (cursor >= segment_.size())  // the directory might have shrunk since the last call.
+    cursor = 0;
+
+  SegmentType* seg = segment_[cursor];
+  unsigned local_depth = seg->local_depth();
+  size_t chunk_size = 1ul << (global_depth_ - local_depth);
+  size_t start_idx = cursor & ~(chunk_size - 1);
+  size_t next = start_idx + chunk_size;
+
+  if (local_depth > initial_depth_) {
+    size_t buddy_idx = start_idx ^ chunk_size;
+    SegmentType* buddy = segment_[buddy_idx];
+
+    auto hash_fn = [this](const auto& k) { return policy_.HashFn(k); };
+    size_t left_idx = std::min(start_idx, buddy_idx);
+    SegmentType* left = segment_[left_idx];
+    SegmentType* right = left == seg ? buddy : seg;
+
+    if (buddy->local_depth() == local_depth &&
+        left->SlowSize() + right->SlowSize() <= max_fill * kSegCapacity &&
+        left->CanMerge(*right, hash_fn)) {
+      left->Merge(std::move(hash_fn), right);
+
+      std::fill(segment_.begin() + left_idx, segment_.begin() + left_idx + chunk_size * 2, left);
+      --unique_segments_;
+
+      std::pmr::polymorphic_allocator<SegmentType> pa(segment_.get_allocator().resource());
+      using alloc_traits = std::allocator_traits<decltype(pa)>;
+      alloc_traits::destroy(pa, right);
+      alloc_traits::deallocate(pa, right, 1);
+
+      next = left_idx + chunk_size * 2;
+      next >>= DecreaseDepthIfPossible();
+    }
+  }
+
+  return next < segment_.size() ? next : 0;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+unsigned DashTable<_Key, _Value, Policy>::DecreaseDepthIfPossible() {
+  unsigned res = 0;
+
+  while (global_depth_ > initial_depth_) {
+    bool can_decrease = true;
+    for (size_t i = 0; i < segment_.size(); i = NextSeg(i)) {
+      if (segment_[i]->local_depth() == global_depth_) {
+        can_decrease = false;
+        break;
+      }
+    }
+
+    if (!can_decrease)
+      break;
+
+    // Every segment spans at least 2 consecutive directory entries.
+    size_t new_size = segment_.size() / 2;
+    for (size_t i = 0; i < new_size; ++i) {
+      segment_[i] = segment_[i * 2];
+    }
+    segment_.resize(new_size);
+    --global_depth_;
+    ++res;
+  }
+
+  if (res)
+    segment_.shrink_to_fit();
+
+  return res;
+}
+
 template <typename _Key, typename _Value, typename Policy>
 template <typename Cb>
 auto DashTable<_Key, _Value, Policy>::Traverse(Cursor curs, Cb&& cb) -> Cursor {
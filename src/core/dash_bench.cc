@@ -23,6 +23,9 @@ using namespace std;
 ABSL_FLAG(uint32_t, n, 100000, "num items");
 ABSL_FLAG(string, type, "dash", "");
 ABSL_FLAG(bool, sds, false, "If true, uses sds as primary key");
+ABSL_FLAG(bool, probe, false,
+          "If true, measures lookups instead of inserts. Half of the lookups miss, "
+          "so that neighbour and stash buckets are probed as well");
 
 namespace dfly {
 
@@ -138,6 +141,40 @@ void BenchDash(uint64_t num) {
   }
 }
 
+void BenchDashProbe(uint64_t num) {
+  for (uint64_t i = 0; i < num; ++i) {
+    udt.Insert(i, 0);
+  }
+
+  uint64_t found = 0;
+  for (uint64_t i = 0; i < num * 2; ++i) {
+    time_t start = GetNow();
+    found += udt.Find(i).is_done() ? 0 : 1;
+    LFENCE;
+
+    time_t end = GetNow();
+    Sample(start, end, &hist);
+  }
+  CHECK_EQ(found, num);
+}
+
+void BenchFlatProbe(uint64_t num) {
+  for (uint64_t i = 0; i < num; ++i) {
+    mymap.emplace(i, 0);
+  }
+
+  uint64_t found = 0;
+  for (uint64_t i = 0; i < num * 2; ++i) {
+    time_t start = GetNow();
+    found += mymap.contains(i);
+    LFENCE;
+
+    time_t end = GetNow();
+    Sample(start, end, &hist);
+  }
+  CHECK_EQ(found, num);
+}
+
 inline sds Prefix() {
   return sdsnew("xxxxxxxxxxxxxxxxxxxxxxx");
 }
@@ -202,11 +239,14 @@ int main(int argc, char* argv[]) {
   string table_type = GetFlag(FLAGS_type);
 
   bool is_sds = GetFlag(FLAGS_sds);
+  bool probe = GetFlag(FLAGS_probe);
   uint64_t start = absl::GetCurrentTimeNanos();
   uint64_t num = GetFlag(FLAGS_n);
 
   if (table_type == "dash") {
-    if (is_sds) {
+    if (probe) {
+      BenchDashProbe(num);
+    } else if (is_sds) {
       BenchDashSds(num);
     } else {
       BenchDash(num);
@@ -218,7 +258,11 @@ int main(int argc, char* argv[]) {
       BenchDict(num);
     }
   } else if (table_type == "flat") {
-    BenchFlat(num);
+    if (probe) {
+      BenchFlatProbe(num);
+    } else {
+      BenchFlat(num);
+    }
   } else {
     LOG(FATAL) << "Unknown type " << table_type;
   }
@@ -15,8 +15,13 @@
 
 #if defined(__aarch64__)
 #include "base/sse2neon.h"
-#else
+#define DASH_SIMD_FP 1
+#elif defined(__SSE2__)
 #include <emmintrin.h>
+#define DASH_SIMD_FP 1
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #endif
 
 namespace dfly {
@@ -152,6 +157,15 @@ template <unsigned NUM_SLOTS, unsigned NUM_STASH_FPS> class BucketBase {
     return mask & GetProbe(probe);
   }
 
+  // Matches fp against the fingerprints of this bucket and of the `next` bucket.
+  // Returns raw (not masked by busy bits) matches of this bucket in bits [0, 16) and
+  // of `next` in bits [16, 32). With AVX2 both buckets are matched with a single
+  // compare-and-movemask.
+  uint32_t CompareFPPair(uint8_t fp, const BucketBase& next) const;
+
+  // Returns the mask of stash fingerprint slots that equal fp, not masked by stash_busy_.
+  unsigned CompareStashFP(uint8_t fp) const;
+
   uint8_t Fp(unsigned i) const {
     assert(i < finger_arr_.size());
     return finger_arr_[i];
@@ -352,7 +366,12 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
     }
 
     template <typename U, typename Pred>
-    SlotId FindByFp(uint8_t fp_hash, bool probe, U&& k, Pred&& pred) const;
+    SlotId FindByFp(uint8_t fp_hash, bool probe, U&& k, Pred&& pred) const {
+      return FindByMask(this->Find(fp_hash, probe), std::forward<U>(k), std::forward<Pred>(pred));
+    }
+
+    // mask - candidate slots, already filtered by fingerprint, busy and probe bits.
+    template <typename U, typename Pred> SlotId FindByMask(unsigned mask, U&& k, Pred&& pred) const;
 
     bool ShiftRight();
 
@@ -408,6 +427,15 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename HashFn> void Split(HashFn&& hfunc, Segment* dest);
 
+  // Returns true if all the entries of `other` can be moved into their home buckets in this
+  // segment. Conservative: does not account for probing or stash placement.
+  template <typename HashFn> bool CanMerge(const Segment& other, HashFn&& hfunc) const;
+
+  // The reverse of Split: moves all the entries from `src` (this segment's buddy) into
+  // this segment and decreases the local depth. Leaves `src` empty.
+  // Requires: CanMerge(*src, hfunc) is true.
+  template <typename HashFn> void Merge(HashFn&& hfunc, Segment* src);
+
   void Delete(const Iterator& it, Hash_t key_hash);
 
   void Clear();  // clears the segment.
@@ -490,6 +518,13 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename U, typename Pred> Iterator FindIt(U&& key, Hash_t key_hash, Pred&& cf) const;
 
+  // Prefetches the home and the neighbour buckets of key_hash.
+  void Prefetch(Hash_t key_hash) const {
+    uint8_t bid = BucketIndex(key_hash);
+    __builtin_prefetch(&bucket_[bid]);
+    __builtin_prefetch(&bucket_[NextBid(bid)]);
+  }
+
   // Returns valid iterator if succeeded or invalid if not (it's full).
   // Requires: key should be not present in the segment.
   // if spread is true, tries to spread the load between neighbour and home buckets,
@@ -887,6 +922,7 @@ template <unsigned NUM_SLOTS, unsigned NUM_OVR>
 uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareFP(uint8_t fp) const {
   static_assert(FpArray{}.size() <= 16);
 
+#ifdef DASH_SIMD_FP
   // Replicate 16 times fp to key_data.
   const __m128i key_data = _mm_set1_epi8(fp);
 
@@ -901,6 +937,53 @@ uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareFP(uint8_t fp) const {
 
   // Note: Last 2 operations can be combined in skylake with _mm_cmpeq_epi8_mask.
   return mask;
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < NUM_SLOTS; ++i) {
+    mask |= uint32_t(finger_arr_[i] == fp) << i;
+  }
+  return mask;
+#endif
+}
+
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareFPPair(uint8_t fp, const BucketBase& next) const {
+#if defined(DASH_SIMD_FP) && defined(__AVX2__)
+  // Buckets are not adjacent in memory (keys and values are stored in between), therefore we
+  // gather both fingerprint arrays into a single 32-byte register.
+  const __m256i key_data = _mm256_set1_epi8(fp);
+  __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(finger_arr_.data()));
+  __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(next.finger_arr_.data()));
+  __m256i fp_data = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(fp_data, key_data));
+#elif defined(DASH_SIMD_FP)
+  const __m128i key_data = _mm_set1_epi8(fp);
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(finger_arr_.data()));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(next.finger_arr_.data()));
+  uint32_t lo = _mm_movemask_epi8(_mm_cmpeq_epi8(a, key_data));
+  uint32_t hi = _mm_movemask_epi8(_mm_cmpeq_epi8(b, key_data));
+  return lo | (hi << 16);
+#else
+  return CompareFP(fp) | (next.CompareFP(fp) << 16);
+#endif
+}
+
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+unsigned BucketBase<NUM_SLOTS, NUM_OVR>::CompareStashFP(uint8_t fp) const {
+#ifdef DASH_SIMD_FP
+  if constexpr (kStashFpLen == 4) {
+    uint32_t fps;
+    memcpy(&fps, stash_arr_.data(), sizeof(fps));
+    __m128i cmp = _mm_cmpeq_epi8(_mm_cvtsi32_si128(fps), _mm_set1_epi8(fp));
+    return _mm_movemask_epi8(cmp) & 0xF;
+  }
+#endif
+
+  unsigned mask = 0;
+  for (unsigned i = 0; i < kStashFpLen; ++i) {
+    mask |= unsigned(stash_arr_[i] == fp) << i;
+  }
+  return mask;
 }
 
 // Bucket slot array goes from left to right: [x, x, ...]
@@ -923,18 +1006,16 @@ template <typename F>
 auto BucketBase<NUM_SLOTS, NUM_OVR>::IterateStash(uint8_t fp, bool is_probe, F&& func) const
     -> ::std::pair<unsigned, SlotId> {
   unsigned om = is_probe ? stash_probe_mask_ : ~stash_probe_mask_;
-  unsigned ob = stash_busy_;
-
-  for (unsigned i = 0; i < kStashFpLen; ++i) {
-    if ((ob & 1) && (stash_arr_[i] == fp) && (om & 1)) {
-      unsigned pos = (stash_pos_ >> (i * 2)) & 3;
-      auto sid = func(i, pos);
-      if (sid != BucketBase::kNanSlot) {
-        return std::pair<unsigned, SlotId>(pos, sid);
-      }
+  unsigned mask = CompareStashFP(fp) & stash_busy_ & om & ((1u << kStashFpLen) - 1);
+
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    unsigned pos = (stash_pos_ >> (i * 2)) & 3;
+    auto sid = func(i, pos);
+    if (sid != BucketBase::kNanSlot) {
+      return std::pair<unsigned, SlotId>(pos, sid);
     }
-    ob >>= 1;
-    om >>= 1;
+    mask &= mask - 1;
   }
   return std::pair<unsigned, SlotId>(0, BucketBase::kNanSlot);
 }
@@ -972,20 +1053,15 @@ ___] |___ |__] |  | |___ | \|  |
 
 template <typename Key, typename Value, typename Policy>
 template <typename U, typename Pred>
-auto Segment<Key, Value, Policy>::Bucket::FindByFp(uint8_t fp_hash, bool probe, U&& k,
-                                                   Pred&& pred) const -> SlotId {
-  unsigned mask = this->Find(fp_hash, probe);
-  if (!mask)
-    return kNanSlot;
-
-  unsigned delta = __builtin_ctz(mask);
-  mask >>= delta;
-  for (unsigned i = delta; i < NUM_SLOTS; ++i) {
-    if ((mask & 1) && pred(key[i], k)) {
+auto Segment<Key, Value, Policy>::Bucket::FindByMask(unsigned mask, U&& k, Pred&& pred) const
+    -> SlotId {
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    if (pred(key[i], k)) {
       return i;
     }
-    mask >>= 1;
-  };
+    mask &= mask - 1;
+  }
 
   return kNanSlot;
 }
@@ -1069,16 +1145,23 @@ auto Segment<Key, Value, Policy>::FindIt(U&& key, Hash_t key_hash, Pred&& cf) co
   // since we are going to access this memory in a bit.
   __builtin_prefetch(&target);
 
+  uint8_t nid = NextBid(bidx);
+  const Bucket& probe = bucket_[nid];
+  __builtin_prefetch(&probe);
+
+  // Match the fingerprints of the home and the neighbour buckets at once, before touching
+  // any keys.
   uint8_t fp_hash = key_hash & kFpMask;
-  SlotId sid = target.FindByFp(fp_hash, false, key, cf);
+  uint32_t fp_mask = target.CompareFPPair(fp_hash, probe);
+  unsigned home_mask = fp_mask & target.GetBusy() & target.GetProbe(false);
+  unsigned probe_mask = (fp_mask >> 16) & probe.GetBusy() & probe.GetProbe(true);
+
+  SlotId sid = target.FindByMask(home_mask, key, cf);
   if (sid != BucketType::kNanSlot) {
     return Iterator{bidx, sid};
   }
 
-  uint8_t nid = NextBid(bidx);
-  const Bucket& probe = bucket_[nid];
-
-  sid = probe.FindByFp(fp_hash, true, key, cf);
+  sid = probe.FindByMask(probe_mask, key, cf);
 
 #ifdef ENABLE_DASH_STATS
   stats.neighbour_probes++;
@@ -1251,6 +1334,54 @@ void Segment<Key, Value, Policy>::Split(HFunc&& hfn, Segment* dest_right) {
   }
 }
 
+template <typename Key, typename Value, typename Policy>
+template <typename HFunc>
+bool Segment<Key, Value, Policy>::CanMerge(const Segment& other, HFunc&& hfn) const {
+  uint8_t incoming[kNumBuckets] = {0};
+  bool fits = true;
+
+  for (unsigned i = 0; i < kTotalBuckets && fits; ++i) {
+    other.bucket_[i].ForEachSlot([&](unsigned slot, bool) {
+      unsigned bid = BucketIndex(hfn(other.bucket_[i].key[slot]));
+      if (bucket_[bid].Size() + (++incoming[bid]) > kNumSlots)
+        fits = false;
+    });
+  }
+
+  return fits;
+}
+
+template <typename Key, typename Value, typename Policy>
+template <typename HFunc>
+void Segment<Key, Value, Policy>::Merge(HFunc&& hfn, Segment* src) {
+  assert(local_depth_ == src->local_depth_ && local_depth_ > 0);
+
+  for (unsigned i = 0; i < kTotalBuckets; ++i) {
+    Bucket& from = src->bucket_[i];
+
+    from.ForEachSlot([&](unsigned slot, bool) {
+      Hash_t hash = hfn(from.key[slot]);
+      auto it = InsertUniq(std::forward<Key_t>(from.key[slot]),
+                           std::forward<Value_t>(from.value[slot]), hash, false);
+
+      // CanMerge guarantees that the home bucket has room.
+      assert(it.index < kNumBuckets);
+      (void)it;
+
+      if constexpr (USE_VERSION) {
+        uint64_t ver = from.GetVersion();
+        if (bucket_[it.index].GetVersion() < ver) {
+          bucket_[it.index].SetVersion(ver);
+        }
+      }
+    });
+  }
+
+  src->Clear();
+  --local_depth_;
+  src->local_depth_ = local_depth_;
+}
+
 template <typename Key, typename Value, typename Policy>
 int Segment<Key, Value, Policy>::MoveToOther(bool own_items, unsigned from_bid, unsigned to_bid) {
   auto& src = bucket_[from_bid];
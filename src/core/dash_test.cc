@@ -198,6 +198,23 @@ TEST_F(DashTest, SlotBitmap) {
   EXPECT_EQ(2, slot.GetProbe(true));
 }
 
+TEST_F(DashTest, CompareFP) {
+  // FillSegment limits fingerprints to [0, 2], so lookups must resolve fp collisions across the
+  // home, neighbour and stash buckets.
+  set<Segment::Key_t> keys = FillSegment(0);
+  ASSERT_FALSE(keys.empty());
+
+  for (auto k : keys) {
+    ASSERT_TRUE(Contains(k)) << k;
+  }
+
+  unsigned misses = 0;
+  for (Segment::Key_t k = 1000000u; k < 1100000u; ++k) {
+    misses += !Contains(k);
+  }
+  EXPECT_EQ(100000u, misses);
+}
+
 TEST_F(DashTest, Basic) {
   Segment::Key_t key = 0;
   Segment::Value_t val = 0;
@@ -330,6 +347,78 @@ TEST_F(DashTest, Split) {
   EXPECT_EQ(4 * Segment::kNumSlots, keys.size());
 }
 
+TEST_F(DashTest, Shrink) {
+  constexpr size_t kNumItems = 100000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  unsigned max_depth = dt_.depth();
+  size_t max_segments = dt_.unique_segments();
+  ASSERT_GT(max_depth, 1u);
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    if (i % 100)
+      dt_.Erase(i);
+  }
+
+  // Run several passes since every pass can merge each segment at most once.
+  for (unsigned pass = 0; pass < 20; ++pass) {
+    size_t cursor = 0;
+    do {
+      cursor = dt_.ShrinkStep(cursor, 0.5);
+    } while (cursor);
+  }
+
+  EXPECT_LT(dt_.unique_segments(), max_segments / 8);
+  EXPECT_LT(dt_.depth(), max_depth);
+  EXPECT_EQ(kNumItems / 100, dt_.size());
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    auto it = dt_.Find(i);
+    if (i % 100) {
+      ASSERT_TRUE(it.is_done()) << i;
+    } else {
+      ASSERT_FALSE(it.is_done()) << i;
+      ASSERT_EQ(i, it->second);
+    }
+  }
+
+  // The table can grow back.
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  EXPECT_EQ(kNumItems, dt_.size());
+}
+
+TEST_F(DashTest, ShrinkDuringTraverse) {
+  constexpr size_t kNumItems = 100000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  for (size_t i = 0; i < kNumItems; ++i) {
+    if (i % 100)
+      dt_.Erase(i);
+  }
+  size_t max_segments = dt_.unique_segments();
+
+  // Segments are merged between the traversal steps, like the heartbeat does between the
+  // SCAN calls of a client.
+  set<uint64_t> seen;
+  auto tr_cb = [&](Dash64::iterator it) { seen.insert(it->first); };
+  Dash64::Cursor cursor;
+  size_t shrink_cursor = 0;
+  do {
+    cursor = dt_.Traverse(cursor, tr_cb);
+    shrink_cursor = dt_.ShrinkStep(shrink_cursor, 0.5);
+  } while (cursor);
+
+  EXPECT_LT(dt_.unique_segments(), max_segments);
+  ASSERT_EQ(kNumItems / 100, seen.size());
+  for (size_t i = 0; i < kNumItems; i += 100) {
+    ASSERT_TRUE(seen.count(i)) << i;
+  }
+}
+
 TEST_F(DashTest, BumpUp) {
   set<Segment::Key_t> keys = FillSegment(0);
   constexpr unsigned kFirstStashId = Segment::kNumBuckets;
@@ -508,6 +597,29 @@ TEST_F(DashTest, Insert) {
   ASSERT_TRUE(dt_.Find(some_val).is_done());
 }
 
+TEST_F(DashTest, FindByHash) {
+  constexpr size_t kNumItems = 10000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i * 2);
+  }
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    uint64_t hash = UInt64Policy::HashFn(i);
+    auto it = dt_.FindByHash(hash, [&](uint64_t key) { return UInt64Policy::HashFn(key) == hash; });
+    ASSERT_FALSE(it.is_done());
+    ASSERT_EQ(i, it->first);
+    ASSERT_EQ(i * 2, it->second);
+  }
+
+  // The predicate filters the candidates.
+  uint64_t hash = UInt64Policy::HashFn(7);
+  EXPECT_TRUE(dt_.FindByHash(hash, [](uint64_t key) { return false; }).is_done());
+  hash = UInt64Policy::HashFn(kNumItems);
+  EXPECT_TRUE(
+      dt_.FindByHash(hash, [&](uint64_t key) { return UInt64Policy::HashFn(key) == hash; })
+          .is_done());
+}
+
 TEST_F(DashTest, Traverse) {
   constexpr auto kNumItems = 50;
   for (size_t i = 0; i < kNumItems; ++i) {
@@ -5,7 +5,9 @@
 #include "core/dense_set.h"
 
 #include <absl/numeric/bits.h>
+#include <absl/random/distributions.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <stack>
@@ -25,49 +27,60 @@ constexpr size_t kMinSizeShift = 2;
 constexpr size_t kMinSize = 1 << kMinSizeShift;
 constexpr bool kAllowDisplacements = true;
 
+// Sets that are being rehashed by this thread. Driven by DenseSet::RehashPending().
+thread_local vector<DenseSet*> tl_rehashing;
+
 DenseSet::IteratorBase::IteratorBase(const DenseSet* owner, bool is_end)
     : owner_(const_cast<DenseSet&>(*owner)), curr_entry_(nullptr) {
-  curr_list_ = is_end ? owner_.entries_.end() : owner_.entries_.begin();
-  if (curr_list_ != owner->entries_.end()) {
-    curr_entry_ = &(*curr_list_);
-    owner->ExpireIfNeeded(nullptr, curr_entry_);
-
-    // find the first non null entry
-    if (curr_entry_->IsEmpty()) {
-      Advance();
+  if (is_end) {
+    curr_list_ = owner_.entries_.end();
+    return;
+  }
+
+  in_old_table_ = owner_.IsRehashing();
+  curr_list_ = in_old_table_ ? owner_.old_entries_.begin() + owner_.rehash_idx_
+                             : owner_.entries_.begin();
+  SeekNonEmpty();
+}
+
+void DenseSet::IteratorBase::SeekNonEmpty() {
+  while (true) {
+    if (in_old_table_ && curr_list_ == owner_.old_entries_.end()) {
+      in_old_table_ = false;
+      curr_list_ = owner_.entries_.begin();
+    }
+
+    if (!in_old_table_ && curr_list_ == owner_.entries_.end()) {
+      curr_entry_ = nullptr;
+      return;
     }
+
+    owner_.ExpireIfNeeded(nullptr, &(*curr_list_));
+    if (!curr_list_->IsEmpty()) {
+      curr_entry_ = &(*curr_list_);
+      return;
+    }
+    ++curr_list_;
   }
 }
 
 void DenseSet::IteratorBase::Advance() {
-  bool step_link = false;
   DCHECK(curr_entry_);
 
   if (curr_entry_->IsLink()) {
     DenseLinkKey* plink = curr_entry_->AsLink();
     if (!owner_.ExpireIfNeeded(curr_entry_, &plink->next) || curr_entry_->IsLink()) {
       curr_entry_ = &plink->next;
-      step_link = true;
+      DCHECK(!curr_entry_->IsEmpty());
+      return;
     }
   }
 
-  if (!step_link) {
-    DCHECK(curr_list_ != owner_.entries_.end());
-    do {
-      ++curr_list_;
-      if (curr_list_ == owner_.entries_.end()) {
-        curr_entry_ = nullptr;
-        return;
-      }
-      owner_.ExpireIfNeeded(nullptr, &(*curr_list_));
-    } while (curr_list_->IsEmpty());
-    DCHECK(curr_list_ != owner_.entries_.end());
-    curr_entry_ = &(*curr_list_);
-  }
-  DCHECK(!curr_entry_->IsEmpty());
+  ++curr_list_;
+  SeekNonEmpty();
 }
 
-DenseSet::DenseSet(pmr::memory_resource* mr) : entries_(mr) {
+DenseSet::DenseSet(pmr::memory_resource* mr) : entries_(mr), old_entries_(mr) {
 }
 
 DenseSet::~DenseSet() {
@@ -153,15 +166,50 @@ void* DenseSet::PopDataFront(DenseSet::ChainVectorIterator it) {
 }
 
 void DenseSet::ClearInternal() {
-  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+  for (auto* table : {&old_entries_, &entries_}) {
+    for (auto it = table->begin(); it != table->end(); ++it) {
+      while (!it->IsEmpty()) {
+        bool has_ttl = it->HasTtl();
+        void* obj = PopDataFront(it);
+        ObjDelete(obj, has_ttl);
+      }
+    }
+  }
+
+  FinishRehash();
+  entries_.clear();
+  num_ttl_entries_ = 0;
+  expire_cursor_ = 0;
+}
+
+uint32_t DenseSet::ClearStep(uint32_t cursor, unsigned max_buckets) {
+  // The buckets of the old array come first, the migrated ones are empty.
+  size_t num_old = old_entries_.size();
+  size_t end = min<size_t>(num_old + entries_.size(), size_t(cursor) + max_buckets);
+  for (; cursor < end && size_ > 0; ++cursor) {
+    auto it = cursor < num_old ? old_entries_.begin() + cursor
+                               : entries_.begin() + (cursor - num_old);
     while (!it->IsEmpty()) {
+      if (it->IsLink()) {
+        --num_chain_entries_;
+      } else {
+        --num_used_buckets_;
+      }
       bool has_ttl = it->HasTtl();
-      void* obj = PopDataFront(it);
-      ObjDelete(obj, has_ttl);
+      obj_malloc_used_ -= ObjectAllocSize(it->GetObject());
+      num_ttl_entries_ -= has_ttl;
+      ObjDelete(PopDataFront(it), has_ttl);
+      --size_;
     }
   }
 
-  entries_.clear();
+  if (size_ == 0) {
+    FinishRehash();
+    decltype(entries_)(mr()).swap(entries_);
+    capacity_log_ = 0;
+    expire_cursor_ = 0;
+  }
+  return cursor;
 }
 
 bool DenseSet::Equal(DensePtr dptr, const void* ptr, uint32_t cookie) const {
@@ -235,125 +283,95 @@ void DenseSet::Reserve(size_t sz) {
 }
 
 void DenseSet::Grow() {
-  size_t prev_size = entries_.size();
-  entries_.resize(prev_size * 2);
+  // Complete the previous rehash before starting a new one. This is rare since every
+  // mutation advances rehashing and the table must double its size before the next Grow.
+  if (IsRehashing()) {
+    RehashStep(old_entries_.size());
+  }
+
+  DCHECK(old_entries_.empty());
+  old_entries_.swap(entries_);
+  entries_.resize(old_entries_.size() * 2);
   ++capacity_log_;
+  rehash_idx_ = 0;
+  tl_rehashing.push_back(this);
+}
 
-  // perform rehashing of items in the set
-  for (long i = prev_size - 1; i >= 0; --i) {
-    DensePtr* curr = &entries_[i];
-    DensePtr* prev = nullptr;
+unsigned DenseSet::RehashStep(unsigned max_buckets) {
+  if (!IsRehashing())
+    return 0;
 
-    while (true) {
-      if (ExpireIfNeeded(prev, curr)) {
-        // if curr has disappeared due to expiry and prev was converted from Link to a
-        // regular DensePtr
-        if (prev && !prev->IsLink())
-          break;
-      }
+  unsigned migrated = 0;
+  for (; migrated < max_buckets && rehash_idx_ < old_entries_.size(); ++migrated, ++rehash_idx_) {
+    auto it = old_entries_.begin() + rehash_idx_;
 
-      if (curr->IsEmpty())
+    while (true) {
+      ExpireIfNeeded(nullptr, &(*it));
+      if (it->IsEmpty())
         break;
-      void* ptr = curr->GetObject();
-
-      DCHECK(ptr != nullptr && ObjectAllocSize(ptr));
-
-      uint32_t bid = BucketId(ptr, 0);
 
-      // if the item does not move from the current chain, ensure
-      // it is not marked as displaced and move to the next item in the chain
-      if (bid == i) {
-        curr->ClearDisplaced();
-        prev = curr;
-        curr = curr->Next();
-        if (curr == nullptr)
-          break;
+      bool has_ttl = it->HasTtl();
+      if (it->IsLink()) {
+        --num_chain_entries_;
       } else {
-        // if the entry is in the wrong chain remove it and
-        // add it to the correct chain. This will also correct
-        // displaced entries
-        auto dest = entries_.begin() + bid;
-        DensePtr dptr = *curr;
-
-        if (curr->IsObject()) {
-          curr->Reset();  // reset the original placeholder (.next or root)
-
-          if (prev) {
-            DCHECK(prev->IsLink());
-
-            DenseLinkKey* plink = prev->AsLink();
-            DCHECK(&plink->next == curr);
+        --num_used_buckets_;
+      }
 
-            // we want to make *prev a DensePtr instead of DenseLink and we
-            // want to deallocate the link.
-            DensePtr tmp = DensePtr::From(plink);
-            DCHECK(ObjectAllocSize(tmp.GetObject()));
+      void* ptr = PopDataFront(it);
+      DCHECK(ptr != nullptr && ObjectAllocSize(ptr));
 
-            FreeLink(plink);
-            *prev = tmp;
-          }
+      DensePtr to_insert(ptr);
+      if (has_ttl)
+        to_insert.SetTtl();
+      InsertUnique(to_insert, BucketId(ptr, 0));
+    }
+  }
 
-          DVLOG(2) << " Pushing to " << bid << " " << dptr.GetObject();
-          PushFront(dest, dptr);
+  if (rehash_idx_ == old_entries_.size()) {
+    FinishRehash();
+  }
 
-          dest->ClearDisplaced();
+  return migrated;
+}
 
-          break;
-        }  // if IsObject
+void DenseSet::FinishRehash() {
+  if (!IsRehashing())
+    return;
 
-        *curr = *dptr.Next();
-        DCHECK(!curr->IsEmpty());
+  decltype(old_entries_)(mr()).swap(old_entries_);
+  rehash_idx_ = 0;
 
-        PushFront(dest, dptr);
-        dest->ClearDisplaced();
-      }
-    }
+  auto it = find(tl_rehashing.begin(), tl_rehashing.end(), this);
+  DCHECK(it != tl_rehashing.end());
+  if (it != tl_rehashing.end()) {
+    *it = tl_rehashing.back();
+    tl_rehashing.pop_back();
   }
 }
 
-bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
-  uint64_t hc = Hash(ptr, 0);
+unsigned DenseSet::RehashPending(unsigned max_buckets) {
+  unsigned migrated = 0;
 
-  if (entries_.empty()) {
-    capacity_log_ = kMinSizeShift;
-    entries_.resize(kMinSize);
-    uint32_t bucket_id = BucketId(hc);
-    auto e = entries_.begin() + bucket_id;
-    obj_malloc_used_ += PushFront(e, ptr, has_ttl);
-    ++size_;
-    ++num_used_buckets_;
-
-    return true;
+  // RehashStep removes the set from tl_rehashing once it finishes.
+  while (migrated < max_buckets && !tl_rehashing.empty()) {
+    migrated += tl_rehashing.back()->RehashStep(max_buckets - migrated);
   }
 
-  // if the value is already in the set exit early
-  uint32_t bucket_id = BucketId(hc);
-  if (Find(ptr, bucket_id, 0).second != nullptr) {
-    return false;
-  }
+  return migrated;
+}
 
+void DenseSet::InsertUnique(DensePtr to_insert, uint32_t bucket_id) {
   DCHECK_LT(bucket_id, entries_.size());
 
-  // Try insert into flat surface first. Also handle the grow case
-  // if utilization is too high.
-  for (unsigned j = 0; j < 2; ++j) {
-    ChainVectorIterator list = FindEmptyAround(bucket_id);
-    if (list != entries_.end()) {
-      obj_malloc_used_ += PushFront(list, ptr, has_ttl);
-      if (std::distance(entries_.begin(), list) != bucket_id) {
-        list->SetDisplaced(std::distance(entries_.begin() + bucket_id, list));
-      }
-      ++num_used_buckets_;
-      ++size_;
-      return true;
-    }
-
-    if (size_ < entries_.size()) {
-      break;
+  // Try insert into flat surface first.
+  ChainVectorIterator list = FindEmptyAround(bucket_id);
+  if (list != entries_.end()) {
+    PushFront(list, to_insert);
+    if (std::distance(entries_.begin(), list) != bucket_id) {
+      list->SetDisplaced(std::distance(entries_.begin() + bucket_id, list));
     }
-
-    Grow();
-    bucket_id = BucketId(hc);
+    ++num_used_buckets_;
+    return;
   }
 
   DCHECK(!entries_[bucket_id].IsEmpty());
@@ -368,10 +386,6 @@ bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
    * unlink it and repeat the steps
    */
 
-  DensePtr to_insert(ptr);
-  if (has_ttl)
-    to_insert.SetTtl();
-
   while (!entries_[bucket_id].IsEmpty() && entries_[bucket_id].IsDisplaced()) {
     DensePtr unlinked = PopPtrFront(entries_.begin() + bucket_id);
 
@@ -384,25 +398,120 @@ bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
     ++num_chain_entries_;
   }
 
-  ChainVectorIterator list = entries_.begin() + bucket_id;
-  PushFront(list, to_insert);
-  obj_malloc_used_ += ObjectAllocSize(ptr);
+  ChainVectorIterator dest = entries_.begin() + bucket_id;
+  PushFront(dest, to_insert);
   DCHECK(!entries_[bucket_id].IsDisplaced());
+}
 
-  ++size_;
+bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
+  uint64_t hc = Hash(ptr, 0);
+
+  if (!entries_.empty()) {
+    if (IsRehashing())
+      RehashStep(kRehashStepsPerOp);
+
+    // if the value is already in the set exit early
+    if (Find(ptr, hc, 0).second != nullptr) {
+      return false;
+    }
+  }
+
+  AddUnique(ptr, has_ttl, hc);
   return true;
 }
 
-auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<DensePtr*, DensePtr*> {
+void* DenseSet::AddOrReplaceObj(void* obj, bool has_ttl) {
+  uint64_t hc = Hash(obj, 0);
+
+  if (!entries_.empty()) {
+    if (IsRehashing())
+      RehashStep(kRehashStepsPerOp);
+
+    DensePtr* ptr = Find(obj, hc, 0).second;
+    if (ptr) {
+      void* res = ptr->GetObject();
+
+      // Keep the tagging info of the entry, i.e. its link and displacement bits.
+      if (ptr->IsLink()) {
+        ptr->AsLink()->SetObject(obj);
+      } else {
+        ptr->SetObject(obj);
+      }
+
+      num_ttl_entries_ -= ptr->HasTtl();
+      if (has_ttl) {
+        ptr->SetTtl();
+      } else {
+        ptr->ClearTtl();
+      }
+      num_ttl_entries_ += has_ttl;
+
+      obj_malloc_used_ -= ObjectAllocSize(res);
+      obj_malloc_used_ += ObjectAllocSize(obj);
+      return res;
+    }
+  }
+
+  AddUnique(obj, has_ttl, hc);
+  return nullptr;
+}
+
+void DenseSet::AddUnique(void* ptr, bool has_ttl, uint64_t hc) {
+  if (entries_.empty()) {
+    capacity_log_ = kMinSizeShift;
+    entries_.resize(kMinSize);
+    uint32_t bucket_id = BucketId(hc);
+    auto e = entries_.begin() + bucket_id;
+    obj_malloc_used_ += PushFront(e, ptr, has_ttl);
+    ++size_;
+    ++num_used_buckets_;
+    num_ttl_entries_ += has_ttl;
+
+    return;
+  }
+
+  // Grow if utilization is too high and there is no empty bucket around the home bucket.
+  uint32_t bucket_id = BucketId(hc);
+  if (size_ >= entries_.size() && FindEmptyAround(bucket_id) == entries_.end()) {
+    Grow();
+    bucket_id = BucketId(hc);
+  }
+
+  DensePtr to_insert(ptr);
+  if (has_ttl)
+    to_insert.SetTtl();
+
+  InsertUnique(to_insert, bucket_id);
+  obj_malloc_used_ += ObjectAllocSize(ptr);
+  ++size_;
+  num_ttl_entries_ += has_ttl;
+}
+
+auto DenseSet::Find(const void* ptr, uint64_t hash, uint32_t cookie)
+    -> pair<DensePtr*, DensePtr*> {
+  if (entries_.empty())
+    return make_pair(nullptr, nullptr);
+
+  auto res = FindInTable(&entries_, ptr, BucketId(hash), cookie);
+  if (res.second == nullptr && IsRehashing()) {
+    // old_entries_ has half of the buckets, i.e. one bit less of the hash is used.
+    uint32_t old_bid = hash >> (64 - capacity_log_ + 1);
+    res = FindInTable(&old_entries_, ptr, old_bid, cookie);
+  }
+  return res;
+}
+
+auto DenseSet::FindInTable(std::pmr::vector<DensePtr>* entries, const void* ptr, uint32_t bid,
+                           uint32_t cookie) -> pair<DensePtr*, DensePtr*> {
   // could do it with zigzag decoding but this is clearer.
   int offset[] = {0, -1, 1};
 
   // first look for displaced nodes since this is quicker than iterating a potential long chain
   for (int j = 0; j < 3; ++j) {
-    if ((bid == 0 && j == 1) || (bid + 1 == entries_.size() && j == 2))
+    if ((bid == 0 && j == 1) || (bid + 1 == entries->size() && j == 2))
       continue;
 
-    DensePtr* curr = &entries_[bid + offset[j]];
+    DensePtr* curr = &(*entries)[bid + offset[j]];
 
     ExpireIfNeeded(nullptr, curr);
     if (Equal(*curr, ptr, cookie)) {
@@ -411,10 +520,13 @@ auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<Dens
   }
 
   // if the node is not displaced, search the correct chain
-  DensePtr* prev = &entries_[bid];
+  DensePtr* prev = &(*entries)[bid];
   DensePtr* curr = prev->Next();
   while (curr != nullptr) {
-    ExpireIfNeeded(prev, curr);
+    // If the tail of the chain expired, its link was freed and prev holds the last object,
+    // which has already been compared.
+    if (ExpireIfNeeded(prev, curr) && !prev->IsLink())
+      break;
 
     if (Equal(*curr, ptr, cookie)) {
       return make_pair(prev, curr);
@@ -428,7 +540,14 @@ auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<Dens
 }
 
 void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
+  bool has_ttl = ptr->HasTtl();
+  void* obj = Unlink(prev, ptr);
+  ObjDelete(obj, has_ttl);
+}
+
+void* DenseSet::Unlink(DensePtr* prev, DensePtr* ptr) {
   void* obj = nullptr;
+  bool has_ttl = ptr->HasTtl();
 
   if (ptr->IsObject()) {
     obj = ptr->Raw();
@@ -443,6 +562,9 @@ void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
       DensePtr tmp = DensePtr::From(plink);
       DCHECK(ObjectAllocSize(tmp.GetObject()));
 
+      // The ttl bit of the link object is kept by prev and not by the link itself.
+      if (prev->HasTtl())
+        tmp.SetTtl();
       FreeLink(plink);
       *prev = tmp;
       DCHECK(!prev->IsLink());
@@ -459,25 +581,43 @@ void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
 
   obj_malloc_used_ -= ObjectAllocSize(obj);
   --size_;
-  ObjDelete(obj, false);
+  num_ttl_entries_ -= has_ttl;
+  return obj;
+}
+
+auto DenseSet::FirstNonEmpty(ChainVectorIterator it, ChainVectorIterator end)
+    -> ChainVectorIterator {
+  for (; it != end; ++it) {
+    if (it->IsEmpty())
+      continue;
+
+    ExpireIfNeeded(nullptr, &(*it));
+    if (!it->IsEmpty())
+      break;
+  }
+  return it;
 }
 
 void* DenseSet::PopInternal() {
-  std::pmr::vector<DenseSet::DensePtr>::iterator bucket_iter = entries_.begin();
+  if (IsRehashing())
+    RehashStep(kRehashStepsPerOp);
 
-  // find the first non-empty chain
-  do {
-    while (bucket_iter != entries_.end() && bucket_iter->IsEmpty()) {
-      ++bucket_iter;
-    }
+  // find the first non-empty chain, starting with the buckets that were not migrated yet.
+  ChainVectorIterator bucket_iter;
+  bool found = false;
+  if (IsRehashing()) {
+    bucket_iter = FirstNonEmpty(old_entries_.begin() + rehash_idx_, old_entries_.end());
+    found = bucket_iter != old_entries_.end();
+  }
+
+  if (!found) {
+    bucket_iter = FirstNonEmpty(entries_.begin(), entries_.end());
 
     // empty set
     if (bucket_iter == entries_.end()) {
       return nullptr;
     }
-
-    ExpireIfNeeded(nullptr, &(*bucket_iter));
-  } while (bucket_iter->IsEmpty());
+  }
 
   if (bucket_iter->IsLink()) {
     --num_chain_entries_;
@@ -488,12 +628,71 @@ void* DenseSet::PopInternal() {
 
   // unlink the first node in the first non-empty chain
   obj_malloc_used_ -= ObjectAllocSize(bucket_iter->GetObject());
+  num_ttl_entries_ -= bucket_iter->HasTtl();
   void* ret = PopDataFront(bucket_iter);
 
   --size_;
   return ret;
 }
 
+void* DenseSet::PopRandomInternal(absl::BitGenRef gen) {
+  if (IsRehashing())
+    RehashStep(kRehashStepsPerOp);
+
+  auto [prev, ptr] = RandomItem(gen);
+  return ptr ? Unlink(prev, ptr) : nullptr;
+}
+
+auto DenseSet::RandomItem(absl::BitGenRef gen) -> pair<DensePtr*, DensePtr*> {
+  if (size_ == 0)
+    return {nullptr, nullptr};
+
+  // The buckets of the old array that were not migrated yet come first.
+  size_t num_old = IsRehashing() ? old_entries_.size() - rehash_idx_ : 0;
+  size_t num_buckets = num_old + entries_.size();
+  auto bucket = [&](size_t i) {
+    return i < num_old ? &old_entries_[rehash_idx_ + i] : &entries_[i - num_old];
+  };
+  auto is_live = [this](const DensePtr* ptr) {
+    return !ptr->HasTtl() || ObjExpireTime(ptr->GetObject()) > time_now_;
+  };
+
+  for (unsigned i = 0; i < kSampleAttempts; ++i) {
+    DensePtr* prev = nullptr;
+    DensePtr* curr = bucket(absl::Uniform<size_t>(gen, 0, num_buckets));
+    if (curr->IsEmpty())
+      continue;
+
+    unsigned depth = absl::Uniform(gen, 0u, kSampleChainDepth);
+    for (; depth > 0 && curr->IsLink(); --depth) {
+      prev = curr;
+      curr = curr->Next();
+    }
+
+    if (depth == 0 && is_live(curr))
+      return {prev, curr};
+  }
+
+  size_t start = absl::Uniform<size_t>(gen, 0, num_buckets);
+  for (size_t i = 0; i < num_buckets; ++i) {
+    pair<DensePtr*, DensePtr*> res{nullptr, nullptr};
+    unsigned num_live = 0;
+    DensePtr* prev = nullptr;
+
+    // reservoir sampling over the live objects of the chain.
+    for (DensePtr* curr = bucket((start + i) % num_buckets); curr && !curr->IsEmpty();
+         prev = curr, curr = curr->Next()) {
+      if (is_live(curr) && absl::Uniform(gen, 0u, ++num_live) == 0)
+        res = {prev, curr};
+    }
+
+    if (res.second)
+      return res;
+  }
+
+  return {nullptr, nullptr};
+}
+
 /**
  * stable scanning api. has the same guarantees as redis scan command.
  * we avoid doing bit-reverse by using a different function to derive a bucket id
@@ -519,10 +718,25 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
 
   auto& entries = const_cast<DenseSet*>(this)->entries_;
 
+  // During rehashing, items of bucket bid may still reside around the old bucket bid / 2.
+  auto old_buckets_empty = [this](uint32_t bid) {
+    if (!IsRehashing())
+      return true;
+    uint32_t old_bid = bid >> 1;
+    uint32_t first = std::max(old_bid ? old_bid - 1 : 0, rehash_idx_);
+    uint32_t last = std::min<uint32_t>(old_bid + 2, old_entries_.size());
+    for (uint32_t i = first; i < last; ++i) {
+      if (!old_entries_[i].IsEmpty())
+        return false;
+    }
+    return true;
+  };
+
   // First find the bucket to scan, skip empty buckets.
   // A bucket is empty if the current index is empty and the data is not displaced
   // to the right or to the left.
-  while (entries_idx < entries_.size() && NoItemBelongsBucket(entries_idx)) {
+  while (entries_idx < entries_.size() && NoItemBelongsBucket(entries_idx) &&
+         old_buckets_empty(entries_idx)) {
     ++entries_idx;
   }
 
@@ -560,6 +774,10 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
     }
   }
 
+  if (IsRehashing()) {
+    ScanOldTable(entries_idx, cb);
+  }
+
   // move to the next index for the next scan and check if we are done
   ++entries_idx;
   if (entries_idx >= entries_.size()) {
@@ -578,6 +796,33 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
   return entries_idx << (32 - capacity_log_);
 }
 
+void DenseSet::ScanOldTable(uint32_t bid, const ItemCb& cb) const {
+  auto& entries = const_cast<DenseSet*>(this)->old_entries_;
+  uint32_t old_bid = bid >> 1;
+  uint32_t first = std::max(old_bid ? old_bid - 1 : 0, rehash_idx_);
+  uint32_t last = std::min<uint32_t>(old_bid + 2, entries.size());
+
+  // Chains around old_bid hold items of both bid and its sibling bucket, so filter by hash.
+  for (uint32_t i = first; i < last; ++i) {
+    DensePtr* curr = &entries[i];
+    ExpireIfNeeded(nullptr, curr);
+
+    while (!curr->IsEmpty()) {
+      void* obj = curr->GetObject();
+      if (BucketId(obj, 0) == bid)
+        cb(obj);
+
+      if (!curr->IsLink())
+        break;
+
+      if (ExpireIfNeeded(curr, &curr->AsLink()->next) && !curr->IsLink()) {
+        break;
+      }
+      curr = &curr->AsLink()->next;
+    }
+  }
+}
+
 auto DenseSet::NewLink(void* data, DensePtr next) -> DenseLinkKey* {
   LinkAllocator la(mr());
   DenseLinkKey* lk = la.allocate(1);
@@ -601,9 +846,36 @@ bool DenseSet::ExpireIfNeeded(DensePtr* prev, DensePtr* node) const {
     // updates the node to next item if relevant.
     const_cast<DenseSet*>(this)->Delete(prev, node);
     deleted = true;
+
+    // node was the last item of the chain and it has been freed together with prev's link.
+    if (prev && !prev->IsLink())
+      break;
   }
 
   return deleted;
 }
 
+unsigned DenseSet::ExpireStep(unsigned max_buckets) {
+  if (num_ttl_entries_ == 0 || entries_.empty())
+    return 0;
+
+  uint32_t prev_size = size_;
+  for (unsigned i = 0; i < max_buckets && num_ttl_entries_ > 0; ++i) {
+    if (expire_cursor_ >= entries_.size())
+      expire_cursor_ = 0;
+
+    DensePtr* curr = &entries_[expire_cursor_++];
+    ExpireIfNeeded(nullptr, curr);
+
+    while (curr->IsLink()) {
+      DensePtr* next = curr->Next();
+      if (ExpireIfNeeded(curr, next) && !curr->IsLink())
+        break;
+      curr = next;
+    }
+  }
+
+  return prev_size - size_;
+}
+
 }  // namespace dfly
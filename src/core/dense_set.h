@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <absl/random/bit_gen_ref.h>
+
 #include <cstddef>
 #include <cstdint>
 #include <functional>
@@ -111,6 +113,10 @@ class DenseSet {
       ptr_ = (void*)(uptr() | kTtlBit);
     }
 
+    void ClearTtl() {
+      ptr_ = (void*)(uptr() & ~kTtlBit);
+    }
+
     void Reset() {
       ptr_ = nullptr;
     }
@@ -173,9 +179,14 @@ class DenseSet {
 
     void Advance();
 
+    // Positions curr_entry_ on the first non-empty bucket starting from curr_list_.
+    // Walks the old bucket array first if the set is being rehashed.
+    void SeekNonEmpty();
+
     DenseSet& owner_;
     ChainVectorIterator curr_list_;
     DensePtr* curr_entry_;
+    bool in_old_table_ = false;
   };
 
  public:
@@ -208,9 +219,47 @@ class DenseSet {
   }
 
   size_t SetMallocUsed() const {
-    return (num_chain_entries_ + entries_.capacity()) * sizeof(DensePtr);
+    return (num_chain_entries_ + entries_.capacity() + old_entries_.capacity()) * sizeof(DensePtr);
+  }
+
+  // Grow() does not rehash the table at once. Instead, the previous bucket array is kept
+  // until all its buckets are migrated to the new one. Every mutation migrates a few buckets
+  // and the rest is driven by RehashStep().
+  bool IsRehashing() const {
+    return !old_entries_.empty();
+  }
+
+  // Migrates up to max_buckets buckets from the old bucket array.
+  // Returns the number of buckets migrated.
+  unsigned RehashStep(unsigned max_buckets);
+
+  // Advances rehashing of the sets that are being rehashed by the calling thread, migrating up
+  // to max_buckets buckets in total. Sets are thread-confined, similarly to the rest of the
+  // shard data. Returns the number of buckets migrated.
+  static unsigned RehashPending(unsigned max_buckets);
+
+  // Completes rehashing, which unregisters the set from the calling thread. Must be called
+  // before the set is handed over to another thread.
+  void Detach() {
+    RehashStep(old_entries_.size());
+  }
+
+  // Number of entries that were added with ttl, including the expired ones that were not
+  // deleted yet.
+  size_t NumTtlEntries() const {
+    return num_ttl_entries_;
   }
 
+  // Deletes expired entries in up to max_buckets buckets, continuing from where the previous
+  // call stopped and wrapping around at the end of the bucket array. Used for active expiry
+  // of entries that are not accessed. Returns the number of deleted entries.
+  unsigned ExpireStep(unsigned max_buckets);
+
+  // Deletes the entries of up to max_buckets buckets, starting at bucket cursor, and returns
+  // the cursor to continue from. Releases the bucket arrays once the set is empty. Lets a large
+  // set be freed incrementally, the set must not be modified between the calls.
+  uint32_t ClearStep(uint32_t cursor, unsigned max_buckets);
+
   template <typename T> class iterator : private IteratorBase {
     static_assert(std::is_pointer_v<T>, "Iterators can only return pointers");
 
@@ -229,7 +278,7 @@ class DenseSet {
     }
 
     friend bool operator==(const iterator& a, const iterator& b) {
-      return a.curr_list_ == b.curr_list_;
+      return a.curr_entry_ == b.curr_entry_;
     }
 
     friend bool operator!=(const iterator& a, const iterator& b) {
@@ -263,7 +312,7 @@ class DenseSet {
     }
 
     friend bool operator==(const const_iterator& a, const const_iterator& b) {
-      return a.curr_list_ == b.curr_list_;
+      return a.curr_entry_ == b.curr_entry_;
     }
 
     friend bool operator!=(const const_iterator& a, const const_iterator& b) {
@@ -318,7 +367,10 @@ class DenseSet {
   virtual void ObjDelete(void* obj, bool has_ttl) const = 0;
 
   bool EraseInternal(void* obj, uint32_t cookie) {
-    auto [prev, found] = Find(obj, BucketId(obj, cookie), cookie);
+    if (IsRehashing())
+      RehashStep(kRehashStepsPerOp);
+
+    auto [prev, found] = Find(obj, Hash(obj, cookie), cookie);
     if (found) {
       Delete(prev, found);
       return true;
@@ -328,18 +380,45 @@ class DenseSet {
 
   bool AddInternal(void* obj, bool has_ttl);
 
+  // Adds obj to the set or replaces the existing object that is equal to obj.
+  // Returns the replaced object, which the caller must free, or nullptr if obj was added.
+  void* AddOrReplaceObj(void* obj, bool has_ttl);
+
+  // Returns the object equal to obj or nullptr if it is not in the set.
+  void* FindInternal(const void* obj, uint32_t cookie) const {
+    DensePtr* ptr = const_cast<DenseSet*>(this)->Find(obj, Hash(obj, cookie), cookie).second;
+    return ptr ? ptr->GetObject() : nullptr;
+  }
+
   bool ContainsInternal(const void* obj, uint32_t cookie) const {
-    return const_cast<DenseSet*>(this)->Find(obj, BucketId(obj, cookie), cookie).second != nullptr;
+    return FindInternal(obj, cookie) != nullptr;
   }
 
   void* PopInternal();
 
+  // Returns a random object or nullptr if the set is empty, see RandomItem.
+  void* GetRandomObjInternal(absl::BitGenRef gen) const {
+    DensePtr* ptr = const_cast<DenseSet*>(this)->RandomItem(gen).second;
+    return ptr ? ptr->GetObject() : nullptr;
+  }
+
+  // Removes a random object and returns it without deleting it, or nullptr if the set is empty.
+  void* PopRandomInternal(absl::BitGenRef gen);
+
   // Note this does not free any dynamic allocations done by derived classes, that a DensePtr
   // in the set may point to. This function only frees the allocated DenseLinkKeys created by
   // DenseSet. All data allocated by a derived class should be freed before calling this
   void ClearInternal();
 
  private:
+  // Number of old buckets migrated by every mutation during rehashing.
+  // Must be at least 1 so that rehashing finishes before the next Grow() is needed.
+  static constexpr unsigned kRehashStepsPerOp = 2;
+
+  // RandomItem picks positions up to this depth in the chains, which are rarely deeper.
+  static constexpr unsigned kSampleChainDepth = 4;
+  static constexpr unsigned kSampleAttempts = 64;
+
   DenseSet(const DenseSet&) = delete;
   DenseSet& operator=(DenseSet&) = delete;
 
@@ -364,6 +443,19 @@ class DenseSet {
   bool NoItemBelongsBucket(uint32_t bid) const;
   void Grow();
 
+  // Adds obj that is known not to be in the set.
+  void AddUnique(void* obj, bool has_ttl, uint64_t hashcode);
+
+  // Inserts to_insert into the current bucket array without checking for duplicates.
+  // Updates bucket statistics but not size_ or obj_malloc_used_.
+  void InsertUnique(DensePtr to_insert, uint32_t bucket_id);
+
+  // Frees the old bucket array once rehashing has completed.
+  void FinishRehash();
+
+  // Calls cb for items in the old bucket array that belong to bucket id bid of the current one.
+  void ScanOldTable(uint32_t bid, const ItemCb& cb) const;
+
   // ============ Pseudo Linked List Functions for interacting with Chains ==================
   size_t PushFront(ChainVectorIterator, void* obj, bool has_ttl);
   void PushFront(ChainVectorIterator, DensePtr);
@@ -374,7 +466,13 @@ class DenseSet {
   // ============ Pseudo Linked List in DenseSet end ==================
 
   // returns (prev, item) pair. If item is root, then prev is null.
-  std::pair<DensePtr*, DensePtr*> Find(const void* ptr, uint32_t bid, uint32_t cookie);
+  // Looks in both bucket arrays during rehashing.
+  std::pair<DensePtr*, DensePtr*> Find(const void* ptr, uint64_t hash, uint32_t cookie);
+  std::pair<DensePtr*, DensePtr*> FindInTable(std::pmr::vector<DensePtr>* entries,
+                                              const void* ptr, uint32_t bid, uint32_t cookie);
+
+  // Returns the first non-empty bucket in range [it, end) or end if there is none.
+  ChainVectorIterator FirstNonEmpty(ChainVectorIterator it, ChainVectorIterator end);
 
   DenseLinkKey* NewLink(void* data, DensePtr next);
 
@@ -390,14 +488,34 @@ class DenseSet {
   // If ptr is a link then it will be deleted internally.
   void Delete(DensePtr* prev, DensePtr* ptr);
 
+  // Removes the object pointed by ptr from the set like Delete, but returns it instead of
+  // deleting it.
+  void* Unlink(DensePtr* prev, DensePtr* ptr);
+
+  // Returns the (prev, item) pair of a random object that did not expire, or a null item if
+  // there is none. Picks a random bucket of both bucket arrays and a random depth in its chain,
+  // and retries while the pick is empty, so that every object is equally likely. Once
+  // kSampleAttempts picks missed, which happens when the table is sparse, falls back to a random
+  // object of the first non-empty chain after a random bucket.
+  std::pair<DensePtr*, DensePtr*> RandomItem(absl::BitGenRef gen);
+
   std::pmr::vector<DensePtr> entries_;
 
+  // The bucket array before the last Grow(), non-empty only during rehashing.
+  // Buckets [0, rehash_idx_) have already been migrated to entries_.
+  std::pmr::vector<DensePtr> old_entries_;
+  uint32_t rehash_idx_ = 0;
+
   mutable size_t obj_malloc_used_ = 0;
   mutable uint32_t size_ = 0;
   mutable uint32_t num_chain_entries_ = 0;
   mutable uint32_t num_used_buckets_ = 0;
+  mutable uint32_t num_ttl_entries_ = 0;
   unsigned capacity_log_ = 0;
 
+  // Next bucket to be checked by ExpireStep.
+  uint32_t expire_cursor_ = 0;
+
   uint32_t time_now_ = 0;
 };
 
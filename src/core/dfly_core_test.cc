@@ -5,6 +5,8 @@
 #include "core/tx_queue.h"
 
 #include "base/gtest.h"
+#include "base/hash.h"
+#include "core/count_min_sketch.h"
 #include "core/intent_lock.h"
 
 namespace dfly {
@@ -55,4 +57,26 @@ TEST_F(IntentLockTest, Basic) {
   ASSERT_TRUE(lk_.Check(IntentLock::EXCLUSIVE));
 }
 
+TEST(CountMinSketchTest, Basic) {
+  CountMinSketch cms(1024);
+  auto hash = [](uint64_t v) { return XXH3_64bits(&v, sizeof(v)); };
+
+  for (uint64_t i = 0; i < 100; ++i) {
+    for (unsigned j = 0; j < i % 8; ++j)
+      cms.Increment(hash(i));
+  }
+
+  for (uint64_t i = 0; i < 100; ++i) {
+    // Count-min sketch never underestimates.
+    EXPECT_GE(cms.Estimate(hash(i)), i % 8) << i;
+  }
+
+  for (unsigned j = 0; j < 100; ++j)
+    cms.Increment(hash(1000));
+  EXPECT_EQ(CountMinSketch::kMaxCount, cms.Estimate(hash(1000)));
+
+  cms.Reset();
+  EXPECT_EQ(CountMinSketch::kMaxCount / 2, cms.Estimate(hash(1000)));
+}
+
 }  // namespace dfly
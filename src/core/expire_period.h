@@ -8,15 +8,21 @@
 
 namespace dfly {
 
+// The deadline of a key relative to one of the two expire bases of its DbSlice, selected by the
+// generation id. Deadlines up to ~12 days away from the base keep ms precision, the further ones
+// are rounded to seconds. DbSlice moves the base forward from time to time, so the deltas of the
+// short ttls stay small: it switches to the other generation and migrates the entries of the
+// previous one incrementally.
 class ExpirePeriod {
  public:
-  static constexpr size_t kMaxGenId = 15;
+  static constexpr size_t kMaxGenId = 1;
 
   ExpirePeriod() : val_(0), gen_(0), precision_(0) {
-    static_assert(sizeof(ExpirePeriod) == 8);  // TODO
+    static_assert(sizeof(ExpirePeriod) == 4);
   }
 
   explicit ExpirePeriod(uint64_t ms, unsigned gen = 0) : ExpirePeriod() {
+    gen_ = gen;
     Set(ms);
   }
 
@@ -35,28 +41,28 @@ class ExpirePeriod {
 
   void Set(uint64_t ms);
 
-  bool is_second_precision() { return precision_ == 1;}
+  bool is_second_precision() {
+    return precision_ == 1;
+  }
 
  private:
-  uint64_t val_ : 59;
-  uint64_t gen_ : 4;
-  uint64_t precision_ : 1;  // 0 - ms, 1 - sec.
+  uint32_t val_ : 30;
+  uint32_t gen_ : 1;
+  uint32_t precision_ : 1;  // 0 - ms, 1 - sec.
 };
 
 inline void ExpirePeriod::Set(uint64_t ms) {
-  constexpr uint64_t kBarrier = (1ULL << 48);
+  constexpr uint64_t kBarrier = (1ULL << 30);
 
   if (ms < kBarrier) {
     val_ = ms;
-    precision_ = 0;   // ms
+    precision_ = 0;  // ms
     return;
   }
 
   precision_ = 1;
-  if (ms < kBarrier << 10) {
-    ms = (ms + 500) / 1000;   // seconds
-  }
-  val_ = ms >= kBarrier ? kBarrier - 1 : ms;
+  uint64_t sec = (ms + 500) / 1000;
+  val_ = sec >= kBarrier ? kBarrier - 1 : sec;
 }
 
 }  // namespace dfly
@@ -0,0 +1,74 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/expire_wheel.h"
+
+#include <algorithm>
+
+namespace dfly {
+
+using namespace std;
+
+void ExpireWheel::Add(uint64_t hash, uint64_t deadline_ms) {
+  ++size_;
+  if (!started_) {
+    pending_.push_back(hash);
+    return;
+  }
+
+  // The entries that are already due go to the next tick.
+  uint64_t tick = max(deadline_ms / kTickMs, current_tick_);
+
+  // The lowest level whose slots all lie in the current rotation of the level above.
+  for (unsigned level = 0; level < kNumLevels; ++level) {
+    unsigned shift = kSlotBits * (level + 1);
+    if ((tick >> shift) == (current_tick_ >> shift)) {
+      levels_[level][(tick >> (shift - kSlotBits)) % kNumSlots].push_back(hash);
+      return;
+    }
+  }
+  overflow_.push_back(hash);
+}
+
+void ExpireWheel::NextTick() {
+  Append(&levels_[0][current_tick_ % kNumSlots]);
+  ++current_tick_;
+
+  // The slot that starts at the new tick is cascaded down before the tick is processed.
+  for (unsigned level = 1; level < kNumLevels; ++level) {
+    unsigned shift = kSlotBits * level;
+    if (current_tick_ % (1ULL << shift) != 0)
+      return;
+    Append(&levels_[level][(current_tick_ >> shift) % kNumSlots]);
+  }
+  if (current_tick_ % (1ULL << (kSlotBits * kNumLevels)) == 0) {
+    Append(&overflow_);
+  }
+}
+
+size_t ExpireWheel::NumOverdue(uint64_t now_ms) const {
+  size_t res = pending_.size() - pending_pos_;
+  if (!started_)
+    return res;
+
+  // The ticks of level 0 that passed, up to a rotation.
+  uint64_t now_tick = now_ms / kTickMs;
+  for (uint64_t tick = current_tick_; tick < now_tick && tick < current_tick_ + kNumSlots;
+       ++tick) {
+    res += levels_[0][tick % kNumSlots].size();
+  }
+  return res;
+}
+
+size_t ExpireWheel::MallocUsed() const {
+  size_t res = pending_.capacity() + overflow_.capacity();
+  for (const auto& level : levels_) {
+    for (const Slot& slot : level) {
+      res += slot.capacity();
+    }
+  }
+  return res * sizeof(uint64_t);
+}
+
+}  // namespace dfly
@@ -0,0 +1,102 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dfly {
+
+// Index of the keys with expiry by their deadline, so that the keys are deleted when they are
+// due instead of being found by sampling the table.
+// It is a hierarchical timer wheel: level 0 has a slot per tick of kTickMs, and each level
+// above has slots 64 times wider. The entries that are further away than the top level stay in
+// an overflow list. The slots of the upper levels are cascaded down when their time comes.
+//
+// The wheel only keeps the hashes of the keys. Its entries are hints, which its owner checks
+// against the deadlines in the table when they are processed: it deletes the keys that are due and
+// reschedules the ones with a later deadline. Hence a deadline that is extended does not need
+// a new entry, and the entries of the keys that were deleted or persisted are simply dropped.
+class ExpireWheel {
+ public:
+  static constexpr unsigned kTickMs = 128;
+  static constexpr unsigned kSlotBits = 6;
+  static constexpr unsigned kNumSlots = 1 << kSlotBits;
+  static constexpr unsigned kNumLevels = 4;
+
+  // Adds an entry for a key that expires at deadline_ms.
+  void Add(uint64_t hash, uint64_t deadline_ms);
+
+  // Processes up to max_entries entries that are due at now_ms, and returns their number.
+  // process(hash) returns the new deadline of the entries to keep, or 0 to drop them.
+  template <typename Process>
+  size_t Advance(uint64_t now_ms, size_t max_entries, Process&& process);
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Number of the entries due at now_ms that were not processed yet, which are the keys
+  // that expired but still hold memory, and a few stale entries.
+  size_t NumOverdue(uint64_t now_ms) const;
+
+  size_t MallocUsed() const;
+
+ private:
+  using Slot = std::vector<uint64_t>;
+
+  // Moves the entries of the next tick, and of the slots that are cascaded at it, to pending_.
+  void NextTick();
+
+  void Append(Slot* slot) {
+    pending_.insert(pending_.end(), slot->begin(), slot->end());
+    Slot{}.swap(*slot);
+  }
+
+  std::array<std::array<Slot, kNumSlots>, kNumLevels> levels_;
+  Slot overflow_;
+
+  // The entries to process, from pending_pos_ on.
+  Slot pending_;
+  size_t pending_pos_ = 0;
+
+  uint64_t current_tick_ = 0;  // The first tick that was not processed.
+  bool started_ = false;       // Before the first Advance, all the entries are pending.
+  size_t size_ = 0;
+};
+
+template <typename Process>
+size_t ExpireWheel::Advance(uint64_t now_ms, size_t max_entries, Process&& process) {
+  if (!started_) {
+    started_ = true;
+    current_tick_ = now_ms / kTickMs;
+  }
+
+  size_t processed = 0;
+  while (processed < max_entries) {
+    if (pending_pos_ == pending_.size()) {
+      Slot{}.swap(pending_);
+      pending_pos_ = 0;
+
+      // A tick is processed once its whole window has passed.
+      if ((current_tick_ + 1) * kTickMs > now_ms)
+        break;
+      NextTick();
+      continue;
+    }
+
+    uint64_t hash = pending_[pending_pos_++];
+    --size_;
+    ++processed;
+    if (uint64_t deadline = process(hash); deadline != 0) {
+      Add(hash, deadline);
+    }
+  }
+  return processed;
+}
+
+}  // namespace dfly
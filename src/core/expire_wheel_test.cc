@@ -0,0 +1,135 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/expire_wheel.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/random/random.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class ExpireWheelTest : public ::testing::Test {
+ protected:
+  static constexpr uint64_t kStart = 1000000;
+
+  // Advances the time to now_ms and processes the entries like DbSlice, deleting the keys that
+  // are due and rescheduling the others.
+  // Without a budget, checks that the keys were not due at the previous call already.
+  size_t AdvanceTo(uint64_t now_ms, size_t max_entries = SIZE_MAX) {
+    uint64_t prev_ms = now_ms_;
+    now_ms_ = now_ms;
+    return wheel_.Advance(now_ms, max_entries, [&](uint64_t hash) -> uint64_t {
+      auto it = deadlines_.find(hash);
+      if (it == deadlines_.end())
+        return 0;
+      if (it->second > now_ms_)
+        return it->second;
+      if (max_entries == SIZE_MAX) {
+        EXPECT_GT(it->second + ExpireWheel::kTickMs, prev_ms) << hash;
+      }
+      deadlines_.erase(it);
+      ++deleted_;
+      return 0;
+    });
+  }
+
+  void AddKey(uint64_t hash, uint64_t deadline_ms) {
+    deadlines_[hash] = deadline_ms;
+    wheel_.Add(hash, deadline_ms);
+  }
+
+  ExpireWheel wheel_;
+  absl::flat_hash_map<uint64_t, uint64_t> deadlines_;
+  uint64_t now_ms_ = 0;
+  size_t deleted_ = 0;
+};
+
+TEST_F(ExpireWheelTest, Basic) {
+  AdvanceTo(kStart);
+  AddKey(1, kStart + 10);
+  AddKey(2, kStart + 1000);
+  AddKey(3, kStart + 100000);
+  EXPECT_EQ(3u, wheel_.size());
+
+  AdvanceTo(kStart + 5);
+  EXPECT_EQ(0u, deleted_);
+  AdvanceTo(kStart + 300);
+  EXPECT_EQ(1u, deleted_);
+  AdvanceTo(kStart + 1300);
+  EXPECT_EQ(2u, deleted_);
+
+  // Extending the deadline does not need a new entry.
+  deadlines_[3] = kStart + 200000;
+  for (uint64_t now = kStart + 1300; now < kStart + 199000; now += 100) {
+    AdvanceTo(now);
+  }
+  EXPECT_EQ(2u, deleted_);
+  EXPECT_EQ(1u, wheel_.size());
+  AdvanceTo(kStart + 200300);
+  EXPECT_EQ(3u, deleted_);
+  EXPECT_EQ(0u, wheel_.size());
+
+  // Deleted keys are dropped.
+  AddKey(4, kStart + 201000);
+  deadlines_.erase(4);
+  AdvanceTo(kStart + 202000);
+  EXPECT_EQ(3u, deleted_);
+  EXPECT_EQ(0u, wheel_.size());
+}
+
+TEST_F(ExpireWheelTest, BeforeStart) {
+  AddKey(1, kStart - 10);
+  AddKey(2, kStart + 500);
+  EXPECT_EQ(2u, wheel_.NumOverdue(kStart));
+  AdvanceTo(kStart);
+  EXPECT_EQ(1u, deleted_);
+  AdvanceTo(kStart + 700);
+  EXPECT_EQ(2u, deleted_);
+}
+
+TEST_F(ExpireWheelTest, Budget) {
+  AdvanceTo(kStart);
+  for (uint64_t i = 0; i < 1000; ++i) {
+    AddKey(i, kStart + 100);
+  }
+  EXPECT_EQ(0u, wheel_.NumOverdue(kStart + 150));
+  EXPECT_EQ(1000u, wheel_.NumOverdue(kStart + 200));
+
+  EXPECT_EQ(100u, AdvanceTo(kStart + 200, 100));
+  EXPECT_EQ(100u, deleted_);
+  EXPECT_EQ(900u, wheel_.NumOverdue(kStart + 200));
+  while (AdvanceTo(kStart + 210, 100) > 0) {
+  }
+  EXPECT_EQ(1000u, deleted_);
+  EXPECT_EQ(0u, wheel_.NumOverdue(kStart + 210));
+}
+
+TEST_F(ExpireWheelTest, Random) {
+  // Deadlines from milliseconds to months, in all the levels and the overflow list.
+  absl::InsecureBitGen gen;
+  AdvanceTo(kStart);
+  uint64_t now = kStart;
+  uint64_t next_hash = 1;
+  for (unsigned step = 0; step < 10000; ++step) {
+    for (unsigned i = 0; i < 5; ++i) {
+      uint64_t ttl = absl::Uniform<uint64_t>(gen, 1, 1ULL << absl::Uniform(gen, 4, 32));
+      AddKey(next_hash++, now + ttl);
+    }
+    now += absl::Uniform<uint64_t>(gen, 1, 1ULL << absl::Uniform(gen, 1, 20));
+    AdvanceTo(now);
+  }
+  while (!deadlines_.empty()) {
+    now += 1 << 20;
+    AdvanceTo(now);
+  }
+  EXPECT_EQ(next_hash - 1, deleted_);
+  EXPECT_EQ(0u, wheel_.size());
+}
+
+}  // namespace dfly
@@ -10,12 +10,12 @@ namespace dfly {
 
 using namespace std;
 
-// offset, len must be multiplies of 256MB.
 void ExtentTree::Add(size_t start, size_t len) {
   DCHECK_GT(len, 0u);
   DCHECK_EQ(len_extents_.size(), extents_.size());
 
   size_t end = start + len;
+  size_ += len;
 
   if (extents_.empty()) {
     extents_.emplace(start, end);
@@ -36,7 +36,7 @@ void ExtentTree::Add(size_t start, size_t len) {
       merged = true;
       len_extents_.erase(pair{prev->second - prev->first, prev->first});
 
-      if (end == it->first) {  // [first, end = it->first, it->second)
+      if (it != extents_.end() && end == it->first) {  // [first, end = it->first, it->second)
         prev->second = it->second;
         len_extents_.erase(pair{it->second - it->first, it->first});
         extents_.erase(it);
@@ -48,7 +48,7 @@ void ExtentTree::Add(size_t start, size_t len) {
   }
 
   if (!merged) {
-    if (end == it->first) {  // [start, end), [it->first, it->second]
+    if (it != extents_.end() && end == it->first) {  // [start, end), [it->first, it->second]
       len_extents_.erase(pair{it->second - it->first, it->first});
       end = it->second;
       extents_.erase(it);
@@ -114,8 +114,40 @@ optional<pair<size_t, size_t>> ExtentTree::GetRange(size_t len, size_t align) {
   }
 
   DCHECK_EQ(range_end - aligned_start, len);
+  size_ -= len;
 
   return pair{aligned_start, range_end};
 }
 
+bool ExtentTree::Remove(size_t start, size_t len) {
+  DCHECK_GT(len, 0u);
+
+  size_t end = start + len;
+  auto it = extents_.upper_bound(start);
+  if (it == extents_.begin())
+    return false;
+
+  --it;  // it->first <= start.
+  if (it->second < end)
+    return false;
+
+  size_t extent_start = it->first, extent_end = it->second;
+  len_extents_.erase(pair{extent_end - extent_start, extent_start});
+
+  if (start > extent_start) {
+    it->second = start;
+    len_extents_.emplace(start - extent_start, extent_start);
+  } else {
+    extents_.erase(it);
+  }
+
+  if (end < extent_end) {
+    extents_.emplace(end, extent_end);
+    len_extents_.emplace(extent_end - end, end);
+  }
+  size_ -= len;
+
+  return true;
+}
+
 }  // namespace dfly
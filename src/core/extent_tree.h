@@ -19,12 +19,28 @@ class ExtentTree {
   void Add(size_t start, size_t len);
 
   // in case of success, returns (start, end) pair, where (end-start) >= len and
-  // start is aligned by align.
+  // start is aligned by align. Picks the smallest extent that fits, so that the large ones are
+  // kept for the large requests.
   std::optional<std::pair<size_t, size_t>> GetRange(size_t len, size_t align);
 
+  // Removes [start, start + len) from the tree. Returns false and does nothing if the range
+  // is not fully contained in one of the extents.
+  bool Remove(size_t start, size_t len);
+
+  // Total length of the extents.
+  size_t size() const {
+    return size_;
+  }
+
+  // Length of the largest extent, 0 if the tree is empty.
+  size_t max_extent() const {
+    return len_extents_.empty() ? 0 : len_extents_.rbegin()->first;
+  }
+
  private:
   absl::btree_map<size_t, size_t> extents_;                 // start -> end.
   absl::btree_set<std::pair<size_t, size_t>> len_extents_;  // (length, start)
+  size_t size_ = 0;
 };
 
 }  // namespace dfly
@@ -55,4 +55,41 @@ TEST_F(ExtentTreeTest, Basic) {
   EXPECT_THAT(*op, testing::Pair(60, 92));
 }
 
+TEST_F(ExtentTreeTest, Remove) {
+  tree_.Add(0, 256);
+  EXPECT_TRUE(tree_.Remove(64, 64));
+  EXPECT_FALSE(tree_.Remove(96, 8));   // already removed.
+  EXPECT_FALSE(tree_.Remove(32, 64));  // crosses the hole.
+
+  auto op = tree_.GetRange(128, 16);
+  EXPECT_TRUE(op);
+  EXPECT_THAT(*op, testing::Pair(128, 256));
+
+  EXPECT_TRUE(tree_.Remove(0, 64));
+  EXPECT_FALSE(tree_.GetRange(16, 16));
+
+  tree_.Add(0, 128);
+  op = tree_.GetRange(128, 16);
+  EXPECT_TRUE(op);
+  EXPECT_THAT(*op, testing::Pair(0, 128));
+}
+
+TEST_F(ExtentTreeTest, Coalesce) {
+  tree_.Add(0, 64);
+  tree_.Add(128, 64);  // after the last extent.
+  EXPECT_EQ(128u, tree_.size());
+  EXPECT_EQ(64u, tree_.max_extent());
+
+  tree_.Add(64, 64);  // fills the gap.
+  EXPECT_EQ(192u, tree_.size());
+  EXPECT_EQ(192u, tree_.max_extent());
+
+  // The smallest extent that fits is used.
+  EXPECT_TRUE(tree_.Remove(16, 16));
+  auto op = tree_.GetRange(16, 16);
+  ASSERT_TRUE(op);
+  EXPECT_THAT(*op, testing::Pair(0, 16));
+  EXPECT_EQ(160u, tree_.size());
+}
+
 }  // namespace dfly
@@ -346,7 +346,14 @@ int64_t ExternalAllocator::Malloc(size_t sz) {
   return seg->BlockOffset(page, pos);
 }
 
-void ExternalAllocator::Free(size_t offset, size_t sz) {
+size_t ExternalAllocator::Free(size_t offset, size_t sz) {
+  if (detail::ClassFromSize(sz) == PageClass::LARGE_P) {
+    size_t align_sz = alignup(sz, 4_KB);
+    extent_tree_.Add(offset, align_sz);  // merges with the adjacent free ranges.
+    allocated_bytes_ -= align_sz;
+    return align_sz;
+  }
+
   size_t idx = offset / 256_MB;
   size_t delta = offset % 256_MB;
   CHECK_LT(idx, segments_.size());
@@ -371,10 +378,104 @@ void ExternalAllocator::Free(size_t offset, size_t sz) {
   ++page->available;
 
   DCHECK_EQ(page->available, page->free_blocks.count());
+  allocated_bytes_ -= block_size;
+
   if (page->available == blocks_num) {
     FreePage(page, seg, block_size);
+    return page_size;
   }
-  allocated_bytes_ -= block_size;
+
+  return 0;
+}
+
+bool ExternalAllocator::Claim(size_t offset, size_t sz) {
+  PageClass pc = detail::ClassFromSize(sz);
+  if (pc == PageClass::LARGE_P) {
+    size_t align_sz = alignup(sz, 4_KB);
+    if (!extent_tree_.Remove(offset, align_sz))
+      return false;
+    allocated_bytes_ += align_sz;
+    return true;
+  }
+
+  size_t idx = offset / kSegmentSize;
+  size_t delta = offset % kSegmentSize;
+  if (segments_.size() <= idx) {
+    segments_.resize(idx + 1);
+  }
+
+  SegmentDescr* seg = segments_[idx];
+  if (!seg) {
+    if (!extent_tree_.Remove(idx * kSegmentSize, kSegmentSize))
+      return false;
+
+    unsigned num_pages = NumPagesInSegment(pc);
+    void* ptr =
+        mi_malloc_aligned(sizeof(SegmentDescr) + num_pages * sizeof(Page), kSegDescrAlignment);
+    seg = new (ptr) SegmentDescr(pc, idx * kSegmentSize, num_pages);
+    segments_[idx] = seg;
+
+    if (sq_[pc] == nullptr) {
+      sq_[pc] = seg;
+    } else {
+      sq_[pc]->LinkBefore(seg);
+    }
+  } else if (seg->page_class() != pc) {
+    return false;
+  }
+
+  unsigned page_id = delta >> seg->page_shift();
+  Page* page = seg->GetPage(page_id);
+  BinIdx bin_idx = ToBinIdx(sz);
+
+  // Claimed pages are not installed into free_pages_, so they are not used for new allocations
+  // until they are freed completely, similarly to the pages that were partially freed.
+  if (!page->segment_inuse) {
+    page->segment_inuse = 1;
+    ++seg->page_info_.used;
+    page->Init(pc, bin_idx);
+  } else if (page->block_size_bin != bin_idx) {
+    return false;
+  }
+
+  size_t block_size = ToBlockSize(bin_idx);
+  unsigned block_id = (delta % (1ULL << seg->page_shift())) / block_size;
+  if (offset != seg->BlockOffset(page, block_id) || !page->free_blocks[block_id])
+    return false;
+
+  page->free_blocks.flip(block_id);
+  --page->available;
+  allocated_bytes_ += block_size;
+
+  return true;
+}
+
+auto ExternalAllocator::GetSparsePages(double max_util, unsigned max_pages) const
+    -> vector<pair<size_t, size_t>> {
+  vector<pair<size_t, size_t>> res;
+
+  for (SegmentDescr* seg : segments_) {
+    if (!seg)
+      continue;
+
+    size_t page_size = 1ULL << seg->page_shift();
+    for (unsigned i = 0; i < seg->capacity(); ++i) {
+      if (res.size() >= max_pages)
+        return res;
+
+      Page* page = seg->GetPage(i);
+      if (!page->segment_inuse || free_pages_[page->block_size_bin] == page)
+        continue;
+
+      size_t total = page_size / ToBlockSize(page->block_size_bin);
+      size_t used = total - page->available;
+      if (used > 0 && used <= total * max_util) {
+        res.emplace_back(seg->BlockOffset(page, 0), page_size);
+      }
+    }
+  }
+
+  return res;
 }
 
 void ExternalAllocator::AddStorage(size_t start, size_t size) {
@@ -451,10 +552,11 @@ int64_t ExternalAllocator::LargeMalloc(size_t size) {
   size_t align_sz = alignup(size, 4_KB);
   auto op_range = extent_tree_.GetRange(align_sz, 4_KB);
   if (!op_range) {
-    align_sz = max(align_sz, kSegmentSize);
-    return -int64_t(align_sz);
+    // The storage grows by whole segments, like for the other classes.
+    return -int64_t(alignup(align_sz, kSegmentSize));
   }
 
+  allocated_bytes_ += align_sz;
   return op_range->first;
 }
 
@@ -5,6 +5,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 #include "core/extent_tree.h"
@@ -69,7 +70,22 @@ class ExternalAllocator {
   // size sz.
   int64_t Malloc(size_t sz);
 
-  void Free(size_t offset, size_t sz);
+  // Returns the size of the page that hosted the block if the page became unused and 0 otherwise.
+  // Pages are aligned by their size, so the page starts at offset rounded down to the result.
+  // Large blocks have a range of their own, which starts at offset and is returned to the
+  // extent tree, so the result is the size of the whole block.
+  size_t Free(size_t offset, size_t sz);
+
+  // Marks the block of size sz at offset as allocated, as if it were returned by Malloc(sz).
+  // Used to restore the allocations that are referenced by a snapshot after restart.
+  // Returns false if the block conflicts with the allocations made so far.
+  bool Claim(size_t offset, size_t sz);
+
+  // Returns upto max_pages (offset, size) ranges of the pages in use, whose ratio of used blocks
+  // is at most max_util. Partially freed pages are not reused for allocations until they become
+  // fully free, so these are the candidates for compaction. The pages that currently serve
+  // allocations are skipped.
+  std::vector<std::pair<size_t, size_t>> GetSparsePages(double max_util, unsigned max_pages) const;
 
   /// Adds backing storage to the allocator. The range should not overlap with already
   /// added storage ranges.
@@ -88,6 +104,16 @@ class ExternalAllocator {
     return allocated_bytes_;
   }
 
+  // The storage that is assigned neither to segments nor to large blocks, and its largest
+  // contiguous range. The further apart they are, the more fragmented the storage is.
+  size_t free_range_bytes() const {
+    return extent_tree_.size();
+  }
+
+  size_t max_free_range() const {
+    return extent_tree_.max_extent();
+  }
+
  private:
   class SegmentDescr;
   using Page = detail::Page;
@@ -87,6 +87,54 @@ TEST_F(ExternalAllocatorTest, Invariants) {
   }
 }
 
+TEST_F(ExternalAllocatorTest, SparsePages) {
+  ext_alloc_.AddStorage(0, kSegSize);
+  constexpr unsigned kBlocksInPage = 1_MB / kMinBlockSize;
+
+  // Fills page0 and starts page1.
+  vector<int64_t> offsets;
+  for (unsigned i = 0; i < kBlocksInPage + 10; ++i) {
+    int64_t res = ext_alloc_.Malloc(kMinBlockSize);
+    ASSERT_GE(res, 0);
+    offsets.push_back(res);
+  }
+  EXPECT_TRUE(ext_alloc_.GetSparsePages(0.5, 8).empty());
+
+  for (unsigned i = 0; i < kBlocksInPage - 10; ++i) {
+    EXPECT_EQ(0u, ext_alloc_.Free(offsets[i], kMinBlockSize));
+  }
+
+  // page1 serves allocations, hence only page0 qualifies.
+  auto pages = ext_alloc_.GetSparsePages(0.5, 8);
+  ASSERT_EQ(1u, pages.size());
+  EXPECT_EQ(0u, pages[0].first);
+  EXPECT_EQ(1_MB, pages[0].second);
+
+  for (unsigned i = kBlocksInPage - 10; i < kBlocksInPage - 1; ++i) {
+    EXPECT_EQ(0u, ext_alloc_.Free(offsets[i], kMinBlockSize));
+  }
+  EXPECT_EQ(1_MB, ext_alloc_.Free(offsets[kBlocksInPage - 1], kMinBlockSize));
+  EXPECT_TRUE(ext_alloc_.GetSparsePages(0.5, 8).empty());
+}
+
+TEST_F(ExternalAllocatorTest, Claim) {
+  ext_alloc_.AddStorage(0, kSegSize * 2);
+
+  EXPECT_TRUE(ext_alloc_.Claim(kSegSize + 4 * kMinBlockSize, kMinBlockSize));
+  EXPECT_FALSE(ext_alloc_.Claim(kSegSize + 4 * kMinBlockSize, kMinBlockSize));  // taken.
+  EXPECT_FALSE(ext_alloc_.Claim(kSegSize + 100, kMinBlockSize));  // not a block offset.
+  EXPECT_FALSE(ext_alloc_.Claim(kSegSize + 8 * kMinBlockSize, kMinBlockSize * 2));  // other bin.
+  EXPECT_FALSE(ext_alloc_.Claim(kSegSize + 16_MB, 256_KB));  // other page class.
+  EXPECT_EQ(kMinBlockSize, ext_alloc_.allocated_bytes());
+
+  // The claimed page is not reused until it is freed.
+  int64_t res = ext_alloc_.Malloc(kMinBlockSize);
+  ASSERT_GE(res, 0);
+  EXPECT_NE(size_t(res) / 1_MB, size_t(kSegSize + 4 * kMinBlockSize) / 1_MB);
+
+  EXPECT_EQ(1_MB, ext_alloc_.Free(kSegSize + 4 * kMinBlockSize, kMinBlockSize));
+}
+
 TEST_F(ExternalAllocatorTest, Classes) {
   using detail::ClassFromSize;
 
@@ -117,4 +165,32 @@ TEST_F(ExternalAllocatorTest, Classes) {
   EXPECT_EQ(1_MB + 4_KB, ExternalAllocator::GoodSize(1_MB + 1));
 }
 
+TEST_F(ExternalAllocatorTest, LargeBlocks) {
+  ext_alloc_.AddStorage(0, kSegSize);
+
+  int64_t offs1 = ext_alloc_.Malloc(2_MB);
+  int64_t offs2 = ext_alloc_.Malloc(3_MB);
+  int64_t offs3 = ext_alloc_.Malloc(2_MB);
+  ASSERT_EQ(0, offs1);
+  ASSERT_EQ(2_MB, offs2);
+  ASSERT_EQ(5_MB, offs3);
+  EXPECT_EQ(7_MB, ext_alloc_.allocated_bytes());
+  EXPECT_EQ(kSegSize - 7_MB, ext_alloc_.free_range_bytes());
+
+  // The hole of the freed block fits the next block of its size, the tail is kept.
+  EXPECT_EQ(3_MB, ext_alloc_.Free(offs2, 3_MB));
+  EXPECT_EQ(2_MB, ext_alloc_.Malloc(2_MB + 1));
+  EXPECT_EQ(kSegSize - 7_MB, ext_alloc_.max_free_range());
+
+  // Freed neighbours coalesce into a single range.
+  ext_alloc_.Free(0, 2_MB);
+  ext_alloc_.Free(2_MB, 2_MB + 1);
+  ext_alloc_.Free(offs3, 2_MB);
+  EXPECT_EQ(0u, ext_alloc_.allocated_bytes());
+  EXPECT_EQ(size_t(kSegSize), ext_alloc_.max_free_range());
+
+  // The storage grows by whole segments.
+  EXPECT_EQ(-2 * kSegSize, ext_alloc_.Malloc(kSegSize + 1));
+}
+
 }  // namespace dfly
@@ -0,0 +1,446 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/frequency_sketch.h"
+
+#include <absl/base/config.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "base/logging.h"
+#include "core/compact_object.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+static_assert(ABSL_IS_LITTLE_ENDIAN, "the serialized counters are copied as is");
+
+// The serialized forms: the header, followed by the counters or the buckets of every row
+// without the padding and, for top-k, by the top items as a length, the bytes and the count.
+constexpr char kCmsMagic[8] = {'D', 'F', 'C', 'M', 'S', 'K', 'T', '1'};
+constexpr char kTopKMagic[8] = {'D', 'F', 'T', 'O', 'P', 'K', 'S', '1'};
+
+struct CmsHeader {
+  char magic[8];
+  uint32_t width;
+  uint32_t depth;
+  uint64_t count;
+};
+
+struct TopKHeader {
+  char magic[8];
+  uint32_t k;
+  uint32_t width;
+  uint32_t depth;
+  uint32_t num_items;
+  double decay;
+};
+
+static_assert(sizeof(CmsHeader) == 24 && sizeof(TopKHeader) == 32);
+
+// The length and the count that frame every top item.
+constexpr size_t kItemOverhead = sizeof(uint32_t) + sizeof(uint64_t);
+
+constexpr size_t kDecayTableSize = 256;
+
+// Increments are applied in windows of items, whose counters are prefetched row by row.
+constexpr size_t kWindow = 64;
+
+// The finalizer of murmur3.
+uint64_t Mix(uint64_t hash) {
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+// The counter of row i for hash, by double hashing the two halves of the hash.
+inline uint32_t RowIndex(uint64_t hash, uint32_t i, uint32_t width) {
+  uint32_t h = uint32_t(hash) + i * (uint32_t(hash >> 32) | 1);
+  return (uint64_t(h) * width) >> 32;
+}
+
+inline uint32_t SaturatingAdd(uint32_t a, uint64_t b) {
+  return min<uint64_t>(a + b, UINT32_MAX);
+}
+
+// Copies the parts of the serialized form at pos that are in [offset, offset + len).
+class Emitter {
+ public:
+  Emitter(size_t offset, size_t len, char* dest) : offset_(offset), len_(len), dest_(dest) {
+  }
+
+  void Emit(const void* src, size_t n) {
+    size_t begin = max(pos_, offset_), end = min(pos_ + n, offset_ + len_);
+    if (begin < end)
+      memcpy(dest_ + (begin - offset_), static_cast<const char*>(src) + (begin - pos_),
+             end - begin);
+    pos_ += n;
+  }
+
+  // Whether the rest of the serialized form is out of range.
+  bool Done() const {
+    return pos_ >= offset_ + len_;
+  }
+
+ private:
+  size_t pos_ = 0;
+  size_t offset_, len_;
+  char* dest_;
+};
+
+}  // namespace
+
+CmsSketch::CmsSketch(pmr::memory_resource* mr) : mr_(mr) {
+}
+
+CmsSketch::~CmsSketch() {
+  Clear();
+}
+
+void CmsSketch::Clear() {
+  if (counters_)
+    mr_->deallocate(counters_, CountersSize(width_, depth_), kRowAlign);
+  counters_ = nullptr;
+  width_ = depth_ = 0;
+  count_ = 0;
+}
+
+size_t CmsSketch::CountersSize(uint32_t width, uint32_t depth) {
+  constexpr size_t kRowCounters = kRowAlign / sizeof(uint32_t);
+  size_t stride = (size_t(width) + kRowCounters - 1) / kRowCounters * kRowCounters;
+  return stride * depth * sizeof(uint32_t);
+}
+
+size_t CmsSketch::RowStride() const {
+  return depth_ ? CountersSize(width_, 1) / sizeof(uint32_t) : 0;
+}
+
+void CmsSketch::Init(uint32_t width, uint32_t depth) {
+  DCHECK(width > 0 && depth > 0);
+
+  Clear();
+  size_t bytes = CountersSize(width, depth);
+  counters_ = static_cast<uint32_t*>(mr_->allocate(bytes, kRowAlign));
+  memset(counters_, 0, bytes);
+  width_ = width;
+  depth_ = depth;
+}
+
+pair<uint32_t, uint32_t> CmsSketch::Dimensions(double error, double probability) {
+  // Like RedisBloom: every row overestimates by more than error * count with a chance of 1/2.
+  double width = ceil(2 / error);
+  double depth = ceil(log(probability) / log(0.5));
+  return {clamp<double>(width, 1, UINT32_MAX), clamp<double>(depth, 1, UINT32_MAX)};
+}
+
+bool CmsSketch::HasMagic(string_view str) {
+  return str.size() >= sizeof(CmsHeader) && memcmp(str.data(), kCmsMagic, sizeof(kCmsMagic)) == 0;
+}
+
+bool CmsSketch::Parse(string_view str) {
+  Clear();
+  if (!HasMagic(str))
+    return false;
+
+  CmsHeader header;
+  memcpy(&header, str.data(), sizeof(header));
+  str.remove_prefix(sizeof(header));
+  size_t row_bytes = size_t(header.width) * sizeof(uint32_t);
+  if (header.width == 0 || header.depth == 0 || str.size() / row_bytes != header.depth ||
+      str.size() % row_bytes != 0) {
+    return false;
+  }
+
+  Init(header.width, header.depth);
+  count_ = header.count;
+  for (uint32_t i = 0; i < depth_; ++i)
+    memcpy(Row(i), str.data() + i * row_bytes, row_bytes);
+  return true;
+}
+
+void CmsSketch::IncrBy(absl::Span<const string_view> items, const uint32_t* incr, uint64_t* res) {
+  uint64_t hashes[kWindow];
+  for (size_t start = 0; start < items.size(); start += kWindow) {
+    size_t len = min(kWindow, items.size() - start);
+    for (size_t j = 0; j < len; ++j) {
+      hashes[j] = CompactObj::HashCode(items[start + j]);
+      count_ += incr[start + j];
+    }
+
+    // The items of a window are applied to a row in order, so an item that repeats within the
+    // batch sees the increments of its previous occurrences, like with sequential updates.
+    for (uint32_t i = 0; i < depth_; ++i) {
+      uint32_t* row = Row(i);
+      uint32_t index[kWindow];
+      for (size_t j = 0; j < len; ++j) {
+        index[j] = RowIndex(hashes[j], i, width_);
+        __builtin_prefetch(row + index[j]);
+      }
+
+      for (size_t j = 0; j < len; ++j) {
+        uint32_t val = row[index[j]] = SaturatingAdd(row[index[j]], incr[start + j]);
+        res[start + j] = i == 0 ? val : min<uint64_t>(res[start + j], val);
+      }
+    }
+  }
+}
+
+void CmsSketch::Query(absl::Span<const string_view> items, uint64_t* res) const {
+  for (size_t j = 0; j < items.size(); ++j) {
+    uint64_t hash = CompactObj::HashCode(items[j]);
+    uint32_t val = UINT32_MAX;
+    for (uint32_t i = 0; i < depth_; ++i)
+      val = min(val, Row(i)[RowIndex(hash, i, width_)]);
+    res[j] = val;
+  }
+}
+
+void CmsSketch::AddWeighted(int64_t weight, absl::Span<int64_t> sums) const {
+  DCHECK_EQ(sums.size(), size_t(width_) * depth_ + 1);
+
+  auto add = [weight](int64_t* sum, uint64_t val) {
+    int64_t product, res;
+    if (__builtin_mul_overflow(int64_t(val), weight, &product) ||
+        __builtin_add_overflow(*sum, product, &res)) {
+      res = (weight > 0) ? INT64_MAX : INT64_MIN;
+    }
+    *sum = res;
+  };
+
+  for (uint32_t i = 0; i < depth_; ++i) {
+    const uint32_t* row = Row(i);
+    int64_t* dest = sums.data() + size_t(i) * width_;
+    for (uint32_t j = 0; j < width_; ++j)
+      add(dest + j, row[j]);
+  }
+  add(&sums.back(), min<uint64_t>(count_, INT64_MAX));
+}
+
+void CmsSketch::Assign(absl::Span<const int64_t> sums) {
+  DCHECK_EQ(sums.size(), size_t(width_) * depth_ + 1);
+
+  for (uint32_t i = 0; i < depth_; ++i) {
+    uint32_t* row = Row(i);
+    const int64_t* src = sums.data() + size_t(i) * width_;
+    for (uint32_t j = 0; j < width_; ++j)
+      row[j] = clamp<int64_t>(src[j], 0, UINT32_MAX);
+  }
+  count_ = max<int64_t>(sums.back(), 0);
+}
+
+size_t CmsSketch::Size() const {
+  return sizeof(CmsHeader) + size_t(width_) * depth_ * sizeof(uint32_t);
+}
+
+void CmsSketch::Materialize(size_t offset, size_t len, char* dest) const {
+  DCHECK_LE(offset + len, Size());
+
+  CmsHeader header;
+  memcpy(header.magic, kCmsMagic, sizeof(kCmsMagic));
+  header.width = width_;
+  header.depth = depth_;
+  header.count = count_;
+
+  Emitter emitter(offset, len, dest);
+  emitter.Emit(&header, sizeof(header));
+  for (uint32_t i = 0; i < depth_ && !emitter.Done(); ++i)
+    emitter.Emit(Row(i), size_t(width_) * sizeof(uint32_t));
+}
+
+TopKSketch::TopKSketch(pmr::memory_resource* mr) : mr_(mr), top_(1) {
+}
+
+TopKSketch::~TopKSketch() {
+  Clear();
+}
+
+void TopKSketch::Clear() {
+  if (buckets_)
+    mr_->deallocate(buckets_, BucketsSize(width_, depth_), CmsSketch::kRowAlign);
+  buckets_ = nullptr;
+  k_ = width_ = depth_ = 0;
+  top_.Clear();
+  top_bytes_ = 0;
+}
+
+size_t TopKSketch::BucketsSize(uint32_t width, uint32_t depth) {
+  return size_t(width) * depth * sizeof(Bucket);
+}
+
+void TopKSketch::Init(uint32_t k, uint32_t width, uint32_t depth, double decay) {
+  DCHECK(k > 0 && width > 0 && depth > 0);
+  DCHECK(decay > 0 && decay <= 1);
+
+  Clear();
+  size_t bytes = BucketsSize(width, depth);
+  buckets_ = static_cast<Bucket*>(mr_->allocate(bytes, CmsSketch::kRowAlign));
+  memset(buckets_, 0, bytes);
+  k_ = k;
+  width_ = width;
+  depth_ = depth;
+  decay_ = decay;
+  top_ = TopKeys(k);
+
+  decay_table_.resize(kDecayTableSize);
+  for (size_t i = 0; i < kDecayTableSize; ++i)
+    decay_table_[i] = pow(decay, i);
+}
+
+bool TopKSketch::HasMagic(string_view str) {
+  return str.size() >= sizeof(TopKHeader) &&
+         memcmp(str.data(), kTopKMagic, sizeof(kTopKMagic)) == 0;
+}
+
+bool TopKSketch::Parse(string_view str) {
+  Clear();
+  if (!HasMagic(str))
+    return false;
+
+  TopKHeader header;
+  memcpy(&header, str.data(), sizeof(header));
+  str.remove_prefix(sizeof(header));
+  size_t bytes = BucketsSize(header.width, header.depth);
+  if (header.k == 0 || header.width == 0 || header.depth == 0 ||
+      !(header.decay > 0 && header.decay <= 1) || header.num_items > header.k ||
+      str.size() / sizeof(Bucket) / header.width < header.depth) {
+    return false;
+  }
+
+  Init(header.k, header.width, header.depth, header.decay);
+  memcpy(buckets_, str.data(), bytes);
+  str.remove_prefix(bytes);
+
+  for (uint32_t i = 0; i < header.num_items; ++i) {
+    uint32_t item_len;
+    uint64_t count;
+    if (str.size() < kItemOverhead)
+      break;
+    memcpy(&item_len, str.data(), sizeof(item_len));
+    if (str.size() - kItemOverhead < item_len)
+      break;
+
+    string_view item = str.substr(sizeof(item_len), item_len);
+    memcpy(&count, str.data() + sizeof(item_len) + item_len, sizeof(count));
+    if (top_.Contains(item))
+      break;
+    top_.Offer(item, count);
+    top_bytes_ += kItemOverhead + item_len;
+    str.remove_prefix(kItemOverhead + item_len);
+  }
+
+  if (top_.size() != header.num_items || !str.empty()) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+uint32_t TopKSketch::Increment(uint64_t hash, uint32_t incr) {
+  uint32_t fingerprint = Mix(hash);
+  uint32_t max_count = 0;
+  for (uint32_t i = 0; i < depth_; ++i) {
+    Bucket& bucket = Row(i)[RowIndex(hash, i, width_)];
+    if (bucket.count == 0) {
+      bucket.fingerprint = fingerprint;
+      bucket.count = incr;
+    } else if (bucket.fingerprint == fingerprint) {
+      bucket.count = SaturatingAdd(bucket.count, incr);
+    } else {
+      // Every unit of the increment decays the bucket with probability decay^count, and the
+      // rest of the increment goes to the item once the count reaches 0.
+      for (uint32_t j = 0; j < incr; ++j) {
+        double chance = bucket.count < kDecayTableSize ? decay_table_[bucket.count]
+                                                       : pow(decay_, bucket.count);
+        uint64_t rnd = Mix(hash ^ (uint64_t(i) << 32 | bucket.count) ^ Mix(j + 1));
+        if ((rnd >> 11) * 0x1.0p-53 >= chance)
+          continue;
+        if (--bucket.count == 0) {
+          bucket.fingerprint = fingerprint;
+          bucket.count = incr - j;
+          break;
+        }
+      }
+      if (bucket.fingerprint != fingerprint)
+        continue;
+    }
+    max_count = max(max_count, bucket.count);
+  }
+  return max_count;
+}
+
+void TopKSketch::IncrBy(absl::Span<const string_view> items, const uint32_t* incr,
+                        optional<string>* expelled) {
+  uint64_t hashes[kWindow];
+  for (size_t start = 0; start < items.size(); start += kWindow) {
+    size_t len = min(kWindow, items.size() - start);
+    for (size_t j = 0; j < len; ++j) {
+      hashes[j] = CompactObj::HashCode(items[start + j]);
+      for (uint32_t i = 0; i < depth_; ++i)
+        __builtin_prefetch(Row(i) + RowIndex(hashes[j], i, width_));
+    }
+
+    // Sequentially, since an item may repeat within the batch or expel a previous one.
+    for (size_t j = 0; j < len; ++j) {
+      string_view item = items[start + j];
+      uint32_t count = Increment(hashes[j], incr[start + j]);
+      expelled[start + j].reset();
+      if (count < top_.threshold())
+        continue;
+
+      bool member = top_.Contains(item);
+      string evicted;
+      if (top_.Offer(item, count, &evicted)) {
+        top_bytes_ -= kItemOverhead + evicted.size();
+        expelled[start + j] = std::move(evicted);
+      }
+      if (!member && top_.Contains(item))
+        top_bytes_ += kItemOverhead + item.size();
+    }
+  }
+}
+
+size_t TopKSketch::Size() const {
+  return sizeof(TopKHeader) + BucketsSize(width_, depth_) + top_bytes_;
+}
+
+void TopKSketch::Materialize(size_t offset, size_t len, char* dest) const {
+  DCHECK_LE(offset + len, Size());
+
+  TopKHeader header;
+  memcpy(header.magic, kTopKMagic, sizeof(kTopKMagic));
+  header.k = k_;
+  header.width = width_;
+  header.depth = depth_;
+  header.num_items = top_.size();
+  header.decay = decay_;
+
+  Emitter emitter(offset, len, dest);
+  emitter.Emit(&header, sizeof(header));
+  emitter.Emit(buckets_, BucketsSize(width_, depth_));
+  if (emitter.Done())
+    return;
+
+  // The items are emitted by descending count, which is the same order while the sketch is
+  // not modified.
+  for (const TopKeys::Entry& entry : List()) {
+    uint32_t item_len = entry.key.size();
+    emitter.Emit(&item_len, sizeof(item_len));
+    emitter.Emit(entry.key.data(), item_len);
+    emitter.Emit(&entry.count, sizeof(entry.count));
+  }
+}
+
+size_t TopKSketch::MallocUsed() const {
+  // The items of top_ are allocated by std::allocator, in nodes of about their serialized size.
+  return BucketsSize(width_, depth_) + decay_table_.capacity() * sizeof(double) + top_bytes_ +
+         top_.size() * 3 * sizeof(void*);
+}
+
+}  // namespace dfly
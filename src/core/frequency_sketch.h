@@ -0,0 +1,205 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/top_keys.h"
+
+namespace dfly {
+
+// The count-min sketch of the CMS commands: depth rows of width 32-bit counters, where an item
+// increments one counter per row and its count is estimated by the minimum of its counters.
+// Unlike the 4-bit CountMinSketch of the eviction policy, the counters do not age, and they
+// saturate at UINT32_MAX. Every row is padded and aligned to a cache line. Items are hashed with
+// CompactObj::HashCode, and a single 64-bit hash selects the counter of every row.
+//
+// The sketch is stored as a string value (see CompactObj::GetCmsSketch), whose raw bytes are its
+// serialized form, i.e. the RDB files and the replication transfer it as a string.
+class CmsSketch {
+ public:
+  static constexpr size_t kRowAlign = 64;
+
+  explicit CmsSketch(std::pmr::memory_resource* mr);
+  ~CmsSketch();
+
+  CmsSketch(const CmsSketch&) = delete;
+  void operator=(const CmsSketch&) = delete;
+
+  // Resets the sketch to zero counters. width and depth must be positive.
+  void Init(uint32_t width, uint32_t depth);
+
+  // The width and depth for an overestimate of at most error times the total count, which is
+  // exceeded with the given probability - see CMS.INITBYPROB.
+  static std::pair<uint32_t, uint32_t> Dimensions(double error, double probability);
+
+  // The bytes of the counters of a sketch with the given dimensions.
+  static size_t CountersSize(uint32_t width, uint32_t depth);
+
+  // Replaces the sketch with the one serialized in str. Returns false if str is not a valid
+  // serialized sketch, in which case the sketch is left empty.
+  bool Parse(std::string_view str);
+
+  // Whether str starts like a serialized sketch.
+  static bool HasMagic(std::string_view str);
+
+  // Increments the counters of items[i] by incr[i] and writes the estimate of every item after
+  // its increment to res. The items are hashed upfront, and the increments are applied one row
+  // at a time, so that every row is scanned once per batch.
+  void IncrBy(absl::Span<const std::string_view> items, const uint32_t* incr, uint64_t* res);
+
+  void Query(absl::Span<const std::string_view> items, uint64_t* res) const;
+
+  // For CMS.MERGE: adds weight times the counters to sums, which holds width * depth entries row
+  // by row, followed by the count. The sums saturate.
+  void AddWeighted(int64_t weight, absl::Span<int64_t> sums) const;
+
+  // Sets the counters and the count to sums, as added by AddWeighted, and clamps them to the range
+  // of the counters.
+  void Assign(absl::Span<const int64_t> sums);
+
+  uint32_t width() const {
+    return width_;
+  }
+
+  uint32_t depth() const {
+    return depth_;
+  }
+
+  // The sum of all the increments.
+  uint64_t count() const {
+    return count_;
+  }
+
+  // The length of the serialized form.
+  size_t Size() const;
+
+  // Writes len bytes of the serialized form from offset to dest.
+  // offset + len must not exceed Size().
+  void Materialize(size_t offset, size_t len, char* dest) const;
+
+  size_t MallocUsed() const {
+    return CountersSize(width_, depth_);
+  }
+
+ private:
+  // The counters of a row are padded to the next cache line.
+  size_t RowStride() const;
+
+  uint32_t* Row(uint32_t i) const {
+    return counters_ + i * RowStride();
+  }
+
+  void Clear();
+
+  std::pmr::memory_resource* mr_;
+  uint32_t* counters_ = nullptr;
+  uint32_t width_ = 0;
+  uint32_t depth_ = 0;
+  uint64_t count_ = 0;
+};
+
+// The top-k sketch of the TOPK commands, i.e. HeavyKeeper of "HeavyKeeper: An Accurate Algorithm
+// for Finding Top-k Elephant Flows" (Gong et al.), as in RedisBloom. depth rows of width buckets
+// count the item fingerprints, where a colliding item decays the count of a bucket with
+// probability decay^count until it takes the bucket over. The k items with the highest counts
+// are kept in a TopKeys set. The decay is decided by a hash of the item and of the bucket rather
+// than by a random number, so that a replica that applies the same commands has the same sketch.
+//
+// The sketch is stored as a string value like CmsSketch (see CompactObj::GetTopKSketch).
+class TopKSketch {
+ public:
+  // The defaults of RedisBloom.
+  static constexpr uint32_t kDefaultWidth = 8;
+  static constexpr uint32_t kDefaultDepth = 7;
+  static constexpr double kDefaultDecay = 0.9;
+
+  explicit TopKSketch(std::pmr::memory_resource* mr);
+  ~TopKSketch();
+
+  TopKSketch(const TopKSketch&) = delete;
+  void operator=(const TopKSketch&) = delete;
+
+  // Resets the sketch to an empty one. k, width and depth must be positive and decay in (0, 1].
+  void Init(uint32_t k, uint32_t width, uint32_t depth, double decay);
+
+  // The bytes of the buckets of a sketch with the given dimensions.
+  static size_t BucketsSize(uint32_t width, uint32_t depth);
+
+  bool Parse(std::string_view str);
+  static bool HasMagic(std::string_view str);
+
+  // Increments items[i] by incr[i]. Writes to expelled[i] the item that dropped out of the top
+  // items to make room for items[i], if any.
+  void IncrBy(absl::Span<const std::string_view> items, const uint32_t* incr,
+              std::optional<std::string>* expelled);
+
+  // Whether item is one of the top items.
+  bool Contains(std::string_view item) const {
+    return top_.Contains(item);
+  }
+
+  // The top items by descending count.
+  std::vector<TopKeys::Entry> List() const {
+    return top_.Top(k_);
+  }
+
+  uint32_t k() const {
+    return k_;
+  }
+
+  uint32_t width() const {
+    return width_;
+  }
+
+  uint32_t depth() const {
+    return depth_;
+  }
+
+  double decay() const {
+    return decay_;
+  }
+
+  size_t Size() const;
+  void Materialize(size_t offset, size_t len, char* dest) const;
+  size_t MallocUsed() const;
+
+ private:
+  struct Bucket {
+    uint32_t fingerprint;
+    uint32_t count;
+  };
+
+  // Returns the count of the item with hash after it is incremented by incr.
+  uint32_t Increment(uint64_t hash, uint32_t incr);
+
+  Bucket* Row(uint32_t i) const {
+    return buckets_ + size_t(i) * width_;
+  }
+
+  void Clear();
+
+  std::pmr::memory_resource* mr_;
+  Bucket* buckets_ = nullptr;
+  uint32_t k_ = 0;
+  uint32_t width_ = 0;
+  uint32_t depth_ = 0;
+  double decay_ = kDefaultDecay;
+
+  // decay^count for the small counts, the chance that a collision decays a bucket.
+  std::vector<double> decay_table_;
+
+  TopKeys top_;
+  size_t top_bytes_ = 0;  // the serialized length of the items of top_.
+};
+
+}  // namespace dfly
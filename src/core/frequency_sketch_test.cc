@@ -0,0 +1,254 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/frequency_sketch.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+template <typename T> string Serialize(const T& sketch) {
+  string res(sketch.Size(), '\0');
+  sketch.Materialize(0, res.size(), res.data());
+  return res;
+}
+
+class CmsSketchTest : public ::testing::Test {
+ protected:
+  CmsSketchTest() : cms_(pmr::get_default_resource()) {
+  }
+
+  uint64_t IncrBy(string_view item, uint32_t incr) {
+    uint64_t res;
+    cms_.IncrBy({item}, &incr, &res);
+    return res;
+  }
+
+  uint64_t Query(string_view item) const {
+    uint64_t res;
+    cms_.Query({item}, &res);
+    return res;
+  }
+
+  CmsSketch cms_;
+};
+
+TEST_F(CmsSketchTest, Basic) {
+  cms_.Init(100, 4);
+  EXPECT_EQ(100u, cms_.width());
+  EXPECT_EQ(4u, cms_.depth());
+  EXPECT_EQ(0u, Query("a"));
+
+  EXPECT_EQ(5u, IncrBy("a", 5));
+  EXPECT_EQ(7u, IncrBy("a", 2));
+  EXPECT_EQ(1u, IncrBy("b", 1));
+  EXPECT_EQ(7u, Query("a"));
+  EXPECT_EQ(8u, cms_.count());
+
+  // The counters saturate.
+  EXPECT_EQ(UINT32_MAX, IncrBy("c", UINT32_MAX));
+  EXPECT_EQ(UINT32_MAX, IncrBy("c", 1));
+
+  auto [width, depth] = CmsSketch::Dimensions(0.001, 0.01);
+  EXPECT_EQ(2000u, width);
+  EXPECT_EQ(7u, depth);
+}
+
+TEST_F(CmsSketchTest, Batch) {
+  cms_.Init(1000, 5);
+
+  // The batch gives the same estimates as the increments one by one, also when an item repeats.
+  CmsSketch expected(pmr::get_default_resource());
+  expected.Init(1000, 5);
+  vector<string> storage;
+  for (unsigned i = 0; i < 300; ++i)
+    storage.push_back(absl::StrCat("item:", i % 170));
+  vector<string_view> items(storage.begin(), storage.end());
+  vector<uint32_t> incr(items.size());
+  for (size_t i = 0; i < incr.size(); ++i)
+    incr[i] = i % 7 + 1;
+
+  vector<uint64_t> res(items.size());
+  cms_.IncrBy(items, incr.data(), res.data());
+  for (size_t i = 0; i < items.size(); ++i) {
+    uint64_t val;
+    expected.IncrBy({items[i]}, &incr[i], &val);
+    EXPECT_EQ(val, res[i]) << i;
+  }
+  EXPECT_EQ(Serialize(expected), Serialize(cms_));
+
+  // The estimates never undercount, and they are exact for most items of a sparse sketch.
+  unsigned exact = 0;
+  for (unsigned i = 0; i < 170; ++i) {
+    uint64_t actual = 0;
+    for (size_t j = i; j < items.size(); j += 170)
+      actual += incr[j];
+    uint64_t estimate = Query(absl::StrCat("item:", i));
+    EXPECT_GE(estimate, actual);
+    exact += estimate == actual;
+  }
+  EXPECT_GT(exact, 160u);
+}
+
+TEST_F(CmsSketchTest, Merge) {
+  cms_.Init(50, 3);
+  CmsSketch src(pmr::get_default_resource());
+  src.Init(50, 3);
+  IncrBy("a", 10);
+  uint32_t incr = 4;
+  uint64_t res;
+  src.IncrBy({"a"}, &incr, &res);
+
+  vector<int64_t> sums(50 * 3 + 1);
+  cms_.AddWeighted(1, absl::MakeSpan(sums));
+  src.AddWeighted(2, absl::MakeSpan(sums));
+  cms_.Assign(sums);
+  EXPECT_EQ(18u, Query("a"));
+  EXPECT_EQ(18u, cms_.count());
+
+  // Negative weights do not go below 0.
+  src.AddWeighted(-10, absl::MakeSpan(sums));
+  cms_.Assign(sums);
+  EXPECT_EQ(0u, Query("a"));
+  EXPECT_EQ(0u, cms_.count());
+
+  // The sums saturate.
+  src.AddWeighted(INT64_MAX, absl::MakeSpan(sums));
+  src.AddWeighted(INT64_MAX, absl::MakeSpan(sums));
+  cms_.Assign(sums);
+  EXPECT_EQ(UINT32_MAX, Query("a"));
+}
+
+TEST_F(CmsSketchTest, Serialization) {
+  cms_.Init(33, 3);
+  for (unsigned i = 0; i < 100; ++i)
+    IncrBy(absl::StrCat(i), i);
+
+  string raw = Serialize(cms_);
+  EXPECT_EQ(24u + 33 * 3 * 4, raw.size());
+  EXPECT_TRUE(CmsSketch::HasMagic(raw));
+
+  CmsSketch parsed(pmr::get_default_resource());
+  ASSERT_TRUE(parsed.Parse(raw));
+  EXPECT_EQ(33u, parsed.width());
+  EXPECT_EQ(cms_.count(), parsed.count());
+  EXPECT_EQ(raw, Serialize(parsed));
+
+  // Parts of the serialized form.
+  string part(50, '\0');
+  cms_.Materialize(20, 50, part.data());
+  EXPECT_EQ(raw.substr(20, 50), part);
+
+  EXPECT_FALSE(parsed.Parse(raw.substr(0, raw.size() - 4)));
+  EXPECT_FALSE(parsed.Parse(raw + "x"));
+  EXPECT_FALSE(parsed.Parse("DFCMSKT1"));
+  EXPECT_FALSE(CmsSketch::HasMagic("foo"));
+}
+
+class TopKSketchTest : public ::testing::Test {
+ protected:
+  TopKSketchTest() : topk_(pmr::get_default_resource()) {
+  }
+
+  // Adds item incr times and returns the expelled item, if any.
+  optional<string> Add(string_view item, uint32_t incr = 1) {
+    optional<string> expelled;
+    topk_.IncrBy({item}, &incr, &expelled);
+    return expelled;
+  }
+
+  vector<string> List() const {
+    vector<string> res;
+    for (const auto& e : topk_.List())
+      res.push_back(e.key);
+    return res;
+  }
+
+  TopKSketch topk_;
+};
+
+TEST_F(TopKSketchTest, Basic) {
+  topk_.Init(2, 8, 7, 0.9);
+  EXPECT_EQ(2u, topk_.k());
+  EXPECT_TRUE(List().empty());
+
+  EXPECT_EQ(nullopt, Add("a", 10));
+  EXPECT_EQ(nullopt, Add("b", 5));
+  EXPECT_TRUE(topk_.Contains("a"));
+  EXPECT_FALSE(topk_.Contains("c"));
+  EXPECT_EQ(List(), (vector<string>{"a", "b"}));
+  EXPECT_EQ(10u, topk_.List()[0].count);
+
+  // c overtakes b, which is expelled.
+  EXPECT_EQ(nullopt, Add("c", 3));
+  EXPECT_EQ("b", Add("c", 3));
+  EXPECT_EQ(List(), (vector<string>{"a", "c"}));
+}
+
+TEST_F(TopKSketchTest, HeavyHitters) {
+  topk_.Init(10, 100, 5, 0.9);
+
+  // 10 items get 50 times the accesses of the 1000 others.
+  vector<string> storage;
+  for (unsigned round = 0; round < 50; ++round) {
+    for (unsigned i = 0; i < 10; ++i)
+      storage.push_back(absl::StrCat("heavy:", i));
+    for (unsigned i = 0; i < 20; ++i)
+      storage.push_back(absl::StrCat("light:", round * 20 + i));
+  }
+  vector<string_view> items(storage.begin(), storage.end());
+  vector<uint32_t> incr(items.size(), 1);
+  vector<optional<string>> expelled(items.size());
+  topk_.IncrBy(items, incr.data(), expelled.data());
+
+  unsigned heavy = 0;
+  for (const string& item : List())
+    heavy += absl::StartsWith(item, "heavy:");
+  EXPECT_GE(heavy, 9u);
+}
+
+TEST_F(TopKSketchTest, Serialization) {
+  topk_.Init(5, 16, 4, 0.95);
+  for (unsigned i = 0; i < 100; ++i)
+    Add(absl::StrCat("item:", i % 13), i % 4 + 1);
+  ASSERT_EQ(5u, topk_.List().size());
+
+  string raw = Serialize(topk_);
+  EXPECT_TRUE(TopKSketch::HasMagic(raw));
+  EXPECT_FALSE(CmsSketch::HasMagic(raw));
+
+  TopKSketch parsed(pmr::get_default_resource());
+  ASSERT_TRUE(parsed.Parse(raw));
+  EXPECT_EQ(5u, parsed.k());
+  EXPECT_EQ(0.95, parsed.decay());
+  EXPECT_EQ(raw, Serialize(parsed));
+
+  string part(40, '\0');
+  topk_.Materialize(raw.size() - 40, 40, part.data());
+  EXPECT_EQ(raw.substr(raw.size() - 40), part);
+
+  // Both sketches continue identically, i.e. the decay is deterministic.
+  for (unsigned i = 0; i < 100; ++i) {
+    string item = absl::StrCat("other:", i % 17);
+    uint32_t incr = 3;
+    optional<string> a, b;
+    topk_.IncrBy({item}, &incr, &a);
+    parsed.IncrBy({item}, &incr, &b);
+    EXPECT_EQ(a, b);
+  }
+  EXPECT_EQ(Serialize(topk_), Serialize(parsed));
+
+  EXPECT_FALSE(parsed.Parse(raw.substr(0, raw.size() - 1)));
+  EXPECT_FALSE(parsed.Parse(raw + "x"));
+}
+
+}  // namespace dfly
@@ -0,0 +1,391 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace dfly {
+
+namespace {
+
+// The constants of Redis, so that the distances and the search areas match its replies.
+constexpr double kEarthRadius = 6372797.560856;
+constexpr double kMercatorMax = 20037726.37;
+constexpr double kLongScale = kGeoLongMax - kGeoLongMin;
+constexpr double kLatScale = kGeoLatMax - kGeoLatMin;
+constexpr double kCells = 1 << kGeoStep;
+constexpr unsigned kHashBits = kGeoStep * 2;
+
+constexpr uint64_t kEvenBits = 0x5555555555555555ULL;
+constexpr uint64_t kOddBits = 0xaaaaaaaaaaaaaaaaULL;
+
+double DegToRad(double deg) {
+  return deg * (M_PI / 180.0);
+}
+
+double RadToDeg(double rad) {
+  return rad / (M_PI / 180.0);
+}
+
+// Spreads the bits of x to the even positions of the result, and those of y to the odd ones.
+uint64_t Interleave(uint64_t x, uint64_t y) {
+  static constexpr uint64_t kMasks[] = {0x5555555555555555ULL, 0x3333333333333333ULL,
+                                        0x0F0F0F0F0F0F0F0FULL, 0x00FF00FF00FF00FFULL,
+                                        0x0000FFFF0000FFFFULL};
+  for (int i = 4; i >= 0; --i) {
+    x = (x | (x << (1 << i))) & kMasks[i];
+    y = (y | (y << (1 << i))) & kMasks[i];
+  }
+  return x | (y << 1);
+}
+
+// The inverse of Interleave, with x in the low half of the result and y in the high one.
+uint64_t Deinterleave(uint64_t bits) {
+  static constexpr uint64_t kMasks[] = {0x5555555555555555ULL, 0x3333333333333333ULL,
+                                        0x0F0F0F0F0F0F0F0FULL, 0x00FF00FF00FF00FFULL,
+                                        0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL};
+  uint64_t x = bits & kMasks[0];
+  uint64_t y = (bits >> 1) & kMasks[0];
+  for (unsigned i = 1; i < 6; ++i) {
+    x = (x | (x >> (1 << (i - 1)))) & kMasks[i];
+    y = (y | (y >> (1 << (i - 1)))) & kMasks[i];
+  }
+  return x | (y << 32);
+}
+
+// The offsets are computed like in Redis, so that the vector kernels round identically.
+uint64_t EncodePoint(GeoPoint p) {
+  double lat_offset = (p.lat - kGeoLatMin) / kLatScale * kCells;
+  double lon_offset = (p.lon - kGeoLongMin) / kLongScale * kCells;
+  return Interleave(uint32_t(lat_offset), uint32_t(lon_offset));
+}
+
+GeoPoint DecodePoint(uint64_t hash) {
+  uint64_t sep = Deinterleave(hash);
+  double lat = double(uint32_t(sep));
+  double lon = double(sep >> 32);
+
+  double lat_min = kGeoLatMin + lat / kCells * kLatScale;
+  double lat_max = kGeoLatMin + (lat + 1) / kCells * kLatScale;
+  double lon_min = kGeoLongMin + lon / kCells * kLongScale;
+  double lon_max = kGeoLongMin + (lon + 1) / kCells * kLongScale;
+  return {std::min((lon_min + lon_max) / 2, kGeoLongMax),
+          std::min((lat_min + lat_max) / 2, kGeoLatMax)};
+}
+
+void EncodeScalar(const GeoPoint* points, size_t count, uint64_t* hashes) {
+  for (size_t i = 0; i < count; ++i)
+    hashes[i] = EncodePoint(points[i]);
+}
+
+void DecodeScalar(const uint64_t* hashes, size_t count, GeoPoint* points) {
+  for (size_t i = 0; i < count; ++i)
+    points[i] = DecodePoint(hashes[i]);
+}
+
+#if defined(__x86_64__)
+
+// The cell offsets are below 2^27, so they convert between doubles and 32-bit integers, which
+// AVX2 supports, and are widened to 64 bits for the interleaving.
+__attribute__((target("avx2"))) __m256i InterleaveAvx2(__m256i x, __m256i y) {
+  const __m256i masks[] = {_mm256_set1_epi64x(0x5555555555555555ULL),
+                           _mm256_set1_epi64x(0x3333333333333333ULL),
+                           _mm256_set1_epi64x(0x0F0F0F0F0F0F0F0FULL),
+                           _mm256_set1_epi64x(0x00FF00FF00FF00FFULL),
+                           _mm256_set1_epi64x(0x0000FFFF0000FFFFULL)};
+  for (int i = 4; i >= 0; --i) {
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 1 << i)), masks[i]);
+    y = _mm256_and_si256(_mm256_or_si256(y, _mm256_slli_epi64(y, 1 << i)), masks[i]);
+  }
+  return _mm256_or_si256(x, _mm256_slli_epi64(y, 1));
+}
+
+__attribute__((target("avx2"))) void EncodeAvx2(const GeoPoint* points, size_t count,
+                                                uint64_t* hashes) {
+  const __m256d lat_min = _mm256_set1_pd(kGeoLatMin), lat_scale = _mm256_set1_pd(kLatScale);
+  const __m256d lon_min = _mm256_set1_pd(kGeoLongMin), lon_scale = _mm256_set1_pd(kLongScale);
+  const __m256d cells = _mm256_set1_pd(kCells);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const double* src = &points[i].lon;
+    __m256d p01 = _mm256_loadu_pd(src), p23 = _mm256_loadu_pd(src + 4);
+
+    // The unpacks give the lanes in the order 0, 2, 1, 3, which the permutes restore.
+    __m256d lon = _mm256_permute4x64_pd(_mm256_unpacklo_pd(p01, p23), 0xD8);
+    __m256d lat = _mm256_permute4x64_pd(_mm256_unpackhi_pd(p01, p23), 0xD8);
+    lon = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(lon, lon_min), lon_scale), cells);
+    lat = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(lat, lat_min), lat_scale), cells);
+
+    __m256i x = _mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(lat));
+    __m256i y = _mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(lon));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes + i), InterleaveAvx2(x, y));
+  }
+  EncodeScalar(points + i, count - i, hashes + i);
+}
+
+// Returns the 32 low bits of every 64-bit lane, as doubles.
+__attribute__((target("avx2"))) __m256d LowHalvesToDouble(__m256i v) {
+  const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  return _mm256_cvtepi32_pd(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, even)));
+}
+
+__attribute__((target("avx2"))) void DecodeAvx2(const uint64_t* hashes, size_t count,
+                                                GeoPoint* points) {
+  const __m256i masks[] = {_mm256_set1_epi64x(0x5555555555555555ULL),
+                           _mm256_set1_epi64x(0x3333333333333333ULL),
+                           _mm256_set1_epi64x(0x0F0F0F0F0F0F0F0FULL),
+                           _mm256_set1_epi64x(0x00FF00FF00FF00FFULL),
+                           _mm256_set1_epi64x(0x0000FFFF0000FFFFULL),
+                           _mm256_set1_epi64x(0x00000000FFFFFFFFULL)};
+  const __m256d lat_min = _mm256_set1_pd(kGeoLatMin), lat_scale = _mm256_set1_pd(kLatScale);
+  const __m256d lon_min = _mm256_set1_pd(kGeoLongMin), lon_scale = _mm256_set1_pd(kLongScale);
+  const __m256d lat_max = _mm256_set1_pd(kGeoLatMax), lon_max = _mm256_set1_pd(kGeoLongMax);
+  const __m256d cells = _mm256_set1_pd(kCells), one = _mm256_set1_pd(1), two = _mm256_set1_pd(2);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i));
+    __m256i x = _mm256_and_si256(bits, masks[0]);
+    __m256i y = _mm256_and_si256(_mm256_srli_epi64(bits, 1), masks[0]);
+    for (unsigned j = 1; j < 6; ++j) {
+      const int shift = 1 << (j - 1);
+      x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, shift)), masks[j]);
+      y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, shift)), masks[j]);
+    }
+
+    __m256d lat = LowHalvesToDouble(x), lon = LowHalvesToDouble(y);
+    __m256d lat_lo = _mm256_add_pd(lat_min, _mm256_mul_pd(_mm256_div_pd(lat, cells), lat_scale));
+    __m256d lat_hi = _mm256_add_pd(
+        lat_min, _mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(lat, one), cells), lat_scale));
+    __m256d lon_lo = _mm256_add_pd(lon_min, _mm256_mul_pd(_mm256_div_pd(lon, cells), lon_scale));
+    __m256d lon_hi = _mm256_add_pd(
+        lon_min, _mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(lon, one), cells), lon_scale));
+    lat = _mm256_min_pd(_mm256_div_pd(_mm256_add_pd(lat_lo, lat_hi), two), lat_max);
+    lon = _mm256_min_pd(_mm256_div_pd(_mm256_add_pd(lon_lo, lon_hi), two), lon_max);
+
+    // Back to pairs of (lon, lat).
+    __m256d lo = _mm256_unpacklo_pd(lon, lat), hi = _mm256_unpackhi_pd(lon, lat);
+    double* dest = &points[i].lon;
+    _mm256_storeu_pd(dest, _mm256_permute2f128_pd(lo, hi, 0x20));
+    _mm256_storeu_pd(dest + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+  }
+  DecodeScalar(hashes + i, count - i, points + i);
+}
+
+#endif
+
+struct Kernels {
+  void (*encode)(const GeoPoint*, size_t, uint64_t*);
+  void (*decode)(const uint64_t*, size_t, GeoPoint*);
+};
+
+SimdLevel SupportedSimdLevel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    return SimdLevel::AVX2;
+#endif
+  return SimdLevel::SCALAR;
+}
+
+Kernels MakeKernels(SimdLevel level) {
+#if defined(__x86_64__)
+  if (level >= SimdLevel::AVX2)
+    return Kernels{EncodeAvx2, DecodeAvx2};
+#endif
+  return Kernels{EncodeScalar, DecodeScalar};
+}
+
+Kernels kernels = MakeKernels(SupportedSimdLevel());
+
+// A cell of the grid at step bits per coordinate.
+struct Cell {
+  uint64_t bits;
+  unsigned step;
+};
+
+struct Area {
+  double lon_min, lon_max, lat_min, lat_max;
+};
+
+Area CellArea(Cell cell) {
+  uint64_t sep = Deinterleave(cell.bits);
+  double cells = double(1ULL << cell.step);
+  double lat = double(uint32_t(sep)), lon = double(sep >> 32);
+  return {kGeoLongMin + lon / cells * kLongScale, kGeoLongMin + (lon + 1) / cells * kLongScale,
+          kGeoLatMin + lat / cells * kLatScale, kGeoLatMin + (lat + 1) / cells * kLatScale};
+}
+
+// Moves the cell by d in the direction of the bits of mask, the odd bits for the longitude and
+// the even ones for the latitude. The moves wrap around the grid.
+Cell Move(Cell cell, int d, uint64_t mask) {
+  if (d == 0)
+    return cell;
+  uint64_t moved = cell.bits & mask;
+  uint64_t other = cell.bits & ~mask;
+  uint64_t fill = ~mask >> (64 - cell.step * 2);
+  if (d > 0) {
+    moved += fill + 1;
+  } else {
+    moved = (moved | fill) - (fill + 1);
+  }
+  moved &= mask >> (64 - cell.step * 2);
+  return {moved | other, cell.step};
+}
+
+Cell Neighbour(Cell cell, int dlon, int dlat) {
+  return Move(Move(cell, dlon, kOddBits), dlat, kEvenBits);
+}
+
+// Returns the coarsest step whose cells span at least the range at the given latitude.
+unsigned EstimateStep(double range, double lat) {
+  if (range == 0)
+    return kGeoStep;
+
+  int step = 1;
+  while (range < kMercatorMax) {
+    range *= 2;
+    step++;
+  }
+  step -= 2;  // Includes the range in most of the cases.
+
+  // The cells narrow towards the poles.
+  if (lat > 66 || lat < -66) {
+    step--;
+    if (lat > 80 || lat < -80)
+      step--;
+  }
+  return std::clamp(step, 1, int(kGeoStep));
+}
+
+}  // namespace
+
+void GeoHashEncode(const GeoPoint* points, size_t count, uint64_t* hashes) {
+  kernels.encode(points, count, hashes);
+}
+
+void GeoHashDecode(const uint64_t* hashes, size_t count, GeoPoint* points) {
+  kernels.decode(hashes, count, points);
+}
+
+std::string GeoHashString(uint64_t hash) {
+  static constexpr char kAlphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+  // Re-encodes the center of the cell with the latitudes of the standard geohash.
+  GeoPoint p = GeoHashDecode(hash);
+  double lat_offset = (p.lat + 90) / 180 * kCells;
+  double lon_offset = (p.lon - kGeoLongMin) / kLongScale * kCells;
+  uint64_t bits = Interleave(uint32_t(lat_offset), uint32_t(lon_offset));
+
+  // 52 bits give 10 characters and 2 bits of the 11th, which Redis leaves as 0.
+  std::string res(11, '0');
+  for (unsigned i = 0; i < 10; ++i)
+    res[i] = kAlphabet[(bits >> (kHashBits - (i + 1) * 5)) & 0x1f];
+  return res;
+}
+
+// The differences are taken in degrees, so that a contraction into fused multiply-adds does not
+// turn equal coordinates into a residue.
+double GeoDistance(GeoPoint a, GeoPoint b) {
+  double v = std::sin(DegToRad(b.lon - a.lon) / 2);
+
+  // Along a meridian the distance is the one of the latitudes.
+  if (v == 0.0)
+    return kEarthRadius * DegToRad(std::fabs(b.lat - a.lat));
+
+  double u = std::sin(DegToRad(b.lat - a.lat) / 2);
+  double h = u * u + std::cos(DegToRad(a.lat)) * std::cos(DegToRad(b.lat)) * v * v;
+  return 2.0 * kEarthRadius * std::asin(std::sqrt(h));
+}
+
+bool GeoShape::Contains(GeoPoint p, double* dist) const {
+  if (type == RADIUS) {
+    *dist = GeoDistance(center, p);
+    return *dist <= radius;
+  }
+
+  // The latitude distance is the cheapest, so it goes first.
+  if (kEarthRadius * DegToRad(std::fabs(p.lat - center.lat)) > height / 2)
+    return false;
+  if (GeoDistance({center.lon, p.lat}, p) > width / 2)
+    return false;
+  *dist = GeoDistance(center, p);
+  return true;
+}
+
+unsigned GeoSearchRanges(const GeoShape& shape, GeoHashRange ranges[kMaxGeoHashRanges]) {
+  const GeoPoint center = shape.center;
+  const bool radius = shape.type == GeoShape::RADIUS;
+  const double half_height = radius ? shape.radius : shape.height / 2;
+  const double half_width = radius ? shape.radius : shape.width / 2;
+
+  // The bounding box of the shape. The roles of its top and bottom sides swap between the
+  // hemispheres.
+  double lat_delta = RadToDeg(half_height / kEarthRadius);
+  double lon_delta_top =
+      RadToDeg(half_width / kEarthRadius / std::cos(DegToRad(center.lat + lat_delta)));
+  double lon_delta_bottom =
+      RadToDeg(half_width / kEarthRadius / std::cos(DegToRad(center.lat - lat_delta)));
+  double lon_delta = center.lat < 0 ? lon_delta_bottom : lon_delta_top;
+  const Area box{center.lon - lon_delta, center.lon + lon_delta, center.lat - lat_delta,
+                 center.lat + lat_delta};
+
+  double range = radius ? shape.radius : std::hypot(half_width, half_height);
+  unsigned step = EstimateStep(range, center.lat);
+  uint64_t hash = EncodePoint(center);
+  auto center_cell = [&] { return Cell{hash >> (kHashBits - step * 2), step}; };
+  Cell cell = center_cell();
+
+  // The estimate may be too coarse near the sides of the cell of the center, where the
+  // neighbours no longer cover the bounding box.
+  if (step > 1 && (CellArea(Neighbour(cell, 0, 1)).lat_max < box.lat_max ||
+                   CellArea(Neighbour(cell, 0, -1)).lat_min > box.lat_min ||
+                   CellArea(Neighbour(cell, 1, 0)).lon_max < box.lon_max ||
+                   CellArea(Neighbour(cell, -1, 0)).lon_min > box.lon_min)) {
+    --step;
+    cell = center_cell();
+  }
+
+  // Skips the neighbours on the sides that the bounding box does not reach.
+  Area area = CellArea(cell);
+  bool prune = step >= 2;
+  int lon_from = prune && area.lon_min < box.lon_min ? 0 : -1;
+  int lon_to = prune && area.lon_max > box.lon_max ? 0 : 1;
+  int lat_from = prune && area.lat_min < box.lat_min ? 0 : -1;
+  int lat_to = prune && area.lat_max > box.lat_max ? 0 : 1;
+
+  unsigned count = 0;
+  const unsigned shift = kHashBits - step * 2;
+  for (int dlon = lon_from; dlon <= lon_to; ++dlon) {
+    for (int dlat = lat_from; dlat <= lat_to; ++dlat) {
+      Cell neighbour = Neighbour(cell, dlon, dlat);
+      ranges[count++] = {neighbour.bits << shift, (neighbour.bits + 1) << shift};
+    }
+  }
+
+  std::sort(ranges, ranges + count,
+            [](const GeoHashRange& a, const GeoHashRange& b) { return a.min < b.min; });
+  unsigned merged = 0;
+  for (unsigned i = 1; i < count; ++i) {
+    if (ranges[i].min <= ranges[merged].max)
+      ranges[merged].max = std::max(ranges[merged].max, ranges[i].max);
+    else
+      ranges[++merged] = ranges[i];
+  }
+  return merged + 1;
+}
+
+SimdLevel SetGeoSimdLevel(SimdLevel level) {
+  level = std::min(level, SupportedSimdLevel());
+  kernels = MakeKernels(level);
+  return level;
+}
+
+}  // namespace dfly
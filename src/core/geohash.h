@@ -0,0 +1,94 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "core/bitops.h"
+
+namespace dfly {
+
+// The geohash scores of the GEO commands, compatible with Redis: the longitude and the latitude
+// are quantized to 26 bits each and interleaved into a 52-bit hash, which a double holds
+// exactly. The latitudes are limited to the range of the web mercator projection. Like the
+// kernels of bitops.h, the batch conversions pick the vector instructions at runtime.
+
+constexpr double kGeoLongMin = -180;
+constexpr double kGeoLongMax = 180;
+constexpr double kGeoLatMin = -85.05112878;
+constexpr double kGeoLatMax = 85.05112878;
+
+// The bits per coordinate of the scores.
+constexpr unsigned kGeoStep = 26;
+
+struct GeoPoint {
+  double lon;
+  double lat;
+};
+
+inline bool IsValidGeoPoint(GeoPoint p) {
+  return p.lon >= kGeoLongMin && p.lon <= kGeoLongMax && p.lat >= kGeoLatMin &&
+         p.lat <= kGeoLatMax;
+}
+
+// Encodes count valid points into the 52-bit scores of their cells.
+void GeoHashEncode(const GeoPoint* points, size_t count, uint64_t* hashes);
+
+// Decodes count scores into the centers of their cells.
+void GeoHashDecode(const uint64_t* hashes, size_t count, GeoPoint* points);
+
+inline uint64_t GeoHashEncode(GeoPoint point) {
+  uint64_t hash;
+  GeoHashEncode(&point, 1, &hash);
+  return hash;
+}
+
+inline GeoPoint GeoHashDecode(uint64_t hash) {
+  GeoPoint point;
+  GeoHashDecode(&hash, 1, &point);
+  return point;
+}
+
+// Returns the standard 11 character geohash of a score, as GEOHASH does. Note that the standard
+// geohash covers the latitudes from -90 to 90.
+std::string GeoHashString(uint64_t hash);
+
+// Returns the great-circle distance in meters of two points.
+double GeoDistance(GeoPoint a, GeoPoint b);
+
+// The area of GEOSEARCH, with the dimensions in meters.
+struct GeoShape {
+  enum Type : uint8_t { RADIUS, BOX } type = RADIUS;
+  GeoPoint center{0, 0};
+  double radius = 0;
+  double width = 0;
+  double height = 0;
+
+  // Returns whether p lies in the shape, and sets *dist to its distance from the center.
+  bool Contains(GeoPoint p, double* dist) const;
+};
+
+// A range [min, max) of scores.
+struct GeoHashRange {
+  uint64_t min;
+  uint64_t max;
+};
+
+constexpr unsigned kMaxGeoHashRanges = 9;
+
+// Fills ranges with the scores of the cells that may hold points of shape, and returns their
+// number. The cells are the one of the center, at the finest step whose neighbours still cover
+// the shape, and those of its 8 neighbours that intersect the bounding box of the shape. The
+// ranges are sorted, and adjacent or duplicate ones are merged, so that a scan of the sorted set
+// visits each of its members at most once.
+unsigned GeoSearchRanges(const GeoShape& shape, GeoHashRange ranges[kMaxGeoHashRanges]);
+
+// Limits the batch conversions to the given instruction set, for tests and benchmarks. Returns
+// the level that is used, which is lower than the requested one if the CPU does not support it.
+SimdLevel SetGeoSimdLevel(SimdLevel level);
+
+}  // namespace dfly
@@ -0,0 +1,134 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <random>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+class GeoHashTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    SetGeoSimdLevel(SimdLevel::AVX512);
+  }
+};
+
+constexpr GeoPoint kPalermo{13.361389, 38.115556};
+constexpr GeoPoint kCatania{15.087269, 37.502669};
+
+TEST_F(GeoHashTest, Encode) {
+  // The scores and the hashes of Redis.
+  EXPECT_EQ(3479099956230698u, GeoHashEncode(kPalermo));
+  EXPECT_EQ(3479447370796909u, GeoHashEncode(kCatania));
+  EXPECT_EQ("sqc8b49rny0", GeoHashString(GeoHashEncode(kPalermo)));
+  EXPECT_EQ("sqdtr74hyu0", GeoHashString(GeoHashEncode(kCatania)));
+
+  GeoPoint p = GeoHashDecode(GeoHashEncode(kPalermo));
+  EXPECT_NEAR(13.36138933897018433, p.lon, 1e-12);
+  EXPECT_NEAR(38.11555639549629859, p.lat, 1e-12);
+
+  EXPECT_TRUE(IsValidGeoPoint({180, kGeoLatMax}));
+  EXPECT_FALSE(IsValidGeoPoint({180.1, 0}));
+  EXPECT_FALSE(IsValidGeoPoint({0, 86}));
+}
+
+TEST_F(GeoHashTest, Batch) {
+  // The vector kernels and the scalar ones give the same results, also on the tails.
+  default_random_engine rand(7);
+  uniform_real_distribution<double> lon(kGeoLongMin, kGeoLongMax), lat(kGeoLatMin, kGeoLatMax);
+  vector<GeoPoint> points(103);
+  for (GeoPoint& p : points)
+    p = {lon(rand), lat(rand)};
+  points[0] = {kGeoLongMin, kGeoLatMin};
+  points[1] = {kGeoLongMax, kGeoLatMax};
+
+  vector<uint64_t> hashes(points.size()), expected(points.size());
+  vector<GeoPoint> decoded(points.size()), expected_decoded(points.size());
+  GeoHashEncode(points.data(), points.size(), hashes.data());
+  GeoHashDecode(hashes.data(), hashes.size(), decoded.data());
+  SetGeoSimdLevel(SimdLevel::SCALAR);
+  GeoHashEncode(points.data(), points.size(), expected.data());
+  GeoHashDecode(expected.data(), expected.size(), expected_decoded.data());
+
+  EXPECT_EQ(expected, hashes);
+  for (size_t i = 0; i < points.size(); ++i) {
+    EXPECT_DOUBLE_EQ(expected_decoded[i].lon, decoded[i].lon) << i;
+    EXPECT_DOUBLE_EQ(expected_decoded[i].lat, decoded[i].lat) << i;
+
+    // The centers of the cells are within a meter of the points.
+    EXPECT_LT(GeoDistance(points[i], decoded[i]), 1) << i;
+  }
+}
+
+TEST_F(GeoHashTest, Distance) {
+  // Like in Redis, the distances are the ones of the stored points.
+  GeoPoint palermo = GeoHashDecode(GeoHashEncode(kPalermo));
+  GeoPoint catania = GeoHashDecode(GeoHashEncode(kCatania));
+  EXPECT_NEAR(166274.1516, GeoDistance(palermo, catania), 1e-4);
+  EXPECT_EQ(0, GeoDistance(palermo, palermo));
+  EXPECT_NEAR(111226.3, GeoDistance({0, 0}, {0, 1}), 0.1);
+
+  GeoShape circle{GeoShape::RADIUS, {15, 37}, 200000};
+  double dist = 0;
+  EXPECT_TRUE(circle.Contains(palermo, &dist));
+  EXPECT_NEAR(190442.4, dist, 0.1);
+  circle.radius = 100000;
+  EXPECT_FALSE(circle.Contains(palermo, &dist));
+  EXPECT_TRUE(circle.Contains(catania, &dist));
+  EXPECT_NEAR(56441.3, dist, 0.1);
+
+  GeoShape box{GeoShape::BOX, {15, 37}, 0, 400000, 400000};
+  EXPECT_TRUE(box.Contains(palermo, &dist));
+  box.width = 200000;
+  EXPECT_FALSE(box.Contains(palermo, &dist));
+}
+
+TEST_F(GeoHashTest, SearchRanges) {
+  // Every point of a shape lies in one of its ranges, for shapes of all the sizes.
+  default_random_engine rand(11);
+  uniform_real_distribution<double> lon(kGeoLongMin, kGeoLongMax), lat(-80, 80);
+  uniform_real_distribution<double> unit(-1, 1);
+  for (double radius : {10.0, 500.0, 20000.0, 800000.0, 6000000.0}) {
+    for (unsigned i = 0; i < 50; ++i) {
+      GeoShape shape{i % 2 ? GeoShape::RADIUS : GeoShape::BOX, {lon(rand), lat(rand)}, radius,
+                     radius * 2, radius};
+      GeoHashRange ranges[kMaxGeoHashRanges];
+      unsigned count = GeoSearchRanges(shape, ranges);
+      ASSERT_GE(count, 1u);
+      for (unsigned j = 1; j < count; ++j)
+        ASSERT_LT(ranges[j - 1].max, ranges[j].min);
+
+      for (unsigned j = 0; j < 200; ++j) {
+        // Points around the center, up to twice the size of the shape.
+        double dlat = unit(rand) * radius / 55000, dlon = unit(rand) * radius / 55000;
+        GeoPoint p{shape.center.lon + dlon, shape.center.lat + dlat};
+        double dist;
+        if (!IsValidGeoPoint(p) || !shape.Contains(p, &dist))
+          continue;
+        uint64_t hash = GeoHashEncode(p);
+        bool found = false;
+        for (unsigned k = 0; k < count; ++k)
+          found |= hash >= ranges[k].min && hash < ranges[k].max;
+        ASSERT_TRUE(found) << radius << " " << p.lon << "," << p.lat;
+      }
+    }
+  }
+
+  // A small radius only scans a few of the 9 cells around the center.
+  GeoHashRange ranges[kMaxGeoHashRanges];
+  unsigned count = GeoSearchRanges({GeoShape::RADIUS, {15, 37}, 100}, ranges);
+  EXPECT_LE(count, 9u);
+  uint64_t scanned = 0;
+  for (unsigned k = 0; k < count; ++k)
+    scanned += ranges[k].max - ranges[k].min;
+  EXPECT_LT(scanned, uint64_t(1) << 30);
+}
+
+}  // namespace dfly
@@ -0,0 +1,71 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_matcher.h"
+
+#include <absl/strings/match.h>
+
+extern "C" {
+#include "redis/util.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+GlobMatcher::GlobMatcher(string_view pattern) : pattern_(pattern) {
+  prefix_ = pattern.substr(0, pattern.find_first_of("*?[\\"));
+  stars_only_ = pattern.find_first_of("?[\\") == string_view::npos;
+
+  size_t first_star = pattern.find('*');
+  has_star_ = first_star != string_view::npos;
+  if (!stars_only_ || !has_star_)
+    return;
+
+  size_t last_star = pattern.rfind('*');
+  suffix_ = pattern.substr(last_star + 1);
+  // The literals between the stars, the last one included so that every literal ends with one.
+  string_view middle = pattern.substr(first_star + 1, last_star - first_star);
+  while (!middle.empty()) {
+    size_t star = middle.find('*');
+    if (star > 0)
+      middle_.push_back(middle.substr(0, star));
+    middle.remove_prefix(star + 1);
+  }
+}
+
+bool GlobMatcher::Matches(string_view str) const {
+  // Like stringmatchlen, an empty string only matches the empty pattern.
+  if (str.empty())
+    return pattern_.empty();
+
+  if (!absl::StartsWith(str, prefix_))
+    return false;
+
+  if (!stars_only_)
+    return stringmatchlen(pattern_.data(), pattern_.size(), str.data(), str.size(), 0) == 1;
+
+  if (!has_star_)
+    return str.size() == pattern_.size();
+
+  if (str.size() < prefix_.size() + suffix_.size() || !absl::EndsWith(str, suffix_))
+    return false;
+
+  // Finding the leftmost occurrence of every literal leaves the most room for the next ones.
+  string_view body = str.substr(prefix_.size(), str.size() - prefix_.size() - suffix_.size());
+  for (string_view part : middle_) {
+    size_t pos = body.find(part);
+    if (pos == string_view::npos)
+      return false;
+    body.remove_prefix(pos + part.size());
+  }
+  return true;
+}
+
+bool GlobMatcher::MayMatchPrefix(string_view prefix) const {
+  size_t len = min(prefix_.size(), prefix.size());
+  return prefix_.substr(0, len) == prefix.substr(0, len);
+}
+
+}  // namespace dfly
@@ -0,0 +1,39 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Matches strings against a glob-style pattern, with the syntax of KEYS and SCAN MATCH.
+// The pattern is analyzed once, so that the common patterns made of literals and stars, like
+// "user:*" or "*:session:*", are matched with plain prefix, suffix and substring searches.
+// The other patterns fall back on stringmatchlen after their literal head is checked.
+// The matcher refers to the pattern, which must outlive it.
+class GlobMatcher {
+ public:
+  explicit GlobMatcher(std::string_view pattern);
+
+  bool Matches(std::string_view str) const;
+
+  // Returns false if no string starting with prefix can match the pattern.
+  bool MayMatchPrefix(std::string_view prefix) const;
+
+ private:
+  std::string_view pattern_;
+
+  // The literal head of the pattern up to its first special character. For the patterns
+  // with stars only, the literal tail after the last star and the literals in between.
+  std::string_view prefix_;
+  std::string_view suffix_;
+  std::vector<std::string_view> middle_;
+
+  bool has_star_ = false;
+  bool stars_only_ = true;  // no ?, [ or escapes.
+};
+
+}  // namespace dfly
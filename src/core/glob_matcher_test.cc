@@ -0,0 +1,92 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_matcher.h"
+
+#include <absl/random/random.h>
+
+#include <string>
+
+extern "C" {
+#include "redis/util.h"
+}
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class GlobMatcherTest : public ::testing::Test {
+ protected:
+  static bool Match(string_view pattern, string_view str) {
+    return GlobMatcher{pattern}.Matches(str);
+  }
+};
+
+TEST_F(GlobMatcherTest, Literals) {
+  EXPECT_TRUE(Match("", ""));
+  EXPECT_FALSE(Match("", "a"));
+  EXPECT_TRUE(Match("abc", "abc"));
+  EXPECT_FALSE(Match("abc", "abcd"));
+  EXPECT_FALSE(Match("abc", "ab"));
+}
+
+TEST_F(GlobMatcherTest, Stars) {
+  EXPECT_FALSE(Match("*", ""));  // as in Redis
+  EXPECT_TRUE(Match("*", "a"));
+  EXPECT_TRUE(Match("**", "abc"));
+  EXPECT_TRUE(Match("user:*", "user:"));
+  EXPECT_TRUE(Match("user:*", "user:42"));
+  EXPECT_FALSE(Match("user:*", "users:42"));
+  EXPECT_TRUE(Match("*:session", "user:session"));
+  EXPECT_FALSE(Match("*:session", "user:sessions"));
+  EXPECT_TRUE(Match("*:session:*", "user:session:1"));
+  EXPECT_FALSE(Match("*:session:*", "user:session"));
+  EXPECT_TRUE(Match("a*b*c", "abc"));
+  EXPECT_TRUE(Match("a*b*b*c", "abbc"));
+  EXPECT_FALSE(Match("a*b*b*c", "abc"));
+  EXPECT_FALSE(Match("ab*ba", "aba"));
+  EXPECT_TRUE(Match("a*x*y*z", "a-x-yz-z"));
+}
+
+TEST_F(GlobMatcherTest, Special) {
+  EXPECT_TRUE(Match("h?llo", "hello"));
+  EXPECT_FALSE(Match("h?llo", "hllo"));
+  EXPECT_TRUE(Match("h[ae]llo:*", "hallo:1"));
+  EXPECT_FALSE(Match("h[^e]llo", "hello"));
+  EXPECT_TRUE(Match("a\\*b", "a*b"));
+  EXPECT_FALSE(Match("a\\*b", "axb"));
+
+  GlobMatcher matcher{"user:[0-9]*"};
+  EXPECT_TRUE(matcher.MayMatchPrefix("us"));
+  EXPECT_TRUE(matcher.MayMatchPrefix("user:1234"));
+  EXPECT_FALSE(matcher.MayMatchPrefix("usr"));
+  EXPECT_TRUE(GlobMatcher{"*"}.MayMatchPrefix("anything"));
+}
+
+TEST_F(GlobMatcherTest, Random) {
+  // Compare with stringmatchlen on short strings of few letters, to hit many matches.
+  absl::InsecureBitGen gen;
+  auto random_str = [&](string_view alphabet, size_t max_len) {
+    string res(absl::Uniform<size_t>(gen, 0, max_len + 1), 0);
+    for (char& c : res) {
+      c = alphabet[absl::Uniform<size_t>(gen, 0, alphabet.size())];
+    }
+    return res;
+  };
+
+  for (unsigned i = 0; i < 20000; ++i) {
+    string pattern = random_str(i % 2 ? "ab*" : "ab*?", 6);
+    GlobMatcher matcher{pattern};
+    for (unsigned j = 0; j < 10; ++j) {
+      string str = random_str("ab", 8);
+      bool expected = stringmatchlen(pattern.data(), pattern.size(), str.data(), str.size(), 0);
+      ASSERT_EQ(expected, matcher.Matches(str)) << pattern << " " << str;
+    }
+  }
+}
+
+}  // namespace dfly
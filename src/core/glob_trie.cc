@@ -0,0 +1,284 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_trie.h"
+
+#include <algorithm>
+
+extern "C" {
+#include "redis/util.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+bool MatchesClass(const string& cls, char c) {
+  return stringmatchlen(cls.data(), cls.size(), &c, 1, 0) == 1;
+}
+
+}  // namespace
+
+struct GlobTrie::Token {
+  enum Kind : uint8_t { LITERAL, ANY, STAR, CLASS };
+
+  Kind kind;
+  char c = 0;       // of LITERAL.
+  string_view cls;  // the whole [...] of CLASS.
+};
+
+struct GlobTrie::Node {
+  // Sorted by the character, usually short.
+  vector<pair<char, unique_ptr<Node>>> literals;
+  vector<pair<string, unique_ptr<Node>>> classes;
+  unique_ptr<Node> any;
+  unique_ptr<Node> star;
+
+  // The patterns that end here, more than one only if they differ in the number of stars.
+  vector<string> patterns;
+  bool is_star = false;  // the node after a star, which loops on every character.
+
+  mutable uint64_t epoch = 0;  // of the last Match step that added the node.
+
+  bool Empty() const {
+    return patterns.empty() && literals.empty() && classes.empty() && !any && !star;
+  }
+
+  const Node* FindLiteral(char c) const {
+    auto it = lower_bound(literals.begin(), literals.end(), c,
+                          [](const auto& p, char c) { return p.first < c; });
+    return it != literals.end() && it->first == c ? it->second.get() : nullptr;
+  }
+};
+
+GlobTrie::GlobTrie() : root_(new Node) {
+}
+
+GlobTrie::~GlobTrie() {
+}
+
+// Mirrors the parsing of stringmatchlen.
+bool GlobTrie::Tokenize(string_view pattern, vector<Token>* tokens) {
+  tokens->clear();
+  size_t i = 0;
+  while (i < pattern.size()) {
+    char c = pattern[i];
+    switch (c) {
+      case '*':
+        // Consecutive stars are the same as one.
+        if (tokens->empty() || tokens->back().kind != Token::STAR)
+          tokens->push_back(Token{Token::STAR});
+        ++i;
+        break;
+      case '?':
+        tokens->push_back(Token{Token::ANY});
+        ++i;
+        break;
+      case '\\':
+        // A trailing backslash is a literal one.
+        if (i + 1 < pattern.size())
+          ++i;
+        tokens->push_back(Token{Token::LITERAL, pattern[i]});
+        ++i;
+        break;
+      case '[': {
+        size_t j = i + 1;
+        if (j < pattern.size() && pattern[j] == '^')
+          ++j;
+        while (true) {
+          if (j == pattern.size())
+            return false;
+          if (pattern[j] == '\\' && j + 1 < pattern.size()) {
+            j += 2;
+          } else if (pattern[j] == ']') {
+            break;
+          } else if (j + 2 < pattern.size() && pattern[j + 1] == '-') {
+            j += 3;
+          } else {
+            ++j;
+          }
+        }
+        tokens->push_back(Token{Token::CLASS, 0, pattern.substr(i, j + 1 - i)});
+        i = j + 1;
+        break;
+      }
+      default:
+        tokens->push_back(Token{Token::LITERAL, c});
+        ++i;
+    }
+  }
+  return true;
+}
+
+auto GlobTrie::Child(Node* node, const Token& tok, bool create) -> Node* {
+  unique_ptr<Node>* child = nullptr;
+  switch (tok.kind) {
+    case Token::LITERAL: {
+      auto it = lower_bound(node->literals.begin(), node->literals.end(), tok.c,
+                            [](const auto& p, char c) { return p.first < c; });
+      if (it == node->literals.end() || it->first != tok.c) {
+        if (!create)
+          return nullptr;
+        it = node->literals.emplace(it, tok.c, nullptr);
+      }
+      child = &it->second;
+      break;
+    }
+    case Token::ANY:
+      child = &node->any;
+      break;
+    case Token::STAR:
+      child = &node->star;
+      break;
+    case Token::CLASS: {
+      auto it = find_if(node->classes.begin(), node->classes.end(),
+                        [&](const auto& p) { return p.first == tok.cls; });
+      if (it == node->classes.end()) {
+        if (!create)
+          return nullptr;
+        node->classes.emplace_back(string(tok.cls), nullptr);
+        it = prev(node->classes.end());
+      }
+      child = &it->second;
+      break;
+    }
+  }
+
+  if (!*child && create) {
+    child->reset(new Node);
+    (*child)->is_star = tok.kind == Token::STAR;
+  }
+  return child->get();
+}
+
+void GlobTrie::RemoveChild(Node* node, const Token& tok) {
+  switch (tok.kind) {
+    case Token::LITERAL:
+      node->literals.erase(find_if(node->literals.begin(), node->literals.end(),
+                                   [&](const auto& p) { return p.first == tok.c; }));
+      break;
+    case Token::ANY:
+      node->any.reset();
+      break;
+    case Token::STAR:
+      node->star.reset();
+      break;
+    case Token::CLASS:
+      node->classes.erase(find_if(node->classes.begin(), node->classes.end(),
+                                  [&](const auto& p) { return p.first == tok.cls; }));
+      break;
+  }
+}
+
+bool GlobTrie::Insert(string_view pattern) {
+  vector<Token> tokens;
+  if (!Tokenize(pattern, &tokens)) {
+    if (find(unparsed_.begin(), unparsed_.end(), pattern) != unparsed_.end())
+      return false;
+    unparsed_.emplace_back(pattern);
+    ++size_;
+    return true;
+  }
+
+  Node* node = root_.get();
+  for (const Token& tok : tokens) {
+    node = Child(node, tok, true);
+  }
+
+  if (find(node->patterns.begin(), node->patterns.end(), pattern) != node->patterns.end())
+    return false;
+  node->patterns.emplace_back(pattern);
+  ++size_;
+  return true;
+}
+
+bool GlobTrie::Erase(string_view pattern) {
+  vector<Token> tokens;
+  if (!Tokenize(pattern, &tokens)) {
+    auto it = find(unparsed_.begin(), unparsed_.end(), pattern);
+    if (it == unparsed_.end())
+      return false;
+    unparsed_.erase(it);
+    --size_;
+    return true;
+  }
+
+  if (!Erase(pattern, root_.get(), tokens.data(), tokens.data() + tokens.size()))
+    return false;
+  --size_;
+  return true;
+}
+
+// Removes the nodes that are left empty on the way back.
+bool GlobTrie::Erase(string_view pattern, Node* node, const Token* tok, const Token* end) {
+  if (tok == end) {
+    auto it = find(node->patterns.begin(), node->patterns.end(), pattern);
+    if (it == node->patterns.end())
+      return false;
+    node->patterns.erase(it);
+    return true;
+  }
+
+  Node* child = Child(node, *tok, false);
+  if (!child || !Erase(pattern, child, tok + 1, end))
+    return false;
+  if (child->Empty())
+    RemoveChild(node, *tok);
+  return true;
+}
+
+void GlobTrie::Match(string_view str, absl::FunctionRef<void(string_view)> cb) const {
+  for (const string& pattern : unparsed_) {
+    if (stringmatchlen(pattern.data(), pattern.size(), str.data(), str.size(), 0) == 1)
+      cb(pattern);
+  }
+
+  // Like stringmatchlen, an empty string only matches the empty pattern.
+  if (str.empty()) {
+    for (const string& pattern : root_->patterns)
+      cb(pattern);
+    return;
+  }
+
+  vector<const Node*> current, next;
+
+  // A node comes with the star after it, which matches the empty string.
+  auto add = [this](const Node* node, vector<const Node*>* dest) {
+    for (; node && node->epoch != epoch_; node = node->star.get()) {
+      node->epoch = epoch_;
+      dest->push_back(node);
+    }
+  };
+
+  ++epoch_;
+  add(root_.get(), &current);
+
+  for (char c : str) {
+    ++epoch_;
+    next.clear();
+    for (const Node* node : current) {
+      if (node->is_star)
+        add(node, &next);
+      add(node->FindLiteral(c), &next);
+      add(node->any.get(), &next);
+      for (const auto& [cls, child] : node->classes) {
+        if (MatchesClass(cls, c))
+          add(child.get(), &next);
+      }
+    }
+
+    if (next.empty())
+      return;
+    current.swap(next);
+  }
+
+  for (const Node* node : current) {
+    for (const string& pattern : node->patterns)
+      cb(pattern);
+  }
+}
+
+}  // namespace dfly
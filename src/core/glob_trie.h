@@ -0,0 +1,67 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/functional/function_ref.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// A set of glob-style patterns, with the syntax of PSUBSCRIBE, that finds the patterns matching
+// a string without trying them one by one.
+// The patterns are parsed into tokens, i.e. literals, ?, * and [...] classes, and kept in a trie
+// of the tokens, so that the patterns with common prefixes share their nodes. A string is
+// matched by walking the trie with the set of the nodes that its prefix reaches, where a star
+// node loops on every character. The cost is proportional to the length of the string times
+// the number of the nodes that are active at once: the literal prefixes of the patterns prune
+// most of the trie, e.g. "sensors/*/temp" is only visited by the strings starting with "sensors/".
+// The patterns with an unterminated class, which stringmatchlen interprets in its own way, are
+// matched with it one by one.
+//
+// Not thread safe, including Match, which marks the visited nodes.
+class GlobTrie {
+ public:
+  GlobTrie();
+  ~GlobTrie();
+
+  GlobTrie(const GlobTrie&) = delete;
+  void operator=(const GlobTrie&) = delete;
+
+  // Returns false if the pattern is already in the set.
+  bool Insert(std::string_view pattern);
+
+  // Returns false if the pattern is not in the set.
+  bool Erase(std::string_view pattern);
+
+  // Calls cb once with every pattern of the set that matches str.
+  void Match(std::string_view str, absl::FunctionRef<void(std::string_view)> cb) const;
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  struct Node;
+  struct Token;
+
+  static bool Tokenize(std::string_view pattern, std::vector<Token>* tokens);
+
+  // Returns the child of node for tok, which is created if create is true, or null.
+  static Node* Child(Node* node, const Token& tok, bool create);
+  static void RemoveChild(Node* node, const Token& tok);
+
+  bool Erase(std::string_view pattern, Node* node, const Token* tok, const Token* end);
+
+  std::unique_ptr<Node> root_;
+  std::vector<std::string> unparsed_;
+  size_t size_ = 0;
+  mutable uint64_t epoch_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,119 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_trie.h"
+
+#include <absl/random/random.h>
+
+#include <algorithm>
+#include <string>
+
+extern "C" {
+#include "redis/util.h"
+}
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class GlobTrieTest : public ::testing::Test {
+ protected:
+  vector<string> Match(string_view str) const {
+    vector<string> res;
+    trie_.Match(str, [&](string_view pattern) { res.emplace_back(pattern); });
+    sort(res.begin(), res.end());
+    return res;
+  }
+
+  GlobTrie trie_;
+};
+
+TEST_F(GlobTrieTest, Basic) {
+  EXPECT_TRUE(trie_.Insert("sensors/*/temp"));
+  EXPECT_TRUE(trie_.Insert("sensors/*"));
+  EXPECT_TRUE(trie_.Insert("sensors/room?/temp"));
+  EXPECT_TRUE(trie_.Insert("sensors/room[0-4]/*"));
+  EXPECT_TRUE(trie_.Insert("*"));
+  EXPECT_TRUE(trie_.Insert("**"));
+  EXPECT_FALSE(trie_.Insert("sensors/*"));
+  EXPECT_EQ(6u, trie_.size());
+
+  EXPECT_EQ(Match("sensors/room1/temp"),
+            (vector<string>{"*", "**", "sensors/*", "sensors/*/temp", "sensors/room?/temp",
+                            "sensors/room[0-4]/*"}));
+  EXPECT_EQ(Match("sensors/room7/hum"), (vector<string>{"*", "**", "sensors/*"}));
+  EXPECT_EQ(Match("lights/1"), (vector<string>{"*", "**"}));
+  EXPECT_TRUE(Match("").empty());  // as in Redis
+
+  EXPECT_TRUE(trie_.Erase("*"));
+  EXPECT_FALSE(trie_.Erase("*"));
+  EXPECT_TRUE(trie_.Erase("sensors/*"));
+  EXPECT_FALSE(trie_.Erase("sensors/room1/temp"));
+  EXPECT_EQ(Match("sensors/room1/temp"),
+            (vector<string>{"**", "sensors/*/temp", "sensors/room?/temp", "sensors/room[0-4]/*"}));
+
+  trie_.Erase("**");
+  trie_.Erase("sensors/*/temp");
+  trie_.Erase("sensors/room?/temp");
+  trie_.Erase("sensors/room[0-4]/*");
+  EXPECT_EQ(0u, trie_.size());
+  EXPECT_TRUE(Match("sensors/room1/temp").empty());
+}
+
+TEST_F(GlobTrieTest, Special) {
+  trie_.Insert("a\\*b");
+  trie_.Insert("a[^x]b");
+  trie_.Insert("a[b");  // unterminated class.
+  trie_.Insert("\\");
+  trie_.Insert("");
+
+  EXPECT_EQ(Match("a*b"), (vector<string>{"a[^x]b", "a\\*b"}));
+  EXPECT_EQ(Match("axb"), (vector<string>{}));
+  EXPECT_EQ(Match("ab"), (vector<string>{"a[b"}));  // stringmatchlen's take on it.
+  EXPECT_EQ(Match("\\"), (vector<string>{"\\"}));
+  EXPECT_EQ(Match(""), (vector<string>{""}));
+}
+
+TEST_F(GlobTrieTest, Random) {
+  // Compare with stringmatchlen on short strings of few letters, to hit many matches.
+  absl::InsecureBitGen gen;
+  auto random_str = [&](string_view alphabet, size_t max_len) {
+    string res(absl::Uniform<size_t>(gen, 0, max_len + 1), 0);
+    for (char& c : res) {
+      c = alphabet[absl::Uniform<size_t>(gen, 0, alphabet.size())];
+    }
+    return res;
+  };
+
+  vector<string> patterns;
+  for (unsigned i = 0; i < 2000; ++i) {
+    string pattern = random_str("ab*?[]^-\\", 6);
+    if (find(patterns.begin(), patterns.end(), pattern) == patterns.end()) {
+      ASSERT_TRUE(trie_.Insert(pattern)) << pattern;
+      patterns.push_back(pattern);
+    }
+  }
+  ASSERT_EQ(patterns.size(), trie_.size());
+
+  for (unsigned i = 0; i < 2000; ++i) {
+    string str = random_str("ab]^-\\", 8);
+    vector<string> expected;
+    for (const string& pattern : patterns) {
+      if (stringmatchlen(pattern.data(), pattern.size(), str.data(), str.size(), 0) == 1)
+        expected.push_back(pattern);
+    }
+    sort(expected.begin(), expected.end());
+    ASSERT_EQ(expected, Match(str)) << str;
+  }
+
+  for (const string& pattern : patterns) {
+    ASSERT_TRUE(trie_.Erase(pattern)) << pattern;
+  }
+  EXPECT_EQ(0u, trie_.size());
+}
+
+}  // namespace dfly
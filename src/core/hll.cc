@@ -0,0 +1,432 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hll.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace dfly {
+namespace hll {
+
+using namespace std;
+
+namespace {
+
+constexpr string_view kMagic = "HYLL";
+constexpr uint8_t kDenseEnc = 0;
+constexpr uint8_t kSparseEnc = 1;
+
+// Set in the last byte of the cache when a write invalidated it.
+constexpr uint8_t kInvalidCacheBit = 1 << 7;
+
+// The sparse opcodes: ZERO is 00xxxxxx, a run of up to 64 empty registers. XZERO is
+// 01xxxxxx yyyyyyyy, a run of up to 16384 empty registers. VAL is 1vvvvvxx, a run of up to 4
+// registers of the value vvvvv + 1.
+constexpr uint8_t kOpMask = 0xc0;
+constexpr uint8_t kXZeroBit = 0x40;
+constexpr uint8_t kValBit = 0x80;
+constexpr unsigned kMaxZeroLen = 64;
+constexpr unsigned kMaxXZeroLen = 16384;
+constexpr unsigned kMaxValLen = 4;
+
+constexpr uint8_t kRegisterMask = (1 << kRegisterBits) - 1;
+
+// 1 / (2 * ln(2)), the bias correction of the estimator.
+constexpr double kAlphaInf = 0.721347520444481703680;
+
+// The hash function of Redis, so that the elements map to the same registers. Reads the words
+// in the host order, which is little endian on the platforms we support.
+uint64_t MurmurHash64A(string_view key, uint64_t seed) {
+  constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+  constexpr int r = 47;
+
+  uint64_t h = seed ^ (key.size() * m);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(key.data());
+  const uint8_t* end = data + (key.size() - (key.size() & 7));
+
+  for (; data != end; data += 8) {
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (key.size() & 7) {
+    case 7:
+      h ^= uint64_t(data[6]) << 48;
+      [[fallthrough]];
+    case 6:
+      h ^= uint64_t(data[5]) << 40;
+      [[fallthrough]];
+    case 5:
+      h ^= uint64_t(data[4]) << 32;
+      [[fallthrough]];
+    case 4:
+      h ^= uint64_t(data[3]) << 24;
+      [[fallthrough]];
+    case 3:
+      h ^= uint64_t(data[2]) << 16;
+      [[fallthrough]];
+    case 2:
+      h ^= uint64_t(data[1]) << 8;
+      [[fallthrough]];
+    case 1:
+      h ^= uint64_t(data[0]);
+      h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// Returns the register of elem and the rank of the rest of its hash, in [1, kHashBits + 1].
+pair<unsigned, uint8_t> HashElement(string_view elem) {
+  uint64_t hash = MurmurHash64A(elem, 0xadc83b19ULL);
+  unsigned index = hash & (kNumRegisters - 1);
+
+  // The sentinel bit bounds the rank.
+  hash = (hash >> kPrecision) | (1ULL << kHashBits);
+  return {index, uint8_t(absl::countr_zero(hash) + 1)};
+}
+
+const uint8_t* RegBytes(string_view sketch) {
+  return reinterpret_cast<const uint8_t*>(sketch.data()) + kHeaderSize;
+}
+
+string NewHeader(uint8_t encoding) {
+  string res(kHeaderSize, '\0');
+  memcpy(res.data(), kMagic.data(), kMagic.size());
+  res[kMagic.size()] = encoding;
+  return res;
+}
+
+void InvalidateCache(string* sketch) {
+  (*sketch)[kCacheOffset + kCacheSize - 1] |= kInvalidCacheBit;
+}
+
+uint8_t GetDense(const uint8_t* regs, unsigned index) {
+  unsigned bit = index * kRegisterBits;
+  unsigned byte = bit / 8, shift = bit % 8;
+  unsigned val = regs[byte] >> shift;
+  if (shift > 8 - kRegisterBits)
+    val |= unsigned(regs[byte + 1]) << (8 - shift);
+  return val & kRegisterMask;
+}
+
+void SetDense(uint8_t* regs, unsigned index, uint8_t val) {
+  unsigned bit = index * kRegisterBits;
+  unsigned byte = bit / 8, shift = bit % 8;
+  regs[byte] = (regs[byte] & ~(kRegisterMask << shift)) | (val << shift);
+  if (shift > 8 - kRegisterBits) {
+    unsigned rshift = 8 - shift;
+    regs[byte + 1] = (regs[byte + 1] & ~(kRegisterMask >> rshift)) | (val >> rshift);
+  }
+}
+
+// Calls cb(index, len, value) for the runs of the sparse registers. Returns false if the opcodes
+// are truncated or do not cover exactly all the registers.
+template <typename F> bool ForEachRun(string_view sketch, F&& cb) {
+  const uint8_t* p = RegBytes(sketch);
+  const uint8_t* end = reinterpret_cast<const uint8_t*>(sketch.data()) + sketch.size();
+  unsigned index = 0;
+
+  while (p < end) {
+    unsigned len;
+    uint8_t val = 0;
+    if ((*p & kOpMask) == 0) {
+      len = (*p & 0x3f) + 1;
+      ++p;
+    } else if ((*p & kOpMask) == kXZeroBit) {
+      if (p + 1 == end)
+        return false;
+      len = (((*p & 0x3f) << 8) | p[1]) + 1;
+      p += 2;
+    } else {
+      val = ((*p >> 2) & 0x1f) + 1;
+      len = (*p & 0x3) + 1;
+      ++p;
+    }
+
+    if (index + len > kNumRegisters)
+      return false;
+    cb(index, len, val);
+    index += len;
+  }
+  return index == kNumRegisters;
+}
+
+// The dense registers are packed 4 per 3 bytes, which the loops below unpack a group at a time
+// so that the compiler could vectorize them.
+void DenseMergeMax(const uint8_t* p, uint8_t* dest) {
+  for (unsigned i = 0; i < kNumRegisters; i += 4, p += 3) {
+    uint8_t r0 = p[0] & kRegisterMask;
+    uint8_t r1 = ((p[0] >> 6) | (p[1] << 2)) & kRegisterMask;
+    uint8_t r2 = ((p[1] >> 4) | (p[2] << 4)) & kRegisterMask;
+    uint8_t r3 = p[2] >> 2;
+    dest[i] = max(dest[i], r0);
+    dest[i + 1] = max(dest[i + 1], r1);
+    dest[i + 2] = max(dest[i + 2], r2);
+    dest[i + 3] = max(dest[i + 3], r3);
+  }
+}
+
+// The registers counts by their value.
+using Histogram = array<unsigned, 1 << kRegisterBits>;
+
+void DenseHistogram(const uint8_t* p, Histogram* hist) {
+  for (unsigned i = 0; i < kNumRegisters; i += 4, p += 3) {
+    ++(*hist)[p[0] & kRegisterMask];
+    ++(*hist)[((p[0] >> 6) | (p[1] << 2)) & kRegisterMask];
+    ++(*hist)[((p[1] >> 4) | (p[2] << 4)) & kRegisterMask];
+    ++(*hist)[p[2] >> 2];
+  }
+}
+
+double Tau(double x) {
+  if (x == 0. || x == 1.)
+    return 0.;
+
+  double prev, y = 1.0, z = 1 - x;
+  do {
+    x = sqrt(x);
+    prev = z;
+    y *= 0.5;
+    z -= pow(1 - x, 2) * y;
+  } while (prev != z);
+  return z / 3;
+}
+
+double Sigma(double x) {
+  if (x == 1.)
+    return INFINITY;
+
+  double prev, y = 1, z = x;
+  do {
+    x *= x;
+    prev = z;
+    z += x * y;
+    y += y;
+  } while (prev != z);
+  return z;
+}
+
+// The estimator of Redis, from "New cardinality estimation algorithms for HyperLogLog
+// sketches" (Otmar Ertl).
+uint64_t Estimate(const Histogram& hist) {
+  double m = kNumRegisters;
+  double z = m * Tau((m - hist[kHashBits + 1]) / m);
+  for (unsigned j = kHashBits; j >= 1; --j) {
+    z += hist[j];
+    z *= 0.5;
+  }
+  z += m * Sigma(hist[0] / m);
+  return llroundl(kAlphaInf * m * m / z);
+}
+
+string EncodeDense(const Registers& regs) {
+  string res = NewHeader(kDenseEnc);
+  res.resize(kDenseSize, '\0');
+  uint8_t* p = reinterpret_cast<uint8_t*>(res.data()) + kHeaderSize;
+  for (unsigned i = 0; i < kNumRegisters; i += 4, p += 3) {
+    uint8_t r0 = regs[i] & kRegisterMask, r1 = regs[i + 1] & kRegisterMask;
+    uint8_t r2 = regs[i + 2] & kRegisterMask, r3 = regs[i + 3] & kRegisterMask;
+    p[0] = r0 | (r1 << 6);
+    p[1] = (r1 >> 2) | (r2 << 4);
+    p[2] = (r2 >> 4) | (r3 << 2);
+  }
+  return res;
+}
+
+// Returns an empty string if a value does not fit the sparse encoding or the sketch would be
+// larger than max_bytes.
+string EncodeSparse(const Registers& regs, size_t max_bytes) {
+  string res = NewHeader(kSparseEnc);
+  for (unsigned i = 0; i < kNumRegisters;) {
+    uint8_t val = regs[i];
+    unsigned run = 1;
+    while (i + run < kNumRegisters && regs[i + run] == val)
+      ++run;
+    i += run;
+
+    if (val > kMaxSparseValue)
+      return {};
+
+    while (run > 0) {
+      if (val > 0) {
+        unsigned len = min(run, kMaxValLen);
+        res.push_back(kValBit | ((val - 1) << 2) | (len - 1));
+        run -= len;
+      } else {
+        unsigned len = min(run, kMaxXZeroLen);
+        if (len > kMaxZeroLen) {
+          res.push_back(kXZeroBit | ((len - 1) >> 8));
+          res.push_back((len - 1) & 0xff);
+        } else {
+          res.push_back(len - 1);
+        }
+        run -= len;
+      }
+    }
+
+    if (res.size() > max_bytes)
+      return {};
+  }
+  return res;
+}
+
+string EncodeRegisters(const Registers& regs, bool dense, size_t sparse_max_bytes) {
+  string res;
+  if (!dense)
+    res = EncodeSparse(regs, sparse_max_bytes);
+  if (res.empty())
+    res = EncodeDense(regs);
+  return res;
+}
+
+bool AddSparse(absl::Span<const string_view> elems, size_t sparse_max_bytes, string* sketch) {
+  vector<pair<unsigned, uint8_t>> hashed(elems.size());
+  for (size_t i = 0; i < elems.size(); ++i)
+    hashed[i] = HashElement(elems[i]);
+  sort(hashed.begin(), hashed.end());
+
+  // The elements that were already counted are the common case, which we check without
+  // decoding the sketch.
+  bool changed = false;
+  size_t pos = 0;
+  ForEachRun(*sketch, [&](unsigned index, unsigned len, uint8_t val) {
+    for (; pos < hashed.size() && hashed[pos].first < index + len; ++pos)
+      changed |= hashed[pos].second > val;
+  });
+  if (!changed)
+    return false;
+
+  auto regs = make_unique<Registers>();
+  regs->fill(0);
+  MergeMax(*sketch, regs.get());
+
+  bool dense = false;
+  for (auto [index, rank] : hashed) {
+    (*regs)[index] = max((*regs)[index], rank);
+    dense |= rank > kMaxSparseValue;
+  }
+  *sketch = EncodeRegisters(*regs, dense, sparse_max_bytes);
+  return true;
+}
+
+}  // namespace
+
+string NewSketch() {
+  string res = NewHeader(kSparseEnc);
+  res.push_back(kXZeroBit | ((kNumRegisters - 1) >> 8));
+  res.push_back((kNumRegisters - 1) & 0xff);
+  return res;
+}
+
+bool IsValid(string_view str) {
+  if (str.size() < kHeaderSize || str.substr(0, kMagic.size()) != kMagic)
+    return false;
+
+  switch (uint8_t(str[kMagic.size()])) {
+    case kDenseEnc:
+      return str.size() == kDenseSize;
+    case kSparseEnc:
+      return ForEachRun(str, [](unsigned, unsigned, uint8_t) {});
+  }
+  return false;
+}
+
+bool IsDense(string_view sketch) {
+  return sketch[kMagic.size()] == kDenseEnc;
+}
+
+bool Add(absl::Span<const string_view> elems, size_t sparse_max_bytes, string* sketch) {
+  bool changed = false;
+  if (IsDense(*sketch)) {
+    uint8_t* regs = reinterpret_cast<uint8_t*>(sketch->data()) + kHeaderSize;
+    for (string_view elem : elems) {
+      auto [index, rank] = HashElement(elem);
+      if (rank > GetDense(regs, index)) {
+        SetDense(regs, index, rank);
+        changed = true;
+      }
+    }
+  } else {
+    changed = AddSparse(elems, sparse_max_bytes, sketch);
+  }
+
+  if (changed)
+    InvalidateCache(sketch);
+  return changed;
+}
+
+void MergeMax(string_view sketch, Registers* dest) {
+  if (IsDense(sketch)) {
+    DenseMergeMax(RegBytes(sketch), dest->data());
+    return;
+  }
+
+  ForEachRun(sketch, [dest](unsigned index, unsigned len, uint8_t val) {
+    for (unsigned i = index; val > 0 && i < index + len; ++i)
+      (*dest)[i] = max((*dest)[i], val);
+  });
+}
+
+void MergeMax(const Registers& src, Registers* dest) {
+  for (unsigned i = 0; i < kNumRegisters; ++i)
+    (*dest)[i] = max((*dest)[i], src[i]);
+}
+
+uint64_t Count(string_view sketch) {
+  Histogram hist{};
+  if (IsDense(sketch)) {
+    DenseHistogram(RegBytes(sketch), &hist);
+  } else {
+    ForEachRun(sketch, [&hist](unsigned, unsigned len, uint8_t val) { hist[val] += len; });
+  }
+  return Estimate(hist);
+}
+
+uint64_t Count(const Registers& regs) {
+  Histogram hist{};
+  for (uint8_t val : regs)
+    ++hist[val & kRegisterMask];
+  return Estimate(hist);
+}
+
+optional<uint64_t> CachedCount(string_view sketch) {
+  const uint8_t* cache = reinterpret_cast<const uint8_t*>(sketch.data()) + kCacheOffset;
+  if (cache[kCacheSize - 1] & kInvalidCacheBit)
+    return nullopt;
+
+  uint64_t res = 0;
+  for (unsigned i = kCacheSize; i > 0; --i)
+    res = (res << 8) | cache[i - 1];
+  return res;
+}
+
+void SetCachedCount(uint64_t count, char* cache) {
+  for (unsigned i = 0; i < kCacheSize; ++i, count >>= 8)
+    cache[i] = count & 0xff;
+}
+
+string Encode(const Registers& regs, bool dense, size_t sparse_max_bytes) {
+  string res = EncodeRegisters(regs, dense, sparse_max_bytes);
+  SetCachedCount(Count(regs), res.data() + kCacheOffset);
+  return res;
+}
+
+}  // namespace hll
+}  // namespace dfly
@@ -0,0 +1,76 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace dfly {
+
+// HyperLogLog sketches in the string format of Redis, so that the values are interchangeable
+// with it through the RDB files, DUMP/RESTORE and the replication. A sketch is a 16 bytes
+// header followed by 16384 registers of 6 bits, either packed (dense) or run-length encoded
+// (sparse). The header caches the last estimated cardinality.
+namespace hll {
+
+constexpr unsigned kPrecision = 14;
+constexpr unsigned kNumRegisters = 1u << kPrecision;
+constexpr unsigned kRegisterBits = 6;
+
+// Bits of the hash that are left for the rank once the register index is taken.
+constexpr unsigned kHashBits = 64 - kPrecision;
+
+constexpr size_t kHeaderSize = 16;
+constexpr size_t kDenseSize = kHeaderSize + (kNumRegisters * kRegisterBits + 7) / 8;
+
+// The largest register value of the sparse encoding.
+constexpr uint8_t kMaxSparseValue = 32;
+
+// One byte per register, which is the form the sketches are merged in.
+using Registers = std::array<uint8_t, kNumRegisters>;
+
+// Returns an empty sparse sketch.
+std::string NewSketch();
+
+// Whether str has a valid header and encoding. The other functions assume valid sketches.
+bool IsValid(std::string_view str);
+
+bool IsDense(std::string_view sketch);
+
+// Adds the elements to sketch. Returns true if any register changed, in which case the cached
+// cardinality is invalidated. A sparse sketch is converted to the dense encoding once a value
+// does not fit the sparse one or its size goes above sparse_max_bytes.
+bool Add(absl::Span<const std::string_view> elems, size_t sparse_max_bytes, std::string* sketch);
+
+// Raises the registers of dest to those of sketch.
+void MergeMax(std::string_view sketch, Registers* dest);
+void MergeMax(const Registers& src, Registers* dest);
+
+// Estimates the cardinality, ignoring the cache.
+uint64_t Count(std::string_view sketch);
+uint64_t Count(const Registers& regs);
+
+// The cardinality cached in the header, or nullopt if a write invalidated it.
+std::optional<uint64_t> CachedCount(std::string_view sketch);
+
+// Offset and size of the cached cardinality within the header.
+constexpr size_t kCacheOffset = 8;
+constexpr size_t kCacheSize = 8;
+
+// Writes count as a valid cache to the kCacheSize bytes at cache, e.g. in place in the string
+// of a value.
+void SetCachedCount(uint64_t count, char* cache);
+
+// Encodes regs as a sketch with a valid cached cardinality. The sketch is dense if dense is set,
+// or if the sparse encoding does not fit or would take more than sparse_max_bytes.
+std::string Encode(const Registers& regs, bool dense, size_t sparse_max_bytes);
+
+}  // namespace hll
+}  // namespace dfly
@@ -0,0 +1,147 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hll.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+class HllTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kSparseMaxBytes = 3000;
+
+  // Adds the elements [from, to) in batches.
+  static void AddRange(unsigned from, unsigned to, string* sketch) {
+    vector<string> elems;
+    for (unsigned i = from; i < to; ++i) {
+      elems.push_back(absl::StrCat("elem:", i));
+      if (elems.size() == 64 || i + 1 == to) {
+        vector<string_view> views(elems.begin(), elems.end());
+        hll::Add(views, kSparseMaxBytes, sketch);
+        elems.clear();
+      }
+    }
+  }
+
+  static double Error(uint64_t count, unsigned expected) {
+    return fabs(double(count) - expected) / expected;
+  }
+};
+
+TEST_F(HllTest, Empty) {
+  string sketch = hll::NewSketch();
+  ASSERT_TRUE(hll::IsValid(sketch));
+  EXPECT_FALSE(hll::IsDense(sketch));
+  EXPECT_EQ(0u, hll::Count(sketch));
+  EXPECT_EQ(0u, hll::CachedCount(sketch));
+}
+
+TEST_F(HllTest, Add) {
+  string sketch = hll::NewSketch();
+  vector<string_view> elems{"a", "b", "c", "d", "e", "f", "g"};
+  EXPECT_TRUE(hll::Add(elems, kSparseMaxBytes, &sketch));
+  EXPECT_FALSE(hll::CachedCount(sketch));
+  EXPECT_EQ(7u, hll::Count(sketch));
+
+  // Nothing changes for the counted elements.
+  hll::SetCachedCount(7, sketch.data() + hll::kCacheOffset);
+  EXPECT_FALSE(hll::Add(elems, kSparseMaxBytes, &sketch));
+  EXPECT_EQ(7u, hll::CachedCount(sketch));
+}
+
+TEST_F(HllTest, Accuracy) {
+  string sketch = hll::NewSketch();
+  unsigned added = 0;
+  for (unsigned n : {10, 100, 1000, 10000, 100000}) {
+    AddRange(added, n, &sketch);
+    added = n;
+    ASSERT_TRUE(hll::IsValid(sketch));
+    EXPECT_LT(Error(hll::Count(sketch), n), 0.03) << n;
+  }
+
+  // The sparse encoding can not hold that many registers within the limit.
+  EXPECT_TRUE(hll::IsDense(sketch));
+  EXPECT_EQ(hll::kDenseSize, sketch.size());
+}
+
+TEST_F(HllTest, Merge) {
+  string sparse = hll::NewSketch(), dense = hll::NewSketch();
+  AddRange(0, 100, &sparse);
+  AddRange(100, 50000, &dense);
+  ASSERT_FALSE(hll::IsDense(sparse));
+  ASSERT_TRUE(hll::IsDense(dense));
+
+  auto regs = make_unique<hll::Registers>();
+  regs->fill(0);
+  hll::MergeMax(sparse, regs.get());
+  EXPECT_EQ(hll::Count(sparse), hll::Count(*regs));
+  hll::MergeMax(dense, regs.get());
+  EXPECT_LT(Error(hll::Count(*regs), 50000), 0.03);
+
+  // The same as adding all the elements to a single sketch.
+  string all = hll::NewSketch();
+  AddRange(0, 50000, &all);
+  EXPECT_EQ(hll::Count(all), hll::Count(*regs));
+
+  auto other = make_unique<hll::Registers>();
+  other->fill(0);
+  hll::MergeMax(*regs, other.get());
+  EXPECT_EQ(*regs, *other);
+}
+
+TEST_F(HllTest, Encode) {
+  auto regs = make_unique<hll::Registers>();
+  regs->fill(0);
+  for (unsigned i = 0; i < hll::kNumRegisters; i += 97)
+    (*regs)[i] = 1 + i % hll::kMaxSparseValue;
+
+  for (bool dense : {false, true}) {
+    string sketch = hll::Encode(*regs, dense, kSparseMaxBytes);
+    ASSERT_TRUE(hll::IsValid(sketch));
+    EXPECT_EQ(dense, hll::IsDense(sketch));
+    EXPECT_EQ(hll::Count(*regs), hll::CachedCount(sketch));
+
+    auto decoded = make_unique<hll::Registers>();
+    decoded->fill(0);
+    hll::MergeMax(sketch, decoded.get());
+    EXPECT_EQ(*regs, *decoded);
+  }
+
+  // Values above kMaxSparseValue need the dense encoding.
+  (*regs)[5] = hll::kMaxSparseValue + 1;
+  EXPECT_TRUE(hll::IsDense(hll::Encode(*regs, false, kSparseMaxBytes)));
+}
+
+TEST_F(HllTest, Invalid) {
+  EXPECT_FALSE(hll::IsValid(""));
+  EXPECT_FALSE(hll::IsValid("HYLL"));
+
+  string sketch = hll::NewSketch();
+  sketch[0] = 'X';
+  EXPECT_FALSE(hll::IsValid(sketch));
+
+  // The runs do not cover all the registers.
+  sketch = hll::NewSketch();
+  sketch.pop_back();
+  EXPECT_FALSE(hll::IsValid(sketch));
+  sketch.back() = 0;
+  EXPECT_FALSE(hll::IsValid(sketch));
+
+  sketch = hll::NewSketch();
+  AddRange(0, 10000, &sketch);
+  ASSERT_TRUE(hll::IsDense(sketch));
+  sketch.pop_back();
+  EXPECT_FALSE(hll::IsValid(sketch));
+}
+
+}  // namespace dfly
@@ -31,6 +31,15 @@ class IntentLock {
     return (m == SHARED) ? true : IsFree();
   }
 
+  // Returns true if an intent of mode m, that was already recorded by the caller,
+  // does not conflict with intents of others.
+  bool IsGranted(Mode m) const {
+    if (m == SHARED)
+      return cnt_[EXCLUSIVE] == 0;
+
+    return cnt_[EXCLUSIVE] == 1 && cnt_[SHARED] == 0;
+  }
+
   void Release(Mode m, unsigned val = 1) {
     assert(cnt_[m] >= val);
 
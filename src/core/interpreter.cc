@@ -4,10 +4,16 @@
 
 #include "core/interpreter.h"
 
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/time/clock.h>
+#include <mimalloc.h>
 #include <openssl/evp.h>
 
+#include <boost/fiber/operations.hpp>
+
 #include <cstring>
+#include <mutex>
 #include <optional>
 
 extern "C" {
@@ -133,6 +139,75 @@ void RedisTranslator::OnArrayEnd() {
   ArrayPost();
 }
 
+// Collects the replies of the commands of redis.pcall_batch into the table at the top of the
+// stack, one entry per reply.
+class BatchTranslator : public ObjectExplorer {
+ public:
+  BatchTranslator(lua_State* lua) : lua_(lua), translator_(lua) {
+  }
+
+  void OnBool(bool b) final {
+    translator_.OnBool(b);
+    PostReply();
+  }
+
+  void OnString(std::string_view str) final {
+    translator_.OnString(str);
+    PostReply();
+  }
+
+  void OnDouble(double d) final {
+    translator_.OnDouble(d);
+    PostReply();
+  }
+
+  void OnInt(int64_t val) final {
+    translator_.OnInt(val);
+    PostReply();
+  }
+
+  void OnArrayStart(unsigned len) final {
+    translator_.OnArrayStart(len);
+    ++depth_;
+  }
+
+  void OnArrayEnd() final {
+    translator_.OnArrayEnd();
+    --depth_;
+    PostReply();
+  }
+
+  void OnNil() final {
+    translator_.OnNil();
+    PostReply();
+  }
+
+  void OnStatus(std::string_view str) final {
+    translator_.OnStatus(str);
+    PostReply();
+  }
+
+  void OnError(std::string_view str) final {
+    translator_.OnError(str);
+    PostReply();
+  }
+
+  unsigned num_replies() const {
+    return num_replies_;
+  }
+
+ private:
+  void PostReply() {
+    if (depth_ == 0)
+      lua_rawseti(lua_, -2, ++num_replies_);
+  }
+
+  lua_State* lua_;
+  RedisTranslator translator_;
+  unsigned depth_ = 0;
+  unsigned num_replies_ = 0;
+};
+
 void RunSafe(lua_State* lua, string_view buf, const char* name) {
   CHECK_EQ(0, luaL_loadbuffer(lua, buf.data(), buf.size(), name));
   int err = lua_pcall(lua, 0, 0, 0);
@@ -331,12 +406,24 @@ int RedisStatusReplyCommand(lua_State* lua) {
   return SingleFieldTable(lua, "ok");
 }
 
+int LuaPanic(lua_State* lua) {
+  LOG(FATAL) << "Unprotected error in call to Lua API: " << lua_tostring(lua, -1);
+  return 0;
+}
+
+int DumpWriter(lua_State* lua, const void* p, size_t sz, void* ud) {
+  static_cast<string*>(ud)->append(static_cast<const char*>(p), sz);
+  return 0;
+}
+
 // const char* kInstanceKey = "_INSTANCE";
 
 }  // namespace
 
 Interpreter::Interpreter() {
-  lua_ = luaL_newstate();
+  lua_ = lua_newstate(LuaAlloc, this);
+  CHECK(lua_);
+  lua_atpanic(lua_, LuaPanic);
   InitLua(lua_);
   void** ptr = static_cast<void**>(lua_getextraspace(lua_));
   *ptr = this;
@@ -355,6 +442,11 @@ Interpreter::Interpreter() {
   lua_pushcfunction(lua_, RedisPCallCommand);
   lua_settable(lua_, -3);
 
+  /* redis.pcall_batch */
+  lua_pushstring(lua_, "pcall_batch");
+  lua_pushcfunction(lua_, RedisPCallBatchCommand);
+  lua_settable(lua_, -3);
+
   lua_pushstring(lua_, "sha1hex");
   lua_pushcfunction(lua_, RedisSha1Command);
   lua_settable(lua_, -3);
@@ -383,7 +475,7 @@ void Interpreter::FuncSha1(string_view body, char* fp) {
   ToHex(digest, fp);
 }
 
-auto Interpreter::AddFunction(string_view body, string* result) -> AddResult {
+auto Interpreter::AddFunction(string_view body, string* result, string* bytecode) -> AddResult {
   char funcname[43];
   funcname[0] = 'f';
   funcname[1] = '_';
@@ -393,7 +485,7 @@ auto Interpreter::AddFunction(string_view body, string* result) -> AddResult {
   int type = lua_getglobal(lua_, funcname);
   lua_pop(lua_, 1);
 
-  if (type == LUA_TNIL && !AddInternal(funcname, body, result))
+  if (type == LUA_TNIL && !AddInternal(funcname, body, result, bytecode))
     return COMPILE_ERR;
 
   result->assign(funcname + 2);
@@ -401,6 +493,22 @@ auto Interpreter::AddFunction(string_view body, string* result) -> AddResult {
   return type == LUA_TNIL ? ADD_OK : ALREADY_EXISTS;
 }
 
+bool Interpreter::AddBytecode(string_view bytecode, string* error) {
+  // Binary chunks keep the name they were compiled with.
+  int res = luaL_loadbufferx(lua_, bytecode.data(), bytecode.size(), nullptr, "b");
+  if (res == 0) {
+    res = lua_pcall(lua_, 0, 0, 0);  // run func definition code
+  }
+
+  if (res) {
+    error->assign(lua_tostring(lua_, -1));
+    lua_pop(lua_, 1);  // Remove the error.
+    return false;
+  }
+
+  return true;
+}
+
 bool Interpreter::Exists(string_view sha) const {
   if (sha.size() != 40)
     return false;
@@ -438,9 +546,14 @@ auto Interpreter::RunFunction(string_view sha, std::string* error) -> RunResult
 
   // At this point lua stack has 2 globals.
 
+  in_run_ = true;
+  run_instructions_ = 0;
+  slice_start_ns_ = absl::GetCurrentTimeNanos();
+
   /* We have zero arguments and expect
    * a single return value. */
   int err = lua_pcall(lua_, 0, 1, -2);
+  in_run_ = false;
 
   if (err) {
     *error = lua_tostring(lua_, -1);
@@ -471,12 +584,21 @@ bool Interpreter::IsResultSafe() const {
   return res;
 }
 
-bool Interpreter::AddInternal(const char* f_id, string_view body, string* error) {
+bool Interpreter::AddInternal(const char* f_id, string_view body, string* error,
+                              string* bytecode) {
   string script = absl::StrCat("function ", f_id, "() \n");
+
+  // Comment out the "#!lua flags=..." shebang line, it is not valid lua code.
+  if (absl::StartsWith(body, "#!"))
+    script.append("--");
   absl::StrAppend(&script, body, "\nend");
 
   int res = luaL_loadbuffer(lua_, script.data(), script.size(), "@user_script");
   if (res == 0) {
+    if (bytecode) {
+      bytecode->clear();
+      lua_dump(lua_, DumpWriter, bytecode, 0);  // keep debug info for error messages.
+    }
     res = lua_pcall(lua_, 0, 0, 0);  // run func definition code
   }
 
@@ -490,6 +612,72 @@ bool Interpreter::AddInternal(const char* f_id, string_view body, string* error)
   return true;
 }
 
+void* Interpreter::LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  Interpreter* me = static_cast<Interpreter*>(ud);
+
+  // osize is the type of the allocated object when ptr is null.
+  size_t old_size = ptr ? mi_usable_size(ptr) : 0;
+  if (nsize == 0) {
+    me->used_bytes_ -= old_size;
+    mi_free(ptr);
+    return nullptr;
+  }
+
+  // We limit only the scripts, since lua raises memory errors as script errors only within
+  // protected calls.
+  size_t max_memory = me->limits_.max_memory;
+  if (max_memory && me->in_run_ && nsize > old_size &&
+      me->used_bytes_ + nsize - old_size > max_memory) {
+    return nullptr;
+  }
+
+  void* res = mi_realloc(ptr, nsize);
+  if (res) {
+    me->used_bytes_ += mi_usable_size(res);
+    me->used_bytes_ -= old_size;
+  }
+  return res;
+}
+
+void Interpreter::SetLimits(const Limits& limits) {
+  limits_ = limits;
+
+  bool needs_hook = limits.max_instructions || limits.max_call_depth || limits.yield_usec;
+  if (needs_hook) {
+    lua_sethook(lua_, LuaHook, LUA_MASKCOUNT, kHookPeriod);
+  } else {
+    lua_sethook(lua_, nullptr, 0, 0);
+  }
+}
+
+void Interpreter::LuaHook(lua_State* lua, lua_Debug* ar) {
+  Interpreter* me = *static_cast<Interpreter**>(lua_getextraspace(lua));
+  const Limits& limits = me->limits_;
+  if (!me->in_run_)  // function definitions are not limited.
+    return;
+
+  me->run_instructions_ += kHookPeriod;
+  if (limits.max_instructions && me->run_instructions_ > limits.max_instructions) {
+    luaL_error(lua, "script exceeded the limit of %I instructions",
+               lua_Integer(limits.max_instructions));
+  }
+
+  lua_Debug dummy;
+  if (limits.max_call_depth && lua_getstack(lua, limits.max_call_depth, &dummy)) {
+    luaL_error(lua, "script exceeded the call depth limit of %d", int(limits.max_call_depth));
+  }
+
+  if (limits.yield_usec) {
+    uint64_t now = absl::GetCurrentTimeNanos();
+    if (now - me->slice_start_ns_ > limits.yield_usec * 1000ULL) {
+      // The interpreter is borrowed by the script, so other fibers will not touch it.
+      ++me->yield_count_;
+      ::boost::this_fiber::yield();
+      me->slice_start_ns_ = absl::GetCurrentTimeNanos();
+    }
+  }
+}
+
 bool Interpreter::IsTableSafe() const {
   auto fres = FetchKey(lua_, "err");
   if (fres && *fres == LUA_TSTRING) {
@@ -600,6 +788,58 @@ void Interpreter::ResetStack() {
   lua_settop(lua_, 0);
 }
 
+namespace {
+
+// Copies the values at the stack indices [first, last] into blob, appending them to args as the
+// arguments of a command. Returns false if one of them is not a string or a number.
+bool ToCmdArgs(lua_State* lua, int first, int last, unique_ptr<char[]>* blob,
+               vector<absl::Span<char>>* args) {
+  size_t blob_len = 0;
+  char tmpbuf[64];
+
+  for (int idx = first; idx <= last; idx++) {
+    if (lua_isinteger(lua, idx)) {
+      absl::AlphaNum an(lua_tointeger(lua, idx));
+      blob_len += an.size();
+    } else if (lua_isnumber(lua, idx)) {
+      // fmt_len does not include '\0'.
+      int fmt_len = absl::SNPrintF(tmpbuf, sizeof(tmpbuf), "%.17g", lua_tonumber(lua, idx));
+      CHECK_GT(fmt_len, 0);
+      blob_len += fmt_len;
+    } else if (lua_isstring(lua, idx)) {
+      blob_len += lua_rawlen(lua, idx);  // lua_rawlen does not include '\0'.
+    } else {
+      return false;
+    }
+  }
+
+  // backing storage.
+  blob->reset(new char[blob_len + 8]);  // 8 safety.
+  char* cur = blob->get();
+  char* end = cur + blob_len;
+
+  for (int idx = first; idx <= last; idx++) {
+    size_t len = 0;
+    if (lua_isinteger(lua, idx)) {
+      char* next = absl::numbers_internal::FastIntToBuffer(lua_tointeger(lua, idx), cur);
+      len = next - cur;
+    } else if (lua_isnumber(lua, idx)) {
+      int fmt_len = absl::SNPrintF(cur, end - cur, "%.17g", lua_tonumber(lua, idx));
+      CHECK_GT(fmt_len, 0);
+      len = fmt_len;
+    } else if (lua_isstring(lua, idx)) {
+      len = lua_rawlen(lua, idx);
+      memcpy(cur, lua_tostring(lua, idx), len);  // copy \0 as well.
+    }
+
+    args->emplace_back(cur, len);
+    cur += len;
+  }
+  return true;
+}
+
+}  // namespace
+
 // Returns number of results, which is always 1 in this case.
 // Please note that lua resets the stack once the function returns so no need
 // to unwind the stack manually in the function (though lua allows doing this).
@@ -632,51 +872,12 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
     return raise_error ? RaiseError(lua_) : 1;
   }
 
-  size_t blob_len = 0;
-  char tmpbuf[64];
-
-  for (int j = 0; j < argc; j++) {
-    unsigned idx = j + 1;
-    if (lua_isinteger(lua_, idx)) {
-      absl::AlphaNum an(lua_tointeger(lua_, idx));
-      blob_len += an.size();
-    } else if (lua_isnumber(lua_, idx)) {
-      // fmt_len does not include '\0'.
-      int fmt_len = absl::SNPrintF(tmpbuf, sizeof(tmpbuf), "%.17g", lua_tonumber(lua_, idx));
-      CHECK_GT(fmt_len, 0);
-      blob_len += fmt_len;
-    } else if (lua_isstring(lua_, idx)) {
-      blob_len += lua_rawlen(lua_, idx);  // lua_rawlen does not include '\0'.
-    } else {
-      PushError(lua_, "Lua redis() command arguments must be strings or integers");
-      cmd_depth_--;
-      return raise_error ? RaiseError(lua_) : 1;
-    }
-  }
-
-  // backing storage.
-  unique_ptr<char[]> blob(new char[blob_len + 8]);  // 8 safety.
+  unique_ptr<char[]> blob;
   vector<absl::Span<char>> cmdargs;
-  char* cur = blob.get();
-  char* end = cur + blob_len;
-
-  for (int j = 0; j < argc; j++) {
-    unsigned idx = j + 1;
-    size_t len = 0;
-    if (lua_isinteger(lua_, idx)) {
-      char* next = absl::numbers_internal::FastIntToBuffer(lua_tointeger(lua_, idx), cur);
-      len = next - cur;
-    } else if (lua_isnumber(lua_, idx)) {
-      int fmt_len = absl::SNPrintF(cur, end - cur, "%.17g", lua_tonumber(lua_, idx));
-      CHECK_GT(fmt_len, 0);
-      len = fmt_len;
-    } else if (lua_isstring(lua_, idx)) {
-      len = lua_rawlen(lua_, idx);
-      memcpy(cur, lua_tostring(lua_, idx), len);  // copy \0 as well.
-    }
-
-    cmdargs.emplace_back(cur, len);
-    cur += len;
+  if (!ToCmdArgs(lua_, 1, argc, &blob, &cmdargs)) {
+    PushError(lua_, "Lua redis() command arguments must be strings or integers");
+    cmd_depth_--;
+    return raise_error ? RaiseError(lua_) : 1;
   }
 
   /* Pop all arguments from the stack, we do not need them anymore
@@ -691,6 +892,81 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
   return 1;
 }
 
+// Like redis.pcall, but runs a table of commands, each a table of arguments, and returns the
+// table of their replies. The errors are returned as the replies of their commands.
+int Interpreter::RedisBatchCommand() {
+  if (cmd_depth_) {
+    PushError(lua_, "redis.pcall_batch() recursive call detected");
+    return 1;
+  }
+
+  if (!redis_func_) {
+    PushError(lua_, "internal error - redis function not defined");
+    return 1;
+  }
+
+  if (lua_gettop(lua_) != 1 || !lua_istable(lua_, 1)) {
+    PushError(lua_, "Please specify a table of commands for redis.pcall_batch()");
+    return 1;
+  }
+
+  // Spread the arguments of all the commands on the stack, above the table.
+  size_t num_cmds = lua_rawlen(lua_, 1);
+  vector<int> cmd_ends(num_cmds);
+  for (size_t i = 0; i < num_cmds; i++) {
+    if (lua_rawgeti(lua_, 1, i + 1) != LUA_TTABLE || lua_rawlen(lua_, -1) == 0) {
+      lua_settop(lua_, 1);
+      PushError(lua_, "Every command of redis.pcall_batch() must be a non-empty table");
+      return 1;
+    }
+
+    size_t argc = lua_rawlen(lua_, -1);
+    if (!lua_checkstack(lua_, argc + 1)) {
+      lua_settop(lua_, 1);
+      PushError(lua_, "Too many arguments for redis.pcall_batch()");
+      return 1;
+    }
+
+    int cmd_table = lua_gettop(lua_);
+    for (size_t j = 0; j < argc; j++)
+      lua_rawgeti(lua_, cmd_table, j + 1);
+    lua_remove(lua_, cmd_table);
+    cmd_ends[i] = lua_gettop(lua_);
+  }
+
+  unique_ptr<char[]> blob;
+  vector<absl::Span<char>> cmdargs;
+  if (!ToCmdArgs(lua_, 2, lua_gettop(lua_), &blob, &cmdargs)) {
+    lua_settop(lua_, 1);
+    PushError(lua_, "Lua redis() command arguments must be strings or integers");
+    return 1;
+  }
+
+  vector<MutSliceSpan> cmds(num_cmds);
+  for (size_t i = 0, start = 0; i < num_cmds; i++) {
+    size_t end = cmd_ends[i] - 1;  // the index in cmdargs past the command.
+    cmds[i] = MutSliceSpan{cmdargs}.subspan(start, end - start);
+    start = end;
+  }
+
+  lua_settop(lua_, 0);
+  lua_createtable(lua_, num_cmds, 0);
+
+  cmd_depth_++;
+  BatchTranslator translator(lua_);
+  if (redis_batch_func_) {
+    redis_batch_func_(absl::MakeSpan(cmds), &translator);
+  } else {
+    for (MutSliceSpan cmd : cmds)
+      redis_func_(cmd, &translator);
+  }
+  DCHECK_EQ(num_cmds, translator.num_replies());
+  DCHECK_EQ(1, lua_gettop(lua_));
+  cmd_depth_--;
+
+  return 1;
+}
+
 int Interpreter::RedisCallCommand(lua_State* lua) {
   void** ptr = static_cast<void**>(lua_getextraspace(lua));
   return reinterpret_cast<Interpreter*>(*ptr)->RedisGenericCommand(true);
@@ -701,4 +977,47 @@ int Interpreter::RedisPCallCommand(lua_State* lua) {
   return reinterpret_cast<Interpreter*>(*ptr)->RedisGenericCommand(false);
 }
 
+int Interpreter::RedisPCallBatchCommand(lua_State* lua) {
+  void** ptr = static_cast<void**>(lua_getextraspace(lua));
+  return reinterpret_cast<Interpreter*>(*ptr)->RedisBatchCommand();
+}
+
+Interpreter* InterpreterManager::Get() {
+  if (Interpreter* ir = TryGet())
+    return ir;
+
+  unique_lock lk(mu_);
+  cond_.wait(lk, [this] { return !available_.empty(); });
+
+  Interpreter* ir = available_.back();
+  available_.pop_back();
+  return ir;
+}
+
+Interpreter* InterpreterManager::TryGet() {
+  if (available_.empty()) {
+    if (storage_.size() >= max_size_)
+      return nullptr;
+    Interpreter& ir = storage_.emplace_back();
+    ir.SetLimits(limits_);
+    return &ir;
+  }
+
+  Interpreter* ir = available_.back();
+  available_.pop_back();
+  return ir;
+}
+
+void InterpreterManager::Return(Interpreter* ir) {
+  available_.push_back(ir);
+  cond_.notify_one();
+}
+
+size_t InterpreterManager::used_bytes() const {
+  size_t res = 0;
+  for (const Interpreter& ir : storage_)
+    res += ir.used_bytes();
+  return res;
+}
+
 }  // namespace dfly
@@ -4,13 +4,17 @@
 
 #pragma once
 
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <deque>
 #include <functional>
 #include <string_view>
+#include <vector>
 
 #include "core/core_types.h"
 
 typedef struct lua_State lua_State;
+typedef struct lua_Debug lua_Debug;
 
 namespace dfly {
 
@@ -34,6 +38,25 @@ class Interpreter {
  public:
   using RedisFunc = std::function<void(MutSliceSpan, ObjectExplorer*)>;
 
+  // Runs the commands of redis.pcall_batch and passes their replies to the explorer one after
+  // the other, in the order of the commands.
+  using RedisBatchFunc = std::function<void(absl::Span<MutSliceSpan>, ObjectExplorer*)>;
+
+  // Bounds the resources of the scripts. Zero means unlimited.
+  struct Limits {
+    // Bytes that the lua state may allocate while it runs a script.
+    size_t max_memory = 0;
+
+    // Lua instructions per RunFunction call.
+    uint64_t max_instructions = 0;
+
+    // Depth of nested lua function calls.
+    unsigned max_call_depth = 0;
+
+    // A script that runs longer than this yields the thread to other fibers.
+    uint32_t yield_usec = 0;
+  };
+
   Interpreter();
   ~Interpreter();
 
@@ -55,7 +78,14 @@ class Interpreter {
   // returns false if an error happened, sets error string into result.
   // otherwise, returns true and sets result to function id.
   // function id is sha1 of the function body.
-  AddResult AddFunction(std::string_view body, std::string* result);
+  // If bytecode is not null and the function was added, sets it to the precompiled function
+  // that can be passed to AddBytecode of other interpreters.
+  AddResult AddFunction(std::string_view body, std::string* result,
+                        std::string* bytecode = nullptr);
+
+  // Adds a function from the bytecode produced by AddFunction. Skips the parsing of its body.
+  // Returns false and sets error if the bytecode could not be loaded.
+  bool AddBytecode(std::string_view bytecode, std::string* error);
 
   bool Exists(std::string_view sha) const;
 
@@ -90,34 +120,93 @@ class Interpreter {
     redis_func_ = std::forward<U>(u);
   }
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
-  // we must lock it until we finish using it per request.
-  // Only RunFunction with companions require locking since other functions perform atomically
-  // without preemptions.
-  std::lock_guard<::boost::fibers::mutex> Lock() {
-    return std::lock_guard<::boost::fibers::mutex>{mu_};
+  // Without a batch function, redis.pcall_batch runs its commands one by one with RedisFunc.
+  template <typename U> void SetRedisBatchFunc(U&& u) {
+    redis_batch_func_ = std::forward<U>(u);
+  }
+
+  // Memory allocated by the lua state.
+  size_t used_bytes() const {
+    return used_bytes_;
+  }
+
+  // The limits are checked every kHookPeriod instructions.
+  void SetLimits(const Limits& limits);
+
+  // Number of times this interpreter yielded the thread during long running scripts.
+  uint64_t yield_count() const {
+    return yield_count_;
   }
 
  private:
   // Returns true if function was successfully added,
   // otherwise returns false and sets the error.
-  bool AddInternal(const char* f_id, std::string_view body, std::string* error);
+  bool AddInternal(const char* f_id, std::string_view body, std::string* error,
+                   std::string* bytecode);
   bool IsTableSafe() const;
 
   int RedisGenericCommand(bool raise_error);
+  int RedisBatchCommand();
 
   static int RedisCallCommand(lua_State* lua);
   static int RedisPCallCommand(lua_State* lua);
+  static int RedisPCallBatchCommand(lua_State* lua);
+
+  static void* LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+  static void LuaHook(lua_State* lua, lua_Debug* ar);
+
+  static constexpr int kHookPeriod = 1000;
 
   lua_State* lua_;
   unsigned cmd_depth_ = 0;
   RedisFunc redis_func_;
+  RedisBatchFunc redis_batch_func_;
+  size_t used_bytes_ = 0;
+
+  Limits limits_;
+  bool in_run_ = false;  // whether RunFunction is in progress.
+  uint64_t run_instructions_ = 0;
+  uint64_t slice_start_ns_ = 0;  // when the script started or last yielded.
+  uint64_t yield_count_ = 0;
+};
+
+// A pool of interpreters of a thread. Since a script may preempt while it waits for its
+// commands, every running script borrows an interpreter of its own. This way scripts of
+// the same thread do not wait for each other.
+// Not thread-safe, every thread has its own pool.
+class InterpreterManager {
+ public:
+  // Creates up to max_size interpreters on demand.
+  InterpreterManager(unsigned max_size, const Interpreter::Limits& limits)
+      : max_size_(max_size), limits_(limits) {
+  }
+
+  // Borrows an interpreter. Blocks the calling fiber while all the interpreters are in use.
+  Interpreter* Get();
+
+  // Same as Get() but returns nullptr instead of blocking.
+  Interpreter* TryGet();
+
+  // Returns an interpreter borrowed with Get or TryGet to the pool.
+  void Return(Interpreter* ir);
+
+  // Applies f to the interpreters that are not in use.
+  template <typename F> void ForEachAvailable(F&& f) {
+    for (Interpreter* ir : available_)
+      f(ir);
+  }
+
+  // Memory allocated by all the interpreters of the pool.
+  size_t used_bytes() const;
+
+ private:
+  unsigned max_size_;
+  Interpreter::Limits limits_;
+  std::deque<Interpreter> storage_;
+  std::vector<Interpreter*> available_;
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
-  // we must lock it until we finish using it per request.
   ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable_any cond_;
 };
 
 }  // namespace dfly
@@ -207,6 +207,11 @@ TEST_F(InterpreterTest, Add) {
   EXPECT_TRUE(intptr_.Exists(res1));
 }
 
+TEST_F(InterpreterTest, Shebang) {
+  ASSERT_TRUE(Execute("#!lua flags=no-writes\nreturn 42"));
+  EXPECT_EQ("i(42)", ser_.res);
+}
+
 // Test cases taken from scripting.tcl
 TEST_F(InterpreterTest, Execute) {
   ASSERT_TRUE(Execute("return 42"));
@@ -292,6 +297,49 @@ TEST_F(InterpreterTest, CallArray) {
   EXPECT_EQ("[str(table) [[[bool(0) str(s2)]] i(42)]]", ser_.res);
 }
 
+TEST_F(InterpreterTest, CallBatch) {
+  auto cb = [](MutSliceSpan span, ObjectExplorer* reply) {
+    string_view cmd{span[0].data(), span[0].size()};
+    if (cmd == "echo") {
+      reply->OnString(string_view{span[1].data(), span[1].size()});
+    } else if (cmd == "arr") {
+      reply->OnArrayStart(2);
+      reply->OnInt(span.size());
+      reply->OnNil();
+      reply->OnArrayEnd();
+    } else {
+      reply->OnError("myerr");
+    }
+  };
+
+  // Without a batch function, the commands run one by one.
+  intptr_.SetRedisFunc(cb);
+  const char* kScript = "return redis.pcall_batch({{'echo', 'a'}, {'arr', 1, 2.5}, {'err'}, "
+                        "{'echo', 7}})";
+  ASSERT_TRUE(Execute(kScript));
+  EXPECT_EQ("[str(a) [i(3) bool(0)] err(myerr) str(7)]", ser_.res);
+
+  unsigned batches = 0;
+  intptr_.SetRedisBatchFunc([&](absl::Span<MutSliceSpan> cmds, ObjectExplorer* reply) {
+    ++batches;
+    for (MutSliceSpan cmd : cmds)
+      cb(cmd, reply);
+  });
+  ASSERT_TRUE(Execute(kScript));
+  EXPECT_EQ("[str(a) [i(3) bool(0)] err(myerr) str(7)]", ser_.res);
+  EXPECT_EQ(1u, batches);
+
+  EXPECT_TRUE(Execute("return redis.pcall_batch({})"));
+  EXPECT_EQ("[]", ser_.res);
+
+  EXPECT_TRUE(Execute("return redis.pcall_batch({{'echo', 'a'}, {}})"));
+  EXPECT_THAT(ser_.res, testing::HasSubstr("must be a non-empty table"));
+
+  EXPECT_TRUE(Execute("return redis.pcall_batch({{'echo', {}}})"));
+  EXPECT_THAT(ser_.res, testing::HasSubstr("must be strings or integers"));
+  EXPECT_EQ(1u, batches);
+}
+
 TEST_F(InterpreterTest, ArgKeys) {
   vector<string> vec_arr{};
   vector<MutableSlice> slices;
@@ -321,4 +369,71 @@ TEST_F(InterpreterTest, Modules) {
   EXPECT_EQ("str(\x1\x2test)", ser_.res);
 }
 
+TEST_F(InterpreterTest, Bytecode) {
+  string sha, bytecode;
+  ASSERT_EQ(Interpreter::ADD_OK, intptr_.AddFunction("return ARGV[1] .. 'bar'", &sha, &bytecode));
+  EXPECT_FALSE(bytecode.empty());
+  EXPECT_GT(intptr_.used_bytes(), 0u);
+
+  Interpreter other;
+  EXPECT_FALSE(other.Exists(sha));
+
+  string error;
+  ASSERT_TRUE(other.AddBytecode(bytecode, &error)) << error;
+  EXPECT_TRUE(other.Exists(sha));
+  EXPECT_FALSE(other.AddBytecode("return 1", &error));  // text chunks are not accepted.
+
+  string arg{"foo"};
+  MutableSlice arg_slice{arg};
+  other.SetGlobalArray("ARGV", MutSliceSpan{&arg_slice, 1});
+  ASSERT_EQ(Interpreter::RUN_OK, other.RunFunction(sha, &error)) << error;
+
+  TestSerializer ser;
+  other.SerializeResult(&ser);
+  EXPECT_EQ("str(foobar) ", ser.res);
+}
+
+TEST_F(InterpreterTest, Limits) {
+  Interpreter::Limits limits;
+  limits.max_instructions = 100000;
+  limits.max_call_depth = 100;
+  limits.yield_usec = 1;
+  intptr_.SetLimits(limits);
+
+  EXPECT_FALSE(Execute("local i = 0 while true do i = i + 1 end"));
+  EXPECT_THAT(error_, testing::HasSubstr("exceeded the limit of 100000 instructions"));
+  EXPECT_GT(intptr_.yield_count(), 0u);
+
+  EXPECT_FALSE(Execute("local function f(n) return 1 + f(n + 1) end return f(1)"));
+  EXPECT_THAT(error_, testing::HasSubstr("exceeded the call depth limit"));
+
+  // The counters are reset between the runs.
+  ASSERT_TRUE(Execute("local s = 0 for i = 1, 1000 do s = s + i end return s"));
+  EXPECT_EQ("i(500500)", ser_.res);
+
+  limits = Interpreter::Limits{};
+  limits.max_memory = 1 << 20;
+  intptr_.SetLimits(limits);
+  EXPECT_FALSE(Execute("local t = {} for i = 1, 1000000 do t[i] = tostring(i) end"));
+  EXPECT_THAT(error_, testing::HasSubstr("not enough memory"));
+
+  ASSERT_TRUE(Execute("return 'small'"));
+  EXPECT_EQ("str(small)", ser_.res);
+}
+
+TEST_F(InterpreterTest, Manager) {
+  InterpreterManager mgr{2, {}};
+  Interpreter* ir1 = mgr.Get();
+  Interpreter* ir2 = mgr.TryGet();
+  ASSERT_TRUE(ir2);
+  EXPECT_NE(ir1, ir2);
+  EXPECT_EQ(nullptr, mgr.TryGet());
+
+  mgr.Return(ir1);
+  EXPECT_EQ(ir1, mgr.Get());
+  mgr.Return(ir1);
+  mgr.Return(ir2);
+  EXPECT_EQ(mgr.used_bytes(), ir1->used_bytes() + ir2->used_bytes());
+}
+
 }  // namespace dfly
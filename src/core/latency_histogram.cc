@@ -0,0 +1,79 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace dfly {
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() : buckets_(new uint64_t[kNumBuckets]()) {
+}
+
+// The values below kSubBuckets have a bucket each. Above, the bucket of a value is given by its
+// highest bit, which selects the group, and by the kSubBits bits after it.
+unsigned LatencyHistogram::BucketIndex(uint64_t usec) {
+  usec = std::min(usec, kMaxValue);
+  if (usec < kSubBuckets)
+    return usec;
+
+  unsigned msb = 63 - __builtin_clzll(usec);
+  unsigned shift = msb - kSubBits;
+  return (shift + 1) * kSubBuckets + ((usec >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::BucketMax(unsigned index) {
+  if (index < kSubBuckets)
+    return index;
+
+  unsigned shift = index / kSubBuckets - 1;
+  uint64_t lower = uint64_t(kSubBuckets + index % kSubBuckets) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::Add(uint64_t usec) {
+  ++buckets_[BucketIndex(usec)];
+  ++count_;
+  sum_ += usec;
+  max_ = std::max(max_, usec);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (unsigned i = 0; i < kNumBuckets; ++i)
+    buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  sum_ += other.sum_;
+  max_ = std::max(max_, other.max_);
+}
+
+void LatencyHistogram::Clear() {
+  fill(buckets_.get(), buckets_.get() + kNumBuckets, 0);
+  count_ = sum_ = max_ = 0;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  uint64_t rank = std::max<uint64_t>(1, ceil(p / 100 * count_));
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank)
+      return std::min(BucketMax(i), max_);
+  }
+  return max_;
+}
+
+uint64_t LatencyHistogram::CountAtMost(uint64_t usec) const {
+  uint64_t res = 0;
+  for (unsigned i = 0; i < kNumBuckets && BucketMax(i) <= usec; ++i)
+    res += buckets_[i];
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,62 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+namespace dfly {
+
+// A histogram of latencies in microseconds with log-linear buckets, as in HdrHistogram: every
+// power of 2 is split into kSubBuckets linear buckets, so that a value is kept with a relative
+// error below 1/kSubBuckets. Values above kMaxValue go to the last bucket.
+// Not thread safe, the threads record into their own histograms, which are merged to read them.
+class LatencyHistogram {
+ public:
+  static constexpr unsigned kSubBits = 4;
+  static constexpr unsigned kSubBuckets = 1u << kSubBits;
+  static constexpr unsigned kMaxBits = 32;  // about 71 minutes.
+  static constexpr uint64_t kMaxValue = (1ULL << kMaxBits) - 1;
+  static constexpr unsigned kNumBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  LatencyHistogram();
+
+  void Add(uint64_t usec);
+  void Merge(const LatencyHistogram& other);
+  void Clear();
+
+  // Returns the highest value of the bucket of the p-th percentile, 0 < p <= 100, or 0 if the
+  // histogram is empty.
+  uint64_t Percentile(double p) const;
+
+  // Returns the number of the values that are lower than or equal to usec, rounded down to the
+  // resolution of the buckets.
+  uint64_t CountAtMost(uint64_t usec) const;
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  uint64_t sum() const {
+    return sum_;
+  }
+
+  uint64_t max() const {
+    return max_;
+  }
+
+ private:
+  static unsigned BucketIndex(uint64_t usec);
+
+  // The highest value that falls into the bucket.
+  static uint64_t BucketMax(unsigned index);
+
+  std::unique_ptr<uint64_t[]> buckets_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,72 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/latency_histogram.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class LatencyHistogramTest : public ::testing::Test {
+ protected:
+  LatencyHistogram hist_;
+};
+
+TEST_F(LatencyHistogramTest, Basic) {
+  EXPECT_EQ(0u, hist_.Percentile(50));
+
+  for (uint64_t i = 1; i <= 10; ++i)
+    hist_.Add(i);
+  EXPECT_EQ(10u, hist_.count());
+  EXPECT_EQ(55u, hist_.sum());
+  EXPECT_EQ(10u, hist_.max());
+
+  // The small values are exact.
+  EXPECT_EQ(5u, hist_.Percentile(50));
+  EXPECT_EQ(10u, hist_.Percentile(100));
+  EXPECT_EQ(1u, hist_.Percentile(1));
+  EXPECT_EQ(3u, hist_.CountAtMost(3));
+  EXPECT_EQ(10u, hist_.CountAtMost(1000));
+
+  hist_.Clear();
+  EXPECT_EQ(0u, hist_.count());
+  EXPECT_EQ(0u, hist_.CountAtMost(1000));
+}
+
+TEST_F(LatencyHistogramTest, Precision) {
+  for (uint64_t i = 1; i <= 100000; ++i)
+    hist_.Add(i);
+
+  for (double p : {10.0, 50.0, 90.0, 99.0, 99.9}) {
+    double expected = p * 1000;
+    uint64_t actual = hist_.Percentile(p);
+    EXPECT_GE(actual, expected) << p;
+    EXPECT_LE(actual, expected * (1 + 1.0 / LatencyHistogram::kSubBuckets)) << p;
+  }
+  EXPECT_EQ(100000u, hist_.Percentile(100));
+
+  // 1024 and 65536 are bucket boundaries.
+  EXPECT_EQ(1023u, hist_.CountAtMost(1023));
+  EXPECT_EQ(65535u, hist_.CountAtMost(65535));
+  EXPECT_LE(hist_.CountAtMost(50000), 50000u);
+  EXPECT_GE(hist_.CountAtMost(50000), 50000u * (1 - 1.0 / LatencyHistogram::kSubBuckets));
+}
+
+TEST_F(LatencyHistogramTest, Merge) {
+  LatencyHistogram other;
+  hist_.Add(100);
+  other.Add(1000000);
+  other.Add(LatencyHistogram::kMaxValue * 2);  // goes to the last bucket.
+
+  hist_.Merge(other);
+  EXPECT_EQ(3u, hist_.count());
+  EXPECT_EQ(103u, hist_.Percentile(30));  // the highest value in the bucket of 100.
+  EXPECT_EQ(LatencyHistogram::kMaxValue, hist_.Percentile(100));
+  EXPECT_EQ(1u, hist_.CountAtMost(1000));
+}
+
+}  // namespace dfly
@@ -23,6 +23,7 @@ void* MiMemoryResource::do_allocate(std::size_t size, std::size_t align) {
   size_t delta = mi_usable_size(res);
 
   used_ += delta;
+  allocated_ += delta;
   DVLOG(1) << "do_allocate: " << heap_ << " " << delta;
 
   return res;
@@ -37,6 +38,7 @@ void MiMemoryResource::do_deallocate(void* ptr, std::size_t size, std::size_t al
 
   DCHECK_GE(used_, size);
   used_ -= usable;
+  freed_ += usable;
   mi_free_size_aligned(ptr, size, align);
 }
 
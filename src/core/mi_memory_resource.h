@@ -23,6 +23,15 @@ class MiMemoryResource : public std::pmr::memory_resource {
     return used_;
   }
 
+  // Cumulative number of bytes allocated and freed through this resource.
+  uint64_t allocated() const {
+    return allocated_;
+  }
+
+  uint64_t freed() const {
+    return freed_;
+  }
+
  private:
   void* do_allocate(std::size_t size, std::size_t align) final;
 
@@ -34,6 +43,8 @@ class MiMemoryResource : public std::pmr::memory_resource {
 
   mi_heap_t* heap_;
   size_t used_ = 0;
+  uint64_t allocated_ = 0;
+  uint64_t freed_ = 0;
 };
 
 }  // namespace dfly
@@ -3,20 +3,139 @@
 //
 #include "core/segment_allocator.h"
 
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
 #include "base/logging.h"
 
 namespace dfly {
 
-SegmentAllocator::SegmentAllocator(mi_heap_t* heap) : heap_(heap) {
+namespace {
+
+constexpr size_t kBlockAlign = 64;
+
+size_t RoundUp(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+}  // namespace
+
+SegmentAllocator::SegmentAllocator(size_t block_size, std::pmr::memory_resource* upstream)
+    : upstream_(upstream), block_size_(RoundUp(block_size, kBlockAlign)) {
+  CHECK_LE(block_size_, kArenaSize);
+}
+
+SegmentAllocator::~SegmentAllocator() {
+  for (void* arena : arenas_)
+    munmap(arena, kArenaSize);
+}
+
+void* SegmentAllocator::Map(size_t size, bool* hugetlb) {
+  DCHECK_EQ(0u, size % kArenaSize);
+
+  *hugetlb = false;
+  if (!hugetlb_failed_) {
+    void* res = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (res != MAP_FAILED) {
+      *hugetlb = true;
+      return res;
+    }
+
+    // The kernel did not reserve huge pages, see /proc/sys/vm/nr_hugepages. We do not retry,
+    // so that every allocation does not pay for the failed call.
+    LOG(INFO) << "Could not map huge pages, using transparent huge pages instead: "
+              << strerror(errno);
+    hugetlb_failed_ = true;
+  }
+
+  // Transparent huge pages back only the aligned 2MB ranges, so we map a larger range and trim
+  // it to the alignment.
+  size_t padded = size + kArenaSize;
+  void* ptr = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    throw std::bad_alloc{};
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+  uintptr_t aligned = RoundUp(start, kArenaSize);
+  if (aligned > start)
+    munmap(ptr, aligned - start);
+  if (size_t tail = start + padded - (aligned + size); tail > 0)
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+
+  void* res = reinterpret_cast<void*>(aligned);
+  if (madvise(res, size, MADV_HUGEPAGE) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "madvise(MADV_HUGEPAGE) failed: " << strerror(errno);
+  }
+  return res;
 }
 
-void SegmentAllocator::ValidateMapSize() {
-  CHECK_LT(address_table_.size(), 1u << 12)
-      << "TODO: to monitor address_table_ map, it should not grow to such sizes";
+void SegmentAllocator::AddArena() {
+  bool hugetlb;
+  char* arena = reinterpret_cast<char*>(Map(kArenaSize, &hugetlb));
+  arenas_.push_back(arena);
+  used_ += kArenaSize;
+  hugetlb_bytes_ += hugetlb ? kArenaSize : 0;
+
+  // The blocks are pushed from the end, so that they are handed out in the address order.
+  size_t count = kArenaSize / block_size_;
+  for (size_t i = count; i > 0; --i) {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(arena + (i - 1) * block_size_);
+    block->next = free_list_;
+    free_list_ = block;
+  }
+}
+
+void* SegmentAllocator::do_allocate(std::size_t size, std::size_t align) {
+  DCHECK_LE(align, kBlockAlign);
+
+  if (size >= kArenaSize) {
+    size_t mapped = RoundUp(size, kArenaSize);
+    bool hugetlb;
+    void* res = Map(mapped, &hugetlb);
+    used_ += mapped;
+    if (hugetlb) {
+      hugetlb_bytes_ += mapped;
+      hugetlb_large_.push_back(res);
+    }
+    return res;
+  }
+
+  if (RoundUp(size, kBlockAlign) != block_size_)
+    return upstream_->allocate(size, align);
+
+  if (!free_list_)
+    AddArena();
+
+  FreeBlock* res = free_list_;
+  free_list_ = res->next;
+  return res;
+}
+
+void SegmentAllocator::do_deallocate(void* ptr, std::size_t size, std::size_t align) {
+  if (size >= kArenaSize) {
+    size_t mapped = RoundUp(size, kArenaSize);
+    munmap(ptr, mapped);
+    used_ -= mapped;
+    if (auto it = std::find(hugetlb_large_.begin(), hugetlb_large_.end(), ptr);
+        it != hugetlb_large_.end()) {
+      hugetlb_large_.erase(it);
+      hugetlb_bytes_ -= mapped;
+    }
+    return;
+  }
+
+  if (RoundUp(size, kBlockAlign) != block_size_) {
+    upstream_->deallocate(ptr, size, align);
+    return;
+  }
 
-  // TODO: we should learn how large this maps can grow for very large databases.
-  // We should learn if mimalloc drops (deallocates) segments and we need to perform GC
-  // to protect ourselves from bloated address table.
+  FreeBlock* block = reinterpret_cast<FreeBlock*>(ptr);
+  block->next = free_list_;
+  free_list_ = block;
 }
 
 }  // namespace dfly
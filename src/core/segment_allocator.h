@@ -1,86 +1,75 @@
 // Copyright 2022, DragonflyDB authors.  All rights reserved.
 // See LICENSE for licensing terms.
 //
-#pragma once
 
-#include <absl/container/flat_hash_map.h>
-#include <mimalloc.h>
+#pragma once
 
-/***
- * This class is tightly coupled with mimalloc segment allocation logic and is designed to provide
- * a compact pointer representation (4bytes ptr) over 64bit address space that gives you
- * 32GB of allocations with option to extend it to 32*256GB if needed.
- *
- */
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
 
 namespace dfly {
 
-/**
- * @brief Tightly coupled with mi_malloc 2.x implementation.
- *        Fetches 8MB segment pointers from the allocated pointers.
- *        Provides own indexing of small pointers to real address space using the segment ptrs/
- */
-
-class SegmentAllocator {
-  static constexpr uint32_t kSegmentIdBits = 12;
-  static constexpr uint32_t kSegmentIdMask = (1 << kSegmentIdBits) - 1;
-  static constexpr uint64_t kSegmentAlignMask = ~((1 << 23) - 1);
-
+// Allocates the segments of dash tables from 2MB huge page arenas, so that a random lookup
+// costs a single TLB entry per 64 segments. The arenas are mapped with MAP_HUGETLB and, when
+// no huge pages are reserved, with transparent huge pages via madvise. The allocations of at
+// least an arena, i.e. the directories of large tables, are mapped the same way. Other
+// allocations go to upstream.
+// The arenas are kept for the reuse of their blocks until the allocator is destroyed.
+// Not thread-safe, like the tables of a shard.
+class SegmentAllocator : public std::pmr::memory_resource {
  public:
-  using Ptr = uint32_t;
+  static constexpr size_t kArenaSize = 1 << 21;
 
-  SegmentAllocator(mi_heap_t* heap);
+  // block_size is the size of the segments, e.g. PrimeTable::kSegBytes.
+  SegmentAllocator(size_t block_size, std::pmr::memory_resource* upstream);
+  ~SegmentAllocator();
 
-  uint8_t* Translate(Ptr p) const {
-    return address_table_[p & kSegmentIdMask] + Offset(p);
-  }
-
-  std::pair<Ptr, uint8_t*> Allocate(uint32_t size);
+  SegmentAllocator(const SegmentAllocator&) = delete;
+  void operator=(const SegmentAllocator&) = delete;
 
-  void Free(Ptr ptr) {
-    void* p = Translate(ptr);
-    used_ -= mi_usable_size(p);
-    mi_free(p);
+  // Bytes mapped by the allocator, including the free blocks of the arenas.
+  size_t used() const {
+    return used_;
   }
 
-  mi_heap_t* heap() {
-    return heap_;
+  // Bytes mapped with MAP_HUGETLB, the rest relies on transparent huge pages.
+  size_t hugetlb_bytes() const {
+    return hugetlb_bytes_;
   }
 
-  size_t used() const { return used_; }
+  size_t block_size() const {
+    return block_size_;
+  }
 
  private:
-  static uint32_t Offset(Ptr p) {
-    return (p >> kSegmentIdBits) * 8;
-  }
+  void* do_allocate(std::size_t size, std::size_t align) final;
 
-  void ValidateMapSize();
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
 
-  std::vector<uint8_t*> address_table_;
-  absl::flat_hash_map<uint64_t, uint16_t> rev_indx_;
-  mi_heap_t* heap_;
-  size_t used_ = 0;
-};
+  bool do_is_equal(const std::pmr::memory_resource& o) const noexcept {
+    return this == &o;
+  }
 
-inline auto SegmentAllocator::Allocate(uint32_t size) -> std::pair<Ptr, uint8_t*> {
-  void* ptr = mi_heap_malloc(heap_, size);
-  if (!ptr)
-    throw std::bad_alloc{};
+  // size is a multiple of kArenaSize. Sets hugetlb if the mapping uses reserved huge pages.
+  void* Map(size_t size, bool* hugetlb);
 
-  uint64_t iptr = (uint64_t)ptr;
-  uint64_t seg_ptr = iptr & kSegmentAlignMask;
+  void AddArena();
 
-  // could be speed up using last used seg_ptr.
-  auto [it, inserted] = rev_indx_.emplace(seg_ptr, address_table_.size());
-  if (inserted) {
-    ValidateMapSize();
-    address_table_.push_back((uint8_t*)seg_ptr);
-  }
+  struct FreeBlock {
+    FreeBlock* next;
+  };
 
-  Ptr res = (((iptr - seg_ptr) / 8) << kSegmentIdBits) | it->second;
-  used_ += mi_good_size(size);
+  std::pmr::memory_resource* upstream_;
+  size_t block_size_;
+  FreeBlock* free_list_ = nullptr;
+  std::vector<void*> arenas_;
+  std::vector<void*> hugetlb_large_;  // The large allocations that use reserved huge pages.
 
-  return std::make_pair(res, (uint8_t*)ptr);
-}
+  size_t used_ = 0;
+  size_t hugetlb_bytes_ = 0;
+  bool hugetlb_failed_ = false;
+};
 
 }  // namespace dfly
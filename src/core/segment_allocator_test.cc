@@ -0,0 +1,98 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/segment_allocator.h"
+
+#include <absl/container/flat_hash_set.h>
+#include <xxhash.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "core/dash.h"
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+struct UInt64Policy : public BasicDashPolicy {
+  static uint64_t HashFn(uint64_t v) {
+    return XXH3_64bits(&v, sizeof(v));
+  }
+};
+
+using Dash64 = DashTable<uint64_t, uint64_t, UInt64Policy>;
+
+}  // namespace
+
+class SegmentAllocatorTest : public ::testing::Test {
+ protected:
+  SegmentAllocatorTest() : alloc_(Dash64::kSegBytes, pmr::new_delete_resource()) {
+  }
+
+  SegmentAllocator alloc_;
+};
+
+TEST_F(SegmentAllocatorTest, Blocks) {
+  const size_t kPerArena = SegmentAllocator::kArenaSize / alloc_.block_size();
+  absl::flat_hash_set<void*> blocks;
+  for (size_t i = 0; i < kPerArena + 1; ++i) {
+    void* ptr = alloc_.allocate(Dash64::kSegBytes, 8);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(ptr) % 64);
+    EXPECT_TRUE(blocks.insert(ptr).second);
+  }
+  EXPECT_EQ(2 * SegmentAllocator::kArenaSize, alloc_.used());
+
+  // The freed blocks are reused.
+  void* ptr = *blocks.begin();
+  alloc_.deallocate(ptr, Dash64::kSegBytes, 8);
+  EXPECT_EQ(ptr, alloc_.allocate(Dash64::kSegBytes, 8));
+
+  for (void* ptr : blocks)
+    alloc_.deallocate(ptr, Dash64::kSegBytes, 8);
+  EXPECT_EQ(2 * SegmentAllocator::kArenaSize, alloc_.used());
+}
+
+TEST_F(SegmentAllocatorTest, Large) {
+  size_t size = 3 * SegmentAllocator::kArenaSize + 10;
+  char* ptr = reinterpret_cast<char*>(alloc_.allocate(size, 8));
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(ptr) % SegmentAllocator::kArenaSize);
+  ptr[0] = ptr[size - 1] = 1;
+  EXPECT_EQ(4 * SegmentAllocator::kArenaSize, alloc_.used());
+
+  alloc_.deallocate(ptr, size, 8);
+  EXPECT_EQ(0u, alloc_.used());
+  EXPECT_EQ(0u, alloc_.hugetlb_bytes());
+
+  // Other sizes go to upstream.
+  void* small = alloc_.allocate(100, 8);
+  EXPECT_EQ(0u, alloc_.used());
+  alloc_.deallocate(small, 100, 8);
+}
+
+TEST_F(SegmentAllocatorTest, Table) {
+  constexpr uint64_t kNumKeys = 200000;
+  {
+    Dash64 table(1, UInt64Policy{}, &alloc_);
+    for (uint64_t i = 0; i < kNumKeys; ++i)
+      table.Insert(i, i * 2);
+
+    EXPECT_GT(alloc_.used(), table.unique_segments() * Dash64::kSegBytes);
+    for (uint64_t i = 0; i < kNumKeys; ++i) {
+      auto it = table.Find(i);
+      ASSERT_FALSE(it.is_done()) << i;
+      EXPECT_EQ(i * 2, it->second);
+    }
+  }
+
+  // The arenas stay for the next tables.
+  size_t used = alloc_.used();
+  Dash64 table(1, UInt64Policy{}, &alloc_);
+  for (uint64_t i = 0; i < kNumKeys; ++i)
+    table.Insert(i, i);
+  EXPECT_EQ(used, alloc_.used());
+}
+
+}  // namespace dfly
@@ -4,12 +4,13 @@
 
 #include "core/small_string.h"
 
+#include <mimalloc.h>
 #include <xxhash.h>
 
+#include <cstring>
 #include <memory>
 
 #include "base/logging.h"
-#include "core/segment_allocator.h"
 
 namespace dfly {
 using namespace std;
@@ -25,29 +26,55 @@ class XXH3_Deleter {
 
 struct TL {
   unique_ptr<XXH3_state_t, XXH3_Deleter> xxh_state;
-  unique_ptr<SegmentAllocator> seg_alloc;
+  mi_heap_t* heap = nullptr;
+  size_t used = 0;
 };
 
 thread_local TL tl;
 
 constexpr XXH64_hash_t kHashSeed = 24061983;  // same as in compact_object.cc
 
+uint8_t* Allocate(size_t size) {
+  void* ptr = mi_heap_malloc(tl.heap, size);
+  if (!ptr)
+    throw std::bad_alloc{};
+
+  tl.used += mi_good_size(size);
+  return (uint8_t*)ptr;
+}
+
+void Deallocate(uint8_t* ptr) {
+  tl.used -= mi_usable_size(ptr);
+  mi_free(ptr);
+}
+
 }  // namespace
 
 void SmallString::InitThreadLocal(void* heap) {
-  SegmentAllocator* ns = new SegmentAllocator((mi_heap_t*)heap);
-
-  tl.seg_alloc.reset(ns);
+  tl.heap = (mi_heap_t*)heap;
+  tl.used = 0;
   tl.xxh_state.reset(XXH3_createState());
   XXH3_64bits_reset_withSeed(tl.xxh_state.get(), kHashSeed);
 }
 
 size_t SmallString::UsedThreadLocal() {
-  return tl.seg_alloc ? tl.seg_alloc->used() : 0;
+  return tl.used;
 }
 
 static_assert(sizeof(SmallString) == 16);
 
+uint8_t* SmallString::ptr() const {
+  uint64_t res = 0;
+  memcpy(&res, ptr_, kPtrLen);  // little endian.
+  return (uint8_t*)res;
+}
+
+void SmallString::set_ptr(uint8_t* ptr) {
+  uint64_t val = uint64_t(ptr);
+  DCHECK_EQ(0u, val >> (kPtrLen * 8));
+  memcpy(ptr_, &val, kPtrLen);
+}
+
 // we should use only for sizes greater than kPrefLen
 size_t SmallString::Assign(std::string_view s) {
   DCHECK_GT(s.size(), kPrefLen);
@@ -55,21 +82,18 @@ size_t SmallString::Assign(std::string_view s) {
   uint8_t* realptr = nullptr;
 
   if (size_ == 0) {
-    // packed structs can not be tied here.
-    auto [sp, rp] = tl.seg_alloc->Allocate(s.size() - kPrefLen);
-    small_ptr_ = sp;
-    realptr = rp;
+    realptr = Allocate(s.size() - kPrefLen);
+    set_ptr(realptr);
     size_ = s.size();
   } else if (s.size() <= size_) {
-    realptr = tl.seg_alloc->Translate(small_ptr_);
+    realptr = ptr();
 
     if (s.size() < size_) {
       size_t capacity = mi_usable_size(realptr);
       if (s.size() * 2 < capacity) {
-        tl.seg_alloc->Free(small_ptr_);
-        auto [sp, rp] = tl.seg_alloc->Allocate(s.size() - kPrefLen);
-        small_ptr_ = sp;
-        realptr = rp;
+        Deallocate(realptr);
+        realptr = Allocate(s.size() - kPrefLen);
+        set_ptr(realptr);
       }
       size_ = s.size();
     }
@@ -87,16 +111,32 @@ void SmallString::Free() {
   if (size_ <= kPrefLen)
     return;
 
-  tl.seg_alloc->Free(small_ptr_);
+  Deallocate(ptr());
   size_ = 0;
 }
 
+bool SmallString::DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse) {
+  if (size_ <= kPrefLen || !is_sparse(ptr()))
+    return false;
+
+  uint8_t* cur = ptr();
+  uint8_t* realptr = Allocate(size_ - kPrefLen);
+  if (is_sparse(realptr)) {
+    Deallocate(realptr);
+    return false;
+  }
+
+  memcpy(realptr, cur, size_ - kPrefLen);
+  Deallocate(cur);
+  set_ptr(realptr);
+  return true;
+}
+
 uint16_t SmallString::MallocUsed() const {
   if (size_ <= kPrefLen)
     return 0;
-  auto* realptr = tl.seg_alloc->Translate(small_ptr_);
 
-  return mi_malloc_usable_size(realptr);
+  return mi_malloc_usable_size(ptr());
 }
 
 bool SmallString::Equal(std::string_view o) const {
@@ -111,9 +151,7 @@ bool SmallString::Equal(std::string_view o) const {
   if (memcmp(prefix_, o.data(), kPrefLen) != 0)
     return false;
 
-  uint8_t* realp = tl.seg_alloc->Translate(small_ptr_);
-
-  return memcmp(realp, o.data() + kPrefLen, size_ - kPrefLen) == 0;
+  return memcmp(ptr(), o.data() + kPrefLen, size_ - kPrefLen) == 0;
 }
 
 bool SmallString::Equal(const SmallString& os) const {
@@ -149,8 +187,7 @@ void SmallString::Get(std::string* dest) const {
   if (size_) {
     DCHECK_GT(size_, kPrefLen);
     memcpy(dest->data(), prefix_, kPrefLen);
-    uint8_t* ptr = tl.seg_alloc->Translate(small_ptr_);
-    memcpy(dest->data() + kPrefLen, ptr, size_ - kPrefLen);
+    memcpy(dest->data() + kPrefLen, ptr(), size_ - kPrefLen);
   }
 }
 
@@ -161,8 +198,7 @@ unsigned SmallString::GetV(string_view dest[2]) const {
   }
 
   dest[0] = string_view{prefix_, kPrefLen};
-  uint8_t* ptr = tl.seg_alloc->Translate(small_ptr_);
-  dest[1] = string_view{reinterpret_cast<char*>(ptr), size_ - kPrefLen};
+  dest[1] = string_view{reinterpret_cast<char*>(ptr()), size_ - kPrefLen};
   return 2;
 }
 
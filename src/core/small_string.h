@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <absl/functional/function_ref.h>
+
 #include <string_view>
 
 #include "core/core_types.h"
@@ -13,8 +15,12 @@ namespace dfly {
 // for in-memory workloads, especially for keys.
 // Please note that this class does not have automatic constructors and destructors, therefore
 // it requires explicit management.
+// The string is allocated from the thread local heap but its accessors (Get, GetV, Equal,
+// MallocUsed) do not depend on thread local state, so a string can be read from other threads
+// as long as it is not mutated concurrently.
 class SmallString {
-  static constexpr unsigned kPrefLen = 10;
+  static constexpr unsigned kPrefLen = 8;
+  static constexpr unsigned kPtrLen = 6;
 
  public:
 
@@ -29,6 +35,10 @@ class SmallString {
   size_t Assign(std::string_view s);
   void Free();
 
+  // Moves the heap part of the string if is_sparse(ptr) returns true for it and false for the
+  // new allocation. Returns true if the string was moved.
+  bool DefragIfNeeded(absl::FunctionRef<bool(const void*)> is_sparse);
+
   bool Equal(std::string_view o) const;
   bool Equal(const SmallString& mps) const;
 
@@ -49,11 +59,15 @@ class SmallString {
   unsigned GetV(std::string_view dest[2]) const;
 
  private:
+  uint8_t* ptr() const;
+  void set_ptr(uint8_t* ptr);
+
   // prefix of the string that is broken down into 2 parts.
   char prefix_[kPrefLen];
 
-  uint32_t small_ptr_;  // 32GB capacity because we ignore 3 lsb bits (i.e. x8).
-  uint16_t size_;       // uint16_t - total size (including prefix)
+  // 48 lsb of the address of the rest of the string. User space addresses fit into 48 bits.
+  uint8_t ptr_[kPtrLen];
+  uint16_t size_;  // uint16_t - total size (including prefix)
 
 } __attribute__((packed));
 
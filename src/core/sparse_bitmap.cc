@@ -0,0 +1,275 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sparse_bitmap.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kNumWords = SparseBitmap::kChunkBits / 64;
+
+inline void SetRawBit(uint64_t pos, char* dest) {
+  dest[pos / 8] |= char(0x80 >> (pos % 8));
+}
+
+}  // namespace
+
+bool SparseBitmap::Chunk::Get(uint32_t offset) const {
+  if (IsBitset())
+    return (words[offset / 64] >> (offset % 64)) & 1;
+  return binary_search(offsets.begin(), offsets.end(), offset);
+}
+
+bool SparseBitmap::Chunk::Set(uint32_t offset, bool val) {
+  if (IsBitset()) {
+    uint64_t& word = words[offset / 64];
+    uint64_t mask = 1ULL << (offset % 64);
+    bool old = word & mask;
+    if (old == val)
+      return old;
+
+    word ^= mask;
+    if (val) {
+      ++num_set;
+      return old;
+    }
+
+    // Back to the sorted offsets, with a margin to not convert back and forth.
+    if (--num_set < kMaxArrayLen / 2) {
+      offsets.reserve(num_set);
+      for (uint32_t i = 0; i < kNumWords; ++i) {
+        for (uint64_t w = words[i]; w; w &= w - 1) {
+          offsets.push_back(i * 64 + absl::countr_zero(w));
+        }
+      }
+      decltype(words){words.get_allocator()}.swap(words);
+    }
+    return old;
+  }
+
+  auto it = lower_bound(offsets.begin(), offsets.end(), offset);
+  bool old = it != offsets.end() && *it == offset;
+  if (old == val)
+    return old;
+
+  if (!val) {
+    offsets.erase(it);
+    --num_set;
+    return old;
+  }
+
+  if (offsets.size() < kMaxArrayLen) {
+    offsets.insert(it, offset);
+    ++num_set;
+    return old;
+  }
+
+  // Too many offsets, switch to the bitset that takes 8KB.
+  words.assign(kNumWords, 0);
+  for (uint16_t o : offsets) {
+    words[o / 64] |= 1ULL << (o % 64);
+  }
+  decltype(offsets){offsets.get_allocator()}.swap(offsets);
+  words[offset / 64] |= 1ULL << (offset % 64);
+  ++num_set;
+  return old;
+}
+
+uint32_t SparseBitmap::Chunk::CountBelow(uint32_t offset) const {
+  if (!IsBitset())
+    return lower_bound(offsets.begin(), offsets.end(), offset) - offsets.begin();
+
+  uint32_t res = 0;
+  for (uint32_t i = 0; i < offset / 64; ++i) {
+    res += absl::popcount(words[i]);
+  }
+  if (offset % 64)
+    res += absl::popcount(words[offset / 64] & ((1ULL << (offset % 64)) - 1));
+  return res;
+}
+
+uint32_t SparseBitmap::Chunk::NextSet(uint32_t offset) const {
+  if (!IsBitset()) {
+    auto it = lower_bound(offsets.begin(), offsets.end(), offset);
+    return it == offsets.end() ? kChunkBits : *it;
+  }
+
+  if (offset >= kChunkBits)
+    return kChunkBits;
+  uint32_t i = offset / 64;
+  uint64_t w = words[i] & (~0ULL << (offset % 64));
+  while (w == 0) {
+    if (++i == kNumWords)
+      return kChunkBits;
+    w = words[i];
+  }
+  return i * 64 + absl::countr_zero(w);
+}
+
+uint32_t SparseBitmap::Chunk::NextClear(uint32_t offset) const {
+  if (!IsBitset()) {
+    // The set bits from offset on are a run as long as the offsets are consecutive.
+    auto it = lower_bound(offsets.begin(), offsets.end(), offset);
+    for (; it != offsets.end() && *it == offset; ++it) {
+      ++offset;
+    }
+    return offset;
+  }
+
+  if (offset >= kChunkBits)
+    return kChunkBits;
+  uint32_t i = offset / 64;
+  uint64_t w = ~words[i] & (~0ULL << (offset % 64));
+  while (w == 0) {
+    if (++i == kNumWords)
+      return kChunkBits;
+    w = ~words[i];
+  }
+  return i * 64 + absl::countr_zero(w);
+}
+
+SparseBitmap::SparseBitmap(pmr::memory_resource* mr) : chunks_(mr), mr_(mr) {
+}
+
+void SparseBitmap::Assign(string_view str) {
+  chunks_.clear();
+  chunks_.shrink_to_fit();
+  size_ = str.size();
+  num_set_ = 0;
+
+  // The bits come in order, so every chunk is appended to the end.
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(str.data());
+  for (size_t i = 0; i < str.size(); ++i) {
+    for (unsigned b = data[i]; b; b &= b - 1) {
+      uint64_t pos = i * 8 + 7 - absl::countr_zero(b);
+      uint32_t key = pos / kChunkBits;
+      if (chunks_.empty() || chunks_.back().key != key)
+        chunks_.emplace_back(key, mr_);
+      chunks_.back().Set(pos % kChunkBits, true);
+      ++num_set_;
+    }
+  }
+
+  malloc_used_ = chunks_.capacity() * sizeof(Chunk);
+  for (const auto& chunk : chunks_) {
+    malloc_used_ += chunk.MallocUsed();
+  }
+}
+
+auto SparseBitmap::LowerBound(uint32_t key) const -> pmr::vector<Chunk>::const_iterator {
+  return lower_bound(chunks_.begin(), chunks_.end(), key,
+                     [](const Chunk& chunk, uint32_t k) { return chunk.key < k; });
+}
+
+bool SparseBitmap::Get(uint64_t pos) const {
+  uint32_t key = pos / kChunkBits;
+  auto it = LowerBound(key);
+  return it != chunks_.end() && it->key == key && it->Get(pos % kChunkBits);
+}
+
+bool SparseBitmap::Set(uint64_t pos, bool val) {
+  size_ = max<size_t>(size_, pos / 8 + 1);
+
+  uint32_t key = pos / kChunkBits;
+  auto it = chunks_.begin() + (LowerBound(key) - chunks_.cbegin());
+  if (it == chunks_.end() || it->key != key) {
+    if (!val)
+      return false;
+    size_t capacity = chunks_.capacity();
+    it = chunks_.emplace(it, key, mr_);
+    malloc_used_ += (chunks_.capacity() - capacity) * sizeof(Chunk);
+  }
+
+  size_t prev_used = it->MallocUsed();
+  uint32_t prev_set = it->num_set;
+  bool old = it->Set(pos % kChunkBits, val);
+  num_set_ = num_set_ + it->num_set - prev_set;
+  malloc_used_ = malloc_used_ + it->MallocUsed() - prev_used;
+
+  if (it->num_set == 0) {
+    malloc_used_ -= it->MallocUsed();
+    chunks_.erase(it);
+  }
+  return old;
+}
+
+uint64_t SparseBitmap::CountRange(uint64_t first, uint64_t last) const {
+  uint64_t res = 0;
+  for (auto it = LowerBound(first / kChunkBits); it != chunks_.end(); ++it) {
+    uint64_t base = uint64_t(it->key) * kChunkBits;
+    if (base >= last)
+      break;
+
+    uint32_t from = first > base ? first - base : 0;
+    uint32_t to = min<uint64_t>(last - base, kChunkBits);
+    if (from == 0 && to == kChunkBits) {
+      res += it->num_set;
+    } else {
+      res += it->CountBelow(to) - it->CountBelow(from);
+    }
+  }
+  return res;
+}
+
+uint64_t SparseBitmap::FindFirst(bool val, uint64_t first, uint64_t last) const {
+  auto it = LowerBound(first / kChunkBits);
+  uint64_t pos = first;
+  while (pos < last) {
+    uint64_t base = uint64_t(pos / kChunkBits) * kChunkBits;
+    if (it == chunks_.end() || it->key != pos / kChunkBits) {
+      if (!val)
+        return pos;  // no chunk, so all the bits are clear.
+      if (it == chunks_.end())
+        return last;
+      pos = uint64_t(it->key) * kChunkBits;
+      continue;
+    }
+
+    uint32_t offset = val ? it->NextSet(pos - base) : it->NextClear(pos - base);
+    if (offset < kChunkBits)
+      return min(base + offset, last);
+    pos = base + kChunkBits;
+    ++it;
+  }
+  return last;
+}
+
+void SparseBitmap::Materialize(size_t offset, size_t len, char* dest) const {
+  DCHECK_LE(offset + len, size_);
+
+  memset(dest, 0, len);
+  uint64_t first = offset * 8, last = (offset + len) * 8;
+
+  for (auto it = LowerBound(first / kChunkBits); it != chunks_.end(); ++it) {
+    uint64_t base = uint64_t(it->key) * kChunkBits;
+    if (base >= last)
+      break;
+
+    uint32_t from = first > base ? first - base : 0;
+    uint32_t to = min<uint64_t>(last - base, kChunkBits);
+    if (!it->IsBitset()) {
+      auto o = lower_bound(it->offsets.begin(), it->offsets.end(), from);
+      for (; o != it->offsets.end() && *o < to; ++o) {
+        SetRawBit(base + *o - first, dest);
+      }
+      continue;
+    }
+
+    for (uint32_t o = it->NextSet(from); o < to; o = it->NextSet(o + 1)) {
+      SetRawBit(base + o - first, dest);
+    }
+  }
+}
+
+}  // namespace dfly
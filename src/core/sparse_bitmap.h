@@ -0,0 +1,114 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Compressed encoding of the large strings that are bitmaps with few set bits, e.g. the ones
+// built by SETBIT at sparse offsets. Bit pos is the bit (0x80 >> pos % 8) of byte pos / 8, like
+// in Redis strings.
+// Similarly to roaring bitmaps, the bits are split into chunks of 2^16 bits. A chunk keeps the
+// sorted offsets of its set bits, or a plain bitset once it has more than kMaxArrayLen of them.
+// The chunks without set bits are not stored.
+class SparseBitmap {
+ public:
+  static constexpr unsigned kChunkBits = 1 << 16;
+  static constexpr unsigned kMaxArrayLen = 4096;
+
+  // The strings shorter than that are kept raw.
+  static constexpr size_t kMinSize = 4096;
+
+  explicit SparseBitmap(std::pmr::memory_resource* mr);
+
+  // Replaces the bitmap with the bits of str.
+  void Assign(std::string_view str);
+
+  // The length of the raw string.
+  size_t Size() const {
+    return size_;
+  }
+
+  // Number of set bits.
+  uint64_t Cardinality() const {
+    return num_set_;
+  }
+
+  bool Get(uint64_t pos) const;
+
+  // Sets bit pos to val and returns its previous value. Like SETBIT, extends the string with
+  // zero bytes up to bit pos, even if val is false.
+  bool Set(uint64_t pos, bool val);
+
+  // Returns the number of set bits in [first, last).
+  uint64_t CountRange(uint64_t first, uint64_t last) const;
+
+  // Returns the position of the first bit in [first, last) that equals val, or last if there
+  // is none.
+  uint64_t FindFirst(bool val, uint64_t first, uint64_t last) const;
+
+  // Writes len bytes of the raw string from offset to dest.
+  // offset + len must not exceed Size().
+  void Materialize(size_t offset, size_t len, char* dest) const;
+
+  size_t MallocUsed() const {
+    return malloc_used_;
+  }
+
+  // Whether a string of size bytes with num_set set bits should use this encoding.
+  static bool IsSparse(size_t size, uint64_t num_set) {
+    return size >= kMinSize && num_set * 16 <= size;
+  }
+
+  // Whether the bitmap became dense enough to be stored as a raw string. Leaves a margin
+  // from IsSparse, so that a bitmap around the threshold is not converted back and forth.
+  bool IsDense() const {
+    return num_set_ * 8 > size_;
+  }
+
+ private:
+  struct Chunk {
+    Chunk(uint32_t k, std::pmr::memory_resource* mr) : key(k), offsets(mr), words(mr) {
+    }
+
+    bool IsBitset() const {
+      return !words.empty();
+    }
+
+    size_t MallocUsed() const {
+      return offsets.capacity() * sizeof(uint16_t) + words.capacity() * sizeof(uint64_t);
+    }
+
+    bool Get(uint32_t offset) const;
+    bool Set(uint32_t offset, bool val);
+
+    // Number of set bits below offset.
+    uint32_t CountBelow(uint32_t offset) const;
+
+    // Return the first set or clear bit from offset, or kChunkBits if there is none.
+    uint32_t NextSet(uint32_t offset) const;
+    uint32_t NextClear(uint32_t offset) const;
+
+    uint32_t key;  // pos / kChunkBits of the bits in the chunk.
+    uint32_t num_set = 0;
+    std::pmr::vector<uint16_t> offsets;  // Sorted, unless the chunk is a bitset.
+    std::pmr::vector<uint64_t> words;    // kChunkBits bits, or empty.
+  };
+
+  // Returns the first chunk with a key that is not less than key.
+  std::pmr::vector<Chunk>::const_iterator LowerBound(uint32_t key) const;
+
+  std::pmr::vector<Chunk> chunks_;
+  std::pmr::memory_resource* mr_;
+  size_t size_ = 0;
+  uint64_t num_set_ = 0;
+  size_t malloc_used_ = 0;
+};
+
+}  // namespace dfly
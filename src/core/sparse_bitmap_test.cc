@@ -0,0 +1,133 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sparse_bitmap.h"
+
+#include <absl/random/random.h>
+
+#include <string>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class SparseBitmapTest : public ::testing::Test {
+ protected:
+  static bool RawGet(const string& raw, uint64_t pos) {
+    return pos / 8 < raw.size() && (uint8_t(raw[pos / 8]) & (0x80 >> (pos % 8)));
+  }
+
+  static void RawSet(uint64_t pos, bool val, string* raw) {
+    if (raw->size() <= pos / 8)
+      raw->resize(pos / 8 + 1, 0);
+    char mask = char(0x80 >> (pos % 8));
+    (*raw)[pos / 8] = val ? ((*raw)[pos / 8] | mask) : ((*raw)[pos / 8] & ~mask);
+  }
+
+  string ToString(const SparseBitmap& bm) {
+    string res(bm.Size(), 0);
+    bm.Materialize(0, res.size(), res.data());
+    return res;
+  }
+
+  SparseBitmap bm_{pmr::get_default_resource()};
+};
+
+TEST_F(SparseBitmapTest, Basic) {
+  EXPECT_EQ(0u, bm_.Size());
+  EXPECT_FALSE(bm_.Set(1ULL << 31, true));
+  EXPECT_EQ((1u << 28) + 1, bm_.Size());
+  EXPECT_TRUE(bm_.Get(1ULL << 31));
+  EXPECT_FALSE(bm_.Get(7));
+  EXPECT_TRUE(bm_.Set(1ULL << 31, true));
+  EXPECT_FALSE(bm_.Set(7, true));
+  EXPECT_EQ(2u, bm_.Cardinality());
+  EXPECT_LT(bm_.MallocUsed(), 256u);
+  EXPECT_TRUE(SparseBitmap::IsSparse(bm_.Size(), bm_.Cardinality()));
+
+  EXPECT_EQ(2u, bm_.CountRange(0, 1ULL << 32));
+  EXPECT_EQ(1u, bm_.CountRange(8, 1ULL << 32));
+  EXPECT_EQ(7u, bm_.FindFirst(true, 0, 1ULL << 32));
+  EXPECT_EQ(1ULL << 31, bm_.FindFirst(true, 8, 1ULL << 32));
+  EXPECT_EQ(100u, bm_.FindFirst(true, 8, 100));
+  EXPECT_EQ(0u, bm_.FindFirst(false, 0, 100));
+  EXPECT_EQ(8u, bm_.FindFirst(false, 7, 100));
+
+  // Clearing a bit beyond the end extends the string.
+  EXPECT_TRUE(bm_.Set(7, false));
+  EXPECT_FALSE(bm_.Set((1ULL << 32) - 1, false));
+  EXPECT_EQ(1u << 29, bm_.Size());
+  EXPECT_EQ(1u, bm_.Cardinality());
+
+  char buf[4];
+  bm_.Materialize((1u << 28) - 2, 4, buf);
+  EXPECT_EQ(string("\0\0\x80\0", 4), string(buf, 4));
+}
+
+TEST_F(SparseBitmapTest, Chunks) {
+  // Fill one chunk until it becomes a bitset, and empty it back.
+  string raw;
+  for (uint64_t pos = 0; pos < SparseBitmap::kChunkBits; pos += 4) {
+    bm_.Set(pos + 3, true);
+    RawSet(pos + 3, true, &raw);
+  }
+  EXPECT_EQ(SparseBitmap::kChunkBits / 4, bm_.Cardinality());
+  EXPECT_EQ(raw, ToString(bm_));
+  EXPECT_TRUE(bm_.IsDense());
+  EXPECT_EQ(3u, bm_.FindFirst(true, 0, 1 << 20));
+  EXPECT_EQ(4u, bm_.FindFirst(false, 3, 1 << 20));
+  EXPECT_EQ(1000u, bm_.CountRange(1, 4001));
+
+  for (uint64_t pos = 0; pos < SparseBitmap::kChunkBits; pos += 4) {
+    ASSERT_TRUE(bm_.Set(pos + 3, false));
+  }
+  EXPECT_EQ(0u, bm_.Cardinality());
+  EXPECT_LT(bm_.MallocUsed(), 256u);
+  EXPECT_EQ(string(SparseBitmap::kChunkBits / 8, 0), ToString(bm_));
+}
+
+TEST_F(SparseBitmapTest, Random) {
+  absl::InsecureBitGen gen;
+  string raw;
+
+  for (unsigned i = 0; i < 50000; ++i) {
+    uint64_t pos = absl::Uniform<uint64_t>(gen, 0, 1 << 20);
+    if (i % 3 == 0)  // dense runs
+      pos = absl::Uniform<uint64_t>(gen, 200000, 210000);
+    bool val = absl::Bernoulli(gen, 0.7);
+    ASSERT_EQ(RawGet(raw, pos), bm_.Set(pos, val));
+    RawSet(pos, val, &raw);
+  }
+  ASSERT_EQ(raw, ToString(bm_));
+
+  uint64_t num_bits = raw.size() * 8;
+  for (unsigned i = 0; i < 2000; ++i) {
+    uint64_t first = absl::Uniform<uint64_t>(gen, 0, num_bits);
+    uint64_t last = absl::Uniform<uint64_t>(gen, first, num_bits + 1);
+    uint64_t count = 0, next_set = last, next_clear = last;
+    for (uint64_t pos = last; pos-- > first;) {
+      bool bit = RawGet(raw, pos);
+      count += bit;
+      (bit ? next_set : next_clear) = pos;
+    }
+    ASSERT_EQ(count, bm_.CountRange(first, last));
+    ASSERT_EQ(next_set, bm_.FindFirst(true, first, last));
+    ASSERT_EQ(next_clear, bm_.FindFirst(false, first, last));
+
+    size_t offset = first / 8, len = (last - first) / 8;
+    string part(len, 0);
+    bm_.Materialize(offset, len, part.data());
+    ASSERT_EQ(raw.substr(offset, len), part);
+  }
+
+  SparseBitmap copy{pmr::get_default_resource()};
+  copy.Assign(raw);
+  EXPECT_EQ(raw, ToString(copy));
+  EXPECT_EQ(bm_.Cardinality(), copy.Cardinality());
+}
+
+}  // namespace dfly
@@ -0,0 +1,150 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include <absl/base/internal/endian.h>
+
+#include "core/compact_object.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+constexpr size_t kValLenSize = 4;
+
+constexpr size_t kExpireTimeSize = 4;
+
+// expire_at == UINT32_MAX means the entry has no ttl.
+sds AllocEntry(string_view field, string_view value, uint32_t expire_at = UINT32_MAX) {
+  DCHECK_LE(value.size(), UINT32_MAX);
+
+  size_t ttl_size = expire_at == UINT32_MAX ? 0 : kExpireTimeSize;
+  sds res = sdsnewlen(SDS_NOINIT, field.size() + 1 + kValLenSize + value.size() + ttl_size);
+  char* ptr = res;
+  if (!field.empty())
+    memcpy(ptr, field.data(), field.size());
+  ptr += field.size();
+  *ptr++ = '\0';
+
+  absl::little_endian::Store32(ptr, value.size());
+  ptr += kValLenSize;
+  if (!value.empty())
+    memcpy(ptr, value.data(), value.size());
+  if (ttl_size)
+    absl::little_endian::Store32(ptr + value.size(), expire_at);
+
+  // sds length covers only the field, this way the entry behaves like a regular sds key.
+  sdssetlen(res, field.size());
+  return res;
+}
+
+}  // namespace
+
+bool StringMap::AddOrUpdate(string_view field, string_view value, uint32_t ttl_sec) {
+  DCHECK_GT(ttl_sec, 0u);  // ttl_sec == 0 would mean find and delete immediately
+
+  bool has_ttl = ttl_sec != UINT32_MAX;
+  uint32_t expire_at = UINT32_MAX;
+  if (has_ttl) {
+    expire_at = time_now() + ttl_sec;
+    DCHECK_LT(time_now(), expire_at);
+  }
+
+  sds entry = AllocEntry(field, value, expire_at);
+  sds prev = (sds)AddOrReplaceObj(entry, has_ttl);
+  if (prev) {
+    sdsfree(prev);
+    return false;
+  }
+
+  return true;
+}
+
+bool StringMap::AddOrSkip(string_view field, string_view value) {
+  if (Contains(field))
+    return false;
+
+  // TODO: to avoid the second lookup inside AddInternal.
+  return AddInternal(AllocEntry(field, value), false);
+}
+
+bool StringMap::Erase(string_view field) {
+  return EraseInternal(&field, 1);
+}
+
+bool StringMap::Contains(string_view field) const {
+  return ContainsInternal(&field, 1);
+}
+
+sds StringMap::Find(string_view field) const {
+  return (sds)FindInternal(&field, 1);
+}
+
+void StringMap::Clear() {
+  ClearInternal();
+}
+
+uint32_t StringMap::Scan(uint32_t cursor, const std::function<void(sds)>& func) const {
+  return DenseSet::Scan(cursor, [func](const void* ptr) { func((sds)ptr); });
+}
+
+string_view StringMap::GetValue(sds entry) {
+  const char* ptr = entry + sdslen(entry) + 1;
+  uint32_t len = absl::little_endian::Load32(ptr);
+  return string_view{ptr + kValLenSize, len};
+}
+
+uint64_t StringMap::Hash(const void* ptr, uint32_t cookie) const {
+  DCHECK_LT(cookie, 2u);
+
+  if (cookie == 0) {
+    sds s = (sds)ptr;
+    return CompactObj::HashCode(string_view{s, sdslen(s)});
+  }
+
+  const string_view* sv = (const string_view*)ptr;
+  return CompactObj::HashCode(*sv);
+}
+
+bool StringMap::ObjEqual(const void* left, const void* right, uint32_t right_cookie) const {
+  DCHECK_LT(right_cookie, 2u);
+
+  sds s1 = (sds)left;
+  string_view left_sv{s1, sdslen(s1)};
+
+  if (right_cookie == 0) {
+    sds s2 = (sds)right;
+    return left_sv == string_view{s2, sdslen(s2)};
+  }
+
+  const string_view* right_sv = (const string_view*)right;
+  return left_sv == (*right_sv);
+}
+
+size_t StringMap::ObjectAllocSize(const void* obj) const {
+  return zmalloc_usable_size(sdsAllocPtr((sds)obj));
+}
+
+uint32_t StringMap::ObjExpireTime(const void* obj) const {
+  string_view value = GetValue((sds)obj);
+  DCHECK_LE(sdslen((sds)obj) + 1 + kValLenSize + value.size() + kExpireTimeSize,
+            ObjectAllocSize(obj));
+
+  return absl::little_endian::Load32(value.data() + value.size());
+}
+
+void StringMap::ObjDelete(void* obj, bool has_ttl) const {
+  sdsfree((sds)obj);
+}
+
+}  // namespace dfly
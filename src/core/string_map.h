@@ -0,0 +1,82 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+#include "core/dense_set.h"
+
+extern "C" {
+#include "redis/sds.h"
+}
+
+namespace dfly {
+
+// Field-value map of strings based on DenseSet. Every entry is a single allocation:
+// an sds holding the field, followed by its null terminator, the 32-bit length of the value
+// and the value bytes. Fields with ttl have their 32-bit expiry time appended after the value.
+// Compared with redis dict it saves the dictEntry and a second sds allocation per field.
+class StringMap : public DenseSet {
+ public:
+  StringMap(std::pmr::memory_resource* res = std::pmr::get_default_resource()) : DenseSet(res) {
+  }
+
+  ~StringMap() {
+    Clear();
+  }
+
+  // Returns true if the field was added, false if it existed and its value was overridden.
+  // ttl_sec is relative to time_now(), UINT32_MAX means that the field does not expire.
+  // Overriding a field resets its ttl.
+  bool AddOrUpdate(std::string_view field, std::string_view value, uint32_t ttl_sec = UINT32_MAX);
+
+  // Returns true if the field was added, false if it existed. In that case the value is kept.
+  bool AddOrSkip(std::string_view field, std::string_view value);
+
+  bool Erase(std::string_view field);
+
+  bool Contains(std::string_view field) const;
+
+  // Returns the entry of the field or nullptr if it does not exist.
+  // The value of the entry is accessed with GetValue().
+  sds Find(std::string_view field) const;
+
+  void Clear();
+
+  iterator<sds> begin() {
+    return DenseSet::begin<sds>();
+  }
+
+  iterator<sds> end() {
+    return DenseSet::end<sds>();
+  }
+
+  const_iterator<sds> cbegin() const {
+    return DenseSet::cbegin<sds>();
+  }
+
+  const_iterator<sds> cend() const {
+    return DenseSet::cend<sds>();
+  }
+
+  uint32_t Scan(uint32_t, const std::function<void(sds)>&) const;
+
+  // Returns the value of the entry. An entry, returned by iterators, Scan and Find, is an sds
+  // of the field.
+  static std::string_view GetValue(sds entry);
+
+ protected:
+  uint64_t Hash(const void* ptr, uint32_t cookie) const override;
+
+  bool ObjEqual(const void* left, const void* right, uint32_t right_cookie) const override;
+
+  size_t ObjectAllocSize(const void* obj) const override;
+  uint32_t ObjExpireTime(const void* obj) const override;
+  void ObjDelete(void* obj, bool has_ttl) const override;
+};
+
+}  // namespace dfly
@@ -0,0 +1,136 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include <gtest/gtest.h>
+#include <mimalloc.h>
+
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include "glog/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+using absl::StrCat;
+
+class StringMapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void SetUp() override {
+    sm_.reset(new StringMap);
+  }
+
+  void TearDown() override {
+    sm_.reset();
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  unique_ptr<StringMap> sm_;
+};
+
+TEST_F(StringMapTest, Basic) {
+  EXPECT_TRUE(sm_->AddOrUpdate("foo", "bar"));
+  EXPECT_TRUE(sm_->Contains("foo"));
+  EXPECT_EQ("bar", StringMap::GetValue(sm_->Find("foo")));
+  EXPECT_EQ(nullptr, sm_->Find("bar"));
+
+  EXPECT_FALSE(sm_->AddOrUpdate("foo", "longer value"));
+  EXPECT_EQ("longer value", StringMap::GetValue(sm_->Find("foo")));
+
+  EXPECT_FALSE(sm_->AddOrSkip("foo", "skipped"));
+  EXPECT_EQ("longer value", StringMap::GetValue(sm_->Find("foo")));
+
+  EXPECT_TRUE(sm_->AddOrUpdate("", ""));
+  sds entry = sm_->Find("");
+  ASSERT_TRUE(entry);
+  EXPECT_EQ(0u, sdslen(entry));
+  EXPECT_EQ("", StringMap::GetValue(entry));
+  EXPECT_EQ(2u, sm_->Size());
+
+  EXPECT_TRUE(sm_->Erase("foo"));
+  EXPECT_FALSE(sm_->Erase("foo"));
+  EXPECT_FALSE(sm_->Contains("foo"));
+  EXPECT_EQ(1u, sm_->Size());
+}
+
+TEST_F(StringMapTest, Iteration) {
+  constexpr size_t kNumItems = 4096;
+  unordered_map<string, string> expected;
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    string field = StrCat("field", i);
+    string value = StrCat("value", i * 7);
+    EXPECT_TRUE(sm_->AddOrUpdate(field, value));
+    expected.emplace(field, value);
+  }
+
+  // Override half of the values while the table may still be rehashing.
+  for (size_t i = 0; i < kNumItems; i += 2) {
+    string field = StrCat("field", i);
+    EXPECT_FALSE(sm_->AddOrUpdate(field, field));
+    expected[field] = field;
+  }
+  EXPECT_EQ(kNumItems, sm_->Size());
+
+  unordered_map<string, string> seen;
+  for (sds entry : *sm_) {
+    string_view value = StringMap::GetValue(entry);
+    EXPECT_TRUE(seen.emplace(string{entry, sdslen(entry)}, string{value}).second);
+  }
+  EXPECT_EQ(expected, seen);
+
+  seen.clear();
+  uint32_t cursor = 0;
+  do {
+    cursor = sm_->Scan(cursor, [&](sds entry) {
+      seen.emplace(string{entry, sdslen(entry)}, string{StringMap::GetValue(entry)});
+    });
+  } while (cursor != 0);
+  EXPECT_EQ(expected, seen);
+}
+
+TEST_F(StringMapTest, Ttl) {
+  EXPECT_TRUE(sm_->AddOrUpdate("foo", "bar", 1));
+  EXPECT_TRUE(sm_->AddOrUpdate("persist", "val"));
+  EXPECT_EQ(1u, sm_->NumTtlEntries());
+  EXPECT_EQ("bar", StringMap::GetValue(sm_->Find("foo")));
+
+  // Overriding the value resets the ttl.
+  EXPECT_TRUE(sm_->AddOrUpdate("bar", "val", 1));
+  EXPECT_FALSE(sm_->AddOrUpdate("bar", "val2"));
+  EXPECT_EQ(1u, sm_->NumTtlEntries());
+
+  sm_->set_time(1);
+  EXPECT_EQ(nullptr, sm_->Find("foo"));
+  EXPECT_EQ("val2", StringMap::GetValue(sm_->Find("bar")));
+  EXPECT_EQ(2u, sm_->Size());
+  EXPECT_EQ(0u, sm_->NumTtlEntries());
+
+  for (unsigned i = 0; i < 100; ++i) {
+    EXPECT_TRUE(sm_->AddOrUpdate(StrCat("field", i), "value", 10));
+  }
+  sm_->set_time(11);
+  EXPECT_EQ(100u, sm_->ExpireStep(sm_->BucketCount()));
+  EXPECT_EQ(2u, sm_->Size());
+  for (sds entry : *sm_) {
+    EXPECT_FALSE(absl::StartsWith(entry, "field")) << entry;
+  }
+}
+
+}  // namespace dfly
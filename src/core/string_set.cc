@@ -162,6 +162,14 @@ sds StringSet::PopRaw() {
   return (sds)PopInternal();
 }
 
+sds StringSet::GetRandomMember(absl::BitGenRef gen) const {
+  return (sds)GetRandomObjInternal(gen);
+}
+
+sds StringSet::PopRandom(absl::BitGenRef gen) {
+  return (sds)PopRandomInternal(gen);
+}
+
 uint32_t StringSet::Scan(uint32_t cursor, const std::function<void(const sds)>& func) const {
   return DenseSet::Scan(cursor, [func](const void* ptr) { func((sds)ptr); });
 }
@@ -28,6 +28,13 @@ class StringSet : public DenseSet {
   std::optional<std::string> Pop();
   sds PopRaw();
 
+  // Returns a random member, every member being equally likely, or nullptr if the set is empty.
+  sds GetRandomMember(absl::BitGenRef gen) const;
+
+  // Removes a random member and returns it, or nullptr if the set is empty.
+  // The caller owns the returned sds.
+  sds PopRandom(absl::BitGenRef gen);
+
   ~StringSet() {
     Clear();
   }
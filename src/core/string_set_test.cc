@@ -13,9 +13,11 @@
 #include <random>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <absl/random/random.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 
@@ -357,6 +359,51 @@ TEST_F(StringSetTest, Pop) {
   DCHECK(to_insert.empty());
 }
 
+TEST_F(StringSetTest, RandomMember) {
+  absl::InsecureBitGen gen;
+  EXPECT_EQ(nullptr, ss_->GetRandomMember(gen));
+
+  constexpr size_t num_items = 100;
+  for (size_t i = 0; i < num_items; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+  EXPECT_TRUE(ss_->Add("ttl", 1));
+  ss_->set_time(1);
+
+  // Every member that did not expire is picked about equally often.
+  unordered_map<string, unsigned> counts;
+  for (size_t i = 0; i < num_items * 1000; ++i) {
+    sds member = ss_->GetRandomMember(gen);
+    ASSERT_NE(nullptr, member);
+    counts[string{member, sdslen(member)}]++;
+  }
+  EXPECT_EQ(num_items, counts.size());
+  EXPECT_EQ(0u, counts.count("ttl"));
+  for (const auto& [member, count] : counts) {
+    EXPECT_GT(count, 700u) << member;
+    EXPECT_LT(count, 1300u) << member;
+  }
+}
+
+TEST_F(StringSetTest, PopRandom) {
+  absl::InsecureBitGen gen;
+  constexpr size_t num_items = 5000;
+  for (size_t i = 0; i < num_items; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+
+  // Popping most of the members leaves a sparse table, which is still sampled.
+  unordered_set<string> popped;
+  while (!ss_->Empty()) {
+    sds member = ss_->PopRandom(gen);
+    ASSERT_NE(nullptr, member);
+    EXPECT_TRUE(popped.emplace(member, sdslen(member)).second);
+    sdsfree(member);
+    EXPECT_EQ(num_items, ss_->Size() + popped.size());
+  }
+  EXPECT_EQ(nullptr, ss_->PopRandom(gen));
+}
+
 TEST_F(StringSetTest, Iteration) {
   constexpr size_t num_items = 8192;
   unordered_set<string> to_insert;
@@ -406,4 +453,124 @@ TEST_F(StringSetTest, Ttl) {
   }
 }
 
+TEST_F(StringSetTest, ExpireStep) {
+  constexpr size_t num_strs = 1000;
+  for (size_t i = 0; i < num_strs; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("ttl", i), 1 + i % 2));
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+  EXPECT_EQ(num_strs, ss_->NumTtlEntries());
+
+  // Nothing has expired yet.
+  EXPECT_EQ(0u, ss_->ExpireStep(ss_->BucketCount()));
+
+  ss_->set_time(1);
+  size_t expired = 0;
+  for (size_t i = 0; i < ss_->BucketCount(); i += 64) {
+    expired += ss_->ExpireStep(64);
+  }
+  EXPECT_EQ(num_strs / 2, expired);
+  EXPECT_EQ(num_strs * 3 / 2, ss_->Size());
+  EXPECT_EQ(num_strs / 2, ss_->NumTtlEntries());
+
+  ss_->set_time(2);
+  EXPECT_EQ(num_strs / 2, ss_->ExpireStep(ss_->BucketCount()));
+  EXPECT_EQ(0u, ss_->NumTtlEntries());
+  EXPECT_EQ(num_strs, ss_->Size());
+  for (size_t i = 0; i < num_strs; ++i) {
+    EXPECT_TRUE(ss_->Contains(StrCat("key", i))) << i;
+  }
+}
+
+TEST_F(StringSetTest, IncrementalRehash) {
+  constexpr size_t num_strs = 1024;
+  for (size_t i = 0; i < num_strs; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+
+  // Keep adding until a Grow() starts a new rehash.
+  size_t num_added = num_strs;
+  while (!ss_->IsRehashing()) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", num_added++)));
+  }
+
+  // All the items are reachable while they are split across both bucket arrays.
+  for (size_t i = 0; i < num_added; ++i) {
+    EXPECT_TRUE(ss_->Contains(StrCat("key", i))) << i;
+  }
+  EXPECT_FALSE(ss_->Add("key0"));
+
+  unordered_set<string> seen;
+  for (const sds ptr : *ss_) {
+    EXPECT_TRUE(seen.emplace(ptr, sdslen(ptr)).second);
+  }
+  EXPECT_EQ(num_added, seen.size());
+
+  seen.clear();
+  uint32_t cursor = 0;
+  do {
+    cursor = ss_->Scan(cursor, [&](const sds ptr) { seen.emplace(ptr, sdslen(ptr)); });
+  } while (cursor != 0);
+  EXPECT_EQ(num_added, seen.size());
+
+  EXPECT_TRUE(ss_->Erase("key1"));
+  EXPECT_FALSE(ss_->Contains("key1"));
+
+  while (ss_->IsRehashing()) {
+    EXPECT_GT(DenseSet::RehashPending(16), 0u);
+  }
+  EXPECT_EQ(0u, DenseSet::RehashPending(16));
+  EXPECT_EQ(num_added - 1, ss_->Size());
+  for (size_t i = 2; i < num_added; ++i) {
+    EXPECT_TRUE(ss_->Contains(StrCat("key", i))) << i;
+  }
+}
+
+TEST_F(StringSetTest, Detach) {
+  size_t num_added = 0;
+  while (!ss_->IsRehashing()) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", num_added++)));
+  }
+
+  // A detached set is no longer driven by the rehashing of this thread.
+  ss_->Detach();
+  EXPECT_FALSE(ss_->IsRehashing());
+  EXPECT_EQ(0u, DenseSet::RehashPending(16));
+  EXPECT_EQ(num_added, ss_->Size());
+  for (size_t i = 0; i < num_added; ++i) {
+    EXPECT_TRUE(ss_->Contains(StrCat("key", i))) << i;
+  }
+}
+
+TEST_F(StringSetTest, ClearStep) {
+  constexpr size_t num_strs = 1024;
+  for (size_t i = 0; i < num_strs; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i), i % 2 ? 100 : UINT32_MAX));
+  }
+
+  // Start a rehash, so that both bucket arrays are cleared.
+  size_t num_added = num_strs;
+  while (!ss_->IsRehashing()) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", num_added++)));
+  }
+
+  uint32_t cursor = 0;
+  unsigned steps = 0;
+  while (!ss_->Empty()) {
+    size_t prev_size = ss_->Size();
+    cursor = ss_->ClearStep(cursor, 64);
+    EXPECT_LE(ss_->Size(), prev_size);
+    ++steps;
+  }
+  EXPECT_GT(steps, 1u);
+  EXPECT_EQ(0u, ss_->NumTtlEntries());
+  EXPECT_EQ(0u, ss_->ObjMallocUsed());
+  EXPECT_EQ(0u, ss_->SetMallocUsed());
+  EXPECT_FALSE(ss_->IsRehashing());
+
+  // The set is usable after it was cleared.
+  EXPECT_TRUE(ss_->Add("key"));
+  EXPECT_TRUE(ss_->Contains("key"));
+}
+
 }  // namespace dfly
@@ -0,0 +1,782 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/time_series.h"
+
+#include <absl/base/config.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+static_assert(ABSL_IS_LITTLE_ENDIAN, "the serialized headers are copied as is");
+
+// The serialized form: the header, the labels as length prefixed strings, then every chunk as
+// its header and its bit stream.
+constexpr char kMagic[8] = {'D', 'F', 'T', 'S', 'E', 'R', 'I', '1'};
+
+struct Header {
+  char magic[8];
+  uint64_t retention_ms;
+  uint32_t chunk_size;
+  uint32_t num_labels;
+  uint32_t num_chunks;
+  uint8_t policy;
+  uint8_t reserved[3];
+};
+
+struct ChunkHeader {
+  int64_t first_ts;
+  int64_t last_ts;
+  uint32_t num_samples;
+  uint32_t num_bits;
+};
+
+static_assert(sizeof(Header) == TimeSeries::kHeaderSize && sizeof(ChunkHeader) == 24);
+
+constexpr const char* kPolicyNames[] = {"BLOCK", "FIRST", "LAST", "MIN", "MAX", "SUM"};
+
+constexpr const char* kAggregationNames[] = {"AVG",  "SUM",   "MIN",   "MAX",   "RANGE", "COUNT",
+                                             "FIRST", "LAST", "STD.P", "STD.S", "VAR.P", "VAR.S"};
+
+// The delta of delta of a timestamp is encoded with the shortest of these widths, after a
+// prefix of as many 1 bits as its position, terminated by a 0 unless it is the last one. A zero
+// delta of delta, i.e. a regular interval, takes the single bit 0.
+constexpr unsigned kDodWidths[] = {7, 9, 12, 32, 64};
+constexpr unsigned kNumDodWidths = sizeof(kDodWidths) / sizeof(kDodWidths[0]);
+
+bool FitsInBits(int64_t val, unsigned n) {
+  if (n >= 64)
+    return true;
+  int64_t bound = int64_t(1) << (n - 1);
+  return val >= -bound && val < bound;
+}
+
+uint64_t ToBits(double value) {
+  uint64_t res;
+  memcpy(&res, &value, sizeof(res));
+  return res;
+}
+
+double FromBits(uint64_t bits) {
+  double res;
+  memcpy(&res, &bits, sizeof(res));
+  return res;
+}
+
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, uint32_t num_bits) : data_(data), num_bits_(num_bits) {
+  }
+
+  // Returns false past the end of the stream.
+  bool Read(unsigned n, uint64_t* res) {
+    if (n > num_bits_ - pos_)
+      return false;
+
+    uint64_t val = 0;
+    while (n > 0) {
+      unsigned bit_off = pos_ & 7;
+      unsigned take = min(8 - bit_off, n);
+      uint8_t byte = data_[pos_ >> 3];
+      val = (val << take) | ((byte >> (8 - bit_off - take)) & ((1u << take) - 1));
+      pos_ += take;
+      n -= take;
+    }
+    *res = val;
+    return true;
+  }
+
+  bool ReadSigned(unsigned n, int64_t* res) {
+    uint64_t val;
+    if (!Read(n, &val))
+      return false;
+    if (n < 64 && (val >> (n - 1)) & 1)
+      val |= ~uint64_t(0) << n;
+    *res = static_cast<int64_t>(val);
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  uint32_t num_bits_;
+  uint32_t pos_ = 0;
+};
+
+// Decodes the samples of a chunk one by one.
+class ChunkReader {
+ public:
+  ChunkReader(const uint8_t* data, uint32_t num_bits, uint32_t num_samples)
+      : reader_(data, num_bits), num_left_(num_samples) {
+  }
+
+  // Returns false at the end of the chunk or if it is malformed, which sets error.
+  bool Next(TimeSeries::Sample* sample);
+
+  bool error() const {
+    return error_;
+  }
+
+ private:
+  bool ReadTimestamp();
+  bool ReadValue();
+
+  BitReader reader_;
+  uint32_t num_left_;
+  bool first_ = true;
+  bool error_ = false;
+
+  int64_t ts_ = 0;
+  int64_t delta_ = 0;
+  uint64_t value_ = 0;
+  unsigned leading_ = 0, trailing_ = 0;
+};
+
+bool ChunkReader::ReadTimestamp() {
+  unsigned width = 0;
+  for (unsigned i = 0; i < kNumDodWidths; ++i) {
+    uint64_t bit;
+    if (!reader_.Read(1, &bit))
+      return false;
+    if (bit == 0) {
+      width = i == 0 ? 0 : kDodWidths[i - 1];
+      break;
+    }
+    if (i + 1 == kNumDodWidths)
+      width = kDodWidths[i];
+  }
+
+  int64_t dod = 0;
+  if (width > 0 && !reader_.ReadSigned(width, &dod))
+    return false;
+
+  delta_ += dod;
+  ts_ += delta_;
+  return true;
+}
+
+bool ChunkReader::ReadValue() {
+  uint64_t control;
+  if (!reader_.Read(1, &control))
+    return false;
+  if (control == 0)
+    return true;
+
+  if (!reader_.Read(1, &control))
+    return false;
+
+  if (control == 1) {
+    uint64_t leading, len;
+    if (!reader_.Read(5, &leading) || !reader_.Read(6, &len))
+      return false;
+    len = len == 0 ? 64 : len;
+    if (leading + len > 64)
+      return false;
+    leading_ = leading;
+    trailing_ = 64 - leading - len;
+  }
+
+  uint64_t bits;
+  if (!reader_.Read(64 - leading_ - trailing_, &bits))
+    return false;
+  value_ ^= bits << trailing_;
+  return true;
+}
+
+bool ChunkReader::Next(TimeSeries::Sample* sample) {
+  if (num_left_ == 0)
+    return false;
+
+  bool ok;
+  if (first_) {
+    uint64_t ts;
+    ok = reader_.Read(64, &ts) && reader_.Read(64, &value_);
+    ts_ = static_cast<int64_t>(ts);
+    // No xor block precedes the second value.
+    leading_ = trailing_ = 0;
+  } else {
+    ok = ReadTimestamp() && ReadValue();
+  }
+  first_ = false;
+
+  if (!ok) {
+    error_ = true;
+    num_left_ = 0;
+    return false;
+  }
+
+  --num_left_;
+  sample->ts = ts_;
+  sample->value = FromBits(value_);
+  return true;
+}
+
+}  // namespace
+
+void TimeSeries::Chunk::WriteBits(uint64_t bits, unsigned n) {
+  while (n > 0) {
+    unsigned bit_off = num_bits & 7;
+    if (bit_off == 0)
+      data.push_back(0);
+
+    unsigned take = min(8 - bit_off, n);
+    uint8_t part = (bits >> (n - take)) & ((1u << take) - 1);
+    data.back() |= part << (8 - bit_off - take);
+    num_bits += take;
+    n -= take;
+  }
+}
+
+void TimeSeries::Chunk::Append(int64_t ts, double value) {
+  uint64_t bits = ToBits(value);
+  if (num_samples == 0) {
+    WriteBits(static_cast<uint64_t>(ts), 64);
+    WriteBits(bits, 64);
+    first_ts = last_ts = ts;
+    prev_delta = 0;
+    prev_value = bits;
+    leading = 0xFF;
+    num_samples = 1;
+    return;
+  }
+
+  // The samples are appended by time, so the deltas are positive but their deltas may not be.
+  int64_t delta = ts - last_ts;
+  int64_t dod = delta - prev_delta;
+  if (dod == 0) {
+    WriteBits(0, 1);
+  } else {
+    for (unsigned i = 0; i < kNumDodWidths; ++i) {
+      if (!FitsInBits(dod, kDodWidths[i]))
+        continue;
+
+      // i + 1 ones, terminated by a zero unless the width is the last one.
+      bool last = i + 1 == kNumDodWidths;
+      unsigned prefix_len = i + 1 + !last;
+      WriteBits(((uint64_t(1) << (i + 1)) - 1) << !last, prefix_len);
+      uint64_t mask = kDodWidths[i] == 64 ? ~uint64_t(0) : (uint64_t(1) << kDodWidths[i]) - 1;
+      WriteBits(static_cast<uint64_t>(dod) & mask, kDodWidths[i]);
+      break;
+    }
+  }
+  prev_delta = delta;
+  last_ts = ts;
+
+  uint64_t x = bits ^ prev_value;
+  prev_value = bits;
+  ++num_samples;
+  if (x == 0) {
+    WriteBits(0, 1);
+    return;
+  }
+
+  unsigned lead = min(__builtin_clzll(x), 31), trail = __builtin_ctzll(x);
+  if (leading != 0xFF && lead >= leading && trail >= trailing) {
+    // The meaningful bits fit in the block of the previous xor.
+    WriteBits(0b10, 2);
+    WriteBits(x >> trailing, 64 - leading - trailing);
+    return;
+  }
+
+  unsigned len = 64 - lead - trail;
+  WriteBits(0b11, 2);
+  WriteBits(lead, 5);
+  WriteBits(len & 63, 6);
+  WriteBits(x >> trail, len);
+  leading = lead;
+  trailing = trail;
+}
+
+void TimeSeries::Chunk::Clear() {
+  first_ts = last_ts = 0;
+  num_samples = num_bits = 0;
+  data.clear();
+  prev_delta = 0;
+  prev_value = 0;
+  leading = 0xFF;
+  trailing = 0;
+}
+
+bool TimeSeries::Chunk::Decode(vector<Sample>* samples) const {
+  samples->clear();
+  samples->reserve(num_samples);
+
+  ChunkReader reader(data.data(), num_bits, num_samples);
+  Sample sample;
+  while (reader.Next(&sample))
+    samples->push_back(sample);
+  return !reader.error() && samples->size() == num_samples;
+}
+
+void TimeSeries::Chunk::Encode(const vector<Sample>& samples) {
+  Clear();
+  for (const Sample& sample : samples)
+    Append(sample.ts, sample.value);
+}
+
+TimeSeries::TimeSeries(pmr::memory_resource* mr) : mr_(mr), chunks_(mr) {
+  UpdateSize();
+}
+
+TimeSeries::~TimeSeries() {
+}
+
+void TimeSeries::Init(uint64_t retention_ms, uint32_t chunk_size, DuplicatePolicy policy) {
+  DCHECK_GT(chunk_size, 0u);
+
+  chunks_.clear();
+  labels_.clear();
+  retention_ms_ = retention_ms;
+  chunk_size_ = chunk_size;
+  policy_ = policy;
+  num_samples_ = 0;
+  UpdateSize();
+}
+
+bool TimeSeries::HasMagic(string_view str) {
+  return str.size() >= sizeof(Header) && memcmp(str.data(), kMagic, sizeof(kMagic)) == 0;
+}
+
+bool TimeSeries::Parse(string_view str) {
+  Init(0, kDefaultChunkSize, BLOCK);
+  if (!HasMagic(str))
+    return false;
+
+  Header header;
+  memcpy(&header, str.data(), sizeof(header));
+  if (header.chunk_size == 0 || header.policy > SUM)
+    return false;
+  str.remove_prefix(sizeof(header));
+
+  auto read_string = [&](string* dest) {
+    uint32_t len;
+    if (str.size() < sizeof(len))
+      return false;
+    memcpy(&len, str.data(), sizeof(len));
+    str.remove_prefix(sizeof(len));
+    if (str.size() < len)
+      return false;
+    dest->assign(str.data(), len);
+    str.remove_prefix(len);
+    return true;
+  };
+
+  // Every label takes at least 8 bytes.
+  if (header.num_labels > str.size() / 8)
+    return false;
+
+  Labels labels(header.num_labels);
+  for (auto& [name, value] : labels) {
+    if (!read_string(&name) || !read_string(&value))
+      return false;
+  }
+
+  // The chunks are decoded to check them and to restore the state of the encoder of the last
+  // one.
+  vector<Sample> samples;
+  for (uint32_t i = 0; i < header.num_chunks; ++i) {
+    ChunkHeader ch;
+    if (str.size() < sizeof(ch))
+      break;
+    memcpy(&ch, str.data(), sizeof(ch));
+    str.remove_prefix(sizeof(ch));
+
+    size_t num_bytes = (size_t(ch.num_bits) + 7) / 8;
+    if (ch.num_samples == 0 || str.size() < num_bytes)
+      break;
+
+    Chunk chunk(mr_);
+    chunk.num_bits = ch.num_bits;
+    chunk.num_samples = ch.num_samples;
+    chunk.data.assign(str.begin(), str.begin() + num_bytes);
+    str.remove_prefix(num_bytes);
+
+    if (!chunk.Decode(&samples))
+      break;
+
+    bool sorted = adjacent_find(samples.begin(), samples.end(), [](const auto& a, const auto& b) {
+                    return a.ts >= b.ts;
+                  }) == samples.end();
+    int64_t prev_ts = chunks_.empty() ? numeric_limits<int64_t>::min() : chunks_.back().last_ts;
+    if (!sorted || samples.front().ts <= prev_ts || samples.front().ts != ch.first_ts ||
+        samples.back().ts != ch.last_ts) {
+      break;
+    }
+
+    if (i + 1 == header.num_chunks) {
+      chunk.Encode(samples);
+    } else {
+      chunk.first_ts = ch.first_ts;
+      chunk.last_ts = ch.last_ts;
+    }
+    num_samples_ += samples.size();
+    chunks_.push_back(std::move(chunk));
+  }
+
+  if (chunks_.size() != header.num_chunks || !str.empty()) {
+    Init(0, kDefaultChunkSize, BLOCK);
+    return false;
+  }
+
+  retention_ms_ = header.retention_ms;
+  chunk_size_ = header.chunk_size;
+  policy_ = DuplicatePolicy(header.policy);
+  labels_ = std::move(labels);
+  UpdateSize();
+  return true;
+}
+
+optional<TimeSeries::DuplicatePolicy> TimeSeries::ParsePolicy(string_view name) {
+  for (unsigned i = 0; i <= SUM; ++i) {
+    if (absl::EqualsIgnoreCase(name, kPolicyNames[i]))
+      return DuplicatePolicy(i);
+  }
+  return nullopt;
+}
+
+const char* TimeSeries::PolicyName(DuplicatePolicy policy) {
+  return kPolicyNames[policy];
+}
+
+int64_t TimeSeries::MinTimestamp() const {
+  if (retention_ms_ == 0 || chunks_.empty())
+    return numeric_limits<int64_t>::min();
+
+  // The distance of the last timestamp from the smallest one does not overflow as unsigned.
+  int64_t last = chunks_.back().last_ts;
+  uint64_t span = uint64_t(last) - uint64_t(numeric_limits<int64_t>::min());
+  if (retention_ms_ >= span)
+    return numeric_limits<int64_t>::min();
+  return int64_t(uint64_t(last) - retention_ms_);
+}
+
+TimeSeries::AddResult TimeSeries::Add(int64_t ts, double value, DuplicatePolicy policy) {
+  if (!chunks_.empty()) {
+    if (ts < MinTimestamp())
+      return TOO_OLD;
+    if (ts <= chunks_.back().last_ts)
+      return Upsert(ts, value, policy);
+  }
+
+  if (chunks_.empty() || chunks_.back().num_bits >= uint64_t(chunk_size_) * 8) {
+    // The full chunk is not appended to anymore.
+    if (!chunks_.empty())
+      chunks_.back().data.shrink_to_fit();
+    chunks_.emplace_back(mr_);
+    size_ += sizeof(ChunkHeader);
+  }
+
+  Chunk& chunk = chunks_.back();
+  size_ -= chunk.data.size();
+  chunk.Append(ts, value);
+  size_ += chunk.data.size();
+  ++num_samples_;
+  return ADDED;
+}
+
+TimeSeries::AddResult TimeSeries::Upsert(int64_t ts, double value, DuplicatePolicy policy) {
+  // The first chunk that ends at or after ts, which starts after the chunk before it ends.
+  auto it = lower_bound(chunks_.begin(), chunks_.end(), ts,
+                        [](const Chunk& chunk, int64_t ts) { return chunk.last_ts < ts; });
+  DCHECK(it != chunks_.end());
+
+  vector<Sample> samples;
+  bool decoded = it->Decode(&samples);
+  DCHECK(decoded);
+
+  auto pos = lower_bound(samples.begin(), samples.end(), ts,
+                         [](const Sample& sample, int64_t ts) { return sample.ts < ts; });
+  if (pos != samples.end() && pos->ts == ts) {
+    switch (policy) {
+      case BLOCK:
+        return BLOCKED;
+      case FIRST:
+        return ADDED;
+      case LAST:
+        pos->value = value;
+        break;
+      case MIN:
+        pos->value = min(pos->value, value);
+        break;
+      case MAX:
+        pos->value = max(pos->value, value);
+        break;
+      case SUM:
+        pos->value += value;
+        break;
+    }
+  } else {
+    samples.insert(pos, Sample{ts, value});
+    ++num_samples_;
+  }
+
+  ReplaceChunk(it - chunks_.begin(), samples);
+  return ADDED;
+}
+
+void TimeSeries::ReplaceChunk(size_t i, const vector<Sample>& samples) {
+  Chunk& chunk = chunks_[i];
+  size_ -= chunk.data.size();
+  if (samples.empty()) {
+    size_ -= sizeof(ChunkHeader);
+    chunks_.erase(chunks_.begin() + i);
+
+    // The new last chunk is appended to, so it needs the state of its encoder, which is not
+    // restored for the chunks that were parsed.
+    if (i == chunks_.size() && i > 0) {
+      vector<Sample> last;
+      chunks_.back().Decode(&last);
+      chunks_.back().Encode(last);
+    }
+    return;
+  }
+
+  chunk.Encode(samples);
+  if (i + 1 < chunks_.size())
+    chunk.data.shrink_to_fit();
+  size_ += chunk.data.size();
+}
+
+size_t TimeSeries::DeleteRange(int64_t from, int64_t to) {
+  size_t res = 0;
+  vector<Sample> samples;
+  for (size_t i = 0; i < chunks_.size();) {
+    Chunk& chunk = chunks_[i];
+    if (chunk.last_ts < from || chunk.first_ts > to) {
+      ++i;
+      continue;
+    }
+
+    size_t num_samples = chunk.num_samples;
+    if (chunk.first_ts >= from && chunk.last_ts <= to) {
+      samples.clear();
+    } else {
+      chunk.Decode(&samples);
+      samples.erase(remove_if(samples.begin(), samples.end(),
+                              [&](const Sample& s) { return s.ts >= from && s.ts <= to; }),
+                    samples.end());
+    }
+
+    res += num_samples - samples.size();
+    ReplaceChunk(i, samples);
+    i += !samples.empty();
+  }
+
+  num_samples_ -= res;
+  return res;
+}
+
+size_t TimeSeries::Trim() {
+  int64_t min_ts = MinTimestamp();
+  size_t num_expired = 0;
+  while (num_expired < chunks_.size() && chunks_[num_expired].last_ts < min_ts)
+    ++num_expired;
+
+  size_t res = 0;
+  for (size_t i = 0; i < num_expired; ++i) {
+    res += chunks_[i].num_samples;
+    size_ -= sizeof(ChunkHeader) + chunks_[i].data.size();
+  }
+  chunks_.erase(chunks_.begin(), chunks_.begin() + num_expired);
+  num_samples_ -= res;
+  return res;
+}
+
+void TimeSeries::Range(int64_t from, int64_t to, absl::FunctionRef<bool(const Sample&)> cb) const {
+  from = max(from, MinTimestamp());
+  auto it = lower_bound(chunks_.begin(), chunks_.end(), from,
+                        [](const Chunk& chunk, int64_t ts) { return chunk.last_ts < ts; });
+
+  for (; it != chunks_.end() && it->first_ts <= to; ++it) {
+    ChunkReader reader(it->data.data(), it->num_bits, it->num_samples);
+    Sample sample;
+    while (reader.Next(&sample)) {
+      if (sample.ts > to)
+        return;
+      if (sample.ts >= from && !cb(sample))
+        return;
+    }
+  }
+}
+
+optional<TimeSeries::Sample> TimeSeries::Last() const {
+  if (chunks_.empty())
+    return nullopt;
+  const Chunk& chunk = chunks_.back();
+  return Sample{chunk.last_ts, FromBits(chunk.prev_value)};
+}
+
+optional<TimeSeries::Sample> TimeSeries::First() const {
+  optional<Sample> res;
+  Range(numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max(), [&](const Sample& s) {
+    res = s;
+    return false;
+  });
+  return res;
+}
+
+void TimeSeries::SetLabels(Labels labels) {
+  labels_ = std::move(labels);
+  UpdateSize();
+}
+
+const string* TimeSeries::Label(string_view name) const {
+  for (const auto& [label, value] : labels_) {
+    if (label == name)
+      return &value;
+  }
+  return nullptr;
+}
+
+void TimeSeries::UpdateSize() {
+  size_ = sizeof(Header);
+  for (const auto& [name, value] : labels_)
+    size_ += 2 * sizeof(uint32_t) + name.size() + value.size();
+  for (const Chunk& chunk : chunks_)
+    size_ += sizeof(ChunkHeader) + chunk.data.size();
+}
+
+void TimeSeries::Materialize(size_t offset, size_t len, char* dest) const {
+  DCHECK_LE(offset + len, size_);
+
+  // Copies the part of [src, src + n) at position pos of the serialized form that is in range.
+  size_t pos = 0;
+  auto emit = [&](const void* src, size_t n) {
+    size_t begin = max(pos, offset), end = min(pos + n, offset + len);
+    if (begin < end)
+      memcpy(dest + (begin - offset), static_cast<const char*>(src) + (begin - pos), end - begin);
+    pos += n;
+  };
+  auto emit_string = [&](const string& str) {
+    uint32_t str_len = str.size();
+    emit(&str_len, sizeof(str_len));
+    emit(str.data(), str.size());
+  };
+
+  Header header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.retention_ms = retention_ms_;
+  header.chunk_size = chunk_size_;
+  header.num_labels = labels_.size();
+  header.num_chunks = chunks_.size();
+  header.policy = policy_;
+  emit(&header, sizeof(header));
+
+  for (const auto& [name, value] : labels_) {
+    emit_string(name);
+    emit_string(value);
+  }
+
+  for (const Chunk& chunk : chunks_) {
+    if (pos >= offset + len)
+      break;
+
+    ChunkHeader ch{chunk.first_ts, chunk.last_ts, chunk.num_samples, chunk.num_bits};
+    emit(&ch, sizeof(ch));
+    emit(chunk.data.data(), chunk.data.size());
+  }
+}
+
+size_t TimeSeries::MallocUsed() const {
+  size_t res = chunks_.capacity() * sizeof(Chunk) + labels_.capacity() * sizeof(labels_[0]);
+  for (const Chunk& chunk : chunks_)
+    res += chunk.data.capacity();
+  for (const auto& [name, value] : labels_)
+    res += name.capacity() + value.capacity();
+  return res;
+}
+
+optional<TimeSeriesAggregator::Type> TimeSeriesAggregator::ParseType(string_view name) {
+  for (unsigned i = 0; i <= VAR_S; ++i) {
+    if (absl::EqualsIgnoreCase(name, kAggregationNames[i]))
+      return Type(i);
+  }
+  return nullopt;
+}
+
+TimeSeriesAggregator::TimeSeriesAggregator(Type type, int64_t bucket_ms, int64_t align)
+    : type_(type), bucket_ms_(bucket_ms), align_(align) {
+  DCHECK_GT(bucket_ms, 0);
+}
+
+int64_t TimeSeriesAggregator::BucketStart(int64_t ts) const {
+  int64_t mod = (ts - align_) % bucket_ms_;
+  return ts - (mod < 0 ? mod + bucket_ms_ : mod);
+}
+
+double TimeSeriesAggregator::Value() const {
+  switch (type_) {
+    case AVG:
+      return sum_ / count_;
+    case SUM:
+      return sum_;
+    case MIN:
+      return min_;
+    case MAX:
+      return max_;
+    case RANGE:
+      return max_ - min_;
+    case COUNT:
+      return count_;
+    case FIRST:
+      return first_;
+    case LAST:
+      return last_;
+    case STD_P:
+      return sqrt(m2_ / count_);
+    case STD_S:
+      return count_ > 1 ? sqrt(m2_ / (count_ - 1)) : 0;
+    case VAR_P:
+      return m2_ / count_;
+    case VAR_S:
+      return count_ > 1 ? m2_ / (count_ - 1) : 0;
+  }
+  return 0;
+}
+
+void TimeSeriesAggregator::Add(const TimeSeries::Sample& sample,
+                               vector<TimeSeries::Sample>* out) {
+  int64_t start = BucketStart(sample.ts);
+  if (open_ && start != start_)
+    Finish(out);
+
+  double value = sample.value;
+  if (!open_) {
+    open_ = true;
+    start_ = start;
+    count_ = 0;
+    sum_ = mean_ = m2_ = 0;
+    min_ = max_ = first_ = value;
+  }
+
+  ++count_;
+  sum_ += value;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  last_ = value;
+
+  double delta = value - mean_;
+  mean_ += delta / count_;
+  m2_ += delta * (value - mean_);
+}
+
+void TimeSeriesAggregator::Finish(vector<TimeSeries::Sample>* out) {
+  if (!open_)
+    return;
+  out->push_back({start_, Value()});
+  open_ = false;
+}
+
+}  // namespace dfly
@@ -0,0 +1,221 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/functional/function_ref.h>
+
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dfly {
+
+// A time series of (timestamp in ms, double) samples, compressed like in Facebook's Gorilla:
+// the timestamps are encoded by their delta of delta and the values by their xor with the
+// previous value, so that a sample of a regular series takes a few bytes. The samples are kept
+// in chunks of about chunk_size bytes, ordered by time. Appending to the last chunk is cheap,
+// older samples are inserted by re-encoding their chunk.
+//
+// The series keeps its samples within retention_ms of its last timestamp, if set. The expired
+// samples are not returned and their chunks are dropped by Trim.
+//
+// Like BloomFilter, it is stored as a string value (see CompactObj::GetTimeSeries), whose raw
+// bytes are its serialized form.
+class TimeSeries {
+ public:
+  static constexpr uint32_t kDefaultChunkSize = 4096;
+
+  // The length of the header of the serialized form, which starts with the magic.
+  static constexpr size_t kHeaderSize = 32;
+
+  struct Sample {
+    int64_t ts;
+    double value;
+
+    bool operator==(const Sample& o) const {
+      return ts == o.ts && value == o.value;
+    }
+  };
+
+  // How a sample with the timestamp of an existing one is added.
+  enum DuplicatePolicy : uint8_t { BLOCK, FIRST, LAST, MIN, MAX, SUM };
+
+  enum AddResult : uint8_t { ADDED, BLOCKED, TOO_OLD };
+
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  explicit TimeSeries(std::pmr::memory_resource* mr);
+  ~TimeSeries();
+
+  TimeSeries(const TimeSeries&) = delete;
+  void operator=(const TimeSeries&) = delete;
+
+  // Resets the series to an empty one. A retention of 0 keeps all the samples.
+  void Init(uint64_t retention_ms, uint32_t chunk_size, DuplicatePolicy policy);
+
+  // Replaces the series with the one serialized in str. Returns false if str is not a valid
+  // serialized series, in which case the series is left empty.
+  bool Parse(std::string_view str);
+
+  // Whether str starts like a serialized series.
+  static bool HasMagic(std::string_view str);
+
+  static std::optional<DuplicatePolicy> ParsePolicy(std::string_view name);
+  static const char* PolicyName(DuplicatePolicy policy);
+
+  // Adds the sample with policy for a duplicate timestamp. TOO_OLD if it precedes the retention
+  // window and BLOCKED if the timestamp exists and policy is BLOCK.
+  AddResult Add(int64_t ts, double value, DuplicatePolicy policy);
+
+  AddResult Add(int64_t ts, double value) {
+    return Add(ts, value, policy_);
+  }
+
+  // Removes the samples within [from, to] and returns their number.
+  size_t DeleteRange(int64_t from, int64_t to);
+
+  // Drops the chunks whose samples all expired and returns the number of their samples.
+  size_t Trim();
+
+  // Calls cb for the samples within [from, to] that did not expire, by time, until it returns
+  // false.
+  void Range(int64_t from, int64_t to, absl::FunctionRef<bool(const Sample&)> cb) const;
+
+  std::optional<Sample> Last() const;
+
+  // The first sample that did not expire.
+  std::optional<Sample> First() const;
+
+  void SetLabels(Labels labels);
+
+  const Labels& labels() const {
+    return labels_;
+  }
+
+  // The value of the label, or nullptr.
+  const std::string* Label(std::string_view name) const;
+
+  uint64_t retention_ms() const {
+    return retention_ms_;
+  }
+
+  void set_retention_ms(uint64_t retention_ms) {
+    retention_ms_ = retention_ms;
+  }
+
+  uint32_t chunk_size() const {
+    return chunk_size_;
+  }
+
+  DuplicatePolicy policy() const {
+    return policy_;
+  }
+
+  void set_policy(DuplicatePolicy policy) {
+    policy_ = policy;
+  }
+
+  // The number of the samples, including the expired ones of the chunks that are not trimmed.
+  size_t num_samples() const {
+    return num_samples_;
+  }
+
+  size_t num_chunks() const {
+    return chunks_.size();
+  }
+
+  // The length of the serialized form.
+  size_t Size() const {
+    return size_;
+  }
+
+  // Writes len bytes of the serialized form from offset to dest.
+  // offset + len must not exceed Size().
+  void Materialize(size_t offset, size_t len, char* dest) const;
+
+  size_t MallocUsed() const;
+
+ private:
+  struct Chunk {
+    explicit Chunk(std::pmr::memory_resource* mr) : data(mr) {
+    }
+
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+    uint32_t num_samples = 0;
+    uint32_t num_bits = 0;
+    std::pmr::vector<uint8_t> data;
+
+    // The state of the encoder after the last sample.
+    int64_t prev_delta = 0;
+    uint64_t prev_value = 0;
+    uint8_t leading = 0xFF;  // Of the last xor block, none if 0xFF.
+    uint8_t trailing = 0;
+
+    void Append(int64_t ts, double value);
+    void WriteBits(uint64_t bits, unsigned n);
+    void Clear();
+
+    // Decodes all the samples, returns false if the chunk is malformed.
+    bool Decode(std::vector<Sample>* samples) const;
+    void Encode(const std::vector<Sample>& samples);
+  };
+
+  // The samples before it expired.
+  int64_t MinTimestamp() const;
+
+  // Re-encodes chunk i with samples, or erases it if there are none.
+  void ReplaceChunk(size_t i, const std::vector<Sample>& samples);
+  AddResult Upsert(int64_t ts, double value, DuplicatePolicy policy);
+
+  void UpdateSize();
+
+  std::pmr::memory_resource* mr_;
+  std::pmr::vector<Chunk> chunks_;
+  Labels labels_;
+  uint64_t retention_ms_ = 0;
+  uint32_t chunk_size_ = kDefaultChunkSize;
+  DuplicatePolicy policy_ = BLOCK;
+  size_t num_samples_ = 0;
+  size_t size_ = 0;
+};
+
+// Folds the samples of a range into buckets of bucket_ms, which start at the multiples of
+// bucket_ms shifted by align, for the downsampling of TS.RANGE. A bucket is reported by its
+// start and the aggregate of its samples.
+class TimeSeriesAggregator {
+ public:
+  enum Type : uint8_t { AVG, SUM, MIN, MAX, RANGE, COUNT, FIRST, LAST, STD_P, STD_S, VAR_P, VAR_S };
+
+  static std::optional<Type> ParseType(std::string_view name);
+
+  TimeSeriesAggregator(Type type, int64_t bucket_ms, int64_t align = 0);
+
+  // The samples must be added by time. Appends the buckets that are complete to out.
+  void Add(const TimeSeries::Sample& sample, std::vector<TimeSeries::Sample>* out);
+
+  // Appends the last bucket, if any.
+  void Finish(std::vector<TimeSeries::Sample>* out);
+
+ private:
+  int64_t BucketStart(int64_t ts) const;
+  double Value() const;
+
+  Type type_;
+  int64_t bucket_ms_;
+  int64_t align_;
+
+  bool open_ = false;
+  int64_t start_ = 0;
+  uint64_t count_ = 0;
+  double sum_ = 0, min_ = 0, max_ = 0, first_ = 0, last_ = 0;
+  double mean_ = 0, m2_ = 0;  // Welford's running variance.
+};
+
+}  // namespace dfly
@@ -0,0 +1,273 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/time_series.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+using Sample = TimeSeries::Sample;
+
+class TimeSeriesTest : public ::testing::Test {
+ protected:
+  TimeSeriesTest() : series_(pmr::get_default_resource()) {
+  }
+
+  vector<Sample> Range(const TimeSeries& series, int64_t from = numeric_limits<int64_t>::min(),
+                       int64_t to = numeric_limits<int64_t>::max()) const {
+    vector<Sample> res;
+    series.Range(from, to, [&](const Sample& s) {
+      res.push_back(s);
+      return true;
+    });
+    return res;
+  }
+
+  vector<Sample> Range(int64_t from = numeric_limits<int64_t>::min(),
+                       int64_t to = numeric_limits<int64_t>::max()) const {
+    return Range(series_, from, to);
+  }
+
+  string Serialize() const {
+    string res(series_.Size(), '\0');
+    series_.Materialize(0, res.size(), res.data());
+    return res;
+  }
+
+  TimeSeries series_;
+};
+
+TEST_F(TimeSeriesTest, Basic) {
+  series_.Init(0, 128, TimeSeries::BLOCK);
+  EXPECT_EQ(0u, series_.num_samples());
+  EXPECT_FALSE(series_.Last());
+  EXPECT_TRUE(Range().empty());
+
+  EXPECT_EQ(TimeSeries::ADDED, series_.Add(1000, 1.5));
+  EXPECT_EQ(TimeSeries::ADDED, series_.Add(2000, 2.5));
+  EXPECT_EQ(TimeSeries::ADDED, series_.Add(3000, -7));
+  EXPECT_EQ(TimeSeries::BLOCKED, series_.Add(2000, 10));
+
+  EXPECT_EQ(3u, series_.num_samples());
+  EXPECT_EQ((Sample{3000, -7}), *series_.Last());
+  EXPECT_EQ((Sample{1000, 1.5}), *series_.First());
+  EXPECT_EQ((vector<Sample>{{1000, 1.5}, {2000, 2.5}, {3000, -7}}), Range());
+  EXPECT_EQ((vector<Sample>{{2000, 2.5}}), Range(1500, 2999));
+}
+
+TEST_F(TimeSeriesTest, Compression) {
+  series_.Init(0, TimeSeries::kDefaultChunkSize, TimeSeries::BLOCK);
+
+  // A regular series of slowly changing values.
+  vector<Sample> expected;
+  for (int64_t i = 0; i < 10000; ++i)
+    expected.push_back({1700000000000 + i * 1000, double(20 + (i / 10) % 5)});
+  for (const Sample& s : expected)
+    ASSERT_EQ(TimeSeries::ADDED, series_.Add(s.ts, s.value));
+
+  EXPECT_EQ(expected, Range());
+  EXPECT_LT(series_.Size(), expected.size());
+
+  // Random values and intervals, which take all the encodings.
+  series_.Init(0, 256, TimeSeries::BLOCK);
+  mt19937 gen(42);
+  expected.clear();
+  int64_t ts = -100000;
+  for (unsigned i = 0; i < 10000; ++i) {
+    unsigned width = gen() % 40;
+    ts += 1 + (gen() & ((uint64_t(1) << width) - 1));
+    double value = i % 3 ? double(gen() % 100) : uniform_real_distribution<double>(-1e9, 1e9)(gen);
+    expected.push_back({ts, value});
+    ASSERT_EQ(TimeSeries::ADDED, series_.Add(ts, value));
+  }
+  EXPECT_GT(series_.num_chunks(), 1u);
+  EXPECT_EQ(expected, Range());
+
+  // The special values keep their bits.
+  series_.Init(0, 256, TimeSeries::BLOCK);
+  series_.Add(1, numeric_limits<double>::infinity());
+  series_.Add(2, -0.0);
+  series_.Add(3, numeric_limits<double>::quiet_NaN());
+  series_.Add(numeric_limits<int64_t>::max(), 0);
+  vector<Sample> res = Range();
+  ASSERT_EQ(4u, res.size());
+  EXPECT_TRUE(isinf(res[0].value));
+  EXPECT_TRUE(signbit(res[1].value));
+  EXPECT_TRUE(isnan(res[2].value));
+  EXPECT_EQ(numeric_limits<int64_t>::max(), res[3].ts);
+}
+
+TEST_F(TimeSeriesTest, OutOfOrder) {
+  series_.Init(0, 64, TimeSeries::LAST);
+  vector<Sample> expected;
+  for (int64_t ts = 0; ts < 2000; ts += 2) {
+    series_.Add(ts, ts);
+    expected.push_back({ts, double(ts)});
+  }
+  ASSERT_GT(series_.num_chunks(), 2u);
+
+  // Fills the gaps, within the chunks and between them.
+  for (int64_t ts = 1999; ts > 0; ts -= 2) {
+    ASSERT_EQ(TimeSeries::ADDED, series_.Add(ts, -ts));
+    expected.push_back({ts, double(-ts)});
+  }
+  sort(expected.begin(), expected.end(), [](const auto& a, const auto& b) { return a.ts < b.ts; });
+  EXPECT_EQ(expected, Range());
+  EXPECT_EQ(2000u, series_.num_samples());
+
+  // The encoder of the last chunk still appends after its re-encoding.
+  series_.Add(1998, 7);
+  series_.Add(2005, 8);
+  EXPECT_EQ((vector<Sample>{{1998, 7}, {1999, -1999}, {2005, 8}}), Range(1998, 3000));
+}
+
+TEST_F(TimeSeriesTest, DuplicatePolicy) {
+  series_.Init(0, 128, TimeSeries::BLOCK);
+  series_.Add(10, 5);
+
+  auto check = [&](TimeSeries::DuplicatePolicy policy, double value, double expected) {
+    EXPECT_EQ(TimeSeries::ADDED, series_.Add(10, value, policy));
+    EXPECT_EQ((vector<Sample>{{10, expected}}), Range());
+  };
+  check(TimeSeries::FIRST, 1, 5);
+  check(TimeSeries::MIN, 1, 1);
+  check(TimeSeries::MAX, 3, 3);
+  check(TimeSeries::SUM, 2, 5);
+  check(TimeSeries::LAST, 9, 9);
+  EXPECT_EQ(1u, series_.num_samples());
+
+  EXPECT_EQ(TimeSeries::SUM, TimeSeries::ParsePolicy("sum"));
+  EXPECT_FALSE(TimeSeries::ParsePolicy("avg"));
+  EXPECT_STREQ("LAST", TimeSeries::PolicyName(TimeSeries::LAST));
+}
+
+TEST_F(TimeSeriesTest, Retention) {
+  series_.Init(100, 32, TimeSeries::BLOCK);
+  for (int64_t ts = 0; ts < 1000; ts += 10)
+    series_.Add(ts, 1);
+
+  // The samples before 990 - 100 expired.
+  EXPECT_EQ(11u, Range().size());
+  EXPECT_EQ(890, series_.First()->ts);
+  EXPECT_EQ(TimeSeries::TOO_OLD, series_.Add(889, 1));
+  EXPECT_EQ(TimeSeries::ADDED, series_.Add(895, 1));
+
+  size_t num_chunks = series_.num_chunks();
+  size_t trimmed = series_.Trim();
+  EXPECT_GT(trimmed, 0u);
+  EXPECT_LT(series_.num_chunks(), num_chunks);
+  EXPECT_EQ(101 - trimmed, series_.num_samples());
+  EXPECT_EQ(12u, Range().size());
+  EXPECT_EQ(0u, series_.Trim());
+}
+
+TEST_F(TimeSeriesTest, DeleteRange) {
+  series_.Init(0, 32, TimeSeries::BLOCK);
+  for (int64_t ts = 0; ts < 100; ++ts)
+    series_.Add(ts, ts);
+
+  EXPECT_EQ(50u, series_.DeleteRange(25, 74));
+  EXPECT_EQ(50u, series_.num_samples());
+  vector<Sample> res = Range();
+  ASSERT_EQ(50u, res.size());
+  EXPECT_EQ(24, res[24].ts);
+  EXPECT_EQ(75, res[25].ts);
+  EXPECT_EQ(0u, series_.DeleteRange(25, 74));
+
+  // Deleting the last chunk resumes the encoding of the previous one.
+  EXPECT_EQ(25u, series_.DeleteRange(75, 99));
+  series_.Add(30, 1);
+  EXPECT_EQ((vector<Sample>{{23, 23}, {24, 24}, {30, 1}}), Range(23, 100));
+
+  EXPECT_EQ(26u, series_.DeleteRange(0, 100));
+  EXPECT_EQ(0u, series_.num_chunks());
+  EXPECT_FALSE(series_.Last());
+}
+
+TEST_F(TimeSeriesTest, Serialization) {
+  series_.Init(5000, 64, TimeSeries::MAX);
+  series_.SetLabels({{"sensor", "t1"}, {"room", "kitchen"}});
+  for (int64_t ts = 0; ts < 1000; ts += 3)
+    series_.Add(ts, sin(ts));
+
+  string serialized = Serialize();
+  EXPECT_TRUE(TimeSeries::HasMagic(serialized));
+  EXPECT_FALSE(TimeSeries::HasMagic("DFTSERI1"));
+
+  // Materializes the parts.
+  string parts(serialized.size(), '\0');
+  for (size_t offset = 0; offset < parts.size(); offset += 7) {
+    size_t len = min<size_t>(7, parts.size() - offset);
+    series_.Materialize(offset, len, parts.data() + offset);
+  }
+  EXPECT_EQ(serialized, parts);
+
+  TimeSeries parsed(pmr::get_default_resource());
+  ASSERT_TRUE(parsed.Parse(serialized));
+  EXPECT_EQ(Range(), Range(parsed));
+  EXPECT_EQ(series_.labels(), parsed.labels());
+  EXPECT_EQ("kitchen", *parsed.Label("room"));
+  EXPECT_EQ(nullptr, parsed.Label("floor"));
+  EXPECT_EQ(5000u, parsed.retention_ms());
+  EXPECT_EQ(64u, parsed.chunk_size());
+  EXPECT_EQ(TimeSeries::MAX, parsed.policy());
+  EXPECT_EQ(series_.Size(), parsed.Size());
+
+  // The parsed series appends like the original.
+  series_.Add(2000, 1);
+  parsed.Add(2000, 1);
+  EXPECT_EQ(Serialize(), [&] {
+    string res(parsed.Size(), '\0');
+    parsed.Materialize(0, res.size(), res.data());
+    return res;
+  }());
+
+  EXPECT_FALSE(parsed.Parse(serialized.substr(0, serialized.size() - 1)));
+  EXPECT_EQ(0u, parsed.num_samples());
+  serialized[serialized.size() / 2] ^= 0x55;
+  serialized.back() ^= 0x55;
+  parsed.Parse(serialized);
+}
+
+TEST(TimeSeriesAggregatorTest, Buckets) {
+  using Agg = TimeSeriesAggregator;
+  vector<Sample> samples = {{-5, 4}, {1, 1}, {3, 2}, {9, 6}, {10, 3}, {25, 8}};
+
+  auto aggregate = [&](Agg::Type type, int64_t bucket, int64_t align = 0) {
+    Agg agg(type, bucket, align);
+    vector<Sample> res;
+    for (const Sample& s : samples)
+      agg.Add(s, &res);
+    agg.Finish(&res);
+    return res;
+  };
+
+  EXPECT_EQ((vector<Sample>{{-10, 1}, {0, 3}, {10, 1}, {20, 1}}), aggregate(Agg::COUNT, 10));
+  EXPECT_EQ((vector<Sample>{{-10, 4}, {0, 9}, {10, 3}, {20, 8}}), aggregate(Agg::SUM, 10));
+  EXPECT_EQ((vector<Sample>{{-10, 4}, {0, 3}, {10, 3}, {20, 8}}), aggregate(Agg::AVG, 10));
+  EXPECT_EQ((vector<Sample>{{-10, 0}, {0, 5}, {10, 0}, {20, 0}}), aggregate(Agg::RANGE, 10));
+  EXPECT_EQ((vector<Sample>{{-10, 4}, {0, 1}, {10, 3}, {20, 8}}), aggregate(Agg::FIRST, 10));
+  EXPECT_EQ((vector<Sample>{{-5, 4}, {5, 6}, {25, 8}}), aggregate(Agg::MAX, 10, 5));
+  EXPECT_EQ((vector<Sample>{{-5, 4}, {1, 1}, {3, 2}, {9, 3}, {25, 8}}), aggregate(Agg::LAST, 2, 1));
+
+  // The variance of 1, 2 and 6.
+  vector<Sample> var = aggregate(Agg::VAR_S, 10);
+  EXPECT_DOUBLE_EQ(7, var[1].value);
+  EXPECT_DOUBLE_EQ(0, var[0].value);
+  EXPECT_DOUBLE_EQ(sqrt(14.0 / 3), aggregate(Agg::STD_P, 10)[1].value);
+
+  EXPECT_EQ(Agg::STD_P, Agg::ParseType("std.p"));
+  EXPECT_FALSE(Agg::ParseType("median"));
+}
+
+}  // namespace dfly
@@ -0,0 +1,48 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace dfly {
+
+// Admits up to rate operations per second on average, with bursts of up to a second worth of
+// them. Not thread-safe.
+class TokenBucket {
+ public:
+  TokenBucket() = default;
+
+  explicit TokenBucket(uint64_t rate) : rate_(rate), tokens_(rate) {
+  }
+
+  // 0 admits everything.
+  uint64_t rate() const {
+    return rate_;
+  }
+
+  // Takes a token at now_ns. Returns false if none is left.
+  bool Acquire(uint64_t now_ns) {
+    if (rate_ == 0)
+      return true;
+
+    if (now_ns > last_ns_) {
+      tokens_ = std::min<double>(rate_, tokens_ + double(now_ns - last_ns_) * rate_ / 1e9);
+      last_ns_ = now_ns;
+    }
+
+    if (tokens_ < 1)
+      return false;
+    tokens_ -= 1;
+    return true;
+  }
+
+ private:
+  uint64_t rate_ = 0;
+  double tokens_ = 0;
+  uint64_t last_ns_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,43 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/token_bucket.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+class TokenBucketTest : public ::testing::Test {
+ protected:
+  static constexpr uint64_t kSec = 1000000000;
+};
+
+TEST_F(TokenBucketTest, Burst) {
+  TokenBucket bucket(100);
+  uint64_t now = 10 * kSec;
+  for (unsigned i = 0; i < 100; ++i)
+    ASSERT_TRUE(bucket.Acquire(now)) << i;
+  EXPECT_FALSE(bucket.Acquire(now));
+
+  // The tokens come back at the rate.
+  now += kSec / 10;
+  for (unsigned i = 0; i < 10; ++i)
+    ASSERT_TRUE(bucket.Acquire(now)) << i;
+  EXPECT_FALSE(bucket.Acquire(now));
+
+  // No more than a second worth of them.
+  now += 100 * kSec;
+  for (unsigned i = 0; i < 100; ++i)
+    ASSERT_TRUE(bucket.Acquire(now)) << i;
+  EXPECT_FALSE(bucket.Acquire(now));
+}
+
+TEST_F(TokenBucketTest, Unlimited) {
+  TokenBucket bucket;
+  for (unsigned i = 0; i < 1000; ++i)
+    ASSERT_TRUE(bucket.Acquire(0));
+}
+
+}  // namespace dfly
@@ -0,0 +1,141 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <algorithm>
+
+namespace dfly {
+
+using namespace std;
+
+TopKeys::TopKeys(size_t capacity) : capacity_(max<size_t>(capacity, 1)) {
+  heap_.reserve(capacity_);
+}
+
+void TopKeys::Increment(string_view key, uint64_t weight) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    heap_[it->second].count += weight;
+    return Fix(it->second);
+  }
+
+  uint64_t min_count = threshold();
+  Insert(key, min_count + weight, min_count);
+}
+
+bool TopKeys::Offer(string_view key, uint64_t value, string* evicted) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    heap_[it->second].count = value;
+    Fix(it->second);
+    return false;
+  }
+
+  if (heap_.size() < capacity_ || value > threshold())
+    return Insert(key, value, 0, evicted);
+  return false;
+}
+
+void TopKeys::Erase(string_view key) {
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return;
+
+  size_t pos = it->second;
+  index_.erase(it);
+  if (pos + 1 < heap_.size()) {
+    heap_[pos] = heap_.back();
+    index_.find(*heap_[pos].key)->second = pos;
+    heap_.pop_back();
+    Fix(pos);
+  } else {
+    heap_.pop_back();
+  }
+}
+
+void TopKeys::Decay() {
+  for (Node& node : heap_) {
+    node.count /= 2;
+    node.error /= 2;
+  }
+
+  // Halving keeps the order of the counts, but it may turn some into ties, which are ordered by
+  // the keys.
+  for (size_t pos = heap_.size() / 2; pos-- > 0;)
+    SiftDown(pos);
+}
+
+vector<TopKeys::Entry> TopKeys::Top(size_t n) const {
+  vector<Entry> res;
+  res.reserve(heap_.size());
+  for (const Node& node : heap_)
+    res.push_back(Entry{*node.key, node.count, node.error});
+
+  n = min(n, res.size());
+  partial_sort(res.begin(), res.begin() + n, res.end(), [](const Entry& a, const Entry& b) {
+    return a.count != b.count ? a.count > b.count : a.key < b.key;
+  });
+  res.resize(n);
+  return res;
+}
+
+bool TopKeys::Insert(string_view key, uint64_t count, uint64_t error, string* evicted) {
+  size_t pos;
+  bool replaced = heap_.size() >= capacity_;
+  if (!replaced) {
+    pos = heap_.size();
+    heap_.emplace_back();
+  } else {
+    pos = 0;
+    if (evicted)
+      *evicted = *heap_[0].key;
+    index_.erase(*heap_[0].key);
+  }
+
+  auto [it, inserted] = index_.emplace(key, pos);
+  heap_[pos] = Node{&it->first, count, error};
+  Fix(pos);
+  return replaced;
+}
+
+bool TopKeys::Lower(const Node& a, const Node& b) {
+  return a.count != b.count ? a.count < b.count : *a.key > *b.key;
+}
+
+void TopKeys::Fix(size_t pos) {
+  // Up while lower than the parent.
+  while (pos > 0) {
+    size_t parent = (pos - 1) / 2;
+    if (!Lower(heap_[pos], heap_[parent]))
+      break;
+    Swap(pos, parent);
+    pos = parent;
+  }
+
+  SiftDown(pos);
+}
+
+void TopKeys::SiftDown(size_t pos) {
+  // Down while higher than the lowest child.
+  while (true) {
+    size_t child = pos * 2 + 1;
+    if (child >= heap_.size())
+      break;
+    if (child + 1 < heap_.size() && Lower(heap_[child + 1], heap_[child]))
+      ++child;
+    if (!Lower(heap_[child], heap_[pos]))
+      break;
+    Swap(pos, child);
+    pos = child;
+  }
+}
+
+void TopKeys::Swap(size_t a, size_t b) {
+  swap(heap_[a], heap_[b]);
+  index_.find(*heap_[a].key)->second = a;
+  index_.find(*heap_[b].key)->second = b;
+}
+
+}  // namespace dfly
@@ -0,0 +1,91 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/node_hash_map.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// The keys with the highest counts out of a stream, in memory bounded by capacity.
+// Increment implements the space-saving algorithm of "Efficient Computation of Frequent and
+// Top-k Elements in Data Streams" (Metwally, Agrawal, El Abbadi): once the set is full, a new
+// key replaces the one with the lowest count and inherits its count as the error of its
+// estimate. Every key with a count above the total / capacity is guaranteed to be in the set.
+// The ties of the counts are ordered by the keys, so that the key to be replaced next does not
+// depend on the order of the updates.
+// Offer keeps the highest values that were offered instead, i.e. the largest keys.
+class TopKeys {
+ public:
+  struct Entry {
+    std::string key;
+    uint64_t count;
+    uint64_t error;  // the count may be overestimated by up to this much.
+  };
+
+  explicit TopKeys(size_t capacity);
+
+  void Increment(std::string_view key, uint64_t weight = 1);
+
+  // Sets the count of the key to value if the key is in the set, or if value is higher than
+  // the lowest count of a full set, which it replaces. Returns true if a key was replaced, and
+  // writes it to evicted if not null.
+  bool Offer(std::string_view key, uint64_t value, std::string* evicted = nullptr);
+
+  void Erase(std::string_view key);
+
+  bool Contains(std::string_view key) const {
+    return index_.contains(key);
+  }
+
+  // Halves all the counts, so that the old accesses weigh less than the recent ones.
+  void Decay();
+
+  // Returns up to n entries with the highest counts, by descending count and then by key.
+  std::vector<Entry> Top(size_t n) const;
+
+  size_t size() const {
+    return heap_.size();
+  }
+
+  // The lowest count that a key must exceed to be added to the set, 0 while it is not full.
+  uint64_t threshold() const {
+    return heap_.size() < capacity_ ? 0 : heap_.front().count;
+  }
+
+  void Clear() {
+    heap_.clear();
+    index_.clear();
+  }
+
+ private:
+  struct Node {
+    const std::string* key;  // owned by index_.
+    uint64_t count;
+    uint64_t error;
+  };
+
+  // Inserts a key that is not in the set, replacing the lowest one if the set is full.
+  // Returns true if a key was replaced, and writes it to evicted if not null.
+  bool Insert(std::string_view key, uint64_t count, uint64_t error,
+              std::string* evicted = nullptr);
+
+  // The order of the heap: by count, and by descending key for the same count.
+  static bool Lower(const Node& a, const Node& b);
+
+  // Restores the heap after the count at pos changed.
+  void Fix(size_t pos);
+  void SiftDown(size_t pos);
+  void Swap(size_t a, size_t b);
+
+  size_t capacity_;
+  std::vector<Node> heap_;                          // a min-heap by count.
+  absl::node_hash_map<std::string, size_t> index_;  // key -> position in heap_.
+};
+
+}  // namespace dfly
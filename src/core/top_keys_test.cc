@@ -0,0 +1,98 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <absl/random/random.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+class TopKeysTest : public ::testing::Test {
+ protected:
+  static vector<string> Keys(const vector<TopKeys::Entry>& entries) {
+    vector<string> res;
+    for (const auto& e : entries)
+      res.push_back(e.key);
+    return res;
+  }
+};
+
+TEST_F(TopKeysTest, Increment) {
+  TopKeys top(3);
+  top.Increment("a", 5);
+  top.Increment("b", 3);
+  top.Increment("c");
+  EXPECT_EQ(3u, top.size());
+  EXPECT_EQ(Keys(top.Top(10)), (vector<string>{"a", "b", "c"}));
+
+  // d replaces c, the lowest one, and inherits its count as the error.
+  top.Increment("d");
+  auto entries = top.Top(10);
+  ASSERT_EQ(3u, entries.size());
+  EXPECT_EQ("d", entries[2].key);
+  EXPECT_EQ(2u, entries[2].count);
+  EXPECT_EQ(1u, entries[2].error);
+
+  top.Increment("d", 10);
+  EXPECT_EQ(Keys(top.Top(2)), (vector<string>{"d", "a"}));
+
+  top.Erase("a");
+  top.Erase("nosuchkey");
+  EXPECT_EQ(Keys(top.Top(10)), (vector<string>{"d", "b"}));
+
+  top.Clear();
+  EXPECT_EQ(0u, top.size());
+}
+
+TEST_F(TopKeysTest, Offer) {
+  TopKeys top(2);
+  top.Offer("a", 100);
+  top.Offer("b", 10);
+  top.Offer("c", 5);  // lower than all of them.
+  EXPECT_EQ(Keys(top.Top(10)), (vector<string>{"a", "b"}));
+
+  string evicted;
+  EXPECT_TRUE(top.Offer("c", 50, &evicted));
+  EXPECT_EQ("b", evicted);
+  EXPECT_EQ(Keys(top.Top(10)), (vector<string>{"a", "c"}));
+  EXPECT_TRUE(top.Contains("c"));
+  EXPECT_FALSE(top.Contains("b"));
+
+  EXPECT_FALSE(top.Offer("a", 1));  // shrunk.
+  EXPECT_EQ(Keys(top.Top(10)), (vector<string>{"c", "a"}));
+  EXPECT_EQ(1u, top.threshold());
+
+  top.Decay();
+  auto entries = top.Top(10);
+  EXPECT_EQ(25u, entries[0].count);
+  EXPECT_EQ(0u, entries[1].count);
+}
+
+TEST_F(TopKeysTest, HeavyHitters) {
+  // A few keys get half of the accesses, the rest are spread over many keys.
+  TopKeys top(64);
+  absl::InsecureBitGen gen;
+  for (unsigned i = 0; i < 100000; ++i) {
+    if (i % 2 == 0) {
+      top.Increment(absl::StrCat("hot", i / 2 % 8));
+    } else {
+      top.Increment(absl::StrCat("cold", absl::Uniform(gen, 0, 10000)));
+    }
+  }
+
+  auto entries = top.Top(8);
+  for (const auto& e : entries) {
+    EXPECT_EQ(0u, e.key.find("hot")) << e.key;
+    EXPECT_GE(e.count, 6250u);
+    EXPECT_LE(e.count - e.error, 6250u);
+  }
+}
+
+}  // namespace dfly
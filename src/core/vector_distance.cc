@@ -0,0 +1,189 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/vector_distance.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace dfly {
+
+namespace {
+
+// The scalar kernels keep 4 independent sums, so that the compiler pipelines them, and finish
+// the vector kernels on their tails.
+float L2Scalar(const float* a, const float* b, size_t dim) {
+  float sum[4] = {0, 0, 0, 0};
+  size_t i = 0;
+  for (; i + 4 <= dim; i += 4) {
+    for (unsigned j = 0; j < 4; ++j) {
+      float diff = a[i + j] - b[i + j];
+      sum[j] += diff * diff;
+    }
+  }
+  for (; i < dim; ++i) {
+    float diff = a[i] - b[i];
+    sum[0] += diff * diff;
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+float InnerProductScalar(const float* a, const float* b, size_t dim) {
+  float sum[4] = {0, 0, 0, 0};
+  size_t i = 0;
+  for (; i + 4 <= dim; i += 4) {
+    for (unsigned j = 0; j < 4; ++j)
+      sum[j] += a[i + j] * b[i + j];
+  }
+  for (; i < dim; ++i)
+    sum[0] += a[i] * b[i];
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2,fma"))) float SumLanes(__m256 acc) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+// Two accumulators hide the latency of the fused multiply-adds.
+__attribute__((target("avx2,fma"))) float L2Avx2(const float* a, const float* b, size_t dim) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+  }
+  if (i + 8 <= dim) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    i += 8;
+  }
+  return SumLanes(_mm256_add_ps(acc0, acc1)) + L2Scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("avx2,fma"))) float InnerProductAvx2(const float* a, const float* b,
+                                                           size_t dim) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+  }
+  if (i + 8 <= dim) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    i += 8;
+  }
+  return SumLanes(_mm256_add_ps(acc0, acc1)) + InnerProductScalar(a + i, b + i, dim - i);
+}
+
+// Like the one of bitops.cc, avoids _mm512_reduce_add_ps, which trips -Wuninitialized in the
+// gcc headers.
+__attribute__((target("avx512f"))) float SumLanes(__m512 acc) {
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, acc);
+  float res = 0;
+  for (float lane : lanes)
+    res += lane;
+  return res;
+}
+
+// The tails are masked loads, which read no bytes past the vectors.
+__attribute__((target("avx512f"))) float L2Avx512(const float* a, const float* b, size_t dim) {
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+    acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+  }
+  for (; i < dim; i += 16) {
+    __mmask16 mask = dim - i >= 16 ? 0xFFFF : (1u << (dim - i)) - 1;
+    __m512 d0 =
+        _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+    acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+  }
+  return SumLanes(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) float InnerProductAvx512(const float* a, const float* b,
+                                                             size_t dim) {
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+  }
+  for (; i < dim; i += 16) {
+    __mmask16 mask = dim - i >= 16 ? 0xFFFF : (1u << (dim - i)) - 1;
+    acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i),
+                           acc0);
+  }
+  return SumLanes(_mm512_add_ps(acc0, acc1));
+}
+
+#endif
+
+struct Kernels {
+  float (*l2)(const float*, const float*, size_t);
+  float (*inner_product)(const float*, const float*, size_t);
+};
+
+SimdLevel SupportedSimdLevel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx512f"))
+    return SimdLevel::AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return SimdLevel::AVX2;
+#endif
+  return SimdLevel::SCALAR;
+}
+
+Kernels MakeKernels(SimdLevel level) {
+#if defined(__x86_64__)
+  if (level == SimdLevel::AVX2)
+    return Kernels{L2Avx2, InnerProductAvx2};
+  if (level == SimdLevel::AVX512)
+    return Kernels{L2Avx512, InnerProductAvx512};
+#endif
+  return Kernels{L2Scalar, InnerProductScalar};
+}
+
+Kernels kernels = MakeKernels(SupportedSimdLevel());
+
+}  // namespace
+
+float L2DistanceSquared(const float* a, const float* b, size_t dim) {
+  return kernels.l2(a, b, dim);
+}
+
+float InnerProduct(const float* a, const float* b, size_t dim) {
+  return kernels.inner_product(a, b, dim);
+}
+
+void NormalizeVector(float* v, size_t dim) {
+  float norm = std::sqrt(kernels.inner_product(v, v, dim));
+  if (norm == 0)
+    return;
+  for (size_t i = 0; i < dim; ++i)
+    v[i] /= norm;
+}
+
+SimdLevel SetVectorSimdLevel(SimdLevel level) {
+  level = std::min(level, SupportedSimdLevel());
+  kernels = MakeKernels(level);
+  return level;
+}
+
+}  // namespace dfly
@@ -0,0 +1,30 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+
+#include "core/bitops.h"
+
+namespace dfly {
+
+// Distance kernels over float vectors for the vector similarity search. Like the kernels of
+// bitops.h, they pick at runtime the widest vector instructions that the CPU supports.
+
+// Returns the squared euclidean distance of a and b.
+float L2DistanceSquared(const float* a, const float* b, size_t dim);
+
+// Returns the dot product of a and b.
+float InnerProduct(const float* a, const float* b, size_t dim);
+
+// Scales v to the unit length, unless it is a null vector. The cosine distance of unit vectors
+// is 1 - InnerProduct.
+void NormalizeVector(float* v, size_t dim);
+
+// Limits the kernels to the given instruction set, for tests and benchmarks. Returns the level
+// that is used, which is lower than the requested one if the CPU does not support it.
+SimdLevel SetVectorSimdLevel(SimdLevel level);
+
+}  // namespace dfly
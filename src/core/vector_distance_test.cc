@@ -0,0 +1,68 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/vector_distance.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "base/gtest.h"
+
+using namespace std;
+
+namespace dfly {
+
+class VectorDistanceTest : public ::testing::TestWithParam<SimdLevel> {
+ protected:
+  void SetUp() override {
+    if (SetVectorSimdLevel(GetParam()) != GetParam())
+      GTEST_SKIP() << "the CPU does not support the instruction set";
+  }
+
+  void TearDown() override {
+    SetVectorSimdLevel(SimdLevel::AVX512);
+  }
+
+  vector<float> RandomVector(size_t dim) {
+    uniform_real_distribution<float> dist(-1, 1);
+    vector<float> res(dim);
+    for (float& val : res)
+      val = dist(gen_);
+    return res;
+  }
+
+  mt19937 gen_{42};
+};
+
+TEST_P(VectorDistanceTest, Distances) {
+  // All the lengths of the tails of the vector loops.
+  for (size_t dim = 1; dim <= 70; ++dim) {
+    vector<float> a = RandomVector(dim), b = RandomVector(dim);
+    double l2 = 0, ip = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      l2 += double(a[i] - b[i]) * (a[i] - b[i]);
+      ip += double(a[i]) * b[i];
+    }
+
+    EXPECT_NEAR(l2, L2DistanceSquared(a.data(), b.data(), dim), 1e-4 * dim) << dim;
+    EXPECT_NEAR(ip, InnerProduct(a.data(), b.data(), dim), 1e-4 * dim) << dim;
+    EXPECT_EQ(0, L2DistanceSquared(a.data(), a.data(), dim));
+  }
+}
+
+TEST_P(VectorDistanceTest, Normalize) {
+  vector<float> v = RandomVector(100);
+  NormalizeVector(v.data(), v.size());
+  EXPECT_NEAR(1, InnerProduct(v.data(), v.data(), v.size()), 1e-5);
+
+  vector<float> zero(10, 0);
+  NormalizeVector(zero.data(), zero.size());
+  EXPECT_EQ(0, InnerProduct(zero.data(), zero.data(), zero.size()));
+}
+
+INSTANTIATE_TEST_SUITE_P(Kernels, VectorDistanceTest,
+                         ::testing::Values(SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512));
+
+}  // namespace dfly
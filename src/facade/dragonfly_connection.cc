@@ -5,6 +5,8 @@
 #include "facade/dragonfly_connection.h"
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/match.h>
 #include <mimalloc.h>
 
@@ -13,6 +15,7 @@
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/conn_context.h"
+#include "facade/ktls.h"
 #include "facade/memcache_parser.h"
 #include "facade/redis_parser.h"
 #include "facade/service_interface.h"
@@ -25,6 +28,28 @@
 ABSL_FLAG(bool, tcp_nodelay, false,
           "Configures dragonfly connections with socket option TCP_NODELAY");
 ABSL_FLAG(bool, http_admin_console, true, "If true allows accessing http console on main TCP port");
+ABSL_FLAG(uint32_t, dispatch_turn_cmds, 0,
+          "The dispatch fiber of a pipelining connection yields to the other connections of its "
+          "thread after running this many queued commands. Scaled by CLIENT WEIGHT. 0 - no limit");
+ABSL_FLAG(uint32_t, dispatch_turn_usec, 0,
+          "The dispatch fiber of a pipelining connection yields to the other connections of its "
+          "thread after running the queued commands for this long. Scaled by CLIENT WEIGHT. "
+          "0 - no limit");
+ABSL_FLAG(uint32_t, pipeline_queue_limit, 0,
+          "A connection stops reading its socket while this many of its pipelined commands wait "
+          "for the dispatch. 0 - no limit");
+ABSL_FLAG(uint64_t, pipeline_buffer_limit, 0,
+          "A connection stops reading its socket while its pipelined commands that wait for the "
+          "dispatch take this many bytes. 0 - no limit");
+ABSL_FLAG(uint64_t, pipeline_thread_buffer_limit, 0,
+          "The pipelining connections of a thread stop reading their sockets while their queued "
+          "commands take this many bytes in total. 0 - no limit");
+ABSL_FLAG(uint32_t, monitor_queue_limit, 10000,
+          "A MONITOR connection drops the new monitor messages while this many of them wait for "
+          "the dispatch. 0 - no limit");
+ABSL_FLAG(bool, conn_pool_read_buffers, false,
+          "If true, idle connections return their read buffer to a per-thread pool "
+          "and wait for input without holding one");
 
 using namespace util;
 using namespace std;
@@ -72,17 +97,56 @@ constexpr size_t kMaxReadSize = 32_KB;
 
 struct PubMsgRecord {
   Connection::PubMessage pub_msg;
+  size_t bytes = 0;  // counted against the pubsub limits, 0 for the invalidations.
 
   PubMsgRecord(const Connection::PubMessage& pmsg) : pub_msg(pmsg) {
   }
 };
 
+// client-output-buffer-limit pubsub, shared by all the connections.
+atomic_size_t pubsub_hard_limit{0};
+atomic_size_t pubsub_soft_limit{0};
+atomic_uint32_t pubsub_soft_seconds{0};
+atomic<Connection::OverflowPolicy> pubsub_overflow_policy{Connection::OverflowPolicy::DISCONNECT};
+
+// Read buffers released by the idle connections of the thread.
+constexpr size_t kMaxPooledReadBufs = 64;
+thread_local vector<unique_ptr<base::IoBuf>> read_buf_pool;
+
+// Notified when the queued pipeline messages of the thread are dispatched, while some input
+// fibers wait for the queues to drain.
+thread_local fibers_ext::EventCount pipeline_drained_ec;
+
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
-constexpr size_t kReqStorageSize = 88;
+constexpr size_t kReqStorageSize = 80;
 #else
-constexpr size_t kReqStorageSize = 120;
+constexpr size_t kReqStorageSize = 112;
 #endif
 
+// The memory blocks of the dispatched requests, which are allocated for every pipelined
+// command, are recycled by the thread.
+constexpr size_t kMaxPooledRequests = 256;
+
+struct RequestPool {
+  vector<void*> blocks;
+
+  ~RequestPool() {
+    for (void* ptr : blocks)
+      mi_free(ptr);
+  }
+};
+
+thread_local RequestPool request_pool;
+
+void* AllocRequest(mi_heap_t* heap, size_t size) {
+  if (request_pool.blocks.empty())
+    return mi_heap_malloc_small(heap, size);
+
+  void* ptr = request_pool.blocks.back();
+  request_pool.blocks.pop_back();
+  return ptr;
+}
+
 }  // namespace
 
 struct Connection::Shutdown {
@@ -117,14 +181,27 @@ struct Connection::Request {
     // The capacity is chosen so that we allocate a fully utilized (256 bytes) block.
     absl::FixedArray<char, kReqStorageSize, mi_stl_allocator<char>> storage;
 
-    PipelineMsg(size_t nargs, size_t capacity) : args(nargs), storage(capacity) {
+    // A large bulk argument taken over from the parser instead of being copied into storage.
+    RedisParser::BlobPtr blob;
+
+    PipelineMsg(size_t nargs, size_t capacity, RedisParser::BlobPtr b)
+        : args(nargs), storage(capacity), blob(std::move(b)) {
+    }
+
+    // Counted against --pipeline_buffer_limit.
+    size_t Bytes() const {
+      size_t res = sizeof(Request);
+      for (const auto& arg : args)
+        res += arg.size();
+      return res;
     }
   };
 
  private:
   using MessagePayload = std::variant<PipelineMsg, PubMsgRecord, MonitorMessage>;
 
-  Request(size_t nargs, size_t capacity) : payload(PipelineMsg{nargs, capacity}) {
+  Request(size_t nargs, size_t capacity, RedisParser::BlobPtr blob)
+      : payload(PipelineMsg{nargs, capacity, std::move(blob)}) {
   }
 
   Request(PubMsgRecord msg) : payload(std::move(msg)) {
@@ -137,7 +214,8 @@ struct Connection::Request {
 
  public:
   // Overload to create the a new pipeline message
-  static RequestPtr New(mi_heap_t* heap, RespVec args, size_t capacity);
+  static RequestPtr New(mi_heap_t* heap, const RespVec& args, size_t capacity,
+                        RedisParser::BlobPtr blob);
 
   // Overload to create a new pubsub message
   static RequestPtr New(const PubMessage& pub_msg);
@@ -149,23 +227,27 @@ struct Connection::Request {
 };
 
 Connection::RequestPtr Connection::Request::New(std::string msg) {
-  void* ptr = mi_malloc(sizeof(Request));
+  void* ptr = AllocRequest(mi_heap_get_default(), sizeof(Request));
   Request* req = new (ptr) Request(std::move(msg));
   return Connection::RequestPtr{req, Connection::RequestDeleter{}};
 }
 
-Connection::RequestPtr Connection::Request::New(mi_heap_t* heap, RespVec args, size_t capacity) {
-  constexpr auto kReqSz = sizeof(Request);
-  void* ptr = mi_heap_malloc_small(heap, kReqSz);
+Connection::RequestPtr Connection::Request::New(mi_heap_t* heap, const RespVec& args,
+                                                size_t capacity, RedisParser::BlobPtr blob) {
+  void* ptr = AllocRequest(heap, sizeof(Request));
 
   // We must construct in place here, since there is a slice that uses memory locations
-  Request* req = new (ptr) Request(args.size(), capacity);
+  Request* req = new (ptr) Request(args.size(), capacity, std::move(blob));
   // At this point we know that we have PipelineMsg in Request so next op is safe.
   Request::PipelineMsg& pipeline_msg = std::get<Request::PipelineMsg>(req->payload);
   auto* next = pipeline_msg.storage.data();
   for (size_t i = 0; i < args.size(); ++i) {
     auto buf = args[i].GetBuf();
     size_t s = buf.size();
+    if (pipeline_msg.blob && buf.data() == pipeline_msg.blob.get()) {
+      pipeline_msg.args[i] = MutableSlice(reinterpret_cast<char*>(buf.data()), s);
+      continue;
+    }
     memcpy(next, buf.data(), s);
     pipeline_msg.args[i] = MutableSlice(next, s);
     next += s;
@@ -181,19 +263,22 @@ Connection::RequestPtr Connection::Request::New(const PubMessage& pub_msg) {
   // ensure that the message is not deleted until we are finish sending it at the other
   // side of the queue
   PubMsgRecord new_msg{pub_msg};
-  void* ptr = mi_malloc(sizeof(Request));
+  void* ptr = AllocRequest(mi_heap_get_default(), sizeof(Request));
   Request* req = new (ptr) Request(std::move(new_msg));
   return Connection::RequestPtr{req, Connection::RequestDeleter{}};
 }
 
 void Connection::RequestDeleter::operator()(Request* req) const {
   req->~Request();
-  mi_free(req);
+  if (request_pool.blocks.size() < kMaxPooledRequests)
+    request_pool.blocks.push_back(req);
+  else
+    mi_free(req);
 }
 
 Connection::Connection(Protocol protocol, util::HttpListenerBase* http_listener, SSL_CTX* ctx,
                        ServiceInterface* service)
-    : io_buf_(kMinReadSize), http_listener_(http_listener), ctx_(ctx), service_(service) {
+    : io_buf_(new base::IoBuf(kMinReadSize)), http_listener_(http_listener), ctx_(ctx), service_(service) {
   static atomic_uint32_t next_id{1};
 
   protocol_ = protocol;
@@ -240,6 +325,31 @@ void Connection::OnPreMigrateThread() {
   }
 }
 
+bool Connection::Migrate(util::ProactorBase* dest) {
+  // The dispatch fiber stays in this thread, so it must not have anything to dispatch.
+  if (ctx_ || !owner() || cc_->async_dispatch || cc_->conn_closing || !dispatch_q_.empty())
+    return false;
+
+  migrating_ = true;
+  evc_.notify();
+  dispatch_fb_.join();
+  migrating_ = false;
+
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  --stats->num_conns;
+  stats->read_buf_capacity -= io_buf_->Capacity();
+
+  owner()->Migrate(this, dest);
+
+  stats = service_->GetThreadLocalConnectionStats();
+  ++stats->num_conns;
+  stats->read_buf_capacity += io_buf_->Capacity();
+
+  FiberSocketBase* peer = socket_.get();
+  dispatch_fb_ = fibers::fiber(fibers::launch::dispatch, [this, peer] { DispatchFiber(peer); });
+  return true;
+}
+
 void Connection::OnPostMigrateThread() {
   // Once we migrated, we should rearm OnBreakCb callback.
   if (breaker_cb_) {
@@ -280,18 +390,26 @@ void Connection::HandleRequests() {
 
 #ifdef DFLY_USE_SSL
   unique_ptr<tls::TlsSocket> tls_sock;
+  bool ktls = false;
   if (ctx_) {
     tls_sock.reset(new tls::TlsSocket(socket_.get()));
     tls_sock->InitSSL(ctx_);
 
+    StartTlsHandshake();
     FiberSocketBase::AcceptResult aresult = tls_sock->Accept();
     if (!aresult) {
       LOG(WARNING) << "Error handshaking " << aresult.error().message();
       return;
     }
     VLOG(1) << "TLS handshake succeeded";
+
+    // With kernel TLS we do plain io on the socket, tls_sock only keeps the session alive.
+    if (OffloadTlsToKernel(lsb->native_handle())) {
+      VLOG(1) << "TLS offloaded to the kernel";
+      ktls = true;
+    }
   }
-  FiberSocketBase* peer = tls_sock ? (FiberSocketBase*)tls_sock.get() : socket_.get();
+  FiberSocketBase* peer = (tls_sock && !ktls) ? (FiberSocketBase*)tls_sock.get() : socket_.get();
 #else
   FiberSocketBase* peer = socket_.get();
 #endif
@@ -305,8 +423,8 @@ void Connection::HandleRequests() {
       VLOG(1) << "HTTP1.1 identified";
       HttpConnection http_conn{http_listener_};
       http_conn.SetSocket(peer);
-      auto ec = http_conn.ParseFromBuffer(io_buf_.InputBuffer());
-      io_buf_.ConsumeInput(io_buf_.InputLen());
+      auto ec = http_conn.ParseFromBuffer(io_buf_->InputBuffer());
+      io_buf_->ConsumeInput(io_buf_->InputLen());
       if (!ec) {
         http_conn.HandleRequests();
       }
@@ -344,10 +462,117 @@ void Connection::SendMsgVecAsync(const PubMessage& pub_msg) {
     return;
   }
   RequestPtr req = Request::New(pub_msg);  // new (ptr) Request(0, 0);
+
+  // The invalidations of CLIENT TRACKING are never dropped, so they are not counted either.
+  if (!pub_msg.invalidate) {
+    size_t bytes = sizeof(Request) + pub_msg.channel.size() + pub_msg.pattern.size() +
+                   (pub_msg.message ? pub_msg.message->size() : 0);
+    get<PubMsgRecord>(req->payload).bytes = bytes;
+    pubsub_bytes_ += bytes;
+    service_->GetThreadLocalConnectionStats()->pubsub_queue_bytes += bytes;
+  }
+
   dispatch_q_.push_back(std::move(req));
   if (dispatch_q_.size() == 1) {
     evc_.notify();
   }
+
+  if (!pub_msg.invalidate)
+    CheckPubSubLimits();
+}
+
+void Connection::SetPubSubLimits(const PubSubLimits& limits, OverflowPolicy policy) {
+  pubsub_hard_limit.store(limits.hard_limit, memory_order_relaxed);
+  pubsub_soft_limit.store(limits.soft_limit, memory_order_relaxed);
+  pubsub_soft_seconds.store(limits.soft_seconds, memory_order_relaxed);
+  pubsub_overflow_policy.store(policy, memory_order_relaxed);
+}
+
+auto Connection::GetPubSubLimits() -> PubSubLimits {
+  return PubSubLimits{pubsub_hard_limit.load(memory_order_relaxed),
+                      pubsub_soft_limit.load(memory_order_relaxed),
+                      pubsub_soft_seconds.load(memory_order_relaxed)};
+}
+
+auto Connection::GetOverflowPolicy() -> OverflowPolicy {
+  return pubsub_overflow_policy.load(memory_order_relaxed);
+}
+
+void Connection::CheckPubSubLimits() {
+  PubSubLimits limits = GetPubSubLimits();
+
+  // Like in Redis, the soft limit is hit once the queue stays above it for soft_seconds.
+  size_t target = SIZE_MAX;
+  if (limits.soft_limit && pubsub_bytes_ > limits.soft_limit) {
+    time_t now = time(nullptr);
+    if (pubsub_soft_since_ == 0)
+      pubsub_soft_since_ = now;
+    else if (now - pubsub_soft_since_ > time_t(limits.soft_seconds))
+      target = limits.soft_limit;
+  } else {
+    pubsub_soft_since_ = 0;
+  }
+  if (limits.hard_limit && pubsub_bytes_ > limits.hard_limit)
+    target = min(target, limits.hard_limit);
+
+  if (target == SIZE_MAX)
+    return;
+
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  switch (GetOverflowPolicy()) {
+    case OverflowPolicy::DISCONNECT:
+      LOG(INFO) << "Disconnecting " << GetClientInfo() << " for overflowing its pubsub limits "
+                << "with " << pubsub_bytes_ << " bytes";
+      ++stats->pubsub_overflow_disconnects;
+      DropPubMessages(0, false);
+      cc_->conn_closing = true;
+      evc_.notify();
+      ShutdownSelf();
+      break;
+    case OverflowPolicy::DROP_OLDEST:
+      DropPubMessages(target, false);
+      break;
+    case OverflowPolicy::COALESCE:
+      DropPubMessages(target, true);
+      break;
+  }
+  pubsub_soft_since_ = 0;
+}
+
+void Connection::DropPubMessages(size_t target, bool coalesce) {
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  auto drop = [&](RequestPtr& req) {
+    auto* rec = get_if<PubMsgRecord>(&req->payload);
+    if (!rec || rec->bytes == 0)
+      return false;
+    pubsub_bytes_ -= rec->bytes;
+    stats->pubsub_queue_bytes -= rec->bytes;
+    return true;
+  };
+
+  // Keeps the latest message of each channel and pattern, scanning from the newest.
+  if (coalesce) {
+    absl::flat_hash_set<pair<string_view, string_view>> latest;
+    auto rit = remove_if(dispatch_q_.rbegin(), dispatch_q_.rend(), [&](RequestPtr& req) {
+      auto* rec = get_if<PubMsgRecord>(&req->payload);
+      if (!rec || rec->bytes == 0 ||
+          latest.emplace(rec->pub_msg.channel, rec->pub_msg.pattern).second) {
+        return false;
+      }
+      ++stats->pubsub_coalesced_cnt;
+      return drop(req);
+    });
+    dispatch_q_.erase(dispatch_q_.begin(), rit.base());
+  }
+
+  // The oldest messages go first.
+  auto it = remove_if(dispatch_q_.begin(), dispatch_q_.end(), [&](RequestPtr& req) {
+    if (pubsub_bytes_ <= target || !drop(req))
+      return false;
+    ++stats->pubsub_dropped_cnt;
+    return true;
+  });
+  dispatch_q_.erase(it, dispatch_q_.end());
 }
 
 string Connection::GetClientInfo() const {
@@ -362,6 +587,9 @@ string Connection::GetClientInfo() const {
   absl::StrAppend(&res, " laddr=", le.address().to_string(), ":", le.port());
   absl::StrAppend(&res, " fd=", lsb->native_handle(), " name=", name_);
   absl::StrAppend(&res, " age=", now - creation_time_, " idle=", now - last_interaction_);
+  absl::StrAppend(&res, " qlen=", dispatch_q_.size(), " qbytes=", pipeline_bytes_);
+  absl::StrAppend(&res, " weight=", dispatch_weight_);
+  absl::StrAppend(&res, " dispatch_usec=", dispatch_ns_ / 1000, " yields=", dispatch_yields_);
   absl::StrAppend(&res, " phase=", phase_, " ");
   if (cc_) {
     absl::StrAppend(&res, service_->GetContextInfo(cc_.get()));
@@ -377,39 +605,39 @@ uint32 Connection::GetClientId() const {
 io::Result<bool> Connection::CheckForHttpProto(FiberSocketBase* peer) {
   size_t last_len = 0;
   do {
-    auto buf = io_buf_.AppendBuffer();
+    auto buf = io_buf_->AppendBuffer();
     ::io::Result<size_t> recv_sz = peer->Recv(buf);
     if (!recv_sz) {
       return make_unexpected(recv_sz.error());
     }
-    io_buf_.CommitWrite(*recv_sz);
-    string_view ib = ToSV(io_buf_.InputBuffer().subspan(last_len));
+    io_buf_->CommitWrite(*recv_sz);
+    string_view ib = ToSV(io_buf_->InputBuffer().subspan(last_len));
     size_t pos = ib.find('\n');
     if (pos != string_view::npos) {
-      ib = ToSV(io_buf_.InputBuffer().first(last_len + pos));
+      ib = ToSV(io_buf_->InputBuffer().first(last_len + pos));
       if (ib.size() < 10 || ib.back() != '\r')
         return false;
 
       ib.remove_suffix(1);
       return MatchHttp11Line(ib);
     }
-    last_len = io_buf_.InputLen();
+    last_len = io_buf_->InputLen();
   } while (last_len < 1024);
 
   return false;
 }
 
 void Connection::ConnectionFlow(FiberSocketBase* peer) {
-  auto dispatch_fb = fibers::fiber(fibers::launch::dispatch, [&] { DispatchFiber(peer); });
+  dispatch_fb_ = fibers::fiber(fibers::launch::dispatch, [this, peer] { DispatchFiber(peer); });
   ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
   stats->num_conns++;
-  stats->read_buf_capacity += io_buf_.Capacity();
+  stats->read_buf_capacity += io_buf_->Capacity();
 
   ParserStatus parse_status = OK;
 
   // At the start we read from the socket to determine the HTTP/Memstore protocol.
   // Therefore we may already have some data in the buffer.
-  if (io_buf_.InputLen() > 0) {
+  if (io_buf_->InputLen() > 0) {
     SetPhase("process");
     if (redis_parser_) {
       parse_status = ParseRedis();
@@ -436,11 +664,14 @@ void Connection::ConnectionFlow(FiberSocketBase* peer) {
   cc_->conn_closing = true;  // Signal dispatch to close.
   evc_.notify();
   VLOG(1) << "Before dispatch_fb.join()";
-  dispatch_fb.join();
+  dispatch_fb_.join();
   VLOG(1) << "After dispatch_fb.join()";
   service_->OnClose(cc_.get());
 
-  stats->read_buf_capacity -= io_buf_.Capacity();
+  // The connection may have migrated to another thread.
+  stats = service_->GetThreadLocalConnectionStats();
+
+  stats->read_buf_capacity -= io_buf_->Capacity();
 
   // Update num_replicas if this was a replica connection.
   if (cc_->replica_conn) {
@@ -481,8 +712,9 @@ auto Connection::ParseRedis() -> ParserStatus {
   SinkReplyBuilder* builder = cc_->reply_builder();
   mi_heap_t* tlh = mi_heap_get_backing();
 
+  parsing_input_ = true;
   do {
-    result = redis_parser_->Parse(io_buf_.InputBuffer(), &consumed, &parse_args_);
+    result = redis_parser_->Parse(io_buf_->InputBuffer(), &consumed, &parse_args_);
 
     if (result == RedisParser::OK && !parse_args_.empty()) {
       RespExpr& first = parse_args_.front();
@@ -495,14 +727,21 @@ auto Connection::ParseRedis() -> ParserStatus {
       // dispatch fiber pulls the last record but is still processing the command and then this
       // fiber enters the condition below and executes out of order.
       bool is_sync_dispatch = !cc_->async_dispatch && !cc_->force_dispatch;
-      if (dispatch_q_.empty() && is_sync_dispatch && consumed >= io_buf_.InputLen()) {
+      if (dispatch_q_.empty() && is_sync_dispatch && consumed >= io_buf_->InputLen()) {
         RespToArgList(parse_args_, &cmd_vec_);
         CmdArgList cmd_list{cmd_vec_.data(), cmd_vec_.size()};
         service_->DispatchCommand(cmd_list, cc_.get());
         last_interaction_ = time(nullptr);
       } else {
         // Dispatch via queue to speedup input reading.
-        RequestPtr req = FromArgs(std::move(parse_args_), tlh);
+        // parse_args_ keeps its capacity for the next command.
+        RequestPtr req = FromArgs(parse_args_, tlh);
+        size_t bytes = get<Request::PipelineMsg>(req->payload).Bytes();
+        ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+        ++pipeline_cmds_;
+        pipeline_bytes_ += bytes;
+        ++stats->pipeline_queue_cmds;
+        stats->pipeline_queue_bytes += bytes;
 
         dispatch_q_.push_back(std::move(req));
         if (dispatch_q_.size() == 1) {
@@ -512,8 +751,16 @@ auto Connection::ParseRedis() -> ParserStatus {
         }
       }
     }
-    io_buf_.ConsumeInput(consumed);
+    io_buf_->ConsumeInput(consumed);
   } while (RedisParser::OK == result && !builder->GetError());
+  parsing_input_ = false;
+
+  // The read buffer is drained. Unless the dispatch fiber is still busy and will flush by itself,
+  // send the replies batched so far.
+  if (dispatch_q_.empty() && !cc_->async_dispatch) {
+    builder->SetBatchMode(false);
+    builder->FlushBatch();
+  }
 
   parser_error_ = result;
   if (result == RedisParser::OK)
@@ -533,18 +780,20 @@ auto Connection::ParseMemcache() -> ParserStatus {
   MCReplyBuilder* builder = static_cast<MCReplyBuilder*>(cc_->reply_builder());
 
   do {
-    string_view str = ToSV(io_buf_.InputBuffer());
+    string_view str = ToSV(io_buf_->InputBuffer());
     result = memcache_parser_->Parse(str, &consumed, &cmd);
 
     if (result != MemcacheParser::OK) {
-      io_buf_.ConsumeInput(consumed);
+      io_buf_->ConsumeInput(consumed);
       break;
     }
 
     size_t total_len = consumed;
-    if (MemcacheParser::IsStoreCmd(cmd.type)) {
+    if (cmd.binary) {
+      value = cmd.bin.value;  // Binary requests are parsed with their values.
+    } else if (MemcacheParser::IsStoreCmd(cmd.type)) {
       total_len += cmd.bytes_len + 2;
-      if (io_buf_.InputLen() >= total_len) {
+      if (io_buf_->InputLen() >= total_len) {
         value = str.substr(consumed, cmd.bytes_len);
         // TODO: dispatch.
       } else {
@@ -560,7 +809,7 @@ auto Connection::ParseMemcache() -> ParserStatus {
     if (dispatch_q_.empty() && is_sync_dispatch) {
       service_->DispatchMC(cmd, value, cc_.get());
     }
-    io_buf_.ConsumeInput(total_len);
+    io_buf_->ConsumeInput(total_len);
   } while (!builder->GetError());
 
   parser_error_ = result;
@@ -569,6 +818,9 @@ auto Connection::ParseMemcache() -> ParserStatus {
     return NEED_MORE;
   }
 
+  if (result != MemcacheParser::OK && cmd.binary)
+    builder->SetBinaryRequest(&cmd);
+
   if (result == MemcacheParser::PARSE_ERROR) {
     builder->SendError("");  // ERROR.
   } else if (result == MemcacheParser::BAD_DELTA) {
@@ -576,10 +828,36 @@ auto Connection::ParseMemcache() -> ParserStatus {
   } else if (result != MemcacheParser::OK) {
     builder->SendClientError("bad command line format");
   }
+  builder->SetBinaryRequest(nullptr);
 
   return OK;
 }
 
+void Connection::WaitReadable(ConnectionStats* stats) {
+  DCHECK_EQ(0u, io_buf_->InputLen());
+
+  stats->read_buf_capacity -= io_buf_->Capacity();
+  if (read_buf_pool.size() < kMaxPooledReadBufs) {
+    read_buf_pool.push_back(std::move(io_buf_));
+  } else {
+    io_buf_.reset();
+  }
+
+  // Errors and hangups also make the socket readable, so the next Recv reports them.
+  util::fibers_ext::Done done;
+  auto* ls = static_cast<LinuxSocketBase*>(socket_.get());
+  ls->PollEvent(POLLIN | POLLERR | POLLHUP, [done](int32_t mask) mutable { done.Notify(); });
+  done.Wait();
+
+  if (read_buf_pool.empty()) {
+    io_buf_.reset(new base::IoBuf(kMinReadSize));
+  } else {
+    io_buf_ = std::move(read_buf_pool.back());
+    read_buf_pool.pop_back();
+  }
+  stats->read_buf_capacity += io_buf_->Capacity();
+}
+
 void Connection::OnBreakCb(int32_t mask) {
   if (mask <= 0)
     return;  // we cancelled the poller, which means we do not need to break from anything.
@@ -599,12 +877,50 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
   error_code ec;
   ParserStatus parse_status = OK;
 
+  // TLS may hold decrypted input that the socket does not signal, so we poll plain sockets only.
+  bool pool_read_buf = absl::GetFlag(FLAGS_conn_pool_read_buffers) && peer == socket_.get();
+
   do {
     FetchBuilderStats(stats, builder);
 
-    io::MutableBytes append_buf = io_buf_.AppendBuffer();
+    // The reads pause until the dispatch fiber catches up, so that a fast client does not
+    // queue more requests than the limits, give or take the requests of a read buffer.
+    if (IsPipelineQueueFull(*stats)) {
+      SetPhase("stalled");
+      ++stats->pipeline_read_stalls;
+      ++stats->num_stalled_clients;
+      pipeline_drained_ec.await([&] { return cc_->conn_closing || !IsPipelineQueueFull(*stats); });
+      --stats->num_stalled_clients;
+    }
+
     SetPhase("readsock");
 
+    if (pool_read_buf && io_buf_->InputLen() == 0) {
+      WaitReadable(stats);
+    }
+
+    // Large bulk strings are received directly into their final buffer, bypassing io_buf_->
+    if (redis_parser_ && io_buf_->InputLen() == 0) {
+      RedisParser::Buffer tail = redis_parser_->BulkTail();
+      if (tail.size() >= kMaxReadSize) {
+        ::io::Result<size_t> recv_sz = peer->Recv(tail);
+        last_interaction_ = time(nullptr);
+
+        if (!recv_sz) {
+          ec = recv_sz.error();
+          parse_status = OK;
+          break;
+        }
+
+        redis_parser_->CommitBulkTail(*recv_sz);
+        stats->io_read_bytes += *recv_sz;
+        ++stats->io_read_cnt;
+        continue;
+      }
+    }
+
+    io::MutableBytes append_buf = io_buf_->AppendBuffer();
+
     ::io::Result<size_t> recv_sz = peer->Recv(append_buf);
     last_interaction_ = time(nullptr);
 
@@ -614,7 +930,7 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
       break;
     }
 
-    io_buf_.CommitWrite(*recv_sz);
+    io_buf_->CommitWrite(*recv_sz);
     stats->io_read_bytes += *recv_sz;
     ++stats->io_read_cnt;
     SetPhase("process");
@@ -625,26 +941,32 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
       DCHECK(memcache_parser_);
       parse_status = ParseMemcache();
     }
+    stats = service_->GetThreadLocalConnectionStats();  // A command may have migrated us.
 
     if (parse_status == NEED_MORE) {
       parse_status = OK;
 
-      size_t capacity = io_buf_.Capacity();
-      if (capacity < kMaxReadSize) {
+      size_t capacity = io_buf_->Capacity();
+      if (memcache_parser_ && memcache_parser_->parselen_hint() > capacity) {
+        // Memcache requests are parsed only when they are fully read, so the buffer grows
+        // beyond kMaxReadSize for large values and multi-get lines.
+        io_buf_->Reserve(memcache_parser_->parselen_hint());
+        stats->read_buf_capacity += (io_buf_->Capacity() - capacity);
+      } else if (capacity < kMaxReadSize) {
         size_t parser_hint = 0;
         if (redis_parser_)
-          parser_hint = redis_parser_->parselen_hint();  // Could be done for MC as well.
+          parser_hint = redis_parser_->parselen_hint();
 
         if (parser_hint > capacity) {
-          io_buf_.Reserve(std::min(kMaxReadSize, parser_hint));
+          io_buf_->Reserve(std::min(kMaxReadSize, parser_hint));
         } else if (append_buf.size() == *recv_sz && append_buf.size() > capacity / 2) {
           // Last io used most of the io_buf to the end.
-          io_buf_.Reserve(capacity * 2);  // Valid growth range.
+          io_buf_->Reserve(capacity * 2);  // Valid growth range.
         }
 
-        if (capacity < io_buf_.Capacity()) {
-          VLOG(1) << "Growing io_buf to " << io_buf_.Capacity();
-          stats->read_buf_capacity += (io_buf_.Capacity() - capacity);
+        if (capacity < io_buf_->Capacity()) {
+          VLOG(1) << "Growing io_buf to " << io_buf_->Capacity();
+          stats->read_buf_capacity += (io_buf_->Capacity() - capacity);
         }
       }
     } else if (parse_status != OK) {
@@ -677,32 +999,47 @@ struct Connection::DispatchOperations {
 
 void Connection::DispatchOperations::operator()(const Request::MonitorMessage& msg) {
   RedisReplyBuilder* rbuilder = (RedisReplyBuilder*)builder;
+  --self->monitor_msgs_;
   rbuilder->SendSimpleString(msg);
 }
 
 void Connection::DispatchOperations::operator()(const PubMsgRecord& msg) {
   RedisReplyBuilder* rbuilder = (RedisReplyBuilder*)builder;
   ++stats->async_writes_cnt;
+  self->pubsub_bytes_ -= msg.bytes;
+  stats->pubsub_queue_bytes -= msg.bytes;
   const PubMessage& pub_msg = msg.pub_msg;
+  if (pub_msg.invalidate) {
+    rbuilder->StartCollection(2, RedisReplyBuilder::PUSH);
+    rbuilder->SendBulkString("invalidate");
+    if (pub_msg.message) {
+      string_view key = *pub_msg.message;
+      rbuilder->SendStringCollection(absl::Span<string_view>{&key, 1}, RedisReplyBuilder::ARRAY);
+    } else {
+      rbuilder->SendNull();
+    }
+    return;
+  }
+
   string_view arr[4];
   if (pub_msg.pattern.empty()) {
-    arr[0] = "message";
+    arr[0] = pub_msg.sharded ? "smessage" : "message";
     arr[1] = pub_msg.channel;
     arr[2] = *pub_msg.message;
-    rbuilder->SendStringArr(absl::Span<string_view>{arr, 3});
+    rbuilder->SendStringCollection(absl::Span<string_view>{arr, 3}, RedisReplyBuilder::PUSH);
   } else {
     arr[0] = "pmessage";
     arr[1] = pub_msg.pattern;
     arr[2] = pub_msg.channel;
     arr[3] = *pub_msg.message;
-    rbuilder->SendStringArr(absl::Span<string_view>{arr, 4});
+    rbuilder->SendStringCollection(absl::Span<string_view>{arr, 4}, RedisReplyBuilder::PUSH);
   }
 }
 
 void Connection::DispatchOperations::operator()(Request::PipelineMsg& msg) {
   ++stats->pipelined_cmd_cnt;
   bool empty = self->dispatch_q_.empty();
-  builder->SetBatchMode(!empty);
+  builder->SetBatchMode(!empty || self->parsing_input_);
   self->cc_->async_dispatch = true;
   self->service_->DispatchCommand(CmdArgList{msg.args.data(), msg.args.size()}, self->cc_.get());
   self->last_interaction_ = time(nullptr);
@@ -720,36 +1057,158 @@ void Connection::DispatchFiber(util::FiberSocketBase* peer) {
   SinkReplyBuilder* builder = cc_->reply_builder();
   DispatchOperations dispatch_op{builder, this};
 
+  // A deep pipeline keeps the queue full, so the fiber yields once it used its turn to let the
+  // other connections of the thread run. The turn is scaled by the weight of the connection.
+  uint64_t turn_cmds = absl::GetFlag(FLAGS_dispatch_turn_cmds);
+  uint64_t turn_ns = uint64_t(absl::GetFlag(FLAGS_dispatch_turn_usec)) * 1000;
+  uint64_t cmds_in_turn = 0, ns_in_turn = 0;
+
   while (!builder->GetError()) {
-    evc_.await([this] { return cc_->conn_closing || !dispatch_q_.empty(); });
+    evc_.await([this] { return cc_->conn_closing || migrating_ || !dispatch_q_.empty(); });
     if (cc_->conn_closing)
       break;
 
+    if (migrating_)
+      return;  // Relaunched by Migrate() in the new thread.
+
     RequestPtr req{std::move(dispatch_q_.front())};
     dispatch_q_.pop_front();
-    std::visit(dispatch_op, req->payload);
+
+    uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+
+    // Hand consecutive pipelined commands to the service together, so that it could squash them.
+    auto* msg = get_if<Request::PipelineMsg>(&req->payload);
+    if (msg && IsPipelineMsgQueued()) {
+      cmds_in_turn += DispatchPipelineBatch(std::move(req), builder);
+    } else {
+      bool pipelined = msg != nullptr;
+      size_t bytes = pipelined ? msg->Bytes() : 0;
+      std::visit(dispatch_op, req->payload);
+      req.reset();
+      if (pipelined)
+        ReleasePipelineMsgs(1, bytes);
+      ++cmds_in_turn;
+    }
+
+    uint64_t elapsed_ns = ProactorBase::GetMonotonicTimeNs() - start_ns;
+    dispatch_ns_ += elapsed_ns;
+    ns_in_turn += elapsed_ns;
+
+    if (dispatch_q_.empty()) {
+      cmds_in_turn = ns_in_turn = 0;
+      continue;
+    }
+
+    if ((turn_cmds && cmds_in_turn * 100 >= max<uint64_t>(turn_cmds * dispatch_weight_, 100)) ||
+        (turn_ns && ns_in_turn * 100 >= turn_ns * dispatch_weight_)) {
+      ++dispatch_yields_;
+      ++service_->GetThreadLocalConnectionStats()->dispatch_yields;
+      this_fiber::yield();
+      cmds_in_turn = ns_in_turn = 0;
+    }
   }
 
   cc_->conn_closing = true;
 
   // make sure that we don't have any leftovers!
   dispatch_q_.clear();
+  service_->GetThreadLocalConnectionStats()->pubsub_queue_bytes -= pubsub_bytes_;
+  pubsub_bytes_ = 0;
+  monitor_msgs_ = 0;
+  ReleasePipelineMsgs(pipeline_cmds_, pipeline_bytes_);
+}
+
+void Connection::ReleasePipelineMsgs(size_t count, size_t bytes) {
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  pipeline_cmds_ -= count;
+  pipeline_bytes_ -= bytes;
+  stats->pipeline_queue_cmds -= count;
+  stats->pipeline_queue_bytes -= bytes;
+  if (stats->num_stalled_clients > 0)
+    pipeline_drained_ec.notifyAll();
 }
 
-auto Connection::FromArgs(RespVec args, mi_heap_t* heap) -> RequestPtr {
+bool Connection::IsPipelineQueueFull(const ConnectionStats& stats) const {
+  // A connection without queued commands dispatches directly, so it never waits for the others.
+  if (pipeline_cmds_ == 0)
+    return false;
+
+  uint32_t queue_limit = absl::GetFlag(FLAGS_pipeline_queue_limit);
+  uint64_t buffer_limit = absl::GetFlag(FLAGS_pipeline_buffer_limit);
+  uint64_t thread_limit = absl::GetFlag(FLAGS_pipeline_thread_buffer_limit);
+  return (queue_limit && pipeline_cmds_ >= queue_limit) ||
+         (buffer_limit && pipeline_bytes_ >= buffer_limit) ||
+         (thread_limit && stats.pipeline_queue_bytes >= thread_limit);
+}
+
+bool Connection::IsPipelineMsgQueued() const {
+  return !dispatch_q_.empty() && holds_alternative<Request::PipelineMsg>(dispatch_q_.front()->payload);
+}
+
+size_t Connection::DispatchPipelineBatch(RequestPtr first, SinkReplyBuilder* builder) {
+  constexpr size_t kMaxBatch = 32;
+
+  absl::InlinedVector<RequestPtr, kMaxBatch> batch;
+  batch.push_back(std::move(first));
+  while (batch.size() < kMaxBatch && IsPipelineMsgQueued()) {
+    batch.push_back(std::move(dispatch_q_.front()));
+    dispatch_q_.pop_front();
+  }
+
+  absl::InlinedVector<CmdArgList, kMaxBatch> args_list;
+  size_t bytes = 0;
+  for (auto& req : batch) {
+    auto& msg = get<Request::PipelineMsg>(req->payload);
+    args_list.emplace_back(msg.args.data(), msg.args.size());
+    bytes += msg.Bytes();
+  }
+
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  stats->pipelined_cmd_cnt += batch.size();
+
+  builder->SetBatchMode(true);
+  cc_->async_dispatch = true;
+  service_->DispatchManyCommands(absl::MakeSpan(args_list), cc_.get());
+  last_interaction_ = time(nullptr);
+  cc_->async_dispatch = false;
+
+  size_t count = batch.size();
+  batch.clear();
+  ReleasePipelineMsgs(count, bytes);
+
+  if (dispatch_q_.empty() && !parsing_input_) {
+    builder->SetBatchMode(false);
+    builder->FlushBatch();
+  }
+  return count;
+}
+
+auto Connection::FromArgs(const RespVec& args, mi_heap_t* heap) -> RequestPtr {
   DCHECK(!args.empty());
   size_t backed_sz = 0;
+  RedisParser::BlobPtr blob;
+
   for (const auto& arg : args) {
     CHECK_EQ(RespExpr::STRING, arg.type);
-    backed_sz += arg.GetBuf().size();
+    auto buf = arg.GetBuf();
+
+    // A bulk string that did not fit into the io buffer already has a dedicated buffer in the
+    // parser. We take it over rather than copying it, unless it is small enough for the inline
+    // storage anyway.
+    if (!blob && arg.has_support && buf.size() > kReqStorageSize) {
+      blob = redis_parser_->ReleaseBlob(buf.data());
+      if (blob)
+        continue;
+    }
+    backed_sz += buf.size();
   }
-  DCHECK(backed_sz);
+  DCHECK(backed_sz || blob);
 
   constexpr auto kReqSz = sizeof(Request);
   static_assert(kReqSz < MI_SMALL_SIZE_MAX);
   static_assert(alignof(Request) == 8);
 
-  RequestPtr req = Request::New(heap, args, backed_sz);
+  RequestPtr req = Request::New(heap, args, backed_sz, std::move(blob));
 
   return req;
 }
@@ -769,12 +1228,21 @@ void RespToArgList(const RespVec& src, CmdArgVec* dest) {
 void Connection::SendMonitorMsg(std::string monitor_msg) {
   DCHECK(cc_);
 
-  if (!cc_->conn_closing) {
-    RequestPtr req = Request::New(std::move(monitor_msg));
-    dispatch_q_.push_back(std::move(req));
-    if (dispatch_q_.size() == 1) {
-      evc_.notify();
-    }
+  if (cc_->conn_closing)
+    return;
+
+  // A monitor that falls behind loses the new messages instead of buffering them.
+  uint32_t queue_limit = absl::GetFlag(FLAGS_monitor_queue_limit);
+  if (queue_limit && monitor_msgs_ >= queue_limit) {
+    ++service_->GetThreadLocalConnectionStats()->monitor_dropped_cnt;
+    return;
+  }
+
+  RequestPtr req = Request::New(std::move(monitor_msg));
+  dispatch_q_.push_back(std::move(req));
+  ++monitor_msgs_;
+  if (dispatch_q_.size() == 1) {
+    evc_.notify();
   }
 }
 
@@ -788,4 +1256,10 @@ std::string Connection::RemoteEndpointStr() const {
   return connection_str;
 }
 
+std::string Connection::LocalBindAddress() const {
+  LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
+  auto le = lsb->LocalEndpoint();
+  return le.address().to_string();
+}
+
 }  // namespace facade
@@ -58,11 +58,38 @@ class Connection : public util::Connection {
     std::string_view channel;
     std::shared_ptr<const std::string> message;  // ensure that this message would out live passing
                                                  // between different threads/fibers
+
+    // CLIENT TRACKING invalidation of key message. A null message invalidates all the keys.
+    bool invalidate = false;
+
+    // SPUBLISH message, sent as smessage.
+    bool sharded = false;
   };
 
   // this function is overriden at test_utils TestConnection
   virtual void SendMsgVecAsync(const PubMessage& pub_msg);
 
+  // Limits of the pubsub messages queued to a connection, like client-output-buffer-limit
+  // pubsub. A connection overflows once its queue holds more than hard_limit bytes, or more
+  // than soft_limit bytes for over soft_seconds. 0 disables a limit.
+  struct PubSubLimits {
+    size_t hard_limit = 0;
+    size_t soft_limit = 0;
+    uint32_t soft_seconds = 0;
+  };
+
+  // What happens to the queue of an overflowing connection.
+  enum class OverflowPolicy : uint8_t {
+    DISCONNECT,
+    DROP_OLDEST,  // drops the oldest messages to get within the limit.
+    COALESCE,     // keeps the latest message of each channel, then drops the oldest ones.
+  };
+
+  // Applies to all the connections.
+  static void SetPubSubLimits(const PubSubLimits& limits, OverflowPolicy policy);
+  static PubSubLimits GetPubSubLimits();
+  static OverflowPolicy GetOverflowPolicy();
+
   // Please note, this accept the message by value, since we really want to
   // create a new copy here, so that we would not need to "worry" about memory
   // management, we are assuming that we would not have many copy for this, and that
@@ -81,12 +108,31 @@ class Connection : public util::Connection {
     CopyCharBuf(phase, sizeof(phase_), phase_);
   }
 
+  // The share of the dispatch turn of the connection in percent of --dispatch_turn_cmds and
+  // --dispatch_turn_usec, see DispatchFiber.
+  void SetDispatchWeight(unsigned weight) {
+    dispatch_weight_ = weight;
+  }
+
+  unsigned GetDispatchWeight() const {
+    return dispatch_weight_;
+  }
+
   std::string GetClientInfo() const;
   std::string RemoteEndpointStr() const;
+
+  // The local address the client connected to.
+  std::string LocalBindAddress() const;
+
   uint32 GetClientId() const;
 
   void ShutdownSelf();
 
+  // Moves the connection to the dest thread. Called from a command that is dispatched
+  // synchronously by the connection fiber. Returns false if the connection can not move now,
+  // i.e. it has queued requests or uses TLS.
+  bool Migrate(util::ProactorBase* dest);
+
  protected:
   void OnShutdown() override;
   void OnPreMigrateThread() override;
@@ -116,7 +162,10 @@ class Connection : public util::Connection {
   ParserStatus ParseMemcache();
   void OnBreakCb(int32_t mask);
 
-  base::IoBuf io_buf_;
+  // Returns io_buf_ to the thread pool until the socket becomes readable.
+  void WaitReadable(ConnectionStats* stats);
+
+  std::unique_ptr<base::IoBuf> io_buf_;  // Null while an idle connection waits for input.
   std::unique_ptr<RedisParser> redis_parser_;
   std::unique_ptr<MemcacheParser> memcache_parser_;
   util::HttpListenerBase* http_listener_;
@@ -136,16 +185,56 @@ class Connection : public util::Connection {
   using RequestPtr = std::unique_ptr<Request, RequestDeleter>;
 
   // args are passed deliberately by value - to pass the ownership.
-  static RequestPtr FromArgs(RespVec args, mi_heap_t* heap);
+  RequestPtr FromArgs(const RespVec& args, mi_heap_t* heap);
+
+  bool IsPipelineMsgQueued() const;
+
+  // Returns the number of the dispatched commands.
+  size_t DispatchPipelineBatch(RequestPtr first, SinkReplyBuilder* builder);
+
+  // Accounts the bytes of the dispatched pipeline messages and wakes the input fibers that wait
+  // for the queues to drain.
+  void ReleasePipelineMsgs(size_t count, size_t bytes);
+
+  // Whether the queued pipeline messages are over the limits, so that the input fiber should
+  // stop reading the socket.
+  bool IsPipelineQueueFull(const ConnectionStats& stats) const;
+
+  // Applies the overflow policy if the queued pubsub messages are over the limits.
+  void CheckPubSubLimits();
+
+  // Drops the older messages of each channel if coalesce is true, then the oldest messages
+  // until their bytes are within target.
+  void DropPubMessages(size_t target, bool coalesce);
 
   std::deque<RequestPtr> dispatch_q_;  // coordinated via evc_.
+  size_t pubsub_bytes_ = 0;            // of the pubsub messages in dispatch_q_.
+  time_t pubsub_soft_since_ = 0;       // when pubsub_bytes_ went above the soft limit.
+  size_t monitor_msgs_ = 0;            // the monitor messages in dispatch_q_.
+  size_t pipeline_cmds_ = 0;           // the pipeline messages in dispatch_q_.
+  size_t pipeline_bytes_ = 0;          // of the pipeline messages in dispatch_q_.
   util::fibers_ext::EventCount evc_;
+  ::boost::fibers::fiber dispatch_fb_;
+
+  // Makes the dispatch fiber exit, so that it could be relaunched in the new thread.
+  bool migrating_ = false;
+
+  // The fairness accounting of the dispatch fiber: the time it ran the queued requests, including
+  // their waits for the shards, and the times it yielded to the other connections before its
+  // queue was empty.
+  unsigned dispatch_weight_ = 100;
+  uint64_t dispatch_ns_ = 0;
+  uint64_t dispatch_yields_ = 0;
 
   RespVec parse_args_;
   CmdArgVec cmd_vec_;
 
   unsigned parser_error_ = 0;
   uint32_t id_;
+
+  // Set while the input fiber parses the read buffer. The dispatch fiber keeps batching the
+  // replies until then, so that a pipeline burst is flushed once.
+  bool parsing_input_ = false;
   uint32_t break_poll_id_ = UINT32_MAX;
 
   Protocol protocol_;
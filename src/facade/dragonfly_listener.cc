@@ -11,6 +11,8 @@
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
+#include "facade/ktls.h"
+#include "facade/numa.h"
 #include "facade/service_interface.h"
 #include "util/proactor_pool.h"
 
@@ -20,10 +22,14 @@ ABSL_FLAG(uint32_t, conn_threads, 0, "Number of threads used for handing server
 ABSL_FLAG(bool, tls, false, "");
 ABSL_FLAG(bool, conn_use_incoming_cpu, false,
           "If true uses incoming cpu of a socket in order to distribute"
-          " incoming connections");
+          " incoming connections. The connections whose cpu has no thread go to the threads"
+          " on the numa node of the cpu");
 
 ABSL_FLAG(string, tls_cert_file, "", "cert file for tls connections");
 ABSL_FLAG(string, tls_key_file, "", "key file for tls connections");
+ABSL_FLAG(bool, tls_ktls, false,
+          "If true, TLS 1.3 sessions are offloaded to the kernel after the handshake, "
+          "so that their io does not pass through OpenSSL. Requires the tls kernel module");
 
 #if 0
 enum TlsClientAuth {
@@ -92,6 +98,9 @@ static SSL_CTX* CreateSslCntx() {
 
   CHECK_EQ(1, SSL_CTX_set_dh_auto(ctx, 1));
 
+  if (GetFlag(FLAGS_tls_ktls))
+    EnableKernelTlsCapture(ctx);
+
   return ctx;
 }
 #endif
@@ -200,10 +209,7 @@ ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
     CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len));
     VLOG(1) << "CPU/NAPI for connection " << fd << " is " << cpu << "/" << napi_id;
 
-    vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
-    if (!ids.empty()) {
-      id = ids.front();
-    }
+    id = PickThreadOfCpu(cpu, total);
   }
 
   if (id == kuint32max) {
@@ -213,4 +219,33 @@ ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
   return pp->at(id % total);
 }
 
+unsigned Listener::PickThreadOfCpu(int cpu, unsigned total) {
+  for (unsigned id : pool()->MapCpuToThreads(cpu)) {
+    if (id < total)
+      return id;
+  }
+
+  // The proactor threads are pinned to their cpus, so we map the nodes to them once.
+  const NumaTopology& topology = NumaTopology::Get();
+  call_once(node_threads_once_, [&] {
+    node_threads_.resize(topology.num_nodes());
+    for (unsigned c = 0; c < topology.num_cpus(); ++c) {
+      int node = topology.NodeOfCpu(c);
+      if (node < 0)
+        continue;
+      for (unsigned id : pool()->MapCpuToThreads(c)) {
+        if (id < total)
+          node_threads_[node].push_back(id);
+      }
+    }
+  });
+
+  int node = topology.NodeOfCpu(cpu);
+  if (node < 0 || node_threads_[node].empty())
+    return kuint32max;
+
+  const vector<unsigned>& threads = node_threads_[node];
+  return threads[next_id_.fetch_add(1, std::memory_order_relaxed) % threads.size()];
+}
+
 }  // namespace facade
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <mutex>
+#include <vector>
+
 #include "facade/facade_types.h"
 #include "util/http/http_handler.h"
 #include "util/listener_interface.h"
@@ -25,6 +28,10 @@ class Listener : public util::ListenerInterface {
   util::Connection* NewConnection(util::ProactorBase* proactor) final;
   util::ProactorBase* PickConnectionProactor(util::LinuxSocketBase* sock) final;
 
+  // Returns a thread below total that runs on cpu or else on its numa node, kuint32max if
+  // there is none.
+  unsigned PickThreadOfCpu(int cpu, unsigned total);
+
   void PreShutdown() final;
 
   void PostShutdown() final;
@@ -34,6 +41,9 @@ class Listener : public util::ListenerInterface {
   ServiceInterface* service_;
 
   std::atomic_uint32_t next_id_{0};
+
+  std::once_flag node_threads_once_;
+  std::vector<std::vector<unsigned>> node_threads_;  // By numa node.
   Protocol protocol_;
   SSL_CTX* ctx_ = nullptr;
 };
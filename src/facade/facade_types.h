@@ -40,9 +40,30 @@ struct ConnectionStats {
   // Writes count that happened via SendRawMessageAsync call.
   size_t async_writes_cnt = 0;
 
+  // The pubsub messages queued to the connections, and the ones dropped by the overflow
+  // policy of client-output-buffer-limit pubsub.
+  size_t pubsub_queue_bytes = 0;
+  size_t pubsub_dropped_cnt = 0;
+  size_t pubsub_coalesced_cnt = 0;
+  size_t pubsub_overflow_disconnects = 0;
+
+  // The monitor messages dropped since their connections were over --monitor_queue_limit.
+  size_t monitor_dropped_cnt = 0;
+
+  // Times the dispatch fibers yielded to the other connections after using their turn, see
+  // --dispatch_turn_cmds.
+  size_t dispatch_yields = 0;
+
+  // The pipelined requests queued to the dispatch fibers, and the times the connections paused
+  // their reads since the queues were over the limits, see --pipeline_queue_limit.
+  size_t pipeline_queue_cmds = 0;
+  size_t pipeline_queue_bytes = 0;
+  size_t pipeline_read_stalls = 0;
+
   uint32_t num_conns = 0;
   uint32_t num_replicas = 0;
   uint32_t num_blocked_clients = 0;
+  uint32_t num_stalled_clients = 0;
 
   ConnectionStats& operator+=(const ConnectionStats& o);
 };
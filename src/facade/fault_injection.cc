@@ -0,0 +1,88 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/fault_injection.h"
+
+#include <absl/strings/match.h>
+
+#include <atomic>
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+struct FaultState {
+  atomic_uint32_t delay_usec{0};
+  atomic_uint32_t every{1};
+  atomic_uint64_t passes{0};
+  atomic_uint64_t injected{0};
+};
+
+FaultState fault_states[kNumFaultPoints];
+
+const char* const kFaultPointNames[kNumFaultPoints] = {"io_completion", "socket_write",
+                                                       "shard_queue", "snapshot_serialize"};
+
+}  // namespace
+
+const char* FaultPointName(FaultPoint point) {
+  return kFaultPointNames[unsigned(point)];
+}
+
+optional<FaultPoint> ParseFaultPoint(string_view name) {
+  for (unsigned i = 0; i < kNumFaultPoints; ++i) {
+    if (absl::EqualsIgnoreCase(name, kFaultPointNames[i]))
+      return FaultPoint(i);
+  }
+  return nullopt;
+}
+
+void SetFault(FaultPoint point, uint32_t delay_usec, uint32_t every) {
+  FaultState& state = fault_states[unsigned(point)];
+  state.every.store(max(every, 1u), memory_order_relaxed);
+  state.passes.store(0, memory_order_relaxed);
+  state.delay_usec.store(delay_usec, memory_order_relaxed);
+}
+
+FaultInfo GetFault(FaultPoint point) {
+  const FaultState& state = fault_states[unsigned(point)];
+  FaultInfo res;
+  res.delay_usec = state.delay_usec.load(memory_order_relaxed);
+  res.every = state.every.load(memory_order_relaxed);
+  res.injected = state.injected.load(memory_order_relaxed);
+  return res;
+}
+
+void ResetFaults() {
+  for (FaultState& state : fault_states) {
+    state.delay_usec.store(0, memory_order_relaxed);
+    state.every.store(1, memory_order_relaxed);
+    state.passes.store(0, memory_order_relaxed);
+    state.injected.store(0, memory_order_relaxed);
+  }
+}
+
+namespace detail {
+
+uint32_t NextFaultDelay(FaultPoint point) {
+  FaultState& state = fault_states[unsigned(point)];
+
+  // The points that are not delayed cost a load.
+  uint32_t usec = state.delay_usec.load(memory_order_relaxed);
+  if (usec == 0)
+    return 0;
+
+  uint64_t pass = state.passes.fetch_add(1, memory_order_relaxed);
+  if (pass % state.every.load(memory_order_relaxed) != 0)
+    return 0;
+
+  state.injected.fetch_add(1, memory_order_relaxed);
+  return usec;
+}
+
+}  // namespace detail
+
+}  // namespace facade
@@ -0,0 +1,85 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#ifdef DFLY_FAULT_INJECTION
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/operations.hpp>
+#include <chrono>
+#endif
+
+namespace facade {
+
+// The places where DEBUG INJECT delays the execution, so that load tests can check how the
+// latency of the other requests holds up when one of the paths becomes slow.
+// The hooks are compiled in only when DFLY_FAULT_INJECTION is defined, i.e. with
+// -DDF_FAULT_INJECTION=ON or in debug builds. Otherwise they are empty.
+enum class FaultPoint : uint8_t {
+  IO_COMPLETION,       // Completions of the reads and writes of IoMgr.
+  SOCKET_WRITE,        // Writes of the replies to the sockets.
+  SHARD_QUEUE,         // Tasks of the shard queues, i.e. the transaction hops.
+  SNAPSHOT_SERIALIZE,  // Steps of the traversal of the snapshot fibers.
+  kNumPoints,
+};
+
+constexpr unsigned kNumFaultPoints = unsigned(FaultPoint::kNumPoints);
+
+#ifdef DFLY_FAULT_INJECTION
+constexpr bool kFaultInjection = true;
+#else
+constexpr bool kFaultInjection = false;
+#endif
+
+struct FaultInfo {
+  uint32_t delay_usec = 0;
+  uint32_t every = 1;
+  uint64_t injected = 0;  // How many times the point was delayed.
+};
+
+// Lower-case, as DEBUG INJECT accepts them, e.g. "socket_write".
+const char* FaultPointName(FaultPoint point);
+std::optional<FaultPoint> ParseFaultPoint(std::string_view name);
+
+// Delays every n-th pass through point by delay_usec. A delay of 0 disables the point.
+// Thread-safe.
+void SetFault(FaultPoint point, uint32_t delay_usec, uint32_t every = 1);
+FaultInfo GetFault(FaultPoint point);
+void ResetFaults();
+
+namespace detail {
+
+// Returns the delay of this pass through point, or 0.
+uint32_t NextFaultDelay(FaultPoint point);
+
+}  // namespace detail
+
+// Suspends the calling fiber if point is delayed. Must be called from a fiber.
+inline void InjectFault(FaultPoint point) {
+#ifdef DFLY_FAULT_INJECTION
+  if (uint32_t usec = detail::NextFaultDelay(point))
+    boost::this_fiber::sleep_for(std::chrono::microseconds(usec));
+#endif
+}
+
+// For the callbacks that must not block, like the completions of io_uring: runs cb in a new
+// fiber after the delay if point is delayed, and right away otherwise.
+template <typename F> void RunAfterFault(FaultPoint point, F&& cb) {
+#ifdef DFLY_FAULT_INJECTION
+  if (uint32_t usec = detail::NextFaultDelay(point)) {
+    boost::fibers::fiber([usec, cb = std::forward<F>(cb)]() mutable {
+      boost::this_fiber::sleep_for(std::chrono::microseconds(usec));
+      cb();
+    }).detach();
+    return;
+  }
+#endif
+  cb();
+}
+
+}  // namespace facade
@@ -0,0 +1,185 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/ktls.h"
+
+#ifdef DFLY_USE_SSL
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+
+#include <boost/fiber/fss.hpp>
+#include <cstring>
+#include <memory>
+
+#include "base/logging.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+struct HandshakeSecrets {
+  const SSL* ssl = nullptr;
+  string client_secret, server_secret;
+};
+
+// The keylog callback runs inside SSL_do_handshake, i.e. in the fiber of the connection.
+boost::fibers::fiber_specific_ptr<HandshakeSecrets> handshake_secrets;
+
+// line is "<label> <client random> <secret>", all in hex.
+void KeylogCb(const SSL* ssl, const char* line) {
+  HandshakeSecrets* secrets = handshake_secrets.get();
+  if (!secrets)
+    return;
+
+  vector<string_view> parts = absl::StrSplit(line, ' ');
+  if (parts.size() != 3)
+    return;
+
+  if (parts[0] == "CLIENT_TRAFFIC_SECRET_0") {
+    secrets->client_secret = absl::HexStringToBytes(parts[2]);
+  } else if (parts[0] == "SERVER_TRAFFIC_SECRET_0") {
+    secrets->server_secret = absl::HexStringToBytes(parts[2]);
+  } else {
+    return;
+  }
+  secrets->ssl = ssl;
+}
+
+// HKDF-Expand-Label of RFC 8446 with an empty context.
+bool HkdfExpandLabel(const EVP_MD* md, string_view secret, string_view label, uint8_t* dest,
+                     size_t len) {
+  string full_label = absl::StrCat("tls13 ", label);
+  string info;
+  info.push_back(char(len >> 8));
+  info.push_back(char(len & 0xff));
+  info.push_back(char(full_label.size()));
+  info.append(full_label);
+  info.push_back(0);
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool res = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, (const uint8_t*)secret.data(), secret.size()) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, (const uint8_t*)info.data(), info.size()) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+  return res;
+}
+
+template <typename Info>
+bool FillCryptoInfo(uint16_t cipher_type, const EVP_MD* md, string_view secret, Info* info) {
+  memset(info, 0, sizeof(Info));
+  info->info.version = TLS_1_3_VERSION;
+  info->info.cipher_type = cipher_type;
+
+  // TLS 1.3 nonce is salt followed by iv. rec_seq stays 0, since no application records
+  // were exchanged yet.
+  uint8_t iv[sizeof(info->salt) + sizeof(info->iv)];
+  if (!HkdfExpandLabel(md, secret, "key", info->key, sizeof(info->key)) ||
+      !HkdfExpandLabel(md, secret, "iv", iv, sizeof(iv))) {
+    return false;
+  }
+
+  memcpy(info->salt, iv, sizeof(info->salt));
+  memcpy(info->iv, iv + sizeof(info->salt), sizeof(info->iv));
+  return true;
+}
+
+template <typename Info>
+bool ConfigureSocket(int fd, uint16_t cipher_type, const EVP_MD* md,
+                     const HandshakeSecrets& secrets) {
+  Info rx, tx;
+  bool res = false;
+
+  if (FillCryptoInfo(cipher_type, md, secrets.client_secret, &rx) &&
+      FillCryptoInfo(cipher_type, md, secrets.server_secret, &tx) &&
+      setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+    // Until a direction has its keys, the socket passes the records through, so failing here
+    // keeps the session usable in user space.
+    if (setsockopt(fd, SOL_TLS, TLS_RX, &rx, sizeof(rx)) == 0) {
+      res = setsockopt(fd, SOL_TLS, TLS_TX, &tx, sizeof(tx)) == 0;
+      if (!res) {
+        LOG(WARNING) << "Could not offload TLS transmission " << strerror(errno);
+        shutdown(fd, SHUT_RDWR);  // The session is broken in both user space and the kernel.
+      }
+    } else {
+      VLOG(1) << "Kernel TLS is not supported " << strerror(errno);
+    }
+  }
+
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  return res;
+}
+
+}  // namespace
+
+void EnableKernelTlsCapture(SSL_CTX* ctx) {
+  SSL_CTX_set_keylog_callback(ctx, KeylogCb);
+
+  // Tickets are records sent after the handshake, they would advance the record sequence.
+  SSL_CTX_set_num_tickets(ctx, 0);
+  CHECK_EQ(1, SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"));
+}
+
+void StartTlsHandshake() {
+  handshake_secrets.reset(new HandshakeSecrets);
+}
+
+bool OffloadTlsToKernel(int fd) {
+  unique_ptr<HandshakeSecrets> secrets{handshake_secrets.release()};
+  if (!secrets || !secrets->ssl || secrets->client_secret.empty() ||
+      secrets->server_secret.empty()) {
+    return false;
+  }
+
+  SSL* ssl = const_cast<SSL*>(secrets->ssl);
+  if (SSL_version(ssl) != TLS1_3_VERSION)
+    return false;
+
+  // Records that arrived together with the handshake are already buffered by OpenSSL.
+  if (SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0 ||
+      BIO_wpending(SSL_get_wbio(ssl)) > 0) {
+    return false;
+  }
+
+  bool res = false;
+  switch (SSL_CIPHER_get_protocol_id(SSL_get_current_cipher(ssl))) {
+    case 0x1301:  // TLS_AES_128_GCM_SHA256
+      res = ConfigureSocket<tls12_crypto_info_aes_gcm_128>(fd, TLS_CIPHER_AES_GCM_128,
+                                                           EVP_sha256(), *secrets);
+      break;
+    case 0x1302:  // TLS_AES_256_GCM_SHA384
+      res = ConfigureSocket<tls12_crypto_info_aes_gcm_256>(fd, TLS_CIPHER_AES_GCM_256,
+                                                           EVP_sha384(), *secrets);
+      break;
+  }
+
+  OPENSSL_cleanse(secrets->client_secret.data(), secrets->client_secret.size());
+  OPENSSL_cleanse(secrets->server_secret.data(), secrets->server_secret.size());
+  return res;
+}
+
+}  // namespace facade
+
+#endif  // DFLY_USE_SSL
@@ -0,0 +1,25 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace facade {
+
+// Kernel TLS offload. The handshake runs in user space, then the session keys move into the
+// kernel, which encrypts and decrypts the records of the plain socket.
+// Only TLS 1.3 sessions with AES-GCM are offloaded, others stay in user space.
+
+// Makes ctx capture the traffic secrets of its handshakes.
+void EnableKernelTlsCapture(SSL_CTX* ctx);
+
+// Called by the fiber that runs the handshake, right before it.
+void StartTlsHandshake();
+
+// Called by the same fiber after a successful handshake. Returns true if the session was
+// offloaded, i.e. the connection should do plain io on fd from now on.
+bool OffloadTlsToKernel(int fd);
+
+}  // namespace facade
@@ -5,8 +5,11 @@
 
 #include <absl/container/flat_hash_map.h>
 #include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
 
+#include "base/endian.h"
 #include "base/stl_util.h"
 
 namespace facade {
@@ -15,6 +18,12 @@ using MP = MemcacheParser;
 
 namespace {
 
+// Lines of other commands are short, so a longer line without a newline is a protocol error.
+constexpr size_t kMaxLine = 300;
+
+// get/gat lines are not limited in number of keys, but we still do not buffer them forever.
+constexpr size_t kMaxRetrievalLine = 1 << 19;
+
 MP::CmdType From(string_view token) {
   static absl::flat_hash_map<string_view, MP::CmdType> cmd_map{
       {"set", MP::SET},       {"add", MP::ADD},         {"replace", MP::REPLACE},
@@ -22,7 +31,9 @@ MP::CmdType From(string_view token) {
       {"get", MP::GET},       {"gets", MP::GETS},       {"gat", MP::GAT},
       {"gats", MP::GATS},     {"stats", MP::STATS},     {"incr", MP::INCR},
       {"decr", MP::DECR},     {"delete", MP::DELETE},   {"flush_all", MP::FLUSHALL},
-      {"quit", MP::QUIT},     {"version", MP::VERSION},
+      {"quit", MP::QUIT},     {"version", MP::VERSION}, {"mn", MP::META_NOOP},
+      {"mg", MP::META_GET},   {"ms", MP::META_SET},     {"md", MP::META_DEL},
+      {"ma", MP::META_ARITHM},
   };
 
   auto it = cmd_map.find(token);
@@ -99,15 +110,316 @@ MP::Result ParseValueless(const std::string_view* tokens, unsigned num_tokens, M
   return MP::OK;
 }
 
+// Returns the flags that are allowed for the meta command.
+string_view MetaFlagsOf(MP::CmdType type) {
+  switch (type) {
+    case MP::META_GET:
+      return "vftcksOqTNR";
+    case MP::META_SET:
+      return "cksOqTFCM";
+    case MP::META_DEL:
+      return "kOqCIT";
+    case MP::META_ARITHM:
+      return "vtckOqTNJDM";
+    default:
+      return "";
+  }
+}
+
+MP::Result ParseMeta(const std::string_view* tokens, unsigned num_tokens, MP::Command* res) {
+  MP::MetaFlags& meta = res->meta;
+  meta = MP::MetaFlags{};
+  res->no_reply = false;
+  res->flags = 0;
+  res->cas_unique = 0;
+
+  if (res->type == MP::META_NOOP)
+    return num_tokens == 0 ? MP::OK : MP::PARSE_ERROR;
+
+  if (num_tokens == 0 || tokens[0].size() > 250)
+    return MP::PARSE_ERROR;
+  res->key = tokens[0];
+
+  unsigned flag_pos = 1;
+  if (res->type == MP::META_SET) {
+    if (num_tokens < 2)
+      return MP::PARSE_ERROR;
+    if (!absl::SimpleAtoi(tokens[1], &res->bytes_len))
+      return MP::BAD_INT;
+    ++flag_pos;
+  }
+
+  if (res->type == MP::META_ARITHM)
+    res->delta = 1;
+
+  string_view allowed = MetaFlagsOf(res->type);
+  for (unsigned i = flag_pos; i < num_tokens; ++i) {
+    char flag = tokens[i][0];
+    string_view arg = tokens[i].substr(1);
+    if (allowed.find(flag) == string_view::npos)
+      return MP::PARSE_ERROR;
+
+    bool valid = true;
+    switch (flag) {
+      case 'v':
+        meta.return_value = true;
+        break;
+      case 'f':
+        meta.return_flags = true;
+        break;
+      case 't':
+        meta.return_ttl = true;
+        break;
+      case 'c':
+        meta.return_cas = true;
+        break;
+      case 'k':
+        meta.return_key = true;
+        break;
+      case 's':
+        meta.return_size = true;
+        break;
+      case 'q':
+        res->no_reply = true;
+        break;
+      case 'I':
+        meta.invalidate = true;
+        break;
+      case 'O':
+        meta.opaque = arg;
+        break;
+      case 'M':
+        valid = arg.size() == 1;
+        meta.mode = valid ? arg[0] : 0;
+        break;
+      case 'T':
+        valid = absl::SimpleAtoi(arg, &meta.new_ttl);
+        break;
+      case 'N':
+        valid = absl::SimpleAtoi(arg, &meta.vivify_ttl);
+        break;
+      case 'R':
+        valid = absl::SimpleAtoi(arg, &meta.recache_ttl);
+        break;
+      case 'F':
+        valid = absl::SimpleAtoi(arg, &res->flags);
+        break;
+      case 'C':
+        valid = absl::SimpleAtoi(arg, &res->cas_unique);
+        break;
+      case 'J':
+        valid = absl::SimpleAtoi(arg, &meta.initial);
+        break;
+      case 'D':
+        valid = absl::SimpleAtoi(arg, &res->delta);
+        break;
+    }
+
+    if (!valid)
+      return MP::BAD_INT;
+  }
+
+  return MP::OK;
+}
+
+bool IsRetrieval(MP::CmdType type) {
+  return type >= MP::GET && type <= MP::GATS;
+}
+
+// Maps the opcode of a binary request, the quiet variants are mapped to their base opcode.
+MP::CmdType FromBinary(MP::BinOpcode opcode, bool* quiet) {
+  *quiet = base::_in(opcode, {MP::BIN_GETQ, MP::BIN_GETKQ, MP::BIN_APPENDQ, MP::BIN_PREPENDQ});
+
+  if (opcode == MP::BIN_APPENDQ) {
+    opcode = MP::BIN_APPEND;
+  } else if (opcode == MP::BIN_PREPENDQ) {
+    opcode = MP::BIN_PREPEND;
+  } else if (opcode > MP::BIN_QUIET_OFFSET && opcode <= MP::BIN_QUIET_OFFSET + MP::BIN_FLUSH) {
+    opcode = MP::BinOpcode(opcode - MP::BIN_QUIET_OFFSET);
+    *quiet = true;
+  }
+
+  switch (opcode) {
+    case MP::BIN_GET:
+    case MP::BIN_GETQ:
+    case MP::BIN_GETK:
+    case MP::BIN_GETKQ:
+      return MP::GET;
+    case MP::BIN_SET:
+      return MP::SET;
+    case MP::BIN_ADD:
+      return MP::ADD;
+    case MP::BIN_REPLACE:
+      return MP::REPLACE;
+    case MP::BIN_APPEND:
+      return MP::APPEND;
+    case MP::BIN_PREPEND:
+      return MP::PREPEND;
+    case MP::BIN_DELETE:
+      return MP::DELETE;
+    case MP::BIN_INCR:
+      return MP::INCR;
+    case MP::BIN_DECR:
+      return MP::DECR;
+    case MP::BIN_QUIT:
+      return MP::QUIT;
+    case MP::BIN_FLUSH:
+      return MP::FLUSHALL;
+    case MP::BIN_NOOP:
+      return MP::META_NOOP;
+    case MP::BIN_VERSION:
+      return MP::VERSION;
+  }
+  return MP::INVALID;
+}
+
+// Fixed part of a binary request.
+struct BinHeader {
+  uint8_t opcode;
+  uint16_t key_len;
+  uint8_t extras_len;
+  uint32_t body_len;
+  uint32_t opaque;
+  uint64_t cas;
+};
+
+BinHeader ParseBinHeader(const char* src) {
+  BinHeader res;
+  res.opcode = src[1];
+  res.key_len = absl::big_endian::Load16(src + 2);
+  res.extras_len = src[4];
+  res.body_len = absl::big_endian::Load32(src + 8);
+  res.opaque = absl::big_endian::Load32(src + 12);
+  res.cas = absl::big_endian::Load64(src + 16);
+  return res;
+}
+
 }  // namespace
 
+auto MP::ParseBinary(string_view str, uint32_t* consumed, Command* cmd) -> Result {
+  if (str.size() < kBinHeaderSize) {
+    parselen_hint_ = kBinHeaderSize;
+    return INPUT_PENDING;
+  }
+
+  BinHeader hdr = ParseBinHeader(str.data());
+  cmd->binary = true;
+  cmd->bin.opcode = hdr.opcode;
+  cmd->bin.opaques.assign(1, hdr.opaque);
+  cmd->bin.value = string_view{};
+  cmd->key = string_view{};
+
+  if (hdr.body_len < uint32_t(hdr.key_len) + hdr.extras_len) {
+    // We can not find the next request, so the rest of the stream is dropped.
+    *consumed = str.size();
+    return PARSE_ERROR;
+  }
+
+  size_t total_len = kBinHeaderSize + size_t(hdr.body_len);
+  if (str.size() < total_len) {
+    parselen_hint_ = total_len;
+    return INPUT_PENDING;
+  }
+  *consumed = total_len;
+
+  cmd->type = FromBinary(BinOpcode(hdr.opcode), &cmd->bin.quiet);
+  if (cmd->type == INVALID)
+    return PARSE_ERROR;
+
+  cmd->bin.with_key = (hdr.opcode == BIN_GETK || hdr.opcode == BIN_GETKQ);
+  cmd->no_reply = false;
+  cmd->flags = 0;
+  cmd->expire_ts = 0;
+  cmd->cas_unique = 0;
+
+  const char* extras = str.data() + kBinHeaderSize;
+  cmd->key = str.substr(kBinHeaderSize + hdr.extras_len, hdr.key_len);
+  string_view value = str.substr(kBinHeaderSize + hdr.extras_len + hdr.key_len,
+                                 hdr.body_len - hdr.extras_len - hdr.key_len);
+  if (cmd->key.size() > 250)
+    return BAD_INT;
+
+  switch (cmd->type) {
+    case SET:
+    case ADD:
+    case REPLACE:
+      if (hdr.extras_len != 8 || cmd->key.empty())
+        return BAD_INT;
+      cmd->flags = absl::big_endian::Load32(extras);
+      cmd->expire_ts = absl::big_endian::Load32(extras + 4);
+      break;
+    case APPEND:
+    case PREPEND:
+    case DELETE:
+    case GET:
+      if (hdr.extras_len != 0 || cmd->key.empty())
+        return BAD_INT;
+      break;
+    case INCR:
+    case DECR:
+      // delta, initial value and expiration. We do not create missing counters.
+      if (hdr.extras_len != 20 || cmd->key.empty())
+        return BAD_INT;
+      cmd->delta = absl::big_endian::Load64(extras);
+      break;
+    default:
+      break;
+  }
+
+  if (IsStoreCmd(cmd->type)) {
+    if (hdr.cas) {  // See Service::DispatchMC.
+      cmd->type = CAS;
+      cmd->cas_unique = hdr.cas;
+    }
+    cmd->bytes_len = value.size();
+    cmd->bin.value = value;
+  }
+
+  // Clients pipeline multi-gets as a sequence of quiet gets, we serve them as a single multi get.
+  if (cmd->type == GET && cmd->bin.quiet) {
+    while (str.size() >= total_len + kBinHeaderSize) {
+      const char* next = str.data() + total_len;
+      if (uint8_t(next[0]) != kBinRequestMagic)
+        break;
+
+      BinHeader next_hdr = ParseBinHeader(next);
+      size_t next_len = kBinHeaderSize + size_t(next_hdr.body_len);
+      if (next_hdr.opcode != hdr.opcode || next_hdr.extras_len != 0 || next_hdr.key_len == 0 ||
+          next_hdr.key_len > 250 || next_hdr.body_len != next_hdr.key_len ||
+          str.size() < total_len + next_len) {
+        break;
+      }
+
+      cmd->keys_ext.push_back(str.substr(total_len + kBinHeaderSize, next_hdr.key_len));
+      cmd->bin.opaques.push_back(next_hdr.opaque);
+      total_len += next_len;
+    }
+    *consumed = total_len;
+  }
+
+  return OK;
+}
+
 auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
-  auto pos = str.find('\n');
   *consumed = 0;
+  parselen_hint_ = 0;
+  cmd->keys_ext.clear();
+  cmd->binary = false;
+
+  if (!str.empty() && uint8_t(str[0]) == kBinRequestMagic)
+    return ParseBinary(str, consumed, cmd);
+
+  auto pos = str.find('\n');
   if (pos == string_view::npos) {
-    // TODO: it's over simplified since we may process GET/GAT command that is not limited to
-    // 300 characters.
-    return str.size() > 300 ? PARSE_ERROR : INPUT_PENDING;
+    if (absl::StartsWith(str, "get") || absl::StartsWith(str, "gat")) {
+      if (str.size() > kMaxRetrievalLine)
+        return PARSE_ERROR;
+
+      // Let the connection grow its buffer until the line fits.
+      parselen_hint_ = str.size() * 2;
+      return INPUT_PENDING;
+    }
+    return str.size() > kMaxLine ? PARSE_ERROR : INPUT_PENDING;
   }
 
   if (pos == 0) {
@@ -117,7 +429,8 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
 
   // cas <key> <flags> <exptime> <bytes> <cas unique> [noreply]\r\n
   // get <key>*\r\n
-  string_view tokens[8];
+  // mg <key> <flag>*\r\n - meta commands may have many flags.
+  string_view tokens[16];
   unsigned num_tokens = 0;
   uint32_t cur = 0;
 
@@ -142,17 +455,31 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
   if (num_tokens == 0)
     return PARSE_ERROR;
 
-  while (cur < pos - 1) {
-    if (str[cur] != ' ')
-      return PARSE_ERROR;
-    ++cur;
+  cmd->type = From(tokens[0]);
+
+  // The keys of retrieval commands that do not fit into tokens.
+  string_view keys_tail;
+  if (cur < pos && IsRetrieval(cmd->type)) {
+    keys_tail = str.substr(cur, pos - cur);
+  } else {
+    while (cur < pos - 1) {
+      if (str[cur] != ' ')
+        return PARSE_ERROR;
+      ++cur;
+    }
   }
 
-  cmd->type = From(tokens[0]);
   if (cmd->type == INVALID) {
     return UNKNOWN_CMD;
   }
 
+  if (IsMetaCmd(cmd->type)) {
+    Result res = ParseMeta(tokens + 1, num_tokens - 1, cmd);
+    if (res == OK && cmd->type == META_SET)
+      parselen_hint_ = *consumed + cmd->bytes_len + 2;
+    return res;
+  }
+
   if (cmd->type <= CAS) {  // Store command
     if (num_tokens < 5 || tokens[1].size() > 250) {
       return MP::PARSE_ERROR;
@@ -161,7 +488,10 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
     // memcpy(single_key_, tokens[0].data(), tokens[0].size());  // we copy the key
     cmd->key = string_view{tokens[1].data(), tokens[1].size()};
 
-    return ParseStore(tokens + 2, num_tokens - 2, cmd);
+    Result res = ParseStore(tokens + 2, num_tokens - 2, cmd);
+    if (res == OK)
+      parselen_hint_ = *consumed + cmd->bytes_len + 2;
+    return res;
   }
 
   if (num_tokens == 1) {
@@ -170,7 +500,14 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
     return MP::PARSE_ERROR;
   }
 
-  return ParseValueless(tokens + 1, num_tokens - 1, cmd);
+  Result res = ParseValueless(tokens + 1, num_tokens - 1, cmd);
+  if (res == OK && !keys_tail.empty()) {
+    auto delim = absl::ByAnyChar(" \t\r");
+    for (string_view key : absl::StrSplit(keys_tail, delim, absl::SkipEmpty()))
+      cmd->keys_ext.push_back(key);
+  }
+
+  return res;
 };
 
 }  // namespace dfly
@@ -38,6 +38,90 @@ class MemcacheParser {
     INCR = 32,
     DECR = 33,
     FLUSHALL = 34,
+
+    // Meta commands, see https://github.com/memcached/memcached/wiki/MetaCommands
+    META_NOOP = 40,
+    META_GET = 41,
+    META_SET = 42,
+    META_DEL = 43,
+    META_ARITHM = 44,
+  };
+
+  // Flags of the meta commands. "q" is parsed into Command::no_reply, "F" into Command::flags,
+  // "C" into Command::cas_unique and "D" into Command::delta.
+  struct MetaFlags {
+    // Return flags, echoed in the reply.
+    bool return_value = false;  // v
+    bool return_flags = false;  // f
+    bool return_ttl = false;    // t
+    bool return_cas = false;    // c
+    bool return_key = false;    // k
+    bool return_size = false;   // s
+    std::string_view opaque;    // O
+
+    bool invalidate = false;  // I: md marks the item as stale instead of deleting it.
+    char mode = 0;            // M: ms - E,A,P,R,S; ma - I,+,D,-.
+
+    // TTLs in seconds, negative if not set.
+    int64_t new_ttl = -1;      // T: updates the TTL of the item.
+    int64_t vivify_ttl = -1;   // N: creates a missing item, the creator gets the win token.
+    int64_t recache_ttl = -1;  // R: win token for the first client that sees a lower TTL.
+
+    uint64_t initial = 0;  // J: initial value for ma with N.
+  };
+
+  // Binary protocol, see https://github.com/memcached/memcached/wiki/BinaryProtocolRevamped
+  static constexpr uint8_t kBinRequestMagic = 0x80;
+  static constexpr uint8_t kBinResponseMagic = 0x81;
+  static constexpr unsigned kBinHeaderSize = 24;
+
+  enum BinOpcode : uint8_t {
+    BIN_GET = 0x00,
+    BIN_SET = 0x01,
+    BIN_ADD = 0x02,
+    BIN_REPLACE = 0x03,
+    BIN_DELETE = 0x04,
+    BIN_INCR = 0x05,
+    BIN_DECR = 0x06,
+    BIN_QUIT = 0x07,
+    BIN_FLUSH = 0x08,
+    BIN_GETQ = 0x09,
+    BIN_NOOP = 0x0a,
+    BIN_VERSION = 0x0b,
+    BIN_GETK = 0x0c,
+    BIN_GETKQ = 0x0d,
+    BIN_APPEND = 0x0e,
+    BIN_PREPEND = 0x0f,
+
+    // Quiet versions of BIN_SET..BIN_FLUSH are at BIN_QUIET_OFFSET from them.
+    BIN_QUIET_OFFSET = 0x10,
+    BIN_APPENDQ = 0x19,
+    BIN_PREPENDQ = 0x1a,
+  };
+
+  enum BinStatus : uint16_t {
+    BIN_OK = 0,
+    BIN_KEY_NOT_FOUND = 0x01,
+    BIN_KEY_EXISTS = 0x02,
+    BIN_INVALID_ARGS = 0x04,
+    BIN_NOT_STORED = 0x05,
+    BIN_UNKNOWN_CMD = 0x81,
+  };
+
+  // Header fields of a binary request that are needed to build its reply.
+  struct BinaryRequest {
+    uint8_t opcode = 0;
+
+    // Quiet requests are not replied on success, quiet gets are not replied on a miss.
+    bool quiet = false;
+    bool with_key = false;  // GETK and GETKQ reply with the key.
+
+    // Opaque of every key of the command, since consecutive quiet gets are merged into
+    // a single multi-key get.
+    std::vector<uint32_t> opaques;
+
+    // Unlike the text protocol, the value of a store command is part of the request.
+    std::string_view value;
   };
 
   // According to https://github.com/memcached/memcached/wiki/Commands#standard-protocol
@@ -55,6 +139,11 @@ class MemcacheParser {
     uint32_t bytes_len = 0;
     uint32_t flags = 0;
     bool no_reply = false;
+
+    MetaFlags meta;
+
+    bool binary = false;  // Whether the request was in binary protocol.
+    BinaryRequest bin;
   };
 
   enum Result {
@@ -67,12 +156,27 @@ class MemcacheParser {
   };
 
   static bool IsStoreCmd(CmdType type) {
-    return type >= SET && type <= CAS;
+    return (type >= SET && type <= CAS) || type == META_SET;
+  }
+
+  static bool IsMetaCmd(CmdType type) {
+    return type >= META_NOOP;
   }
 
+  // Parses the next request, either text or binary, the latter are detected by their magic.
   Result Parse(std::string_view str, uint32_t* consumed, Command* res);
 
+  // Length of the whole request that was parsed last, including its value, if known.
+  // Connections use it to grow their read buffer, since a request is parsed only when the
+  // buffer holds all of it.
+  uint32_t parselen_hint() const {
+    return parselen_hint_;
+  }
+
  private:
+  Result ParseBinary(std::string_view str, uint32_t* consumed, Command* res);
+
+  uint32_t parselen_hint_ = 0;
 };
 
 }  // namespace dfly
@@ -7,6 +7,7 @@
 #include <gmock/gmock.h>
 
 #include "absl/strings/str_cat.h"
+#include "base/endian.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -16,6 +17,23 @@ using namespace std;
 
 namespace facade {
 
+namespace {
+
+string BinRequest(uint8_t opcode, string_view extras, string_view key, string_view value,
+                  uint32_t opaque = 0) {
+  string res(MemcacheParser::kBinHeaderSize, '\0');
+  res[0] = MemcacheParser::kBinRequestMagic;
+  res[1] = opcode;
+  absl::big_endian::Store16(res.data() + 2, key.size());
+  res[4] = extras.size();
+  absl::big_endian::Store32(res.data() + 8, extras.size() + key.size() + value.size());
+  absl::big_endian::Store32(res.data() + 12, opaque);
+  absl::StrAppend(&res, extras, key, value);
+  return res;
+}
+
+}  // namespace
+
 class MCParserTest : public testing::Test {
  protected:
   MemcacheParser parser_;
@@ -78,4 +96,113 @@ TEST_F(MCParserTest, Stats) {
   EXPECT_EQ(MemcacheParser::PARSE_ERROR, st);
 }
 
+TEST_F(MCParserTest, Meta) {
+  MemcacheParser::Result st = parser_.Parse("mg foo v t N30 Oab q\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::META_GET, cmd_.type);
+  EXPECT_EQ("foo", cmd_.key);
+  EXPECT_TRUE(cmd_.meta.return_value);
+  EXPECT_TRUE(cmd_.meta.return_ttl);
+  EXPECT_FALSE(cmd_.meta.return_cas);
+  EXPECT_EQ(30, cmd_.meta.vivify_ttl);
+  EXPECT_EQ(-1, cmd_.meta.recache_ttl);
+  EXPECT_EQ("ab", cmd_.meta.opaque);
+  EXPECT_TRUE(cmd_.no_reply);
+
+  st = parser_.Parse("ms foo 5 T10 F3 MA\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::META_SET, cmd_.type);
+  EXPECT_TRUE(MemcacheParser::IsStoreCmd(cmd_.type));
+  EXPECT_EQ(5, cmd_.bytes_len);
+  EXPECT_EQ(10, cmd_.meta.new_ttl);
+  EXPECT_EQ(3, cmd_.flags);
+  EXPECT_EQ('A', cmd_.meta.mode);
+  EXPECT_FALSE(cmd_.no_reply);
+
+  st = parser_.Parse("ma cnt D5 MD\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(5, cmd_.delta);
+
+  st = parser_.Parse("mn\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::META_NOOP, cmd_.type);
+
+  EXPECT_EQ(MemcacheParser::PARSE_ERROR, parser_.Parse("mg foo x\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::BAD_INT, parser_.Parse("mg foo Tx\r\n", &consumed_, &cmd_));
+}
+
+TEST_F(MCParserTest, ManyKeys) {
+  string line = "get";
+  for (unsigned i = 0; i < 100; ++i) {
+    absl::StrAppend(&line, " key", i);
+  }
+
+  // Long lines are pending until they are complete.
+  EXPECT_EQ(MemcacheParser::INPUT_PENDING, parser_.Parse(line, &consumed_, &cmd_));
+  EXPECT_GT(parser_.parselen_hint(), line.size());
+
+  line.append("\r\n");
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse(line, &consumed_, &cmd_));
+  EXPECT_EQ(line.size(), consumed_);
+  EXPECT_EQ(MemcacheParser::GET, cmd_.type);
+  EXPECT_EQ("key0", cmd_.key);
+  ASSERT_EQ(99, cmd_.keys_ext.size());
+  EXPECT_EQ("key99", cmd_.keys_ext.back());
+
+  // keys_ext is not carried over to the next command.
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse("get a\r\n", &consumed_, &cmd_));
+  EXPECT_TRUE(cmd_.keys_ext.empty());
+
+  EXPECT_EQ(MemcacheParser::PARSE_ERROR, parser_.Parse(string(400, 'x'), &consumed_, &cmd_));
+}
+
+TEST_F(MCParserTest, Binary) {
+  string extras(8, '\0');
+  absl::big_endian::Store32(extras.data(), 7);
+  absl::big_endian::Store32(extras.data() + 4, 100);
+  string req = BinRequest(MemcacheParser::BIN_SET, extras, "foo", "bar", 5);
+
+  EXPECT_EQ(MemcacheParser::INPUT_PENDING,
+            parser_.Parse(req.substr(0, req.size() - 1), &consumed_, &cmd_));
+  EXPECT_EQ(req.size(), parser_.parselen_hint());
+
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse(req, &consumed_, &cmd_));
+  EXPECT_EQ(req.size(), consumed_);
+  EXPECT_TRUE(cmd_.binary);
+  EXPECT_EQ(MemcacheParser::SET, cmd_.type);
+  EXPECT_EQ("foo", cmd_.key);
+  EXPECT_EQ("bar", cmd_.bin.value);
+  EXPECT_EQ(7, cmd_.flags);
+  EXPECT_EQ(100, cmd_.expire_ts);
+  EXPECT_THAT(cmd_.bin.opaques, ElementsAre(5));
+  EXPECT_FALSE(cmd_.bin.quiet);
+
+  // Consecutive quiet gets are merged into a single command.
+  req = BinRequest(MemcacheParser::BIN_GETKQ, "", "a", "", 1) +
+        BinRequest(MemcacheParser::BIN_GETKQ, "", "b", "", 2) +
+        BinRequest(MemcacheParser::BIN_GETKQ, "", "c", "", 3);
+  string noop = BinRequest(MemcacheParser::BIN_NOOP, "", "", "", 4);
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse(req + noop, &consumed_, &cmd_));
+  EXPECT_EQ(req.size(), consumed_);
+  EXPECT_EQ(MemcacheParser::GET, cmd_.type);
+  EXPECT_TRUE(cmd_.bin.quiet);
+  EXPECT_TRUE(cmd_.bin.with_key);
+  EXPECT_EQ("a", cmd_.key);
+  EXPECT_THAT(cmd_.keys_ext, ElementsAre("b", "c"));
+  EXPECT_THAT(cmd_.bin.opaques, ElementsAre(1, 2, 3));
+
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse(noop, &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::META_NOOP, cmd_.type);
+
+  EXPECT_EQ(MemcacheParser::OK, parser_.Parse(BinRequest(0x19, "", "k", "v"), &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::APPEND, cmd_.type);
+  EXPECT_TRUE(cmd_.bin.quiet);
+
+  EXPECT_EQ(MemcacheParser::PARSE_ERROR,
+            parser_.Parse(BinRequest(0x70, "", "", ""), &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::BAD_INT,
+            parser_.Parse(BinRequest(MemcacheParser::BIN_SET, "", "foo", "bar"), &consumed_,
+                          &cmd_));
+}
+
 }  // namespace facade
@@ -0,0 +1,116 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "base/logging.h"
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+vector<int> ReadCpuNodes() {
+  vector<int> res;
+  error_code ec;
+  for (const auto& entry : filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+    string filename = entry.path().filename();
+    string_view name = filename;
+    unsigned node;
+    if (!absl::ConsumePrefix(&name, "node") || !absl::SimpleAtoi(name, &node))
+      continue;
+
+    ifstream file(entry.path() / "cpulist");
+    string list;
+    vector<int> cpus;
+    if (!getline(file, list) || !ParseCpuList(list, &cpus)) {
+      LOG(WARNING) << "Could not read the cpus of numa node " << node;
+      continue;
+    }
+
+    for (int cpu : cpus) {
+      if (unsigned(cpu) >= res.size())
+        res.resize(cpu + 1, -1);
+      res[cpu] = node;
+    }
+  }
+
+  return res;
+}
+
+}  // namespace
+
+bool ParseCpuList(string_view list, vector<int>* cpus) {
+  cpus->clear();
+  list = absl::StripAsciiWhitespace(list);
+  if (list.empty())
+    return true;
+
+  for (string_view range : absl::StrSplit(list, ',')) {
+    pair<string_view, string_view> bounds = absl::StrSplit(range, absl::MaxSplits('-', 1));
+    unsigned first, last;
+    if (!absl::SimpleAtoi(bounds.first, &first))
+      return false;
+    last = first;
+    if (!bounds.second.empty() && !absl::SimpleAtoi(bounds.second, &last))
+      return false;
+    if (last < first)
+      return false;
+    for (unsigned cpu = first; cpu <= last; ++cpu)
+      cpus->push_back(cpu);
+  }
+  return true;
+}
+
+NumaTopology::NumaTopology(vector<int> cpu_node) : cpu_node_(std::move(cpu_node)) {
+  int max_node = *max_element(cpu_node_.begin(), cpu_node_.end());
+  num_nodes_ = max(max_node, 0) + 1;
+}
+
+const NumaTopology& NumaTopology::Get() {
+  static const NumaTopology topology = [] {
+    vector<int> cpu_node = ReadCpuNodes();
+    if (cpu_node.empty()) {
+      // Not a NUMA kernel, all the cpus are on node 0.
+      cpu_node.assign(max(sysconf(_SC_NPROCESSORS_CONF), 1L), 0);
+    }
+    return NumaTopology{std::move(cpu_node)};
+  }();
+  return topology;
+}
+
+int NumaTopology::CurrentNode() const {
+  return NodeOfCpu(sched_getcpu());
+}
+
+bool NumaTopology::PreferThreadMemory(int node) {
+  constexpr unsigned kMaskBits = sizeof(unsigned long) * 8;
+  if (node < 0 || unsigned(node) >= kMaskBits)
+    return false;
+
+  // libnuma wraps the same syscall, which we call directly to avoid the dependency.
+  unsigned long mask = 1UL << node;
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, kMaskBits) != 0) {
+    LOG(WARNING) << "Could not set the memory policy of node " << node << ": "
+                 << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace facade
@@ -0,0 +1,52 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+namespace facade {
+
+// The NUMA nodes of the cpus, as listed under /sys/devices/system/node. A machine without
+// that directory has a single node with all the cpus.
+class NumaTopology {
+ public:
+  // Reads the topology once.
+  static const NumaTopology& Get();
+
+  explicit NumaTopology(std::vector<int> cpu_node);
+
+  unsigned num_nodes() const {
+    return num_nodes_;
+  }
+
+  unsigned num_cpus() const {
+    return cpu_node_.size();
+  }
+
+  // -1 if the cpu is unknown.
+  int NodeOfCpu(int cpu) const {
+    return cpu >= 0 && unsigned(cpu) < cpu_node_.size() ? cpu_node_[cpu] : -1;
+  }
+
+  // The node of the cpu that the calling thread runs on, which is stable for the proactor
+  // threads since they are pinned to their cpus.
+  int CurrentNode() const;
+
+  // Makes the kernel prefer the memory of node for the pages that the calling thread faults
+  // in, falling back to the other nodes when it is full. Returns false if the policy could not
+  // be set.
+  static bool PreferThreadMemory(int node);
+
+ private:
+  std::vector<int> cpu_node_;
+  unsigned num_nodes_ = 1;
+};
+
+// Parses a cpu list of the kernel, e.g. "0-3,8,10-11", into cpus. Returns false if list is
+// malformed.
+bool ParseCpuList(std::string_view list, std::vector<int>* cpus);
+
+}  // namespace facade
@@ -0,0 +1,43 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include <gmock/gmock.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+TEST(NumaTest, ParseCpuList) {
+  vector<int> cpus;
+  ASSERT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_THAT(cpus, ElementsAre(0, 1, 2, 3, 8, 10, 11));
+
+  ASSERT_TRUE(ParseCpuList("", &cpus));
+  EXPECT_THAT(cpus, IsEmpty());
+
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("0,a", &cpus));
+}
+
+TEST(NumaTest, Topology) {
+  NumaTopology topology({0, 0, 1, 1, -1});
+  EXPECT_EQ(2u, topology.num_nodes());
+  EXPECT_EQ(5u, topology.num_cpus());
+  EXPECT_EQ(1, topology.NodeOfCpu(3));
+  EXPECT_EQ(-1, topology.NodeOfCpu(4));
+  EXPECT_EQ(-1, topology.NodeOfCpu(100));
+
+  // Every cpu of the machine has a node.
+  const NumaTopology& local = NumaTopology::Get();
+  EXPECT_GE(local.num_nodes(), 1u);
+  EXPECT_GE(local.CurrentNode(), 0);
+}
+
+}  // namespace facade
@@ -16,6 +16,16 @@ namespace {
 constexpr int kMaxArrayLen = 65536;
 constexpr int64_t kMaxBulkLen = 64 * (1ul << 20);  // 64MB.
 
+// Maps, sets and pushes are parsed as arrays, maps with their keys and values interleaved.
+inline bool IsResp3Aggregate(uint8_t c) {
+  return c == '%' || c == '~' || c == '>';
+}
+
+// Nulls, doubles and big numbers.
+inline bool IsResp3Scalar(uint8_t c) {
+  return c == '_' || c == ',' || c == '(';
+}
+
 }  // namespace
 
 auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> Result {
@@ -44,8 +54,10 @@ auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> R
         last_result_ = ConsumeArrayLen(str);
         break;
       case PARSE_ARG_S:
-        if (str.size() < 4) {
+        if (str.size() < 3) {  // The shortest argument is RESP3 null "_\r\n".
           last_result_ = INPUT_PENDING;
+        } else if (server_mode_) {
+          last_result_ = ParseBulkArgs(str);
         } else {
           last_result_ = ParseArg(str);
         }
@@ -106,7 +118,15 @@ void RedisParser::InitStart(uint8_t prefix_b, RespExpr::Vec* res) {
       state_ = ARRAY_LEN_S;
       break;
     default:
-      state_ = INLINE_S;
+      // RESP3 types are only sent by servers.
+      if (!server_mode_ && IsResp3Aggregate(prefix_b)) {
+        state_ = ARRAY_LEN_S;
+      } else if (!server_mode_ && IsResp3Scalar(prefix_b)) {
+        state_ = PARSE_ARG_S;
+        parse_stack_.emplace_back(1, cached_expr_);
+      } else {
+        state_ = INLINE_S;
+      }
       break;
   }
 }
@@ -247,6 +267,9 @@ auto RedisParser::ConsumeArrayLen(Buffer str) -> Result {
       LOG(ERROR) << "Unexpected result " << res;
   }
 
+  if (str[0] == '%' && len > 0)
+    len *= 2;
+
   if (server_mode_ && (parse_stack_.size() > 0 || !cached_expr_->empty()))
     return BAD_STRING;
 
@@ -319,14 +342,20 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
     return BAD_BULKLEN;
   }
 
-  if (c == '*') {
+  if (c == '*' || IsResp3Aggregate(c)) {
     return ConsumeArrayLen(str);
   }
 
   char* s = reinterpret_cast<char*>(str.data() + 1);
   char* eol = reinterpret_cast<char*>(memchr(s, '\n', str.size() - 1));
 
-  if (c == '+' || c == '-') {  // Simple string or error.
+  if (c == '_') {
+    if (!eol) {
+      return INPUT_PENDING;
+    }
+    cached_expr_->emplace_back(RespExpr::NIL);
+    cached_expr_->back().u = Buffer{};
+  } else if (c == '+' || c == '-' || c == ',' || c == '(') {  // Simple string, error or number.
     DCHECK(!server_mode_);
     if (!eol) {
       return str.size() < 256 ? INPUT_PENDING : BAD_STRING;
@@ -334,7 +363,7 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
     if (eol[-1] != '\r')
       return BAD_STRING;
 
-    cached_expr_->emplace_back(c == '+' ? RespExpr::STRING : RespExpr::ERROR);
+    cached_expr_->emplace_back(c == '-' ? RespExpr::ERROR : RespExpr::STRING);
     cached_expr_->back().u = Buffer{reinterpret_cast<uint8_t*>(s), size_t((eol - 1) - s)};
   } else if (c == ':') {
     DCHECK(!server_mode_);
@@ -358,6 +387,62 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
   return OK;
 }
 
+auto RedisParser::ParseBulkArgs(Buffer str) -> Result {
+  DCHECK(server_mode_);
+  DCHECK_EQ(1u, parse_stack_.size());
+
+  if (is_broken_token_)
+    return ParseArg(str);
+
+  const uint8_t* begin = str.data();
+  const uint8_t* end = begin + str.size();
+  const uint8_t* next = begin;
+  uint32_t& remaining = parse_stack_.back().first;
+
+  while (remaining > 0) {
+    // The shortest bulk string is "$0\r\n\r\n".
+    if (end - next < 6 || *next != '$')
+      break;
+
+    // Parses the length in place. Negative, malformed or too long lengths are left to ParseArg,
+    // which reports the proper error.
+    const uint8_t* ptr = next + 1;
+    const uint8_t* num_end = std::min(end, ptr + 9);
+    int64_t len = 0;
+    while (ptr < num_end && *ptr >= '0' && *ptr <= '9') {
+      len = len * 10 + (*ptr - '0');
+      ++ptr;
+    }
+
+    if (ptr == next + 1 || ptr == num_end || len > kMaxBulkLen)
+      break;
+
+    // ptr points to "\r\n" followed by the string and its "\r\n".
+    if (size_t(end - ptr) < size_t(len) + 4 || ptr[0] != '\r' || ptr[1] != '\n')
+      break;
+
+    ptr += 2;
+    if (ptr[len] != '\r' || ptr[len + 1] != '\n')
+      break;
+
+    cached_expr_->emplace_back(RespExpr::STRING);
+    cached_expr_->back().u = Buffer{const_cast<uint8_t*>(ptr), size_t(len)};
+    next = ptr + len + 2;
+    --remaining;
+  }
+
+  if (next == begin)
+    return ParseArg(str);
+
+  if (remaining == 0) {
+    parse_stack_.pop_back();
+    state_ = CMD_COMPLETE_S;
+  }
+  last_consumed_ = next - begin;
+
+  return OK;
+}
+
 auto RedisParser::ConsumeBulk(Buffer str) -> Result {
   auto& bulk_str = get<Buffer>(cached_expr_->back().u);
 
@@ -406,6 +491,34 @@ auto RedisParser::ConsumeBulk(Buffer str) -> Result {
   return INPUT_PENDING;
 }
 
+auto RedisParser::BulkTail() -> Buffer {
+  if (state_ != BULK_STR_S || !is_broken_token_ || bulk_len_ == 0)
+    return Buffer{};
+
+  const Buffer& bulk_str = get<Buffer>(cached_expr_->back().u);
+  return Buffer{bulk_str.end(), bulk_len_};
+}
+
+void RedisParser::CommitBulkTail(size_t len) {
+  DCHECK(state_ == BULK_STR_S && is_broken_token_);
+  DCHECK_LE(len, bulk_len_);
+
+  auto& bulk_str = get<Buffer>(cached_expr_->back().u);
+  bulk_str = Buffer{bulk_str.data(), bulk_str.size() + len};
+  bulk_len_ -= len;
+}
+
+auto RedisParser::ReleaseBlob(const uint8_t* data) -> BlobPtr {
+  for (auto it = buf_stash_.rbegin(); it != buf_stash_.rend(); ++it) {
+    if (it->get() == data) {
+      BlobPtr res = std::move(*it);
+      buf_stash_.erase(std::next(it).base());
+      return res;
+    }
+  }
+  return BlobPtr{};
+}
+
 void RedisParser::HandleFinishArg() {
   state_ = PARSE_ARG_S;
   DCHECK(!parse_stack_.empty());
@@ -20,6 +20,7 @@ class RedisParser {
  public:
   enum Result { OK, INPUT_PENDING, BAD_ARRAYLEN, BAD_BULKLEN, BAD_STRING, BAD_INT };
   using Buffer = RespExpr::Buffer;
+  using BlobPtr = std::unique_ptr<uint8_t[]>;
 
   explicit RedisParser(bool server_mode = true) : server_mode_(server_mode) {
   }
@@ -54,6 +55,17 @@ class RedisParser {
     return stash_;
   }
 
+  // When a bulk string that did not fit into the input is being parsed, returns the part of its
+  // buffer that has not been received yet. The caller may read directly into it and report
+  // the received bytes via CommitBulkTail() instead of passing them through Parse().
+  // Returns an empty buffer otherwise.
+  Buffer BulkTail();
+  void CommitBulkTail(size_t len);
+
+  // Transfers the ownership of the parser buffer that starts at data, if there is one.
+  // Valid only for the arguments of the last successfully parsed command.
+  BlobPtr ReleaseBlob(const uint8_t* data);
+
  private:
   void InitStart(uint8_t prefix_b, RespVec* res);
   void StashState(RespVec* res);
@@ -61,6 +73,11 @@ class RedisParser {
   // Skips the first character (*).
   Result ConsumeArrayLen(Buffer str);
   Result ParseArg(Buffer str);
+
+  // Server-mode fast path for pipelines of small commands: consumes all the bulk strings of the
+  // current array that are entirely in str without going through the state machine per
+  // argument. Falls back to ParseArg if it could not consume anything.
+  Result ParseBulkArgs(Buffer str);
   Result ConsumeBulk(Buffer str);
   Result ParseInline(Buffer str);
 
@@ -90,7 +107,6 @@ class RedisParser {
   absl::InlinedVector<std::pair<uint32_t, RespVec*>, 4> parse_stack_;
   std::vector<std::unique_ptr<RespVec>> stash_;
 
-  using BlobPtr = std::unique_ptr<uint8_t[]>;
   std::vector<BlobPtr> buf_stash_;
   RespVec* cached_expr_ = nullptr;
   bool is_broken_token_ = false;
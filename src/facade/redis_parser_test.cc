@@ -146,6 +146,23 @@ TEST_F(RedisParserTest, ClientMode) {
   EXPECT_THAT(args_, ElementsAre(ErrArg("ERR foo")));
 }
 
+TEST_F(RedisParserTest, Resp3) {
+  parser_.SetClientMode();
+
+  ASSERT_EQ(RedisParser::OK, Parse("_\r\n"));
+  EXPECT_THAT(args_, ElementsAre(ArgType(RespExpr::NIL)));
+
+  ASSERT_EQ(RedisParser::OK, Parse(",3.5\r\n"));
+  EXPECT_THAT(args_, ElementsAre("3.5"));
+
+  ASSERT_EQ(RedisParser::OK, Parse("%2\r\n$1\r\na\r\n:1\r\n$1\r\nb\r\n_\r\n"));
+  EXPECT_THAT(args_, ElementsAre("a", IntArg(1), "b", ArgType(RespExpr::NIL)));
+
+  ASSERT_EQ(RedisParser::OK, Parse(">2\r\n$7\r\nmessage\r\n~1\r\n(123\r\n"));
+  ASSERT_THAT(args_, ElementsAre("message", ArrArg(1)));
+  EXPECT_THAT(args_[1].GetVec(), ElementsAre("123"));
+}
+
 TEST_F(RedisParserTest, Hierarchy) {
   parser_.SetClientMode();
 
@@ -191,4 +208,69 @@ TEST_F(RedisParserTest, LargeBulk) {
   ASSERT_EQ(RedisParser::OK, Parse("\r\n"));
 }
 
+TEST_F(RedisParserTest, BulkTail) {
+  EXPECT_TRUE(parser_.BulkTail().empty());
+
+  string half(512, 'a');
+  ASSERT_EQ(RedisParser::INPUT_PENDING, Parse(absl::StrCat("*1\r\n$1024\r\n", half)));
+  RedisParser::Buffer tail = parser_.BulkTail();
+  ASSERT_EQ(512, tail.size());
+
+  memset(tail.data(), 'b', tail.size());
+  parser_.CommitBulkTail(tail.size());
+  EXPECT_TRUE(parser_.BulkTail().empty());
+
+  ASSERT_EQ(RedisParser::OK, Parse("\r\n"));
+  ASSERT_THAT(args_, ElementsAre(absl::StrCat(half, string(512, 'b'))));
+
+  RedisParser::BlobPtr blob = parser_.ReleaseBlob(args_[0].GetBuf().data());
+  ASSERT_TRUE(blob);
+  EXPECT_EQ(blob.get(), args_[0].GetBuf().data());
+  EXPECT_FALSE(parser_.ReleaseBlob(args_[0].GetBuf().data()));
+}
+
+TEST_F(RedisParserTest, Pipeline) {
+  string batch;
+  for (unsigned i = 0; i < 3; ++i) {
+    absl::StrAppend(&batch, "*3\r\n$3\r\nSET\r\n$4\r\nkey", i, "\r\n$3\r\nval\r\n");
+  }
+  absl::StrAppend(&batch, "*2\r\n$3\r\nGET\r\n$4\r\nke");
+
+  RedisParser::Buffer buf{reinterpret_cast<uint8_t*>(batch.data()), batch.size()};
+  for (unsigned i = 0; i < 3; ++i) {
+    ASSERT_EQ(RedisParser::OK, parser_.Parse(buf, &consumed_, &args_));
+    EXPECT_EQ(32, consumed_);
+    EXPECT_THAT(args_, ElementsAre("SET", absl::StrCat("key", i), "val"));
+    buf.remove_prefix(consumed_);
+  }
+
+  ASSERT_EQ(RedisParser::INPUT_PENDING, parser_.Parse(buf, &consumed_, &args_));
+  EXPECT_EQ(17, consumed_);
+  ASSERT_EQ(RedisParser::OK, Parse("key0\r\n"));
+  EXPECT_THAT(args_, ElementsAre("GET", "key0"));
+
+  ASSERT_EQ(RedisParser::BAD_ARRAYLEN, Parse("*2\r\n$3\r\nGET\r\n$-x\r\n"));
+}
+
+static void BM_ParsePipeline(benchmark::State& state) {
+  string batch;
+  for (int i = 0; i < state.range(0); ++i) {
+    absl::StrAppend(&batch, "*3\r\n$3\r\nSET\r\n$16\r\nkey:", absl::Dec(i, absl::kZeroPad12),
+                    "\r\n$3\r\nval\r\n");
+  }
+
+  RedisParser parser;
+  RespVec args;
+  uint32_t consumed;
+
+  while (state.KeepRunning()) {
+    RedisParser::Buffer buf{reinterpret_cast<uint8_t*>(batch.data()), batch.size()};
+    while (!buf.empty()) {
+      CHECK_EQ(RedisParser::OK, parser.Parse(buf, &consumed, &args));
+      buf.remove_prefix(consumed);
+    }
+  }
+}
+BENCHMARK(BM_ParsePipeline)->Arg(1)->Arg(16)->Arg(256);
+
 }  // namespace facade
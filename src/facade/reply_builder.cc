@@ -6,10 +6,13 @@
 #include <absl/container/fixed_array.h>
 #include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/strip.h>
 #include <double-conversion/double-to-string.h>
 
+#include "base/endian.h"
 #include "base/logging.h"
 #include "facade/error.h"
+#include "facade/fault_injection.h"
 
 using namespace std;
 using absl::StrAppend;
@@ -24,6 +27,12 @@ inline iovec constexpr IoVec(std::string_view s) {
   return r;
 }
 
+// Batched replies are sent once they reach this size, together with the reply that crossed it.
+constexpr size_t kMaxBatchSize = 16384;
+
+// Well below IOV_MAX, Send may also prepend the batched replies.
+constexpr size_t kMaxIovPerSend = 512;
+
 constexpr char kCRLF[] = "\r\n";
 constexpr char kErrPref[] = "-ERR ";
 constexpr char kSimplePref[] = "+";
@@ -33,6 +42,32 @@ constexpr unsigned kConvFlags =
 
 DoubleToStringConverter dfly_conv(kConvFlags, "inf", "nan", 'e', -6, 21, 6, 0);
 
+char CollectionPrefix(RedisReplyBuilder::CollectionType type) {
+  switch (type) {
+    case RedisReplyBuilder::SET:
+      return '~';
+    case RedisReplyBuilder::MAP:
+      return '%';
+    case RedisReplyBuilder::PUSH:
+      return '>';
+    default:
+      return '*';
+  }
+}
+
+void FillBinHeader(uint8_t opcode, uint16_t status, uint8_t extras_len, uint16_t key_len,
+                   uint32_t body_len, uint32_t opaque, uint64_t cas, char* dest) {
+  dest[0] = MemcacheParser::kBinResponseMagic;
+  dest[1] = opcode;
+  absl::big_endian::Store16(dest + 2, key_len);
+  dest[4] = extras_len;
+  dest[5] = 0;  // data type.
+  absl::big_endian::Store16(dest + 6, status);
+  absl::big_endian::Store32(dest + 8, body_len);
+  absl::big_endian::Store32(dest + 12, opaque);
+  absl::big_endian::Store64(dest + 16, cas);
+}
+
 }  // namespace
 
 SinkReplyBuilder::SinkReplyBuilder(::io::Sink* sink) : sink_(sink) {
@@ -47,13 +82,21 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   DCHECK(sink_);
 
   if (should_batch_) {
-    // TODO: to introduce flushing when too much data is batched.
+    size_t total = batch_.size();
     for (unsigned i = 0; i < len; ++i) {
-      std::string_view src((char*)v[i].iov_base, v[i].iov_len);
-      DVLOG(2) << "Appending to stream " << sink_ << " " << src;
-      batch_.append(src.data(), src.size());
+      total += v[i].iov_len;
+    }
+
+    // Large replies are not copied, they are sent right away in the same writev as the batch.
+    // This also keeps the capacity of batch_, which we reuse across flushes, bounded.
+    if (total < kMaxBatchSize) {
+      for (unsigned i = 0; i < len; ++i) {
+        std::string_view src((char*)v[i].iov_base, v[i].iov_len);
+        DVLOG(2) << "Appending to stream " << sink_ << " " << src;
+        batch_.append(src.data(), src.size());
+      }
+      return;
     }
-    return;
   }
 
   error_code ec;
@@ -63,6 +106,8 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
     io_write_bytes_ += v[i].iov_len;
   }
 
+  InjectFault(FaultPoint::SOCKET_WRITE);
+
   if (batch_.empty()) {
     ec = sink_->Write(v, len);
   } else {
@@ -83,6 +128,16 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   }
 }
 
+void SinkReplyBuilder::FlushBatch() {
+  if (batch_.empty())
+    return;
+
+  bool should_batch = should_batch_;
+  should_batch_ = false;
+  Send(nullptr, 0);
+  should_batch_ = should_batch;
+}
+
 void SinkReplyBuilder::SendRaw(std::string_view raw) {
   iovec v = {IoVec(raw)};
 
@@ -103,6 +158,16 @@ MCReplyBuilder::MCReplyBuilder(::io::Sink* sink) : SinkReplyBuilder(sink) {
 }
 
 void MCReplyBuilder::SendSimpleString(std::string_view str) {
+  if (bin_req_) {
+    if (bin_req_->bin.opcode == MemcacheParser::BIN_VERSION) {
+      absl::ConsumePrefix(&str, "VERSION ");
+      SendBinaryStatus(MemcacheParser::BIN_OK, str);
+    } else {
+      SendBinaryStatus(MemcacheParser::BIN_OK);
+    }
+    return;
+  }
+
   iovec v[2] = {IoVec(str), IoVec(kCRLF)};
 
   Send(v, ABSL_ARRAYSIZE(v));
@@ -113,13 +178,29 @@ void MCReplyBuilder::SendStored() {
 }
 
 void MCReplyBuilder::SendLong(long val) {
+  if (bin_req_) {
+    if (!bin_req_->bin.quiet) {
+      char buf[8];
+      absl::big_endian::Store64(buf, val);
+      SendBinary(MemcacheParser::BIN_OK, "", "", string_view(buf, 8), bin_req_->bin.opaques[0]);
+    }
+    return;
+  }
+
   char buf[32];
   char* next = absl::numbers_internal::FastIntToBuffer(val, buf);
   SendSimpleString(string_view(buf, next - buf));
 }
 
 void MCReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
+  if (bin_req_) {
+    SendBinaryMGet(resp, count);
+    return;
+  }
+
+  // The headers are formatted first, so that the iovecs can point into them.
   string header;
+  vector<size_t> header_end;
   for (unsigned i = 0; i < count; ++i) {
     if (resp[i]) {
       const auto& src = *resp[i];
@@ -129,31 +210,147 @@ void MCReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
       }
 
       absl::StrAppend(&header, "\r\n");
-      iovec v[] = {IoVec(header), IoVec(src.value), IoVec(kCRLF)};
-      Send(v, ABSL_ARRAYSIZE(v));
-      header.clear();
+      header_end.push_back(header.size());
+    }
+  }
+
+  // All the values go out together instead of a write per key.
+  vector<iovec> v;
+  v.reserve(header_end.size() * 3 + 1);
+  size_t start = 0;
+  for (unsigned i = 0, j = 0; i < count; ++i) {
+    if (resp[i]) {
+      v.push_back(IoVec(string_view(header).substr(start, header_end[j] - start)));
+      v.push_back(IoVec(resp[i]->value));
+      v.push_back(IoVec(kCRLF));
+      start = header_end[j++];
+    }
+  }
+  v.push_back(IoVec("END\r\n"));
+  SendIovecs(v);
+}
+
+void MCReplyBuilder::SendBinaryMGet(const OptResp* resp, uint32_t count) {
+  constexpr size_t kHitHeaderSize = MemcacheParser::kBinHeaderSize + 4;  // With flags extras.
+
+  const auto& bin = bin_req_->bin;
+  string header(count * kHitHeaderSize, '\0');
+  vector<iovec> v;
+  v.reserve(count * 3);
+
+  for (unsigned i = 0; i < count; ++i) {
+    char* dest = header.data() + i * kHitHeaderSize;
+    uint32_t opaque = i < bin.opaques.size() ? bin.opaques[i] : 0;
+    string_view key = bin.with_key ? (i == 0 ? bin_req_->key : bin_req_->keys_ext[i - 1]) : "";
+
+    if (resp[i]) {
+      const auto& src = *resp[i];
+      FillBinHeader(bin.opcode, MemcacheParser::BIN_OK, 4, key.size(),
+                    4 + key.size() + src.value.size(), opaque, src.mc_ver, dest);
+      absl::big_endian::Store32(dest + MemcacheParser::kBinHeaderSize, src.mc_flag);
+      v.push_back(IoVec(string_view(dest, kHitHeaderSize)));
+      v.push_back(IoVec(key));
+      v.push_back(IoVec(src.value));
+    } else if (!bin.quiet) {
+      FillBinHeader(bin.opcode, MemcacheParser::BIN_KEY_NOT_FOUND, 0, key.size(), key.size(),
+                    opaque, 0, dest);
+      v.push_back(IoVec(string_view(dest, MemcacheParser::kBinHeaderSize)));
+      v.push_back(IoVec(key));
     }
   }
-  SendSimpleString("END");
+
+  SendIovecs(v);
+}
+
+void MCReplyBuilder::SendIovecs(const vector<iovec>& v) {
+  for (size_t i = 0; i < v.size(); i += kMaxIovPerSend) {
+    Send(v.data() + i, std::min(kMaxIovPerSend, v.size() - i));
+  }
 }
 
 void MCReplyBuilder::SendError(string_view str, std::string_view type) {
+  if (bin_req_) {
+    SendBinaryStatus(MemcacheParser::BIN_UNKNOWN_CMD, "Unknown command");
+    return;
+  }
   SendSimpleString("ERROR");
 }
 
 void MCReplyBuilder::SendClientError(string_view str) {
+  if (bin_req_) {
+    SendBinaryStatus(MemcacheParser::BIN_INVALID_ARGS, str);
+    return;
+  }
   iovec v[] = {IoVec("CLIENT_ERROR "), IoVec(str), IoVec(kCRLF)};
   Send(v, ABSL_ARRAYSIZE(v));
 }
 
 void MCReplyBuilder::SendSetSkipped() {
+  if (bin_req_) {
+    // Follows the statuses of memcached.
+    uint16_t status = MemcacheParser::BIN_NOT_STORED;
+    if (bin_req_->type == MemcacheParser::ADD) {
+      status = MemcacheParser::BIN_KEY_EXISTS;
+    } else if (bin_req_->type == MemcacheParser::REPLACE) {
+      status = MemcacheParser::BIN_KEY_NOT_FOUND;
+    }
+    SendBinaryStatus(status);
+    return;
+  }
   SendSimpleString("NOT_STORED");
 }
 
 void MCReplyBuilder::SendNotFound() {
+  if (bin_req_) {
+    SendBinaryStatus(MemcacheParser::BIN_KEY_NOT_FOUND, "Not found");
+    return;
+  }
   SendSimpleString("NOT_FOUND");
 }
 
+void MCReplyBuilder::SendExists() {
+  if (bin_req_) {
+    SendBinaryStatus(MemcacheParser::BIN_KEY_EXISTS);
+    return;
+  }
+  SendSimpleString("EXISTS");
+}
+
+void MCReplyBuilder::SendMeta(string_view code, string_view flags) {
+  if (bin_req_) {  // NOOP
+    SendBinaryStatus(MemcacheParser::BIN_OK);
+    return;
+  }
+  iovec v[] = {IoVec(code), IoVec(flags), IoVec(kCRLF)};
+  Send(v, ABSL_ARRAYSIZE(v));
+}
+
+void MCReplyBuilder::SendMetaValue(string_view value, string_view flags) {
+  char buf[32];
+  char* next = absl::numbers_internal::FastIntToBuffer(value.size(), buf);
+  iovec v[] = {IoVec("VA "),  IoVec(string_view(buf, next - buf)), IoVec(flags),
+               IoVec(kCRLF), IoVec(value),                          IoVec(kCRLF)};
+  Send(v, ABSL_ARRAYSIZE(v));
+}
+
+void MCReplyBuilder::SendBinary(uint16_t status, string_view extras, string_view key,
+                                string_view value, uint32_t opaque) {
+  char header[MemcacheParser::kBinHeaderSize];
+  FillBinHeader(bin_req_->bin.opcode, status, extras.size(), key.size(),
+                extras.size() + key.size() + value.size(), opaque, 0, header);
+
+  iovec v[] = {IoVec(string_view(header, sizeof(header))), IoVec(extras), IoVec(key),
+               IoVec(value)};
+  Send(v, ABSL_ARRAYSIZE(v));
+}
+
+void MCReplyBuilder::SendBinaryStatus(uint16_t status, string_view value) {
+  if (status == MemcacheParser::BIN_OK && bin_req_->bin.quiet)
+    return;
+
+  SendBinary(status, "", "", value, bin_req_->bin.opaques[0]);
+}
+
 char* RedisReplyBuilder::FormatDouble(double val, char* dest, unsigned dest_len) {
   StringBuilder sb(dest, dest_len);
   CHECK(dfly_conv.ToShortest(val, &sb));
@@ -197,8 +394,9 @@ void RedisReplyBuilder::SendSetSkipped() {
 
 void RedisReplyBuilder::SendNull() {
   constexpr char kNullStr[] = "$-1\r\n";
+  constexpr char kResp3NullStr[] = "_\r\n";
 
-  iovec v[] = {IoVec(kNullStr)};
+  iovec v[] = {IoVec(is_resp3_ ? kResp3NullStr : kNullStr)};
 
   Send(v, ABSL_ARRAYSIZE(v));
 }
@@ -268,7 +466,20 @@ void RedisReplyBuilder::SendDouble(double val) {
   StringBuilder sb(buf, sizeof(buf));
   CHECK(dfly_conv.ToShortest(val, &sb));
 
-  SendBulkString(sb.Finalize());
+  if (is_resp3_) {
+    iovec v[] = {IoVec(","), IoVec(sb.Finalize()), IoVec(kCRLF)};
+    Send(v, ABSL_ARRAYSIZE(v));
+  } else {
+    SendBulkString(sb.Finalize());
+  }
+}
+
+void RedisReplyBuilder::SendBigNumber(string_view num) {
+  if (!is_resp3_)
+    return SendBulkString(num);
+
+  iovec v[] = {IoVec("("), IoVec(num), IoVec(kCRLF)};
+  Send(v, ABSL_ARRAYSIZE(v));
 }
 
 void RedisReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
@@ -296,7 +507,7 @@ void RedisReplyBuilder::SendSimpleStrArr(const std::string_view* arr, uint32_t c
 }
 
 void RedisReplyBuilder::SendNullArray() {
-  SendRaw("*-1\r\n");
+  SendRaw(is_resp3_ ? "_\r\n" : "*-1\r\n");
 }
 
 void RedisReplyBuilder::SendEmptyArray() {
@@ -329,7 +540,35 @@ void RedisReplyBuilder::StartArray(unsigned len) {
   SendRaw(absl::StrCat("*", len, kCRLF));
 }
 
-void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len) {
+void RedisReplyBuilder::StartCollection(unsigned len, CollectionType type) {
+  if (!is_resp3_ || type == ARRAY)
+    return StartArray(type == MAP ? len * 2 : len);
+
+  SendRaw(absl::StrCat(string_view{CollectionPrefix(type), 1}, len, kCRLF));
+}
+
+void RedisReplyBuilder::SendStringCollection(absl::Span<const string> arr, CollectionType type) {
+  if (!is_resp3_ || type == ARRAY)
+    return SendStringArr(arr);
+
+  if (arr.empty())
+    return StartCollection(0, type);
+
+  SendStringArr(arr.data(), arr.size(), type);
+}
+
+void RedisReplyBuilder::SendStringCollection(absl::Span<const string_view> arr,
+                                             CollectionType type) {
+  if (!is_resp3_ || type == ARRAY)
+    return SendStringArr(arr);
+
+  if (arr.empty())
+    return StartCollection(0, type);
+
+  SendStringArr(arr.data(), arr.size(), type);
+}
+
+void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len, CollectionType type) {
   // When vector length is too long, Send returns EMSGSIZE.
   size_t vec_len = std::min<size_t>(256u, len);
 
@@ -337,8 +576,8 @@ void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len) {
   absl::FixedArray<char, 64> meta((vec_len + 1) * 16);
   char* next = meta.data();
 
-  *next++ = '*';
-  next = absl::numbers_internal::FastIntToBuffer(len, next);
+  *next++ = CollectionPrefix(type);
+  next = absl::numbers_internal::FastIntToBuffer(type == MAP ? len / 2 : len, next);
   *next++ = '\r';
   *next++ = '\n';
   vec[0] = IoVec(string_view{meta.data(), size_t(next - meta.data())});
@@ -5,7 +5,9 @@
 
 #include <optional>
 #include <string_view>
+#include <vector>
 
+#include "facade/memcache_parser.h"
 #include "facade/op_status.h"
 #include "io/io.h"
 
@@ -28,6 +30,9 @@ class SinkReplyBuilder {
     should_batch_ = batch;
   }
 
+  // Sends the replies accumulated in batch mode, if there are any.
+  void FlushBatch();
+
   // Used for QUIT - > should move to conn_context?
   void CloseConnection();
 
@@ -111,13 +116,51 @@ class MCReplyBuilder : public SinkReplyBuilder {
 
   void SendClientError(std::string_view str);
   void SendNotFound();
+  void SendExists();
   void SendSimpleString(std::string_view str) final;
+
+  // Meta protocol replies. flags are the return flags, each preceded by a space.
+  // Sends "<code><flags>\r\n".
+  void SendMeta(std::string_view code, std::string_view flags);
+
+  // Sends "VA <size><flags>\r\n<value>\r\n".
+  void SendMetaValue(std::string_view value, std::string_view flags);
+
+  // Replies to cmd in the binary protocol until it is reset with nullptr.
+  void SetBinaryRequest(const MemcacheParser::Command* cmd) {
+    bin_req_ = cmd;
+  }
+
+ private:
+  void SendBinary(uint16_t status, std::string_view extras, std::string_view key,
+                  std::string_view value, uint32_t opaque);
+
+  // Quiet requests are not replied on success.
+  void SendBinaryStatus(uint16_t status, std::string_view value = std::string_view{});
+  void SendBinaryMGet(const OptResp* resp, uint32_t count);
+
+  // Sends a long vector in several writes, since writev is limited in the number of iovecs.
+  void SendIovecs(const std::vector<iovec>& v);
+
+  const MemcacheParser::Command* bin_req_ = nullptr;
 };
 
 class RedisReplyBuilder : public SinkReplyBuilder {
  public:
+  // RESP3 aggregate types. In RESP2 mode all of them are sent as arrays.
+  enum CollectionType { ARRAY, SET, MAP, PUSH };
+
   RedisReplyBuilder(::io::Sink* stream);
 
+  // Selected by HELLO per connection.
+  void SetResp3(bool is_resp3) {
+    is_resp3_ = is_resp3;
+  }
+
+  bool IsResp3() const {
+    return is_resp3_;
+  }
+
   void SendError(std::string_view str, std::string_view type = std::string_view{}) override;
   void SendMGetResponse(const OptResp* resp, uint32_t count) override;
   void SendSimpleString(std::string_view str) override;
@@ -143,12 +186,24 @@ class RedisReplyBuilder : public SinkReplyBuilder {
 
   virtual void StartArray(unsigned len);
 
+  // For MAP, len is the number of key-value pairs.
+  void StartCollection(unsigned len, CollectionType type);
+
+  // Sends arr as a collection of bulk strings. For MAP, arr holds the keys and values interleaved.
+  void SendStringCollection(absl::Span<const std::string> arr, CollectionType type);
+  void SendStringCollection(absl::Span<const std::string_view> arr, CollectionType type);
+
+  // num is a decimal integer of arbitrary length. Sent as a bulk string in RESP2 mode.
+  void SendBigNumber(std::string_view num);
+
   static char* FormatDouble(double val, char* dest, unsigned dest_len);
 
  private:
 
   using StrPtr = std::variant<const std::string_view*, const std::string*>;
-  void SendStringArr(StrPtr str_ptr, uint32_t len);
+  void SendStringArr(StrPtr str_ptr, uint32_t len, CollectionType type = ARRAY);
+
+  bool is_resp3_ = false;
 };
 
 class ReqSerializer {
@@ -0,0 +1,226 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/reply_builder.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <gmock/gmock.h>
+
+#include <cstdlib>
+#include <new>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+
+using namespace testing;
+using namespace std;
+
+namespace {
+
+// Counts the allocations of the thread, so that the benchmarks report them per reply.
+thread_local uint64_t tl_allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++tl_allocations;
+  if (void* ptr = malloc(size))
+    return ptr;
+  throw bad_alloc{};
+}
+
+void* operator new[](size_t size) {
+  ++tl_allocations;
+  if (void* ptr = malloc(size))
+    return ptr;
+  throw bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+namespace facade {
+
+namespace {
+
+// Discards the replies and counts their bytes and the writes.
+class CountingSink : public ::io::Sink {
+ public:
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
+    size_t res = 0;
+    for (uint32_t i = 0; i < len; ++i)
+      res += v[i].iov_len;
+    bytes += res;
+    ++writes;
+    return res;
+  }
+
+  uint64_t bytes = 0;
+  uint64_t writes = 0;
+};
+
+// Captures the replies.
+class StringSink : public ::io::Sink {
+ public:
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
+    size_t res = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      str.append(reinterpret_cast<const char*>(v[i].iov_base), v[i].iov_len);
+      res += v[i].iov_len;
+    }
+    return res;
+  }
+
+  string str;
+};
+
+vector<SinkReplyBuilder::OptResp> MakeMGetResponse(unsigned count) {
+  vector<SinkReplyBuilder::OptResp> res(count);
+  for (unsigned i = 0; i < count; ++i) {
+    // Every tenth key is missing.
+    if (i % 10 == 9)
+      continue;
+    res[i].emplace();
+    res[i]->value = absl::StrCat("value:", absl::Dec(i, absl::kZeroPad12), string(14, 'x'));
+  }
+  return res;
+}
+
+vector<string> MakeHashPairs(unsigned count) {
+  vector<string> res;
+  for (unsigned i = 0; i < count; ++i) {
+    res.push_back(absl::StrCat("field:", i));
+    res.push_back(absl::StrCat("value:", absl::Dec(i, absl::kZeroPad12)));
+  }
+  return res;
+}
+
+vector<pair<string, double>> MakeScoredMembers(unsigned count) {
+  vector<pair<string, double>> res;
+  for (unsigned i = 0; i < count; ++i)
+    res.emplace_back(absl::StrCat("member:", i), i * 1.25 + 0.1);
+  return res;
+}
+
+// Follows the reply of ZRANGE WITHSCORES in zset_family.cc.
+void SendScoredMembers(const vector<pair<string, double>>& members, RedisReplyBuilder* rb) {
+  bool with_pairs = rb->IsResp3();
+  rb->StartArray(members.size() * (with_pairs ? 1 : 2));
+  for (const auto& [member, score] : members) {
+    if (with_pairs)
+      rb->StartArray(2);
+    rb->SendBulkString(member);
+    rb->SendDouble(score);
+  }
+}
+
+}  // namespace
+
+class ReplyBuilderTest : public testing::Test {
+ protected:
+  StringSink sink_;
+  RedisReplyBuilder rb_{&sink_};
+};
+
+TEST_F(ReplyBuilderTest, MGet) {
+  auto resp = MakeMGetResponse(10);
+  rb_.SendMGetResponse(resp.data(), resp.size());
+  EXPECT_TRUE(absl::StartsWith(sink_.str, "*10\r\n$32\r\nvalue:000000000000"));
+  EXPECT_TRUE(absl::EndsWith(sink_.str, "$-1\r\n"));
+}
+
+TEST_F(ReplyBuilderTest, StringArr) {
+  rb_.SendStringArr(MakeHashPairs(1000));
+  EXPECT_TRUE(absl::StartsWith(sink_.str, "*2000\r\n$7\r\nfield:0\r\n$18\r\nvalue:000000000000"));
+  EXPECT_TRUE(absl::EndsWith(sink_.str, "$9\r\nfield:999\r\n$18\r\nvalue:000000000999\r\n"));
+}
+
+TEST_F(ReplyBuilderTest, ScoredMembers) {
+  SendScoredMembers(MakeScoredMembers(2), &rb_);
+  EXPECT_EQ("*4\r\n$8\r\nmember:0\r\n$3\r\n0.1\r\n$8\r\nmember:1\r\n$4\r\n1.35\r\n", sink_.str);
+
+  sink_.str.clear();
+  rb_.SetResp3(true);
+  SendScoredMembers(MakeScoredMembers(1), &rb_);
+  EXPECT_EQ("*1\r\n*2\r\n$8\r\nmember:0\r\n,0.1\r\n", sink_.str);
+}
+
+TEST_F(ReplyBuilderTest, Batch) {
+  rb_.SetBatchMode(true);
+  rb_.SendLong(1);
+  rb_.SendBulkString("foo");
+  EXPECT_EQ("", sink_.str);
+
+  rb_.FlushBatch();
+  EXPECT_EQ(":1\r\n$3\r\nfoo\r\n", sink_.str);
+}
+
+// The benchmarks build the replies into a sink that only counts them. The first argument is the
+// size of the reply and the second one tells whether the builder is in batch mode, in which the
+// replies are accumulated and flushed in one write as for a pipeline. They report the
+// allocations and the writes per reply.
+template <typename F> void RunReplyBenchmark(benchmark::State& state, F&& send) {
+  CountingSink sink;
+  RedisReplyBuilder rb(&sink);
+  rb.SetBatchMode(state.range(1));
+
+  uint64_t allocations = tl_allocations;
+  for (auto _ : state) {
+    send(&rb);
+    rb.FlushBatch();
+  }
+  allocations = tl_allocations - allocations;
+
+  double replies = max<double>(state.iterations(), 1);
+  state.counters["allocs_per_reply"] = allocations / replies;
+  state.counters["writes_per_reply"] = sink.writes / replies;
+  state.SetBytesProcessed(sink.bytes);
+}
+
+void BM_MGet(benchmark::State& state) {
+  auto resp = MakeMGetResponse(state.range(0));
+  RunReplyBenchmark(state, [&](RedisReplyBuilder* rb) {
+    rb->SendMGetResponse(resp.data(), resp.size());
+  });
+}
+BENCHMARK(BM_MGet)->Args({1, 0})->Args({1, 1})->Args({100, 0})->Args({100, 1});
+
+void BM_HGetAll(benchmark::State& state) {
+  auto pairs = MakeHashPairs(state.range(0));
+  RunReplyBenchmark(state, [&](RedisReplyBuilder* rb) { rb->SendStringArr(pairs); });
+}
+BENCHMARK(BM_HGetAll)->Args({10, 0})->Args({10, 1})->Args({1000, 0})->Args({1000, 1});
+
+void BM_ZRangeWithScores(benchmark::State& state) {
+  auto members = MakeScoredMembers(state.range(0));
+  RunReplyBenchmark(state, [&](RedisReplyBuilder* rb) { SendScoredMembers(members, rb); });
+}
+BENCHMARK(BM_ZRangeWithScores)->Args({10, 0})->Args({10, 1})->Args({1000, 0})->Args({1000, 1});
+
+void BM_FormatDouble(benchmark::State& state) {
+  char buf[64];
+  double val = 0.1;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(RedisReplyBuilder::FormatDouble(val, buf, sizeof(buf)));
+    val += 1.25;
+  }
+}
+BENCHMARK(BM_FormatDouble);
+
+}  // namespace facade
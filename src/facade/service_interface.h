@@ -24,6 +24,14 @@ class ServiceInterface {
   }
 
   virtual void DispatchCommand(CmdArgList args, ConnectionContext* cntx) = 0;
+
+  // Dispatches a run of pipelined commands. Replies must be sent in the same order.
+  // Implementations may execute them together to reduce the per-command overhead.
+  virtual void DispatchManyCommands(absl::Span<CmdArgList> args_list, ConnectionContext* cntx) {
+    for (auto args : args_list) {
+      DispatchCommand(args, cntx);
+    }
+  }
   virtual void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                           ConnectionContext* cntx) = 0;
 
@@ -112,14 +112,151 @@ uint64_t _crc64(uint_fast64_t crc, const void *in_data, const uint64_t len) {
 
 /******************** END GENERATED PYCRC FUNCTIONS ********************/
 
-/* Initializes the 16KB lookup tables. */
+static uint64_t crc64_tables(uint64_t crc, const unsigned char *s, uint64_t l) {
+    return crcspeed64native(crc64_table, crc, (void *) s, l);
+}
+
+/* Carry-less multiplication kernels. The input is folded 64 bytes at a time
+ * into four 128 bit lanes, following "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" by Intel. The lanes are then folded
+ * into one and the last 128 bits are reduced with the tables.
+ *
+ * With the reflected polynomial, a 128 bit lane x holds a polynomial whose
+ * low qword is multiplied by x^64. Shifting the lane by D bits is
+ * lo * (x^(D+64) mod P) + hi * (x^D mod P). The constants are reflected and
+ * taken for exponents one less, since the product of two reflected qwords is
+ * one bit short of 128 bits. */
+#define CRC64_K128_LO UINT64_C(0xd9d7be7d505da32c)
+#define CRC64_K128_HI UINT64_C(0x381d0015c96f4444)
+#define CRC64_K256_LO UINT64_C(0x6ba4d760ab38201e)
+#define CRC64_K256_HI UINT64_C(0xef3d1d18ed889ed2)
+#define CRC64_K384_LO UINT64_C(0xa062b2319d66692f)
+#define CRC64_K384_HI UINT64_C(0x7b3211a760160db8)
+#define CRC64_K512_LO UINT64_C(0xaf86efb16d9ab4fb)
+#define CRC64_K512_HI UINT64_C(0xf49784a634f014e4)
+
+/* Below this length the setup of the lanes does not pay off. */
+#define CRC64_FOLD_MIN_LEN 128
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define CRC64_HAVE_CLMUL 1
+
+__attribute__((target("pclmul")))
+static inline __m128i crc64_fold(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul")))
+static uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l) {
+    if (l < CRC64_FOLD_MIN_LEN)
+        return crc64_tables(crc, s, l);
+
+    const __m128i k128 = _mm_set_epi64x(CRC64_K128_HI, CRC64_K128_LO);
+    const __m128i k256 = _mm_set_epi64x(CRC64_K256_HI, CRC64_K256_LO);
+    const __m128i k384 = _mm_set_epi64x(CRC64_K384_HI, CRC64_K384_LO);
+    const __m128i k512 = _mm_set_epi64x(CRC64_K512_HI, CRC64_K512_LO);
+    const __m128i *p = (const __m128i *) s;
+
+    /* The crc so far is the first 8 bytes of the remaining message. */
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi64_si128(crc));
+    __m128i x1 = _mm_loadu_si128(p + 1);
+    __m128i x2 = _mm_loadu_si128(p + 2);
+    __m128i x3 = _mm_loadu_si128(p + 3);
+    p += 4;
+    l -= 64;
+
+    while (l >= 64) {
+        x0 = _mm_xor_si128(crc64_fold(x0, k512), _mm_loadu_si128(p));
+        x1 = _mm_xor_si128(crc64_fold(x1, k512), _mm_loadu_si128(p + 1));
+        x2 = _mm_xor_si128(crc64_fold(x2, k512), _mm_loadu_si128(p + 2));
+        x3 = _mm_xor_si128(crc64_fold(x3, k512), _mm_loadu_si128(p + 3));
+        p += 4;
+        l -= 64;
+    }
+
+    __m128i x = _mm_xor_si128(_mm_xor_si128(crc64_fold(x0, k384), crc64_fold(x1, k256)),
+                              _mm_xor_si128(crc64_fold(x2, k128), x3));
+    for (; l >= 16; l -= 16)
+        x = _mm_xor_si128(crc64_fold(x, k128), _mm_loadu_si128(p++));
+
+    unsigned char last[16];
+    _mm_storeu_si128((__m128i *) last, x);
+    return crc64_tables(crc64_tables(0, last, 16), (const unsigned char *) p, l);
+}
+
+static int crc64_clmul_supported(void) {
+    return __builtin_cpu_supports("pclmul");
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define CRC64_HAVE_CLMUL 1
+
+static inline uint64x2_t crc64_fold(uint64x2_t x, uint64_t k_lo, uint64_t k_hi) {
+    poly128_t lo = vmull_p64((poly64_t) vgetq_lane_u64(x, 0), (poly64_t) k_lo);
+    poly128_t hi = vmull_p64((poly64_t) vgetq_lane_u64(x, 1), (poly64_t) k_hi);
+    return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+static uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l) {
+    if (l < CRC64_FOLD_MIN_LEN)
+        return crc64_tables(crc, s, l);
+
+    const uint64_t *p = (const uint64_t *) s;
+
+    /* The crc so far is the first 8 bytes of the remaining message. */
+    uint64x2_t x0 = veorq_u64(vld1q_u64(p), vcombine_u64(vcreate_u64(crc), vcreate_u64(0)));
+    uint64x2_t x1 = vld1q_u64(p + 2);
+    uint64x2_t x2 = vld1q_u64(p + 4);
+    uint64x2_t x3 = vld1q_u64(p + 6);
+    p += 8;
+    l -= 64;
+
+    while (l >= 64) {
+        x0 = veorq_u64(crc64_fold(x0, CRC64_K512_LO, CRC64_K512_HI), vld1q_u64(p));
+        x1 = veorq_u64(crc64_fold(x1, CRC64_K512_LO, CRC64_K512_HI), vld1q_u64(p + 2));
+        x2 = veorq_u64(crc64_fold(x2, CRC64_K512_LO, CRC64_K512_HI), vld1q_u64(p + 4));
+        x3 = veorq_u64(crc64_fold(x3, CRC64_K512_LO, CRC64_K512_HI), vld1q_u64(p + 6));
+        p += 8;
+        l -= 64;
+    }
+
+    uint64x2_t x = veorq_u64(veorq_u64(crc64_fold(x0, CRC64_K384_LO, CRC64_K384_HI),
+                                       crc64_fold(x1, CRC64_K256_LO, CRC64_K256_HI)),
+                             veorq_u64(crc64_fold(x2, CRC64_K128_LO, CRC64_K128_HI), x3));
+    for (; l >= 16; l -= 16, p += 2)
+        x = veorq_u64(crc64_fold(x, CRC64_K128_LO, CRC64_K128_HI), vld1q_u64(p));
+
+    unsigned char last[16];
+    vst1q_u64((uint64_t *) last, x);
+    return crc64_tables(crc64_tables(0, last, 16), (const unsigned char *) p, l);
+}
+
+static int crc64_clmul_supported(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+static uint64_t (*crc64_impl)(uint64_t, const unsigned char *, uint64_t) = crc64_tables;
+
+/* Initializes the 16KB lookup tables and picks the fastest implementation. */
 void crc64_init(void) {
     crcspeed64native_init(_crc64, crc64_table);
+#ifdef CRC64_HAVE_CLMUL
+    if (crc64_clmul_supported())
+        crc64_impl = crc64_clmul;
+#endif
 }
 
 /* Compute crc64 */
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
-    return crcspeed64native(crc64_table, crc, (void *) s, l);
+    return crc64_impl(crc, s, l);
 }
 
 /* Test main */
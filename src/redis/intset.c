@@ -282,6 +282,35 @@ uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
     return 0;
 }
 
+/* Search for "value" at the positions from "from" onwards, probing at exponentially
+ * growing distances before the binary search. This is cheap when the values are looked up
+ * in ascending order, like when merging sets. Return 1 when the value was found. Sets "pos"
+ * either way to the position of the first value that is not smaller than "value". */
+uint8_t intsetGallop(intset *is, uint32_t from, int64_t value, uint32_t *pos) {
+    uint64_t len = intrev32ifbe(is->length);
+    uint64_t lo = from, hi = from, step = 1;
+
+    /* Values before lo are smaller than "value" and the value at hi is not. */
+    while (hi < len && _intsetGet(is,hi) < value) {
+        lo = hi+1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi > len) hi = len;
+
+    while (lo < hi) {
+        uint64_t mid = lo + ((hi-lo) >> 1);
+        if (_intsetGet(is,mid) < value) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *pos = lo;
+    return lo < len && _intsetGet(is,lo) == value;
+}
+
 /* Return intset length */
 uint32_t intsetLen(const intset *is) {
     return intrev32ifbe(is->length);
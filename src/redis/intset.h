@@ -45,6 +45,7 @@ intset *intsetTrimTail(intset *is, uint32_t trim_len);  // Removes last trim_len
 uint8_t intsetFind(intset *is, int64_t value);
 int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
+uint8_t intsetGallop(intset *is, uint32_t from, int64_t value, uint32_t *pos);
 uint32_t intsetLen(const intset *is);
 size_t intsetBlobLen(intset *is);
 
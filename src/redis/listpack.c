@@ -33,6 +33,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* For memmem(). */
 #include <stdint.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -751,6 +752,48 @@ unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
     return NULL;
 }
 
+/* Stores into 'buf' the complete entry, with its backlen, that encodes the
+ * element 's' of 'slen' bytes, and returns its length. lpInsert() encodes
+ * every element the same way (see lpEncodeGetType()), so the entries equal to
+ * 's' are exactly the occurrences of these bytes at entry boundaries.
+ * 'buf' must hold slen+LP_MAX_ENTRY_OVERHEAD bytes. */
+uint32_t lpEncodeEntry(const unsigned char *s, uint32_t slen, unsigned char *buf) {
+    uint64_t enclen;
+    if (lpEncodeGetType(s,slen,buf,&enclen) == LP_ENCODING_STRING)
+        lpEncodeString(buf,s,slen);
+    return enclen + lpEncodeBacklen(buf+enclen,enclen);
+}
+
+/* Returns the first entry starting from 'p' that is made of the 'enclen' bytes
+ * 'enc' of lpEncodeEntry(), or NULL if there is none. The bytes of the
+ * listpack are scanned with memmem(), and of the entries before a candidate
+ * only the headers are read to check that it starts at an entry boundary,
+ * so no entry is decoded. If 'skipped' is not NULL it is set to the number of
+ * entries from 'p' to the returned one. */
+unsigned char *lpFindEncoded(unsigned char *lp, unsigned char *p, const unsigned char *enc,
+                             uint32_t enclen, unsigned long *skipped) {
+    if (!p) return NULL;
+    unsigned char *eof = lp + lpGetTotalBytes(lp) - 1;
+    unsigned char *from = p;
+    unsigned long count = 0;
+
+    while ((size_t)(eof - from) >= enclen) {
+        unsigned char *match = memmem(from,eof-from,enc,enclen);
+        if (!match) return NULL;
+        while (p < match) {
+            p = lpSkip(p);
+            count++;
+        }
+        if (p == match) {
+            if (skipped) *skipped = count;
+            return p;
+        }
+        /* The candidate was inside the entry before 'p'. */
+        from = p;
+    }
+    return NULL;
+}
+
 /* Insert, delete or replace the specified string element 'elestr' of length
  * 'size' or integer element 'eleint' at the specified position 'p', with 'p'
  * being a listpack element pointer obtained with lpFirst(), lpLast(), lpNext(),
@@ -863,10 +906,13 @@ unsigned char *lpInsert(unsigned char *lp, const unsigned char *elestr, unsigned
     if (where == LP_BEFORE) {
         memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
     } else { /* LP_REPLACE. */
+        /* An element replaced with one of the same encoded size, like most
+         * counter updates, is overwritten in place without moving the tail. */
         long lendiff = (enclen+backlen_size)-replaced_len;
-        memmove(dst+replaced_len+lendiff,
-                dst+replaced_len,
-                old_listpack_bytes-poff-replaced_len);
+        if (lendiff != 0)
+            memmove(dst+replaced_len+lendiff,
+                    dst+replaced_len,
+                    old_listpack_bytes-poff-replaced_len);
     }
 
     /* Realloc after: we need to free space. */
@@ -974,6 +1020,52 @@ unsigned char *lpAppendInteger(unsigned char *lp, long long lval) {
     return lpInsertInteger(lp, lval, eofptr, LP_BEFORE, NULL);
 }
 
+/* Append the 'len' string entries at the end of the listpack, reallocating it
+ * once for all of them, which is much faster than calling lpAppend() for every
+ * entry. Returns NULL if the listpack would be too big. */
+unsigned char *lpBatchAppend(unsigned char *lp, const listpackEntry *entries, unsigned long len) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    uint64_t enclen;
+    uint64_t added_bytes = 0;
+
+    for (unsigned long i = 0; i < len; i++) {
+        lpEncodeGetType(entries[i].sval,entries[i].slen,intenc,&enclen);
+        added_bytes += enclen + lpEncodeBacklen(NULL,enclen);
+    }
+
+    uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
+    uint64_t new_listpack_bytes = old_listpack_bytes + added_bytes;
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+
+    if (new_listpack_bytes > zmalloc_size(lp)) {
+        if ((lp = zrealloc(lp,new_listpack_bytes)) == NULL) return NULL;
+    }
+
+    /* The entries overwrite the EOF byte, which is written again after them. */
+    unsigned char *dst = lp + old_listpack_bytes - 1;
+    for (unsigned long i = 0; i < len; i++) {
+        int enctype = lpEncodeGetType(entries[i].sval,entries[i].slen,intenc,&enclen);
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst,intenc,enclen);
+        } else {
+            lpEncodeString(dst,entries[i].sval,entries[i].slen);
+        }
+        dst += enclen;
+        dst += lpEncodeBacklen(dst,enclen);
+    }
+    dst[0] = LP_EOF;
+
+    uint32_t num_elements = lpGetNumElements(lp);
+    if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+        if (num_elements + len < LP_HDR_NUMELE_UNKNOWN)
+            lpSetNumElements(lp,num_elements+len);
+        else
+            lpSetNumElements(lp,LP_HDR_NUMELE_UNKNOWN);
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
 /* This is just a wrapper for lpInsert() to directly use a string to replace
  * the current element. The function returns the new listpack as return
  * value, and also updates the current cursor by updating '*p'. */
@@ -39,6 +39,7 @@
 #include <stdint.h>
 
 #define LP_INTBUF_SIZE 21 /* 20 digits of -2^63 + 1 null term = 21. */
+#define LP_MAX_ENTRY_OVERHEAD 10 /* Bytes of an entry beyond its element, see lpEncodeEntry(). */
 
 /* lpInsert() where argument possible values: */
 #define LP_BEFORE 0
@@ -63,6 +64,7 @@ unsigned char *lpPrepend(unsigned char *lp, const unsigned char *s, uint32_t sle
 unsigned char *lpPrependInteger(unsigned char *lp, long long lval);
 unsigned char *lpAppend(unsigned char *lp, const unsigned char *s, uint32_t slen);
 unsigned char *lpAppendInteger(unsigned char *lp, long long lval);
+unsigned char *lpBatchAppend(unsigned char *lp, const listpackEntry *entries, unsigned long len);
 unsigned char *lpReplace(unsigned char *lp, unsigned char **p, const unsigned char *s, uint32_t slen);
 unsigned char *lpReplaceInteger(unsigned char *lp, unsigned char **p, long long lval);
 unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp);
@@ -73,6 +75,9 @@ unsigned long lpLength(unsigned char *lp);
 unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf);
 unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval);
 unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip);
+uint32_t lpEncodeEntry(const unsigned char *s, uint32_t slen, unsigned char *buf);
+unsigned char *lpFindEncoded(unsigned char *lp, unsigned char *p, const unsigned char *enc,
+                             uint32_t enclen, unsigned long *skipped);
 unsigned char *lpFirst(unsigned char *lp);
 unsigned char *lpLast(unsigned char *lp);
 unsigned char *lpNext(unsigned char *lp, unsigned char *p);
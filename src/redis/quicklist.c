@@ -37,6 +37,7 @@
 #include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzfP.h"
+#include <lz4.h>
 
 
 #ifndef REDIS_STATIC
@@ -54,6 +55,14 @@ static size_t packed_threshold = (1 << 30);
 /* set threshold for PLAIN nodes, the real limit is 4gb */
 #define isLargeElement(size) ((size) >= packed_threshold)
 
+/* The encoding of the nodes that get compressed, LZF or LZ4. */
+static int compress_codec = QUICKLIST_NODE_ENCODING_LZF;
+
+void quicklistSetCompressCodec(int encoding) {
+    assert(encoding == QUICKLIST_NODE_ENCODING_LZF || encoding == QUICKLIST_NODE_ENCODING_LZ4);
+    compress_codec = encoding;
+}
+
 int quicklistisSetPackedThreshold(size_t sz) {
     /* Don't allow threshold to be set above or even slightly below 4GB */
     if (sz > (1ull<<32) - (1<<20)) {
@@ -76,6 +85,10 @@ int quicklistisSetPackedThreshold(size_t sz) {
  * when the listpack exceeds the size limit by a few bytes (e.g. being 16388). */
 #define SIZE_ESTIMATE_OVERHEAD 8
 
+/* Lists of at least this many nodes index the positions of their nodes, so
+ * that seeking an element by its index does not walk the nodes. */
+#define INDEX_MIN_NODES 64
+
 /* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
@@ -141,6 +154,7 @@ quicklist *quicklistCreate(void) {
     quicklist->compress = 0;
     quicklist->fill = -2;
     quicklist->bookmark_count = 0;
+    quicklist->index = NULL;
     return quicklist;
 }
 
@@ -176,9 +190,44 @@ quicklist *quicklistNew(int fill, int compress) {
     return quicklist;
 }
 
+/* Nodes released by the lists of this thread, linked through 'next'. Queues
+ * that push on one end and pop on the other create and free a node for every
+ * listpack that fills up, so we keep a few of them instead of going back to the
+ * allocator each time. The pool is allocated from the thread heap and is not
+ * subtracted from the used memory. */
+#define QUICKLIST_NODE_POOL_MAX 64
+static __thread quicklistNode *node_pool = NULL;
+static __thread unsigned node_pool_len = 0;
+
+REDIS_STATIC void quicklistFreeNode(quicklistNode *node) {
+    if (node_pool_len < QUICKLIST_NODE_POOL_MAX) {
+        node->next = node_pool;
+        node_pool = node;
+        node_pool_len++;
+        return;
+    }
+    zfree(node);
+}
+
+/* Returns the pooled nodes to the allocator, must be called before the thread
+ * heap is destroyed. */
+void quicklistReleaseNodePool(void) {
+    while (node_pool) {
+        quicklistNode *next = node_pool->next;
+        zfree(node_pool);
+        node_pool = next;
+    }
+    node_pool_len = 0;
+}
+
 REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
-    quicklistNode *node;
-    node = zmalloc(sizeof(*node));
+    quicklistNode *node = node_pool;
+    if (node) {
+        node_pool = node->next;
+        node_pool_len--;
+    } else {
+        node = zmalloc(sizeof(*node));
+    }
     node->entry = NULL;
     node->count = 0;
     node->sz = 0;
@@ -186,6 +235,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
+    node->attempted_compress = 0;
     return node;
 }
 
@@ -205,12 +255,14 @@ void quicklistRelease(quicklist *quicklist) {
         zfree(current->entry);
         quicklist->count -= current->count;
 
-        zfree(current);
+        quicklistFreeNode(current);
 
         quicklist->len--;
         current = next;
     }
     quicklistBookmarksClear(quicklist);
+    if (quicklist->index)
+        zfree(quicklist->index);
     zfree(quicklist);
 }
 
@@ -231,23 +283,31 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
-    // ROMAN: we allocate LZF_STATE on heap, piggy-backing on the existing allocation.
-    char* uptr = zmalloc(sizeof(quicklistLZF) + node->sz + sizeof(LZF_STATE));
-    quicklistLZF *lzf = (quicklistLZF*)uptr;
-    LZF_HSLOT* sdata = (LZF_HSLOT*)(uptr + sizeof(quicklistLZF) + node->sz);
+    quicklistLZF *lzf;
+    if (compress_codec == QUICKLIST_NODE_ENCODING_LZ4) {
+        int bound = LZ4_compressBound(node->sz);
+        lzf = zmalloc(sizeof(quicklistLZF) + bound);
+        int res = LZ4_compress_default((const char *)node->entry, lzf->compressed, node->sz,
+                                       bound);
+        lzf->sz = res > 0 ? res : 0;
+    } else {
+        // ROMAN: we allocate LZF_STATE on heap, piggy-backing on the existing allocation.
+        char* uptr = zmalloc(sizeof(quicklistLZF) + node->sz + sizeof(LZF_STATE));
+        lzf = (quicklistLZF*)uptr;
+        LZF_HSLOT* sdata = (LZF_HSLOT*)(uptr + sizeof(quicklistLZF) + node->sz);
+        lzf->sz = lzf_compress(node->entry, node->sz, lzf->compressed, node->sz, sdata);
+    }
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->entry, node->sz, lzf->compressed,
-                                 node->sz, sdata)) == 0) ||
-        lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressible. */
+    if (lzf->sz == 0 || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        /* The codec aborts/rejects compression if value not compressible. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->entry);
     node->entry = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = compress_codec;
     return 1;
 }
 
@@ -259,6 +319,17 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
+/* Uncompress the data of the compressed 'node' into 'dst', which must hold
+ * node->sz bytes. The node itself is left intact.
+ * Returns 1 on successful decode, 0 on failure to decode. */
+int quicklistDecompressTo(const quicklistNode *node, void *dst) {
+    const quicklistLZF *lzf = (const quicklistLZF *)node->entry;
+    if (node->encoding == QUICKLIST_NODE_ENCODING_LZ4) {
+        return LZ4_decompress_safe(lzf->compressed, dst, lzf->sz, node->sz) == (int)node->sz;
+    }
+    return lzf_decompress(lzf->compressed, lzf->sz, dst, node->sz) != 0;
+}
+
 /* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
@@ -268,13 +339,12 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
     node->recompress = 0;
 
     void *decompressed = zmalloc(node->sz);
-    quicklistLZF *lzf = (quicklistLZF *)node->entry;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (!quicklistDecompressTo(node, decompressed)) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
     }
-    zfree(lzf);
+    zfree(node->entry);
     node->entry = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     return 1;
@@ -283,7 +353,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Decompress only compressed nodes. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
@@ -291,13 +361,13 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Force node to not be immediately re-compressible */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
+/* Extract the raw LZF data from this quicklistNode, which must be LZF encoded.
  * Pointer to LZF data is assigned to '*data'.
  * Return value is the length of compressed LZF data. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
@@ -319,6 +389,12 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     /* The head and tail should never be compressed (we should not attempt to recompress them) */
     assert(quicklist->head->recompress == 0 && quicklist->tail->recompress == 0);
 
+    /* quicklistCompressInterior() compresses the interior nodes regardless of
+     * the depth, so a compressed node may become the head or tail once its
+     * neighbours are deleted. */
+    quicklistDecompressNode(quicklist->head);
+    quicklistDecompressNode(quicklist->tail);
+
     /* If length is less than our compress depth (from both sides),
      * we can't compress anything. */
     if (!quicklistAllowsCompression(quicklist) ||
@@ -400,6 +476,156 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
             quicklistCompressNode((_node));                                    \
     } while (0)
 
+/* Compress all the nodes of 'quicklist' except its head and tail, used for
+ * the lists that were not accessed for a while.
+ * Returns the number of nodes that got compressed, '*saved' is increased by
+ * the bytes they saved. */
+unsigned long quicklistCompressInterior(quicklist *quicklist, size_t *saved) {
+    unsigned long compressed = 0;
+    if (quicklist->len < 3)
+        return 0;
+
+    for (quicklistNode *node = quicklist->head->next; node != quicklist->tail;
+         node = node->next) {
+        if (quicklistNodeIsCompressed(node))
+            continue;
+        size_t sz = node->sz;
+        if (__quicklistCompressNode(node)) {
+            *saved += sz - ((quicklistLZF *)node->entry)->sz;
+            ++compressed;
+        }
+    }
+    return compressed;
+}
+
+/* The nodes of the list from the head to the tail are entries[lo, hi).
+ * 'start' is the position of the first element of the node relative to an
+ * arbitrary origin. The head does not maintain its start while the list has
+ * other nodes: the position of the second node is the count of the head.
+ * This way pushes and pops at both ends of the list leave the entries as is,
+ * other changes to the nodes drop the index. */
+typedef struct quicklistIndexEntry {
+    quicklistNode *node;
+    long long start;
+} quicklistIndexEntry;
+
+typedef struct quicklistIndex {
+    unsigned long lo, hi, cap;
+    quicklistIndexEntry entries[];
+} quicklistIndex;
+
+REDIS_STATIC void __quicklistIndexDrop(quicklist *quicklist) {
+    if (quicklist->index) {
+        zfree(quicklist->index);
+        quicklist->index = NULL;
+    }
+}
+
+/* Allocates the index with room for 'len' nodes in the middle, so that nodes
+ * can be added at both ends. */
+REDIS_STATIC quicklistIndex *__quicklistIndexAlloc(unsigned long len) {
+    unsigned long cap = len * 2 + 16;
+    quicklistIndex *qi = zmalloc(sizeof(*qi) + cap * sizeof(quicklistIndexEntry));
+    qi->cap = cap;
+    qi->lo = qi->hi = (cap - len) / 2;
+    return qi;
+}
+
+REDIS_STATIC void __quicklistIndexBuild(quicklist *quicklist) {
+    quicklistIndex *qi = __quicklistIndexAlloc(quicklist->len);
+    long long start = 0;
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        qi->entries[qi->hi].node = node;
+        qi->entries[qi->hi++].start = start;
+        start += node->count;
+    }
+    quicklist->index = qi;
+}
+
+/* Makes room for one more entry at the front or the back of the index. */
+REDIS_STATIC quicklistIndex *__quicklistIndexReserve(quicklist *quicklist, int front) {
+    quicklistIndex *qi = quicklist->index;
+    if (front ? qi->lo > 0 : qi->hi < qi->cap)
+        return qi;
+
+    unsigned long len = qi->hi - qi->lo;
+    quicklistIndex *grown = __quicklistIndexAlloc(len);
+    memcpy(grown->entries + grown->lo, qi->entries + qi->lo, len * sizeof(quicklistIndexEntry));
+    grown->hi = grown->lo + len;
+    zfree(qi);
+    quicklist->index = grown;
+    return grown;
+}
+
+/* Called before 'new_node' is linked next to 'old_node'. */
+REDIS_STATIC void __quicklistIndexInsert(quicklist *quicklist, quicklistNode *old_node,
+                                         quicklistNode *new_node, int after) {
+    quicklistIndex *qi;
+    if (after && old_node == quicklist->tail) {
+        qi = __quicklistIndexReserve(quicklist, 0);
+        qi->entries[qi->hi].node = new_node;
+        qi->entries[qi->hi].start = qi->entries[qi->hi - 1].start + old_node->count;
+        qi->hi++;
+    } else if (!after && old_node == quicklist->head) {
+        qi = __quicklistIndexReserve(quicklist, 1);
+        /* The old head starts to maintain its position. */
+        if (qi->hi - qi->lo > 1)
+            qi->entries[qi->lo].start = qi->entries[qi->lo + 1].start - old_node->count;
+        qi->lo--;
+        qi->entries[qi->lo].node = new_node;
+        qi->entries[qi->lo].start = 0;
+    } else {
+        __quicklistIndexDrop(quicklist);
+    }
+}
+
+/* Called before 'node' is unlinked from the list. */
+REDIS_STATIC void __quicklistIndexDelete(quicklist *quicklist, quicklistNode *node) {
+    quicklistIndex *qi = quicklist->index;
+    if (node == quicklist->head) {
+        qi->lo++;
+    } else if (node == quicklist->tail) {
+        qi->hi--;
+    } else {
+        __quicklistIndexDrop(quicklist);
+        return;
+    }
+    if (qi->lo == qi->hi)
+        __quicklistIndexDrop(quicklist);
+}
+
+/* Returns the node that holds the element at the forward position 'pos' and
+ * sets '*accum' to the number of elements before it. */
+REDIS_STATIC quicklistNode *__quicklistIndexSeek(quicklist *quicklist, unsigned long long pos,
+                                                 unsigned long long *accum) {
+    if (!quicklist->index)
+        __quicklistIndexBuild(quicklist);
+
+    quicklistIndex *qi = quicklist->index;
+    quicklistNode *head = qi->entries[qi->lo].node;
+    assert(head == quicklist->head && qi->entries[qi->hi - 1].node == quicklist->tail);
+
+    *accum = 0;
+    if (pos < head->count)
+        return head;
+
+    /* The origin of the positions, the start of the head had it maintained it. */
+    long long base = qi->entries[qi->lo + 1].start - head->count;
+    long long target = base + (long long)pos;
+
+    /* Find the last node that starts at or before the target. */
+    unsigned long l = qi->lo + 1, r = qi->hi;
+    while (r - l > 1) {
+        unsigned long m = l + (r - l) / 2;
+        if (qi->entries[m].start <= target)
+            l = m;
+        else
+            r = m;
+    }
+    *accum = qi->entries[l].start - base;
+    return qi->entries[l].node;
+}
+
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
  * Insert 'new_node' before 'old_node' if 'after' is 0.
  * Note: 'new_node' is *always* uncompressed, so if we assign it to
@@ -407,6 +633,9 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
                                         quicklistNode *old_node,
                                         quicklistNode *new_node, int after) {
+    if (quicklist->index)
+        __quicklistIndexInsert(quicklist, old_node, new_node, after);
+
     if (after) {
         new_node->prev = old_node;
         if (old_node) {
@@ -641,6 +870,9 @@ void quicklistAppendPlainNode(quicklist *quicklist, unsigned char *data, size_t
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    if (quicklist->index)
+        __quicklistIndexDelete(quicklist, node);
+
     /* Update the bookmark if any */
     quicklistBookmark *bm = _quicklistBookmarkFindByNode(quicklist, node);
     if (bm) {
@@ -672,7 +904,7 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
     __quicklistCompress(quicklist, NULL);
 
     zfree(node->entry);
-    zfree(node);
+    quicklistFreeNode(node);
 }
 
 /* Delete one entry from list given the node for the entry and a pointer
@@ -709,6 +941,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
  * 'entry' stores enough metadata to delete the proper position in
  * the correct listpack in the correct quicklist node. */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    __quicklistIndexDrop((quicklist *)entry->quicklist);
     quicklistNode *prev = entry->node->prev;
     quicklistNode *next = entry->node->next;
     int deleted_node = quicklistDelIndex((quicklist *)entry->quicklist,
@@ -951,6 +1184,8 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
     quicklistNode *node = entry->node;
     quicklistNode *new_node = NULL;
 
+    __quicklistIndexDrop(quicklist);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
@@ -1116,6 +1351,13 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     long offset = iter->offset;
     quicklistReleaseIterator(iter);
 
+    /* Trimming either end of the list keeps the positions of the remaining
+     * nodes, their index entries are kept once the deleted ones are dropped. */
+    unsigned long first = start >= 0 ? (unsigned long)start : quicklist->count + start;
+    int trim_head = first == 0, trim_tail = first + extent == quicklist->count;
+    quicklistIndex *qi = quicklist->index;
+    quicklist->index = NULL;
+
     /* iterate over next nodes until everything is deleted. */
     while (extent) {
         quicklistNode *next = node->next;
@@ -1173,6 +1415,17 @@ int quicklistDelRange(quicklist *quicklist, const long start,
 
         offset = 0;
     }
+
+    if (qi && quicklist->len > 0 && (trim_head || trim_tail)) {
+        /* The nodes that were deleted are compared by address only. */
+        while (trim_head && qi->entries[qi->lo].node != quicklist->head)
+            qi->lo++;
+        while (trim_tail && qi->entries[qi->hi - 1].node != quicklist->tail)
+            qi->hi--;
+        quicklist->index = qi;
+    } else if (qi) {
+        zfree(qi);
+    }
     return 1;
 }
 
@@ -1230,7 +1483,14 @@ quicklistIter *quicklistGetIteratorAtIdx(quicklist *quicklist,
         seek_index = quicklist->count - 1 - index;
     }
 
-    n = seek_forward ? quicklist->head : quicklist->tail;
+    if (quicklist->index || quicklist->len >= INDEX_MIN_NODES) {
+        /* The index seeks the forward position, the loop below stops at once. */
+        seek_forward = 1;
+        seek_index = forward ? index : quicklist->count - 1 - index;
+        n = __quicklistIndexSeek(quicklist, seek_index, &accum);
+    } else {
+        n = seek_forward ? quicklist->head : quicklist->tail;
+    }
     while (likely(n)) {
         if ((accum + n->count) > seek_index) {
             break;
@@ -1392,7 +1652,7 @@ quicklist *quicklistDup(quicklist *orig) {
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        if (quicklistNodeIsCompressed(current)) {
             quicklistLZF *lzf = (quicklistLZF *)current->entry;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
             node->entry = zmalloc(lzf_sz);
@@ -1433,6 +1693,7 @@ quicklistIter *quicklistGetIteratorEntryAtIdx(quicklist *quicklist, const long l
 }
 
 static void quicklistRotatePlain(quicklist *quicklist) {
+    __quicklistIndexDrop(quicklist);
     quicklistNode *new_head = quicklist->tail;
     quicklistNode *new_tail = quicklist->tail->prev;
     quicklist->head->prev = new_head;
@@ -1529,7 +1790,7 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
     }
 
     /* The head and tail should never be compressed */
-    assert(node->encoding != QUICKLIST_NODE_ENCODING_LZF);
+    assert(!quicklistNodeIsCompressed(node));
 
     if (unlikely(QL_NODE_IS_PLAIN(node))) {
         if (data)
@@ -1594,9 +1855,9 @@ void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
                    int where) {
     /* The head and tail should never be compressed (we don't attempt to decompress them) */
     if (quicklist->head)
-        assert(quicklist->head->encoding != QUICKLIST_NODE_ENCODING_LZF);
+        assert(!quicklistNodeIsCompressed(quicklist->head));
     if (quicklist->tail)
-        assert(quicklist->tail->encoding != QUICKLIST_NODE_ENCODING_LZF);
+        assert(!quicklistNodeIsCompressed(quicklist->tail));
 
     if (where == QUICKLIST_HEAD) {
         quicklistPushHead(quicklist, value, sz);
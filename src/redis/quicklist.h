@@ -49,7 +49,7 @@ typedef struct quicklistNode {
     unsigned char *entry;
     size_t sz;             /* entry size in bytes */
     unsigned int count : 16;     /* count of items in listpack */
-    unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
+    unsigned int encoding : 2;   /* RAW==1, LZF==2 or LZ4==3 */
     unsigned int container : 2;  /* PLAIN==1 or PACKED==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
@@ -58,7 +58,7 @@ typedef struct quicklistNode {
 
 /* quicklistLZF is a 8+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF or LZ4 data with total (compressed) length 'sz'
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->entry is compressed, node->entry points to a quicklistLZF */
 typedef struct quicklistLZF {
@@ -94,9 +94,11 @@ typedef struct quicklistBookmark {
 #   error unknown arch bits count
 #endif
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* quicklist is a 48 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
+ * 'index' is the positions of the nodes of long lists, built on the first
+ *         seek by index and NULL otherwise.
  * 'compress' is: 0 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
  * 'fill' is the user-requested (or default) fill factor.
@@ -107,6 +109,7 @@ typedef struct quicklist {
     quicklistNode *tail;
     unsigned long count;        /* total count of all entries in all listpacks */
     unsigned long len;          /* number of quicklistNodes */
+    struct quicklistIndex *index; /* node positions, see quicklistGetIteratorAtIdx() */
     signed int fill : QL_FILL_BITS;       /* fill factor for individual nodes */
     unsigned int compress : QL_COMP_BITS; /* depth of end nodes not to compress;0=off */
     unsigned int bookmark_count: QL_BM_BITS;
@@ -137,6 +140,7 @@ typedef struct quicklistEntry {
 /* quicklist node encodings */
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
+#define QUICKLIST_NODE_ENCODING_LZ4 3
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
@@ -148,7 +152,7 @@ typedef struct quicklistEntry {
 #define QL_NODE_IS_PLAIN(node) ((node)->container == QUICKLIST_NODE_CONTAINER_PLAIN)
 
 #define quicklistNodeIsCompressed(node)                                        \
-    ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+    ((node)->encoding != QUICKLIST_NODE_ENCODING_RAW)
 
 /* Prototypes */
 quicklist *quicklistCreate(void);
@@ -157,6 +161,7 @@ void quicklistSetCompressDepth(quicklist *quicklist, int depth);
 void quicklistSetFill(quicklist *quicklist, int fill);
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
 void quicklistRelease(quicklist *quicklist);
+void quicklistReleaseNodePool(void);
 int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
@@ -191,10 +196,13 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
 unsigned long quicklistCount(const quicklist *ql);
 int quicklistCompare(const quicklistEntry *entry, const unsigned char *p2, const size_t p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+int quicklistDecompressTo(const quicklistNode *node, void *dst);
+unsigned long quicklistCompressInterior(quicklist *quicklist, size_t *saved);
 void quicklistRepr(unsigned char *ql, int full);
 
 /* bookmarks */
 int quicklistisSetPackedThreshold(size_t sz);
+void quicklistSetCompressCodec(int encoding);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[], int flags);
@@ -433,6 +433,31 @@ void streamGetEdgeID(stream *s, int first, int skip_tombstones, streamID *edge_i
  * 2. If a size of a single element or the sum of the elements is too big to
  *    be stored into the stream. errno will be set to ERANGE. */
 int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id, int seq_given) {
+    unsigned char *stack_fv[16];
+    size_t stack_fv_len[16];
+    unsigned char **fv = stack_fv;
+    size_t *fv_len = stack_fv_len;
+    if (numfields*2 > 16) {
+        fv = zmalloc(sizeof(*fv)*numfields*2);
+        fv_len = zmalloc(sizeof(*fv_len)*numfields*2);
+    }
+    for (int64_t i = 0; i < numfields*2; i++) {
+        fv[i] = (unsigned char*)argv[i]->ptr;
+        fv_len[i] = sdslen(argv[i]->ptr);
+    }
+
+    int res = streamAppendItemRaw(s, fv, fv_len, numfields, added_id, use_id, seq_given);
+    if (fv != stack_fv) {
+        zfree(fv);
+        zfree(fv_len);
+    }
+    return res;
+}
+
+/* Like streamAppendItem, but the field-value pairs are given as 'numfields*2'
+ * byte strings 'fv' of lengths 'fv_len', so the caller does not need to
+ * create objects for them. */
+int streamAppendItemRaw(stream *s, unsigned char **fv, const size_t *fv_len, int64_t numfields, streamID *added_id, streamID *use_id, int seq_given) {
 
     /* Generate the new entry ID. */
     streamID id;
@@ -472,8 +497,7 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
      * can't be bigger than 32bit length. */
     size_t totelelen = 0;
     for (int64_t i = 0; i < numfields*2; i++) {
-        sds ele = argv[i]->ptr;
-        totelelen += sdslen(ele);
+        totelelen += fv_len[i];
     }
     if (totelelen > STREAM_LISTPACK_MAX_SIZE) {
         errno = ERANGE;
@@ -575,8 +599,7 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
         lp = lpAppendInteger(lp,0); /* Zero deleted so far. */
         lp = lpAppendInteger(lp,numfields);
         for (int64_t i = 0; i < numfields; i++) {
-            sds field = argv[i*2]->ptr;
-            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+            lp = lpAppend(lp,fv[i*2],fv_len[i*2]);
         }
         lp = lpAppendInteger(lp,0); /* Master entry zero terminator. */
         raxInsert(s->rax_tree,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
@@ -604,13 +627,12 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
         if (numfields == master_fields_count) {
             int64_t i;
             for (i = 0; i < master_fields_count; i++) {
-                sds field = argv[i*2]->ptr;
                 int64_t e_len;
                 unsigned char buf[LP_INTBUF_SIZE];
                 unsigned char *e = lpGet(lp_ele,&e_len,buf);
                 /* Stop if there is a mismatch. */
-                if (sdslen(field) != (size_t)e_len ||
-                    memcmp(e,field,e_len) != 0) break;
+                if (fv_len[i*2] != (size_t)e_len ||
+                    memcmp(e,fv[i*2],e_len) != 0) break;
                 lp_ele = lpNext(lp,lp_ele);
             }
             /* All fields are the same! We can compress the field names
@@ -647,10 +669,9 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
         lp = lpAppendInteger(lp,numfields);
     for (int64_t i = 0; i < numfields; i++) {
-        sds field = argv[i*2]->ptr, value = argv[i*2+1]->ptr;
         if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
-            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
-        lp = lpAppend(lp,(unsigned char*)value,sdslen(value));
+            lp = lpAppend(lp,fv[i*2],fv_len[i*2]);
+        lp = lpAppend(lp,fv[i*2+1],fv_len[i*2+1]);
     }
     /* Compute and store the lp-count field. */
     int64_t lp_count = numfields;
@@ -673,30 +694,6 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     return C_OK;
 }
 
-typedef struct {
-    /* XADD options */
-    streamID id; /* User-provided ID, for XADD only. */
-    int id_given; /* Was an ID different than "*" specified? for XADD only. */
-    int seq_given; /* Was an ID different than "ms-*" specified? for XADD only. */
-    int no_mkstream; /* if set to 1 do not create new stream */
-
-    /* XADD + XTRIM common options */
-    int trim_strategy; /* TRIM_STRATEGY_* */
-    int trim_strategy_arg_idx; /* Index of the count in MAXLEN/MINID, for rewriting. */
-    int approx_trim; /* If 1 only delete whole radix tree nodes, so
-                      * the trim argument is not applied verbatim. */
-    long long limit; /* Maximum amount of entries to trim. If 0, no limitation
-                      * on the amount of trimming work is enforced. */
-    /* TRIM_STRATEGY_MAXLEN options */
-    long long maxlen; /* After trimming, leave stream at this length . */
-    /* TRIM_STRATEGY_MINID options */
-    streamID minid; /* Trim by ID (No stream entries with ID < 'minid' will remain) */
-} streamAddTrimArgs;
-
-#define TRIM_STRATEGY_NONE 0
-#define TRIM_STRATEGY_MAXLEN 1
-#define TRIM_STRATEGY_MINID 2
-
 /* Trim the stream 's' according to args->trim_strategy, and return the
  * number of elements removed from the stream. The 'approx' option, if non-zero,
  * specifies that the trimming must be performed in a approximated way in
@@ -1285,8 +1285,12 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * Memory management of 'ele':
  *
  * The function does not take ownership of the 'ele' SDS string, but copies
- * it if needed. */
-int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore) {
+ * it if needed.
+ *
+ * zsetAddEx converts a listpack encoded sorted set once it grows beyond
+ * max_lp_entries entries, zsetAdd uses server.zset_max_listpack_entries. */
+int zsetAddEx(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore,
+              size_t max_lp_entries) {
     /* Turn options into simple to check vars. */
     int incr = (in_flags & ZADD_IN_INCR) != 0;
     int nx = (in_flags & ZADD_IN_NX) != 0;
@@ -1340,7 +1344,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
         } else if (!xx) {
             /* check if the element is too large or the list
              * becomes too long *before* executing zzlInsert. */
-            if (zzlLength(zobj->ptr)+1 > server.zset_max_listpack_entries ||
+            if (zzlLength(zobj->ptr)+1 > max_lp_entries ||
                 sdslen(ele) > server.zset_max_listpack_value ||
                 !lpSafeToAdd(zobj->ptr, sdslen(ele)))
             {
@@ -1418,6 +1422,11 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
     return 0; /* Never reached. */
 }
 
+int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore) {
+    return zsetAddEx(zobj,score,ele,in_flags,out_flags,newscore,
+                     server.zset_max_listpack_entries);
+}
+
 /* Deletes the element 'ele' from the sorted set encoded as a skiplist+dict,
  * returning 1 if the element existed and was deleted, 0 otherwise (the
  * element was not there). It does not resize the dict after deleting the
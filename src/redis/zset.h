@@ -77,6 +77,8 @@ void zsetConvertToZiplistIfNeeded(robj* zobj, size_t maxelelen);
 int zsetScore(robj* zobj, sds member, double* score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds ele);
 int zsetAdd(robj* zobj, double score, sds ele, int in_flags, int* out_flags, double* newscore);
+int zsetAddEx(robj* zobj, double score, sds ele, int in_flags, int* out_flags, double* newscore,
+              size_t max_lp_entries);
 long zsetRank(robj* zobj, sds ele, int reverse);
 int zsetDel(robj* zobj, sds ele);
 
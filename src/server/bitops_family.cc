@@ -4,13 +4,19 @@
 
 #include "server/bitops_family.h"
 
+#include <absl/numeric/bits.h>
+#include <absl/strings/strip.h>
+
 #include <bitset>
 
 extern "C" {
 #include "redis/object.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/bitops.h"
+#include "core/sparse_bitmap.h"
 #include "server/command_registry.h"
 #include "server/common.h"
 #include "server/conn_context.h"
@@ -20,6 +26,10 @@ extern "C" {
 #include "server/transaction.h"
 #include "util/varz.h"
 
+ABSL_FLAG(bool, sparse_bitmaps, true,
+          "If true, large bitmaps with few set bits built by SETBIT and BITOP are stored "
+          "compressed");
+
 namespace dfly {
 using namespace facade;
 
@@ -48,6 +58,8 @@ OpResult<std::string> ReadValue(const DbContext& context, std::string_view key,
 OpResult<bool> ReadValueBitsetAt(const OpArgs& op_args, std::string_view key, uint32_t offset);
 OpResult<std::size_t> CountBitsForValue(const OpArgs& op_args, std::string_view key, int64_t start,
                                         int64_t end, bool bit_value);
+OpResult<int64_t> FindBitPosForValue(const OpArgs& op_args, std::string_view key, bool bit,
+                                     int64_t start, int64_t end, bool end_given, bool as_bit);
 std::string GetString(const PrimeValue& pv, EngineShard* shard);
 bool SetBitValue(uint32_t offset, bool bit_value, std::string* entry);
 std::size_t CountBitSetByByteIndices(std::string_view at, std::size_t start, std::size_t end);
@@ -58,66 +70,8 @@ std::string RunBitOperationOnValues(std::string_view op, const BitsStrVec& value
 
 // ------------------------------------------------------------------------- //
 
-// This function can be used for any case where we allowing out of bound
-// access where the default in this case would be 0 -such as bitop
-uint8_t GetByteAt(std::string_view s, std::size_t at) {
-  return at >= s.size() ? 0 : s[at];
-}
-
-// For XOR, OR, AND operations on a collection of bytes
-template <typename BitOp, typename SkipOp>
-std::string BitOpString(BitOp operation_f, SkipOp skip_f, const BitsStrVec& values,
-                        std::string new_value) {
-  // at this point, values are not empty
-  std::size_t max_size = new_value.size();
-
-  if (values.size() > 1) {
-    for (std::size_t i = 0; i < max_size; i++) {
-      std::uint8_t new_entry = operation_f(GetByteAt(values[0], i), GetByteAt(values[1], i));
-      for (std::size_t j = 2; j < values.size(); ++j) {
-        new_entry = operation_f(new_entry, GetByteAt(values[j], i));
-        if (skip_f(new_entry)) {
-          break;
-        }
-      }
-      new_value[i] = new_entry;
-    }
-    return new_value;
-  } else {
-    return values[0];
-  }
-}
-
-// Helper functions to support operations
-// so we would not need to check which
-// operations to run in the look (unlike
-// https://github.com/redis/redis/blob/c2b0c13d5c0fab49131f6f5e844f80bfa43f6219/src/bitops.c#L607)
-constexpr bool SkipAnd(uint8_t byte) {
-  return byte == 0x0;
-}
-
-constexpr bool SkipOr(uint8_t byte) {
-  return byte == 0xff;
-}
-
-constexpr bool SkipXor(uint8_t) {
-  return false;
-}
-
-constexpr uint8_t AndOp(uint8_t left, uint8_t right) {
-  return left & right;
-}
-
-constexpr uint8_t OrOp(uint8_t left, uint8_t right) {
-  return left | right;
-}
-
-constexpr uint8_t XorOp(uint8_t left, uint8_t right) {
-  return left ^ right;
-}
-
 std::string BitOpNotString(std::string from) {
-  std::transform(from.begin(), from.end(), from.begin(), [](auto c) { return ~c; });
+  BitNotInPlace(reinterpret_cast<uint8_t*>(from.data()), from.size());
   return from;
 }
 
@@ -153,14 +107,11 @@ constexpr std::uint8_t CountBitsRange(std::uint8_t byte, std::uint8_t from, uint
 // Count the number of bits that are on, on bytes boundaries: i.e. Start and end are the indices for
 // bytes locations inside str CountBitSetByByteIndices
 std::size_t CountBitSetByByteIndices(std::string_view at, std::size_t start, std::size_t end) {
+  end = std::min(end, at.size());  // don't overflow
   if (start >= end) {
     return 0;
   }
-  end = std::min(end, at.size());  // don't overflow
-  std::uint32_t count =
-      std::accumulate(std::next(at.begin(), start), std::next(at.begin(), end), 0,
-                      [](auto counter, uint8_t ch) { return counter + absl::popcount(ch); });
-  return count;
+  return CountSetBits(reinterpret_cast<const uint8_t*>(at.data()) + start, end - start);
 }
 
 // Count the number of bits that are on, on bits boundaries: i.e. Start and end are the indices for
@@ -184,14 +135,9 @@ std::size_t CountBitSetByBitIndices(std::string_view at, std::size_t start, std:
   return count;
 }
 
-// General purpose function to count the number of bits that are on.
-// The parameters for start, end and bits are defaulted to the start of the string,
-// end of the string and bits are false.
-// Note that when bits is false, it means that we are looking on byte boundaries.
-std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool bits) {
-  const int32_t size = bits ? str.size() * OFFSET_FACTOR : str.size();
-
-  auto NormalizedOffset = [size](int32_t orig) {
+// Converts the range of BITCOUNT over a string of size bytes or bits to a half open range.
+std::pair<int64_t, int64_t> NormalizeCountRange(int64_t size, int64_t start, int64_t end) {
+  auto NormalizedOffset = [size](int64_t orig) {
     if (orig < 0) {
       orig = size + orig;
     }
@@ -199,16 +145,16 @@ std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool b
   };
 
   if (start > 0 && end > 0 && end < start) {
-    return 0;  // for illegal range with positive we just return 0
+    return {0, 0};  // for illegal range with positive we just return 0
   }
 
   if (start < 0 && end < 0 && start > end) {
-    return 0;  // for illegal range with negative we just return 0
+    return {0, 0};  // for illegal range with negative we just return 0
   }
 
   start = NormalizedOffset(start);
   if (end > 0 && end < start) {
-    return 0;
+    return {0, 0};
   }
   end = NormalizedOffset(end);
   if (start > end) {
@@ -217,11 +163,116 @@ std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool b
   if (end > size) {
     end = size;  // don't overflow
   }
-  ++end;
+  return {start, end + 1};
+}
+
+// General purpose function to count the number of bits that are on.
+// The parameters for start, end and bits are defaulted to the start of the string,
+// end of the string and bits are false.
+// Note that when bits is false, it means that we are looking on byte boundaries.
+std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool bits) {
+  const int64_t size = bits ? str.size() * OFFSET_FACTOR : str.size();
+  std::tie(start, end) = NormalizeCountRange(size, start, end);
+  if (start >= end) {
+    return 0;
+  }
   return bits ? CountBitSetByBitIndices(str, start, end)
               : CountBitSetByByteIndices(str, start, end);
 }
 
+// The same for a value in the sparse bitmap encoding.
+std::size_t CountBitSet(const SparseBitmap& bitmap, int64_t start, int64_t end, bool bits) {
+  const int64_t size = bits ? bitmap.Size() * OFFSET_FACTOR : bitmap.Size();
+  std::tie(start, end) = NormalizeCountRange(size, start, end);
+  end = std::min(end, size);
+  if (start >= end) {
+    return 0;
+  }
+  return bits ? bitmap.CountRange(start, end)
+              : bitmap.CountRange(start * OFFSET_FACTOR, end * OFFSET_FACTOR);
+}
+
+// Converts the range of BITPOS over a string of size bytes to the bits [first_bit, last_bit].
+// Returns false if the range is empty.
+bool NormalizeBitPosRange(size_t size, int64_t start, int64_t end, bool as_bit,
+                          int64_t* first_bit, int64_t* last_bit) {
+  const int64_t len = as_bit ? size * OFFSET_FACTOR : size;
+  if (start < 0) {
+    start = std::max<int64_t>(len + start, 0);
+  }
+  if (end < 0) {
+    end = std::max<int64_t>(len + end, 0);
+  }
+  end = std::min(end, len - 1);
+  if (start > end) {
+    return false;
+  }
+
+  *first_bit = as_bit ? start : start * OFFSET_FACTOR;
+  *last_bit = as_bit ? end : end * OFFSET_FACTOR + (OFFSET_FACTOR - 1);
+  return true;
+}
+
+// Returns the position of the first bit that equals bit in str, between start and end
+// (inclusive). They are byte offsets, unless as_bit is set, and may be negative to count from
+// the end. Similar to redisBitpos, when we look for a clear bit and the range is not limited
+// by end, we return the first bit after the string.
+int64_t FindBitPos(std::string_view str, bool bit, int64_t start, int64_t end, bool end_given,
+                   bool as_bit) {
+  int64_t first_bit, last_bit;
+  if (!NormalizeBitPosRange(str.size(), start, end, as_bit, &first_bit, &last_bit)) {
+    return -1;
+  }
+
+  auto bit_at = [&](int64_t pos) {
+    return CheckBitStatus(GetByteValue(str, pos), GetNormalizedBitIndex(pos));
+  };
+
+  // The bits of the partial first byte.
+  for (; first_bit <= last_bit && first_bit % OFFSET_FACTOR != 0; ++first_bit) {
+    if (bit_at(first_bit) == bit) {
+      return first_bit;
+    }
+  }
+
+  // The whole bytes, skipping the ones that don't hold such a bit with the vector kernel.
+  const int64_t first_byte = first_bit / OFFSET_FACTOR;
+  const int64_t end_byte = (last_bit + 1) / OFFSET_FACTOR;
+  if (first_byte < end_byte) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(str.data());
+    const uint8_t skip = bit ? 0 : 0xff;
+    size_t index = FindFirstByteNotEqual(data + first_byte, end_byte - first_byte, skip);
+    if (index < size_t(end_byte - first_byte)) {
+      uint8_t byte = data[first_byte + index] ^ skip;
+      return (first_byte + index) * OFFSET_FACTOR + absl::countl_zero(byte);
+    }
+    first_bit = end_byte * OFFSET_FACTOR;
+  }
+
+  // The bits of the partial last byte.
+  for (; first_bit <= last_bit; ++first_bit) {
+    if (bit_at(first_bit) == bit) {
+      return first_bit;
+    }
+  }
+  return !bit && !end_given ? last_bit + 1 : -1;
+}
+
+// The same for a value in the sparse bitmap encoding.
+int64_t FindBitPos(const SparseBitmap& bitmap, bool bit, int64_t start, int64_t end,
+                   bool end_given, bool as_bit) {
+  int64_t first_bit, last_bit;
+  if (!NormalizeBitPosRange(bitmap.Size(), start, end, as_bit, &first_bit, &last_bit)) {
+    return -1;
+  }
+
+  uint64_t pos = bitmap.FindFirst(bit, first_bit, last_bit + 1);
+  if (pos <= uint64_t(last_bit)) {
+    return pos;
+  }
+  return !bit && !end_given ? last_bit + 1 : -1;
+}
+
 // return true if bit is on
 bool GetBitValue(const std::string& entry, uint32_t offset) {
   const auto byte_val{GetByteValue(entry, offset)};
@@ -278,9 +329,33 @@ class ElementAccess {
 
   std::string Value() const;
 
+  // The value if it is stored as a sparse bitmap, nullptr otherwise.
+  const SparseBitmap* Bitmap() const;
+
   void Commit(std::string_view new_value) const;
+
+  // Stores the bits of raw as a sparse bitmap, with bit offset set to bit_value.
+  void CommitSparse(std::string_view raw, uint32_t offset, bool bit_value) const;
+
+  // Sets bit offset of a sparse bitmap value, converting it to a raw string once it becomes
+  // dense. Returns the previous value of the bit.
+  bool SetSparseBit(uint32_t offset, bool bit_value) const;
 };
 
+// Whether a string of size bytes with num_set set bits should be stored as a sparse bitmap.
+bool UseSparseBitmap(size_t size, uint64_t num_set) {
+  return size >= SparseBitmap::kMinSize && absl::GetFlag(FLAGS_sparse_bitmaps) &&
+         SparseBitmap::IsSparse(size, num_set);
+}
+
+bool UseSparseBitmap(std::string_view value) {
+  if (value.size() < SparseBitmap::kMinSize) {
+    return false;  // Don't count the bits of the short strings.
+  }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(value.data());
+  return UseSparseBitmap(value.size(), CountSetBits(data, value.size()));
+}
+
 OpStatus ElementAccess::Find(EngineShard* shard) {
   try {
     std::pair<PrimeIterator, bool> add_res = shard->db_slice().AddOrFind(context_, key_);
@@ -307,15 +382,53 @@ std::string ElementAccess::Value() const {
   }
 }
 
+const SparseBitmap* ElementAccess::Bitmap() const {
+  CHECK_NOTNULL(shard_);
+  return added_ ? nullptr : element_iter_->second.GetSparseBitmap();
+}
+
 void ElementAccess::Commit(std::string_view new_value) const {
   if (shard_) {
     auto& db_slice = shard_->db_slice();
     db_slice.PreUpdate(Index(), element_iter_);
-    element_iter_->second.SetString(new_value);
+    if (UseSparseBitmap(new_value)) {
+      element_iter_->second.InitSparseBitmap()->Assign(new_value);
+    } else {
+      element_iter_->second.SetString(new_value);
+    }
     db_slice.PostUpdate(Index(), element_iter_, key_, !added_);
   }
 }
 
+void ElementAccess::CommitSparse(std::string_view raw, uint32_t offset, bool bit_value) const {
+  CHECK_NOTNULL(shard_);
+  auto& db_slice = shard_->db_slice();
+  db_slice.PreUpdate(Index(), element_iter_);
+  SparseBitmap* bitmap = element_iter_->second.InitSparseBitmap();
+  bitmap->Assign(raw);
+  bitmap->Set(offset, bit_value);
+  db_slice.PostUpdate(Index(), element_iter_, key_, !added_);
+}
+
+bool ElementAccess::SetSparseBit(uint32_t offset, bool bit_value) const {
+  CHECK_NOTNULL(shard_);
+  PrimeValue& pv = element_iter_->second;
+  SparseBitmap* bitmap = pv.GetSparseBitmap();
+  bool old_value = bitmap->Get(offset);
+  if (old_value == bit_value && GetByteIndex(offset) < bitmap->Size()) {
+    return old_value;  // nothing changed
+  }
+
+  auto& db_slice = shard_->db_slice();
+  db_slice.PreUpdate(Index(), element_iter_);
+  bitmap->Set(offset, bit_value);
+  if (bitmap->IsDense()) {
+    pv.SetString(pv.ToString());
+  }
+  db_slice.PostUpdate(Index(), element_iter_, key_, true);
+  return old_value;
+}
+
 // =============================================
 // Set a new value to a given bit
 
@@ -333,15 +446,28 @@ OpResult<bool> BitNewValue(const OpArgs& args, std::string_view key, uint32_t of
     return find_res;
   }
 
+  // Large sparse bitmaps never exist in the raw form.
+  const size_t new_size = GetByteIndex(offset) + 1;
   if (element_access.IsNewEntry()) {
-    std::string new_entry(GetByteIndex(offset) + 1, 0);
+    if (UseSparseBitmap(new_size, bit_value)) {
+      element_access.CommitSparse(std::string_view{}, offset, bit_value);
+      return false;
+    }
+    std::string new_entry(new_size, 0);
     old_value = SetBitValue(offset, bit_value, &new_entry);
     element_access.Commit(new_entry);
+  } else if (element_access.Bitmap()) {
+    old_value = element_access.SetSparseBit(offset, bit_value);
   } else {
     bool reset = false;
     std::string existing_entry{element_access.Value()};
     if ((existing_entry.size() * OFFSET_FACTOR) <= offset) {
-      existing_entry.resize(GetByteIndex(offset) + 1, 0);
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(existing_entry.data());
+      if (UseSparseBitmap(new_size, CountSetBits(data, existing_entry.size()) + bit_value)) {
+        element_access.CommitSparse(existing_entry, offset, bit_value);
+        return false;
+      }
+      existing_entry.resize(new_size, 0);
       reset = true;
     }
     old_value = SetBitValue(offset, bit_value, &existing_entry);
@@ -352,6 +478,217 @@ OpResult<bool> BitNewValue(const OpArgs& args, std::string_view key, uint32_t of
   return old_value;
 }
 
+// =============================================
+// BITFIELD subcommands
+
+enum class BitFieldOverflow : uint8_t { WRAP, SAT, FAIL };
+
+struct BitFieldOp {
+  enum Type : uint8_t { GET, SET, INCRBY };
+
+  Type type;
+  BitFieldOverflow overflow;
+  bool is_signed;
+  uint8_t bits;
+  uint64_t offset;  // in bits
+  int64_t value;    // SET value or INCRBY increment
+};
+
+// A reply per subcommand, or nullopt for the writes that failed with OVERFLOW FAIL.
+using BitFieldResults = std::vector<std::optional<int64_t>>;
+
+// Returns the unsigned integer of the bits [offset, offset + bits) of value, where the bits
+// past its end are zeros.
+uint64_t GetUnsignedBits(std::string_view value, uint64_t offset, uint8_t bits) {
+  uint64_t res = 0;
+  if (offset % OFFSET_FACTOR == 0 && bits % OFFSET_FACTOR == 0) {
+    for (size_t byte = offset / OFFSET_FACTOR; bits > 0; ++byte, bits -= OFFSET_FACTOR) {
+      res = (res << OFFSET_FACTOR) | (byte < value.size() ? uint8_t(value[byte]) : 0);
+    }
+    return res;
+  }
+
+  for (uint8_t i = 0; i < bits; ++i, ++offset) {
+    size_t byte = GetByteIndex(offset);
+    bool bit = byte < value.size() && CheckBitStatus(value[byte], GetNormalizedBitIndex(offset));
+    res = (res << 1) | bit;
+  }
+  return res;
+}
+
+int64_t GetBitField(std::string_view value, uint64_t offset, uint8_t bits, bool is_signed) {
+  uint64_t res = GetUnsignedBits(value, offset, bits);
+  if (is_signed && bits < 64 && (res >> (bits - 1))) {
+    res |= ~0ULL << bits;  // sign extension
+  }
+  return res;
+}
+
+// Writes the lowest bits of val to [offset, offset + bits) of value, which must be long enough.
+void SetBitField(uint64_t offset, uint8_t bits, uint64_t val, std::string* value) {
+  if (offset % OFFSET_FACTOR == 0 && bits % OFFSET_FACTOR == 0) {
+    for (size_t byte = offset / OFFSET_FACTOR; bits > 0; ++byte) {
+      bits -= OFFSET_FACTOR;
+      (*value)[byte] = char(val >> bits);
+    }
+    return;
+  }
+
+  for (uint8_t i = 0; i < bits; ++i, ++offset) {
+    uint8_t byte = (*value)[GetByteIndex(offset)];
+    uint32_t index = GetNormalizedBitIndex(offset);
+    bool bit = (val >> (bits - 1 - i)) & 1;
+    (*value)[GetByteIndex(offset)] = bit ? TurnBitOn(byte, index) : TunBitOff(byte, index);
+  }
+}
+
+// Returns the result of value + incr for a field of bits, or nullopt if it overflows with
+// OVERFLOW FAIL. Follows checkUnsignedBitfieldOverflow and checkSignedBitfieldOverflow of Redis.
+std::optional<int64_t> AddBitField(const BitFieldOp& op, int64_t value, int64_t incr) {
+  const uint8_t bits = op.bits;
+  auto wrap = [&] {
+    uint64_t res = uint64_t(value) + uint64_t(incr);  // defined on overflow
+    if (bits < 64) {
+      uint64_t mask = ~0ULL << bits;
+      res = (op.is_signed && (res >> (bits - 1)) & 1) ? (res | mask) : (res & ~mask);
+    }
+    return int64_t(res);
+  };
+
+  bool overflow = false, underflow = false;
+  int64_t max, min;
+  if (op.is_signed) {
+    max = bits == 64 ? INT64_MAX : (int64_t(1) << (bits - 1)) - 1;
+    min = -max - 1;
+    int64_t maxincr = uint64_t(max) - value;
+    int64_t minincr = uint64_t(min) - value;
+    overflow = value > max || (bits != 64 && incr > maxincr) ||
+               (value >= 0 && incr > 0 && incr > maxincr);
+    underflow = !overflow && (value < min || (bits != 64 && incr < minincr) ||
+                              (value < 0 && incr < 0 && incr < minincr));
+  } else {
+    // The unsigned fields have at most 63 bits.
+    max = ~0ULL >> (64 - bits);
+    min = 0;
+    uint64_t uvalue = value;
+    overflow = uvalue > uint64_t(max) || (incr > 0 && incr > max - value);
+    underflow = !overflow && incr < 0 && incr < -value;
+  }
+
+  if (!overflow && !underflow) {
+    return value + incr;
+  }
+  switch (op.overflow) {
+    case BitFieldOverflow::WRAP:
+      return wrap();
+    case BitFieldOverflow::SAT:
+      return overflow ? max : min;
+    case BitFieldOverflow::FAIL:
+      break;
+  }
+  return std::nullopt;
+}
+
+// Runs the subcommands one after another over value in a single pass. Sets changed if any of
+// them modified value.
+BitFieldResults ApplyBitFieldOps(const std::vector<BitFieldOp>& ops, std::string* value,
+                                 bool* changed) {
+  BitFieldResults results;
+  results.reserve(ops.size());
+  for (const BitFieldOp& op : ops) {
+    int64_t current = GetBitField(*value, op.offset, op.bits, op.is_signed);
+    if (op.type == BitFieldOp::GET) {
+      results.push_back(current);
+      continue;
+    }
+
+    std::optional<int64_t> res = op.type == BitFieldOp::SET ? AddBitField(op, op.value, 0)
+                                                            : AddBitField(op, current, op.value);
+    if (res) {
+      if (*res != current) {
+        SetBitField(op.offset, op.bits, *res, value);
+        *changed = true;
+      }
+      results.push_back(op.type == BitFieldOp::SET ? current : *res);
+    } else {
+      results.push_back(std::nullopt);
+    }
+  }
+  return results;
+}
+
+OpResult<BitFieldResults> ReadBitFields(const OpArgs& op_args, std::string_view key,
+                                        const std::vector<BitFieldOp>& ops) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND) {
+    return BitFieldResults(ops.size(), 0);
+  }
+  if (!it_res.ok()) {
+    return it_res.status();
+  }
+
+  const PrimeValue& pv = it_res.value()->second;
+  BitFieldResults results;
+  results.reserve(ops.size());
+  std::string scratch;
+  if (pv.GetSparseBitmap()) {
+    // Materializes only the bytes of every field.
+    for (const BitFieldOp& op : ops) {
+      size_t first = GetByteIndex(op.offset);
+      size_t last = std::min<size_t>((op.offset + op.bits + 7) / OFFSET_FACTOR, pv.Size());
+      std::string_view window;
+      if (first < last) {
+        window = pv.GetSlice(first, last - first, &scratch);
+      }
+      results.push_back(
+          GetBitField(window, op.offset - first * OFFSET_FACTOR, op.bits, op.is_signed));
+    }
+    return results;
+  }
+
+  // Raw strings are accessed in place.
+  std::string_view value;
+  if (pv.IsExternal()) {
+    scratch = GetString(pv, op_args.shard);
+    value = scratch;
+  } else {
+    value = pv.GetSlice(&scratch);
+  }
+  for (const BitFieldOp& op : ops) {
+    results.push_back(GetBitField(value, op.offset, op.bits, op.is_signed));
+  }
+  return results;
+}
+
+OpResult<BitFieldResults> WriteBitFields(const OpArgs& op_args, std::string_view key,
+                                         const std::vector<BitFieldOp>& ops) {
+  ElementAccess element_access{key, op_args};
+  auto find_res = element_access.Find(op_args.shard);
+  if (find_res != OpStatus::OK) {
+    return find_res;
+  }
+
+  // Like Redis, the string is grown up to the highest written field, even if its write fails.
+  size_t new_size = 0;
+  for (const BitFieldOp& op : ops) {
+    if (op.type != BitFieldOp::GET) {
+      new_size = std::max<size_t>(new_size, (op.offset + op.bits + 7) / OFFSET_FACTOR);
+    }
+  }
+
+  std::string value = element_access.Value();
+  bool changed = element_access.IsNewEntry() || value.size() < new_size;
+  if (value.size() < new_size) {
+    value.resize(new_size, 0);
+  }
+
+  BitFieldResults results = ApplyBitFieldOps(ops, &value, &changed);
+  if (changed) {
+    element_access.Commit(value);
+  }
+  return results;
+}
+
 // ---------------------------------------------------------
 
 std::string RunBitOperationOnValues(std::string_view op, const BitsStrVec& values) {
@@ -359,37 +696,46 @@ std::string RunBitOperationOnValues(std::string_view op, const BitsStrVec& value
   // on all the values we got from the database. Note that in case that one of the values
   // is shorter than the other it would return a 0 and the operation would continue
   // until we ran the longest value. The function will return the resulting new value
-  std::size_t max_len = 0;
-  std::size_t max_len_index = 0;
-
-  const auto BitOperation = [&]() {
-    if (op == OR_OP_NAME) {
-      std::string default_str{values[max_len_index]};
-      return BitOpString(OrOp, SkipOr, std::move(values), std::move(default_str));
-    } else if (op == XOR_OP_NAME) {
-      return BitOpString(XorOp, SkipXor, std::move(values), std::string(max_len, 0));
-    } else if (op == AND_OP_NAME) {
-      return BitOpString(AndOp, SkipAnd, std::move(values), std::string(max_len, 0));
-    } else if (op == NOT_OP_NAME) {
-      return BitOpNotString(values[0]);
-    } else {
-      LOG(FATAL) << "Operation not supported '" << op << "'";
-      return std::string{};  // otherwise we will have warning of not returning value
-    }
-  };
-
   if (values.empty()) {  // this is ok in case we don't have the src keys
     return std::string{};
   }
+
+  if (op == NOT_OP_NAME) {
+    return BitOpNotString(values[0]);
+  }
+
+  BitOpType op_type;
+  if (op == OR_OP_NAME) {
+    op_type = BitOpType::OR;
+  } else if (op == XOR_OP_NAME) {
+    op_type = BitOpType::XOR;
+  } else if (op == AND_OP_NAME) {
+    op_type = BitOpType::AND;
+  } else {
+    LOG(FATAL) << "Operation not supported '" << op << "'";
+    return std::string{};  // otherwise we will have warning of not returning value
+  }
+
   // The new result is the max length input
-  max_len = values[0].size();
+  std::size_t max_len = 0;
+  for (const auto& value : values) {
+    max_len = std::max(max_len, value.size());
+  }
+
+  // Applies the values one after another over the whole result, which runs the vector kernels
+  // on long stretches of memory.
+  std::string result = values[0];
+  result.resize(max_len, 0);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.data());
   for (std::size_t i = 1; i < values.size(); ++i) {
-    if (values[i].size() > max_len) {
-      max_len = values[i].size();
-      max_len_index = i;
+    const std::string& value = values[i];
+    BitOpInPlace(op_type, reinterpret_cast<const uint8_t*>(value.data()), value.size(), dest);
+    if (op_type == BitOpType::AND) {
+      // The missing bytes of the shorter values are zeros.
+      std::fill(result.begin() + value.size(), result.end(), 0);
     }
   }
-  return BitOperation();
+  return result;
 }
 
 OpResult<std::string> CombineResultOp(ShardStringResults result, std::string_view op) {
@@ -483,7 +829,51 @@ OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
 // ------------------------------------------------------------------------- //
 //  Impl for the command functions
 void BitPos(CmdArgList args, ConnectionContext* cntx) {
-  (*cntx)->SendLong(0);
+  // Support for the command BITPOS
+  // See details at https://redis.io/commands/bitpos/
+
+  if (args.size() > 6) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  std::string_view key = ArgS(args, 1);
+  int32_t value = 0;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &value)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (value != 0 && value != 1) {
+    return (*cntx)->SendError("The bit argument must be 1 or 0.");
+  }
+
+  int64_t start = 0;
+  int64_t end = std::numeric_limits<int64_t>::max();
+  bool end_given = false;
+  bool as_bit = false;
+  if (args.size() >= 4 && !absl::SimpleAtoi(ArgS(args, 3), &start)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (args.size() >= 5) {
+    if (!absl::SimpleAtoi(ArgS(args, 4), &end)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+    end_given = true;
+  }
+  if (args.size() == 6) {
+    ToUpper(&args[5]);
+    std::string_view unit = ArgS(args, 5);
+    if (unit == "BIT") {
+      as_bit = true;
+    } else if (unit != "BYTE") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return FindBitPosForValue(t->GetOpArgs(shard), key, value == 1, start, end, end_given, as_bit);
+  };
+  Transaction* trans = cntx->transaction;
+  OpResult<int64_t> res = trans->ScheduleSingleHopT(std::move(cb));
+  HandleOpValueResult(res, cntx);
 }
 
 void BitCount(CmdArgList args, ConnectionContext* cntx) {
@@ -517,12 +907,132 @@ void BitCount(CmdArgList args, ConnectionContext* cntx) {
   HandleOpValueResult(res, cntx);
 }
 
+// Parses the type of a field, like i16 or u8.
+bool ParseBitFieldType(std::string_view type, BitFieldOp* op) {
+  if (type.size() < 2 || (type[0] != 'i' && type[0] != 'u')) {
+    return false;
+  }
+  op->is_signed = type[0] == 'i';
+  uint32_t bits = 0;
+  if (!absl::SimpleAtoi(type.substr(1), &bits) || bits == 0 || bits > (op->is_signed ? 64 : 63)) {
+    return false;
+  }
+  op->bits = bits;
+  return true;
+}
+
+// Parses the offset of a field, which is in bits, or in multiples of the field width with #.
+bool ParseBitFieldOffset(std::string_view offset, BitFieldOp* op) {
+  bool multiply = absl::ConsumePrefix(&offset, "#");
+  int64_t num = 0;
+  if (!absl::SimpleAtoi(offset, &num) || num < 0) {
+    return false;
+  }
+  uint64_t res = num;
+  if (multiply) {
+    if (res > (1ULL << 32) / op->bits) {
+      return false;
+    }
+    res *= op->bits;
+  }
+  // Like the other bit commands, the strings are limited to 512MB.
+  if (res + op->bits > (1ULL << 32)) {
+    return false;
+  }
+  op->offset = res;
+  return true;
+}
+
+void BitFieldGeneric(CmdArgList args, bool read_only, ConnectionContext* cntx) {
+  // Support for the commands BITFIELD and BITFIELD_RO
+  // See details at https://redis.io/commands/bitfield/
+  std::string_view key = ArgS(args, 1);
+  std::vector<BitFieldOp> ops;
+  BitFieldOverflow overflow = BitFieldOverflow::WRAP;
+  bool has_writes = false;
+
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    std::string_view sub = ArgS(args, i);
+    size_t num_args = sub == "GET" ? 2 : (sub == "SET" || sub == "INCRBY") ? 3 : 1;
+    if (sub != "OVERFLOW" && num_args == 1) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    if (i + num_args >= args.size()) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    if (sub == "OVERFLOW") {
+      ToUpper(&args[++i]);
+      std::string_view type = ArgS(args, i);
+      if (type == "WRAP") {
+        overflow = BitFieldOverflow::WRAP;
+      } else if (type == "SAT") {
+        overflow = BitFieldOverflow::SAT;
+      } else if (type == "FAIL") {
+        overflow = BitFieldOverflow::FAIL;
+      } else {
+        return (*cntx)->SendError("Invalid OVERFLOW type specified");
+      }
+      continue;
+    }
+
+    if (read_only && sub != "GET") {
+      return (*cntx)->SendError("BITFIELD_RO only supports the GET subcommand");
+    }
+
+    BitFieldOp op{};
+    op.type = sub == "GET" ? BitFieldOp::GET : sub == "SET" ? BitFieldOp::SET : BitFieldOp::INCRBY;
+    op.overflow = overflow;
+    if (!ParseBitFieldType(ArgS(args, i + 1), &op)) {
+      return (*cntx)->SendError(
+          "Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but "
+          "i64 is.");
+    }
+    if (!ParseBitFieldOffset(ArgS(args, i + 2), &op)) {
+      return (*cntx)->SendError("bit offset is not an integer or out of range");
+    }
+    if (op.type != BitFieldOp::GET) {
+      if (!absl::SimpleAtoi(ArgS(args, i + 3), &op.value)) {
+        return (*cntx)->SendError(kInvalidIntErr);
+      }
+      has_writes = true;
+    }
+    ops.push_back(op);
+    i += num_args;
+  }
+
+  if (ops.empty()) {
+    return (*cntx)->SendEmptyArray();
+  }
+
+  // All the subcommands run in the same hop, over a single copy of the value.
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    return has_writes ? WriteBitFields(op_args, key, ops) : ReadBitFields(op_args, key, ops);
+  };
+  OpResult<BitFieldResults> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res) {
+    return (*cntx)->SendError(res.status());
+  }
+
+  (*cntx)->StartArray(res->size());
+  for (const std::optional<int64_t>& val : *res) {
+    if (val) {
+      (*cntx)->SendLong(*val);
+    } else {
+      (*cntx)->SendNull();
+    }
+  }
+}
+
 void BitField(CmdArgList args, ConnectionContext* cntx) {
-  (*cntx)->SendLong(0);
+  BitFieldGeneric(args, false, cntx);
 }
 
 void BitFieldRo(CmdArgList args, ConnectionContext* cntx) {
-  (*cntx)->SendLong(0);
+  BitFieldGeneric(args, true, cntx);
 }
 
 void BitOp(CmdArgList args, ConnectionContext* cntx) {
@@ -644,12 +1154,16 @@ std::string GetString(const PrimeValue& pv, EngineShard* shard) {
 }
 
 OpResult<bool> ReadValueBitsetAt(const OpArgs& op_args, std::string_view key, uint32_t offset) {
-  OpResult<std::string> result = ReadValue(op_args.db_cntx, key, op_args.shard);
-  if (result) {
-    return GetBitValueSafe(result.value(), offset);
-  } else {
-    return result.status();
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res.ok()) {
+    return it_res.status();
   }
+
+  const PrimeValue& pv = it_res.value()->second;
+  if (const SparseBitmap* bitmap = pv.GetSparseBitmap()) {
+    return bitmap->Get(offset);
+  }
+  return GetBitValueSafe(GetString(pv, op_args.shard), offset);
 }
 
 OpResult<std::string> ReadValue(const DbContext& context, std::string_view key,
@@ -666,19 +1180,45 @@ OpResult<std::string> ReadValue(const DbContext& context, std::string_view key,
 
 OpResult<std::size_t> CountBitsForValue(const OpArgs& op_args, std::string_view key, int64_t start,
                                         int64_t end, bool bit_value) {
-  OpResult<std::string> result = ReadValue(op_args.db_cntx, key, op_args.shard);
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res.ok()) {  // if this is not found, just return 0 - per Redis
+    return it_res.status();
+  }
 
-  if (result) {  // if this is not found, just return 0 - per Redis
-    if (result.value().empty()) {
-      return 0;
-    }
+  const PrimeValue& pv = it_res.value()->second;
+  if (const SparseBitmap* bitmap = pv.GetSparseBitmap()) {
     if (end == std::numeric_limits<int64_t>::max()) {
-      end = result.value().size();
+      end = bitmap->Size();
     }
-    return CountBitSet(result.value(), start, end, bit_value);
-  } else {
-    return result.status();
+    return CountBitSet(*bitmap, start, end, bit_value);
+  }
+
+  std::string value = GetString(pv, op_args.shard);
+  if (value.empty()) {
+    return 0;
+  }
+  if (end == std::numeric_limits<int64_t>::max()) {
+    end = value.size();
+  }
+  return CountBitSet(value, start, end, bit_value);
+}
+
+OpResult<int64_t> FindBitPosForValue(const OpArgs& op_args, std::string_view key, bool bit,
+                                     int64_t start, int64_t end, bool end_given, bool as_bit) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND) {
+    // A missing key is an empty string, so it has no set bits and an infinite run of clear ones.
+    return bit ? -1 : 0;
+  }
+  if (!it_res.ok()) {
+    return it_res.status();
+  }
+
+  const PrimeValue& pv = it_res.value()->second;
+  if (const SparseBitmap* bitmap = pv.GetSparseBitmap()) {
+    return FindBitPos(*bitmap, bit, start, end, end_given, as_bit);
   }
+  return FindBitPos(GetString(pv, op_args.shard), bit, start, end, end_given, as_bit);
 }
 
 }  // namespace
@@ -688,8 +1228,8 @@ void BitOpsFamily::Register(CommandRegistry* registry) {
 
   *registry << CI{"BITPOS", CO::CommandOpt::READONLY, -3, 1, 1, 1}.SetHandler(&BitPos)
             << CI{"BITCOUNT", CO::READONLY, -2, 1, 1, 1}.SetHandler(&BitCount)
-            << CI{"BITFIELD", CO::WRITE, -3, 1, 1, 1}.SetHandler(&BitField)
-            << CI{"BITFIELD_RO", CO::READONLY, -5, 1, 1, 1}.SetHandler(&BitFieldRo)
+            << CI{"BITFIELD", CO::WRITE, -2, 1, 1, 1}.SetHandler(&BitField)
+            << CI{"BITFIELD_RO", CO::READONLY, -2, 1, 1, 1}.SetHandler(&BitFieldRo)
             << CI{"BITOP", CO::WRITE, -4, 2, -1, 1}.SetHandler(&BitOp)
             << CI{"GETBIT", CO::READONLY | CO::FAST | CO::FAST, 3, 1, 1, 1}.SetHandler(&GetBit)
             << CI{"SETBIT", CO::WRITE, 4, 1, 1, 1}.SetHandler(&SetBit);
@@ -4,6 +4,9 @@
 
 #include "server/bitops_family.h"
 
+#include <absl/numeric/bits.h>
+#include <absl/random/random.h>
+
 #include <bitset>
 #include <iomanip>
 #include <iostream>
@@ -12,6 +15,7 @@
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "core/bitops.h"
 #include "facade/facade_test.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
@@ -420,4 +424,327 @@ TEST_F(BitOpsFamilyTest, BitOpsNot) {
   EXPECT_EQ(res, NOT_RESULTS);
 }
 
+TEST_F(BitOpsFamilyTest, BitPos) {
+  // The examples from https://redis.io/commands/bitpos/
+  Run({"set", "foo", string_view("\xff\xf0\x00", 3)});
+  EXPECT_EQ(12, CheckedInt({"bitpos", "foo", "0"}));
+
+  Run({"set", "foo", string_view("\x00\xff\xf0", 3)});
+  EXPECT_EQ(8, CheckedInt({"bitpos", "foo", "1", "0"}));
+  EXPECT_EQ(16, CheckedInt({"bitpos", "foo", "1", "2"}));
+  EXPECT_EQ(16, CheckedInt({"bitpos", "foo", "1", "2", "-1", "byte"}));
+  EXPECT_EQ(8, CheckedInt({"bitpos", "foo", "1", "7", "15", "bit"}));
+  EXPECT_EQ(20, CheckedInt({"bitpos", "foo", "0", "1", "-1"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "1", "3"}));
+
+  Run({"set", "foo", string_view("\x00\x00\x00", 3)});
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "1"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "1", "7", "-3", "bit"}));
+
+  // On a run of set bits, a clear bit is found right after the string unless end is given.
+  Run({"set", "foo", string(100, '\xff')});
+  EXPECT_EQ(800, CheckedInt({"bitpos", "foo", "0"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "0", "0", "-1"}));
+  EXPECT_EQ(80, CheckedInt({"bitpos", "foo", "1", "10"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "1", "-1", "-2"}));
+
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "missing", "1"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "missing", "0"}));
+
+  ASSERT_THAT(Run({"bitpos", "foo", "2"}), ErrArg("The bit argument must be 1 or 0."));
+  ASSERT_THAT(Run({"bitpos", "foo", "1", "a"}), ErrArg("value is not an integer or out of range"));
+  ASSERT_THAT(Run({"bitpos", "foo", "1", "0", "1", "bits"}), ErrArg("syntax error"));
+}
+
+TEST_F(BitOpsFamilyTest, SparseBitmap) {
+  // A 2MB bitmap with a couple of bits is stored compressed.
+  const uint32_t kLast = 1 << 24;
+  EXPECT_EQ(0, CheckedInt({"setbit", "foo", std::to_string(kLast), "1"}));
+  EXPECT_EQ(0, CheckedInt({"setbit", "foo", "11", "1"}));
+  EXPECT_EQ(1, CheckedInt({"setbit", "foo", "11", "1"}));
+  auto metrics = service_->server_family().GetMetrics();
+  EXPECT_LT(metrics.db[0].obj_memory_usage, 4096u);
+
+  EXPECT_EQ(1, CheckedInt({"getbit", "foo", "11"}));
+  EXPECT_EQ(0, CheckedInt({"getbit", "foo", "12"}));
+  EXPECT_EQ(2, CheckedInt({"bitcount", "foo"}));
+  EXPECT_EQ(1, CheckedInt({"bitcount", "foo", "2", "-1"}));
+  EXPECT_EQ(1, CheckedInt({"bitcount", "foo", "12", std::to_string(kLast), "bit"}));
+  EXPECT_EQ(11, CheckedInt({"bitpos", "foo", "1"}));
+  EXPECT_EQ(kLast, CheckedInt({"bitpos", "foo", "1", "2"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "foo", "0"}));
+  EXPECT_EQ(kLast + 1, CheckedInt({"bitpos", "foo", "0", std::to_string(kLast), "-1", "bit"}));
+
+  // GET returns the raw string.
+  string expected(kLast / 8 + 1, 0);
+  expected[1] = 0x10;
+  expected.back() = char(0x80);
+  EXPECT_EQ(expected.size(), CheckedInt({"strlen", "foo"}));
+  EXPECT_EQ(Run({"get", "foo"}), expected);
+  EXPECT_EQ(Run({"getrange", "foo", "0", "2"}), expected.substr(0, 3));
+
+  // BITOP results stay compressed while they are sparse.
+  Run({"set", "bar", "\x01"});
+  EXPECT_EQ(expected.size(), CheckedInt({"bitop", "or", "dest", "foo", "bar"}));
+  expected[0] = 1;
+  EXPECT_EQ(Run({"get", "dest"}), expected);
+  EXPECT_EQ(3, CheckedInt({"bitcount", "dest"}));
+  metrics = service_->server_family().GetMetrics();
+  EXPECT_LT(metrics.db[0].obj_memory_usage, 8192u);
+
+  // Growing a short string by far switches to the compressed encoding as well.
+  EXPECT_EQ(0, CheckedInt({"setbit", "bar", std::to_string(kLast), "1"}));
+  EXPECT_EQ(2, CheckedInt({"bitcount", "bar"}));
+
+  // Once it is dense, the bitmap becomes a raw string.
+  Run({"del", "foo", "dest", "bar"});
+  EXPECT_EQ(0, CheckedInt({"setbit", "foo", "32768", "1"}));
+  metrics = service_->server_family().GetMetrics();
+  EXPECT_LT(metrics.db[0].obj_memory_usage, 1024u);
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"setbit", "foo", std::to_string(i * 16), "1"});
+  }
+  EXPECT_EQ(1001, CheckedInt({"bitcount", "foo"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "foo", "1", "1", "1"}));
+  EXPECT_EQ(16, CheckedInt({"bitpos", "foo", "1", "1"}));
+  metrics = service_->server_family().GetMetrics();
+  EXPECT_GT(metrics.db[0].obj_memory_usage, 4096u);
+}
+
+TEST_F(BitOpsFamilyTest, BitField) {
+  // The examples from https://redis.io/commands/bitfield/
+  auto resp = Run({"bitfield", "foo", "incrby", "i5", "100", "1", "get", "u4", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0)));
+
+  resp = Run({"bitfield", "bar", "set", "i8", "#0", "100", "set", "i8", "#1", "200"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(0)));
+  resp = Run({"bitfield", "bar", "get", "u8", "#0", "get", "i8", "#1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(100), IntArg(-56)));
+  EXPECT_EQ(Run({"get", "bar"}), "d\xc8");
+
+  for (int i = 1; i <= 3; ++i) {
+    resp = Run({"bitfield", "mykey", "incrby", "u2", "100", "1", "overflow", "sat", "incrby", "u2",
+                "102", "1"});
+    EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(i), IntArg(i)));
+  }
+  resp = Run({"bitfield", "mykey", "incrby", "u2", "100", "1", "overflow", "sat", "incrby", "u2",
+              "102", "1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(3)));
+  EXPECT_THAT(Run({"bitfield", "mykey", "overflow", "fail", "incrby", "u2", "102", "1"}),
+              ArgType(RespExpr::NIL));
+
+  // Signed overflows, and the writes that do not fit the field.
+  resp = Run({"bitfield", "i64", "set", "i64", "0", "9223372036854775807", "incrby", "i64", "0",
+              "1", "overflow", "sat", "incrby", "i64", "0", "-1", "set", "u8", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(INT64_MIN), IntArg(INT64_MIN),
+                                         IntArg(128)));
+  EXPECT_EQ(255, CheckedInt({"bitfield", "i64", "get", "u8", "0"}));
+
+  // A missing key reads as zeros, and a GET does not create it.
+  resp = Run({"bitfield", "missing", "get", "u8", "0", "get", "i64", "1000"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(0)));
+  EXPECT_EQ(0, CheckedInt({"exists", "missing"}));
+  EXPECT_THAT(Run({"bitfield", "missing"}), ArrLen(0));
+
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"bitfield", "list", "get", "u8", "0"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bitfield", "foo", "get", "u64", "0"}), ErrArg("Invalid bitfield type"));
+  EXPECT_THAT(Run({"bitfield", "foo", "get", "i65", "0"}), ErrArg("Invalid bitfield type"));
+  EXPECT_THAT(Run({"bitfield", "foo", "get", "u8", "-1"}), ErrArg("bit offset is not an integer"));
+  EXPECT_THAT(Run({"bitfield", "foo", "get", "u8", "#536870912"}),
+              ErrArg("bit offset is not an integer"));
+  EXPECT_THAT(Run({"bitfield", "foo", "set", "u8", "0", "a"}), ErrArg("value is not an integer"));
+  EXPECT_THAT(Run({"bitfield", "foo", "overflow", "no"}), ErrArg("Invalid OVERFLOW type"));
+  EXPECT_THAT(Run({"bitfield", "foo", "get", "u8"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"bitfield", "foo", "del", "u8", "0"}), ErrArg("syntax error"));
+}
+
+TEST_F(BitOpsFamilyTest, BitFieldCounters) {
+  // A rate limiter that keeps many small counters in a single key.
+  vector<string> offsets, incrs;
+  for (unsigned i = 0; i < 64; ++i) {
+    offsets.push_back(StrCat("#", i));
+    incrs.push_back(StrCat(i));
+  }
+  vector<string_view> incr{"bitfield", "counters"}, get{"bitfield_ro", "counters"};
+  for (unsigned i = 0; i < 64; ++i) {
+    incr.insert(incr.end(), {"incrby", "u8", offsets[i], incrs[i]});
+    get.insert(get.end(), {"get", "u8", offsets[i]});
+  }
+
+  for (unsigned j = 1; j <= 3; ++j) {
+    auto resp = Run(absl::MakeSpan(incr));
+    ASSERT_THAT(resp, ArrLen(64));
+    for (unsigned i = 0; i < 64; ++i) {
+      EXPECT_THAT(resp.GetVec()[i], IntArg(i * j));
+    }
+  }
+  EXPECT_EQ(64, CheckedInt({"strlen", "counters"}));
+
+  auto resp = Run(absl::MakeSpan(get));
+  ASSERT_THAT(resp, ArrLen(64));
+  EXPECT_THAT(resp.GetVec()[33], IntArg(99));
+}
+
+TEST_F(BitOpsFamilyTest, BitFieldRo) {
+  Run({"set", "foo", "\x01\x02"});
+  auto resp = Run({"bitfield_ro", "foo", "get", "u8", "0", "get", "u16", "0", "get", "i4", "12"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(258), IntArg(2)));
+  EXPECT_THAT(Run({"bitfield_ro", "foo", "set", "u8", "0", "1"}),
+              ErrArg("BITFIELD_RO only supports the GET subcommand"));
+  EXPECT_THAT(Run({"bitfield_ro", "foo", "incrby", "u8", "0", "1"}),
+              ErrArg("BITFIELD_RO only supports the GET subcommand"));
+  EXPECT_EQ(Run({"get", "foo"}), "\x01\x02");
+
+  // The fields are read from sparse bitmaps without materializing them.
+  Run({"setbit", "sparse", "80000", "1"});
+  Run({"setbit", "sparse", "79999", "1"});
+  resp = Run({"bitfield_ro", "sparse", "get", "u2", "79999", "get", "u8", "#9999", "get", "u8",
+              "#100000"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(3), IntArg(1), IntArg(0)));
+  resp = Run({"bitfield", "sparse", "incrby", "u8", "#9999", "1", "get", "u8", "#9999"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), IntArg(2)));
+  EXPECT_EQ(2, CheckedInt({"bitcount", "sparse"}));
+  EXPECT_EQ(1, CheckedInt({"getbit", "sparse", "79998"}));
+}
+
+// ------------------------- Kernel tests
+
+class BitOpsKernelTest : public ::testing::TestWithParam<SimdLevel> {
+ protected:
+  void SetUp() final {
+    level_ = SetBitOpsSimdLevel(GetParam());
+  }
+
+  void TearDown() final {
+    SetBitOpsSimdLevel(SimdLevel::AVX512);
+  }
+
+  // Random bytes with a few long runs of zeros and ones, like sparse and dense bitmaps.
+  string RandomBitmap(size_t len) {
+    string res(len, 0);
+    for (auto& c : res) {
+      c = absl::Uniform<uint8_t>(gen_);
+    }
+    if (len > 64) {
+      size_t from = absl::Uniform<size_t>(gen_, 0, len / 2);
+      char fill = absl::Bernoulli(gen_, 0.5) ? 0xff : 0;
+      std::fill(res.begin() + from, res.begin() + from + len / 4, fill);
+    }
+    return res;
+  }
+
+  absl::InsecureBitGen gen_;
+  SimdLevel level_;
+};
+
+TEST_P(BitOpsKernelTest, CountSetBits) {
+  for (size_t len : {0, 1, 7, 31, 32, 63, 64, 65, 255, 1000, 4096, 100000}) {
+    string bitmap = RandomBitmap(len + 3);
+    // Unaligned buffers of every length.
+    for (size_t offset = 0; offset < 3; ++offset) {
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(bitmap.data()) + offset;
+      uint64_t expected = 0;
+      for (size_t i = 0; i < len; ++i) {
+        expected += absl::popcount(data[i]);
+      }
+      ASSERT_EQ(expected, CountSetBits(data, len)) << len << " " << offset;
+    }
+  }
+}
+
+TEST_P(BitOpsKernelTest, BitOpInPlace) {
+  for (size_t len : {0, 1, 31, 32, 65, 129, 1000, 4097}) {
+    string src = RandomBitmap(len);
+    string dest = RandomBitmap(len);
+    const uint8_t* src_data = reinterpret_cast<const uint8_t*>(src.data());
+
+    for (BitOpType op : {BitOpType::AND, BitOpType::OR, BitOpType::XOR}) {
+      string res = dest;
+      BitOpInPlace(op, src_data, len, reinterpret_cast<uint8_t*>(res.data()));
+      for (size_t i = 0; i < len; ++i) {
+        char expected = op == BitOpType::AND  ? (dest[i] & src[i])
+                        : op == BitOpType::OR ? (dest[i] | src[i])
+                                              : (dest[i] ^ src[i]);
+        ASSERT_EQ(expected, res[i]) << len << " " << i;
+      }
+    }
+
+    string res = dest;
+    BitNotInPlace(reinterpret_cast<uint8_t*>(res.data()), len);
+    for (size_t i = 0; i < len; ++i) {
+      ASSERT_EQ(char(~dest[i]), res[i]);
+    }
+  }
+}
+
+TEST_P(BitOpsKernelTest, FindFirstByteNotEqual) {
+  for (size_t len : {0, 1, 31, 32, 64, 65, 200, 5000}) {
+    for (uint8_t val : {0x00, 0xff}) {
+      string bitmap(len, val);
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(bitmap.data());
+      ASSERT_EQ(len, FindFirstByteNotEqual(data, len, val));
+      for (size_t pos = 0; pos < len; pos += 1 + pos / 3) {
+        bitmap[pos] = val ^ 0x10;
+        ASSERT_EQ(pos, FindFirstByteNotEqual(data, len, val)) << len;
+        bitmap[pos] = val;
+      }
+    }
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(Simd, BitOpsKernelTest,
+                         Values(SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512));
+
+// The kernels over 1MB bitmaps, the argument is the SimdLevel.
+static string BenchBitmap(size_t len) {
+  string buf(len, 0);
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = char(i * 7919);
+  return buf;
+}
+
+static void BM_CountSetBits(benchmark::State& state) {
+  SetBitOpsSimdLevel(SimdLevel(state.range(0)));
+  string buf = BenchBitmap(1 << 20);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buf.data());
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(CountSetBits(data, buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+  SetBitOpsSimdLevel(SimdLevel::AVX512);
+}
+BENCHMARK(BM_CountSetBits)->Arg(0)->Arg(1)->Arg(2);
+
+static void BM_BitOpAnd(benchmark::State& state) {
+  SetBitOpsSimdLevel(SimdLevel(state.range(0)));
+  string src = BenchBitmap(1 << 20);
+  string dest(src.size(), '\xff');
+
+  while (state.KeepRunning()) {
+    BitOpInPlace(BitOpType::AND, reinterpret_cast<const uint8_t*>(src.data()), src.size(),
+                 reinterpret_cast<uint8_t*>(dest.data()));
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * src.size());
+  SetBitOpsSimdLevel(SimdLevel::AVX512);
+}
+BENCHMARK(BM_BitOpAnd)->Arg(0)->Arg(1)->Arg(2);
+
+static void BM_FindFirstByteNotEqual(benchmark::State& state) {
+  SetBitOpsSimdLevel(SimdLevel(state.range(0)));
+  string buf(1 << 20, 0);
+  buf.back() = 1;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buf.data());
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(FindFirstByteNotEqual(data, buf.size(), 0));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+  SetBitOpsSimdLevel(SimdLevel::AVX512);
+}
+BENCHMARK(BM_FindFirstByteNotEqual)->Arg(0)->Arg(1)->Arg(2);
+
 }  // end of namespace dfly
@@ -30,15 +30,30 @@ struct WatchItem {
 };
 
 struct BlockingController::WatchQueue {
-  deque<WatchItem> items;
+  list<WatchItem> items;
+
+  // Positions of the transactions in items, so that they are removed in O(1).
+  absl::flat_hash_map<Transaction*, list<WatchItem>::iterator> positions;
+
   TxId notify_txid = UINT64_MAX;
 
+  // The transaction notified last, the next one is notified once it completes.
+  Transaction* notified = nullptr;
+
   // Updated  by both coordinator and shard threads but at different times.
   enum State { SUSPENDED, ACTIVE } state = SUSPENDED;
 
   void Suspend() {
     state = SUSPENDED;
     notify_txid = UINT64_MAX;
+    notified = nullptr;
+  }
+
+  Transaction* PopFront() {
+    Transaction* trans = items.front().get();
+    positions.erase(trans);
+    items.pop_front();
+    return trans;
   }
 };
 
@@ -97,8 +112,14 @@ void BlockingController::RunStep(Transaction* completed_t) {
       ShardId sid = owner_->shard_id();
       KeyLockArgs lock_args = completed_t->GetLockArgs(sid);
 
+      // Only the queues that notified completed_t move on, other keys of completed_t, like
+      // the destination of BLMOVE, get their waiters notified by the pushes.
       for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
         string_view key = lock_args.args[i];
+        auto it = wt.queue_map.find(key);
+        if (it == wt.queue_map.end() || it->second->notified != completed_t)
+          continue;
+        it->second->notified = nullptr;
         if (wt.AddAwakeEvent(WatchQueue::ACTIVE, key)) {
           awakened_indices_.emplace(completed_t->db_index());
         }
@@ -121,11 +142,16 @@ void BlockingController::RunStep(Transaction* completed_t) {
       DVLOG(1) << "Processing awakened key " << sv_key;
 
       // Double verify we still got the item.
-      auto [it, exp_it] = owner_->db_slice().FindExt(context, sv_key);
-      if (!IsValid(it) || it->second.ObjType() != OBJ_LIST)  // Only LIST is allowed to block.
+      PrimeIterator it = owner_->db_slice().FindExt(context, sv_key);
+      unsigned obj_type = IsValid(it) ? it->second.ObjType() : OBJ_STRING;
+      if (obj_type != OBJ_LIST && obj_type != OBJ_STREAM) {  // Only LIST and STREAM can block.
+        // The waiters are awakened again once the list is created.
+        if (auto wq_it = wt.queue_map.find(sv_key); wq_it != wt.queue_map.end())
+          wq_it->second->Suspend();
         continue;
+      }
 
-      NotifyWatchQueue(sv_key, &wt.queue_map);
+      NotifyWatchQueue(sv_key, &wt.queue_map, obj_type == OBJ_STREAM);
     }
     wt.awakened_keys.clear();
 
@@ -136,9 +162,13 @@ void BlockingController::RunStep(Transaction* completed_t) {
   awakened_indices_.clear();
 }
 
-void BlockingController::AddWatched(Transaction* trans) {
+void BlockingController::AddWatched(Transaction* trans, ArgSlice keys) {
   VLOG(1) << "AddWatched [" << owner_->shard_id() << "] " << trans->DebugId();
 
+  if (keys.empty())
+    return;
+
+  blocked_.insert(trans);
   auto [dbit, added] = watched_dbs_.emplace(trans->db_index(), nullptr);
   if (added) {
     dbit->second.reset(new DbWatchTable);
@@ -146,29 +176,26 @@ void BlockingController::AddWatched(Transaction* trans) {
 
   DbWatchTable& wt = *dbit->second;
 
-  auto args = trans->ShardArgsInShard(owner_->shard_id());
-  for (auto key : args) {
+  for (auto key : keys) {
     auto [res, inserted] = wt.queue_map.emplace(key, nullptr);
     if (inserted) {
       res->second.reset(new WatchQueue);
     }
 
-    if (!res->second->items.empty()) {
-      Transaction* last = res->second->items.back().get();
-      DCHECK_GT(last->use_count(), 0u);
+    WatchQueue& wq = *res->second;
+
+    // Duplicate keys case. We push only once per key.
+    if (wq.positions.contains(trans))
+      continue;
 
-      // Duplicate keys case. We push only once per key.
-      if (last == trans)
-        continue;
-    }
     DVLOG(2) << "Emplace " << trans << " " << trans->DebugId() << " to watch " << key;
-    res->second->items.emplace_back(trans);
+    wq.positions.emplace(trans, wq.items.emplace(wq.items.end(), trans));
   }
 }
 
-// Runs in O(N) complexity in the worst case.
 void BlockingController::RemoveWatched(Transaction* trans) {
   VLOG(1) << "RemoveWatched [" << owner_->shard_id() << "] " << trans->DebugId();
+  blocked_.erase(trans);
 
   auto dbit = watched_dbs_.find(trans->db_index());
   if (dbit == watched_dbs_.end())
@@ -181,14 +208,13 @@ void BlockingController::RemoveWatched(Transaction* trans) {
     if (watch_it == wt.queue_map.end())
       continue;  // that can happen in case of duplicate keys
 
+    // again, we may not find trans if we searched for the same key several times, or if it
+    // had been notified by this key.
     WatchQueue& wq = *watch_it->second;
-    for (auto items_it = wq.items.begin(); items_it != wq.items.end(); ++items_it) {
-      if (items_it->trans == trans) {
-        wq.items.erase(items_it);
-        break;
-      }
+    if (auto pos_it = wq.positions.find(trans); pos_it != wq.positions.end()) {
+      wq.items.erase(pos_it->second);
+      wq.positions.erase(pos_it);
     }
-    // again, we may not find trans if we searched for the same key several times.
 
     if (wq.items.empty()) {
       wt.RemoveEntry(watch_it);
@@ -222,7 +248,10 @@ void BlockingController::AwakeWatched(DbIndex db_index, string_view db_key) {
 
 // Internal function called from RunStep().
 // Marks the queue as active and notifies the first transaction in the queue.
-void BlockingController::NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm) {
+// Notifies all the transactions if notify_all is set, since every reader of a stream gets the
+// new entries, while an element of a list goes to a single popper.
+void BlockingController::NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm,
+                                          bool notify_all) {
   auto w_it = wqm->find(key);
   CHECK(w_it != wqm->end());
   DVLOG(1) << "Notify WQ: [" << owner_->shard_id() << "] " << key;
@@ -233,15 +262,23 @@ void BlockingController::NotifyWatchQueue(std::string_view key, WatchQueueMap* w
   auto& queue = wq->items;
   ShardId sid = owner_->shard_id();
 
+  if (notify_all) {
+    while (!queue.empty()) {
+      Transaction* head = wq->PopFront();
+      if (head->NotifySuspended(owner_->committed_txid(), sid))
+        awakened_transactions_.insert(head);
+    }
+    wqm->erase(w_it);
+    return;
+  }
+
   do {
-    WatchItem& wi = queue.front();
-    Transaction* head = wi.get();
+    Transaction* head = wq->PopFront();
     DVLOG(2) << "Pop " << head << " from key " << key;
 
-    queue.pop_front();
-
     if (head->NotifySuspended(owner_->committed_txid(), sid)) {
       wq->notify_txid = owner_->committed_txid();
+      wq->notified = head;
       awakened_transactions_.insert(head);
       break;
     }
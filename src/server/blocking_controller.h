@@ -37,13 +37,18 @@ class BlockingController {
   // Blocking API
   // TODO: consider moving all watched functions to
   // EngineShard with separate per db map.
-  //! AddWatched adds a transaction to the blocking queue.
-  void AddWatched(Transaction* me);
+  //! AddWatched adds a transaction to the blocking queues of keys, which belong to this shard.
+  void AddWatched(Transaction* me, ArgSlice keys);
   void RemoveWatched(Transaction* me);
 
-  // Called from operations that create keys like lpush, rename etc.
+  // Called from operations that create keys like lpush, rename etc, and from xadd.
   void AwakeWatched(DbIndex db_index, std::string_view db_key);
 
+  // Number of the transactions that are blocked on the keys of the shard.
+  size_t NumBlocked() const {
+    return blocked_.size();
+  }
+
   // Used in tests and debugging functions.
   size_t NumWatched(DbIndex db_indx) const;
   std::vector<std::string> GetWatchedKeys(DbIndex db_indx) const;
@@ -54,7 +59,7 @@ class BlockingController {
 
   using WatchQueueMap = absl::flat_hash_map<std::string, std::unique_ptr<WatchQueue>>;
 
-  void NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm);
+  void NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm, bool notify_all);
 
   // void NotifyConvergence(Transaction* tx);
 
@@ -71,6 +76,9 @@ class BlockingController {
   // could awaken arbitrary number of keys.
   absl::flat_hash_set<Transaction*> awakened_transactions_;
 
+  // The transactions between AddWatched and RemoveWatched.
+  absl::flat_hash_set<Transaction*> blocked_;
+
   // absl::btree_multimap<TxId, Transaction*> waiting_convergence_;
 };
 }  // namespace dfly
@@ -67,7 +67,7 @@ void BlockingControllerTest::TearDown() {
 TEST_F(BlockingControllerTest, Basic) {
   shard_set->Await(0, [&] {
     BlockingController bc(EngineShard::tlocal());
-    bc.AddWatched(trans_.get());
+    bc.AddWatched(trans_.get(), trans_->ShardArgsInShard(0));
     EXPECT_EQ(1, bc.NumWatched(0));
 
     bc.RemoveWatched(trans_.get());
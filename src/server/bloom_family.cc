@@ -0,0 +1,318 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/numbers.h>
+
+#include <memory>
+
+#include "base/logging.h"
+#include "core/bloom_filter.h"
+#include "server/command_registry.h"
+#include "server/common.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+using CI = CommandId;
+using AddResult = BloomFilter::AddResult;
+
+constexpr char kFilterFullErr[] = "non scaling filter is full";
+constexpr char kItemExistsErr[] = "item exists";
+
+// Keep the allocation of the first sub-filter reasonable. The expansion is limited like in
+// RedisBloom.
+constexpr size_t kMaxFilterSize = 1ULL << 30;
+constexpr unsigned kMaxExpansion = 32768;
+
+struct ReserveParams {
+  double error_rate = BloomFilter::kDefaultErrorRate;
+  uint64_t capacity = BloomFilter::kDefaultCapacity;
+  unsigned expansion = BloomFilter::kDefaultExpansion;
+};
+
+string GetString(EngineShard* shard, const PrimeValue& pv) {
+  string res;
+  if (pv.IsExternal()) {
+    auto [offset, size] = pv.GetExternalPtr();
+    res.resize(size);
+
+    error_code ec = shard->tiered_storage()->Read(offset, size, res.data());
+    CHECK(!ec) << "TBD: " << ec;
+  } else {
+    pv.GetString(&res);
+  }
+  return res;
+}
+
+// Returns the filter of pv, or nullptr if pv is not a filter. A filter that was loaded as a plain
+// string, e.g. from an RDB file or by a full sync, is parsed into tmp, and the next write stores
+// the parsed filter in place of the string.
+const BloomFilter* ReadFilter(EngineShard* shard, const PrimeValue& pv,
+                              unique_ptr<BloomFilter>* tmp) {
+  if (const BloomFilter* bf = pv.GetBloomFilter())
+    return bf;
+
+  string raw = GetString(shard, pv);
+  if (!BloomFilter::HasMagic(raw))
+    return nullptr;
+
+  *tmp = make_unique<BloomFilter>(CompactObj::memory_resource());
+  return (*tmp)->Parse(raw) ? tmp->get() : nullptr;
+}
+
+// Creates the filter of key with params, or fails with KEY_EXISTS if the key exists.
+OpStatus OpReserve(const OpArgs& op_args, string_view key, const ReserveParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  auto [it, added] = add_res;
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  it->second.InitBloomFilter()->Init(params.error_rate, params.capacity, params.expansion);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
+  return OpStatus::OK;
+}
+
+OpStatus OpAdd(const OpArgs& op_args, string_view key, ArgSlice items, AddResult* res) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  auto [it, added] = add_res;
+  PrimeValue& pv = it->second;
+  BloomFilter* bf = nullptr;
+  if (added) {
+    bf = pv.InitBloomFilter();
+    bf->Init(BloomFilter::kDefaultErrorRate, BloomFilter::kDefaultCapacity,
+             BloomFilter::kDefaultExpansion);
+  } else {
+    if (pv.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+
+    bf = pv.GetBloomFilter();
+    if (!bf) {
+      // Replaces the plain string of the filter with the parsed one.
+      string raw = GetString(op_args.shard, pv);
+      if (!BloomFilter::HasMagic(raw))
+        return OpStatus::WRONG_TYPE;
+
+      db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+      bf = pv.InitBloomFilter();
+      if (!bf->Parse(raw)) {
+        pv.SetString(raw);
+        db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
+        return OpStatus::WRONG_TYPE;
+      }
+    } else {
+      db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    }
+  }
+
+  bf->AddMany(items, res);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+  return OpStatus::OK;
+}
+
+// Missing keys have no items.
+OpStatus OpExists(const OpArgs& op_args, string_view key, ArgSlice items, bool* res) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND) {
+    fill(res, res + items.size(), false);
+    return OpStatus::OK;
+  }
+  if (!it_res)
+    return it_res.status();
+
+  unique_ptr<BloomFilter> tmp;
+  const BloomFilter* bf = ReadFilter(op_args.shard, it_res.value()->second, &tmp);
+  if (!bf)
+    return OpStatus::WRONG_TYPE;
+
+  bf->ExistsMany(items, res);
+  return OpStatus::OK;
+}
+
+OpResult<uint64_t> OpCard(const OpArgs& op_args, string_view key) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND)
+    return 0;
+  if (!it_res)
+    return it_res.status();
+
+  unique_ptr<BloomFilter> tmp;
+  const BloomFilter* bf = ReadFilter(op_args.shard, it_res.value()->second, &tmp);
+  if (!bf)
+    return OpStatus::WRONG_TYPE;
+  return bf->NumItems();
+}
+
+vector<string_view> ItemArgs(CmdArgList args) {
+  vector<string_view> items(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i)
+    items[i - 2] = ArgS(args, i);
+  return items;
+}
+
+OpStatus AddItems(CmdArgList args, ConnectionContext* cntx, vector<AddResult>* res) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+  res->resize(items.size());
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), key, items, res->data());
+  };
+  return cntx->transaction->ScheduleSingleHop(std::move(cb));
+}
+
+OpStatus ExistItems(CmdArgList args, ConnectionContext* cntx, unique_ptr<bool[]>* res) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+  *res = make_unique<bool[]>(items.size());
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpExists(t->GetOpArgs(shard), key, items, res->get());
+  };
+  return cntx->transaction->ScheduleSingleHop(std::move(cb));
+}
+
+void BfReserve(CmdArgList args, ConnectionContext* cntx) {
+  // BF.RESERVE key error_rate capacity [EXPANSION expansion] [NONSCALING]
+  string_view key = ArgS(args, 1);
+  ReserveParams params;
+  if (!absl::SimpleAtod(ArgS(args, 2), &params.error_rate))
+    return (*cntx)->SendError(kInvalidFloatErr);
+  if (!absl::SimpleAtoi(ArgS(args, 3), &params.capacity))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  bool nonscaling = false, has_expansion = false;
+  for (size_t i = 4; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "NONSCALING") {
+      nonscaling = true;
+    } else if (arg == "EXPANSION" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &params.expansion))
+        return (*cntx)->SendError(kInvalidIntErr);
+      has_expansion = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!(params.error_rate > 0 && params.error_rate < 1))
+    return (*cntx)->SendError("(0 < error rate range < 1)");
+  if (params.capacity == 0)
+    return (*cntx)->SendError("(capacity should be larger than 0)");
+  if (BloomFilter::FilterSize(params.error_rate, params.capacity) > kMaxFilterSize)
+    return (*cntx)->SendError("filter would be larger than 1GB");
+  if (nonscaling) {
+    if (has_expansion)
+      return (*cntx)->SendError("nonscaling filters cannot expand");
+    params.expansion = 0;
+  } else if (params.expansion < 1 || params.expansion > kMaxExpansion) {
+    return (*cntx)->SendError("expansion should be in the range [1, 32768]");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpReserve(t->GetOpArgs(shard), key, params);
+  };
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status == OpStatus::KEY_EXISTS)
+    return (*cntx)->SendError(kItemExistsErr);
+  (*cntx)->SendError(status);
+}
+
+void BfAdd(CmdArgList args, ConnectionContext* cntx) {
+  vector<AddResult> res;
+  OpStatus status = AddItems(args, cntx, &res);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+  if (res[0] == BloomFilter::FULL)
+    return (*cntx)->SendError(kFilterFullErr);
+  (*cntx)->SendLong(res[0] == BloomFilter::ADDED);
+}
+
+void BfMAdd(CmdArgList args, ConnectionContext* cntx) {
+  vector<AddResult> res;
+  OpStatus status = AddItems(args, cntx, &res);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+
+  // Like RedisBloom, the items that did not fit a full filter are errors within the array.
+  (*cntx)->StartArray(res.size());
+  for (AddResult r : res) {
+    if (r == BloomFilter::FULL)
+      (*cntx)->SendError(kFilterFullErr);
+    else
+      (*cntx)->SendLong(r == BloomFilter::ADDED);
+  }
+}
+
+void BfExists(CmdArgList args, ConnectionContext* cntx) {
+  unique_ptr<bool[]> res;
+  OpStatus status = ExistItems(args, cntx, &res);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+  (*cntx)->SendLong(res[0]);
+}
+
+void BfMExists(CmdArgList args, ConnectionContext* cntx) {
+  unique_ptr<bool[]> res;
+  OpStatus status = ExistItems(args, cntx, &res);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+
+  size_t num_items = args.size() - 2;
+  (*cntx)->StartArray(num_items);
+  for (size_t i = 0; i < num_items; ++i)
+    (*cntx)->SendLong(res[i]);
+}
+
+void BfCard(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) { return OpCard(t->GetOpArgs(shard), key); };
+
+  OpResult<uint64_t> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return (*cntx)->SendError(res.status());
+  (*cntx)->SendLong(*res);
+}
+
+}  // namespace
+
+void BloomFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"BF.RESERVE", CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.SetHandler(&BfReserve)
+            << CI{"BF.ADD", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.SetHandler(&BfAdd)
+            << CI{"BF.MADD", CO::WRITE | CO::DENYOOM | CO::FAST, -3, 1, 1, 1}.SetHandler(&BfMAdd)
+            << CI{"BF.EXISTS", CO::READONLY | CO::FAST, 3, 1, 1, 1}.SetHandler(&BfExists)
+            << CI{"BF.MEXISTS", CO::READONLY | CO::FAST, -3, 1, 1, 1}.SetHandler(&BfMExists)
+            << CI{"BF.CARD", CO::READONLY | CO::FAST, 2, 1, 1, 1}.SetHandler(&BfCard);
+}
+
+}  // namespace dfly
@@ -0,0 +1,18 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace dfly {
+
+class CommandRegistry;
+
+// The Bloom filter commands of RedisBloom: BF.RESERVE, BF.ADD, BF.MADD, BF.EXISTS, BF.MEXISTS
+// and BF.CARD. The filters are string values, see core/bloom_filter.h.
+class BloomFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
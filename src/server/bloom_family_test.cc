@@ -0,0 +1,109 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class BloomFamilyTest : public BaseFamilyTest {
+ protected:
+};
+
+TEST_F(BloomFamilyTest, AddExists) {
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "bf", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "bf", "b"}));
+  EXPECT_EQ(1, CheckedInt({"bf.card", "bf"}));
+  EXPECT_EQ(0, CheckedInt({"bf.card", "missing"}));
+
+  auto resp = Run({"bf.madd", "bf", "a", "b", "c", "b"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(1), IntArg(1), IntArg(0)));
+
+  resp = Run({"bf.mexists", "bf", "a", "b", "c", "d"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(1), IntArg(1), IntArg(0)));
+  EXPECT_EQ(3, CheckedInt({"bf.card", "bf"}));
+}
+
+TEST_F(BloomFamilyTest, Reserve) {
+  EXPECT_EQ(Run({"bf.reserve", "bf", "0.001", "10", "nonscaling"}), "OK");
+  EXPECT_THAT(Run({"bf.reserve", "bf", "0.01", "10"}), ErrArg("item exists"));
+
+  vector<string> items;
+  for (unsigned i = 0; i < 20; ++i)
+    items.push_back(StrCat("item:", i));
+  vector<string_view> cmd{"bf.madd", "bf"};
+  cmd.insert(cmd.end(), items.begin(), items.end());
+
+  // The non scaling filter rejects the items above its capacity.
+  auto resp = Run(cmd);
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  ASSERT_EQ(20u, resp.GetVec().size());
+  EXPECT_THAT(resp.GetVec()[0], IntArg(1));
+  unsigned num_errors = 0;
+  for (const auto& elem : resp.GetVec())
+    num_errors += elem.type == RespExpr::ERROR;
+  EXPECT_GE(num_errors, 9u);
+  EXPECT_EQ(10, CheckedInt({"bf.card", "bf"}));
+  EXPECT_THAT(Run({"bf.add", "bf", "new"}), ErrArg("non scaling filter is full"));
+
+  EXPECT_EQ(Run({"bf.reserve", "scaling", "0.01", "10", "EXPANSION", "4"}), "OK");
+  cmd[1] = "scaling";
+  resp = Run(cmd);
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_GE(CheckedInt({"bf.card", "scaling"}), 19);
+
+  EXPECT_THAT(Run({"bf.reserve", "x", "1.5", "10"}), ErrArg("error rate"));
+  EXPECT_THAT(Run({"bf.reserve", "x", "0.01", "0"}), ErrArg("capacity"));
+  EXPECT_THAT(Run({"bf.reserve", "x", "0.01", "10", "EXPANSION", "0"}), ErrArg("expansion"));
+  EXPECT_THAT(Run({"bf.reserve", "x", "0.01", "10", "EXPANSION", "2", "NONSCALING"}),
+              ErrArg("cannot expand"));
+  EXPECT_THAT(Run({"bf.reserve", "x", "0.01", "1000000000000"}), ErrArg("larger than"));
+  EXPECT_THAT(Run({"bf.reserve", "x", "0.01", "10", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(BloomFamilyTest, Reload) {
+  Run({"bf.reserve", "bf", "0.01", "100"});
+  for (unsigned i = 0; i < 1000; ++i)
+    Run({"bf.add", "bf", StrCat("item:", i)});
+  int64_t card = CheckedInt({"bf.card", "bf"});
+
+  // The filter is saved as its serialized string and parsed back by the next command.
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+  EXPECT_EQ(card, CheckedInt({"bf.card", "bf"}));
+  for (unsigned i = 0; i < 1000; ++i)
+    ASSERT_EQ(1, CheckedInt({"bf.exists", "bf", StrCat("item:", i)})) << i;
+  EXPECT_EQ(0, CheckedInt({"bf.add", "bf", "item:1"}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "bf", "item:1"}));
+}
+
+TEST_F(BloomFamilyTest, WrongType) {
+  Run({"set", "str", "foo"});
+  Run({"lpush", "list", "a"});
+
+  EXPECT_THAT(Run({"bf.add", "str", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.exists", "str", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.madd", "list", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.mexists", "list", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.card", "list"}), ErrArg("WRONGTYPE"));
+  EXPECT_EQ(Run({"get", "str"}), "foo");
+}
+
+}  // namespace dfly
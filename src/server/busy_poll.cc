@@ -0,0 +1,84 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/busy_poll.h"
+
+#include <boost/fiber/operations.hpp>
+
+#include "base/logging.h"
+#include "server/engine_shard_set.h"
+#include "server/server_state.h"
+#include "util/fiber_sched_algo.h"
+#include "util/proactor_base.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+namespace this_fiber = ::boost::this_fiber;
+namespace fibers = ::boost::fibers;
+
+namespace {
+
+// How often a sleeping poller checks whether the thread became active.
+constexpr auto kSleepPeriod = chrono::microseconds(500);
+
+uint64_t ThreadActivity() {
+  uint64_t res = ServerState::tl_connection_stats()->io_read_cnt;
+  if (EngineShard* shard = EngineShard::tlocal())
+    res += shard->stats().tx_hops;
+  return res;
+}
+
+}  // namespace
+
+BusyPoller::~BusyPoller() {
+  Stop();
+}
+
+void BusyPoller::Start() {
+  DCHECK(!fiber_.joinable());
+  last_activity_ = ThreadActivity();
+  last_active_ns_ = ProactorBase::GetMonotonicTimeNs();
+
+  fiber_ = fibers::fiber([this] {
+    this_fiber::properties<FiberProps>().set_name("busy_poll");
+    Run();
+  });
+}
+
+void BusyPoller::Stop() {
+  if (fiber_.joinable()) {
+    stop_ = true;
+    fiber_.join();
+  }
+}
+
+bool BusyPoller::Step(uint64_t activity, uint64_t now_ns) {
+  if (activity != last_activity_) {
+    last_activity_ = activity;
+    last_active_ns_ = now_ns;
+  }
+
+  if (last_step_ns_ && now_ns > last_step_ns_) {
+    uint64_t delta = now_ns - last_step_ns_;
+    (spinning_ ? stats_.poll_ns : stats_.sleep_ns) += delta;
+  }
+  last_step_ns_ = now_ns;
+
+  spinning_ = now_ns - last_active_ns_ < budget_ns_;
+  return spinning_;
+}
+
+void BusyPoller::Run() {
+  while (!stop_) {
+    if (Step(ThreadActivity(), ProactorBase::GetMonotonicTimeNs())) {
+      this_fiber::yield();
+    } else {
+      this_fiber::sleep_for(kSleepPeriod);
+    }
+  }
+}
+
+}  // namespace dfly
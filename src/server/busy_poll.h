@@ -0,0 +1,64 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <boost/fiber/fiber.hpp>
+#include <cstdint>
+
+namespace dfly {
+
+// Keeps an idle thread of the pool spinning for a while after its last activity instead of
+// letting its proactor sleep in the kernel, see --busy_poll_usec. A fiber that yields keeps
+// the proactor loop polling its completions, so the next request of a quiet client does not
+// pay for the wake-up of the thread. Once nothing happened for the budget, the fiber sleeps in
+// short periods until the thread becomes active again.
+// The activity is the number of the socket reads and the shard hops of the thread.
+class BusyPoller {
+ public:
+  // The time the thread spent spinning and sleeping, which includes the work of the other
+  // fibers that ran in between.
+  struct Stats {
+    uint64_t poll_ns = 0;
+    uint64_t sleep_ns = 0;
+
+    Stats& operator+=(const Stats& o) {
+      poll_ns += o.poll_ns;
+      sleep_ns += o.sleep_ns;
+      return *this;
+    }
+  };
+
+  explicit BusyPoller(uint64_t budget_usec) : budget_ns_(budget_usec * 1000) {
+  }
+
+  ~BusyPoller();
+
+  // Starts polling in the calling thread.
+  void Start();
+  void Stop();
+
+  // Accounts the time since the previous step and returns whether the thread should keep
+  // spinning at now_ns, given its activity counter.
+  bool Step(uint64_t activity, uint64_t now_ns);
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  void Run();
+
+  uint64_t budget_ns_;
+  uint64_t last_activity_ = 0;
+  uint64_t last_active_ns_ = 0;
+  uint64_t last_step_ns_ = 0;
+  bool spinning_ = false;
+  bool stop_ = false;
+
+  Stats stats_;
+  ::boost::fibers::fiber fiber_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,46 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/busy_poll.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+class BusyPollerTest : public ::testing::Test {
+ protected:
+  static constexpr uint64_t kUsec = 1000;
+
+  BusyPoller poller_{100};
+};
+
+TEST_F(BusyPollerTest, SpinsAfterActivity) {
+  EXPECT_TRUE(poller_.Step(1, 10 * kUsec));
+  EXPECT_TRUE(poller_.Step(1, 100 * kUsec));
+
+  // Nothing happened for the budget.
+  EXPECT_FALSE(poller_.Step(1, 110 * kUsec));
+  EXPECT_FALSE(poller_.Step(1, 1000 * kUsec));
+
+  // A new request starts another spin.
+  EXPECT_TRUE(poller_.Step(2, 1500 * kUsec));
+  EXPECT_TRUE(poller_.Step(3, 1590 * kUsec));
+  EXPECT_TRUE(poller_.Step(3, 1680 * kUsec));
+  EXPECT_FALSE(poller_.Step(3, 1700 * kUsec));
+}
+
+TEST_F(BusyPollerTest, Stats) {
+  poller_.Step(1, 10 * kUsec);
+  poller_.Step(1, 60 * kUsec);
+  poller_.Step(1, 200 * kUsec);
+  poller_.Step(1, 700 * kUsec);
+  poller_.Step(2, 900 * kUsec);
+
+  // The time until a step is accounted to the mode that the previous step chose.
+  EXPECT_EQ(190 * kUsec, poller_.stats().poll_ns);
+  EXPECT_EQ(700 * kUsec, poller_.stats().sleep_ns);
+}
+
+}  // namespace dfly
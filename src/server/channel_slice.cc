@@ -9,6 +9,7 @@ extern "C" {
 }
 
 #include "base/logging.h"
+#include "server/keyspace_events.h"
 
 namespace dfly {
 using namespace std;
@@ -17,37 +18,64 @@ ChannelSlice::Subscriber::Subscriber(ConnectionContext* cntx, uint32_t tid)
     : conn_cntx(cntx), borrow_token(cntx->conn_state.subscribe_info->borrow_token), thread_id(tid) {
 }
 
-void ChannelSlice::AddSubscription(string_view channel, ConnectionContext* me, uint32_t thread_id) {
-  auto [it, added] = channels_.emplace(channel, nullptr);
+bool ChannelSlice::Add(string_view channel, ConnectionContext* me, uint32_t thread_id,
+                       ChannelMap* map) {
+  auto [it, added] = map->emplace(channel, nullptr);
   if (added) {
     it->second.reset(new Channel);
   }
-  it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
+  return it->second->subscribers.emplace(me, SubscriberInternal{thread_id}).second;
+}
+
+bool ChannelSlice::Remove(string_view channel, ConnectionContext* me, ChannelMap* map) {
+  auto it = map->find(channel);
+  if (it == map->end())
+    return false;
+
+  bool removed = it->second->subscribers.erase(me) > 0;
+  if (it->second->subscribers.empty())
+    map->erase(it);
+  return removed;
+}
+
+void ChannelSlice::AddSubscription(string_view channel, ConnectionContext* me, uint32_t thread_id) {
+  if (Add(channel, me, thread_id, &channels_))
+    KeyspaceEvents::OnSubscription(channel, false, true);
 }
 
 void ChannelSlice::RemoveSubscription(string_view channel, ConnectionContext* me) {
-  auto it = channels_.find(channel);
-  if (it != channels_.end()) {
-    it->second->subscribers.erase(me);
-    if (it->second->subscribers.empty())
-      channels_.erase(it);
-  }
+  if (Remove(channel, me, &channels_))
+    KeyspaceEvents::OnSubscription(channel, false, false);
+}
+
+void ChannelSlice::AddShardSubscription(string_view channel, ConnectionContext* me,
+                                        uint32_t thread_id) {
+  Add(channel, me, thread_id, &shard_channels_);
+}
+
+void ChannelSlice::RemoveShardSubscription(string_view channel, ConnectionContext* me) {
+  Remove(channel, me, &shard_channels_);
 }
 
 void ChannelSlice::AddGlobPattern(string_view pattern, ConnectionContext* me, uint32_t thread_id) {
   auto [it, added] = patterns_.emplace(pattern, nullptr);
   if (added) {
     it->second.reset(new Channel);
+    pattern_trie_.Insert(pattern);
   }
-  it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
+  if (it->second->subscribers.emplace(me, SubscriberInternal{thread_id}).second)
+    KeyspaceEvents::OnSubscription(pattern, true, true);
 }
 
 void ChannelSlice::RemoveGlobPattern(string_view pattern, ConnectionContext* me) {
   auto it = patterns_.find(pattern);
   if (it != patterns_.end()) {
-    it->second->subscribers.erase(me);
-    if (it->second->subscribers.empty())
+    if (it->second->subscribers.erase(me))
+      KeyspaceEvents::OnSubscription(pattern, true, false);
+    if (it->second->subscribers.empty()) {
+      pattern_trie_.Erase(pattern);
       patterns_.erase(it);
+    }
   }
 }
 
@@ -60,17 +88,26 @@ auto ChannelSlice::FetchSubscribers(string_view channel) -> vector<Subscriber> {
     CopySubscribers(it->second->subscribers, string{}, &res);
   }
 
-  for (const auto& k_v : patterns_) {
-    const string& pat = k_v.first;
-    // 1 - match
-    if (stringmatchlen(pat.data(), pat.size(), channel.data(), channel.size(), 0) == 1) {
-      CopySubscribers(k_v.second->subscribers, pat, &res);
-    }
-  }
+  pattern_trie_.Match(channel, [&](string_view pattern) {
+    auto it = patterns_.find(pattern);
+    DCHECK(it != patterns_.end());
+    CopySubscribers(it->second->subscribers, it->first, &res);
+  });
 
   return res;
 }
 
+auto ChannelSlice::FetchShardSubscribers(string_view channel) -> vector<Subscriber> {
+  vector<Subscriber> res;
+
+  auto it = shard_channels_.find(channel);
+  if (it != shard_channels_.end()) {
+    res.reserve(it->second->subscribers.size());
+    CopySubscribers(it->second->subscribers, string{}, &res);
+  }
+  return res;
+}
+
 void ChannelSlice::CopySubscribers(const SubscribeMap& src, const std::string& pattern,
                                    vector<Subscriber>* dest) {
   for (const auto& sub : src) {
@@ -85,12 +122,13 @@ void ChannelSlice::CopySubscribers(const SubscribeMap& src, const std::string& p
   }
 }
 
-vector<string> ChannelSlice::ListChannels(const string_view pattern) const {
+vector<string> ChannelSlice::List(string_view pattern, const ChannelMap& map) {
   vector<string> res;
-  for (const auto& k_v : channels_) {
+  for (const auto& k_v : map) {
     const string& channel = k_v.first;
 
-    if (pattern.empty() || stringmatchlen(pattern.data(), pattern.size(), channel.data(), channel.size(), 0) == 1) {
+    if (pattern.empty() || stringmatchlen(pattern.data(), pattern.size(), channel.data(),
+                                          channel.size(), 0) == 1) {
       res.push_back(channel);
     }
   }
@@ -98,6 +136,14 @@ vector<string> ChannelSlice::ListChannels(const string_view pattern) const {
   return res;
 }
 
+vector<string> ChannelSlice::ListChannels(const string_view pattern) const {
+  return List(pattern, channels_);
+}
+
+vector<string> ChannelSlice::ListShardChannels(string_view pattern) const {
+  return List(pattern, shard_channels_);
+}
+
 size_t ChannelSlice::PatternCount() const {
   return patterns_.size();
 }
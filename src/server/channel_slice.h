@@ -7,6 +7,7 @@
 
 #include <string_view>
 
+#include "core/glob_trie.h"
 #include "server/conn_context.h"
 
 namespace dfly {
@@ -43,6 +44,15 @@ class ChannelSlice {
   std::vector<std::string> ListChannels(const std::string_view pattern) const;
   size_t PatternCount() const;
 
+  // Sharded pubsub, i.e. SSUBSCRIBE and SPUBLISH. Its channels are separate from the others and
+  // are not matched by the patterns, so SPUBLISH only visits the shard of the channel.
+  std::vector<Subscriber> FetchShardSubscribers(std::string_view channel);
+
+  void AddShardSubscription(std::string_view channel, ConnectionContext* me, uint32_t thread_id);
+  void RemoveShardSubscription(std::string_view channel, ConnectionContext* me);
+
+  std::vector<std::string> ListShardChannels(std::string_view pattern) const;
+
  private:
   struct SubscriberInternal {
     uint32_t thread_id;  // proactor thread id.
@@ -60,8 +70,20 @@ class ChannelSlice {
     SubscribeMap subscribers;
   };
 
-  absl::flat_hash_map<std::string, std::unique_ptr<Channel>> channels_;
+  using ChannelMap = absl::flat_hash_map<std::string, std::unique_ptr<Channel>>;
+
+  // Returns whether me was added to or removed from the channel.
+  static bool Add(std::string_view channel, ConnectionContext* me, uint32_t thread_id,
+                  ChannelMap* map);
+  static bool Remove(std::string_view channel, ConnectionContext* me, ChannelMap* map);
+  static std::vector<std::string> List(std::string_view pattern, const ChannelMap& map);
+
+  ChannelMap channels_;
+  ChannelMap shard_channels_;
   absl::flat_hash_map<std::string, std::unique_ptr<Channel>> patterns_;
+
+  // The keys of patterns_, to find the ones that match a channel.
+  GlobTrie pattern_trie_;
 };
 
 }  // namespace dfly
@@ -0,0 +1,220 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster/cluster_config.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/flags.h"
+#include "base/logging.h"
+
+using namespace std;
+
+ABSL_FLAG(string, cluster_mode, "",
+          "Cluster mode supported. "
+          "'emulated' - the node reports itself as a cluster of one node that owns all the slots. "
+          "'yes' - the node serves the slots assigned to it by DFLYCLUSTER CONFIG. "
+          "Default: not a cluster node.");
+
+namespace dfly {
+
+namespace {
+
+// CRC16/XMODEM, the hash of Redis Cluster.
+constexpr array<uint16_t, 256> MakeCrc16Table() {
+  array<uint16_t, 256> table{};
+  for (unsigned i = 0; i < 256; ++i) {
+    uint16_t crc = i << 8;
+    for (unsigned j = 0; j < 8; ++j)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    table[i] = crc;
+  }
+  return table;
+}
+
+constexpr auto kCrc16Table = MakeCrc16Table();
+
+uint16_t Crc16(string_view data) {
+  uint16_t crc = 0;
+  for (unsigned char c : data)
+    crc = (crc << 8) ^ kCrc16Table[((crc >> 8) ^ c) & 0xFF];
+  return crc;
+}
+
+}  // namespace
+
+bool ClusterConfig::enabled_ = false;
+bool ClusterConfig::emulated_ = false;
+
+void ClusterConfig::Initialize() {
+  string mode = absl::GetFlag(FLAGS_cluster_mode);
+  if (mode == "emulated") {
+    enabled_ = emulated_ = true;
+  } else if (mode == "yes") {
+    enabled_ = true;
+  } else if (!mode.empty()) {
+    LOG(ERROR) << "Invalid value " << mode << " for --cluster_mode";
+    exit(1);
+  }
+}
+
+string_view ClusterConfig::KeyTag(string_view key) {
+  size_t start = key.find('{');
+  if (start == string_view::npos)
+    return key;
+
+  size_t end = key.find('}', start + 1);
+  if (end == string_view::npos || end == start + 1)
+    return key;
+
+  return key.substr(start + 1, end - start - 1);
+}
+
+SlotId ClusterConfig::KeySlot(string_view key) {
+  return Crc16(KeyTag(key)) & kMaxSlotNum;
+}
+
+shared_ptr<ClusterConfig> ClusterConfig::Create(string_view my_id, vector<ClusterShard> shards,
+                                                string* error) {
+  if (shards.size() >= kNoShard) {
+    *error = "too many shards";
+    return nullptr;
+  }
+
+  shared_ptr<ClusterConfig> res(new ClusterConfig);
+  res->my_id_ = my_id;
+
+  absl::flat_hash_map<string_view, uint16_t> masters;
+  for (uint16_t i = 0; i < shards.size(); ++i) {
+    const ClusterShard& shard = shards[i];
+    if (shard.master.id.empty()) {
+      *error = "a shard has no master id";
+      return nullptr;
+    }
+    if (!masters.emplace(shard.master.id, i).second) {
+      *error = absl::StrCat("node ", shard.master.id, " is the master of two shards");
+      return nullptr;
+    }
+
+    if (shard.master.id == my_id) {
+      res->my_shard_ = i;
+      res->is_master_ = true;
+    }
+    for (const Node& replica : shard.replicas) {
+      if (replica.id == my_id)
+        res->my_shard_ = i;
+    }
+
+    for (const SlotRange& range : shard.slot_ranges) {
+      if (range.start > range.end || range.end > kMaxSlotNum) {
+        *error = absl::StrCat("invalid slot range ", range.start, "-", range.end);
+        return nullptr;
+      }
+      for (unsigned slot = range.start; slot <= range.end; ++slot) {
+        if (res->slots_[slot].owner != kNoShard) {
+          *error = absl::StrCat("slot ", slot, " is assigned twice");
+          return nullptr;
+        }
+        res->slots_[slot].owner = i;
+      }
+    }
+  }
+
+  for (uint16_t i = 0; i < shards.size(); ++i) {
+    for (const Migration& migration : shards[i].migrations) {
+      auto it = masters.find(migration.node_id);
+      if (migration.slot > kMaxSlotNum || res->slots_[migration.slot].owner != i ||
+          it == masters.end() || it->second == i) {
+        *error = absl::StrCat("invalid migration of slot ", migration.slot);
+        return nullptr;
+      }
+      res->slots_[migration.slot].migration = it->second;
+    }
+  }
+
+  res->shards_ = std::move(shards);
+  return res;
+}
+
+shared_ptr<ClusterConfig> ClusterConfig::CreateEmulated(Node me) {
+  ClusterShard shard;
+  shard.slot_ranges.push_back(SlotRange{0, kMaxSlotNum});
+  shard.master = std::move(me);
+
+  string error;
+  string id = shard.master.id;
+  auto res = Create(id, {std::move(shard)}, &error);
+  CHECK(res) << error;
+  return res;
+}
+
+SlotSet ClusterConfig::ToSlotSet(const vector<SlotRange>& ranges) {
+  SlotSet res;
+  for (const SlotRange& range : ranges) {
+    for (unsigned slot = range.start; slot <= range.end && slot <= kMaxSlotNum; ++slot)
+      res.set(slot);
+  }
+  return res;
+}
+
+shared_ptr<ClusterConfig> ClusterConfig::MoveSlots(const SlotSet& slots, string_view node_id,
+                                                   string* error) const {
+  uint16_t target = kNoShard;
+  for (uint16_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[i].master.id == node_id)
+      target = i;
+  }
+  if (target == kNoShard) {
+    *error = absl::StrCat("node ", node_id, " is not a master");
+    return nullptr;
+  }
+
+  // Rebuild the ranges of all the shards from the new owners of the slots.
+  vector<ClusterShard> shards = shards_;
+  for (ClusterShard& shard : shards) {
+    shard.slot_ranges.clear();
+    auto& migrations = shard.migrations;
+    migrations.erase(remove_if(migrations.begin(), migrations.end(),
+                               [&](const Migration& m) { return slots.test(m.slot); }),
+                     migrations.end());
+  }
+
+  for (unsigned slot = 0; slot <= kMaxSlotNum; ++slot) {
+    uint16_t owner = slots.test(slot) ? target : slots_[slot].owner;
+    if (owner == kNoShard)
+      continue;
+
+    vector<SlotRange>& ranges = shards[owner].slot_ranges;
+    if (!ranges.empty() && ranges.back().end + 1u == slot)
+      ranges.back().end = slot;
+    else
+      ranges.push_back({SlotId(slot), SlotId(slot)});
+  }
+
+  return Create(my_id_, std::move(shards), error);
+}
+
+auto ClusterConfig::SlotOwner(SlotId id) const -> const Node* {
+  uint16_t owner = slots_[id].owner;
+  return owner == kNoShard ? nullptr : &shards_[owner].master;
+}
+
+auto ClusterConfig::MigrationTarget(SlotId id) const -> const Node* {
+  uint16_t target = slots_[id].migration;
+  return target == kNoShard ? nullptr : &shards_[target].master;
+}
+
+bool ClusterConfig::IsImporting(SlotId id) const {
+  return is_master_ && slots_[id].migration == my_shard_;
+}
+
+size_t ClusterConfig::NumAssignedSlots() const {
+  size_t res = 0;
+  for (const SlotEntry& entry : slots_)
+    res += (entry.owner != kNoShard);
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,141 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+using SlotId = uint16_t;
+
+constexpr SlotId kMaxSlotNum = 0x3FFF;
+
+using SlotSet = std::bitset<kMaxSlotNum + 1>;
+
+// The assignment of the hash slots of Redis Cluster to the nodes of the fleet.
+//
+// Cluster mode is fixed at startup by --cluster_mode. In "emulated" mode the node owns all the
+// slots and reports itself as a single node cluster, so cluster clients can talk to it. With
+// "yes" the node owns no slots until the orchestrator pushes the config of the whole fleet
+// with DFLYCLUSTER CONFIG. Every node serves the slots of the shards it belongs to and
+// redirects the commands on other slots with MOVED.
+//
+// A slot is migrated to another master by listing it under the migrations of its shard. Until
+// the config moves the slot to the target, the source still serves the keys it holds and
+// redirects the others with ASK, while the target serves the commands that follow ASKING.
+// Alternatively, the target imports the slots online with DFLYCLUSTER START-SLOT-MIGRATION and
+// both nodes move them with MoveSlots once it has caught up, see DflyCmd.
+class ClusterConfig {
+ public:
+  struct Node {
+    std::string id;
+    std::string ip;
+    uint16_t port = 0;
+  };
+
+  struct SlotRange {
+    SlotId start = 0;
+    SlotId end = 0;  // Inclusive.
+  };
+
+  struct Migration {
+    SlotId slot = 0;
+    std::string node_id;  // The master of the shard the slot moves to.
+  };
+
+  struct ClusterShard {
+    std::vector<SlotRange> slot_ranges;
+    Node master;
+    std::vector<Node> replicas;
+    std::vector<Migration> migrations;
+  };
+
+  // Reads --cluster_mode, must be called before the shards are created.
+  static void Initialize();
+
+  static bool IsEnabled() {
+    return enabled_;
+  }
+
+  static bool IsEmulated() {
+    return emulated_;
+  }
+
+  // The part of the key that is hashed, i.e. the content of the first non-empty {...} if any.
+  static std::string_view KeyTag(std::string_view key);
+
+  static SlotId KeySlot(std::string_view key);
+
+  // Validates the config of the fleet. Returns nullptr and sets error if the shards overlap or
+  // refer to unknown nodes. The slots that no shard covers are served by nobody.
+  static std::shared_ptr<ClusterConfig> Create(std::string_view my_id,
+                                               std::vector<ClusterShard> shards,
+                                               std::string* error);
+
+  // The config of emulated mode, where me serves all the slots.
+  static std::shared_ptr<ClusterConfig> CreateEmulated(Node me);
+
+  static SlotSet ToSlotSet(const std::vector<SlotRange>& ranges);
+
+  // A copy of this config where the shard of the master node_id serves the slots as well.
+  // Returns nullptr and sets error if node_id is not a master of this config.
+  std::shared_ptr<ClusterConfig> MoveSlots(const SlotSet& slots, std::string_view node_id,
+                                           std::string* error) const;
+
+  // Whether the node serves the slot, as a master or a replica of its shard.
+  bool IsMySlot(SlotId id) const {
+    return slots_[id].owner == my_shard_ && my_shard_ != kNoShard;
+  }
+
+  bool IsMaster() const {
+    return is_master_;
+  }
+
+  // The master that serves the slot, nullptr if the slot is not assigned.
+  const Node* SlotOwner(SlotId id) const;
+
+  // The master the slot is migrating to, nullptr if it does not migrate.
+  const Node* MigrationTarget(SlotId id) const;
+
+  // Whether the slot migrates to this node.
+  bool IsImporting(SlotId id) const;
+
+  const std::vector<ClusterShard>& shards() const {
+    return shards_;
+  }
+
+  const std::string& my_id() const {
+    return my_id_;
+  }
+
+  // The number of assigned slots.
+  size_t NumAssignedSlots() const;
+
+ private:
+  static constexpr uint16_t kNoShard = UINT16_MAX;
+
+  struct SlotEntry {
+    uint16_t owner = kNoShard;      // Index in shards_.
+    uint16_t migration = kNoShard;  // Index of the target in shards_.
+  };
+
+  ClusterConfig() = default;
+
+  static bool enabled_;
+  static bool emulated_;
+
+  std::string my_id_;
+  std::vector<ClusterShard> shards_;
+  std::array<SlotEntry, kMaxSlotNum + 1> slots_;
+  uint16_t my_shard_ = kNoShard;
+  bool is_master_ = false;
+};
+
+}  // namespace dfly
@@ -0,0 +1,114 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster/cluster_config.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+
+class ClusterConfigTest : public Test {
+ protected:
+  static ClusterConfig::ClusterShard MakeShard(string id, SlotId start, SlotId end) {
+    ClusterConfig::ClusterShard shard;
+    shard.slot_ranges.push_back({start, end});
+    shard.master = {std::move(id), "127.0.0.1", 7000};
+    return shard;
+  }
+};
+
+TEST_F(ClusterConfigTest, KeySlot) {
+  // The values of redis-cli CLUSTER KEYSLOT.
+  EXPECT_EQ(12182, ClusterConfig::KeySlot("foo"));
+  EXPECT_EQ(5061, ClusterConfig::KeySlot("bar"));
+  EXPECT_EQ(12739, ClusterConfig::KeySlot("123456789"));
+
+  EXPECT_EQ(ClusterConfig::KeySlot("user1000"), ClusterConfig::KeySlot("{user1000}.following"));
+  EXPECT_EQ(ClusterConfig::KeySlot("{user1000}.followers"),
+            ClusterConfig::KeySlot("{user1000}.following"));
+
+  // Only the first non-empty tag is hashed.
+  EXPECT_EQ("{}", ClusterConfig::KeyTag("{}"));
+  EXPECT_EQ("foo{}{bar}", ClusterConfig::KeyTag("foo{}{bar}"));
+  EXPECT_EQ("{bar", ClusterConfig::KeyTag("foo{{bar}}zap"));
+  EXPECT_EQ("bar", ClusterConfig::KeyTag("foo{bar}{zap}"));
+}
+
+TEST_F(ClusterConfigTest, Ownership) {
+  vector<ClusterConfig::ClusterShard> shards{MakeShard("a", 0, 8000),
+                                             MakeShard("b", 8001, kMaxSlotNum)};
+  shards[0].replicas.push_back({"c", "127.0.0.2", 7000});
+  shards[0].migrations.push_back({100, "b"});
+
+  string error;
+  auto config = ClusterConfig::Create("c", shards, &error);
+  ASSERT_TRUE(config) << error;
+  EXPECT_TRUE(config->IsMySlot(0));
+  EXPECT_FALSE(config->IsMySlot(8001));
+  EXPECT_FALSE(config->IsMaster());
+  EXPECT_EQ("a", config->SlotOwner(100)->id);
+  EXPECT_EQ("b", config->MigrationTarget(100)->id);
+  EXPECT_EQ(nullptr, config->MigrationTarget(101));
+  EXPECT_EQ(size_t(kMaxSlotNum) + 1, config->NumAssignedSlots());
+
+  config = ClusterConfig::Create("b", shards, &error);
+  ASSERT_TRUE(config) << error;
+  EXPECT_TRUE(config->IsImporting(100));
+  EXPECT_FALSE(config->IsMySlot(100));
+}
+
+TEST_F(ClusterConfigTest, MoveSlots) {
+  vector<ClusterConfig::ClusterShard> shards{MakeShard("a", 0, 8000),
+                                             MakeShard("b", 8001, kMaxSlotNum)};
+  shards[0].migrations.push_back({100, "b"});
+
+  string error;
+  auto config = ClusterConfig::Create("a", shards, &error);
+  ASSERT_TRUE(config) << error;
+
+  SlotSet slots = ClusterConfig::ToSlotSet({{100, 199}, {8000, 8000}});
+  EXPECT_EQ(101u, slots.count());
+
+  auto moved = config->MoveSlots(slots, "b", &error);
+  ASSERT_TRUE(moved) << error;
+  EXPECT_TRUE(moved->IsMySlot(99));
+  EXPECT_FALSE(moved->IsMySlot(100));
+  EXPECT_TRUE(moved->IsMySlot(200));
+  EXPECT_EQ("b", moved->SlotOwner(8000)->id);
+  EXPECT_EQ(nullptr, moved->MigrationTarget(100));
+  EXPECT_EQ(size_t(kMaxSlotNum) + 1, moved->NumAssignedSlots());
+
+  const auto& ranges = moved->shards()[0].slot_ranges;
+  ASSERT_EQ(2u, ranges.size());
+  EXPECT_EQ(99, ranges[0].end);
+  EXPECT_EQ(200, ranges[1].start);
+  EXPECT_EQ(7999, ranges[1].end);
+
+  EXPECT_FALSE(config->MoveSlots(slots, "c", &error));
+}
+
+TEST_F(ClusterConfigTest, Invalid) {
+  string error;
+  EXPECT_FALSE(ClusterConfig::Create("a", {MakeShard("a", 0, 100), MakeShard("b", 100, 200)},
+                                     &error));
+  EXPECT_FALSE(ClusterConfig::Create("a", {MakeShard("a", 0, 100), MakeShard("a", 101, 200)},
+                                     &error));
+  EXPECT_FALSE(ClusterConfig::Create("a", {MakeShard("a", 10, 5)}, &error));
+
+  vector<ClusterConfig::ClusterShard> shards{MakeShard("a", 0, 100)};
+  shards[0].migrations.push_back({200, "a"});
+  EXPECT_FALSE(ClusterConfig::Create("a", shards, &error));
+
+  auto config = ClusterConfig::Create("x", {MakeShard("a", 0, 100)}, &error);
+  ASSERT_TRUE(config);
+  EXPECT_FALSE(config->IsMySlot(0));
+  EXPECT_EQ(nullptr, config->SlotOwner(101));
+  EXPECT_EQ(101u, config->NumAssignedSlots());
+}
+
+}  // namespace dfly
@@ -0,0 +1,665 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster/cluster_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <jsoncons/json.hpp>
+#include <optional>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "facade/error.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/main_service.h"
+#include "server/replica.h"
+#include "server/server_family.h"
+#include "server/server_state.h"
+#include "server/transaction.h"
+
+ABSL_DECLARE_FLAG(uint32_t, port);
+
+ABSL_FLAG(std::string, cluster_announce_ip, "",
+          "The ip of this node in the replies of CLUSTER in emulated mode. "
+          "Default: the address the client connected to.");
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using jsoncons::json;
+
+namespace {
+
+using CI = CommandId;
+using Node = ClusterConfig::Node;
+using ClusterShard = ClusterConfig::ClusterShard;
+
+constexpr string_view kClusterDisabled =
+    "Cluster is disabled. Enabled via passing --cluster_mode=emulated|yes";
+
+constexpr string_view kMigrationSyncing = "SYNCING";
+
+optional<Node> ParseNode(const json& obj) {
+  if (!obj.is_object() || !obj.contains("id") || !obj.contains("ip") || !obj.contains("port"))
+    return nullopt;
+
+  const json& id = obj.at("id");
+  const json& ip = obj.at("ip");
+  const json& port = obj.at("port");
+  if (!id.is_string() || !ip.is_string() || !port.is_uint64() ||
+      port.as<uint64_t>() > UINT16_MAX)
+    return nullopt;
+
+  return Node{id.as<string>(), ip.as<string>(), port.as<uint16_t>()};
+}
+
+optional<SlotId> ParseSlot(const json& obj) {
+  if (!obj.is_uint64() || obj.as<uint64_t>() > kMaxSlotNum)
+    return nullopt;
+  return obj.as<SlotId>();
+}
+
+// Parses the config of DFLYCLUSTER CONFIG, an array of the shards of the fleet:
+// [{"slot_ranges": [{"start": 0, "end": 8191}],
+//   "master": {"id": "...", "ip": "10.0.0.1", "port": 6379},
+//   "replicas": [{"id": "...", "ip": "10.0.0.2", "port": 6379}],
+//   "migrations": [{"slot": 100, "node_id": "..."}]}, ...]
+// "migrations" is optional.
+optional<vector<ClusterShard>> ParseConfig(string_view json_str) {
+  json j;
+  try {
+    j = json::parse(json_str);
+  } catch (const exception& e) {
+    VLOG(1) << "Could not parse cluster config: " << e.what();
+    return nullopt;
+  }
+
+  if (!j.is_array())
+    return nullopt;
+
+  vector<ClusterShard> shards;
+  for (const json& shard_obj : j.array_range()) {
+    if (!shard_obj.is_object() || !shard_obj.contains("slot_ranges") ||
+        !shard_obj.contains("master") || !shard_obj.contains("replicas"))
+      return nullopt;
+
+    ClusterShard shard;
+    const json& ranges = shard_obj.at("slot_ranges");
+    if (!ranges.is_array())
+      return nullopt;
+    for (const json& range : ranges.array_range()) {
+      if (!range.is_object() || !range.contains("start") || !range.contains("end"))
+        return nullopt;
+      optional<SlotId> start = ParseSlot(range.at("start"));
+      optional<SlotId> end = ParseSlot(range.at("end"));
+      if (!start || !end)
+        return nullopt;
+      shard.slot_ranges.push_back({*start, *end});
+    }
+
+    optional<Node> master = ParseNode(shard_obj.at("master"));
+    if (!master)
+      return nullopt;
+    shard.master = std::move(*master);
+
+    const json& replicas = shard_obj.at("replicas");
+    if (!replicas.is_array())
+      return nullopt;
+    for (const json& replica_obj : replicas.array_range()) {
+      optional<Node> replica = ParseNode(replica_obj);
+      if (!replica)
+        return nullopt;
+      shard.replicas.push_back(std::move(*replica));
+    }
+
+    if (shard_obj.contains("migrations")) {
+      const json& migrations = shard_obj.at("migrations");
+      if (!migrations.is_array())
+        return nullopt;
+      for (const json& migration : migrations.array_range()) {
+        if (!migration.is_object() || !migration.contains("slot") ||
+            !migration.contains("node_id") || !migration.at("node_id").is_string())
+          return nullopt;
+        optional<SlotId> slot = ParseSlot(migration.at("slot"));
+        if (!slot)
+          return nullopt;
+        shard.migrations.push_back({*slot, migration.at("node_id").as<string>()});
+      }
+    }
+
+    shards.push_back(std::move(shard));
+  }
+
+  return shards;
+}
+
+// CLUSTER SHARDS and NODES need the ranges while the shards may list them in any order.
+vector<ClusterConfig::SlotRange> SortedRanges(const ClusterShard& shard) {
+  vector<ClusterConfig::SlotRange> res = shard.slot_ranges;
+  sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.start < r.start; });
+  return res;
+}
+
+}  // namespace
+
+ClusterFamily::ClusterFamily(ServerFamily* server_family) : server_family_(server_family) {
+}
+
+ClusterFamily::~ClusterFamily() {
+  if (migration_fb_.joinable())
+    migration_fb_.join();
+}
+
+void ClusterFamily::Shutdown() {
+  {
+    lock_guard lk(mu_);
+    if (migration_ && migration_state_ == kMigrationSyncing)
+      migration_->Stop();
+  }
+
+  if (migration_fb_.joinable())
+    migration_fb_.join();
+}
+
+void ClusterFamily::Init() {
+  if (!ClusterConfig::IsEmulated())
+    return;
+
+  // The node serves all the slots, its address only matters for the replies of CLUSTER.
+  config_ = ClusterConfig::CreateEmulated(MyNode(nullptr));
+  shard_set->pool()->AwaitFiberOnAll(
+      [config = config_](auto*) { ServerState::tlocal()->cluster_config = config; });
+}
+
+ClusterConfig::Node ClusterFamily::MyNode(ConnectionContext* cntx) const {
+  Node res{server_family_->master_id(), absl::GetFlag(FLAGS_cluster_announce_ip),
+           uint16_t(absl::GetFlag(FLAGS_port))};
+  if (res.ip.empty() && cntx && cntx->owner())
+    res.ip = cntx->owner()->LocalBindAddress();
+  return res;
+}
+
+shared_ptr<const ClusterConfig> ClusterFamily::GetConfig(ConnectionContext* cntx) const {
+  if (ClusterConfig::IsEmulated())
+    return ClusterConfig::CreateEmulated(MyNode(cntx));
+
+  lock_guard lk(mu_);
+  return config_;
+}
+
+void ClusterFamily::Cluster(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "HELP" && args.size() == 2) {
+    string_view help_arr[] = {
+        "CLUSTER <subcommand> [<arg> [value] [opt] ...]. Subcommands are:",
+        "SLOTS",
+        "   Return information about slots range mappings. Each range is made of:",
+        "   start, end, master and replicas IP addresses, ports and ids.",
+        "SHARDS",
+        "   Return information about the shards of the cluster.",
+        "NODES",
+        "   Return the config of the cluster in the format of CLUSTER NODES.",
+        "INFO",
+        "   Return information about the cluster.",
+        "MYID",
+        "   Return the id of this node.",
+        "KEYSLOT <key>",
+        "   Return the hash slot of the key.",
+        "COUNTKEYSINSLOT <slot>",
+        "   Return the number of keys in the slot.",
+        "GETKEYSINSLOT <slot> <count>",
+        "   Return up to count keys of the slot.",
+        "HELP",
+        "   Prints this help.",
+    };
+    return (*cntx)->SendSimpleStrArr(help_arr, ABSL_ARRAYSIZE(help_arr));
+  }
+
+  if (sub_cmd == "SLOTS" && args.size() == 2) {
+    return ClusterSlots(cntx);
+  }
+
+  if (sub_cmd == "SHARDS" && args.size() == 2) {
+    return ClusterShards(cntx);
+  }
+
+  if (sub_cmd == "NODES" && args.size() == 2) {
+    return ClusterNodes(cntx);
+  }
+
+  if (sub_cmd == "INFO" && args.size() == 2) {
+    return ClusterInfo(cntx);
+  }
+
+  if (sub_cmd == "MYID" && args.size() == 2) {
+    return (*cntx)->SendBulkString(server_family_->master_id());
+  }
+
+  if (sub_cmd == "KEYSLOT" && args.size() == 3) {
+    return (*cntx)->SendLong(ClusterConfig::KeySlot(ArgS(args, 2)));
+  }
+
+  if ((sub_cmd == "COUNTKEYSINSLOT" && args.size() == 3) ||
+      (sub_cmd == "GETKEYSINSLOT" && args.size() == 4)) {
+    uint32_t slot;
+    if (!absl::SimpleAtoi(ArgS(args, 2), &slot) || slot > kMaxSlotNum) {
+      return (*cntx)->SendError("Invalid or out of range slot");
+    }
+
+    uint32_t count = 0;
+    if (args.size() == 4 && !absl::SimpleAtoi(ArgS(args, 3), &count)) {
+      return (*cntx)->SendError("Invalid number of keys");
+    }
+
+    // The keys of a slot are in a single shard, see Shard().
+    ShardId sid = slot % shard_set->size();
+
+    if (args.size() == 3) {
+      size_t res = shard_set->Await(
+          sid, [slot] { return EngineShard::tlocal()->db_slice().SlotSize(0, slot); });
+      return (*cntx)->SendLong(res);
+    }
+
+    vector<string> keys = shard_set->Await(sid, [slot, count] {
+      return EngineShard::tlocal()->db_slice().GetSlotKeys(0, slot, count);
+    });
+    return (*cntx)->SendStringArr(keys);
+  }
+
+  return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "CLUSTER"), kSyntaxErrType);
+}
+
+void ClusterFamily::ClusterSlots(ConnectionContext* cntx) {
+  shared_ptr<const ClusterConfig> config = GetConfig(cntx);
+  if (!config) {
+    return (*cntx)->SendEmptyArray();
+  }
+
+  auto send_node = [&](const Node& node) {
+    (*cntx)->StartArray(3);
+    (*cntx)->SendBulkString(node.ip);
+    (*cntx)->SendLong(node.port);
+    (*cntx)->SendBulkString(node.id);
+  };
+
+  unsigned num_ranges = 0;
+  for (const ClusterShard& shard : config->shards())
+    num_ranges += shard.slot_ranges.size();
+
+  (*cntx)->StartArray(num_ranges);
+  for (const ClusterShard& shard : config->shards()) {
+    for (const auto& range : shard.slot_ranges) {
+      (*cntx)->StartArray(3 + shard.replicas.size());
+      (*cntx)->SendLong(range.start);
+      (*cntx)->SendLong(range.end);
+      send_node(shard.master);
+      for (const Node& replica : shard.replicas)
+        send_node(replica);
+    }
+  }
+}
+
+void ClusterFamily::ClusterShards(ConnectionContext* cntx) {
+  shared_ptr<const ClusterConfig> config = GetConfig(cntx);
+  if (!config) {
+    return (*cntx)->SendEmptyArray();
+  }
+
+  auto* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  auto send_node = [&](const Node& node, bool is_master) {
+    rb->StartCollection(7, RedisReplyBuilder::MAP);
+    rb->SendBulkString("id");
+    rb->SendBulkString(node.id);
+    rb->SendBulkString("endpoint");
+    rb->SendBulkString(node.ip);
+    rb->SendBulkString("ip");
+    rb->SendBulkString(node.ip);
+    rb->SendBulkString("port");
+    rb->SendLong(node.port);
+    rb->SendBulkString("role");
+    rb->SendBulkString(is_master ? "master" : "replica");
+    rb->SendBulkString("replication-offset");
+    rb->SendLong(0);
+    rb->SendBulkString("health");
+    rb->SendBulkString("online");
+  };
+
+  rb->StartArray(config->shards().size());
+  for (const ClusterShard& shard : config->shards()) {
+    rb->StartCollection(2, RedisReplyBuilder::MAP);
+
+    rb->SendBulkString("slots");
+    vector<ClusterConfig::SlotRange> ranges = SortedRanges(shard);
+    rb->StartArray(ranges.size() * 2);
+    for (const auto& range : ranges) {
+      rb->SendLong(range.start);
+      rb->SendLong(range.end);
+    }
+
+    rb->SendBulkString("nodes");
+    rb->StartArray(1 + shard.replicas.size());
+    send_node(shard.master, true);
+    for (const Node& replica : shard.replicas)
+      send_node(replica, false);
+  }
+}
+
+void ClusterFamily::ClusterNodes(ConnectionContext* cntx) {
+  shared_ptr<const ClusterConfig> config = GetConfig(cntx);
+  string res;
+  if (!config) {
+    return (*cntx)->SendBulkString(res);
+  }
+
+  auto append_node = [&](const Node& node, const ClusterShard& shard, bool is_master) {
+    string_view myself = node.id == config->my_id() ? "myself," : "";
+    absl::StrAppend(&res, node.id, " ", node.ip, ":", node.port, "@", node.port, " ", myself,
+                    is_master ? "master - " : "slave ", is_master ? "" : shard.master.id,
+                    is_master ? "" : " ", "0 0 0 connected");
+    if (is_master) {
+      for (const auto& range : SortedRanges(shard)) {
+        absl::StrAppend(&res, " ", range.start);
+        if (range.start != range.end)
+          absl::StrAppend(&res, "-", range.end);
+      }
+      for (const auto& migration : shard.migrations)
+        absl::StrAppend(&res, " [", migration.slot, "->-", migration.node_id, "]");
+    }
+    res.append("\r\n");
+  };
+
+  for (const ClusterShard& shard : config->shards()) {
+    append_node(shard.master, shard, true);
+    for (const Node& replica : shard.replicas)
+      append_node(replica, shard, false);
+  }
+
+  return (*cntx)->SendBulkString(res);
+}
+
+void ClusterFamily::ClusterInfo(ConnectionContext* cntx) {
+  shared_ptr<const ClusterConfig> config = GetConfig(cntx);
+  uint64_t epoch;
+  {
+    lock_guard lk(mu_);
+    epoch = ClusterConfig::IsEmulated() ? 1 : config_epoch_;
+  }
+
+  size_t assigned = config ? config->NumAssignedSlots() : 0;
+  size_t known_nodes = 0, size = 0;
+  if (config) {
+    for (const ClusterShard& shard : config->shards()) {
+      known_nodes += 1 + shard.replicas.size();
+      size += !shard.slot_ranges.empty();
+    }
+  }
+
+  string res;
+  auto append = [&res](string_view name, auto val) {
+    absl::StrAppend(&res, name, ":", val, "\r\n");
+  };
+
+  append("cluster_state", assigned == kMaxSlotNum + 1 ? "ok" : "fail");
+  append("cluster_slots_assigned", assigned);
+  append("cluster_slots_ok", assigned);
+  append("cluster_slots_pfail", 0);
+  append("cluster_slots_fail", 0);
+  append("cluster_known_nodes", known_nodes);
+  append("cluster_size", size);
+  append("cluster_current_epoch", epoch);
+  append("cluster_my_epoch", epoch);
+  append("cluster_stats_messages_ping_sent", 0);
+  append("cluster_stats_messages_pong_sent", 0);
+  append("cluster_stats_messages_sent", 0);
+  append("cluster_stats_messages_ping_received", 0);
+  append("cluster_stats_messages_pong_received", 0);
+  append("cluster_stats_messages_received", 0);
+  return (*cntx)->SendBulkString(res);
+}
+
+void ClusterFamily::DflyCluster(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled() || ClusterConfig::IsEmulated()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "MYID" && args.size() == 2) {
+    return (*cntx)->SendBulkString(server_family_->master_id());
+  }
+
+  if (sub_cmd == "CONFIG" && args.size() == 3) {
+    return SetConfig(ArgS(args, 2), cntx);
+  }
+
+  if (sub_cmd == "START-SLOT-MIGRATION" && args.size() >= 6 && args.size() % 2 == 0) {
+    return StartSlotMigration(args, cntx);
+  }
+
+  if (sub_cmd == "SLOT-MIGRATION-STATUS" && args.size() == 2) {
+    lock_guard lk(mu_);
+    return (*cntx)->SendSimpleString(migration_state_.empty() ? "NONE" : migration_state_);
+  }
+
+  return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "DFLYCLUSTER"), kSyntaxErrType);
+}
+
+void ClusterFamily::SetConfig(string_view json_str, ConnectionContext* cntx) {
+  optional<vector<ClusterShard>> shards = ParseConfig(json_str);
+  if (!shards) {
+    return (*cntx)->SendError("Invalid cluster configuration");
+  }
+
+  string error;
+  shared_ptr<const ClusterConfig> new_config =
+      ClusterConfig::Create(server_family_->master_id(), std::move(*shards), &error);
+  if (!new_config) {
+    return (*cntx)->SendError(absl::StrCat("Invalid cluster configuration: ", error));
+  }
+
+  lock_guard lk(mu_);
+  ApplyConfig(std::move(new_config), cntx->transaction);
+  return (*cntx)->SendOk();
+}
+
+void ClusterFamily::ApplyConfig(shared_ptr<const ClusterConfig> new_config, Transaction* trans) {
+  // The keys of the slots the node stops serving are unreachable, drop them.
+  vector<SlotId> lost_slots;
+  if (config_) {
+    for (unsigned slot = 0; slot <= kMaxSlotNum; ++slot) {
+      if (config_->IsMySlot(slot) && !new_config->IsMySlot(slot))
+        lost_slots.push_back(slot);
+    }
+  }
+
+  config_ = new_config;
+  ++config_epoch_;
+
+  // Redirect first, so no command writes the lost slots after they were flushed.
+  shard_set->pool()->AwaitFiberOnAll(
+      [&new_config](auto*) { ServerState::tlocal()->cluster_config = new_config; });
+
+  if (lost_slots.empty())
+    return;
+
+  LOG(INFO) << "Dropping the keys of " << lost_slots.size() << " slots";
+  if (!trans) {
+    shard_set->RunBlockingInParallel(
+        [&lost_slots](EngineShard* shard) { shard->db_slice().FlushSlots(0, lost_slots); });
+    return;
+  }
+
+  trans->Schedule();
+  trans->Execute(
+      [&lost_slots](Transaction* t, EngineShard* shard) {
+        shard->db_slice().FlushSlots(0, lost_slots);
+        return OpStatus::OK;
+      },
+      true);
+}
+
+bool ClusterFamily::MoveSlots(const SlotSet& slots, string_view node_id, Transaction* trans,
+                              string* error) {
+  lock_guard lk(mu_);
+  if (!config_) {
+    *error = "The node has no cluster config";
+    return false;
+  }
+
+  shared_ptr<const ClusterConfig> new_config = config_->MoveSlots(slots, node_id, error);
+  if (!new_config)
+    return false;
+
+  ApplyConfig(std::move(new_config), trans);
+  return true;
+}
+
+void ClusterFamily::StartSlotMigration(CmdArgList args, ConnectionContext* cntx) {
+  string host{ArgS(args, 2)};
+  uint32_t port;
+  if (!absl::SimpleAtoi(ArgS(args, 3), &port) || port == 0 || port > UINT16_MAX) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  vector<ClusterConfig::SlotRange> ranges;
+  for (size_t i = 4; i < args.size(); i += 2) {
+    uint32_t start, end;
+    if (!absl::SimpleAtoi(ArgS(args, i), &start) || !absl::SimpleAtoi(ArgS(args, i + 1), &end) ||
+        start > end || end > kMaxSlotNum) {
+      return (*cntx)->SendError("Invalid slot range");
+    }
+    ranges.push_back({SlotId(start), SlotId(end)});
+  }
+  SlotSet slots = ClusterConfig::ToSlotSet(ranges);
+
+  lock_guard lk(mu_);
+  if (!config_ || !config_->IsMaster()) {
+    return (*cntx)->SendError("Slots migrate only to the masters of a cluster");
+  }
+
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    if (slots.test(slot) && config_->IsMySlot(slot))
+      return (*cntx)->SendError(absl::StrCat("Slot ", slot, " is already served by this node"));
+  }
+
+  if (migration_state_ == kMigrationSyncing) {
+    return (*cntx)->SendError("A slot migration is in progress");
+  }
+
+  // The previous migration has finished, except for its fiber returning.
+  if (migration_fb_.joinable())
+    migration_fb_.join();
+
+  migration_.reset(new Replica(std::move(host), port, &server_family_->service()));
+  migration_state_ = kMigrationSyncing;
+  migration_fb_ = ::boost::fibers::fiber(&ClusterFamily::SlotMigrationFb, this, std::move(ranges));
+
+  return (*cntx)->SendOk();
+}
+
+void ClusterFamily::SlotMigrationFb(vector<ClusterConfig::SlotRange> ranges) {
+  SlotSet slots = ClusterConfig::ToSlotSet(ranges);
+  string my_id = server_family_->master_id();
+  Replica* migration;
+  {
+    lock_guard lk(mu_);
+    migration = migration_.get();
+  }
+
+  error_code ec = migration->SyncSlots(my_id, ranges);
+  bool release_sent = false;
+  if (!ec) {
+    release_sent = true;
+    ec = migration->ReleaseSlots();
+  }
+
+  // Ends the session on the source, which lets the paused writes through if it still has them.
+  migration->Stop();
+
+  lock_guard lk(mu_);
+  if (!ec) {
+    // The source redirects the slots here already, there is nothing to drop.
+    string error;
+    shared_ptr<const ClusterConfig> new_config =
+        config_ ? config_->MoveSlots(slots, my_id, &error) : nullptr;
+    if (new_config) {
+      ApplyConfig(std::move(new_config), nullptr);
+      LOG(INFO) << "Imported " << slots.count() << " slots from " << migration->MasterHost();
+      migration_state_ = "FINISHED";
+    } else {
+      LOG(ERROR) << "Could not take over the imported slots: " << error;
+      migration_state_ = absl::StrCat("FAILED ", error);
+    }
+    return;
+  }
+
+  LOG(WARNING) << "Slot migration failed: " << ec.message();
+  migration_state_ = absl::StrCat("FAILED ", ec.message());
+
+  // Unless the source may have released the slots, it still serves them and the imported keys
+  // are stale copies.
+  if (release_sent && ec != errc::bad_message) {
+    migration_state_ = absl::StrCat("FAILED unknown outcome of the release, ", ec.message());
+    return;
+  }
+
+  vector<SlotId> stale_slots;
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    if (slots.test(slot) && !(config_ && config_->IsMySlot(slot)))
+      stale_slots.push_back(slot);
+  }
+  shard_set->RunBlockingInParallel(
+      [&stale_slots](EngineShard* shard) { shard->db_slice().FlushSlots(0, stale_slots); });
+}
+
+void ClusterFamily::Asking(CmdArgList args, ConnectionContext* cntx) {
+  cntx->conn_state.asking = true;
+  return (*cntx)->SendOk();
+}
+
+// Reads are served by the replicas of a shard regardless of READONLY, so the commands that
+// clients send to them only need to succeed.
+void ClusterFamily::ReadOnly(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+  return (*cntx)->SendOk();
+}
+
+void ClusterFamily::ReadWrite(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+  return (*cntx)->SendOk();
+}
+
+using EngineFunc = void (ClusterFamily::*)(CmdArgList args, ConnectionContext* cntx);
+
+inline CommandId::Handler HandlerFunc(ClusterFamily* se, EngineFunc f) {
+  return [=](CmdArgList args, ConnectionContext* cntx) { return (se->*f)(args, cntx); };
+}
+
+#define HFUNC(x) SetHandler(HandlerFunc(this, &ClusterFamily::x))
+
+void ClusterFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"CLUSTER", CO::READONLY, -2, 0, 0, 0}.HFUNC(Cluster)
+            << CI{"DFLYCLUSTER", CO::ADMIN | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(DflyCluster)
+            << CI{"ASKING", CO::FAST, 1, 0, 0, 0}.HFUNC(Asking)
+            << CI{"READONLY", CO::READONLY | CO::FAST, 1, 0, 0, 0}.HFUNC(ReadOnly)
+            << CI{"READWRITE", CO::READONLY | CO::FAST, 1, 0, 0, 0}.HFUNC(ReadWrite);
+}
+
+}  // namespace dfly
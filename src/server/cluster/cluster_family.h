@@ -0,0 +1,87 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <memory>
+
+#include "facade/facade_types.h"
+#include "server/cluster/cluster_config.h"
+
+namespace dfly {
+
+class CommandRegistry;
+class ConnectionContext;
+class Replica;
+class ServerFamily;
+class Transaction;
+
+// Commands of cluster mode. CLUSTER serves the standard cluster clients, DFLYCLUSTER lets the
+// orchestrator of the fleet assign the slots. The redirects of the commands on the slots of
+// other nodes are done in Service::DispatchCommand.
+//
+// DFLYCLUSTER START-SLOT-MIGRATION imports slots from the node that serves them through a sync
+// session of DflyCmd, which hands them over once they are loaded. One migration runs at a time.
+class ClusterFamily {
+ public:
+  explicit ClusterFamily(ServerFamily* server_family);
+  ~ClusterFamily();
+
+  // Installs the config of emulated mode. Must be called after the threads started.
+  void Init();
+
+  // Stops the slot migration.
+  void Shutdown();
+
+  void Register(CommandRegistry* registry);
+
+  // Moves the slots to the master node_id in the config of this node and drops their keys if
+  // it served them, using trans. Returns false and sets error if node_id is not a master.
+  bool MoveSlots(const SlotSet& slots, std::string_view node_id, Transaction* trans,
+                 std::string* error);
+
+ private:
+  using CmdArgList = facade::CmdArgList;
+
+  void Cluster(CmdArgList args, ConnectionContext* cntx);
+  void DflyCluster(CmdArgList args, ConnectionContext* cntx);
+  void Asking(CmdArgList args, ConnectionContext* cntx);
+  void ReadOnly(CmdArgList args, ConnectionContext* cntx);
+  void ReadWrite(CmdArgList args, ConnectionContext* cntx);
+
+  void ClusterSlots(ConnectionContext* cntx);
+  void ClusterShards(ConnectionContext* cntx);
+  void ClusterNodes(ConnectionContext* cntx);
+  void ClusterInfo(ConnectionContext* cntx);
+  void SetConfig(std::string_view json, ConnectionContext* cntx);
+
+  // DFLYCLUSTER START-SLOT-MIGRATION <host> <port> <start> <end> [<start> <end> ...]
+  void StartSlotMigration(CmdArgList args, ConnectionContext* cntx);
+
+  // Runs the migration of the slot ranges, spawned by StartSlotMigration.
+  void SlotMigrationFb(std::vector<ClusterConfig::SlotRange> ranges);
+
+  // Installs the config in all the threads and drops the keys of the slots that it no longer
+  // assigns to this node, using trans if there are any. mu_ must be held.
+  void ApplyConfig(std::shared_ptr<const ClusterConfig> config, Transaction* trans);
+
+  // The current config, in emulated mode with the address the client connected to.
+  std::shared_ptr<const ClusterConfig> GetConfig(ConnectionContext* cntx) const;
+
+  ClusterConfig::Node MyNode(ConnectionContext* cntx) const;
+
+  ServerFamily* server_family_;
+
+  mutable boost::fibers::mutex mu_;
+  std::shared_ptr<const ClusterConfig> config_;  // protected by mu_
+  uint64_t config_epoch_ = 0;                    // protected by mu_
+
+  std::unique_ptr<Replica> migration_;  // protected by mu_
+  std::string migration_state_;         // protected by mu_, reported by SLOT-MIGRATION-STATUS
+  ::boost::fibers::fiber migration_fb_;
+};
+
+}  // namespace dfly
@@ -111,6 +111,10 @@ const char* OptName(CO::CommandOpt fl) {
       return "global-trans";
     case VARIADIC_KEYS:
       return "variadic-keys";
+    case NO_AUTOJOURNAL:
+      return "no-autojournal";
+    case SPLIT_JOURNAL:
+      return "split-journal";
   }
   return "unknown";
 }
@@ -33,6 +33,12 @@ enum CommandOpt : uint32_t {
   NOSCRIPT = 0x100,
   BLOCKING = 0x200,  // implies REVERSE_MAPPING
   GLOBAL_TRANS = 0x1000,
+
+  NO_AUTOJOURNAL = 0x2000,  // the command journals its effects itself, e.g. SPOP.
+
+  // the command applies to every key independently, so the shards of a multi-shard invocation
+  // journal only their own keys, e.g. MSET.
+  SPLIT_JOURNAL = 0x4000,
 };
 
 const char* OptName(CommandOpt fl);
@@ -6,7 +6,10 @@
 
 #include <absl/strings/charconv.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
 #include <mimalloc.h>
 
 extern "C" {
@@ -16,10 +19,26 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "server/error.h"
 #include "server/server_state.h"
 
+ABSL_FLAG(uint32_t, interpreter_per_thread, 10,
+          "Maximal number of lua interpreters per thread. Scripts of the same thread wait for each "
+          "other when all the interpreters are busy.");
+ABSL_FLAG(uint64_t, lua_max_memory, 0,
+          "Maximal memory of a lua interpreter while it runs a script. 0 - unlimited.");
+ABSL_FLAG(uint64_t, lua_max_instructions, 0,
+          "Maximal number of lua instructions a script may execute during a single run. "
+          "0 - unlimited.");
+ABSL_FLAG(uint32_t, lua_max_call_depth, 4096,
+          "Maximal depth of nested lua function calls. Protects the thread stack from runaway "
+          "recursion. 0 - unlimited.");
+ABSL_FLAG(uint32_t, lua_yield_usec, 0,
+          "If positive, long running scripts yield their thread to other fibers every so many "
+          "microseconds.");
+
 namespace dfly {
 
 using namespace std;
@@ -48,15 +67,21 @@ void ServerState::Init() {
 
 void ServerState::Shutdown() {
   gstate_ = GlobalState::SHUTTING_DOWN;
-  interpreter_.reset();
+  interpreter_mgr_.reset();
 }
 
-Interpreter& ServerState::GetInterpreter() {
-  if (!interpreter_) {
-    interpreter_.emplace();
+InterpreterManager& ServerState::GetInterpreterManager() {
+  if (!interpreter_mgr_) {
+    Interpreter::Limits limits;
+    limits.max_memory = absl::GetFlag(FLAGS_lua_max_memory);
+    limits.max_instructions = absl::GetFlag(FLAGS_lua_max_instructions);
+    limits.max_call_depth = absl::GetFlag(FLAGS_lua_max_call_depth);
+    limits.yield_usec = absl::GetFlag(FLAGS_lua_yield_usec);
+
+    interpreter_mgr_.emplace(std::max(1u, absl::GetFlag(FLAGS_interpreter_per_thread)), limits);
   }
 
-  return interpreter_.value();
+  return interpreter_mgr_.value();
 }
 
 const char* GlobalStateName(GlobalState s) {
@@ -170,6 +195,24 @@ bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes) {
   return true;
 }
 
+bool ParseDbLimits(string_view str, vector<pair<DbIndex, uint64_t>>* limits) {
+  limits->clear();
+  if (str.empty())
+    return true;
+
+  for (string_view item : absl::StrSplit(str, ',')) {
+    pair<string_view, string_view> kv = absl::StrSplit(item, absl::MaxSplits(':', 1));
+    uint32_t db_index;
+    int64_t limit;
+    if (!absl::SimpleAtoi(kv.first, &db_index) || db_index > UINT16_MAX)
+      return false;
+    if (!ParseHumanReadableBytes(kv.second, &limit) || limit <= 0)
+      return false;
+    limits->emplace_back(db_index, limit);
+  }
+  return true;
+}
+
 bool ParseDouble(string_view src, double* value) {
   if (src.empty())
     return false;
@@ -189,12 +232,22 @@ bool ParseDouble(string_view src, double* value) {
 #define ADD(x) (x) += o.x
 
 TieredStats& TieredStats::operator+=(const TieredStats& o) {
-  static_assert(sizeof(TieredStats) == 32);
+  static_assert(sizeof(TieredStats) == 112);
 
   ADD(external_reads);
   ADD(external_writes);
+  ADD(external_coalesced_reads);
+  ADD(external_promotions);
+  ADD(external_demotions);
+  ADD(external_relocations);
+  ADD(external_punched_bytes);
+  ADD(external_pressure_offloads);
+  ADD(external_throttled_steps);
+  ADD(external_eviction_offloads);
   ADD(storage_capacity);
   ADD(storage_reserved);
+  ADD(storage_free);
+  ADD(storage_max_free_range);
   return *this;
 }
 
@@ -217,9 +270,11 @@ OpResult<ScanOpts> ScanOpts::TryFrom(CmdArgList args) {
       else if (scan_opts.limit > 4096)
         scan_opts.limit = 4096;
     } else if (opt == "MATCH") {
-      scan_opts.pattern = ArgS(args, i + 1);
-      if (scan_opts.pattern == "*")
-        scan_opts.pattern = string_view{};
+      string_view pattern = ArgS(args, i + 1);
+      if (pattern == "*")
+        scan_opts.matcher.reset();
+      else
+        scan_opts.matcher.emplace(pattern);
     } else if (opt == "TYPE") {
       ToLower(&args[i + 1]);
       scan_opts.type_filter = ArgS(args, i + 1);
@@ -227,6 +282,16 @@ OpResult<ScanOpts> ScanOpts::TryFrom(CmdArgList args) {
       if (!absl::SimpleAtoi(ArgS(args, i + 1), &scan_opts.bucket_id)) {
         return facade::OpStatus::INVALID_INT;
       }
+    } else if (opt == "MINTTL") {
+      int64_t sec = 0;
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &sec) || sec < 0 || sec > INT32_MAX) {
+        return facade::OpStatus::INVALID_INT;
+      }
+      scan_opts.min_ttl_ms = sec * 1000;
+    } else if (opt == "MAXSIZE") {
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &scan_opts.max_size)) {
+        return facade::OpStatus::INVALID_INT;
+      }
     } else {
       return facade::OpStatus::SYNTAX_ERR;
     }
@@ -235,9 +300,11 @@ OpResult<ScanOpts> ScanOpts::TryFrom(CmdArgList args) {
 }
 
 bool ScanOpts::Matches(std::string_view val_name) const {
-  if (pattern.empty())
-    return true;
-  return stringmatchlen(pattern.data(), pattern.size(), val_name.data(), val_name.size(), 0) == 1;
+  return !matcher || matcher->Matches(val_name);
+}
+
+bool ScanOpts::MayMatchPrefix(std::string_view prefix) const {
+  return !matcher || matcher->MayMatchPrefix(prefix);
 }
 
 std::string GenericError::Format() const {
@@ -250,4 +317,49 @@ std::string GenericError::Format() const {
     return absl::StrCat(ec_.message(), ":", details_);
 }
 
+namespace {
+
+atomic_bool snapshot_stages_enabled{false};
+atomic_uint64_t snapshot_stage_ns[SnapshotStages::kNumStages];
+atomic_uint64_t snapshot_stage_bytes[SnapshotStages::kNumStages];
+
+}  // namespace
+
+void SnapshotStages::Enable(bool enable) {
+  if (enable) {
+    for (unsigned i = 0; i < kNumStages; ++i) {
+      snapshot_stage_ns[i].store(0, memory_order_relaxed);
+      snapshot_stage_bytes[i].store(0, memory_order_relaxed);
+    }
+  }
+  snapshot_stages_enabled.store(enable, memory_order_relaxed);
+}
+
+auto SnapshotStages::Read() -> Totals {
+  Totals res;
+  for (unsigned i = 0; i < kNumStages; ++i) {
+    res.ns[i] = snapshot_stage_ns[i].load(memory_order_relaxed);
+    res.bytes[i] = snapshot_stage_bytes[i].load(memory_order_relaxed);
+  }
+  return res;
+}
+
+const char* SnapshotStages::Name(Stage stage) {
+  static const char* const kNames[kNumStages] = {
+      "traverse", "serialize", "compress", "channel_push", "channel_pop", "checksum", "write",
+      "read",     "verify",    "parse",    "decompress",   "decode",      "insert"};
+  return kNames[stage];
+}
+
+uint64_t SnapshotStages::Start() {
+  return snapshot_stages_enabled.load(memory_order_relaxed) ? absl::GetCurrentTimeNanos() : 0;
+}
+
+void SnapshotStages::Finish(Stage stage, uint64_t start, size_t bytes) {
+  if (start == 0)
+    return;
+  snapshot_stage_ns[stage].fetch_add(absl::GetCurrentTimeNanos() - start, memory_order_relaxed);
+  snapshot_stage_bytes[stage].fetch_add(bytes, memory_order_relaxed);
+}
+
 }  // namespace dfly
@@ -10,9 +10,11 @@
 
 #include <atomic>
 #include <boost/fiber/mutex.hpp>
+#include <optional>
 #include <string_view>
 #include <vector>
 
+#include "core/glob_matcher.h"
 #include "facade/facade_types.h"
 #include "facade/op_status.h"
 
@@ -94,14 +96,47 @@ struct TieredStats {
   size_t external_reads = 0;
   size_t external_writes = 0;
 
+  // reads that were served by an io request of another read of the same page.
+  size_t external_coalesced_reads = 0;
+
+  // values that were moved back to memory and values that were moved to disk.
+  size_t external_promotions = 0;
+  size_t external_demotions = 0;
+
+  // values that were moved out of sparse pages and bytes released back to the file system.
+  size_t external_relocations = 0;
+  size_t external_punched_bytes = 0;
+
+  // values picked for offloading because the shard memory crossed the offload watermark and the
+  // number of heartbeats in which this offloading was slowed down due to high disk latency.
+  size_t external_pressure_offloads = 0;
+  size_t external_throttled_steps = 0;
+
+  // values offloaded by the eviction in cache mode instead of deleting their entries.
+  size_t external_eviction_offloads = 0;
+
   size_t storage_capacity = 0;
 
   // how much was reserved by actively stored items.
   size_t storage_reserved = 0;
 
+  // the storage that large values and new segments can be cut from, and the sum of the largest
+  // contiguous range of each shard. Their ratio shows the fragmentation of the backing file.
+  size_t storage_free = 0;
+  size_t storage_max_free_range = 0;
+
   TieredStats& operator+=(const TieredStats&);
 };
 
+// The position of a snapshot of a shard in the journal of the master that saved it. A replica
+// that loads the snapshot resumes replication from there instead of a full sync.
+struct ReplOffset {
+  std::string master_id;
+  ShardId shard = 0;
+  uint32_t shard_count = 0;
+  LSN lsn = 0;
+};
+
 enum class GlobalState : uint8_t {
   ACTIVE,
   LOADING,
@@ -111,6 +146,14 @@ enum class GlobalState : uint8_t {
 
 enum class TimeUnit : uint8_t { SEC, MSEC };
 
+// Expiry times of set members and hash fields are kept in seconds relative to Oct 1, 2022,
+// so that they fit into 32 bits.
+constexpr uint64_t kMemberExpiryBase = 1664582400ULL;
+
+inline uint32_t MemberTimeSeconds(uint64_t now_ms) {
+  return (now_ms / 1000) - kMemberExpiryBase;
+}
+
 inline void ToUpper(const MutableSlice* val) {
   for (auto& c : *val) {
     c = absl::ascii_toupper(c);
@@ -124,6 +167,10 @@ inline void ToLower(const MutableSlice* val) {
 }
 
 bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes);
+
+// Parses a list of per-database limits, e.g. "0:1gb,3:5000", into pairs of the database index
+// and the limit. The limits accept the suffixes of ParseHumanReadableBytes.
+bool ParseDbLimits(std::string_view str, std::vector<std::pair<DbIndex, uint64_t>>* limits);
 bool ParseDouble(std::string_view src, double* value);
 const char* ObjTypeName(int type);
 
@@ -274,13 +321,61 @@ class Context : public Cancellation {
 };
 
 struct ScanOpts {
-  std::string_view pattern;
+  std::optional<GlobMatcher> matcher;  // Matches everything if not set.
   size_t limit = 10;
   std::string_view type_filter;
   unsigned bucket_id = UINT_MAX;
 
+  // Dragonfly specific filters of SCAN: the minimal remaining TTL, which the keys without
+  // expiry always pass, and the maximal memory used by the value.
+  int64_t min_ttl_ms = 0;
+  size_t max_size = SIZE_MAX;
+
   bool Matches(std::string_view val_name) const;
+
+  // Returns false if no key starting with prefix can match the pattern.
+  bool MayMatchPrefix(std::string_view prefix) const;
   static OpResult<ScanOpts> TryFrom(CmdArgList args);
 };
 
+// The time and the bytes that saving and loading snapshots spent in each of their stages, summed
+// over all the threads. The stages are measured only while enabled, by DEBUG SNAPSHOTBENCH.
+// The stages may nest: traverse includes serialize, and parse includes the reads and the
+// checksum verification it triggers. The channel, write and read stages include their waits.
+class SnapshotStages {
+ public:
+  enum Stage : unsigned {
+    TRAVERSE,
+    SERIALIZE,
+    COMPRESS,
+    CHANNEL_PUSH,
+    CHANNEL_POP,
+    CHECKSUM,
+    WRITE,
+    READ,
+    VERIFY,
+    PARSE,
+    DECOMPRESS,
+    DECODE,
+    INSERT,
+    kNumStages
+  };
+
+  struct Totals {
+    uint64_t ns[kNumStages] = {0};
+    uint64_t bytes[kNumStages] = {0};
+  };
+
+  // Enabling resets the totals.
+  static void Enable(bool enable);
+  static Totals Read();
+  static const char* Name(Stage stage);
+
+  // Returns the start of a stage, or 0 if the stages are not measured.
+  static uint64_t Start();
+
+  // Adds the time since start and bytes to stage, unless start is 0.
+  static void Finish(Stage stage, uint64_t start, size_t bytes = 0);
+};
+
 }  // namespace dfly
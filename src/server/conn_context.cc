@@ -21,26 +21,84 @@ void ConnectionContext::SendMonitorMsg(std::string msg) {
   owner()->SendMonitorMsg(std::move(msg));
 }
 
-void ConnectionContext::ChangeMonitor(bool start) {
+void ConnectionContext::ChangeMonitor(bool start, std::shared_ptr<const MonitorFilter> filter) {
   // This will either remove or register a new connection
   // at the "top level" thread --> ServerState context
   // note that we are registering/removing this connection to the thread at which at run
-  // then notify all other threads that there is a change in the number of monitors
+  // then notify all other threads about the filter of this monitor
   auto& my_monitors = ServerState::tlocal()->Monitors();
   if (start) {
-    my_monitors.Add(this);
+    DCHECK(filter && filter->conn == this);
+    if (!monitor)
+      my_monitors.Add(this);
   } else {
     VLOG(1) << "connection " << owner()->GetClientInfo()
             << " no longer needs to be monitored - removing 0x" << std::hex << (const void*)this;
     my_monitors.Remove(this);
   }
-  // Tell other threads that about the change in the number of connection that we monitor
-  shard_set->pool()->Await(
-      [start](auto*) { ServerState::tlocal()->Monitors().NotifyChangeCount(start); });
+  // Tell other threads about the change in the connections that we monitor
+  shard_set->pool()->Await([this, start, &filter](auto*) {
+    auto& monitors = ServerState::tlocal()->Monitors();
+    if (start)
+      monitors.AddFilter(filter);
+    else
+      monitors.RemoveFilter(this);
+  });
   EnableMonitoring(start);
 }
 
-void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgList args) {
+void ConnectionContext::ChangeTracking(bool enable, bool bcast, StringVec prefixes) {
+  uint32_t client_id = owner()->GetClientId();
+  TrackingTable::ClientRef ref = TrackingTable::MakeRef(util::ProactorBase::GetIndex(), client_id);
+
+  if (conn_state.tracking_info && conn_state.tracking_info->bcast) {
+    shard_set->RunBriefInParallel(
+        [ref](EngineShard* shard) { shard->tracking_table().RemovePrefixes(ref); });
+  }
+
+  auto& tracking_clients = ServerState::tlocal()->tracking_clients;
+  if (!enable) {
+    // The keys that this client has read stay in the tracking tables until they change,
+    // their notifications are dropped since the client is not registered anymore.
+    tracking_clients.erase(client_id);
+    conn_state.tracking_info.reset();
+    return;
+  }
+
+  tracking_clients[client_id] = owner();
+
+  if (bcast && prefixes.empty())
+    prefixes.emplace_back();
+
+  if (bcast) {
+    shard_set->RunBriefInParallel([ref, &prefixes](EngineShard* shard) {
+      for (const auto& prefix : prefixes) {
+        shard->tracking_table().AddPrefix(prefix, ref);
+      }
+    });
+  }
+
+  conn_state.tracking_info.emplace();
+  conn_state.tracking_info->bcast = bcast;
+  conn_state.tracking_info->prefixes = std::move(prefixes);
+}
+
+void ConnectionContext::SendInvalidation(const vector<uint32_t>& client_ids,
+                                         shared_ptr<const string> key) {
+  const auto& tracking_clients = ServerState::tlocal()->tracking_clients;
+
+  facade::Connection::PubMessage msg;
+  msg.message = std::move(key);
+  msg.invalidate = true;
+
+  for (uint32_t client_id : client_ids) {
+    if (auto it = tracking_clients.find(client_id); it != tracking_clients.end())
+      it->second->SendMsgVecAsync(msg);
+  }
+}
+
+void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgList args,
+                                           bool sharded) {
   vector<unsigned> result(to_reply ? args.size() : 0, 0);
 
   if (to_add || conn_state.subscribe_info) {
@@ -55,18 +113,21 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
       this->force_dispatch = true;
     }
 
+    auto& info = *conn_state.subscribe_info;
+    auto& subscriptions = sharded ? info.shard_channels : info.channels;
+
     // Gather all the channels we need to subscribe to / remove.
     for (size_t i = 0; i < args.size(); ++i) {
       bool res = false;
       string_view channel = ArgS(args, i);
       if (to_add) {
-        res = conn_state.subscribe_info->channels.emplace(channel).second;
+        res = subscriptions.emplace(channel).second;
       } else {
-        res = conn_state.subscribe_info->channels.erase(channel) > 0;
+        res = subscriptions.erase(channel) > 0;
       }
 
       if (to_reply)
-        result[i] = conn_state.subscribe_info->SubscriptionCount();
+        result[i] = sharded ? info.shard_channels.size() : info.SubscriptionCount();
 
       if (res) {
         ShardId sid = Shard(channel, shard_set->size());
@@ -102,7 +163,11 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
 
       DCHECK_LT(start, end);
       for (unsigned i = start; i < end; ++i) {
-        if (to_add) {
+        if (sharded && to_add) {
+          cs.AddShardSubscription(channels[i].second, this, tid);
+        } else if (sharded) {
+          cs.RemoveShardSubscription(channels[i].second, this);
+        } else if (to_add) {
           cs.AddSubscription(channels[i].second, this, tid);
         } else {
           cs.RemoveSubscription(channels[i].second, this);
@@ -123,10 +188,11 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
 
   if (to_reply) {
     const char* action[2] = {"unsubscribe", "subscribe"};
+    const char* shard_action[2] = {"sunsubscribe", "ssubscribe"};
 
     for (size_t i = 0; i < result.size(); ++i) {
       (*this)->StartArray(3);
-      (*this)->SendBulkString(action[to_add]);
+      (*this)->SendBulkString(sharded ? shard_action[to_add] : action[to_add]);
       (*this)->SendBulkString(ArgS(args, i));  // channel
 
       // number of subscribed channels for this connection *right after*
@@ -205,15 +271,17 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
     }
   }
 }
-void ConnectionContext::UnsubscribeAll(bool to_reply) {
-  if (to_reply && (!conn_state.subscribe_info || conn_state.subscribe_info->channels.empty())) {
-    return SendSubscriptionChangedResponse("unsubscribe", std::nullopt, 0);
+void ConnectionContext::UnsubscribeAll(bool to_reply, bool sharded) {
+  auto* info = conn_state.subscribe_info.get();
+  if (to_reply && (!info || (sharded ? info->shard_channels : info->channels).empty())) {
+    return SendSubscriptionChangedResponse(sharded ? "sunsubscribe" : "unsubscribe",
+                                           std::nullopt, 0);
   }
-  StringVec channels(conn_state.subscribe_info->channels.begin(),
-                     conn_state.subscribe_info->channels.end());
+  const auto& subscriptions = sharded ? info->shard_channels : info->channels;
+  StringVec channels(subscriptions.begin(), subscriptions.end());
   CmdArgVec arg_vec(channels.begin(), channels.end());
 
-  ChangeSubscription(false, to_reply, CmdArgList{arg_vec});
+  ChangeSubscription(false, to_reply, CmdArgList{arg_vec}, sharded);
 }
 
 void ConnectionContext::PUnsubscribeAll(bool to_reply) {
@@ -230,7 +298,7 @@ void ConnectionContext::PUnsubscribeAll(bool to_reply) {
 void ConnectionContext::SendSubscriptionChangedResponse(string_view action,
                                                         std::optional<string_view> topic,
                                                         unsigned count) {
-  (*this)->StartArray(3);
+  (*this)->StartCollection(3, facade::RedisReplyBuilder::PUSH);
   (*this)->SendBulkString(action);
   if (topic.has_value())
     (*this)->SendBulkString(topic.value());
@@ -247,8 +315,6 @@ void ConnectionState::ExecInfo::Clear() {
 
 void ConnectionState::ExecInfo::ClearWatched() {
   watched_keys.clear();
-  watched_dirty.store(false, memory_order_relaxed);
-  watched_existed = 0;
 }
 
 }  // namespace dfly
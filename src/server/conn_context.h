@@ -7,12 +7,14 @@
 #include <absl/container/flat_hash_set.h>
 
 #include "facade/conn_context.h"
+#include "facade/memcache_parser.h"
 #include "server/common.h"
 #include "util/fibers/fibers_ext.h"
 
 namespace dfly {
 
 class EngineShardSet;
+struct MonitorFilter;
 
 struct StoredCmd {
   const CommandId* descr;
@@ -27,10 +29,6 @@ struct ConnectionState {
   struct ExecInfo {
     enum ExecState { EXEC_INACTIVE, EXEC_COLLECT, EXEC_ERROR };
 
-    ExecInfo() = default;
-    // ExecInfo is immovable due to being referenced from DbSlice.
-    ExecInfo(ExecInfo&&) = delete;
-
     // Return true if ExecInfo is active (after MULTI)
     bool IsActive() {
       return state != EXEC_INACTIVE;
@@ -39,29 +37,38 @@ struct ConnectionState {
     // Resets to blank state after EXEC or DISCARD
     void Clear();
 
-    // Resets local watched keys info. Does not unregister the keys from DbSlices.
+    // Resets the watched keys info.
     void ClearWatched();
 
+    // A key registered with WATCH and the state in which WATCH found it. EXEC fails if the key
+    // was added or removed since, or if the version of its slot reached version, which every
+    // later change of the key does. Other changes in the slot may fail EXEC as well.
+    struct WatchedKey {
+      DbIndex db_index;
+      std::string key;
+      uint64_t version = 0;  // The version of the db slice at WATCH.
+      bool existed = false;
+    };
+
     ExecState state = EXEC_INACTIVE;
     std::vector<StoredCmd> body;
     // List of keys registered with WATCH
-    std::vector<std::pair<DbIndex, std::string>> watched_keys;
-    // Set if a watched key was changed before EXEC
-    std::atomic_bool watched_dirty = false;
-    // Number of times watch was called on an existing key.
-    uint32_t watched_existed = 0;
+    std::vector<WatchedKey> watched_keys;
   };
 
   // Lua-script related data.
   struct ScriptInfo {
     bool is_write = true;
+
+    // Whether the script runs in the shard thread of its keys.
+    bool in_shard = false;
     absl::flat_hash_set<std::string_view> keys;
   };
 
   // PUB-SUB messaging related data.
   struct SubscribeInfo {
     bool IsEmpty() const {
-      return channels.empty() && patterns.empty();
+      return channels.empty() && patterns.empty() && shard_channels.empty();
     }
 
     unsigned SubscriptionCount() const {
@@ -71,10 +78,26 @@ struct ConnectionState {
     // TODO: to provide unique_strings across service. This will allow us to use string_view here.
     absl::flat_hash_set<std::string> channels;
     absl::flat_hash_set<std::string> patterns;
+    absl::flat_hash_set<std::string> shard_channels;  // of SSUBSCRIBE, counted on their own.
 
     util::fibers_ext::BlockingCounter borrow_token{0};
   };
 
+  // CLIENT TRACKING related data.
+  struct TrackingInfo {
+    // In BCAST mode the client is notified about all the keys that match prefixes,
+    // and not only about the keys it has read.
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+  };
+
+  // Majority vote over the shards of the recent single-shard commands. The connection
+  // migrates to the thread of shard once score reaches migrate_connections_threshold.
+  struct ShardAffinity {
+    ShardId shard = kInvalidSid;
+    uint32_t score = 0;
+  };
+
   enum MCGetMask {
     FETCH_CAS_VER = 1,
   };
@@ -86,14 +109,25 @@ struct ConnectionState {
   // For get op - we use it as a mask of MCGetMask values.
   uint32_t memcache_flag = 0;
 
+  // Set while a memcache meta command is dispatched, holds its flags.
+  const facade::MemcacheParser::Command* mc_command = nullptr;
+
   // If this server is master, and this connection is from a secondary replica,
   // then it holds positive sync session id.
   uint32_t repl_session_id = 0;
   uint32_t repl_flow_id = kuint32max;
 
+  // Set by CLIENT READONLY_STALENESS. Reads on a replica whose data is older fail, 0 disables.
+  uint64_t max_staleness_ms = 0;
+
+  // Set by ASKING in cluster mode, lets the next command run on a slot that migrates here.
+  bool asking = false;
+
   ExecInfo exec_info;
   std::optional<ScriptInfo> script_info;
   std::unique_ptr<SubscribeInfo> subscribe_info;
+  std::optional<TrackingInfo> tracking_info;
+  ShardAffinity shard_affinity;
 };
 
 class ConnectionContext : public facade::ConnectionContext {
@@ -125,11 +159,22 @@ class ConnectionContext : public facade::ConnectionContext {
   // 2. we need to have for each of them each own copy for thread safe reasons
   void SendMonitorMsg(std::string msg);
 
-  void ChangeSubscription(bool to_add, bool to_reply, CmdArgList args);
+  // SSUBSCRIBE and SUNSUBSCRIBE if sharded is true.
+  void ChangeSubscription(bool to_add, bool to_reply, CmdArgList args, bool sharded = false);
   void ChangePSub(bool to_add, bool to_reply, CmdArgList args);
-  void UnsubscribeAll(bool to_reply);
+  void UnsubscribeAll(bool to_reply, bool sharded = false);
   void PUnsubscribeAll(bool to_reply);
-  void ChangeMonitor(bool start);  // either start or stop monitor on a given connection
+  // Either starts or stops monitor on a given connection. Starting requires the filter
+  // of the monitor, and replaces the previous one if the connection already monitors.
+  void ChangeMonitor(bool start, std::shared_ptr<const MonitorFilter> filter = {});
+
+  // Starts or stops CLIENT TRACKING for this connection. In BCAST mode, prefixes are
+  // registered on all the shards. An empty list of prefixes tracks all the keys.
+  void ChangeTracking(bool enable, bool bcast, StringVec prefixes);
+
+  // Runs in the io thread of the tracking connections. Registered as TrackingTable::NotifyFn.
+  static void SendInvalidation(const std::vector<uint32_t>& client_ids,
+                               std::shared_ptr<const std::string> key);
 
   bool is_replicating = false;
   bool monitor = false;  // when a monitor command is sent over a given connection, we need to aware
@@ -3,6 +3,7 @@
 //
 #include "server/container_utils.h"
 
+#include "base/flags.h"
 #include "base/logging.h"
 
 extern "C" {
@@ -14,8 +15,22 @@ extern "C" {
 #include "redis/zset.h"
 }
 
+ABSL_FLAG(bool, listpack_adaptive_limits, true,
+          "If true, the listpack limits of hashes and sorted sets are tuned per key by "
+          "the mix of their lookups and writes");
+
 namespace dfly::container_utils {
 
+namespace {
+
+// The accesses to sample before the access mix of a container is trusted.
+constexpr unsigned kMinAccessSample = 16;
+
+// The maximal average size of a listpack entry for it to be scanned cheap enough.
+constexpr size_t kSmallEntrySize = 24;
+
+}  // namespace
+
 quicklistEntry QLEntry() {
   quicklistEntry res{.quicklist = NULL,
                      .node = NULL,
@@ -158,4 +173,26 @@ bool IterateSortedSet(robj* zobj, const IterateSortedFunc& func, int32_t start,
   return false;
 }
 
+size_t ListpackLimit(const PrimeValue& pv, size_t limit) {
+  if (!absl::GetFlag(FLAGS_listpack_adaptive_limits))
+    return limit;
+
+  auto [lookups, writes] = pv.AccessMix();
+  if (lookups < kMinAccessSample)
+    return limit;
+
+  // Writes look the container up as well, so lookups >= writes roughly.
+  if (writes * 2 >= lookups)
+    return limit / 2;
+
+  if (writes * 8 <= lookups) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    size_t len = lpLength(lp);
+    if (len > 0 && lpBytes(lp) / len <= kSmallEntrySize)
+      return limit * 4;
+  }
+
+  return limit;
+}
+
 }  // namespace dfly::container_utils
@@ -69,6 +69,22 @@ bool IterateSet(const PrimeValue& pv, const IterateFunc& func);
 bool IterateSortedSet(robj* zobj, const IterateSortedFunc& func, int32_t start = 0,
                       int32_t end = -1, bool reverse = false, bool use_score = false);
 
+// Returns the limit (in bytes or entries) up to which the listpack of a hash or a sorted set
+// stays a listpack, given the static limit. Read-mostly containers with small entries keep
+// their listpacks up to 4 times longer since scanning them is cheap, while write-hot ones are
+// converted at half of the limit. See --listpack_adaptive_limits.
+size_t ListpackLimit(const PrimeValue& pv, size_t limit);
+
+// Sets, hashes and sorted sets with more elements than this are sent to the client in batches of
+// this size, one hop per batch, instead of being copied whole on the shard before the reply.
+constexpr size_t kReplyBatchSize = 4096;
+
+// Whether the replies with all the entries of ds can be sent in batches. The entries that may
+// expire are not, since the number of entries in the reply must be known before the first batch.
+inline bool IsBatchReplyable(const DenseSet& ds) {
+  return ds.Size() > kReplyBatchSize && ds.NumTtlEntries() == 0 && !ds.IsRehashing();
+}
+
 };  // namespace container_utils
 
 }  // namespace dfly
@@ -8,49 +8,167 @@ extern "C" {
 #include "redis/object.h"
 }
 
-#include <boost/fiber/fiber.hpp>
-#include <boost/fiber/operations.hpp>
+#include <absl/strings/match.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/count_min_sketch.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
+#include "core/time_series.h"
 #include "server/engine_shard_set.h"
+#include "server/keyspace_events.h"
 #include "server/server_state.h"
 #include "server/tiered_storage.h"
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(bool, cache_admission_filter, false,
+          "In cache mode, admits a new key at the expense of an evicted one only if the new key "
+          "has been accessed more often recently. Protects the working set from scans");
+
+ABSL_FLAG(bool, expire_wheel, true,
+          "If true, the keys with expiry are indexed by their deadline, so that they are deleted "
+          "when they are due with bounded work per tick, instead of being found by sampling");
+
+ABSL_FLAG(uint32_t, lazyfree_threshold, 64,
+          "Values of deleted keys and of flushed databases with more elements are freed in the "
+          "background in small steps, so that deleting them does not block the shard. "
+          "0 frees all the values inline");
+
+ABSL_FLAG(uint32_t, hotkeys_sample_rate, 100,
+          "One out of about that many key accesses is counted towards the hot keys of "
+          "MEMORY HOTKEYS. 0 disables the tracking of both the hot keys and the big keys of "
+          "MEMORY BIGKEYS");
+
+ABSL_FLAG(string, maxmemory_policy, "",
+          "Which keys are evicted at maxmemory: noeviction, allkeys-lfu, allkeys-lru, "
+          "volatile-lfu or volatile-ttl. The volatile policies evict only keys with an expiry "
+          "and fail the writes when there are none left. If empty, allkeys-lfu with cache_mode "
+          "and noeviction otherwise");
+
+ABSL_DECLARE_FLAG(bool, cache_mode);
+
+ABSL_FLAG(bool, key_prefix_compression, false,
+          "If true, the part of a key up to its last ':' is stored once per shard in a prefix "
+          "dictionary and shared by all the keys with the same prefix");
+
 namespace dfly {
 
 using namespace std;
 using namespace util;
 using facade::OpStatus;
+using absl::GetFlag;
 
 namespace {
 
 constexpr auto kPrimeSegmentSize = PrimeTable::kSegBytes;
-constexpr auto kExpireSegmentSize = ExpireTable::kSegBytes;
 constexpr auto kTaxSize = PrimeTable::kTaxAmount;
 
-// mi_malloc good size is 32768. i.e. we have malloc waste of 1.5%.
-static_assert(kPrimeSegmentSize == 32288);
+// mi_malloc good size is 32768. i.e. we have malloc waste of 0.3%.
+static_assert(kPrimeSegmentSize == 32680);
 
-// 20480 is the next goodsize so we are loosing ~300 bytes or 1.5%.
-// 24576
-static_assert(kExpireSegmentSize == 23528);
+// The number of the most accessed and of the largest keys that each shard keeps.
+constexpr size_t kTopKeysCapacity = 128;
+
+// The counts of the hot keys are halved after that many samples, so that they reflect the
+// recent accesses rather than the whole uptime.
+constexpr uint64_t kHotKeysDecaySamples = 1 << 16;
+
+// The expire base of the new deadlines is moved forward once it is older than that, which keeps
+// the ttls up to ~11 days in ms precision.
+constexpr time_t kExpireBaseMaxAgeMs = 24 * 3600 * 1000;
+constexpr unsigned kRebaseTraversesPerStep = 100;  // buckets per db and heartbeat.
+
+// Bounds the deletion work of the expiry timer that is not paced by the heartbeat.
+constexpr size_t kMaxSoonExpiry = 1024;
+
+// Bounds the inline freeing of the lazy free queue by a write under memory pressure.
+constexpr unsigned kMaxInlineLazyFreeSteps = 16;
+constexpr size_t kInlineLazyFreeBudget = 1024;
+
+// Returns the stats of the slot of key in cluster mode, null otherwise.
+SlotStats* KeySlotStats(const PrimeKey& key, DbTable* table) {
+  if (table->slot_stats.empty())
+    return nullptr;
+
+  string tmp;
+  return &table->slot_stats[ClusterConfig::KeySlot(key.GetSlice(&tmp))];
+}
 
-void UpdateStatsOnDeletion(PrimeIterator it, DbTableStats* stats) {
+void UpdateStatsOnDeletion(PrimeIterator it, DbTable* table) {
+  DbTableStats* stats = &table->stats;
   size_t value_heap_size = it->second.MallocUsed();
   stats->inline_keys -= it->first.IsInline();
   stats->obj_memory_usage -= (it->first.MallocUsed() + value_heap_size);
   if (it->second.ObjType() == OBJ_STRING)
     stats->strval_memory_usage -= value_heap_size;
+
+  if (SlotStats* slot = KeySlotStats(it->first, table)) {
+    slot->key_count--;
+    slot->memory_bytes -= it->first.MallocUsed() + value_heap_size;
+  }
+}
+
+// Invalidates the client side caches of key, if any.
+void NotifyTracking(const PrimeKey& key) {
+  EngineShard* shard = EngineShard::tlocal();
+  if (!shard || shard->tracking_table().Empty())
+    return;
+
+  string tmp;
+  shard->tracking_table().OnChange(key.GetSlice(&tmp));
+}
+
+// Removes the document of key from the search indices, which cover the database 0.
+void NotifySearch(DbIndex db_ind, const PrimeKey& key) {
+  EngineShard* shard = EngineShard::tlocal();
+  if (db_ind != 0 || !shard || shard->search_indices().Empty())
+    return;
+
+  string tmp;
+  shard->search_indices().OnRemove(key.GetSlice(&tmp));
+}
+
+void NotifyKeyspace(DbIndex db_ind, const PrimeKey& key, KeyspaceEvent event) {
+  if (!KeyspaceEvents::Enabled(event))
+    return;
+
+  string tmp;
+  KeyspaceEvents::Notify(db_ind, key.GetSlice(&tmp), event);
 }
 
-void EvictItemFun(PrimeIterator del_it, DbTable* table) {
+// Keeps DbTable::slot_keys, which are empty when the cluster mode is off.
+void AddSlotKey(string_view key, size_t key_heap_size, DbTable* table) {
+  if (table->slot_keys.empty())
+    return;
+
+  SlotId slot = ClusterConfig::KeySlot(key);
+  table->slot_keys[slot].emplace(key);
+  table->slot_stats[slot].key_count++;
+  table->slot_stats[slot].memory_bytes += key_heap_size;
+}
+
+void RemoveSlotKey(const PrimeKey& key, DbTable* table) {
+  if (table->slot_keys.empty())
+    return;
+
+  string tmp;
+  string_view sv = key.GetSlice(&tmp);
+  table->slot_keys[ClusterConfig::KeySlot(sv)].erase(sv);
+}
+
+void EvictItemFun(DbIndex db_ind, PrimeIterator del_it, DbTable* table, DbSlice* db_slice) {
+  NotifyTracking(del_it->first);
+  NotifySearch(db_ind, del_it->first);
+  NotifyKeyspace(db_ind, del_it->first, KeyspaceEvent::EVICTED);
+  RemoveSlotKey(del_it->first, table);
+  db_slice->RecordDeletion(del_it->first, table);
   if (del_it->second.HasExpire()) {
-    CHECK_EQ(1u, table->expire.Erase(del_it->first));
+    --table->expire_count;
   }
 
-  UpdateStatsOnDeletion(del_it, &table->stats);
+  UpdateStatsOnDeletion(del_it, table);
 
   DVLOG(2) << "Evicted from bucket " << del_it.bucket_id() << " " << del_it->first.ToString();
 
@@ -140,8 +258,7 @@ unsigned PrimeEvictionPolicy::GarbageCollect(const PrimeTable::HotspotBuckets& e
     for (; !bucket_it.is_done(); ++bucket_it) {
       if (bucket_it->second.HasExpire()) {
         ++checked_;
-        auto [prime_it, exp_it] = db_slice_->ExpireIfNeeded(cntx_, bucket_it);
-        if (prime_it.is_done())
+        if (db_slice_->ExpireIfNeeded(cntx_, bucket_it).is_done())
           ++res;
       }
     }
@@ -156,21 +273,45 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
 
   constexpr size_t kNumStashBuckets = ABSL_ARRAYSIZE(eb.probes.by_type.stash_buckets);
 
-  // choose "randomly" a stash bucket to evict an item.
-  auto bucket_it = eb.probes.by_type.stash_buckets[eb.key_hash % kNumStashBuckets];
-  auto last_slot_it = bucket_it;
-  last_slot_it += (PrimeTable::kBucketWidth - 1);
-  if (!last_slot_it.is_done()) {
-    // don't evict sticky items
-    if (last_slot_it->first.IsSticky()) {
-      return 0;
-    }
+  // Choose the best ranked item among the stash buckets, see DbSlice::EvictionRank. Within a
+  // bucket, items are ordered by recency (see BumpUp), hence we scan from the last slot and
+  // prefer it on ties. We start from a "random" stash bucket to spread evictions when the ranks
+  // are equal.
+  PrimeIterator victim;
+  uint64_t victim_rank = UINT64_MAX;
+  unsigned start = eb.key_hash % kNumStashBuckets;
+
+  for (unsigned i = 0; i < kNumStashBuckets && victim_rank > 0; ++i) {
+    auto bucket_it = eb.probes.by_type.stash_buckets[(start + i) % kNumStashBuckets];
+    for (int slot = PrimeTable::kBucketWidth - 1; slot >= 0; --slot) {
+      auto it = me->GetIterator(bucket_it.segment_id(), bucket_it.bucket_id(), slot);
+      if (!it.IsOccupied())
+        continue;
 
-    DbTable* table = db_slice_->GetDBTable(cntx_.db_index);
-    EvictItemFun(last_slot_it, table);
-    ++evicted_;
+      optional<uint64_t> rank = db_slice_->EvictionRank(cntx_.db_index, it);
+      if (rank && *rank < victim_rank) {
+        victim = it;
+        victim_rank = *rank;
+      }
+    }
   }
-  me->ShiftRight(bucket_it);
+
+  if (victim.is_done())
+    return 0;
+
+  if (!db_slice_->AdmitNewKey(eb.key_hash, victim->first))
+    return 0;
+
+  bool is_last_slot = victim.slot_id() == PrimeTable::kBucketWidth - 1;
+  PrimeTable::bucket_iterator victim_bucket{victim};
+
+  DbTable* table = db_slice_->GetDBTable(cntx_.db_index);
+  EvictItemFun(cntx_.db_index, victim, table, db_slice_);
+  ++evicted_;
+
+  // Keeps recency order by placing the new item at the head of the bucket.
+  if (is_last_slot)
+    me->ShiftRight(victim_bucket);
 
   return 1;
 }
@@ -181,7 +322,7 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
 
 DbStats& DbStats::operator+=(const DbStats& o) {
   constexpr size_t kDbSz = sizeof(DbStats);
-  static_assert(kDbSz == 96);
+  static_assert(kDbSz == 136);
 
   DbTableStats::operator+=(o);
 
@@ -189,12 +330,15 @@ DbStats& DbStats::operator+=(const DbStats& o) {
   ADD(expire_count);
   ADD(bucket_count);
   ADD(table_mem_usage);
+  ADD(expired_pending_count);
+  ADD(expired_pending_memory);
+  ADD(expire_wheel_memory);
 
   return *this;
 }
 
 SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
-  static_assert(sizeof(SliceEvents) == 56, "You should update this function with new fields");
+  static_assert(sizeof(SliceEvents) == 96, "You should update this function with new fields");
 
   ADD(evicted_keys);
   ADD(hard_evictions);
@@ -203,18 +347,75 @@ SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
   ADD(stash_unloaded);
   ADD(bumpups);
   ADD(garbage_checked);
+  ADD(admission_hits);
+  ADD(admission_admitted);
+  ADD(admission_rejected);
+  ADD(quota_rejections);
+  ADD(quota_evictions);
 
   return *this;
 }
 
 #undef ADD
 
-DbSlice::DbSlice(uint32_t index, bool caching_mode, EngineShard* owner)
-    : shard_id_(index), caching_mode_(caching_mode), owner_(owner) {
+bool GetFlagEvictionPolicy(EvictionPolicy* policy) {
+  string name = GetFlag(FLAGS_maxmemory_policy);
+  if (name.empty()) {
+    *policy = GetFlag(FLAGS_cache_mode) ? EvictionPolicy::ALLKEYS_LFU : EvictionPolicy::NO_EVICTION;
+    return true;
+  }
+
+  for (EvictionPolicy candidate :
+       {EvictionPolicy::NO_EVICTION, EvictionPolicy::ALLKEYS_LFU, EvictionPolicy::ALLKEYS_LRU,
+        EvictionPolicy::VOLATILE_LFU, EvictionPolicy::VOLATILE_TTL}) {
+    if (absl::EqualsIgnoreCase(name, EvictionPolicyName(candidate))) {
+      *policy = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+string_view EvictionPolicyName(EvictionPolicy policy) {
+  switch (policy) {
+    case EvictionPolicy::NO_EVICTION:
+      return "noeviction";
+    case EvictionPolicy::ALLKEYS_LFU:
+      return "allkeys-lfu";
+    case EvictionPolicy::ALLKEYS_LRU:
+      return "allkeys-lru";
+    case EvictionPolicy::VOLATILE_LFU:
+      return "volatile-lfu";
+    case EvictionPolicy::VOLATILE_TTL:
+      return "volatile-ttl";
+  }
+  return "";
+}
+
+DbSlice::DbSlice(uint32_t index, EvictionPolicy eviction_policy, EngineShard* owner)
+    : shard_id_(index),
+      eviction_policy_(eviction_policy),
+      caching_mode_(eviction_policy != EvictionPolicy::NO_EVICTION),
+      track_loading_writes_(0),
+      owner_(owner),
+      lazy_free_(GetFlag(FLAGS_lazyfree_threshold)) {
+  prefix_compression_ = GetFlag(FLAGS_key_prefix_compression);
+  expire_wheel_ = GetFlag(FLAGS_expire_wheel);
   db_arr_.emplace_back();
   CreateDb(0);
   expire_base_[0] = expire_base_[1] = 0;
   soft_budget_limit_ = (0.1 * max_memory_limit / shard_set->size());
+
+  if (caching_mode_ && GetFlag(FLAGS_cache_admission_filter)) {
+    constexpr uint32_t kSketchWidth = 1 << 16;
+    admission_filter_.reset(new CountMinSketch(kSketchWidth));
+  }
+
+  hotkeys_sample_rate_ = GetFlag(FLAGS_hotkeys_sample_rate);
+  if (hotkeys_sample_rate_ > 0) {
+    hot_keys_.reset(new TopKeys(kTopKeysCapacity));
+    big_keys_.reset(new TopKeys(kTopKeysCapacity));
+  }
 }
 
 DbSlice::~DbSlice() {
@@ -241,10 +442,22 @@ auto DbSlice::GetStats() const -> Stats {
     stats = db_wrap.stats;
     stats.key_count = db_wrap.prime.size();
     stats.bucket_count = db_wrap.prime.bucket_count();
-    stats.expire_count = db_wrap.expire.size();
-    stats.table_mem_usage = (db_wrap.prime.mem_usage() + db_wrap.expire.mem_usage());
+    stats.expire_count = db_wrap.expire_count;
+    stats.table_mem_usage = db_wrap.prime.mem_usage();
+
+    // The memory of the expired keys is estimated from the average of the keys.
+    stats.expired_pending_count = db_wrap.expire_wheel.NumOverdue(GetCurrentTimeMs());
+    if (stats.key_count) {
+      stats.expired_pending_memory = stats.expired_pending_count *
+                                     (stats.obj_memory_usage + stats.table_mem_usage) /
+                                     stats.key_count;
+    }
+    stats.expire_wheel_memory = db_wrap.expire_wheel.MallocUsed();
   }
   s.small_string_bytes = CompactObj::GetStats().small_string_bytes;
+  s.lazyfree_pending = lazy_free_.size();
+  s.lazyfree_pending_memory = lazy_free_.pending_bytes();
+  s.lazyfree_tables = lazy_free_.num_tables();
 
   return s;
 }
@@ -260,7 +473,7 @@ void DbSlice::Reserve(DbIndex db_ind, size_t key_size) {
 
 auto DbSlice::Find(const Context& cntx, string_view key, unsigned req_obj_type) const
     -> OpResult<PrimeIterator> {
-  auto it = FindExt(cntx, key).first;
+  auto it = FindExt(cntx, key);
 
   if (!IsValid(it))
     return OpStatus::KEY_NOTFOUND;
@@ -272,24 +485,87 @@ auto DbSlice::Find(const Context& cntx, string_view key, unsigned req_obj_type)
   return it;
 }
 
-pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(const Context& cntx, string_view key) const {
-  pair<PrimeIterator, ExpireIterator> res;
-
+PrimeIterator DbSlice::FindExt(const Context& cntx, string_view key) const {
   if (!IsDbValid(cntx.db_index))
-    return res;
+    return PrimeIterator{};
 
   auto& db = *db_arr_[cntx.db_index];
-  res.first = db.prime.Find(key);
+  PrimeIterator res = db.prime.Find(key);
+  RecordAccess(key);
 
-  if (!IsValid(res.first)) {
+  if (!IsValid(res)) {
     return res;
   }
 
-  if (res.first->second.HasExpire()) {  // check expiry state
-    res = ExpireIfNeeded(cntx, res.first);
+  OnFound(cntx, &res);
+  return res;
+}
+
+void DbSlice::FindMany(const Context& cntx, ArgSlice keys, FindManyCb cb) const {
+  if (!IsDbValid(cntx.db_index)) {
+    for (unsigned i = 0; i < keys.size(); ++i)
+      cb(i, PrimeIterator{});
+    return;
+  }
+
+  auto& db = *db_arr_[cntx.db_index];
+  constexpr size_t kBatchSize = 32;
+  PrimeIterator found[kBatchSize];
+
+  // The prefetched iterators of a batch may become stale before they are used: expiry and
+  // bump-ups of the earlier keys move or erase entries, cb may delete its entry, and a FaultIn
+  // or a cb that reads an offloaded value suspends the fiber, letting the heartbeat expire keys
+  // or merge segments meanwhile. Hence every prefetched entry is checked against its key and
+  // the key is looked up again if it moved.
+  for (size_t start = 0; start < keys.size(); start += kBatchSize) {
+    size_t batch_size = std::min(kBatchSize, keys.size() - start);
+    db.prime.FindBatch(keys.data() + start, batch_size, found);
+
+    for (size_t i = 0; i < batch_size; ++i) {
+      string_view key = keys[start + i];
+      PrimeIterator res = found[i];
+      if (IsValid(res) && !(res.IsOccupied() && res->first == key)) {
+        res = FindExt(cntx, key);
+      } else {
+        RecordAccess(key);
+        if (IsValid(res))
+          OnFound(cntx, &res);
+      }
+      cb(start + i, res);
+    }
+  }
+}
+
+bool DbSlice::OnFound(const Context& cntx, PrimeIterator* res) const {
+  bool mutated = false;
+  auto& db = *db_arr_[cntx.db_index];
+
+  if ((*res)->second.HasExpire()) {  // check expiry state
+    *res = ExpireIfNeeded(cntx, *res);
+    mutated = !IsValid(*res);
+  }
+
+  if (IsValid(*res) && (*res)->second.ObjType() != OBJ_STRING) {
+    PrimeValue& pv = (*res)->second;
+    pv.SetTouched(true);
+
+    // Offloaded containers are loaded back before any command sees them. The read suspends the
+    // fiber, so the caller can not rely on other iterators it holds.
+    if (pv.IsExternal()) {
+      error_code ec = owner_->tiered_storage()->FaultIn(cntx.db_index, *res);
+      CHECK(!ec) << "TBD: " << ec;
+      mutated = true;
+    }
+    (*res)->second.RecordAccess(false);
+  }
+
+  // The access metadata is kept in the spare bits of the key, see OBJECT FREQ and IDLETIME.
+  if (IsValid(*res)) {
+    (*res)->first.IncrFreq(NextFreqRnd());
+    (*res)->first.SetIdle(0);
   }
 
-  if (caching_mode_ && IsValid(res.first)) {
+  if (caching_mode_ && IsValid(*res)) {
     if (!change_cb_.empty()) {
       auto bump_cb = [&](PrimeTable::bucket_iterator bit) {
         for (const auto& ccb : change_cb_) {
@@ -298,14 +574,16 @@ pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(const Context& cntx, string
       };
 
       //
-      db.prime.CVCUponBump(change_cb_.back().first, res.first, bump_cb);
+      db.prime.CVCUponBump(change_cb_.back().first, *res, bump_cb);
     }
 
-    res.first = db.prime.BumpUp(res.first, PrimeBumpPolicy{});
+    events_.admission_hits += bool(admission_filter_);
+    *res = db.prime.BumpUp(*res, PrimeBumpPolicy{});
     ++events_.bumpups;
+    mutated = true;
   }
 
-  return res;
+  return mutated;
 }
 
 OpResult<pair<PrimeIterator, unsigned>> DbSlice::FindFirst(const Context& cntx, ArgSlice args) {
@@ -325,12 +603,6 @@ OpResult<pair<PrimeIterator, unsigned>> DbSlice::FindFirst(const Context& cntx,
 }
 
 pair<PrimeIterator, bool> DbSlice::AddOrFind(const Context& cntx, string_view key) noexcept(false) {
-  auto res = AddOrFind2(cntx, key);
-  return make_pair(get<0>(res), get<2>(res));
-}
-
-tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cntx,
-                                                               string_view key) noexcept(false) {
   DCHECK(IsDbValid(cntx.db_index));
 
   DbTable& db = *db_arr_[cntx.db_index];
@@ -339,8 +611,8 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
   if (!change_cb_.empty()) {
     auto res = FindExt(cntx, key);
 
-    if (IsValid(res.first)) {
-      return tuple_cat(res, make_tuple(false));
+    if (IsValid(res)) {
+      return make_pair(res, false);
     }
 
     // It's a new entry.
@@ -349,6 +621,27 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
     }
   }
 
+  // The memory that is being freed in the background still counts in the budget. Under memory
+  // pressure it is freed inline before the writes evict or fail.
+  for (unsigned i = 0; i < kMaxInlineLazyFreeSteps && memory_budget_ < ssize_t(key.size()) &&
+                       lazy_free_.size() > 0;
+       ++i) {
+    size_t pending = lazy_free_.pending_bytes();
+    if (!lazy_free_.Step(kInlineLazyFreeBudget))
+      break;
+    memory_budget_ += pending - lazy_free_.pending_bytes();
+  }
+
+  // The volatile policies free the memory before the write and fail it, like noeviction, if
+  // they find nothing to evict.
+  if ((eviction_policy_ == EvictionPolicy::VOLATILE_LFU ||
+       eviction_policy_ == EvictionPolicy::VOLATILE_TTL) &&
+      memory_budget_ < ssize_t(key.size())) {
+    memory_budget_ += EvictSampled(ssize_t(key.size()) - memory_budget_, key, cntx.db_index);
+    if (memory_budget_ < ssize_t(key.size()))
+      throw bad_alloc();
+  }
+
   PrimeEvictionPolicy evp{cntx, bool(caching_mode_), int64_t(memory_budget_ - key.size()),
                           ssize_t(soft_budget_limit_), this};
 
@@ -357,9 +650,24 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
     throw bad_alloc();
   }
 
+  // The same for the quota of the database, see SetMemoryQuota.
+  size_t quota = memory_quota(cntx.db_index);
+  if (!caching_mode_ && quota && DbMemoryUsage(cntx.db_index) + key.size() > quota) {
+    ++events_.quota_rejections;
+    throw bad_alloc();
+  }
+
   // Fast-path if change_cb_ is empty so we Find or Add using
   // the insert operation: twice more efficient.
-  CompactObj co_key{key};
+  CompactObj co_key;
+  if (prefix_compression_) {
+    co_key.SetPrefixedString(key);
+  } else {
+    co_key.SetString(key);
+  }
+  co_key.SetFreq(CompactObj::kFreqInit);
+  RecordAccess(key);
+
   PrimeIterator it;
   bool inserted;
 
@@ -376,7 +684,16 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
   // do not add new segments. For example, we have half full segments
   // and we add new objects or update the existing ones and our memory usage grows.
   if (evp.mem_budget() < 0) {
-    evicted_obj_bytes = EvictObjects(-evp.mem_budget(), it, &db);
+    evicted_obj_bytes = EvictObjects(-evp.mem_budget(), it, cntx.db_index);
+  }
+
+  // In cache mode a database over its quota evicts its own keys, regardless of the others.
+  if (caching_mode_ && quota) {
+    size_t usage = DbMemoryUsage(cntx.db_index);
+    if (usage > quota) {
+      ++events_.quota_evictions;
+      evicted_obj_bytes += EvictObjects(usage - quota, it, cntx.db_index);
+    }
   }
 
   if (inserted) {  // new entry
@@ -390,8 +707,15 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
 
     it.SetVersion(NextVersion());
     memory_budget_ = evp.mem_budget() + evicted_obj_bytes;
+    AddSlotKey(key, it->first.MallocUsed(), &db);
+
+    if (!db.tombstones.empty()) {
+      auto ts_it = db.tombstones.find(key);
+      if (ts_it != db.tombstones.end())
+        ts_it->second.readded = it.GetVersion();
+    }
 
-    return make_tuple(it, ExpireIterator{}, true);
+    return make_pair(it, true);
   }
 
   auto& existing = it;
@@ -400,17 +724,9 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
 
   memory_budget_ += evicted_obj_bytes;
 
-  ExpireIterator expire_it;
   if (existing->second.HasExpire()) {
-    expire_it = db.expire.Find(existing->first);
-    CHECK(IsValid(expire_it));
-
-    // TODO: to implement the incremental update of expiry values using multi-generation
-    // expire_base_ update. Right now we use only index 0.
-    uint64_t delta_ms = cntx.time_now_ms - expire_base_[0];
-
-    if (expire_it->second.duration_ms() <= delta_ms) {
-      db.expire.Erase(expire_it);
+    if (ExpireTime(existing) <= time_t(cntx.time_now_ms)) {
+      --db.expire_count;
 
       if (existing->second.HasFlag()) {
         db.mcflag.Erase(existing->first);
@@ -419,15 +735,18 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
       // Keep the entry but reset the object.
       size_t value_heap_size = existing->second.MallocUsed();
       db.stats.obj_memory_usage -= value_heap_size;
+      if (SlotStats* slot = KeySlotStats(existing->first, &db))
+        slot->memory_bytes -= value_heap_size;
 
       existing->second.Reset();
       events_.expired_keys++;
+      NotifyKeyspace(cntx.db_index, existing->first, KeyspaceEvent::EXPIRED);
 
-      return make_tuple(existing, ExpireIterator{}, true);
+      return make_pair(existing, true);
     }
   }
 
-  return make_tuple(existing, expire_it, false);
+  return make_pair(existing, false);
 }
 
 void DbSlice::ActivateDb(DbIndex db_ind) {
@@ -441,51 +760,55 @@ bool DbSlice::Del(DbIndex db_ind, PrimeIterator it) {
     return false;
   }
 
+  NotifyTracking(it->first);
+  NotifySearch(db_ind, it->first);
+  NotifyKeyspace(db_ind, it->first, KeyspaceEvent::DEL);
+
   auto& db = db_arr_[db_ind];
+  RecordDeletion(it->first, db.get());
+  RemoveSlotKey(it->first, db.get());
   if (it->second.HasExpire()) {
-    CHECK_EQ(1u, db->expire.Erase(it->first));
+    --db->expire_count;
   }
 
   if (it->second.HasFlag()) {
     CHECK_EQ(1u, db->mcflag.Erase(it->first));
   }
 
-  UpdateStatsOnDeletion(it, &db->stats);
+  if (it->second.IsExternal()) {
+    auto [offset, size] = it->second.GetExternalPtr();
+    owner_->tiered_storage()->Free(db_ind, offset, size);
+  }
+
+  UpdateStatsOnDeletion(it, db.get());
+  lazy_free_.TryPush(&it->second);
   db->prime.Erase(it);
 
   return true;
 }
 
 void DbSlice::FlushDb(DbIndex db_ind) {
-  // TODO: to add preeemptiveness by yielding inside clear.
+  // Tracking tables do not know the databases of the keys, so clients drop their whole cache.
+  if (owner_)
+    owner_->tracking_table().OnFlush();
+
+  if (owner_ && (db_ind == 0 || db_ind == kDbAll))
+    owner_->search_indices().OnFlush();
+
+  // Tombstones do not cover flushes, the next snapshot must be a full one.
+  delta_base_version_ = 0;
 
   if (db_ind != kDbAll) {
     auto& db = db_arr_[db_ind];
-    if (db) {
-      InvalidateDbWatches(db_ind);
-    }
-
     auto db_ptr = std::move(db);
     DCHECK(!db);
     CreateDb(db_ind);
     db_arr_[db_ind]->trans_locks.swap(db_ptr->trans_locks);
 
-    auto cb = [db_ptr = std::move(db_ptr)]() mutable {
-      db_ptr.reset();
-      mi_heap_collect(ServerState::tlocal()->data_heap(), true);
-    };
-
-    boost::fibers::fiber(std::move(cb)).detach();
-
+    lazy_free_.Push(std::move(db_ptr));
     return;
   }
 
-  for (size_t i = 0; i < db_arr_.size(); i++) {
-    if (db_arr_[i]) {
-      InvalidateDbWatches(i);
-    }
-  }
-
   auto all_dbs = std::move(db_arr_);
   db_arr_.resize(all_dbs.size());
   for (size_t i = 0; i < db_arr_.size(); ++i) {
@@ -495,27 +818,85 @@ void DbSlice::FlushDb(DbIndex db_ind) {
     }
   }
 
-  boost::fibers::fiber([all_dbs = std::move(all_dbs)]() mutable {
-    for (auto& db : all_dbs) {
-      db.reset();
+  for (auto& db : all_dbs) {
+    if (db)
+      lazy_free_.Push(std::move(db));
+  }
+}
+
+void DbSlice::FlushSlots(DbIndex db_ind, const vector<SlotId>& slots) {
+  if (!IsDbValid(db_ind))
+    return;
+
+  DbTable* db = db_arr_[db_ind].get();
+  if (db->slot_keys.empty())
+    return;
+
+  for (SlotId slot : slots) {
+    // Del erases from the set we iterate.
+    auto keys = std::move(db->slot_keys[slot]);
+    for (const string& key : keys) {
+      PrimeIterator it = db->prime.Find(key);
+      if (IsValid(it))
+        Del(db_ind, it);
     }
-  }).detach();
+  }
+}
+
+vector<string> DbSlice::GetSlotKeys(DbIndex db_ind, SlotId slot, size_t limit) const {
+  vector<string> res;
+  if (!IsDbValid(db_ind) || db_arr_[db_ind]->slot_keys.empty())
+    return res;
+
+  for (const string& key : db_arr_[db_ind]->slot_keys[slot]) {
+    if (res.size() >= limit)
+      break;
+    res.push_back(key);
+  }
+  return res;
+}
+
+size_t DbSlice::SlotSize(DbIndex db_ind, SlotId slot) const {
+  if (!IsDbValid(db_ind) || db_arr_[db_ind]->slot_stats.empty())
+    return 0;
+  return db_arr_[db_ind]->slot_stats[slot].key_count;
+}
+
+void DbSlice::MergeSlotStats(DbIndex db_ind, vector<SlotStats>* dest) const {
+  if (!IsDbValid(db_ind))
+    return;
+
+  const auto& slot_stats = db_arr_[db_ind]->slot_stats;
+  if (slot_stats.empty())
+    return;
+
+  dest->resize(slot_stats.size());
+  for (size_t i = 0; i < slot_stats.size(); ++i)
+    (*dest)[i] += slot_stats[i];
+}
+
+void DbSlice::AccountSlotMemory(DbIndex db_ind, const PrimeKey& key, ssize_t delta) {
+  if (SlotStats* slot = KeySlotStats(key, db_arr_[db_ind].get()))
+    slot->memory_bytes += delta;
 }
 
 // Returns true if a state has changed, false otherwise.
 bool DbSlice::UpdateExpire(DbIndex db_ind, PrimeIterator it, uint64_t at) {
   auto& db = *db_arr_[db_ind];
   if (at == 0 && it->second.HasExpire()) {
-    CHECK_EQ(1u, db.expire.Erase(it->first));
+    OnChangeInPlace(db_ind, it);
+    --db.expire_count;
     it->second.SetExpire(false);
 
     return true;
   }
 
   if (!it->second.HasExpire() && at) {
-    uint64_t delta = at - expire_base_[0];  // TODO: employ multigen expire updates.
-    CHECK(db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta)).second);
+    OnChangeInPlace(db_ind, it);
+    ++db.expire_count;
+    it->second.set_expire_period(FromAbsoluteTime(at));
     it->second.SetExpire(true);
+    ScheduleExpiry(db_ind, it->first, at);
 
     return true;
   }
@@ -540,6 +921,25 @@ uint32_t DbSlice::GetMCFlag(DbIndex db_ind, const PrimeKey& key) const {
   return it.is_done() ? 0 : it->second;
 }
 
+void DbSlice::SetMCState(DbIndex db_ind, string_view key, uint8_t state) {
+  auto& mc_state = db_arr_[db_ind]->mc_state;
+  if (state == 0) {
+    if (!mc_state.empty())
+      mc_state.erase(key);
+  } else {
+    mc_state[key] = state;
+  }
+}
+
+uint8_t DbSlice::GetMCState(DbIndex db_ind, string_view key) const {
+  const auto& mc_state = db_arr_[db_ind]->mc_state;
+  if (mc_state.empty())
+    return 0;
+
+  auto it = mc_state.find(key);
+  return it == mc_state.end() ? 0 : it->second;
+}
+
 PrimeIterator DbSlice::AddNew(const Context& cntx, string_view key, PrimeValue obj,
                               uint64_t expire_at_ms) noexcept(false) {
   auto [it, added] = AddOrSkip(cntx, key, std::move(obj), expire_at_ms);
@@ -548,8 +948,18 @@ PrimeIterator DbSlice::AddNew(const Context& cntx, string_view key, PrimeValue o
   return it;
 }
 
+void DbSlice::SetExpireTime(DbIndex db_ind, PrimeIterator it, uint64_t at_ms) {
+  DCHECK(it->second.HasExpire());
+
+  // The wheel entry of a later deadline is rescheduled when it comes, an earlier one needs
+  // a new entry.
+  if (time_t(at_ms) < ExpireTime(it))
+    ScheduleExpiry(db_ind, it->first, at_ms);
+  it->second.set_expire_period(FromAbsoluteTime(at_ms));
+}
+
 OpStatus DbSlice::UpdateExpire(const Context& cntx, PrimeIterator prime_it,
-                               ExpireIterator expire_it, const ExpireParams& params) {
+                               const ExpireParams& params) {
   DCHECK(params.IsDefined());
   DCHECK(IsValid(prime_it));
 
@@ -562,8 +972,9 @@ OpStatus DbSlice::UpdateExpire(const Context& cntx, PrimeIterator prime_it,
 
   if (rel_msec <= 0 && !params.persist) {
     CHECK(Del(cntx.db_index, prime_it));
-  } else if (IsValid(expire_it)) {
-    expire_it->second = FromAbsoluteTime(now_msec + rel_msec);
+  } else if (prime_it->second.HasExpire()) {
+    OnChangeInPlace(cntx.db_index, prime_it);
+    SetExpireTime(cntx.db_index, prime_it, now_msec + rel_msec);
   } else {
     UpdateExpire(cntx.db_index, prime_it, params.persist ? 0 : rel_msec + now_msec);
   }
@@ -584,16 +995,21 @@ std::pair<PrimeIterator, bool> DbSlice::AddOrUpdateInternal(const Context& cntx,
   auto& db = *db_arr_[cntx.db_index];
   auto& it = res.first;
 
+  // The deadline of the entry is set by expire_at_ms only.
+  uint64_t prev_expire_ms = ExpireTime(it);
+  db.expire_count -= bool(prev_expire_ms);
   it->second = std::move(obj);
+  it->second.SetExpire(false);
   PostUpdate(cntx.db_index, it, key, false);
 
   if (expire_at_ms) {
     it->second.SetExpire(true);
-    uint64_t delta = expire_at_ms - expire_base_[0];
-    auto [eit, inserted] = db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta));
-    CHECK(inserted || force_update);
-    if (!inserted) {
-      eit->second = ExpirePeriod(delta);
+    it->second.set_expire_period(FromAbsoluteTime(expire_at_ms));
+    ++db.expire_count;
+
+    // The wheel entry of a later deadline is rescheduled when it comes.
+    if (prev_expire_ms == 0 || expire_at_ms < prev_expire_ms) {
+      ScheduleExpiry(cntx.db_index, it->first, expire_at_ms);
     }
   }
 
@@ -627,16 +1043,13 @@ bool DbSlice::Acquire(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
   bool lock_acquired = true;
 
   if (lock_args.args.size() == 1) {
-    lock_acquired = lt[lock_args.args.front()].Acquire(mode);
+    lock_acquired = lt[LockFingerprint(lock_args.args.front())].Acquire(mode);
   } else {
-    uniq_keys_.clear();
+    FillUniqueKeys(lock_args);
 
-    for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-      auto s = lock_args.args[i];
-      if (uniq_keys_.insert(s).second) {
-        bool res = lt[s].Acquire(mode);
-        lock_acquired &= res;
-      }
+    for (const auto& fp_key : uniq_keys_) {
+      bool res = lt[fp_key.first].Acquire(mode);
+      lock_acquired &= res;
     }
   }
 
@@ -654,28 +1067,38 @@ void DbSlice::Release(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
     Release(mode, lock_args.db_index, lock_args.args.front(), 1);
   } else {
     auto& lt = db_arr_[lock_args.db_index]->trans_locks;
-    uniq_keys_.clear();
-    for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-      auto s = lock_args.args[i];
-      if (uniq_keys_.insert(s).second) {
-        auto it = lt.find(s);
-        CHECK(it != lt.end());
-        it->second.Release(mode);
-        if (it->second.IsFree()) {
-          lt.erase(it);
-        }
+    FillUniqueKeys(lock_args);
+
+    for (const auto& fp_key : uniq_keys_) {
+      auto it = lt.find(fp_key.first);
+      CHECK(it != lt.end());
+      it->second.Release(mode);
+      if (it->second.IsFree()) {
+        lt.erase(it);
       }
     }
   }
 }
 
+void DbSlice::FillUniqueKeys(const KeyLockArgs& lock_args) {
+  uniq_keys_.clear();
+  for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
+    string_view key = lock_args.args[i];
+    uniq_keys_.emplace_back(LockFingerprint(key), key);
+  }
+
+  // Keys are deduplicated by their value, so that the keys with colliding fingerprints
+  // are locked as many times as they are released, for example by UnlockMulti.
+  sort(uniq_keys_.begin(), uniq_keys_.end());
+  uniq_keys_.erase(unique(uniq_keys_.begin(), uniq_keys_.end()), uniq_keys_.end());
+}
+
 bool DbSlice::CheckLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) const {
   DCHECK(!lock_args.args.empty());
 
   const auto& lt = db_arr_[lock_args.db_index]->trans_locks;
   for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-    auto s = lock_args.args[i];
-    auto it = lt.find(s);
+    auto it = lt.find(LockFingerprint(lock_args.args[i]));
     if (it != lt.end() && !it->second.Check(mode)) {
       return false;
     }
@@ -683,6 +1106,66 @@ bool DbSlice::CheckLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) con
   return true;
 }
 
+bool DbSlice::CheckLockGranted(IntentLock::Mode mode, const KeyLockArgs& lock_args) const {
+  DCHECK(!lock_args.args.empty());
+
+  const auto& lt = db_arr_[lock_args.db_index]->trans_locks;
+  for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
+    auto it = lt.find(LockFingerprint(lock_args.args[i]));
+    DCHECK(it != lt.end());
+    if (it == lt.end() || !it->second.IsGranted(mode)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DbSlice::PinKey(DbIndex db_ind, string_view key) {
+  auto& db = *db_arr_[db_ind];
+  ++db.pinned_keys[key];
+  db.trans_locks[LockFingerprint(key)].Acquire(IntentLock::SHARED);
+}
+
+void DbSlice::UnpinKey(DbIndex db_ind, string_view key) {
+  // The table could have been replaced by FlushDb in the meantime, then there is nothing to do.
+  if (!IsDbValid(db_ind))
+    return;
+
+  auto& pinned = db_arr_[db_ind]->pinned_keys;
+  auto it = pinned.find(key);
+  if (it == pinned.end())
+    return;
+
+  if (--it->second == 0)
+    pinned.erase(it);
+  db_arr_[db_ind]->Release(IntentLock::SHARED, key, 1);
+}
+
+bool DbSlice::IsPinned(DbIndex db_ind, string_view key) const {
+  if (!IsDbValid(db_ind))
+    return false;
+
+  const auto& pinned = db_arr_[db_ind]->pinned_keys;
+  return !pinned.empty() && pinned.contains(key);
+}
+
+bool DbSlice::IsPinned(DbIndex db_ind, const PrimeKey& key) const {
+  const auto& pinned = db_arr_[db_ind]->pinned_keys;
+  if (pinned.empty())
+    return false;
+
+  string tmp;
+  return pinned.contains(key.GetSlice(&tmp));
+}
+
+bool DbSlice::HasPinnedKeys() const {
+  for (const auto& db : db_arr_) {
+    if (db && !db->pinned_keys.empty())
+      return true;
+  }
+  return false;
+}
+
 void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
   for (const auto& ccb : change_cb_) {
     ccb.second(db_ind, ChangeReq{it});
@@ -691,6 +1174,13 @@ void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
   auto* stats = MutableStats(db_ind);
   stats->obj_memory_usage -= value_heap_size;
   stats->update_value_amount -= value_heap_size;
+  AccountSlotMemory(db_ind, it->first, -ssize_t(value_heap_size));
+
+  // Cancels offloading of a container whose write is in flight, see TieredStorage.
+  if (it->second.HasIoPending() && it->second.ObjType() != OBJ_STRING) {
+    it->second.SetIoPending(false);
+  }
+  it->second.RecordAccess(true);
 
   if (it->second.ObjType() == OBJ_STRING) {
     stats->strval_memory_usage -= value_heap_size;
@@ -710,45 +1200,50 @@ void DbSlice::PostUpdate(DbIndex db_ind, PrimeIterator it, std::string_view key,
 
   size_t value_heap_size = it->second.MallocUsed();
   stats->obj_memory_usage += value_heap_size;
+  AccountSlotMemory(db_ind, it->first, value_heap_size);
   if (it->second.ObjType() == OBJ_STRING)
     stats->strval_memory_usage += value_heap_size;
   if (existing)
     stats->update_value_amount += value_heap_size;
 
-  auto& watched_keys = db_arr_[db_ind]->watched_keys;
-  if (!watched_keys.empty()) {
-    // Check if the key is watched.
-    if (auto wit = watched_keys.find(key); wit != watched_keys.end()) {
-      for (auto conn_ptr : wit->second) {
-        conn_ptr->watched_dirty.store(true, memory_order_relaxed);
-      }
-      // No connections need to watch it anymore.
-      watched_keys.erase(wit);
-    }
-  }
+  // The values that shrink are refreshed by GetBigKeys.
+  if (big_keys_ && value_heap_size > big_keys_->threshold())
+    big_keys_->Offer(key, value_heap_size);
+
+  if (owner_ && !owner_->tracking_table().Empty())
+    owner_->tracking_table().OnChange(key);
+
+  if (owner_ && db_ind == 0 && !owner_->search_indices().Empty())
+    owner_->search_indices().OnUpdate(key, it->second);
+
+  // A new value is neither stale nor being recached.
+  auto& mc_state = db_arr_[db_ind]->mc_state;
+  if (!mc_state.empty())
+    mc_state.erase(key);
 }
 
-pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(const Context& cntx,
-                                                            PrimeIterator it) const {
+PrimeIterator DbSlice::ExpireIfNeeded(const Context& cntx, PrimeIterator it) const {
   DCHECK(it->second.HasExpire());
   auto& db = db_arr_[cntx.db_index];
 
-  auto expire_it = db->expire.Find(it->first);
+  if (time_t(cntx.time_now_ms) < ExpireTime(it))
+    return it;
 
-  CHECK(IsValid(expire_it));
+  // The value is still referenced by a pending reply, it will be expired after it's unpinned.
+  if (IsPinned(cntx.db_index, it->first))
+    return it;
 
-  // TODO: to employ multi-generation update of expire-base and the underlying values.
-  time_t expire_time = ExpireTime(expire_it);
-
-  if (time_t(cntx.time_now_ms) < expire_time)
-    return make_pair(it, expire_it);
-
-  db->expire.Erase(expire_it);
-  UpdateStatsOnDeletion(it, &db->stats);
+  NotifyTracking(it->first);
+  NotifySearch(cntx.db_index, it->first);
+  NotifyKeyspace(cntx.db_index, it->first, KeyspaceEvent::EXPIRED);
+  RemoveSlotKey(it->first, db.get());
+  --db->expire_count;
+  UpdateStatsOnDeletion(it, db.get());
+  lazy_free_.TryPush(&it->second);
   db->prime.Erase(it);
   ++events_.expired_keys;
 
-  return make_pair(PrimeIterator{}, ExpireIterator{});
+  return PrimeIterator{};
 }
 
 void DbSlice::ExpireAllIfNeeded() {
@@ -757,22 +1252,100 @@ void DbSlice::ExpireAllIfNeeded() {
       continue;
     auto& db = *db_arr_[db_index];
 
-    auto cb = [&](ExpireTable::iterator exp_it) {
-      auto prime_it = db.prime.Find(exp_it->first);
-      if (!IsValid(prime_it)) {
-        LOG(ERROR) << "Expire entry " << exp_it->first.ToString() << " not found in prime table";
-        return;
-      }
-      ExpireIfNeeded(DbSlice::Context{db_index, GetCurrentTimeMs()}, prime_it);
+    // The traversal is not affected by the deletions of the entries it visits.
+    auto cb = [&](PrimeIterator it) {
+      if (it->second.HasExpire())
+        ExpireIfNeeded(DbSlice::Context{db_index, GetCurrentTimeMs()}, it);
     };
 
-    ExpireTable::Cursor cursor;
+    PrimeTable::Cursor cursor;
     do {
-      cursor = db.expire.Traverse(cursor, cb);
+      cursor = db.prime.Traverse(cursor, cb);
     } while (cursor);
   }
 }
 
+void DbSlice::SetDeltaBase(uint64_t version) {
+  delta_base_version_ = version;
+
+  for (auto& db : db_arr_) {
+    if (!db)
+      continue;
+
+    // Keys deleted before the snapshot are absent from it, the next delta does not need them.
+    auto& tombstones = db->tombstones;
+    for (auto it = tombstones.begin(); it != tombstones.end();) {
+      if (it->second.deleted < version) {
+        tombstones.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void DbSlice::RecordDeletion(const PrimeKey& key, DbTable* table) {
+  if (delta_base_version_ == 0)
+    return;
+
+  table->tombstones[key.ToString()] = DbTable::Tombstone{.deleted = NextVersion()};
+}
+
+void DbSlice::SetMemoryQuota(DbIndex db_ind, size_t bytes) {
+  if (memory_quota_.size() <= db_ind)
+    memory_quota_.resize(db_ind + 1);
+  memory_quota_[db_ind] = bytes;
+}
+
+size_t DbSlice::DbMemoryUsage(DbIndex db_ind) const {
+  if (!IsDbValid(db_ind))
+    return 0;
+
+  const DbTable& db = *db_arr_[db_ind];
+  return db.stats.obj_memory_usage + db.prime.mem_usage();
+}
+
+void DbSlice::TrackLoadingWrites(bool enable) {
+  track_loading_writes_ = enable;
+  if (enable)
+    return;
+
+  for (auto& db : db_arr_) {
+    if (db)
+      db->loading_writes = {};
+  }
+}
+
+void DbSlice::RecordLoadingWrite(DbIndex db_ind, string_view key) {
+  DCHECK(track_loading_writes_);
+  ActivateDb(db_ind);
+  db_arr_[db_ind]->loading_writes.emplace(key);
+}
+
+bool DbSlice::WrittenWhileLoading(DbIndex db_ind, string_view key) const {
+  if (!track_loading_writes_ || !IsDbValid(db_ind))
+    return false;
+
+  const auto& writes = db_arr_[db_ind]->loading_writes;
+  return !writes.empty() && writes.contains(key);
+}
+
+size_t DbSlice::loading_writes() const {
+  size_t res = 0;
+  for (const auto& db : db_arr_) {
+    if (db)
+      res += db->loading_writes.size();
+  }
+  return res;
+}
+
+void DbSlice::OnChangeInPlace(DbIndex db_ind, PrimeIterator it) {
+  for (const auto& ccb : change_cb_) {
+    ccb.second(db_ind, ChangeReq{it});
+  }
+  it.SetVersion(NextVersion());
+}
+
 uint64_t DbSlice::RegisterOnChange(ChangeCallback cb) {
   uint64_t ver = NextVersion();
   change_cb_.emplace_back(ver, std::move(cb));
@@ -794,14 +1367,15 @@ auto DbSlice::DeleteExpiredStep(const Context& cntx, unsigned count) -> DeleteEx
   auto& db = *db_arr_[cntx.db_index];
   DeleteExpiredStats result;
 
-  auto cb = [&](ExpireIterator it) {
+  auto cb = [&](PrimeIterator it) {
+    if (!it->second.HasExpire())
+      return;
+
     result.traversed++;
     time_t ttl = ExpireTime(it) - cntx.time_now_ms;
     if (ttl <= 0) {
-      auto prime_it = db.prime.Find(it->first);
-      CHECK(!prime_it.is_done());
-      ExpireIfNeeded(cntx, prime_it);
-      ++result.deleted;
+      if (ExpireIfNeeded(cntx, it).is_done())
+        ++result.deleted;
     } else {
       result.survivor_ttl_sum += ttl;
     }
@@ -809,35 +1383,439 @@ auto DbSlice::DeleteExpiredStep(const Context& cntx, unsigned count) -> DeleteEx
 
   unsigned i = 0;
   for (; i < count / 3; ++i) {
-    db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+    db.expire_cursor = db.prime.Traverse(db.expire_cursor, cb);
   }
 
   // continue traversing only if we had strong deletion rate based on the first sample.
   if (result.deleted * 4 > result.traversed) {
     for (; i < count; ++i) {
-      db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+      db.expire_cursor = db.prime.Traverse(db.expire_cursor, cb);
     }
   }
 
   return result;
 }
 
+uint64_t DbSlice::ExpireByHash(const Context& cntx, uint64_t hash, DeleteExpiredStats* stats) {
+  auto& db = *db_arr_[cntx.db_index];
+  PrimeIterator it =
+      db.prime.FindByHash(hash, [hash](const PrimeKey& key) { return key.HashCode() == hash; });
+  if (!IsValid(it) || !it->second.HasExpire())
+    return 0;  // deleted or persisted.
+
+  stats->traversed++;
+  uint64_t deadline = ExpireTime(it);
+  if (deadline > cntx.time_now_ms) {
+    stats->survivor_ttl_sum += deadline - cntx.time_now_ms;
+    return deadline;
+  }
+
+  if (ExpireIfNeeded(cntx, it).is_done()) {
+    ++stats->deleted;
+    return 0;
+  }
+  return deadline;  // pinned, retried later.
+}
+
+auto DbSlice::ExpireWheelStep(const Context& cntx, unsigned max_entries) -> DeleteExpiredStats {
+  DeleteExpiredStats result;
+
+  // Returns the deadline of the keys that are kept, 0 for the others.
+  auto process = [&](uint64_t hash) { return ExpireByHash(cntx, hash, &result); };
+
+  db_arr_[cntx.db_index]->expire_wheel.Advance(cntx.time_now_ms, max_entries, process);
+  return result;
+}
+
+void DbSlice::ScheduleExpiry(DbIndex db_ind, const PrimeKey& key, uint64_t at_ms) {
+  if (!expire_wheel_)
+    return;
+
+  uint64_t hash = key.HashCode();
+  db_arr_[db_ind]->expire_wheel.Add(hash, at_ms);
+
+  // When the queue is full, the key is deleted by the wheel.
+  if (at_ms < soon_expiry_horizon_ms_ && soon_expiry_.size() < kMaxSoonExpiry) {
+    bool earliest = soon_expiry_.empty() || at_ms < soon_expiry_.top().deadline_ms;
+    soon_expiry_.push(SoonExpiry{at_ms, hash, db_ind});
+    if (earliest)
+      soon_expiry_ec_.notify();
+  }
+}
+
+auto DbSlice::SoonExpiryStep(uint64_t now_ms, unsigned max_entries) -> DeleteExpiredStats {
+  DeleteExpiredStats result;
+  for (unsigned i = 0; i < max_entries && !soon_expiry_.empty(); ++i) {
+    SoonExpiry entry = soon_expiry_.top();
+    if (entry.deadline_ms > now_ms)
+      break;
+    soon_expiry_.pop();
+
+    // The entries of the keys that were extended or pinned meanwhile are dropped, the wheel
+    // still has them.
+    if (IsDbValid(entry.db_index))
+      ExpireByHash(Context{entry.db_index, now_ms}, entry.hash, &result);
+  }
+  return result;
+}
+
+void DbSlice::RebaseExpireStep(uint64_t now_ms) {
+  unsigned prev_gen = expire_gen_ ^ 1;
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (pv.HasExpire() && pv.expire_period().generation_id() == prev_gen)
+      pv.set_expire_period(FromAbsoluteTime(ExpireTime(pv.expire_period())));
+  };
+
+  bool pending = false;
+  for (auto& db : db_arr_) {
+    if (!db || !db->expire_rebase_pending)
+      continue;
+
+    for (unsigned i = 0; i < kRebaseTraversesPerStep; ++i) {
+      db->expire_rebase_cursor = db->prime.Traverse(db->expire_rebase_cursor, cb);
+      if (!db->expire_rebase_cursor) {
+        db->expire_rebase_pending = false;
+        break;
+      }
+    }
+    pending |= db->expire_rebase_pending;
+  }
+
+  // The base of the previous generation can only be reused once none of the entries refer to it.
+  if (pending || time_t(now_ms) < expire_base_[expire_gen_] + kExpireBaseMaxAgeMs)
+    return;
+
+  expire_gen_ = prev_gen;
+  expire_base_[expire_gen_] = now_ms;
+  for (auto& db : db_arr_) {
+    if (db && db->expire_count > 0) {
+      db->expire_rebase_pending = true;
+      db->expire_rebase_cursor = PrimeTable::Cursor{};
+    }
+  }
+}
+
 // TODO: Design a better background evicting heuristic.
 void DbSlice::FreeMemWithEvictionStep(DbIndex db_ind, size_t increase_goal_bytes) {
   if (!caching_mode_)
     return;
 }
 
+void DbSlice::RecordAccess(string_view key) const {
+  if (admission_filter_)
+    admission_filter_->Increment(CompactObj::HashCode(key));
+
+  if (hot_keys_ && --hot_keys_countdown_ == 0) {
+    // A random interval with the mean of the sample rate, so that the samples do not follow
+    // the patterns of the accesses, e.g. the same position of an MGET.
+    hot_keys_countdown_ = 1 + NextFreqRnd() % (2 * hotkeys_sample_rate_ - 1);
+    hot_keys_->Increment(key);
+    if (++hot_keys_samples_ % kHotKeysDecaySamples == 0)
+      hot_keys_->Decay();
+  }
+}
+
+vector<TopKeys::Entry> DbSlice::GetHotKeys(size_t n) const {
+  if (!hot_keys_)
+    return {};
+
+  vector<TopKeys::Entry> res = hot_keys_->Top(n);
+  for (auto& e : res) {
+    e.count *= hotkeys_sample_rate_;
+    e.error *= hotkeys_sample_rate_;
+  }
+  return res;
+}
+
+vector<TopKeys::Entry> DbSlice::GetBigKeys(size_t n) {
+  if (!big_keys_)
+    return {};
+
+  // The keys are tracked by name only, so a key is as large as the largest of its namesakes.
+  for (const auto& e : big_keys_->Top(kTopKeysCapacity)) {
+    bool found = false;
+    size_t size = 0;
+    for (const auto& db : db_arr_) {
+      if (!db)
+        continue;
+      PrimeIterator it = db->prime.Find(e.key);
+      if (IsValid(it)) {
+        found = true;
+        size = max(size, it->second.MallocUsed());
+      }
+    }
+
+    if (found) {
+      big_keys_->Offer(e.key, size);
+    } else {
+      big_keys_->Erase(e.key);
+    }
+  }
+  return big_keys_->Top(n);
+}
+
+bool DbSlice::AdmitNewKey(uint64_t key_hash, const PrimeKey& victim) const {
+  if (!admission_filter_)
+    return true;
+
+  unsigned candidate_freq = admission_filter_->Estimate(key_hash);
+  unsigned victim_freq = admission_filter_->Estimate(victim.HashCode());
+
+  // On ties we still admit a small random portion of newcomers, otherwise a full cache would
+  // never adapt to a new working set that arrives all at once.
+  bool admit = candidate_freq > victim_freq ||
+               (candidate_freq == victim_freq && (NextFreqRnd() & 63) == 0);
+  if (admit) {
+    ++events_.admission_admitted;
+  } else {
+    ++events_.admission_rejected;
+  }
+  return admit;
+}
+
+optional<uint64_t> DbSlice::EvictionRank(DbIndex db_ind, PrimeIterator it) const {
+  if (it->first.IsSticky() || IsPinned(db_ind, it->first))
+    return nullopt;
+
+  bool has_expire = it->second.HasExpire();
+  switch (eviction_policy_) {
+    case EvictionPolicy::NO_EVICTION:
+      return nullopt;
+    case EvictionPolicy::ALLKEYS_LFU:
+      return it->first.GetFreq();
+    case EvictionPolicy::ALLKEYS_LRU:
+      return 0;  // the callers scan the least recently used slots first.
+    case EvictionPolicy::VOLATILE_LFU:
+      return has_expire ? optional<uint64_t>(it->first.GetFreq()) : nullopt;
+    case EvictionPolicy::VOLATILE_TTL:
+      return has_expire ? optional<uint64_t>(ExpireTime(it)) : nullopt;
+  }
+  return nullopt;
+}
+
+uint64_t DbSlice::IdleSeconds(unsigned idle) {
+  return idle == 0 ? 0 : 60ULL << (2 * (idle - 1));
+}
+
+void DbSlice::DecayFreqStep(DbIndex db_ind) {
+  // Roughly 100 keys per heartbeat, so that the counters of a large table are aged
+  // every few minutes.
+  constexpr unsigned kBucketsPerStep = 8;
+
+  auto& db = *db_arr_[db_ind];
+  if (!db.freq_decay_cursor) {
+    uint64_t now_ms = GetCurrentTimeMs();
+    if (db.freq_pass_start_ms)
+      db.freq_pass_ms = now_ms - db.freq_pass_start_ms;
+    db.freq_pass_start_ms = now_ms;
+  }
+
+  // A key is visited once per pass, so it advances to the next idle level with probability
+  // pass duration / level duration. This way, the levels follow the wall clock whatever
+  // the size of the table is.
+  auto cb = [&](PrimeIterator it) {
+    const PrimeKey& key = it->first;
+    key.DecayFreq();
+
+    unsigned idle = key.GetIdle();
+    if (idle == CompactObj::kIdleMax || db.freq_pass_ms == 0)
+      return;
+    uint64_t level_ms = (IdleSeconds(idle + 1) - IdleSeconds(idle)) * 1000;
+    if (uint64_t(NextFreqRnd()) * level_ms < (db.freq_pass_ms << 32))
+      key.SetIdle(idle + 1);
+  };
+  for (unsigned i = 0; i < kBucketsPerStep; ++i) {
+    db.freq_decay_cursor = db.prime.Traverse(db.freq_decay_cursor, cb);
+    if (!db.freq_decay_cursor)
+      break;
+  }
+}
+
+size_t DbSlice::ExpireMembersStep(const Context& cntx) {
+  // Similarly to DecayFreqStep, roughly 100 keys per heartbeat. Large containers are
+  // processed over multiple passes.
+  constexpr unsigned kBucketsPerStep = 8;
+  constexpr unsigned kMemberBucketsPerKey = 128;
+
+  auto& db = *db_arr_[cntx.db_index];
+  uint32_t now_sec = MemberTimeSeconds(cntx.time_now_ms);
+  size_t deleted = 0;
+  vector<string> emptied;
+
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (pv.Encoding() != kEncodingStrMap2)
+      return;
+
+    DenseSet* ds = nullptr;
+    if (pv.ObjType() == OBJ_SET) {
+      ds = (StringSet*)pv.RObjPtr();
+    } else if (pv.ObjType() == OBJ_HASH) {
+      ds = (StringMap*)pv.RObjPtr();
+    }
+
+    if (!ds || ds->NumTtlEntries() == 0)
+      return;
+
+    size_t prev_used = pv.MallocUsed();
+    ds->set_time(now_sec);
+    unsigned num_expired = ds->ExpireStep(kMemberBucketsPerKey);
+    if (num_expired == 0)
+      return;
+
+    deleted += num_expired;
+    db.stats.obj_memory_usage -= prev_used - pv.MallocUsed();
+    if (SlotStats* slot = KeySlotStats(it->first, &db))
+      slot->memory_bytes -= prev_used - pv.MallocUsed();
+
+    // Deleting from the table while traversing it is not safe.
+    if (ds->Empty())
+      emptied.push_back(it->first.ToString());
+  };
+
+  for (unsigned i = 0; i < kBucketsPerStep; ++i) {
+    db.member_expire_cursor = db.prime.Traverse(db.member_expire_cursor, cb);
+    if (!db.member_expire_cursor)
+      break;
+  }
+
+  for (const string& key : emptied) {
+    Del(cntx.db_index, db.prime.Find(key));
+  }
+
+  return deleted;
+}
+
+size_t DbSlice::TrimTimeSeriesStep(DbIndex db_ind) {
+  constexpr unsigned kBucketsPerStep = 8;
+
+  if (!change_cb_.empty())
+    return 0;
+
+  auto& db = *db_arr_[db_ind];
+  size_t trimmed = 0;
+  string tmp;
+
+  auto cb = [&](PrimeIterator it) {
+    TimeSeries* ts = it->second.GetTimeSeries();
+    if (!ts || ts->retention_ms() == 0)
+      return;
+
+    string_view key_arr[1] = {it->first.GetSlice(&tmp)};
+    if (!CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{db_ind, key_arr, 1}))
+      return;
+
+    size_t prev_used = it->second.MallocUsed();
+    size_t num_trimmed = ts->Trim();
+    if (num_trimmed == 0)
+      return;
+
+    trimmed += num_trimmed;
+    db.stats.obj_memory_usage -= prev_used - it->second.MallocUsed();
+    if (SlotStats* slot = KeySlotStats(it->first, &db))
+      slot->memory_bytes -= prev_used - it->second.MallocUsed();
+  };
+
+  for (unsigned i = 0; i < kBucketsPerStep; ++i) {
+    db.ts_trim_cursor = db.prime.Traverse(db.ts_trim_cursor, cb);
+    if (!db.ts_trim_cursor)
+      break;
+  }
+
+  return trimmed;
+}
+
+void DbSlice::ShrinkTablesStep(DbIndex db_ind) {
+  // Merging segments moves entries across buckets which would break the version
+  // guarantees snapshotting relies on, and invalidates the iterators of suspended callbacks.
+  if (!change_cb_.empty() || running_cbs_ > 0)
+    return;
+
+  // We shrink only tables that are mostly empty, and merge segments only if the result
+  // is at most half full, so that we won't need to split them again right away.
+  constexpr double kShrinkLoadFactor = 0.25;
+  constexpr double kMergedFill = 0.5;
+  constexpr unsigned kStepsPerCall = 8;
+
+  auto& db = *db_arr_[db_ind];
+  auto shrink = [&](auto& table, size_t* cursor) {
+    if (table.unique_segments() < 2 || table.load_factor() > kShrinkLoadFactor)
+      return;
+
+    for (unsigned i = 0; i < kStepsPerCall; ++i) {
+      *cursor = table.ShrinkStep(*cursor, kMergedFill);
+      if (*cursor == 0)
+        break;
+    }
+  };
+
+  shrink(db.prime, &db.prime_shrink_cursor);
+}
+
 void DbSlice::CreateDb(DbIndex db_ind) {
   auto& db = db_arr_[db_ind];
   if (!db) {
-    db.reset(new DbTable{owner_->memory_resource()});
+    db.reset(new DbTable{owner_->table_memory_resource()});
   }
 }
 
+size_t DbSlice::EvictSampled(size_t memory_to_free, string_view keep, DbIndex db_ind) {
+  // Similarly to DeleteExpiredStep, a sample is roughly 100 keys. Only the best quarter of
+  // each sample is evicted, so that the ranks of the evicted keys are close to the best of the
+  // table.
+  constexpr unsigned kBucketsPerSample = 8;
+  constexpr unsigned kMaxSamples = 8;
+
+  DbTable* table = db_arr_[db_ind].get();
+  size_t used_memory_start = owner_->UsedMemory();
+  auto freed_memory_fun = [&] {
+    size_t current = owner_->UsedMemory();
+    return current < used_memory_start ? used_memory_start - current : 0;
+  };
+
+  vector<pair<uint64_t, PrimeIterator>> candidates;
+  auto sample_cb = [&](PrimeIterator it) {
+    if (it->first == keep)
+      return;
+    if (optional<uint64_t> rank = EvictionRank(db_ind, it); rank)
+      candidates.emplace_back(*rank, it);
+  };
+
+  unsigned evicted = 0;
+  for (unsigned sample = 0; sample < kMaxSamples && freed_memory_fun() <= memory_to_free;
+       ++sample) {
+    candidates.clear();
+    for (unsigned i = 0; i < kBucketsPerSample; ++i)
+      table->eviction_cursor = table->prime.Traverse(table->eviction_cursor, sample_cb);
+
+    // Erasing an entry does not move the others, so the iterators stay valid.
+    size_t num_evict = (candidates.size() + 3) / 4;
+    partial_sort(candidates.begin(), candidates.begin() + num_evict, candidates.end(),
+                 [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t i = 0; i < num_evict && freed_memory_fun() <= memory_to_free; ++i) {
+      EvictItemFun(db_ind, candidates[i].second, table, this);
+      ++evicted;
+    }
+  }
+
+  DVLOG(1) << "Evicted " << evicted << " sampled items, freed " << freed_memory_fun() << " bytes";
+  events_.evicted_keys += evicted;
+  events_.hard_evictions += evicted;
+
+  return freed_memory_fun();
+}
+
 // "it" is the iterator that we just added/updated and it should not be deleted.
 // "table" is the instance where we should delete the objects from.
-size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* table) {
+size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbIndex db_ind) {
+  if (eviction_policy_ == EvictionPolicy::VOLATILE_LFU ||
+      eviction_policy_ == EvictionPolicy::VOLATILE_TTL) {
+    string tmp;
+    return EvictSampled(memory_to_free, it->first.GetSlice(&tmp), db_ind);
+  }
+
+  DbTable* table = db_arr_[db_ind].get();
   PrimeTable::Segment_t* segment = table->prime.GetSegment(it.segment_id());
   DCHECK(segment);
 
@@ -851,65 +1829,100 @@ size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* t
   EngineShard* shard = owner_;
   size_t used_memory_start = shard->UsedMemory();
 
+  // In cache mode with tiered storage the values are moved to the backing file while it has
+  // room, and their entries stay as external references. Their memory is counted as freed,
+  // since it is released once the writes finish.
+  TieredStorage* tiered = caching_mode_ ? shard->tiered_storage() : nullptr;
+  size_t demoted_bytes = 0;
+
   auto freed_memory_fun = [&] {
     size_t current = shard->UsedMemory();
-    return current < used_memory_start ? used_memory_start - current : 0;
+    return (current < used_memory_start ? used_memory_start - current : 0) + demoted_bytes;
   };
 
-  for (unsigned i = 0; !evict_succeeded && i < kNumStashBuckets; ++i) {
-    unsigned stash_bid = i + PrimeTable::Segment_t::kNumBuckets;
-    const auto& bucket = segment->GetBucket(stash_bid);
-    if (bucket.IsEmpty())
-      continue;
+  auto evict_fun = [&](PrimeIterator evict_it) {
+    if (tiered) {
+      if (evict_it->second.HasIoPending())  // Already being written to the backing file.
+        return;
 
-    for (int slot_id = PrimeTable::Segment_t::kNumSlots - 1; slot_id >= 0; --slot_id) {
-      if (!bucket.IsBusy(slot_id))
-        continue;
+      size_t obj_size = evict_it->second.MallocUsed();
+      if (tiered->Demote(db_ind, evict_it)) {
+        demoted_bytes += obj_size;
+        return;
+      }
+    }
+    EvictItemFun(db_ind, evict_it, table, this);
+    ++evicted;
+  };
+
+  // We evict colder items first: every pass goes over the stash buckets and then over the
+  // regular buckets, evicting items whose frequency counter is at most max_freq. Without
+  // frequency information (all counters are equal) it degenerates to a single pass, and so
+  // does allkeys-lru, which only follows the order of the slots.
+  constexpr unsigned kFreqPasses[] = {CompactObj::kFreqInit, 3, 7, CompactObj::kFreqMax};
+  bool lru = eviction_policy_ == EvictionPolicy::ALLKEYS_LRU;
+  auto too_hot = [&](PrimeIterator evict_it, unsigned max_freq) {
+    return !lru && evict_it->first.GetFreq() > max_freq;
+  };
+
+  for (unsigned max_freq : kFreqPasses) {
+    if (evict_succeeded)
+      break;
 
-      auto evict_it = table->prime.GetIterator(it.segment_id(), stash_bid, slot_id);
-      // skip the iterator that we must keep or the sticky items.
-      if (evict_it == it || evict_it->first.IsSticky())
+    for (unsigned i = 0; !evict_succeeded && i < kNumStashBuckets; ++i) {
+      unsigned stash_bid = i + PrimeTable::Segment_t::kNumBuckets;
+      const auto& bucket = segment->GetBucket(stash_bid);
+      if (bucket.IsEmpty())
         continue;
 
-      EvictItemFun(evict_it, table);
-      ++evicted;
-      if (freed_memory_fun() > memory_to_free) {
-        evict_succeeded = true;
-        break;
+      for (int slot_id = PrimeTable::Segment_t::kNumSlots - 1; slot_id >= 0; --slot_id) {
+        if (!bucket.IsBusy(slot_id))
+          continue;
+
+        auto evict_it = table->prime.GetIterator(it.segment_id(), stash_bid, slot_id);
+        // skip the iterator that we must keep or the sticky items.
+        if (evict_it == it || evict_it->first.IsSticky() || too_hot(evict_it, max_freq))
+          continue;
+
+        evict_fun(evict_it);
+        if (freed_memory_fun() > memory_to_free) {
+          evict_succeeded = true;
+          break;
+        }
       }
     }
-  }
 
-  if (evicted) {
-    DVLOG(1) << "Evicted " << evicted << " stashed items, freed " << freed_memory_fun() << " bytes";
-  }
+    if (evicted) {
+      DVLOG(1) << "Evicted " << evicted << " stashed items, freed " << freed_memory_fun()
+               << " bytes";
+    }
 
-  // Try normal buckets now. We iterate from largest slot to smallest across the whole segment.
-  for (int slot_id = PrimeTable::Segment_t::kNumSlots - 1; !evict_succeeded && slot_id >= 0;
-       --slot_id) {
-    for (unsigned i = 0; i < PrimeTable::Segment_t::kNumBuckets; ++i) {
-      unsigned bid = (it.bucket_id() + i) % PrimeTable::Segment_t::kNumBuckets;
-      const auto& bucket = segment->GetBucket(bid);
-      if (!bucket.IsBusy(slot_id))
-        continue;
+    // Try normal buckets now. We iterate from largest slot to smallest across the whole segment.
+    for (int slot_id = PrimeTable::Segment_t::kNumSlots - 1; !evict_succeeded && slot_id >= 0;
+         --slot_id) {
+      for (unsigned i = 0; i < PrimeTable::Segment_t::kNumBuckets; ++i) {
+        unsigned bid = (it.bucket_id() + i) % PrimeTable::Segment_t::kNumBuckets;
+        const auto& bucket = segment->GetBucket(bid);
+        if (!bucket.IsBusy(slot_id))
+          continue;
 
-      auto evict_it = table->prime.GetIterator(it.segment_id(), bid, slot_id);
-      if (evict_it == it || evict_it->first.IsSticky())
-        continue;
+        auto evict_it = table->prime.GetIterator(it.segment_id(), bid, slot_id);
+        if (evict_it == it || evict_it->first.IsSticky() || too_hot(evict_it, max_freq))
+          continue;
 
-      EvictItemFun(evict_it, table);
-      ++evicted;
+        evict_fun(evict_it);
 
-      if (freed_memory_fun() > memory_to_free) {
-        evict_succeeded = true;
-        break;
+        if (freed_memory_fun() > memory_to_free) {
+          evict_succeeded = true;
+          break;
+        }
       }
     }
   }
 
-  if (evicted) {
-    DVLOG(1) << "Evicted total: " << evicted << " items, freed " << freed_memory_fun() << " bytes "
-             << "success: " << evict_succeeded;
+  if (evicted || demoted_bytes) {
+    DVLOG(1) << "Evicted total: " << evicted << " items, offloaded " << demoted_bytes
+             << " bytes, freed " << freed_memory_fun() << " bytes success: " << evict_succeeded;
 
     events_.evicted_keys += evicted;
     events_.hard_evictions += evicted;
@@ -918,29 +1931,4 @@ size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* t
   return freed_memory_fun();
 };
 
-void DbSlice::RegisterWatchedKey(DbIndex db_indx, std::string_view key,
-                                 ConnectionState::ExecInfo* exec_info) {
-  db_arr_[db_indx]->watched_keys[key].push_back(exec_info);
-}
-
-void DbSlice::UnregisterConnectionWatches(ConnectionState::ExecInfo* exec_info) {
-  for (const auto& [db_indx, key] : exec_info->watched_keys) {
-    auto& watched_keys = db_arr_[db_indx]->watched_keys;
-    if (auto it = watched_keys.find(key); it != watched_keys.end()) {
-      it->second.erase(std::remove(it->second.begin(), it->second.end(), exec_info),
-                       it->second.end());
-      if (it->second.empty())
-        watched_keys.erase(it);
-    }
-  }
-}
-
-void DbSlice::InvalidateDbWatches(DbIndex db_indx) {
-  for (const auto& [key, conn_list] : db_arr_[db_indx]->watched_keys) {
-    for (auto conn_ptr : conn_list) {
-      conn_ptr->watched_dirty.store(true, memory_order_relaxed);
-    }
-  }
-}
-
 }  // namespace dfly
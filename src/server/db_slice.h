@@ -5,11 +5,19 @@
 #pragma once
 
 #include <absl/container/flat_hash_set.h>
+#include <absl/functional/function_ref.h>
 
+#include <optional>
+#include <queue>
+
+#include "core/top_keys.h"
 #include "facade/op_status.h"
+#include "server/cluster/cluster_config.h"
 #include "server/common.h"
 #include "server/conn_context.h"
+#include "server/lazy_free.h"
 #include "server/table.h"
+#include "util/fibers/event_count.h"
 
 namespace util {
 class ProactorBase;
@@ -19,6 +27,23 @@ namespace dfly {
 
 using facade::OpResult;
 
+class CountMinSketch;
+
+// Which keys may be evicted once the shard reaches its memory budget, see maxmemory_policy.
+enum class EvictionPolicy : uint8_t {
+  NO_EVICTION,   // the writes fail instead.
+  ALLKEYS_LFU,   // the least frequently used keys, the eviction of cache_mode.
+  ALLKEYS_LRU,   // the least recently used keys, regardless of their frequency.
+  VOLATILE_LFU,  // the least frequently used keys, among those with an expiry.
+  VOLATILE_TTL,  // the keys with an expiry that are the closest to it.
+};
+
+// The policy that maxmemory_policy names, or the one that cache_mode implies if it is empty.
+// Returns false if the name is invalid.
+bool GetFlagEvictionPolicy(EvictionPolicy* policy);
+
+std::string_view EvictionPolicyName(EvictionPolicy policy);
+
 struct DbStats : public DbTableStats {
   // number of active keys.
   size_t key_count = 0;
@@ -32,6 +57,12 @@ struct DbStats : public DbTableStats {
   // Memory used by dictionaries.
   size_t table_mem_usage = 0;
 
+  // Keys that are due according to the expire wheel but were not deleted yet, and an estimate
+  // of their memory. Memory of the expire wheel itself.
+  size_t expired_pending_count = 0;
+  size_t expired_pending_memory = 0;
+  size_t expire_wheel_memory = 0;
+
   using DbTableStats::operator+=;
   using DbTableStats::operator=;
 
@@ -50,6 +81,15 @@ struct SliceEvents {
   size_t stash_unloaded = 0;
   size_t bumpups = 0;  // how many bump-upds we did.
 
+  // cache admission filter (see cache_admission_filter flag).
+  size_t admission_hits = 0;  // lookups of existing keys recorded by the filter.
+  size_t admission_admitted = 0;
+  size_t admission_rejected = 0;
+
+  // writes over the memory quota of their database that failed or evicted its keys.
+  size_t quota_rejections = 0;
+  size_t quota_evictions = 0;
+
   SliceEvents& operator+=(const SliceEvents& o);
 };
 
@@ -63,6 +103,9 @@ class DbSlice {
     std::vector<DbStats> db_stats;
     SliceEvents events;
     size_t small_string_bytes = 0;
+    size_t lazyfree_pending = 0;  // values and tables that are being freed in the background.
+    size_t lazyfree_pending_memory = 0;
+    size_t lazyfree_tables = 0;  // flushed tables that were not freed yet.
   };
 
   using Context = DbContext;
@@ -95,7 +138,9 @@ class DbSlice {
     }
   };
 
-  DbSlice(uint32_t index, bool caching_mode, EngineShard* owner);
+  // Any policy but NO_EVICTION puts the slice into cache mode, which tracks the frequency and
+  // the recency of the keys.
+  DbSlice(uint32_t index, EvictionPolicy eviction_policy, EngineShard* owner);
   ~DbSlice();
 
   // Activates `db_ind` database if it does not exist (see ActivateDb below).
@@ -108,6 +153,11 @@ class DbSlice {
     expire_base_[generation & 1] = now;
   }
 
+  // Moves the expire base of the new deadlines to now_ms once it gets old, and migrates the
+  // entries of the previous generation to it incrementally, so that the deltas of the short
+  // ttls stay within the ms precision of ExpirePeriod. Called from the heartbeat.
+  void RebaseExpireStep(uint64_t now_ms);
+
   // From time to time DbSlice is set with a new set of params needed to estimate its
   // memory usage.
   void SetCachedParams(int64_t budget, size_t bytes_per_object) {
@@ -119,24 +169,59 @@ class DbSlice {
     return memory_budget_;
   }
 
+  // Limits the memory of the database in this shard, i.e. its share of the quota. Over the
+  // quota the new keys fail with OOM, or evict the keys of the same database in cache mode.
+  // 0 - no quota.
+  void SetMemoryQuota(DbIndex db_ind, size_t bytes);
+
+  size_t memory_quota(DbIndex db_ind) const {
+    return db_ind < memory_quota_.size() ? memory_quota_[db_ind] : 0;
+  }
+
+  // The memory of the keys and values of the database and of its table.
+  size_t DbMemoryUsage(DbIndex db_ind) const;
+
   size_t bytes_per_object() const {
     return bytes_per_object_;
   }
 
-  // returns absolute time of the expiration.
-  time_t ExpireTime(ExpireIterator it) const {
-    return it.is_done() ? 0 : expire_base_[0] + it->second.duration_ms();
+  // Number of the flushed tables that are still being freed in the background.
+  size_t lazyfree_tables() const {
+    return lazy_free_.num_tables();
+  }
+
+  // Returns the absolute time of the expiration of the entry, 0 if it does not expire.
+  time_t ExpireTime(PrimeIterator it) const {
+    return it.is_done() || !it->second.HasExpire() ? 0 : ExpireTime(it->second.expire_period());
   }
 
+  time_t ExpireTime(ExpirePeriod period) const {
+    return expire_base_[period.generation_id()] + period.duration_ms();
+  }
+
+  // The deadlines before the expire base are set to the base, which is in the past anyway.
   ExpirePeriod FromAbsoluteTime(uint64_t time_ms) const {
-    return ExpirePeriod{time_ms - expire_base_[0]};
+    uint64_t base = expire_base_[expire_gen_];
+    return ExpirePeriod{time_ms > base ? time_ms - base : 0, expire_gen_};
   }
 
   OpResult<PrimeIterator> Find(const Context& cntx, std::string_view key,
                                unsigned req_obj_type) const;
 
-  // Returns (value, expire) dict entries if key exists, null if it does not exist or has expired.
-  std::pair<PrimeIterator, ExpireIterator> FindExt(const Context& cntx, std::string_view key) const;
+  // Returns the entry of key if it exists, an invalid iterator if it does not exist or has
+  // expired. The entry keeps its deadline, see ExpireTime.
+  PrimeIterator FindExt(const Context& cntx, std::string_view key) const;
+
+  using FindManyCb = absl::FunctionRef<void(unsigned, PrimeIterator)>;
+
+  // Batched version of FindExt: calls cb(i, FindExt(cntx, keys[i])) for every key, in order.
+  // Prefetches the buckets of multiple keys before resolving them, which makes multi-key
+  // lookups significantly cheaper.
+  // The iterator passed to cb is valid only until cb returns, because resolving the next key
+  // can bump up or expire entries and move the others. cb may suspend, e.g. to read an
+  // offloaded value, and may delete its entry, in which case the later duplicates of its key
+  // are reported as missing, but it must not add keys.
+  void FindMany(const Context& cntx, ArgSlice keys, FindManyCb cb) const;
 
   // Returns (iterator, args-index) if found, KEY_NOTFOUND otherwise.
   // If multiple keys are found, returns the first index in the ArgSlice.
@@ -147,9 +232,6 @@ class DbSlice {
   std::pair<PrimeIterator, bool> AddOrFind(const Context& cntx,
                                            std::string_view key) noexcept(false);
 
-  std::tuple<PrimeIterator, ExpireIterator, bool> AddOrFind2(const Context& cntx,
-                                                             std::string_view key) noexcept(false);
-
   // Same as AddOrSkip, but overwrites in case entry exists.
   // Returns second=true if insertion took place.
   std::pair<PrimeIterator, bool> AddOrUpdate(const Context& cntx, std::string_view key,
@@ -167,16 +249,29 @@ class DbSlice {
   PrimeIterator AddNew(const Context& cntx, std::string_view key, PrimeValue obj,
                        uint64_t expire_at_ms) noexcept(false);
 
-  facade::OpStatus UpdateExpire(const Context& cntx, PrimeIterator prime_it, ExpireIterator exp_it,
+  facade::OpStatus UpdateExpire(const Context& cntx, PrimeIterator prime_it,
                                 const ExpireParams& params);
 
   // Either adds or removes (if at == 0) expiry. Returns true if a change was made.
   // Does not change expiry if at != 0 and expiry already exists.
   bool UpdateExpire(DbIndex db_ind, PrimeIterator main_it, uint64_t at);
 
+  // Moves the deadline of an entry that expires to at_ms.
+  void SetExpireTime(DbIndex db_ind, PrimeIterator it, uint64_t at_ms);
+
   void SetMCFlag(DbIndex db_ind, PrimeKey key, uint32_t flag);
   uint32_t GetMCFlag(DbIndex db_ind, const PrimeKey& key) const;
 
+  // Memcache meta protocol state bits of an item.
+  enum McState : uint8_t {
+    MC_STALE = 1,     // Invalidated by "md <key> I", served until it is set again.
+    MC_WIN_SENT = 2,  // A client got the win token to recache the item.
+  };
+
+  // State 0 clears the item state.
+  void SetMCState(DbIndex db_ind, std::string_view key, uint8_t state);
+  uint8_t GetMCState(DbIndex db_ind, std::string_view key) const;
+
   // Creates a database with index `db_ind`. If such database exists does nothing.
   void ActivateDb(DbIndex db_ind);
 
@@ -191,6 +286,20 @@ class DbSlice {
    */
   void FlushDb(DbIndex db_ind);
 
+  // Deletes the keys of the slots in cluster mode.
+  void FlushSlots(DbIndex db_ind, const std::vector<SlotId>& slots);
+
+  // Returns up to limit keys of the slot in cluster mode.
+  std::vector<std::string> GetSlotKeys(DbIndex db_ind, SlotId slot, size_t limit) const;
+
+  size_t SlotSize(DbIndex db_ind, SlotId slot) const;
+
+  // Adds the stats of the slots in cluster mode to dest, resizing it to the number of slots.
+  void MergeSlotStats(DbIndex db_ind, std::vector<SlotStats>* dest) const;
+
+  // Adjusts the object memory of the slot of key in cluster mode, along DbTableStats.
+  void AccountSlotMemory(DbIndex db_ind, const PrimeKey& key, ssize_t delta);
+
   EngineShard* shard_owner() {
     return owner_;
   }
@@ -210,6 +319,24 @@ class DbSlice {
   // Returns true if all keys can be locked under m. Does not lock them though.
   bool CheckLock(IntentLock::Mode m, const KeyLockArgs& lock_args) const;
 
+  // Returns true if the locks on all keys, that were already acquired under m by the caller,
+  // are not contended by others.
+  bool CheckLockGranted(IntentLock::Mode m, const KeyLockArgs& lock_args) const;
+
+  // Pins the key so that its value is neither expired nor evicted until a matching UnpinKey().
+  // Used when a value is read from another thread after its transaction has concluded.
+  // The pin holds a shared intent lock on the key, so the writers of the key can not run out
+  // of order, and they wait at the tx-queue head until it's unpinned, see
+  // Transaction::WritesPinnedKeys. The transactions on other keys are not delayed.
+  void PinKey(DbIndex db_ind, std::string_view key);
+  void UnpinKey(DbIndex db_ind, std::string_view key);
+
+  bool IsPinned(DbIndex db_ind, std::string_view key) const;
+  bool IsPinned(DbIndex db_ind, const PrimeKey& key) const;
+
+  // Returns true if any key of the shard is pinned.
+  bool HasPinnedKeys() const;
+
   size_t db_array_size() const {
     return db_arr_.size();
   }
@@ -222,8 +349,8 @@ class DbSlice {
     return db_arr_[id].get();
   }
 
-  std::pair<PrimeTable*, ExpireTable*> GetTables(DbIndex id) {
-    return std::pair<PrimeTable*, ExpireTable*>(&db_arr_[id]->prime, &db_arr_[id]->expire);
+  PrimeTable* GetPrimeTable(DbIndex id) {
+    return &db_arr_[id]->prime;
   }
 
   // Returns existing keys count in the db.
@@ -239,11 +366,10 @@ class DbSlice {
   }
 
   // Check whether 'it' has not expired. Returns it if it's still valid. Otherwise, erases it
-  // from both tables and return PrimeIterator{}.
-  std::pair<PrimeIterator, ExpireIterator> ExpireIfNeeded(const Context& cntx,
-                                                          PrimeIterator it) const;
+  // and returns PrimeIterator{}.
+  PrimeIterator ExpireIfNeeded(const Context& cntx, PrimeIterator it) const;
 
-  // Iterate over all expire table entries and delete expired.
+  // Iterate over all the entries with expiry and delete expired.
   void ExpireAllIfNeeded();
 
   // Current version of this slice.
@@ -252,6 +378,35 @@ class DbSlice {
     return version_;
   }
 
+  // Version of the snapshot that the next delta snapshot is based on, 0 if deletions are not
+  // tracked, i.e. no snapshot was taken with delta_snapshots or the slice was flushed since.
+  uint64_t delta_base_version() const {
+    return delta_base_version_;
+  }
+
+  // Makes the snapshot that started at version the base of the next delta snapshot and tracks
+  // the keys deleted from now on. Drops the tombstones of the keys deleted before version.
+  void SetDeltaBase(uint64_t version);
+
+  // Records a tombstone of key if deletions are tracked, see SetDeltaBase.
+  void RecordDeletion(const PrimeKey& key, DbTable* table);
+
+  // While enabled, the keys of the write commands are recorded, so that the snapshot being
+  // loaded does not overwrite them: the last writer wins. Disabling drops the records.
+  void TrackLoadingWrites(bool enable);
+
+  bool tracks_loading_writes() const {
+    return track_loading_writes_;
+  }
+
+  void RecordLoadingWrite(DbIndex db_ind, std::string_view key);
+
+  // Whether a client wrote key while the snapshot was being loaded.
+  bool WrittenWhileLoading(DbIndex db_ind, std::string_view key) const;
+
+  // Number of the keys written while loading.
+  size_t loading_writes() const;
+
   using ChangeCallback = std::function<void(DbIndex, const ChangeReq&)>;
 
   //! Registers the callback to be called for each change.
@@ -270,59 +425,212 @@ class DbSlice {
 
   // Deletes some amount of possible expired items.
   DeleteExpiredStats DeleteExpiredStep(const Context& cntx, unsigned count);
+
+  // Deletes the keys that are due according to the expire wheel, processing up to max_entries
+  // of its entries.
+  DeleteExpiredStats ExpireWheelStep(const Context& cntx, unsigned max_entries);
+
+  bool expire_wheel_enabled() const {
+    return expire_wheel_;
+  }
+
+  // The expire wheel only fires once per tick and heartbeat, so the keys that are due before
+  // its next tick are also kept in a small queue, which the expiry timer of the shard serves
+  // on time. This way the keys with short ttls, like locks, are deleted when they are due.
+
+  // Returns the earliest deadline in the queue, or 0 if it is empty.
+  uint64_t NextSoonExpiry() const {
+    return soon_expiry_.empty() ? 0 : soon_expiry_.top().deadline_ms;
+  }
+
+  // Deletes the keys of the queue that are due at now_ms, up to max_entries of them.
+  DeleteExpiredStats SoonExpiryStep(uint64_t now_ms, unsigned max_entries);
+
+  // Notified when a key with an earlier deadline than the queued ones is added to the queue.
+  util::fibers_ext::EventCount* soon_expiry_ec() {
+    return &soon_expiry_ec_;
+  }
+
+  // The keys due before horizon_ms are queued from now on. Set by the heartbeat of the shards
+  // that run the expiry timer, the queue stays empty otherwise.
+  void SetSoonExpiryHorizon(uint64_t horizon_ms) {
+    soon_expiry_horizon_ms_ = horizon_ms;
+  }
+
   void FreeMemWithEvictionStep(DbIndex db_indx, size_t increase_goal_bytes);
 
+  EvictionPolicy eviction_policy() const {
+    return eviction_policy_;
+  }
+
+  // Returns the rank of the key among the eviction candidates, the lower ranks are evicted
+  // first. Returns nullopt if the eviction policy keeps the key, as well as for sticky and
+  // pinned keys.
+  std::optional<uint64_t> EvictionRank(DbIndex db_ind, PrimeIterator it) const;
+
+  // Cache mode admission policy: returns true if a new key with key_hash should be added
+  // at the expense of evicting victim.
+  bool AdmitNewKey(uint64_t key_hash, const PrimeKey& victim) const;
+
+  // Ages the frequency counters and the idle clocks of a portion of the keys.
+  void DecayFreqStep(DbIndex db_ind);
+
+  // The lower bound of the idle time of a key at the idle level, see CompactObj::GetIdle.
+  // The levels grow by a factor of 4 from one minute, i.e. up to ~68 hours.
+  static uint64_t IdleSeconds(unsigned idle);
+
+  // Deletes expired members of sets and hashes that were added with ttl, so that members
+  // that are not accessed anymore do not hold memory. Traverses a portion of the table,
+  // continuing from where the previous call stopped. Containers that become empty are deleted.
+  // Returns the number of deleted members.
+  size_t ExpireMembersStep(const Context& cntx);
+
+  // Drops the chunks of time series whose samples are past their retention, for a portion of
+  // the table like ExpireMembersStep. Skips the keys that are locked by transactions and does
+  // nothing while there are registered change callbacks, since the values are changed in place.
+  // Returns the number of dropped samples.
+  size_t TrimTimeSeriesStep(DbIndex db_ind);
+
+  // Incrementally merges sparse segments of the db tables, so that memory is returned
+  // after mass deletions. Does nothing while there are registered change callbacks, since
+  // those rely on entries not moving between segments, or while a shard callback runs, since
+  // it may be suspended while holding iterators, e.g. on a read of an offloaded value.
+  void ShrinkTablesStep(DbIndex db_ind);
+
+  // Mark the shard callbacks of transactions that are running, see ShrinkTablesStep.
+  void OnCbStart() {
+    ++running_cbs_;
+  }
+
+  void OnCbFinish() {
+    --running_cbs_;
+  }
+
   const DbTableArray& databases() const {
     return db_arr_;
   }
 
-  void TEST_EnableCacheMode() {
+  void TEST_EnableCacheMode(EvictionPolicy policy = EvictionPolicy::ALLKEYS_LFU) {
+    eviction_policy_ = policy;
     caching_mode_ = 1;
   }
 
-  void RegisterWatchedKey(DbIndex db_indx, std::string_view key,
-                          ConnectionState::ExecInfo* exec_info);
-
-  // Unregisted all watched key entries for connection.
-  void UnregisterConnectionWatches(ConnectionState::ExecInfo* exec_info);
+  // Up to n of the most accessed keys of the shard, with their estimated number of accesses,
+  // by descending count. Empty if hotkeys_sample_rate is 0.
+  std::vector<TopKeys::Entry> GetHotKeys(size_t n) const;
 
-  // Invalidate all watched keys in database. Used on FLUSH.
-  void InvalidateDbWatches(DbIndex db_indx);
+  // Up to n of the largest keys of the shard, with the memory of their values, by descending
+  // size. The sizes are refreshed and the keys that were deleted are dropped.
+  std::vector<TopKeys::Entry> GetBigKeys(size_t n);
 
  private:
   std::pair<PrimeIterator, bool> AddOrUpdateInternal(const Context& cntx, std::string_view key,
                                                      PrimeValue obj, uint64_t expire_at_ms,
                                                      bool force_update) noexcept(false);
 
+  // Handles expiry and cache bump-ups of a found entry. Updates res accordingly and returns
+  // true if the table has been mutated, i.e. other iterators could have been invalidated.
+  bool OnFound(const Context& cntx, PrimeIterator* res) const;
+
+  // Records the key access in the admission filter if it's enabled, and samples it for the
+  // hot keys.
+  void RecordAccess(std::string_view key) const;
+
+  // Fills uniq_keys_ with the unique keys of lock_args and their lock fingerprints.
+  void FillUniqueKeys(const KeyLockArgs& lock_args);
+
   void CreateDb(DbIndex index);
-  size_t EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* table);
+
+  // Runs the change callbacks and bumps the version of the bucket of it, for the changes that
+  // bypass PreUpdate, i.e. only the expiry of the entry changes.
+  void OnChangeInPlace(DbIndex db_ind, PrimeIterator it);
+
+  // Adds key to the expire wheel of db, if it is enabled.
+  void ScheduleExpiry(DbIndex db_ind, const PrimeKey& key, uint64_t at_ms);
+
+  // Deletes the key with the hash if it is due according to its deadline. Returns its
+  // deadline if it is kept, or 0 if it was deleted or not found.
+  uint64_t ExpireByHash(const Context& cntx, uint64_t hash, DeleteExpiredStats* stats);
+
+  size_t EvictObjects(size_t memory_to_free, PrimeIterator it, DbIndex db_ind);
+
+  // Used by the volatile policies, whose keys may be rare in any given segment. Evicts the best
+  // ranked keys of samples of the whole table until memory_to_free bytes are freed or a few
+  // samples did not free enough. Keeps the key keep. Returns the freed bytes.
+  size_t EvictSampled(size_t memory_to_free, std::string_view keep, DbIndex db_ind);
 
   uint64_t NextVersion() {
     return version_++;
   }
 
+  // xorshift32, used for probabilistic increments of the frequency counters.
+  uint32_t NextFreqRnd() const {
+    freq_rnd_ ^= freq_rnd_ << 13;
+    freq_rnd_ ^= freq_rnd_ >> 17;
+    freq_rnd_ ^= freq_rnd_ << 5;
+    return freq_rnd_;
+  }
+
  private:
   ShardId shard_id_;
+  EvictionPolicy eviction_policy_;
   uint8_t caching_mode_ : 1;
+  uint8_t prefix_compression_ : 1;
+  uint8_t expire_wheel_ : 1;
+  uint8_t track_loading_writes_ : 1;
 
   EngineShard* owner_;
 
   time_t expire_base_[2];  // Used for expire logic, represents a real clock.
+  unsigned expire_gen_ = 0;  // The generation of the new deadlines.
+
+  struct SoonExpiry {
+    uint64_t deadline_ms;
+    uint64_t hash;
+    DbIndex db_index;
+
+    bool operator>(const SoonExpiry& o) const {
+      return deadline_ms > o.deadline_ms;
+    }
+  };
+
+  // The keys due before the next tick of the expire wheel, by deadline, see NextSoonExpiry.
+  std::priority_queue<SoonExpiry, std::vector<SoonExpiry>, std::greater<SoonExpiry>> soon_expiry_;
+  util::fibers_ext::EventCount soon_expiry_ec_;
+  uint64_t soon_expiry_horizon_ms_ = 0;
 
   uint64_t version_ = 1;  // Used to version entries in the PrimeTable.
+  uint64_t delta_base_version_ = 0;
   ssize_t memory_budget_ = SSIZE_MAX;
   size_t bytes_per_object_ = 0;
   size_t soft_budget_limit_ = 0;
 
   mutable SliceEvents events_;  // we may change this even for const operations.
+  mutable uint32_t freq_rnd_ = 2463534242;
 
   DbTableArray db_arr_;
+  std::vector<size_t> memory_quota_;  // by database, see SetMemoryQuota.
+
+  std::unique_ptr<CountMinSketch> admission_filter_;
 
-  // Used in temporary computations in Acquire/Release.
-  absl::flat_hash_set<std::string_view> uniq_keys_;
+  // The most accessed keys out of every ~hotkeys_sample_rate access, and the keys with the
+  // largest values as of their last update.
+  std::unique_ptr<TopKeys> hot_keys_;
+  std::unique_ptr<TopKeys> big_keys_;
+  uint32_t hotkeys_sample_rate_ = 0;
+  uint32_t running_cbs_ = 0;
+  mutable uint32_t hot_keys_countdown_ = 1;
+  mutable uint64_t hot_keys_samples_ = 0;
+
+  // Used in temporary computations in Acquire/Release. Keeps its capacity between the calls.
+  std::vector<std::pair<LockFp, std::string_view>> uniq_keys_;
 
   // ordered from the smallest to largest version.
   std::vector<std::pair<uint64_t, ChangeCallback>> change_cb_;
+
+  // The large values of the deleted keys and the flushed tables that are being freed.
+  // Mutable, because const lookups may delete expired keys.
+  mutable LazyFreeQueue lazy_free_;
 };
 
 }  // namespace dfly
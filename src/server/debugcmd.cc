@@ -4,16 +4,23 @@
 #include "server/debugcmd.h"
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/container/flat_hash_map.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <sys/resource.h>
 
 #include <boost/fiber/operations.hpp>
 #include <filesystem>
+#include <random>
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "facade/fault_injection.h"
 #include "server/blocking_controller.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/journal/executor.h"
 #include "server/main_service.h"
 #include "server/rdb_load.h"
 #include "server/server_state.h"
@@ -58,19 +65,80 @@ struct ObjInfo {
   bool found = false;
 };
 
-void DoPopulateBatch(std::string_view prefix, size_t val_size, const SetCmd::SetParams& params,
-                     const PopulateBatch& batch) {
+// The options of DEBUG POPULATE. The sizes of the values, or of the elements of the other
+// types, the numbers of the elements and the expiry times are drawn uniformly from their ranges.
+struct PopulateOptions {
+  string_view prefix{"key"};
+  string_view type{"STRING"};
+  uint32_t val_size = 0;
+  uint32_t val_size_max = 0;
+  uint32_t elements = 1;
+  uint32_t elements_max = 1;
+  uint32_t expire_sec = 0;  // 0 means no expiry.
+  uint32_t expire_sec_max = 0;
+  bool random_values = false;
+};
+
+namespace {
+
+constexpr string_view kPopulateTypes[] = {"STRING", "HASH", "SET", "ZSET",
+                                          "LIST", "JSON", "STREAM"};
+
+uint32_t DrawUniform(uint32_t min, uint32_t max, default_random_engine* rnd) {
+  return min < max ? uniform_int_distribution<uint32_t>(min, max)(*rnd) : min;
+}
+
+// Returns tag padded with 'x', or with random letters if RAND was given, up to a size drawn from
+// the range of the value sizes.
+string PopulateValue(const PopulateOptions& options, string tag, default_random_engine* rnd) {
+  uint32_t size = DrawUniform(options.val_size, options.val_size_max, rnd);
+  if (tag.size() >= size)
+    return tag;
+
+  size_t pos = tag.size();
+  tag.resize(size, 'x');
+  if (options.random_values) {
+    for (; pos < tag.size(); ++pos)
+      tag[pos] = 'a' + (*rnd)() % 26;
+  }
+  return tag;
+}
+
+// The expiry time of a key in ms, or 0 if the keys do not expire.
+uint64_t PopulateExpireMs(const PopulateOptions& options, default_random_engine* rnd) {
+  return uint64_t(DrawUniform(options.expire_sec, options.expire_sec_max, rnd)) * 1000;
+}
+
+}  // namespace
+
+// Every key draws its values from its own generator seeded by its index, so that the same
+// options always populate the same dataset, whichever thread populates each key.
+void DoPopulateBatch(const PopulateOptions& options, const PopulateBatch& batch) {
   DbContext db_cntx{batch.dbid, 0};
   OpArgs op_args(EngineShard::tlocal(), 0, db_cntx);
   SetCmd sg(op_args);
+  SetCmd::SetParams params;
+  bool is_json = options.type == "JSON";
 
   for (unsigned i = 0; i < batch.sz; ++i) {
-    string key = absl::StrCat(prefix, ":", batch.index[i]);
-    string val = absl::StrCat("value:", batch.index[i]);
-
-    if (val.size() < val_size) {
-      val.resize(val_size, 'x');
+    uint64_t index = batch.index[i];
+    default_random_engine rnd(index);
+    string key = absl::StrCat(options.prefix, ":", index);
+    string val;
+
+    if (is_json) {
+      uint32_t elements = DrawUniform(options.elements, options.elements_max, &rnd);
+      val = "{";
+      for (uint32_t j = 0; j < elements; ++j) {
+        absl::StrAppend(&val, j ? "," : "", "\"field:", j, "\":\"",
+                        PopulateValue(options, absl::StrCat("value:", j), &rnd), "\"");
+      }
+      val.append("}");
+    } else {
+      val = PopulateValue(options, absl::StrCat("value:", index), &rnd);
     }
+
+    params.expire_after_ms = PopulateExpireMs(options, &rnd);
     sg.Set(params, key, val);
   }
 }
@@ -92,13 +160,28 @@ void DebugCmd::Run(CmdArgList args) {
         "    Examples:",
         "    * DEBUG RELOAD NOSAVE: replace the current database with the contents of an",
         "      existing RDB file.",
+        "INJECT [<point> <delay_usec> [EVERY <n>] | RESET]",
+        "    Delays every <n>-th pass through <point> by <delay_usec>, 0 disables it.",
+        "    The points are IO_COMPLETION, SOCKET_WRITE, SHARD_QUEUE and SNAPSHOT_SERIALIZE.",
+        "    RESET disables all of them. Without arguments, shows the delays.",
+        "    Needs a debug build, or a build with -DDF_FAULT_INJECTION=ON.",
+        "SNAPSHOTBENCH [RDB]",
+        "    Save and reload the dataset, like RELOAD, and report the throughput and the time",
+        "    spent in every stage of the save and of the load. Saves a dragonfly snapshot",
+        "    unless RDB is given.",
         "REPLICA PAUSE/RESUME",
         "    Stops replica from reconnecting to master, or resumes",
         "WATCHED",
         "    Shows the watched keys as a result of BLPOP and similar operations."
-        "POPULATE <count> [<prefix>] [<size>]",
+        "POPULATE <count> [<prefix>] [<size>] [RAND] [TYPE <type>] [ELEMENTS <min> [<max>]]",
+        "         [SIZE <min> [<max>]] [EXPIRE <min> [<max>]]",
         "    Create <count> string keys named key:<num>. If <prefix> is specified then",
-        "    it is used instead of the 'key' prefix.",
+        "    it is used instead of the 'key' prefix. The options, which follow <size>, are:",
+        "    * RAND: fills the values with random letters instead of 'x'.",
+        "    * TYPE: STRING, HASH, SET, ZSET, LIST, JSON or STREAM.",
+        "    * ELEMENTS: the number of the elements of every key of the other types.",
+        "    * SIZE: the size of the values, or of the elements, instead of <size>.",
+        "    * EXPIRE: the keys expire in that many seconds.",
         "HELP",
         "    Prints this help.",
     };
@@ -115,10 +198,18 @@ void DebugCmd::Run(CmdArgList args) {
     return Reload(args);
   }
 
+  if (subcmd == "SNAPSHOTBENCH") {
+    return SnapshotBench(args);
+  }
+
   if (subcmd == "REPLICA" && args.size() == 3) {
     return Replica(args);
   }
 
+  if (subcmd == "INJECT") {
+    return Inject(args);
+  }
+
   if (subcmd == "WATCHED") {
     return Watched();
   }
@@ -181,11 +272,64 @@ void DebugCmd::Replica(CmdArgList args) {
   return (*cntx_)->SendError(UnknownSubCmd("replica", "DEBUG"));
 }
 
+void DebugCmd::Inject(CmdArgList args) {
+  if (!kFaultInjection) {
+    return (*cntx_)->SendError("DEBUG INJECT is not compiled in, see DF_FAULT_INJECTION");
+  }
+
+  args.remove_prefix(2);
+  if (args.empty()) {
+    (*cntx_)->StartArray(kNumFaultPoints);
+    for (unsigned i = 0; i < kNumFaultPoints; ++i) {
+      FaultInfo info = GetFault(FaultPoint(i));
+      (*cntx_)->SendSimpleString(absl::StrCat(FaultPointName(FaultPoint(i)),
+                                              " delay_usec=", info.delay_usec, " every=",
+                                              info.every, " injected=", info.injected));
+    }
+    return;
+  }
+
+  ToUpper(&args[0]);
+  if (args.size() == 1 && ArgS(args, 0) == "RESET") {
+    ResetFaults();
+    return (*cntx_)->SendOk();
+  }
+
+  if (args.size() != 2 && args.size() != 4)
+    return (*cntx_)->SendError(kSyntaxErr);
+
+  optional<FaultPoint> point = ParseFaultPoint(ArgS(args, 0));
+  if (!point)
+    return (*cntx_)->SendError(absl::StrCat("Unknown fault point ", ArgS(args, 0)));
+
+  uint32_t delay_usec = 0, every = 1;
+  if (!absl::SimpleAtoi(ArgS(args, 1), &delay_usec))
+    return (*cntx_)->SendError(kUintErr);
+
+  if (args.size() == 4) {
+    ToUpper(&args[2]);
+    if (ArgS(args, 2) != "EVERY")
+      return (*cntx_)->SendError(kSyntaxErr);
+    if (!absl::SimpleAtoi(ArgS(args, 3), &every) || every == 0)
+      return (*cntx_)->SendError(kUintErr);
+  }
+
+  SetFault(*point, delay_usec, every);
+  (*cntx_)->SendOk();
+}
+
 void DebugCmd::Load(string_view filename) {
+  if (GenericError ec = LoadFile(filename); ec) {
+    return (*cntx_)->SendError(ec.Format());
+  }
+  (*cntx_)->SendOk();
+}
+
+GenericError DebugCmd::LoadFile(string_view filename) {
   GlobalState new_state = sf_.service().SwitchState(GlobalState::ACTIVE, GlobalState::LOADING);
   if (new_state != GlobalState::LOADING) {
     LOG(WARNING) << GlobalStateName(new_state) << " in progress, ignored";
-    return;
+    return GenericError(make_error_code(errc::operation_in_progress), GlobalStateName(new_state));
   }
 
   absl::Cleanup rev_state = [this] {
@@ -215,31 +359,141 @@ void DebugCmd::Load(string_view filename) {
     ec = fut_ec.get();
     if (ec) {
       LOG(INFO) << "Could not load file " << ec.message();
-      return (*cntx_)->SendError(ec.message());
+      return ec;
     }
   }
 
-  (*cntx_)->SendOk();
+  return {};
+}
+
+void DebugCmd::SnapshotBench(CmdArgList args) {
+  bool new_version = true;
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (opt == "RDB") {
+      new_version = false;
+    } else {
+      return (*cntx_)->SendError(kSyntaxErr);
+    }
+  }
+
+  using Stage = SnapshotStages::Stage;
+  auto cpu_ns = [] {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    auto to_ns = [](const timeval& tv) {
+      return uint64_t(tv.tv_sec) * 1'000'000'000 + uint64_t(tv.tv_usec) * 1000;
+    };
+    return to_ns(ru.ru_utime) + to_ns(ru.ru_stime);
+  };
+
+  vector<string> lines;
+  auto report = [&](string_view phase, uint64_t wall_ns, uint64_t cpu, uint64_t bytes,
+                    const SnapshotStages::Totals& totals, Stage first, Stage last) {
+    lines.push_back(absl::StrFormat("%s: %.3f sec, %.3f GB/s, cpu %.3f sec, %u bytes", phase,
+                                    wall_ns / 1e9, double(bytes) / max<uint64_t>(wall_ns, 1),
+                                    cpu / 1e9, bytes));
+    for (unsigned i = first; i <= last; ++i) {
+      string line = absl::StrFormat("%s.%s: %.3f sec", phase, SnapshotStages::Name(Stage(i)),
+                                    totals.ns[i] / 1e9);
+      if (totals.bytes[i] > 0) {
+        absl::StrAppendFormat(&line, ", %.3f GB/s",
+                              double(totals.bytes[i]) / max<uint64_t>(totals.ns[i], 1));
+      }
+      lines.push_back(std::move(line));
+    }
+  };
+
+  SnapshotStages::Enable(true);
+  absl::Cleanup disable = [] { SnapshotStages::Enable(false); };
+
+  const CommandId* cid = sf_.service().FindCmd("SAVE");
+  CHECK_NOTNULL(cid);
+  intrusive_ptr<Transaction> trans(new Transaction{cid});
+  trans->InitByArgs(0, {});
+
+  uint64_t start_ns = absl::GetCurrentTimeNanos(), start_cpu = cpu_ns();
+  if (GenericError ec = sf_.DoSave(new_version, trans.get()); ec) {
+    return (*cntx_)->SendError(ec.Format());
+  }
+  uint64_t save_ns = absl::GetCurrentTimeNanos() - start_ns, save_cpu = cpu_ns() - start_cpu;
+  SnapshotStages::Totals save_totals = SnapshotStages::Read();
+
+  SnapshotStages::Enable(true);
+  start_ns = absl::GetCurrentTimeNanos();
+  start_cpu = cpu_ns();
+  if (GenericError ec = LoadFile(sf_.GetLastSaveInfo()->file_name); ec) {
+    return (*cntx_)->SendError(ec.Format());
+  }
+  uint64_t load_ns = absl::GetCurrentTimeNanos() - start_ns, load_cpu = cpu_ns() - start_cpu;
+  SnapshotStages::Totals load_totals = SnapshotStages::Read();
+
+  report("save", save_ns, save_cpu, save_totals.bytes[SnapshotStages::WRITE], save_totals,
+         SnapshotStages::TRAVERSE, SnapshotStages::WRITE);
+  report("load", load_ns, load_cpu, load_totals.bytes[SnapshotStages::READ], load_totals,
+         SnapshotStages::READ, SnapshotStages::INSERT);
+
+  (*cntx_)->StartArray(lines.size());
+  for (const auto& line : lines) {
+    (*cntx_)->SendSimpleString(line);
+  }
 }
 
 void DebugCmd::Populate(CmdArgList args) {
-  if (args.size() < 3 || args.size() > 5) {
+  if (args.size() < 3) {
     return (*cntx_)->SendError(UnknownSubCmd("populate", "DEBUG"));
   }
 
   uint64_t total_count = 0;
   if (!absl::SimpleAtoi(ArgS(args, 2), &total_count))
     return (*cntx_)->SendError(kUintErr);
-  std::string_view prefix{"key"};
 
+  PopulateOptions options;
   if (args.size() > 3) {
-    prefix = ArgS(args, 3);
+    options.prefix = ArgS(args, 3);
   }
-  uint32_t val_size = 0;
   if (args.size() > 4) {
     std::string_view str = ArgS(args, 4);
-    if (!absl::SimpleAtoi(str, &val_size))
+    if (!absl::SimpleAtoi(str, &options.val_size))
       return (*cntx_)->SendError(kUintErr);
+    options.val_size_max = options.val_size;
+  }
+
+  for (size_t i = 5; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+
+    // Parses <min> [<max>] into min and max.
+    auto parse_range = [&](uint32_t* min, uint32_t* max) {
+      if (i + 1 == args.size() || !absl::SimpleAtoi(ArgS(args, i + 1), min))
+        return false;
+      ++i;
+      *max = *min;
+      if (i + 1 < args.size() && absl::SimpleAtoi(ArgS(args, i + 1), max))
+        ++i;
+      return *min <= *max;
+    };
+
+    bool valid = true;
+    if (opt == "RAND") {
+      options.random_values = true;
+    } else if (opt == "TYPE" && i + 1 < args.size()) {
+      ToUpper(&args[++i]);
+      options.type = ArgS(args, i);
+      valid = find(begin(kPopulateTypes), end(kPopulateTypes), options.type) != end(kPopulateTypes);
+    } else if (opt == "ELEMENTS") {
+      valid = parse_range(&options.elements, &options.elements_max) && options.elements > 0;
+    } else if (opt == "SIZE") {
+      valid = parse_range(&options.val_size, &options.val_size_max);
+    } else if (opt == "EXPIRE") {
+      valid = parse_range(&options.expire_sec, &options.expire_sec_max) && options.expire_sec > 0;
+    } else {
+      valid = false;
+    }
+
+    if (!valid)
+      return (*cntx_)->SendError(kSyntaxErr);
   }
 
   ProactorPool& pp = sf_.service().proactor_pool();
@@ -259,8 +513,8 @@ void DebugCmd::Populate(CmdArgList args) {
     auto range = ranges[i];
 
     // whatever we do, we should not capture i by reference.
-    fb_arr[i] = pp.at(i)->LaunchFiber([range, prefix, val_size, this] {
-      this->PopulateRangeFiber(range.first, range.second, prefix, val_size);
+    fb_arr[i] = pp.at(i)->LaunchFiber([range, &options, this] {
+      this->PopulateRangeFiber(range.first, range.second, options);
     });
   }
   for (auto& fb : fb_arr)
@@ -269,17 +523,20 @@ void DebugCmd::Populate(CmdArgList args) {
   (*cntx_)->SendOk();
 }
 
-void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix,
-                                  unsigned value_len) {
+void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, const PopulateOptions& options) {
   this_fiber::properties<FiberProps>().set_name("populate_range");
   VLOG(1) << "PopulateRange: " << from << "-" << (from + len - 1);
 
-  string key = absl::StrCat(prefix, ":");
+  // json documents are kept as strings, and are populated in the same batches.
+  if (options.type != "STRING" && options.type != "JSON") {
+    return PopulateTypedRange(from, len, options);
+  }
+
+  string key = absl::StrCat(options.prefix, ":");
   size_t prefsize = key.size();
   DbIndex db_indx = cntx_->db_index();
   EngineShardSet& ess = *shard_set;
   std::vector<PopulateBatch> ps(ess.size(), PopulateBatch{db_indx});
-  SetCmd::SetParams params;
 
   for (uint64_t i = from; i < from + len; ++i) {
     StrAppend(&key, i);
@@ -289,8 +546,8 @@ void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view
     auto& shard_batch = ps[sid];
     shard_batch.index[shard_batch.sz++] = i;
     if (shard_batch.sz == 32) {
-      ess.Add(sid, [=] {
-        DoPopulateBatch(prefix, value_len, params, shard_batch);
+      ess.Add(sid, [=, &options] {
+        DoPopulateBatch(options, shard_batch);
         if (i % 50 == 0) {
           this_fiber::yield();
         }
@@ -301,9 +558,52 @@ void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view
     }
   }
 
-  ess.RunBlockingInParallel([&](EngineShard* shard) {
-    DoPopulateBatch(prefix, value_len, params, ps[shard->shard_id()]);
-  });
+  ess.RunBlockingInParallel(
+      [&](EngineShard* shard) { DoPopulateBatch(options, ps[shard->shard_id()]); });
+}
+
+void DebugCmd::PopulateTypedRange(uint64_t from, uint64_t len, const PopulateOptions& options) {
+  journal::JournalExecutor executor(&sf_.service());
+  DbIndex db_indx = cntx_->db_index();
+  vector<string> cmd;
+  CmdArgVec cmd_args;
+
+  auto execute = [&] {
+    cmd_args.clear();
+    for (auto& s : cmd)
+      cmd_args.emplace_back(s);
+    executor.Execute(db_indx, {cmd_args.data(), cmd_args.size()});
+  };
+
+  for (uint64_t i = from; i < from + len; ++i) {
+    default_random_engine rnd(i);
+    string key = absl::StrCat(options.prefix, ":", i);
+    uint32_t elements = DrawUniform(options.elements, options.elements_max, &rnd);
+
+    if (options.type == "STREAM") {
+      for (uint32_t j = 0; j < elements; ++j) {
+        cmd = {"XADD", key, "*", "field", PopulateValue(options, absl::StrCat("value:", j), &rnd)};
+        execute();
+      }
+    } else {
+      static const absl::flat_hash_map<string_view, string_view> kTypeCmds = {
+          {"HASH", "HSET"}, {"SET", "SADD"}, {"ZSET", "ZADD"}, {"LIST", "RPUSH"}};
+      cmd = {string(kTypeCmds.at(options.type)), key};
+      for (uint32_t j = 0; j < elements; ++j) {
+        if (options.type == "HASH")
+          cmd.push_back(absl::StrCat("field:", j));
+        else if (options.type == "ZSET")
+          cmd.push_back(absl::StrCat(j));
+        cmd.push_back(PopulateValue(options, absl::StrCat("value:", j), &rnd));
+      }
+      execute();
+    }
+
+    if (uint64_t expire_ms = PopulateExpireMs(options, &rnd); expire_ms) {
+      cmd = {"PEXPIRE", key, absl::StrCat(expire_ms)};
+      execute();
+    }
+  }
 }
 
 void DebugCmd::Inspect(string_view key) {
@@ -312,9 +612,7 @@ void DebugCmd::Inspect(string_view key) {
 
   auto cb = [&]() -> ObjInfo {
     auto& db_slice = EngineShard::tlocal()->db_slice();
-    auto [pt, exp_t] = db_slice.GetTables(cntx_->db_index());
-
-    PrimeIterator it = pt->Find(key);
+    PrimeIterator it = db_slice.GetPrimeTable(cntx_->db_index())->Find(key);
     ObjInfo oinfo;
     if (IsValid(it)) {
       oinfo.found = true;
@@ -322,12 +620,9 @@ void DebugCmd::Inspect(string_view key) {
       oinfo.bucket_id = it.bucket_id();
       oinfo.slot_id = it.slot_id();
       if (it->second.HasExpire()) {
-        ExpireIterator exp_it = exp_t->Find(it->first);
-        CHECK(!exp_it.is_done());
-
-        time_t exp_time = db_slice.ExpireTime(exp_it);
+        time_t exp_time = db_slice.ExpireTime(it);
         oinfo.ttl = exp_time - GetCurrentTimeMs();
-        oinfo.has_sec_precision = exp_it->second.is_second_precision();
+        oinfo.has_sec_precision = it->second.expire_period().is_second_precision();
       }
     }
 
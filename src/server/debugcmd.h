@@ -10,6 +10,7 @@ namespace dfly {
 
 class EngineShardSet;
 class ServerFamily;
+struct PopulateOptions;
 
 class DebugCmd {
  public:
@@ -19,10 +20,18 @@ class DebugCmd {
 
  private:
   void Populate(CmdArgList args);
-  void PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix, unsigned value_len);
+  void PopulateRangeFiber(uint64_t from, uint64_t len, const PopulateOptions& options);
+
+  // Populates the keys of the types other than strings, by running a command per key.
+  void PopulateTypedRange(uint64_t from, uint64_t len, const PopulateOptions& options);
   void Reload(CmdArgList args);
+  void SnapshotBench(CmdArgList args);
   void Replica(CmdArgList args);
+  void Inject(CmdArgList args);
   void Load(std::string_view filename);
+
+  // Replaces the dataset with the snapshot in filename, or in the default file if it is empty.
+  GenericError LoadFile(std::string_view filename);
   void Inspect(std::string_view key);
   void Watched();
 
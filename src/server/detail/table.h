@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <cstring>
+
 #include "core/compact_object.h"
 #include "core/dash.h"
 #include "core/expire_period.h"
@@ -13,10 +15,49 @@ namespace dfly {
 namespace detail {
 
 using PrimeKey = CompactObj;
-using PrimeValue = CompactObj;
+
+// The values of the prime table carry the deadline of their key, so that the lookups check the
+// expiry without another table. The deadline is relative to one of the expire bases of DbSlice
+// and is meaningful only when HasExpire() is set. Moves carry it along with the value.
+class PrimeValue : public CompactObj {
+ public:
+  using CompactObj::CompactObj;
+
+  PrimeValue() = default;
+
+  PrimeValue(CompactObj&& o) noexcept : CompactObj(std::move(o)) {
+  }
+
+  PrimeValue(PrimeValue&& o) noexcept = default;
+  PrimeValue& operator=(PrimeValue&& o) noexcept = default;
+
+  // Keeps the deadline of this value.
+  PrimeValue& operator=(CompactObj&& o) noexcept {
+    CompactObj::operator=(std::move(o));
+    return *this;
+  }
+
+  ExpirePeriod expire_period() const {
+    ExpirePeriod res;
+    memcpy(&res, expire_, sizeof(res));
+    return res;
+  }
+
+  void set_expire_period(ExpirePeriod period) {
+    memcpy(expire_, &period, sizeof(period));
+  }
+
+ private:
+  // Unaligned, so that the slots of the prime table grow by 4 bytes only.
+  uint8_t expire_[sizeof(ExpirePeriod)] = {0};
+};
+
+static_assert(sizeof(PrimeValue) == sizeof(CompactObj) + sizeof(ExpirePeriod));
 
 struct PrimeTablePolicy {
-  enum { kSlotNum = 14, kBucketNum = 56, kStashBucketNum = 4 };
+  // 51 buckets keep the segment below 32KB, which is a good size for mimalloc, with the
+  // deadlines in the values.
+  enum { kSlotNum = 14, kBucketNum = 51, kStashBucketNum = 4 };
 
   static constexpr bool kUseVersion = true;
 
@@ -45,7 +86,7 @@ struct PrimeTablePolicy {
   }
 };
 
-struct ExpireTablePolicy {
+struct McFlagTablePolicy {
   enum { kSlotNum = 14, kBucketNum = 56, kStashBucketNum = 4 };
   static constexpr bool kUseVersion = false;
 
@@ -57,9 +98,6 @@ struct ExpireTablePolicy {
     cs.Reset();
   }
 
-  static void DestroyValue(ExpirePeriod e) {
-  }
-
   static void DestroyValue(uint32_t val) {
   }
 
@@ -0,0 +1,536 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// A load generator that drives a redis-compatible server from every thread of a proactor pool.
+// Every thread opens --c connections, and every connection sends --pipeline requests at a time,
+// picked by --ratio out of SET and GET, or the --command template. --qps caps the rate of the
+// requests, to measure the server under a steady load. For example:
+//   dfly_bench --h localhost --p 6379 --c 20 --pipeline 10 --test_time 30 --key_dist zipf
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/operations.hpp>
+#include <iostream>
+#include <random>
+
+#include "base/init.h"
+#include "base/zipf_gen.h"
+#include "core/latency_histogram.h"
+#include "facade/redis_parser.h"
+#include "facade/reply_builder.h"
+#include "util/epoll/epoll_pool.h"
+#include "util/uring/uring_pool.h"
+
+ABSL_FLAG(std::string, h, "localhost", "Server host");
+ABSL_FLAG(uint16_t, p, 6379, "Server port");
+ABSL_FLAG(uint32_t, c, 10, "Number of connections per thread");
+ABSL_FLAG(uint32_t, pipeline, 1, "Number of requests a connection sends before it reads replies");
+ABSL_FLAG(uint64_t, n, 0,
+          "Number of requests per connection. If 0, the connections run for --test_time seconds");
+ABSL_FLAG(uint32_t, test_time, 10, "Duration of the run in seconds, if --n is 0");
+ABSL_FLAG(uint64_t, qps, 0,
+          "Requests per second of all the connections together. If 0, the connections send "
+          "as fast as the server replies");
+ABSL_FLAG(std::string, ratio, "1:10", "The ratio of SET to GET requests, as set:get");
+ABSL_FLAG(std::string, command, "",
+          "If set, the command to send instead of the SET/GET mix, with __key__ and __data__ "
+          "standing for the generated key and value. For example \"HSET __key__ f __data__\"");
+ABSL_FLAG(std::string, key_dist, "uniform",
+          "Distribution of the keys: uniform, zipf or sequential");
+ABSL_FLAG(double, zipf_alpha, 0.99, "Skew of the zipf distribution of the keys");
+ABSL_FLAG(uint64_t, key_minimum, 0, "The lowest key index");
+ABSL_FLAG(uint64_t, key_maximum, 1000000, "The highest key index");
+ABSL_FLAG(std::string, key_prefix, "key:", "Prefix of the generated keys");
+ABSL_FLAG(uint32_t, key_hashtags, 0,
+          "If positive, spreads the keys over this many hashtags, so that on a cluster a "
+          "pipeline can be routed to few slots");
+ABSL_FLAG(uint32_t, d, 16, "Size of the values in bytes");
+ABSL_FLAG(bool, server_info, true,
+          "Whether to fetch INFO before and after the run and print the server side deltas");
+ABSL_FLAG(bool, force_epoll, false, "If true, uses epoll api instead iouring to run the load");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using namespace facade;
+using absl::GetFlag;
+using absl::StrCat;
+using boost::asio::ip::tcp;
+namespace fibers = ::boost::fibers;
+
+namespace {
+
+enum class KeyDist { UNIFORM, ZIPF, SEQUENTIAL };
+
+struct BenchConfig {
+  tcp::endpoint endpoint;
+  uint64_t num_requests = 0;
+  uint64_t deadline_ns = 0;
+  uint64_t conn_qps = 0;  // 0 if unlimited.
+  unsigned pipeline = 1;
+  unsigned set_weight = 1;
+  unsigned get_weight = 10;
+  string command;
+  KeyDist key_dist = KeyDist::UNIFORM;
+  uint64_t key_min = 0;
+  uint64_t key_max = 0;
+  uint32_t key_hashtags = 0;
+  string key_prefix;
+  string value;
+};
+
+// Per thread counters, merged after the run.
+struct BenchStats {
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  LatencyHistogram latency;
+
+  BenchStats& operator+=(const BenchStats& o) {
+    requests += o.requests;
+    errors += o.errors;
+    hits += o.hits;
+    misses += o.misses;
+    latency.Merge(o.latency);
+    return *this;
+  }
+};
+
+int ResolveDns(std::string_view host, char* dest) {
+  struct addrinfo hints, *servinfo;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  int res = getaddrinfo(string(host).c_str(), NULL, &hints, &servinfo);
+  if (res != 0)
+    return res;
+
+  res = EAI_FAMILY;
+  for (addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
+    if (p->ai_family == AF_INET) {
+      struct sockaddr_in* ipv4 = (struct sockaddr_in*)p->ai_addr;
+      CHECK_NOTNULL(inet_ntop(p->ai_family, &ipv4->sin_addr, dest, INET6_ADDRSTRLEN));
+      res = 0;
+      break;
+    }
+  }
+
+  freeaddrinfo(servinfo);
+  return res;
+}
+
+class KeyGenerator {
+ public:
+  KeyGenerator(const BenchConfig& config, uint64_t seed);
+
+  string Next();
+
+ private:
+  const BenchConfig& config_;
+  default_random_engine rnd_;
+  uniform_int_distribution<uint64_t> uniform_;
+  unique_ptr<base::ZipfianGenerator> zipf_;
+  uint64_t seq_;
+};
+
+KeyGenerator::KeyGenerator(const BenchConfig& config, uint64_t seed)
+    : config_(config), rnd_(seed), uniform_(config.key_min, config.key_max) {
+  if (config.key_dist == KeyDist::ZIPF) {
+    zipf_.reset(
+        new base::ZipfianGenerator(config.key_min, config.key_max, GetFlag(FLAGS_zipf_alpha)));
+  }
+
+  // Every connection starts at its own offset so that they do not write the same keys in lock
+  // step.
+  seq_ = config.key_min + seed % (config.key_max - config.key_min + 1);
+}
+
+string KeyGenerator::Next() {
+  uint64_t index;
+  switch (config_.key_dist) {
+    case KeyDist::UNIFORM:
+      index = uniform_(rnd_);
+      break;
+    case KeyDist::ZIPF:
+      index = zipf_->Next(rnd_);
+      break;
+    case KeyDist::SEQUENTIAL:
+      index = seq_;
+      seq_ = seq_ == config_.key_max ? config_.key_min : seq_ + 1;
+      break;
+  }
+
+  if (config_.key_hashtags == 0)
+    return StrCat(config_.key_prefix, index);
+
+  return StrCat("{", config_.key_prefix, index % config_.key_hashtags, "}", index);
+}
+
+// A connection that keeps a window of config.pipeline requests in flight.
+class Driver {
+ public:
+  Driver(const BenchConfig& config, uint64_t seed, BenchStats* stats)
+      : config_(config), stats_(stats), keys_(config, seed), rnd_(seed) {
+  }
+
+  error_code Connect();
+  error_code Run();
+
+ private:
+  enum CmdType { SET, GET, CUSTOM };
+
+  // Appends the next request to batch.
+  CmdType AppendRequest(string* batch);
+
+  // Reads the replies to the last batch of requests, sent at start_ns.
+  error_code ReadReplies(const vector<CmdType>& types, uint64_t start_ns);
+
+  const BenchConfig& config_;
+  BenchStats* stats_;
+  KeyGenerator keys_;
+  default_random_engine rnd_;
+  unique_ptr<FiberSocketBase> sock_;
+  RedisParser parser_{false};
+  base::IoBuf io_buf_{1024};
+  RespVec resp_args_;
+};
+
+error_code Driver::Connect() {
+  sock_.reset(ProactorBase::me()->CreateSocket());
+  return sock_->Connect(config_.endpoint);
+}
+
+auto Driver::AppendRequest(string* batch) -> CmdType {
+  string key = keys_.Next();
+  if (!config_.command.empty()) {
+    absl::StrAppend(batch, absl::StrReplaceAll(config_.command,
+                                               {{"__key__", key}, {"__data__", config_.value}}));
+    return CUSTOM;
+  }
+
+  unsigned total = config_.set_weight + config_.get_weight;
+  if (rnd_() % total < config_.set_weight) {
+    absl::StrAppend(batch, "SET ", key, " ", config_.value);
+    return SET;
+  }
+
+  absl::StrAppend(batch, "GET ", key);
+  return GET;
+}
+
+error_code Driver::Run() {
+  ReqSerializer serializer{sock_.get()};
+  ProactorBase* proactor = sock_->proactor();
+  vector<CmdType> types;
+  string batch;
+  uint64_t next_send_ns = proactor->GetMonotonicTimeNs();
+
+  for (uint64_t sent = 0;;) {
+    if (config_.num_requests ? sent >= config_.num_requests
+                             : proactor->GetMonotonicTimeNs() >= config_.deadline_ns)
+      break;
+
+    unsigned count = config_.pipeline;
+    if (config_.num_requests)
+      count = min<uint64_t>(count, config_.num_requests - sent);
+
+    // Paces the batches, without making up for the time lost to slow replies.
+    if (config_.conn_qps) {
+      uint64_t now = proactor->GetMonotonicTimeNs();
+      if (now < next_send_ns)
+        boost::this_fiber::sleep_for(chrono::nanoseconds(next_send_ns - now));
+      next_send_ns = max(now, next_send_ns) + count * 1000000000ULL / config_.conn_qps;
+    }
+
+    batch.clear();
+    types.clear();
+    for (unsigned i = 0; i < count; ++i) {
+      if (i > 0)
+        batch.append("\r\n");
+      types.push_back(AppendRequest(&batch));
+    }
+
+    uint64_t start_ns = proactor->GetMonotonicTimeNs();
+    serializer.SendCommand(batch);
+    if (serializer.ec())
+      return serializer.ec();
+
+    if (auto ec = ReadReplies(types, start_ns); ec)
+      return ec;
+    sent += count;
+  }
+
+  return error_code{};
+}
+
+error_code Driver::ReadReplies(const vector<CmdType>& types, uint64_t start_ns) {
+  ProactorBase* proactor = sock_->proactor();
+  uint32_t consumed = 0;
+
+  for (size_t replies = 0; replies < types.size();) {
+    RedisParser::Result result = parser_.Parse(io_buf_.InputBuffer(), &consumed, &resp_args_);
+    io_buf_.ConsumeInput(consumed);
+
+    if (result == RedisParser::OK && !resp_args_.empty()) {
+      uint64_t now = proactor->GetMonotonicTimeNs();
+      stats_->latency.Add((now - start_ns) / 1000);
+      ++stats_->requests;
+
+      const RespExpr& reply = resp_args_.front();
+      if (reply.type == RespExpr::ERROR) {
+        ++stats_->errors;
+        LOG_FIRST_N(WARNING, 10) << "Error reply " << ToSV(reply.GetBuf());
+      } else if (types[replies] == GET) {
+        ++(reply.type == RespExpr::NIL ? stats_->misses : stats_->hits);
+      }
+      ++replies;
+      continue;
+    }
+
+    if (result != RedisParser::INPUT_PENDING) {
+      LOG(ERROR) << "Invalid parser status " << result;
+      return make_error_code(errc::bad_message);
+    }
+
+    io::MutableBytes buf = io_buf_.AppendBuffer();
+    io::Result<size_t> size_res = sock_->Recv(buf);
+    if (!size_res)
+      return size_res.error();
+    io_buf_.CommitWrite(*size_res);
+  }
+
+  return error_code{};
+}
+
+// Returns the fields of INFO ALL, or an empty map if the server did not reply.
+absl::flat_hash_map<string, string> FetchInfo(const tcp::endpoint& endpoint) {
+  absl::flat_hash_map<string, string> res;
+  unique_ptr<FiberSocketBase> sock(ProactorBase::me()->CreateSocket());
+  if (auto ec = sock->Connect(endpoint); ec) {
+    LOG(ERROR) << "Could not connect to fetch INFO: " << ec.message();
+    return res;
+  }
+
+  ReqSerializer serializer{sock.get()};
+  serializer.SendCommand("INFO ALL");
+  if (serializer.ec())
+    return res;
+
+  RedisParser parser{false};
+  base::IoBuf io_buf{4096};
+  RespVec args;
+  uint32_t consumed = 0;
+  while (true) {
+    io::MutableBytes buf = io_buf.AppendBuffer();
+    io::Result<size_t> size_res = sock->Recv(buf);
+    if (!size_res)
+      return res;
+    io_buf.CommitWrite(*size_res);
+
+    RedisParser::Result result = parser.Parse(io_buf.InputBuffer(), &consumed, &args);
+    if (result == RedisParser::OK && !args.empty())
+      break;
+    if (result != RedisParser::INPUT_PENDING)
+      return res;
+    io_buf.ConsumeInput(consumed);
+  }
+
+  if (args.front().type != RespExpr::STRING)
+    return res;
+
+  for (string_view line : absl::StrSplit(ToSV(args.front().GetBuf()), "\r\n")) {
+    size_t pos = line.find(':');
+    if (line.empty() || line[0] == '#' || pos == string_view::npos)
+      continue;
+    res.emplace(line.substr(0, pos), line.substr(pos + 1));
+  }
+  return res;
+}
+
+// Prints the difference of the numeric fields that tell what the run cost the server.
+void PrintInfoDelta(const absl::flat_hash_map<string, string>& before,
+                    const absl::flat_hash_map<string, string>& after, double elapsed_sec,
+                    uint64_t requests) {
+  auto get = [](const auto& info, string_view name, double* dest) {
+    auto it = info.find(name);
+    return it != info.end() && absl::SimpleAtod(it->second, dest);
+  };
+
+  auto delta = [&](string_view name, double* dest) {
+    double b, a;
+    if (!get(before, name, &b) || !get(after, name, &a))
+      return false;
+    *dest = a - b;
+    return true;
+  };
+
+  double val;
+  cout << "\nServer:\n";
+  if (delta("total_commands_processed", &val))
+    cout << "  commands: " << uint64_t(val) << ", " << uint64_t(val / elapsed_sec) << " per sec\n";
+
+  double user, sys;
+  if (delta("used_cpu_user", &user) && delta("used_cpu_sys", &sys)) {
+    cout << "  cpu: " << user + sys << " sec, "
+         << (requests ? (user + sys) * 1e6 / requests : 0) << " usec per request\n";
+  }
+
+  for (string_view name : {"tx_hops", "tx_cross_shard_hops", "total_net_input_bytes",
+                           "total_net_output_bytes", "keyspace_hits", "keyspace_misses"}) {
+    if (delta(name, &val))
+      cout << "  " << name << ": " << uint64_t(val) << "\n";
+  }
+
+  for (string_view name : {"used_memory", "shard_hops_imbalance", "shard_memory_imbalance"}) {
+    if (get(after, name, &val))
+      cout << "  " << name << ": " << val << "\n";
+  }
+}
+
+void PrintReport(const BenchStats& stats, double elapsed_sec) {
+  const LatencyHistogram& lat = stats.latency;
+  cout << "Requests: " << stats.requests << " in " << elapsed_sec << " sec, "
+       << uint64_t(stats.requests / elapsed_sec) << " per sec\n";
+  cout << "Errors: " << stats.errors << "\n";
+  if (stats.hits + stats.misses > 0) {
+    cout << "GET hits: " << stats.hits << ", misses: " << stats.misses << ", hit ratio: "
+         << double(stats.hits) / (stats.hits + stats.misses) << "\n";
+  }
+
+  cout << "Latency usec: avg " << (lat.count() ? lat.sum() / lat.count() : 0) << ", p50 "
+       << lat.Percentile(50) << ", p99 " << lat.Percentile(99) << ", p99.9 "
+       << lat.Percentile(99.9) << ", max " << lat.max() << "\n";
+}
+
+bool ParseConfig(BenchConfig* config) {
+  config->num_requests = GetFlag(FLAGS_n);
+  config->pipeline = max(1u, GetFlag(FLAGS_pipeline));
+  config->command = GetFlag(FLAGS_command);
+  config->key_min = GetFlag(FLAGS_key_minimum);
+  config->key_max = GetFlag(FLAGS_key_maximum);
+  config->key_hashtags = GetFlag(FLAGS_key_hashtags);
+  config->key_prefix = GetFlag(FLAGS_key_prefix);
+  config->value.assign(GetFlag(FLAGS_d), 'x');
+
+  if (config->key_min > config->key_max) {
+    LOG(ERROR) << "--key_minimum must not exceed --key_maximum";
+    return false;
+  }
+
+  string key_dist = GetFlag(FLAGS_key_dist);
+  if (key_dist == "uniform") {
+    config->key_dist = KeyDist::UNIFORM;
+  } else if (key_dist == "zipf") {
+    config->key_dist = KeyDist::ZIPF;
+  } else if (key_dist == "sequential") {
+    config->key_dist = KeyDist::SEQUENTIAL;
+  } else {
+    LOG(ERROR) << "Unknown --key_dist " << key_dist;
+    return false;
+  }
+
+  vector<string> ratio = absl::StrSplit(GetFlag(FLAGS_ratio), ':');
+  if (ratio.size() != 2 || !absl::SimpleAtoi(ratio[0], &config->set_weight) ||
+      !absl::SimpleAtoi(ratio[1], &config->get_weight) ||
+      config->set_weight + config->get_weight == 0) {
+    LOG(ERROR) << "--ratio must be set:get, for example 1:10";
+    return false;
+  }
+
+  char ip_addr[INET6_ADDRSTRLEN];
+  string host = GetFlag(FLAGS_h);
+  if (int res = ResolveDns(host, ip_addr); res != 0) {
+    LOG(ERROR) << "Dns error " << gai_strerror(res) << ", host: " << host;
+    return false;
+  }
+  config->endpoint = {boost::asio::ip::make_address(ip_addr), GetFlag(FLAGS_p)};
+
+  return true;
+}
+
+}  // namespace
+
+}  // namespace dfly
+
+using namespace dfly;
+using namespace util;
+
+int main(int argc, char* argv[]) {
+  absl::SetProgramUsageMessage("usage: dfly_bench [options]");
+  MainInitGuard guard(&argc, &argv);
+
+  BenchConfig config;
+  if (!ParseConfig(&config))
+    return 1;
+
+  unique_ptr<ProactorPool> pool;
+  if (GetFlag(FLAGS_force_epoll)) {
+    pool.reset(new epoll::EpollPool);
+  } else {
+    pool.reset(new uring::UringPool(1024));
+  }
+  pool->Run();
+
+  absl::flat_hash_map<string, string> info_before;
+  if (GetFlag(FLAGS_server_info)) {
+    info_before = pool->GetNextProactor()->Await([&] { return FetchInfo(config.endpoint); });
+  }
+
+  vector<BenchStats> stats(pool->size());
+  unsigned num_conns = GetFlag(FLAGS_c);
+  if (uint64_t qps = GetFlag(FLAGS_qps); qps) {
+    config.conn_qps = max<uint64_t>(qps / (pool->size() * num_conns), 1);
+  }
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  config.deadline_ns = start_ns + uint64_t(GetFlag(FLAGS_test_time)) * 1000000000;
+
+  LOG(INFO) << "Running " << pool->size() * num_conns << " connections against "
+               << config.endpoint;
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* proactor) {
+    vector<fibers::fiber> fbs;
+    for (unsigned i = 0; i < num_conns; ++i) {
+      uint64_t seed = uint64_t(index) * num_conns + i;
+      fbs.emplace_back([&, seed] {
+        Driver driver(config, seed, &stats[index]);
+        error_code ec = driver.Connect();
+        if (!ec)
+          ec = driver.Run();
+        if (ec)
+          LOG(ERROR) << "Connection " << seed << " failed: " << ec.message();
+      });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+  });
+
+  uint64_t end_ns = ProactorBase::GetMonotonicTimeNs();
+  double elapsed_sec = double(end_ns - start_ns) / 1e9;
+
+  BenchStats total;
+  for (const auto& s : stats)
+    total += s;
+  PrintReport(total, elapsed_sec);
+
+  if (!info_before.empty()) {
+    auto info_after =
+        pool->GetNextProactor()->Await([&] { return FetchInfo(config.endpoint); });
+    PrintInfoDelta(info_before, info_after, elapsed_sec, total.requests);
+  }
+
+  pool->Stop();
+
+  return 0;
+}
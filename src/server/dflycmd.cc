@@ -13,6 +13,8 @@
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/journal/journal.h"
+#include "server/journal/serializer.h"
+#include "server/main_service.h"
 #include "server/rdb_save.h"
 #include "server/script_mgr.h"
 #include "server/server_family.h"
@@ -23,6 +25,14 @@ using namespace std;
 
 ABSL_DECLARE_FLAG(string, dir);
 
+ABSL_FLAG(string, replication_compression, "lz4",
+          "Compression of the full sync and the journal stream for the replicas that support it: "
+          "none, zstd or lz4");
+
+ABSL_FLAG(uint32_t, slot_migration_pause_ms, 5000,
+          "The longest time that the writes of migrating slots wait for the target of the "
+          "migration to take them over. The migration fails past it");
+
 namespace dfly {
 
 using namespace facade;
@@ -31,6 +41,14 @@ using util::ProactorBase;
 
 namespace {
 const char kBadMasterId[] = "bad master id";
+const char kNoPromotion[] = "not promoted at these offsets";
+
+// A replica that falls this far behind the journal stream is disconnected. It resumes from the
+// journal backlog if it reconnects soon enough.
+constexpr size_t kMaxStreamBuf = 1ULL << 26;
+
+// Stable sync flows send a NOOP at least this often, so replicas can bound their staleness.
+constexpr auto kHeartbeatInterval = chrono::milliseconds(100);
 const char kIdNotFound[] = "syncid not found";
 const char kInvalidSyncId[] = "bad sync id";
 const char kInvalidState[] = "invalid state";
@@ -43,6 +61,15 @@ bool ToSyncId(string_view str, uint32_t* num) {
   return absl::SimpleAtoi(str, num);
 }
 
+// Makes the writes of the slots wait in DispatchCommand, or lets them through if slots is null.
+void PauseSlots(shared_ptr<const SlotSet> slots) {
+  shard_set->pool()->AwaitFiberOnAll([&slots](auto*) {
+    ServerState* ss = ServerState::tlocal();
+    ss->paused_slots = slots;
+    ss->slots_unpaused.notifyAll();
+  });
+}
+
 struct TransactionGuard {
   constexpr static auto kEmptyCb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
 
@@ -79,14 +106,26 @@ void DflyCmd::Run(CmdArgList args, ConnectionContext* cntx) {
     return Thread(args, cntx);
   }
 
-  if (sub_cmd == "FLOW" && args.size() == 5) {
+  if (sub_cmd == "FLOW" && args.size() >= 5) {
     return Flow(args, cntx);
   }
 
-  if (sub_cmd == "SYNC" && args.size() == 3) {
+  if (sub_cmd == "PROMOTION" && args.size() >= 4) {
+    return Promotion(args, cntx);
+  }
+
+  if (sub_cmd == "SYNC" && args.size() >= 3) {
     return Sync(args, cntx);
   }
 
+  if (sub_cmd == "SLOTS-PAUSE" && args.size() == 3) {
+    return SlotsPause(args, cntx);
+  }
+
+  if (sub_cmd == "SLOTS-RELEASE" && args.size() == 3) {
+    return SlotsRelease(args, cntx);
+  }
+
   if (sub_cmd == "STARTSTABLE" && args.size() == 3) {
     return StartStable(args, cntx);
   }
@@ -145,7 +184,8 @@ void DflyCmd::Journal(CmdArgList args, ConnectionContext* cntx) {
 
   if (sub_cmd == "STOP") {
     unique_lock lk(mu_);
-    if (sf_->journal()->EnterLameDuck()) {
+    // The persistent journal outlives the replication streams.
+    if (!sf_->IsJournalPersistent() && sf_->journal()->EnterLameDuck()) {
       auto barrier_cb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
       trans->ScheduleSingleHop(std::move(barrier_cb));
 
@@ -207,6 +247,34 @@ void DflyCmd::Flow(CmdArgList args, ConnectionContext* cntx) {
     return rb->SendError(facade::kInvalidIntErr);
   }
 
+  optional<LSN> lsn;
+  bool compress = false;
+  for (size_t i = 5; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (opt == "LSN" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &lsn.emplace()))
+        return rb->SendError(facade::kInvalidIntErr);
+    } else if (opt == "COMPRESS") {
+      compress = true;
+    } else {
+      return rb->SendError(kSyntaxErr);
+    }
+  }
+
+  optional<LSN> resume_lsn;
+  if (lsn) {
+    // The backlog is checked again by STARTSTABLE, since entries may be evicted meanwhile.
+    bool partial = shard_set->pool()->at(flow_id)->AwaitBrief([this, lsn = *lsn] {
+      EngineShard* shard = EngineShard::tlocal();
+      if (shard == nullptr)  // io threads do not stream anything.
+        return true;
+      return shard->journal() != nullptr && sf_->journal()->ReadBacklog(lsn).has_value();
+    });
+    if (partial)
+      resume_lsn = lsn;
+  }
+
   auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(sync_id_str, rb);
   if (!sync_id)
     return;
@@ -224,19 +292,76 @@ void DflyCmd::Flow(CmdArgList args, ConnectionContext* cntx) {
   string eof_token = GetRandomHex(gen, 40);
 
   replica_ptr->flows[flow_id] = FlowInfo{cntx->owner(), eof_token};
+  replica_ptr->flows[flow_id].resume_lsn = resume_lsn;
+  if (compress)
+    replica_ptr->flows[flow_id].compression = absl::GetFlag(FLAGS_replication_compression);
   listener_->Migrate(cntx->owner(), shard_set->pool()->at(flow_id));
 
   rb->StartArray(2);
-  rb->SendSimpleString("FULL");
+  rb->SendSimpleString(resume_lsn ? "PARTIAL" : "FULL");
   rb->SendSimpleString(eof_token);
 }
 
+void DflyCmd::Promotion(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  string_view master_id = ArgS(args, 2);
+
+  vector<LSN> shard_lsns(args.size() - 3);
+  for (size_t i = 3; i < args.size(); ++i) {
+    if (!absl::SimpleAtoi(ArgS(args, i), &shard_lsns[i - 3]))
+      return rb->SendError(facade::kInvalidIntErr);
+  }
+
+  optional<vector<LSN>> lsns = sf_->GetPromotionOffsets(master_id, shard_lsns);
+  if (!lsns)
+    return rb->SendError(kNoPromotion);
+
+  // The io threads stream nothing, their flows resume from anywhere.
+  rb->StartArray(shard_set->pool()->size());
+  for (unsigned i = 0; i < shard_set->pool()->size(); ++i)
+    rb->SendLong(i < lsns->size() ? (*lsns)[i] : 0);
+}
+
 void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
   string_view sync_id_str = ArgS(args, 2);
 
   VLOG(1) << "Got DFLY SYNC " << sync_id_str;
 
+  shared_ptr<const SlotSet> slots;
+  string slots_target;
+  if (args.size() > 3) {
+    ToUpper(&args[3]);
+    if (ArgS(args, 3) != "SLOTS" || args.size() < 7 || args.size() % 2 == 0)
+      return rb->SendError(kSyntaxErr);
+
+    slots_target = ArgS(args, 4);
+    vector<ClusterConfig::SlotRange> ranges;
+    for (size_t i = 5; i < args.size(); i += 2) {
+      uint32_t start, end;
+      if (!absl::SimpleAtoi(ArgS(args, i), &start) || !absl::SimpleAtoi(ArgS(args, i + 1), &end) ||
+          start > end || end > kMaxSlotNum) {
+        return rb->SendError("Invalid slot range");
+      }
+      ranges.push_back({SlotId(start), SlotId(end)});
+    }
+
+    auto slot_set = make_shared<SlotSet>(ClusterConfig::ToSlotSet(ranges));
+    const ClusterConfig* config = ServerState::tlocal()->cluster_config.get();
+    if (ClusterConfig::IsEmulated() || !config || !config->IsMaster())
+      return rb->SendError("Slots migrate only from the masters of a cluster");
+
+    for (size_t slot = 0; slot < slot_set->size(); ++slot) {
+      if (slot_set->test(slot) && !config->IsMySlot(slot))
+        return rb->SendError(absl::StrCat("Slot ", slot, " is not served by this node"));
+    }
+
+    string error;
+    if (slots_target == config->my_id() || !config->MoveSlots(*slot_set, slots_target, &error))
+      return rb->SendError(absl::StrCat("Invalid migration target ", slots_target));
+    slots = std::move(slot_set);
+  }
+
   auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(sync_id_str, rb);
   if (!sync_id)
     return;
@@ -245,12 +370,17 @@ void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
   if (!CheckReplicaStateOrReply(*replica_ptr, SyncState::PREPARATION, rb))
     return;
 
+  replica_ptr->slots = slots;
+  replica_ptr->slots_target = std::move(slots_target);
+
   // Start full sync.
   {
     TransactionGuard tg{cntx->transaction};
     AggregateStatus status;
 
     auto cb = [this, &status, replica_ptr](unsigned index, auto*) {
+      replica_ptr->flows[index].resume_lsn.reset();
+      replica_ptr->flows[index].slots = replica_ptr->slots;
       status = StartFullSyncInThread(&replica_ptr->flows[index], &replica_ptr->cntx,
                                      EngineShard::tlocal());
     };
@@ -262,6 +392,7 @@ void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
   }
 
   replica_ptr->state = SyncState::FULL_SYNC;
+  full_syncs_.fetch_add(1, memory_order_relaxed);
   return rb->SendOk();
 }
 
@@ -276,19 +407,26 @@ void DflyCmd::StartStable(CmdArgList args, ConnectionContext* cntx) {
     return;
 
   unique_lock lk(replica_ptr->mu);
-  if (!CheckReplicaStateOrReply(*replica_ptr, SyncState::FULL_SYNC, rb))
+
+  // The replica resumes without a full sync only if every flow can resume.
+  bool partial = replica_ptr->state == SyncState::PREPARATION &&
+                 all_of(replica_ptr->flows.begin(), replica_ptr->flows.end(),
+                        [](const FlowInfo& flow) { return flow.resume_lsn.has_value(); });
+  SyncState expected = partial ? SyncState::PREPARATION : SyncState::FULL_SYNC;
+  if (!CheckReplicaStateOrReply(*replica_ptr, expected, rb))
     return;
 
   {
     TransactionGuard tg{cntx->transaction};
     AggregateStatus status;
 
-    auto cb = [this, &status, replica_ptr](unsigned index, auto*) {
+    auto cb = [this, &status, replica_ptr, partial](unsigned index, auto*) {
       EngineShard* shard = EngineShard::tlocal();
       FlowInfo* flow = &replica_ptr->flows[index];
 
-      StopFullSyncInThread(flow, shard);
-      status = StartStableSyncInThread(flow, shard);
+      if (!partial)
+        StopFullSyncInThread(flow, shard);
+      status = StartStableSyncInThread(flow, &replica_ptr->cntx, shard);
       return OpStatus::OK;
     };
     shard_set->pool()->AwaitFiberOnAll(std::move(cb));
@@ -298,6 +436,100 @@ void DflyCmd::StartStable(CmdArgList args, ConnectionContext* cntx) {
   }
 
   replica_ptr->state = SyncState::STABLE_SYNC;
+  if (partial)
+    partial_syncs_.fetch_add(1, memory_order_relaxed);
+  return rb->SendOk();
+}
+
+void DflyCmd::SlotsPause(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  string_view sync_id_str = ArgS(args, 2);
+
+  VLOG(1) << "Got DFLY SLOTS-PAUSE " << sync_id_str;
+
+  auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(sync_id_str, rb);
+  if (!sync_id)
+    return;
+
+  unique_lock lk(replica_ptr->mu);
+  if (!CheckReplicaStateOrReply(*replica_ptr, SyncState::FULL_SYNC, rb))
+    return;
+
+  if (!replica_ptr->slots || replica_ptr->slots_paused)
+    return rb->SendError(kInvalidState);
+
+  // The paused writes keep their connections waiting, so only one migration pauses at a time.
+  {
+    lock_guard global_lk(mu_);
+    if (ServerState::tlocal()->paused_slots)
+      return rb->SendError("Another slot migration is being finalized");
+    PauseSlots(replica_ptr->slots);
+  }
+  replica_ptr->slots_paused = true;
+
+  // The writes that passed the pause before it started finish before the barrier, and their
+  // changes are streamed before the snapshots end.
+  {
+    TransactionGuard tg{cntx->transaction};
+    shard_set->pool()->AwaitFiberOnAll([this, replica_ptr](unsigned index, auto*) {
+      StopFullSyncInThread(&replica_ptr->flows[index], EngineShard::tlocal());
+    });
+  }
+
+  auto timeout = chrono::milliseconds(absl::GetFlag(FLAGS_slot_migration_pause_ms));
+  ::boost::fibers::fiber([this, sync_id = sync_id, timeout] {
+    ::boost::this_fiber::sleep_for(timeout);
+    auto replica_ptr = GetReplicaInfo(sync_id);
+    if (!replica_ptr)
+      return;
+
+    bool released;
+    {
+      lock_guard lk(replica_ptr->mu);
+      released = replica_ptr->slots_released;
+    }
+    if (!released) {
+      LOG(WARNING) << "The target of slot migration " << sync_id << " did not take them over";
+      CancelReplication(sync_id, replica_ptr);
+    }
+  }).detach();
+
+  return rb->SendOk();
+}
+
+void DflyCmd::SlotsRelease(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  string_view sync_id_str = ArgS(args, 2);
+
+  VLOG(1) << "Got DFLY SLOTS-RELEASE " << sync_id_str;
+
+  auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(sync_id_str, rb);
+  if (!sync_id)
+    return;
+
+  unique_lock lk(replica_ptr->mu);
+  if (replica_ptr->state != SyncState::FULL_SYNC || !replica_ptr->slots_paused)
+    return rb->SendError(kInvalidState);
+
+  // The writes are redirected once they are let through, the keys are dropped.
+  string error;
+  ClusterFamily& cluster_family = sf_->service().cluster_family();
+  if (!cluster_family.MoveSlots(*replica_ptr->slots, replica_ptr->slots_target,
+                                cntx->transaction, &error)) {
+    lk.unlock();
+    CancelReplication(sync_id, replica_ptr);  // Keeps serving the slots.
+    return rb->SendError(error);
+  }
+
+  {
+    lock_guard global_lk(mu_);
+    PauseSlots(nullptr);
+  }
+  replica_ptr->slots_paused = false;
+  replica_ptr->slots_released = true;
+
+  LOG(INFO) << "Migrated " << replica_ptr->slots->count() << " slots to "
+            << replica_ptr->slots_target;
   return rb->SendOk();
 }
 
@@ -316,6 +548,9 @@ OpStatus DflyCmd::StartFullSyncInThread(FlowInfo* flow, Context* cntx, EngineSha
 
   SaveMode save_mode = shard == nullptr ? SaveMode::SUMMARY : SaveMode::SINGLE_SHARD;
   flow->saver.reset(new RdbSaver(flow->conn->socket(), save_mode, false));
+  flow->saver->SetCompression(flow->compression);
+  if (flow->slots)
+    flow->saver->SetSlots(flow->slots);
 
   flow->cleanup = [flow]() {
     flow->saver->Cancel();
@@ -348,20 +583,50 @@ void DflyCmd::StopFullSyncInThread(FlowInfo* flow, EngineShard* shard) {
   flow->saver.reset();
 }
 
-OpStatus DflyCmd::StartStableSyncInThread(FlowInfo* flow, EngineShard* shard) {
+OpStatus DflyCmd::StartStableSyncInThread(FlowInfo* flow, Context* cntx, EngineShard* shard) {
+  auto stream = make_shared<JournalStream>();
+  stream->compressor = BlobCompressor::Create(flow->compression);
+
   // Register journal listener and cleanup.
   uint32_t cb_id = 0;
   if (shard != nullptr) {
-    cb_id = sf_->journal()->RegisterOnChange([flow](const journal::Entry& je) {
-      // TODO: Serialize event.
-      ReqSerializer serializer{flow->conn->socket()};
-      serializer.SendCommand(absl::StrCat("SET ", je.key, " ", je.pval_ptr->ToString()));
+    journal::Journal* journal = sf_->journal();
+
+    // A resumed flow continues with the entries it missed, a new one learns the LSN it starts
+    // from. Nothing is journaled meanwhile, since the transaction guard locks all the shards.
+    if (flow->resume_lsn) {
+      optional<string> backlog = journal->ReadBacklog(*flow->resume_lsn);
+      if (!backlog) {
+        LOG(WARNING) << "Journal backlog evicted the entries after " << *flow->resume_lsn;
+        return OpStatus::INVALID_VALUE;
+      }
+      stream->buf = std::move(*backlog);
+    } else {
+      journal::JournalWriter::EncodeNoop(journal->GetLsn() - 1, GetCurrentTimeMs(),
+                                         &stream->buf);
+    }
+
+    // Must not preempt, it runs while the journal notifies its callbacks.
+    cb_id = journal->RegisterOnStream([stream, cntx](string_view data) {
+      if (stream->buf.size() > kMaxStreamBuf) {
+        return cntx->Error(make_error_code(errc::no_buffer_space),
+                           "Replica does not keep up with the journal stream");
+      }
+      stream->buf.append(data);
+      stream->ec.notify();
     });
+  } else if (!flow->resume_lsn) {
+    journal::JournalWriter::EncodeNoop(0, GetCurrentTimeMs(), &stream->buf);
   }
 
+  flow->stream = stream;
+  stream->fb = ::boost::fibers::fiber(&DflyCmd::StableSyncFb, this, flow, cntx);
+
   flow->cleanup = [flow, this, cb_id]() {
     if (cb_id)
       sf_->journal()->Unregister(cb_id);
+    flow->stream->closed = true;
+    flow->stream->ec.notify();
     flow->TryShutdownSocket();
   };
 
@@ -374,9 +639,10 @@ void DflyCmd::FullSyncFb(FlowInfo* flow, Context* cntx) {
 
   if (saver->Mode() == SaveMode::SUMMARY) {
     auto scripts = sf_->script_mgr()->GetLuaScripts();
-    ec = saver->SaveHeader(scripts);
+    ec = saver->SaveHeader(scripts, {});
   } else {
-    ec = saver->SaveHeader({});
+    // The key counts of the whole dataset would oversize the tables of a slot migration.
+    ec = saver->SaveHeader({}, flow->slots ? RdbSaver::KeyCounts{} : RdbSaver::GetKeyCounts());
   }
 
   if (ec) {
@@ -393,6 +659,51 @@ void DflyCmd::FullSyncFb(FlowInfo* flow, Context* cntx) {
   }
 }
 
+void DflyCmd::StableSyncFb(FlowInfo* flow, Context* cntx) {
+  JournalStream* stream = flow->stream.get();
+  string batch;
+
+  // Io threads journal nothing, so their heartbeats always carry LSN 0.
+  bool in_shard = EngineShard::tlocal() != nullptr;
+  auto next_heartbeat = chrono::steady_clock::now() + kHeartbeatInterval;
+
+  while (true) {
+    stream->ec.await_until([stream] { return stream->closed || !stream->buf.empty(); },
+                           next_heartbeat);
+    if (stream->closed)
+      break;
+
+    batch.clear();
+    batch.swap(stream->buf);
+
+    // The heartbeat follows the entries of the batch, so it covers all of them.
+    if (auto now = chrono::steady_clock::now(); now >= next_heartbeat) {
+      LSN lsn = in_shard ? sf_->journal()->GetStreamedLsn() : 0;
+      journal::JournalWriter::EncodeNoop(lsn, GetCurrentTimeMs(), &batch);
+      next_heartbeat = now + kHeartbeatInterval;
+    }
+
+    size_t raw_size = batch.size();
+    if (stream->compressor)
+      stream->compressor->Compress(&batch);
+
+    stream_raw_bytes_.fetch_add(raw_size, memory_order_relaxed);
+    stream_wire_bytes_.fetch_add(batch.size(), memory_order_relaxed);
+
+    if (auto ec = flow->conn->socket()->Write(io::Buffer(batch)); ec)
+      return cntx->Error(ec);
+  }
+}
+
+auto DflyCmd::GetReplicationStats() const -> ReplicationStats {
+  ReplicationStats res;
+  res.stream_raw_bytes = stream_raw_bytes_.load(memory_order_relaxed);
+  res.stream_wire_bytes = stream_wire_bytes_.load(memory_order_relaxed);
+  res.full_syncs = full_syncs_.load(memory_order_relaxed);
+  res.partial_syncs = partial_syncs_.load(memory_order_relaxed);
+  return res;
+}
+
 uint32_t DflyCmd::CreateSyncSession() {
   unique_lock lk(mu_);
   unsigned sync_id = next_sync_id_++;
@@ -451,6 +762,13 @@ void DflyCmd::CancelReplication(uint32_t sync_id, shared_ptr<ReplicaInfo> replic
   replica_ptr->state = SyncState::CANCELLED;
   replica_ptr->cntx.Cancel();
 
+  // The migrating slots stay here.
+  if (replica_ptr->slots_paused) {
+    lock_guard lk(mu_);
+    PauseSlots(nullptr);
+    replica_ptr->slots_paused = false;
+  }
+
   // Run cleanup for shard threads.
   shard_set->AwaitRunningOnShardQueue([replica_ptr](EngineShard* shard) {
     FlowInfo* flow = &replica_ptr->flows[shard->shard_id()];
@@ -473,6 +791,9 @@ void DflyCmd::CancelReplication(uint32_t sync_id, shared_ptr<ReplicaInfo> replic
     if (flow->full_sync_fb.joinable()) {
       flow->full_sync_fb.join();
     }
+    if (flow->stream && flow->stream->fb.joinable()) {
+      flow->stream->fb.join();
+    }
   });
 
   // Remove ReplicaInfo from global map
@@ -531,6 +852,16 @@ bool DflyCmd::CheckReplicaStateOrReply(const ReplicaInfo& sync_info, SyncState e
   return true;
 }
 
+void DflyCmd::CancelAllReplicas() {
+  vector<pair<uint32_t, shared_ptr<ReplicaInfo>>> replicas;
+  {
+    lock_guard lk(mu_);
+    replicas.assign(replica_infos_.begin(), replica_infos_.end());
+  }
+  for (auto& [sync_id, replica_ptr] : replicas)
+    CancelReplication(sync_id, std::move(replica_ptr));
+}
+
 void DflyCmd::BreakOnShutdown() {
   VLOG(1) << "BreakOnShutdown";
 }
@@ -10,8 +10,11 @@
 #include <boost/fiber/fiber.hpp>
 #include <boost/fiber/mutex.hpp>
 #include <memory>
+#include <optional>
 
+#include "server/cluster/cluster_config.h"
 #include "server/conn_context.h"
+#include "util/fibers/event_count.h"
 
 namespace facade {
 class RedisReplyBuilder;
@@ -26,6 +29,7 @@ namespace dfly {
 class EngineShardSet;
 class ServerFamily;
 class RdbSaver;
+class BlobCompressor;
 
 namespace journal {
 class Journal;
@@ -49,17 +53,32 @@ class Journal;
 //    during state transitions (start full sync, start stable state sync), cancellation and member
 //    access.
 //
+// Replicas serve their own replicas the same way, from their dataset and the journal of the
+// entries they apply, so replicas can be chained. The replicas of a replica are cancelled when
+// it replaces its dataset with a full sync, see ServerFamily::OnMasterFullSync.
+//
 // Upon first connection from the replica, a new ReplicaInfo is created.
 // It tranistions through the following phases:
 //  1. Preparation
 //    During this start phase the "flows" are set up - one connection for every master thread. Those
 //    connections registered by the FLOW command sent from each newly opened connection.
+//    A replica that was already connected passes the last LSN it received on every flow. If
+//    the journal backlogs of all the shards still hold the entries after those LSNs, the
+//    replica skips the full sync and sends STARTSTABLE right away.
 //  2. Full sync
 //    This phase is initiated by the SYNC command. It makes sure all flows are connected and the
 //    replica is in a valid state.
 //  3. Stable state sync
 //    After the replica has received confirmation, that each flow is ready to transition, it sends a
 //    STARTSTABLE command. This transitions the replica into streaming journal changes.
+//  Slot migration
+//    A cluster node imports slots from their owner through a sync session that passes SLOTS to
+//    SYNC. Then the full sync saves only the keys of the slots and streams their changes, and
+//    it never ends on its own: the target sends SLOTS-PAUSE once it caught up, which blocks
+//    the writes of the slots and ends the snapshots. The target applies their tails and sends
+//    SLOTS-RELEASE, which moves the slots to the target in the config of this node and lets
+//    the blocked writes through to be redirected. If the target does not release them within
+//    slot_migration_pause_ms, the session is cancelled and this node keeps serving them.
 //  4. Cancellation
 //    This can happed due to an error at any phase or through a normal abort. For properly releasing
 //    resources we need to run a multi-step cancellation procedure:
@@ -80,6 +99,18 @@ class DflyCmd {
   // See header comments for state descriptions.
   enum class SyncState { PREPARATION, FULL_SYNC, STABLE_SYNC, CANCELLED };
 
+  // The journal entries that a flow streams in stable sync. The entries that accumulate while
+  // the previous batch is written are sent together as the next batch, compressed as a whole if
+  // the flow uses compression. Idle or not, the stream carries a NOOP with the time of the master
+  // every 100ms, so that replicas know how fresh their data is.
+  struct JournalStream {
+    std::string buf;  // Entries that were not written yet.
+    util::fibers_ext::EventCount ec;
+    ::boost::fibers::fiber fb;
+    std::unique_ptr<BlobCompressor> compressor;
+    bool closed = false;
+  };
+
   // Stores information related to a single flow.
   struct FlowInfo {
     FlowInfo() = default;
@@ -95,6 +126,17 @@ class DflyCmd {
     std::unique_ptr<RdbSaver> saver;      // Saver used by the full sync phase.
     std::string eof_token;
 
+    // Set if the flow resumes the stream after this LSN instead of doing a full sync.
+    std::optional<LSN> resume_lsn;
+
+    // Compression of the full sync and the journal stream, "none" unless the replica can
+    // decompress them.
+    std::string compression = "none";
+
+    // Set if the full sync saves only these slots, for a slot migration.
+    std::shared_ptr<const SlotSet> slots;
+    std::shared_ptr<JournalStream> stream;
+
     std::function<void()> cleanup;  // Optional cleanup for cancellation.
   };
 
@@ -107,6 +149,12 @@ class DflyCmd {
     SyncState state;
     Context cntx;
 
+    // The slots that migrate to the node slots_target, see the Slot migration above.
+    std::shared_ptr<const SlotSet> slots;
+    std::string slots_target;
+    bool slots_paused = false;
+    bool slots_released = false;
+
     std::vector<FlowInfo> flows;
     ::boost::fibers::mutex mu;  // See top of header for locking levels.
   };
@@ -121,9 +169,24 @@ class DflyCmd {
   // Stop all background processes so we can exit in orderly manner.
   void BreakOnShutdown();
 
+  // Cancels the sync sessions of all the replicas, which then reconnect.
+  void CancelAllReplicas();
+
   // Create new sync session.
   uint32_t CreateSyncSession();
 
+  struct ReplicationStats {
+    // Bytes of the journal entries streamed to the replicas, before and after compression.
+    uint64_t stream_raw_bytes = 0;
+    uint64_t stream_wire_bytes = 0;
+
+    // Syncs of the replicas that needed a snapshot, and those that resumed from the backlog.
+    uint64_t full_syncs = 0;
+    uint64_t partial_syncs = 0;
+  };
+
+  ReplicationStats GetReplicationStats() const;  // thread-safe
+
  private:
   // JOURNAL [START/STOP]
   // Start or stop journaling.
@@ -133,16 +196,33 @@ class DflyCmd {
   // Return connection thread index or migrate to another thread.
   void Thread(CmdArgList args, ConnectionContext* cntx);
 
-  // FLOW <masterid> <syncid> <flowid>
+  // FLOW <masterid> <syncid> <flowid> [LSN <lsn>] [COMPRESS]
   // Register connection as flow for sync session.
+  // Replies PARTIAL if the flow can resume after lsn without a full sync, FULL otherwise.
+  // COMPRESS tells that the replica decompresses the snapshot blocks and journal batches, then
+  // the flow uses replication_compression.
   void Flow(CmdArgList args, ConnectionContext* cntx);
 
-  // SYNC <syncid>
-  // Initiate full sync.
+  // PROMOTION <masterid> <lsn> [<lsn> ...]
+  // Reply the LSNs for the FLOWs of a replica whose dataset is that of masterid at the LSNs of
+  // its shards, if this instance was promoted from a replica of it at that point.
+  void Promotion(CmdArgList args, ConnectionContext* cntx);
+
+  // SYNC <syncid> [SLOTS <target_id> <start> <end> [<start> <end> ...]]
+  // Initiate full sync. With SLOTS, the sync migrates the slot ranges to the cluster node
+  // target_id.
   void Sync(CmdArgList args, ConnectionContext* cntx);
 
+  // SLOTS-PAUSE <syncid>
+  // Pause the writes of the migrating slots and end the full sync.
+  void SlotsPause(CmdArgList args, ConnectionContext* cntx);
+
+  // SLOTS-RELEASE <syncid>
+  // Hand the paused slots over to the target.
+  void SlotsRelease(CmdArgList args, ConnectionContext* cntx);
+
   // STARTSTABLE <syncid>
-  // Switch to stable state replication.
+  // Switch to stable state replication. Can be sent without SYNC if all flows are partial.
   void StartStable(CmdArgList args, ConnectionContext* cntx);
 
   // EXPIRE
@@ -156,11 +236,14 @@ class DflyCmd {
   void StopFullSyncInThread(FlowInfo* flow, EngineShard* shard);
 
   // Start stable sync in thread. Called for each flow.
-  facade::OpStatus StartStableSyncInThread(FlowInfo* flow, EngineShard* shard);
+  facade::OpStatus StartStableSyncInThread(FlowInfo* flow, Context* cntx, EngineShard* shard);
 
   // Fiber that runs full sync for each flow.
   void FullSyncFb(FlowInfo* flow, Context* cntx);
 
+  // Fiber that writes the journal stream of a flow in stable sync.
+  void StableSyncFb(FlowInfo* flow, Context* cntx);
+
   // Main entrypoint for stopping replication.
   void StopReplication(uint32_t sync_id);
 
@@ -184,6 +267,10 @@ class DflyCmd {
   util::ListenerInterface* listener_;
   TxId journal_txid_ = 0;
 
+  std::atomic_uint64_t stream_raw_bytes_{0};
+  std::atomic_uint64_t stream_wire_bytes_{0};
+  std::atomic_uint64_t full_syncs_{0}, partial_syncs_{0};
+
   uint32_t next_sync_id_ = 1;
   absl::btree_map<uint32_t, std::shared_ptr<ReplicaInfo>> replica_infos_;
 
@@ -7,18 +7,27 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/flags/reflection.h>
 #include <absl/strings/ascii.h>
 #include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
 #include <absl/strings/strip.h>
 #include <gmock/gmock.h>
 
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
+#include "facade/fault_injection.h"
+#include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/main_service.h"
+#include "server/profiler.h"
 #include "server/test_utils.h"
+#include "server/transaction.h"
+
+ABSL_DECLARE_FLAG(uint32_t, info_max_age_ms);
+ABSL_DECLARE_FLAG(uint32_t, heartbeat_idle_ms);
 
 namespace dfly {
 
@@ -27,7 +36,9 @@ using namespace util;
 using absl::StrCat;
 using ::io::Result;
 using testing::ElementsAre;
+using testing::ElementsAreArray;
 using testing::HasSubstr;
+using testing::StartsWith;
 namespace this_fiber = boost::this_fiber;
 
 namespace {
@@ -269,6 +280,102 @@ TEST_F(DflyEngineTest, MultiHop) {
   p2_fb.join();
 }
 
+TEST_F(DflyEngineTest, LocksWithDuplicateKeys) {
+  EXPECT_EQ(Run({"mset", kKey1, "1", kKey4, "2", kKey1, "3"}), "OK");
+  EXPECT_EQ(2, CheckedInt({"del", kKey4, kKey1, kKey4}));
+
+  EXPECT_FALSE(service_->IsLocked(0, kKey1));
+  EXPECT_FALSE(service_->IsLocked(0, kKey4));
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    EXPECT_TRUE(shard->db_slice().GetDBTable(0)->trans_locks.empty());
+  });
+}
+
+TEST_F(DflyEngineTest, OutOfOrderBehindQueueHead) {
+  CommandId cid{"del", CO::WRITE, -2, 1, -1, 1};
+
+  // Both transactions span all the shards but do not share keys.
+  StringVec head_keys{"del"}, next_keys{"del"};
+  for (unsigned i = 0; i < 32; ++i) {
+    head_keys.push_back(StrCat("head", i));
+    next_keys.push_back(StrCat("next", i));
+  }
+
+  pp_->at(0)->Await([&] {
+    auto make_trans = [&](StringVec& keys, CmdArgVec* args) {
+      for (auto& s : keys) {
+        args->emplace_back(s);
+      }
+      boost::intrusive_ptr<Transaction> trans(new Transaction{&cid});
+      trans->InitByArgs(0, {args->data(), args->size()});
+      return trans;
+    };
+    auto noop = [](Transaction*, EngineShard*) { return OpStatus::OK; };
+
+    CmdArgVec head_args, next_args;
+    auto head = make_trans(head_keys, &head_args);
+    auto next = make_trans(next_keys, &next_args);
+
+    // head stays at the front of the tx-queues until it executes.
+    head->Schedule();
+    next->Schedule();
+
+    // Would wait for head if next could not run ahead of it.
+    next->Execute(noop, true);
+    head->Execute(noop, true);
+  });
+
+  atomic_uint64_t ooo_queue_runs{0};
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    ooo_queue_runs.fetch_add(shard->stats().ooo_queue_runs, memory_order_relaxed);
+  });
+  EXPECT_GT(ooo_queue_runs.load(), 0u);
+}
+
+TEST_F(DflyEngineTest, MultiSingleShard) {
+  // Keys that belong to the same shard.
+  StringVec keys;
+  ShardId sid = Shard("key0", shard_set->size());
+  for (unsigned i = 0; keys.size() < 4; ++i) {
+    string key = StrCat("key", i);
+    if (Shard(key, shard_set->size()) == sid)
+      keys.push_back(key);
+  }
+
+  CommandId cid{"del", CO::WRITE, -2, 1, -1, 1};
+  StringVec head_keys{"del", keys[3]};
+
+  pp_->at(0)->Await([&] {
+    CmdArgVec args;
+    for (auto& s : head_keys) {
+      args.emplace_back(s);
+    }
+
+    boost::intrusive_ptr<Transaction> head(new Transaction{&cid});
+    head->InitByArgs(0, {args.data(), args.size()});
+
+    // head stays at the front of the tx-queue of the shard until it executes.
+    head->Schedule();
+
+    // Does not wait for head, since it locks only its keys.
+    Run({"multi"});
+    Run({"set", keys[0], "1"});
+    Run({"incr", keys[0]});
+    Run({"mset", keys[1], "a", keys[2], "b"});
+    RespExpr resp = Run({"exec"});
+    ASSERT_THAT(resp, ArrLen(3));
+    EXPECT_THAT(resp.GetVec(), ElementsAre("OK", IntArg(2), "OK"));
+
+    head->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+  });
+
+  EXPECT_EQ(Run({"get", keys[2]}), "b");
+  for (const auto& key : keys) {
+    EXPECT_FALSE(service_->IsLocked(0, key));
+  }
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
 TEST_F(DflyEngineTest, FlushDb) {
   Run({"mset", kKey1, "1", kKey4, "2"});
   auto resp = Run({"flushdb"});
@@ -396,6 +503,110 @@ TEST_F(DflyEngineTest, EvalSha) {
   EXPECT_THAT(resp, "c6459b95a0e81df97af6fdd49b1a9e0287a57363");
 }
 
+TEST_F(DflyEngineTest, EvalShaAllThreads) {
+  auto resp = Run({"script", "load", "return ARGV[1] .. redis.call('get', KEYS[1])"});
+  ASSERT_THAT(resp, ArgType(RespExpr::STRING));
+  string sha{ToSV(resp.GetBuf())};
+
+  Run({"set", "foo", "bar"});
+
+  // Every thread loads the precompiled script into its interpreters.
+  for (unsigned i = 0; i < pp_->size(); ++i) {
+    resp = pp_->at(i)->Await([&] { return Run({"evalsha", sha, "1", "foo", "x"}); });
+    EXPECT_EQ(resp, "xbar");
+  }
+
+  resp = Run({"info", "memory"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("used_memory_lua:"));
+}
+
+TEST_F(DflyEngineTest, EvalShebang) {
+  Run({"set", "foo", "bar"});
+
+  auto resp = Run({"eval", "#!lua flags=no-writes\nreturn redis.call('get', KEYS[1])", "1", "foo"});
+  EXPECT_EQ(resp, "bar");
+
+  resp = Run({"eval", "#!lua flags=no-writes\nreturn redis.call('del', KEYS[1])", "1", "foo"});
+  EXPECT_THAT(resp, ErrArg("Write commands are not allowed"));
+
+  resp = Run({"eval", "#!lua flags=foo\nreturn 1", "0"});
+  EXPECT_THAT(resp, ErrArg("Unexpected flag"));
+
+  resp = Run({"script", "load", "#!python\nreturn 1"});
+  EXPECT_THAT(resp, ErrArg("Unexpected engine"));
+
+  EXPECT_EQ(Run({"get", "foo"}), "bar");
+  EXPECT_FALSE(service_->IsLocked(0, "foo"));
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
+TEST_F(DflyEngineTest, EvalInShard) {
+  // Keys that belong to the same shard.
+  StringVec keys;
+  ShardId sid = Shard("key0", shard_set->size());
+  for (unsigned i = 0; keys.size() < 3; ++i) {
+    string key = StrCat("key", i);
+    if (Shard(key, shard_set->size()) == sid)
+      keys.push_back(key);
+  }
+
+  CommandId cid{"del", CO::WRITE, -2, 1, -1, 1};
+  StringVec head_keys{"del", keys[2]};
+  const char* kScript = "redis.call('set', KEYS[1], ARGV[1]) return redis.call('incr', KEYS[1])";
+
+  pp_->at(0)->Await([&] {
+    CmdArgVec args;
+    for (auto& s : head_keys) {
+      args.emplace_back(s);
+    }
+
+    boost::intrusive_ptr<Transaction> head(new Transaction{&cid});
+    head->InitByArgs(0, {args.data(), args.size()});
+
+    // head blocks the tx-queue of the shard until it executes, but the script does not need
+    // to wait for it since it runs in the shard thread.
+    head->Schedule();
+
+    RespExpr resp = Run({"eval", kScript, "2", keys[0], keys[1], "5"});
+    EXPECT_THAT(resp, IntArg(6));
+
+    head->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+  });
+
+  // Scripts that call commands by non-literal names run the usual way.
+  auto resp = Run({"eval", "return redis.call(ARGV[1], KEYS[1])", "1", keys[0], "get"});
+  EXPECT_EQ(resp, "6");
+
+  for (const auto& key : keys) {
+    EXPECT_FALSE(service_->IsLocked(0, key));
+  }
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
+TEST_F(DflyEngineTest, EvalBatch) {
+  Run({"hset", "a", "f", "v1"});
+  Run({"set", "b", "5"});
+
+  // The reads before INCR run in a single hop, then the rest of the commands one by one.
+  const char* kScript =
+      "return redis.pcall_batch({{'hget', KEYS[1], 'f'}, {'get', KEYS[2]}, {'hget', KEYS[3], 'f'},"
+      "{'get', KEYS[1]}, {'incr', KEYS[2]}, {'get', KEYS[2]}, {'get', 'undeclared'}})";
+  auto resp = Run({"eval", kScript, "3", "a", "b", "c"});
+  ASSERT_THAT(resp, ArrLen(7));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("v1", "5", ArgType(RespExpr::NIL), ErrArg("WRONGTYPE"),
+                                         IntArg(6), "6", ErrArg("undeclared")));
+
+  // Read only scripts batch their reads as well.
+  resp = Run({"eval", "#!lua flags=no-writes\nreturn redis.pcall_batch({{'get', KEYS[1]}, "
+                      "{'hget', KEYS[2], 'f'}})", "2", "b", "a"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("6", "v1"));
+
+  for (string_view key : {"a", "b", "c"}) {
+    EXPECT_FALSE(service_->IsLocked(0, key));
+  }
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
 TEST_F(DflyEngineTest, Hello) {
   auto resp = Run({"hello"});
   ASSERT_THAT(resp, ArrLen(12));
@@ -448,6 +659,83 @@ TEST_F(DflyEngineTest, Memcache) {
   EXPECT_THAT(resp, ElementsAre("END"));
 }
 
+TEST_F(DflyEngineTest, MemcacheMeta) {
+  auto resp = RunMeta("ms foo 3 T100 F5", "bar");
+  EXPECT_THAT(resp, ElementsAre("HD"));
+
+  resp = RunMeta("mg foo v f t k O123");
+  EXPECT_THAT(resp, ElementsAre("VA 3 f5 t100 kfoo O123", "bar"));
+
+  resp = RunMeta("mg missing v");
+  EXPECT_THAT(resp, ElementsAre("EN"));
+
+  resp = RunMeta("ms foo 3 ME", "baz");
+  EXPECT_THAT(resp, ElementsAre("NS"));
+
+  // Only the first client that misses gets the win token, the others see that it was sent.
+  resp = RunMeta("mg lazy v N30");
+  EXPECT_THAT(resp, ElementsAre("VA 0 W", ""));
+  resp = RunMeta("mg lazy v N30");
+  EXPECT_THAT(resp, ElementsAre("VA 0 Z", ""));
+
+  resp = RunMeta("ms lazy 3", "val");
+  EXPECT_THAT(resp, ElementsAre("HD"));
+  resp = RunMeta("mg lazy v");
+  EXPECT_THAT(resp, ElementsAre("VA 3", "val"));
+
+  // Invalidated items are served as stale until one client recaches them.
+  resp = RunMeta("md lazy I");
+  EXPECT_THAT(resp, ElementsAre("HD"));
+  resp = RunMeta("mg lazy v");
+  EXPECT_THAT(resp, ElementsAre("VA 3 W X", "val"));
+  resp = RunMeta("mg lazy v");
+  EXPECT_THAT(resp, ElementsAre("VA 3 X Z", "val"));
+
+  resp = RunMeta("ma cnt N0 J10 v");
+  EXPECT_THAT(resp, ElementsAre("VA 2", "10"));
+  resp = RunMeta("ma cnt MD D20 v");
+  EXPECT_THAT(resp, ElementsAre("VA 1", "0"));
+
+  resp = RunMeta("md foo q");
+  EXPECT_THAT(resp, ElementsAre());
+  resp = RunMeta("md foo");
+  EXPECT_THAT(resp, ElementsAre("NF"));
+
+  resp = RunMeta("mn");
+  EXPECT_THAT(resp, ElementsAre("MN"));
+}
+
+TEST_F(DflyEngineTest, MemcacheCas) {
+  auto resp = RunMeta("set foo 0 0 3", "bar");
+  EXPECT_THAT(resp, ElementsAre("STORED"));
+
+  resp = RunMeta("gets foo");
+  ASSERT_EQ(3u, resp.size());
+  vector<string_view> header = absl::StrSplit(resp[0], ' ');
+  ASSERT_EQ(5u, header.size());
+  string token{header[4]};
+
+  resp = RunMeta(absl::StrCat("cas foo 0 0 3 ", token), "baz");
+  EXPECT_THAT(resp, ElementsAre("STORED"));
+
+  // The token is stale after the update.
+  resp = RunMeta(absl::StrCat("cas foo 0 0 3 ", token), "qux");
+  EXPECT_THAT(resp, ElementsAre("EXISTS"));
+
+  resp = RunMeta("cas missing 0 0 3 1", "qux");
+  EXPECT_THAT(resp, ElementsAre("NOT_FOUND"));
+
+  // The meta commands share the tokens.
+  resp = RunMeta("mg foo c");
+  ASSERT_EQ(1u, resp.size());
+  token = resp[0].substr(strlen("HD c"));
+  resp = RunMeta(absl::StrCat("ms foo 3 C", token), "new");
+  EXPECT_THAT(resp, ElementsAre("HD"));
+
+  resp = RunMC(MemcacheParser::GET, "foo");
+  EXPECT_THAT(resp, ElementsAre("VALUE foo 0 3", "new", "END"));
+}
+
 TEST_F(DflyEngineTest, LimitMemory) {
   mi_option_enable(mi_option_limit_os_alloc);
   string blob(128, 'a');
@@ -533,6 +821,46 @@ TEST_F(DflyEngineTest, Bug207) {
   }
 }
 
+TEST_F(DflyEngineTest, VolatileTtlEviction) {
+  shard_set->TEST_EnableHeartBeat();
+  shard_set->TEST_EnableCacheMode(EvictionPolicy::VOLATILE_TTL);
+  max_memory_limit = 300000;
+
+  string tmp_val(100, '.');
+  for (unsigned i = 0; i < 200; ++i) {
+    ASSERT_EQ("OK", Run({"set", StrCat("persistent", i), tmp_val}));
+  }
+
+  // Only the keys with an expiry are evicted to make room for the new ones.
+  for (unsigned i = 0; i < 5000; ++i) {
+    ASSERT_EQ("OK", Run({"setex", StrCat("volatile", i), "1000", tmp_val})) << i;
+  }
+
+  for (unsigned i = 0; i < 200; ++i) {
+    EXPECT_THAT(Run({"exists", StrCat("persistent", i)}), IntArg(1)) << i;
+  }
+  EXPECT_THAT(Run({"dbsize"}), testing::Not(IntArg(5200)));
+}
+
+TEST_F(DflyEngineTest, IdleHeartbeat) {
+  absl::FlagSaver fs;
+  absl::SetFlag(&FLAGS_heartbeat_idle_ms, 32);
+  shard_set->TEST_EnableHeartBeat();
+
+  // The heartbeat runs every millisecond under test, an idle shard skips most of the beats.
+  this_fiber::sleep_for(200ms);
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_GT(metrics.shard_stats.heartbeat_skips, metrics.shard_stats.heartbeats);
+
+  // The commands reset the back off.
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), "val"});
+  }
+  this_fiber::sleep_for(10ms);
+  EXPECT_GT(service_->server_family().GetMetrics().shard_stats.heartbeats,
+            metrics.shard_stats.heartbeats);
+}
+
 TEST_F(DflyEngineTest, StickyEviction) {
   shard_set->TEST_EnableHeartBeat();
   shard_set->TEST_EnableCacheMode();
@@ -571,6 +899,7 @@ TEST_F(DflyEngineTest, PSubscribe) {
   EXPECT_THAT(resp, ArrLen(3));
   resp = pp_->at(0)->Await([&] { return Run({"publish", "ab", "foo"}); });
   EXPECT_THAT(resp, IntArg(1));
+  pp_->at(1)->Await([] {});  // Lets the message reach IO1.
 
   ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
 
@@ -580,6 +909,61 @@ TEST_F(DflyEngineTest, PSubscribe) {
   EXPECT_EQ("a*", msg.pattern);
 }
 
+TEST_F(DflyEngineTest, PublishFanout) {
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "ch"}); });
+  pp_->at(2)->Await([&] { return Run({"psubscribe", "c*"}); });
+
+  auto resp = pp_->at(0)->Await([&] { return Run({"publish", "ch", "payload"}); });
+  EXPECT_THAT(resp, IntArg(2));
+  pp_->at(1)->Await([] {});
+  pp_->at(2)->Await([] {});
+
+  ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
+  ASSERT_EQ(1, SubscriberMessagesLen("IO2"));
+
+  // The subscribers share the buffer of the message.
+  facade::Connection::PubMessage msg1 = GetPublishedMessage("IO1", 0);
+  facade::Connection::PubMessage msg2 = GetPublishedMessage("IO2", 0);
+  EXPECT_EQ("payload", *msg1.message);
+  EXPECT_EQ(msg1.message.get(), msg2.message.get());
+  EXPECT_EQ("", msg1.pattern);
+  EXPECT_EQ("c*", msg2.pattern);
+}
+
+TEST_F(DflyEngineTest, ShardedPubSub) {
+  single_response_ = false;
+  auto resp = pp_->at(1)->Await([&] { return Run({"ssubscribe", "ch"}); });
+  EXPECT_THAT(resp.GetVec(), ElementsAre("ssubscribe", "ch", IntArg(1)));
+  pp_->at(2)->Await([&] { return Run({"ssubscribe", "local"}); });
+
+  // The shard channels are separate from the others.
+  EXPECT_THAT(Run({"publish", "ch", "foo"}), IntArg(0));
+  EXPECT_THAT(Run({"spublish", "ch", "foo"}), IntArg(1));
+  pp_->at(1)->Await([] {});
+
+  ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
+  EXPECT_EQ("foo", *msg.message);
+  EXPECT_EQ("ch", msg.channel);
+  EXPECT_TRUE(msg.sharded);
+
+  // The subscribers of the publisher's thread get the message without a hop.
+  size_t len = pp_->at(2)->Await([&] {
+    Run({"spublish", "local", "bar"});
+    return SubscriberMessagesLen("IO2");
+  });
+  EXPECT_EQ(1u, len);
+
+  resp = Run({"pubsub", "shardchannels"});
+  EXPECT_THAT(resp.GetVec(), testing::UnorderedElementsAre("ch", "local"));
+  EXPECT_THAT(Run({"pubsub", "channels"}), ArrLen(0));
+
+  resp = pp_->at(1)->Await([&] { return Run({"sunsubscribe"}); });
+  EXPECT_THAT(resp.GetVec(), ElementsAre("sunsubscribe", "ch", IntArg(0)));
+  EXPECT_THAT(Run({"spublish", "ch", "foo"}), IntArg(0));
+}
+
 TEST_F(DflyEngineTest, Unsubscribe) {
   auto resp = Run({"unsubscribe", "a"});
   EXPECT_THAT(resp.GetVec(), ElementsAre("unsubscribe", "a", IntArg(0)));
@@ -703,6 +1087,81 @@ TEST_F(DflyEngineTest, Watch) {
   Run({"select", "0"});
   Run({"multi"});
   ASSERT_THAT(Run({"exec"}), kExecSuccess);
+
+  // Reading the watched keys does not fail EXEC.
+  Run({"watch", "a", "b"});
+  Run({"get", "a"});
+  Run({"exists", "a", "b"});
+  Run({"multi"});
+  Run({"set", "a", "3"});
+  ASSERT_THAT(Run({"exec"}), kExecSuccess);
+
+  // A key that was removed and added again changed.
+  Run({"watch", "a"});
+  Run({"del", "a"});
+  Run({"set", "a", "3"});
+  Run({"multi"});
+  ASSERT_THAT(Run({"exec"}), kExecFail);
+
+  // Neither UNWATCH nor EXEC leave anything behind in the shards.
+  Run({"watch", "a"});
+  Run({"unwatch"});
+  Run({"set", "a", "4"});
+  Run({"multi"});
+  ASSERT_THAT(Run({"exec"}), kExecSuccess);
+}
+
+TEST_F(DflyEngineTest, PipelineSquash) {
+  Run({"lpush", "list", "a"});
+
+  vector<vector<string>> cmds;
+  for (unsigned i = 0; i < 10; ++i) {
+    cmds.push_back({"set", StrCat("key", i), StrCat("val", i)});
+  }
+  for (unsigned i = 0; i < 10; ++i) {
+    cmds.push_back({"get", StrCat("key", i)});
+  }
+  cmds.push_back({"get", "missing"});
+  cmds.push_back({"get", "list"});
+  cmds.push_back({"incr", "counter"});  // not squashed, breaks the run.
+  cmds.push_back({"set", "key0", "new"});
+  cmds.push_back({"get", "key0"});
+
+  vector<string> expected(10, "+OK");
+  for (unsigned i = 0; i < 10; ++i) {
+    expected.push_back("$4");
+    expected.push_back(StrCat("val", i));
+  }
+  expected.push_back("$-1");
+  expected.push_back("-WRONGTYPE Operation against a key holding the wrong kind of value");
+  expected.push_back(":1");
+  expected.push_back("+OK");
+  expected.push_back("$3");
+  expected.push_back("new");
+
+  EXPECT_THAT(RunPipeline(cmds), ElementsAreArray(expected));
+}
+
+TEST_F(DflyEngineTest, PipelineSquashHSet) {
+  Run({"set", "str", "a"});
+
+  vector<vector<string>> cmds;
+  for (unsigned i = 0; i < 10; ++i) {
+    cmds.push_back({"hset", StrCat("hash", i), "f1", "v1", "f2", StrCat(i)});
+  }
+  cmds.push_back({"hset", "hash0", "f1", "v2", "f3", "v3"});
+  cmds.push_back({"hset", "str", "f1", "v1"});
+  cmds.push_back({"get", "str"});
+
+  vector<string> expected(10, ":2");
+  expected.push_back(":1");
+  expected.push_back("-WRONGTYPE Operation against a key holding the wrong kind of value");
+  expected.push_back("$1");
+  expected.push_back("a");
+
+  EXPECT_THAT(RunPipeline(cmds), ElementsAreArray(expected));
+  EXPECT_EQ(Run({"hget", "hash0", "f1"}), "v2");
+  EXPECT_EQ(Run({"hget", "hash9", "f2"}), "9");
 }
 
 TEST_F(DflyEngineTest, Bug468) {
@@ -749,6 +1208,392 @@ TEST_F(DflyEngineTest, Bug496) {
   });
 }
 
+TEST_F(DflyEngineTest, ReusedTransactions) {
+  // The commands reuse the transactions of the previous ones, of other shapes and shard counts.
+  for (unsigned i = 0; i < 20; ++i) {
+    string a = StrCat("a", i), b = StrCat("b", i), c = StrCat("c", i);
+    EXPECT_EQ(Run({"mset", a, "1", b, "2", c, "3"}), "OK");
+    EXPECT_THAT(Run({"incr", b}), IntArg(3));
+    EXPECT_THAT(Run({"mget", c, "nokey", a, b}).GetVec(),
+                ElementsAre("3", ArgType(RespExpr::NIL), "1", "3"));
+    EXPECT_THAT(Run({"dbsize"}), IntArg(3 * (i + 1)));
+    EXPECT_THAT(Run({"exists", a, b, c, "nokey"}), IntArg(3));
+  }
+
+  Run({"multi"});
+  Run({"get", "a0"});
+  EXPECT_EQ(Run({"exec"}), "1");
+  EXPECT_EQ(Run({"get", "c19"}), "3");
+}
+
+TEST_F(DflyEngineTest, Resp3) {
+  Run({"hset", "h", "f", "v"});
+  Run({"zadd", "z", "1.5", "m"});
+
+  auto resp = Run({"hello", "3"});
+  ASSERT_THAT(resp, ArrLen(12));
+  EXPECT_THAT(resp.GetVec()[5], IntArg(3));
+
+  resp = Run({"hgetall", "h"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("f", "v"));
+
+  resp = Run({"zrange", "z", "0", "-1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m", "1.5"));
+
+  resp = Run({"get", "missing"});
+  EXPECT_THAT(resp, ArgType(RespExpr::NIL));
+
+  resp = Run({"hello", "2"});
+  EXPECT_THAT(resp.GetVec()[5], IntArg(2));
+}
+
+TEST_F(DflyEngineTest, ClientTracking) {
+  Run({"set", "foo", "bar"});
+  EXPECT_THAT(Run({"client", "tracking", "on"}), ErrArg("RESP3"));
+
+  Run({"hello", "3"});
+  EXPECT_EQ(Run({"client", "tracking", "on"}), "OK");
+  EXPECT_EQ(Run({"get", "foo"}), "bar");
+
+  pp_->at(1)->Await([&] { return Run({"set", "foo", "baz"}); });
+  pp_->at(0)->Await([] {});  // Lets the invalidation reach IO0.
+  ASSERT_EQ(1, SubscriberMessagesLen("IO0"));
+
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO0", 0);
+  EXPECT_TRUE(msg.invalidate);
+  EXPECT_EQ("foo", *msg.message);
+
+  // The key is not tracked anymore until it is read again.
+  pp_->at(1)->Await([&] { return Run({"set", "foo", "qux"}); });
+  pp_->at(0)->Await([] {});
+  EXPECT_EQ(1, SubscriberMessagesLen("IO0"));
+
+  EXPECT_EQ(Run({"client", "tracking", "off"}), "OK");
+}
+
+TEST_F(DflyEngineTest, ClientWeight) {
+  EXPECT_THAT(Run({"client", "weight"}), IntArg(100));
+  EXPECT_EQ(Run({"client", "weight", "25"}), "OK");
+  EXPECT_THAT(Run({"client", "weight"}), IntArg(25));
+  EXPECT_THAT(Run({"client", "weight", "0"}), ErrArg("between 1 and 10000"));
+  EXPECT_THAT(Run({"client", "weight", "x"}), ErrArg("between 1 and 10000"));
+}
+
+TEST_F(DflyEngineTest, KeyspaceEvents) {
+  EXPECT_THAT(Run({"config", "set", "notify-keyspace-events", "Eq"}), ErrArg("Invalid argument"));
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", "Eg$x"}), "OK");
+  EXPECT_THAT(Run({"config", "get", "notify-keyspace-events"}).GetVec(),
+              ElementsAre("notify-keyspace-events", "g$xE"));
+
+  single_response_ = false;
+  auto resp = pp_->at(1)->Await([&] { return Run({"psubscribe", "__keyevent@0__:*"}); });
+  EXPECT_THAT(resp, ArrLen(3));
+
+  Run({"set", "foo", "bar", "px", "10"});
+  AdvanceTime(20);
+  EXPECT_THAT(Run({"get", "foo"}), ArgType(RespExpr::NIL));
+  Run({"set", "baz", "1"});
+  Run({"del", "baz"});
+
+  // The events are published in batches by the shards.
+  for (unsigned i = 0; i < 100 && SubscriberMessagesLen("IO1") < 4; ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  ASSERT_EQ(4, SubscriberMessagesLen("IO1"));
+
+  vector<string> events;
+  for (size_t i = 0; i < 4; ++i) {
+    facade::Connection::PubMessage msg = GetPublishedMessage("IO1", i);
+    EXPECT_EQ("__keyevent@0__:*", msg.pattern);
+    events.push_back(StrCat(msg.channel, " ", *msg.message));
+  }
+  EXPECT_THAT(events, testing::UnorderedElementsAre(
+                          "__keyevent@0__:set foo", "__keyevent@0__:expired foo",
+                          "__keyevent@0__:set baz", "__keyevent@0__:del baz"));
+
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", ""}), "OK");
+}
+
+TEST_F(DflyEngineTest, CmdMemStats) {
+  Run({"set", "foo", string(1024, 'x')});
+  Run({"del", "foo"});
+
+  auto resp = Run({"info", "commandstats"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("cmd_mem_SET:allocated="));
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("cmd_mem_DEL:allocated="));
+}
+
+TEST_F(DflyEngineTest, LatencyStats) {
+  Run({"set", "foo", "bar"});
+  Run({"set", "foo", "baz"});
+  Run({"get", "foo"});
+
+  auto resp = Run({"info", "latencystats"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("latency_percentiles_usec_set:p50="));
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("latency_percentiles_usec_get:p50="));
+
+  resp = Run({"latency", "histogram", "set", "nosuchcmd"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& arr = resp.GetVec();
+  EXPECT_EQ(arr[0], "set");
+  ASSERT_THAT(arr[1], ArrLen(4));
+  EXPECT_THAT(arr[1].GetVec(), ElementsAre("calls", IntArg(2), "histogram_usec", testing::_));
+
+  // The counts are cumulative, the last one holds all the calls.
+  const auto& buckets = arr[1].GetVec()[3].GetVec();
+  ASSERT_FALSE(buckets.empty());
+  EXPECT_THAT(buckets.back(), IntArg(2));
+
+  Run({"config", "resetstat"});
+  resp = Run({"latency", "histogram"});
+  EXPECT_THAT(resp, ArrLen(2));  // only CONFIG RESETSTAT itself.
+}
+
+TEST_F(DflyEngineTest, TxTrace) {
+  TxTrace::SetSampleRate(1);
+  Run({"mset", "a", "1", "b", "2", "c", "3"});
+  Run({"rename", "a", "d"});
+  TxTrace::SetSampleRate(0);
+
+  vector<TxTrace::StatsMap> thread_stats(shard_set->pool()->size());
+  vector<string> timelines(shard_set->pool()->size());
+  shard_set->pool()->Await([&](ProactorBase* pb) {
+    unsigned index = ProactorBase::GetIndex();
+    TxTrace::MergeStats(&thread_stats[index]);
+    TxTrace::AppendTimeline(index, &timelines[index]);
+  });
+
+  uint64_t mset_hops = 0, rename_hops = 0;
+  for (const auto& stats : thread_stats) {
+    for (const auto& [key, phase_stats] : stats) {
+      if (key.first == "MSET")
+        mset_hops += phase_stats.hops;
+      if (key.first == "RENAME")
+        rename_hops += phase_stats.hops;
+      EXPECT_GE(phase_stats.total_ns[TxTrace::RUN], phase_stats.max_ns[TxTrace::RUN]);
+    }
+  }
+  EXPECT_GE(mset_hops, 1u);  // once in every shard of its keys.
+  EXPECT_GE(rename_hops, 2u);
+  EXPECT_THAT(absl::StrJoin(timelines, ""), HasSubstr(R"({"name":"run","cat":"RENAME")"));
+}
+
+TEST_F(DflyEngineTest, SlowLog) {
+  Run({"slowlog", "reset"});
+  EXPECT_EQ(Run({"config", "set", "slowlog-log-slower-than", "0"}), "OK");
+  Run({"set", "foo", string(200, 'x')});
+  Run({"mset", "a", "1", "b", "2"});
+
+  auto resp = Run({"slowlog", "get", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& mset = resp.GetVec()[0].GetVec();  // the newest first.
+  ASSERT_EQ(8u, mset.size());
+  EXPECT_THAT(mset[3].GetVec(), ElementsAre("MSET", "a", "1", "b", "2"));
+  EXPECT_THAT(mset[7], ArgType(RespExpr::ARRAY));
+  EXPECT_FALSE(mset[7].GetVec().empty());
+
+  const auto& set = resp.GetVec()[1].GetVec();
+  ASSERT_EQ(8u, set.size());
+  EXPECT_GT(get<int64_t>(mset[0].u), get<int64_t>(set[0].u));
+  ASSERT_THAT(set[3], ArrLen(3));
+  EXPECT_EQ(set[3].GetVec()[2], string(128, 'x') + "... (72 more bytes)");
+  EXPECT_THAT(set[7], ArrLen(1));
+
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(4));  // with the CONFIG SET and SLOWLOG commands.
+  EXPECT_EQ(Run({"slowlog", "reset"}), "OK");
+  EXPECT_EQ(Run({"config", "set", "slowlog-log-slower-than", "-1"}), "OK");
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(1));  // SLOWLOG RESET logs itself.
+  EXPECT_THAT(Run({"slowlog", "get", "-2"}), ErrArg("count should be"));
+}
+
+TEST_F(DflyEngineTest, TopKeys) {
+  Run({"set", "small", "x"});
+  Run({"set", "big", string(10000, 'x')});
+  Run({"set", "medium", string(1000, 'x')});
+  for (unsigned i = 0; i < 2000; ++i) {
+    Run({"get", "hot"});
+    Run({"get", absl::StrCat("cold", i)});
+  }
+
+  auto resp = Run({"memory", "bigkeys", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[0], "big");
+  EXPECT_GE(get<int64_t>(resp.GetVec()[0].GetVec()[1].u), 10000);
+  EXPECT_EQ(resp.GetVec()[1].GetVec()[0], "medium");
+
+  // Deleted keys are dropped.
+  Run({"del", "big"});
+  resp = Run({"memory", "bigkeys", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[0], "medium");
+
+  // Sampled, the hot key stands out nevertheless.
+  resp = Run({"memory", "hotkeys", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[0], "hot");
+
+  EXPECT_THAT(Run({"memory", "hotkeys", "x"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"memory", "bigkeys", "1", "2"}), ErrArg("syntax error"));
+}
+
+TEST_F(DflyEngineTest, MemoryStats) {
+  Run({"set", "int", "42"});
+  Run({"set", "big", string(1000, 'x')});
+  Run({"hset", "hash", "field", "value"});
+  Run({"sadd", "intset", "1", "2", "3"});
+  Run({"zadd", "zset", "1", "a"});
+
+  auto resp = Run({"memory", "stats"});
+  ASSERT_EQ(RespExpr::ARRAY, resp.type);
+  absl::flat_hash_map<string, RespExpr> fields;
+  const auto& vec = resp.GetVec();
+  ASSERT_EQ(0u, vec.size() % 2);
+  for (size_t i = 0; i < vec.size(); i += 2)
+    fields.emplace(ToSV(vec[i].GetBuf()), vec[i + 1]);
+
+  EXPECT_THAT(fields["keys.count"], IntArg(5));
+  EXPECT_THAT(fields["keys.sampled"], IntArg(5));
+  for (string_view name :
+       {"string.int", "string.small", "hash.listpack", "set.intset", "zset.listpack"}) {
+    ASSERT_TRUE(fields.contains(name)) << name;
+    EXPECT_THAT(fields[name], ArrLen(6)) << name;
+    EXPECT_THAT(fields[name].GetVec()[1], IntArg(1)) << name;
+  }
+  EXPECT_GE(get<int64_t>(fields["string.small"].GetVec()[3].u), 500);
+
+  // A sample of a shard extrapolates to all of its keys.
+  resp = Run({"memory", "stats", "samples", "1"});
+  ASSERT_EQ(RespExpr::ARRAY, resp.type);
+  EXPECT_THAT(resp.GetVec()[1], IntArg(5));
+
+  EXPECT_THAT(Run({"memory", "stats", "samples", "x"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"memory", "stats", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(DflyEngineTest, Profiles) {
+  optional<string> profile = CollectCpuProfile(shard_set->pool(), 100ms, 100);
+  ASSERT_TRUE(profile);
+
+  // The header of the legacy format, then the stacks and the trailer, then the mappings.
+  const uintptr_t* words = reinterpret_cast<const uintptr_t*>(profile->data());
+  ASSERT_GE(profile->size(), 8 * sizeof(uintptr_t));
+  EXPECT_EQ(0u, words[0]);
+  EXPECT_EQ(3u, words[1]);
+  EXPECT_EQ(10000u, words[3]);
+  EXPECT_THAT(*profile, HasSubstr("dragonfly_test"));
+
+  Run({"set", "key", string(1000, 'x')});
+  string heap = CollectHeapProfile(shard_set->pool());
+  EXPECT_THAT(heap, StartsWith("thread block_size"));
+  EXPECT_THAT(heap, HasSubstr("0 total"));
+}
+
+#ifdef DFLY_FAULT_INJECTION
+TEST_F(DflyEngineTest, InjectFaults) {
+  EXPECT_THAT(Run({"debug", "inject", "foo", "100"}), ErrArg("Unknown fault point"));
+  EXPECT_THAT(Run({"debug", "inject", "shard_queue", "x"}), ErrArg(kUintErr));
+  EXPECT_THAT(Run({"debug", "inject", "shard_queue", "100", "every", "0"}), ErrArg(kUintErr));
+
+  EXPECT_EQ(Run({"debug", "inject", "shard_queue", "1000", "every", "2"}), "OK");
+  for (unsigned i = 0; i < 10; ++i) {
+    Run({"set", kKey1, "1"});
+  }
+
+  auto resp = Run({"debug", "inject"});
+  ASSERT_THAT(resp, ArrLen(4));
+  EXPECT_THAT(ToSV(resp.GetVec()[2].GetBuf()), StartsWith("shard_queue delay_usec=1000 every=2"));
+  EXPECT_GT(GetFault(FaultPoint::SHARD_QUEUE).injected, 0u);
+
+  EXPECT_EQ(Run({"debug", "inject", "reset"}), "OK");
+  EXPECT_EQ(0u, GetFault(FaultPoint::SHARD_QUEUE).delay_usec);
+}
+#endif
+
+TEST_F(DflyEngineTest, ShardLoad) {
+  Run({"mset", kKey1, "1", kKey2, "2", kKey3, "3", kKey4, "4"});
+  Run({"get", kKey1});
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  ASSERT_EQ(shard_set->size(), metrics.shard_load.size());
+  uint64_t hops = 0, cross_shard_hops = 0;
+  for (const auto& load : metrics.shard_load) {
+    hops += load.hops;
+    cross_shard_hops += load.cross_shard_hops;
+    EXPECT_GT(load.heap_bytes, 0u);
+  }
+  EXPECT_EQ(hops, metrics.shard_stats.tx_hops);
+  EXPECT_GT(cross_shard_hops, 0u);
+  EXPECT_GT(hops, cross_shard_hops);
+
+  auto resp = Run({"info", "shards"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("shard_0:txq_len=0,hops_per_sec="));
+  resp = Run({"info", "stats"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("shard_hops_imbalance:"));
+
+  // Every shard runs on a cpu of a known node.
+  resp = Run({"info", "numa"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("numa_nodes:"));
+  EXPECT_THAT(ToSV(resp.GetBuf()), Not(HasSubstr("numa_node_-1")));
+}
+
+TEST_F(DflyEngineTest, CachedMetrics) {
+  absl::FlagSaver fs;
+  absl::SetFlag(&FLAGS_info_max_age_ms, 60000);
+
+  Run({"set", "foo", "bar"});
+  auto resp = Run({"info", "keyspace"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("db0:keys=1,"));
+
+  // Served from the cache.
+  Run({"set", "foo2", "bar"});
+  resp = Run({"info", "keyspace"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("db0:keys=1,"));
+  EXPECT_EQ(service_->server_family().GetCachedMetrics(),
+            service_->server_family().GetCachedMetrics());
+
+  absl::SetFlag(&FLAGS_info_max_age_ms, 0);
+  resp = Run({"info", "keyspace"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("db0:keys=2,"));
+
+  resp = Run({"info", "server"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("uptime_in_seconds:"));
+}
+
+TEST_F(DflyEngineTest, PopulateTypes) {
+  EXPECT_EQ(Run({"debug", "populate", "100", "h", "8", "TYPE", "hash", "ELEMENTS", "5"}), "OK");
+  EXPECT_EQ(5, CheckedInt({"hlen", "h:7"}));
+  EXPECT_EQ(8, CheckedInt({"hstrlen", "h:7", "field:3"}));
+
+  Run({"debug", "populate", "100", "z", "10", "TYPE", "zset", "ELEMENTS", "2", "4"});
+  int64_t card = CheckedInt({"zcard", "z:99"});
+  EXPECT_GE(card, 2);
+  EXPECT_LE(card, 4);
+
+  Run({"debug", "populate", "10", "l", "0", "TYPE", "list", "ELEMENTS", "3", "EXPIRE", "100"});
+  EXPECT_EQ(3, CheckedInt({"llen", "l:0"}));
+  EXPECT_GE(CheckedInt({"ttl", "l:0"}), 99);
+
+  Run({"debug", "populate", "10", "s", "0", "TYPE", "stream", "ELEMENTS", "3"});
+  EXPECT_EQ(3, CheckedInt({"xlen", "s:5"}));
+
+  Run({"debug", "populate", "10", "j", "0", "TYPE", "json", "ELEMENTS", "2"});
+  auto resp = Run({"JSON.GET", "j:1", "$['field:1']"});
+  EXPECT_EQ(resp, R"(["value:1"])");
+
+  // Strings, with the sizes drawn from a range, and the same values every time.
+  Run({"debug", "populate", "100", "key", "0", "RAND", "SIZE", "20", "30", "EXPIRE", "50", "60"});
+  string val{ToSV(Run({"get", "key:42"}).GetBuf())};
+  EXPECT_GE(val.size(), 20u);
+  EXPECT_LE(val.size(), 30u);
+  Run({"debug", "populate", "100", "key", "0", "RAND", "SIZE", "20", "30", "EXPIRE", "50", "60"});
+  EXPECT_EQ(Run({"get", "key:42"}), val);
+  EXPECT_EQ(Run({"dbsize"}), IntArg(100 + 100 + 10 + 10 + 10 + 100));
+
+  EXPECT_THAT(Run({"debug", "populate", "10", "key", "0", "TYPE", "foo"}), ErrArg("syntax"));
+  EXPECT_THAT(Run({"debug", "populate", "10", "key", "0", "ELEMENTS", "0"}), ErrArg("syntax"));
+  EXPECT_THAT(Run({"debug", "populate", "10", "key", "0", "SIZE", "5", "2"}), ErrArg("syntax"));
+}
+
 // TODO: to test transactions with a single shard since then all transactions become local.
 // To consider having a parameter in dragonfly engine controlling number of shards
 // unconditionally from number of cpus. TO TEST BLPOP under multi for single/multi argument case.
@@ -6,11 +6,16 @@
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/quicklist.h"
 #include "redis/zmalloc.h"
 }
 
+#include <absl/cleanup/cleanup.h>
+
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/dense_set.h"
+#include "facade/numa.h"
 #include "server/blocking_controller.h"
 #include "server/server_state.h"
 #include "server/tiered_storage.h"
@@ -30,6 +35,39 @@ ABSL_FLAG(bool, cache_mode, false,
           "If true, the backend behaves like a cache, "
           "by evicting entries when getting close to maxmemory limit");
 
+ABSL_FLAG(double, mem_defrag_threshold, 0,
+          "Ratio of the committed heap memory of a shard to its used memory above which the shard "
+          "moves values off the underutilized heap pages. 0 - no defragmentation");
+
+ABSL_FLAG(double, mem_defrag_page_utilization, 0.8,
+          "Heap pages whose ratio of used bytes is below this value are drained by the "
+          "defragmentation");
+
+ABSL_FLAG(uint32_t, list_compress_idle_beats, 0,
+          "Lists that were not accessed for this many heartbeats get all their nodes but the head "
+          "and the tail compressed, regardless of list_compress_depth. 0 - disabled");
+
+ABSL_FLAG(uint32_t, tx_ooo_scan_depth, 32,
+          "How many transactions behind a blocked tx-queue head are checked for out of order "
+          "execution. 0 disables it.");
+
+ABSL_FLAG(uint32_t, tx_heavy_usec, 0,
+          "Commands whose shard callbacks take at least this long on average run in the heavy "
+          "lane: the ready fast commands behind them in the tx-queue run first, and the shard "
+          "serves its other tasks between them. 0 disables the lanes");
+
+ABSL_FLAG(bool, table_huge_pages, false,
+          "If true, the segments and the directories of the key tables are allocated from 2MB "
+          "huge page arenas, with transparent huge pages if no huge pages are reserved");
+
+ABSL_FLAG(uint32_t, heartbeat_idle_ms, 0,
+          "If positive, the heartbeats of a shard that runs no commands and has no expiry, "
+          "eviction or defragmentation backlog back off exponentially up to this interval. "
+          "0 - the heartbeat always runs at --hz");
+
+ABSL_FLAG(bool, numa_bind_shards, false,
+          "If true, the kernel prefers the memory of the numa node of its thread for every shard");
+
 namespace dfly {
 
 using namespace util;
@@ -41,9 +79,16 @@ namespace {
 
 vector<EngineShardSet::CachedStats> cached_stats;  // initialized in EngineShardSet::Init
 
+// The flag is validated in Service::Init, before the shards are created.
+EvictionPolicy FlagEvictionPolicy() {
+  EvictionPolicy policy = EvictionPolicy::NO_EVICTION;
+  GetFlagEvictionPolicy(&policy);
+  return policy;
+}
+
 }  // namespace
 
-constexpr size_t kQueueLen = 64;
+constexpr size_t kQueueLen = 256;
 
 thread_local EngineShard* EngineShard::shard_ = nullptr;
 EngineShardSet* shard_set = nullptr;
@@ -52,13 +97,36 @@ uint64_t TEST_current_time_ms = 0;
 EngineShard::Stats& EngineShard::Stats::operator+=(const EngineShard::Stats& o) {
   ooo_runs += o.ooo_runs;
   quick_runs += o.quick_runs;
+  ooo_queue_runs += o.ooo_queue_runs;
+  defrag_scans += o.defrag_scans;
+  defrag_realloc += o.defrag_realloc;
+  list_compressed_nodes += o.list_compressed_nodes;
+  list_compress_saved_bytes += o.list_compress_saved_bytes;
+  snapshot_lag_usec += o.snapshot_lag_usec;
+  snapshot_spill_bytes += o.snapshot_spill_bytes;
+  tx_hops += o.tx_hops;
+  tx_cross_shard_hops += o.tx_cross_shard_hops;
+  poll_busy_usec += o.poll_busy_usec;
+  fast_lane_runs += o.fast_lane_runs;
+  heavy_slices += o.heavy_slices;
+  heartbeats += o.heartbeats;
+  heartbeat_skips += o.heartbeat_skips;
+  heartbeat_stats_ns += o.heartbeat_stats_ns;
+  heartbeat_expire_ns += o.heartbeat_expire_ns;
+  heartbeat_evict_ns += o.heartbeat_evict_ns;
+  heartbeat_maintenance_ns += o.heartbeat_maintenance_ns;
 
   return *this;
 }
 
 EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t* heap)
     : queue_(kQueueLen), txq_([](const Transaction* t) { return t->txid(); }), mi_resource_(heap),
-      db_slice_(pb->GetIndex(), GetFlag(FLAGS_cache_mode), this) {
+      segment_alloc_(GetFlag(FLAGS_table_huge_pages)
+                         ? make_unique<SegmentAllocator>(PrimeTable::kSegBytes, &mi_resource_)
+                         : nullptr),
+      db_slice_(pb->GetIndex(), FlagEvictionPolicy(), this),
+      ooo_scan_depth_(GetFlag(FLAGS_tx_ooo_scan_depth)),
+      heavy_ns_(uint64_t(GetFlag(FLAGS_tx_heavy_usec)) * 1000) {
   fiber_q_ = fibers::fiber([this, index = pb->GetIndex()] {
     this_fiber::properties<FiberProps>().set_name(absl::StrCat("shard_queue", index));
     queue_.Run();
@@ -69,7 +137,9 @@ EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t*
     if (clock_cycle_ms == 0)
       clock_cycle_ms = 1;
 
+    heartbeat_state_.max_skip = GetFlag(FLAGS_heartbeat_idle_ms) / clock_cycle_ms;
     periodic_task_ = pb->AddPeriodic(clock_cycle_ms, [this] { Heartbeat(); });
+    StartExpiryTimer();
   }
 
   tmp_str1 = sdsempty();
@@ -82,6 +152,7 @@ EngineShard::~EngineShard() {
 }
 
 void EngineShard::Shutdown() {
+  keyspace_events_.Shutdown();
   queue_.Shutdown();
   fiber_q_.join();
 
@@ -92,14 +163,27 @@ void EngineShard::Shutdown() {
   if (periodic_task_) {
     ProactorBase::me()->CancelPeriodic(periodic_task_);
   }
+
+  if (expiry_timer_.joinable()) {
+    stop_expiry_timer_ = true;
+    db_slice_.soon_expiry_ec()->notify();
+    expiry_timer_.join();
+  }
 }
 
 void EngineShard::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   CHECK(shard_ == nullptr) << pb->GetIndex();
 
+  // The threads of the pool are pinned to their cpus, so the node of the shard does not change.
+  int numa_node = facade::NumaTopology::Get().CurrentNode();
+  if (GetFlag(FLAGS_numa_bind_shards) && facade::NumaTopology::PreferThreadMemory(numa_node)) {
+    VLOG(1) << "Shard " << pb->GetIndex() << " prefers the memory of numa node " << numa_node;
+  }
+
   mi_heap_t* data_heap = ServerState::tlocal()->data_heap();
   void* ptr = mi_heap_malloc_aligned(data_heap, sizeof(EngineShard), alignof(EngineShard));
   shard_ = new (ptr) EngineShard(pb, update_db_time, data_heap);
+  shard_->numa_node_ = numa_node;
 
   CompactObj::InitThreadLocal(shard_->memory_resource());
   SmallString::InitThreadLocal(data_heap);
@@ -128,6 +212,7 @@ void EngineShard::DestroyThreadLocal() {
   mi_free(shard_);
   shard_ = nullptr;
   CompactObj::InitThreadLocal(nullptr);
+  quicklistReleaseNodePool();
   mi_heap_delete(tlh);
   VLOG(1) << "Shard reset " << index;
 }
@@ -138,6 +223,13 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
   VLOG(2) << "PollExecution " << context << " " << (trans ? trans->DebugId() : "") << " "
           << txq_.size() << " " << continuation_trans_;
 
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  absl::Cleanup record_busy = [this, start_ns] {
+    uint64_t usec = (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000;
+    stats_.poll_busy_usec += usec;
+    counter_[POLL_BUSY_USEC].IncBy(usec);
+  };
+
   ShardId sid = shard_id();
 
   uint16_t trans_mask = trans ? trans->GetLocalMask(sid) : 0;
@@ -166,6 +258,7 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
 
   Transaction* head = nullptr;
   string dbg_id;
+  bool sliced = false;
 
   if (continuation_trans_ == nullptr) {
     while (!txq_.Empty()) {
@@ -187,6 +280,21 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
       if (!is_armed)
         break;
 
+      // A writer of keys whose values are still being sent waits until they are unpinned. The
+      // transactions behind it that do not conflict run out of order below.
+      if (head->WritesPinnedKeys(this))
+        break;
+
+      // The ready fast transactions behind a heavy head run first, so that the point lookups do
+      // not wait for it.
+      bool is_heavy = heavy_ns_ && LaneOf(*head) == TxLane::HEAVY;
+      if (is_heavy && ooo_scan_depth_ > 0 && RunOutOfOrder(true) > 0) {
+        // trans did not run if it is still armed, and it is kept alive by its callback.
+        if (trans && !trans->IsArmedInShard(sid))
+          trans = nullptr;
+        continue;
+      }
+
       // It could be that head is processed and unblocks multi-hop transaction .
       // The transaction will schedule again and will arm another callback.
       // Then we will reach invalid state by running trans after this loop,
@@ -208,7 +316,7 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
         dbg_id = head->DebugId();
       }
 
-      bool keep = head->RunInShard(this);
+      bool keep = RunTransaction(head);
 
       // We should not access head from this point since RunInShard callback decrements refcount.
       DLOG_IF(INFO, !dbg_id.empty()) << "RunHead " << dbg_id << ", keep " << keep;
@@ -217,6 +325,15 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
         continuation_trans_ = head;
         break;
       }
+
+      // The tasks that wait in the shard queue, e.g. the hops of the fast commands, run before
+      // we continue with the tx-queue.
+      if (is_heavy && !txq_.Empty() && !queue_.Empty() &&
+          queue_.TryAdd([this] { PollExecution("heavy_slice", nullptr); })) {
+        ++stats_.heavy_slices;
+        sliced = true;
+        break;
+      }
     }       // while(!txq_.Empty())
   } else {  // if (continuation_trans_ == nullptr)
     DVLOG(1) << "Skipped TxQueue " << continuation_trans_;
@@ -240,9 +357,92 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
     }
     ++stats_.ooo_runs;
 
-    bool keep = trans->RunInShard(this);
+    bool keep = RunTransaction(trans);
     DLOG_IF(INFO, !dbg_id.empty()) << "Eager run " << sid << ", " << dbg_id << ", keep " << keep;
   }
+
+  // Whatever stopped the queue head, the transactions behind it may not conflict with it.
+  if (!txq_.Empty() && ooo_scan_depth_ > 0 && !sliced) {
+    RunOutOfOrder(false);
+  }
+}
+
+auto EngineShard::LaneOf(const Transaction& trans) const -> TxLane {
+  auto it = cmd_cost_ns_.find(trans.Name());
+  if (it != cmd_cost_ns_.end() && it->second >= heavy_ns_)
+    return TxLane::HEAVY;
+  return trans.IsFastCmd() ? TxLane::FAST : TxLane::NORMAL;
+}
+
+bool EngineShard::RunTransaction(Transaction* trans) {
+  if (heavy_ns_ == 0)
+    return trans->RunInShard(this);
+
+  // The name is owned by the command registry, so it outlives trans.
+  string_view name = trans->Name();
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  bool keep = trans->RunInShard(this);
+  uint64_t ns = ProactorBase::GetMonotonicTimeNs() - start_ns;
+
+  uint64_t& cost = cmd_cost_ns_[name];
+  cost = cost ? (cost * 7 + ns) / 8 : ns;
+  return keep;
+}
+
+size_t EngineShard::RunOutOfOrder(bool fast_only) {
+  ShardId sid = shard_id();
+  size_t runs = 0;
+
+  // A transaction is removed from txq_ when it runs, so we rescan the queue after every run.
+  while (!txq_.Empty()) {
+    // Same as with the queue head, the awaked transactions must run first.
+    if (blocking_controller_ && blocking_controller_->HasAwakedTransaction())
+      break;
+
+    // Intent locks fully describe the conflicts between transactions as long as their key sets
+    // are fixed. A multi transaction ahead of a multi-shard transaction could lock its keys
+    // later in one shard but earlier in another, so we allow only single shard ones past it.
+    bool multi_ahead = continuation_trans_ && continuation_trans_->IsMulti();
+    Transaction* ready = nullptr;
+
+    TxQueue::Iterator it = txq_.Head();
+    size_t depth = std::min<size_t>(txq_.size(), ooo_scan_depth_);
+    for (size_t i = 0; i < depth; ++i, it = txq_.Next(it)) {
+      Transaction* cand = absl::get<Transaction*>(txq_.At(it));
+
+      // A multi transaction stays as the continuation transaction after its first run.
+      bool can_continue = !cand->IsMulti() || continuation_trans_ == nullptr;
+      if (fast_only)
+        can_continue = !cand->IsMulti() && LaneOf(*cand) == TxLane::FAST;
+      if (can_continue && cand->IsReadyOutOfOrder(this, !multi_ahead)) {
+        ready = cand;
+        break;
+      }
+      multi_ahead |= cand->IsMulti();
+    }
+
+    if (!ready)
+      break;
+
+    string dbg_id;
+    if (VLOG_IS_ON(1)) {
+      dbg_id = ready->DebugId();
+    }
+    ++stats_.ooo_queue_runs;
+    stats_.fast_lane_runs += fast_only;
+    ++runs;
+    bool is_multi = ready->IsMulti();
+
+    // We do not update committed_txid_ since the transactions ahead of ready did not run yet.
+    bool keep = RunTransaction(ready);
+    DLOG_IF(INFO, !dbg_id.empty()) << "OOO run " << sid << ", " << dbg_id << ", keep " << keep;
+
+    if (keep) {
+      DCHECK(is_multi);
+      continuation_trans_ = ready;
+    }
+  }
+  return runs;
 }
 
 void EngineShard::ShutdownMulti(Transaction* multi) {
@@ -251,6 +451,14 @@ void EngineShard::ShutdownMulti(Transaction* multi) {
   }
 }
 
+bool EngineShard::TrySetContinuation(Transaction* multi) {
+  if (continuation_trans_)
+    return false;
+
+  continuation_trans_ = multi;
+  return true;
+}
+
 #if 0
 // There are several cases that contain proof of convergence for this shard:
 // 1. txq_ empty - it means that anything that is goonna be scheduled will already be scheduled
@@ -289,10 +497,54 @@ bool EngineShard::HasResultConverged(TxId notifyid) const {
 }
 #endif
 
+bool EngineShard::SkipIdleHeartbeat() {
+  HeartbeatState& st = heartbeat_state_;
+  if (st.max_skip == 0)
+    return false;
+
+  uint64_t activity = stats_.tx_hops + stats_.quick_runs;
+  bool idle = activity == st.last_activity && !st.backlog;
+  st.last_activity = activity;
+  if (!idle) {
+    st.skip_span = st.skipped = 0;
+    return false;
+  }
+
+  if (st.skipped < st.skip_span) {
+    ++st.skipped;
+    return true;
+  }
+
+  // Every heartbeat that finds the shard idle doubles the number of the beats skipped after it.
+  st.skipped = 0;
+  st.skip_span = min(max(1u, st.skip_span * 2), st.max_skip);
+  return false;
+}
+
 void EngineShard::Heartbeat() {
+  if (SkipIdleHeartbeat()) {
+    ++stats_.heartbeat_skips;
+    return;
+  }
+
+  ++stats_.heartbeats;
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   CacheStats();
+  uint64_t now_ns = ProactorBase::GetMonotonicTimeNs();
+  stats_.heartbeat_stats_ns += now_ns - start_ns;
+
+  // Charges the time since the previous checkpoint to the given counter.
+  auto charge = [&now_ns](uint64_t* dest) {
+    uint64_t prev_ns = now_ns;
+    now_ns = ProactorBase::GetMonotonicTimeNs();
+    *dest += now_ns - prev_ns;
+  };
+  bool backlog = false;
+
   constexpr double kTtlDeleteLimit = 200;
   constexpr double kRedLimitFactor = 0.1;
+  constexpr unsigned kRehashBucketsPerBeat = 1024;
+  constexpr unsigned kExpireWheelBudget = 2000;  // entries per db and heartbeat.
 
   uint32_t traversed = GetMovingSum6(TTL_TRAVERSE);
   uint32_t deleted = GetMovingSum6(TTL_DELETE);
@@ -305,28 +557,73 @@ void EngineShard::Heartbeat() {
     ttl_delete_target = kTtlDeleteLimit * double(deleted) / (double(traversed) + 10);
   }
 
+  // The expire wheel deletes the keys when they are due, the sampling of a bucket per
+  // heartbeat only remains a backstop.
+  if (db_slice_.expire_wheel_enabled()) {
+    ttl_delete_target = 3;
+  }
+
   ssize_t redline = (max_memory_limit * kRedLimitFactor) / shard_set->size();
   DbContext db_cntx;
   db_cntx.time_now_ms = GetCurrentTimeMs();
 
+  db_slice_.RebaseExpireStep(db_cntx.time_now_ms);
+  if (expiry_timer_.joinable()) {
+    // The keys due within the current and the next tick of the expire wheel.
+    db_slice_.SetSoonExpiryHorizon(db_cntx.time_now_ms + 2 * ExpireWheel::kTickMs);
+  }
+
   for (unsigned i = 0; i < db_slice_.db_array_size(); ++i) {
     if (!db_slice_.IsDbValid(i))
       continue;
 
     db_cntx.db_index = i;
-    auto [pt, expt] = db_slice_.GetTables(i);
-    if (expt->size() > pt->size() / 4) {
+    if (db_slice_.expire_wheel_enabled()) {
+      DbSlice::DeleteExpiredStats stats = db_slice_.ExpireWheelStep(db_cntx, kExpireWheelBudget);
+      counter_[TTL_TRAVERSE].IncBy(stats.traversed);
+      counter_[TTL_DELETE].IncBy(stats.deleted);
+      backlog |= stats.deleted > 0;
+    }
+
+    const DbTable& table = *db_slice_.GetDBTable(i);
+    if (table.expire_count > table.prime.size() / 4) {
       DbSlice::DeleteExpiredStats stats = db_slice_.DeleteExpiredStep(db_cntx, ttl_delete_target);
 
       counter_[TTL_TRAVERSE].IncBy(stats.traversed);
       counter_[TTL_DELETE].IncBy(stats.deleted);
+      backlog |= stats.deleted > 0;
     }
+    charge(&stats_.heartbeat_expire_ns);
 
     // if our budget is below the limit
     if (db_slice_.memory_budget() < redline) {
       db_slice_.FreeMemWithEvictionStep(i, redline - db_slice_.memory_budget());
+      backlog = true;
+      charge(&stats_.heartbeat_evict_ns);
     }
+
+    db_slice_.DecayFreqStep(i);
+    db_slice_.ExpireMembersStep(db_cntx);
+    db_slice_.TrimTimeSeriesStep(i);
+    db_slice_.ShrinkTablesStep(i);
+    charge(&stats_.heartbeat_maintenance_ns);
   }
+
+  // Advance incremental rehashing of sets/hashes that were grown by this shard.
+  backlog |= DenseSet::RehashPending(kRehashBucketsPerBeat) > 0;
+
+  DefragStep();
+  backlog |= !defrag_state_.sparse_pages.empty();
+  CompressListsStep();
+
+  // The offloading follows the memory usage, which may change without commands.
+  if (tiered_storage_) {
+    tiered_storage_->OffloadStep(UsedMemory(), max_memory_limit / shard_set->size());
+    backlog = true;
+  }
+  charge(&stats_.heartbeat_maintenance_ns);
+
+  heartbeat_state_.backlog = backlog;
 }
 
 void EngineShard::CacheStats() {
@@ -344,7 +641,7 @@ void EngineShard::CacheStats() {
     DbTable* table = db_slice_.GetDBTable(i);
     if (table) {
       entries += table->prime.size();
-      table_memory += (table->prime.mem_usage() + table->expire.mem_usage());
+      table_memory += table->prime.mem_usage();
     }
   }
   size_t obj_memory = table_memory <= used_mem ? used_mem - table_memory : 0;
@@ -353,20 +650,264 @@ void EngineShard::CacheStats() {
   db_slice_.SetCachedParams(free_mem / shard_set->size(), bytes_per_obj);
 }
 
+// Similarly to Redis activedefrag, values are reallocated so that the blocks they free empty
+// the underutilized pages, which mimalloc then reuses for other size classes or returns to
+// the OS. The pages are chosen once the fragmentation is detected and the tables are traversed
+// a few buckets at a time until the traversal completes.
+void EngineShard::DefragStep() {
+  constexpr unsigned kCheckPeriodBeats = 100;
+  constexpr unsigned kBucketsPerStep = 64;
+
+  double threshold = GetFlag(FLAGS_mem_defrag_threshold);
+  if (threshold <= 0)
+    return;
+
+  DefragState& st = defrag_state_;
+  if (st.sparse_pages.empty()) {
+    // Visiting the heap is not cheap, hence we do not do it every heartbeat.
+    if (++st.beats_since_check < kCheckPeriodBeats)
+      return;
+
+    st.beats_since_check = 0;
+    FindSparsePages(threshold);
+    if (st.sparse_pages.empty())
+      return;
+
+    st.db_index = 0;
+    st.cursor = 0;
+    ++stats_.defrag_scans;
+  }
+
+  auto is_sparse = [&st](const void* ptr) {
+    uintptr_t addr = uintptr_t(ptr);
+    auto it = upper_bound(st.sparse_pages.begin(), st.sparse_pages.end(),
+                          pair<uintptr_t, uintptr_t>{addr, UINTPTR_MAX});
+    return it != st.sparse_pages.begin() && addr < prev(it)->second;
+  };
+
+  string tmp;
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (pv.IsExternal() || pv.HasIoPending())
+      return;
+
+    // Commands that hold the key may keep pointers into its value across hops.
+    string_view key_arr[1] = {it->first.GetSlice(&tmp)};
+    if (!db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{st.db_index, key_arr, 1}))
+      return;
+
+    size_t prev_used = pv.MallocUsed();
+    if (!pv.DefragIfNeeded(is_sparse))
+      return;
+
+    ++stats_.defrag_realloc;
+    DbTableStats* stats = db_slice_.MutableStats(st.db_index);
+    stats->obj_memory_usage += pv.MallocUsed();
+    stats->obj_memory_usage -= prev_used;
+    db_slice_.AccountSlotMemory(st.db_index, it->first,
+                                ssize_t(pv.MallocUsed()) - ssize_t(prev_used));
+    if (pv.ObjType() == OBJ_STRING) {
+      stats->strval_memory_usage += pv.MallocUsed();
+      stats->strval_memory_usage -= prev_used;
+    }
+  };
+
+  for (unsigned i = 0; i < kBucketsPerStep;) {
+    if (st.db_index >= db_slice_.db_array_size()) {
+      st.sparse_pages.clear();  // The traversal is complete.
+      return;
+    }
+
+    if (!db_slice_.IsDbValid(st.db_index)) {
+      ++st.db_index;
+      continue;
+    }
+
+    PrimeTable* pt = db_slice_.GetPrimeTable(st.db_index);
+    st.cursor = pt->Traverse(st.cursor, cb);
+    if (!st.cursor)
+      ++st.db_index;
+    ++i;
+  }
+}
+
+// Lists get a second chance like the containers the tiered storage offloads: a pass clears
+// their touched bit and the next pass, idle_beats later, compresses the ones that were not
+// looked up in between. The bit is shared with the tiered storage scan, which may clear it too.
+void EngineShard::CompressListsStep() {
+  constexpr unsigned kBucketsPerStep = 64;
+
+  uint32_t idle_beats = GetFlag(FLAGS_list_compress_idle_beats);
+  if (idle_beats == 0)
+    return;
+
+  ListCompressState& st = list_compress_state_;
+  if (st.db_index >= db_slice_.db_array_size()) {
+    if (++st.beats_since_pass < idle_beats)
+      return;
+    st.beats_since_pass = 0;
+    st.db_index = 0;
+    st.cursor = 0;
+  }
+
+  string tmp;
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (pv.ObjType() != OBJ_LIST || pv.IsExternal())
+      return;
+
+    if (pv.IsTouched()) {
+      pv.SetTouched(false);
+      return;
+    }
+
+    // Commands that hold the key may keep pointers into its nodes across hops.
+    string_view key_arr[1] = {it->first.GetSlice(&tmp)};
+    if (!db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{st.db_index, key_arr, 1}))
+      return;
+
+    DCHECK_EQ(pv.Encoding(), OBJ_ENCODING_QUICKLIST);
+    stats_.list_compressed_nodes +=
+        quicklistCompressInterior((quicklist*)pv.RObjPtr(), &stats_.list_compress_saved_bytes);
+  };
+
+  for (unsigned i = 0; i < kBucketsPerStep && st.db_index < db_slice_.db_array_size(); ++i) {
+    if (!db_slice_.IsDbValid(st.db_index)) {
+      ++st.db_index;
+      continue;
+    }
+
+    PrimeTable* pt = db_slice_.GetPrimeTable(st.db_index);
+    st.cursor = pt->Traverse(st.cursor, cb);
+    if (!st.cursor)
+      ++st.db_index;
+  }
+}
+
+void EngineShard::FindSparsePages(double threshold) {
+  struct VisitState {
+    double page_util;
+    size_t used = 0;
+    size_t committed = 0;
+    vector<pair<uintptr_t, uintptr_t>> pages;
+  } vs{GetFlag(FLAGS_mem_defrag_page_utilization)};
+
+  auto visit_cb = [](const mi_heap_t* heap, const mi_heap_area_t* area, void* block,
+                     size_t block_size, void* arg) {
+    VisitState* vs = reinterpret_cast<VisitState*>(arg);
+
+    // mimalloc reports used in blocks instead of bytes.
+    size_t used = area->used * block_size;
+    vs->used += used;
+    vs->committed += area->committed;
+    if (used > 0 && used < area->committed * vs->page_util) {
+      uintptr_t start = uintptr_t(area->blocks);
+      vs->pages.emplace_back(start, start + area->reserved);
+    }
+    return true;
+  };
+
+  mi_heap_visit_blocks(mi_resource_.heap(), false /* visit all blocks*/, visit_cb, &vs);
+
+  if (vs.used == 0 || vs.committed < vs.used * threshold)
+    return;
+
+  VLOG(1) << "Defragmenting " << vs.pages.size() << " pages, used: " << vs.used
+          << " committed: " << vs.committed;
+  sort(vs.pages.begin(), vs.pages.end());
+  defrag_state_.sparse_pages = std::move(vs.pages);
+}
+
 size_t EngineShard::UsedMemory() const {
-  return mi_resource_.used() + zmalloc_used_memory_tl + SmallString::UsedThreadLocal();
+  size_t segment_bytes = segment_alloc_ ? segment_alloc_->used() : 0;
+  return mi_resource_.used() + segment_bytes + zmalloc_used_memory_tl +
+         SmallString::UsedThreadLocal();
+}
+
+auto EngineShard::GetLoadStats() const -> LoadStats {
+  LoadStats res;
+  res.txq_len = txq_.size();
+  res.hops_per_sec = GetMovingSum6(TX_HOPS) / 6;
+  res.busy_ratio = min(1.0, GetMovingSum6(POLL_BUSY_USEC) / 6e6);
+  res.hops = stats_.tx_hops;
+  res.cross_shard_hops = stats_.tx_cross_shard_hops;
+  res.blocked_transactions = blocking_controller_ ? blocking_controller_->NumBlocked() : 0;
+  res.heap_bytes = UsedMemory();
+  res.numa_node = numa_node_;
+  return res;
 }
 
-void EngineShard::AddBlocked(Transaction* trans) {
+auto EngineShard::GetHeapCounters() const -> HeapCounters {
+  HeapCounters res;
+  res.allocated = mi_resource_.allocated();
+  res.freed = mi_resource_.freed();
+  res.other_used = zmalloc_used_memory_tl + ssize_t(SmallString::UsedThreadLocal());
+  return res;
+}
+
+void EngineShard::RecordCmdMemory(string_view cmd, const HeapCounters& snapshot) {
+  HeapCounters now = GetHeapCounters();
+  CmdMemStats& st = cmd_mem_stats_[cmd];
+
+  st.allocated += now.allocated - snapshot.allocated;
+  st.freed += now.freed - snapshot.freed;
+
+  ssize_t other_delta = now.other_used - snapshot.other_used;
+  if (other_delta > 0)
+    st.allocated += other_delta;
+  else
+    st.freed -= other_delta;
+}
+
+void EngineShard::AddBlocked(Transaction* trans, ArgSlice keys) {
   if (!blocking_controller_) {
     blocking_controller_.reset(new BlockingController(this));
   }
-  blocking_controller_->AddWatched(trans);
+  blocking_controller_->AddWatched(trans, keys);
+}
+
+void EngineShard::StartExpiryTimer() {
+  expiry_timer_ = fibers::fiber([this] {
+    this_fiber::properties<FiberProps>().set_name("shard_expiry");
+    RunExpiryTimer();
+  });
+}
+
+void EngineShard::RunExpiryTimer() {
+  constexpr unsigned kMaxEntriesPerStep = 128;
+  auto* ec = db_slice_.soon_expiry_ec();
+
+  while (!stop_expiry_timer_) {
+    uint64_t deadline = db_slice_.NextSoonExpiry();
+    if (deadline == 0) {
+      ec->await([&] { return stop_expiry_timer_ || db_slice_.NextSoonExpiry() != 0; });
+      continue;
+    }
+
+    uint64_t now = GetCurrentTimeMs();
+    if (deadline > now) {
+      // Wakes up earlier if a key with an earlier deadline is queued.
+      auto earlier = [&] {
+        uint64_t next = db_slice_.NextSoonExpiry();
+        return stop_expiry_timer_ || (next != 0 && next < deadline);
+      };
+      ec->await_until(earlier, chrono::steady_clock::now() + chrono::milliseconds(deadline - now));
+      continue;
+    }
+
+    DbSlice::DeleteExpiredStats stats = db_slice_.SoonExpiryStep(now, kMaxEntriesPerStep);
+    counter_[TTL_TRAVERSE].IncBy(stats.traversed);
+    counter_[TTL_DELETE].IncBy(stats.deleted);
+    this_fiber::yield();
+  }
 }
 
 void EngineShard::TEST_EnableHeartbeat() {
   auto* pb = ProactorBase::me();
+  heartbeat_state_.max_skip = GetFlag(FLAGS_heartbeat_idle_ms);
   periodic_task_ = pb->AddPeriodic(1, [this] { Heartbeat(); });
+  if (!expiry_timer_.joinable())
+    StartExpiryTimer();
 }
 
 /**
@@ -400,7 +941,7 @@ void EngineShardSet::Shutdown() {
 void EngineShardSet::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   EngineShard::InitThreadLocal(pb, update_db_time);
   EngineShard* es = EngineShard::tlocal();
-  shard_queue_[es->shard_id()] = es->GetFiberQueue();
+  shard_queue_[es->shard_id()] = es->GetTaskQueue();
 }
 
 const vector<EngineShardSet::CachedStats>& EngineShardSet::GetCachedStats() {
@@ -411,8 +952,9 @@ void EngineShardSet::TEST_EnableHeartBeat() {
   RunBriefInParallel([](EngineShard* shard) { shard->TEST_EnableHeartbeat(); });
 }
 
-void EngineShardSet::TEST_EnableCacheMode() {
-  RunBriefInParallel([](EngineShard* shard) { shard->db_slice().TEST_EnableCacheMode(); });
+void EngineShardSet::TEST_EnableCacheMode(EvictionPolicy policy) {
+  RunBriefInParallel(
+      [policy](EngineShard* shard) { shard->db_slice().TEST_EnableCacheMode(policy); });
 }
 
 }  // namespace dfly
@@ -15,9 +15,15 @@ extern "C" {
 #include "base/string_view_sso.h"
 #include "core/external_alloc.h"
 #include "core/mi_memory_resource.h"
+#include "core/segment_allocator.h"
 #include "core/tx_queue.h"
 #include "server/channel_slice.h"
+#include "server/cluster/cluster_config.h"
 #include "server/db_slice.h"
+#include "server/keyspace_events.h"
+#include "server/search/doc_index.h"
+#include "server/task_queue.h"
+#include "server/tracking_table.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers_ext.h"
 #include "util/proactor_pool.h"
@@ -35,12 +41,75 @@ class BlockingController;
 class EngineShard {
  public:
   struct Stats {
-    uint64_t ooo_runs = 0;    // how many times transactions run as OOO.
-    uint64_t quick_runs = 0;  //  how many times single shard "RunQuickie" transaction run.
+    uint64_t ooo_runs = 0;        // how many times transactions run as OOO.
+    uint64_t quick_runs = 0;      //  how many times single shard "RunQuickie" transaction run.
+    uint64_t ooo_queue_runs = 0;  // how many times transactions run ahead of the tx-queue head.
+
+    uint64_t defrag_scans = 0;    // how many times the defragmentation traversed the tables.
+    uint64_t defrag_realloc = 0;  // how many values were moved off the underutilized pages.
+
+    // List nodes compressed by the idle list scan and the bytes it saved.
+    uint64_t list_compressed_nodes = 0;
+    size_t list_compress_saved_bytes = 0;
+
+    // How long snapshots paused to let the queued transactions run, in microseconds.
+    uint64_t snapshot_lag_usec = 0;
+
+    // Serialized changes that snapshots spilled to disk while their consumer lagged behind.
+    uint64_t snapshot_spill_bytes = 0;
+
+    // Shard callbacks that ran, and those of them that belong to multi-shard transactions.
+    uint64_t tx_hops = 0;
+    uint64_t tx_cross_shard_hops = 0;
+
+    // Time spent in PollExecution, in microseconds.
+    uint64_t poll_busy_usec = 0;
+
+    // Fast transactions that ran ahead of a heavy queue head, and the times the shard served
+    // its other tasks between the heavy transactions, see --tx_heavy_usec.
+    uint64_t fast_lane_runs = 0;
+    uint64_t heavy_slices = 0;
+
+    // Heartbeats that ran and that were skipped while the shard was idle, see
+    // --heartbeat_idle_ms, and the time the heartbeats spent by task, in nanoseconds.
+    uint64_t heartbeats = 0;
+    uint64_t heartbeat_skips = 0;
+    uint64_t heartbeat_stats_ns = 0;
+    uint64_t heartbeat_expire_ns = 0;
+    uint64_t heartbeat_evict_ns = 0;
+    uint64_t heartbeat_maintenance_ns = 0;
 
     Stats& operator+=(const Stats&);
   };
 
+  // Bytes allocated and freed on the shard heap by the shard callbacks of a command.
+  struct CmdMemStats {
+    uint64_t allocated = 0;
+    uint64_t freed = 0;
+  };
+
+  // Load gauges of a single shard, to spot the shards that are hotter than the others.
+  struct LoadStats {
+    size_t txq_len = 0;
+    uint32_t hops_per_sec = 0;
+    double busy_ratio = 0;  // of PollExecution over the last seconds, in [0, 1].
+    uint64_t hops = 0;
+    uint64_t cross_shard_hops = 0;
+    size_t blocked_transactions = 0;
+    size_t heap_bytes = 0;
+    int numa_node = -1;
+  };
+
+  // Keyed by the command name, which is owned by the command registry.
+  using CmdMemStatsMap = absl::flat_hash_map<std::string_view, CmdMemStats>;
+
+  // Snapshot of the shard heap counters, taken before running a shard callback.
+  struct HeapCounters {
+    uint64_t allocated = 0;
+    uint64_t freed = 0;
+    ssize_t other_used = 0;  // zmalloc and small strings only track the net usage.
+  };
+
   // EngineShard() is private down below.
   ~EngineShard();
 
@@ -70,11 +139,30 @@ class EngineShard {
     return channel_slice_;
   }
 
+  KeyspaceEvents& keyspace_events() {
+    return keyspace_events_;
+  }
+
+  TrackingTable& tracking_table() {
+    return tracking_table_;
+  }
+
+  ShardDocIndices& search_indices() {
+    return search_indices_;
+  }
+
   std::pmr::memory_resource* memory_resource() {
     return &mi_resource_;
   }
 
-  ::util::fibers_ext::FiberQueue* GetFiberQueue() {
+  // The resource of the key tables, which allocates their segments from huge pages if
+  // table_huge_pages is set.
+  std::pmr::memory_resource* table_memory_resource() {
+    return segment_alloc_ ? static_cast<std::pmr::memory_resource*>(segment_alloc_.get())
+                          : &mi_resource_;
+  }
+
+  TaskQueue* GetTaskQueue() {
     return &queue_;
   }
 
@@ -100,10 +188,27 @@ class EngineShard {
   // TODO: Awkward interface. I should solve it somehow.
   void ShutdownMulti(Transaction* multi);
 
+  // Makes multi the continuation transaction unless the shard already runs one.
+  bool TrySetContinuation(Transaction* multi);
+
   void IncQuickRun() {
     stats_.quick_runs++;
   }
 
+  void RecordHop(bool cross_shard) {
+    stats_.tx_hops++;
+    stats_.tx_cross_shard_hops += cross_shard;
+    counter_[TX_HOPS].Inc();
+  }
+
+  void AddSnapshotLag(uint64_t usec) {
+    stats_.snapshot_lag_usec += usec;
+  }
+
+  void AddSnapshotSpill(uint64_t bytes) {
+    stats_.snapshot_spill_bytes += bytes;
+  }
+
   const Stats& stats() const {
     return stats_;
   }
@@ -111,12 +216,23 @@ class EngineShard {
   // Returns used memory for this shard.
   size_t UsedMemory() const;
 
+  LoadStats GetLoadStats() const;
+
+  HeapCounters GetHeapCounters() const;
+
+  // Charges cmd with the heap activity since the snapshot.
+  void RecordCmdMemory(std::string_view cmd, const HeapCounters& snapshot);
+
+  const CmdMemStatsMap& cmd_mem_stats() const {
+    return cmd_mem_stats_;
+  }
+
   TieredStorage* tiered_storage() {
     return tiered_storage_.get();
   }
 
   // Adds blocked transaction to the watch-list.
-  void AddBlocked(Transaction* trans);
+  void AddBlocked(Transaction* trans, ArgSlice keys);
 
   BlockingController* blocking_controller() {
     return blocking_controller_.get();
@@ -126,7 +242,7 @@ class EngineShard {
   sds tmp_str1;
 
   // Moving average counters.
-  enum MovingCnt { TTL_TRAVERSE, TTL_DELETE, COUNTER_TOTAL };
+  enum MovingCnt { TTL_TRAVERSE, TTL_DELETE, TX_HOPS, POLL_BUSY_USEC, COUNTER_TOTAL };
 
   // Returns moving sum over the last 6 seconds.
   uint32_t GetMovingSum6(MovingCnt type) const {
@@ -151,17 +267,53 @@ class EngineShard {
 
   void Heartbeat();
 
+  // Whether the heartbeat backs off since the shard is idle, see --heartbeat_idle_ms.
+  bool SkipIdleHeartbeat();
+
+  // Deletes the keys of the soon expiry queue of db_slice_ when they are due, see
+  // DbSlice::NextSoonExpiry. Runs in expiry_timer_.
+  void RunExpiryTimer();
+  void StartExpiryTimer();
+
   void CacheStats();
 
-  ::util::fibers_ext::FiberQueue queue_;
+  // Moves values off the underutilized heap pages. Runs incrementally from the heartbeat.
+  void DefragStep();
+
+  // Fills defrag_state_.sparse_pages if the heap fragmentation crossed the threshold.
+  void FindSparsePages(double threshold);
+
+  // Compresses the lists that were not accessed for list_compress_idle_beats heartbeats.
+  void CompressListsStep();
+
+  // The scheduling lanes of the transactions. The heavy ones are the commands whose shard
+  // callbacks take at least --tx_heavy_usec on average.
+  enum class TxLane : uint8_t { FAST, NORMAL, HEAVY };
+
+  TxLane LaneOf(const Transaction& trans) const;
+
+  // Runs the shard callback of trans and updates the average cost of its command.
+  bool RunTransaction(Transaction* trans);
+
+  // Runs the armed transactions from the tx-queue that do not conflict with the transactions
+  // ahead of them, when the queue head can not progress. If fast_only is set, runs only the
+  // single hop transactions of the fast lane. Returns the number of the transactions that ran.
+  size_t RunOutOfOrder(bool fast_only);
+
+  TaskQueue queue_;
   ::boost::fibers::fiber fiber_q_;
 
   TxQueue txq_;
   MiMemoryResource mi_resource_;
+  std::unique_ptr<SegmentAllocator> segment_alloc_;  // Must outlive db_slice_.
   DbSlice db_slice_;
   ChannelSlice channel_slice_;
+  TrackingTable tracking_table_;
+  ShardDocIndices search_indices_;
+  KeyspaceEvents keyspace_events_;
 
   Stats stats_;
+  CmdMemStatsMap cmd_mem_stats_;
 
   // Logical ts used to order distributed transactions.
   TxId committed_txid_ = 0;
@@ -170,11 +322,48 @@ class EngineShard {
   IntentLock shard_lock_;
 
   uint32_t periodic_task_ = 0;
+  ::boost::fibers::fiber expiry_timer_;
+  bool stop_expiry_timer_ = false;
+  uint32_t ooo_scan_depth_;
+  uint64_t heavy_ns_;  // 0 if the lanes are disabled.
+
+  // Moving averages of the running time of the shard callbacks by the command name. Filled only
+  // if the lanes are enabled.
+  absl::flat_hash_map<std::string_view, uint64_t> cmd_cost_ns_;
+  int numa_node_ = -1;  // Of the thread of the shard.
   std::unique_ptr<TieredStorage> tiered_storage_;
   std::unique_ptr<BlockingController> blocking_controller_;
 
   using Counter = util::SlidingCounter<7>;
 
+  struct DefragState {
+    // Sorted [start, end) address ranges of the heap pages that are being drained.
+    std::vector<std::pair<uintptr_t, uintptr_t>> sparse_pages;
+    DbIndex db_index = 0;
+    PrimeTable::Cursor cursor;
+    unsigned beats_since_check = 0;
+  };
+
+  DefragState defrag_state_;
+
+  struct ListCompressState {
+    DbIndex db_index = 0;
+    PrimeTable::Cursor cursor;
+    unsigned beats_since_pass = 0;
+  };
+
+  ListCompressState list_compress_state_;
+
+  struct HeartbeatState {
+    unsigned max_skip = 0;  // the most beats skipped in a row, 0 - the heartbeats never back off.
+    unsigned skip_span = 0;
+    unsigned skipped = 0;
+    uint64_t last_activity = 0;  // the transaction runs at the previous heartbeat.
+    bool backlog = false;        // whether the previous heartbeat left work behind.
+  };
+
+  HeartbeatState heartbeat_state_;
+
   Counter counter_[COUNTER_TOTAL];
   std::vector<Counter> ttl_survivor_sum_;  // we need it per db.
 
@@ -247,13 +436,13 @@ class EngineShardSet {
 
   // Used in tests
   void TEST_EnableHeartBeat();
-  void TEST_EnableCacheMode();
+  void TEST_EnableCacheMode(EvictionPolicy policy = EvictionPolicy::ALLKEYS_LFU);
 
  private:
   void InitThreadLocal(util::ProactorBase* pb, bool update_db_time);
 
   util::ProactorPool* pp_;
-  std::vector<util::fibers_ext::FiberQueue*> shard_queue_;
+  std::vector<TaskQueue*> shard_queue_;
 };
 
 template <typename U, typename P>
@@ -290,6 +479,10 @@ template <typename U> void EngineShardSet::RunBlockingInParallel(U&& func) {
 }
 
 inline ShardId Shard(std::string_view v, ShardId shard_num) {
+  // A hash slot lives in a single shard, so the keys of a slot are reached with a single hop.
+  if (ClusterConfig::IsEnabled())
+    return ClusterConfig::KeySlot(v) % shard_num;
+
   XXH64_hash_t hash = XXH64(v.data(), v.size(), 120577240643ULL);
   return hash % shard_num;
 }
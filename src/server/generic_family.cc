@@ -4,6 +4,12 @@
 
 #include "server/generic_family.h"
 
+#include <absl/time/clock.h>
+
+#include <cmath>
+#include <deque>
+#include <numeric>
+
 extern "C" {
 #include "redis/crc64.h"
 #include "redis/object.h"
@@ -12,6 +18,8 @@ extern "C" {
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 #include "redis/rdb.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
@@ -19,13 +27,21 @@ extern "C" {
 #include "server/container_utils.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/hset_family.h"
+#include "server/journal/journal.h"
+#include "server/rdb_extensions.h"
 #include "server/rdb_load.h"
 #include "server/rdb_save.h"
+#include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "util/varz.h"
 
 ABSL_FLAG(uint32_t, dbnum, 16, "Number of databases");
 ABSL_FLAG(uint32_t, keys_output_limit, 8192, "Maximum number of keys output by keys command");
+ABSL_FLAG(uint32_t, scan_time_budget_usec, 10000,
+          "Time a SCAN call may spend traversing the keys. Once it is spent, SCAN returns the keys "
+          "it found so far with its cursor, so that rare patterns do not stall the shards. "
+          "0 - unlimited.");
 
 namespace dfly {
 using namespace std;
@@ -43,10 +59,10 @@ int64_t CalculateExpirationTime(bool seconds, bool absolute, int64_t ts, int64_t
   return rel_msec;
 }
 
-VersionBuffer MakeRdbVersion() {
+VersionBuffer MakeRdbVersion(uint16_t version) {
   VersionBuffer buf;
-  buf[0] = RDB_VERSION & 0xff;
-  buf[1] = (RDB_VERSION >> 8) & 0xff;
+  buf[0] = version & 0xff;
+  buf[1] = (version >> 8) & 0xff;
   return buf;
 }
 
@@ -57,20 +73,20 @@ CrcBuffer MakeCheckSum(std::string_view dump_res) {
   return buf;
 }
 
-void AppendFooter(std::string* dump_res) {
+void AppendFooter(std::string* dump_res, uint16_t version = RDB_VERSION) {
   /* Write the footer, this is how it looks like:
    * ----------------+---------------------+---------------+
    * ... RDB payload | 2 bytes RDB version | 8 bytes CRC64 |
    * ----------------+---------------------+---------------+
    * RDB version and CRC are both in little endian.
    */
-  const auto ver = MakeRdbVersion();
+  const auto ver = MakeRdbVersion(version);
   dump_res->append(ver.data(), ver.size());
   const auto crc = MakeCheckSum(*dump_res);
   dump_res->append(crc.data(), crc.size());
 }
 
-bool VerifyFooter(std::string_view msg) {
+bool VerifyFooter(std::string_view msg, uint16_t max_version = RDB_VERSION) {
   if (msg.size() <= DUMP_FOOTER_SIZE) {
     LOG(WARNING) << "got restore payload that is too short - " << msg.size();
     return false;
@@ -78,9 +94,9 @@ bool VerifyFooter(std::string_view msg) {
   const uint8_t* footer =
       reinterpret_cast<const uint8_t*>(msg.data()) + (msg.size() - DUMP_FOOTER_SIZE);
   uint16_t version = (*(footer + 1) << 8 | (*footer));
-  if (version > RDB_VERSION) {
+  if (version > max_version) {
     LOG(WARNING) << "got restore payload with illegal version - supporting version up to "
-                 << RDB_VERSION << " got version " << version;
+                 << max_version << " got version " << version;
     return false;
   }
   uint64_t expected_cs =
@@ -126,13 +142,22 @@ class RdbRestoreValue : protected RdbLoaderBase {
   bool Add(std::string_view payload, std::string_view key, DbSlice& db_slice, DbIndex index,
            uint64_t expire_ms);
 
+  // Decompresses a block compressed by BlobCompressor.
+  bool Decompress(std::string_view block, std::string* dest);
+
  private:
   std::optional<OpaqueObj> Parse(std::string_view payload);
+
+  // Drops the input left from the previous call, so that the loader can be reused.
+  void SetSource(InMemSource* source) {
+    mem_buf_.ConsumeInput(mem_buf_.InputLen());
+    src_ = source;
+  }
 };
 
 std::optional<RdbLoaderBase::OpaqueObj> RdbRestoreValue::Parse(std::string_view payload) {
   InMemSource source(payload);
-  src_ = &source;
+  SetSource(&source);
   if (auto type_id = FetchType(); type_id && rdbIsObjectType(type_id.value())) {
     io::Result<OpaqueObj> io_res = ReadObj(type_id.value());  // load the type from the input stream
     if (!io_res) {
@@ -165,6 +190,91 @@ bool RdbRestoreValue::Add(std::string_view data, std::string_view key, DbSlice&
   return added;
 }
 
+bool RdbRestoreValue::Decompress(std::string_view block, std::string* dest) {
+  InMemSource source(block);
+  SetSource(&source);
+  auto opcode = FetchType();
+  if (!opcode ||
+      (*opcode != RDB_OPCODE_COMPRESSED_ZSTD_BLOB && *opcode != RDB_OPCODE_COMPRESSED_LZ4_BLOB)) {
+    return false;
+  }
+  return !FetchCompressedBlob(*opcode, dest);
+}
+
+// MDUMP payloads hold a block of records per shard, followed by the footer of DUMP with
+// RDB_NATIVE_VERSION. Each block follows its 4 byte length and is either kRawRecords followed by
+// the records or the records compressed by BlobCompressor. A record holds the 4 byte length of
+// the key, the key, its 8 byte expiry in ms (0 for none), the 4 byte length of the value and
+// the value serialized like DUMP does. The integers are little endian.
+constexpr uint8_t kRawRecords = 0;
+
+// A record of an MDUMP payload, refers to the payload.
+struct DumpRecord {
+  std::string_view key;
+  uint64_t expire_ms;
+  std::string_view value;
+};
+
+void AppendBlob(std::string_view blob, std::string* dest) {
+  char len[sizeof(uint32_t)];
+  absl::little_endian::Store32(len, blob.size());
+  dest->append(len, sizeof(len));
+  dest->append(blob);
+}
+
+// Consumes the blob that AppendBlob appended to src.
+bool ConsumeBlob(std::string_view* src, std::string_view* blob) {
+  if (src->size() < sizeof(uint32_t))
+    return false;
+  uint32_t len = absl::little_endian::Load32(src->data());
+  if (src->size() - sizeof(uint32_t) < len)
+    return false;
+  *blob = src->substr(sizeof(uint32_t), len);
+  src->remove_prefix(sizeof(uint32_t) + len);
+  return true;
+}
+
+void AppendDumpRecord(const DumpRecord& record, std::string* dest) {
+  AppendBlob(record.key, dest);
+  char expire[sizeof(uint64_t)];
+  absl::little_endian::Store64(expire, record.expire_ms);
+  dest->append(expire, sizeof(expire));
+  AppendBlob(record.value, dest);
+}
+
+// Splits the records of an MDUMP payload without its footer between the shards of their keys.
+// The compressed blocks are decompressed into the strings of decompressed, which the records
+// then refer to. Returns false if the payload is malformed.
+bool SplitDumpRecords(std::string_view payload, std::deque<std::string>* decompressed,
+                      std::vector<std::vector<DumpRecord>>* shard_records) {
+  RdbRestoreValue loader;
+  while (!payload.empty()) {
+    std::string_view block;
+    if (!ConsumeBlob(&payload, &block) || block.empty())
+      return false;
+
+    if (block[0] == kRawRecords) {
+      block.remove_prefix(1);
+    } else {
+      if (!loader.Decompress(block, &decompressed->emplace_back()))
+        return false;
+      block = decompressed->back();
+    }
+
+    while (!block.empty()) {
+      DumpRecord record;
+      if (!ConsumeBlob(&block, &record.key) || block.size() < sizeof(uint64_t))
+        return false;
+      record.expire_ms = absl::little_endian::Load64(block.data());
+      block.remove_prefix(sizeof(uint64_t));
+      if (!ConsumeBlob(&block, &record.value))
+        return false;
+      (*shard_records)[Shard(record.key, shard_records->size())].push_back(record);
+    }
+  }
+  return true;
+}
+
 class RestoreArgs {
   static constexpr int64_t NO_EXPIRATION = 0;
 
@@ -266,12 +376,27 @@ OpResult<RestoreArgs> RestoreArgs::TryFrom(const CmdArgList& args) {
 
 OpStatus OpPersist(const OpArgs& op_args, string_view key);
 
+// Prepares a container for being moved to another shard thread. Sets and hashes that are being
+// rehashed are registered in the thread that grew them, see DenseSet::RehashPending.
+void DetachValue(const PrimeValue& pv) {
+  if (pv.Encoding() != kEncodingStrMap2)
+    return;
+
+  if (pv.ObjType() == OBJ_SET) {
+    static_cast<StringSet*>(pv.RObjPtr())->Detach();
+  } else if (pv.ObjType() == OBJ_HASH) {
+    static_cast<StringMap*>(pv.RObjPtr())->Detach();
+  }
+}
+
 class Renamer {
  public:
   Renamer(ShardId source_id) : src_sid_(source_id) {
   }
 
-  void Find(Transaction* t);
+  // Unless skip_exist_dest is set, the outcome does not depend on the destination, so the
+  // source value is moved out in the same hop.
+  void Find(Transaction* t, bool skip_exist_dest);
 
   OpResult<void> status() const {
     return status_;
@@ -284,6 +409,7 @@ class Renamer {
   OpStatus UpdateDest(Transaction* t, EngineShard* es);
 
   ShardId src_sid_;
+  bool src_moved_ = false;
 
   struct FindResult {
     string_view key;
@@ -293,15 +419,15 @@ class Renamer {
     bool found = false;
   };
 
-  PrimeValue pv_;
+  CompactObj pv_;  // without the deadline, which is in src_res_.
   string str_val_;
 
   FindResult src_res_, dest_res_;  // index 0 for source, 1 for destination
   OpResult<void> status_;
 };
 
-void Renamer::Find(Transaction* t) {
-  auto cb = [this](Transaction* t, EngineShard* shard) {
+void Renamer::Find(Transaction* t, bool skip_exist_dest) {
+  auto cb = [this, skip_exist_dest](Transaction* t, EngineShard* shard) {
     auto args = t->ShardArgsInShard(shard->shard_id());
     CHECK_EQ(1u, args.size());
 
@@ -309,14 +435,19 @@ void Renamer::Find(Transaction* t) {
 
     res->key = args.front();
     auto& db_slice = EngineShard::tlocal()->db_slice();
-    auto [it, exp_it] = db_slice.FindExt(t->db_context(), res->key);
+    PrimeIterator it = db_slice.FindExt(t->db_context(), res->key);
 
     res->found = IsValid(it);
     if (IsValid(it)) {
       res->ref_val = it->second.AsRef();
-      res->expire_ts = db_slice.ExpireTime(exp_it);
+      res->expire_ts = db_slice.ExpireTime(it);
       res->sticky = it->first.IsSticky();
     }
+
+    if (res->found && res == &src_res_ && !skip_exist_dest) {
+      src_moved_ = true;
+      return MoveSrc(t, shard);
+    }
     return OpStatus::OK;
   };
 
@@ -342,30 +473,47 @@ void Renamer::Finalize(Transaction* t, bool skip_exist_dest) {
 
   DCHECK(src_res_.ref_val.IsRef());
 
-  // Src key exist and we need to override the destination.
-  // Alternatively, we could apply an optimistic algorithm and move src at Find step.
-  // We would need to restore the state in case of cleanups.
-  t->Execute([&](Transaction* t, EngineShard* shard) { return MoveSrc(t, shard); }, false);
+  // Src key exist and we need to override the destination. RENAMENX moves the source only
+  // now, since it would need to restore it if the destination existed.
+  if (!src_moved_)
+    t->Execute([&](Transaction* t, EngineShard* shard) { return MoveSrc(t, shard); }, false);
   t->Execute([&](Transaction* t, EngineShard* shard) { return UpdateDest(t, shard); }, true);
 }
 
 OpStatus Renamer::MoveSrc(Transaction* t, EngineShard* es) {
   if (es->shard_id() == src_sid_) {  // Handle source key.
-    // TODO: to call PreUpdate/PostUpdate.
-    auto it = es->db_slice().FindExt(t->db_context(), src_res_.key).first;
+    auto& db_slice = es->db_slice();
+    auto it = db_slice.FindExt(t->db_context(), src_res_.key);
     CHECK(IsValid(it));
 
     // We distinguish because of the SmallString that is pinned to its thread by design,
     // thus can not be accessed via another thread.
-    // Therefore, we copy it to standard string in its thread.
+    // Therefore, we copy it to standard string in its thread. Offloaded strings live in the
+    // file of this shard, so they are read back here as well. The containers are handed over
+    // as they are, the destination shard takes ownership of their allocations.
+    if (it->second.ObjType() == OBJ_STRING) {
+      if (it->second.IsExternal()) {
+        auto [offset, size] = it->second.GetExternalPtr();
+        str_val_.resize(size);
+        error_code ec = es->tiered_storage()->Read(offset, size, str_val_.data());
+        CHECK(!ec) << "TBD: " << ec;
+      } else {
+        it->second.GetString(&str_val_);
+      }
+    }
+
+    // Accounts for the value leaving the shard and lets the snapshots serialize it.
+    db_slice.PreUpdate(t->db_index(), it);
+    bool has_expire = it->second.HasExpire(), has_flag = it->second.HasFlag();
     if (it->second.ObjType() == OBJ_STRING) {
-      it->second.GetString(&str_val_);
+      it->second.Reset();
     } else {
-      bool has_expire = it->second.HasExpire();
+      DetachValue(it->second);
       pv_ = std::move(it->second);
-      it->second.SetExpire(has_expire);
     }
-    CHECK(es->db_slice().Del(t->db_index(), it));  // delete the entry with empty value in it.
+    it->second.SetExpire(has_expire);
+    it->second.SetFlag(has_flag);
+    CHECK(db_slice.Del(t->db_index(), it));  // delete the entry with empty value in it.
   }
 
   return OpStatus::OK;
@@ -375,20 +523,25 @@ OpStatus Renamer::UpdateDest(Transaction* t, EngineShard* es) {
   if (es->shard_id() != src_sid_) {
     auto& db_slice = es->db_slice();
     string_view dest_key = dest_res_.key;
-    PrimeIterator dest_it = db_slice.FindExt(t->db_context(), dest_key).first;
+    PrimeIterator dest_it = db_slice.FindExt(t->db_context(), dest_key);
     bool is_prior_list = false;
 
     if (IsValid(dest_it)) {
       bool has_expire = dest_it->second.HasExpire();
       is_prior_list = dest_it->second.ObjType() == OBJ_LIST;
 
+      db_slice.PreUpdate(t->db_index(), dest_it);
       if (src_res_.ref_val.ObjType() == OBJ_STRING) {
         dest_it->second.SetString(str_val_);
       } else {
         dest_it->second = std::move(pv_);
       }
       dest_it->second.SetExpire(has_expire);  // preserve expire flag.
-      db_slice.UpdateExpire(t->db_index(), dest_it, src_res_.expire_ts);
+      db_slice.PostUpdate(t->db_index(), dest_it, dest_key);
+      if (has_expire && src_res_.expire_ts)
+        db_slice.SetExpireTime(t->db_index(), dest_it, src_res_.expire_ts);
+      else
+        db_slice.UpdateExpire(t->db_index(), dest_it, src_res_.expire_ts);
     } else {
       if (src_res_.ref_val.ObjType() == OBJ_STRING) {
         pv_.SetString(str_val_);
@@ -408,12 +561,12 @@ OpStatus Renamer::UpdateDest(Transaction* t, EngineShard* es) {
 
 OpStatus OpPersist(const OpArgs& op_args, string_view key) {
   auto& db_slice = op_args.shard->db_slice();
-  auto [it, expire_it] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
 
   if (!IsValid(it)) {
     return OpStatus::KEY_NOTFOUND;
   } else {
-    if (IsValid(expire_it)) {
+    if (it->second.HasExpire()) {
       // The SKIPPED not really used, just placeholder for error
       return db_slice.UpdateExpire(op_args.db_cntx.db_index, it, 0) ? OpStatus::OK
                                                                     : OpStatus::SKIPPED;
@@ -424,7 +577,7 @@ OpStatus OpPersist(const OpArgs& op_args, string_view key) {
 
 OpResult<std::string> OpDump(const OpArgs& op_args, string_view key) {
   auto& db_slice = op_args.shard->db_slice();
-  auto [it, expire_it] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
 
   if (IsValid(it)) {
     DVLOG(1) << "Dump: key '" << key << "' successfully found, going to dump it";
@@ -436,7 +589,8 @@ OpResult<std::string> OpDump(const OpArgs& op_args, string_view key) {
     // 2. Save footer: this include the RDB version and the CRC value for the message
     unsigned obj_type = it->second.ObjType();
     unsigned encoding = it->second.Encoding();
-    auto type = RdbObjectType(obj_type, encoding);
+    // DUMP payloads carry RDB_VERSION, so they keep the ziplist encoding.
+    auto type = RdbObjectType(obj_type, encoding, false);
     DVLOG(1) << "We are going to dump object type: " << type;
     std::error_code ec = serializer.WriteOpcode(type);
     CHECK(!ec);
@@ -463,7 +617,7 @@ OpResult<bool> OnRestore(const OpArgs& op_args, std::string_view key, std::strin
   auto& db_slice = op_args.shard->db_slice();
   // The redis impl (see cluster.c function restoreCommand), remove the old key if
   // the replace option is set, so lets do the same here
-  auto [from_it, from_expire] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator from_it = db_slice.FindExt(op_args.db_cntx, key);
   if (restore_args.Replace()) {
     if (IsValid(from_it)) {
       VLOG(1) << "restore command is running with replace, found old key '" << key
@@ -488,15 +642,96 @@ OpResult<bool> OnRestore(const OpArgs& op_args, std::string_view key, std::strin
                     restore_args.ExpirationTime());
 }
 
+// Serializes the keys of the shard into a block of MDUMP records, all with the same serializer.
+// Returns an empty block if none of the keys exists.
+std::string OpMDump(const OpArgs& op_args, ArgSlice keys) {
+  auto& db_slice = op_args.shard->db_slice();
+  ::io::StringSink sink;
+  RdbSerializer serializer(&sink);
+  serializer.set_native_encoding(true);
+
+  std::string records;
+  for (std::string_view key : keys) {
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
+    if (!IsValid(it))
+      continue;
+
+    const PrimeValue& pv = it->second;
+    std::error_code ec = serializer.WriteOpcode(RdbObjectType(pv.ObjType(), pv.Encoding(), true));
+    CHECK(!ec);
+    ec = serializer.SaveValue(pv);
+    CHECK(!ec);
+    ec = serializer.FlushMem();
+    CHECK(!ec);
+
+    AppendDumpRecord({key, uint64_t(db_slice.ExpireTime(it)), sink.str()}, &records);
+    sink.Clear();
+  }
+
+  if (records.empty())
+    return records;
+
+  auto compressor = BlobCompressor::Create();
+  if (compressor && compressor->Compress(&records))
+    return records;
+  return std::string(1, char(kRawRecords)) + records;
+}
+
+// Restores the records of the shard, skipping the expired ones and the existing keys unless
+// replace is set. Returns the number of the restored keys.
+OpResult<uint32_t> OpMRestore(const OpArgs& op_args, const std::vector<DumpRecord>& records,
+                              bool replace) {
+  auto& db_slice = op_args.shard->db_slice();
+  RdbRestoreValue loader;
+  std::string journal_records(1, char(kRawRecords));
+  uint32_t restored = 0;
+
+  for (const DumpRecord& record : records) {
+    if (record.expire_ms && record.expire_ms <= op_args.db_cntx.time_now_ms)
+      continue;
+
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, record.key);
+    if (IsValid(it)) {
+      if (!replace)
+        continue;
+      CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
+    }
+
+    if (!loader.Add(record.value, record.key, db_slice, op_args.db_cntx.db_index,
+                    record.expire_ms)) {
+      return OpStatus::INVALID_VALUE;
+    }
+    ++restored;
+    if (op_args.shard->journal())
+      AppendDumpRecord(record, &journal_records);
+  }
+
+  // The replicas restore the same records, regardless of their keys at the time.
+  if (restored && op_args.shard->journal()) {
+    std::string payload;
+    AppendBlob(journal_records, &payload);
+    AppendFooter(&payload, RDB_NATIVE_VERSION);
+    std::string_view journal_args[] = {payload, "REPLACE"};
+    RecordJournal(op_args, "MRESTORE", journal_args);
+  }
+  return restored;
+}
+
 bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, StringVec* res) {
+  // Keys that share a dictionary prefix can be rejected without materializing them.
+  string_view prefix = it->first.GetPrefix();
+  if (!prefix.empty() && !opts.MayMatchPrefix(prefix))
+    return false;
+
   auto& db_slice = op_args.shard->db_slice();
   if (it->second.HasExpire()) {
-    it = db_slice.ExpireIfNeeded(op_args.db_cntx, it).first;
+    it = db_slice.ExpireIfNeeded(op_args.db_cntx, it);
   }
 
   if (!IsValid(it))
     return false;
 
+  // The cheap filters run first, the pattern is matched last.
   bool matches = opts.type_filter.empty() || ObjTypeName(it->second.ObjType()) == opts.type_filter;
 
   if (!matches)
@@ -506,16 +741,30 @@ bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, Strin
     return false;
   }
 
-  string str = it->first.ToString();
-  if (!opts.Matches(str)) {
+  if (opts.min_ttl_ms > 0 && it->second.HasExpire() &&
+      db_slice.ExpireTime(it) - int64_t(op_args.db_cntx.time_now_ms) < opts.min_ttl_ms) {
+    return false;
+  }
+
+  if (opts.max_size != SIZE_MAX && it->second.MallocUsed() > opts.max_size) {
     return false;
   }
-  res->push_back(std::move(str));
+
+  // The keys are copied only when they match.
+  string scratch;
+  string_view key = it->first.GetSlice(&scratch);
+  if (!opts.Matches(key)) {
+    return false;
+  }
+  res->emplace_back(key);
 
   return true;
 }
 
-void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t* cursor, StringVec* vec) {
+// Traverses the table from cursor until limit keys are found, the table ends or the deadline
+// passes. The deadline is checked every few buckets, 0 means no deadline.
+void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t deadline_ns,
+            uint64_t* cursor, StringVec* vec) {
   auto& db_slice = op_args.shard->db_slice();
   DCHECK(db_slice.IsDbValid(op_args.db_cntx.db_index));
 
@@ -525,10 +774,13 @@ void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t* cursor,
           << db_slice.DbSize(op_args.db_cntx.db_index);
 
   PrimeTable::Cursor cur = *cursor;
-  auto [prime_table, expire_table] = db_slice.GetTables(op_args.db_cntx.db_index);
+  PrimeTable* prime_table = db_slice.GetPrimeTable(op_args.db_cntx.db_index);
+  unsigned steps = 0;
   do {
     cur = prime_table->Traverse(
         cur, [&](PrimeIterator it) { cnt += ScanCb(op_args, it, scan_opts, vec); });
+    if (deadline_ns && ++steps % 64 == 0 && absl::GetCurrentTimeNanos() >= deadline_ns)
+      break;
   } while (cur && cnt < scan_opts.limit);
 
   VLOG(1) << "OpScan " << db_slice.shard_id() << " cursor: " << cur.value();
@@ -553,17 +805,23 @@ uint64_t ScanGeneric(uint64_t cursor, const ScanOpts& scan_opts, StringVec* keys
   cursor >>= 10;
   DbContext db_cntx{.db_index = cntx->conn_state.db_index, .time_now_ms = GetCurrentTimeMs()};
 
+  uint64_t budget_ns = uint64_t(absl::GetFlag(FLAGS_scan_time_budget_usec)) * 1000;
+  uint64_t deadline_ns = budget_ns ? absl::GetCurrentTimeNanos() + budget_ns : 0;
+
   do {
     ess->Await(sid, [&] {
       OpArgs op_args{EngineShard::tlocal(), 0, db_cntx};
 
-      OpScan(op_args, scan_opts, &cursor, keys);
+      OpScan(op_args, scan_opts, deadline_ns, &cursor, keys);
     });
     if (cursor == 0) {
       ++sid;
       if (unsigned(sid) == shard_count)
         break;
     }
+    // Returns early with the cursor, possibly without keys, once the budget is spent.
+    if (deadline_ns && absl::GetCurrentTimeNanos() >= deadline_ns)
+      break;
   } while (keys->size() < scan_opts.limit);
 
   if (sid < shard_count) {
@@ -577,11 +835,11 @@ uint64_t ScanGeneric(uint64_t cursor, const ScanOpts& scan_opts, StringVec* keys
 
 OpStatus OpExpire(const OpArgs& op_args, string_view key, const DbSlice::ExpireParams& params) {
   auto& db_slice = op_args.shard->db_slice();
-  auto [it, expire_it] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
   if (!IsValid(it))
     return OpStatus::KEY_NOTFOUND;
 
-  return db_slice.UpdateExpire(op_args.db_cntx, it, expire_it, params);
+  return db_slice.UpdateExpire(op_args.db_cntx, it, params);
 }
 
 }  // namespace
@@ -724,22 +982,33 @@ void GenericFamily::ExpireAt(CmdArgList args, ConnectionContext* cntx) {
 
 void GenericFamily::Keys(CmdArgList args, ConnectionContext* cntx) {
   string_view pattern(ArgS(args, 1));
-  uint64_t cursor = 0;
-
-  StringVec keys;
-
-  ScanOpts scan_opts;
-  scan_opts.pattern = pattern;
-  scan_opts.limit = 512;
   auto output_limit = absl::GetFlag(FLAGS_keys_output_limit);
 
-  do {
-    cursor = ScanGeneric(cursor, scan_opts, &keys, cntx);
-  } while (cursor != 0 && keys.size() < output_limit);
+  ScanOpts scan_opts;
+  if (pattern != "*")
+    scan_opts.matcher.emplace(pattern);
+  scan_opts.limit = output_limit;
 
-  (*cntx)->StartArray(keys.size());
-  for (const auto& k : keys) {
-    (*cntx)->SendBulkString(k);
+  // The shards traverse their tables in parallel, each one up to the output limit.
+  vector<StringVec> shard_keys(shard_set->size());
+  DbContext db_cntx{.db_index = cntx->conn_state.db_index, .time_now_ms = GetCurrentTimeMs()};
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    OpArgs op_args{shard, 0, db_cntx};
+    uint64_t cursor = 0;
+    OpScan(op_args, scan_opts, 0, &cursor, &shard_keys[shard->shard_id()]);
+  });
+
+  size_t num_keys = 0;
+  for (const auto& keys : shard_keys) {
+    num_keys += keys.size();
+  }
+  num_keys = std::min<size_t>(num_keys, output_limit);
+
+  (*cntx)->StartArray(num_keys);
+  for (const auto& keys : shard_keys) {
+    for (size_t i = 0; i < keys.size() && num_keys > 0; ++i, --num_keys) {
+      (*cntx)->SendBulkString(keys[i]);
+    }
   }
 }
 
@@ -812,57 +1081,108 @@ void GenericFamily::Stick(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendLong(match_cnt);
 }
 
-// Used to conditionally store double score
-struct SortEntryScore {
-  double score;
-};
-
-// SortEntry stores all data required for sorting
-template <bool ALPHA>
-struct SortEntry
-    // Store score only if we need it
-    : public std::conditional_t<ALPHA, std::tuple<>, SortEntryScore> {
-  std::string key;
+namespace {
 
-  bool Parse(std::string&& item) {
-    if constexpr (!ALPHA) {
-      if (!absl::SimpleAtod(item, &this->score))
-        return false;
+// A BY or GET pattern of SORT. The first '*' of the pattern is replaced with the element to get
+// the key, and the part after "->", if any, names the field of a hash.
+struct SortPattern {
+  std::string_view prefix, suffix, field;
+  bool self = false;      // "#" stands for the element itself.
+  bool has_star = false;  // Without '*', all the lookups come out empty.
+
+  explicit SortPattern(std::string_view pattern) {
+    if (pattern == "#") {
+      self = true;
+      return;
     }
-    key = std::move(item);
-    return true;
-  }
 
-  bool Parse(int64_t item) {
-    if constexpr (!ALPHA) {
-      this->score = item;
+    size_t star = pattern.find('*');
+    if (star == std::string_view::npos)
+      return;
+    has_star = true;
+    prefix = pattern.substr(0, star);
+    suffix = pattern.substr(star + 1);
+    if (size_t arrow = suffix.find("->"); arrow != std::string_view::npos) {
+      field = suffix.substr(arrow + 2);
+      if (!field.empty())
+        suffix = suffix.substr(0, arrow);
     }
-    key = absl::StrCat(item);
-    return true;
   }
+};
 
-  std::conditional_t<ALPHA, const std::string&, double> Cmp() const {
-    if constexpr (ALPHA) {
-      return key;
-    } else {
-      return this->score;
-    }
+struct SortParams {
+  bool alpha = false;
+  bool desc = false;
+  bool dontsort = false;  // BY pattern without '*'.
+  std::optional<SortPattern> by;
+  std::vector<SortPattern> get;
+
+  // The window of the result.
+  size_t offset = 0;
+  size_t count = SIZE_MAX;
+
+  // Whether the elements are sorted by themselves, in the shard of the key.
+  bool ByElements() const {
+    return dontsort || !by;
   }
 };
 
-// std::variant of all possible vectors of SortEntries
-using SortEntryList = std::variant<
-    // Used when sorting by double values
-    std::vector<SortEntry<false>>,
-    // Used when sorting by string values
-    std::vector<SortEntry<true>>>;
+// The elements to sort, with the values they are compared by in parallel arrays, so that numbers
+// are parsed once and the sort only moves indices.
+struct SortInput {
+  std::vector<std::string> elems;
+  std::vector<double> scores;                         // Unless alpha.
+  std::vector<std::optional<std::string>> by_values;  // Alpha with a BY pattern.
+  bool reverse_order = false;                         // dontsort of a sorted set with DESC.
+};
+
+int ThreeWay(std::string_view a, std::string_view b) {
+  int cmp = a.compare(b);
+  return (cmp > 0) - (cmp < 0);
+}
+
+// Returns the indices of the window of the sorted elements. Only the window is sorted, the
+// elements before it are just partitioned away. Ties are broken by the elements themselves,
+// so that the result is deterministic.
+std::vector<uint32_t> SortWindow(const SortInput& in, const SortParams& params) {
+  size_t size = in.elems.size();
+  size_t begin = std::min(params.offset, size);
+  size_t end = begin + std::min(params.count, size - begin);
+
+  std::vector<uint32_t> order(size);
+  std::iota(order.begin(), order.end(), 0);
+  if (params.dontsort) {
+    if (in.reverse_order)
+      std::reverse(order.begin(), order.end());
+    return std::vector<uint32_t>(order.begin() + begin, order.begin() + end);
+  }
+
+  auto cmp = [&](uint32_t a, uint32_t b) {
+    int res = 0;
+    if (!params.alpha) {
+      res = (in.scores[a] > in.scores[b]) - (in.scores[a] < in.scores[b]);
+    } else if (!in.by_values.empty()) {
+      const auto &x = in.by_values[a], &y = in.by_values[b];
+      res = x && y ? ThreeWay(*x, *y) : bool(x) - bool(y);  // Missing values go first.
+    }
+    return res ? res : ThreeWay(in.elems[a], in.elems[b]);
+  };
+  auto less = [&](uint32_t a, uint32_t b) { return params.desc ? cmp(b, a) < 0 : cmp(a, b) < 0; };
+
+  if (begin == end)
+    return {};
+  if (end - begin == size) {
+    std::sort(order.begin(), order.end(), less);
+  } else {
+    if (begin > 0)
+      std::nth_element(order.begin(), order.begin() + begin, order.end(), less);
+    std::partial_sort(order.begin() + begin, order.begin() + end, order.end(), less);
+  }
+  return std::vector<uint32_t>(order.begin() + begin, order.begin() + end);
+}
 
-// Create SortEntryList based on runtime arguments
-SortEntryList MakeSortEntryList(bool alpha) {
-  if (alpha)
-    return SortEntryList{std::vector<SortEntry<true>>{}};
-  else
-    return SortEntryList{std::vector<SortEntry<false>>{}};
+bool ParseSortScore(std::string_view str, double* score) {
+  return absl::SimpleAtod(str, score) && !std::isnan(*score);
 }
 
 // Iterate over container with generic function that accepts strings and ints
@@ -887,93 +1207,205 @@ template <typename F> bool Iterate(const PrimeValue& pv, F&& func) {
   }
 }
 
-// Create a SortEntryList from given key
-OpResult<SortEntryList> OpFetchSortEntries(const OpArgs& op_args, std::string_view key,
-                                           bool alpha) {
+// Fetches the elements of the container at key. If they are sorted by themselves, sorts them in
+// the shard and returns only the window of the result. Otherwise returns all of them, unsorted.
+OpResult<std::vector<std::string>> OpFetchSortEntries(const OpArgs& op_args, std::string_view key,
+                                                      const SortParams& params) {
   using namespace container_utils;
 
-  auto [it, _] = op_args.shard->db_slice().FindExt(op_args.db_cntx, key);
+  PrimeIterator it = op_args.shard->db_slice().FindExt(op_args.db_cntx, key);
   if (!IsValid(it) || !IsContainer(it->second)) {
     return OpStatus::KEY_NOTFOUND;
   }
 
-  auto result = MakeSortEntryList(alpha);
-  bool success = std::visit(
-      [&pv = it->second](auto& entries) {
-        entries.reserve(pv.Size());
-        return Iterate(pv, [&entries](auto&& val) {
-          return entries.emplace_back().Parse(std::forward<decltype(val)>(val));
-        });
-      },
-      result);
-  return success ? OpResult{std::move(result)} : OpStatus::WRONG_TYPE;
+  const PrimeValue& pv = it->second;
+  SortInput in;
+  in.elems.reserve(pv.Size());
+  bool parse_scores = params.ByElements() && !params.alpha && !params.dontsort;
+  if (parse_scores)
+    in.scores.reserve(pv.Size());
+
+  bool success = Iterate(pv, [&](auto&& val) {
+    if constexpr (std::is_integral_v<std::decay_t<decltype(val)>>) {
+      if (parse_scores)
+        in.scores.push_back(val);
+      in.elems.push_back(absl::StrCat(val));
+    } else {
+      if (parse_scores && !ParseSortScore(val, &in.scores.emplace_back()))
+        return false;
+      in.elems.push_back(std::move(val));
+    }
+    return true;
+  });
+  if (!success)
+    return OpStatus::WRONG_TYPE;
+
+  if (!params.ByElements())
+    return std::move(in.elems);
+
+  in.reverse_order = params.dontsort && params.desc && pv.ObjType() == OBJ_ZSET;
+  std::vector<std::string> res;
+  for (uint32_t i : SortWindow(in, params)) {
+    res.push_back(std::move(in.elems[i]));
+  }
+  return res;
 }
 
-void GenericFamily::Sort(CmdArgList args, ConnectionContext* cntx) {
+std::string GetString(EngineShard* shard, const PrimeValue& pv) {
+  std::string res;
+  if (pv.IsExternal()) {
+    auto [offset, size] = pv.GetExternalPtr();
+    res.resize(size);
+    std::error_code ec = shard->tiered_storage()->Read(offset, size, res.data());
+    CHECK(!ec) << "TBD: " << ec;
+  } else {
+    pv.GetString(&res);
+  }
+  return res;
+}
+
+// Looks up the values of the pattern for the elements, batching the lookups of every shard into
+// a single callback. The values of the missing keys or fields are empty.
+// The lookups run after the transaction of SORT, so they are not atomic with it.
+std::vector<std::optional<std::string>> LookupSortPattern(
+    const SortPattern& pattern, const std::vector<std::string>& elems, DbIndex db_index) {
+  std::vector<std::optional<std::string>> res(elems.size());
+  if (pattern.self) {
+    std::copy(elems.begin(), elems.end(), res.begin());
+    return res;
+  }
+  if (!pattern.has_star)
+    return res;
+
+  std::vector<std::string> keys(elems.size());
+  std::vector<std::vector<uint32_t>> shard_keys(shard_set->size());
+  for (size_t i = 0; i < elems.size(); ++i) {
+    keys[i] = absl::StrCat(pattern.prefix, elems[i], pattern.suffix);
+    shard_keys[Shard(keys[i], shard_set->size())].push_back(i);
+  }
+
+  auto cb = [&](EngineShard* shard) {
+    OpArgs op_args{shard, 0, DbContext{.db_index = db_index, .time_now_ms = GetCurrentTimeMs()}};
+    for (uint32_t i : shard_keys[shard->shard_id()]) {
+      if (!pattern.field.empty()) {
+        if (auto value = HSetFamily::OpHGet(op_args, keys[i], pattern.field); value)
+          res[i] = std::move(*value);
+      } else if (auto it = shard->db_slice().Find(op_args.db_cntx, keys[i], OBJ_STRING); it) {
+        res[i] = GetString(shard, (*it)->second);
+      }
+    }
+  };
+  shard_set->RunBriefInParallel(std::move(cb),
+                                [&](ShardId sid) { return !shard_keys[sid].empty(); });
+  return res;
+}
+
+void SortGeneric(CmdArgList args, bool read_only, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
-  bool alpha = false;
-  bool reversed = false;
-  std::optional<std::pair<size_t, size_t>> bounds;
+  SortParams params;
 
   for (size_t i = 2; i < args.size(); i++) {
     ToUpper(&args[i]);
 
     std::string_view arg = ArgS(args, i);
+    bool has_value = i + 1 < args.size();
     if (arg == "ALPHA") {
-      alpha = true;
+      params.alpha = true;
     } else if (arg == "DESC") {
-      reversed = true;
+      params.desc = true;
+    } else if (arg == "ASC") {
+      params.desc = false;
     } else if (arg == "LIMIT") {
-      int offset, limit;
+      int64_t offset, count;
       if (i + 2 >= args.size()) {
         return (*cntx)->SendError(kSyntaxErr);
       }
       if (!absl::SimpleAtoi(ArgS(args, i + 1), &offset) ||
-          !absl::SimpleAtoi(ArgS(args, i + 2), &limit)) {
+          !absl::SimpleAtoi(ArgS(args, i + 2), &count)) {
         return (*cntx)->SendError(kInvalidIntErr);
       }
-      bounds = {offset, limit};
+      // Like Redis, a negative offset starts at the beginning and a negative count takes all.
+      params.offset = std::max<int64_t>(offset, 0);
+      params.count = count < 0 ? SIZE_MAX : count;
       i += 2;
+    } else if (arg == "BY" && has_value) {
+      params.by.emplace(ArgS(args, ++i));
+      params.dontsort = !params.by->has_star;
+    } else if (arg == "GET" && has_value) {
+      params.get.emplace_back(ArgS(args, ++i));
+    } else if (arg == "STORE" && has_value && !read_only) {
+      return (*cntx)->SendError("STORE is not supported");
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
     }
   }
 
-  OpResult<SortEntryList> entries =
+  OpResult<std::vector<std::string>> entries =
       cntx->transaction->ScheduleSingleHopT([&](Transaction* t, EngineShard* shard) {
-        return OpFetchSortEntries(t->GetOpArgs(shard), key, alpha);
+        return OpFetchSortEntries(t->GetOpArgs(shard), key, params);
       });
 
+  constexpr std::string_view kScoreErr = "One or more scores can't be converted into double";
   if (entries.status() == OpStatus::WRONG_TYPE)
-    return (*cntx)->SendError("One or more scores can't be converted into double");
+    return (*cntx)->SendError(kScoreErr);
 
   if (!entries.ok())
     return (*cntx)->SendEmptyArray();
 
-  auto sort_call = [cntx, bounds, reversed](auto& entries) {
-    if (bounds) {
-      auto sort_it = entries.begin() + std::min(bounds->first + bounds->second, entries.size());
-      std::partial_sort(entries.begin(), sort_it, entries.end(),
-                        [reversed](const auto& lhs, const auto& rhs) {
-                          return bool(lhs.Cmp() < rhs.Cmp()) ^ reversed;
-                        });
+  std::vector<std::string>& window = entries.value();
+  if (!params.ByElements()) {
+    SortInput in;
+    in.elems = std::move(window);
+    auto by_values = LookupSortPattern(*params.by, in.elems, cntx->db_index());
+    if (params.alpha) {
+      in.by_values = std::move(by_values);
     } else {
-      std::sort(entries.begin(), entries.end(), [reversed](const auto& lhs, const auto& rhs) {
-        return bool(lhs.Cmp() < rhs.Cmp()) ^ reversed;
-      });
+      // Missing weights count as 0.
+      in.scores.resize(in.elems.size());
+      for (size_t i = 0; i < by_values.size(); ++i) {
+        if (by_values[i] && !ParseSortScore(*by_values[i], &in.scores[i]))
+          return (*cntx)->SendError(kScoreErr);
+      }
     }
 
-    auto start_it = entries.begin();
-    auto end_it = entries.end();
-    if (bounds) {
-      start_it += std::min(bounds->first, entries.size());
-      end_it = entries.begin() + std::min(bounds->first + bounds->second, entries.size());
+    window.clear();
+    for (uint32_t i : SortWindow(in, params)) {
+      window.push_back(std::move(in.elems[i]));
     }
+  }
 
-    (*cntx)->StartArray(std::distance(start_it, end_it));
-    for (auto it = start_it; it != end_it; ++it) {
-      (*cntx)->SendBulkString(it->key);
+  if (params.get.empty()) {
+    (*cntx)->StartArray(window.size());
+    for (const auto& elem : window) {
+      (*cntx)->SendBulkString(elem);
     }
-  };
-  std::visit(std::move(sort_call), entries.value());
+    return;
+  }
+
+  std::vector<std::vector<std::optional<std::string>>> values;
+  for (const SortPattern& pattern : params.get) {
+    values.push_back(LookupSortPattern(pattern, window, cntx->db_index()));
+  }
+
+  (*cntx)->StartArray(window.size() * values.size());
+  for (size_t i = 0; i < window.size(); ++i) {
+    for (const auto& pattern_values : values) {
+      if (pattern_values[i])
+        (*cntx)->SendBulkString(*pattern_values[i]);
+      else
+        (*cntx)->SendNull();
+    }
+  }
+}
+
+}  // namespace
+
+void GenericFamily::Sort(CmdArgList args, ConnectionContext* cntx) {
+  SortGeneric(args, false, cntx);
+}
+
+void GenericFamily::SortRo(CmdArgList args, ConnectionContext* cntx) {
+  SortGeneric(args, true, cntx);
 }
 
 void GenericFamily::Restore(CmdArgList args, ConnectionContext* cntx) {
@@ -1107,6 +1539,10 @@ void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   if (index < 0 || index >= absl::GetFlag(FLAGS_dbnum)) {
     return (*cntx)->SendError(kDbIndOutOfRangeErr);
   }
+  // The slot index and the redirects only cover the first database.
+  if (ClusterConfig::IsEnabled() && index != 0) {
+    return (*cntx)->SendError("SELECT is not allowed in cluster mode");
+  }
   cntx->conn_state.db_index = index;
   auto cb = [index](EngineShard* shard) {
     shard->db_slice().ActivateDb(index);
@@ -1117,6 +1553,64 @@ void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendOk();
 }
 
+void GenericFamily::MDump(CmdArgList args, ConnectionContext* cntx) {
+  std::vector<std::string> blocks(shard_set->size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    blocks[sid] = OpMDump(t->GetOpArgs(shard), t->ShardArgsInShard(sid));
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  std::string payload;
+  for (const std::string& block : blocks) {
+    if (!block.empty())
+      AppendBlob(block, &payload);
+  }
+  AppendFooter(&payload, RDB_NATIVE_VERSION);
+  (*cntx)->SendBulkString(payload);
+}
+
+// MRESTORE payload [REPLACE]
+void GenericFamily::MRestore(CmdArgList args, ConnectionContext* cntx) {
+  std::string_view payload = ArgS(args, 1);
+  bool replace = false;
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) != "REPLACE")
+      return (*cntx)->SendError(kSyntaxErr);
+    replace = true;
+  }
+
+  if (!VerifyFooter(payload, RDB_NATIVE_VERSION)) {
+    return (*cntx)->SendError("ERR DUMP payload version or checksum are wrong");
+  }
+  payload.remove_suffix(DUMP_FOOTER_SIZE);
+
+  // The records are split between the shards here, and each shard restores its own.
+  std::deque<std::string> decompressed;
+  std::vector<std::vector<DumpRecord>> shard_records(shard_set->size());
+  if (!SplitDumpRecords(payload, &decompressed, &shard_records))
+    return (*cntx)->SendError("Bad data format");
+
+  std::atomic_uint32_t restored = 0;
+  std::atomic_bool failed = false;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpResult<uint32_t> res =
+        OpMRestore(t->GetOpArgs(shard), shard_records[shard->shard_id()], replace);
+    if (res)
+      restored.fetch_add(*res, std::memory_order_relaxed);
+    else
+      failed.store(true, std::memory_order_relaxed);
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  if (failed.load(std::memory_order_relaxed))
+    return (*cntx)->SendError("Bad data format");
+  (*cntx)->SendLong(restored.load(std::memory_order_relaxed));
+}
+
 void GenericFamily::Dump(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
   DVLOG(1) << "Dumping before ::ScheduleSingleHopT " << key;
@@ -1138,7 +1632,7 @@ void GenericFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
 
   auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<int> {
-    auto it = shard->db_slice().FindExt(t->db_context(), key).first;
+    auto it = shard->db_slice().FindExt(t->db_context(), key);
     if (!it.is_done()) {
       return it->second.ObjType();
     } else {
@@ -1153,6 +1647,50 @@ void GenericFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void GenericFamily::Object(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+  string_view key = ArgS(args, 2);
+
+  if (args.size() != 3)
+    return (*cntx)->SendError(kSyntaxErr);
+  if (sub_cmd != "ENCODING" && sub_cmd != "FREQ" && sub_cmd != "IDLETIME" &&
+      sub_cmd != "REFCOUNT") {
+    return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "OBJECT"), kSyntaxErrType);
+  }
+
+  struct ObjectInfo {
+    const char* encoding;
+    unsigned freq;
+    uint64_t idle_sec;
+  };
+
+  // Unlike FindExt, the lookup does not count as an access of the key.
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<ObjectInfo> {
+    DbSlice& db_slice = shard->db_slice();
+    const DbContext& db_cntx = t->db_context();
+    PrimeIterator it = db_slice.GetDBTable(db_cntx.db_index)->prime.Find(key);
+    if (!IsValid(it) ||
+        (it->second.HasExpire() && db_slice.ExpireTime(it) <= time_t(db_cntx.time_now_ms))) {
+      return OpStatus::KEY_NOTFOUND;
+    }
+    return ObjectInfo{it->second.EncodingName(), it->first.GetFreq(),
+                      DbSlice::IdleSeconds(it->first.GetIdle())};
+  };
+
+  OpResult<ObjectInfo> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return (*cntx)->SendNull();
+
+  if (sub_cmd == "ENCODING")
+    return (*cntx)->SendBulkString(result->encoding);
+  if (sub_cmd == "FREQ")
+    return (*cntx)->SendLong(result->freq);
+  if (sub_cmd == "IDLETIME")
+    return (*cntx)->SendLong(result->idle_sec);
+  return (*cntx)->SendLong(1);  // REFCOUNT, the values are not shared.
+}
+
 void GenericFamily::Time(CmdArgList args, ConnectionContext* cntx) {
   uint64_t now_usec;
   if (cntx->transaction) {
@@ -1188,7 +1726,7 @@ OpResult<void> GenericFamily::RenameGeneric(CmdArgList args, bool skip_exist_des
   // Phase 1 -> Fetch  keys from both shards.
   // Phase 2 -> If everything is ok, clone the source object, delete the destination object, and
   //            set its ptr to cloned one. we also copy the expiration data of the source key.
-  renamer.Find(transaction);
+  renamer.Find(transaction, skip_exist_dest);
   renamer.Finalize(transaction, skip_exist_dest);
 
   return renamer.status();
@@ -1228,14 +1766,14 @@ void GenericFamily::Scan(CmdArgList args, ConnectionContext* cntx) {
 
 OpResult<uint64_t> GenericFamily::OpTtl(Transaction* t, EngineShard* shard, string_view key) {
   auto& db_slice = shard->db_slice();
-  auto [it, expire_it] = db_slice.FindExt(t->db_context(), key);
+  PrimeIterator it = db_slice.FindExt(t->db_context(), key);
   if (!IsValid(it))
     return OpStatus::KEY_NOTFOUND;
 
-  if (!IsValid(expire_it))
+  if (!it->second.HasExpire())
     return OpStatus::SKIPPED;
 
-  int64_t ttl_ms = db_slice.ExpireTime(expire_it) - t->db_context().time_now_ms;
+  int64_t ttl_ms = db_slice.ExpireTime(it) - t->db_context().time_now_ms;
   DCHECK_GT(ttl_ms, 0);  // Otherwise FindExt would return null.
   return ttl_ms;
 }
@@ -1246,12 +1784,11 @@ OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys) {
 
   uint32_t res = 0;
 
-  for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto fres = db_slice.FindExt(op_args.db_cntx, keys[i]);
-    if (!IsValid(fres.first))
-      continue;
-    res += int(db_slice.Del(op_args.db_cntx.db_index, fres.first));
-  }
+  // FindMany reports the duplicates of the deleted keys as missing.
+  db_slice.FindMany(op_args.db_cntx, keys, [&](unsigned, PrimeIterator it) {
+    if (IsValid(it))
+      res += int(db_slice.Del(op_args.db_cntx.db_index, it));
+  });
 
   return res;
 }
@@ -1261,10 +1798,8 @@ OpResult<uint32_t> GenericFamily::OpExists(const OpArgs& op_args, ArgSlice keys)
   auto& db_slice = op_args.shard->db_slice();
   uint32_t res = 0;
 
-  for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto find_res = db_slice.FindExt(op_args.db_cntx, keys[i]);
-    res += IsValid(find_res.first);
-  }
+  db_slice.FindMany(op_args.db_cntx, keys,
+                    [&](unsigned, PrimeIterator it) { res += IsValid(it); });
   return res;
 }
 
@@ -1272,12 +1807,12 @@ OpResult<void> GenericFamily::OpRen(const OpArgs& op_args, string_view from_key,
                                     bool skip_exists) {
   auto* es = op_args.shard;
   auto& db_slice = es->db_slice();
-  auto [from_it, from_expire] = db_slice.FindExt(op_args.db_cntx, from_key);
+  PrimeIterator from_it = db_slice.FindExt(op_args.db_cntx, from_key);
   if (!IsValid(from_it))
     return OpStatus::KEY_NOTFOUND;
 
   bool is_prior_list = false;
-  auto [to_it, to_expire] = db_slice.FindExt(op_args.db_cntx, to_key);
+  PrimeIterator to_it = db_slice.FindExt(op_args.db_cntx, to_key);
   if (IsValid(to_it)) {
     if (skip_exists)
       return OpStatus::KEY_EXISTS;
@@ -1286,22 +1821,27 @@ OpResult<void> GenericFamily::OpRen(const OpArgs& op_args, string_view from_key,
   }
 
   bool sticky = from_it->first.IsSticky();
-  uint64_t exp_ts = db_slice.ExpireTime(from_expire);
+  bool from_expire = from_it->second.HasExpire();
+  uint64_t exp_ts = db_slice.ExpireTime(from_it);
 
-  // we keep the value we want to move.
-  PrimeValue from_obj = std::move(from_it->second);
+  // we keep the value we want to move, without its deadline.
+  CompactObj from_obj = std::move(from_it->second);
 
-  // Restore the expire flag on 'from' so we could delete it from expire table.
-  from_it->second.SetExpire(IsValid(from_expire));
+  // Restore the expire flag on 'from' so that deleting it updates the expiry count.
+  from_it->second.SetExpire(from_expire);
 
   if (IsValid(to_it)) {
-    to_it->second = std::move(from_obj);
-    to_it->second.SetExpire(IsValid(to_expire));  // keep the expire flag on 'to'.
+    bool to_expire = to_it->second.HasExpire();
+    to_it->second = std::move(from_obj);  // keeps the deadline of 'to'.
+    to_it->second.SetExpire(to_expire);   // keep the expire flag on 'to'.
 
-    // It is guaranteed that UpdateExpire() call does not erase the element because then
-    // from_it would be invalid. Therefore, UpdateExpire does not invalidate any iterators,
+    // It is guaranteed that updating the expiry does not erase the element because then
+    // from_it would be invalid. Therefore, it does not invalidate any iterators,
     // therefore we can delete 'from_it'.
-    db_slice.UpdateExpire(op_args.db_cntx.db_index, to_it, exp_ts);
+    if (to_expire && exp_ts)
+      db_slice.SetExpireTime(op_args.db_cntx.db_index, to_it, exp_ts);
+    else
+      db_slice.UpdateExpire(op_args.db_cntx.db_index, to_it, exp_ts);
     CHECK(db_slice.Del(op_args.db_cntx.db_index, from_it));
   } else {
     // Here we first delete from_it because AddNew below could invalidate from_it.
@@ -1326,7 +1866,7 @@ OpResult<uint32_t> GenericFamily::OpStick(const OpArgs& op_args, ArgSlice keys)
 
   uint32_t res = 0;
   for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto [it, _] = db_slice.FindExt(op_args.db_cntx, keys[i]);
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, keys[i]);
     if (IsValid(it) && !it->first.IsSticky()) {
       it->first.SetSticky(true);
       ++res;
@@ -1343,14 +1883,14 @@ OpStatus GenericFamily::OpMove(const OpArgs& op_args, string_view key, DbIndex t
   auto& db_slice = op_args.shard->db_slice();
 
   // Fetch value at key in current db.
-  auto [from_it, from_expire] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator from_it = db_slice.FindExt(op_args.db_cntx, key);
   if (!IsValid(from_it))
     return OpStatus::KEY_NOTFOUND;
 
   // Fetch value at key in target db.
   DbContext target_cntx = op_args.db_cntx;
   target_cntx.db_index = target_db;
-  auto [to_it, _] = db_slice.FindExt(target_cntx, key);
+  PrimeIterator to_it = db_slice.FindExt(target_cntx, key);
   if (IsValid(to_it))
     return OpStatus::KEY_EXISTS;
 
@@ -1358,16 +1898,26 @@ OpStatus GenericFamily::OpMove(const OpArgs& op_args, string_view key, DbIndex t
   db_slice.ActivateDb(target_db);
 
   bool sticky = from_it->first.IsSticky();
-  uint64_t exp_ts = db_slice.ExpireTime(from_expire);
+  bool from_expire = from_it->second.HasExpire();
+  uint64_t exp_ts = db_slice.ExpireTime(from_it);
   PrimeValue from_obj = std::move(from_it->second);
 
   // Restore expire flag after std::move.
-  from_it->second.SetExpire(IsValid(from_expire));
+  from_it->second.SetExpire(from_expire);
 
   CHECK(db_slice.Del(op_args.db_cntx.db_index, from_it));
   to_it = db_slice.AddNew(target_cntx, key, std::move(from_obj), exp_ts);
   to_it->first.SetSticky(sticky);
 
+  // Global transactions do not journal their keys, see Transaction::JournalKeys.
+  if (auto* journal = op_args.shard->journal(); journal) {
+    journal->PersistEntry(
+        journal::Entry{journal::Op::DEL, op_args.db_cntx.db_index, op_args.txid, key});
+    journal::Entry entry{target_db, op_args.txid, key, to_it->second};
+    entry.expire_ms = exp_ts;
+    journal->PersistEntry(entry);
+  }
+
   if (to_it->second.ObjType() == OBJ_LIST && op_args.shard->blocking_controller()) {
     op_args.shard->blocking_controller()->AwakeWatched(target_db, key);
   }
@@ -1382,7 +1932,7 @@ using CI = CommandId;
 void GenericFamily::Register(CommandRegistry* registry) {
   constexpr auto kSelectOpts = CO::LOADING | CO::FAST | CO::NOSCRIPT;
 
-  *registry << CI{"DEL", CO::WRITE, -2, 1, -1, 1}.HFUNC(Del)
+  *registry << CI{"DEL", CO::WRITE | CO::SPLIT_JOURNAL, -2, 1, -1, 1}.HFUNC(Del)
             /* Redis compaitibility:
              * We don't allow PING during loading since in Redis PING is used as
              * failure detection, and a loading server is considered to be
@@ -1405,12 +1955,17 @@ void GenericFamily::Register(CommandRegistry* registry) {
             << CI{"PTTL", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(Pttl)
             << CI{"TIME", CO::LOADING | CO::FAST, 1, 0, 0, 0}.HFUNC(Time)
             << CI{"TYPE", CO::READONLY | CO::FAST | CO::LOADING, 2, 1, 1, 1}.HFUNC(Type)
+            << CI{"OBJECT", CO::READONLY | CO::FAST, -3, 2, 2, 1}.HFUNC(Object)
             << CI{"DUMP", CO::READONLY, 2, 1, 1, 1}.HFUNC(Dump)
-            << CI{"UNLINK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Del)
+            << CI{"UNLINK", CO::WRITE | CO::SPLIT_JOURNAL, -2, 1, -1, 1}.HFUNC(Del)
             << CI{"STICK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Stick)
             << CI{"SORT", CO::READONLY, -2, 1, 1, 1}.HFUNC(Sort)
+            << CI{"SORT_RO", CO::READONLY, -2, 1, 1, 1}.HFUNC(SortRo)
             << CI{"MOVE", CO::WRITE | CO::GLOBAL_TRANS, 3, 1, 1, 1}.HFUNC(Move)
-            << CI{"RESTORE", CO::WRITE, -4, 1, 1, 1}.HFUNC(Restore);
+            << CI{"RESTORE", CO::WRITE, -4, 1, 1, 1}.HFUNC(Restore)
+            << CI{"MDUMP", CO::READONLY, -2, 1, -1, 1}.HFUNC(MDump)
+            << CI{"MRESTORE", CO::WRITE | CO::GLOBAL_TRANS | CO::NO_AUTOJOURNAL, -2, 0, 0, 0}.HFUNC(
+                   MRestore);
 }
 
 }  // namespace dfly
@@ -43,6 +43,7 @@ class GenericFamily {
   static void Pexpire(CmdArgList args, ConnectionContext* cntx);
   static void Stick(CmdArgList args, ConnectionContext* cntx);
   static void Sort(CmdArgList args, ConnectionContext* cntx);
+  static void SortRo(CmdArgList args, ConnectionContext* cntx);
   static void Move(CmdArgList args, ConnectionContext* cntx);
 
   static void Rename(CmdArgList args, ConnectionContext* cntx);
@@ -55,8 +56,11 @@ class GenericFamily {
   static void Scan(CmdArgList args, ConnectionContext* cntx);
   static void Time(CmdArgList args, ConnectionContext* cntx);
   static void Type(CmdArgList args, ConnectionContext* cntx);
+  static void Object(CmdArgList args, ConnectionContext* cntx);
   static void Dump(CmdArgList args, ConnectionContext* cntx);
   static void Restore(CmdArgList args, ConnectionContext* cntx);
+  static void MDump(CmdArgList args, ConnectionContext* cntx);
+  static void MRestore(CmdArgList args, ConnectionContext* cntx);
 
   static OpResult<void> RenameGeneric(CmdArgList args, bool skip_exist_dest,
                                       ConnectionContext* cntx);
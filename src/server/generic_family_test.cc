@@ -4,6 +4,8 @@
 
 #include "server/generic_family.h"
 
+#include <absl/container/flat_hash_set.h>
+
 extern "C" {
 #include "redis/rdb.h"
 }
@@ -22,8 +24,13 @@ using namespace testing;
 using namespace std;
 using namespace util;
 using namespace boost;
+using absl::SetFlag;
 using absl::StrCat;
 
+ABSL_DECLARE_FLAG(uint32_t, keys_output_limit);
+ABSL_DECLARE_FLAG(uint32_t, scan_time_budget_usec);
+ABSL_DECLARE_FLAG(std::string, snapshot_compression);
+
 namespace dfly {
 
 class GenericFamilyTest : public BaseFamilyTest {};
@@ -97,6 +104,127 @@ TEST_F(GenericFamilyTest, Del) {
   del_fb.join();
 }
 
+TEST_F(GenericFamilyTest, DelMany) {
+  vector<string> keys;
+  for (size_t i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), "1"});
+    keys.push_back(StrCat("key", i));
+    keys.push_back(StrCat("key", i));  // duplicates are deleted only once.
+  }
+  Run({"pexpire", "key7", "10"});
+  AdvanceTime(20);
+
+  vector<string_view> args{"exists"};
+  args.insert(args.end(), keys.begin(), keys.end());
+  EXPECT_THAT(Run(absl::MakeSpan(args)), IntArg(198));
+
+  args[0] = "del";
+  EXPECT_THAT(Run(absl::MakeSpan(args)), IntArg(99));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+}
+
+TEST_F(GenericFamilyTest, LazyFree) {
+  auto run_with_members = [&](vector<string> args, int num, bool pairs) {
+    for (int i = 0; i < num; ++i) {
+      if (pairs)
+        args.push_back(StrCat(i));
+      args.push_back(StrCat("member", i));
+    }
+    vector<string_view> sv_args(args.begin(), args.end());
+    return Run(absl::MakeSpan(sv_args));
+  };
+  auto wait_freed = [&] {
+    for (unsigned i = 0; i < 1000; ++i) {
+      if (service_->server_family().GetMetrics().lazyfree_pending_objects == 0)
+        return true;
+      this_fiber::sleep_for(1ms);
+    }
+    return false;
+  };
+
+  constexpr int kNum = 5000;
+  run_with_members({"sadd", "set"}, kNum, false);
+  run_with_members({"rpush", "list"}, kNum, false);
+  run_with_members({"hset", "hash"}, kNum, true);
+  run_with_members({"zadd", "zset"}, kNum, true);
+  Run({"sadd", "small", "a", "b"});
+
+  // The keys are gone at once, their values are freed in the background.
+  EXPECT_THAT(Run({"del", "set", "list"}), IntArg(2));
+  EXPECT_THAT(Run({"unlink", "hash", "zset", "small"}), IntArg(3));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  EXPECT_TRUE(wait_freed());
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().db[0].obj_memory_usage);
+
+  // The keys can be added back while their old values are freed.
+  run_with_members({"sadd", "set"}, kNum, false);
+  run_with_members({"rpush", "list"}, kNum, false);
+  EXPECT_EQ(kNum, CheckedInt({"scard", "set"}));
+  Run({"flushdb"});
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  EXPECT_TRUE(wait_freed());
+
+  auto info = Run({"info", "memory"});
+  EXPECT_THAT(ToSV(info.GetBuf()), HasSubstr("lazyfree_pending_objects:0"));
+}
+
+TEST_F(GenericFamilyTest, FlushAsync) {
+  EXPECT_THAT(Run({"flushall", "foo"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"flushdb", "async", "sync"}), ErrArg("syntax error"));
+
+  // The database is available at once, while its old table is freed in the background.
+  Run({"debug", "populate", "10000"});
+  EXPECT_EQ("OK", Run({"flushall", "async"}));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  Run({"set", "foo", "bar"});
+  EXPECT_EQ("bar", Run({"get", "foo"}));
+
+  // SYNC replies once the flushed tables are freed.
+  Run({"debug", "populate", "10000"});
+  EXPECT_EQ("OK", Run({"flushdb", "sync"}));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(0u, metrics.lazyfree_pending_objects);
+  EXPECT_EQ(0u, metrics.lazyfree_pending_memory);
+}
+
+// Bump-ups swap the entries of a segment between the lookups of a multi-key command.
+TEST_F(GenericFamilyTest, MultiKeyCacheMode) {
+  shard_set->TEST_EnableCacheMode();
+
+  constexpr size_t kNumKeys = 2000;
+  vector<string> keys;
+  for (size_t i = 0; i < kNumKeys; ++i) {
+    keys.push_back(StrCat("key", i));
+    Run({"set", keys.back(), StrCat("val", i)});
+  }
+
+  vector<string_view> args{"mget"};
+  for (size_t i = kNumKeys; i > 0; --i)
+    args.push_back(keys[i - 1]);
+
+  for (unsigned round = 0; round < 2; ++round) {
+    auto resp = Run(absl::MakeSpan(args));
+    ASSERT_THAT(resp, ArrLen(kNumKeys));
+    for (size_t i = 0; i < kNumKeys; ++i) {
+      ASSERT_EQ(resp.GetVec()[i], StrCat("val", kNumKeys - 1 - i));
+    }
+  }
+
+  args[0] = "exists";
+  EXPECT_THAT(Run(absl::MakeSpan(args)), IntArg(kNumKeys));
+
+  args.resize(1 + kNumKeys / 2);
+  args[0] = "del";
+  EXPECT_THAT(Run(absl::MakeSpan(args)), IntArg(kNumKeys / 2));
+  for (size_t i = 0; i < kNumKeys; ++i) {
+    if (i < kNumKeys / 2)
+      ASSERT_EQ(Run({"get", keys[i]}), StrCat("val", i));
+    else
+      ASSERT_THAT(Run({"get", keys[i]}), ArgType(RespExpr::NIL));
+  }
+}
+
 TEST_F(GenericFamilyTest, TTL) {
   EXPECT_EQ(-2, CheckedInt({"ttl", "foo"}));
   EXPECT_EQ(-2, CheckedInt({"pttl", "foo"}));
@@ -174,6 +302,22 @@ TEST_F(GenericFamilyTest, RenameNonString) {
   EXPECT_EQ(1, CheckedInt({"del", "b"}));
 }
 
+TEST_F(GenericFamilyTest, RenameOverContainer) {
+  for (int i = 0; i < 1000; ++i)
+    Run({"rpush", "x", StrCat(i)});
+  Run({"sadd", "b", "a", "b"});
+  Run({"pexpire", "x", "100000"});
+
+  ASSERT_EQ(Run({"rename", "x", "b"}), "OK");
+  ASSERT_EQ(2, last_cmd_dbg_info_.shards_count);
+
+  EXPECT_EQ(Run({"type", "b"}), "list");
+  EXPECT_EQ(1000, CheckedInt({"llen", "b"}));
+  EXPECT_EQ(Run({"lindex", "b", "999"}), "999");
+  EXPECT_GT(CheckedInt({"pttl", "b"}), 0);
+  EXPECT_EQ(0, CheckedInt({"exists", "x"}));
+}
+
 TEST_F(GenericFamilyTest, RenameBinary) {
   const char kKey1[] = "\x01\x02\x03\x04";
   const char kKey2[] = "\x05\x06\x07\x08";
@@ -196,6 +340,21 @@ TEST_F(GenericFamilyTest, RenameNx) {
   ASSERT_EQ(Run({"get", "y"}), x_val);
 }
 
+TEST_F(GenericFamilyTest, RenameOverExpiring) {
+  Run({"set", "x", "1", "px", "100000"});
+  Run({"set", "b", "2", "px", "500"});
+  ASSERT_EQ(Run({"rename", "x", "b"}), "OK");
+  EXPECT_EQ(100000, CheckedInt({"pttl", "b"}));
+
+  // The deadline of the destination is removed with the one of the source.
+  Run({"set", "x", "3"});
+  ASSERT_EQ(Run({"rename", "x", "b"}), "OK");
+  EXPECT_EQ(-1, CheckedInt({"pttl", "b"}));
+
+  auto resp = Run({"info", "keyspace"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("keys=1,expires=0"));
+}
+
 TEST_F(GenericFamilyTest, Stick) {
   // check stick returns zero on non-existent keys
   ASSERT_THAT(Run({"stick", "a", "b"}), IntArg(0));
@@ -307,6 +466,173 @@ TEST_F(GenericFamilyTest, Scan) {
   EXPECT_THAT(vec, Each(StartsWith("zset")));
 }
 
+// The heartbeat may merge the segments of a shrinking table between the SCAN calls.
+TEST_F(GenericFamilyTest, ScanWhileShrinking) {
+  constexpr unsigned kNumKeys = 20000;
+  Run({"debug", "populate", absl::StrCat(kNumKeys)});
+
+  vector<string> keys;
+  for (unsigned i = 0; i < kNumKeys; ++i) {
+    if (i % 50)
+      keys.push_back(StrCat("key:", i));
+    if (keys.size() == 1000 || i + 1 == kNumKeys) {
+      vector<string_view> args{"del"};
+      args.insert(args.end(), keys.begin(), keys.end());
+      Run(absl::MakeSpan(args));
+      keys.clear();
+    }
+  }
+  ASSERT_EQ(kNumKeys / 50, CheckedInt({"dbsize"}));
+
+  absl::flat_hash_set<string> seen;
+  string cursor = "0";
+  do {
+    auto resp = Run({"scan", cursor, "count", "20"});
+    ASSERT_THAT(resp, ArrLen(2));
+    cursor = string(facade::ToSV(resp.GetVec()[0].GetBuf()));
+    for (const string& key : StrArray(resp.GetVec()[1]))
+      seen.insert(key);
+
+    shard_set->RunBriefInParallel([](EngineShard* es) { es->db_slice().ShrinkTablesStep(0); });
+  } while (cursor != "0");
+
+  EXPECT_EQ(kNumKeys / 50, seen.size());
+  for (unsigned i = 0; i < kNumKeys; i += 50) {
+    EXPECT_TRUE(seen.contains(StrCat("key:", i))) << i;
+  }
+}
+
+TEST_F(GenericFamilyTest, ScanFilters) {
+  Run({"set", "small", "bar"});
+  Run({"set", "large", string(1000, 'x')});
+  Run({"setex", "ttl10", "10", "bar"});
+  Run({"setex", "ttl1000", "1000", "bar"});
+
+  auto resp = Run({"scan", "0", "count", "100", "minttl", "100"});
+  EXPECT_THAT(StrArray(resp.GetVec()[1]), UnorderedElementsAre("small", "large", "ttl1000"));
+  resp = Run({"scan", "0", "count", "100", "maxsize", "100"});
+  EXPECT_THAT(StrArray(resp.GetVec()[1]), UnorderedElementsAre("small", "ttl10", "ttl1000"));
+  resp = Run({"scan", "0", "count", "100", "match", "*1*", "minttl", "11", "maxsize", "100"});
+  EXPECT_THAT(StrArray(resp.GetVec()[1]), ElementsAre("ttl1000"));
+
+  // The remaining TTL is compared.
+  AdvanceTime(995 * 1000);
+  resp = Run({"scan", "0", "count", "100", "minttl", "10"});
+  EXPECT_THAT(StrArray(resp.GetVec()[1]), UnorderedElementsAre("small", "large"));
+
+  EXPECT_THAT(Run({"scan", "0", "minttl", "-1"}), ErrArg("value is not an integer"));
+  EXPECT_THAT(Run({"scan", "0", "maxsize", "a"}), ErrArg("value is not an integer"));
+}
+
+TEST_F(GenericFamilyTest, ScanTimeBudget) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_scan_time_budget_usec, 1);
+  Run({"debug", "populate", "5000"});
+  Run({"set", "rare", "bar"});
+
+  // SCAN returns once its budget is spent, possibly without keys, and still finds all of them.
+  uint64_t cursor = 0;
+  vector<string> found;
+  unsigned calls = 0;
+  do {
+    auto resp = Run({"scan", StrCat(cursor), "count", "100", "match", "ra*"});
+    ASSERT_THAT(resp, ArrLen(2));
+    ASSERT_TRUE(absl::SimpleAtoi(ToSV(resp.GetVec()[0].GetBuf()), &cursor));
+    for (const auto& key : StrArray(resp.GetVec()[1])) {
+      found.push_back(key);
+    }
+    ++calls;
+  } while (cursor != 0);
+
+  EXPECT_THAT(found, ElementsAre("rare"));
+  EXPECT_GT(calls, 1u);
+}
+
+TEST_F(GenericFamilyTest, Keys) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("user:", i, ":session"), "bar"});
+  }
+  Run({"set", "user", "bar"});
+
+  EXPECT_EQ(101, Run({"keys", "*"}).GetVec().size());
+  EXPECT_EQ(100, Run({"keys", "user:*"}).GetVec().size());
+  EXPECT_EQ(10, Run({"keys", "*:1?:*"}).GetVec().size());
+  EXPECT_THAT(Run({"keys", "*:42:*"}), "user:42:session");
+  EXPECT_THAT(Run({"keys", "user"}), "user");
+  EXPECT_THAT(Run({"keys", "nokey*"}), ArrLen(0));
+
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_keys_output_limit, 10);
+  EXPECT_EQ(10, Run({"keys", "*"}).GetVec().size());
+}
+
+TEST_F(GenericFamilyTest, ExpireWheel) {
+  constexpr int kNumKeys = 100;
+  for (int i = 0; i < kNumKeys; ++i) {
+    Run({"set", StrCat("key", i), "bar", "px", StrCat(100 + i * 10)});
+  }
+  Run({"set", "persistent", "bar"});
+  Run({"set", "extended", "bar", "px", "100"});
+  Run({"pexpire", "extended", "100000"});
+  AdvanceTime(5000);
+
+  // The keys are deleted from the wheel, without being accessed or sampled.
+  for (unsigned i = 0; i < 100 && CheckedInt({"dbsize"}) > 2; ++i) {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      DbContext cntx{.db_index = 0, .time_now_ms = GetCurrentTimeMs()};
+      shard->db_slice().ExpireWheelStep(cntx, 1000);
+    });
+  }
+  EXPECT_EQ(2, CheckedInt({"dbsize"}));
+  EXPECT_EQ(1, CheckedInt({"exists", "extended"}));
+
+  auto info = Run({"info", "memory"});
+  EXPECT_THAT(ToSV(info.GetBuf()), HasSubstr("expired_pending_keys:0"));
+}
+
+TEST_F(GenericFamilyTest, SoonExpiry) {
+  shard_set->TEST_EnableHeartBeat();
+  this_fiber::sleep_for(5ms);
+
+  // A lock with a short ttl is deleted by the expiry timer of the shard when it is due.
+  EXPECT_EQ(Run({"set", "lock", "owner", "nx", "px", "50"}), "OK");
+  AdvanceTime(60);
+  for (unsigned i = 0; i < 200 && CheckedInt({"dbsize"}) > 0; ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  EXPECT_EQ(Run({"set", "lock", "other", "nx", "px", "50"}), "OK");
+}
+
+TEST_F(GenericFamilyTest, RebaseExpire) {
+  constexpr int64_t kDayMs = 24 * 3600 * 1000;
+  auto rebase = [&] {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      for (unsigned i = 0; i < 10; ++i)
+        shard->db_slice().RebaseExpireStep(GetCurrentTimeMs());
+    });
+  };
+
+  Run({"set", "long", "bar", "px", absl::StrCat(30 * kDayMs)});
+  Run({"set", "gone", "bar", "px", "10"});
+  AdvanceTime(kDayMs + 1000);
+
+  // Switches to the other expire base and migrates the entries to it.
+  rebase();
+  EXPECT_EQ(30 * kDayMs - kDayMs - 1000, CheckedInt({"pttl", "long"}));
+  EXPECT_EQ(-2, CheckedInt({"pttl", "gone"}));
+
+  Run({"set", "short", "bar", "px", "1500"});
+  EXPECT_EQ(1500, CheckedInt({"pttl", "short"}));
+
+  // Switches back to the first base, which is reused.
+  AdvanceTime(kDayMs + 1000);
+  Run({"set", "short", "bar", "px", "1234"});
+  rebase();
+  EXPECT_EQ(1234, CheckedInt({"pttl", "short"}));
+  EXPECT_EQ(30 * kDayMs - 2 * kDayMs - 2000, CheckedInt({"pttl", "long"}));
+}
+
 TEST_F(GenericFamilyTest, Sort) {
   // Test list sort with params
   Run({"del", "list-1"});
@@ -372,6 +698,96 @@ TEST_F(GenericFamilyTest, Sort) {
   ASSERT_THAT(Run({"sort", "list-2"}), ErrArg("One or more scores can't be converted into double"));
 }
 
+TEST_F(GenericFamilyTest, SortByGet) {
+  Run({"rpush", "ids", "3", "1", "2", "4"});
+  Run({"mset", "w_1", "30", "w_2", "10", "w_3", "20"});
+  Run({"mset", "a_1", "c", "a_2", "a", "a_3", "b"});
+  Run({"hset", "h_1", "name", "one"});
+  Run({"hset", "h_2", "name", "two"});
+
+  // Missing weights count as 0, or go first with ALPHA.
+  EXPECT_THAT(Run({"sort", "ids", "by", "w_*"}).GetVec(), ElementsAre("4", "2", "3", "1"));
+  EXPECT_THAT(Run({"sort", "ids", "by", "w_*", "desc", "limit", "0", "2"}).GetVec(),
+              ElementsAre("1", "3"));
+  EXPECT_THAT(Run({"sort", "ids", "by", "a_*", "alpha"}).GetVec(),
+              ElementsAre("4", "2", "3", "1"));
+  EXPECT_THAT(Run({"sort", "ids", "by", "nosort", "limit", "1", "2"}).GetVec(),
+              ElementsAre("1", "2"));
+
+  auto resp = Run({"sort", "ids", "by", "w_*", "limit", "1", "2", "get", "#", "get", "h_*->name"});
+  ASSERT_THAT(resp, ArrLen(4));
+  EXPECT_EQ(resp.GetVec()[0], "2");
+  EXPECT_EQ(resp.GetVec()[1], "two");
+  EXPECT_EQ(resp.GetVec()[2], "3");
+  EXPECT_THAT(resp.GetVec()[3], ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"sort", "ids", "get", "w_*"}).GetVec()[1], "10");
+
+  Run({"set", "w_4", "heavy"});
+  EXPECT_THAT(Run({"sort", "ids", "by", "w_*"}),
+              ErrArg("One or more scores can't be converted into double"));
+
+  EXPECT_THAT(Run({"sort_ro", "ids", "limit", "0", "2"}).GetVec(), ElementsAre("1", "2"));
+  EXPECT_THAT(Run({"sort_ro", "ids", "store", "dest"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"sort", "ids", "store", "dest"}), ErrArg("STORE is not supported"));
+  EXPECT_THAT(Run({"sort", "ids", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(GenericFamilyTest, SortLimit) {
+  vector<string> args{"rpush", "big"};
+  for (int i = 999; i >= 0; --i) {
+    args.push_back(StrCat(i * 7 % 1000));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  Run(absl::MakeSpan(sv_args));
+
+  EXPECT_THAT(Run({"sort", "big", "limit", "0", "3"}).GetVec(), ElementsAre("0", "1", "2"));
+  EXPECT_THAT(Run({"sort", "big", "limit", "500", "2"}).GetVec(), ElementsAre("500", "501"));
+  EXPECT_THAT(Run({"sort", "big", "desc", "limit", "10", "2"}).GetVec(),
+              ElementsAre("989", "988"));
+  EXPECT_THAT(Run({"sort", "big", "alpha", "limit", "0", "3"}).GetVec(),
+              ElementsAre("0", "1", "10"));
+  EXPECT_THAT(Run({"sort", "big", "limit", "998", "10"}).GetVec(), ElementsAre("998", "999"));
+
+  // A negative offset starts at the beginning, a negative count takes all the elements.
+  EXPECT_THAT(Run({"sort", "big", "limit", "-5", "1"}), "0");
+  EXPECT_THAT(Run({"sort", "big", "limit", "0", "-1"}), ArrLen(1000));
+}
+
+TEST_F(GenericFamilyTest, Object) {
+  Run({"set", "key", "val"});
+  EXPECT_EQ(Run({"object", "encoding", "key"}), "inline");
+  EXPECT_THAT(Run({"object", "refcount", "key"}), IntArg(1));
+  EXPECT_THAT(Run({"object", "idletime", "key"}), IntArg(0));
+  EXPECT_THAT(Run({"object", "freq", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"object", "foo", "key"}), ErrArg("Unknown subcommand"));
+
+  for (unsigned i = 0; i < 100; ++i)
+    Run({"get", "key"});
+  auto resp = Run({"object", "freq", "key"});
+  ASSERT_THAT(resp, ArgType(RespExpr::INT64));
+  EXPECT_GT(get<int64_t>(resp.u), 1);
+
+  // Runs full passes of the aging of the idle clocks.
+  auto run_pass = [] {
+    shard_set->RunBriefInParallel([](EngineShard* shard) {
+      DbSlice& db_slice = shard->db_slice();
+      do {
+        db_slice.DecayFreqStep(0);
+      } while (db_slice.GetDBTable(0)->freq_decay_cursor);
+    });
+  };
+
+  // The first pass measures the duration of the passes, the second one lasts a minute and
+  // therefore ages the key to the first level.
+  run_pass();
+  AdvanceTime(60000);
+  run_pass();
+  EXPECT_THAT(Run({"object", "idletime", "key"}), IntArg(60));
+
+  Run({"get", "key"});
+  EXPECT_THAT(Run({"object", "idletime", "key"}), IntArg(0));
+}
+
 TEST_F(GenericFamilyTest, Time) {
   auto resp = Run({"time"});
   EXPECT_THAT(resp, ArrLen(2));
@@ -521,4 +937,51 @@ TEST_F(GenericFamilyTest, Restore) {
   EXPECT_EQ(CheckedInt({"ttl", "string-key"}), -1);
 }
 
+TEST_F(GenericFamilyTest, MDumpMRestore) {
+  Run({"set", "str", "value"});
+  Run({"pexpire", "str", "100000"});
+  Run({"rpush", "list", "a", "b"});
+  Run({"hset", "hash", "f1", "v1", "f2", "v2"});
+  Run({"zadd", "zset", "1", "m1", "2", "m2"});
+
+  auto resp = Run({"mdump", "str", "list", "hash", "zset", "missing"});
+  ASSERT_EQ(resp.type, RespExpr::STRING);
+  string payload{ToSV(resp.GetBuf())};
+
+  // Existing keys are kept unless REPLACE is given.
+  Run({"set", "hash", "other"});
+  EXPECT_THAT(Run({"mrestore", payload}), IntArg(0));
+  Run({"del", "str", "list", "zset"});
+  EXPECT_THAT(Run({"mrestore", payload}), IntArg(3));
+  EXPECT_EQ(Run({"get", "hash"}), "other");
+  EXPECT_THAT(Run({"mrestore", payload, "REPLACE"}), IntArg(4));
+
+  EXPECT_EQ(Run({"get", "str"}), "value");
+  EXPECT_GT(CheckedInt({"pttl", "str"}), 0);
+  resp = Run({"lrange", "list", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "b"));
+  EXPECT_EQ(Run({"hget", "hash", "f2"}), "v2");
+  EXPECT_EQ(Run({"zscore", "zset", "m2"}), "2");
+
+  // Compressed payloads and the errors.
+  SetFlag(&FLAGS_snapshot_compression, "lz4");
+  vector<string> keys;
+  for (unsigned i = 0; i < 100; ++i) {
+    keys.push_back(StrCat("key", i));
+    Run({"set", keys.back(), string(100, 'x')});
+  }
+  vector<string_view> args{"mdump"};
+  args.insert(args.end(), keys.begin(), keys.end());
+  resp = Run(absl::MakeSpan(args));
+  payload = ToSV(resp.GetBuf());
+  SetFlag(&FLAGS_snapshot_compression, "none");
+  Run({"flushdb"});
+  EXPECT_THAT(Run({"mrestore", payload}), IntArg(100));
+  EXPECT_EQ(Run({"get", "key42"}), string(100, 'x'));
+
+  payload[0] ^= 1;
+  EXPECT_THAT(Run({"mrestore", payload}), ErrArg("checksum"));
+  EXPECT_THAT(Run({"mrestore", payload, "NX"}), ErrArg("syntax error"));
+}
+
 }  // namespace dfly
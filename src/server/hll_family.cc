@@ -0,0 +1,278 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <memory>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "core/hll.h"
+#include "server/command_registry.h"
+#include "server/common.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+ABSL_FLAG(uint32_t, hll_sparse_max_bytes, 3000,
+          "HyperLogLog sketches are converted from the sparse to the dense encoding (12KB) once "
+          "their sparse encoding grows above this size. Same as hll-sparse-max-bytes of Redis");
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using absl::GetFlag;
+
+namespace {
+
+using CI = CommandId;
+
+constexpr char kInvalidHllErr[] = "-WRONGTYPE Key is not a valid HyperLogLog string value.";
+
+// The registers merged from the keys of a single shard.
+struct ShardSketches {
+  unique_ptr<hll::Registers> regs;  // null if the shard has none of the keys.
+  bool dense = false;               // whether any of the sketches is dense.
+  OpStatus status = OpStatus::OK;
+};
+
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
+}
+
+void SendHllError(OpStatus status, ConnectionContext* cntx) {
+  if (status == OpStatus::INVALID_VALUE)
+    return (*cntx)->SendError(kInvalidHllErr);
+  (*cntx)->SendError(status);
+}
+
+string_view GetSketch(EngineShard* shard, const PrimeValue& pv, string* scratch) {
+  if (pv.IsExternal()) {
+    auto [offset, size] = pv.GetExternalPtr();
+    scratch->resize(size);
+
+    error_code ec = shard->tiered_storage()->Read(offset, size, scratch->data());
+    CHECK(!ec) << "TBD: " << ec;
+    return *scratch;
+  }
+  return pv.GetSlice(scratch);
+}
+
+// Returns whether the key was created or any of its registers changed.
+OpResult<bool> OpAdd(const OpArgs& op_args, string_view key, ArgSlice elems) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  auto [it, added] = add_res;
+  string sketch;
+  if (added) {
+    sketch = hll::NewSketch();
+  } else {
+    if (it->second.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+
+    string scratch;
+    string_view value = GetSketch(op_args.shard, it->second, &scratch);
+    if (!hll::IsValid(value))
+      return OpStatus::INVALID_VALUE;
+    sketch.assign(value);
+  }
+
+  bool changed = hll::Add(elems, GetFlag(FLAGS_hll_sparse_max_bytes), &sketch);
+  if (!changed && !added)
+    return false;
+
+  if (!added)
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  it->second.SetString(sketch);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+
+  return true;
+}
+
+OpResult<uint64_t> OpCount(const OpArgs& op_args, string_view key) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND)
+    return 0;
+  if (!it_res)
+    return it_res.status();
+
+  string scratch;
+  string_view sketch = GetSketch(op_args.shard, it_res.value()->second, &scratch);
+  if (!hll::IsValid(sketch))
+    return OpStatus::INVALID_VALUE;
+
+  // PFCOUNT is a read-only command here, so unlike in Redis a stale cache is not written back.
+  // The cache is valid after PFMERGE and until the next PFADD that changes the sketch.
+  if (optional<uint64_t> cached = hll::CachedCount(sketch))
+    return *cached;
+  return hll::Count(sketch);
+}
+
+// Merges the sketches of keys into the registers of res. Missing keys are skipped.
+void OpMerge(const OpArgs& op_args, ArgSlice keys, ShardSketches* res) {
+  auto& db_slice = op_args.shard->db_slice();
+  string scratch;
+  for (string_view key : keys) {
+    auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+    if (it_res.status() == OpStatus::KEY_NOTFOUND)
+      continue;
+    if (!it_res) {
+      res->status = it_res.status();
+      return;
+    }
+
+    string_view sketch = GetSketch(op_args.shard, it_res.value()->second, &scratch);
+    if (!hll::IsValid(sketch)) {
+      res->status = OpStatus::INVALID_VALUE;
+      return;
+    }
+
+    if (!res->regs) {
+      res->regs = make_unique<hll::Registers>();
+      res->regs->fill(0);
+    }
+    hll::MergeMax(sketch, res->regs.get());
+    res->dense |= hll::IsDense(sketch);
+  }
+}
+
+OpStatus OpStore(const OpArgs& op_args, string_view key, string_view sketch) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  // The type of an existing key was checked by the merge hop.
+  auto [it, added] = add_res;
+  if (!added)
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  it->second.SetString(sketch);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+  return OpStatus::OK;
+}
+
+// Merges the registers of all the shards into dest.
+OpStatus MergeShards(const vector<ShardSketches>& sketches, hll::Registers* dest, bool* dense) {
+  dest->fill(0);
+  *dense = false;
+  for (const ShardSketches& shard_res : sketches) {
+    if (shard_res.status != OpStatus::OK)
+      return shard_res.status;
+    if (!shard_res.regs)
+      continue;
+    hll::MergeMax(*shard_res.regs, dest);
+    *dense |= shard_res.dense;
+  }
+  return OpStatus::OK;
+}
+
+void PfAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> elems(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i)
+    elems[i - 2] = ArgS(args, i);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), key, elems);
+  };
+
+  OpResult<bool> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return SendHllError(res.status(), cntx);
+  (*cntx)->SendLong(*res ? 1 : 0);
+}
+
+void PfCount(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() == 2) {
+    string_view key = ArgS(args, 1);
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      return OpCount(t->GetOpArgs(shard), key);
+    };
+
+    OpResult<uint64_t> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+    if (!res)
+      return SendHllError(res.status(), cntx);
+    return (*cntx)->SendLong(*res);
+  }
+
+  // Every shard merges its own keys so that only one set of registers per shard is combined.
+  vector<ShardSketches> sketches(shard_set->size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    OpMerge(t->GetOpArgs(shard), t->ShardArgsInShard(sid), &sketches[sid]);
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  auto total = make_unique<hll::Registers>();
+  bool dense;
+  OpStatus status = MergeShards(sketches, total.get(), &dense);
+  if (status != OpStatus::OK)
+    return SendHllError(status, cntx);
+  (*cntx)->SendLong(hll::Count(*total));
+}
+
+void PfMerge(CmdArgList args, ConnectionContext* cntx) {
+  string_view dest_key = ArgS(args, 1);
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
+
+  // The destination is merged as well, as in Redis.
+  vector<ShardSketches> sketches(shard_set->size());
+  auto merge_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    OpMerge(t->GetOpArgs(shard), t->ShardArgsInShard(sid), &sketches[sid]);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Schedule();
+  cntx->transaction->Execute(std::move(merge_cb), false);
+
+  auto total = make_unique<hll::Registers>();
+  bool dense;
+  OpStatus status = MergeShards(sketches, total.get(), &dense);
+  if (status != OpStatus::OK) {
+    cntx->transaction->Execute(NoOpCb, true);
+    return SendHllError(status, cntx);
+  }
+
+  // Encoded with a valid cache, so that the following PFCOUNT of dest_key does not estimate.
+  string sketch = hll::Encode(*total, dense, GetFlag(FLAGS_hll_sparse_max_bytes));
+  OpStatus store_status = OpStatus::OK;
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == dest_shard)
+      store_status = OpStore(t->GetOpArgs(shard), dest_key, sketch);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Execute(std::move(store_cb), true);
+  if (store_status != OpStatus::OK)
+    return SendHllError(store_status, cntx);
+  (*cntx)->SendOk();
+}
+
+}  // namespace
+
+void HllFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"PFADD", CO::WRITE | CO::DENYOOM | CO::FAST, -2, 1, 1, 1}.SetHandler(&PfAdd)
+            << CI{"PFCOUNT", CO::READONLY, -2, 1, -1, 1}.SetHandler(&PfCount)
+            << CI{"PFMERGE", CO::WRITE | CO::DENYOOM, -2, 1, -1, 1}.SetHandler(&PfMerge);
+}
+
+}  // namespace dfly
@@ -0,0 +1,18 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace dfly {
+
+class CommandRegistry;
+
+// The HyperLogLog commands: PFADD, PFCOUNT and PFMERGE. The sketches are strings in the format
+// of Redis, see core/hll.h.
+class HllFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
@@ -0,0 +1,119 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class HllFamilyTest : public BaseFamilyTest {
+ protected:
+  // Adds count distinct elements with the given prefix to key.
+  void AddElems(string_view key, string_view prefix, unsigned count) {
+    vector<string> elems;
+    for (unsigned i = 0; i < count; ++i)
+      elems.push_back(StrCat(prefix, i));
+
+    vector<string_view> cmd{"pfadd", key};
+    cmd.insert(cmd.end(), elems.begin(), elems.end());
+    Run(cmd);
+  }
+};
+
+TEST_F(HllFamilyTest, AddCount) {
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll", "a", "b", "c", "d", "e", "f", "g"}));
+  EXPECT_EQ(7, CheckedInt({"pfcount", "hll"}));
+
+  // The elements are already counted.
+  EXPECT_EQ(0, CheckedInt({"pfadd", "hll", "a", "b", "c"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll", "h"}));
+  EXPECT_EQ(8, CheckedInt({"pfcount", "hll"}));
+
+  // PFADD without elements only creates the key.
+  EXPECT_EQ(1, CheckedInt({"pfadd", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfadd", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "missing"}));
+
+  // The sketches are plain strings in the format of Redis.
+  auto resp = Run({"getrange", "hll", "0", "3"});
+  EXPECT_EQ(resp, "HYLL");
+}
+
+TEST_F(HllFamilyTest, Dense) {
+  AddElems("hll", "elem:", 20000);
+  int64_t count = CheckedInt({"pfcount", "hll"});
+  EXPECT_GT(count, 19400);
+  EXPECT_LT(count, 20600);
+  EXPECT_EQ(12304, CheckedInt({"strlen", "hll"}));
+}
+
+TEST_F(HllFamilyTest, MultiCount) {
+  // The keys are spread over the shards.
+  for (unsigned i = 0; i < 10; ++i)
+    AddElems(StrCat("day:", i), StrCat("user:", i, ":"), 100);
+
+  int64_t count = CheckedInt({"pfcount", "day:0", "day:1", "day:2", "day:3", "day:4", "day:5",
+                              "day:6", "day:7", "day:8", "day:9", "missing"});
+  EXPECT_GT(count, 970);
+  EXPECT_LT(count, 1030);
+
+  EXPECT_EQ(1, CheckedInt({"pfadd", "a", "1", "2", "3", "4", "5", "6", "7"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "b", "5", "6", "7", "8", "9"}));
+  EXPECT_EQ(9, CheckedInt({"pfcount", "a", "b"}));
+}
+
+TEST_F(HllFamilyTest, Merge) {
+  Run({"pfadd", "a", "1", "2", "3", "4"});
+  Run({"pfadd", "b", "3", "4", "5", "6"});
+  Run({"pfadd", "dest", "7"});
+
+  EXPECT_EQ(Run({"pfmerge", "dest", "a", "b", "missing"}), "OK");
+  EXPECT_EQ(7, CheckedInt({"pfcount", "dest"}));
+  EXPECT_EQ(4, CheckedInt({"pfcount", "a"}));
+
+  EXPECT_EQ(Run({"pfmerge", "new", "a"}), "OK");
+  EXPECT_EQ(4, CheckedInt({"pfcount", "new"}));
+  EXPECT_EQ(Run({"pfmerge", "empty"}), "OK");
+  EXPECT_EQ(0, CheckedInt({"pfcount", "empty"}));
+
+  // The merged sketch is dense once any of its sources is.
+  AddElems("big", "elem:", 10000);
+  EXPECT_EQ(Run({"pfmerge", "dest", "big"}), "OK");
+  EXPECT_EQ(12304, CheckedInt({"strlen", "dest"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "dest", "new:elem"}));
+}
+
+TEST_F(HllFamilyTest, Errors) {
+  Run({"set", "str", "foo"});
+  Run({"lpush", "list", "a"});
+  Run({"pfadd", "hll", "a"});
+
+  EXPECT_THAT(Run({"pfadd", "str", "a"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfcount", "str"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfcount", "hll", "str"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfmerge", "hll", "str"}), ErrArg("not a valid HyperLogLog"));
+
+  EXPECT_THAT(Run({"pfadd", "list", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"pfcount", "list"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"pfmerge", "list", "hll"}), ErrArg("WRONGTYPE"));
+
+  // A failed merge leaves the destination as is.
+  EXPECT_EQ(1, CheckedInt({"pfcount", "hll"}));
+  EXPECT_THAT(Run({"pfcount"}), ErrArg("wrong number of arguments"));
+}
+
+}  // namespace dfly
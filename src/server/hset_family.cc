@@ -4,6 +4,10 @@
 
 #include "server/hset_family.h"
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/container/inlined_vector.h>
+#include <absl/random/random.h>
+
 extern "C" {
 #include "redis/listpack.h"
 #include "redis/object.h"
@@ -12,9 +16,11 @@ extern "C" {
 }
 
 #include "base/logging.h"
+#include "core/string_map.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
+#include "server/container_utils.h"
 #include "server/engine_shard_set.h"
 #include "server/transaction.h"
 
@@ -31,7 +37,9 @@ using IncrByParam = std::variant<double, int64_t>;
 using OptStr = std::optional<std::string>;
 enum GetAllMode : uint8_t { FIELDS = 1, VALUES = 2 };
 
-bool IsGoodForListpack(CmdArgList args, const uint8_t* lp) {
+// Returns whether lp stays below max_len bytes after adding args. A null lp stands for an
+// empty listpack.
+bool IsGoodForListpack(CmdArgList args, const uint8_t* lp, size_t max_len) {
   size_t sum = 0;
   for (auto s : args) {
     if (s.size() > server.hash_max_listpack_value)
@@ -39,7 +47,8 @@ bool IsGoodForListpack(CmdArgList args, const uint8_t* lp) {
     sum += s.size();
   }
 
-  return lpBytes(const_cast<uint8_t*>(lp)) + sum < kMaxListPackLen;
+  constexpr size_t kEmptyLpBytes = 7;
+  return (lp ? lpBytes(const_cast<uint8_t*>(lp)) : kEmptyLpBytes) + sum < max_len;
 }
 
 string LpGetVal(uint8_t* lp_it) {
@@ -102,34 +111,95 @@ pair<uint8_t*, bool> LpInsert(uint8_t* lp, string_view field, string_view val, b
   return make_pair(lp, !updated);
 }
 
+// Sets the value of field to val, where vptr is the current value of field or null if lp does not
+// contain it. Returns the new pointer to lp.
+uint8_t* LpSetValue(uint8_t* lp, uint8_t* vptr, string_view field, string_view val) {
+  // See LpInsert for the addresses of the empty strings.
+  uint8_t* vsrc = val.empty() ? lp : (uint8_t*)val.data();
+  if (!vptr) {
+    lp = lpAppend(lp, field.empty() ? lp : (uint8_t*)field.data(), field.size());
+    return lpAppend(lp, vsrc, val.size());
+  }
+
+  // lpReplace overwrites the value in place if its encoded size does not change.
+  return lpReplace(lp, &vptr, vsrc, val.size());
+}
+
+// Returns the StringMap of pv with its clock set, so that expired fields are not returned.
+StringMap* GetStringMap(const PrimeValue& pv, const DbContext& db_context) {
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+  StringMap* sm = (StringMap*)pv.RObjPtr();
+  sm->set_time(MemberTimeSeconds(db_context.time_now_ms));
+  return sm;
+}
+
+// For StringMap, the length includes expired fields that have not been deleted yet.
+size_t HMapLength(const DbContext& db_context, const PrimeValue& pv) {
+  if (pv.Encoding() == kEncodingListPack) {
+    return lpLength((uint8_t*)pv.RObjPtr()) / 2;
+  }
+
+  return GetStringMap(pv, db_context)->Size();
+}
+
+// Converts a listpack hash into StringMap. The listpack is freed by InitRobj.
+void ConvertToStrMap(PrimeValue* pv) {
+  StringMap* sm = HSetFamily::ConvertToStrMap((uint8_t*)pv->RObjPtr());
+  pv->InitRobj(OBJ_HASH, kEncodingStrMap2, sm);
+}
+
+// Picks a random entry from a non-empty StringMap by scanning from a random cursor.
+sds RandomEntry(const StringMap& sm) {
+  thread_local absl::InsecureBitGen bitgen;
+
+  sds res = nullptr;
+  unsigned num_seen = 0;
+  auto scan_cb = [&](sds entry) {
+    // reservoir sampling over the entries of the scanned bucket.
+    if (absl::Uniform(bitgen, 0u, ++num_seen) == 0)
+      res = entry;
+  };
+
+  // The second pass wraps around from the beginning of the table.
+  uint32_t cursor = absl::Uniform<uint32_t>(bitgen);
+  for (unsigned pass = 0; pass < 2 && !res; ++pass) {
+    do {
+      cursor = sm.Scan(cursor, scan_cb);
+    } while (!res && cursor != 0);
+  }
+
+  DCHECK(res);
+  return res;
+}
+
 OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, IncrByParam* param) {
   auto& db_slice = op_args.shard->db_slice();
   const auto [it, inserted] = db_slice.AddOrFind(op_args.db_cntx, key);
 
   DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
 
-  robj* hset = nullptr;
   size_t lpb = 0;
 
   PrimeValue& pv = it->second;
   if (inserted) {
     pv.InitRobj(OBJ_HASH, kEncodingListPack, lpNew(0));
     stats->listpack_blob_cnt++;
-    hset = it->second.AsRObj();
   } else {
     if (pv.ObjType() != OBJ_HASH)
       return OpStatus::WRONG_TYPE;
 
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-    hset = it->second.AsRObj();
 
     if (pv.Encoding() == kEncodingListPack) {
       lpb = lpBytes((uint8_t*)pv.RObjPtr());
       stats->listpack_bytes -= lpb;
 
-      if (lpb >= kMaxListPackLen) {
+      if (lpb >= container_utils::ListpackLimit(pv, kMaxListPackLen)) {
         stats->listpack_blob_cnt--;
-        hashTypeConvert(hset, OBJ_ENCODING_HT);
+        stats->listpack_conversions++;
+        stats->listpack_early_conversions += (lpb < kMaxListPackLen);
+        ConvertToStrMap(&pv);
+        lpb = 0;
       }
     }
   }
@@ -138,10 +208,33 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
   uint8_t* vstr = NULL;
   unsigned int vlen = UINT_MAX;
   long long old_val = 0;
+  int exist_res = C_ERR;
 
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+  // The value of the field in a listpack, which is replaced in place when the new value has
+  // the same encoded size, so that counters do not search the listpack twice.
+  uint8_t* lp_vptr = nullptr;
 
-  int exist_res = hashTypeGetValue(hset, op_args.shard->tmp_str1, &vstr, &vlen, &old_val);
+  if (enc == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    uint8_t* fptr = lpFirst(lp);
+    if (fptr) {
+      uint8_t* fsrc = field.empty() ? lp : (uint8_t*)field.data();
+      fptr = lpFind(lp, fptr, fsrc, field.size(), 1);
+    }
+    if (fptr) {
+      lp_vptr = lpNext(lp, fptr);
+      vstr = lpGetValue(lp_vptr, &vlen, &old_val);
+      exist_res = C_OK;
+    }
+  } else {
+    sds entry = GetStringMap(pv, op_args.db_cntx)->Find(field);
+    if (entry) {
+      string_view val = StringMap::GetValue(entry);
+      vstr = (uint8_t*)val.data();
+      vlen = val.size();
+      exist_res = C_OK;
+    }
+  }
 
   if (holds_alternative<double>(*param)) {
     long double value;
@@ -172,15 +265,11 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
     string_view sval{str};
 
     if (enc == kEncodingListPack) {
-      uint8_t* lp = (uint8_t*)pv.RObjPtr();
-
-      lp = LpInsert(lp, field, sval, false).first;
+      uint8_t* lp = LpSetValue((uint8_t*)pv.RObjPtr(), lp_vptr, field, sval);
       pv.SetRObjPtr(lp);
       stats->listpack_bytes += lpBytes(lp);
     } else {
-      sds news = sdsnewlen(str, sval.size());
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
-      pv.SyncRObj();
+      GetStringMap(pv, op_args.db_cntx)->AddOrUpdate(field, sval);
     }
     param->emplace<double>(value);
   } else {  // integer increment
@@ -207,15 +296,11 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
     string_view sval{buf, size_t(next - buf)};
 
     if (enc == kEncodingListPack) {
-      uint8_t* lp = (uint8_t*)pv.RObjPtr();
-
-      lp = LpInsert(lp, field, sval, false).first;
+      uint8_t* lp = LpSetValue((uint8_t*)pv.RObjPtr(), lp_vptr, field, sval);
       pv.SetRObjPtr(lp);
       stats->listpack_bytes += lpBytes(lp);
     } else {
-      sds news = sdsfromlonglong(new_val);
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
-      pv.SyncRObj();
+      GetStringMap(pv, op_args.db_cntx)->AddOrUpdate(field, sval);
     }
     param->emplace<int64_t>(new_val);
   }
@@ -227,7 +312,6 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
 
 OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t* cursor,
                            const ScanOpts& scan_op) {
-  using PrivateDataRef = std::tuple<StringVec&, const ScanOpts&>;
   constexpr size_t HASH_TABLE_ENTRIES_FACTOR = 2;  // return key/value
 
   /* We set the max number of iterations to ten times the specified
@@ -246,10 +330,10 @@ OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t
   PrimeIterator it = find_res.value();
   StringVec res;
   uint32_t count = scan_op.limit * HASH_TABLE_ENTRIES_FACTOR;
-  robj* hset = it->second.AsRObj();
+  const PrimeValue& pv = it->second;
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    uint8_t* lp = (uint8_t*)hset->ptr;
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
     uint8_t* lp_elem = lpFirst(lp);
 
     DCHECK(lp_elem);  // empty containers are not allowed.
@@ -271,32 +355,43 @@ OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t
 
     *cursor = 0;
   } else {
-    dict* ht = (dict*)hset->ptr;
+    DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+    StringMap* sm = GetStringMap(pv, op_args.db_cntx);
     long max_iterations = count * INTERATION_FACTOR;
-    PrivateDataRef private_data_ref(res, scan_op);
-    void* private_data = &private_data_ref;
-
-    // note about this lambda - don't capture here! it should be convertible to C function!
-    auto scanCb = [](void* private_data, const dictEntry* de) {
-      StringVec& res = std::get<0>(*(PrivateDataRef*)private_data);
-      const ScanOpts& scan_op = std::get<1>(*(PrivateDataRef*)private_data);
-      sds val = (sds)de->key;
-      auto len = sdslen(val);
-      if (scan_op.Matches(std::string_view(val, len))) {
-        res.emplace_back(val, len);
-        val = (sds)de->v.val;
-        res.emplace_back(val, sdslen(val));
+
+    auto scan_cb = [&](const sds entry) {
+      string_view field{entry, sdslen(entry)};
+      if (scan_op.Matches(field)) {
+        res.emplace_back(field);
+        res.emplace_back(StringMap::GetValue(entry));
       }
     };
 
     do {
-      *cursor = dictScan(ht, *cursor, scanCb, NULL, private_data);
+      *cursor = sm->Scan(*cursor, scan_cb);
     } while (*cursor && max_iterations-- && res.size() < count);
   }
 
   return res;
 }
 
+// Persists the field that OpIncrBy set with the value that it stored.
+void PersistIncrBy(Transaction* t, EngineShard* shard, string_view key, MutableSlice field,
+                   const IncrByParam& param) {
+  char buf[128];
+  MutableSlice value;
+  if (holds_alternative<double>(param)) {
+    char* str = RedisReplyBuilder::FormatDouble(get<double>(param), buf, sizeof(buf));
+    value = MutableSlice{str, strlen(str)};
+  } else {
+    char* next = absl::numbers_internal::FastIntToBuffer(get<int64_t>(param), buf);
+    value = MutableSlice{buf, size_t(next - buf)};
+  }
+
+  MutableSlice field_value[2] = {field, value};
+  t->PersistFields(shard, key, CmdArgList{field_value, 2}, {});
+}
+
 OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, CmdArgList values) {
   DCHECK(!values.empty());
 
@@ -308,37 +403,51 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, CmdArgList valu
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, *it_res);
   CompactObj& co = (*it_res)->second;
-  robj* hset = co.AsRObj();
+  unsigned enc = co.Encoding();
   unsigned deleted = 0;
   bool key_remove = false;
   DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    stats->listpack_bytes -= lpBytes((uint8_t*)hset->ptr);
-  }
+  if (enc == kEncodingListPack) {
+    stats->listpack_bytes -= lpBytes((uint8_t*)co.RObjPtr());
+    robj* hset = co.AsRObj();
 
-  for (auto s : values) {
-    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
+    for (auto s : values) {
+      op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
 
-    if (hashTypeDelete(hset, op_args.shard->tmp_str1)) {
-      ++deleted;
-      if (hashTypeLength(hset) == 0) {
-        key_remove = true;
-        break;
+      if (hashTypeDelete(hset, op_args.shard->tmp_str1)) {
+        ++deleted;
+        if (hashTypeLength(hset) == 0) {
+          key_remove = true;
+          break;
+        }
       }
     }
-  }
 
-  co.SyncRObj();
+    co.SyncRObj();
+  } else {
+    DCHECK_EQ(kEncodingStrMap2, enc);
+    StringMap* sm = GetStringMap(co, op_args.db_cntx);
+
+    for (auto s : values) {
+      if (sm->Erase(string_view{s.data(), s.size()})) {
+        ++deleted;
+        if (sm->Empty()) {
+          key_remove = true;
+          break;
+        }
+      }
+    }
+  }
 
   db_slice.PostUpdate(op_args.db_cntx.db_index, *it_res, key);
   if (key_remove) {
-    if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    if (enc == kEncodingListPack) {
       stats->listpack_blob_cnt--;
     }
     db_slice.Del(op_args.db_cntx.db_index, *it_res);
-  } else if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    stats->listpack_bytes += lpBytes((uint8_t*)hset->ptr);
+  } else if (enc == kEncodingListPack) {
+    stats->listpack_bytes += lpBytes((uint8_t*)co.RObjPtr());
   }
 
   return deleted;
@@ -354,12 +463,11 @@ OpResult<vector<OptStr>> OpMGet(const OpArgs& op_args, std::string_view key, Cmd
     return it_res.status();
 
   CompactObj& co = (*it_res)->second;
-  robj* hset = co.AsRObj();
 
   std::vector<OptStr> result(fields.size());
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    uint8_t* lp = (uint8_t*)hset->ptr;
+  if (co.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)co.RObjPtr();
     absl::flat_hash_map<string_view, unsigned> reverse;
     reverse.reserve(fields.size() + 1);
     for (size_t i = 0; i < fields.size(); ++i) {
@@ -395,15 +503,12 @@ OpResult<vector<OptStr>> OpMGet(const OpArgs& op_args, std::string_view key, Cmd
       lp_elem = lpNext(lp, lp_elem);  // switch to the next key
     } while (lp_elem);
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* d = (dict*)hset->ptr;
+    DCHECK_EQ(kEncodingStrMap2, co.Encoding());
+    StringMap* sm = GetStringMap(co, op_args.db_cntx);
     for (size_t i = 0; i < fields.size(); ++i) {
-      op_args.shard->tmp_str1 =
-          sdscpylen(op_args.shard->tmp_str1, fields[i].data(), fields[i].size());
-      dictEntry* de = dictFind(d, op_args.shard->tmp_str1);
-      if (de) {
-        sds val = (sds)dictGetVal(de);
-        result[i].emplace(val, sdslen(val));
+      sds entry = sm->Find(ArgS(fields, i));
+      if (entry) {
+        result[i].emplace(StringMap::GetValue(entry));
       }
     }
   }
@@ -416,8 +521,7 @@ OpResult<uint32_t> OpLen(const OpArgs& op_args, string_view key) {
   auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
 
   if (it_res) {
-    robj* hset = (*it_res)->second.AsRObj();
-    return hashTypeLength(hset);
+    return HMapLength(op_args.db_cntx, (*it_res)->second);
   }
   if (it_res.status() == OpStatus::KEY_NOTFOUND)
     return 0;
@@ -430,16 +534,15 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, string_view field
   if (!it_res)
     return it_res.status();
 
-  robj* hset = (*it_res)->second.AsRObj();
-
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+  const PrimeValue& pv = (*it_res)->second;
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+  if (pv.Encoding() == kEncodingListPack) {
     unsigned char* vstr = NULL;
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
 
-    int ret = hashTypeGetFromListpack(hset, op_args.shard->tmp_str1, &vstr, &vlen, &vll);
+    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+    int ret = hashTypeGetFromListpack(pv.AsRObj(), op_args.shard->tmp_str1, &vstr, &vlen, &vll);
     if (ret < 0) {
       return OpStatus::KEY_NOTFOUND;
     }
@@ -450,15 +553,13 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, string_view field
 
     return absl::StrCat(vll);
   }
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
 
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  if (!de)
+  sds entry = GetStringMap(pv, op_args.db_cntx)->Find(field);
+  if (!entry)
     return OpStatus::KEY_NOTFOUND;
 
-  sds val = (sds)dictGetVal(de);
-
-  return string(val, sdslen(val));
+  return string(StringMap::GetValue(entry));
 }
 
 OpResult<vector<string>> OpGetAll(const OpArgs& op_args, string_view key, uint8_t mask) {
@@ -470,16 +571,17 @@ OpResult<vector<string>> OpGetAll(const OpArgs& op_args, string_view key, uint8_
     return it_res.status();
   }
 
-  robj* hset = (*it_res)->second.AsRObj();
-  hashTypeIterator* hi = hashTypeInitIterator(hset);
+  const PrimeValue& pv = (*it_res)->second;
 
   vector<string> res;
   bool keyval = (mask == (FIELDS | VALUES));
-  size_t len = hashTypeLength(hset);
+  size_t len = HMapLength(op_args.db_cntx, pv);
   res.resize(keyval ? len * 2 : len);
   unsigned index = 0;
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+  if (pv.Encoding() == kEncodingListPack) {
+    hashTypeIterator* hi = hashTypeInitIterator(pv.AsRObj());
+
     while (hashTypeNext(hi) != C_ERR) {
       if (mask & FIELDS) {
         res[index++] = LpGetVal(hi->fptr);
@@ -489,25 +591,111 @@ OpResult<vector<string>> OpGetAll(const OpArgs& op_args, string_view key, uint8_
         res[index++] = LpGetVal(hi->vptr);
       }
     }
+
+    hashTypeReleaseIterator(hi);
   } else {
-    while (hashTypeNext(hi) != C_ERR) {
+    DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+
+    for (sds entry : *GetStringMap(pv, op_args.db_cntx)) {
       if (mask & FIELDS) {
-        sds key = (sds)dictGetKey(hi->de);
-        res[index++].assign(key, sdslen(key));
+        res[index++].assign(entry, sdslen(entry));
       }
 
       if (mask & VALUES) {
-        sds val = (sds)dictGetVal(hi->de);
-        res[index++].assign(val, sdslen(val));
+        res[index++] = StringMap::GetValue(entry);
       }
     }
-  }
 
-  hashTypeReleaseIterator(hi);
+    // The length included fields that expired during the iteration.
+    res.resize(index);
+  }
 
   return res;
 }
 
+bool IsBatchReplyable(const PrimeValue& pv) {
+  return pv.Encoding() == kEncodingStrMap2 &&
+         container_utils::IsBatchReplyable(*(StringMap*)pv.RObjPtr());
+}
+
+// Sends the entries of a big hash in batches of kReplyBatchSize, one hop per batch, so that
+// the shard never holds a copy of the whole hash. The hops run on a transaction of their own
+// that keeps the key locked until the last batch is sent.
+void HGetAllInBatches(string_view key, uint8_t mask, ConnectionContext* cntx) {
+  auto trans = cntx->transaction->CloneUnscheduled();
+  trans->Schedule();
+
+  OpStatus status = OpStatus::OK;
+  size_t total = 0;  // in entries.
+  uint32_t cursor = 0;
+  bool first_hop = true;
+  vector<string> batch;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
+    if (!it_res) {
+      status = it_res.status();
+      return OpStatus::OK;
+    }
+
+    const PrimeValue& pv = (*it_res)->second;
+    batch.clear();
+    if (first_hop) {
+      first_hop = false;
+      if (!IsBatchReplyable(pv)) {  // The hash changed since the first transaction.
+        batch = std::move(OpGetAll(op_args, key, mask).value());
+        total = mask == (FIELDS | VALUES) ? batch.size() / 2 : batch.size();
+        return OpStatus::OK;
+      }
+      total = ((StringMap*)pv.RObjPtr())->Size();
+    }
+
+    const StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+    size_t entries = 0;
+    do {
+      cursor = sm->Scan(cursor, [&](sds entry) {
+        if (mask & FIELDS)
+          batch.emplace_back(entry, sdslen(entry));
+        if (mask & VALUES)
+          batch.emplace_back(StringMap::GetValue(entry));
+        ++entries;
+      });
+    } while (cursor && entries < container_utils::kReplyBatchSize);
+    return OpStatus::OK;
+  };
+
+  bool is_map = (mask == (FIELDS | VALUES));
+  auto collection_type = is_map ? RedisReplyBuilder::MAP : RedisReplyBuilder::ARRAY;
+
+  trans->Execute(cb, false);
+  if (status != OpStatus::OK) {
+    trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+    if (status == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->StartCollection(0, collection_type);
+    return (*cntx)->SendError(status);
+  }
+
+  size_t total_strings = is_map ? total * 2 : total;
+  (*cntx)->StartCollection(total, collection_type);
+
+  size_t sent = 0;
+  while (true) {
+    for (size_t i = 0; i < batch.size() && sent < total_strings; ++i, ++sent) {
+      (*cntx)->SendBulkString(batch[i]);
+    }
+    if (cursor == 0 || status != OpStatus::OK)
+      break;
+    trans->Execute(cb, false);
+  }
+  trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+
+  LOG_IF(DFATAL, sent < total_strings) << "Sent " << sent << " strings of " << total_strings;
+  for (; sent < total_strings; ++sent) {
+    (*cntx)->SendBulkString("");
+  }
+}
+
 OpResult<size_t> OpStrLen(const OpArgs& op_args, string_view key, string_view field) {
   auto& db_slice = op_args.shard->db_slice();
   auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
@@ -518,29 +706,64 @@ OpResult<size_t> OpStrLen(const OpArgs& op_args, string_view key, string_view fi
     return it_res.status();
   }
 
-  robj* hset = (*it_res)->second.AsRObj();
+  const PrimeValue& pv = (*it_res)->second;
   size_t field_len = 0;
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+  if (pv.Encoding() == kEncodingListPack) {
     unsigned char* vstr = NULL;
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
 
-    if (hashTypeGetFromListpack(hset, op_args.shard->tmp_str1, &vstr, &vlen, &vll) == 0)
+    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+    if (hashTypeGetFromListpack(pv.AsRObj(), op_args.shard->tmp_str1, &vstr, &vlen, &vll) == 0)
       field_len = vstr ? vlen : sdigits10(vll);
 
     return field_len;
   }
 
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
 
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  return de ? sdslen((sds)de->v.val) : 0;
+  sds entry = GetStringMap(pv, op_args.db_cntx)->Find(field);
+  return entry ? StringMap::GetValue(entry).size() : 0;
+}
+
+// ttl_sec is applied to all the fields set, UINT32_MAX means no ttl. Fields with ttl are
+// supported only by StringMap, so listpack hashes are converted.
+// Builds the listpack of a new hash from the field value pairs in a single pass, instead of
+// inserting them one by one. Returns nullptr if the pairs do not fit into a listpack shorter
+// than max_len or if some field repeats, since then they need LpInsert.
+uint8_t* LpBuild(CmdArgList values, size_t max_len) {
+  if (!IsGoodForListpack(values, nullptr, max_len))
+    return nullptr;
+
+  size_t num_fields = values.size() / 2;
+  constexpr size_t kMaxQuadraticFields = 8;
+  if (num_fields <= kMaxQuadraticFields) {
+    for (size_t i = 2; i < values.size(); i += 2) {
+      for (size_t j = 0; j < i; j += 2) {
+        if (ArgS(values, i) == ArgS(values, j))
+          return nullptr;
+      }
+    }
+  } else {
+    absl::flat_hash_set<string_view> fields;
+    fields.reserve(num_fields);
+    for (size_t i = 0; i < values.size(); i += 2) {
+      if (!fields.insert(ArgS(values, i)).second)
+        return nullptr;
+    }
+  }
+
+  absl::InlinedVector<listpackEntry, 16> entries(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    entries[i].sval = reinterpret_cast<uint8_t*>(values[i].data());
+    entries[i].slen = values[i].size();
+  }
+  return lpBatchAppend(lpNew(0), entries.data(), entries.size());
 }
 
 OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList values,
-                         bool skip_if_exists) {
+                         bool skip_if_exists, uint32_t ttl_sec = UINT32_MAX) {
   DCHECK(!values.empty() && 0 == values.size() % 2);
 
   auto& db_slice = op_args.shard->db_slice();
@@ -556,6 +779,18 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
   uint8_t* lp = nullptr;
   PrimeIterator& it = add_res.first;
 
+  // The common case of bulk loads: a new small hash whose fields are all distinct.
+  if (add_res.second && ttl_sec == UINT32_MAX) {
+    lp = LpBuild(values, kMaxListPackLen);
+    if (lp) {
+      it->second.InitRobj(OBJ_HASH, kEncodingListPack, lp);
+      stats->listpack_blob_cnt++;
+      stats->listpack_bytes += lpBytes(lp);
+      db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
+      return values.size() / 2;
+    }
+  }
+
   if (add_res.second) {  // new key
     lp = lpNew(0);
     it->second.InitRobj(OBJ_HASH, kEncodingListPack, lp);
@@ -568,15 +803,19 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
 
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   }
-  robj* hset = it->second.AsRObj();
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    lp = (uint8_t*)hset->ptr;
+  PrimeValue& pv = it->second;
+  if (pv.Encoding() == kEncodingListPack) {
+    lp = (uint8_t*)pv.RObjPtr();
     stats->listpack_bytes -= lpBytes(lp);
 
-    if (!IsGoodForListpack(values, lp)) {
+    size_t max_len = container_utils::ListpackLimit(pv, kMaxListPackLen);
+    if (ttl_sec != UINT32_MAX || !IsGoodForListpack(values, lp, max_len)) {
       stats->listpack_blob_cnt--;
-      hashTypeConvert(hset, OBJ_ENCODING_HT);
+      stats->listpack_conversions++;
+      stats->listpack_early_conversions +=
+          ttl_sec == UINT32_MAX && IsGoodForListpack(values, lp, kMaxListPackLen);
+      ConvertToStrMap(&pv);
       lp = nullptr;
     }
   }
@@ -589,33 +828,22 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
       tie(lp, inserted) = LpInsert(lp, ArgS(values, i), ArgS(values, i + 1), skip_if_exists);
       created += inserted;
     }
-    hset->ptr = lp;
+    pv.SetRObjPtr(lp);
     stats->listpack_bytes += lpBytes(lp);
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* this_dict = (dict*)hset->ptr;
+    DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+    StringMap* sm = GetStringMap(pv, op_args.db_cntx);
 
-    // Dictionary
     for (size_t i = 0; i < values.size(); i += 2) {
-      sds fs = sdsnewlen(values[i].data(), values[i].size());
-      dictEntry* existing;
-      dictEntry* de = dictAddRaw(this_dict, fs, &existing);
-      if (de) {
-        ++created;
-      } else {  // already exists
-        sdsfree(fs);
-        if (skip_if_exists)
-          continue;
-
-        de = existing;
-        dictFreeVal(this_dict, existing);
+      string_view field = ArgS(values, i);
+      string_view value = ArgS(values, i + 1);
+      if (skip_if_exists) {
+        created += sm->AddOrSkip(field, value);
+      } else {
+        created += sm->AddOrUpdate(field, value, ttl_sec);
       }
-
-      sds vs = sdsnewlen(values[i + 1].data(), values[i + 1].size());
-      dictSetVal(this_dict, de, vs);
     }
   }
-  it->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
   return created;
@@ -623,12 +851,40 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
 
 }  // namespace
 
+OpResult<uint32_t> HSetFamily::OpHSet(const OpArgs& op_args, string_view key,
+                                      CmdArgList values) {
+  return OpSet(op_args, key, values, false);
+}
+
+OpResult<string> HSetFamily::OpHGet(const OpArgs& op_args, string_view key, string_view field) {
+  return OpGet(op_args, key, field);
+}
+
+OpStatus HSetFamily::OpApplyFields(const OpArgs& op_args, string_view key, CmdArgList set_fields,
+                                   CmdArgList removed_fields) {
+  if (!set_fields.empty()) {
+    OpResult<uint32_t> res = OpSet(op_args, key, set_fields, false);
+    if (!res)
+      return res.status();
+  }
+
+  if (!removed_fields.empty()) {
+    OpResult<uint32_t> res = OpDel(op_args, key, removed_fields);
+    if (!res && res.status() != OpStatus::KEY_NOTFOUND)
+      return res.status();
+  }
+  return OpStatus::OK;
+}
+
 void HSetFamily::HDel(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
 
   args.remove_prefix(2);
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpDel(t->GetOpArgs(shard), key, args);
+    OpResult<uint32_t> res = OpDel(t->GetOpArgs(shard), key, args);
+    if (res || res.status() == OpStatus::KEY_NOTFOUND)
+      t->PersistFields(shard, key, {}, res.value_or(0) ? args : CmdArgList{});
+    return res;
   };
 
   OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -661,10 +917,13 @@ void HSetFamily::HExists(CmdArgList args, ConnectionContext* cntx) {
     auto it_res = db_slice.Find(t->db_context(), key, OBJ_HASH);
 
     if (it_res) {
-      robj* hset = (*it_res)->second.AsRObj();
-      shard->tmp_str1 = sdscpylen(shard->tmp_str1, field.data(), field.size());
+      const PrimeValue& pv = (*it_res)->second;
+      if (pv.Encoding() == kEncodingStrMap2) {
+        return GetStringMap(pv, t->db_context())->Contains(field);
+      }
 
-      return hashTypeExists(hset, shard->tmp_str1);
+      shard->tmp_str1 = sdscpylen(shard->tmp_str1, field.data(), field.size());
+      return hashTypeExists(pv.AsRObj(), shard->tmp_str1);
     }
     if (it_res.status() == OpStatus::KEY_NOTFOUND)
       return 0;
@@ -741,7 +1000,10 @@ void HSetFamily::HIncrBy(CmdArgList args, ConnectionContext* cntx) {
   IncrByParam param{ival};
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+    OpStatus status = OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+    if (status == OpStatus::OK)
+      PersistIncrBy(t, shard, key, args[2], param);
+    return status;
   };
 
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
@@ -776,7 +1038,10 @@ void HSetFamily::HIncrByFloat(CmdArgList args, ConnectionContext* cntx) {
   IncrByParam param{dval};
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+    OpStatus status = OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+    if (status == OpStatus::OK)
+      PersistIncrBy(t, shard, key, args[2], param);
+    return status;
   };
 
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
@@ -809,15 +1074,28 @@ void HSetFamily::HGetAll(CmdArgList args, ConnectionContext* cntx) {
 
 void HSetFamily::HGetGeneric(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask) {
   string_view key = ArgS(args, 1);
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGetAll(t->GetOpArgs(shard), key, getall_mask);
+  bool in_batches = false;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<vector<string>> {
+    OpArgs op_args = t->GetOpArgs(shard);
+    if (!t->IsMulti() && !cntx->conn_state.script_info) {
+      auto it_res = shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
+      if (it_res && IsBatchReplyable((*it_res)->second)) {
+        in_batches = true;
+        return vector<string>{};
+      }
+    }
+    return OpGetAll(op_args, key, getall_mask);
   };
 
   OpResult<vector<string>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (in_batches)
+    return HGetAllInBatches(key, getall_mask, cntx);
 
   if (result) {
-    (*cntx)->SendStringArr(absl::Span<const string>{*result});
+    bool is_map = (getall_mask == (FIELDS | VALUES));
+    (*cntx)->SendStringCollection(*result,
+                                  is_map ? RedisReplyBuilder::MAP : RedisReplyBuilder::ARRAY);
   } else {
     (*cntx)->SendError(result.status());
   }
@@ -876,7 +1154,10 @@ void HSetFamily::HSet(CmdArgList args, ConnectionContext* cntx) {
 
   args.remove_prefix(2);
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpSet(t->GetOpArgs(shard), key, args, false);
+    OpResult<uint32_t> res = OpSet(t->GetOpArgs(shard), key, args, false);
+    if (res)
+      t->PersistFields(shard, key, args, {});
+    return res;
   };
 
   OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -892,7 +1173,38 @@ void HSetFamily::HSetNx(CmdArgList args, ConnectionContext* cntx) {
 
   args.remove_prefix(2);
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpSet(t->GetOpArgs(shard), key, args, true);
+    OpResult<uint32_t> res = OpSet(t->GetOpArgs(shard), key, args, true);
+    if (res)
+      t->PersistFields(shard, key, *res ? args : CmdArgList{}, {});
+    return res;
+  };
+
+  OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result) {
+    (*cntx)->SendLong(*result);
+  } else {
+    (*cntx)->SendError(result.status());
+  }
+}
+
+// Syntax: hsetex key ttl_sec field value [field value...]
+void HSetFamily::HSetEx(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view ttl_str = ArgS(args, 2);
+  uint32_t ttl_sec;
+  constexpr uint32_t kMaxTtl = (1UL << 26);
+
+  if (!absl::SimpleAtoi(ttl_str, &ttl_sec) || ttl_sec == 0 || ttl_sec > kMaxTtl) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  if (args.size() % 2 == 0) {
+    return (*cntx)->SendError(facade::WrongNumArgsError("hsetex"), kSyntaxErrType);
+  }
+
+  args.remove_prefix(3);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpSet(t->GetOpArgs(shard), key, args, false, ttl_sec);
   };
 
   OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -932,12 +1244,10 @@ void HSetFamily::HRandField(CmdArgList args, ConnectionContext* cntx) {
     const PrimeValue& pv = it_res.value()->second;
     StringVec str_vec;
 
-    if (pv.Encoding() == OBJ_ENCODING_HT) {
-      dict* this_dict = (dict*)pv.RObjPtr();
-      dictEntry* de = dictGetFairRandomKey(this_dict);
-      sds key = (sds)de->key;
-      str_vec.emplace_back(key, sdslen(key));
-    } else if (pv.Encoding() == OBJ_ENCODING_LISTPACK) {
+    if (pv.Encoding() == kEncodingStrMap2) {
+      sds entry = RandomEntry(*GetStringMap(pv, t->db_context()));
+      str_vec.emplace_back(entry, sdslen(entry));
+    } else if (pv.Encoding() == kEncodingListPack) {
       uint8_t* lp = (uint8_t*)pv.RObjPtr();
       size_t lplen = lpLength(lp);
       CHECK(lplen > 0 && lplen % 2 == 0);
@@ -988,6 +1298,7 @@ void HSetFamily::Register(CommandRegistry* registry) {
             << CI{"HRANDFIELD", CO::READONLY, 2, 1, 1, 1}.HFUNC(HRandField)
             << CI{"HSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(HScan)
             << CI{"HSET", CO::WRITE | CO::FAST | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(HSet)
+            << CI{"HSETEX", CO::WRITE | CO::FAST | CO::DENYOOM, -5, 1, 1, 1}.HFUNC(HSetEx)
             << CI{"HSETNX", CO::WRITE | CO::DENYOOM | CO::FAST, 4, 1, 1, 1}.HFUNC(HSetNx)
             << CI{"HSTRLEN", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(HStrLen)
             << CI{"HVALS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HVals);
@@ -997,4 +1308,27 @@ uint32_t HSetFamily::MaxListPackLen() {
   return kMaxListPackLen;
 }
 
+StringMap* HSetFamily::ConvertToStrMap(uint8_t* lp) {
+  StringMap* sm = new StringMap(CompactObj::memory_resource());
+  size_t lplen = lpLength(lp);
+  if (lplen == 0)
+    return sm;
+
+  uint8_t* lp_elem = lpFirst(lp);
+  uint8_t intbuf[2][LP_INTBUF_SIZE];
+
+  DCHECK(lp_elem);  // empty containers are not allowed.
+
+  do {
+    string_view key = LpGetView(lp_elem, intbuf[0]);
+    lp_elem = lpNext(lp, lp_elem);  // switch to value
+    DCHECK(lp_elem);
+    string_view value = LpGetView(lp_elem, intbuf[1]);
+    lp_elem = lpNext(lp, lp_elem);  // switch to next key
+    CHECK(sm->AddOrUpdate(key, value));  // must be unique
+  } while (lp_elem);
+
+  return sm;
+}
+
 }  // namespace dfly
@@ -13,6 +13,7 @@ namespace dfly {
 
 class ConnectionContext;
 class CommandRegistry;
+class StringMap;
 using facade::OpResult;
 using facade::OpStatus;
 
@@ -21,6 +22,23 @@ class HSetFamily {
   static void Register(CommandRegistry* registry);
   static uint32_t MaxListPackLen();
 
+  // Does not free lp.
+  static StringMap* ConvertToStrMap(uint8_t* lp);
+
+  // Sets the fields of the hash at key, interleaved with their values, like HSET does.
+  // Returns the number of the fields that were added. Used by the squashed pipelines.
+  static OpResult<uint32_t> OpHSet(const OpArgs& op_args, std::string_view key,
+                                   CmdArgList values);
+
+  // Returns the value of field of the hash at key. Used by SORT BY and GET patterns.
+  static OpResult<std::string> OpHGet(const OpArgs& op_args, std::string_view key,
+                                      std::string_view field);
+
+  // Sets the fields of the hash at key, interleaved with their values, and removes the fields
+  // removed_fields. Replays RDB_OPCODE_HASH_FIELDS.
+  static OpStatus OpApplyFields(const OpArgs& op_args, std::string_view key,
+                                CmdArgList set_fields, CmdArgList removed_fields);
+
  private:
 
   static void HDel(CmdArgList args, ConnectionContext* cntx);
@@ -35,6 +53,7 @@ class HSetFamily {
   static void HIncrByFloat(CmdArgList args, ConnectionContext* cntx);
   static void HScan(CmdArgList args, ConnectionContext* cntx);
   static void HSet(CmdArgList args, ConnectionContext* cntx);
+  static void HSetEx(CmdArgList args, ConnectionContext* cntx);
   static void HSetNx(CmdArgList args, ConnectionContext* cntx);
   static void HStrLen(CmdArgList args, ConnectionContext* cntx);
   static void HRandField(CmdArgList args, ConnectionContext* cntx);
@@ -13,6 +13,7 @@ extern "C" {
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
+#include "server/engine_shard_set.h"
 #include "server/test_utils.h"
 
 using namespace testing;
@@ -118,6 +119,26 @@ TEST_F(HSetFamilyTest, HIncr) {
   EXPECT_THAT(resp, ErrArg("hash value is not an integer"));
 }
 
+TEST_F(HSetFamilyTest, HIncrListpack) {
+  // The counters are updated in place while their encoded size stays the same, and moved
+  // when it changes, without touching their neighbours.
+  Run({"hset", "key", "", "x", "b", "middle", "c", "tail"});
+  for (unsigned i = 0; i < 300; ++i)
+    ASSERT_EQ(i + 1, CheckedInt({"hincrby", "key", "a", "1"}));
+  EXPECT_EQ(-100, CheckedInt({"hincrby", "key", "a", "-400"}));
+  EXPECT_EQ(1000000000000, CheckedInt({"hincrby", "key", "a", "1000000000100"}));
+  EXPECT_THAT(Run({"hincrbyfloat", "key", "b", "0"}), ErrArg("hash value is not a float"));
+  EXPECT_EQ(Run({"hincrbyfloat", "key", "f", "1.5"}), "1.5");
+  EXPECT_EQ(Run({"hincrbyfloat", "key", "f", "1"}), "2.5");
+  EXPECT_THAT(Run({"hset", "key", "b", "MIDDLE"}), IntArg(0));
+
+  auto resp = Run({"hgetall", "key"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("", "x", "b", "MIDDLE", "c", "tail", "a",
+                                         "1000000000000", "f", "2.5"));
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().db[0].listpack_conversions);
+}
+
 TEST_F(HSetFamilyTest, HScan) {
   for (int i = 0; i < 10; i++) {
     Run({"HSET", "myhash", absl::StrCat("Field-", i), absl::StrCat("Value-", i)});
@@ -163,4 +184,127 @@ TEST_F(HSetFamilyTest, HScanLpMatchBug) {
   EXPECT_THAT(resp, ArrLen(2));
 }
 
+TEST_F(HSetFamilyTest, StringMap) {
+  // Large enough to convert the hash from listpack.
+  for (int i = 0; i < 200; i++) {
+    Run({"HSET", "hmap", absl::StrCat("field", i), absl::StrCat("value", i)});
+  }
+  EXPECT_EQ(200, CheckedInt({"hlen", "hmap"}));
+  EXPECT_EQ("value5", Run({"hget", "hmap", "field5"}));
+  EXPECT_THAT(Run({"hget", "hmap", "nofield"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(1, CheckedInt({"hexists", "hmap", "field199"}));
+  EXPECT_EQ(7, CheckedInt({"hstrlen", "hmap", "field10"}));
+
+  EXPECT_EQ(0, CheckedInt({"hset", "hmap", "field1", "updated"}));
+  EXPECT_EQ(0, CheckedInt({"hsetnx", "hmap", "field1", "skipped"}));
+  EXPECT_EQ("updated", Run({"hget", "hmap", "field1"}));
+
+  EXPECT_EQ(10, CheckedInt({"hincrby", "hmap", "counter", "10"}));
+  EXPECT_EQ(15, CheckedInt({"hincrby", "hmap", "counter", "5"}));
+
+  auto resp = Run({"hmget", "hmap", "field2", "nofield"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("value2", ArgType(RespExpr::NIL)));
+
+  resp = Run({"hgetall", "hmap"});
+  ASSERT_THAT(resp, ArrLen(402));
+
+  resp = Run({"hrandfield", "hmap"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), AnyOf(StartsWith("field"), StrEq("counter")));
+
+  EXPECT_EQ(2, CheckedInt({"hdel", "hmap", "field0", "counter", "nofield"}));
+  EXPECT_EQ(199, CheckedInt({"hlen", "hmap"}));
+  for (int i = 1; i < 200; i++) {
+    Run({"hdel", "hmap", absl::StrCat("field", i)});
+  }
+  EXPECT_EQ(0, CheckedInt({"exists", "hmap"}));
+}
+
+TEST_F(HSetFamilyTest, NewHashRepeatedFields) {
+  // New hashes are built in one pass unless their fields repeat.
+  EXPECT_EQ(1, CheckedInt({"hset", "x", "a", "1", "a", "2"}));
+  EXPECT_EQ(Run({"hget", "x", "a"}), "2");
+
+  vector<string> args{"hset", "y"};
+  for (int i = 0; i < 20; i++) {
+    args.push_back(absl::StrCat("f", i % 10));
+    args.push_back(absl::StrCat(i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  EXPECT_THAT(Run(ArgSlice{sv_args.data(), sv_args.size()}), IntArg(10));
+  EXPECT_EQ(10, CheckedInt({"hlen", "y"}));
+  EXPECT_EQ(Run({"hget", "y", "f3"}), "13");
+
+  EXPECT_EQ(3, CheckedInt({"hset", "z", "a", "", "b", "12345", "c", "-7"}));
+  EXPECT_THAT(Run({"hgetall", "z"}).GetVec(), ElementsAre("a", "", "b", "12345", "c", "-7"));
+}
+
+TEST_F(HSetFamilyTest, AdaptiveListpack) {
+  // Converted before the static limit of 1024 bytes since it is only written.
+  for (int i = 0; i < 40; i++) {
+    Run({"HSET", "hot", absl::StrCat("field", i), absl::StrCat("value", i)});
+  }
+  auto metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(1u, metrics.db[0].listpack_conversions);
+  EXPECT_EQ(1u, metrics.db[0].listpack_early_conversions);
+
+  // Stays a listpack beyond the static limit since it is mostly read.
+  for (int i = 0; i < 100; i++) {
+    Run({"HSET", "cold", absl::StrCat("field", i), absl::StrCat("value", i)});
+    for (int j = 0; j < 10; j++) {
+      Run({"HGET", "cold", "field0"});
+    }
+  }
+  metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(1u, metrics.db[0].listpack_conversions);
+  EXPECT_GT(metrics.db[0].listpack_bytes, 1024u);
+  EXPECT_EQ(100, CheckedInt({"hlen", "cold"}));
+}
+
+TEST_F(HSetFamilyTest, HSetEx) {
+  EXPECT_EQ(2, CheckedInt({"hsetex", "k", "10", "f1", "v1", "f2", "v2"}));
+  EXPECT_EQ(1, CheckedInt({"hset", "k", "f3", "v3"}));
+  EXPECT_EQ("v1", Run({"hget", "k", "f1"}));
+
+  // Setting the field again resets its ttl.
+  EXPECT_EQ(0, CheckedInt({"hsetex", "k", "20", "f2", "v2"}));
+
+  AdvanceTime(10000);
+  EXPECT_THAT(Run({"hget", "k", "f1"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ("v2", Run({"hget", "k", "f2"}));
+  EXPECT_THAT(Run({"hgetall", "k"}), ArrLen(4));
+
+  AdvanceTime(10000);
+  auto resp = Run({"hgetall", "k"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("f3", "v3"));
+  EXPECT_EQ(1, CheckedInt({"hlen", "k"}));
+
+  EXPECT_THAT(Run({"hsetex", "k", "0", "f", "v"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"hsetex", "k", "10", "f"}), ErrArg("wrong number"));
+}
+
+TEST_F(HSetFamilyTest, ActiveFieldExpiry) {
+  constexpr int kNumKeys = 100;
+  for (int i = 0; i < kNumKeys; ++i) {
+    Run({"hsetex", absl::StrCat("k", i), "1", "f", "v"});
+  }
+  Run({"hset", "k0", "persistent", "v"});
+  AdvanceTime(1000);
+
+  // Fields are expired in the background without accessing them.
+  atomic_size_t deleted = 0;
+  for (unsigned i = 0; i < 1000 && deleted < kNumKeys; ++i) {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      DbContext cntx{.db_index = 0, .time_now_ms = GetCurrentTimeMs()};
+      deleted += shard->db_slice().ExpireMembersStep(cntx);
+    });
+  }
+  EXPECT_EQ(kNumKeys, deleted.load());
+
+  // Hashes that became empty are deleted.
+  EXPECT_EQ(1, CheckedInt({"exists", "k0", "k1", "k2"}));
+  EXPECT_EQ(1, CheckedInt({"hlen", "k0"}));
+}
+
 }  // namespace dfly
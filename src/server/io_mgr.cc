@@ -5,14 +5,22 @@
 #include "server/io_mgr.h"
 
 #include <fcntl.h>
+#include <liburing.h>
+#include <linux/falloc.h>
 #include <mimalloc.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/facade_types.h"
+#include "facade/fault_injection.h"
 #include "util/uring/proactor.h"
 
 ABSL_FLAG(bool, backing_file_direct, false, "If true uses O_DIRECT to open backing files");
+ABSL_FLAG(uint32_t, backing_file_fixed_buffers, 256,
+          "Number of 4KB io buffers per thread that are registered with io_uring together with "
+          "the backing file. 0 - do not register");
 
 namespace dfly {
 
@@ -36,12 +44,22 @@ IoMgr::IoMgr() {
   flags_val = 0;
 }
 
+IoMgr::~IoMgr() {
+  if (buf_pool_) {
+    DCHECK_EQ(free_bufs_.size() * kIoBufSize, pool_size_) << "buffers are still in use";
+    mi_free(buf_pool_);
+  }
+}
+
 constexpr size_t kInitialSize = 1UL << 28;  // 256MB
 
-error_code IoMgr::Open(const string& path) {
+error_code IoMgr::Open(const string& path, bool keep_contents) {
   CHECK(!backing_file_);
 
-  int kFlags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
+  int kFlags = O_CREAT | O_RDWR | O_CLOEXEC;
+  if (!keep_contents) {
+    kFlags |= O_TRUNC;
+  }
   if (absl::GetFlag(FLAGS_backing_file_direct)) {
     kFlags |= O_DIRECT;
   }
@@ -50,7 +68,18 @@ error_code IoMgr::Open(const string& path) {
     return res.error();
   backing_file_ = move(res.value());
   Proactor* proactor = (Proactor*)ProactorBase::me();
-  {
+
+  // The file only grows in kInitialSize steps, see GrowAsync.
+  size_t file_size = 0;
+  if (keep_contents) {
+    struct stat st;
+    if (fstat(backing_file_->fd(), &st) < 0) {
+      return error_code{errno, system_category()};
+    }
+    file_size = st.st_size & ~(kInitialSize - 1);
+  }
+
+  if (file_size < kInitialSize) {
     uring::FiberCall fc(proactor);
     fc->PrepFallocate(backing_file_->fd(), 0, 0, kInitialSize);
     FiberCall::IoResult io_res = fc.Get();
@@ -66,10 +95,75 @@ error_code IoMgr::Open(const string& path) {
       return error_code{-io_res, system_category()};
     }
   }
-  sz_ = kInitialSize;
+  sz_ = std::max(file_size, kInitialSize);
+
+  unsigned num_bufs = absl::GetFlag(FLAGS_backing_file_fixed_buffers);
+  if (num_bufs > 0) {
+    pool_size_ = num_bufs * kIoBufSize;
+    buf_pool_ = (uint8_t*)mi_malloc_aligned(pool_size_, kIoBufSize);
+    for (unsigned i = num_bufs; i > 0; --i) {
+      free_bufs_.push_back(buf_pool_ + (i - 1) * kIoBufSize);
+    }
+
+    // The whole pool is registered as a single buffer, READ_FIXED/WRITE_FIXED accept any range
+    // inside it.
+    iovec v{.iov_base = buf_pool_, .iov_len = pool_size_};
+    int res = syscall(__NR_io_uring_register, proactor->ring_fd(), IORING_REGISTER_BUFFERS, &v, 1);
+    if (res < 0) {
+      LOG(WARNING) << "Could not register io buffers: " << util::detail::SafeErrorMessage(errno);
+    } else {
+      bufs_registered_ = true;
+    }
+
+    fixed_fd_ = proactor->RegisterFd(backing_file_->fd());
+  }
+
   return error_code{};
 }
 
+uint8_t* IoMgr::AllocBuffer(size_t len) {
+  if (len == kIoBufSize && !free_bufs_.empty()) {
+    uint8_t* res = free_bufs_.back();
+    free_bufs_.pop_back();
+    return res;
+  }
+
+  return (uint8_t*)mi_malloc_aligned(len, kIoBufSize);
+}
+
+void IoMgr::FreeBuffer(uint8_t* buf, size_t len) {
+  if (buf >= buf_pool_ && buf < buf_pool_ + pool_size_) {
+    DCHECK_EQ(len, kIoBufSize);
+    free_bufs_.push_back(buf);
+  } else {
+    mi_free(buf);
+  }
+}
+
+void IoMgr::PrepRw(uring::SubmitEntry* se, bool is_write, const uint8_t* buf, size_t len,
+                   size_t offset) {
+  io_uring_sqe* sqe = se->sqe();
+  int fd = fixed_fd_ >= 0 ? fixed_fd_ : backing_file_->fd();
+
+  if (IsFixedBuffer(buf, len)) {
+    if (is_write) {
+      io_uring_prep_write_fixed(sqe, fd, buf, len, offset, 0);
+    } else {
+      io_uring_prep_read_fixed(sqe, fd, const_cast<uint8_t*>(buf), len, offset, 0);
+    }
+  } else {
+    if (is_write) {
+      io_uring_prep_write(sqe, fd, buf, len, offset);
+    } else {
+      io_uring_prep_read(sqe, fd, const_cast<uint8_t*>(buf), len, offset);
+    }
+  }
+
+  // prep functions reset the flags.
+  if (fixed_fd_ >= 0)
+    sqe->flags |= IOSQE_FIXED_FILE;
+}
+
 error_code IoMgr::GrowAsync(size_t len, GrowCb cb) {
   DCHECK_EQ(0u, len % (1 << 20));
 
@@ -99,12 +193,57 @@ error_code IoMgr::WriteAsync(size_t offset, string_view blob, WriteCb cb) {
 
   Proactor* proactor = (Proactor*)ProactorBase::me();
 
-  auto ring_cb = [cb = move(cb)](Proactor::IoResult res, uint32_t flags, int64_t payload) {
-    cb(res);
+  auto ring_cb = [cb = move(cb)](Proactor::IoResult res, uint32_t flags,
+                                 int64_t payload) mutable {
+    facade::RunAfterFault(facade::FaultPoint::IO_COMPLETION, [cb = move(cb), res] { cb(res); });
   };
 
   uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
-  se.PrepWrite(backing_file_->fd(), blob.data(), blob.size(), offset);
+  PrepRw(&se, true, reinterpret_cast<const uint8_t*>(blob.data()), blob.size(), offset);
+
+  return error_code{};
+}
+
+error_code IoMgr::ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb) {
+  DCHECK(!dest.empty());
+  DCHECK(!absl::GetFlag(FLAGS_backing_file_direct) ||
+         (offset % 4096 == 0 && dest.size() % 4096 == 0 && intptr_t(dest.data()) % 4096 == 0));
+  VLOG(1) << "ReadAsync " << offset << "/" << dest.size();
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+
+  auto ring_cb = [this, cb = move(cb)](Proactor::IoResult res, uint32_t flags,
+                                       int64_t payload) mutable {
+    // Shutdown waits for the delayed completions as well.
+    facade::RunAfterFault(facade::FaultPoint::IO_COMPLETION, [this, cb = move(cb), res] {
+      --pending_io_;
+      cb(res);
+    });
+  };
+
+  uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
+  PrepRw(&se, false, dest.data(), dest.size(), offset);
+  ++pending_io_;
+
+  return error_code{};
+}
+
+error_code IoMgr::PunchHoleAsync(size_t offset, size_t len) {
+  DCHECK_GT(len, 0u);
+  VLOG(1) << "PunchHoleAsync " << offset << "/" << len;
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+
+  auto ring_cb = [this, offset](Proactor::IoResult res, uint32_t flags, int64_t payload) {
+    --pending_io_;
+    LOG_IF(ERROR, res < 0) << "Error punching a hole at " << offset << ": "
+                           << util::detail::SafeErrorMessage(-res);
+  };
+
+  uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
+  se.PrepFallocate(backing_file_->fd(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+  se.sqe()->flags |= IOSQE_IO_DRAIN;
+  ++pending_io_;
 
   return error_code{};
 }
@@ -135,10 +274,30 @@ error_code IoMgr::Read(size_t offset, io::MutableBytes dest) {
   return backing_file_->Read(&v, 1, offset, 0);
 }
 
+error_code IoMgr::Fsync() {
+  uring::FiberCall fc((Proactor*)ProactorBase::me());
+  io_uring_prep_fsync(fc->sqe(), backing_file_->fd(), IORING_FSYNC_DATASYNC);
+  FiberCall::IoResult io_res = fc.Get();
+  if (io_res < 0) {
+    return error_code{-io_res, system_category()};
+  }
+  return error_code{};
+}
+
 void IoMgr::Shutdown() {
-  while (flags_val) {
+  while (flags_val || pending_io_) {
     this_fiber::sleep_for(200us);  // TODO: hacky for now.
   }
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+  if (bufs_registered_) {
+    syscall(__NR_io_uring_register, proactor->ring_fd(), IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    bufs_registered_ = false;
+  }
+  if (fixed_fd_ >= 0) {
+    proactor->UnregisterFd(fixed_fd_);
+    fixed_fd_ = -1;
+  }
 }
 
 }  // namespace dfly
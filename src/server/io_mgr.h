@@ -6,7 +6,9 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 
+#include "util/uring/submit_entry.h"
 #include "util/uring/uring_file.h"
 
 namespace dfly {
@@ -20,12 +22,28 @@ class IoMgr {
   // (io_res, )
   using GrowCb = std::function<void(int)>;
 
+  // first arg - io result, i.e. the number of bytes read or a negative errno.
+  using ReadCb = std::function<void(int)>;
+
+  // Size of the buffers in the registered pool, see AllocBuffer.
+  static constexpr size_t kIoBufSize = 4096;
+
   IoMgr();
+  ~IoMgr();
 
   // blocks until all the pending requests are finished.
   void Shutdown();
 
-  std::error_code Open(const std::string& path);
+  // Opens the backing file and registers it, together with the buffer pool, with io_uring.
+  // If keep_contents is true, an existing file is not truncated and Span() covers it whole.
+  std::error_code Open(const std::string& path, bool keep_contents = false);
+
+  // Returns a 4k aligned buffer of len bytes. Buffers of kIoBufSize are taken from a pool that
+  // is registered with io_uring, so the requests that use them are submitted as READ_FIXED and
+  // WRITE_FIXED and the kernel does not pin their pages on every request.
+  // Falls back to the heap when the pool is exhausted.
+  uint8_t* AllocBuffer(size_t len);
+  void FreeBuffer(uint8_t* buf, size_t len);
 
   // Grows file by that length. len must be divided by 1MB.
   // passing other values will check-fail.
@@ -34,8 +52,22 @@ class IoMgr {
   // Returns error if submission failed. Otherwise - returns the io result
   // via cb. A caller must make sure that the blob exists until cb is called.
   std::error_code WriteAsync(size_t offset, std::string_view blob, WriteCb cb);
+
+  // Suspends only the io request - the calling fiber continues right away and the result is
+  // passed to cb. A caller must make sure that dest exists until cb is called.
+  // With backing_file_direct, offset, dest and its size must be 4k aligned.
+  std::error_code ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb);
+
   std::error_code Read(size_t offset, io::MutableBytes dest);
 
+  // Deallocates the file range, the file size stays the same. The request acts as a barrier -
+  // the requests that were submitted before it finish first and the following requests
+  // start after it finishes, so a write to a reused range is never lost.
+  std::error_code PunchHoleAsync(size_t offset, size_t len);
+
+  // Flushes the written data of the file to the device. Blocks the calling fiber.
+  std::error_code Fsync();
+
   // Total file span
   size_t Span() const {
     return sz_;
@@ -46,8 +78,22 @@ class IoMgr {
   }
 
  private:
+  bool IsFixedBuffer(const uint8_t* buf, size_t len) const {
+    return bufs_registered_ && buf >= buf_pool_ && buf + len <= buf_pool_ + pool_size_;
+  }
+
+  void PrepRw(util::uring::SubmitEntry* se, bool is_write, const uint8_t* buf, size_t len,
+              size_t offset);
+
   std::unique_ptr<util::uring::LinuxFile> backing_file_;
   size_t sz_ = 0;
+  uint32_t pending_io_ = 0;
+
+  uint8_t* buf_pool_ = nullptr;
+  size_t pool_size_ = 0;
+  std::vector<uint8_t*> free_bufs_;
+  bool bufs_registered_ = false;
+  int fixed_fd_ = -1;  // index of the backing file in the registered files table.
 
   union {
     uint8_t flags_val;
@@ -0,0 +1,49 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/executor.h"
+
+#include "base/logging.h"
+#include "server/command_registry.h"
+#include "server/main_service.h"
+#include "server/transaction.h"
+
+namespace dfly {
+namespace journal {
+
+using namespace std;
+
+JournalExecutor::JournalExecutor(Service* service)
+    : service_(service), conn_context_{&null_sink_, nullptr} {
+  conn_context_.is_replicating = true;
+}
+
+void JournalExecutor::Execute(DbIndex dbid, CmdArgList args) {
+  DCHECK(!args.empty());
+  conn_context_.conn_state.db_index = dbid;
+
+  ToUpper(&args[0]);
+  const CommandId* cid = service_->FindCmd(ArgS(args, 0));
+
+  // Scripts and the other commands without keys need the setup of the full dispatch.
+  if (cid == nullptr || (cid->first_key_pos() == 0 && !(cid->opt_mask() & CO::GLOBAL_TRANS))) {
+    service_->DispatchCommand(args, &conn_context_);
+    return;
+  }
+
+  boost::intrusive_ptr<Transaction> trans{new Transaction{cid}};
+  OpStatus st = trans->InitByArgs(dbid, args);
+  if (st != OpStatus::OK) {
+    LOG(ERROR) << "Could not apply replicated " << cid->name() << ": " << st;
+    return;
+  }
+
+  conn_context_.transaction = trans.get();
+  conn_context_.cid = cid;
+  cid->Invoke(args, &conn_context_);
+  conn_context_.transaction = nullptr;
+}
+
+}  // namespace journal
+}  // namespace dfly
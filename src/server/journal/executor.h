@@ -0,0 +1,34 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "io/io.h"
+#include "server/conn_context.h"
+
+namespace dfly {
+
+class Service;
+
+namespace journal {
+
+// Applies the commands of a replication stream on the replica.
+// The master already validated them, so unlike Service::DispatchCommand the executor skips the
+// checks and the bookkeeping of client commands, runs the transaction of the command right away
+// and discards its reply. Each replica flow owns an executor.
+class JournalExecutor {
+ public:
+  explicit JournalExecutor(Service* service);
+
+  // args holds the command name followed by its arguments.
+  void Execute(DbIndex dbid, CmdArgList args);
+
+ private:
+  Service* service_;
+  io::NullSink null_sink_;
+  ConnectionContext conn_context_;
+};
+
+}  // namespace journal
+}  // namespace dfly
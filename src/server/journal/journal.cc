@@ -29,23 +29,28 @@ thread_local JournalSlice journal_slice;
 Journal::Journal() {
 }
 
-error_code Journal::OpenInThread(bool persistent, string_view dir) {
+error_code Journal::OpenInThread(bool persistent, string_view dir, uint64_t generation) {
   journal_slice.Init(unsigned(ProactorBase::GetIndex()));
 
   error_code ec;
 
   if (persistent) {
-    ec = journal_slice.Open(dir);
+    ec = journal_slice.Open(dir, generation);
     if (ec) {
       return ec;
     }
   }
 
-      ServerState::tlocal()->set_journal(this);
-      EngineShard* shard = EngineShard::tlocal();
-      if (shard) {
-        shard->set_journal(this);
-      }
+  ServerState::tlocal()->set_journal(this);
+  EngineShard* shard = EngineShard::tlocal();
+  if (shard) {
+    lock_guard lk(state_mu_);
+    if (shard_slices_.size() <= shard->shard_id())
+      shard_slices_.resize(shard->shard_id() + 1);
+    shard_slices_[shard->shard_id()] = &journal_slice;
+
+    shard->set_journal(this);
+  }
 
   return ec;
 }
@@ -83,10 +88,26 @@ uint32_t Journal::RegisterOnChange(ChangeCallback cb) {
   return journal_slice.RegisterOnChange(cb);
 }
 
+uint32_t Journal::RegisterOnStream(StreamCallback cb) {
+  return journal_slice.RegisterOnStream(std::move(cb));
+}
+
 void Journal::Unregister(uint32_t id) {
   journal_slice.Unregister(id);
 }
 
+optional<string> Journal::ReadBacklog(LSN lsn) const {
+  return journal_slice.ReadBacklog(lsn);
+}
+
+LSN Journal::GetStreamedLsn() const {
+  return journal_slice.streamed_lsn();
+}
+
+void Journal::DropBacklog() {
+  journal_slice.DropBacklog();
+}
+
 bool Journal::SchedStartTx(TxId txid, unsigned num_keys, unsigned num_shards) {
   if (!journal_slice.IsOpen() || lameduck_.load(memory_order_relaxed))
     return false;
@@ -115,6 +136,19 @@ void Journal::RecordEntry(const Entry& entry) {
   journal_slice.AddLogRecord(entry);
 }
 
+LSN Journal::PersistEntry(const Entry& entry) {
+  return journal_slice.PersistEntry(entry);
+}
+
+error_code Journal::RotateInThread(uint64_t generation) {
+  return journal_slice.Rotate(generation);
+}
+
+void Journal::AwaitDurable(ShardId sid, LSN lsn) {
+  DCHECK_LT(sid, shard_slices_.size());
+  shard_slices_[sid]->AwaitDurable(lsn);
+}
+
 /*
 void Journal::OpArgs(TxId txid, Op opcode, Span keys) {
   DCHECK(journal_slice.IsOpen());
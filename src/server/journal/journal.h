@@ -13,6 +13,14 @@ class Transaction;
 
 namespace journal {
 
+class JournalSlice;
+
+// Name of the file that holds the persistent journal of a shard for a generation. Every snapshot
+// starts a new generation, see ServerFamily::DoSave.
+std::string FileName(unsigned shard, uint64_t generation);
+
+// Parses a name produced by FileName. Returns false for other names.
+bool ParseFileName(std::string_view name, unsigned* shard, uint64_t* generation);
 
 class Journal {
  public:
@@ -28,14 +36,29 @@ class Journal {
   std::error_code Close();
 
   // Opens journal inside a Dragonfly thread. Must be called in each thread.
-  std::error_code OpenInThread(bool persistent, std::string_view dir);
+  // If persistent, the shards journal their changes into the files of generation in dir.
+  std::error_code OpenInThread(bool persistent, std::string_view dir, uint64_t generation = 0);
 
   //******* The following functions must be called in the context of the owning shard *********//
 
 
   uint32_t RegisterOnChange(ChangeCallback cb);
+
+  // Registers a callback for the encoded COMMAND entries, see JournalSlice.
+  uint32_t RegisterOnStream(StreamCallback cb);
   void Unregister(uint32_t id);
 
+  // Returns the encoded entries of the shard with LSNs above lsn, or nullopt if the backlog
+  // does not have all of them anymore.
+  std::optional<std::string> ReadBacklog(LSN lsn) const;
+
+  // Returns the LSN of the last entry the shard passed to its stream callbacks.
+  LSN GetStreamedLsn() const;
+
+  // Drops the backlog of the shard and skips an LSN, so that no stream resumes across a change
+  // of the dataset that was not journaled, like the full sync of a replica from its master.
+  void DropBacklog();
+
   // Returns true if transaction was scheduled, false if journal is inactive
   // or in lameduck mode and does not log new transactions.
   bool SchedStartTx(TxId txid, unsigned num_keys, unsigned num_shards);
@@ -57,10 +80,26 @@ class Journal {
 
   void RecordEntry(const Entry& entry);
 
+  // Appends the entry to the journal file of the shard, if the journal is persistent.
+  // Unlike RecordEntry, does not notify the change callbacks.
+  // Returns the LSN to pass to AwaitDurable, or 0 if replies do not wait for the disk.
+  LSN PersistEntry(const Entry& entry);
+
+  // Moves the persistent journal of the shard to the files of generation.
+  std::error_code RotateInThread(uint64_t generation);
+
+  //********************************************************************************************//
+
+  // Blocks until the entries of shard sid up to lsn are on disk, see journal_fsync.
+  void AwaitDurable(ShardId sid, LSN lsn);
+
  private:
 
   mutable boost::fibers::mutex state_mu_;
 
+  // Slices of the shard threads, indexed by shard id.
+  std::vector<JournalSlice*> shard_slices_;
+
   std::atomic_bool lameduck_{false};
 };
 
@@ -4,14 +4,36 @@
 
 #include "server/journal/journal_slice.h"
 
+#include <absl/base/internal/endian.h>
 #include <absl/container/inlined_vector.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/strip.h>
 #include <fcntl.h>
+#include <liburing.h>
 
 #include <filesystem>
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/journal/journal.h"
+#include "server/journal/serializer.h"
+#include "server/rdb_extensions.h"
+#include "server/rdb_save.h"
+#include "server/tiered_storage.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/uring/proactor.h"
+
+ABSL_FLAG(std::string, journal_fsync, "everysec",
+          "When the persistent journal calls fdatasync: always - before replying to the writes, "
+          "everysec - at most once a second, losing up to a second of writes on power loss, "
+          "no - leaves it to the OS");
+ABSL_FLAG(uint64_t, repl_backlog_bytes, 1ULL << 24,
+          "How many bytes of the latest journal entries every shard keeps in memory, so that "
+          "replicas can resume from them after a disconnect instead of doing a full sync");
 
 namespace dfly {
 namespace journal {
@@ -22,12 +44,25 @@ namespace fs = std::filesystem;
 
 namespace {
 
-string ShardName(std::string_view base, unsigned index) {
-  return absl::StrCat(base, "-", absl::Dec(index, absl::kZeroPad4), ".log");
-}
+constexpr string_view kFilePrefix = "journal-";
+constexpr string_view kFileSuffix = ".log";
 
 }  // namespace
 
+string FileName(unsigned shard, uint64_t generation) {
+  return absl::StrCat(kFilePrefix, absl::Dec(shard, absl::kZeroPad4), "-", generation,
+                      kFileSuffix);
+}
+
+bool ParseFileName(string_view name, unsigned* shard, uint64_t* generation) {
+  if (!absl::ConsumePrefix(&name, kFilePrefix) || !absl::ConsumeSuffix(&name, kFileSuffix))
+    return false;
+
+  size_t pos = name.find('-');
+  return pos == 4 && absl::SimpleAtoi(name.substr(0, pos), shard) &&
+         absl::SimpleAtoi(name.substr(pos + 1), generation);
+}
+
 #define CHECK_EC(x)                                                                 \
   do {                                                                              \
     auto __ec$ = (x);                                                               \
@@ -36,66 +71,119 @@ string ShardName(std::string_view base, unsigned index) {
 
 struct JournalSlice::RingItem {
   LSN lsn;
-  TxId txid;
-  Op opcode;
+  std::string data;
 };
 
 JournalSlice::JournalSlice() {
 }
 
 JournalSlice::~JournalSlice() {
-  CHECK(!shard_file_);
+  CHECK(files_.empty());
 }
 
 void JournalSlice::Init(unsigned index) {
-  if (ring_buffer_)  // calling this function multiple times is allowed and it's a no-op.
+  // calling this function multiple times is allowed and it's a no-op.
+  if (slice_index_ != UINT32_MAX)
     return;
 
   slice_index_ = index;
-  ring_buffer_.emplace(128);  // TODO: to make it configurable
+  max_ring_bytes_ = absl::GetFlag(FLAGS_repl_backlog_bytes);
 }
 
-std::error_code JournalSlice::Open(std::string_view dir) {
-  CHECK(!shard_file_);
+std::error_code JournalSlice::Open(std::string_view dir, uint64_t generation) {
+  CHECK(!is_open_);
   DCHECK_NE(slice_index_, UINT32_MAX);
 
-  fs::path dir_path;
+  // Only the shards change data.
+  if (!EngineShard::tlocal()) {
+    is_open_ = true;
+    return error_code{};
+  }
 
-  if (dir.empty()) {
-  } else {
-    dir_path = dir;
+  // fdatasync is issued through the ring, see Sync().
+  if (ProactorBase::me()->GetKind() != ProactorBase::IOURING) {
+    return make_error_code(errc::operation_not_supported);
+  }
+
+  if (!dir.empty()) {
     error_code ec;
 
-    fs::file_status dir_status = fs::status(dir_path, ec);
+    fs::file_status dir_status = fs::status(dir, ec);
     if (ec) {
       if (ec == errc::no_such_file_or_directory) {
-        fs::create_directory(dir_path, ec);
-        dir_status = fs::status(dir_path, ec);
+        fs::create_directory(dir, ec);
+        dir_status = fs::status(dir, ec);
       }
       if (ec)
         return ec;
     }
-    // LOG(INFO) << int(dir_status.type());
   }
+  dir_ = dir;
 
-  dir_path.append(ShardName("journal", slice_index_));
-  shard_path_ = dir_path;
+  string policy = absl::GetFlag(FLAGS_journal_fsync);
+  if (policy == "always") {
+    fsync_policy_ = FSYNC_ALWAYS;
+  } else if (policy == "no") {
+    fsync_policy_ = FSYNC_NO;
+  } else {
+    LOG_IF(WARNING, policy != "everysec") << "Unknown journal_fsync " << policy;
+    fsync_policy_ = FSYNC_EVERYSEC;
+  }
+
+  serializer_.reset(new RdbSerializer(&sink_));
+  serializer_->set_native_encoding(true);
+
+  if (error_code ec = OpenFile(generation); ec) {
+    serializer_.reset();
+    return ec;
+  }
+
+  status_ec_.clear();
+  failed_.store(false, memory_order_relaxed);
+  closing_ = false;
+  last_sync_ = chrono::steady_clock::now();
+  is_open_ = true;
+
+  flush_fb_ = fibers::fiber([this] { FlushFiber(); });
+
+  return error_code{};
+}
+
+error_code JournalSlice::OpenFile(uint64_t generation) {
+  fs::path path = dir_;
+  path.append(FileName(slice_index_, generation));
 
   // For file integrity guidelines see:
   // https://lwn.net/Articles/457667/
   // https://www.evanjones.ca/durability-filesystem.html
-  // NOTE: O_DSYNC is omitted.
+  // NOTE: O_DSYNC is omitted, the flush fiber calls fdatasync once per batch.
   constexpr auto kJournalFlags = O_CLOEXEC | O_CREAT | O_TRUNC | O_RDWR;
   io::Result<std::unique_ptr<uring::LinuxFile>> res =
-      uring::OpenLinux(shard_path_, kJournalFlags, 0666);
+      uring::OpenLinux(path.generic_string(), kJournalFlags, 0666);
   if (!res) {
     return res.error();
   }
-  DVLOG(1) << "Opened journal " << shard_path_;
+  DVLOG(1) << "Opened journal " << path;
 
-  shard_file_ = std::move(res).value();
-  file_offset_ = 0;
-  status_ec_.clear();
+  if (!files_.empty()) {
+    File& prev = files_.back();
+    prev.data = std::move(sink_.val);
+    prev.last_lsn = lsn_ - 1;
+    sink_.val.clear();
+  }
+
+  File& file = files_.emplace_back();
+  file.file = std::move(res).value();
+  file.path = path.generic_string();
+
+  char magic[16];
+  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_NATIVE_VERSION);
+  CHECK_EQ(9u, sz);
+  CHECK_EC(serializer_->WriteRaw(io::Bytes{reinterpret_cast<uint8_t*>(magic), sz}));
+  CHECK_EC(serializer_->FlushMem());  // we write to StringFile.
+
+  // Every file starts in db 0, as the RDB format says.
+  cur_db_ = 0;
 
   return error_code{};
 }
@@ -103,42 +191,255 @@ std::error_code JournalSlice::Open(std::string_view dir) {
 error_code JournalSlice::Close() {
   VLOG(1) << "JournalSlice::Close";
 
-  CHECK(shard_file_);
+  CHECK(is_open_);
   lameduck_ = true;
+  is_open_ = false;
+
+  // The changes made until the journal is reopened are not logged at all. Skipping an LSN keeps
+  // the backlog, and the snapshots saved meanwhile, from resuming across them.
+  DropBacklog();
+
+  if (files_.empty())
+    return error_code{};
+
+  closing_ = true;
+  flush_ec_.notify();
+  flush_fb_.join();
+
+  // The flush fiber stops at the first error, or once everything is written out.
+  error_code ec = status_ec_;
+  for (File& file : files_) {
+    DVLOG(1) << "Closing " << file.path;
+    auto close_ec = file.file->Close();
+    LOG_IF(ERROR, close_ec) << "Error closing journal file " << close_ec;
+    if (!ec)
+      ec = close_ec;
+  }
+  files_.clear();
+  sink_.val.clear();
+  serializer_.reset();
+
+  return ec;
+}
 
-  auto ec = shard_file_->Close();
+error_code JournalSlice::Rotate(uint64_t generation) {
+  if (files_.empty())  // Not a shard thread or not persistent.
+    return error_code{};
 
-  DVLOG(1) << "Closing " << shard_path_;
-  LOG_IF(ERROR, ec) << "Error closing journal file " << ec;
-  shard_file_.reset();
+  if (status_ec_)
+    return status_ec_;
 
-  return ec;
+  RETURN_ON_ERR(OpenFile(generation));
+  flush_ec_.notify();
+  return error_code{};
 }
 
 void JournalSlice::AddLogRecord(const Entry& entry) {
-  DCHECK(ring_buffer_);
+  DCHECK_NE(slice_index_, UINT32_MAX);
+  LSN lsn = lsn_++;
 
   iterating_cb_arr_ = true;
   for (const auto& k_v : change_cb_arr_) {
     k_v.second(entry);
   }
+
+  // Empty commands of a single shard only carry its keys for the change callbacks.
+  if (entry.opcode == Op::COMMAND && (!entry.payload.first.empty() || entry.shard_cnt > 1)) {
+    RingItem item;
+    item.lsn = lsn;
+    JournalWriter::Encode(entry, lsn, &item.data);
+    VLOG(1) << "Writing item " << item.lsn;
+
+    ring_bytes_ += item.data.size();
+    ring_buffer_.push_back(move(item));
+    while (ring_bytes_ > max_ring_bytes_ && ring_buffer_.size() > 1) {
+      evicted_lsn_ = ring_buffer_.front().lsn;
+      ring_bytes_ -= ring_buffer_.front().data.size();
+      ring_buffer_.pop_front();
+    }
+
+    // The callbacks may preempt, and the item may be evicted meanwhile.
+    if (!stream_cb_arr_.empty()) {
+      string data = ring_buffer_.back().data;
+      for (const auto& k_v : stream_cb_arr_) {
+        k_v.second(data);
+      }
+    }
+  }
   iterating_cb_arr_ = false;
+}
+
+LSN JournalSlice::PersistEntry(const Entry& entry) {
+  if (files_.empty() || status_ec_)
+    return 0;
 
-  RingItem item;
-  item.lsn = lsn_;
-  item.opcode = entry.opcode;
-  item.txid = entry.txid;
-  VLOG(1) << "Writing item " << item.lsn;
-  ring_buffer_->EmplaceOrOverride(move(item));
+  // Offloaded values are loaded before anything is serialized, because loading preempts and
+  // other transactions of the shard may persist their entries meanwhile.
+  const PrimeValue* pv = entry.pval_ptr;
+  PrimeValue loaded;
+  if (entry.opcode == Op::VAL && pv->IsExternal()) {
+    error_code ec = EngineShard::tlocal()->tiered_storage()->LoadExternal(*pv, &loaded);
+    if (ec) {
+      LOG(ERROR) << "Could not journal " << entry.key << ", error " << ec.message();
+      status_ec_ = ec;
+      return 0;
+    }
+    pv = &loaded;
+  }
 
-  if (shard_file_) {
-    string line = absl::StrCat(lsn_, " ", entry.txid, " ", entry.opcode, "\n");
-    error_code ec = shard_file_->Write(io::Buffer(line), file_offset_, 0);
-    CHECK_EC(ec);
-    file_offset_ += line.size();
+  if (entry.opcode != Op::FLUSH && entry.db_ind != cur_db_) {
+    CHECK_EC(serializer_->SelectDb(entry.db_ind));
+    cur_db_ = entry.db_ind;
+  }
+
+  // We write to StringFile, so the serializer does not fail.
+  switch (entry.opcode) {
+    case Op::VAL: {
+      PrimeKey pkey{entry.key};
+      CHECK(serializer_->SaveEntry(pkey, *pv, entry.expire_ms));
+      break;
+    }
+    case Op::DEL:
+      CHECK_EC(serializer_->SaveDeletedKey(entry.key));
+      break;
+    case Op::FIELDS:
+      CHECK_EC(serializer_->SaveHashFields(entry.key, entry.fields_set, entry.fields_removed));
+      break;
+    case Op::FLUSH:
+      CHECK_EC(serializer_->WriteOpcode(RDB_OPCODE_JOURNAL_FLUSH));
+      CHECK_EC(serializer_->SaveLen(entry.db_ind));
+      CHECK_EC(serializer_->SaveLen(slice_index_));
+      break;
+    default:
+      LOG(DFATAL) << "Unexpected journal entry " << unsigned(entry.opcode);
+      return 0;
   }
+  CHECK_EC(serializer_->FlushMem());
 
-  ++lsn_;
+  LSN lsn = lsn_++;
+  flush_ec_.notify();
+
+  return fsync_policy_ == FSYNC_ALWAYS ? lsn : 0;
+}
+
+void JournalSlice::AwaitDurable(LSN lsn) {
+  durable_ec_.await([&] {
+    return durable_lsn_.load(memory_order_acquire) >= lsn || failed_.load(memory_order_acquire);
+  });
+}
+
+void JournalSlice::FlushFiber() {
+  auto has_work = [this] { return files_.size() > 1 || !sink_.val.empty() || closing_; };
+
+  while (true) {
+    if (!has_work()) {
+      if (unsynced_ && fsync_policy_ == FSYNC_EVERYSEC) {
+        // everysec: sync once a second has passed since the last time, unless new entries come.
+        flush_ec_.await_until(has_work, last_sync_ + chrono::seconds(1));
+      } else {
+        flush_ec_.await(has_work);
+      }
+    }
+
+    error_code ec = WriteBatch();
+
+    bool done = closing_ && files_.size() == 1 && sink_.val.empty();
+    if (!ec && unsynced_ &&
+        (fsync_policy_ == FSYNC_ALWAYS || done ||
+         (fsync_policy_ == FSYNC_EVERYSEC &&
+          chrono::steady_clock::now() - last_sync_ >= chrono::seconds(1)))) {
+      ec = Sync();
+    }
+
+    if (ec) {
+      LOG(ERROR) << "Error writing journal " << files_.front().path << ": " << ec.message();
+      status_ec_ = ec;
+      failed_.store(true, memory_order_release);
+      durable_ec_.notifyAll();
+      return;
+    }
+
+    if (done)
+      return;
+  }
+}
+
+error_code JournalSlice::WriteBatch() {
+  File& file = files_.front();
+  bool rotated = files_.size() > 1;
+
+  string batch;
+  LSN last_lsn;
+  if (rotated) {
+    batch.swap(file.data);
+    last_lsn = file.last_lsn;
+  } else {
+    batch.swap(sink_.val);
+    last_lsn = lsn_ - 1;
+  }
+
+  if (!batch.empty()) {
+    uint8_t marker[9];
+    marker[0] = RDB_OPCODE_JOURNAL_COMMIT;
+    absl::little_endian::Store64(marker + 1, last_lsn);
+    batch.append(reinterpret_cast<char*>(marker), sizeof(marker));
+
+    // Preempts, the entries of the next batch accumulate in the meantime.
+    RETURN_ON_ERR(file.file->Write(io::Buffer(batch), file.offset, 0));
+    file.offset += batch.size();
+    written_lsn_ = last_lsn;
+    unsynced_ = true;
+  }
+
+  if (rotated) {
+    // The file is needed until the snapshot that replaces it is saved, so it is synced
+    // regardless of the policy.
+    if (unsynced_)
+      RETURN_ON_ERR(Sync());
+
+    DVLOG(1) << "Closing " << file.path;
+    RETURN_ON_ERR(file.file->Close());
+    files_.pop_front();
+  }
+
+  return error_code{};
+}
+
+error_code JournalSlice::Sync() {
+  File& file = files_.front();
+
+  uring::FiberCall fc((uring::Proactor*)ProactorBase::me());
+  io_uring_prep_fsync(fc->sqe(), file.file->fd(), IORING_FSYNC_DATASYNC);
+  uring::FiberCall::IoResult io_res = fc.Get();
+  if (io_res < 0) {
+    return error_code{-io_res, system_category()};
+  }
+
+  last_sync_ = chrono::steady_clock::now();
+  unsynced_ = false;
+  durable_lsn_.store(written_lsn_, memory_order_release);
+  durable_ec_.notifyAll();
+
+  return error_code{};
+}
+
+void JournalSlice::DropBacklog() {
+  evicted_lsn_ = lsn_++;
+  ring_buffer_.clear();
+  ring_bytes_ = 0;
+}
+
+optional<string> JournalSlice::ReadBacklog(LSN lsn) const {
+  if (lsn < evicted_lsn_ || lsn >= lsn_)
+    return nullopt;
+
+  auto it = lower_bound(ring_buffer_.begin(), ring_buffer_.end(), lsn + 1,
+                        [](const RingItem& item, LSN val) { return item.lsn < val; });
+  string res;
+  for (; it != ring_buffer_.end(); ++it) {
+    res.append(it->data);
+  }
+  return res;
 }
 
 uint32_t JournalSlice::RegisterOnChange(ChangeCallback cb) {
@@ -147,11 +448,23 @@ uint32_t JournalSlice::RegisterOnChange(ChangeCallback cb) {
   return id;
 }
 
+uint32_t JournalSlice::RegisterOnStream(StreamCallback cb) {
+  uint32_t id = next_cb_id_++;
+  stream_cb_arr_.emplace_back(id, std::move(cb));
+  return id;
+}
+
 void JournalSlice::Unregister(uint32_t id) {
   CHECK(!iterating_cb_arr_);
 
-  auto it = find_if(change_cb_arr_.begin(), change_cb_arr_.end(),
-                    [id](const auto& e) { return e.first == id; });
+  auto pred = [id](const auto& e) { return e.first == id; };
+  if (auto it = find_if(stream_cb_arr_.begin(), stream_cb_arr_.end(), pred);
+      it != stream_cb_arr_.end()) {
+    stream_cb_arr_.erase(it);
+    return;
+  }
+
+  auto it = find_if(change_cb_arr_.begin(), change_cb_arr_.end(), pred);
   CHECK(it != change_cb_arr_.end());
   change_cb_arr_.erase(it);
 }
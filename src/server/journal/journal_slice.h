@@ -6,18 +6,34 @@
 
 #include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
+#include <deque>
 #include <optional>
 #include <string_view>
 
-#include "base/ring_buffer.h"
+#include "io/file.h"
 #include "server/common.h"
 #include "server/journal/types.h"
+#include "util/fibers/event_count.h"
 #include "util/uring/uring_file.h"
 
 namespace dfly {
+
+class RdbSerializer;
+
 namespace journal {
 
 // Journal slice is present for both shards and io threads.
+//
+// When opened in a shard thread, it also persists the changes of the shard into an append-only
+// file. The entries are serialized as RDB records that hold the keys with their values after
+// the change, so replaying a journal on top of an older state of the shard is idempotent.
+// A flush fiber writes everything accumulated since its previous write with a single io_uring
+// write, followed by at most one fdatasync according to journal_fsync, so concurrent
+// transactions share the cost of the disk round trip.
+//
+// Independently of the file, the slice keeps the latest COMMAND entries in the encoding of
+// JournalWriter, up to repl_backlog_bytes, so a replica that lost its connection can resume
+// from its last LSN instead of doing a full sync.
 class JournalSlice {
  public:
   JournalSlice();
@@ -25,10 +41,16 @@ class JournalSlice {
 
   void Init(unsigned index);
 
-  std::error_code Open(std::string_view dir);
+  // Opens the journal file of generation in dir if the slice belongs to a shard thread.
+  std::error_code Open(std::string_view dir, uint64_t generation);
 
+  // Writes out all the persisted entries and closes the journal files.
   std::error_code Close();
 
+  // Switches the persisted entries to the file of generation. Does not preempt, so it can run
+  // in the same shard callback that starts a snapshot, see ServerFamily::DoSave.
+  std::error_code Rotate(uint64_t generation);
+
   LSN cur_lsn() const {
     return lsn_;
   }
@@ -39,25 +61,91 @@ class JournalSlice {
 
   // Whether the file-based journaling is open.
   bool IsOpen() const {
-    return bool(shard_file_);
+    return is_open_;
   }
 
   void AddLogRecord(const Entry& entry);
 
+  // Appends a VAL, DEL or FLUSH entry to the journal file, if there is one.
+  // Returns the LSN of the entry if the caller must wait for it with AwaitDurable, i.e. with
+  // journal_fsync=always, and 0 otherwise.
+  LSN PersistEntry(const Entry& entry);
+
+  // Blocks until the entries up to lsn are on disk or the journal failed. Thread-safe.
+  void AwaitDurable(LSN lsn);
+
+  // Returns the encoded entries with LSNs above lsn, or nullopt if some of them are no longer
+  // in the backlog.
+  std::optional<std::string> ReadBacklog(LSN lsn) const;
+
+  // Skips an LSN and drops the backlog, so that ReadBacklog fails for the LSNs before it.
+  void DropBacklog();
+
+  // The LSN of the last entry that was passed to the stream callbacks, 0 if there was none.
+  LSN streamed_lsn() const {
+    return ring_buffer_.empty() ? evicted_lsn_ : ring_buffer_.back().lsn;
+  }
+
   uint32_t RegisterOnChange(ChangeCallback cb);
+
+  // Like RegisterOnChange, but the callback receives the backlog encoding of the COMMAND entries.
+  uint32_t RegisterOnStream(StreamCallback cb);
   void Unregister(uint32_t);
 
  private:
   struct RingItem;
 
-  std::string shard_path_;
-  std::unique_ptr<util::uring::LinuxFile> shard_file_;
-  std::optional<base::RingBuffer<RingItem>> ring_buffer_;
+  enum FsyncPolicy : uint8_t { FSYNC_ALWAYS, FSYNC_EVERYSEC, FSYNC_NO };
+
+  struct File {
+    std::unique_ptr<util::uring::LinuxFile> file;
+    std::string path;
+    size_t offset = 0;
+
+    // Serialized entries that were not written yet. The entries of the last file are kept in
+    // sink_ instead, until the file is rotated.
+    std::string data;
+    LSN last_lsn = 0;
+  };
+
+  std::error_code OpenFile(uint64_t generation);
+  void FlushFiber();
+
+  // Writes the pending entries of the first file. Closes the file if it was rotated.
+  std::error_code WriteBatch();
+  std::error_code Sync();
+
+  std::string dir_;
+
+  std::deque<RingItem> ring_buffer_;
+  size_t ring_bytes_ = 0;
+  size_t max_ring_bytes_ = 0;
+  LSN evicted_lsn_ = 0;  // The highest LSN that is no longer in ring_buffer_.
+
+  // Journal files, the last one receives the new entries.
+  std::deque<File> files_;
+  ::io::StringFile sink_;
+  std::unique_ptr<RdbSerializer> serializer_;
+  DbIndex cur_db_ = 0;
+  FsyncPolicy fsync_policy_ = FSYNC_EVERYSEC;
+
+  ::boost::fibers::fiber flush_fb_;
+  util::fibers_ext::EventCount flush_ec_;
+  bool closing_ = false;
+
+  // Written entries since the last fdatasync.
+  bool unsynced_ = false;
+  LSN written_lsn_ = 0;
+  std::chrono::steady_clock::time_point last_sync_;
+
+  std::atomic<LSN> durable_lsn_{0};
+  std::atomic_bool failed_{false};
+  util::fibers_ext::EventCount durable_ec_;
 
   bool iterating_cb_arr_ = false;
   std::vector<std::pair<uint32_t, ChangeCallback>> change_cb_arr_;
+  std::vector<std::pair<uint32_t, StreamCallback>> stream_cb_arr_;
 
-  size_t file_offset_ = 0;
   LSN lsn_ = 1;
 
   uint32_t slice_index_ = UINT32_MAX;
@@ -65,6 +153,7 @@ class JournalSlice {
 
   std::error_code status_ec_;
 
+  bool is_open_ = false;
   bool lameduck_ = false;
 };
 
@@ -0,0 +1,147 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/serializer.h"
+
+#include <lz4.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "server/rdb_extensions.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+namespace journal {
+
+class JournalTest : public Test {
+ protected:
+  // The 6 and 14 bit length encodings of RDB.
+  static void AppendRdbLen(size_t len, string* dest) {
+    CHECK_LT(len, 1u << 14);
+    if (len < 64) {
+      dest->push_back(char(len));
+    } else {
+      dest->push_back(char(0x40 | (len >> 8)));
+      dest->push_back(char(len & 0xFF));
+    }
+  }
+
+  vector<string> Decode(const string& buf, size_t num_entries, vector<ParsedEntry>* entries) {
+    io::BytesSource source{io::Buffer(buf)};
+    JournalReader reader{&source};
+    for (size_t i = 0; i < num_entries; ++i) {
+      io::Result<ParsedEntry> res = reader.ReadEntry();
+      EXPECT_TRUE(res) << res.error();
+      if (!res)
+        break;
+      entries->push_back(std::move(*res));
+    }
+    EXPECT_FALSE(reader.ReadEntry());  // End of stream.
+
+    vector<string> args;
+    for (const auto& entry : *entries) {
+      for (const auto& arg : entry.cmd_args)
+        args.emplace_back(arg.data(), arg.size());
+    }
+    return args;
+  }
+};
+
+TEST_F(JournalTest, RoundTrip) {
+  string key = "key", field = "field", value(1000, 'v');
+  vector<MutableSlice> full_args{MutableSlice{key.data(), key.size()},
+                                 MutableSlice{field.data(), field.size()},
+                                 MutableSlice{value.data(), value.size()}};
+  vector<string_view> shard_args{"k1", "v1", "k2", ""};
+
+  string buf;
+  JournalWriter::Encode(Entry{5, 2, {"HSET", CmdArgList{full_args}}, 1}, 1, &buf);
+  JournalWriter::Encode(Entry{700, 0, {"MSET", ArgSlice{shard_args}}, 3}, 2, &buf);
+  JournalWriter::EncodeNoop(300, 5, &buf);
+
+  // Small integers and lengths take a single byte, the 1000 byte value, txid 700 and lsn 300
+  // take two.
+  EXPECT_EQ(6 + (5 + 4 + 6 + 1002) + 7 + (5 + 3 + 3 + 3 + 1) + 4, buf.size());
+
+  vector<ParsedEntry> entries;
+  vector<string> args = Decode(buf, 3, &entries);
+  ASSERT_EQ(3u, entries.size());
+
+  EXPECT_EQ(Op::COMMAND, entries[0].opcode);
+  EXPECT_EQ(1u, entries[0].lsn);
+  EXPECT_EQ(2u, entries[0].dbid);
+  EXPECT_EQ(5u, entries[0].txid);
+  EXPECT_EQ(1u, entries[0].shard_cnt);
+  EXPECT_EQ(0u, entries[1].dbid);
+  EXPECT_EQ(700u, entries[1].txid);
+  EXPECT_EQ(3u, entries[1].shard_cnt);
+  EXPECT_EQ(2u, entries[1].lsn);
+  EXPECT_EQ(Op::NOOP, entries[2].opcode);
+  EXPECT_EQ(300u, entries[2].lsn);
+  EXPECT_EQ(5u, entries[2].time_ms);
+  EXPECT_TRUE(entries[2].cmd_args.empty());
+
+  EXPECT_THAT(args, ElementsAre("HSET", "key", "field", value, "MSET", "k1", "v1", "k2", ""));
+}
+
+TEST_F(JournalTest, Marker) {
+  string buf;
+  JournalWriter::Encode(Entry{9, 1, {"", ArgSlice{}}, 3}, 7, &buf);
+  EXPECT_EQ(6u, buf.size());
+
+  vector<ParsedEntry> entries;
+  vector<string> args = Decode(buf, 1, &entries);
+  ASSERT_EQ(1u, entries.size());
+  EXPECT_EQ(Op::COMMAND, entries[0].opcode);
+  EXPECT_EQ(9u, entries[0].txid);
+  EXPECT_EQ(3u, entries[0].shard_cnt);
+  EXPECT_TRUE(args.empty());
+}
+
+TEST_F(JournalTest, CompressedBatch) {
+  vector<string_view> args{"key", string_view{"value-value-value-value-value-value-value-value"}};
+  string raw;
+  for (unsigned i = 1; i <= 10; ++i)
+    JournalWriter::Encode(Entry{i, 0, {"SET", ArgSlice{args}}, 1}, i, &raw);
+
+  string compressed(LZ4_compressBound(raw.size()), '\0');
+  int compressed_len =
+      LZ4_compress_default(raw.data(), compressed.data(), raw.size(), compressed.size());
+  ASSERT_GT(compressed_len, 0);
+
+  string buf;
+  buf.push_back(char(RDB_OPCODE_COMPRESSED_LZ4_BLOB));
+  AppendRdbLen(raw.size(), &buf);
+  AppendRdbLen(compressed_len, &buf);
+  buf.append(compressed.data(), compressed_len);
+  JournalWriter::EncodeNoop(11, 0, &buf);
+
+  vector<ParsedEntry> entries;
+  vector<string> decoded = Decode(buf, 11, &entries);
+  ASSERT_EQ(11u, entries.size());
+  for (unsigned i = 0; i < 10; ++i) {
+    EXPECT_EQ(i + 1, entries[i].lsn);
+    EXPECT_EQ(i + 1, entries[i].txid);
+  }
+  EXPECT_EQ(Op::NOOP, entries[10].opcode);
+  EXPECT_EQ(30u, decoded.size());
+}
+
+TEST_F(JournalTest, Truncated) {
+  vector<string_view> args{"key", "value"};
+  string buf;
+  JournalWriter::Encode(Entry{1, 0, {"SET", ArgSlice{args}}, 1}, 1, &buf);
+
+  for (size_t len = 0; len < buf.size(); ++len) {
+    string prefix = buf.substr(0, len);
+    io::BytesSource source{io::Buffer(prefix)};
+    JournalReader reader{&source};
+    EXPECT_FALSE(reader.ReadEntry()) << len;
+  }
+}
+
+}  // namespace journal
+}  // namespace dfly
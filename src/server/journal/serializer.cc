@@ -0,0 +1,287 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/serializer.h"
+
+extern "C" {
+#include "redis/rdb.h"
+}
+
+#include <absl/base/internal/endian.h>
+#include <lz4.h>
+#include <zstd.h>
+
+#include "base/logging.h"
+#include "server/rdb_extensions.h"
+
+#define SET_OR_RETURN(expr, dest) \
+  do {                            \
+    auto exp_val = (expr);        \
+    if (!exp_val)                 \
+      return exp_val.error();     \
+    dest = exp_val.value();       \
+  } while (0)
+
+#define SET_OR_UNEXPECT(expr, dest)                     \
+  do {                                                  \
+    auto exp_res = (expr);                              \
+    if (!exp_res)                                       \
+      return nonstd::make_unexpected(exp_res.error());  \
+    dest = exp_res.value();                             \
+  } while (0)
+
+namespace dfly {
+namespace journal {
+
+using namespace std;
+
+namespace {
+
+constexpr size_t kMaxVarUIntLen = 10;
+
+void AppendVarUInt(uint64_t val, string* dest) {
+  while (val >= 0x80) {
+    dest->push_back(char(val | 0x80));
+    val >>= 7;
+  }
+  dest->push_back(char(val));
+}
+
+void AppendString(string_view str, string* dest) {
+  AppendVarUInt(str.size(), dest);
+  dest->append(str);
+}
+
+}  // namespace
+
+JournalWriter::JournalWriter(io::Sink* sink) : sink_(sink) {
+}
+
+error_code JournalWriter::Write(const Entry& entry, LSN lsn) {
+  buf_.clear();
+  Encode(entry, lsn, &buf_);
+  return sink_->Write(io::Buffer(buf_));
+}
+
+void JournalWriter::Encode(const Entry& entry, LSN lsn, string* dest) {
+  DCHECK(entry.opcode == Op::COMMAND);
+
+  dest->push_back(char(entry.opcode));
+  AppendVarUInt(lsn, dest);
+
+  AppendVarUInt(entry.db_ind, dest);
+  AppendVarUInt(entry.txid, dest);
+  AppendVarUInt(entry.shard_cnt, dest);
+
+  const auto& [cmd, args] = entry.payload;
+  if (cmd.empty()) {
+    AppendVarUInt(0, dest);
+    return;
+  }
+
+  visit(
+      [&](const auto& list) {
+        AppendVarUInt(list.size() + 1, dest);
+        AppendString(cmd, dest);
+        for (const auto& arg : list) {
+          AppendString(string_view{arg.data(), arg.size()}, dest);
+        }
+      },
+      args);
+}
+
+void JournalWriter::EncodeNoop(LSN lsn, uint64_t time_ms, string* dest) {
+  dest->push_back(char(Op::NOOP));
+  AppendVarUInt(lsn, dest);
+  AppendVarUInt(time_ms, dest);
+}
+
+JournalReader::JournalReader(io::Source* source) : source_(source), buf_(4096) {
+}
+
+error_code JournalReader::EnsureRead(size_t num) {
+  if (buf_.InputLen() >= num)
+    return error_code{};
+
+  buf_.EnsureCapacity(num);
+  io::MutableBytes dest = buf_.AppendBuffer();
+  io::Result<size_t> res = source_->ReadAtLeast(dest, num - buf_.InputLen());
+  if (!res)
+    return res.error();
+
+  buf_.CommitWrite(*res);
+  bytes_read_ += *res;
+
+  if (buf_.InputLen() < num)
+    return make_error_code(errc::io_error);
+
+  return error_code{};
+}
+
+io::Result<uint64_t> JournalReader::ReadVarUInt() {
+  uint64_t res = 0;
+  for (size_t i = 0; i < kMaxVarUIntLen; ++i) {
+    if (auto ec = EnsureRead(1); ec)
+      return nonstd::make_unexpected(ec);
+
+    uint8_t byte = buf_.InputBuffer()[0];
+    buf_.ConsumeInput(1);
+
+    res |= uint64_t(byte & 0x7F) << (7 * i);
+    if ((byte & 0x80) == 0)
+      return res;
+  }
+
+  return nonstd::make_unexpected(make_error_code(errc::illegal_byte_sequence));
+}
+
+// The length encoding of RDB, which the compressed batches share with the snapshots.
+io::Result<uint64_t> JournalReader::ReadRdbLen() {
+  if (auto ec = EnsureRead(1); ec)
+    return nonstd::make_unexpected(ec);
+
+  const uint8_t* data = buf_.InputBuffer().data();
+  uint8_t type = (data[0] & 0xC0) >> 6;
+  uint64_t res;
+  if (type == RDB_6BITLEN) {
+    res = data[0] & 0x3F;
+    buf_.ConsumeInput(1);
+  } else if (type == RDB_14BITLEN) {
+    if (auto ec = EnsureRead(2); ec)
+      return nonstd::make_unexpected(ec);
+    data = buf_.InputBuffer().data();
+    res = (uint64_t(data[0] & 0x3F) << 8) | data[1];
+    buf_.ConsumeInput(2);
+  } else if (data[0] == RDB_32BITLEN) {
+    if (auto ec = EnsureRead(5); ec)
+      return nonstd::make_unexpected(ec);
+    res = absl::big_endian::Load32(buf_.InputBuffer().data() + 1);
+    buf_.ConsumeInput(5);
+  } else if (data[0] == RDB_64BITLEN) {
+    if (auto ec = EnsureRead(9); ec)
+      return nonstd::make_unexpected(ec);
+    res = absl::big_endian::Load64(buf_.InputBuffer().data() + 1);
+    buf_.ConsumeInput(9);
+  } else {
+    return nonstd::make_unexpected(make_error_code(errc::illegal_byte_sequence));
+  }
+
+  return res;
+}
+
+error_code JournalReader::ReadCompressedBatch(uint8_t opcode) {
+  uint64_t len, compressed_len;
+  SET_OR_RETURN(ReadRdbLen(), len);
+  SET_OR_RETURN(ReadRdbLen(), compressed_len);
+
+  if (len > UINT32_MAX || compressed_len > len)
+    return make_error_code(errc::illegal_byte_sequence);
+
+  if (auto ec = EnsureRead(compressed_len); ec)
+    return ec;
+
+  compr_buf_.resize(len);
+  const char* src = reinterpret_cast<const char*>(buf_.InputBuffer().data());
+  size_t res = 0;
+  if (opcode == RDB_OPCODE_COMPRESSED_ZSTD_BLOB) {
+    res = ZSTD_decompress(compr_buf_.data(), len, src, compressed_len);
+    if (ZSTD_isError(res))
+      res = 0;
+  } else {
+    int lz4_res = LZ4_decompress_safe(src, compr_buf_.data(), compressed_len, len);
+    res = lz4_res < 0 ? 0 : lz4_res;
+  }
+  buf_.ConsumeInput(compressed_len);
+
+  if (res != len)
+    return make_error_code(errc::illegal_byte_sequence);
+
+  // The entries of the batch are decoded before the input that follows it.
+  io::Bytes input = buf_.InputBuffer();
+  compr_buf_.append(reinterpret_cast<const char*>(input.data()), input.size());
+  buf_.ConsumeInput(input.size());
+  buf_.EnsureCapacity(compr_buf_.size());
+
+  io::MutableBytes dest = buf_.AppendBuffer();
+  memcpy(dest.data(), compr_buf_.data(), compr_buf_.size());
+  buf_.CommitWrite(compr_buf_.size());
+
+  return error_code{};
+}
+
+error_code JournalReader::ReadString(string* dest) {
+  uint64_t len;
+  SET_OR_RETURN(ReadVarUInt(), len);
+
+  size_t start = dest->size();
+  dest->resize(start + len);
+  while (len > 0) {
+    if (auto ec = EnsureRead(1); ec)
+      return ec;
+
+    size_t chunk = min<size_t>(len, buf_.InputLen());
+    memcpy(dest->data() + dest->size() - len, buf_.InputBuffer().data(), chunk);
+    buf_.ConsumeInput(chunk);
+    len -= chunk;
+  }
+
+  return error_code{};
+}
+
+io::Result<ParsedEntry> JournalReader::ReadEntry() {
+  if (auto ec = EnsureRead(1); ec)
+    return nonstd::make_unexpected(ec);
+
+  uint8_t opcode = buf_.InputBuffer()[0];
+  if (opcode == RDB_OPCODE_COMPRESSED_ZSTD_BLOB || opcode == RDB_OPCODE_COMPRESSED_LZ4_BLOB) {
+    buf_.ConsumeInput(1);
+    if (auto ec = ReadCompressedBatch(opcode); ec)
+      return nonstd::make_unexpected(ec);
+
+    // Batches never nest, and never are empty.
+    if (auto ec = EnsureRead(1); ec)
+      return nonstd::make_unexpected(ec);
+  }
+
+  ParsedEntry entry;
+  entry.opcode = Op(buf_.InputBuffer()[0]);
+  buf_.ConsumeInput(1);
+
+  if (entry.opcode != Op::COMMAND && entry.opcode != Op::NOOP)
+    return nonstd::make_unexpected(make_error_code(errc::illegal_byte_sequence));
+
+  SET_OR_UNEXPECT(ReadVarUInt(), entry.lsn);
+  if (entry.opcode == Op::NOOP) {
+    SET_OR_UNEXPECT(ReadVarUInt(), entry.time_ms);
+    return entry;
+  }
+
+  uint64_t dbid, shard_cnt, argc;
+  SET_OR_UNEXPECT(ReadVarUInt(), dbid);
+  SET_OR_UNEXPECT(ReadVarUInt(), entry.txid);
+  SET_OR_UNEXPECT(ReadVarUInt(), shard_cnt);
+  SET_OR_UNEXPECT(ReadVarUInt(), argc);
+  entry.dbid = dbid;
+  entry.shard_cnt = shard_cnt;
+
+  // The slices are taken once cmd_buf is complete, since it may reallocate meanwhile.
+  vector<size_t> ends(argc);
+  for (size_t i = 0; i < argc; ++i) {
+    if (auto ec = ReadString(&entry.cmd_buf); ec)
+      return nonstd::make_unexpected(ec);
+    ends[i] = entry.cmd_buf.size();
+  }
+
+  entry.cmd_args.reserve(argc);
+  size_t start = 0;
+  for (size_t end : ends) {
+    entry.cmd_args.emplace_back(entry.cmd_buf.data() + start, end - start);
+    start = end;
+  }
+
+  return entry;
+}
+
+}  // namespace journal
+}  // namespace dfly
@@ -0,0 +1,75 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+
+#include "base/io_buf.h"
+#include "io/io.h"
+#include "server/journal/types.h"
+
+namespace dfly {
+namespace journal {
+
+// Serializes COMMAND entries into a compact binary stream:
+//   opcode (1 byte), lsn, db index, txid, shard count, number of arguments, and then every
+//   argument as its length followed by its bytes. All the integers are varints.
+// An entry without a command has no arguments at all. It only marks that the shard takes part
+// in a multi-shard transaction that another shard journals.
+// NOOP entries consist of the opcode, the lsn and the wall clock time of the master in ms.
+// They announce the position of the stream, and are sent periodically so that replicas can
+// tell how stale they are.
+// Replication streams may also carry batches of consecutive entries compressed as a whole, in
+// the format of the compressed snapshot blocks, see RDB_OPCODE_COMPRESSED_ZSTD_BLOB.
+class JournalWriter {
+ public:
+  explicit JournalWriter(io::Sink* sink);
+
+  std::error_code Write(const Entry& entry, LSN lsn);
+
+  // Appends the encoding of entry to dest without writing it anywhere.
+  static void Encode(const Entry& entry, LSN lsn, std::string* dest);
+
+  // Appends a NOOP entry to dest.
+  static void EncodeNoop(LSN lsn, uint64_t time_ms, std::string* dest);
+
+ private:
+  io::Sink* sink_;
+  std::string buf_;
+};
+
+// Decodes the entries written by JournalWriter.
+class JournalReader {
+ public:
+  explicit JournalReader(io::Source* source);
+
+  io::Result<ParsedEntry> ReadEntry();
+
+  size_t bytes_read() const {
+    return bytes_read_;
+  }
+
+  // Bytes read from the source that were not decoded yet.
+  io::Bytes Leftover() const {
+    return buf_.InputBuffer();
+  }
+
+ private:
+  std::error_code EnsureRead(size_t num);
+  io::Result<uint64_t> ReadVarUInt();
+  io::Result<uint64_t> ReadRdbLen();
+  std::error_code ReadString(std::string* dest);
+
+  // Replaces a compressed batch at the front of the input with its entries.
+  std::error_code ReadCompressedBatch(uint8_t opcode);
+
+  io::Source* source_;
+  base::IoBuf buf_;
+  std::string compr_buf_;
+  size_t bytes_read_ = 0;
+};
+
+}  // namespace journal
+}  // namespace dfly
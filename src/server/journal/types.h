@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <variant>
+
 #include "server/common.h"
 #include "server/table.h"
 
@@ -19,6 +21,9 @@ enum class Op : uint8_t {
   VAL = 10,
   DEL,
   MSET,
+  FLUSH,  // Flush of the database db_ind, or of all of them for DbSlice::kDbAll.
+  COMMAND,
+  FIELDS,  // Some fields of a hash set or removed, only in the persistent journal.
 };
 
 // TODO: to pass all the attributes like ttl, stickiness etc.
@@ -32,6 +37,14 @@ struct Entry {
     pval_ptr = &pval;
   }
 
+  // The command name and the arguments it is replayed with.
+  using Payload = std::pair<std::string_view, std::variant<CmdArgList, ArgSlice>>;
+
+  // A COMMAND entry. shard_cnt is the number of shards that journal the same transaction.
+  Entry(TxId tid, DbIndex did, Payload pl, uint32_t shard_cnt)
+      : opcode(Op::COMMAND), db_ind(did), txid(tid), payload(std::move(pl)), shard_cnt(shard_cnt) {
+  }
+
   static Entry Sched(TxId tid) {
     return Entry{Op::SCHED, 0, tid, {}};
   }
@@ -42,9 +55,38 @@ struct Entry {
   std::string_view key;
   const PrimeValue* pval_ptr = nullptr;
   uint64_t expire_ms = 0;  // 0 means no expiry.
+
+  Payload payload;
+  uint32_t shard_cnt = 1;
+
+  // The keys of the shard that a COMMAND entry changes, every key_step-th of shard_args, for
+  // the consumers that need the resulting values. Not serialized.
+  ArgSlice shard_args;
+  uint32_t key_step = 1;
+
+  // The fields that a FIELDS entry sets, interleaved with their values, and the fields it
+  // removes.
+  CmdArgList fields_set;
+  CmdArgList fields_removed;
+};
+
+// An entry decoded by JournalReader. cmd_args point into cmd_buf.
+struct ParsedEntry {
+  Op opcode;
+  LSN lsn = 0;
+  DbIndex dbid = 0;
+  TxId txid = 0;
+  uint32_t shard_cnt = 0;
+  uint64_t time_ms = 0;  // NOOP entries only.
+
+  std::string cmd_buf;
+  CmdArgVec cmd_args;  // The command name followed by its arguments.
 };
 
 using ChangeCallback = std::function<void(const Entry&)>;
 
+// Receives an entry encoded by JournalWriter.
+using StreamCallback = std::function<void(std::string_view)>;
+
 }  // namespace journal
 }  // namespace dfly
@@ -8,6 +8,7 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_join.h>
 
@@ -15,11 +16,12 @@ extern "C" {
 #include <jsoncons_ext/jsonpatch/jsonpatch.hpp>
 #include <jsoncons_ext/jsonpath/jsonpath.hpp>
 #include <jsoncons_ext/jsonpointer/jsonpointer.hpp>
+#include <list>
 
 #include "base/logging.h"
 #include "server/command_registry.h"
+#include "server/engine_shard_set.h"
 #include "server/error.h"
-#include "server/journal/journal.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 
@@ -54,13 +56,6 @@ string GetString(EngineShard* shard, const PrimeValue& pv) {
   return res;
 }
 
-inline void RecordJournal(const OpArgs& op_args, string_view key, const PrimeKey& pvalue) {
-  if (op_args.shard->journal()) {
-    journal::Entry entry{op_args.db_cntx.db_index, op_args.txid, key, pvalue};
-    op_args.shard->journal()->RecordEntry(entry);
-  }
-}
-
 void SetString(const OpArgs& op_args, string_view key, const string& value) {
   auto& db_slice = op_args.shard->db_slice();
   DbIndex db_index = op_args.db_cntx.db_index;
@@ -68,7 +63,6 @@ void SetString(const OpArgs& op_args, string_view key, const string& value) {
   db_slice.PreUpdate(db_index, it_output);
   it_output->second.SetString(value);
   db_slice.PostUpdate(db_index, it_output, key);
-  RecordJournal(op_args, key, it_output->second);
 }
 
 string JsonType(const json& val) {
@@ -158,6 +152,54 @@ optional<json> ConstructJsonFromString(string_view val) {
   return decoder.get_result();
 }
 
+// An LRU cache of the compiled expressions of the recently used JSONPaths. Each thread has its
+// own cache, so an expression is only evaluated by the thread that compiled it.
+class JsonPathCache {
+ public:
+  // Returns nullptr if the path is not a valid JSONPath.
+  JsonExpression* Get(string_view path);
+
+ private:
+  static constexpr size_t kMaxSize = 512;
+
+  struct Entry {
+    string path;
+    JsonExpression expression;
+  };
+
+  list<Entry> lru_;  // the most recently used paths first.
+  absl::flat_hash_map<string_view, list<Entry>::iterator> index_;  // points to the paths of lru_.
+};
+
+JsonExpression* JsonPathCache::Get(string_view path) {
+  if (auto it = index_.find(path); it != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return &it->second->expression;
+  }
+
+  error_code ec;
+  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
+  if (ec) {
+    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+    return nullptr;
+  }
+
+  if (lru_.size() >= kMaxSize) {
+    index_.erase(lru_.back().path);
+    lru_.pop_back();
+  }
+
+  lru_.push_front(Entry{string(path), move(expression)});
+  index_.emplace(lru_.front().path, lru_.begin());
+  return &lru_.front().expression;
+}
+
+thread_local JsonPathCache tl_path_cache;
+
+JsonExpression* GetPathExpression(string_view path) {
+  return tl_path_cache.Get(path);
+}
+
 OpResult<json> GetJson(const OpArgs& op_args, string_view key) {
   OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
   if (!it_res.ok())
@@ -342,28 +384,39 @@ void SendJsonValue(ConnectionContext* cntx, const json& j) {
   }
 }
 
-OpResult<string> OpGet(const OpArgs& op_args, string_view key,
-                       vector<pair<string_view, JsonExpression>> expressions) {
+OpResult<string> OpGet(const OpArgs& op_args, string_view key, const vector<string_view>& paths) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
-  if (expressions.size() == 1) {
-    json out = expressions[0].second.evaluate(*result);
-    return out.as<string>();
+  if (paths.size() == 1) {
+    // Serializes the matched values one by one instead of copying them into a result array.
+    string out{"["}, val_str;
+    auto cb = [&](const string_view& path, const json& val) {
+      val_str.clear();
+      val.dump(val_str);
+      if (out.size() > 1)
+        out.push_back(',');
+      out.append(val_str);
+    };
+
+    GetPathExpression(paths[0])->evaluate(*result, cb);
+    out.push_back(']');
+    return out;
   }
 
   json out;
-  for (auto& expr : expressions) {
-    json eval = expr.second.evaluate(*result);
-    out[expr.first] = eval;
+  for (string_view path : paths) {
+    json eval = GetPathExpression(path)->evaluate(*result);
+    out[path] = eval;
   }
 
   return out.as<string>();
 }
 
-OpResult<vector<string>> OpType(const OpArgs& op_args, string_view key, JsonExpression expression) {
+OpResult<vector<string>> OpType(const OpArgs& op_args, string_view key,
+                                JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -377,7 +430,7 @@ OpResult<vector<string>> OpType(const OpArgs& op_args, string_view key, JsonExpr
 }
 
 OpResult<vector<OptSizeT>> OpStrLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
+                                    JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -397,7 +450,7 @@ OpResult<vector<OptSizeT>> OpStrLen(const OpArgs& op_args, string_view key,
 }
 
 OpResult<vector<OptSizeT>> OpObjLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
+                                    JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -417,7 +470,7 @@ OpResult<vector<OptSizeT>> OpObjLen(const OpArgs& op_args, string_view key,
 }
 
 OpResult<vector<OptSizeT>> OpArrLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
+                                    JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -515,7 +568,7 @@ OpResult<long> OpDel(const OpArgs& op_args, string_view key, string_view path) {
   long total_deletions = 0;
   if (path.empty()) {
     auto& db_slice = op_args.shard->db_slice();
-    auto [it, _] = db_slice.FindExt(op_args.db_cntx, key);
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
     total_deletions += long(db_slice.Del(op_args.db_cntx.db_index, it));
     return total_deletions;
   }
@@ -561,7 +614,7 @@ OpResult<long> OpDel(const OpArgs& op_args, string_view key, string_view path) {
 // Returns a vector of string vectors,
 // keys within the same object are stored in the same string vector.
 OpResult<vector<StringVec>> OpObjKeys(const OpArgs& op_args, string_view key,
-                                      JsonExpression expression) {
+                                      JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -871,7 +924,7 @@ OpResult<vector<OptSizeT>> OpArrAppend(const OpArgs& op_args, string_view key, s
 // An index value of -1 represents unfound in the array.
 // JSON scalar has types of string, boolean, null, and number.
 OpResult<vector<OptLong>> OpArrIndex(const OpArgs& op_args, string_view key,
-                                     JsonExpression expression, const json& search_val,
+                                     JsonExpression& expression, const json& search_val,
                                      int start_index, int end_index) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
@@ -932,38 +985,37 @@ OpResult<vector<OptLong>> OpArrIndex(const OpArgs& op_args, string_view key,
   return vec;
 }
 
-// Returns string vector that represents the query result of each supplied key.
-OpResult<vector<OptString>> OpMGet(const OpArgs& op_args, const vector<string_view>& keys,
-                                   JsonExpression expression) {
-  vector<OptString> vec;
-  for (auto& it : keys) {
-    OpResult<json> result = GetJson(op_args, it);
-    if (!result) {
-      vec.emplace_back();
-      continue;
-    }
+// Returns the serialized matches of the path in each key of the shard, in the order of the shard
+// arguments. A key with several matches gets them as a JSON array.
+vector<OptString> OpMGet(JsonExpression& expression, const Transaction* t, EngineShard* shard) {
+  ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
+  DCHECK(!keys.empty());
 
-    auto cb = [&vec](const string_view& path, const json& val) {
-      string str;
-      error_code ec;
-      val.dump(str, {}, ec);
-      if (ec) {
-        VLOG(1) << "Failed to dump JSON to string with the error: " << ec.message();
-        return;
-      }
+  vector<OptString> response(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    OpResult<json> result = GetJson(t->GetOpArgs(shard), keys[i]);
+    if (!result)
+      continue;
 
-      vec.push_back(move(str));
-    };
+    json matches = expression.evaluate(*result);
+    if (matches.empty())
+      continue;
 
-    expression.evaluate(*result, cb);
+    const json& val = matches.size() == 1 ? matches[0] : matches;
+    error_code ec;
+    val.dump(response[i].emplace(), {}, ec);
+    if (ec) {
+      VLOG(1) << "Failed to dump JSON to string with the error: " << ec.message();
+      response[i].reset();
+    }
   }
 
-  return vec;
+  return response;
 }
 
 // Returns numeric vector that represents the number of fields of JSON value at each path.
 OpResult<vector<OptSizeT>> OpFields(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
+                                    JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -979,7 +1031,8 @@ OpResult<vector<OptSizeT>> OpFields(const OpArgs& op_args, string_view key,
 }
 
 // Returns json vector that represents the result of the json query.
-OpResult<vector<json>> OpResp(const OpArgs& op_args, string_view key, JsonExpression expression) {
+OpResult<vector<json>> OpResp(const OpArgs& op_args, string_view key,
+                              JsonExpression& expression) {
   OpResult<json> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
@@ -998,17 +1051,13 @@ void JsonFamily::Resp(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpResp(t->GetOpArgs(shard), key, move(expression));
+    return OpResp(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1049,19 +1098,15 @@ void JsonFamily::Debug(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  error_code ec;
   string_view key = ArgS(args, 2);
   string_view path = ArgS(args, 3);
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return func(t->GetOpArgs(shard), key, move(expression));
+    return func(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1075,39 +1120,47 @@ void JsonFamily::Debug(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void JsonFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
-  error_code ec;
+  DCHECK_GE(args.size(), 3U);
   string_view path = ArgS(args, args.size() - 1);
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
-  vector<string_view> vec;
-  for (auto i = 1U; i < args.size() - 1; i++) {
-    vec.emplace_back(ArgS(args, i));
-  }
+  Transaction* transaction = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  vector<vector<OptString>> mget_resp(shard_count);
 
+  // Every shard evaluates the path on its keys in parallel.
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpMGet(t->GetOpArgs(shard), vec, move(expression));
+    mget_resp[shard->shard_id()] = OpMGet(*GetPathExpression(path), t, shard);
+    return OpStatus::OK;
   };
 
-  Transaction* trans = cntx->transaction;
-  OpResult<vector<OptString>> result = trans->ScheduleSingleHopT(move(cb));
+  OpStatus result = transaction->ScheduleSingleHop(std::move(cb));
+  CHECK_EQ(OpStatus::OK, result);
 
-  if (result) {
-    (*cntx)->StartArray(result->size());
-    for (auto& it : *result) {
-      if (!it) {
-        (*cntx)->SendNull();
-      } else {
-        (*cntx)->SendSimpleString(*it);
+  // Reorders the responses back according to the order of their keys.
+  vector<OptString> results(args.size() - 2);
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    vector<OptString>& res = mget_resp[sid];
+    for (size_t j = 0; j < res.size(); ++j) {
+      if (res[j]) {
+        results[transaction->ReverseArgIndex(sid, j)] = move(res[j]);
       }
     }
-  } else {
-    (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(results.size());
+  for (auto& it : results) {
+    if (!it) {
+      (*cntx)->SendNull();
+    } else {
+      (*cntx)->SendSimpleString(*it);
+    }
   }
 }
 
@@ -1115,11 +1168,7 @@ void JsonFamily::ArrIndex(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
@@ -1154,8 +1203,8 @@ void JsonFamily::ArrIndex(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpArrIndex(t->GetOpArgs(shard), key, move(expression), *search_value, start_index,
-                      end_index);
+    return OpArrIndex(t->GetOpArgs(shard), key, *GetPathExpression(path), *search_value,
+                      start_index, end_index);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1283,11 +1332,7 @@ void JsonFamily::ArrPop(CmdArgList args, ConnectionContext* cntx) {
     }
   }
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
@@ -1357,17 +1402,13 @@ void JsonFamily::ObjKeys(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpObjKeys(t->GetOpArgs(shard), key, move(expression));
+    return OpObjKeys(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1475,17 +1516,13 @@ void JsonFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpType(t->GetOpArgs(shard), key, move(expression));
+    return OpType(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1511,17 +1548,13 @@ void JsonFamily::ArrLen(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpArrLen(t->GetOpArgs(shard), key, move(expression));
+    return OpArrLen(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1538,17 +1571,13 @@ void JsonFamily::ObjLen(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpObjLen(t->GetOpArgs(shard), key, move(expression));
+    return OpObjLen(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1565,17 +1594,13 @@ void JsonFamily::StrLen(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view path = ArgS(args, 2);
 
-  error_code ec;
-  JsonExpression expression = jsonpath::make_expression<json>(path, ec);
-
-  if (ec) {
-    VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+  if (!GetPathExpression(path)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpStrLen(t->GetOpArgs(shard), key, move(expression));
+    return OpStrLen(t->GetOpArgs(shard), key, *GetPathExpression(path));
   };
 
   Transaction* trans = cntx->transaction;
@@ -1592,24 +1617,19 @@ void JsonFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   DCHECK_GE(args.size(), 3U);
   string_view key = ArgS(args, 1);
 
-  vector<pair<string_view, JsonExpression>> expressions;
+  vector<string_view> paths;
   for (size_t i = 2; i < args.size(); ++i) {
     string_view path = ArgS(args, i);
-
-    error_code ec;
-    JsonExpression expr = jsonpath::make_expression<json>(path, ec);
-
-    if (ec) {
-      VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
+    if (!GetPathExpression(path)) {
       (*cntx)->SendError(kSyntaxErr);
       return;
     }
 
-    expressions.emplace_back(path, move(expr));
+    paths.push_back(path);
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGet(t->GetOpArgs(shard), key, move(expressions));
+    return OpGet(t->GetOpArgs(shard), key, paths);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1626,7 +1646,8 @@ void JsonFamily::Get(CmdArgList args, ConnectionContext* cntx) {
 
 void JsonFamily::Register(CommandRegistry* registry) {
   *registry << CI{"JSON.GET", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(Get);
-  *registry << CI{"JSON.MGET", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(MGet);
+  *registry << CI{"JSON.MGET", CO::READONLY | CO::FAST | CO::REVERSE_MAPPING, -3, 1, -2, 1}.HFUNC(
+      MGet);
   *registry << CI{"JSON.TYPE", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(Type);
   *registry << CI{"JSON.STRLEN", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(StrLen);
   *registry << CI{"JSON.OBJLEN", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(ObjLen);
@@ -122,6 +122,28 @@ TEST_F(JsonFamilyTest, SetGetFromPhonebook) {
   EXPECT_EQ(resp, R"(["646 555-4567","office"])");
 }
 
+TEST_F(JsonFamilyTest, GetCachedPath) {
+  auto resp = Run({"set", "json", R"({"a":1,"b":{"a":[1,{"c":"x"}]}})"});
+  ASSERT_THAT(resp, "OK");
+
+  resp = Run({"JSON.GET", "json", "$..a"});
+  EXPECT_EQ(resp, R"([1,[1,{"c":"x"}]])");
+
+  // The compiled path is reused for the updated document.
+  Run({"JSON.NUMINCRBY", "json", "$.a", "2"});
+  resp = Run({"JSON.GET", "json", "$..a"});
+  EXPECT_EQ(resp, R"([3,[1,{"c":"x"}]])");
+
+  resp = Run({"JSON.GET", "json", "$.none"});
+  EXPECT_EQ(resp, "[]");
+
+  resp = Run({"JSON.TYPE", "json", "$..a"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("integer", "array"));
+
+  resp = Run({"JSON.GET", "json", "$..a", "//*"});
+  EXPECT_THAT(resp, ArgType(RespExpr::ERROR));
+}
+
 TEST_F(JsonFamilyTest, Type) {
   string json = R"(
     [1, 2.3, "foo", true, null, {}, []]
@@ -859,6 +881,15 @@ TEST_F(JsonFamilyTest, MGet) {
   resp = Run({"JSON.MGET", "json1", "json2", "json3", "$.address.country"});
   ASSERT_EQ(RespExpr::ARRAY, resp.type);
   EXPECT_THAT(resp.GetVec(), ElementsAre(R"("Israel")", R"("Germany")", ArgType(RespExpr::NIL)));
+
+  // The keys are spread over the shards, and a key with several matches gets an array.
+  resp = Run({"JSON.MGET", "json3", "json2", "json1", "$.address['country','city']"});
+  ASSERT_EQ(RespExpr::ARRAY, resp.type);
+  EXPECT_THAT(resp.GetVec(), ElementsAre(ArgType(RespExpr::NIL), R"(["Germany","Berlin"])",
+                                         R"(["Israel","Petah-Tikva"])"));
+
+  resp = Run({"JSON.MGET", "json1", "json2", "$.none"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(ArgType(RespExpr::NIL), ArgType(RespExpr::NIL)));
 }
 
 TEST_F(JsonFamilyTest, DebugFields) {
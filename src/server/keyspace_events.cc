@@ -0,0 +1,266 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/keyspace_events.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/flags/flag.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <boost/fiber/operations.hpp>
+
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/engine_shard_set.h"
+#include "util/fiber_sched_algo.h"
+
+ABSL_FLAG(std::string, notify_keyspace_events, "",
+          "Classes of the keyspace events to publish, like Redis notify-keyspace-events, e.g. "
+          "\"Ex\" for the expired keys. Supports the del, set, expired and evicted events. "
+          "Empty disables the notifications");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+namespace this_fiber = ::boost::this_fiber;
+
+atomic_uint32_t KeyspaceEvents::flags_{0};
+atomic_uint32_t KeyspaceEvents::subscriptions_{0};
+
+namespace {
+
+constexpr string_view kKeyspacePrefix = "__keyspace@";
+constexpr string_view kKeyeventPrefix = "__keyevent@";
+
+constexpr pair<char, uint32_t> kFlagChars[] = {
+    {'K', KeyspaceEvents::kKeyspace}, {'E', KeyspaceEvents::kKeyevent},
+    {'g', KeyspaceEvents::kGeneric},  {'$', KeyspaceEvents::kString},
+    {'l', KeyspaceEvents::kList},     {'s', KeyspaceEvents::kSet},
+    {'h', KeyspaceEvents::kHash},     {'z', KeyspaceEvents::kZset},
+    {'x', KeyspaceEvents::kExpired},  {'e', KeyspaceEvents::kEvicted},
+    {'t', KeyspaceEvents::kStream},   {'m', KeyspaceEvents::kKeyMiss},
+    {'n', KeyspaceEvents::kNew},
+};
+
+string_view EventName(KeyspaceEvent event) {
+  switch (event) {
+    case KeyspaceEvent::DEL:
+      return "del";
+    case KeyspaceEvent::SET:
+      return "set";
+    case KeyspaceEvent::EXPIRED:
+      return "expired";
+    case KeyspaceEvent::EVICTED:
+      return "evicted";
+  }
+  return "";
+}
+
+// Returns true if the pattern may match a keyspace channel, judging by its literal prefix.
+bool MayMatchKeyspace(string_view pattern) {
+  string_view literal = pattern.substr(0, pattern.find_first_of("*?[\\"));
+  for (string_view prefix : {kKeyspacePrefix, kKeyeventPrefix}) {
+    size_t len = min(literal.size(), prefix.size());
+    if (literal.substr(0, len) == prefix.substr(0, len))
+      return true;
+  }
+  return false;
+}
+
+struct Message {
+  string channel;
+  string payload;
+};
+
+using MessagePtr = shared_ptr<const Message>;
+
+// The messages of a channel for one of its subscribers.
+struct Delivery {
+  ChannelSlice::Subscriber subscriber;
+  vector<MessagePtr> messages;
+};
+
+// Runs in the io thread of the subscribers.
+void SendDeliveries(const shared_ptr<vector<Delivery>>& deliveries) {
+  for (Delivery& delivery : *deliveries) {
+    facade::Connection* conn = delivery.subscriber.conn_cntx->owner();
+    DCHECK(conn);
+    for (const MessagePtr& msg : delivery.messages) {
+      facade::Connection::PubMessage pmsg;
+      pmsg.pattern = delivery.subscriber.pattern;
+      pmsg.channel = msg->channel;
+
+      // Shares the ownership of the deliveries, which keep the channel and the pattern alive
+      // until the connection sends the message.
+      pmsg.message = shared_ptr<const string>(deliveries, &msg->payload);
+      conn->SendMsgVecAsync(pmsg);
+    }
+    delivery.subscriber.borrow_token.Dec();
+  }
+}
+
+// Runs in the shard that keeps the subscribers of the channels of messages.
+void PublishBatch(const vector<MessagePtr>& messages) {
+  ChannelSlice& cs = EngineShard::tlocal()->channel_slice();
+
+  // Many events share a channel, like the expiry events of __keyevent, so the subscribers are
+  // fetched once per channel.
+  absl::flat_hash_map<string_view, vector<MessagePtr>> by_channel;
+  for (const MessagePtr& msg : messages) {
+    by_channel[msg->channel].push_back(msg);
+  }
+
+  vector<shared_ptr<vector<Delivery>>> by_thread(shard_set->pool()->size());
+  for (auto& [channel, channel_msgs] : by_channel) {
+    for (ChannelSlice::Subscriber& sub : cs.FetchSubscribers(channel)) {
+      auto& dest = by_thread[sub.thread_id];
+      if (!dest)
+        dest = make_shared<vector<Delivery>>();
+      dest->push_back(Delivery{std::move(sub), channel_msgs});
+    }
+  }
+
+  for (unsigned thread_id = 0; thread_id < by_thread.size(); ++thread_id) {
+    if (by_thread[thread_id]) {
+      shard_set->pool()->at(thread_id)->DispatchBrief(
+          [deliveries = std::move(by_thread[thread_id])] { SendDeliveries(deliveries); });
+    }
+  }
+}
+
+}  // namespace
+
+KeyspaceEvents::~KeyspaceEvents() {
+  Shutdown();
+}
+
+bool KeyspaceEvents::ParseFlags(string_view str, uint32_t* flags) {
+  uint32_t res = 0;
+  for (char c : str) {
+    if (c == 'A') {
+      res |= kAll;
+      continue;
+    }
+
+    auto it = find_if(begin(kFlagChars), end(kFlagChars),
+                      [c](const auto& p) { return p.first == c; });
+    if (it == end(kFlagChars))
+      return false;
+    res |= it->second;
+  }
+
+  *flags = res;
+  return true;
+}
+
+string KeyspaceEvents::FlagsToString(uint32_t flags) {
+  string res;
+  if ((flags & kAll) == kAll) {
+    res.push_back('A');
+    flags &= ~kAll;
+  }
+
+  // Redis lists the classes before K and E.
+  for (size_t i = 2; i < ABSL_ARRAYSIZE(kFlagChars); ++i) {
+    if (flags & kFlagChars[i].second)
+      res.push_back(kFlagChars[i].first);
+  }
+  if (flags & kKeyspace)
+    res.push_back('K');
+  if (flags & kKeyevent)
+    res.push_back('E');
+  return res;
+}
+
+void KeyspaceEvents::Init() {
+  string str = absl::GetFlag(FLAGS_notify_keyspace_events);
+  uint32_t flags = 0;
+  if (!ParseFlags(str, &flags)) {
+    LOG(ERROR) << "Invalid notify_keyspace_events " << str;
+    exit(1);
+  }
+  SetFlags(flags);
+}
+
+void KeyspaceEvents::OnSubscription(string_view channel, bool pattern, bool added) {
+  bool keyspace = pattern ? MayMatchKeyspace(channel)
+                          : absl::StartsWith(channel, kKeyspacePrefix) ||
+                                absl::StartsWith(channel, kKeyeventPrefix);
+  if (!keyspace)
+    return;
+
+  if (added)
+    subscriptions_.fetch_add(1, memory_order_relaxed);
+  else
+    subscriptions_.fetch_sub(1, memory_order_relaxed);
+}
+
+void KeyspaceEvents::Notify(DbIndex db_index, string_view key, KeyspaceEvent event) {
+  if (!Enabled(event))
+    return;
+
+  EngineShard* shard = EngineShard::tlocal();
+  if (shard)
+    shard->keyspace_events().Add(db_index, key, event);
+}
+
+void KeyspaceEvents::Shutdown() {
+  stopped_ = true;
+  pending_.clear();
+  if (fiber_.joinable())
+    fiber_.join();
+}
+
+void KeyspaceEvents::Add(DbIndex db_index, string_view key, KeyspaceEvent event) {
+  if (stopped_)
+    return;
+
+  pending_.push_back(Entry{string(key), db_index, event});
+  if (running_)
+    return;
+
+  // The previous fiber, if any, has finished already.
+  if (fiber_.joinable())
+    fiber_.join();
+
+  // The fiber runs after the current one yields, so the events of a transaction are batched.
+  running_ = true;
+  fiber_ = ::boost::fibers::fiber([this] {
+    this_fiber::properties<FiberProps>().set_name("keyspace_events");
+    while (!stopped_ && !pending_.empty()) {
+      Flush();
+      this_fiber::yield();
+    }
+    running_ = false;
+  });
+}
+
+void KeyspaceEvents::Flush() {
+  vector<Entry> batch;
+  batch.swap(pending_);
+
+  uint32_t flags = GetFlags();
+  vector<vector<MessagePtr>> by_shard(shard_set->size());
+  auto add = [&](string channel, string_view payload) {
+    ShardId sid = Shard(channel, shard_set->size());
+    by_shard[sid].push_back(make_shared<Message>(Message{std::move(channel), string(payload)}));
+  };
+
+  for (const Entry& entry : batch) {
+    string_view name = EventName(entry.event);
+    if (flags & kKeyspace)
+      add(absl::StrCat(kKeyspacePrefix, entry.db_index, "__:", entry.key), name);
+    if (flags & kKeyevent)
+      add(absl::StrCat(kKeyeventPrefix, entry.db_index, "__:", name), entry.key);
+  }
+
+  for (ShardId sid = 0; sid < by_shard.size(); ++sid) {
+    if (!by_shard[sid].empty())
+      shard_set->Add(sid, [messages = std::move(by_shard[sid])] { PublishBatch(messages); });
+  }
+}
+
+}  // namespace dfly
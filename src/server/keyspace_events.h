@@ -0,0 +1,117 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/fiber/fiber.hpp>
+
+#include "server/common.h"
+
+namespace dfly {
+
+enum class KeyspaceEvent : uint8_t { DEL, SET, EXPIRED, EVICTED };
+
+// Keyspace notifications, configured by notify-keyspace-events like in Redis. They are published
+// to __keyspace@<db>__:<key> with the event as the message and to __keyevent@<db>__:<event>
+// with the key as the message.
+// The events of a shard are queued and published in batches by a fiber: a batch takes a hop per
+// shard that keeps the subscribers of its channels and a hop per io thread of the subscribers.
+// While the notifications are disabled or nobody subscribed to the keyspace channels, the hooks
+// only load two relaxed atomics.
+class KeyspaceEvents {
+ public:
+  // The classes of notify-keyspace-events.
+  static constexpr uint32_t kKeyspace = 1;       // K
+  static constexpr uint32_t kKeyevent = 1 << 1;  // E
+  static constexpr uint32_t kGeneric = 1 << 2;   // g
+  static constexpr uint32_t kString = 1 << 3;    // $
+  static constexpr uint32_t kList = 1 << 4;      // l
+  static constexpr uint32_t kSet = 1 << 5;       // s
+  static constexpr uint32_t kHash = 1 << 6;      // h
+  static constexpr uint32_t kZset = 1 << 7;      // z
+  static constexpr uint32_t kExpired = 1 << 8;   // x
+  static constexpr uint32_t kEvicted = 1 << 9;   // e
+  static constexpr uint32_t kStream = 1 << 10;   // t
+  static constexpr uint32_t kKeyMiss = 1 << 11;  // m
+  static constexpr uint32_t kNew = 1 << 12;      // n
+  static constexpr uint32_t kAll = kGeneric | kString | kList | kSet | kHash | kZset | kExpired |
+                                   kEvicted | kStream;  // A
+
+  KeyspaceEvents() = default;
+  ~KeyspaceEvents();
+
+  // Parses notify-keyspace-events, e.g. "KEA". Returns false if str has an unknown class.
+  static bool ParseFlags(std::string_view str, uint32_t* flags);
+  static std::string FlagsToString(uint32_t flags);
+
+  // Sets the flags from the notify_keyspace_events flag, called once by the service.
+  static void Init();
+
+  static void SetFlags(uint32_t flags) {
+    flags_.store(flags, std::memory_order_relaxed);
+  }
+
+  static uint32_t GetFlags() {
+    return flags_.load(std::memory_order_relaxed);
+  }
+
+  // Returns true if event of some key should be published.
+  static bool Enabled(KeyspaceEvent event) {
+    if (subscriptions_.load(std::memory_order_relaxed) == 0)
+      return false;
+    uint32_t flags = flags_.load(std::memory_order_relaxed);
+    return (flags & (kKeyspace | kKeyevent)) && (flags & ClassOf(event));
+  }
+
+  // Counts the subscriptions to the keyspace channels and to the patterns that may match them.
+  static void OnSubscription(std::string_view channel, bool pattern, bool added);
+
+  // Queues the notification of the event of key in the shard of the calling thread, if it is
+  // enabled.
+  static void Notify(DbIndex db_index, std::string_view key, KeyspaceEvent event);
+
+  // Drops the queued events and stops the fiber, called before the shards are destroyed.
+  void Shutdown();
+
+ private:
+  struct Entry {
+    std::string key;
+    DbIndex db_index;
+    KeyspaceEvent event;
+  };
+
+  static constexpr uint32_t ClassOf(KeyspaceEvent event) {
+    switch (event) {
+      case KeyspaceEvent::DEL:
+        return kGeneric;
+      case KeyspaceEvent::SET:
+        return kString;
+      case KeyspaceEvent::EXPIRED:
+        return kExpired;
+      case KeyspaceEvent::EVICTED:
+        return kEvicted;
+    }
+    return 0;
+  }
+
+  void Add(DbIndex db_index, std::string_view key, KeyspaceEvent event);
+
+  // Publishes the queued events.
+  void Flush();
+
+  std::vector<Entry> pending_;
+  ::boost::fibers::fiber fiber_;
+  bool running_ = false;
+  bool stopped_ = false;
+
+  static std::atomic_uint32_t flags_;
+  static std::atomic_uint32_t subscriptions_;
+};
+
+}  // namespace dfly
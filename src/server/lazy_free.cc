@@ -0,0 +1,205 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/lazy_free.h"
+
+extern "C" {
+#include "redis/object.h"
+#include "redis/quicklist.h"
+#include "redis/stream.h"
+#include "redis/zset.h"
+}
+
+#include <mimalloc.h>
+
+#include <boost/fiber/operations.hpp>
+
+#include "base/logging.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
+#include "server/server_state.h"
+#include "util/fiber_sched_algo.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+namespace this_fiber = ::boost::this_fiber;
+
+namespace {
+
+// Elements freed between the yields of the fiber, roughly 100us of work.
+constexpr size_t kStepBudget = 1024;
+
+// The fiber polls the tables that snapshots refer to at this interval.
+constexpr auto kBlockedPollInterval = 1ms;
+
+// Returns the number of elements of the containers whose elements are allocated separately,
+// which take long to free, or 0 for the single blob values.
+size_t NumElements(const PrimeValue& pv) {
+  if (pv.IsExternal())
+    return 0;
+
+  void* ptr = pv.RObjPtr();
+  switch (pv.ObjType()) {
+    case OBJ_LIST:
+      return quicklistCount((quicklist*)ptr);
+    case OBJ_SET:
+      return pv.Encoding() == kEncodingIntSet ? 0 : pv.Size();
+    case OBJ_HASH:
+      return pv.Encoding() == kEncodingStrMap2 ? ((StringMap*)ptr)->Size() : 0;
+    case OBJ_ZSET:
+      return pv.Encoding() == OBJ_ENCODING_SKIPLIST ? pv.Size() : 0;
+    case OBJ_STREAM:
+      return ((stream*)ptr)->length;
+    default:
+      return 0;
+  }
+}
+
+}  // namespace
+
+LazyFreeQueue::~LazyFreeQueue() {
+  stopped_ = true;
+  if (fiber_.joinable())
+    fiber_.join();
+}
+
+bool LazyFreeQueue::TryPush(PrimeValue* pv) {
+  if (threshold_ == 0 || NumElements(*pv) <= threshold_)
+    return false;
+
+  size_t bytes = pv->MallocUsed();
+  pending_bytes_ += bytes;
+  values_.push_back(Value{std::move(*pv), 0, bytes});
+  Start();
+  return true;
+}
+
+void LazyFreeQueue::Push(boost::intrusive_ptr<DbTable> table) {
+  size_t bytes = table->stats.obj_memory_usage + table->prime.mem_usage();
+  pending_bytes_ += bytes;
+  tables_.push_back(Table{std::move(table), bytes});
+  Start();
+}
+
+void LazyFreeQueue::Start() {
+  if (running_)
+    return;
+
+  // The previous fiber, if any, has finished already.
+  if (fiber_.joinable())
+    fiber_.join();
+
+  running_ = true;
+  fiber_ = ::boost::fibers::fiber([this] {
+    this_fiber::properties<FiberProps>().set_name("lazy_free");
+    while (!stopped_ && size() > 0) {
+      if (Step(kStepBudget)) {
+        this_fiber::yield();
+      } else {
+        this_fiber::sleep_for(kBlockedPollInterval);
+      }
+    }
+    running_ = false;
+  });
+}
+
+bool LazyFreeQueue::Step(size_t budget) {
+  bool progress = false;
+  size_t blocked = 0;
+
+  // The values go first, so that the tables do not pile up their large values in the queue.
+  while (budget > 0 && size() > 0) {
+    if (!values_.empty()) {
+      progress = true;
+      if (FreeElements(&values_.front(), &budget))
+        values_.pop_front();
+    } else if (FreeTableStep(&budget)) {
+      progress = true;
+    } else if (++blocked >= tables_.size()) {
+      break;
+    }
+  }
+  return progress;
+}
+
+bool LazyFreeQueue::FreeElements(Value* val, size_t* budget) {
+  PrimeValue& pv = val->pv;
+  void* ptr = pv.RObjPtr();
+  size_t size = NumElements(pv);
+
+  // Lists, dense sets and skiplists are freed incrementally, the rest at once.
+  if (size > *budget) {
+    bool partial = true;
+    switch (pv.ObjType()) {
+      case OBJ_LIST:
+        quicklistDelRange((quicklist*)ptr, 0, *budget);
+        break;
+      case OBJ_SET:
+        // Dense sets have about one entry per bucket.
+        if (pv.Encoding() == kEncodingStrMap2)
+          val->cursor = ((StringSet*)ptr)->ClearStep(val->cursor, *budget);
+        else
+          partial = false;
+        break;
+      case OBJ_HASH:
+        val->cursor = ((StringMap*)ptr)->ClearStep(val->cursor, *budget);
+        break;
+      case OBJ_ZSET: {
+        zset* zs = (zset*)ptr;
+        zslDeleteRangeByRank(zs->zsl, 1, *budget, zs->dict);
+        break;
+      }
+      default:
+        partial = false;
+    }
+
+    if (partial) {
+      Release(&val->bytes, val->bytes / size * *budget);
+      *budget = 0;
+      return false;
+    }
+  }
+
+  pv.Reset();
+  Release(&val->bytes, val->bytes);
+  *budget -= min(size, *budget);
+  return true;
+}
+
+bool LazyFreeQueue::FreeTableStep(size_t* budget) {
+  Table& table = tables_.front();
+
+  // A snapshot still traverses the table. Nobody else acquires it after the flush, so the
+  // traversal of the table never started yet.
+  if (table.ptr->use_count() > 1) {
+    DCHECK(!table_cursor_);
+    tables_.push_back(std::move(table));
+    tables_.pop_front();
+    return false;
+  }
+
+  // The large values move to values_ with their memory.
+  auto cb = [&](PrimeIterator it) {
+    Release(&table.bytes, it->first.MallocUsed() + it->second.MallocUsed());
+    if (!TryPush(&it->second))
+      it->second.Reset();
+    it->first.Reset();
+    *budget -= min<size_t>(1, *budget);
+  };
+
+  do {
+    table_cursor_ = table.ptr->prime.Traverse(table_cursor_, cb);
+  } while (table_cursor_ && *budget > 0);
+
+  if (!table_cursor_) {
+    Release(&table.bytes, table.bytes);
+    tables_.pop_front();
+    mi_heap_collect(ServerState::tlocal()->data_heap(), true);
+  }
+  return true;
+}
+
+}  // namespace dfly
@@ -0,0 +1,94 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+
+#include <boost/fiber/fiber.hpp>
+
+#include "server/table.h"
+
+namespace dfly {
+
+// Frees the large values and the flushed tables of a shard in the background, so that deleting
+// a container with millions of elements does not block the shard. They are detached from the
+// tables at once and freed by a fiber in small steps, which yields between the steps.
+// The tables that snapshots still traverse wait in the queue until the snapshots release them.
+class LazyFreeQueue {
+ public:
+  // Values of more than threshold elements are freed in the background, 0 disables it.
+  explicit LazyFreeQueue(uint32_t threshold) : threshold_(threshold) {
+  }
+
+  ~LazyFreeQueue();
+
+  // Takes over the value of a deleted key if it is large enough to be freed in the background.
+  // Returns false if pv should be freed inline.
+  bool TryPush(PrimeValue* pv);
+
+  // Takes over the reference to a flushed table.
+  void Push(boost::intrusive_ptr<DbTable> table);
+
+  // Frees about budget elements from the queue head. Also called inline to free memory
+  // faster than the fiber does. Returns false if nothing could be freed, i.e. only the tables
+  // that snapshots still refer to are left.
+  bool Step(size_t budget);
+
+  // Number of the values and tables that were not freed yet.
+  size_t size() const {
+    return values_.size() + tables_.size();
+  }
+
+  size_t num_tables() const {
+    return tables_.size();
+  }
+
+  // Estimated memory of the values and tables that were not freed yet.
+  size_t pending_bytes() const {
+    return pending_bytes_;
+  }
+
+ private:
+  struct Value {
+    PrimeValue pv;
+    uint32_t cursor = 0;  // of the incremental clearing of dense sets.
+    size_t bytes = 0;     // not freed yet.
+  };
+
+  struct Table {
+    boost::intrusive_ptr<DbTable> ptr;
+    size_t bytes = 0;
+  };
+
+  // Frees up to budget elements of the value, deducting them from the budget. Returns true once
+  // the value is freed.
+  bool FreeElements(Value* val, size_t* budget);
+
+  // Frees the entries of the front table, pushing its large values to values_. Pops the table
+  // once it is empty. Returns false if a snapshot still refers to the table, which is moved to
+  // the back of the queue.
+  bool FreeTableStep(size_t* budget);
+
+  // Deducts the freed bytes from the pending memory of an entry of the queue.
+  void Release(size_t* bytes, size_t freed) {
+    freed = std::min(freed, *bytes);
+    *bytes -= freed;
+    pending_bytes_ -= freed;
+  }
+
+  void Start();
+
+  uint32_t threshold_;
+  std::deque<Value> values_;
+  std::deque<Table> tables_;
+  PrimeTable::Cursor table_cursor_;
+  size_t pending_bytes_ = 0;
+
+  ::boost::fibers::fiber fiber_;
+  bool running_ = false;
+  bool stopped_ = false;
+};
+
+}  // namespace dfly
@@ -4,7 +4,9 @@
 #include "server/list_family.h"
 
 extern "C" {
+#include "redis/listpack.h"
 #include "redis/object.h"
+#include "redis/quicklist.h"
 #include "redis/sds.h"
 }
 
@@ -58,6 +60,10 @@ ABSL_FLAG(int32_t, list_max_listpack_size, -2, "Maximum listpack size, default i
 
 ABSL_FLAG(int32_t, list_compress_depth, 0, "Compress depth of the list. Default is no compression");
 
+ABSL_FLAG(string, list_compress_codec, "lzf",
+          "Codec of the compressed list nodes: lzf or lz4. LZ4 nodes are saved uncompressed "
+          "in the snapshots");
+
 namespace dfly {
 
 using namespace std;
@@ -106,6 +112,64 @@ bool ElemCompare(const quicklistEntry& entry, string_view elem) {
   return elem == an.Piece();
 }
 
+// Calls cb with the indices, counted from the end given by direction, of the elements of ql
+// that are equal to elem, until cb returns false or the first limit elements were scanned
+// (0 for all of them). The listpack nodes are searched with lpFindEncoded for the bytes of the
+// entry that encodes elem, so that the nodes without it are skipped as a whole and none of
+// their entries are decoded.
+template <typename Cb>
+void FindElements(quicklist* ql, string_view elem, int direction, unsigned long limit, Cb&& cb) {
+  const bool packed = elem.size() <= UINT32_MAX - LP_MAX_ENTRY_OVERHEAD;
+  string enc;
+  uint32_t enclen = 0;
+  if (packed) {
+    enc.resize(elem.size() + LP_MAX_ENTRY_OVERHEAD);
+    enclen = lpEncodeEntry(reinterpret_cast<const uint8_t*>(elem.data()), elem.size(),
+                           reinterpret_cast<uint8_t*>(enc.data()));
+  }
+
+  const bool from_head = direction == AL_START_HEAD;
+  unique_ptr<uint8_t[]> buf;  // For the compressed nodes.
+  size_t buf_size = 0;
+  absl::InlinedVector<unsigned, 16> matches;  // The offsets in the node, from its head.
+  unsigned long base = 0;                      // The elements of the nodes before node.
+
+  for (quicklistNode* node = from_head ? ql->head : ql->tail; node && (!limit || base < limit);
+       base += node->count, node = from_head ? node->next : node->prev) {
+    uint8_t* data = node->entry;
+    if (quicklistNodeIsCompressed(node)) {
+      if (buf_size < node->sz) {
+        buf_size = node->sz;
+        buf.reset(new uint8_t[buf_size]);
+      }
+      CHECK(quicklistDecompressTo(node, buf.get()));
+      data = buf.get();
+    }
+
+    matches.clear();
+    if (QL_NODE_IS_PLAIN(node)) {
+      if (node->sz == elem.size() && memcmp(data, elem.data(), elem.size()) == 0)
+        matches.push_back(0);
+    } else if (packed) {
+      unsigned offset = 0;
+      unsigned long skipped = 0;
+      uint8_t* p = lpFirst(data);
+      while ((p = lpFindEncoded(data, p, reinterpret_cast<uint8_t*>(enc.data()), enclen,
+                                &skipped))) {
+        offset += skipped;
+        matches.push_back(offset++);
+        p = lpNext(data, p);
+      }
+    }
+
+    for (size_t i = 0; i < matches.size(); ++i) {
+      unsigned long index = base + (from_head ? matches[i] : node->count - 1 - matches.rbegin()[i]);
+      if ((limit && index >= limit) || !cb(index))
+        return;
+    }
+  }
+}
+
 using FFResult = pair<PrimeKey, unsigned>;  // key, argument index.
 
 struct ShardFFResult {
@@ -176,9 +240,21 @@ OpResult<ShardFFResult> FindFirst(Transaction* trans) {
   return OpResult<ShardFFResult>{move(shard_result)};
 }
 
+string_view DirToSv(ListDir dir) {
+  return dir == ListDir::LEFT ? "LEFT" : "RIGHT";
+}
+
+optional<ListDir> ParseDir(string_view dir) {
+  if (dir == "LEFT")
+    return ListDir::LEFT;
+  if (dir == "RIGHT")
+    return ListDir::RIGHT;
+  return nullopt;
+}
+
 class BPopper {
  public:
-  explicit BPopper(ListDir dir);
+  explicit BPopper(ListDir dir, uint32_t count = 1);
 
   // Returns WRONG_TYPE, OK.
   // If OK is returned then use result() to fetch the value.
@@ -186,21 +262,31 @@ class BPopper {
 
   // returns (key, value) pair.
   auto result() const {
-    return make_pair<string_view, string_view>(key_, value_);
+    return make_pair<string_view, string_view>(key_, values_.front());
+  }
+
+  string_view key() const {
+    return key_;
+  }
+
+  // Up to count values popped from the key.
+  const StringVec& values() const {
+    return values_;
   }
 
  private:
   OpStatus Pop(Transaction* t, EngineShard* shard);
 
   ListDir dir_;
+  uint32_t count_;
 
   ShardFFResult ff_result_;
 
   string key_;
-  string value_;
+  StringVec values_;
 };
 
-BPopper::BPopper(ListDir dir) : dir_(dir) {
+BPopper::BPopper(ListDir dir, uint32_t count) : dir_(dir), count_(count) {
 }
 
 OpStatus BPopper::Run(Transaction* t, unsigned msec) {
@@ -264,11 +350,20 @@ OpStatus BPopper::Pop(Transaction* t, EngineShard* shard) {
     quicklist* ql = GetQL(it->second);
 
     db_slice.PreUpdate(t->db_index(), it);
-    value_ = ListPop(dir_, ql);
+    uint32_t count = min<size_t>(count_, quicklistCount(ql));
+    for (uint32_t i = 0; i < count; ++i) {
+      values_.push_back(ListPop(dir_, ql));
+    }
     db_slice.PostUpdate(t->db_index(), it, key_);
     if (quicklistCount(ql) == 0) {
       CHECK(shard->db_slice().Del(t->db_index(), it));
     }
+
+    // Replaying the blocking command could block, only the pop itself is journaled.
+    string count_str = absl::StrCat(count);
+    string_view journal_args[2] = {key_, count_str};
+    string_view cmd = dir_ == ListDir::LEFT ? "LPOP" : "RPOP";
+    RecordJournal(t->GetOpArgs(shard), cmd, ArgSlice{journal_args, count_ > 1 ? 2u : 1u});
   }
 
   return OpStatus::OK;
@@ -312,7 +407,7 @@ OpResult<string> OpMoveSingleShard(const OpArgs& op_args, string_view src, strin
     dest_it->second.ImportRObj(obj);
 
     // Insertion of dest could invalidate src_it. Find it again.
-    src_it = db_slice.GetTables(op_args.db_cntx.db_index).first->Find(src);
+    src_it = db_slice.GetPrimeTable(op_args.db_cntx.db_index)->Find(src);
   } else {
     if (dest_it->second.ObjType() != OBJ_LIST)
       return OpStatus::WRONG_TYPE;
@@ -334,6 +429,10 @@ OpResult<string> OpMoveSingleShard(const OpArgs& op_args, string_view src, strin
     CHECK(db_slice.Del(op_args.db_cntx.db_index, src_it));
   }
 
+  if (new_key && op_args.shard->blocking_controller()) {
+    op_args.shard->blocking_controller()->AwakeWatched(op_args.db_cntx.db_index, dest);
+  }
+
   return val;
 }
 
@@ -452,6 +551,118 @@ OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, ListDir dir, u
   return res;
 }
 
+// Moves an element between the lists like LMOVE, but waits for the source list while it does
+// not exist. Only the source key is watched, so the waiter is awakened by the pushes into it.
+class BMover {
+ public:
+  BMover(string_view src, string_view dest, ListDir src_dir, ListDir dest_dir)
+      : src_(src), dest_(dest), src_dir_(src_dir), dest_dir_(dest_dir) {
+  }
+
+  // Returns WRONG_TYPE, TIMED_OUT or OK, in which case value() holds the moved element.
+  OpStatus Run(Transaction* t, unsigned msec);
+
+  const string& value() const {
+    return value_;
+  }
+
+ private:
+  // Non-concluding hop that peeks the source element and checks the type of the destination.
+  OpResult<string> Find(Transaction* t);
+
+  OpStatus Move(Transaction* t, EngineShard* shard);
+
+  string_view src_, dest_;
+  ListDir src_dir_, dest_dir_;
+  string value_;
+};
+
+OpStatus BMover::Run(Transaction* t, unsigned msec) {
+  using time_point = Transaction::time_point;
+
+  time_point tp =
+      msec ? chrono::steady_clock::now() + chrono::milliseconds(msec) : time_point::max();
+  t->Schedule();
+
+  OpResult<string> result = Find(t);
+  if (result.status() == OpStatus::KEY_NOTFOUND && !t->IsMulti()) {
+    auto* stats = ServerState::tl_connection_stats();
+
+    ++stats->num_blocked_clients;
+    bool wait_succeeded = t->WaitOnWatch(tp, ArgSlice{&src_, 1});
+    --stats->num_blocked_clients;
+
+    if (!wait_succeeded)
+      return OpStatus::TIMED_OUT;
+
+    result = Find(t);
+  }
+
+  if (!result) {
+    auto cb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
+    t->Execute(std::move(cb), true);
+
+    return result.status() == OpStatus::KEY_NOTFOUND ? OpStatus::TIMED_OUT : result.status();
+  }
+
+  value_ = std::move(*result);
+  auto cb = [this](Transaction* t, EngineShard* shard) { return Move(t, shard); };
+  t->Execute(std::move(cb), true);
+
+  return OpStatus::OK;
+}
+
+OpResult<string> BMover::Find(Transaction* t) {
+  OpResult<string> src_res = OpStatus::KEY_NOTFOUND;
+  OpStatus dest_status = OpStatus::OK;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    for (string_view key : t->ShardArgsInShard(shard->shard_id())) {
+      if (key == src_) {
+        src_res = Peek(op_args, src_, src_dir_, true);
+      } else if (key == dest_) {
+        auto res = shard->db_slice().Find(op_args.db_cntx, dest_, OBJ_LIST);
+        if (res.status() == OpStatus::WRONG_TYPE)
+          dest_status = OpStatus::WRONG_TYPE;
+      }
+    }
+    return OpStatus::OK;
+  };
+  t->Execute(std::move(cb), false);
+
+  if (src_res && dest_status != OpStatus::OK)
+    return dest_status;
+  return src_res;
+}
+
+OpStatus BMover::Move(Transaction* t, EngineShard* shard) {
+  OpArgs op_args = t->GetOpArgs(shard);
+
+  // Replaying the blocking command could block, only the move itself is journaled.
+  if (t->unique_shard_cnt() == 1) {
+    OpMoveSingleShard(op_args, src_, dest_, src_dir_, dest_dir_);
+
+    string_view journal_args[4] = {src_, dest_, DirToSv(src_dir_), DirToSv(dest_dir_)};
+    RecordJournal(op_args, "LMOVE", ArgSlice{journal_args, 4});
+    return OpStatus::OK;
+  }
+
+  string_view key = t->ShardArgsInShard(shard->shard_id()).front();
+  if (key == src_) {
+    OpPop(op_args, src_, src_dir_, 1, false);
+    RecordJournal(op_args, src_dir_ == ListDir::LEFT ? "LPOP" : "RPOP", ArgSlice{&src_, 1});
+  } else {
+    string_view val = value_;
+    OpPush(op_args, dest_, dest_dir_, false, absl::Span<string_view>{&val, 1});
+
+    string_view journal_args[2] = {dest_, val};
+    RecordJournal(op_args, dest_dir_ == ListDir::LEFT ? "LPUSH" : "RPUSH",
+                  ArgSlice{journal_args, 2});
+  }
+  return OpStatus::OK;
+}
+
 }  // namespace
 
 void ListFamily::LPush(CmdArgList args, ConnectionContext* cntx) {
@@ -711,24 +922,108 @@ void ListFamily::LMove(CmdArgList args, ConnectionContext* cntx) {
   ToUpper(&args[3]);
   ToUpper(&args[4]);
 
-  ListDir src_dir;
-  ListDir dest_dir;
-  if (src_dir_str == "LEFT") {
-    src_dir = ListDir::LEFT;
-  } else if (src_dir_str == "RIGHT") {
-    src_dir = ListDir::RIGHT;
-  } else {
+  optional<ListDir> src_dir = ParseDir(src_dir_str);
+  optional<ListDir> dest_dir = ParseDir(dest_dir_str);
+  if (!src_dir || !dest_dir) {
     return (*cntx)->SendError(kSyntaxErr);
   }
-  if (dest_dir_str == "LEFT") {
-    dest_dir = ListDir::LEFT;
-  } else if (dest_dir_str == "RIGHT") {
-    dest_dir = ListDir::RIGHT;
-  } else {
+
+  MoveGeneric(cntx, src, dest, *src_dir, *dest_dir);
+}
+
+void ListFamily::BLMove(CmdArgList args, ConnectionContext* cntx) {
+  string_view src = ArgS(args, 1);
+  string_view dest = ArgS(args, 2);
+
+  ToUpper(&args[3]);
+  ToUpper(&args[4]);
+
+  optional<ListDir> src_dir = ParseDir(ArgS(args, 3));
+  optional<ListDir> dest_dir = ParseDir(ArgS(args, 4));
+  if (!src_dir || !dest_dir) {
     return (*cntx)->SendError(kSyntaxErr);
   }
 
-  MoveGeneric(cntx, src, dest, src_dir, dest_dir);
+  float timeout;
+  if (!absl::SimpleAtof(ArgS(args, 5), &timeout)) {
+    return (*cntx)->SendError("timeout is not a float or out of range");
+  }
+  if (timeout < 0) {
+    return (*cntx)->SendError("timeout is negative");
+  }
+
+  BMover mover(src, dest, *src_dir, *dest_dir);
+  OpStatus result = mover.Run(cntx->transaction, unsigned(timeout * 1000));
+
+  switch (result) {
+    case OpStatus::OK:
+      return (*cntx)->SendBulkString(mover.value());
+    case OpStatus::TIMED_OUT:
+      return (*cntx)->SendNull();
+    default:
+      return (*cntx)->SendError(result);
+  }
+}
+
+void ListFamily::BLMPop(CmdArgList args, ConnectionContext* cntx) {
+  float timeout;
+  if (!absl::SimpleAtof(ArgS(args, 1), &timeout)) {
+    return (*cntx)->SendError("timeout is not a float or out of range");
+  }
+  if (timeout < 0) {
+    return (*cntx)->SendError("timeout is negative");
+  }
+
+  // The number of keys was validated when the keys of the transaction were determined.
+  uint32_t num_keys = 0;
+  CHECK(absl::SimpleAtoi(ArgS(args, 2), &num_keys));
+  if (num_keys == 0) {
+    return (*cntx)->SendError("numkeys should be greater than 0");
+  }
+
+  size_t pos = 3 + num_keys;
+  if (pos >= args.size()) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  ToUpper(&args[pos]);
+  optional<ListDir> dir = ParseDir(ArgS(args, pos));
+  if (!dir) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  uint32_t count = 1;
+  if (++pos < args.size()) {
+    ToUpper(&args[pos]);
+    if (pos + 2 != args.size() || ArgS(args, pos) != "COUNT") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    if (!absl::SimpleAtoi(ArgS(args, pos + 1), &count) || count == 0) {
+      return (*cntx)->SendError("count should be greater than 0");
+    }
+  }
+
+  BPopper popper(*dir, count);
+  OpStatus result = popper.Run(cntx->transaction, unsigned(timeout * 1000));
+
+  switch (result) {
+    case OpStatus::OK:
+      break;
+    case OpStatus::WRONG_TYPE:
+      return (*cntx)->SendError(kWrongTypeErr);
+    case OpStatus::TIMED_OUT:
+      return (*cntx)->SendNullArray();
+    default:
+      LOG(ERROR) << "Unexpected error " << result;
+      return (*cntx)->SendNullArray();
+  }
+
+  (*cntx)->StartArray(2);
+  (*cntx)->SendBulkString(popper.key());
+  (*cntx)->StartArray(popper.values().size());
+  for (const auto& val : popper.values()) {
+    (*cntx)->SendBulkString(val);
+  }
 }
 
 void ListFamily::BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx) {
@@ -959,33 +1254,15 @@ OpResult<vector<uint32_t>> ListFamily::OpPos(const OpArgs& op_args, std::string_
   }
 
   quicklist* ql = GetQL(it_res.value()->second);
-  quicklistIter* ql_iter = quicklistGetIterator(ql, direction);
-  quicklistEntry entry;
-
-  int index = 0;
   int matched = 0;
   vector<uint32_t> matches;
-  string str;
 
-  while (quicklistNext(ql_iter, &entry) && (max_len == 0 || index < max_len)) {
-    if (entry.value) {
-      str.assign(reinterpret_cast<char*>(entry.value), entry.sz);
-    } else {
-      str = absl::StrCat(entry.longval);
-    }
-    if (str == element) {
-      matched++;
-      auto k = (direction == AL_START_TAIL) ? ql->count - index - 1 : index;
-      if (matched >= rank) {
-        matches.push_back(k);
-        if (count && matched - rank + 1 >= count) {
-          break;
-        }
-      }
-    }
-    index++;
-  }
-  quicklistReleaseIterator(ql_iter);
+  FindElements(ql, element, direction, max_len, [&](unsigned long index) {
+    if (++matched < rank)
+      return true;
+    matches.push_back(direction == AL_START_TAIL ? ql->count - index - 1 : index);
+    return count == 0 || matched - rank + 1 < count;
+  });
   return matches;
 }
 
@@ -1036,36 +1313,38 @@ OpResult<uint32_t> ListFamily::OpRem(const OpArgs& op_args, string_view key, str
   quicklist* ql = GetQL(it->second);
 
   int iter_direction = AL_START_HEAD;
-  long long index = 0;
   if (count < 0) {
     count = -count;
     iter_direction = AL_START_TAIL;
-    index = -1;
   }
 
-  quicklistIter* qiter = quicklistGetIteratorAtIdx(ql, iter_direction, index);
-  quicklistEntry entry;
-  unsigned removed = 0;
-  const uint8_t* elem_ptr = reinterpret_cast<const uint8_t*>(elem.data());
-
+  // The indices from the head of the elements to remove, found before the list is changed.
+  vector<unsigned long> found;
+  FindElements(ql, elem, iter_direction, 0, [&](unsigned long index) {
+    found.push_back(iter_direction == AL_START_TAIL ? ql->count - index - 1 : index);
+    return count == 0 || found.size() < size_t(count);
+  });
+  if (found.empty())
+    return 0;
+
+  // The elements are deleted from the tail, so that the indices of the remaining ones stay
+  // valid, and the adjacent ones are deleted together.
+  sort(found.begin(), found.end(), greater<>());
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  while (quicklistNext(qiter, &entry)) {
-    if (quicklistCompare(&entry, elem_ptr, elem.size())) {
-      quicklistDelEntry(qiter, &entry);
-      removed++;
-      if (count && removed == count)
-        break;
-    }
+  for (size_t i = 0; i < found.size();) {
+    size_t j = i + 1;
+    while (j < found.size() && found[j] + 1 == found[j - 1])
+      ++j;
+    quicklistDelRange(ql, found[j - 1], j - i);
+    i = j;
   }
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
-  quicklistReleaseIterator(qiter);
-
   if (quicklistCount(ql) == 0) {
     CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
   }
 
-  return removed;
+  return found.size();
 }
 
 OpStatus ListFamily::OpSet(const OpArgs& op_args, string_view key, string_view elem, long index) {
@@ -1173,6 +1452,11 @@ using CI = CommandId;
 #define HFUNC(x) SetHandler(&ListFamily::x)
 
 void ListFamily::Register(CommandRegistry* registry) {
+  string codec = GetFlag(FLAGS_list_compress_codec);
+  LOG_IF(WARNING, codec != "lzf" && codec != "lz4") << "Unknown list_compress_codec " << codec;
+  quicklistSetCompressCodec(codec == "lz4" ? QUICKLIST_NODE_ENCODING_LZ4
+                                           : QUICKLIST_NODE_ENCODING_LZF);
+
   *registry << CI{"LPUSH", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(LPush)
             << CI{"LPUSHX", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(LPushX)
             << CI{"LPOP", CO::WRITE | CO::FAST | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(LPop)
@@ -1180,8 +1464,10 @@ void ListFamily::Register(CommandRegistry* registry) {
             << CI{"RPUSHX", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(RPushX)
             << CI{"RPOP", CO::WRITE | CO::FAST | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(RPop)
             << CI{"RPOPLPUSH", CO::WRITE | CO::FAST | CO::DENYOOM, 3, 1, 2, 1}.HFUNC(RPopLPush)
-            << CI{"BLPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BLPop)
-            << CI{"BRPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BRPop)
+            << CI{"BLPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::NO_AUTOJOURNAL, -3, 1, -2, 1}
+                   .HFUNC(BLPop)
+            << CI{"BRPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::NO_AUTOJOURNAL, -3, 1, -2, 1}
+                   .HFUNC(BRPop)
             << CI{"LLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(LLen)
             << CI{"LPOS", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(LPos)
             << CI{"LINDEX", CO::READONLY, 3, 1, 1, 1}.HFUNC(LIndex)
@@ -1190,7 +1476,14 @@ void ListFamily::Register(CommandRegistry* registry) {
             << CI{"LSET", CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(LSet)
             << CI{"LTRIM", CO::WRITE, 4, 1, 1, 1}.HFUNC(LTrim)
             << CI{"LREM", CO::WRITE, 4, 1, 1, 1}.HFUNC(LRem)
-            << CI{"LMOVE", CO::WRITE | CO::DENYOOM, 5, 1, 2, 1}.HFUNC(LMove);
+            << CI{"LMOVE", CO::WRITE | CO::DENYOOM, 5, 1, 2, 1}.HFUNC(LMove)
+            << CI{"BLMOVE", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::NO_AUTOJOURNAL, 6, 1, 2,
+                  1}
+                   .HFUNC(BLMove)
+            << CI{"BLMPOP",
+                  CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::NO_AUTOJOURNAL | CO::VARIADIC_KEYS,
+                  -5, 3, 3, 1}
+                   .HFUNC(BLMPop);
 }
 
 }  // namespace dfly
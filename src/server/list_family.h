@@ -38,6 +38,8 @@ class ListFamily {
   static void LSet(CmdArgList args, ConnectionContext* cntx);
   static void RPopLPush(CmdArgList args, ConnectionContext* cntx);
   static void LMove(CmdArgList args, ConnectionContext* cntx);
+  static void BLMove(CmdArgList args, ConnectionContext* cntx);
+  static void BLMPop(CmdArgList args, ConnectionContext* cntx);
 
   static void PopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx);
   static void PushGeneric(ListDir dir, bool skip_notexist, CmdArgList args,
@@ -4,7 +4,9 @@
 
 #include "server/list_family.h"
 
+#include <absl/flags/reflection.h>
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -17,11 +19,16 @@
 #include "server/transaction.h"
 
 using namespace testing;
+using absl::SetFlag;
 using namespace std;
 using namespace util;
 namespace this_fiber = ::boost::this_fiber;
 namespace fibers = ::boost::fibers;
 
+ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
+ABSL_DECLARE_FLAG(int32_t, list_compress_depth);
+ABSL_DECLARE_FLAG(uint32_t, list_compress_idle_beats);
+
 namespace dfly {
 
 class ListFamilyTest : public BaseFamilyTest {
@@ -439,6 +446,34 @@ TEST_F(ListFamilyTest, Lset) {
   ASSERT_THAT(Run({"lset", kKey2, "1", "foo"}), ErrArg("index out of range"));
 }
 
+TEST_F(ListFamilyTest, LongListIndex) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_list_max_listpack_size, 4);
+
+  // Long enough for the quicklist to index its nodes.
+  vector<string> args{"rpush", kKey1};
+  for (unsigned i = 0; i < 1000; ++i)
+    args.push_back(absl::StrCat(i));
+  Run(absl::MakeSpan(args));
+
+  EXPECT_EQ("500", Run({"lindex", kKey1, "500"}));
+  EXPECT_EQ("998", Run({"lindex", kKey1, "-2"}));
+
+  // Pushes and pops at the ends keep the index.
+  Run({"lpush", kKey1, "a", "b"});
+  Run({"rpop", kKey1});
+  Run({"ltrim", kKey1, "1", "-1"});
+  EXPECT_EQ("a", Run({"lindex", kKey1, "0"}));
+  EXPECT_EQ("500", Run({"lindex", kKey1, "501"}));
+  EXPECT_THAT(Run({"lrange", kKey1, "990", "991"}).GetVec(), ElementsAre("989", "990"));
+
+  ASSERT_EQ("OK", Run({"lset", kKey1, "700", "x"}));
+  EXPECT_THAT(Run({"linsert", kKey1, "before", "x", "y"}), IntArg(1000));
+  EXPECT_EQ("y", Run({"lindex", kKey1, "700"}));
+  EXPECT_EQ("x", Run({"lindex", kKey1, "701"}));
+  EXPECT_EQ("998", Run({"lindex", kKey1, "-1"}));
+}
+
 TEST_F(ListFamilyTest, LPos) {
   auto resp = Run({"rpush", kKey1, "1", "a", "b", "1", "1", "a", "1"});
   ASSERT_THAT(resp, IntArg(7));
@@ -460,6 +495,70 @@ TEST_F(ListFamilyTest, LPos) {
   ASSERT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(3), IntArg(4)));
 }
 
+TEST_F(ListFamilyTest, LongListSearch) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_list_max_listpack_size, 8);
+  SetFlag(&FLAGS_list_compress_depth, 1);
+
+  // Integers and strings spread over many nodes, the inner ones compressed.
+  vector<string> model;
+  for (unsigned i = 0; i < 300; ++i)
+    model.push_back(i % 3 ? absl::StrCat("item-", i % 20, "-padding") : absl::StrCat(i % 30));
+  vector<string> args{"rpush", kKey1};
+  args.insert(args.end(), model.begin(), model.end());
+  Run(absl::MakeSpan(args));
+
+  auto positions = [&](string_view elem) {
+    vector<int64_t> res;
+    for (size_t i = 0; i < model.size(); ++i)
+      if (model[i] == elem)
+        res.push_back(i);
+    return res;
+  };
+  auto int_args = [](const RespVec& vec) {
+    vector<int64_t> res;
+    for (const auto& e : vec)
+      res.push_back(get<int64_t>(e.u));
+    return res;
+  };
+
+  vector<int64_t> expected = positions("12");
+  ASSERT_EQ(10u, expected.size());
+  auto resp = Run({"lpos", kKey1, "12", "COUNT", "0"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(expected, int_args(resp.GetVec()));
+  EXPECT_THAT(Run({"lpos", kKey1, "12", "RANK", "3"}), IntArg(expected[2]));
+  resp = Run({"lpos", kKey1, "12", "RANK", "-2", "COUNT", "3"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(vector<int64_t>({expected[8], expected[7], expected[6]}), int_args(resp.GetVec()));
+  resp = Run({"lpos", kKey1, "12", "COUNT", "0", "MAXLEN", "100"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(vector<int64_t>(expected.begin(), expected.begin() + 3), int_args(resp.GetVec()));
+  EXPECT_THAT(Run({"lpos", kKey1, "item-7-padding", "RANK", "-1"}),
+              IntArg(positions("item-7-padding").back()));
+  EXPECT_THAT(Run({"lpos", kKey1, "item-7"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"lpos", kKey1, "012"}), ArgType(RespExpr::NIL));
+
+  // Removes from both ends, including adjacent elements.
+  Run({"linsert", kKey1, "before", "item-1-padding", "0"});
+  model.insert(model.begin() + 1, "0");
+  EXPECT_THAT(Run({"lrem", kKey1, "3", "0"}), IntArg(3));
+  for (unsigned removed = 0, i = 0; removed < 3; ++removed) {
+    i = find(model.begin() + i, model.end(), "0") - model.begin();
+    model.erase(model.begin() + i);
+  }
+  EXPECT_THAT(Run({"lrem", kKey1, "-2", "item-5-padding"}), IntArg(2));
+  for (unsigned removed = 0; removed < 2; ++removed)
+    model.erase(model.begin() + positions("item-5-padding").back());
+  EXPECT_THAT(Run({"lrem", kKey1, "0", "item-4-padding"}), IntArg(10));
+  model.erase(remove(model.begin(), model.end(), "item-4-padding"), model.end());
+  EXPECT_THAT(Run({"lrem", kKey1, "0", "missing"}), IntArg(0));
+
+  resp = Run({"lrange", kKey1, "0", "-1"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(model, StrArray(resp));
+}
+
 TEST_F(ListFamilyTest, RPopLPush) {
   // src and dest are diffrent keys
   auto resp = Run({"rpush", kKey1, "1", "a", "b", "1", "2", "3", "4"});
@@ -661,4 +760,140 @@ TEST_F(ListFamilyTest, TwoQueueBug451) {
     f.join();
 }
 
+TEST_F(ListFamilyTest, BLPopManyWaiters) {
+  // Every pushed element wakes exactly one waiter, in the order they blocked.
+  constexpr unsigned kNumWaiters = 8;
+  vector<RespExpr> resps(kNumWaiters);
+  vector<fibers::fiber> fbs;
+
+  for (unsigned i = 0; i < kNumWaiters; ++i) {
+    fbs.push_back(pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&, i] {
+      resps[i] = Run(absl::StrCat("w", i), {"blpop", kKey1, "0"});
+    }));
+    while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients <= i)
+      this_fiber::sleep_for(1ms);
+  }
+
+  vector<string> vals;
+  for (unsigned i = 0; i < kNumWaiters; ++i)
+    vals.push_back(absl::StrCat(i));
+  vector<string_view> cmd{"rpush", kKey1};
+  cmd.insert(cmd.end(), vals.begin(), vals.end());
+  pp_->at(1)->Await([&] { Run("pusher", absl::MakeSpan(cmd)); });
+
+  for (auto& fb : fbs)
+    fb.join();
+
+  for (unsigned i = 0; i < kNumWaiters; ++i) {
+    ASSERT_THAT(resps[i], ArrLen(2));
+    EXPECT_THAT(resps[i].GetVec(), ElementsAre(kKey1, vals[i]));
+  }
+  EXPECT_EQ(0, CheckedInt({"exists", kKey1}));
+  EXPECT_THAT(Run({"debug", "watched"}), ArrLen(0));
+}
+
+TEST_F(ListFamilyTest, BLMove) {
+  EXPECT_THAT(Run({"blmove", kKey1, kKey2, "LEFT", "RIGHT", "0.01"}), ArgType(RespExpr::NIL));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+  ASSERT_FALSE(IsLocked(0, kKey2));
+
+  Run({"rpush", kKey1, "a", "b"});
+  EXPECT_EQ(Run({"blmove", kKey1, kKey2, "LEFT", "RIGHT", "0"}), "a");
+  EXPECT_EQ(Run({"blmove", kKey1, kKey1, "RIGHT", "LEFT", "0"}), "b");
+  EXPECT_THAT(Run({"blmove", kKey1, kKey2, "UP", "RIGHT", "0"}), ErrArg("syntax error"));
+
+  Run({"set", kKey3, "foo"});
+  EXPECT_THAT(Run({"blmove", kKey1, kKey3, "LEFT", "RIGHT", "0"}), ErrArg("WRONGTYPE"));
+
+  Run({"del", kKey1, kKey2});
+  RespExpr resp;
+  auto fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmove", kKey1, kKey2, "RIGHT", "LEFT", "0"});
+  });
+  WaitUntilLocked(0, kKey1);
+
+  // Pushing into the destination does not wake the waiter.
+  pp_->at(1)->Await([&] { Run({"lpush", kKey2, "x"}); });
+  pp_->at(1)->Await([&] { Run({"rpush", kKey1, "1", "2"}); });
+  fb.join();
+
+  EXPECT_EQ(resp, "2");
+  EXPECT_THAT(Run({"lrange", kKey1, "0", "-1"}), "1");
+  EXPECT_THAT(Run({"lrange", kKey2, "0", "-1"}).GetVec(), ElementsAre("2", "x"));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+  ASSERT_FALSE(IsLocked(0, kKey2));
+}
+
+TEST_F(ListFamilyTest, BLMPop) {
+  EXPECT_THAT(Run({"blmpop", "0.01", "2", kKey1, kKey2, "LEFT"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"blmpop", "0", "2", kKey1, kKey2, "UP"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"blmpop", "0", "1", kKey1, "LEFT", "COUNT", "0"}), ErrArg("count"));
+
+  Run({"rpush", kKey2, "a", "b", "c"});
+  auto resp = Run({"blmpop", "0", "2", kKey1, kKey2, "RIGHT", "COUNT", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], kKey2);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("c", "b"));
+
+  auto fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmpop", "0", "2", kKey1, kKey3, "LEFT", "COUNT", "5"});
+  });
+  WaitUntilLocked(0, kKey1);
+
+  pp_->at(1)->Await([&] { Run({"rpush", kKey3, "1", "2"}); });
+  fb.join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], kKey3);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("1", "2"));
+  EXPECT_EQ(0, CheckedInt({"exists", kKey3}));
+}
+
+TEST_F(ListFamilyTest, CompressIdle) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_list_max_listpack_size, 1);
+  SetFlag(&FLAGS_list_compress_idle_beats, 1);
+
+  Run({"rpush", kKey1, "head", string(500, 'a'), string(500, 'b'), "tail"});
+  shard_set->TEST_EnableHeartBeat();
+
+  // The nodes between the head and the tail get compressed once the list stays idle.
+  Metrics metrics;
+  for (unsigned i = 0; i < 100; ++i) {
+    metrics = service_->server_family().GetMetrics();
+    if (metrics.shard_stats.list_compressed_nodes > 0)
+      break;
+    this_fiber::sleep_for(10ms);
+  }
+  EXPECT_EQ(2u, metrics.shard_stats.list_compressed_nodes);
+  EXPECT_GT(metrics.shard_stats.list_compress_saved_bytes, 900u);
+
+  EXPECT_EQ(string(500, 'b'), Run({"lindex", kKey1, "2"}));
+
+  // The compressed nodes become the head and the tail once their neighbours are popped.
+  EXPECT_EQ("head", Run({"lpop", kKey1}));
+  EXPECT_EQ("tail", Run({"rpop", kKey1}));
+  EXPECT_EQ(string(500, 'a'), Run({"lpop", kKey1}));
+  EXPECT_EQ(string(500, 'b'), Run({"rpop", kKey1}));
+}
+
+TEST_F(ListFamilyTest, QueueNodeReuse) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_list_max_listpack_size, 2);
+
+  // Every node that is popped empty returns to the pool and is taken by a later push.
+  for (unsigned round = 0; round < 3; ++round) {
+    for (unsigned i = 0; i < 100; ++i) {
+      Run({"lpush", kKey1, absl::StrCat(round, ":", i)});
+    }
+    for (unsigned i = 0; i < 100; ++i) {
+      ASSERT_EQ(absl::StrCat(round, ":", i), Run({"rpop", kKey1}));
+    }
+    EXPECT_EQ(0, CheckedInt({"llen", kKey1}));
+  }
+
+  Run({"rpush", kKey2, "a", "b", "c"});
+  EXPECT_THAT(Run({"lrange", kKey2, "0", "-1"}), RespArray(ElementsAre("a", "b", "c")));
+}
+
 }  // namespace dfly
@@ -10,6 +10,7 @@ extern "C" {
 
 #include <absl/cleanup/cleanup.h>
 #include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_format.h>
 #include <xxhash.h>
 
@@ -20,19 +21,30 @@ extern "C" {
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/error.h"
+#include "io/io.h"
 #include "server/bitops_family.h"
+#include "server/bloom_family.h"
+#include "server/cluster/cluster_config.h"
 #include "server/conn_context.h"
 #include "server/error.h"
 #include "server/generic_family.h"
+#include "server/hll_family.h"
 #include "server/hset_family.h"
 #include "server/json_family.h"
+#include "server/keyspace_events.h"
 #include "server/list_family.h"
+#include "server/profiler.h"
 #include "server/script_mgr.h"
+#include "server/search/search_family.h"
 #include "server/server_state.h"
 #include "server/set_family.h"
+#include "server/sketch_family.h"
 #include "server/stream_family.h"
 #include "server/string_family.h"
+#include "server/timeseries_family.h"
+#include "server/tracking_table.h"
 #include "server/transaction.h"
+#include "server/tx_trace.h"
 #include "server/version.h"
 #include "server/zset_family.h"
 #include "util/html/sorted_table.h"
@@ -42,8 +54,39 @@ using namespace std;
 
 ABSL_FLAG(uint32_t, port, 6379, "Redis port");
 ABSL_FLAG(uint32_t, memcache_port, 0, "Memcached port");
+ABSL_FLAG(uint32_t, pipeline_squash, 4,
+          "Minimal number of consecutive pipelined GET/SET commands that are executed together, "
+          "in one hop per shard. 0 disables squashing");
+ABSL_FLAG(uint32_t, migrate_connections_threshold, 64,
+          "Moves a connection to the thread of the shard that its single-shard commands use the "
+          "most, once that shard is ahead of the others by this many commands. Commands on a "
+          "local shard do not hop between threads. 0 disables migration");
+ABSL_FLAG(uint32_t, num_shards, 0,
+          "Number of shards, at most the number of threads, otherwise the server does not start. "
+          "Keeping it fixed keeps the mapping of the keys to the shards, and thus the snapshot "
+          "files and the replication offsets, when the number of threads changes. 0 uses all "
+          "the threads but one");
+ABSL_FLAG(int64_t, slowlog_log_slower_than, 10000,
+          "Commands that take longer than this many microseconds go to SLOWLOG. A negative "
+          "value disables it, 0 logs every command");
+ABSL_FLAG(uint32_t, slowlog_max_len, 128, "Maximal number of entries of SLOWLOG per thread");
+ABSL_FLAG(uint32_t, tx_trace_sample, 0,
+          "Traces the phases of 1 in this many transactions, which /txz shows by command and "
+          "shard, and /txz?trace dumps in Chrome trace format. 0 disables tracing");
+ABSL_FLAG(string, db_maxmemory, "",
+          "Memory quotas of the databases, e.g. '0:1gb,3:200mb'. A database over its quota fails "
+          "the writes of new keys with OOM, or evicts its own keys in cache mode");
+ABSL_FLAG(string, db_max_ops, "",
+          "Limits of the commands per second on the databases, e.g. '1:5000,2:100'. Each thread "
+          "admits its share of the limit, the commands above it fail");
+ABSL_FLAG(uint32_t, busy_poll_usec, 0,
+          "If positive, the threads keep polling for this many microseconds after their last "
+          "request instead of sleeping, which saves the wake-up latency at low load at the cost "
+          "of the cpu. 0 - sleep when idle");
 
 ABSL_DECLARE_FLAG(string, requirepass);
+ABSL_DECLARE_FLAG(uint32_t, dbnum);
+ABSL_DECLARE_FLAG(string, maxmemory_policy);
 
 namespace dfly {
 
@@ -65,22 +108,16 @@ namespace h2 = boost::beast::http;
 namespace {
 
 DEFINE_VARZ(VarzMapAverage, request_latency_usec);
+DEFINE_VARZ(VarzMapAverage, script_latency_usec);
 
 std::optional<VarzFunction> engine_varz;
 
 constexpr size_t kMaxThreadSize = 1024;
 
-// Unwatch all keys for a connection and unregister from DbSlices.
-// Used by UNWATCH, DICARD and EXEC.
+// Unwatch all keys for a connection. Used by UNWATCH, DICARD and EXEC.
+// The shards do not know the watched keys, hence there is nothing to unregister.
 void UnwatchAllKeys(ConnectionContext* cntx) {
-  auto& exec_info = cntx->conn_state.exec_info;
-  if (!exec_info.watched_keys.empty()) {
-    auto cb = [&](EngineShard* shard) {
-      shard->db_slice().UnregisterConnectionWatches(&exec_info);
-    };
-    shard_set->RunBriefInParallel(std::move(cb));
-  }
-  exec_info.ClearWatched();
+  cntx->conn_state.exec_info.ClearWatched();
 }
 
 void MultiCleanup(ConnectionContext* cntx) {
@@ -171,22 +208,115 @@ void DispatchMonitorIfNeeded(bool admin_cmd, ConnectionContext* connection, CmdA
   // We are not sending any admin command in the monitor, and we do not want to
   // do any processing if we don't have any waiting connections with monitor
   // enabled on them - see https://redis.io/commands/monitor/
-  const auto& my_monitors = ServerState::tlocal()->Monitors();
-  if (!(my_monitors.Empty() || admin_cmd)) {
-    //  We have connections waiting to get the info on the last command, send it to them
-    auto monitor_msg = MakeMonitorMessage(connection->conn_state, connection->owner(), args);
-    // Note that this is accepted by value for lifetime reasons
-    // we want to have our own copy since we are assuming that
-    // 1. there will be not to many connections that we in monitor state
-    // 2. we need to have for each of them each own copy for thread safe reasons
-    VLOG(1) << "sending command '" << monitor_msg << "' to the clients that registered on it";
-    shard_set->pool()->DispatchBrief(
-        [msg = std::move(monitor_msg)](unsigned idx, util::ProactorBase*) {
-          ServerState::tlocal()->Monitors().Send(msg);
-        });
+  auto& my_monitors = ServerState::tlocal()->Monitors();
+  if (my_monitors.Empty() || admin_cmd)
+    return;
+
+  // The message is formatted only if the filter of some monitor picks the command.
+  my_monitors.Dispatch(connection->conn_state.db_index, args, [&] {
+    return MakeMonitorMessage(connection->conn_state, connection->owner(), args);
+  });
+}
+
+// A pipelined GET, SET (without options) or HSET that runs directly in the shard thread,
+// as a part of a single hop with other such commands.
+struct SquashedCmd {
+  enum Kind : uint8_t { GET, SET, HSET };
+
+  CmdArgList args;
+  ShardId sid = 0;
+  Kind kind = GET;
+
+  // Filled by the shard.
+  bool executed = false;
+  OpStatus status = OpStatus::OK;
+  string value;
+  uint32_t added = 0;  // HSET only.
+};
+
+bool IsSquashable(CmdArgList args) {
+  string_view cmd = ArgS(args, 0);
+  return (cmd == "GET" && args.size() == 2) || (cmd == "SET" && args.size() == 3) ||
+         (cmd == "HSET" && args.size() >= 4 && args.size() % 2 == 0);
+}
+
+// Runs the commands of a single shard in order. Similarly to Transaction::RunQuickie,
+// a command runs only if its key is not locked. Stops at the first one that can not run,
+// so that the rest are dispatched normally, preserving the order of commands on each key.
+void RunSquashedInShard(DbIndex db_index, const vector<SquashedCmd*>& cmds) {
+  EngineShard* shard = EngineShard::tlocal();
+  auto& db_slice = shard->db_slice();
+  if (!db_slice.IsDbValid(db_index))
+    return;
+
+  OpArgs op_args{shard, 0, DbContext{db_index, GetCurrentTimeMs()}};
+
+  for (SquashedCmd* cmd : cmds) {
+    string_view key = ArgS(cmd->args, 1);
+    auto mode = cmd->kind == SquashedCmd::GET ? IntentLock::SHARED : IntentLock::EXCLUSIVE;
+    KeyLockArgs lock_args{db_index, ArgSlice{&key, 1}, 1};
+    if (!shard->shard_lock()->Check(mode) || !db_slice.CheckLock(mode, lock_args))
+      return;
+
+    if (cmd->kind == SquashedCmd::SET) {
+      SetCmd sg{op_args};
+      cmd->status = sg.Set(SetCmd::SetParams{}, key, ArgS(cmd->args, 2));
+    } else if (cmd->kind == SquashedCmd::HSET) {
+      OpResult<uint32_t> res = HSetFamily::OpHSet(op_args, key, cmd->args.subspan(2));
+      cmd->status = res.status();
+      cmd->added = res.value_or(0);
+    } else {
+      auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+      if (it_res) {
+        // Offloaded values are read via the regular path.
+        if ((*it_res)->second.IsExternal())
+          return;
+        (*it_res)->second.GetString(&cmd->value);
+      } else {
+        cmd->status = it_res.status();
+      }
+    }
+    cmd->executed = true;
+  }
+}
+
+// A GET or HGET of redis.pcall_batch that runs in the shard of its key, in a single hop with
+// the other reads of the batch.
+struct ScriptBatchCmd {
+  CmdArgList args;
+  ShardId sid = 0;
+  bool is_hget = false;
+
+  // Filled by the shard.
+  bool executed = false;
+  OpStatus status = OpStatus::OK;
+  string value;
+};
+
+void SendSquashedReply(const SquashedCmd& cmd, ConnectionContext* cntx) {
+  if (cmd.kind == SquashedCmd::SET) {
+    if (cmd.status == OpStatus::OUT_OF_MEMORY)
+      return (*cntx)->SendError(kOutOfMemory);
+    return (*cntx)->SendOk();
+  }
+
+  if (cmd.kind == SquashedCmd::HSET) {
+    if (cmd.status != OpStatus::OK)
+      return (*cntx)->SendError(cmd.status);
+    return (*cntx)->SendLong(cmd.added);
+  }
+
+  switch (cmd.status) {
+    case OpStatus::OK:
+      return (*cntx)->SendBulkString(cmd.value);
+    case OpStatus::WRONG_TYPE:
+      return (*cntx)->SendError(kWrongTypeErr);
+    default:
+      return (*cntx)->SendNull();
   }
 }
 
+
 class InterpreterReplier : public RedisReplyBuilder {
  public:
   InterpreterReplier(ObjectExplorer* explr) : RedisReplyBuilder(nullptr), explr_(explr) {
@@ -397,6 +527,21 @@ bool IsTransactional(const CommandId* cid) {
   return false;
 }
 
+// Whether a script that runs in the shard thread of its keys can call cid. Such scripts can not
+// wait for any shard, since they block the shard that runs them.
+bool CanRunInShard(const CommandId* cid) {
+  return cid->first_key_pos() > 0 &&
+         (cid->opt_mask() & (CO::GLOBAL_TRANS | CO::BLOCKING | CO::NOSCRIPT)) == 0;
+}
+
+// Whether cid can run while a snapshot is loaded, see --serve_while_loading. Only the commands
+// on their keys can: the loader does not overwrite the keys written by them and the keys it did
+// not load yet are missing. The blocking commands are not woken by the loaded keys.
+bool CanServeWhileLoading(const CommandId* cid) {
+  return cid->first_key_pos() > 0 &&
+         (cid->opt_mask() & (CO::GLOBAL_TRANS | CO::BLOCKING | CO::ADMIN)) == 0;
+}
+
 bool EvalValidator(CmdArgList args, ConnectionContext* cntx) {
   string_view num_keys_str = ArgS(args, 2);
   int32_t num_keys;
@@ -414,9 +559,156 @@ bool EvalValidator(CmdArgList args, ConnectionContext* cntx) {
   return true;
 }
 
+// Whether all the keys of a command on a migrating slot are still in this node.
+bool KeysExist(SlotId slot, const vector<string_view>& keys, DbIndex db_index) {
+  return shard_set->Await(slot % shard_set->size(), [&] {
+    DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+    DbSlice::Context db_cntx{db_index, GetCurrentTimeMs()};
+    for (string_view key : keys) {
+      if (!IsValid(db_slice.FindExt(db_cntx, key)))
+        return false;
+    }
+    return true;
+  });
+}
+
+// In cluster mode, returns the redirect or the error for a command on keys that this node does
+// not serve, and nullopt if it can run here.
+optional<string> CheckKeysOwnership(const CommandId* cid, CmdArgList args, bool is_write_cmd,
+                                    const ConnectionContext& cntx) {
+  // The channels of the sharded pubsub are routed like keys, without being locked.
+  string_view name{cid->name()};
+  bool shard_channels = name == "SPUBLISH" || name == "SSUBSCRIBE" || name == "SUNSUBSCRIBE";
+
+  vector<string_view> keys;
+  if (shard_channels) {
+    size_t end = name == "SPUBLISH" ? 2 : args.size();
+    for (size_t i = 1; i < end; ++i)
+      keys.push_back(ArgS(args, i));
+  } else {
+    if (cid->first_key_pos() == 0 || (cid->opt_mask() & CO::GLOBAL_TRANS))
+      return nullopt;
+
+    OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+    if (!key_index)
+      return nullopt;  // The command reports the error.
+
+    if (key_index->bonus)
+      keys.push_back(ArgS(args, key_index->bonus));
+    for (unsigned i = key_index->start; i < key_index->end; i += key_index->step)
+      keys.push_back(ArgS(args, i));
+  }
+  if (keys.empty())
+    return nullopt;
+
+  SlotId slot = ClusterConfig::KeySlot(keys.front());
+  for (string_view key : keys) {
+    if (ClusterConfig::KeySlot(key) != slot)
+      return "-CROSSSLOT Keys in request don't hash to the same slot";
+  }
+
+  // The writes on a slot that is handed over to another node wait until it is done, then they
+  // are redirected to the new owner.
+  ServerState* ss = ServerState::tlocal();
+  if (is_write_cmd) {
+    ss->slots_unpaused.await(
+        [ss, slot] { return !ss->paused_slots || !ss->paused_slots->test(slot); });
+  }
+
+  const ClusterConfig* config = ss->cluster_config.get();
+  const ClusterConfig::Node* owner = config ? config->SlotOwner(slot) : nullptr;
+  if (!owner)
+    return absl::StrCat("-CLUSTERDOWN Hash slot ", slot, " is not served");
+
+  auto redirect = [slot](string_view type, const ClusterConfig::Node& node) {
+    return absl::StrCat("-", type, " ", slot, " ", node.ip, ":", node.port);
+  };
+
+  if (config->IsMySlot(slot)) {
+    // The replicas of a shard serve its reads.
+    if (!config->IsMaster()) {
+      return is_write_cmd ? optional<string>{redirect("MOVED", *owner)} : nullopt;
+    }
+
+    // A migrating slot is still served here for the keys that were not moved yet. The shard
+    // channels stay until the migration ends.
+    const ClusterConfig::Node* target = config->MigrationTarget(slot);
+    if (target && !shard_channels && !KeysExist(slot, keys, cntx.conn_state.db_index))
+      return redirect("ASK", *target);
+    return nullopt;
+  }
+
+  if (cntx.conn_state.asking && config->IsImporting(slot))
+    return nullopt;
+
+  return redirect("MOVED", *owner);
+}
+
+// Dumps the timelines of the traced transactions of all the threads, to be loaded into
+// chrome://tracing or Perfetto.
+void TxTimeline(HttpContext* send) {
+  vector<string> events(shard_set->pool()->size());
+  shard_set->pool()->Await([&](ProactorBase* pb) {
+    unsigned index = ProactorBase::GetIndex();
+    TxTrace::AppendTimeline(index, &events[index]);
+  });
+
+  http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+  resp.set(h2::field::content_type, "application/json");
+  string& body = resp.body();
+  body = R"({"traceEvents":[
+{"name":"process_name","ph":"M","pid":0,"args":{"name":"shards"}},
+{"name":"process_name","ph":"M","pid":1,"args":{"name":"coordinators"}})";
+  for (const string& thread_events : events) {
+    if (!thread_events.empty())
+      absl::StrAppend(&body, ",\n", thread_events);
+  }
+  body.append("\n]}\n");
+  send->Invoke(std::move(resp));
+}
+
+// /profile/cpu?seconds=N&hz=M replies with a cpu profile of N seconds, 30 by default, sampled
+// M times a second, 100 by default, in pprof format.
+void ProfileCpu(const http::QueryArgs& args, HttpContext* send) {
+  unsigned seconds = 30, hz = 100;
+  for (const auto& [name, value] : args) {
+    if ((name == "seconds" && !absl::SimpleAtoi(value, &seconds)) ||
+        (name == "hz" && !absl::SimpleAtoi(value, &hz))) {
+      http::StringResponse resp = http::MakeStringResponse(h2::status::bad_request);
+      resp.body() = absl::StrCat("invalid ", name, "\n");
+      return send->Invoke(std::move(resp));
+    }
+  }
+
+  seconds = clamp(seconds, 1u, 600u);
+  optional<string> profile = CollectCpuProfile(shard_set->pool(), chrono::seconds(seconds), hz);
+  if (!profile) {
+    http::StringResponse resp = http::MakeStringResponse(h2::status::conflict);
+    resp.body() = "a cpu profile is already in progress\n";
+    return send->Invoke(std::move(resp));
+  }
+
+  http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+  resp.set(h2::field::content_type, "application/octet-stream");
+  resp.body() = std::move(*profile);
+  send->Invoke(std::move(resp));
+}
+
+void ProfileHeap(const http::QueryArgs& args, HttpContext* send) {
+  http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+  resp.set(h2::field::content_type, "text/plain");
+  resp.body() = CollectHeapProfile(shard_set->pool());
+  send->Invoke(std::move(resp));
+}
+
 void TxTable(const http::QueryArgs& args, HttpContext* send) {
   using html::SortedTable;
 
+  for (const auto& [name, value] : args) {
+    if (name == "trace" && shard_set)
+      return TxTimeline(send);
+  }
+
   http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
   resp.body() = SortedTable::HtmlStart();
   SortedTable::StartTable({"ShardId", "TID", "TxId", "Armed"}, &resp.body());
@@ -453,12 +745,152 @@ void TxTable(const http::QueryArgs& args, HttpContext* send) {
   }
 
   SortedTable::EndTable(&resp.body());
+
+  // The phases of the traced transactions, with their average and max latency in usec.
+  if (shard_set) {
+    vector<TxTrace::StatsMap> thread_stats(shard_set->pool()->size());
+    shard_set->pool()->Await(
+        [&](ProactorBase* pb) { TxTrace::MergeStats(&thread_stats[ProactorBase::GetIndex()]); });
+
+    TxTrace::StatsMap stats;
+    for (const auto& ts : thread_stats) {
+      for (const auto& [key, phase_stats] : ts)
+        stats[key] += phase_stats;
+    }
+
+    SortedTable::StartTable({"Command", "ShardId", "Hops", "Schedule", "Queue", "Run",
+                             "Conclude"},
+                            &resp.body());
+    for (const auto& [key, phase_stats] : stats) {
+      vector<string> row{key.first, absl::StrCat(key.second), absl::StrCat(phase_stats.hops)};
+      for (unsigned i = 0; i < TxTrace::NUM_PHASES; ++i) {
+        row.push_back(absl::StrCat(phase_stats.total_ns[i] / phase_stats.hops / 1000, " / ",
+                                   phase_stats.max_ns[i] / 1000));
+      }
+      SortedTable::Row({row[0], row[1], row[2], row[3], row[4], row[5], row[6]}, &resp.body());
+    }
+    SortedTable::EndTable(&resp.body());
+  }
+
   send->Invoke(std::move(resp));
 }
 
+void LogSlowCommand(CmdArgList args, const Transaction* trans, uint64_t duration_usec,
+                    ConnectionContext* cntx) {
+  SlowLog::Entry entry;
+  entry.unix_ts = time(nullptr);
+  entry.duration_usec = duration_usec;
+  if (trans) {
+    entry.exec_usec = trans->exec_ns() / 1000;
+    entry.shards = trans->GetActiveShards();
+  }
+
+  // As in Redis, the last argument tells how many were left out.
+  size_t num_args = min(args.size(), SlowLog::kMaxArgs);
+  for (size_t i = 0; i < num_args; ++i) {
+    string_view arg = ArgS(args, i);
+    if (i + 1 == SlowLog::kMaxArgs && args.size() > SlowLog::kMaxArgs) {
+      entry.args.push_back(absl::StrCat("... (", args.size() - SlowLog::kMaxArgs + 1,
+                                        " more arguments)"));
+    } else if (arg.size() > SlowLog::kMaxArgLen) {
+      entry.args.push_back(absl::StrCat(arg.substr(0, SlowLog::kMaxArgLen), "... (",
+                                        arg.size() - SlowLog::kMaxArgLen, " more bytes)"));
+    } else {
+      entry.args.emplace_back(arg);
+    }
+  }
+
+  if (cntx->owner()) {
+    entry.client_addr = cntx->owner()->RemoteEndpointStr();
+    entry.client_name = cntx->owner()->GetName();
+  }
+  ServerState::tlocal()->slowlog.Add(std::move(entry));
+}
+
+// A published message, shared by all of its subscribers.
+struct PublishedMessage {
+  string channel;
+  string message;
+  bool sharded;
+};
+
+// The subscribers of a published message in an io thread.
+struct Delivery {
+  shared_ptr<const PublishedMessage> msg;
+  vector<ChannelSlice::Subscriber> subscribers;
+};
+
+// Queues the message to the subscribers of the calling io thread and returns their tokens.
+void SendToSubscribers(const shared_ptr<Delivery>& delivery) {
+  // Shares the ownership of the delivery, so that the connections keep the channel and the
+  // patterns of the subscribers alive as well until they write the message from the shared
+  // buffer.
+  const PublishedMessage& msg = *delivery->msg;
+  shared_ptr<const string> message(delivery, &msg.message);
+
+  for (ChannelSlice::Subscriber& subscriber : delivery->subscribers) {
+    facade::Connection* conn = subscriber.conn_cntx->owner();
+    DCHECK(conn);
+    facade::Connection::PubMessage pmsg;
+    pmsg.channel = msg.channel;
+    pmsg.message = message;
+    pmsg.pattern = subscriber.pattern;
+    pmsg.sharded = msg.sharded;
+    conn->SendMsgVecAsync(pmsg);
+    subscriber.borrow_token.Dec();
+  }
+}
+
+// Publishes the message to the subscribers of the channel, or of the shard channel if sharded
+// is true, and returns their number.
+size_t PublishMessage(string_view channel, string_view message, bool sharded) {
+  ShardId sid = Shard(channel, shard_set->size());
+
+  auto cb = [&] {
+    ChannelSlice& cs = EngineShard::tlocal()->channel_slice();
+    return sharded ? cs.FetchShardSubscribers(channel) : cs.FetchSubscribers(channel);
+  };
+
+  // How do we know that subscribers did not disappear after we fetched them?
+  // Each subscriber object hold a borrow_token.
+  // OnClose does not reset subscribe_info before all tokens are returned.
+  vector<ChannelSlice::Subscriber> subscriber_arr = shard_set->Await(sid, std::move(cb));
+  if (subscriber_arr.empty())
+    return 0;
+
+  // The message is copied once and the subscribers of each io thread get it in a single hop,
+  // which returns their tokens. The reply does not wait for the hops, which keep the order
+  // of the messages of a publisher as the tasks of a thread run in order.
+  auto msg = make_shared<const PublishedMessage>(
+      PublishedMessage{string(channel), string(message), sharded});
+
+  vector<shared_ptr<Delivery>> by_thread(shard_set->pool()->size());
+  for (ChannelSlice::Subscriber& subscriber : subscriber_arr) {
+    auto& dest = by_thread[subscriber.thread_id];
+    if (!dest)
+      dest = make_shared<Delivery>(Delivery{msg, {}});
+    dest->subscribers.push_back(std::move(subscriber));
+  }
+
+  // The subscribers of the publisher's thread get the message right away.
+  int32_t my_tid = ProactorBase::GetIndex();
+  for (unsigned thread_id = 0; thread_id < by_thread.size(); ++thread_id) {
+    if (!by_thread[thread_id])
+      continue;
+    if (int32_t(thread_id) == my_tid) {
+      SendToSubscribers(by_thread[thread_id]);
+      continue;
+    }
+    shard_set->pool()->at(thread_id)->DispatchBrief(
+        [delivery = std::move(by_thread[thread_id])] { SendToSubscribers(delivery); });
+  }
+  return subscriber_arr.size();
+}
+
 }  // namespace
 
-Service::Service(ProactorPool* pp) : pp_(*pp), server_family_(this) {
+Service::Service(ProactorPool* pp)
+    : pp_(*pp), server_family_(this), cluster_family_(&server_family_) {
   CHECK(pp);
   CHECK(shard_set == NULL);
 
@@ -483,13 +915,71 @@ void Service::Init(util::AcceptServer* acceptor, util::ListenerInterface* main_i
 
   pp_.AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) { ServerState::tlocal()->Init(); });
 
+  if (EvictionPolicy policy; !GetFlagEvictionPolicy(&policy)) {
+    LOG(ERROR) << "Invalid maxmemory_policy " << GetFlag(FLAGS_maxmemory_policy);
+    exit(1);
+  }
+
+  vector<pair<DbIndex, uint64_t>> mem_quotas, ops_limits;
+  if (!ParseDbLimits(GetFlag(FLAGS_db_maxmemory), &mem_quotas)) {
+    LOG(ERROR) << "Invalid db_maxmemory " << GetFlag(FLAGS_db_maxmemory);
+    exit(1);
+  }
+  if (!ParseDbLimits(GetFlag(FLAGS_db_max_ops), &ops_limits)) {
+    LOG(ERROR) << "Invalid db_max_ops " << GetFlag(FLAGS_db_max_ops);
+    exit(1);
+  }
+
+  if (!ops_limits.empty()) {
+    pp_.AwaitFiberOnAll([&](ProactorBase* pb) {
+      auto& limits = ServerState::tlocal()->db_ops_limits;
+      for (auto [db_index, ops] : ops_limits) {
+        if (limits.size() <= db_index)
+          limits.resize(db_index + 1);
+        limits[db_index] = TokenBucket{max<uint64_t>(ops / pp_.size(), 1)};
+      }
+    });
+  }
+
+  if (uint32_t busy_poll_usec = GetFlag(FLAGS_busy_poll_usec); busy_poll_usec > 0) {
+    pp_.AwaitFiberOnAll([&](ProactorBase* pb) {
+      auto& poller = ServerState::tlocal()->busy_poller;
+      poller = make_unique<BusyPoller>(busy_poll_usec);
+      poller->Start();
+    });
+  }
+
   uint32_t shard_num = pp_.size() > 1 ? pp_.size() - 1 : pp_.size();
+  if (uint32_t num_shards = GetFlag(FLAGS_num_shards); num_shards > 0) {
+    // A shard is pinned to its thread, so a smaller thread count can not keep the mapping of
+    // the keys to the shards. Running with fewer shards would silently reshard the data.
+    if (num_shards > pp_.size()) {
+      LOG(ERROR) << "num_shards " << num_shards << " exceeds the " << pp_.size()
+                 << " threads. Exiting...";
+      exit(1);
+    }
+    shard_num = num_shards;
+  }
+  ClusterConfig::Initialize();
+  TrackingTable::SetNotifyFn(&ConnectionContext::SendInvalidation);
+  KeyspaceEvents::Init();
+  TxTrace::SetSampleRate(GetFlag(FLAGS_tx_trace_sample));
+  SlowLog::SetThreshold(GetFlag(FLAGS_slowlog_log_slower_than));
+  SlowLog::SetMaxLen(GetFlag(FLAGS_slowlog_max_len));
   shard_set->Init(shard_num, !opts.disable_time_update);
+  if (!mem_quotas.empty()) {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      for (auto [db_index, bytes] : mem_quotas)
+        shard->db_slice().SetMemoryQuota(db_index, max<uint64_t>(bytes / shard_num, 1));
+    });
+  }
 
   request_latency_usec.Init(&pp_);
+  script_latency_usec.Init(&pp_);
   StringFamily::Init(&pp_);
   GenericFamily::Init(&pp_);
   server_family_.Init(acceptor, main_interface);
+  cluster_family_.Init();
 }
 
 void Service::Shutdown() {
@@ -497,12 +987,19 @@ void Service::Shutdown() {
 
   // We mark that we are shutting down. After this incoming requests will be
   // rejected
-  pp_.AwaitFiberOnAll([](ProactorBase* pb) { ServerState::tlocal()->Shutdown(); });
+  pp_.AwaitFiberOnAll([](ProactorBase* pb) {
+    ServerState* ss = ServerState::tlocal();
+    ss->Shutdown();
+    if (ss->busy_poller)
+      ss->busy_poller->Stop();
+  });
 
   engine_varz.reset();
   request_latency_usec.Shutdown();
+  script_latency_usec.Shutdown();
 
   // to shutdown all the runtime components that depend on EngineShard.
+  cluster_family_.Shutdown();
   server_family_.Shutdown();
   StringFamily::Shutdown();
   GenericFamily::Shutdown();
@@ -513,6 +1010,39 @@ void Service::Shutdown() {
   boost::this_fiber::sleep_for(10ms);
 }
 
+// Migrates the connection to the thread of sid if most of its commands run there.
+static void UpdateShardAffinity(ShardId sid, ConnectionContext* cntx) {
+  uint32_t threshold = GetFlag(FLAGS_migrate_connections_threshold);
+  if (threshold == 0)
+    return;
+
+  auto& affinity = cntx->conn_state.shard_affinity;
+  if (affinity.shard == sid) {
+    affinity.score = std::min(affinity.score + 1, threshold);
+  } else if (affinity.score > 0) {
+    --affinity.score;
+    return;
+  } else {
+    affinity.shard = sid;
+    affinity.score = 1;
+  }
+
+  if (affinity.score < threshold || int(sid) == ProactorBase::GetIndex())
+    return;
+
+  // Subscriptions, tracking and replication are bound to the thread of the connection.
+  const auto& state = cntx->conn_state;
+  if (cntx->async_dispatch || cntx->monitor || cntx->replica_conn || cntx->is_replicating ||
+      state.subscribe_info || state.tracking_info || state.exec_info.IsActive() ||
+      state.script_info || state.repl_flow_id != kuint32max) {
+    return;
+  }
+
+  if (cntx->owner()->Migrate(shard_set->pool()->at(sid))) {
+    VLOG(1) << "Migrated connection " << cntx->owner()->GetClientId() << " to thread " << sid;
+  }
+}
+
 static void MultiSetError(ConnectionContext* cntx) {
   if (cntx->conn_state.exec_info.IsActive()) {
     cntx->conn_state.exec_info.state = ConnectionState::ExecInfo::EXEC_ERROR;
@@ -546,7 +1076,8 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
-  if ((etl.gstate() == GlobalState::LOADING && (cid->opt_mask() & CO::LOADING) == 0) ||
+  if ((etl.gstate() == GlobalState::LOADING && (cid->opt_mask() & CO::LOADING) == 0 &&
+       !(etl.serve_while_loading && CanServeWhileLoading(cid))) ||
       etl.gstate() == GlobalState::SHUTTING_DOWN) {
     string err = StrCat("Can not execute during ", GlobalStateName(etl.gstate()));
     (*cntx)->SendError(err);
@@ -561,6 +1092,13 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     }
   }
 
+  // The replicas apply the writes that the master already admitted.
+  if (DbIndex db_index = dfly_cntx->conn_state.db_index;
+      db_index < etl.db_ops_limits.size() && !dfly_cntx->is_replicating && IsTransactional(cid) &&
+      !etl.db_ops_limits[db_index].Acquire(ProactorBase::GetMonotonicTimeNs())) {
+    return (*cntx)->SendError("ops/sec quota of the database exceeded");
+  }
+
   // only reset and quit are allow if this connection is used for monitoring
   if (dfly_cntx->monitor && (cmd_name != "RESET" && cmd_name != "QUIT")) {
     return (*cntx)->SendError("Replica can't interact with the keyspace");
@@ -572,6 +1110,17 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return (*cntx)->SendError("This Redis command is not allowed from script");
   }
 
+  if (under_script) {
+    const auto& script_info = *dfly_cntx->conn_state.script_info;
+    if (script_info.in_shard && !CanRunInShard(cid)) {
+      return (*cntx)->SendError("This Redis command is not allowed from this script");
+    }
+
+    if (!script_info.is_write && (cid->opt_mask() & CO::WRITE)) {
+      return (*cntx)->SendError("Write commands are not allowed from read-only scripts");
+    }
+  }
+
   bool is_write_cmd = (cid->opt_mask() & CO::WRITE) ||
                       (under_script && dfly_cntx->conn_state.script_info->is_write);
   bool under_multi = dfly_cntx->conn_state.exec_info.IsActive() && !is_trans_cmd;
@@ -581,12 +1130,28 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
+  if (is_write_cmd)
+    etl.dataset_modified = true;
+
+  uint64_t max_staleness_ms = dfly_cntx->conn_state.max_staleness_ms;
+  if (!etl.is_master && max_staleness_ms && !is_write_cmd && cid->first_key_pos() > 0 &&
+      !dfly_cntx->is_replicating) {
+    uint64_t staleness_ms = server_family_.ReplicaStalenessMs();
+    if (staleness_ms > max_staleness_ms) {
+      return (*cntx)->SendError(
+          staleness_ms == UINT64_MAX
+              ? "-STALE replica staleness is unknown"
+              : absl::StrCat("-STALE replica is ", staleness_ms, "ms behind, the limit is ",
+                             max_staleness_ms, "ms"));
+    }
+  }
+
   if ((cid->arity() > 0 && args.size() != size_t(cid->arity())) ||
       (cid->arity() < 0 && args.size() < size_t(-cid->arity()))) {
     return (*cntx)->SendError(facade::WrongNumArgsError(cmd_str), kSyntaxErrType);
   }
 
-  if (cid->key_arg_step() == 2 && (args.size() % 2) == 0) {
+  if (cid->key_arg_step() > 1 && (args.size() - 1) % cid->key_arg_step() != 0) {
     return (*cntx)->SendError(facade::WrongNumArgsError(cmd_str), kSyntaxErrType);
   }
 
@@ -595,6 +1160,15 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
+  // The commands of scripts and replication streams were checked by their callers.
+  if (ClusterConfig::IsEnabled() && !under_script && !dfly_cntx->is_replicating) {
+    optional<string> error = CheckKeysOwnership(cid, args, is_write_cmd, *dfly_cntx);
+    if (cmd_name != "ASKING")
+      dfly_cntx->conn_state.asking = false;
+    if (error)
+      return (*cntx)->SendError(*error);
+  }
+
   if (under_multi) {
     if (cid->opt_mask() & CO::ADMIN) {
       (*cntx)->SendError("Can not run admin commands under transactions");
@@ -668,11 +1242,17 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     DCHECK(dfly_cntx->transaction == nullptr);
 
     if (IsTransactional(cid)) {
-      dist_trans.reset(new Transaction{cid});
+      dist_trans = Transaction::New(cid);
       OpStatus st = dist_trans->InitByArgs(dfly_cntx->conn_state.db_index, args);
       if (st != OpStatus::OK)
         return (*cntx)->SendError(st);
 
+      const auto& tracking = dfly_cntx->conn_state.tracking_info;
+      if (tracking && !tracking->bcast) {
+        dist_trans->SetTrackingClient(
+            TrackingTable::MakeRef(ProactorBase::GetIndex(), cntx->owner()->GetClientId()));
+      }
+
       dfly_cntx->transaction = dist_trans.get();
       dfly_cntx->last_command_debug.shards_count = dfly_cntx->transaction->unique_shard_cnt();
     } else {
@@ -694,15 +1274,116 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
 
   end_usec = ProactorBase::GetMonotonicTimeNs();
 
-  request_latency_usec.IncBy(cmd_str, (end_usec - start_usec) / 1000);
+  uint64_t duration_usec = (end_usec - start_usec) / 1000;
+  request_latency_usec.IncBy(cmd_str, duration_usec);
+  etl.cmd_latency[cid->name()].Add(duration_usec);
+  if (SlowLog::IsSlow(duration_usec))
+    LogSlowCommand(args, dist_trans.get(), duration_usec, dfly_cntx);
   if (dist_trans) {
     dfly_cntx->last_command_debug.clock = dist_trans->txid();
     dfly_cntx->last_command_debug.is_ooo = dist_trans->IsOOO();
+
+    if (dist_trans->unique_shard_cnt() == 1 && !dist_trans->IsGlobal())
+      UpdateShardAffinity(dist_trans->GetUniqueShard(), dfly_cntx);
   }
 
   if (!under_script) {
     dfly_cntx->transaction = nullptr;
   }
+
+  if (dist_trans)
+    Transaction::Recycle(std::move(dist_trans));
+}
+
+void Service::DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                                   facade::ConnectionContext* cntx) {
+  ConnectionContext* dfly_cntx = static_cast<ConnectionContext*>(cntx);
+  ServerState& etl = *ServerState::tlocal();
+  size_t min_squash = GetFlag(FLAGS_pipeline_squash);
+
+  // Squashed commands bypass the checks of DispatchCommand and the journal, hence we only
+  // squash when none of them can apply.
+  bool can_squash = min_squash > 0 && etl.is_master && !etl.journal() &&
+                    etl.gstate() == GlobalState::ACTIVE &&
+                    etl.Monitors().Empty() && !dfly_cntx->monitor &&
+                    (!cntx->req_auth || cntx->authenticated) &&
+                    !dfly_cntx->conn_state.exec_info.IsActive() &&
+                    !dfly_cntx->conn_state.script_info && etl.db_ops_limits.empty();
+
+  for (auto args : args_list) {
+    ToUpper(&args[0]);
+  }
+
+  // Blocking commands may wait indefinitely, so we do not hold back the replies produced so far.
+  auto dispatch = [&](CmdArgList args) {
+    const CommandId* cid = registry_.Find(ArgS(args, 0));
+    if (cid && (cid->opt_mask() & CO::BLOCKING))
+      cntx->reply_builder()->FlushBatch();
+    DispatchCommand(args, cntx);
+  };
+
+  if (!can_squash || args_list.size() < min_squash) {
+    for (auto args : args_list) {
+      dispatch(args);
+    }
+    return;
+  }
+
+  size_t i = 0;
+  while (i < args_list.size()) {
+    size_t end = i;
+    while (end < args_list.size() && IsSquashable(args_list[end]))
+      ++end;
+
+    if (end - i >= min_squash) {
+      SquashCommands(args_list.subspan(i, end - i), dfly_cntx);
+      i = end;
+    } else {
+      dispatch(args_list[i++]);
+    }
+  }
+}
+
+void Service::SquashCommands(absl::Span<CmdArgList> args_list, ConnectionContext* cntx) {
+  ServerState& etl = *ServerState::tlocal();
+  DbIndex db_index = cntx->conn_state.db_index;
+
+  vector<SquashedCmd> cmds(args_list.size());
+  vector<vector<SquashedCmd*>> sharded(shard_set->size());
+
+  for (size_t i = 0; i < args_list.size(); ++i) {
+    SquashedCmd& cmd = cmds[i];
+    cmd.args = args_list[i];
+    string_view name = ArgS(cmd.args, 0);
+    cmd.kind = name == "GET" ? SquashedCmd::GET
+                             : (name == "SET" ? SquashedCmd::SET : SquashedCmd::HSET);
+    cmd.sid = Shard(ArgS(cmd.args, 1), shard_set->size());
+    sharded[cmd.sid].push_back(&cmd);
+  }
+
+  fibers_ext::BlockingCounter bc{0};
+  for (ShardId sid = 0; sid < sharded.size(); ++sid) {
+    if (sharded[sid].empty())
+      continue;
+
+    bc.Add(1);
+    shard_set->Add(sid, [&, sid, bc]() mutable {
+      RunSquashedInShard(db_index, sharded[sid]);
+      bc.Dec();
+    });
+  }
+  bc.Wait();
+
+  for (const SquashedCmd& cmd : cmds) {
+    if (!cmd.executed) {
+      DispatchCommand(cmd.args, cntx);
+      continue;
+    }
+
+    etl.RecordCmd();
+    etl.connection_stats.cmd_count_map[ArgS(cmd.args, 0)]++;
+    SendSquashedReply(cmd, cntx);
+  }
 }
 
 void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
@@ -714,6 +1395,8 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
   char ttl_op[] = "EX";
 
   MCReplyBuilder* mc_builder = static_cast<MCReplyBuilder*>(cntx->reply_builder());
+  mc_builder->SetBinaryRequest(cmd.binary ? &cmd : nullptr);
+  absl::Cleanup reset_binary = [mc_builder] { mc_builder->SetBinaryRequest(nullptr); };
 
   switch (cmd.type) {
     case MemcacheParser::REPLACE:
@@ -745,8 +1428,13 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       strcpy(cmd_name, "PREPEND");
       break;
     case MemcacheParser::GET:
+    case MemcacheParser::GETS:
       strcpy(cmd_name, "MGET");
       break;
+    case MemcacheParser::CAS:
+      // The meta set compares the token, see StringFamily::MetaSet.
+      strcpy(cmd_name, "MS");
+      break;
     case MemcacheParser::FLUSHALL:
       strcpy(cmd_name, "FLUSHDB");
       break;
@@ -759,6 +1447,21 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
     case MemcacheParser::VERSION:
       mc_builder->SendSimpleString(StrCat("VERSION ", kGitTag));
       return;
+    case MemcacheParser::META_NOOP:
+      mc_builder->SendMeta("MN", "");
+      return;
+    case MemcacheParser::META_GET:
+      strcpy(cmd_name, "MG");
+      break;
+    case MemcacheParser::META_SET:
+      strcpy(cmd_name, "MS");
+      break;
+    case MemcacheParser::META_DEL:
+      strcpy(cmd_name, "MD");
+      break;
+    case MemcacheParser::META_ARITHM:
+      strcpy(cmd_name, "MA");
+      break;
     default:
       mc_builder->SendClientError("bad command line format");
       return;
@@ -792,16 +1495,24 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       char* key = const_cast<char*>(s.data());
       args.emplace_back(key, s.size());
     }
+
+    // The binary replies always carry the cas token.
+    if (cmd.type == MemcacheParser::GETS || cmd.binary)
+      dfly_cntx->conn_state.memcache_flag = ConnectionState::FETCH_CAS_VER;
   } else {  // write commands.
     if (store_opt[0]) {
       args.emplace_back(store_opt, strlen(store_opt));
     }
   }
 
+  if (MemcacheParser::IsMetaCmd(cmd.type) || cmd.type == MemcacheParser::CAS)
+    dfly_cntx->conn_state.mc_command = &cmd;
+
   DispatchCommand(CmdArgList{args}, cntx);
 
   // Reset back.
   dfly_cntx->conn_state.memcache_flag = 0;
+  dfly_cntx->conn_state.mc_command = nullptr;
 }
 
 facade::ConnectionContext* Service::CreateContext(util::FiberSocketBase* peer,
@@ -878,32 +1589,28 @@ void Service::Multi(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void Service::Watch(CmdArgList args, ConnectionContext* cntx) {
-  auto& exec_info = cntx->conn_state.exec_info;
+  auto& watched_keys = cntx->conn_state.exec_info.watched_keys;
 
-  // Skip if EXEC will already fail due previous WATCH.
-  if (exec_info.watched_dirty.load(memory_order_relaxed)) {
-    return (*cntx)->SendOk();
+  // Every shard fills the state of its keys, see ExecInfo::WatchedKey.
+  size_t first = watched_keys.size();
+  for (size_t i = 1; i < args.size(); i++) {
+    watched_keys.push_back({cntx->db_index(), string{ArgS(args, i)}});
   }
 
-  atomic_uint32_t keys_existed = 0;
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
-    for (auto k : largs) {
-      shard->db_slice().RegisterWatchedKey(cntx->db_index(), k, &exec_info);
+    auto& db_slice = shard->db_slice();
+    for (size_t i = first; i < watched_keys.size(); i++) {
+      auto& wkey = watched_keys[i];
+      if (Shard(wkey.key, shard_set->size()) != shard->shard_id())
+        continue;
+
+      wkey.version = db_slice.version();
+      wkey.existed = IsValid(db_slice.FindExt(t->db_context(), wkey.key));
     }
-
-    auto res = GenericFamily::OpExists(t->GetOpArgs(shard), largs);
-    keys_existed.fetch_add(res.value_or(0), memory_order_relaxed);
     return OpStatus::OK;
   };
   cntx->transaction->ScheduleSingleHop(std::move(cb));
 
-  // Duplicate keys are stored to keep correct count.
-  exec_info.watched_existed += keys_existed.load(memory_order_relaxed);
-  for (size_t i = 1; i < args.size(); i++) {
-    exec_info.watched_keys.emplace_back(cntx->db_index(), ArgS(args, i));
-  }
-
   return (*cntx)->SendOk();
 }
 
@@ -922,6 +1629,113 @@ void Service::CallFromScript(CmdArgList args, ObjectExplorer* reply, ConnectionC
   cntx->Inject(orig);
 }
 
+void Service::CallBatchFromScript(absl::Span<CmdArgList> cmds, ObjectExplorer* reply,
+                                  ConnectionContext* cntx) {
+  const auto& script_info = *cntx->conn_state.script_info;
+  for (CmdArgList args : cmds)
+    ToUpper(&args[0]);
+
+  // The reads of the declared keys, which the script transaction locked, run in one hop.
+  // Scripts that run in the shard thread do not hop between the threads anyway.
+  bool can_batch = !script_info.keys.empty() && !script_info.in_shard &&
+                   ServerState::tlocal()->Monitors().Empty();
+  auto is_batchable = [&](CmdArgList args) {
+    string_view cmd = ArgS(args, 0);
+    return ((cmd == "GET" && args.size() == 2) || (cmd == "HGET" && args.size() == 3)) &&
+           script_info.keys.contains(ArgS(args, 1));
+  };
+
+  size_t i = 0;
+  while (i < cmds.size()) {
+    size_t end = i;
+    while (can_batch && end < cmds.size() && is_batchable(cmds[end]))
+      ++end;
+
+    if (end - i >= 2) {
+      RunScriptBatch(cmds.subspan(i, end - i), reply, cntx);
+      i = end;
+    } else {
+      CallFromScript(cmds[i++], reply, cntx);
+    }
+  }
+}
+
+void Service::RunScriptBatch(absl::Span<CmdArgList> cmds, ObjectExplorer* reply,
+                             ConnectionContext* cntx) {
+  static char EXISTS[] = "EXISTS";
+  ServerState& etl = *ServerState::tlocal();
+
+  vector<ScriptBatchCmd> batch(cmds.size());
+  CmdArgVec keys(cmds.size() + 1);
+  keys[0] = MutableSlice{EXISTS, strlen(EXISTS)};
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    batch[i].args = cmds[i];
+    batch[i].sid = Shard(ArgS(cmds[i], 1), shard_set->size());
+    batch[i].is_hget = ArgS(cmds[i], 0) == "HGET";
+    keys[i + 1] = cmds[i][1];
+  }
+
+  // The hop of the script transaction spans the keys of the batch, as if it ran EXISTS on them,
+  // which also makes CLIENT TRACKING track them.
+  Transaction* trans = cntx->transaction;
+  trans->SetExecCmd(registry_.Find(EXISTS));
+  CHECK_EQ(OpStatus::OK, trans->InitByArgs(cntx->conn_state.db_index, absl::MakeSpan(keys)));
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    for (ScriptBatchCmd& cmd : batch) {
+      if (cmd.sid != shard->shard_id())
+        continue;
+
+      string_view key = ArgS(cmd.args, 1);
+      if (cmd.is_hget) {
+        OpResult<string> res = HSetFamily::OpHGet(op_args, key, ArgS(cmd.args, 2));
+        cmd.status = res.status();
+        if (res)
+          cmd.value = std::move(*res);
+      } else {
+        auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+        if (it_res) {
+          // Offloaded values are read via the regular path.
+          if ((*it_res)->second.IsExternal())
+            continue;
+          (*it_res)->second.GetString(&cmd.value);
+        } else {
+          cmd.status = it_res.status();
+        }
+      }
+      cmd.executed = true;
+    }
+    return OpStatus::OK;
+  };
+  trans->ScheduleSingleHop(std::move(cb));
+
+  // Since the batch only reads the keys that the script locked, the commands that were not
+  // executed can run after the others.
+  for (const ScriptBatchCmd& cmd : batch) {
+    if (!cmd.executed) {
+      CallFromScript(cmd.args, reply, cntx);
+      continue;
+    }
+
+    etl.RecordCmd();
+    etl.connection_stats.cmd_count_map[ArgS(cmd.args, 0)]++;
+
+    InterpreterReplier replier(reply);
+    RedisReplyBuilder* rb = &replier;
+    switch (cmd.status) {
+      case OpStatus::OK:
+        rb->SendBulkString(cmd.value);
+        break;
+      case OpStatus::KEY_NOTFOUND:
+        rb->SendNull();
+        break;
+      default:
+        rb->SendError(cmd.status);
+    }
+  }
+}
+
 void Service::Eval(CmdArgList args, ConnectionContext* cntx) {
   uint32_t num_keys;
 
@@ -934,24 +1748,39 @@ void Service::Eval(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendNull();
   }
 
-  ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
-
-  string result;
-  Interpreter::AddResult add_result = script.AddFunction(body, &result);
-  if (add_result == Interpreter::COMPILE_ERR) {
-    return (*cntx)->SendError(result, facade::kScriptErrType);
+  // Validate the shebang before the script is added.
+  if (absl::StartsWith(body, "#!")) {
+    ScriptMgr::ScriptParams params;
+    string error;
+    if (!ScriptMgr::ParseParams(body, &params, &error)) {
+      return (*cntx)->SendError(error);
+    }
   }
 
-  if (add_result == Interpreter::ADD_OK) {
-    server_family_.script_mgr()->InsertFunction(result, body);
+  char sha[41];
+  Interpreter::FuncSha1(body, sha);
+
+  // Every script is compiled once, the interpreters load its bytecode from ScriptMgr.
+  if (!server_family_.script_mgr()->Find(sha)) {
+    InterpreterManager& mgr = ServerState::tlocal()->GetInterpreterManager();
+    Interpreter* interpreter = mgr.Get();
+
+    string result, bytecode;
+    Interpreter::AddResult add_result = interpreter->AddFunction(body, &result, &bytecode);
+    mgr.Return(interpreter);
+
+    if (add_result == Interpreter::COMPILE_ERR) {
+      return (*cntx)->SendError(result, facade::kScriptErrType);
+    }
+
+    server_family_.script_mgr()->InsertFunction(result, body, std::move(bytecode));
   }
 
   EvalArgs eval_args;
-  eval_args.sha = result;
+  eval_args.sha = string_view{sha, 40};
   eval_args.keys = args.subspan(3, num_keys);
   eval_args.args = args.subspan(3 + num_keys);
-  EvalInternal(eval_args, &script, cntx);
+  EvalInternal(eval_args, cntx);
 }
 
 void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
@@ -962,32 +1791,15 @@ void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
 
   ToLower(&args[1]);
 
-  string_view sha = ArgS(args, 1);
-  ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
-  bool exists = script.Exists(sha);
-
-  if (!exists) {
-    const char* body = (sha.size() == 40) ? server_family_.script_mgr()->Find(sha) : nullptr;
-    if (!body) {
-      return (*cntx)->SendError(facade::kScriptNotFound);
-    }
-
-    string res;
-    CHECK_EQ(Interpreter::ADD_OK, script.AddFunction(body, &res));
-    CHECK_EQ(res, sha);
-  }
-
   EvalArgs ev_args;
-  ev_args.sha = sha;
+  ev_args.sha = ArgS(args, 1);
   ev_args.keys = args.subspan(3, num_keys);
   ev_args.args = args.subspan(3 + num_keys);
 
-  EvalInternal(ev_args, &script, cntx);
+  EvalInternal(ev_args, cntx);
 }
 
-void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
-                           ConnectionContext* cntx) {
+void Service::EvalInternal(const EvalArgs& eval_args, ConnectionContext* cntx) {
   DCHECK(!eval_args.sha.empty());
 
   // Sanitizing the input to avoid code injection.
@@ -995,43 +1807,58 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
     return (*cntx)->SendError(facade::kScriptNotFound);
   }
 
-  bool exists = interpreter->Exists(eval_args.sha);
-
-  if (!exists) {
-    const char* body = server_family_.script_mgr()->Find(eval_args.sha);
-    if (!body) {
-      return (*cntx)->SendError(facade::kScriptNotFound);
-    }
-
-    string res;
-    CHECK_EQ(Interpreter::ADD_OK, interpreter->AddFunction(body, &res));
-    CHECK_EQ(res, eval_args.sha);
+  optional<ScriptMgr::ScriptParams> params =
+      server_family_.script_mgr()->GetParams(eval_args.sha);
+  if (!params) {
+    return (*cntx)->SendError(facade::kScriptNotFound);
   }
 
-  string error;
-
   DCHECK(!cntx->conn_state.script_info);  // we should not call eval from the script.
 
-  // TODO: to determine whether the script is RO by scanning all "redis.p?call" calls
-  // and checking whether all invocations consist of RO commands.
-  // we can do it once during script insertion into script mgr.
   cntx->conn_state.script_info.emplace(ConnectionState::ScriptInfo{});
+  cntx->conn_state.script_info->is_write = !params->no_writes;
   for (size_t i = 0; i < eval_args.keys.size(); ++i) {
     cntx->conn_state.script_info->keys.insert(ArgS(eval_args.keys, i));
   }
   DCHECK(cntx->transaction);
 
+  if (!eval_args.keys.empty()) {
+    if (params->no_writes)
+      cntx->transaction->SetMultiReadOnly();
+
+    if (CanRunScriptInShard(*params, cntx) && RunScriptInShard(eval_args, cntx))
+      return;
+  }
+
+  // We must borrow the interpreter before locking the keys, since the scripts that hold the
+  // interpreters of this thread may wait for these keys.
+  InterpreterManager& mgr = ServerState::tlocal()->GetInterpreterManager();
+  Interpreter* interpreter = mgr.Get();
+  absl::Cleanup return_interpreter = [&] { mgr.Return(interpreter); };
+  CHECK(server_family_.script_mgr()->AddToInterpreter(eval_args.sha, interpreter));
+
   if (!eval_args.keys.empty())
     cntx->transaction->Schedule();
 
-  auto lk = interpreter->Lock();
+  RunScript(eval_args, interpreter, static_cast<RedisReplyBuilder*>(cntx->reply_builder()), cntx);
+}
+
+void Service::RunScript(const EvalArgs& eval_args, Interpreter* interpreter,
+                        RedisReplyBuilder* rb, ConnectionContext* cntx) {
+  string error;
 
   interpreter->SetGlobalArray("KEYS", eval_args.keys);
   interpreter->SetGlobalArray("ARGV", eval_args.args);
   interpreter->SetRedisFunc(
       [cntx, this](CmdArgList args, ObjectExplorer* reply) { CallFromScript(args, reply, cntx); });
+  interpreter->SetRedisBatchFunc(
+      [cntx, this](absl::Span<CmdArgList> cmds, ObjectExplorer* reply) {
+        CallBatchFromScript(cmds, reply, cntx);
+      });
 
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   Interpreter::RunResult result = interpreter->RunFunction(eval_args.sha, &error);
+  script_latency_usec.IncBy(eval_args.sha, (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000);
 
   cntx->conn_state.script_info.reset();  // reset script_info
 
@@ -1041,21 +1868,70 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
 
   if (result == Interpreter::RUN_ERR) {
     string resp = StrCat("Error running script (call to ", eval_args.sha, "): ", error);
-    return (*cntx)->SendError(resp, facade::kScriptErrType);
+    return rb->SendError(resp, facade::kScriptErrType);
   }
 
   CHECK(result == Interpreter::RUN_OK);
 
-  EvalSerializer ser{static_cast<RedisReplyBuilder*>(cntx->reply_builder())};
+  EvalSerializer ser{rb};
 
   if (!interpreter->IsResultSafe()) {
-    (*cntx)->SendError("reached lua stack limit");
+    rb->SendError("reached lua stack limit");
   } else {
     interpreter->SerializeResult(&ser);
   }
   interpreter->ResetStack();
 }
 
+bool Service::CanRunScriptInShard(const ScriptMgr::ScriptParams& params,
+                                  ConnectionContext* cntx) const {
+  if (cntx->transaction->unique_shard_cnt() != 1 || !params.literal_calls)
+    return false;
+
+  for (const string& name : params.commands) {
+    const CommandId* cid = registry_.Find(name);
+    if (!cid || !CanRunInShard(cid))
+      return false;
+  }
+  return true;
+}
+
+bool Service::RunScriptInShard(const EvalArgs& eval_args, ConnectionContext* cntx) {
+  Transaction* trans = cntx->transaction;
+  ShardId sid = trans->GetUniqueShard();
+  optional<string> reply;
+
+  auto cb = [&] {
+    // Connection fibers of this thread may hold all the interpreters while they wait for
+    // this shard, hence we can not wait for an interpreter here.
+    InterpreterManager& mgr = ServerState::tlocal()->GetInterpreterManager();
+    Interpreter* interpreter = mgr.TryGet();
+    if (!interpreter)
+      return;
+
+    absl::Cleanup return_interpreter = [&] { mgr.Return(interpreter); };
+    CHECK(server_family_.script_mgr()->AddToInterpreter(eval_args.sha, interpreter));
+
+    if (!trans->ScheduleInline(EngineShard::tlocal()))
+      return;
+
+    cntx->conn_state.script_info->in_shard = true;
+
+    ::io::StringSink sink;
+    RedisReplyBuilder rb{&sink};
+    RunScript(eval_args, interpreter, &rb, cntx);
+    reply.emplace(sink.str());
+  };
+
+  shard_set->Await(sid, std::move(cb));
+
+  if (!reply)
+    return false;
+
+  (*cntx)->SendRaw(*reply);
+  return true;
+}
+
 void Service::Discard(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = (*cntx).operator->();
 
@@ -1067,28 +1943,39 @@ void Service::Discard(CmdArgList args, ConnectionContext* cntx) {
   rb->SendOk();
 }
 
-// Return true if non of the connections watched keys expired.
-bool CheckWatchedKeyExpiry(ConnectionContext* cntx, const CommandRegistry& registry) {
+// Return true if none of the connection's watched keys changed since WATCH. Runs as the first
+// hop of the EXEC transaction, which locks the watched keys, so they can not change before its
+// commands run.
+bool CheckWatchedKeys(ConnectionContext* cntx, const CommandRegistry& registry) {
   static char EXISTS[] = "EXISTS";
   auto& exec_info = cntx->conn_state.exec_info;
 
   CmdArgVec str_list(exec_info.watched_keys.size() + 1);
   str_list[0] = MutableSlice{EXISTS, strlen(EXISTS)};
   for (size_t i = 1; i < str_list.size(); i++) {
-    auto& [db, s] = exec_info.watched_keys[i - 1];
+    string& s = exec_info.watched_keys[i - 1].key;
     str_list[i] = MutableSlice{s.data(), s.size()};
   }
 
-  atomic_uint32_t watch_exist_count{0};
-  auto cb = [&watch_exist_count](Transaction* t, EngineShard* shard) {
-    ArgSlice args = t->ShardArgsInShard(shard->shard_id());
-    auto res = GenericFamily::OpExists(t->GetOpArgs(shard), args);
-    watch_exist_count.fetch_add(res.value_or(0), memory_order_relaxed);
-
+  atomic_bool changed{false};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    auto& db_slice = shard->db_slice();
+    for (const auto& wkey : exec_info.watched_keys) {
+      if (Shard(wkey.key, shard_set->size()) != shard->shard_id())
+        continue;
+
+      // The keys that expired since WATCH count as removed.
+      PrimeIterator it = db_slice.FindExt(t->db_context(), wkey.key);
+      bool exists = IsValid(it);
+      if (exists != wkey.existed || (exists && it.GetVersion() >= wkey.version)) {
+        changed.store(true, memory_order_relaxed);
+        break;
+      }
+    }
     return OpStatus::OK;
   };
 
-  VLOG(1) << "Checking expired watch keys";
+  VLOG(1) << "Checking watched keys";
 
   cntx->transaction->SetExecCmd(registry.Find(EXISTS));
   cntx->transaction->InitByArgs(cntx->conn_state.db_index,
@@ -1096,22 +1983,61 @@ bool CheckWatchedKeyExpiry(ConnectionContext* cntx, const CommandRegistry& regis
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
   CHECK_EQ(OpStatus::OK, status);
 
-  // The comparison can still be true even if a key expired due to another one being created.
-  // So we have to check the watched_dirty flag, which is set if a key expired.
-  return watch_exist_count.load() == exec_info.watched_existed &&
-         !exec_info.watched_dirty.load(memory_order_relaxed);
+  return !changed.load(memory_order_relaxed);
 }
 
 // Check if exec_info watches keys on dbs other than db_indx.
 bool IsWatchingOtherDbs(DbIndex db_indx, const ConnectionState::ExecInfo& exec_info) {
-  for (const auto& [key_db, _] : exec_info.watched_keys) {
-    if (key_db != db_indx) {
+  for (const auto& wkey : exec_info.watched_keys) {
+    if (wkey.db_index != db_indx) {
       return true;
     }
   }
   return false;
 }
 
+// Returns the shard that holds all the keys touched by the transaction, or nullopt if they span
+// multiple shards or some command can not run with only its keys locked. Fills keys with them.
+optional<ShardId> FindExecShard(ConnectionState::ExecInfo& exec_info, unsigned shard_count,
+                                vector<string_view>* keys) {
+  for (const auto& wkey : exec_info.watched_keys) {
+    keys->push_back(wkey.key);
+  }
+
+  CmdArgVec str_list;
+  for (auto& scmd : exec_info.body) {
+    const CommandId* cid = scmd.descr;
+    if (!IsTransactional(cid) || (cid->opt_mask() & (CO::GLOBAL_TRANS | CO::BLOCKING)))
+      return nullopt;
+
+    str_list.clear();
+    for (string& s : scmd.cmd) {
+      str_list.emplace_back(s.data(), s.size());
+    }
+
+    OpResult<KeyIndex> key_index = DetermineKeys(cid, {str_list.data(), str_list.size()});
+    if (!key_index)
+      return nullopt;
+
+    if (key_index->bonus)
+      keys->push_back(scmd.cmd[key_index->bonus]);
+    for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+      keys->push_back(scmd.cmd[i]);
+    }
+  }
+
+  // Transaction shard args are limited in size.
+  if (keys->empty() || keys->size() >= (1u << 15))
+    return nullopt;
+
+  ShardId sid = Shard(keys->front(), shard_count);
+  for (string_view key : *keys) {
+    if (Shard(key, shard_count) != sid)
+      return nullopt;
+  }
+  return sid;
+}
+
 void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = (*cntx).operator->();
 
@@ -1130,12 +2056,15 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
     return rb->SendError("-EXECABORT Transaction discarded because of previous errors");
   }
 
-  if (exec_info.watched_dirty.load(memory_order_relaxed)) {
-    return rb->SendNull();
+  // When all the keys belong to a single shard, we lock just them instead of all the shards,
+  // so that the transaction does not wait for unrelated transactions and can run out of order.
+  vector<string_view> exec_keys;
+  if (auto sid = FindExecShard(exec_info, shard_count(), &exec_keys); sid) {
+    cntx->transaction->SetMultiKeys(cntx->db_index(), *sid, exec_keys);
   }
 
-  // EXEC should not run if any of the watched keys expired.
-  if (!exec_info.watched_keys.empty() && !CheckWatchedKeyExpiry(cntx, registry_)) {
+  // EXEC should not run if any of the watched keys changed or expired.
+  if (!exec_info.watched_keys.empty() && !CheckWatchedKeys(cntx, registry_)) {
     cntx->transaction->UnlockMulti();
     return rb->SendNull();
   }
@@ -1175,64 +2104,11 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void Service::Publish(CmdArgList args, ConnectionContext* cntx) {
-  string_view channel = ArgS(args, 1);
-
-  // shared_ptr ensures that the message lives until it's been sent to all subscribers and handled
-  // by DispatchOperations.
-  std::shared_ptr<const std::string> message = std::make_shared<const std::string>(ArgS(args, 2));
-  ShardId sid = Shard(channel, shard_count());
-
-  auto cb = [&] { return EngineShard::tlocal()->channel_slice().FetchSubscribers(channel); };
-
-  // How do we know that subscribers did not disappear after we fetched them?
-  // Each subscriber object hold a borrow_token.
-  // OnClose does not reset subscribe_info before all tokens are returned.
-  vector<ChannelSlice::Subscriber> subscriber_arr = shard_set->Await(sid, std::move(cb));
-  atomic_uint32_t published{0};
-
-  if (!subscriber_arr.empty()) {
-    sort(subscriber_arr.begin(), subscriber_arr.end(),
-         [](const auto& left, const auto& right) { return left.thread_id < right.thread_id; });
-
-    vector<unsigned> slices(shard_set->pool()->size(), UINT_MAX);
-    for (size_t i = 0; i < subscriber_arr.size(); ++i) {
-      if (slices[subscriber_arr[i].thread_id] > i) {
-        slices[subscriber_arr[i].thread_id] = i;
-      }
-    }
-
-    // We run publish_cb in each subscriber's thread.
-    auto publish_cb = [&](unsigned idx, util::ProactorBase*) mutable {
-      unsigned start = slices[idx];
-
-      for (unsigned i = start; i < subscriber_arr.size(); ++i) {
-        const ChannelSlice::Subscriber& subscriber = subscriber_arr[i];
-        if (subscriber.thread_id != idx)
-          break;
-
-        published.fetch_add(1, memory_order_relaxed);
-
-        facade::Connection* conn = subscriber_arr[i].conn_cntx->owner();
-        DCHECK(conn);
-        facade::Connection::PubMessage pmsg;
-        pmsg.channel = channel;
-        pmsg.message = message;
-        pmsg.pattern = subscriber.pattern;
-        conn->SendMsgVecAsync(pmsg);
-      }
-    };
-
-    shard_set->pool()->Await(publish_cb);
-  }
-
-  // If subscriber connections are closing they will wait
-  // for the tokens to be reclaimed in OnClose(). This guarantees that subscribers we gathered
-  // still exist till we finish publishing.
-  for (auto& s : subscriber_arr) {
-    s.borrow_token.Dec();
-  }
+  (*cntx)->SendLong(PublishMessage(ArgS(args, 1), ArgS(args, 2), false));
+}
 
-  (*cntx)->SendLong(published.load(memory_order_relaxed));
+void Service::SPublish(CmdArgList args, ConnectionContext* cntx) {
+  (*cntx)->SendLong(PublishMessage(ArgS(args, 1), ArgS(args, 2), true));
 }
 
 void Service::Subscribe(CmdArgList args, ConnectionContext* cntx) {
@@ -1251,6 +2127,22 @@ void Service::Unsubscribe(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void Service::SSubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
+
+  cntx->ChangeSubscription(true, true, std::move(args), true /* sharded */);
+}
+
+void Service::SUnsubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
+
+  if (args.size() == 0) {
+    cntx->UnsubscribeAll(true, true /* sharded */);
+  } else {
+    cntx->ChangeSubscription(false, true, std::move(args), true /* sharded */);
+  }
+}
+
 void Service::PSubscribe(CmdArgList args, ConnectionContext* cntx) {
   args.remove_prefix(1);
   cntx->ChangePSub(true, true, args);
@@ -1280,11 +2172,13 @@ void Service::Function(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(err, kSyntaxErrType);
 }
 
-void Service::PubsubChannels(string_view pattern, ConnectionContext* cntx) {
+void Service::PubsubChannels(string_view pattern, bool sharded, ConnectionContext* cntx) {
   vector<vector<string>> result_set(shard_set->size());
 
   shard_set->RunBriefInParallel([&](EngineShard* shard) {
-    result_set[shard->shard_id()] = shard->channel_slice().ListChannels(pattern);
+    ChannelSlice& cs = shard->channel_slice();
+    result_set[shard->shard_id()] =
+        sharded ? cs.ListShardChannels(pattern) : cs.ListChannels(pattern);
   });
 
   vector<string> union_set;
@@ -1302,12 +2196,43 @@ void Service::PubsubPatterns(ConnectionContext* cntx) {
   (*cntx)->SendLong(pattern_count);
 }
 
+// MONITOR [SAMPLE ratio] [MATCH pattern] [DB index]
 void Service::Monitor(CmdArgList args, ConnectionContext* cntx) {
+  double sample_ratio = 1;
+  string pattern;
+  optional<DbIndex> db;
+  for (size_t i = 1; i < args.size(); i += 2) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (i + 1 == args.size())
+      return (*cntx)->SendError(kSyntaxErr);
+
+    string_view val = ArgS(args, i + 1);
+    if (opt == "SAMPLE") {
+      if (!absl::SimpleAtod(val, &sample_ratio))
+        return (*cntx)->SendError(kInvalidFloatErr);
+      if (!(sample_ratio > 0 && sample_ratio <= 1))
+        return (*cntx)->SendError("sample ratio must be in (0, 1]");
+    } else if (opt == "MATCH") {
+      pattern = val;
+    } else if (opt == "DB") {
+      int64_t index;
+      if (!absl::SimpleAtoi(val, &index))
+        return (*cntx)->SendError(kInvalidDbIndErr);
+      if (index < 0 || index >= absl::GetFlag(FLAGS_dbnum))
+        return (*cntx)->SendError(kDbIndOutOfRangeErr);
+      db = index;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
   VLOG(1) << "starting monitor on this connection: " << cntx->owner()->GetClientInfo();
   // we are registering the current connection for all threads so they will be aware of
-  // this connection, to send to it any command
+  // this connection, to send to it the commands that its filter picks
   (*cntx)->SendOk();
-  cntx->ChangeMonitor(true /* start */);
+  cntx->ChangeMonitor(true /* start */,
+                      make_shared<MonitorFilter>(cntx, sample_ratio, std::move(pattern), db));
 }
 
 void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
@@ -1326,6 +2251,8 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
         "\tReturn the currently active channels matching a <pattern> (default: '*').",
         "NUMPAT",
         "\tReturn number of subscriptions to patterns.",
+        "SHARDCHANNELS [<pattern>]",
+        "\tReturn the currently active shard channels matching a <pattern> (default: '*').",
         "HELP",
         "\tPrints this help."};
 
@@ -1333,13 +2260,13 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  if (subcmd == "CHANNELS") {
+  if (subcmd == "CHANNELS" || subcmd == "SHARDCHANNELS") {
     string_view pattern;
     if (args.size() > 2) {
       pattern = ArgS(args, 2);
     }
 
-    PubsubChannels(pattern, cntx);
+    PubsubChannels(pattern, subcmd == "SHARDCHANNELS", cntx);
   } else if (subcmd == "NUMPAT") {
     PubsubPatterns(cntx);
   } else {
@@ -1377,6 +2304,8 @@ GlobalState Service::SwitchState(GlobalState from, GlobalState to) {
 void Service::ConfigureHttpHandlers(util::HttpListenerBase* base) {
   server_family_.ConfigureMetrics(base);
   base->RegisterCb("/txz", TxTable);
+  base->RegisterCb("/profile/cpu", ProfileCpu);
+  base->RegisterCb("/profile/heap", ProfileHeap);
 }
 
 void Service::OnClose(facade::ConnectionContext* cntx) {
@@ -1393,6 +2322,12 @@ void Service::OnClose(facade::ConnectionContext* cntx) {
       token.Wait();
     }
 
+    if (conn_state.subscribe_info && !conn_state.subscribe_info->shard_channels.empty()) {
+      auto token = conn_state.subscribe_info->borrow_token;
+      server_cntx->UnsubscribeAll(false, true /* sharded */);
+      token.Wait();
+    }
+
     if (conn_state.subscribe_info) {
       DCHECK(!conn_state.subscribe_info->patterns.empty());
       auto token = conn_state.subscribe_info->borrow_token;
@@ -1405,6 +2340,9 @@ void Service::OnClose(facade::ConnectionContext* cntx) {
 
   DeactivateMonitoring(server_cntx);
 
+  if (conn_state.tracking_info)
+    server_cntx->ChangeTracking(false, false, {});
+
   server_family_.OnClose(server_cntx);
 }
 
@@ -1443,12 +2381,15 @@ void Service::RegisterCommands() {
              &EvalValidator)
       << CI{"EXEC", kExecMask, 1, 0, 0, 0}.MFUNC(Exec)
       << CI{"PUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(Publish)
+      << CI{"SPUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(SPublish)
       << CI{"SUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(Subscribe)
       << CI{"UNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(Unsubscribe)
       << CI{"PSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(PSubscribe)
       << CI{"PUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(PUnsubscribe)
+      << CI{"SSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(SSubscribe)
+      << CI{"SUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(SUnsubscribe)
       << CI{"FUNCTION", CO::NOSCRIPT, 2, 0, 0, 0}.MFUNC(Function)
-      << CI{"MONITOR", CO::ADMIN, 1, 0, 0, 0}.MFUNC(Monitor)
+      << CI{"MONITOR", CO::ADMIN, -1, 0, 0, 0}.MFUNC(Monitor)
       << CI{"PUBSUB", CO::LOADING | CO::FAST, -1, 0, 0, 0}.MFUNC(Pubsub);
 
   StreamFamily::Register(&registry_);
@@ -1460,8 +2401,14 @@ void Service::RegisterCommands() {
   ZSetFamily::Register(&registry_);
   JsonFamily::Register(&registry_);
   BitOpsFamily::Register(&registry_);
+  HllFamily::Register(&registry_);
+  BloomFamily::Register(&registry_);
+  SearchFamily::Register(&registry_);
+  TimeSeriesFamily::Register(&registry_);
+  SketchFamily::Register(&registry_);
 
   server_family_.Register(&registry_);
+  cluster_family_.Register(&registry_);
 
   if (VLOG_IS_ON(1)) {
     LOG(INFO) << "Multi-key commands are: ";
@@ -6,8 +6,10 @@
 
 #include "base/varz_value.h"
 #include "facade/service_interface.h"
+#include "server/cluster/cluster_family.h"
 #include "server/command_registry.h"
 #include "server/engine_shard_set.h"
+#include "server/script_mgr.h"
 #include "server/server_family.h"
 
 namespace util {
@@ -39,6 +41,10 @@ class Service : public facade::ServiceInterface {
   void Shutdown();
 
   void DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx) final;
+
+  // Squashes runs of pipelined GET/SET commands, see --pipeline_squash.
+  void DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                            facade::ConnectionContext* cntx) final;
   void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                   facade::ConnectionContext* cntx) final;
 
@@ -75,6 +81,10 @@ class Service : public facade::ServiceInterface {
     return server_family_;
   }
 
+  ClusterFamily& cluster_family() {
+    return cluster_family_;
+  }
+
   // Returns: the new state.
   // if from equals the old state then the switch is performed "to" is returned.
   // Otherwise, does not switch and returns the current state in the system.
@@ -97,31 +107,59 @@ class Service : public facade::ServiceInterface {
   void EvalSha(CmdArgList args, ConnectionContext* cntx);
   void Exec(CmdArgList args, ConnectionContext* cntx);
   void Publish(CmdArgList args, ConnectionContext* cntx);
+  void SPublish(CmdArgList args, ConnectionContext* cntx);
   void Subscribe(CmdArgList args, ConnectionContext* cntx);
   void Unsubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SSubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SUnsubscribe(CmdArgList args, ConnectionContext* cntx);
   void PSubscribe(CmdArgList args, ConnectionContext* cntx);
   void PUnsubscribe(CmdArgList args, ConnectionContext* cntx);
   void Function(CmdArgList args, ConnectionContext* cntx);
   void Monitor(CmdArgList args, ConnectionContext* cntx);
   void Pubsub(CmdArgList args, ConnectionContext* cntx);
-  void PubsubChannels(std::string_view pattern, ConnectionContext* cntx);
+  void PubsubChannels(std::string_view pattern, bool sharded, ConnectionContext* cntx);
   void PubsubPatterns(ConnectionContext* cntx);
 
+  // Runs the commands in one hop per shard and sends their replies in order.
+  void SquashCommands(absl::Span<CmdArgList> args_list, ConnectionContext* cntx);
+
   struct EvalArgs {
     std::string_view sha;  // only one of them is defined.
     CmdArgList keys, args;
   };
 
-  void EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter, ConnectionContext* cntx);
+  void EvalInternal(const EvalArgs& eval_args, ConnectionContext* cntx);
+
+  // Runs the script and replies into rb. Concludes the script transaction.
+  void RunScript(const EvalArgs& eval_args, Interpreter* interpreter, facade::RedisReplyBuilder* rb,
+                 ConnectionContext* cntx);
+
+  // Whether the script can run in the shard thread of its keys.
+  bool CanRunScriptInShard(const ScriptMgr::ScriptParams& params, ConnectionContext* cntx) const;
+
+  // Runs a script whose keys belong to a single shard in the thread of that shard, so that its
+  // commands do not hop between the threads. Returns false if the interpreter of that thread
+  // or the keys are busy, in which case the script did not run.
+  bool RunScriptInShard(const EvalArgs& eval_args, ConnectionContext* cntx);
 
   void CallFromScript(CmdArgList args, ObjectExplorer* reply, ConnectionContext* cntx);
 
+  // Runs the commands of redis.pcall_batch in order. The consecutive reads of the script keys
+  // run in a single hop of the script transaction, see RunScriptBatch.
+  void CallBatchFromScript(absl::Span<CmdArgList> cmds, ObjectExplorer* reply,
+                           ConnectionContext* cntx);
+
+  // Runs GET and HGET commands on declared keys of the script in the shards of their keys.
+  void RunScriptBatch(absl::Span<CmdArgList> cmds, ObjectExplorer* reply,
+                      ConnectionContext* cntx);
+
   void RegisterCommands();
   base::VarzValue::Map GetVarzStats();
 
   util::ProactorPool& pp_;
 
   ServerFamily server_family_;
+  ClusterFamily cluster_family_;
   CommandRegistry registry_;
   absl::flat_hash_map<std::string, unsigned> unknown_cmds_;
 
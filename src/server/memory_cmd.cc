@@ -4,15 +4,19 @@
 
 #include "server/memory_cmd.h"
 
+#include <absl/container/btree_map.h>
 #include <absl/strings/str_cat.h>
 #include <mimalloc.h>
 
+#include <boost/fiber/operations.hpp>
+
 #include "facade/error.h"
 #include "server/engine_shard_set.h"
 #include "server/server_state.h"
 
 using namespace std;
 using namespace facade;
+namespace this_fiber = ::boost::this_fiber;
 
 namespace dfly {
 
@@ -36,6 +40,88 @@ bool MiArenaVisit(const mi_heap_t* heap, const mi_heap_area_t* area, void* block
   return true;
 };
 
+// The values of a type and an encoding. For external values, the bytes are those on disk.
+struct EncodingStats {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+};
+
+struct MemoryStats {
+  uint64_t keys = 0;
+  uint64_t sampled_keys = 0;
+  uint64_t inline_keys = 0;
+  uint64_t heap_keys = 0;
+  uint64_t heap_key_bytes = 0;
+  uint64_t prime_table_bytes = 0;
+
+  // By "<type>.<encoding>", e.g. "hash.listpack".
+  absl::btree_map<string, EncodingStats> encodings;
+
+  // Adds o, with its per-key counters multiplied by scale.
+  void Merge(const MemoryStats& o, double scale);
+};
+
+void MemoryStats::Merge(const MemoryStats& o, double scale) {
+  keys += o.keys;
+  sampled_keys += o.sampled_keys;
+  inline_keys += o.inline_keys * scale;
+  heap_keys += o.heap_keys * scale;
+  heap_key_bytes += o.heap_key_bytes * scale;
+  prime_table_bytes += o.prime_table_bytes;
+  for (const auto& [name, es] : o.encodings) {
+    EncodingStats& dest = encodings[name];
+    dest.count += es.count * scale;
+    dest.bytes += es.bytes * scale;
+  }
+}
+
+// Traverses up to max_samples entries of every database of the shard, all of them if it is 0,
+// and extrapolates the entries that were not visited. Yields between the buckets, so that
+// the shard keeps serving.
+MemoryStats ShardMemoryStats(EngineShard* shard, size_t max_samples) {
+  MemoryStats res;
+  // Copies the tables, in case they are flushed during the traversal.
+  DbTableArray dbs = shard->db_slice().databases();
+  for (const auto& db : dbs) {
+    if (!db)
+      continue;
+
+    MemoryStats db_stats;
+    auto cb = [&](PrimeIterator it) {
+      const PrimeKey& key = it->first;
+      const PrimeValue& pv = it->second;
+      ++db_stats.sampled_keys;
+      if (key.IsInline()) {
+        ++db_stats.inline_keys;
+      } else {
+        ++db_stats.heap_keys;
+        db_stats.heap_key_bytes += key.MallocUsed();
+      }
+
+      EncodingStats& es =
+          db_stats.encodings[absl::StrCat(ObjTypeName(pv.ObjType()), ".", pv.EncodingName())];
+      ++es.count;
+      es.bytes += pv.IsExternal() ? pv.GetExternalPtr().second : pv.MallocUsed();
+    };
+
+    PrimeTable::Cursor cursor;
+    unsigned buckets = 0;
+    do {
+      cursor = db->prime.Traverse(cursor, cb);
+      if (++buckets % 100 == 0)
+        this_fiber::yield();
+    } while (cursor && (max_samples == 0 || db_stats.sampled_keys < max_samples));
+
+    db_stats.keys = db->prime.size();
+    db_stats.prime_table_bytes = db->prime.mem_usage();
+    double scale = 1;
+    if (cursor && db_stats.sampled_keys > 0)
+      scale = double(db_stats.keys) / db_stats.sampled_keys;
+    res.Merge(db_stats, scale);
+  }
+  return res;
+}
+
 }  // namespace
 
 MemoryCmd::MemoryCmd(ServerFamily* owner, ConnectionContext* cntx) : sf_(*owner), cntx_(cntx) {
@@ -57,10 +143,100 @@ void MemoryCmd::Run(CmdArgList args) {
     return (*cntx_)->SendBulkString(res);
   }
 
+  if (sub_cmd == "STATS") {
+    size_t samples = 0;
+    if (args.size() == 4) {
+      ToUpper(&args[2]);
+      if (ArgS(args, 2) != "SAMPLES")
+        return (*cntx_)->SendError(kSyntaxErr);
+      if (!absl::SimpleAtoi(ArgS(args, 3), &samples)) {
+        return (*cntx_)->SendError(kInvalidIntErr);
+      }
+    } else if (args.size() != 2) {
+      return (*cntx_)->SendError(kSyntaxErr);
+    }
+    return SendStats(samples);
+  }
+
+  if (sub_cmd == "HOTKEYS" || sub_cmd == "BIGKEYS") {
+    size_t count = 10;
+    if (args.size() > 3) {
+      return (*cntx_)->SendError(kSyntaxErr);
+    }
+    if (args.size() == 3 && !absl::SimpleAtoi(ArgS(args, 2), &count)) {
+      return (*cntx_)->SendError(kInvalidIntErr);
+    }
+    return SendTopKeys(sub_cmd == "HOTKEYS", count);
+  }
+
   string err = UnknownSubCmd(sub_cmd, "MEMORY");
   return (*cntx_)->SendError(err, kSyntaxErrType);
 }
 
+// Replies with an array of [key, count] pairs, by descending count.
+void MemoryCmd::SendTopKeys(bool hot, size_t count) {
+  vector<vector<TopKeys::Entry>> shard_keys(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    shard_keys[shard->shard_id()] = hot ? db_slice.GetHotKeys(count) : db_slice.GetBigKeys(count);
+  });
+
+  // The shards own disjoint keys, so the top of all the keys is the top of the tops of the shards.
+  vector<TopKeys::Entry> entries;
+  for (auto& keys : shard_keys) {
+    entries.insert(entries.end(), make_move_iterator(keys.begin()),
+                   make_move_iterator(keys.end()));
+  }
+  sort(entries.begin(), entries.end(),
+       [](const TopKeys::Entry& a, const TopKeys::Entry& b) { return a.count > b.count; });
+  entries.resize(min(count, entries.size()));
+
+  (*cntx_)->StartArray(entries.size());
+  for (const auto& e : entries) {
+    (*cntx_)->StartArray(2);
+    (*cntx_)->SendBulkString(e.key);
+    (*cntx_)->SendLong(e.count);
+  }
+}
+
+// Replies with a flat array of name/value pairs, like the MEMORY STATS of Redis. Every
+// "<type>.<encoding>" entry is itself such an array, with the count and the bytes of its values.
+void MemoryCmd::SendStats(size_t samples) {
+  vector<MemoryStats> shard_stats(shard_set->size());
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    shard_stats[shard->shard_id()] = ShardMemoryStats(shard, samples);
+  });
+
+  MemoryStats total;
+  for (const auto& s : shard_stats)
+    total.Merge(s, 1);
+
+  pair<string_view, uint64_t> fields[] = {
+      {"keys.count", total.keys},
+      {"keys.sampled", total.sampled_keys},
+      {"keys.inline", total.inline_keys},
+      {"keys.heap", total.heap_keys},
+      {"keys.heap.bytes", total.heap_key_bytes},
+      {"table.prime.bytes", total.prime_table_bytes},
+  };
+
+  (*cntx_)->StartArray((size(fields) + total.encodings.size()) * 2);
+  for (const auto& [name, value] : fields) {
+    (*cntx_)->SendBulkString(name);
+    (*cntx_)->SendLong(value);
+  }
+  for (const auto& [name, es] : total.encodings) {
+    (*cntx_)->SendBulkString(name);
+    (*cntx_)->StartArray(6);
+    (*cntx_)->SendBulkString("count");
+    (*cntx_)->SendLong(es.count);
+    (*cntx_)->SendBulkString("bytes");
+    (*cntx_)->SendLong(es.bytes);
+    (*cntx_)->SendBulkString("bytes-per-entry");
+    (*cntx_)->SendLong(es.count ? es.bytes / es.count : 0);
+  }
+}
+
 string MemoryCmd::MallocStats(unsigned tid) {
   string str;
 
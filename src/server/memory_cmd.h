@@ -18,6 +18,8 @@ class MemoryCmd {
 
  private:
   std::string MallocStats(unsigned tid);
+  void SendTopKeys(bool hot, size_t count);
+  void SendStats(size_t samples);
 
   ServerFamily& sf_;
   ConnectionContext* cntx_;
@@ -0,0 +1,207 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/profiler.h"
+
+#include <absl/container/btree_map.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+#include <execinfo.h>
+#include <mimalloc.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <boost/fiber/operations.hpp>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "base/logging.h"
+#include "server/server_state.h"
+#include "util/proactor_pool.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace dfly {
+
+using namespace std;
+using util::ProactorBase;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 64;
+
+// The frames of the signal handler and of the signal trampoline of the kernel.
+constexpr unsigned kSkipFrames = 2;
+
+// About 8MB. The samples beyond it are dropped.
+constexpr size_t kMaxSamples = 1 << 14;
+
+struct Sample {
+  atomic_uint32_t depth{0};  // Set once pcs are written.
+  void* pcs[kMaxDepth];
+};
+
+atomic_bool cpu_profiling{false};
+Sample* samples = nullptr;
+atomic_size_t num_samples{0};
+
+void OnProfSignal(int, siginfo_t*, void*) {
+  int saved_errno = errno;
+  size_t index = num_samples.fetch_add(1, memory_order_relaxed);
+  if (index < kMaxSamples) {
+    Sample& sample = samples[index];
+    int depth = backtrace(sample.pcs, kMaxDepth);
+    sample.depth.store(depth, memory_order_release);
+  }
+  errno = saved_errno;
+}
+
+void AppendWord(uintptr_t word, string* dest) {
+  dest->append(reinterpret_cast<const char*>(&word), sizeof(word));
+}
+
+// See https://github.com/gperftools/gperftools/blob/master/docs/cpuprofile-fileformat.html
+string FormatCpuProfile(unsigned period_usec) {
+  size_t count = min(num_samples.load(memory_order_relaxed), kMaxSamples);
+  absl::flat_hash_map<vector<uintptr_t>, uint64_t> stacks;
+  for (size_t i = 0; i < count; ++i) {
+    const Sample& sample = samples[i];
+    unsigned depth = sample.depth.load(memory_order_acquire);
+    if (depth <= kSkipFrames)
+      continue;
+    vector<uintptr_t> pcs(depth - kSkipFrames);
+    for (unsigned j = kSkipFrames; j < depth; ++j)
+      pcs[j - kSkipFrames] = reinterpret_cast<uintptr_t>(sample.pcs[j]);
+    ++stacks[std::move(pcs)];
+  }
+
+  string res;
+  for (uintptr_t word : {0u, 3u, 0u, period_usec, 0u})
+    AppendWord(word, &res);
+
+  for (const auto& [pcs, hits] : stacks) {
+    AppendWord(hits, &res);
+    AppendWord(pcs.size(), &res);
+    for (uintptr_t pc : pcs)
+      AppendWord(pc, &res);
+  }
+
+  for (uintptr_t word : {0u, 1u, 0u})
+    AppendWord(word, &res);
+
+  // pprof maps the addresses to the binaries with the mappings of the process.
+  ifstream maps("/proc/self/maps");
+  res.append(istreambuf_iterator<char>(maps), istreambuf_iterator<char>());
+  return res;
+}
+
+}  // namespace
+
+optional<string> CollectCpuProfile(util::ProactorPool* pool, chrono::milliseconds duration,
+                                   unsigned hz) {
+  if (cpu_profiling.exchange(true))
+    return nullopt;
+
+  unique_ptr<Sample[]> buffer(new Sample[kMaxSamples]);
+  samples = buffer.get();
+  num_samples.store(0, memory_order_relaxed);
+
+  // backtrace loads libgcc on its first call, which must not happen in the signal handler.
+  void* pcs[1];
+  backtrace(pcs, 1);
+
+  struct sigaction sa = {}, prev_sa = {};
+  sa.sa_sigaction = OnProfSignal;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  CHECK_EQ(0, sigaction(SIGPROF, &sa, &prev_sa));
+
+  hz = clamp(hz, 1u, 1000u);
+  uint64_t period_ns = 1000000000ULL / hz;
+
+  // A timer per thread, which measures the CPU time of the thread and signals only it.
+  vector<timer_t> timers(pool->size());
+  vector<uint8_t> armed(pool->size(), 0);
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    sigevent sev = {};
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timers[index]) != 0) {
+      LOG(WARNING) << "Could not create a profiling timer " << strerror(errno);
+      return;
+    }
+
+    itimerspec its = {};
+    its.it_interval.tv_sec = period_ns / 1000000000;
+    its.it_interval.tv_nsec = period_ns % 1000000000;
+    its.it_value = its.it_interval;
+    timer_settime(timers[index], 0, &its, nullptr);
+    armed[index] = 1;
+  });
+
+  boost::this_fiber::sleep_for(duration);
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    if (armed[index])
+      timer_delete(timers[index]);
+  });
+  sigaction(SIGPROF, &prev_sa, nullptr);
+
+  size_t total = num_samples.load(memory_order_relaxed);
+  LOG_IF(WARNING, total > kMaxSamples)
+      << "Dropped " << total - kMaxSamples << " samples of the cpu profile";
+  string res = FormatCpuProfile(period_ns / 1000);
+
+  samples = nullptr;
+  cpu_profiling.store(false);
+  return res;
+}
+
+string CollectHeapProfile(util::ProactorPool* pool) {
+  struct BlockStats {
+    uint64_t count = 0;
+    uint64_t used = 0;
+    uint64_t committed = 0;
+  };
+
+  // By the block size.
+  using BlockMap = absl::btree_map<size_t, BlockStats>;
+
+  auto visit = [](const mi_heap_t*, const mi_heap_area_t* area, void*, size_t block_size,
+                  void* arg) {
+    BlockStats& stats = (*reinterpret_cast<BlockMap*>(arg))[block_size];
+    ++stats.count;
+    stats.used += area->used * block_size;
+    stats.committed += area->committed;
+    return true;
+  };
+
+  vector<BlockMap> threads(pool->size());
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    mi_heap_visit_blocks(ServerState::tlocal()->data_heap(), false /* visit all blocks*/, visit,
+                         &threads[index]);
+  });
+
+  string res = "thread block_size areas used committed\n";
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    uint64_t used = 0, committed = 0;
+    for (const auto& [block_size, stats] : threads[i]) {
+      absl::StrAppend(&res, i, " ", block_size, " ", stats.count, " ", stats.used, " ",
+                      stats.committed, "\n");
+      used += stats.used;
+      committed += stats.committed;
+    }
+    absl::StrAppend(&res, i, " total - ", used, " ", committed, "\n");
+  }
+  return res;
+}
+
+}  // namespace dfly
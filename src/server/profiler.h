@@ -0,0 +1,29 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+namespace util {
+class ProactorPool;
+}  // namespace util
+
+namespace dfly {
+
+// Samples the stacks of the threads of pool every 1/hz second of the CPU time of each thread,
+// for duration. Returns the profile in the legacy binary format of gperftools, which pprof
+// reads, e.g. "pprof -http :8080 dragonfly cpu.prof". Returns nullopt if another profile is
+// being collected. Backs the /profile/cpu page of the http console.
+std::optional<std::string> CollectCpuProfile(util::ProactorPool* pool,
+                                             std::chrono::milliseconds duration, unsigned hz);
+
+// The blocks of the mimalloc data heap of every thread by block size, as text.
+// mimalloc does not keep the stacks of the allocations, so this is not a pprof profile.
+// Backs the /profile/heap page of the http console.
+std::string CollectHeapProfile(util::ProactorPool* pool);
+
+}  // namespace dfly
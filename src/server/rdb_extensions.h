@@ -10,3 +10,34 @@
 // to notify that it finished streaming static data and is ready
 // to switch to the stable state replication phase.
 const uint8_t RDB_OPCODE_FULLSYNC_END = 200;
+
+// A value that stays in the backing file of the tiered storage, see tiered_reuse_backing_file.
+// Followed by the key, the shard id, the object type, the encoding and the offset and size of
+// the value in the backing file.
+const uint8_t RDB_TYPE_EXTERNAL = 201;
+
+// A block of serialized entries compressed as a whole. Followed by the uncompressed and the
+// compressed lengths and the compressed bytes. Blocks always contain complete entries.
+const uint8_t RDB_OPCODE_COMPRESSED_ZSTD_BLOB = 202;
+const uint8_t RDB_OPCODE_COMPRESSED_LZ4_BLOB = 203;
+
+// A key deleted since the base of a delta snapshot, see SAVE DELTA. Followed by the key.
+// Delta snapshots carry the file name of their base in the "delta-base" aux field.
+const uint8_t RDB_OPCODE_DELETED_KEY = 204;
+
+// Persistent journal files are RDB streams without the EOF opcode and the checksum, see
+// JournalSlice. A flush of a database in a shard is followed by the db index and the shard id.
+// Every batch of entries written at once ends with a commit marker followed by the 8 byte LSN
+// of its last entry, so a torn batch at the end of the file is recognized at recovery.
+const uint8_t RDB_OPCODE_JOURNAL_FLUSH = 205;
+const uint8_t RDB_OPCODE_JOURNAL_COMMIT = 206;
+
+// A change of some fields of a hash in the persistent journal, written instead of the whole
+// hash. Followed by the key, the number of the fields set and the fields interleaved with their
+// values, then the number of the fields removed and the fields.
+const uint8_t RDB_OPCODE_HASH_FIELDS = 207;
+
+// Version of the snapshots that store listpack based values verbatim, using
+// RDB_TYPE_HASH_LISTPACK, RDB_TYPE_ZSET_LISTPACK and RDB_TYPE_LIST_QUICKLIST_2.
+// Such snapshots are readable by Redis 7, RDB_VERSION snapshots by older versions as well.
+const int RDB_NATIVE_VERSION = 10;
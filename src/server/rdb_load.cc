@@ -6,6 +6,7 @@
 
 extern "C" {
 
+#include "redis/crc64.h"
 #include "redis/intset.h"
 #include "redis/listpack.h"
 #include "redis/lzfP.h" /* LZF compression library */
@@ -18,11 +19,15 @@ extern "C" {
 }
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <lz4.h>
+#include <zstd.h>
 
 #include "base/endian.h"
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/string_map.h"
 #include "core/string_set.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
@@ -31,6 +36,7 @@ extern "C" {
 #include "server/script_mgr.h"
 #include "server/server_state.h"
 #include "server/set_family.h"
+#include "server/tiered_storage.h"
 #include "strings/human_readable.h"
 
 ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
@@ -201,6 +207,31 @@ bool resizeStringSet(robj* set, size_t size, bool use_set2) {
   }
 }
 
+// Given the crc64 of prefix + suffix, returns the crc64 of prefix.
+// crc64 is linear, so crc(prefix + suffix) = crc(prefix) * x^(8 * len(suffix)) + crc0(suffix),
+// where crc0 starts from zero. The multiplication is undone one bit at a time.
+uint64_t Crc64DropSuffix(uint64_t crc, io::Bytes suffix) {
+  constexpr uint64_t kReflectedPoly = 0x95ac9329ac4bc9b5ULL;
+
+  crc ^= crc64(0, suffix.data(), suffix.size());
+  for (size_t i = 0; i < suffix.size() * 8; ++i) {
+    uint64_t carry = crc >> 63;
+    crc = ((crc ^ (carry ? kReflectedPoly : 0)) << 1) | carry;
+  }
+  return crc;
+}
+
+// Decompresses a block written by BlobCompressor. Returns the decompressed length, 0 on errors.
+size_t DecompressBlob(int opcode, const void* src, size_t src_len, void* dest, size_t len) {
+  if (opcode == RDB_OPCODE_COMPRESSED_ZSTD_BLOB) {
+    size_t res = ZSTD_decompress(dest, len, src, src_len);
+    return ZSTD_isError(res) ? 0 : res;
+  }
+  int res = LZ4_decompress_safe(static_cast<const char*>(src), static_cast<char*>(dest), src_len,
+                                len);
+  return res < 0 ? 0 : res;
+}
+
 }  // namespace
 
 class RdbLoaderBase::OpaqueObjLoader {
@@ -221,6 +252,14 @@ class RdbLoaderBase::OpaqueObjLoader {
   void operator()(const LzfString& lzfstr);
   void operator()(const unique_ptr<LoadTrace>& ptr);
 
+  void operator()(const ExternalRef& ref) {
+    if (ref.obj_type == OBJ_STRING) {
+      pv_->SetExternal(ref.offset, ref.len);
+    } else {
+      pv_->SetExternal(ref.offset, ref.len, ref.obj_type, ref.encoding);
+    }
+  }
+
   std::error_code ec() const {
     return ec_;
   }
@@ -234,6 +273,9 @@ class RdbLoaderBase::OpaqueObjLoader {
 
   void HandleBlob(string_view blob);
 
+  // Returns a newly allocated listpack of (field, value) pairs or null on error.
+  uint8_t* LoadPairsListPack(string_view blob);
+
   sds ToSds(const RdbVariant& obj);
   string_view ToSV(const RdbVariant& obj);
 
@@ -418,35 +460,27 @@ void RdbLoaderBase::OpaqueObjLoader::CreateHMap(const LoadTrace* ltrace) {
     res = createObject(OBJ_HASH, lp);
     res->encoding = OBJ_ENCODING_LISTPACK;
   } else {
-    dict* hmap = dictCreate(&hashDictType);
+    StringMap* string_map = new StringMap(CompactObj::memory_resource());
 
-    auto cleanup = absl::MakeCleanup([&] { dictRelease(hmap); });
-
-    if (len > DICT_HT_INITIAL_SIZE) {
-      if (dictTryExpand(hmap, len) != DICT_OK) {
-        LOG(ERROR) << "OOM in dictTryExpand " << len;
-        ec_ = RdbError(errc::out_of_memory);
-        return;
-      }
-    }
+    auto cleanup = absl::MakeCleanup([&] { delete string_map; });
 
+    // ToSV may return a view into a shared buffer, hence we copy the key.
+    string key;
     for (size_t i = 0; i < len; ++i) {
-      sds key = ToSds(ltrace->arr[i * 2].rdb_var);
-      sds val = ToSds(ltrace->arr[i * 2 + 1].rdb_var);
+      key = ToSV(ltrace->arr[i * 2].rdb_var);
+      string_view val = ToSV(ltrace->arr[i * 2 + 1].rdb_var);
 
-      if (!key || !val)
+      if (ec_)
         return;
 
-      /* Add pair to hash table */
-      int ret = dictAdd(hmap, key, val);
-      if (ret == DICT_ERR) {
+      if (!string_map->AddOrSkip(key, val)) {
         LOG(ERROR) << "Duplicate hash fields detected";
         ec_ = RdbError(errc::rdb_file_corrupted);
         return;
       }
     }
 
-    res = createObject(OBJ_HASH, hmap);
+    res = createObject(OBJ_HASH, string_map);
     res->encoding = OBJ_ENCODING_HT;
     std::move(cleanup).Cancel();
   }
@@ -717,14 +751,10 @@ void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
       res = createObject(OBJ_SET, mine);
       res->encoding = OBJ_ENCODING_INTSET;
     }
-  } else if (rdb_type_ == RDB_TYPE_HASH_ZIPLIST) {
-    unsigned char* lp = lpNew(blob.size());
-    if (!ziplistPairsConvertAndValidateIntegrity((const uint8_t*)blob.data(), blob.size(), &lp)) {
-      LOG(ERROR) << "Zset ziplist integrity check failed.";
-      zfree(lp);
-      ec_ = RdbError(errc::rdb_file_corrupted);
+  } else if (rdb_type_ == RDB_TYPE_HASH_ZIPLIST || rdb_type_ == RDB_TYPE_HASH_LISTPACK) {
+    unsigned char* lp = LoadPairsListPack(blob);
+    if (!lp)
       return;
-    }
 
     if (lpLength(lp) == 0) {
       lpFree(lp);
@@ -735,18 +765,17 @@ void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
     res = createObject(OBJ_HASH, lp);
     res->encoding = OBJ_ENCODING_LISTPACK;
 
-    if (lpBytes(lp) > HSetFamily::MaxListPackLen())
-      hashTypeConvert(res, OBJ_ENCODING_HT);
-    else
+    if (lpBytes(lp) > HSetFamily::MaxListPackLen()) {
+      res->ptr = HSetFamily::ConvertToStrMap(lp);
+      res->encoding = OBJ_ENCODING_HT;
+      lpFree(lp);
+    } else {
       res->ptr = lpShrinkToFit((uint8_t*)res->ptr);
-  } else if (rdb_type_ == RDB_TYPE_ZSET_ZIPLIST) {
-    unsigned char* lp = lpNew(blob.size());
-    if (!ziplistPairsConvertAndValidateIntegrity((uint8_t*)blob.data(), blob.size(), &lp)) {
-      LOG(ERROR) << "Zset ziplist integrity check failed.";
-      zfree(lp);
-      ec_ = RdbError(errc::rdb_file_corrupted);
-      return;
     }
+  } else if (rdb_type_ == RDB_TYPE_ZSET_ZIPLIST || rdb_type_ == RDB_TYPE_ZSET_LISTPACK) {
+    unsigned char* lp = LoadPairsListPack(blob);
+    if (!lp)
+      return;
 
     if (lpLength(lp) == 0) {
       lpFree(lp);
@@ -768,6 +797,33 @@ void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
   pv_->ImportRObj(res);
 }
 
+uint8_t* RdbLoaderBase::OpaqueObjLoader::LoadPairsListPack(string_view blob) {
+  uint8_t* src = (uint8_t*)blob.data();
+  uint8_t* lp = nullptr;
+
+  if (rdb_type_ == RDB_TYPE_HASH_LISTPACK || rdb_type_ == RDB_TYPE_ZSET_LISTPACK) {
+    // Native encoding, the listpack is adopted as is.
+    if (!lpValidateIntegrity(src, blob.size(), 1, NULL, NULL) || lpLength(src) % 2 != 0) {
+      LOG(ERROR) << "Listpack integrity check failed.";
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return nullptr;
+    }
+
+    lp = (uint8_t*)zmalloc(blob.size());
+    memcpy(lp, src, blob.size());
+  } else {
+    lp = lpNew(blob.size());
+    if (!ziplistPairsConvertAndValidateIntegrity(src, blob.size(), &lp)) {
+      LOG(ERROR) << "Ziplist integrity check failed.";
+      zfree(lp);
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return nullptr;
+    }
+  }
+
+  return lp;
+}
+
 sds RdbLoaderBase::OpaqueObjLoader::ToSds(const RdbVariant& obj) {
   if (holds_alternative<long long>(obj)) {
     return sdsfromlonglong(get<long long>(obj));
@@ -856,6 +912,7 @@ std::error_code RdbLoaderBase::FetchBuf(size_t size, void* dest) {
     if (bytes_read < size)
       return RdbError(errc::rdb_file_corrupted);
 
+    UpdateChecksum(next, bytes_read);
     bytes_read_ += bytes_read;
     DCHECK_LE(bytes_read_, source_limit_);
 
@@ -875,6 +932,7 @@ std::error_code RdbLoaderBase::FetchBuf(size_t size, void* dest) {
 
   if (bytes_read < size)
     return RdbError(errc::rdb_file_corrupted);
+  UpdateChecksum(mb.data(), bytes_read);
   bytes_read_ += bytes_read;
 
   DCHECK_LE(bytes_read_, source_limit_);
@@ -1069,6 +1127,9 @@ auto RdbLoaderBase::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
       return ReadZSet(rdbtype);
     case RDB_TYPE_ZSET_ZIPLIST:
       return ReadZSetZL();
+    case RDB_TYPE_HASH_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+      return ReadListPack(rdbtype);
     case RDB_TYPE_LIST_QUICKLIST:
     case RDB_TYPE_LIST_QUICKLIST_2:
       return ReadListQuicklist(rdbtype);
@@ -1082,6 +1143,22 @@ auto RdbLoaderBase::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
   return Unexpected(errc::invalid_encoding);
 }
 
+auto RdbLoaderBase::ReadExternalRef(ShardId* shard_id) -> io::Result<OpaqueObj> {
+  ExternalRef ref;
+  uint64_t sid, obj_type, encoding;
+
+  SET_OR_UNEXPECT(LoadLen(nullptr), sid);
+  SET_OR_UNEXPECT(LoadLen(nullptr), obj_type);
+  SET_OR_UNEXPECT(LoadLen(nullptr), encoding);
+  SET_OR_UNEXPECT(LoadLen(nullptr), ref.offset);
+  SET_OR_UNEXPECT(LoadLen(nullptr), ref.len);
+
+  *shard_id = sid;
+  ref.obj_type = obj_type;
+  ref.encoding = encoding;
+  return OpaqueObj{ref, RDB_TYPE_EXTERNAL};
+}
+
 auto RdbLoaderBase::ReadStringObj() -> io::Result<RdbVariant> {
   bool isencoded;
   size_t len;
@@ -1261,6 +1338,17 @@ auto RdbLoaderBase::ReadZSetZL() -> io::Result<OpaqueObj> {
   return OpaqueObj{std::move(str_obj), RDB_TYPE_ZSET_ZIPLIST};
 }
 
+auto RdbLoaderBase::ReadListPack(int rdbtype) -> io::Result<OpaqueObj> {
+  RdbVariant str_obj;
+  SET_OR_UNEXPECT(ReadStringObj(), str_obj);
+
+  if (StrLen(str_obj) == 0) {
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  return OpaqueObj{std::move(str_obj), rdbtype};
+}
+
 auto RdbLoaderBase::ReadListQuicklist(int rdbtype) -> io::Result<OpaqueObj> {
   uint64_t len;
   SET_OR_UNEXPECT(LoadLen(nullptr), len);
@@ -1486,6 +1574,7 @@ error_code RdbLoader::Load(io::Source* src) {
   if (bytes_read_ < 9) {
     return RdbError(errc::wrong_signature);
   }
+  UpdateChecksum(bytes.data(), bytes_read_);
 
   mem_buf_.CommitWrite(bytes_read_);
 
@@ -1500,7 +1589,7 @@ error_code RdbLoader::Load(io::Source* src) {
     ::memcpy(buf, cb.data() + 5, 4);
 
     int rdbver = atoi(buf);
-    if (rdbver < 5 || rdbver > RDB_VERSION) {  // We accept starting from 5.
+    if (rdbver < 5 || rdbver > RDB_NATIVE_VERSION) {  // We accept starting from 5.
       LOG(ERROR) << "RDB Version " << rdbver << " is not supported";
       return RdbError(errc::bad_version);
     }
@@ -1508,17 +1597,60 @@ error_code RdbLoader::Load(io::Source* src) {
     mem_buf_.ConsumeInput(9);
   }
 
+  size_t keys_loaded = 0;
+  error_code ec = LoadBody(&keys_loaded);
+  if (header_only_)
+    return ec;
+
+  // A crash may tear the last batch of a journal, the entries up to the failure are applied.
+  if (ec && journal_mode_ && !stop_early_) {
+    bool clean_end = mem_buf_.InputLen() == 0 && bytes_read_ == commit_offset_;
+    LOG_IF(WARNING, !clean_end) << "Skipping the torn tail of the journal after LSN "
+                                << committed_lsn_ << ": " << ec.message();
+    ec.clear();
+  }
+  RETURN_ON_ERR(ec);
+
+  if (stop_early_) {
+    return *ec_;
+  }
+
+  /* Verify the checksum if RDB version is >= 5 */
+  if (!journal_mode_)
+    RETURN_ON_ERR(VerifyChecksum());
+
+  fibers_ext::BlockingCounter bc(shard_set->size());
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    // Flush the remaining items.
+    FlushShardAsync(i);
+
+    // Send sentinel callbacks to ensure that all previous messages have been processed.
+    shard_set->Add(i, [bc]() mutable { bc.Dec(); });
+  }
+  bc.Wait();  // wait for sentinels to report.
+
+  absl::Duration dur = absl::Now() - start;
+  load_time_ = double(absl::ToInt64Milliseconds(dur)) / 1000;
+  keys_loaded_ = keys_loaded;
+
+  return kOk;
+}
+
+error_code RdbLoader::LoadBody(size_t* keys_loaded) {
   int type;
 
   /* Key-specific attributes, set by opcodes before the key type. */
   ObjSettings settings;
   settings.now = mstime();
-  size_t keys_loaded = 0;
 
   while (!stop_early_.load(memory_order_relaxed)) {
     /* Read type. */
     SET_OR_RETURN(FetchType(), type);
 
+    // Aux fields precede all the other opcodes.
+    if (header_only_ && type != RDB_OPCODE_AUX)
+      return kOk;
+
     /* Handle special types. */
     if (type == RDB_OPCODE_EXPIRETIME) {
       LOG(ERROR) << "opcode RDB_OPCODE_EXPIRETIME not supported";
@@ -1592,7 +1724,9 @@ error_code RdbLoader::Load(io::Source* src) {
       SET_OR_RETURN(LoadLen(nullptr), db_size);
       SET_OR_RETURN(LoadLen(nullptr), expires_size);
 
-      ResizeDb(db_size, expires_size);
+      VLOG(1) << "Resize DB " << cur_db_index_ << ": " << db_size << " keys, " << expires_size
+              << " expires";
+      ResizeDb(cur_db_index_, db_size);
       continue; /* Read next opcode. */
     }
 
@@ -1601,41 +1735,46 @@ error_code RdbLoader::Load(io::Source* src) {
       continue; /* Read type again. */
     }
 
+    if (type == RDB_OPCODE_COMPRESSED_ZSTD_BLOB || type == RDB_OPCODE_COMPRESSED_LZ4_BLOB) {
+      RETURN_ON_ERR(HandleCompressedBlob(type));
+      continue;
+    }
+
+    if (type == RDB_OPCODE_DELETED_KEY) {
+      RETURN_ON_ERR(HandleDeletedKey());
+      continue;
+    }
+
+    if (type == RDB_OPCODE_JOURNAL_FLUSH) {
+      RETURN_ON_ERR(HandleJournalFlush());
+      continue;
+    }
+
+    if (type == RDB_OPCODE_HASH_FIELDS) {
+      RETURN_ON_ERR(HandleHashFields());
+      continue;
+    }
+
+    if (type == RDB_OPCODE_JOURNAL_COMMIT) {
+      SET_OR_RETURN(FetchInt<uint64_t>(), committed_lsn_);
+      commit_offset_ = bytes_read_ - mem_buf_.InputLen();
+      continue;
+    }
+
     if (type == RDB_OPCODE_MODULE_AUX) {
       LOG(ERROR) << "Modules are not supported";
       return RdbError(errc::feature_not_supported);
     }
 
-    if (!rdbIsObjectType(type)) {
+    if (!rdbIsObjectType(type) && type != RDB_TYPE_EXTERNAL) {
       return RdbError(errc::invalid_rdb_type);
     }
 
-    ++keys_loaded;
+    ++*keys_loaded;
     RETURN_ON_ERR(LoadKeyValPair(type, &settings));
     settings.Reset();
   }  // main load loop
 
-  if (stop_early_) {
-    return *ec_;
-  }
-
-  /* Verify the checksum if RDB version is >= 5 */
-  RETURN_ON_ERR(VerifyChecksum());
-
-  fibers_ext::BlockingCounter bc(shard_set->size());
-  for (unsigned i = 0; i < shard_set->size(); ++i) {
-    // Flush the remaining items.
-    FlushShardAsync(i);
-
-    // Send sentinel callbacks to ensure that all previous messages have been processed.
-    shard_set->Add(i, [bc]() mutable { bc.Dec(); });
-  }
-  bc.Wait();  // wait for sentinels to report.
-
-  absl::Duration dur = absl::Now() - start;
-  load_time_ = double(absl::ToInt64Milliseconds(dur)) / 1000;
-  keys_loaded_ = keys_loaded;
-
   return kOk;
 }
 
@@ -1651,13 +1790,16 @@ error_code RdbLoaderBase::EnsureReadInternal(size_t min_sz) {
     out_buf = out_buf.subspan(0, source_limit_ - bytes_read_);
   }
 
+  uint64_t start = SnapshotStages::Start();
   io::Result<size_t> res = src_->ReadAtLeast(out_buf, min_sz);
   if (!res)
     return res.error();
+  SnapshotStages::Finish(SnapshotStages::READ, start, *res);
 
   if (*res < min_sz)
     return RdbError(errc::rdb_file_corrupted);
 
+  UpdateChecksum(out_buf.data(), *res);
   bytes_read_ += *res;
 
   DCHECK_LE(bytes_read_, source_limit_);
@@ -1718,6 +1860,28 @@ error_code RdbLoader::HandleAux() {
   SET_OR_RETURN(FetchGenericString(), auxkey);
   SET_OR_RETURN(FetchGenericString(), auxval);
 
+  if (auxkey == "journal-gen" && !absl::SimpleAtoi(auxval, &journal_generation_)) {
+    LOG(WARNING) << "Ignoring bad journal generation " << auxval;
+  }
+
+  if (auxkey == "repl-id") {
+    repl_offset_.master_id = auxval;
+    repl_fields_ |= 1;
+  } else if (uint32_t sid; auxkey == "repl-shard" && absl::SimpleAtoi(auxval, &sid)) {
+    repl_offset_.shard = sid;
+    repl_fields_ |= 2;
+  } else if (auxkey == "repl-shards" && absl::SimpleAtoi(auxval, &repl_offset_.shard_count)) {
+    repl_fields_ |= 4;
+  } else if (auxkey == "repl-lsn" && absl::SimpleAtoi(auxval, &repl_offset_.lsn)) {
+    repl_fields_ |= 8;
+  }
+
+  if (header_only_) {
+    if (auxkey == "delta-base")
+      delta_base_ = std::move(auxval);
+    return kOk;
+  }
+
   if (!auxkey.empty() && auxkey[0] == '%') {
     /* All the fields with a name staring with '%' are considered
      * information fields and are logged at startup with a log
@@ -1725,19 +1889,21 @@ error_code RdbLoader::HandleAux() {
     LOG(INFO) << "RDB '" << auxkey << "': " << auxval;
   } else if (auxkey == "repl-stream-db") {
     // TODO
-  } else if (auxkey == "repl-id") {
-    // TODO
+  } else if (auxkey == "repl-id" || auxkey == "repl-shard" || auxkey == "repl-shards" ||
+             auxkey == "repl-lsn") {
+    // Read above, see repl_offset().
   } else if (auxkey == "repl-offset") {
     // TODO
   } else if (auxkey == "lua") {
-    ServerState* ss = ServerState::tlocal();
-    Interpreter& script = ss->GetInterpreter();
+    InterpreterManager& mgr = ServerState::tlocal()->GetInterpreterManager();
+    Interpreter* script = mgr.Get();
     string_view body{auxval};
-    string result;
-    Interpreter::AddResult add_result = script.AddFunction(body, &result);
+    string result, bytecode;
+    Interpreter::AddResult add_result = script->AddFunction(body, &result, &bytecode);
+    mgr.Return(script);
     if (add_result == Interpreter::ADD_OK) {
       if (script_mgr_)
-        script_mgr_->InsertFunction(result, body);
+        script_mgr_->InsertFunction(result, body, std::move(bytecode));
     } else if (add_result == Interpreter::COMPILE_ERR) {
       LOG(ERROR) << "Error when compiling lua scripts";
     }
@@ -1763,6 +1929,16 @@ error_code RdbLoader::HandleAux() {
     }
   } else if (auxkey == "redis-bits") {
     /* Just ignored. */
+  } else if (auxkey == "delta-base") {
+    LOG(INFO) << "Loading a delta of " << auxval;
+    delta_base_ = std::move(auxval);
+  } else if (absl::StartsWith(auxkey, "keys-db")) {
+    unsigned db_ind;
+    size_t key_num;
+    if (absl::SimpleAtoi(string_view{auxkey}.substr(7), &db_ind) &&
+        absl::SimpleAtoi(auxval, &key_num) && db_ind < GetFlag(FLAGS_dbnum)) {
+      ResizeDb(db_ind, key_num);
+    }
   } else {
     /* We ignore fields we don't understand, as by AUX field
      * contract. */
@@ -1772,14 +1948,87 @@ error_code RdbLoader::HandleAux() {
   return kOk;
 }
 
+error_code RdbLoader::HandleCompressedBlob(int opcode) {
+  uint64_t len, compressed_len;
+  SET_OR_RETURN(LoadLen(nullptr), len);
+  SET_OR_RETURN(LoadLen(nullptr), compressed_len);
+
+  if (len > UINT32_MAX || compressed_len > len) {
+    LOG(ERROR) << "Bad compressed block " << compressed_len << "/" << len;
+    return RdbError(errc::rdb_file_corrupted);
+  }
+
+  compr_buf_.resize(compressed_len);
+  RETURN_ON_ERR(FetchBuf(compressed_len, compr_buf_.data()));
+
+  // The decompressed entries are parsed before the input that follows the block.
+  io::Bytes input = mem_buf_.InputBuffer();
+  string tail(reinterpret_cast<const char*>(input.data()), input.size());
+  mem_buf_.ConsumeInput(input.size());
+  mem_buf_.Reserve(len + tail.size());
+
+  io::MutableBytes dest = mem_buf_.AppendBuffer();
+  CHECK_GE(dest.size(), len + tail.size());
+
+  uint64_t start = SnapshotStages::Start();
+  size_t res = DecompressBlob(opcode, compr_buf_.data(), compressed_len, dest.data(), len);
+  SnapshotStages::Finish(SnapshotStages::DECOMPRESS, start, compressed_len);
+
+  if (res != len) {
+    LOG(ERROR) << "Failed to decompress a block of " << compressed_len << " bytes";
+    return RdbError(errc::rdb_file_corrupted);
+  }
+
+  memcpy(dest.data() + len, tail.data(), tail.size());
+  mem_buf_.CommitWrite(len + tail.size());
+
+  return kOk;
+}
+
+error_code RdbLoaderBase::FetchCompressedBlob(int opcode, string* dest) {
+  uint64_t len, compressed_len;
+  SET_OR_RETURN(LoadLen(nullptr), len);
+  SET_OR_RETURN(LoadLen(nullptr), compressed_len);
+
+  if (len > UINT32_MAX || compressed_len > len) {
+    LOG(ERROR) << "Bad compressed block " << compressed_len << "/" << len;
+    return RdbError(errc::rdb_file_corrupted);
+  }
+
+  compr_buf_.resize(compressed_len);
+  RETURN_ON_ERR(FetchBuf(compressed_len, compr_buf_.data()));
+
+  dest->resize(len);
+  if (DecompressBlob(opcode, compr_buf_.data(), compressed_len, dest->data(), len) != len) {
+    LOG(ERROR) << "Failed to decompress a block of " << compressed_len << " bytes";
+    return RdbError(errc::rdb_file_corrupted);
+  }
+  return kOk;
+}
+
+void RdbLoaderBase::UpdateChecksum(const uint8_t* data, size_t len) {
+  uint64_t start = SnapshotStages::Start();
+  checksum_ = crc64(checksum_, data, len);
+  SnapshotStages::Finish(SnapshotStages::VERIFY, start, len);
+}
+
 error_code RdbLoader::VerifyChecksum() {
   uint64_t expected;
 
-  SET_OR_RETURN(FetchInt<uint64_t>(), expected);
-
+  // The checksum covers the input up to here, not what was read ahead.
+  RETURN_ON_ERR(EnsureRead(8));
   io::Bytes cur_buf = mem_buf_.InputBuffer();
+  uint64_t actual = Crc64DropSuffix(checksum_, cur_buf);
 
-  VLOG(1) << "VerifyChecksum: input buffer len " << cur_buf.size() << ", expected " << expected;
+  VLOG(1) << "VerifyChecksum: input buffer len " << cur_buf.size() << ", actual " << actual;
+
+  SET_OR_RETURN(FetchInt<uint64_t>(), expected);
+
+  // Zero means that the writer did not compute the checksum.
+  if (expected != 0 && expected != actual) {
+    LOG(ERROR) << "Wrong RDB checksum, expected " << expected << ", actual " << actual;
+    return RdbError(errc::rdb_file_corrupted);
+  }
 
   return kOk;
 }
@@ -1809,25 +2058,176 @@ void RdbLoader::LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib) {
   DbContext db_cntx{.db_index = db_ind, .time_now_ms = GetCurrentTimeMs()};
 
   for (const auto& item : ib) {
+    // The clients that write while the snapshot is loaded are the last writers of their keys.
+    if (db_slice.WrittenWhileLoading(db_ind, item.key)) {
+      skipped_writes_.fetch_add(1, memory_order_relaxed);
+      continue;
+    }
+
+    if (item.val.rdb_type == RDB_OPCODE_DELETED_KEY) {
+      db_slice.Del(db_ind, db_slice.FindExt(db_cntx, item.key));
+      continue;
+    }
+
+    if (item.val.rdb_type == RDB_OPCODE_HASH_FIELDS) {
+      ApplyHashFields(db_cntx, item);
+      continue;
+    }
+
     PrimeValue pv;
+    uint64_t start = SnapshotStages::Start();
     if (ec_ = Visit(item, &pv); ec_) {
       stop_early_ = true;
       break;
     }
+    SnapshotStages::Finish(SnapshotStages::DECODE, start);
 
-    if (item.expire_ms > 0 && db_cntx.time_now_ms >= item.expire_ms)
+    if (item.val.rdb_type == RDB_TYPE_EXTERNAL) {
+      TieredStorage* tiered = EngineShard::tlocal()->tiered_storage();
+      ec_ = tiered ? tiered->Adopt(db_ind, pv) : RdbError(errc::feature_not_supported);
+      if (ec_) {
+        stop_early_ = true;
+        break;
+      }
+    }
+
+    if (item.expire_ms > 0 && db_cntx.time_now_ms >= item.expire_ms) {
+      if (pv.IsExternal()) {
+        auto [offset, len] = pv.GetExternalPtr();
+        EngineShard::tlocal()->tiered_storage()->Free(db_ind, offset, len);
+      }
+
+      // The key that the entry replaces is gone as well.
+      if (Overwrites())
+        db_slice.Del(db_ind, db_slice.FindExt(db_cntx, item.key));
       continue;
+    }
 
+    start = SnapshotStages::Start();
     auto [it, added] = db_slice.AddOrUpdate(db_cntx, item.key, std::move(pv), item.expire_ms);
-    if (!added) {
+    SnapshotStages::Finish(SnapshotStages::INSERT, start);
+    if (!added && !Overwrites()) {
       LOG(WARNING) << "RDB has duplicated key '" << item.key << "' in DB " << db_ind;
     }
   }
 }
 
-void RdbLoader::ResizeDb(size_t key_num, size_t expire_num) {
-  DCHECK_LT(key_num, 1U << 31);
-  DCHECK_LT(expire_num, 1U << 31);
+void RdbLoader::ResizeDb(DbIndex db_ind, size_t key_num) {
+  if (key_num >= 1U << 31) {
+    LOG(WARNING) << "Ignoring bogus size hint " << key_num << " for DB " << db_ind;
+    return;
+  }
+
+  // Keys are spread evenly over the shards regardless of the file they are loaded from.
+  // Reserve is absolute, so the files that are loaded in parallel can all apply the same hint.
+  size_t shard_keys = key_num / shard_set->size();
+  if (shard_keys == 0)
+    return;
+
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    shard_set->Add(
+        i, [db_ind, shard_keys] { EngineShard::tlocal()->db_slice().Reserve(db_ind, shard_keys); });
+  }
+}
+
+io::Result<string> RdbLoader::ReadDeltaBase(io::Source* src) {
+  RdbLoader loader(nullptr);
+  loader.header_only_ = true;
+
+  if (error_code ec = loader.Load(src); ec)
+    return make_unexpected(ec);
+  return std::move(loader.delta_base_);
+}
+
+error_code RdbLoader::HandleDeletedKey() {
+  string key;
+  SET_OR_RETURN(ReadKey(), key);
+
+  ShardId sid = Shard(key, shard_set->size());
+  auto& out_buf = shard_buf_[sid];
+  out_buf.emplace_back(Item{std::move(key), OpaqueObj{{}, RDB_OPCODE_DELETED_KEY}, 0});
+
+  constexpr size_t kBufSize = 128;
+  if (out_buf.size() >= kBufSize) {
+    FlushShardAsync(sid);
+  }
+  return kOk;
+}
+
+error_code RdbLoader::HandleHashFields() {
+  string key;
+  SET_OR_RETURN(ReadKey(), key);
+
+  // arr[0] holds the number of the strings of the fields set, which come first.
+  unique_ptr<LoadTrace> load_trace(new LoadTrace);
+  auto read_strings = [&](size_t count) -> error_code {
+    for (size_t i = 0; i < count; ++i) {
+      string str;
+      SET_OR_RETURN(FetchGenericString(), str);
+
+      base::PODArray<char> arr;
+      arr.resize(str.size());
+      memcpy(arr.data(), str.data(), str.size());
+      load_trace->arr.emplace_back().rdb_var = std::move(arr);
+    }
+    return kOk;
+  };
+
+  uint64_t len;
+  SET_OR_RETURN(LoadLen(nullptr), len);
+  load_trace->arr.emplace_back().rdb_var = static_cast<long long>(len * 2);
+  RETURN_ON_ERR(read_strings(len * 2));
+
+  SET_OR_RETURN(LoadLen(nullptr), len);
+  RETURN_ON_ERR(read_strings(len));
+
+  ShardId sid = Shard(key, shard_set->size());
+  auto& out_buf = shard_buf_[sid];
+  out_buf.emplace_back(
+      Item{std::move(key), OpaqueObj{std::move(load_trace), RDB_OPCODE_HASH_FIELDS}, 0});
+
+  constexpr size_t kBufSize = 128;
+  if (out_buf.size() >= kBufSize) {
+    FlushShardAsync(sid);
+  }
+  return kOk;
+}
+
+void RdbLoader::ApplyHashFields(const DbContext& db_cntx, const Item& item) {
+  const auto& arr = get<unique_ptr<LoadTrace>>(item.val.obj)->arr;
+  size_t set_len = get<long long>(arr[0].rdb_var);
+
+  // The fields are not modified, CmdArgList is what the hash operations take.
+  vector<MutableSlice> fields;
+  fields.reserve(arr.size() - 1);
+  for (size_t i = 1; i < arr.size(); ++i) {
+    const auto& str = get<base::PODArray<char>>(arr[i].rdb_var);
+    fields.emplace_back(const_cast<char*>(str.data()), str.size());
+  }
+
+  CmdArgList args{fields.data(), fields.size()};
+  OpArgs op_args{EngineShard::tlocal(), 0, db_cntx};
+  OpStatus status =
+      HSetFamily::OpApplyFields(op_args, item.key, args.subspan(0, set_len), args.subspan(set_len));
+  LOG_IF(ERROR, status != OpStatus::OK)
+      << "Could not apply the fields of " << item.key << ": " << status;
+}
+
+error_code RdbLoader::HandleJournalFlush() {
+  uint64_t db_ind, sid;
+  SET_OR_RETURN(LoadLen(nullptr), db_ind);
+  SET_OR_RETURN(LoadLen(nullptr), sid);
+
+  if (sid >= shard_set->size() || (db_ind >= GetFlag(FLAGS_dbnum) && db_ind != DbSlice::kDbAll))
+    return RdbError(errc::rdb_file_corrupted);
+
+  // The journal of a shard holds only its own keys, so the flush applies to that shard alone.
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    FlushShardAsync(i);
+  }
+  shard_set->Add(sid, [db_ind] { EngineShard::tlocal()->db_slice().FlushDb(DbIndex(db_ind)); });
+
+  return kOk;
 }
 
 error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
@@ -1836,9 +2236,22 @@ error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
   OpaqueObj val;
 
   // We free key in LoadItemsBuffer.
+  uint64_t parse_start = SnapshotStages::Start();
   SET_OR_RETURN(ReadKey(), key);
 
-  io::Result<OpaqueObj> io_res = ReadObj(type);
+  io::Result<OpaqueObj> io_res;
+  if (type == RDB_TYPE_EXTERNAL) {
+    // The value must be loaded by the shard that owns its backing file.
+    ShardId owner = kInvalidSid;
+    io_res = ReadExternalRef(&owner);
+    if (io_res && owner != Shard(key, shard_set->size())) {
+      LOG(ERROR) << "The number of shards changed, external value of " << key
+                 << " can not be loaded";
+      return RdbError(errc::feature_not_supported);
+    }
+  } else {
+    io_res = ReadObj(type);
+  }
 
   if (!io_res) {
     VLOG(1) << "ReadObj error " << io_res.error() << " for key " << key;
@@ -1846,6 +2259,7 @@ error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
   }
 
   val = std::move(io_res.value());
+  SnapshotStages::Finish(SnapshotStages::PARSE, parse_start);
 
   /* Check if the key already expired. This function is used when loading
    * an RDB file from disk, either at startup, or when an RDB was
@@ -1856,7 +2270,7 @@ error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
    * load all the keys as they are, since the log of operations later
    * assume to work in an exact keyspace state. */
   // TODO: check rdbflags&RDBFLAGS_AOF_PREAMBLE logic in rdb.c
-  bool should_expire = settings->has_expired;  // TODO: to implement
+  bool should_expire = settings->has_expired && !Overwrites();  // TODO: to implement
   if (should_expire) {
     // decrRefCount(val);
   } else {
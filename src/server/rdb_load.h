@@ -4,6 +4,7 @@
 #pragma once
 
 #include <boost/fiber/mutex.hpp>
+#include <optional>
 #include <system_error>
 
 extern "C" {
@@ -33,8 +34,16 @@ class RdbLoaderBase {
     uint64_t uncompressed_len;
   };
 
-  using RdbVariant =
-      std::variant<long long, base::PODArray<char>, LzfString, std::unique_ptr<LoadTrace>>;
+  // A value that stays in the backing file, see RDB_TYPE_EXTERNAL.
+  struct ExternalRef {
+    uint64_t offset;
+    uint64_t len;
+    unsigned obj_type;
+    unsigned encoding;
+  };
+
+  using RdbVariant = std::variant<long long, base::PODArray<char>, LzfString,
+                                  std::unique_ptr<LoadTrace>, ExternalRef>;
 
   struct OpaqueObj {
     RdbVariant obj;
@@ -112,6 +121,10 @@ class RdbLoaderBase {
   ::io::Result<std::string> ReadKey();
 
   ::io::Result<OpaqueObj> ReadObj(int rdbtype);
+
+  // Reads the reference that follows the key of RDB_TYPE_EXTERNAL entry. Fills the id of the shard
+  // whose backing file holds the value.
+  ::io::Result<OpaqueObj> ReadExternalRef(ShardId* shard_id);
   ::io::Result<RdbVariant> ReadStringObj();
   ::io::Result<long long> ReadIntObj(int encoding);
   ::io::Result<LzfString> ReadLzf();
@@ -122,11 +135,16 @@ class RdbLoaderBase {
   ::io::Result<OpaqueObj> ReadHMap();
   ::io::Result<OpaqueObj> ReadZSet(int rdbtype);
   ::io::Result<OpaqueObj> ReadZSetZL();
+  ::io::Result<OpaqueObj> ReadListPack(int rdbtype);
   ::io::Result<OpaqueObj> ReadListQuicklist(int rdbtype);
   ::io::Result<OpaqueObj> ReadStreams();
 
   static size_t StrLen(const RdbVariant& tset);
 
+  // Reads a block compressed by BlobCompressor, whose opcode was already fetched, and
+  // decompresses it into dest.
+  std::error_code FetchCompressedBlob(int opcode, std::string* dest);
+
   std::error_code EnsureRead(size_t min_sz) {
     if (mem_buf_.InputLen() >= min_sz)
       return std::error_code{};
@@ -136,10 +154,14 @@ class RdbLoaderBase {
 
   std::error_code EnsureReadInternal(size_t min_sz);
 
+  // Must be called for all the data that is read from src_.
+  void UpdateChecksum(const uint8_t* data, size_t len);
+
  protected:
   base::IoBuf mem_buf_;
   ::io::Source* src_ = nullptr;
   size_t bytes_read_ = 0;
+  uint64_t checksum_ = 0;  // crc64 of the bytes_read_ bytes.
   size_t source_limit_ = SIZE_MAX;
   base::PODArray<uint8_t> compr_buf_;
 };
@@ -151,6 +173,11 @@ class RdbLoader : protected RdbLoaderBase {
   ~RdbLoader();
 
   std::error_code Load(::io::Source* src);
+
+  // Reads only the header of the snapshot in src. Returns the file name of the snapshot that it
+  // is a delta of, or an empty string for full snapshots, see SAVE DELTA.
+  static ::io::Result<std::string> ReadDeltaBase(::io::Source* src);
+
   void set_source_limit(size_t n) {
     source_limit_ = n;
   }
@@ -167,11 +194,34 @@ class RdbLoader : protected RdbLoaderBase {
     return keys_loaded_;
   }
 
+  // The entries that were not loaded since the clients wrote their keys during the load, see
+  // DbSlice::TrackLoadingWrites.
+  size_t keys_skipped() const {
+    return skipped_writes_.load(std::memory_order_relaxed);
+  }
+
   // returns time in seconds.
   double load_time() const {
     return load_time_;
   }
 
+  // Makes Load read a persistent journal file, see JournalSlice. Its entries overwrite the
+  // existing keys and a batch torn by a crash at the end of the file is skipped.
+  void SetJournalMode() {
+    journal_mode_ = true;
+  }
+
+  // Generation of the persistent journal that continues the loaded snapshot, 0 if the snapshot
+  // was saved without one.
+  uint64_t journal_generation() const {
+    return journal_generation_;
+  }
+
+  // The position of the snapshot in the journal of the master that saved it, if it has one.
+  std::optional<ReplOffset> repl_offset() const {
+    return repl_fields_ == kAllReplFields ? std::make_optional(repl_offset_) : std::nullopt;
+  }
+
   // Set callback for receiving RDB_OPCODE_FULLSYNC_END.
   // This opcode is used by a master instance to notify it finished streaming static data
   // and is ready to switch to stable state sync.
@@ -181,10 +231,33 @@ class RdbLoader : protected RdbLoaderBase {
 
  private:
   struct ObjSettings;
+
+  // Reads the opcodes that follow the header until RDB_OPCODE_EOF.
+  std::error_code LoadBody(size_t* keys_loaded);
   std::error_code LoadKeyValPair(int type, ObjSettings* settings);
-  void ResizeDb(size_t key_num, size_t expire_num);
+
+  // Presizes the tables of db_ind in all the shards for key_num keys of the whole dataset.
+  void ResizeDb(DbIndex db_ind, size_t key_num);
   std::error_code HandleAux();
 
+  // Decompresses a block of entries into mem_buf_, see RDB_OPCODE_COMPRESSED_ZSTD_BLOB.
+  std::error_code HandleCompressedBlob(int opcode);
+
+  // Queues the deletion of a key of a delta snapshot, see RDB_OPCODE_DELETED_KEY.
+  std::error_code HandleDeletedKey();
+
+  // Queues the flush of RDB_OPCODE_JOURNAL_FLUSH after the entries that precede it.
+  std::error_code HandleJournalFlush();
+
+  // Queues the change of the fields of a hash, see RDB_OPCODE_HASH_FIELDS.
+  std::error_code HandleHashFields();
+  void ApplyHashFields(const DbContext& db_cntx, const Item& item);
+
+  // Whether the loaded entries replace the existing keys rather than being new ones.
+  bool Overwrites() const {
+    return !delta_base_.empty() || journal_mode_;
+  }
+
   std::error_code VerifyChecksum();
   void FlushShardAsync(ShardId sid);
 
@@ -192,14 +265,32 @@ class RdbLoader : protected RdbLoaderBase {
 
   ScriptMgr* script_mgr_;
   std::unique_ptr<ItemsBuf[]> shard_buf_;
+  base::PODArray<char> compr_buf_;
 
   size_t keys_loaded_ = 0;
   double load_time_ = 0;
 
   DbIndex cur_db_index_ = 0;
 
+  // Set for delta snapshots, whose entries overwrite the ones of their base.
+  std::string delta_base_;
+  bool header_only_ = false;
+
+  uint64_t journal_generation_ = 0;
+  bool journal_mode_ = false;
+
+  // A bit per repl-* aux field that was read into repl_offset_.
+  static constexpr unsigned kAllReplFields = 0xF;
+  ReplOffset repl_offset_;
+  unsigned repl_fields_ = 0;
+
+  // The last RDB_OPCODE_JOURNAL_COMMIT and the input offset right after it.
+  LSN committed_lsn_ = 0;
+  size_t commit_offset_ = 0;
+
   AggregateError ec_;
   std::atomic_bool stop_early_{false};
+  std::atomic_size_t skipped_writes_{0};
 
   // Callback when receiving RDB_OPCODE_FULLSYNC_END
   std::function<void()> full_sync_cut_cb;
@@ -7,10 +7,14 @@
 #include <absl/cleanup/cleanup.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <lz4.h>
+#include <zstd.h>
 
+#include "core/string_map.h"
 #include "core/string_set.h"
 
 extern "C" {
+#include "redis/crc64.h"
 #include "redis/intset.h"
 #include "redis/listpack.h"
 #include "redis/rdb.h"
@@ -21,13 +25,25 @@ extern "C" {
 #include "redis/zset.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/rdb_extensions.h"
 #include "server/snapshot.h"
+#include "server/tiered_storage.h"
 #include "util/fibers/simple_channel.h"
 
+ABSL_FLAG(bool, rdb_native_encoding, true,
+          "If true, listpack based hashes, sorted sets and lists are stored in snapshots as is, "
+          "which makes them readable only by Redis 7 and later. Otherwise they are converted to "
+          "ziplists, as older versions expect");
+
+ABSL_FLAG(std::string, snapshot_compression, "none",
+          "Compression of the serialized blocks in snapshots and full sync streams: "
+          "none, zstd or lz4");
+ABSL_FLAG(int32_t, snapshot_compression_level, 1, "Compression level for zstd");
+
 namespace dfly {
 
 using namespace std;
@@ -119,17 +135,21 @@ inline unsigned SerializeLen(uint64_t len, uint8_t* buf) {
 }
 
 constexpr size_t kBufLen = 64_KB;
+
+// The containers are written to the sink every time this much of them is serialized, so that a
+// huge value does not have to fit in the memory buffer of the serializer first.
+constexpr size_t kMemBufFlushThreshold = 256_KB;
 constexpr size_t kAmask = 4_KB - 1;
 
 }  // namespace
 
-uint8_t RdbObjectType(unsigned type, unsigned encoding) {
+uint8_t RdbObjectType(unsigned type, unsigned encoding, bool native_encoding) {
   switch (type) {
     case OBJ_STRING:
       return RDB_TYPE_STRING;
     case OBJ_LIST:
       if (encoding == OBJ_ENCODING_QUICKLIST)
-        return RDB_TYPE_LIST_QUICKLIST;
+        return native_encoding ? RDB_TYPE_LIST_QUICKLIST_2 : RDB_TYPE_LIST_QUICKLIST;
       break;
     case OBJ_SET:
       if (encoding == kEncodingIntSet)
@@ -139,14 +159,14 @@ uint8_t RdbObjectType(unsigned type, unsigned encoding) {
       break;
     case OBJ_ZSET:
       if (encoding == OBJ_ENCODING_LISTPACK)
-        return RDB_TYPE_ZSET_ZIPLIST;  // we save using the old ziplist encoding.
+        return native_encoding ? RDB_TYPE_ZSET_LISTPACK : RDB_TYPE_ZSET_ZIPLIST;
       else if (encoding == OBJ_ENCODING_SKIPLIST)
         return RDB_TYPE_ZSET_2;
       break;
     case OBJ_HASH:
       if (encoding == kEncodingListPack)
-        return RDB_TYPE_HASH_ZIPLIST;
-      else if (encoding == kEncodingStrMap)
+        return native_encoding ? RDB_TYPE_HASH_LISTPACK : RDB_TYPE_HASH_ZIPLIST;
+      else if (encoding == kEncodingStrMap2)
         return RDB_TYPE_HASH;
       break;
     case OBJ_STREAM:
@@ -158,6 +178,66 @@ uint8_t RdbObjectType(unsigned type, unsigned encoding) {
   return 0; /* avoid warning */
 }
 
+unique_ptr<BlobCompressor> BlobCompressor::Create() {
+  return Create(absl::GetFlag(FLAGS_snapshot_compression));
+}
+
+unique_ptr<BlobCompressor> BlobCompressor::Create(string_view mode) {
+  if (mode == "zstd")
+    return unique_ptr<BlobCompressor>(new BlobCompressor(
+        RDB_OPCODE_COMPRESSED_ZSTD_BLOB, absl::GetFlag(FLAGS_snapshot_compression_level)));
+  if (mode == "lz4")
+    return unique_ptr<BlobCompressor>(new BlobCompressor(RDB_OPCODE_COMPRESSED_LZ4_BLOB, 0));
+
+  LOG_IF(WARNING, mode != "none") << "Unknown snapshot_compression " << mode;
+  return nullptr;
+}
+
+BlobCompressor::BlobCompressor(uint8_t opcode, int level) : opcode_(opcode), level_(level) {
+  if (opcode_ == RDB_OPCODE_COMPRESSED_ZSTD_BLOB)
+    zstd_cctx_ = ZSTD_createCCtx();
+}
+
+BlobCompressor::~BlobCompressor() {
+  ZSTD_freeCCtx(zstd_cctx_);
+}
+
+bool BlobCompressor::Compress(string* blob) {
+  // Small blobs, like the ones produced by writes during the snapshot, are not worth it.
+  constexpr size_t kMinBlobSize = 256;
+  if (blob->size() < kMinBlobSize)
+    return false;
+
+  size_t compressed_len;
+  if (zstd_cctx_) {
+    compr_buf_.resize(ZSTD_compressBound(blob->size()));
+    compressed_len = ZSTD_compressCCtx(zstd_cctx_, compr_buf_.data(), compr_buf_.size(),
+                                       blob->data(), blob->size(), level_);
+    if (ZSTD_isError(compressed_len))
+      return false;
+  } else {
+    compr_buf_.resize(LZ4_compressBound(blob->size()));
+    compressed_len =
+        LZ4_compress_default(blob->data(), compr_buf_.data(), blob->size(), compr_buf_.size());
+    if (compressed_len == 0)
+      return false;
+  }
+
+  uint8_t header[1 + 9 + 9];
+  header[0] = opcode_;
+  unsigned header_len = 1 + SerializeLen(blob->size(), header + 1);
+  header_len += SerializeLen(compressed_len, header + header_len);
+
+  // Keep the raw blob if we save less than 1/8 of it.
+  if (header_len + compressed_len > blob->size() - blob->size() / 8)
+    return false;
+
+  blob->resize(header_len + compressed_len);
+  memcpy(blob->data(), header, header_len);
+  memcpy(blob->data() + header_len, compr_buf_.data(), compressed_len);
+  return true;
+}
+
 RdbSerializer::RdbSerializer(io::Sink* s) : sink_(s), mem_buf_{4_KB}, tmp_buf_(nullptr) {
 }
 
@@ -203,10 +283,17 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   string_view key = pk.GetSlice(&tmp_str_);
   unsigned obj_type = pv.ObjType();
   unsigned encoding = pv.Encoding();
-  uint8_t rdb_type = RdbObjectType(obj_type, encoding);
+  uint8_t rdb_type = RdbObjectType(obj_type, encoding, native_encoding_);
 
   DVLOG(3) << "Saving key/val start " << key;
 
+  if (pv.IsExternal() && keep_external_) {
+    ec = SaveExternalRef(key, pv);
+    if (ec)
+      return make_unexpected(ec);
+    return rdb_type;
+  }
+
   ec = WriteOpcode(rdb_type);
   if (ec)
     return make_unexpected(ec);
@@ -214,12 +301,33 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   ec = SaveString(key);
   if (ec)
     return make_unexpected(ec);
-  ec = SaveValue(pv);
+
+  // Offloaded values are serialized from a temporary copy, the entry itself stays on disk.
+  if (pv.IsExternal()) {
+    PrimeValue loaded;
+    ec = EngineShard::tlocal()->tiered_storage()->LoadExternal(pv, &loaded);
+    if (!ec)
+      ec = SaveValue(loaded);
+  } else {
+    ec = SaveValue(pv);
+  }
   if (ec)
     return make_unexpected(ec);
   return rdb_type;
 }
 
+error_code RdbSerializer::SaveExternalRef(string_view key, const PrimeValue& pv) {
+  auto [offset, len] = pv.GetExternalPtr();
+
+  RETURN_ON_ERR(WriteOpcode(RDB_TYPE_EXTERNAL));
+  RETURN_ON_ERR(SaveString(key));
+  RETURN_ON_ERR(SaveLen(EngineShard::tlocal()->shard_id()));
+  RETURN_ON_ERR(SaveLen(pv.ObjType()));
+  RETURN_ON_ERR(SaveLen(pv.Encoding()));
+  RETURN_ON_ERR(SaveLen(offset));
+  return SaveLen(len);
+}
+
 error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
   unsigned obj_type = pv.ObjType();
   CHECK_NE(obj_type, OBJ_STRING);
@@ -233,7 +341,7 @@ error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
   }
 
   if (obj_type == OBJ_HASH) {
-    return SaveHSetObject(pv.AsRObj());
+    return SaveHSetObject(pv);
   }
 
   if (obj_type == OBJ_ZSET) {
@@ -259,26 +367,21 @@ error_code RdbSerializer::SaveListObject(const robj* obj) {
   while (node) {
     DVLOG(3) << "QL node (encoding/container/sz): " << node->encoding << "/" << node->container
              << "/" << node->sz;
-    if (QL_NODE_IS_PLAIN(node)) {
-      if (quicklistNodeIsCompressed(node)) {
-        void* data;
-        size_t compress_len = quicklistGetLzf(node, &data);
-
-        RETURN_ON_ERR(SaveLzfBlob(Bytes{reinterpret_cast<uint8_t*>(data), compress_len}, node->sz));
-      } else {
-        RETURN_ON_ERR(SaveString(node->entry, node->sz));
-      }
+    if (native_encoding_) {
+      // Nodes are stored as is, compressed nodes keep their LZF representation.
+      RETURN_ON_ERR(SaveLen(node->container));
+      RETURN_ON_ERR(SaveListNode(node));
+    } else if (QL_NODE_IS_PLAIN(node)) {
+      RETURN_ON_ERR(SaveListNode(node));
     } else {
       // listpack
       uint8_t* lp = node->entry;
       uint8_t* decompressed = NULL;
 
       if (quicklistNodeIsCompressed(node)) {
-        void* data;
-        size_t compress_len = quicklistGetLzf(node, &data);
         decompressed = (uint8_t*)zmalloc(node->sz);
 
-        if (lzf_decompress(data, compress_len, decompressed, node->sz) == 0) {
+        if (!quicklistDecompressTo(node, decompressed)) {
           /* Someone requested decompress, but we can't decompress.  Not good. */
           zfree(decompressed);
           return make_error_code(errc::illegal_byte_sequence);
@@ -292,11 +395,31 @@ error_code RdbSerializer::SaveListObject(const robj* obj) {
       });
       RETURN_ON_ERR(SaveListPackAsZiplist(lp));
     }
+    RETURN_ON_ERR(FlushIfNeeded());
     node = node->next;
   }
   return error_code{};
 }
 
+error_code RdbSerializer::SaveListNode(const quicklistNode* node) {
+  if (node->encoding == QUICKLIST_NODE_ENCODING_RAW)
+    return SaveString(node->entry, node->sz);
+
+  if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+    void* data;
+    size_t compress_len = quicklistGetLzf(node, &data);
+    return SaveLzfBlob(Bytes{reinterpret_cast<uint8_t*>(data), compress_len}, node->sz);
+  }
+
+  // RDB has no LZ4 blobs, such nodes are saved uncompressed.
+  uint8_t* decompressed = (uint8_t*)zmalloc(node->sz);
+  auto cleanup = absl::MakeCleanup([=] { zfree(decompressed); });
+  if (!quicklistDecompressTo(node, decompressed))
+    return make_error_code(errc::illegal_byte_sequence);
+
+  return SaveString(decompressed, node->sz);
+}
+
 error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
   if (obj.Encoding() == kEncodingStrMap) {
     dict* set = (dict*)obj.RObjPtr();
@@ -311,6 +434,7 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
       sds ele = (sds)de->key;
 
       RETURN_ON_ERR(SaveString(string_view{ele, sdslen(ele)}));
+      RETURN_ON_ERR(FlushIfNeeded());
     }
   } else if (obj.Encoding() == kEncodingStrMap2) {
     StringSet* set = (StringSet*)obj.RObjPtr();
@@ -319,6 +443,7 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
 
     for (sds ele : *set) {
       RETURN_ON_ERR(SaveString(string_view{ele, sdslen(ele)}));
+      RETURN_ON_ERR(FlushIfNeeded());
     }
   } else {
     CHECK_EQ(obj.Encoding(), kEncodingIntSet);
@@ -331,32 +456,26 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
   return error_code{};
 }
 
-error_code RdbSerializer::SaveHSetObject(const robj* obj) {
-  DCHECK_EQ(OBJ_HASH, obj->type);
-  if (obj->encoding == OBJ_ENCODING_HT) {
-    dict* set = (dict*)obj->ptr;
-
-    RETURN_ON_ERR(SaveLen(dictSize(set)));
-
-    dictIterator* di = dictGetIterator(set);
-    dictEntry* de;
-    auto cleanup = absl::MakeCleanup([di] { dictReleaseIterator(di); });
+error_code RdbSerializer::SaveHSetObject(const PrimeValue& pv) {
+  DCHECK_EQ(OBJ_HASH, pv.ObjType());
+  if (pv.Encoding() == kEncodingStrMap2) {
+    StringMap* string_map = (StringMap*)pv.RObjPtr();
 
-    while ((de = dictNext(di)) != NULL) {
-      sds key = (sds)de->key;
-      sds value = (sds)de->v.val;
+    RETURN_ON_ERR(SaveLen(string_map->Size()));
 
+    for (sds key : *string_map) {
       RETURN_ON_ERR(SaveString(string_view{key, sdslen(key)}));
-      RETURN_ON_ERR(SaveString(string_view{value, sdslen(value)}));
+      RETURN_ON_ERR(SaveString(StringMap::GetValue(key)));
+      RETURN_ON_ERR(FlushIfNeeded());
     }
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_LISTPACK), obj->encoding);
+    CHECK_EQ(kEncodingListPack, pv.Encoding());
 
-    uint8_t* lp = (uint8_t*)obj->ptr;
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
     size_t lplen = lpLength(lp);
     CHECK(lplen > 0 && lplen % 2 == 0);  // has (key,value) pairs.
 
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    RETURN_ON_ERR(SaveListPack(lp));
   }
 
   return error_code{};
@@ -380,12 +499,13 @@ error_code RdbSerializer::SaveZSetObject(const robj* obj) {
     while (zn != NULL) {
       RETURN_ON_ERR(SaveString(string_view{zn->ele, sdslen(zn->ele)}));
       RETURN_ON_ERR(SaveBinaryDouble(zn->score));
+      RETURN_ON_ERR(FlushIfNeeded());
       zn = zn->backward;
     }
   } else {
     CHECK_EQ(obj->encoding, unsigned(OBJ_ENCODING_LISTPACK)) << "Unknown zset encoding";
     uint8_t* lp = (uint8_t*)obj->ptr;
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    RETURN_ON_ERR(SaveListPack(lp));
   }
 
   return error_code{};
@@ -414,6 +534,8 @@ error_code RdbSerializer::SaveStreamObject(const robj* obj) {
     }
 
     ec = SaveString(lp, lp_bytes);
+    if (!ec)
+      ec = FlushIfNeeded();
     if (ec) {
       raxStop(&ri);
       return ec;
@@ -517,6 +639,13 @@ error_code RdbSerializer::SaveListPackAsZiplist(uint8_t* lp) {
   return ec;
 }
 
+error_code RdbSerializer::SaveListPack(uint8_t* lp) {
+  if (!native_encoding_)
+    return SaveListPackAsZiplist(lp);
+
+  return SaveString(lp, lpBytes(lp));
+}
+
 error_code RdbSerializer::SaveStreamPEL(rax* pel, bool nacks) {
   /* Number of entries in the PEL. */
 
@@ -587,6 +716,29 @@ error_code RdbSerializer::SendFullSyncCut() {
   return FlushMem();
 }
 
+error_code RdbSerializer::SaveDeletedKey(string_view key) {
+  RETURN_ON_ERR(WriteOpcode(RDB_OPCODE_DELETED_KEY));
+  return SaveString(key);
+}
+
+error_code RdbSerializer::SaveHashFields(string_view key, CmdArgList set_fields,
+                                         CmdArgList removed_fields) {
+  DCHECK_EQ(0u, set_fields.size() % 2);
+
+  RETURN_ON_ERR(WriteOpcode(RDB_OPCODE_HASH_FIELDS));
+  RETURN_ON_ERR(SaveString(key));
+  RETURN_ON_ERR(SaveLen(set_fields.size() / 2));
+  for (size_t i = 0; i < set_fields.size(); ++i) {
+    RETURN_ON_ERR(SaveString(ArgS(set_fields, i)));
+  }
+
+  RETURN_ON_ERR(SaveLen(removed_fields.size()));
+  for (size_t i = 0; i < removed_fields.size(); ++i) {
+    RETURN_ON_ERR(SaveString(ArgS(removed_fields, i)));
+  }
+  return error_code{};
+}
+
 // TODO: if buf is large enough, it makes sense to write both mem_buf and buf
 // directly to sink_.
 error_code RdbSerializer::WriteRaw(const io::Bytes& buf) {
@@ -625,6 +777,13 @@ error_code RdbSerializer::FlushMem() {
   return error_code{};
 }
 
+error_code RdbSerializer::FlushIfNeeded() {
+  if (mem_buf_.InputLen() < kMemBufFlushThreshold)
+    return error_code{};
+
+  return FlushMem();
+}
+
 error_code RdbSerializer::SaveString(string_view val) {
   /* Try integer encoding */
   if (val.size() <= 11) {
@@ -733,6 +892,26 @@ error_code AlignedBuffer::Flush() {
   return upstream_->Write(&ivec, 1);
 }
 
+io::Result<size_t> ChecksumSink::WriteSome(const iovec* v, uint32_t len) {
+  uint64_t start = SnapshotStages::Start();
+  io::Result<size_t> res = upstream_->WriteSome(v, len);
+  if (!res)
+    return res;
+  SnapshotStages::Finish(SnapshotStages::WRITE, start, *res);
+
+  // Only the part that was written, the caller retries the rest.
+  start = SnapshotStages::Start();
+  size_t left = *res;
+  for (uint32_t i = 0; i < len && left > 0; ++i) {
+    size_t sz = std::min(left, v[i].iov_len);
+    checksum_ = crc64(checksum_, reinterpret_cast<const uint8_t*>(v[i].iov_base), sz);
+    left -= sz;
+  }
+  SnapshotStages::Finish(SnapshotStages::CHECKSUM, start, *res);
+
+  return res;
+}
+
 class RdbSaver::Impl {
  public:
   // We pass K=sz to say how many producers are pushing data in order to maintain
@@ -741,10 +920,38 @@ class RdbSaver::Impl {
 
   void StartSnapshotting(bool stream_journal, const Cancellation* cll, EngineShard* shard);
 
+  void KeepExternalValues() {
+    keep_external_ = true;
+  }
+
+  void SetDeltaBase(string base_file) {
+    delta_base_ = std::move(base_file);
+  }
+
+  const string& delta_base() const {
+    return delta_base_;
+  }
+
+  void SetCompression(string mode) {
+    compression_ = std::move(mode);
+  }
+
+  void SetSlots(shared_ptr<const SlotSet> slots) {
+    slots_ = std::move(slots);
+  }
+
+  void CommitDeltaBase(EngineShard* shard) {
+    shard->db_slice().SetDeltaBase(GetSnapshot(shard)->snapshot_version());
+  }
+
   void StopSnapshotting(EngineShard* shard);
 
   error_code ConsumeChannel(const Cancellation* cll);
 
+  uint64_t checksum() const {
+    return checksum_sink_.checksum();
+  }
+
   error_code Flush() {
     if (aligned_buf_)
       return aligned_buf_->Flush();
@@ -764,27 +971,39 @@ class RdbSaver::Impl {
     return &meta_serializer_;
   }
 
+  bool native_encoding() const {
+    return native_encoding_;
+  }
+
   void Cancel();
 
  private:
   unique_ptr<SliceSnapshot>& GetSnapshot(EngineShard* shard);
 
-  io::Sink* sink_;
+  // Everything is written through checksum_sink_, into aligned_buf_ if it is set.
+  ChecksumSink checksum_sink_;
   vector<unique_ptr<SliceSnapshot>> shard_snapshots_;
   // used for serializing non-body components in the calling fiber.
   RdbSerializer meta_serializer_;
   SliceSnapshot::RecordChannel channel_;
+  SliceSnapshot::ChannelBudget budget_;
   std::optional<AlignedBuffer> aligned_buf_;
+  bool keep_external_ = false;
+  bool native_encoding_;
+  string delta_base_;
+  optional<string> compression_;
+  shared_ptr<const SlotSet> slots_;
 };
 
 // We pass K=sz to say how many producers are pushing data in order to maintain
 // correct closing semantics - channel is closing when K producers marked it as closed.
 RdbSaver::Impl::Impl(bool align_writes, unsigned producers_len, io::Sink* sink)
-    : sink_(sink), shard_snapshots_(producers_len),
-      meta_serializer_(sink), channel_{128, producers_len} {
+    : checksum_sink_(sink), shard_snapshots_(producers_len),
+      meta_serializer_(&checksum_sink_), channel_{128, producers_len},
+      native_encoding_(absl::GetFlag(FLAGS_rdb_native_encoding)) {
   if (align_writes) {
     aligned_buf_.emplace(kBufLen, sink);
-    meta_serializer_.set_sink(&aligned_buf_.value());
+    checksum_sink_.set_upstream(&aligned_buf_.value());
   }
 
   DCHECK(producers_len > 0 || channel_.IsClosing());
@@ -812,38 +1031,43 @@ error_code RdbSaver::Impl::ConsumeChannel(const Cancellation* cll) {
   // we can not exit on io-error since we spawn fibers that push data.
   // TODO: we may signal them to stop processing and exit asap in case of the error.
 
+  // The producers wait for the released bytes, so every popped record must be released.
   auto& channel = channel_;
+  uint64_t pop_start = SnapshotStages::Start();
   while (channel.Pop(record)) {
-    if (io_error || cll->IsCancelled())
+    SnapshotStages::Finish(SnapshotStages::CHANNEL_POP, pop_start);
+    absl::Cleanup restart_pop = [&pop_start] { pop_start = SnapshotStages::Start(); };
+
+    if (io_error || cll->IsCancelled()) {
+      budget_.Release(record.value.size());
       continue;
+    }
 
     do {
-      if (cll->IsCancelled())
+      size_t record_size = record.value.size();
+      if (cll->IsCancelled()) {
+        budget_.Release(record_size);
         continue;
+      }
 
       if (record.db_index != last_db_index) {
         unsigned enclen = SerializeLen(record.db_index, buf + 1);
         string_view str{(char*)buf, enclen + 1};
 
-        if (aligned_buf_) {
-          io_error = aligned_buf_->Write(str);
-        } else {
-          io_error = sink_->Write(io::Buffer(str));
-        }
-        if (io_error)
+        io_error = checksum_sink_.Write(str);
+        if (io_error) {
+          budget_.Release(record_size);
           break;
+        }
         last_db_index = record.db_index;
       }
 
       DVLOG(2) << "Pulled " << record.id;
-      channel_bytes += record.value.size();
+      channel_bytes += record_size;
 
-      if (aligned_buf_) {
-        io_error = aligned_buf_->Write(record.value);
-      } else {
-        io_error = sink_->Write(io::Buffer(record.value));
-      }
+      io_error = checksum_sink_.Write(record.value);
       record.value.clear();
+      budget_.Release(record_size);
     } while (!io_error && channel.TryPop(record));
   }  // while (channel.pop)
 
@@ -863,8 +1087,20 @@ error_code RdbSaver::Impl::ConsumeChannel(const Cancellation* cll) {
 void RdbSaver::Impl::StartSnapshotting(bool stream_journal, const Cancellation* cll,
                                        EngineShard* shard) {
   auto& s = GetSnapshot(shard);
-  s.reset(new SliceSnapshot(&shard->db_slice(), &channel_));
+  s.reset(new SliceSnapshot(&shard->db_slice(), &channel_, &budget_));
 
+  if (keep_external_ && shard->tiered_storage()) {
+    shard->tiered_storage()->OnSnapshotStart();
+    s->KeepExternalValues();
+  }
+  if (native_encoding_)
+    s->UseNativeEncoding();
+  if (!delta_base_.empty())
+    s->SetDeltaBase(shard->db_slice().delta_base_version());
+  if (compression_)
+    s->SetCompression(*compression_);
+  if (slots_)
+    s->SetSlots(slots_);
   s->Start(stream_journal, cll);
 }
 
@@ -883,6 +1119,7 @@ void RdbSaver::Impl::Cancel() {
 
   dfly::SliceSnapshot::DbRecord rec;
   while (channel_.Pop(rec)) {
+    budget_.Release(rec.value.size());
   }
 }
 
@@ -930,17 +1167,59 @@ void RdbSaver::StartSnapshotInShard(bool stream_journal, const Cancellation* cll
   impl_->StartSnapshotting(stream_journal, cll, shard);
 }
 
+void RdbSaver::KeepExternalValues() {
+  impl_->KeepExternalValues();
+}
+
+void RdbSaver::SetDeltaBase(string base_file) {
+  impl_->SetDeltaBase(std::move(base_file));
+}
+
+void RdbSaver::SetCompression(string mode) {
+  impl_->SetCompression(std::move(mode));
+}
+
+void RdbSaver::SetSlots(shared_ptr<const SlotSet> slots) {
+  impl_->SetSlots(std::move(slots));
+}
+
+void RdbSaver::CommitDeltaBase(EngineShard* shard) {
+  impl_->CommitDeltaBase(shard);
+}
+
 void RdbSaver::StopSnapshotInShard(EngineShard* shard) {
   impl_->StopSnapshotting(shard);
 }
 
-error_code RdbSaver::SaveHeader(const StringVec& lua_scripts) {
+RdbSaver::KeyCounts RdbSaver::GetKeyCounts() {
+  vector<KeyCounts> shard_counts(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    const DbSlice& db_slice = shard->db_slice();
+    KeyCounts& counts = shard_counts[shard->shard_id()];
+    counts.resize(db_slice.db_array_size());
+    for (DbIndex db = 0; db < counts.size(); ++db) {
+      if (db_slice.IsDbValid(db))
+        counts[db] = db_slice.DbSize(db);
+    }
+  });
+
+  KeyCounts res;
+  for (const KeyCounts& counts : shard_counts) {
+    res.resize(max(res.size(), counts.size()));
+    for (size_t db = 0; db < counts.size(); ++db)
+      res[db] += counts[db];
+  }
+  return res;
+}
+
+error_code RdbSaver::SaveHeader(const StringVec& lua_scripts, const KeyCounts& key_counts) {
   char magic[16];
-  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_VERSION);
+  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d",
+                             impl_->native_encoding() ? RDB_NATIVE_VERSION : RDB_VERSION);
   CHECK_EQ(9u, sz);
 
   RETURN_ON_ERR(impl_->serializer()->WriteRaw(Bytes{reinterpret_cast<uint8_t*>(magic), sz}));
-  RETURN_ON_ERR(SaveAux(lua_scripts));
+  RETURN_ON_ERR(SaveAux(lua_scripts, key_counts));
 
   return error_code{};
 }
@@ -969,7 +1248,7 @@ error_code RdbSaver::SaveBody(const Cancellation* cll, RdbTypeFreqMap* freq_map)
   return error_code{};
 }
 
-error_code RdbSaver::SaveAux(const StringVec& lua_scripts) {
+error_code RdbSaver::SaveAux(const StringVec& lua_scripts, const KeyCounts& key_counts) {
   static_assert(sizeof(void*) == 8, "");
 
   int aof_preamble = false;
@@ -991,7 +1270,25 @@ error_code RdbSaver::SaveAux(const StringVec& lua_scripts) {
     RETURN_ON_ERR(impl_->SaveAuxFieldStrStr("lua", s));
   }
 
-  // TODO: "repl-stream-db", "repl-id", "repl-offset"
+  for (size_t db = 0; db < key_counts.size(); ++db) {
+    if (key_counts[db] > 0)
+      RETURN_ON_ERR(SaveAuxFieldStrInt(absl::StrCat("keys-db", db), key_counts[db]));
+  }
+
+  if (!impl_->delta_base().empty())
+    RETURN_ON_ERR(impl_->SaveAuxFieldStrStr("delta-base", impl_->delta_base()));
+
+  if (journal_generation_)
+    RETURN_ON_ERR(SaveAuxFieldStrInt("journal-gen", journal_generation_));
+
+  // Redis uses repl-offset for its replication offset, hence the different names.
+  if (repl_offset_) {
+    RETURN_ON_ERR(impl_->SaveAuxFieldStrStr("repl-id", repl_offset_->master_id));
+    RETURN_ON_ERR(SaveAuxFieldStrInt("repl-shard", repl_offset_->shard));
+    RETURN_ON_ERR(SaveAuxFieldStrInt("repl-shards", repl_offset_->shard_count));
+    RETURN_ON_ERR(SaveAuxFieldStrInt("repl-lsn", repl_offset_->lsn));
+  }
+
   return error_code{};
 }
 
@@ -1003,10 +1300,11 @@ error_code RdbSaver::SaveEpilog() {
 
   /* EOF opcode */
   RETURN_ON_ERR(ser.WriteOpcode(RDB_OPCODE_EOF));
+  RETURN_ON_ERR(ser.FlushMem());
 
-  /* CRC64 checksum. It will be zero if checksum computation is disabled, the
-   * loading code skips the check in this case. */
-  chksum = 0;
+  /* CRC64 checksum of everything up to here. Every file of a multi-file snapshot has its own, so
+   * that they are verified in parallel by their loaders. */
+  chksum = impl_->checksum();
 
   absl::little_endian::Store64(buf, chksum);
   RETURN_ON_ERR(ser.WriteRaw(buf));
@@ -5,6 +5,8 @@
 
 #include <absl/container/flat_hash_map.h>
 
+#include <optional>
+
 extern "C" {
 #include "redis/lzfP.h"
 #include "redis/object.h"
@@ -13,15 +15,19 @@ extern "C" {
 #include "base/io_buf.h"
 #include "base/pod_array.h"
 #include "io/io.h"
+#include "server/cluster/cluster_config.h"
 #include "server/common.h"
 #include "server/table.h"
 
+typedef struct quicklistNode quicklistNode;
 typedef struct rax rax;
 typedef struct streamCG streamCG;
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
 
 namespace dfly {
 
-uint8_t RdbObjectType(unsigned type, unsigned encoding);
+// If native_encoding is true, listpack based values are stored as listpacks and not ziplists.
+uint8_t RdbObjectType(unsigned type, unsigned encoding, bool native_encoding);
 
 class EngineShard;
 
@@ -52,6 +58,33 @@ class AlignedBuffer : public ::io::Sink {
   off_t buf_offs_ = 0;
 };
 
+// Computes the CRC64 checksum of the data written to upstream, see RdbSaver::SaveEpilog.
+class ChecksumSink : public ::io::Sink {
+ public:
+  using io::Sink::Write;
+
+  explicit ChecksumSink(::io::Sink* upstream) : upstream_(upstream) {
+  }
+
+  std::error_code Write(std::string_view buf) {
+    return Write(io::Buffer(buf));
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  void set_upstream(::io::Sink* upstream) {
+    upstream_ = upstream;
+  }
+
+  uint64_t checksum() const {
+    return checksum_;
+  }
+
+ private:
+  ::io::Sink* upstream_;
+  uint64_t checksum_ = 0;
+};
+
 // SaveMode for snapshot. Used by RdbSaver to adjust internals.
 enum class SaveMode {
   SUMMARY,       // Save only header values (summary.dfs). Expected to read no shards.
@@ -77,8 +110,47 @@ class RdbSaver {
   // Stops serialization in journal streaming mode in the shard's thread.
   void StopSnapshotInShard(EngineShard* shard);
 
+  // Offloaded values are stored as references into the backing files instead of their contents.
+  // Must be called before the snapshot starts in the shards.
+  void KeepExternalValues();
+
+  // Makes the snapshot a delta of base_file, which must be the last snapshot saved by this
+  // instance. Must be called before SaveHeader.
+  void SetDeltaBase(std::string base_file);
+
+  // Overrides snapshot_compression for this snapshot. Must be called before the snapshot
+  // starts in the shards.
+  void SetCompression(std::string mode);
+
+  // Restricts the snapshot to the keys of the slots. Must be called before the snapshot starts
+  // in the shards.
+  void SetSlots(std::shared_ptr<const SlotSet> slots);
+
+  // Records the generation of the persistent journal that holds the changes made after this
+  // snapshot, see JournalSlice. Must be called before SaveHeader.
+  void SetJournalGeneration(uint64_t generation) {
+    journal_generation_ = generation;
+  }
+
+  // Records the position of this snapshot of a shard in the journal. Must be called before
+  // SaveHeader.
+  void SetReplOffset(ReplOffset offset) {
+    repl_offset_ = std::move(offset);
+  }
+
+  // Makes this snapshot the base of the next delta snapshot of shard.
+  // Called in the thread of shard once the snapshot has been saved.
+  void CommitDeltaBase(EngineShard* shard);
+
+  // Number of keys per database index, summed over all the shards.
+  using KeyCounts = std::vector<size_t>;
+
+  // Collects the key counts of the whole dataset. Must not run inside a shard callback.
+  static KeyCounts GetKeyCounts();
+
   // Stores auxiliary (meta) values and lua scripts.
-  std::error_code SaveHeader(const StringVec& lua_scripts);
+  // key_counts are stored as a hint that lets the loader presize its tables.
+  std::error_code SaveHeader(const StringVec& lua_scripts, const KeyCounts& key_counts);
 
   // Writes the RDB file into sink. Waits for the serialization to finish.
   // Fills freq_map with the histogram of rdb types.
@@ -96,13 +168,39 @@ class RdbSaver {
 
   std::error_code SaveEpilog();
 
-  std::error_code SaveAux(const StringVec& lua_scripts);
+  std::error_code SaveAux(const StringVec& lua_scripts, const KeyCounts& key_counts);
   std::error_code SaveAuxFieldStrInt(std::string_view key, int64_t val);
 
   SaveMode save_mode_;
+  uint64_t journal_generation_ = 0;
+  std::optional<ReplOffset> repl_offset_;
   std::unique_ptr<Impl> impl_;
 };
 
+// Compresses blocks of serialized entries, see RDB_OPCODE_COMPRESSED_ZSTD_BLOB.
+class BlobCompressor {
+ public:
+  // Returns null if snapshot_compression is "none".
+  static std::unique_ptr<BlobCompressor> Create();
+
+  // Same for mode instead of snapshot_compression: none, zstd or lz4.
+  static std::unique_ptr<BlobCompressor> Create(std::string_view mode);
+
+  ~BlobCompressor();
+
+  // Replaces blob with its compressed form unless compression does not pay off. Returns true
+  // if it did.
+  bool Compress(std::string* blob);
+
+ private:
+  BlobCompressor(uint8_t opcode, int level);
+
+  uint8_t opcode_;
+  int level_;
+  ZSTD_CCtx* zstd_cctx_ = nullptr;
+  base::PODArray<char> compr_buf_;
+};
+
 class RdbSerializer {
  public:
   // TODO: for aligned cased, it does not make sense that RdbSerializer buffers into unaligned
@@ -117,6 +215,16 @@ class RdbSerializer {
     sink_ = s;
   }
 
+  // If true, SaveEntry writes offloaded values as RDB_TYPE_EXTERNAL references.
+  void set_keep_external(bool keep) {
+    keep_external_ = keep;
+  }
+
+  // If true, listpacks are written verbatim, see RDB_NATIVE_VERSION.
+  void set_native_encoding(bool native) {
+    native_encoding_ = native;
+  }
+
   std::error_code WriteOpcode(uint8_t opcode) {
     return WriteRaw(::io::Bytes{&opcode, 1});
   }
@@ -138,6 +246,15 @@ class RdbSerializer {
 
   std::error_code FlushMem();
 
+  // Flushes the memory buffer once it grows past a threshold. Called between the elements of
+  // large values, so that the sink receives them in parts and the buffer stays small.
+  std::error_code FlushIfNeeded();
+
+  // The size of the data that FlushMem did not write yet.
+  size_t SerializedLen() const {
+    return mem_buf_.InputLen();
+  }
+
   // This would work for either string or an object.
   // The arg pv is taken from it->second if accessing
   // this by finding the key. This function is used
@@ -146,21 +263,35 @@ class RdbSerializer {
 
   std::error_code SendFullSyncCut();
 
+  // Writes a tombstone of key, see RDB_OPCODE_DELETED_KEY.
+  std::error_code SaveDeletedKey(std::string_view key);
+
+  // Writes the fields of the hash at key that were set, interleaved with their values, and the
+  // fields that were removed, see RDB_OPCODE_HASH_FIELDS.
+  std::error_code SaveHashFields(std::string_view key, CmdArgList set_fields,
+                                 CmdArgList removed_fields);
+
  private:
   std::error_code SaveLzfBlob(const ::io::Bytes& src, size_t uncompressed_len);
   std::error_code SaveObject(const PrimeValue& pv);
   std::error_code SaveListObject(const robj* obj);
+  // Saves the data of a PLAIN or native listpack node, LZF compressed nodes are saved as is.
+  std::error_code SaveListNode(const quicklistNode* node);
   std::error_code SaveSetObject(const PrimeValue& pv);
-  std::error_code SaveHSetObject(const robj* obj);
+  std::error_code SaveHSetObject(const PrimeValue& pv);
   std::error_code SaveZSetObject(const robj* obj);
   std::error_code SaveStreamObject(const robj* obj);
   std::error_code SaveLongLongAsString(int64_t value);
   std::error_code SaveBinaryDouble(double val);
   std::error_code SaveListPackAsZiplist(uint8_t* lp);
+  std::error_code SaveListPack(uint8_t* lp);
   std::error_code SaveStreamPEL(rax* pel, bool nacks);
   std::error_code SaveStreamConsumers(streamCG* cg);
+  std::error_code SaveExternalRef(std::string_view key, const PrimeValue& pv);
 
   ::io::Sink* sink_;
+  bool keep_external_ = false;
+  bool native_encoding_ = false;
 
   std::unique_ptr<LZF_HSLOT[]> lzf_;
   base::IoBuf mem_buf_;
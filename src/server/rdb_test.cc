@@ -5,6 +5,7 @@
 
 extern "C" {
 #include "redis/crc64.h"
+#include "redis/quicklist.h"
 #include "redis/redis_aux.h"
 #include "redis/zmalloc.h"
 }
@@ -12,6 +13,8 @@ extern "C" {
 #include <absl/flags/reflection.h>
 #include <mimalloc.h>
 
+#include <fstream>
+
 #include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -30,6 +33,9 @@ using absl::StrCat;
 
 ABSL_DECLARE_FLAG(int32, list_compress_depth);
 ABSL_DECLARE_FLAG(int32, list_max_listpack_size);
+ABSL_DECLARE_FLAG(bool, rdb_native_encoding);
+ABSL_DECLARE_FLAG(string, snapshot_compression);
+ABSL_DECLARE_FLAG(bool, delta_snapshots);
 
 namespace dfly {
 
@@ -72,6 +78,21 @@ TEST_F(RdbTest, Crc) {
   c2 = crc64(0, to_byte(s.data() + 4), 4);
   c3 = crc64(c2, to_byte(s.data()), 4);
   EXPECT_NE(c, c3);
+
+  s = "123456789";
+  EXPECT_EQ(0xe9c6d914c4b8d9ca, crc64(0, to_byte(s.data()), s.size()));
+
+  // Long inputs are folded with carry-less multiplication when the cpu supports it.
+  string long_str(10000, 0);
+  for (size_t i = 0; i < long_str.size(); ++i)
+    long_str[i] = char(i * 7919);
+  for (size_t len : {127, 128, 129, 1000, 4095, 10000}) {
+    c = crc64(17, to_byte(long_str.data()), len);
+    c2 = 17;
+    for (size_t i = 0; i < len; i += 5)
+      c2 = crc64(c2, to_byte(long_str.data() + i), min<size_t>(5, len - i));
+    EXPECT_EQ(c, c2) << len;
+  }
 }
 
 TEST_F(RdbTest, LoadEmpty) {
@@ -118,6 +139,32 @@ TEST_F(RdbTest, LoadSmall6) {
   EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(1)));
 }
 
+TEST_F(RdbTest, LoadAfterWrites) {
+  shard_set->RunBriefInParallel(
+      [](EngineShard* shard) { shard->db_slice().TrackLoadingWrites(true); });
+
+  // The keys written during the load keep the values of the clients.
+  Run({"set", "strkey", "written"});
+  Run({"del", "intkey"});
+  Run({"get", "intset"});
+
+  io::FileSource fs = GetSource("redis6_small.rdb");
+  RdbLoader loader(service_->script_mgr());
+  auto ec = pp_->at(0)->Await([&] { return loader.Load(&fs); });
+  ASSERT_FALSE(ec) << ec.message();
+  EXPECT_EQ(2u, loader.keys_skipped());
+
+  EXPECT_EQ(Run({"get", "strkey"}), "written");
+  EXPECT_THAT(Run({"get", "intkey"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(7, CheckedInt({"scard", "intset"}));
+  EXPECT_EQ(9, CheckedInt({"dbsize"}));
+
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    shard->db_slice().TrackLoadingWrites(false);
+    EXPECT_EQ(0u, shard->db_slice().loading_writes());
+  });
+}
+
 TEST_F(RdbTest, Stream) {
   io::FileSource fs = GetSource("redis6_stream.rdb");
   RdbLoader loader(service_->script_mgr());
@@ -172,11 +219,102 @@ TEST_F(RdbTest, Reload) {
   EXPECT_EQ(3, CheckedInt({"scard", "intset_key"}));
   EXPECT_EQ(2, CheckedInt({"hlen", "small_hset"}));
   EXPECT_EQ(2, CheckedInt({"hlen", "large_hset"}));
+  EXPECT_EQ(string(510, 'V'), Run({"hget", "large_hset", "field1"}));
+  EXPECT_EQ("val2", Run({"hget", "large_hset", string(120, 'F')}));
   EXPECT_EQ(4, CheckedInt({"LLEN", "list_key2"}));
   EXPECT_EQ(2, CheckedInt({"ZCARD", "zs1"}));
   EXPECT_EQ(2, CheckedInt({"ZCARD", "zs2"}));
 }
 
+TEST_F(RdbTest, ReloadZiplistEncoding) {
+  absl::FlagSaver fs;
+
+  SetFlag(&FLAGS_rdb_native_encoding, false);
+  SetFlag(&FLAGS_list_compress_depth, 1);
+  SetFlag(&FLAGS_list_max_listpack_size, 2);
+
+  Run({"hset", "hset", "field1", "val1", "field2", "2"});
+  Run({"rpush", "list", "a", string(500, 'b'), "3", string(500, 'd'), "e"});
+  Run({"zadd", "zset", "1.1", "a", "-2", "b"});
+
+  auto resp = Run({"debug", "reload"});
+  ASSERT_EQ(resp, "OK");
+
+  EXPECT_EQ("val1", Run({"hget", "hset", "field1"}));
+  EXPECT_EQ("2", Run({"hget", "hset", "field2"}));
+  EXPECT_EQ(5, CheckedInt({"llen", "list"}));
+  EXPECT_EQ(string(500, 'd'), Run({"lindex", "list", "3"}));
+  EXPECT_EQ("e", Run({"lindex", "list", "4"}));
+  EXPECT_THAT(Run({"zrange", "zset", "0", "-1"}).GetVec(), ElementsAre("b", "a"));
+
+  SetFlag(&FLAGS_rdb_native_encoding, true);
+  resp = Run({"debug", "reload"});
+  ASSERT_EQ(resp, "OK");
+
+  EXPECT_EQ("2", Run({"hget", "hset", "field2"}));
+  EXPECT_EQ(string(500, 'b'), Run({"lindex", "list", "1"}));
+  EXPECT_THAT(Run({"zrange", "zset", "0", "-1"}).GetVec(), ElementsAre("b", "a"));
+}
+
+TEST_F(RdbTest, ReloadLz4List) {
+  absl::FlagSaver fs;
+
+  SetFlag(&FLAGS_list_compress_depth, 1);
+  SetFlag(&FLAGS_list_max_listpack_size, 1);
+  quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZ4);
+
+  Run({"rpush", "list", "head", string(500, 'b'), string(500, 'c'), "tail"});
+  for (bool native : {true, false}) {
+    SetFlag(&FLAGS_rdb_native_encoding, native);
+    auto resp = Run({"debug", "reload"});
+    ASSERT_EQ(resp, "OK");
+
+    EXPECT_EQ(4, CheckedInt({"llen", "list"}));
+    EXPECT_EQ(string(500, 'b'), Run({"lindex", "list", "1"}));
+    EXPECT_EQ(string(500, 'c'), Run({"lindex", "list", "2"}));
+  }
+  quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZF);
+}
+
+TEST_F(RdbTest, ReloadCompressed) {
+  absl::FlagSaver fs;
+  Run({"debug", "populate", "50000"});
+  Run({"hset", "hset", "field1", string(1000, 'V')});
+
+  for (string_view mode : {"zstd", "lz4"}) {
+    SetFlag(&FLAGS_snapshot_compression, string(mode));
+    auto resp = Run({"debug", "reload"});
+    ASSERT_EQ(resp, "OK") << mode;
+
+    EXPECT_EQ(50001, CheckedInt({"dbsize"})) << mode;
+    EXPECT_EQ("value:4321", Run({"get", "key:4321"})) << mode;
+    EXPECT_EQ(string(1000, 'V'), Run({"hget", "hset", "field1"})) << mode;
+  }
+}
+
+TEST_F(RdbTest, ReloadLargeValues) {
+  // Each container is larger than the serializer buffers, so it is flushed in parts.
+  string pad(100, 'x');
+  for (unsigned i = 0; i < 5000; ++i) {
+    string member = StrCat(pad, i);
+    Run({"zadd", "zset", StrCat(i), member});
+    Run({"sadd", "set", member});
+    Run({"hset", "hash", member, StrCat(i)});
+    Run({"rpush", "list", member});
+  }
+
+  auto resp = Run({"debug", "reload"});
+  ASSERT_EQ(resp, "OK");
+
+  EXPECT_EQ(5000, CheckedInt({"zcard", "zset"}));
+  EXPECT_EQ(5000, CheckedInt({"scard", "set"}));
+  EXPECT_EQ(5000, CheckedInt({"hlen", "hash"}));
+  EXPECT_EQ(5000, CheckedInt({"llen", "list"}));
+  EXPECT_EQ(StrCat(pad, 4321), Run({"lindex", "list", "4321"}));
+  EXPECT_EQ("4321", Run({"zscore", "zset", StrCat(pad, 4321)}));
+  EXPECT_EQ("4321", Run({"hget", "hash", StrCat(pad, 4321)}));
+}
+
 TEST_F(RdbTest, ReloadTtl) {
   Run({"set", "key", "val"});
   Run({"expire", "key", "1000"});
@@ -184,6 +322,23 @@ TEST_F(RdbTest, ReloadTtl) {
   EXPECT_LT(990, CheckedInt({"ttl", "key"}));
 }
 
+TEST_F(RdbTest, SnapshotBench) {
+  Run({"debug", "populate", "10000"});
+  for (string_view format : {"", "RDB"}) {
+    auto resp = format.empty() ? Run({"debug", "snapshotbench"})
+                               : Run({"debug", "snapshotbench", format});
+    ASSERT_EQ(RespExpr::ARRAY, resp.type) << format;
+    auto vec = resp.GetVec();
+    ASSERT_EQ(15u, vec.size()) << format;
+    EXPECT_THAT(ToSV(vec[0].GetBuf()), StartsWith("save: ")) << format;
+    EXPECT_THAT(ToSV(vec[1].GetBuf()), StartsWith("save.traverse: ")) << format;
+    EXPECT_THAT(ToSV(vec[8].GetBuf()), StartsWith("load: ")) << format;
+    EXPECT_THAT(ToSV(vec[9].GetBuf()), StartsWith("load.read: ")) << format;
+    EXPECT_EQ(10000, CheckedInt({"dbsize"})) << format;
+  }
+  EXPECT_THAT(Run({"debug", "snapshotbench", "foo"}), ErrArg("syntax error"));
+}
+
 TEST_F(RdbTest, SaveFlush) {
   Run({"debug", "populate", "500000"});
 
@@ -257,6 +412,59 @@ TEST_F(RdbTest, SaveManyDbs) {
   }
 }
 
+TEST_F(RdbTest, SaveDelta) {
+  SetFlag(&FLAGS_delta_snapshots, true);
+  Run({"debug", "populate", "1000"});
+  ASSERT_EQ(Run({"save"}), "OK");
+  string base = service_->server_family().GetLastSaveInfo()->file_name;
+
+  Run({"set", "key:1", "changed"});
+  Run({"del", "key:2"});
+  Run({"set", "newkey", "val"});
+  Run({"expire", "key:3", "1000"});
+  ASSERT_EQ(Run({"save", "delta", base}), "OK");
+  string delta = service_->server_family().GetLastSaveInfo()->file_name;
+  EXPECT_THAT(Run({"save", "delta", base}), ErrArg("delta base must be the last snapshot"));
+
+  Run({"del", "key:1"});
+  Run({"set", "key:2", "again"});
+  ASSERT_EQ(Run({"save", "delta", delta}), "OK");
+  string last_delta = service_->server_family().GetLastSaveInfo()->file_name;
+  EXPECT_NE(delta, last_delta);
+
+  ASSERT_EQ(Run({"debug", "load", last_delta}), "OK");
+  EXPECT_EQ(1000, CheckedInt({"dbsize"}));
+  EXPECT_THAT(Run({"get", "key:1"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(Run({"get", "key:2"}), "again");
+  EXPECT_EQ(Run({"get", "key:4"}), "value:4");
+  EXPECT_EQ(Run({"get", "newkey"}), "val");
+  EXPECT_GT(CheckedInt({"ttl", "key:3"}), 0);
+
+  // A flush drops the tombstones, so the next snapshot must be a full one.
+  Run({"flushall"});
+  EXPECT_THAT(Run({"save", "delta", last_delta}), ErrArg("database was flushed"));
+  SetFlag(&FLAGS_delta_snapshots, false);
+}
+
+TEST_F(RdbTest, SaveChecksum) {
+  Run({"debug", "populate", "1000"});
+  ASSERT_EQ(Run({"save"}), "OK");
+  string file = service_->server_family().GetLastSaveInfo()->file_name;
+  ASSERT_EQ(Run({"debug", "load", file}), "OK");
+  EXPECT_EQ(1000, CheckedInt({"dbsize"}));
+
+  // The corrupted value is still parsed, only the checksum catches it.
+  {
+    fstream f(file, ios::in | ios::out | ios::binary);
+    string data{istreambuf_iterator<char>(f), istreambuf_iterator<char>()};
+    size_t pos = data.find("value:");
+    ASSERT_NE(pos, string::npos);
+    f.seekp(pos);
+    f.put('V');
+  }
+  EXPECT_THAT(Run({"debug", "load", file}), ErrArg("when loading RDB file"));
+}
+
 TEST_F(RdbTest, HMapBugs) {
   // Force OBJ_ENCODING_HT encoding.
   server.hash_max_listpack_value = 0;
@@ -268,4 +476,18 @@ TEST_F(RdbTest, HMapBugs) {
   EXPECT_EQ(2, CheckedInt({"hlen", "hmap1"}));
 }
 
+static void BM_Crc64(benchmark::State& state) {
+  string buf(state.range(0), 'a');
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = char(i * 7919);
+
+  uint64_t crc = 0;
+  while (state.KeepRunning()) {
+    crc = crc64(crc, to_byte(buf.data()), buf.size());
+  }
+  benchmark::DoNotOptimize(crc);
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Crc64)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
 }  // namespace dfly
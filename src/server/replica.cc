@@ -9,18 +9,28 @@ extern "C" {
 
 #include <absl/strings/escaping.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
 #include <absl/strings/strip.h>
 
 #include <boost/asio/ip/tcp.hpp>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/redis_parser.h"
 #include "server/error.h"
+#include "server/journal/executor.h"
+#include "server/journal/serializer.h"
 #include "server/main_service.h"
 #include "server/rdb_load.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(bool, replica_multi_shard_barrier, true,
+          "If false, the parts of multi-shard commands that are journaled per shard (MSET, DEL, "
+          "...) are applied by every flow without waiting for the other flows, when the replica "
+          "runs as many shards as the master. Replica readers may then observe such a command "
+          "partially applied.");
+
 namespace dfly {
 
 using namespace std;
@@ -95,8 +105,9 @@ Replica::Replica(string host, uint16_t port, Service* se) : service_(*se) {
   master_context_.port = port;
 }
 
-Replica::Replica(const MasterContext& context, uint32_t dfly_flow_id, Service* service)
-    : service_(*service), master_context_(context) {
+Replica::Replica(const MasterContext& context, uint32_t dfly_flow_id, Service* service,
+                 std::shared_ptr<MultiShardExecution> multi_shard_exe)
+    : service_(*service), master_context_(context), multi_shard_exe_(std::move(multi_shard_exe)) {
   master_context_.dfly_flow_id = dfly_flow_id;
 }
 
@@ -150,18 +161,45 @@ void Replica::Stop() {
     });
   }
 
+  if (multi_shard_exe_)
+    multi_shard_exe_->Cancel();
+
   // Close sub flows.
-  auto partition = Partition(num_df_flows_);
-  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
-    for (auto id : partition[index]) {
-      shard_flows_[id]->Stop();
-    }
-  });
+  StopFlows();
 
   if (sync_fb_.joinable())
     sync_fb_.join();
 }
 
+void Replica::SetBootstrapOffsets(string master_id, vector<LSN> shard_lsns) {
+  bootstrap_master_id_ = std::move(master_id);
+  bootstrap_lsns_ = std::move(shard_lsns);
+}
+
+bool Replica::GetMasterOffsets(string* master_id, vector<LSN>* flow_lsns) const {
+  if (shard_flows_.empty())
+    return false;
+
+  flow_lsns->clear();
+  for (const auto& flow : shard_flows_) {
+    if (!flow->journal_lsn_)
+      return false;
+    flow_lsns->push_back(*flow->journal_lsn_);
+  }
+  *master_id = master_context_.master_repl_id;
+  return true;
+}
+
+void Replica::DropBootstrap() {
+  if (bootstrap_lsns_.empty())
+    return;
+
+  LOG(INFO) << "Dropping the loaded snapshot before the full sync";
+  bootstrap_lsns_.clear();
+  shard_set->RunBlockingInParallel(
+      [](EngineShard* shard) { shard->db_slice().FlushDb(DbSlice::kDbAll); });
+}
+
 void Replica::Pause(bool pause) {
   sock_->proactor()->Await([&] { is_paused_ = pause; });
 }
@@ -381,6 +419,8 @@ error_code Replica::InitiatePSync() {
   // we get the snapshot size.
   if (snapshot_size || token != nullptr) {  // full sync
     // Start full sync
+    service_.server_family().OnMasterFullSync();
+    DropBootstrap();
     state_mask_ |= R_SYNCING;
 
     SocketSource ss{sock_.get()};
@@ -426,24 +466,52 @@ error_code Replica::InitiatePSync() {
 error_code Replica::InitiateDflySync() {
   DCHECK_GT(num_df_flows_, 0u);
 
-  shard_flows_.resize(num_df_flows_);
-  for (unsigned i = 0; i < num_df_flows_; ++i) {
-    shard_flows_[i].reset(new Replica(master_context_, i, &service_));
+  // Stop the flows of the previous attempt, their stream may still be running.
+  StopFlows();
+
+  // Flows of the same master keep their positions in its journal, so they can try to resume.
+  // So does the snapshot of the master that was loaded before the first sync. Its shards are
+  // the first threads of the master, the other flows stream nothing and resume from anywhere.
+  // A master promoted from a replica of the bootstrap master may know where they lead to.
+  vector<optional<LSN>> lsns(num_df_flows_);
+  if (shard_flows_.size() == num_df_flows_ &&
+      shard_flows_[0]->master_context_.master_repl_id == master_context_.master_repl_id) {
+    for (unsigned i = 0; i < num_df_flows_; ++i)
+      lsns[i] = shard_flows_[i]->journal_lsn_;
+  } else if (!bootstrap_lsns_.empty() &&
+             bootstrap_master_id_ == master_context_.master_repl_id &&
+             bootstrap_lsns_.size() <= num_df_flows_) {
+    for (unsigned i = 0; i < num_df_flows_; ++i)
+      lsns[i] = i < bootstrap_lsns_.size() ? bootstrap_lsns_[i] : 0;
+  } else if (!bootstrap_lsns_.empty()) {
+    RETURN_ON_ERR(FetchPromotionOffsets(&lsns));
   }
 
-  SyncBlock sb{num_df_flows_};
+  RETURN_ON_ERR(StartFlows(lsns));
 
-  AggregateError ec;
+  if (all_of(shard_flows_.begin(), shard_flows_.end(),
+             [](const auto& flow) { return flow->partial_; })) {
+    LOG(INFO) << "Resuming replication from the journal backlog";
+    bootstrap_lsns_.clear();
+    state_mask_ |= R_SYNC_OK;
+    return error_code{};
+  }
+
+  service_.server_family().OnMasterFullSync();
+  DropBootstrap();
+
+  // The full sync overwrites the dataset, the old positions do not apply to it anymore.
+  SyncBlock sb{num_df_flows_};
   auto partition = Partition(num_df_flows_);
+  auto progress = atomic_load(&flow_progress_);
   shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
     for (auto id : partition[index]) {
-      if ((ec = shard_flows_[id]->StartFullSyncFlow(&sb)))
-        break;
+      shard_flows_[id]->journal_lsn_.reset();
+      (*progress)[id].lsn.store(0, memory_order_relaxed);
+      shard_flows_[id]->StartFullSyncFlow(&sb);
     }
   });
 
-  RETURN_ON_ERR(*ec);
-
   ReqSerializer serializer{sock_.get()};
 
   // Master waits for this command in order to start sending replication stream.
@@ -470,6 +538,170 @@ error_code Replica::InitiateDflySync() {
   return error_code{};
 }
 
+error_code Replica::FetchPromotionOffsets(vector<optional<LSN>>* lsns) {
+  ReqSerializer serializer{sock_.get()};
+  RETURN_ON_ERR(SendCommand(StrCat("DFLY PROMOTION ", bootstrap_master_id_, " ",
+                                   absl::StrJoin(bootstrap_lsns_, " ")),
+                            &serializer));
+
+  base::IoBuf io_buf{128};
+  unsigned consumed = 0;
+  RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+
+  // Masters that were not promoted right after the bootstrap, or predate the command, refuse.
+  if (!resp_args_.empty() && resp_args_[0].type == RespExpr::ERROR) {
+    VLOG(1) << "No promotion offsets: " << ToSV(resp_args_[0].GetBuf());
+    return error_code{};
+  }
+
+  if (resp_args_.size() != num_df_flows_) {
+    LOG(ERROR) << "Bad promotion offsets " << ToSV(io_buf.InputBuffer());
+    return make_error_code(errc::bad_message);
+  }
+
+  for (unsigned i = 0; i < num_df_flows_; ++i) {
+    if (resp_args_[i].type != RespExpr::INT64)
+      return make_error_code(errc::bad_message);
+    (*lsns)[i] = get<int64_t>(resp_args_[i].u);
+  }
+
+  LOG(INFO) << "Master " << master_context_.master_repl_id << " took over from "
+            << bootstrap_master_id_ << " at the position of this dataset";
+  return error_code{};
+}
+
+error_code Replica::StartFlows(const vector<optional<LSN>>& lsns) {
+  multi_shard_exe_.reset(new MultiShardExecution);
+
+  // With the same number of shards, every flow applies the keys of its master shard to a single
+  // replica shard, so a split part is a complete shard-local command.
+  bool split_without_barrier =
+      !absl::GetFlag(FLAGS_replica_multi_shard_barrier) && num_df_flows_ == shard_set->size();
+  auto progress = make_shared<vector<FlowProgress>>(num_df_flows_);
+  shard_flows_.resize(num_df_flows_);
+  for (unsigned i = 0; i < num_df_flows_; ++i) {
+    shard_flows_[i].reset(new Replica(master_context_, i, &service_, multi_shard_exe_));
+    shard_flows_[i]->journal_lsn_ = lsns[i];
+    shard_flows_[i]->split_without_barrier_ = split_without_barrier;
+    shard_flows_[i]->flow_progress_ = progress;
+    (*progress)[i].lsn.store(lsns[i].value_or(0), memory_order_relaxed);
+  }
+  atomic_store(&flow_progress_, progress);
+
+  AggregateError ec;
+  auto partition = Partition(num_df_flows_);
+  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
+    for (auto id : partition[index]) {
+      if ((ec = shard_flows_[id]->StartFlow()))
+        break;
+    }
+  });
+
+  return *ec;
+}
+
+void Replica::StopFlows() {
+  auto partition = Partition(shard_flows_.size());
+  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
+    for (auto id : partition[index]) {
+      shard_flows_[id]->Stop();
+    }
+  });
+}
+
+error_code Replica::SyncSlots(string_view my_id, const vector<ClusterConfig::SlotRange>& ranges) {
+  CHECK(!sock_);
+
+  RETURN_ON_ERR(ConnectSocket());
+  state_mask_ = R_ENABLED | R_TCP_CONNECTED;
+  last_io_time_ = ProactorBase::me()->GetMonotonicTimeNs();
+  RETURN_ON_ERR(Greet());
+  if (!HasDflyMaster())
+    return make_error_code(errc::protocol_not_supported);
+
+  // The flows may still hold the sync block when we fail, stop them before it goes away.
+  SyncBlock sb{num_df_flows_};
+  auto fail = [this](error_code ec) {
+    StopFlows();
+    return ec;
+  };
+
+  if (error_code ec = StartFlows(vector<optional<LSN>>(num_df_flows_)); ec)
+    return fail(ec);
+
+  auto partition = Partition(num_df_flows_);
+  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
+    for (auto id : partition[index]) {
+      shard_flows_[id]->StartFullSyncFlow(&sb);
+    }
+  });
+
+  // Sends a command of the migration on the main connection and checks that it succeeded.
+  auto run_cmd = [this](string_view cmd) -> error_code {
+    ReqSerializer serializer{sock_.get()};
+    RETURN_ON_ERR(SendCommand(cmd, &serializer));
+
+    base::IoBuf io_buf{128};
+    unsigned consumed = 0;
+    RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+    if (!CheckRespIsSimpleReply("OK")) {
+      LOG(ERROR) << "Slot migration failed " << ToSV(io_buf.InputBuffer());
+      return make_error_code(errc::bad_message);
+    }
+    return error_code{};
+  };
+
+  // The flows stream a snapshot of the slots, which the source keeps updating with their
+  // changes until the writes of the slots pause.
+  string cmd = StrCat("DFLY SYNC ", master_context_.dfly_session_id, " SLOTS ", my_id);
+  for (const auto& range : ranges)
+    absl::StrAppend(&cmd, " ", range.start, " ", range.end);
+  if (error_code ec = run_cmd(cmd); ec)
+    return fail(ec);
+
+  // The loaders do not report a broken stream before the full sync cut, hence the polling.
+  {
+    std::unique_lock lk(sb.mu_);
+    while (!sb.cv_.wait_for(lk, 100ms, [&] { return sb.flows_left == 0; })) {
+      bool failed = any_of(shard_flows_.begin(), shard_flows_.end(),
+                           [](const auto& flow) { return flow->load_failed_.load(); });
+      if (failed || (state_mask_ & R_ENABLED) == 0) {
+        lk.unlock();
+        return fail(make_error_code(errc::connection_aborted));
+      }
+    }
+  }
+
+  VLOG(1) << "Slots caught up, pausing their writes on the source";
+  if (error_code ec = run_cmd(StrCat("DFLY SLOTS-PAUSE ", master_context_.dfly_session_id)); ec)
+    return fail(ec);
+
+  // The source ends the snapshots once the writes have stopped, apply what is left of them.
+  for (auto& flow : shard_flows_) {
+    if (flow->sync_fb_.joinable())
+      flow->sync_fb_.join();
+    if (flow->load_failed_.load())
+      return fail(make_error_code(errc::connection_aborted));
+  }
+
+  return error_code{};
+}
+
+error_code Replica::ReleaseSlots() {
+  ReqSerializer serializer{sock_.get()};
+  RETURN_ON_ERR(SendCommand(StrCat("DFLY SLOTS-RELEASE ", master_context_.dfly_session_id),
+                            &serializer));
+
+  base::IoBuf io_buf{128};
+  unsigned consumed = 0;
+  RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+  if (!CheckRespIsSimpleReply("OK")) {
+    LOG(ERROR) << "Could not release the slots " << ToSV(io_buf.InputBuffer());
+    return make_error_code(errc::bad_message);
+  }
+  return error_code{};
+}
+
 error_code Replica::ConsumeRedisStream() {
   base::IoBuf io_buf(16_KB);
   parser_.reset(new RedisParser);
@@ -524,9 +756,11 @@ error_code Replica::ConsumeDflyStream() {
     RETURN_ON_ERR(serializer.ec());
   }
 
-  // Wait for all flows to finish full sync.
-  for (auto& sub_repl : shard_flows_)
-    sub_repl->sync_fb_.join();
+  // Wait for all flows to finish full sync. Resumed flows have none.
+  for (auto& sub_repl : shard_flows_) {
+    if (sub_repl->sync_fb_.joinable())
+      sub_repl->sync_fb_.join();
+  }
 
   AggregateError all_ec;
   vector<vector<unsigned>> partition = Partition(num_df_flows_);
@@ -553,7 +787,47 @@ error_code Replica::ConsumeDflyStream() {
   return error_code{};
 }
 
-error_code Replica::StartFullSyncFlow(SyncBlock* sb) {
+bool Replica::MultiShardExecution::Arrive(TxId txid, uint32_t shard_cnt) {
+  unique_lock lk(mu_);
+  if (cancelled_)
+    return false;
+
+  if (++txs_[txid].arrived == shard_cnt) {
+    cv_.notify_all();
+    return true;
+  }
+
+  cv_.wait(lk, [&] { return cancelled_ || txs_[txid].arrived == shard_cnt; });
+  if (txs_[txid].arrived == shard_cnt)
+    return true;
+
+  // Cancelled, the flows that arrive later must not apply the transaction either.
+  --txs_[txid].arrived;
+  return false;
+}
+
+void Replica::MultiShardExecution::Depart(TxId txid, uint32_t shard_cnt) {
+  unique_lock lk(mu_);
+  auto it = txs_.find(txid);
+  DCHECK(it != txs_.end());
+
+  // All the flows arrived, so all of them depart independently of the cancellation.
+  if (++it->second.departed == shard_cnt) {
+    txs_.erase(it);
+    cv_.notify_all();
+    return;
+  }
+
+  cv_.wait(lk, [&] { return !txs_.contains(txid); });
+}
+
+void Replica::MultiShardExecution::Cancel() {
+  lock_guard lk(mu_);
+  cancelled_ = true;
+  cv_.notify_all();
+}
+
+error_code Replica::StartFlow() {
   CHECK(!sock_);
   DCHECK(!master_context_.master_repl_id.empty() && !master_context_.dfly_session_id.empty());
 
@@ -569,6 +843,11 @@ error_code Replica::StartFullSyncFlow(SyncBlock* sb) {
   ReqSerializer serializer{sock_.get()};
   auto cmd = StrCat("DFLY FLOW ", master_context_.master_repl_id, " ",
                     master_context_.dfly_session_id, " ", master_context_.dfly_flow_id);
+  if (journal_lsn_)
+    absl::StrAppend(&cmd, " LSN ", *journal_lsn_);
+
+  // The loader and the journal reader decompress whatever the master chooses.
+  absl::StrAppend(&cmd, " COMPRESS");
   RETURN_ON_ERR(SendCommand(cmd, &serializer));
 
   parser_.reset(new RedisParser{false});  // client mode
@@ -583,9 +862,9 @@ error_code Replica::StartFullSyncFlow(SyncBlock* sb) {
   }
 
   string_view flow_directive = ToSV(resp_args_[0].GetBuf());
-  string eof_token;
-  if (flow_directive == "FULL") {
-    eof_token = ToSV(resp_args_[1].GetBuf());
+  if (flow_directive == "FULL" || flow_directive == "PARTIAL") {
+    partial_ = flow_directive == "PARTIAL";
+    eof_token_ = ToSV(resp_args_[1].GetBuf());
   } else {
     LOG(ERROR) << "Bad FLOW response " << ToSV(leftover_buf_->InputBuffer());
   }
@@ -593,11 +872,13 @@ error_code Replica::StartFullSyncFlow(SyncBlock* sb) {
 
   state_mask_ = R_ENABLED | R_TCP_CONNECTED;
 
+  return error_code{};
+}
+
+void Replica::StartFullSyncFlow(SyncBlock* sb) {
   // We can not discard io_buf because it may contain data
   // besides the response we parsed. Therefore we pass it further to ReplicateDFFb.
-  sync_fb_ = ::boost::fibers::fiber(&Replica::FullSyncDflyFb, this, sb, move(eof_token));
-
-  return error_code{};
+  sync_fb_ = ::boost::fibers::fiber(&Replica::FullSyncDflyFb, this, sb, move(eof_token_));
 }
 
 error_code Replica::StartStableSyncFlow() {
@@ -627,7 +908,10 @@ void Replica::FullSyncDflyFb(SyncBlock* sb, string eof_token) {
     }
     sb->cv_.notify_all();
   });
-  loader.Load(&ps);
+  if (error_code ec = loader.Load(&ps); ec) {
+    VLOG(1) << "Full sync stream broke " << ec.message();
+    load_failed_.store(true);
+  }
 
   // Try finding eof token.
   io::PrefixSource chained_tail{loader.Leftover(), &ps};
@@ -657,35 +941,65 @@ void Replica::FullSyncDflyFb(SyncBlock* sb, string eof_token) {
 }
 
 void Replica::StableSyncDflyFb() {
-  base::IoBuf io_buf(16_KB);
-  parser_.reset(new RedisParser);
-
-  // Check leftover from stable state.
+  // Check leftover from full sync.
+  io::Bytes prefix{};
   if (leftover_buf_ && leftover_buf_->InputLen() > 0) {
-    size_t len = leftover_buf_->InputLen();
-    leftover_buf_->ReadAndConsume(len, io_buf.AppendBuffer().data());
-    io_buf.CommitWrite(len);
-    leftover_buf_.reset();
+    prefix = leftover_buf_->InputBuffer();
   }
 
-  error_code ec;
-  string ack_cmd;
+  SocketSource ss{sock_.get()};
+  io::PrefixSource ps{prefix, &ss};
+  journal::JournalReader reader{&ps};
 
-  while (!ec) {
-    io::MutableBytes buf = io_buf.AppendBuffer();
-    io::Result<size_t> size_res = sock_->Recv(buf);
-    if (!size_res)
-      return;
+  journal::JournalExecutor executor{&service_};
+  FlowProgress& progress = (*flow_progress_)[master_context_.dfly_flow_id];
+
+  while (true) {
+    io::Result<journal::ParsedEntry> res = reader.ReadEntry();
+    if (!res) {
+      VLOG(1) << "Stable sync stream finished " << res.error().message();
+      break;
+    }
 
     last_io_time_ = sock_->proactor()->GetMonotonicTimeNs();
+    repl_offs_ = reader.bytes_read() - reader.Leftover().size();
+
+    // Besides the starting position, NOOPs are heartbeats with the last streamed LSN, which
+    // may precede the position of a flow that started after it.
+    if (res->opcode == journal::Op::NOOP) {
+      journal_lsn_ = max(journal_lsn_.value_or(0), res->lsn);
+      progress.lsn.store(*journal_lsn_, memory_order_relaxed);
+      progress.heartbeat_ms.store(res->time_ms, memory_order_relaxed);
+      continue;
+    }
 
-    io_buf.CommitWrite(*size_res);
-    repl_offs_ += *size_res;
+    // The entries of a multi-shard transaction arrive through the flows of its shards, each
+    // flow applies its part, see journal::Entry::shard_cnt. Parts of CO::SPLIT_JOURNAL commands
+    // carry their own arguments and may skip the barrier.
+    bool multi_shard = res->shard_cnt > 1;
+    if (multi_shard && split_without_barrier_ && !res->cmd_args.empty()) {
+      // The master journals the registered, upper case, command names.
+      const CommandId* cid = service_.FindCmd(facade::ArgS(res->cmd_args, 0));
+      multi_shard = !cid || (cid->opt_mask() & CO::SPLIT_JOURNAL) == 0;
+    }
+    if (multi_shard && !multi_shard_exe_->Arrive(res->txid, res->shard_cnt))
+      break;
 
-    ec = ParseAndExecute(&io_buf);
+    if (!res->cmd_args.empty()) {
+      CmdArgList arg_list{res->cmd_args.data(), res->cmd_args.size()};
+      executor.Execute(res->dbid, arg_list);
+    }
+    journal_lsn_ = res->lsn;
+    progress.lsn.store(res->lsn, memory_order_relaxed);
+
+    if (multi_shard)
+      multi_shard_exe_->Depart(res->txid, res->shard_cnt);
   }
 
-  return;
+  // The other flows can not complete the transactions that this flow did not reach.
+  multi_shard_exe_->Cancel();
+
+  leftover_buf_.reset();
 }
 
 error_code Replica::ReadRespReply(base::IoBuf* io_buf, uint32_t* consumed) {
@@ -841,9 +1155,7 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
   uint32_t consumed = 0;
   RedisParser::Result result = RedisParser::OK;
 
-  io::NullSink null_sink;  // we never reply back on the commands.
-  ConnectionContext conn_context{&null_sink, nullptr};
-  conn_context.is_replicating = true;
+  journal::JournalExecutor executor{&service_};
 
   do {
     result = parser_->Parse(io_buf->InputBuffer(), &consumed, &resp_args_);
@@ -883,10 +1195,31 @@ Replica::Info Replica::GetInfo() const {
     res.master_link_established = (state_mask_ & R_TCP_CONNECTED);
     res.sync_in_progress = (state_mask_ & R_SYNCING);
     res.master_last_io_sec = (ProactorBase::GetMonotonicTimeNs() - last_io_time_) / 1000000000UL;
+    if (auto progress = atomic_load(&flow_progress_); progress) {
+      for (const auto& flow : *progress)
+        res.flow_lsns.push_back(flow.lsn.load(memory_order_relaxed));
+    }
+    res.staleness_ms = StalenessMs();
     return res;
   });
 }
 
+uint64_t Replica::StalenessMs() const {
+  auto progress = atomic_load(&flow_progress_);
+  if (!progress || progress->empty())
+    return UINT64_MAX;
+
+  uint64_t oldest = UINT64_MAX;
+  for (const auto& flow : *progress)
+    oldest = min(oldest, flow.heartbeat_ms.load(memory_order_relaxed));
+
+  if (oldest == 0)  // Some flow did not receive a heartbeat yet.
+    return UINT64_MAX;
+
+  uint64_t now = GetCurrentTimeMs();
+  return now > oldest ? now - oldest : 0;
+}
+
 bool Replica::CheckRespIsSimpleReply(string_view reply) const {
   return resp_args_.size() == 1 || resp_args_.front().type == RespExpr::STRING ||
          ToSV(resp_args_.front().GetBuf()) == reply;
@@ -3,14 +3,20 @@
 //
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
 #include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <atomic>
+#include <optional>
 #include <variant>
 
 #include "base/io_buf.h"
 #include "facade/facade_types.h"
 #include "facade/redis_parser.h"
+#include "server/cluster/cluster_config.h"
+#include "server/common.h"
 #include "util/fiber_socket_base.h"
 
 namespace facade {
@@ -56,6 +62,39 @@ class Replica {
     ::boost::fibers::condition_variable cv_;
   };
 
+  // Coordinates the flows that apply the parts of the same multi-shard transaction, see
+  // journal::Entry::shard_cnt. The flows apply their parts once all of them have reached the
+  // transaction, and continue once all of them have applied it, so the other entries of their
+  // shards are not reordered around it. Entries of a single shard need no coordination.
+  struct MultiShardExecution {
+    // Returns false if it was cancelled before all the flows arrived. Then none of them applies
+    // the transaction.
+    bool Arrive(TxId txid, uint32_t shard_cnt);
+
+    // Waits for the other flows to apply their parts.
+    void Depart(TxId txid, uint32_t shard_cnt);
+
+    // Releases the flows that wait for the flows that stopped.
+    void Cancel();
+
+   private:
+    struct TxSync {
+      uint32_t arrived = 0;
+      uint32_t departed = 0;
+    };
+
+    ::boost::fibers::mutex mu_;
+    ::boost::fibers::condition_variable cv_;
+    absl::flat_hash_map<TxId, TxSync> txs_;
+    bool cancelled_ = false;
+  };
+
+  // How far a flow has applied the journal of its shard, read by the other threads.
+  struct FlowProgress {
+    std::atomic<LSN> lsn{0};                // The LSN of the last applied entry.
+    std::atomic_uint64_t heartbeat_ms{0};  // Master time of the last received NOOP.
+  };
+
  public:
   Replica(std::string master_host, uint16_t port, Service* se);
   ~Replica();
@@ -69,6 +108,29 @@ class Replica {
 
   void Pause(bool pause);
 
+  // Makes the first sync with a Dragonfly master resume after the given positions in the
+  // journals of its shards, which are those of a snapshot of master_id that was loaded before.
+  // If the master can not resume from them, the replica flushes the loaded data and does a
+  // full sync. Must be called before Start.
+  void SetBootstrapOffsets(std::string master_id, std::vector<LSN> shard_lsns);
+
+  bool HasBootstrapOffsets() const {
+    return !bootstrap_lsns_.empty();
+  }
+
+  // Returns the id of the Dragonfly master and the positions of the flows in its journal if all
+  // of them are streaming, so they describe the dataset once the replica is stopped.
+  bool GetMasterOffsets(std::string* master_id, std::vector<LSN>* flow_lsns) const;
+
+  // Imports the keys of the slots from the Dragonfly cluster node at the address, which keeps
+  // serving them meanwhile. Returns once they are loaded and the source paused their writes.
+  // Then ReleaseSlots makes the source hand them over to my_id. Used instead of Start.
+  std::error_code SyncSlots(std::string_view my_id,
+                            const std::vector<ClusterConfig::SlotRange>& ranges);
+
+  // Returns bad_message if the source refused to release the slots and still serves them.
+  std::error_code ReleaseSlots();
+
  private: /* Main standalone mode functions */
   // Coordinate state transitions. Spawned by start.
   void MainReplicationFb();
@@ -82,12 +144,25 @@ class Replica {
   std::error_code ConsumeRedisStream();  // Redis stable state.
   std::error_code ConsumeDflyStream();   // Dragonfly stable state.
 
+  // Creates the flows of a new sync and registers them, resuming after lsns where they are set.
+  std::error_code StartFlows(const std::vector<std::optional<LSN>>& lsns);
+
+  // Asks the master for the positions of its threads that continue the bootstrap offsets of
+  // another master, see ServerFamily::GetPromotionOffsets. Leaves lsns unset if it has none.
+  std::error_code FetchPromotionOffsets(std::vector<std::optional<LSN>>* lsns);
+
+  void StopFlows();
+
  private: /* Main dlfly flow mode functions */
   // Initialize as single dfly flow.
-  Replica(const MasterContext& context, uint32_t dfly_flow_id, Service* service);
+  Replica(const MasterContext& context, uint32_t dfly_flow_id, Service* service,
+          std::shared_ptr<MultiShardExecution> multi_shard_exe);
+
+  // Register as a dfly flow on the master. Asks to resume after journal_lsn_ if it is known.
+  std::error_code StartFlow();
 
-  // Start replica initialized as dfly flow.
-  std::error_code StartFullSyncFlow(SyncBlock* block);
+  // Start the full sync of a flow registered by StartFlow.
+  void StartFullSyncFlow(SyncBlock* block);
 
   // Transition into stable state mode as dfly flow.
   std::error_code StartStableSyncFlow();
@@ -124,6 +199,9 @@ class Replica {
   // Send command, update last_io_time, return error.
   std::error_code SendCommand(std::string_view command, facade::ReqSerializer* serializer);
 
+  // Drops the bootstrap offsets and the data they describe, before a full sync.
+  void DropBootstrap();
+
  public: /* Utility */
   struct Info {
     std::string host;
@@ -131,10 +209,17 @@ class Replica {
     bool master_link_established;
     bool sync_in_progress;      // snapshot sync.
     time_t master_last_io_sec;  // monotonic clock.
+    std::vector<LSN> flow_lsns;  // Applied LSN of every dfly flow.
+    uint64_t staleness_ms;
   };
 
   Info GetInfo() const;  // thread-safe, blocks fiber
 
+  // How far behind the master the dataset may be, i.e. the time since the oldest of the latest
+  // heartbeats of the flows, according to the clock of the master. UINT64_MAX if unknown, e.g.
+  // before the first sync or with a Redis master. Thread-safe and does not block.
+  uint64_t StalenessMs() const;
+
   bool HasDflyMaster() const {
     return !master_context_.dfly_session_id.empty();
   }
@@ -159,6 +244,11 @@ class Replica {
   // MainReplicationFb in standalone mode, FullSyncDflyFb in flow mode.
   ::boost::fibers::fiber sync_fb_;
   std::vector<std::unique_ptr<Replica>> shard_flows_;
+  std::shared_ptr<MultiShardExecution> multi_shard_exe_;
+  bool split_without_barrier_ = false;  // See FLAGS_replica_multi_shard_barrier.
+
+  // Indexed by dfly_flow_id, shared by the flows of the same sync. Replaced atomically.
+  std::shared_ptr<std::vector<FlowProgress>> flow_progress_;
 
   std::unique_ptr<base::IoBuf> leftover_buf_;
   std::unique_ptr<facade::RedisParser> parser_;
@@ -169,6 +259,17 @@ class Replica {
   // ack_offs_ last acknowledged offset.
   size_t repl_offs_ = 0, ack_offs_ = 0;
   uint64_t last_io_time_ = 0;  // in ns, monotonic clock.
+
+  // Dfly flow mode: the LSN of the last journal entry received in stable sync.
+  std::optional<LSN> journal_lsn_;
+  bool partial_ = false;  // Whether the master accepted to resume after journal_lsn_.
+  std::string eof_token_;
+  std::atomic_bool load_failed_{false};  // Set if the full sync stream broke.
+
+  // Set by SetBootstrapOffsets until the first sync uses them.
+  std::string bootstrap_master_id_;
+  std::vector<LSN> bootstrap_lsns_;
+
   unsigned state_mask_ = 0;
   unsigned num_df_flows_ = 0;
 
@@ -0,0 +1,762 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/s3_storage.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/escaping.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <netdb.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "server/error.h"
+#include "util/fiber_socket_base.h"
+#include "util/proactor_base.h"
+
+#ifdef DFLY_USE_SSL
+#include <openssl/ssl.h>
+
+#include "util/tls/tls_socket.h"
+#endif
+
+ABSL_FLAG(std::string, s3_endpoint, "",
+          "host[:port] of the S3 compatible storage behind s3:// paths. Defaults to the AWS "
+          "endpoint of s3_region. Use storage.googleapis.com for GCS with HMAC keys");
+ABSL_FLAG(std::string, s3_region, "", "Region of s3:// buckets. Defaults to $AWS_REGION");
+ABSL_FLAG(bool, s3_use_https, true, "If false, object storage is accessed with plain HTTP");
+ABSL_FLAG(uint32_t, s3_part_size_mb, 16, "Part size of snapshot uploads, 5MB at least");
+ABSL_FLAG(uint32_t, s3_upload_concurrency, 2,
+          "Number of parts uploaded in parallel per snapshot file. Together with s3_part_size_mb "
+          "it bounds the memory of an upload");
+ABSL_FLAG(uint32_t, s3_download_concurrency, 4,
+          "Number of ranges of a snapshot file that are downloaded in parallel when loading");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using absl::StrAppend;
+using absl::StrCat;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr string_view kS3Prefix = "s3://";
+constexpr size_t kMaxHeaderSize = 64 * 1024;
+constexpr size_t kDownloadRangeSize = 8 * 1024 * 1024;
+
+struct HttpRequest {
+  string_view method;
+  string_view bucket;
+  string_view key;
+
+  // Not encoded, must be sorted by name.
+  vector<pair<string, string>> query;
+  string_view body;
+
+  // Headers that are not signed.
+  vector<pair<string, string>> headers;
+};
+
+struct HttpResponse {
+  unsigned status = 0;
+  vector<pair<string, string>> headers;  // names are lower case.
+  string body;
+
+  string_view Header(string_view name) const {
+    for (const auto& [k, v] : headers) {
+      if (k == name)
+        return v;
+    }
+    return string_view{};
+  }
+};
+
+string GetEnv(const char* name) {
+  const char* val = getenv(name);
+  return val ? val : "";
+}
+
+string Region() {
+  string region = GetFlag(FLAGS_s3_region);
+  if (region.empty())
+    region = GetEnv("AWS_REGION");
+  if (region.empty())
+    region = GetEnv("AWS_DEFAULT_REGION");
+  return region.empty() ? "us-east-1" : region;
+}
+
+string Endpoint(string_view region) {
+  string endpoint = GetFlag(FLAGS_s3_endpoint);
+  return endpoint.empty() ? StrCat("s3.", region, ".amazonaws.com") : endpoint;
+}
+
+string ToHex(string_view data) {
+  return absl::BytesToHexString(data);
+}
+
+string Sha256(string_view data) {
+  uint8_t md[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), md);
+  return string(reinterpret_cast<const char*>(md), sizeof(md));
+}
+
+string HmacSha256(string_view key, string_view data) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned len = 0;
+  HMAC(EVP_sha256(), key.data(), key.size(), reinterpret_cast<const uint8_t*>(data.data()),
+       data.size(), md, &len);
+  return string(reinterpret_cast<const char*>(md), len);
+}
+
+// Percent encoding of SigV4, slashes are kept in object keys.
+string UriEncode(string_view src, bool keep_slash) {
+  constexpr char kHex[] = "0123456789ABCDEF";
+  string res;
+  res.reserve(src.size());
+  for (char c : src) {
+    if (absl::ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        (keep_slash && c == '/')) {
+      res.push_back(c);
+    } else {
+      res.push_back('%');
+      res.push_back(kHex[uint8_t(c) >> 4]);
+      res.push_back(kHex[uint8_t(c) & 0xF]);
+    }
+  }
+  return res;
+}
+
+string XmlUnescape(string_view src) {
+  string res;
+  while (!src.empty()) {
+    size_t pos = src.find('&');
+    res.append(src.substr(0, pos));
+    if (pos == string_view::npos)
+      break;
+
+    src.remove_prefix(pos);
+    constexpr pair<string_view, char> kEntities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+    bool found = false;
+    for (const auto& [entity, c] : kEntities) {
+      if (absl::StartsWith(src, entity)) {
+        res.push_back(c);
+        src.remove_prefix(entity.size());
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      res.push_back('&');
+      src.remove_prefix(1);
+    }
+  }
+  return res;
+}
+
+// Returns the text of the next element tag in xml starting at *pos and advances *pos past it.
+// Returns false if there is none.
+bool NextXmlValue(string_view xml, string_view tag, size_t* pos, string* dest) {
+  string open = StrCat("<", tag, ">"), close = StrCat("</", tag, ">");
+  size_t start = xml.find(open, *pos);
+  if (start == string_view::npos)
+    return false;
+  start += open.size();
+
+  size_t end = xml.find(close, start);
+  if (end == string_view::npos)
+    return false;
+
+  *dest = XmlUnescape(xml.substr(start, end - start));
+  *pos = end + close.size();
+  return true;
+}
+
+io::Result<boost::asio::ip::address> ResolveHost(const string& host) {
+  addrinfo hints, *servinfo = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  int res = getaddrinfo(host.c_str(), nullptr, &hints, &servinfo);
+  if (res != 0 || !servinfo) {
+    LOG(ERROR) << "Dns error " << gai_strerror(res) << ", host: " << host;
+    return make_unexpected(make_error_code(errc::host_unreachable));
+  }
+
+  auto* ipv4 = reinterpret_cast<sockaddr_in*>(servinfo->ai_addr);
+  boost::asio::ip::address_v4 addr(ntohl(ipv4->sin_addr.s_addr));
+  freeaddrinfo(servinfo);
+
+  return boost::asio::ip::address{addr};
+}
+
+#ifdef DFLY_USE_SSL
+SSL_CTX* ClientTlsContext() {
+  static SSL_CTX* ctx = [] {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    CHECK_EQ(1, SSL_CTX_set_default_verify_paths(ctx));
+    return ctx;
+  }();
+  return ctx;
+}
+#endif
+
+// An HTTP/1.1 connection that serves a single request.
+class HttpConnection {
+ public:
+  ~HttpConnection() {
+    if (sock_)
+      sock_->Close();
+  }
+
+  error_code Connect(string_view endpoint);
+  error_code Send(string_view head, string_view body);
+  error_code ReadResponse(HttpResponse* resp);
+
+ private:
+  // Appends the next received bytes to buf_. Sets *eof instead of failing if the peer closed.
+  error_code Recv(bool* eof);
+  error_code ReadChunkedBody(string* body);
+
+  unique_ptr<FiberSocketBase> sock_;
+#ifdef DFLY_USE_SSL
+  unique_ptr<tls::TlsSocket> tls_sock_;
+#endif
+  FiberSocketBase* peer_ = nullptr;
+  string buf_;
+};
+
+error_code HttpConnection::Connect(string_view endpoint) {
+  bool https = GetFlag(FLAGS_s3_use_https);
+  string host{endpoint};
+  uint16_t port = https ? 443 : 80;
+
+  if (size_t pos = endpoint.rfind(':'); pos != string_view::npos) {
+    if (!absl::SimpleAtoi(endpoint.substr(pos + 1), &port))
+      return make_error_code(errc::invalid_argument);
+    host.resize(pos);
+  }
+
+  io::Result<boost::asio::ip::address> addr = ResolveHost(host);
+  if (!addr)
+    return addr.error();
+
+  sock_.reset(ProactorBase::me()->CreateSocket());
+  FiberSocketBase::endpoint_type ep{*addr, port};
+
+#ifdef DFLY_USE_SSL
+  if (https) {
+    tls_sock_.reset(new tls::TlsSocket(sock_.get()));
+    tls_sock_->InitSSL(ClientTlsContext());
+    peer_ = tls_sock_.get();
+    return tls_sock_->Connect(ep);
+  }
+#else
+  if (https) {
+    LOG(ERROR) << "Built without TLS support, use --s3_use_https=false";
+    return make_error_code(errc::protocol_not_supported);
+  }
+#endif
+
+  peer_ = sock_.get();
+  return sock_->Connect(ep);
+}
+
+error_code HttpConnection::Send(string_view head, string_view body) {
+  iovec v[2] = {{const_cast<char*>(head.data()), head.size()},
+                {const_cast<char*>(body.data()), body.size()}};
+  return peer_->Write(v, body.empty() ? 1 : 2);
+}
+
+error_code HttpConnection::Recv(bool* eof) {
+  constexpr size_t kChunk = 16 * 1024;
+  size_t prev = buf_.size();
+  buf_.resize(prev + kChunk);
+
+  io::Result<size_t> res = peer_->Recv(io::MutableBytes{
+      reinterpret_cast<uint8_t*>(buf_.data() + prev), kChunk});
+  if (!res) {
+    buf_.resize(prev);
+    return res.error();
+  }
+
+  buf_.resize(prev + *res);
+  if (*res == 0) {
+    if (!eof)
+      return make_error_code(errc::connection_aborted);
+    *eof = true;
+  }
+  return error_code{};
+}
+
+error_code HttpConnection::ReadResponse(HttpResponse* resp) {
+  size_t hdr_end;
+  while ((hdr_end = buf_.find("\r\n\r\n")) == string::npos) {
+    if (buf_.size() > kMaxHeaderSize)
+      return make_error_code(errc::bad_message);
+    RETURN_ON_ERR(Recv(nullptr));
+  }
+
+  string_view head{buf_.data(), hdr_end};
+  size_t line_end = head.find("\r\n");
+  string_view status_line = head.substr(0, line_end);
+
+  // HTTP/1.1 200 OK
+  vector<string_view> parts = absl::StrSplit(status_line, absl::MaxSplits(' ', 2));
+  if (parts.size() < 2 || !absl::SimpleAtoi(parts[1], &resp->status))
+    return make_error_code(errc::bad_message);
+
+  while (line_end != string_view::npos) {
+    head.remove_prefix(line_end + 2);
+    line_end = head.find("\r\n");
+    string_view line = head.substr(0, line_end);
+    size_t colon = line.find(':');
+    if (colon == string_view::npos)
+      continue;
+
+    string name = absl::AsciiStrToLower(line.substr(0, colon));
+    resp->headers.emplace_back(std::move(name), absl::StripAsciiWhitespace(line.substr(colon + 1)));
+  }
+
+  buf_.erase(0, hdr_end + 4);
+  string_view len_hdr = resp->Header("content-length");
+
+  if (size_t len = 0; !len_hdr.empty()) {
+    if (!absl::SimpleAtoi(len_hdr, &len))
+      return make_error_code(errc::bad_message);
+    while (buf_.size() < len) {
+      RETURN_ON_ERR(Recv(nullptr));
+    }
+    buf_.resize(len);
+    resp->body = std::move(buf_);
+  } else if (absl::EqualsIgnoreCase(resp->Header("transfer-encoding"), "chunked")) {
+    RETURN_ON_ERR(ReadChunkedBody(&resp->body));
+  } else {
+    bool eof = false;
+    while (!eof) {
+      RETURN_ON_ERR(Recv(&eof));
+    }
+    resp->body = std::move(buf_);
+  }
+
+  buf_.clear();
+  return error_code{};
+}
+
+error_code HttpConnection::ReadChunkedBody(string* body) {
+  while (true) {
+    size_t line_end;
+    while ((line_end = buf_.find("\r\n")) == string::npos) {
+      RETURN_ON_ERR(Recv(nullptr));
+    }
+
+    // Chunk extensions follow a semicolon.
+    string_view size_str = string_view{buf_}.substr(0, min(line_end, buf_.find(';')));
+    size_t chunk_size = 0;
+    if (!absl::SimpleHexAtoi(absl::StripAsciiWhitespace(size_str), &chunk_size))
+      return make_error_code(errc::bad_message);
+
+    while (buf_.size() < line_end + 2 + chunk_size + 2) {
+      RETURN_ON_ERR(Recv(nullptr));
+    }
+
+    body->append(buf_, line_end + 2, chunk_size);
+    buf_.erase(0, line_end + 2 + chunk_size + 2);
+    if (chunk_size == 0)  // Trailers are not supported, S3 does not send them.
+      return error_code{};
+  }
+}
+
+// Signs req with AWS signature version 4 and sends it.
+error_code SendRequest(const HttpRequest& req, HttpResponse* resp) {
+  string access_key = GetEnv("AWS_ACCESS_KEY_ID"), secret_key = GetEnv("AWS_SECRET_ACCESS_KEY");
+  string token = GetEnv("AWS_SESSION_TOKEN");
+  if (access_key.empty() || secret_key.empty()) {
+    LOG(ERROR) << "AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set for s3:// paths";
+    return make_error_code(errc::permission_denied);
+  }
+
+  string region = Region();
+  string endpoint = Endpoint(region);
+
+  string amz_date = absl::FormatTime("%Y%m%dT%H%M%SZ", absl::Now(), absl::UTCTimeZone());
+  string_view date = string_view{amz_date}.substr(0, 8);
+  string payload_hash = ToHex(Sha256(req.body));
+
+  // Path style addressing works with all the S3 compatible storages.
+  string uri = StrCat("/", UriEncode(req.bucket, false));
+  if (!req.key.empty())
+    StrAppend(&uri, "/", UriEncode(req.key, true));
+
+  string query;
+  for (const auto& [name, val] : req.query) {
+    StrAppend(&query, query.empty() ? "" : "&", UriEncode(name, false), "=", UriEncode(val, false));
+  }
+
+  string headers = StrCat("host:", endpoint, "\nx-amz-content-sha256:", payload_hash,
+                          "\nx-amz-date:", amz_date, "\n");
+  string signed_headers = "host;x-amz-content-sha256;x-amz-date";
+  if (!token.empty()) {
+    StrAppend(&headers, "x-amz-security-token:", token, "\n");
+    StrAppend(&signed_headers, ";x-amz-security-token");
+  }
+
+  string canonical = StrCat(req.method, "\n", uri, "\n", query, "\n", headers, "\n",
+                            signed_headers, "\n", payload_hash);
+  string scope = StrCat(date, "/", region, "/s3/aws4_request");
+  string to_sign = StrCat("AWS4-HMAC-SHA256\n", amz_date, "\n", scope, "\n", ToHex(Sha256(canonical)));
+
+  string key = HmacSha256(StrCat("AWS4", secret_key), date);
+  key = HmacSha256(key, region);
+  key = HmacSha256(key, "s3");
+  key = HmacSha256(key, "aws4_request");
+  string signature = ToHex(HmacSha256(key, to_sign));
+
+  string head = StrCat(req.method, " ", uri, query.empty() ? "" : "?", query, " HTTP/1.1\r\n");
+  StrAppend(&head, "Host: ", endpoint, "\r\nx-amz-date: ", amz_date,
+            "\r\nx-amz-content-sha256: ", payload_hash, "\r\n");
+  if (!token.empty())
+    StrAppend(&head, "x-amz-security-token: ", token, "\r\n");
+  StrAppend(&head, "Authorization: AWS4-HMAC-SHA256 Credential=", access_key, "/", scope,
+            ", SignedHeaders=", signed_headers, ", Signature=", signature, "\r\n");
+  for (const auto& [name, val] : req.headers) {
+    StrAppend(&head, name, ": ", val, "\r\n");
+  }
+  StrAppend(&head, "Content-Length: ", req.body.size(), "\r\nConnection: close\r\n\r\n");
+
+  HttpConnection conn;
+  RETURN_ON_ERR(conn.Connect(endpoint));
+  RETURN_ON_ERR(conn.Send(head, req.body));
+  return conn.ReadResponse(resp);
+}
+
+error_code CheckStatus(const HttpResponse& resp, string_view op) {
+  if (resp.status / 100 == 2)
+    return error_code{};
+
+  LOG(ERROR) << "S3 " << op << " failed with status " << resp.status << ": "
+             << string_view{resp.body}.substr(0, 512);
+  switch (resp.status) {
+    case 403:
+      return make_error_code(errc::permission_denied);
+    case 404:
+      return make_error_code(errc::no_such_file_or_directory);
+    default:
+      return make_error_code(errc::io_error);
+  }
+}
+
+// Sends req and checks that it succeeded.
+error_code Call(const HttpRequest& req, string_view op, HttpResponse* resp) {
+  if (error_code ec = SendRequest(req, resp); ec) {
+    LOG(ERROR) << "S3 " << op << " failed: " << ec.message();
+    return ec;
+  }
+  return CheckStatus(*resp, op);
+}
+
+}  // namespace
+
+bool IsS3Path(string_view path) {
+  return absl::StartsWith(path, kS3Prefix);
+}
+
+bool ParseS3Path(string_view path, string* bucket, string* key) {
+  if (!absl::ConsumePrefix(&path, kS3Prefix))
+    return false;
+
+  size_t pos = path.find('/');
+  if (pos == 0 || pos == string_view::npos)
+    return false;
+
+  *bucket = path.substr(0, pos);
+  *key = path.substr(pos + 1);
+  return true;
+}
+
+io::Result<vector<string>> ListS3Objects(string_view prefix_path) {
+  string bucket, prefix;
+  if (!ParseS3Path(prefix_path, &bucket, &prefix))
+    return make_unexpected(make_error_code(errc::invalid_argument));
+
+  vector<string> res;
+  string token;
+  do {
+    HttpRequest req{.method = "GET", .bucket = bucket};
+    if (!token.empty())
+      req.query.emplace_back("continuation-token", token);
+    req.query.emplace_back("list-type", "2");
+    req.query.emplace_back("prefix", prefix);
+
+    HttpResponse resp;
+    if (error_code ec = Call(req, "list", &resp); ec)
+      return make_unexpected(ec);
+
+    string key;
+    for (size_t pos = 0; NextXmlValue(resp.body, "Key", &pos, &key);) {
+      res.push_back(StrCat(kS3Prefix, bucket, "/", key));
+    }
+
+    size_t pos = 0;
+    string truncated;
+    token.clear();
+    if (NextXmlValue(resp.body, "IsTruncated", &pos, &truncated) && truncated == "true") {
+      pos = 0;
+      if (!NextXmlValue(resp.body, "NextContinuationToken", &pos, &token))
+        return make_unexpected(make_error_code(errc::bad_message));
+    }
+  } while (!token.empty());
+
+  sort(res.begin(), res.end());
+  return res;
+}
+
+S3WriteFile::S3WriteFile(string bucket, string key, string upload_id)
+    : bucket_(std::move(bucket)), key_(std::move(key)), upload_id_(std::move(upload_id)) {
+  part_size_ = size_t(max(GetFlag(FLAGS_s3_part_size_mb), 5u)) << 20;
+  concurrency_ = max(GetFlag(FLAGS_s3_upload_concurrency), 1u);
+  buf_.reserve(part_size_);
+}
+
+S3WriteFile::~S3WriteFile() {
+  if (!closed_) {
+    JoinParts(0);
+    Abort();
+  }
+}
+
+io::Result<S3WriteFile*> S3WriteFile::Open(string_view path) {
+  string bucket, key;
+  if (!ParseS3Path(path, &bucket, &key) || key.empty())
+    return make_unexpected(make_error_code(errc::invalid_argument));
+
+  HttpRequest req{.method = "POST", .bucket = bucket, .key = key, .query = {{"uploads", ""}}};
+  HttpResponse resp;
+  if (error_code ec = Call(req, "create multipart upload", &resp); ec)
+    return make_unexpected(ec);
+
+  string upload_id;
+  size_t pos = 0;
+  if (!NextXmlValue(resp.body, "UploadId", &pos, &upload_id))
+    return make_unexpected(make_error_code(errc::bad_message));
+
+  VLOG(1) << "Started the upload of " << path << ", id " << upload_id;
+  return new S3WriteFile(std::move(bucket), std::move(key), std::move(upload_id));
+}
+
+io::Result<size_t> S3WriteFile::WriteSome(const iovec* v, uint32_t len) {
+  if (ec_)
+    return make_unexpected(ec_);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    string_view src{reinterpret_cast<const char*>(v[i].iov_base), v[i].iov_len};
+    while (!src.empty()) {
+      size_t n = min(src.size(), part_size_ - buf_.size());
+      buf_.append(src.substr(0, n));
+      src.remove_prefix(n);
+      total += n;
+
+      if (buf_.size() == part_size_)
+        FlushPart();
+    }
+  }
+
+  // A failed upload stops the saver as if the disk failed.
+  if (ec_)
+    return make_unexpected(ec_);
+  return total;
+}
+
+void S3WriteFile::FlushPart() {
+  auto part = make_unique<Part>();
+  Part* p = part.get();
+  unsigned part_num = parts_.size() + 1;
+
+  p->data = std::move(buf_);
+  buf_.clear();
+  buf_.reserve(part_size_);
+
+  p->fb = ::boost::fibers::fiber([this, p, part_num] {
+    HttpRequest req{.method = "PUT", .bucket = bucket_, .key = key_, .body = p->data};
+    req.query = {{"partNumber", absl::StrCat(part_num)}, {"uploadId", upload_id_}};
+
+    HttpResponse resp;
+    p->ec = Call(req, "upload part", &resp);
+    if (!p->ec) {
+      p->etag = resp.Header("etag");
+      if (p->etag.empty())
+        p->ec = make_error_code(errc::bad_message);
+    }
+    p->data = string{};
+  });
+  parts_.push_back(std::move(part));
+
+  JoinParts(concurrency_);
+}
+
+void S3WriteFile::JoinParts(size_t max_in_flight) {
+  while (parts_.size() - joined_ > max_in_flight) {
+    Part& part = *parts_[joined_++];
+    part.fb.join();
+    if (part.ec && !ec_)
+      ec_ = part.ec;
+  }
+}
+
+error_code S3WriteFile::Close() {
+  // S3 accepts a single empty part, so empty files are uploaded as well.
+  if (!buf_.empty() || parts_.empty())
+    FlushPart();
+  JoinParts(0);
+  closed_ = true;
+
+  if (!ec_)
+    ec_ = Complete();
+  if (ec_)
+    Abort();
+
+  return ec_;
+}
+
+error_code S3WriteFile::Complete() {
+  string body = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < parts_.size(); ++i) {
+    StrAppend(&body, "<Part><PartNumber>", i + 1, "</PartNumber><ETag>", parts_[i]->etag,
+              "</ETag></Part>");
+  }
+  StrAppend(&body, "</CompleteMultipartUpload>");
+
+  HttpRequest req{.method = "POST", .bucket = bucket_, .key = key_,
+                  .query = {{"uploadId", upload_id_}}, .body = body};
+  HttpResponse resp;
+  RETURN_ON_ERR(Call(req, "complete multipart upload", &resp));
+
+  // Completion may fail after the response status has been sent.
+  if (absl::StrContains(resp.body, "<Error>")) {
+    LOG(ERROR) << "S3 complete multipart upload failed: " << resp.body;
+    return make_error_code(errc::io_error);
+  }
+  return error_code{};
+}
+
+void S3WriteFile::Abort() {
+  HttpRequest req{
+      .method = "DELETE", .bucket = bucket_, .key = key_, .query = {{"uploadId", upload_id_}}};
+  HttpResponse resp;
+  if (!Call(req, "abort multipart upload", &resp))
+    VLOG(1) << "Aborted the upload of " << key_;
+}
+
+S3ReadFile::S3ReadFile(string bucket, string key, size_t size)
+    : bucket_(std::move(bucket)), key_(std::move(key)), size_(size) {
+}
+
+S3ReadFile::~S3ReadFile() {
+  for (auto& range : ranges_) {
+    if (range->fb.joinable())
+      range->fb.join();
+  }
+}
+
+io::Result<S3ReadFile*> S3ReadFile::Open(string_view path) {
+  string bucket, key;
+  if (!ParseS3Path(path, &bucket, &key) || key.empty())
+    return make_unexpected(make_error_code(errc::invalid_argument));
+
+  // HEAD responses carry a content length without the body, so the size is taken from the
+  // Content-Range of a one byte request instead.
+  HttpRequest req{.method = "GET", .bucket = bucket, .key = key};
+  req.headers.emplace_back("Range", "bytes=0-0");
+
+  HttpResponse resp;
+  error_code ec = SendRequest(req, &resp);
+  if (ec)
+    return make_unexpected(ec);
+
+  // Empty objects do not satisfy any range.
+  size_t size = 0;
+  if (resp.status != 416) {
+    if (ec = CheckStatus(resp, "get"); ec)
+      return make_unexpected(ec);
+
+    // Content-Range: bytes 0-0/<size>
+    string_view range = resp.Header("content-range");
+    size_t pos = range.rfind('/');
+    if (pos == string_view::npos || !absl::SimpleAtoi(range.substr(pos + 1), &size))
+      return make_unexpected(make_error_code(errc::bad_message));
+  }
+
+  return new S3ReadFile(std::move(bucket), std::move(key), size);
+}
+
+void S3ReadFile::Prefetch() {
+  size_t concurrency = max(GetFlag(FLAGS_s3_download_concurrency), 1u);
+
+  while (ranges_.size() < concurrency && next_offset_ < size_) {
+    size_t start = next_offset_, end = min(size_, start + kDownloadRangeSize);
+    next_offset_ = end;
+
+    auto range = make_unique<Range>();
+    Range* r = range.get();
+    r->fb = ::boost::fibers::fiber([this, r, start, end] {
+      HttpRequest req{.method = "GET", .bucket = bucket_, .key = key_};
+      req.headers.emplace_back("Range", StrCat("bytes=", start, "-", end - 1));
+
+      HttpResponse resp;
+      r->ec = Call(req, "get", &resp);
+      if (!r->ec && resp.body.size() != end - start) {
+        LOG(ERROR) << "S3 get returned " << resp.body.size() << " bytes instead of " << end - start;
+        r->ec = make_error_code(errc::bad_message);
+      }
+      r->data = std::move(resp.body);
+    });
+    ranges_.push_back(std::move(range));
+  }
+}
+
+io::Result<size_t> S3ReadFile::ReadSome(const iovec* v, uint32_t len) {
+  Prefetch();
+  if (ranges_.empty())
+    return 0;
+
+  Range& range = *ranges_.front();
+  if (range.fb.joinable())
+    range.fb.join();
+  if (range.ec)
+    return make_unexpected(range.ec);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len && range.consumed < range.data.size(); ++i) {
+    size_t n = min(v[i].iov_len, range.data.size() - range.consumed);
+    memcpy(v[i].iov_base, range.data.data() + range.consumed, n);
+    range.consumed += n;
+    total += n;
+  }
+
+  if (range.consumed == range.data.size()) {
+    ranges_.pop_front();
+    Prefetch();
+  }
+  return total;
+}
+
+}  // namespace dfly
@@ -0,0 +1,104 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <boost/fiber/fiber.hpp>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "io/io.h"
+
+namespace dfly {
+
+// Snapshots are saved to and loaded from S3 compatible object storage when --dir has the form
+// s3://bucket/prefix. Credentials are taken from AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and
+// optionally AWS_SESSION_TOKEN. GCS is reachable through its XML API with HMAC keys,
+// see s3_endpoint. All the functions must run in a proactor thread.
+
+bool IsS3Path(std::string_view path);
+
+// Splits s3://bucket/key into its parts. Returns false if path is malformed.
+bool ParseS3Path(std::string_view path, std::string* bucket, std::string* key);
+
+// Returns the paths of the objects whose keys start with the key of prefix_path, sorted.
+io::Result<std::vector<std::string>> ListS3Objects(std::string_view prefix_path);
+
+// Streams a file to object storage with a multipart upload. At most s3_upload_concurrency parts
+// are in flight while the next one is filled, so the memory does not depend on the file size.
+// The object becomes visible only once Close() succeeds.
+class S3WriteFile : public ::io::Sink {
+ public:
+  static io::Result<S3WriteFile*> Open(std::string_view path);
+
+  ~S3WriteFile();
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // Uploads the last part and completes the upload. Aborts the upload on failure.
+  std::error_code Close();
+
+ private:
+  struct Part {
+    std::string data;
+    std::string etag;
+    std::error_code ec;
+    ::boost::fibers::fiber fb;
+  };
+
+  S3WriteFile(std::string bucket, std::string key, std::string upload_id);
+
+  // Uploads buf_ as the next part in the background. Blocks while too many parts are in flight.
+  void FlushPart();
+
+  // Waits until at most max_in_flight parts are being uploaded.
+  void JoinParts(size_t max_in_flight);
+
+  std::error_code Complete();
+  void Abort();
+
+  std::string bucket_, key_, upload_id_;
+  std::string buf_;
+  size_t part_size_;
+  size_t concurrency_;
+
+  std::vector<std::unique_ptr<Part>> parts_;
+  size_t joined_ = 0;  // parts_ before joined_ finished uploading.
+  std::error_code ec_;
+  bool closed_ = false;
+};
+
+// Reads an object with ranged GET requests, keeping up to s3_download_concurrency ranges
+// in flight ahead of the reader.
+class S3ReadFile : public ::io::Source {
+ public:
+  static io::Result<S3ReadFile*> Open(std::string_view path);
+
+  ~S3ReadFile();
+
+  io::Result<size_t> ReadSome(const iovec* v, uint32_t len) final;
+
+ private:
+  struct Range {
+    std::string data;
+    size_t consumed = 0;
+    std::error_code ec;
+    ::boost::fibers::fiber fb;
+  };
+
+  S3ReadFile(std::string bucket, std::string key, size_t size);
+
+  // Starts fetching ranges until s3_download_concurrency of them are queued.
+  void Prefetch();
+
+  std::string bucket_, key_;
+  size_t size_;
+  size_t next_offset_ = 0;
+  std::deque<std::unique_ptr<Range>> ranges_;
+};
+
+}  // namespace dfly
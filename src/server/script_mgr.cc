@@ -4,11 +4,16 @@
 
 #include "server/script_mgr.h"
 
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
 
 #include "base/logging.h"
 #include "core/interpreter.h"
 #include "facade/error.h"
+#include "server/engine_shard_set.h"
 #include "server/server_state.h"
 
 namespace dfly {
@@ -60,10 +65,18 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
       return (*cntx)->SendBulkString(sha);
     }
 
-    Interpreter& interpreter = ServerState::tlocal()->GetInterpreter();
-    // no need to lock the interpreter since we do not mess the stack.
-    string error_or_id;
-    Interpreter::AddResult add_result = interpreter.AddFunction(body, &error_or_id);
+    ScriptParams params;
+    string error;
+    if (!ParseParams(body, &params, &error)) {
+      return (*cntx)->SendError(error);
+    }
+
+    InterpreterManager& mgr = ServerState::tlocal()->GetInterpreterManager();
+    Interpreter* interpreter = mgr.Get();
+    string error_or_id, bytecode;
+    Interpreter::AddResult add_result = interpreter->AddFunction(body, &error_or_id, &bytecode);
+    mgr.Return(interpreter);
+
     if (add_result == Interpreter::ALREADY_EXISTS) {
       return (*cntx)->SendBulkString(error_or_id);
     }
@@ -71,7 +84,7 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
       return (*cntx)->SendError(error_or_id);
     }
 
-    InsertFunction(error_or_id, body);
+    InsertFunction(error_or_id, body, std::move(bytecode));
 
     return (*cntx)->SendBulkString(error_or_id);
   }
@@ -81,19 +94,78 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
   cntx->reply_builder()->SendError(err, kSyntaxErrType);
 }
 
-bool ScriptMgr::InsertFunction(std::string_view id, std::string_view body) {
+bool ScriptMgr::InsertFunction(std::string_view id, std::string_view body, std::string bytecode) {
   ScriptKey key;
   CHECK_EQ(key.size(), id.size());
   memcpy(key.data(), id.data(), key.size());
 
-  lock_guard lk(mu_);
-  auto [it, inserted] = db_.emplace(key, nullptr);
-  if (inserted) {
-    it->second.reset(new char[body.size() + 1]);
-    memcpy(it->second.get(), body.data(), body.size());
-    it->second[body.size()] = '\0';
+  ScriptParams params;
+  string error;
+  if (!ParseParams(body, &params, &error)) {
+    // Scripts loaded from a snapshot are inserted without validation.
+    LOG(WARNING) << "Ignoring the shebang of script " << id << ": " << error;
+    params = ScriptParams{};
+  }
+
+  auto shared_bytecode = make_shared<const string>(std::move(bytecode));
+  {
+    lock_guard lk(mu_);
+    auto [it, inserted] = db_.try_emplace(key);
+    if (!inserted)
+      return false;
+
+    it->second.params = std::move(params);
+    it->second.body.reset(new char[body.size() + 1]);
+    memcpy(it->second.body.get(), body.data(), body.size());
+    it->second.body[body.size()] = '\0';
+    it->second.bytecode = shared_bytecode;
   }
-  return inserted;
+
+  // The interpreters that are busy now will load the script when they first run it.
+  if (shard_set && !shared_bytecode->empty()) {
+    shard_set->pool()->DispatchBrief([shared_bytecode](unsigned, util::ProactorBase*) {
+      string error;
+      ServerState::tlocal()->GetInterpreterManager().ForEachAvailable([&](Interpreter* ir) {
+        if (!ir->AddBytecode(*shared_bytecode, &error))
+          LOG(DFATAL) << "Could not load script bytecode: " << error;
+      });
+    });
+  }
+  return true;
+}
+
+bool ScriptMgr::AddToInterpreter(std::string_view sha, Interpreter* interpreter) const {
+  if (interpreter->Exists(sha))
+    return true;
+
+  if (sha.size() != 40)
+    return false;
+
+  ScriptKey key;
+  memcpy(key.data(), sha.data(), key.size());
+
+  shared_ptr<const string> bytecode;
+  string body;
+  {
+    lock_guard lk(mu_);
+    auto it = db_.find(key);
+    if (it == db_.end())
+      return false;
+
+    bytecode = it->second.bytecode;
+    body = it->second.body.get();
+  }
+
+  if (bytecode && !bytecode->empty()) {
+    string error;
+    if (interpreter->AddBytecode(*bytecode, &error))
+      return true;
+    LOG(DFATAL) << "Could not load script bytecode: " << error;
+  }
+
+  string res;
+  CHECK_EQ(Interpreter::ADD_OK, interpreter->AddFunction(body, &res));
+  return true;
 }
 
 const char* ScriptMgr::Find(std::string_view sha) const {
@@ -108,7 +180,22 @@ const char* ScriptMgr::Find(std::string_view sha) const {
   if (it == db_.end())
     return nullptr;
 
-  return it->second.get();
+  return it->second.body.get();
+}
+
+auto ScriptMgr::GetParams(std::string_view sha) const -> optional<ScriptParams> {
+  if (sha.size() != 40)
+    return nullopt;
+
+  ScriptKey key;
+  memcpy(key.data(), sha.data(), key.size());
+
+  lock_guard lk(mu_);
+  auto it = db_.find(key);
+  if (it == db_.end())
+    return nullopt;
+
+  return it->second.params;
 }
 
 vector<string> ScriptMgr::GetLuaScripts() const {
@@ -117,10 +204,65 @@ vector<string> ScriptMgr::GetLuaScripts() const {
   lock_guard lk(mu_);
   res.reserve(db_.size());
   for (const auto& k_v : db_) {
-    res.emplace_back(k_v.second.get());
+    res.emplace_back(k_v.second.body.get());
   }
 
   return res;
 }
 
+bool ScriptMgr::ParseParams(string_view body, ScriptParams* params, string* error) {
+  // Redis 7 style shebang: "#!lua flags=no-writes,allow-oom".
+  if (absl::StartsWith(body, "#!")) {
+    string_view line = body.substr(0, body.find('\n'));
+    vector<string_view> parts = absl::StrSplit(line.substr(2), ' ', absl::SkipEmpty());
+    if (parts.empty() || parts[0] != "lua") {
+      *error = "Unexpected engine in script shebang";
+      return false;
+    }
+
+    for (size_t i = 1; i < parts.size(); ++i) {
+      string_view flags = parts[i];
+      if (!absl::ConsumePrefix(&flags, "flags=")) {
+        *error = absl::StrCat("Unknown lua shebang option: ", parts[i]);
+        return false;
+      }
+
+      for (string_view flag : absl::StrSplit(flags, ',', absl::SkipEmpty())) {
+        if (flag == "no-writes") {
+          params->no_writes = true;
+        } else if (flag != "allow-oom" && flag != "allow-stale" && flag != "no-cluster" &&
+                   flag != "allow-cross-slot-keys") {
+          *error = absl::StrCat("Unexpected flag in script shebang: ", flag);
+          return false;
+        }
+      }
+    }
+  }
+
+  // Collect the command names of "redis.call('name', ..." like invocations.
+  for (string_view prefix : {"redis.call", "redis.pcall"}) {
+    for (size_t pos = body.find(prefix); pos != string_view::npos;
+         pos = body.find(prefix, pos + 1)) {
+      string_view rest = absl::StripLeadingAsciiWhitespace(body.substr(pos + prefix.size()));
+      if (!absl::ConsumePrefix(&rest, "(")) {
+        // For example "local call = redis.call", or redis.pcall_batch, whose commands are
+        // not literals.
+        params->literal_calls = false;
+        continue;
+      }
+
+      rest = absl::StripLeadingAsciiWhitespace(rest);
+      size_t end = rest.empty() ? string_view::npos : rest.find(rest[0], 1);
+      if (end == string_view::npos || (rest[0] != '\'' && rest[0] != '"')) {
+        params->literal_calls = false;  // redis.call(KEYS[1], ...) etc.
+        continue;
+      }
+
+      params->commands.push_back(absl::AsciiStrToUpper(rest.substr(1, end - 1)));
+    }
+  }
+
+  return true;
+}
+
 }  // namespace dfly
@@ -8,30 +8,64 @@
 
 #include <array>
 #include <boost/fiber/mutex.hpp>
+#include <memory>
+#include <optional>
 
 #include "server/conn_context.h"
 
 namespace dfly {
 
 class EngineShardSet;
+class Interpreter;
 
 // This class has a state through the lifetime of a server because it manipulates scripts
 class ScriptMgr {
  public:
+  // Properties of a script that are deduced from its body.
+  struct ScriptParams {
+    // Set by the no-writes flag of the "#!lua flags=..." shebang.
+    bool no_writes = false;
+
+    // False if some redis.call/redis.pcall invocation does not pass a literal command name.
+    bool literal_calls = true;
+
+    // Upper-cased command names passed to redis.call/redis.pcall.
+    std::vector<std::string> commands;
+  };
+
   ScriptMgr();
 
   void Run(CmdArgList args, ConnectionContext* cntx);
 
-  bool InsertFunction(std::string_view sha, std::string_view body);
+  // bytecode is the precompiled function produced by Interpreter::AddFunction. It is loaded
+  // into the idle interpreters of all the threads, so that they do not need to compile the
+  // script when they run it for the first time.
+  bool InsertFunction(std::string_view sha, std::string_view body, std::string bytecode);
+
+  // Adds the script sha to interpreter unless it's already there, preferably from the bytecode.
+  // Returns false if the script is not found.
+  bool AddToInterpreter(std::string_view sha, Interpreter* interpreter) const;
 
   // Returns body as null-terminated c-string. NULL if sha is not found.
   const char* Find(std::string_view sha) const;
 
+  std::optional<ScriptParams> GetParams(std::string_view sha) const;
+
   std::vector<std::string> GetLuaScripts() const;
 
+  // Returns false and sets error if body has an invalid shebang.
+  static bool ParseParams(std::string_view body, ScriptParams* params, std::string* error);
+
  private:
   using ScriptKey = std::array<char, 40>;
-  absl::flat_hash_map<ScriptKey, std::unique_ptr<char[]>> db_;  // protected by mu_
+
+  struct ScriptData {
+    ScriptParams params;
+    std::unique_ptr<char[]> body;
+    std::shared_ptr<const std::string> bytecode;
+  };
+
+  absl::flat_hash_map<ScriptKey, ScriptData> db_;  // protected by mu_
   mutable ::boost::fibers::mutex mu_;
 };
 
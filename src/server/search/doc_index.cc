@@ -0,0 +1,366 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/doc_index.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/object.h"
+}
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_join.h>
+
+#include <jsoncons/json.hpp>
+#include <jsoncons_ext/jsonpath/jsonpath.hpp>
+
+#include "base/logging.h"
+#include "core/string_map.h"
+#include "server/common.h"
+#include "server/engine_shard_set.h"
+
+namespace dfly {
+
+using namespace std;
+using search::DocFields;
+using search::DocId;
+using search::FieldSchema;
+
+using JsonExpression = jsoncons::jsonpath::jsonpath_expression<jsoncons::json>;
+
+namespace {
+
+string_view LpGetView(uint8_t* lp_it, uint8_t int_buf[]) {
+  int64_t ele_len = 0;
+  uint8_t* elem = lpGet(lp_it, &ele_len, int_buf);
+  DCHECK(elem);
+  return string_view{reinterpret_cast<char*>(elem), size_t(ele_len)};
+}
+
+// Calls cb(field, value) for every field of a hash.
+template <typename Cb> void IterateHash(const PrimeValue& pv, Cb&& cb) {
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    uint8_t field_buf[LP_INTBUF_SIZE], value_buf[LP_INTBUF_SIZE];
+    for (uint8_t* fptr = lpFirst(lp); fptr;) {
+      uint8_t* vptr = lpNext(lp, fptr);
+      cb(LpGetView(fptr, field_buf), LpGetView(vptr, value_buf));
+      fptr = lpNext(lp, vptr);
+    }
+    return;
+  }
+
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+  StringMap* sm = (StringMap*)pv.RObjPtr();
+  sm->set_time(MemberTimeSeconds(GetCurrentTimeMs()));
+  for (sds entry : *sm)
+    cb(string_view{entry, sdslen(entry)}, StringMap::GetValue(entry));
+}
+
+optional<jsoncons::json> ParseJson(string_view str) {
+  error_code ec;
+  jsoncons::json_decoder<jsoncons::json> decoder;
+  jsoncons::basic_json_parser<char> parser;
+
+  parser.update(str);
+  parser.finish_parse(decoder, ec);
+  if (ec || !decoder.is_valid())
+    return nullopt;
+  return decoder.get_result();
+}
+
+// The value of a json field as it is indexed: the strings are taken as is, the arrays of
+// strings, e.g. of a tag field, are joined and the arrays of numbers of a vector field are packed
+// as float32 numbers, like the vectors of the hashes.
+optional<string> JsonFieldValue(const jsoncons::json& value, FieldSchema::Type type) {
+  if (value.is_null())
+    return nullopt;
+  if (value.is_string())
+    return value.as_string();
+
+  if (type == FieldSchema::VECTOR) {
+    if (!value.is_array())
+      return nullopt;
+
+    string res;
+    res.reserve(value.size() * sizeof(float));
+    for (const auto& item : value.array_range()) {
+      if (!item.is_number())
+        return nullopt;
+      float num = item.as<float>();
+      res.append(reinterpret_cast<const char*>(&num), sizeof(num));
+    }
+    return res;
+  }
+
+  if (value.is_array() && type != FieldSchema::NUMERIC) {
+    vector<string> items;
+    for (const auto& item : value.array_range()) {
+      if (item.is_string())
+        items.push_back(item.as_string());
+    }
+    return absl::StrJoin(items, type == FieldSchema::TAG ? "," : " ");
+  }
+  return value.to_string();
+}
+
+}  // namespace
+
+bool DocIndex::Matches(string_view key) const {
+  if (prefixes.empty())
+    return true;
+
+  for (const string& prefix : prefixes) {
+    if (absl::StartsWith(key, prefix))
+      return true;
+  }
+  return false;
+}
+
+bool DocIndex::IsValidJsonPath(string_view path) {
+  error_code ec;
+  jsoncons::jsonpath::make_expression<jsoncons::json>(path, ec);
+  return !ec;
+}
+
+struct ShardDocIndex::JsonPaths {
+  vector<JsonExpression> fields;  // By the position of the field in the schema.
+
+  // The first value of field in doc, if any.
+  optional<jsoncons::json> GetJson(size_t field, jsoncons::json& doc) {
+    jsoncons::json res = fields[field].evaluate(doc);
+    if (!res.is_array() || res.empty())
+      return nullopt;
+    return res[0];
+  }
+
+  optional<string> Get(size_t field, FieldSchema::Type type, jsoncons::json& doc) {
+    optional<jsoncons::json> value = GetJson(field, doc);
+    return value ? JsonFieldValue(*value, type) : nullopt;
+  }
+};
+
+ShardDocIndex::ShardDocIndex(shared_ptr<const DocIndex> base)
+    : base_(std::move(base)), indices_(base_->schema) {
+  if (base_->type == DocIndex::JSON) {
+    json_paths_ = make_unique<JsonPaths>();
+    for (const FieldSchema& field : base_->schema.fields) {
+      error_code ec;
+      json_paths_->fields.push_back(
+          jsoncons::jsonpath::make_expression<jsoncons::json>(field.identifier, ec));
+      DCHECK(!ec) << field.identifier;
+    }
+  }
+}
+
+ShardDocIndex::~ShardDocIndex() {
+}
+
+bool ShardDocIndex::GetFields(const PrimeValue& pv, DocFields* fields) const {
+  const auto& schema = base_->schema;
+  fields->assign(schema.fields.size(), nullopt);
+
+  if (base_->type == DocIndex::HASH) {
+    if (pv.ObjType() != OBJ_HASH)
+      return false;
+
+    IterateHash(pv, [&](string_view field, string_view value) {
+      for (size_t i = 0; i < schema.fields.size(); ++i) {
+        if (schema.fields[i].identifier == field)
+          (*fields)[i] = string(value);
+      }
+    });
+    return true;
+  }
+
+  if (pv.ObjType() != OBJ_STRING)
+    return false;
+
+  string str;
+  pv.GetString(&str);
+  optional<jsoncons::json> doc = ParseJson(str);
+  if (!doc || !doc->is_object())
+    return false;
+
+  for (size_t i = 0; i < schema.fields.size(); ++i)
+    (*fields)[i] = json_paths_->Get(i, schema.fields[i].type, *doc);
+  return true;
+}
+
+void ShardDocIndex::Build(PrimeTable* table) {
+  string tmp;
+  PrimeTable::Cursor cursor;
+  do {
+    cursor = table->Traverse(cursor, [&](PrimeIterator it) {
+      string_view key = it->first.GetSlice(&tmp);
+      if (base_->Matches(key))
+        AddOrUpdate(key, it->second);
+    });
+  } while (cursor);
+}
+
+void ShardDocIndex::AddOrUpdate(string_view key, const PrimeValue& pv) {
+  // The values that were offloaded to the disk are not modified, so they keep their documents.
+  if (pv.IsExternal())
+    return;
+
+  DocFields new_fields;
+  if (!GetFields(pv, &new_fields)) {
+    Remove(key);
+    return;
+  }
+
+  auto [it, added] = ids_.emplace(key, 0);
+  if (added) {
+    if (free_ids_.empty()) {
+      it->second = keys_.size();
+      keys_.emplace_back();
+      fields_.emplace_back();
+    } else {
+      it->second = free_ids_.back();
+      free_ids_.pop_back();
+    }
+    keys_[it->second] = key;
+  } else {
+    indices_.Remove(it->second, fields_[it->second]);
+  }
+
+  DocId doc = it->second;
+  indices_.Add(doc, new_fields);
+  for (size_t i = 0; i < new_fields.size(); ++i) {
+    if (base_->schema.fields[i].type == FieldSchema::VECTOR)
+      new_fields[i].reset();
+  }
+  fields_[doc] = std::move(new_fields);
+}
+
+void ShardDocIndex::Remove(string_view key) {
+  auto it = ids_.find(key);
+  if (it == ids_.end())
+    return;
+
+  DocId doc = it->second;
+  indices_.Remove(doc, fields_[doc]);
+  keys_[doc] = string{};
+  fields_[doc] = DocFields{};
+  free_ids_.push_back(doc);
+  ids_.erase(it);
+}
+
+void ShardDocIndex::Clear() {
+  indices_.Clear();
+  ids_.clear();
+  keys_.clear();
+  fields_.clear();
+  free_ids_.clear();
+}
+
+DocContent ShardDocIndex::GetContent(const PrimeValue& pv, const vector<string>& fields) const {
+  const auto& schema = base_->schema;
+
+  // The schema field of a returned name, either its alias or its identifier.
+  auto find_field = [&](string_view name) {
+    int res = schema.Find(name);
+    for (size_t i = 0; res < 0 && i < schema.fields.size(); ++i) {
+      if (schema.fields[i].identifier == name)
+        res = i;
+    }
+    return res;
+  };
+
+  DocContent res;
+  if (base_->type == DocIndex::HASH) {
+    if (pv.ObjType() != OBJ_HASH)
+      return res;
+
+    IterateHash(pv, [&](string_view field, string_view value) {
+      if (fields.empty()) {
+        res.emplace_back(field, value);
+        return;
+      }
+
+      for (const string& name : fields) {
+        int pos = find_field(name);
+        if (pos >= 0 ? schema.fields[pos].identifier == field : name == field)
+          res.emplace_back(name, value);
+      }
+    });
+    return res;
+  }
+
+  // Reading the offloaded values would block the shard.
+  if (pv.IsExternal())
+    return res;
+
+  string str;
+  pv.GetString(&str);
+  if (fields.empty()) {
+    res.emplace_back("$", std::move(str));
+    return res;
+  }
+
+  optional<jsoncons::json> doc = ParseJson(str);
+  if (!doc)
+    return res;
+
+  for (const string& name : fields) {
+    int pos = find_field(name);
+    if (pos < 0)
+      continue;
+
+    // The vectors are returned as json arrays rather than packed.
+    if (schema.fields[pos].type == FieldSchema::VECTOR) {
+      if (optional<jsoncons::json> value = json_paths_->GetJson(pos, *doc))
+        res.emplace_back(name, value->to_string());
+    } else if (optional<string> value = json_paths_->Get(pos, schema.fields[pos].type, *doc)) {
+      res.emplace_back(name, std::move(*value));
+    }
+  }
+  return res;
+}
+
+ShardDocIndex* ShardDocIndices::GetIndex(string_view name) {
+  auto it = indices_.find(name);
+  return it == indices_.end() ? nullptr : it->second.get();
+}
+
+void ShardDocIndices::InitIndex(string_view name, shared_ptr<const DocIndex> base,
+                                PrimeTable* table) {
+  auto index = make_unique<ShardDocIndex>(std::move(base));
+  if (table)
+    index->Build(table);
+  indices_[name] = std::move(index);
+}
+
+bool ShardDocIndices::DropIndex(string_view name) {
+  return indices_.erase(name) > 0;
+}
+
+vector<string> ShardDocIndices::GetIndexNames() const {
+  vector<string> res;
+  for (const auto& [name, index] : indices_)
+    res.push_back(name);
+  return res;
+}
+
+void ShardDocIndices::OnUpdate(string_view key, const PrimeValue& pv) {
+  for (auto& [name, index] : indices_) {
+    if (index->base().Matches(key))
+      index->AddOrUpdate(key, pv);
+  }
+}
+
+void ShardDocIndices::OnRemove(string_view key) {
+  for (auto& [name, index] : indices_) {
+    if (index->base().Matches(key))
+      index->Remove(key);
+  }
+}
+
+void ShardDocIndices::OnFlush() {
+  for (auto& [name, index] : indices_)
+    index->Clear();
+}
+
+}  // namespace dfly
@@ -0,0 +1,133 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "server/search/query.h"
+#include "server/table.h"
+
+namespace dfly {
+
+// The definition of an index of FT.CREATE: the documents are the hashes or the json strings of
+// the keys with one of the prefixes.
+struct DocIndex {
+  enum DataType : uint8_t { HASH, JSON };
+
+  DataType type = HASH;
+  std::vector<std::string> prefixes;  // Empty for all the keys.
+  search::Schema schema;
+
+  bool Matches(std::string_view key) const;
+
+  // Whether path is a valid JSONPath for the schema of a json index.
+  static bool IsValidJsonPath(std::string_view path);
+};
+
+// The field names and the values of a document that are returned by FT.SEARCH.
+using DocContent = std::vector<std::pair<std::string, std::string>>;
+
+// The documents of an index that live in a shard. Kept up to date by DbSlice, which calls
+// AddOrUpdate from PostUpdate and Remove upon the deletion of a key of the index.
+class ShardDocIndex {
+ public:
+  explicit ShardDocIndex(std::shared_ptr<const DocIndex> base);
+  ~ShardDocIndex();
+
+  // Indexes the keys of the table that match the index.
+  void Build(PrimeTable* table);
+
+  // Replaces the document of key with the fields of pv. A value of an other type than the
+  // documents of the index removes it.
+  void AddOrUpdate(std::string_view key, const PrimeValue& pv);
+  void Remove(std::string_view key);
+  void Clear();
+
+  search::DocIds Search(const search::AstNode& query) const {
+    return search::Evaluate(query, indices_);
+  }
+
+  // The nearest documents of a KNN query, among the documents of filter if it is set.
+  std::vector<search::KnnHit> Knn(const search::KnnQuery& query,
+                                  const search::DocIds* filter) const {
+    return indices_.MatchKnn(query.field, query.blob, query.k, filter);
+  }
+
+  const std::string& key(search::DocId doc) const {
+    return keys_[doc];
+  }
+
+  // The values of the schema fields of doc, but the vectors, which are kept by their index only.
+  const search::DocFields& fields(search::DocId doc) const {
+    return fields_[doc];
+  }
+
+  // The content of a document of the index, i.e. all the fields of a hash or the whole json
+  // string as "$". If fields is not empty, only these fields or aliases of the schema.
+  DocContent GetContent(const PrimeValue& pv, const std::vector<std::string>& fields) const;
+
+  size_t num_docs() const {
+    return ids_.size();
+  }
+
+  const DocIndex& base() const {
+    return *base_;
+  }
+
+  std::shared_ptr<const DocIndex> base_ptr() const {
+    return base_;
+  }
+
+ private:
+  struct JsonPaths;
+
+  // Returns false if pv is not a document of the index type.
+  bool GetFields(const PrimeValue& pv, search::DocFields* fields) const;
+
+  std::shared_ptr<const DocIndex> base_;
+  std::unique_ptr<JsonPaths> json_paths_;  // The compiled paths of a json index.
+  search::FieldIndices indices_;
+
+  absl::flat_hash_map<std::string, search::DocId> ids_;
+  std::vector<std::string> keys_;          // By document id, empty for the free ids.
+  std::vector<search::DocFields> fields_;  // By document id.
+  std::vector<search::DocId> free_ids_;
+};
+
+// The indices of a shard, which cover the keys of the database 0 like RediSearch does.
+class ShardDocIndices {
+ public:
+  bool Empty() const {
+    return indices_.empty();
+  }
+
+  ShardDocIndex* GetIndex(std::string_view name);
+
+  // Adds the index and builds it from the keys of table.
+  void InitIndex(std::string_view name, std::shared_ptr<const DocIndex> base, PrimeTable* table);
+  bool DropIndex(std::string_view name);
+
+  std::vector<std::string> GetIndexNames() const;
+
+  // Called for each key of the database 0 that was added or modified.
+  void OnUpdate(std::string_view key, const PrimeValue& pv);
+
+  // Called for each key of the database 0 that was deleted, expired or evicted.
+  void OnRemove(std::string_view key);
+
+  // Called when the database 0 is flushed. The indices are kept, empty.
+  void OnFlush();
+
+ private:
+  absl::flat_hash_map<std::string, std::unique_ptr<ShardDocIndex>> indices_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,229 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/index.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "base/logging.h"
+#include "server/search/vector_index.h"
+
+namespace dfly {
+
+namespace search {
+
+using namespace std;
+
+namespace {
+
+bool IsTokenChar(char c) {
+  return absl::ascii_isalnum(c) || c == '_' || (c & 0x80);
+}
+
+}  // namespace
+
+int Schema::Find(string_view alias) const {
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (absl::EqualsIgnoreCase(fields[i].alias, alias))
+      return i;
+  }
+  return -1;
+}
+
+vector<string> Tokenize(string_view text) {
+  vector<string> res;
+  size_t i = 0;
+  while (i < text.size()) {
+    if (!IsTokenChar(text[i])) {
+      ++i;
+      continue;
+    }
+
+    size_t start = i;
+    while (i < text.size() && IsTokenChar(text[i]))
+      ++i;
+    res.push_back(absl::AsciiStrToLower(text.substr(start, i - start)));
+  }
+  return res;
+}
+
+vector<string> SplitTags(string_view value) {
+  vector<string> res;
+  for (string_view tag : absl::StrSplit(value, ',')) {
+    tag = absl::StripAsciiWhitespace(tag);
+    if (!tag.empty())
+      res.push_back(absl::AsciiStrToLower(tag));
+  }
+  return res;
+}
+
+FieldIndices::FieldIndices(const Schema& schema)
+    : schema_(schema),
+      terms_(schema.fields.size()),
+      numbers_(schema.fields.size()),
+      vectors_(schema.fields.size()) {
+  for (size_t i = 0; i < schema.fields.size(); ++i) {
+    if (schema.fields[i].type == FieldSchema::VECTOR)
+      vectors_[i] = VectorIndex::Create(schema.fields[i].vector);
+  }
+}
+
+FieldIndices::~FieldIndices() {
+}
+
+void FieldIndices::Insert(DocId doc, DocIds* ids) {
+  auto it = lower_bound(ids->begin(), ids->end(), doc);
+  if (it == ids->end() || *it != doc)
+    ids->insert(it, doc);
+}
+
+void FieldIndices::Erase(DocId doc, DocIds* ids) {
+  auto it = lower_bound(ids->begin(), ids->end(), doc);
+  if (it != ids->end() && *it == doc)
+    ids->erase(it);
+}
+
+void FieldIndices::Unite(const DocIds& ids, DocIds* dest) {
+  if (dest->empty()) {
+    *dest = ids;
+    return;
+  }
+
+  DocIds res;
+  res.reserve(ids.size() + dest->size());
+  set_union(ids.begin(), ids.end(), dest->begin(), dest->end(), back_inserter(res));
+  dest->swap(res);
+}
+
+vector<string> FieldIndices::Terms(int field, string_view value) const {
+  return schema_.fields[field].type == FieldSchema::TAG ? SplitTags(value) : Tokenize(value);
+}
+
+void FieldIndices::Add(DocId doc, const DocFields& fields) {
+  DCHECK_EQ(fields.size(), schema_.fields.size());
+
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (!fields[i])
+      continue;
+
+    if (vectors_[i]) {
+      vectors_[i]->Add(doc, *fields[i]);
+      continue;
+    }
+
+    if (schema_.fields[i].type == FieldSchema::NUMERIC) {
+      double num;
+      if (absl::SimpleAtod(*fields[i], &num) && !isnan(num))
+        numbers_[i].emplace(num, doc);
+      continue;
+    }
+
+    for (string& term : Terms(i, *fields[i]))
+      Insert(doc, &terms_[i][term]);
+  }
+  Insert(doc, &all_docs_);
+}
+
+void FieldIndices::Remove(DocId doc, const DocFields& fields) {
+  DCHECK_EQ(fields.size(), schema_.fields.size());
+
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (vectors_[i]) {
+      vectors_[i]->Remove(doc);
+      continue;
+    }
+
+    if (!fields[i])
+      continue;
+
+    if (schema_.fields[i].type == FieldSchema::NUMERIC) {
+      double num;
+      if (absl::SimpleAtod(*fields[i], &num))
+        numbers_[i].erase({num, doc});
+      continue;
+    }
+
+    for (const string& term : Terms(i, *fields[i])) {
+      auto it = terms_[i].find(term);
+      if (it == terms_[i].end())
+        continue;
+      Erase(doc, &it->second);
+      if (it->second.empty())
+        terms_[i].erase(it);
+    }
+  }
+  Erase(doc, &all_docs_);
+}
+
+void FieldIndices::Clear() {
+  terms_.assign(schema_.fields.size(), {});
+  numbers_.assign(schema_.fields.size(), {});
+  for (auto& index : vectors_) {
+    if (index)
+      index->Clear();
+  }
+  all_docs_.clear();
+}
+
+DocIds FieldIndices::MatchTerm(int field, string_view term) const {
+  DocIds res;
+  for (size_t i = 0; i < schema_.fields.size(); ++i) {
+    if ((field >= 0 && size_t(field) != i) || schema_.fields[i].type != FieldSchema::TEXT)
+      continue;
+
+    if (auto it = terms_[i].find(term); it != terms_[i].end())
+      Unite(it->second, &res);
+  }
+  return res;
+}
+
+DocIds FieldIndices::MatchPrefix(int field, string_view prefix) const {
+  DocIds res;
+  for (size_t i = 0; i < schema_.fields.size(); ++i) {
+    if ((field >= 0 && size_t(field) != i) || schema_.fields[i].type != FieldSchema::TEXT)
+      continue;
+
+    for (const auto& [term, ids] : terms_[i]) {
+      if (absl::StartsWith(term, prefix))
+        Unite(ids, &res);
+    }
+  }
+  return res;
+}
+
+DocIds FieldIndices::MatchRange(int field, double lo, double hi) const {
+  DCHECK_EQ(FieldSchema::NUMERIC, schema_.fields[field].type);
+
+  DocIds res;
+  const auto& numbers = numbers_[field];
+  for (auto it = numbers.lower_bound({lo, 0}); it != numbers.end() && it->first <= hi; ++it)
+    res.push_back(it->second);
+
+  sort(res.begin(), res.end());
+  return res;
+}
+
+DocIds FieldIndices::MatchTag(int field, string_view tag) const {
+  DCHECK_EQ(FieldSchema::TAG, schema_.fields[field].type);
+
+  auto it = terms_[field].find(absl::AsciiStrToLower(tag));
+  return it == terms_[field].end() ? DocIds{} : it->second;
+}
+
+vector<KnnHit> FieldIndices::MatchKnn(int field, string_view blob, size_t k,
+                                      const DocIds* filter) const {
+  DCHECK(vectors_[field]);
+  return vectors_[field]->Knn(blob, k, filter);
+}
+
+}  // namespace search
+
+}  // namespace dfly
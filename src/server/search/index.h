@@ -0,0 +1,135 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/btree_set.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+namespace search {
+
+// Identifies a document within the index of a shard. The ids of the removed documents are
+// reused.
+using DocId = uint32_t;
+
+// Sorted and unique.
+using DocIds = std::vector<DocId>;
+
+// The parameters of a vector field, whose values are arrays of dim float32 numbers.
+struct VectorParams {
+  enum Algorithm : uint8_t { FLAT, HNSW };
+  enum Metric : uint8_t { L2, IP, COSINE };
+
+  Algorithm algorithm = FLAT;
+  Metric metric = L2;
+  uint32_t dim = 0;
+
+  // HNSW only: the number of neighbors of a node, and the sizes of the candidate lists of the
+  // insertions and of the queries.
+  uint32_t m = 16;
+  uint32_t ef_construction = 200;
+  uint32_t ef_runtime = 10;
+};
+
+struct FieldSchema {
+  enum Type : uint8_t { TEXT, NUMERIC, TAG, VECTOR };
+
+  std::string identifier;  // The field of a hash or the JSONPath of a json document.
+  std::string alias;       // The name of the field in the queries.
+  Type type = TEXT;
+  VectorParams vector;     // VECTOR only.
+};
+
+struct Schema {
+  std::vector<FieldSchema> fields;
+
+  // Returns the position of the field with the given alias, or -1.
+  int Find(std::string_view alias) const;
+};
+
+// The values of the schema fields of a document, by the position of their field. Absent values
+// are not indexed.
+using DocFields = std::vector<std::optional<std::string>>;
+
+// Splits a text into lower case tokens of alphanumeric characters. Non ASCII bytes are kept
+// within the tokens, so that words in UTF-8 are indexed whole.
+std::vector<std::string> Tokenize(std::string_view text);
+
+// Splits a tag field by ',' into trimmed lower case tags.
+std::vector<std::string> SplitTags(std::string_view value);
+
+class VectorIndex;
+
+// A document found by a KNN query and its distance to the query vector.
+using KnnHit = std::pair<float, DocId>;
+
+// The inverted, numeric and vector indices of the documents of a shard, one per schema field.
+// Documents are removed with the fields they were added with, which the caller keeps, except for
+// the vector fields, whose values are only kept by their index.
+class FieldIndices {
+ public:
+  explicit FieldIndices(const Schema& schema);
+  ~FieldIndices();
+
+  void Add(DocId doc, const DocFields& fields);
+  void Remove(DocId doc, const DocFields& fields);
+  void Clear();
+
+  // The documents whose text field contains term. A negative field stands for all the text
+  // fields, also below.
+  DocIds MatchTerm(int field, std::string_view term) const;
+
+  // The documents whose text field contains a token starting with prefix.
+  DocIds MatchPrefix(int field, std::string_view prefix) const;
+
+  // The documents whose numeric field is within [lo, hi].
+  DocIds MatchRange(int field, double lo, double hi) const;
+
+  // The documents whose tag field contains tag.
+  DocIds MatchTag(int field, std::string_view tag) const;
+
+  // The k documents nearest to the vector blob by their vector field, nearest first. If filter is
+  // set, only among its documents. Returns nothing if blob is not a vector of the field.
+  std::vector<KnnHit> MatchKnn(int field, std::string_view blob, size_t k,
+                               const DocIds* filter) const;
+
+  const DocIds& AllDocs() const {
+    return all_docs_;
+  }
+
+  const Schema& schema() const {
+    return schema_;
+  }
+
+ private:
+  using InvertedIndex = absl::flat_hash_map<std::string, DocIds>;
+
+  static void Insert(DocId doc, DocIds* ids);
+  static void Erase(DocId doc, DocIds* ids);
+  static void Unite(const DocIds& ids, DocIds* dest);
+
+  std::vector<std::string> Terms(int field, std::string_view value) const;
+
+  const Schema& schema_;
+
+  // By the position of the field, only the ones of its type are used.
+  std::vector<InvertedIndex> terms_;
+  std::vector<absl::btree_set<std::pair<double, DocId>>> numbers_;
+  std::vector<std::unique_ptr<VectorIndex>> vectors_;
+
+  DocIds all_docs_;
+};
+
+}  // namespace search
+
+}  // namespace dfly
@@ -0,0 +1,438 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/query.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+namespace search {
+
+using namespace std;
+
+namespace {
+
+constexpr string_view kSpecialChars = "()|-@*\"[]{}:";
+
+bool IsTokenChar(char c) {
+  return absl::ascii_isalnum(c) || c == '_' || (c & 0x80);
+}
+
+class QueryParser {
+ public:
+  QueryParser(string_view query, const Schema& schema) : query_(query), schema_(schema) {
+  }
+
+  optional<AstNode> Parse(string* error) {
+    AstNode res = ParseUnion(-1);
+    if (error_.empty() && !AtEnd())
+      SetError("unexpected character");
+
+    if (!error_.empty()) {
+      *error = std::move(error_);
+      return nullopt;
+    }
+    return res;
+  }
+
+ private:
+  // Punctuation separates the terms like the white space does.
+  void SkipSeparators() {
+    while (pos_ < query_.size() && !IsTokenChar(query_[pos_]) &&
+           kSpecialChars.find(query_[pos_]) == string_view::npos) {
+      ++pos_;
+    }
+  }
+
+  bool AtEnd() {
+    SkipSeparators();
+    return pos_ >= query_.size();
+  }
+
+  char Peek() {
+    return AtEnd() ? '\0' : query_[pos_];
+  }
+
+  bool Consume(char c) {
+    if (Peek() != c)
+      return false;
+    ++pos_;
+    return true;
+  }
+
+  void SetError(string_view msg) {
+    if (error_.empty())
+      error_ = absl::StrCat("Syntax error at offset ", pos_, ": ", msg);
+  }
+
+  bool Expect(char c) {
+    if (Consume(c))
+      return true;
+    SetError(absl::StrCat("expected '", string_view{&c, 1}, "'"));
+    return false;
+  }
+
+  string_view ReadToken() {
+    size_t start = pos_;
+    while (pos_ < query_.size() && IsTokenChar(query_[pos_]))
+      ++pos_;
+    return query_.substr(start, pos_ - start);
+  }
+
+  static AstNode Compound(AstNode::Kind kind, vector<AstNode> children) {
+    if (children.size() == 1)
+      return std::move(children.front());
+
+    AstNode res;
+    res.kind = kind;
+    res.children = std::move(children);
+    return res;
+  }
+
+  AstNode ParseUnion(int field) {
+    vector<AstNode> children;
+    children.push_back(ParseIntersection(field));
+    while (error_.empty() && Consume('|'))
+      children.push_back(ParseIntersection(field));
+    return Compound(AstNode::OR, std::move(children));
+  }
+
+  AstNode ParseIntersection(int field) {
+    vector<AstNode> children;
+    while (error_.empty() && !AtEnd() && Peek() != ')' && Peek() != '|')
+      children.push_back(ParseUnary(field));
+
+    if (children.empty())
+      SetError("empty expression");
+    return Compound(AstNode::AND, std::move(children));
+  }
+
+  AstNode ParseUnary(int field) {
+    if (!Consume('-'))
+      return ParseAtom(field);
+
+    AstNode res;
+    res.kind = AstNode::NOT;
+    res.children.push_back(ParseUnary(field));
+    return res;
+  }
+
+  AstNode ParseAtom(int field) {
+    AstNode res;
+    if (Consume('(')) {
+      res = ParseUnion(field);
+      Expect(')');
+      return res;
+    }
+
+    if (field < 0 && Consume('*'))
+      return res;
+
+    if (field < 0 && Consume('@'))
+      return ParseField();
+
+    if (Consume('"')) {
+      // Matches all the terms of the phrase.
+      size_t end = query_.find('"', pos_);
+      if (end == string_view::npos) {
+        SetError("unterminated quote");
+        return res;
+      }
+
+      vector<AstNode> children;
+      for (string& term : Tokenize(query_.substr(pos_, end - pos_))) {
+        children.emplace_back();
+        children.back().kind = AstNode::TERM;
+        children.back().field = field;
+        children.back().term = std::move(term);
+      }
+      pos_ = end + 1;
+
+      if (children.empty()) {
+        SetError("empty phrase");
+        return res;
+      }
+      return Compound(AstNode::AND, std::move(children));
+    }
+
+    string_view token = ReadToken();
+    if (token.empty()) {
+      SetError("unexpected character");
+      return res;
+    }
+
+    res.kind = pos_ < query_.size() && query_[pos_] == '*' ? AstNode::PREFIX : AstNode::TERM;
+    pos_ += res.kind == AstNode::PREFIX;
+    res.field = field;
+    res.term = absl::AsciiStrToLower(token);
+    return res;
+  }
+
+  AstNode ParseField() {
+    AstNode res;
+    string_view name = ReadToken();
+    if (!Expect(':'))
+      return res;
+
+    res.field = schema_.Find(name);
+    if (res.field < 0) {
+      error_ = absl::StrCat("Unknown field ", name);
+      return res;
+    }
+
+    switch (schema_.fields[res.field].type) {
+      case FieldSchema::TEXT:
+        if (Consume('(')) {
+          res = ParseUnion(res.field);
+          Expect(')');
+          return res;
+        }
+        return ParseAtom(res.field);
+      case FieldSchema::NUMERIC:
+        ParseRange(&res);
+        return res;
+      case FieldSchema::TAG:
+        ParseTags(&res);
+        return res;
+      case FieldSchema::VECTOR:
+        error_ = absl::StrCat("Vector field ", name, " can only be queried with KNN");
+        return res;
+    }
+    return res;
+  }
+
+  // The bound of a numeric range, which sets exclusive for a leading '('.
+  optional<double> ParseNumber(bool* exclusive) {
+    SkipSpaces();
+    *exclusive = pos_ < query_.size() && query_[pos_] == '(';
+    pos_ += *exclusive;
+
+    size_t start = pos_;
+    while (pos_ < query_.size() && query_[pos_] != ']' && !absl::ascii_isspace(query_[pos_]))
+      ++pos_;
+    string_view str = query_.substr(start, pos_ - start);
+
+    if (absl::EqualsIgnoreCase(str, "+inf") || absl::EqualsIgnoreCase(str, "inf"))
+      return numeric_limits<double>::infinity();
+    if (absl::EqualsIgnoreCase(str, "-inf"))
+      return -numeric_limits<double>::infinity();
+
+    double num;
+    if (!absl::SimpleAtod(str, &num) || isnan(num)) {
+      SetError("invalid range bound");
+      return nullopt;
+    }
+    return num;
+  }
+
+  void SkipSpaces() {
+    while (pos_ < query_.size() && absl::ascii_isspace(query_[pos_]))
+      ++pos_;
+  }
+
+  void ParseRange(AstNode* node) {
+    node->kind = AstNode::RANGE;
+    if (!Expect('['))
+      return;
+
+    bool lo_exclusive, hi_exclusive;
+    optional<double> lo = ParseNumber(&lo_exclusive);
+    optional<double> hi = lo ? ParseNumber(&hi_exclusive) : nullopt;
+    if (!hi || !Expect(']'))
+      return;
+
+    node->lo = lo_exclusive ? nextafter(*lo, numeric_limits<double>::infinity()) : *lo;
+    node->hi = hi_exclusive ? nextafter(*hi, -numeric_limits<double>::infinity()) : *hi;
+  }
+
+  void ParseTags(AstNode* node) {
+    node->kind = AstNode::TAG;
+    if (!Expect('{'))
+      return;
+
+    // The tags may contain any character but the delimiters.
+    while (error_.empty()) {
+      size_t end = query_.find_first_of("|}", pos_);
+      if (end == string_view::npos) {
+        SetError("expected '}'");
+        return;
+      }
+
+      string_view tag = absl::StripAsciiWhitespace(query_.substr(pos_, end - pos_));
+      if (!tag.empty())
+        node->tags.push_back(absl::AsciiStrToLower(tag));
+      pos_ = end + 1;
+      if (query_[end] == '}')
+        break;
+    }
+
+    if (node->tags.empty())
+      SetError("empty tag list");
+  }
+
+  string_view query_;
+  const Schema& schema_;
+  size_t pos_ = 0;
+  string error_;
+};
+
+DocIds Intersect(const DocIds& a, const DocIds& b) {
+  DocIds res;
+  set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(res));
+  return res;
+}
+
+DocIds Unite(const DocIds& a, const DocIds& b) {
+  DocIds res;
+  res.reserve(a.size() + b.size());
+  set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(res));
+  return res;
+}
+
+// The value of a KNN argument, which is a parameter if it starts with '$'.
+optional<string_view> ResolveParam(string_view arg, const QueryParams& params, string* error) {
+  if (arg.empty() || arg[0] != '$')
+    return arg;
+
+  auto it = params.find(arg.substr(1));
+  if (it == params.end()) {
+    *error = absl::StrCat("No such parameter `", arg.substr(1), "`");
+    return nullopt;
+  }
+  return it->second;
+}
+
+// Parses "[KNN k @field $vector [AS score]]".
+optional<KnnQuery> ParseKnn(string_view clause, const Schema& schema, const QueryParams& params,
+                            string* error) {
+  clause = absl::StripAsciiWhitespace(clause);
+  if (clause.size() < 2 || clause.front() != '[' || clause.back() != ']') {
+    *error = "Syntax error: expected [KNN ...] after =>";
+    return nullopt;
+  }
+
+  vector<string_view> args = absl::StrSplit(clause.substr(1, clause.size() - 2),
+                                            absl::ByAnyChar(" \t\r\n"), absl::SkipEmpty());
+  if ((args.size() != 4 && args.size() != 6) || !absl::EqualsIgnoreCase(args[0], "KNN") ||
+      (args.size() == 6 && !absl::EqualsIgnoreCase(args[4], "AS"))) {
+    *error = "Syntax error: expected [KNN k @field $vector [AS score]]";
+    return nullopt;
+  }
+
+  KnnQuery res;
+  optional<string_view> k = ResolveParam(args[1], params, error);
+  if (!k)
+    return nullopt;
+  if (!absl::SimpleAtoi(*k, &res.k)) {
+    *error = "Syntax error: invalid KNN k";
+    return nullopt;
+  }
+
+  if (args[2].size() < 2 || args[2][0] != '@') {
+    *error = "Syntax error: expected @field in KNN";
+    return nullopt;
+  }
+  string_view name = args[2].substr(1);
+  res.field = schema.Find(name);
+  if (res.field < 0) {
+    *error = absl::StrCat("Unknown field ", name);
+    return nullopt;
+  }
+  if (schema.fields[res.field].type != FieldSchema::VECTOR) {
+    *error = absl::StrCat("Field ", name, " is not a vector field");
+    return nullopt;
+  }
+
+  optional<string_view> blob = ResolveParam(args[3], params, error);
+  if (!blob)
+    return nullopt;
+  if (blob->size() != size_t(schema.fields[res.field].vector.dim) * sizeof(float)) {
+    *error = absl::StrCat("Vector of field ", name, " must have ",
+                          schema.fields[res.field].vector.dim, " float32 numbers");
+    return nullopt;
+  }
+  res.blob = *blob;
+
+  res.score = args.size() == 6 ? string(args[5]) : absl::StrCat("__", name, "_score");
+  return res;
+}
+
+}  // namespace
+
+optional<AstNode> ParseQuery(string_view query, const Schema& schema, string* error) {
+  return QueryParser{query, schema}.Parse(error);
+}
+
+optional<SearchQuery> ParseSearchQuery(string_view query, const Schema& schema,
+                                       const QueryParams& params, string* error) {
+  size_t arrow = query.find("=>");
+  SearchQuery res;
+
+  optional<AstNode> filter = ParseQuery(query.substr(0, arrow), schema, error);
+  if (!filter)
+    return nullopt;
+  res.filter = std::move(*filter);
+
+  if (arrow != string_view::npos) {
+    res.knn = ParseKnn(query.substr(arrow + 2), schema, params, error);
+    if (!res.knn)
+      return nullopt;
+  }
+  return res;
+}
+
+DocIds Evaluate(const AstNode& node, const FieldIndices& indices) {
+  switch (node.kind) {
+    case AstNode::STAR:
+      return indices.AllDocs();
+    case AstNode::TERM:
+      return indices.MatchTerm(node.field, node.term);
+    case AstNode::PREFIX:
+      return indices.MatchPrefix(node.field, node.term);
+    case AstNode::RANGE:
+      return indices.MatchRange(node.field, node.lo, node.hi);
+    case AstNode::TAG: {
+      DocIds res;
+      for (const string& tag : node.tags)
+        res = Unite(res, indices.MatchTag(node.field, tag));
+      return res;
+    }
+    case AstNode::AND: {
+      DocIds res = Evaluate(node.children.front(), indices);
+      for (size_t i = 1; i < node.children.size() && !res.empty(); ++i)
+        res = Intersect(res, Evaluate(node.children[i], indices));
+      return res;
+    }
+    case AstNode::OR: {
+      DocIds res;
+      for (const AstNode& child : node.children)
+        res = Unite(res, Evaluate(child, indices));
+      return res;
+    }
+    case AstNode::NOT: {
+      DocIds excluded = Evaluate(node.children.front(), indices);
+      DocIds res;
+      const DocIds& all = indices.AllDocs();
+      set_difference(all.begin(), all.end(), excluded.begin(), excluded.end(),
+                     back_inserter(res));
+      return res;
+    }
+  }
+  return {};
+}
+
+}  // namespace search
+
+}  // namespace dfly
@@ -0,0 +1,78 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server/search/index.h"
+
+namespace dfly {
+
+namespace search {
+
+// A parsed query. The shards evaluate the same tree against their indices.
+struct AstNode {
+  enum Kind : uint8_t { STAR, TERM, PREFIX, RANGE, TAG, AND, OR, NOT };
+
+  Kind kind = STAR;
+  int field = -1;  // The position of the field in the schema, or -1 for all the text fields.
+
+  std::string term;               // TERM and PREFIX.
+  std::vector<std::string> tags;  // TAG, any of them.
+  double lo = 0, hi = 0;          // RANGE, inclusive.
+
+  std::vector<AstNode> children;  // AND, OR and NOT.
+};
+
+// Parses the subset of the RediSearch query syntax that follows:
+//   *                      all the documents
+//   foo bar                the documents with both terms in any text field
+//   foo | bar              either of them
+//   -foo                   the documents without the term
+//   (foo | bar) baz        grouping
+//   foo*                   the terms with the prefix
+//   "foo bar"              both terms, their positions are not indexed
+//   @title:foo             the term in a text field, @title:(foo | bar) for an expression
+//   @price:[10 (20]        the numeric range, exclusive with '(', -inf and +inf are unbounded
+//   @color:{red | blue}    any of the tags
+// Returns nullopt and sets error if query is malformed or names an unknown field.
+std::optional<AstNode> ParseQuery(std::string_view query, const Schema& schema,
+                                  std::string* error);
+
+// The documents that match the query.
+DocIds Evaluate(const AstNode& node, const FieldIndices& indices);
+
+// The k nearest neighbors clause of FT.SEARCH.
+struct KnnQuery {
+  int field = -1;     // A vector field.
+  size_t k = 0;
+  std::string blob;   // The query vector, an array of float32 numbers.
+  std::string score;  // The name of the distance in the results.
+};
+
+// A query of FT.SEARCH: the documents of the filter, or its k nearest ones to a vector.
+struct SearchQuery {
+  AstNode filter;
+  std::optional<KnnQuery> knn;
+};
+
+// The values of the PARAMS of FT.SEARCH by their names.
+using QueryParams = absl::flat_hash_map<std::string, std::string>;
+
+// Parses a query of ParseQuery, optionally followed by a KNN clause:
+//   filter=>[KNN k @field $vector [AS score]]
+// where the number may be a parameter too, e.g. $k. The default name of the score is
+// __<field>_score.
+std::optional<SearchQuery> ParseSearchQuery(std::string_view query, const Schema& schema,
+                                            const QueryParams& params, std::string* error);
+
+}  // namespace search
+
+}  // namespace dfly
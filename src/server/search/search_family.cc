@@ -0,0 +1,570 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/search_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/fiber/mutex.hpp>
+#include <memory>
+
+#include "base/logging.h"
+#include "server/command_registry.h"
+#include "server/common.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/search/doc_index.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using search::DocId;
+using search::FieldSchema;
+
+namespace {
+
+using CI = CommandId;
+
+constexpr char kUnknownIndexErr[] = "Unknown Index name";
+
+// Serializes the changes of the index definitions, so that all the shards hold the same ones.
+::boost::fibers::mutex index_mu;
+
+struct SearchParams {
+  bool no_content = false;
+  vector<string> return_fields;  // All the fields if empty.
+  int sort_field = -1;           // By key if negative.
+  bool sort_desc = false;
+  size_t offset = 0;
+  size_t limit = 10;
+  search::QueryParams query_params;
+
+  bool Returns(string_view field) const {
+    return return_fields.empty() ||
+           find(return_fields.begin(), return_fields.end(), field) != return_fields.end();
+  }
+};
+
+// The value of the sort field of a document, the documents without it come last.
+struct SortValue {
+  bool present = false;
+  double num = 0;
+  string_view str;
+};
+
+// A document found by a shard.
+struct SearchHit {
+  string key;
+  float distance = 0;  // To the vector of a KNN query.
+  bool present = false;
+  double num = 0;
+  string str;
+  DocContent content;
+
+  SortValue value() const {
+    return SortValue{present, num, str};
+  }
+};
+
+struct ShardResult {
+  size_t total = 0;
+  vector<SearchHit> hits;
+};
+
+// Whether the document a goes before b in the results.
+bool HitLess(const SearchParams& params, bool numeric, string_view a_key, const SortValue& a,
+             string_view b_key, const SortValue& b) {
+  if (params.sort_field >= 0) {
+    if (a.present != b.present)
+      return a.present;
+
+    if (a.present) {
+      int cmp = numeric ? (a.num < b.num ? -1 : a.num > b.num) : a.str.compare(b.str);
+      if (cmp != 0)
+        return params.sort_desc ? cmp > 0 : cmp < 0;
+    }
+  }
+  return a_key < b_key;
+}
+
+// Parses the attributes of a vector field at args[*pos]:
+//   FLAT|HNSW count TYPE FLOAT32 DIM dim DISTANCE_METRIC L2|IP|COSINE [M m]
+//   [EF_CONSTRUCTION n] [EF_RUNTIME n]
+// where count is the number of the arguments that follow it.
+bool ParseVectorParams(CmdArgList args, size_t* pos, search::VectorParams* params,
+                       string* error) {
+  size_t& i = *pos;
+  *error = kSyntaxErr;
+  if (i + 1 >= args.size())
+    return false;
+
+  ToUpper(&args[i]);
+  string_view algorithm = ArgS(args, i++);
+  if (algorithm == "FLAT") {
+    params->algorithm = search::VectorParams::FLAT;
+  } else if (algorithm == "HNSW") {
+    params->algorithm = search::VectorParams::HNSW;
+  } else {
+    *error = absl::StrCat("Bad arguments for vector similarity algorithm: ", algorithm);
+    return false;
+  }
+
+  uint32_t num_args;
+  if (!absl::SimpleAtoi(ArgS(args, i++), &num_args) || num_args % 2 != 0 ||
+      num_args > args.size() - i) {
+    return false;
+  }
+
+  bool has_metric = false;
+  for (size_t end = i + num_args; i < end; i += 2) {
+    ToUpper(&args[i]);
+    string_view attr = ArgS(args, i);
+    ToUpper(&args[i + 1]);
+    string_view value = ArgS(args, i + 1);
+
+    bool valid = true;
+    if (attr == "TYPE") {
+      if (value != "FLOAT32") {
+        *error = absl::StrCat("Unsupported vector type ", value);
+        return false;
+      }
+    } else if (attr == "DIM") {
+      valid = absl::SimpleAtoi(value, &params->dim) && params->dim > 0 && params->dim <= 32768;
+    } else if (attr == "DISTANCE_METRIC") {
+      has_metric = true;
+      if (value == "L2") {
+        params->metric = search::VectorParams::L2;
+      } else if (value == "IP") {
+        params->metric = search::VectorParams::IP;
+      } else if (value == "COSINE") {
+        params->metric = search::VectorParams::COSINE;
+      } else {
+        valid = false;
+      }
+    } else if (attr == "M" && params->algorithm == search::VectorParams::HNSW) {
+      valid = absl::SimpleAtoi(value, &params->m) && params->m >= 2 && params->m <= 512;
+    } else if (attr == "EF_CONSTRUCTION" && params->algorithm == search::VectorParams::HNSW) {
+      valid = absl::SimpleAtoi(value, &params->ef_construction) && params->ef_construction > 0;
+    } else if (attr == "EF_RUNTIME" && params->algorithm == search::VectorParams::HNSW) {
+      valid = absl::SimpleAtoi(value, &params->ef_runtime) && params->ef_runtime > 0;
+    } else if (attr != "INITIAL_CAP" && attr != "BLOCK_SIZE") {
+      valid = false;
+    }
+
+    if (!valid) {
+      *error = absl::StrCat("Bad arguments for vector similarity ", algorithm, " index ", attr);
+      return false;
+    }
+  }
+
+  if (params->dim == 0 || !has_metric) {
+    *error = absl::StrCat("Missing mandatory parameters of vector similarity ", algorithm,
+                          " index: DIM and DISTANCE_METRIC");
+    return false;
+  }
+  return true;
+}
+
+shared_ptr<const DocIndex> GetIndexDefinition(string_view name) {
+  return shard_set->Await(0, [name] {
+    ShardDocIndex* index = EngineShard::tlocal()->search_indices().GetIndex(name);
+    return index ? index->base_ptr() : nullptr;
+  });
+}
+
+// Finds the documents of the shard that match the query and returns the first
+// offset + limit of them. All the nearest documents of a KNN query are returned, the nearest ones
+// of all the shards are the results.
+ShardResult SearchShard(EngineShard* shard, string_view name, const DocIndex& base,
+                        const search::SearchQuery& query, const SearchParams& params) {
+  ShardResult res;
+
+  // The query refers to the fields of base, the index may have been recreated since.
+  ShardDocIndex* index = shard->search_indices().GetIndex(name);
+  if (!index || &index->base() != &base)
+    return res;
+
+  bool numeric = params.sort_field >= 0 &&
+                 index->base().schema.fields[params.sort_field].type == FieldSchema::NUMERIC;
+
+  struct Ref {
+    DocId doc;
+    string_view key;
+    float distance = 0;
+    SortValue value;
+  };
+
+  vector<Ref> refs;
+  if (query.knn) {
+    search::DocIds ids;
+    bool filtered = query.filter.kind != search::AstNode::STAR;
+    if (filtered)
+      ids = index->Search(query.filter);
+
+    for (auto [distance, doc] : index->Knn(*query.knn, filtered ? &ids : nullptr))
+      refs.push_back(Ref{doc, index->key(doc), distance});
+  } else {
+    for (DocId doc : index->Search(query.filter))
+      refs.push_back(Ref{doc, index->key(doc)});
+  }
+  res.total = refs.size();
+
+  for (Ref& ref : refs) {
+    if (params.sort_field < 0)
+      break;
+
+    const auto& field = index->fields(ref.doc)[params.sort_field];
+    if (!field)
+      continue;
+    ref.value.str = *field;
+    ref.value.present = !numeric || absl::SimpleAtod(ref.value.str, &ref.value.num);
+  }
+
+  size_t top = query.knn ? refs.size() : min(refs.size(), params.offset + params.limit);
+  if (!query.knn) {
+    partial_sort(refs.begin(), refs.begin() + top, refs.end(), [&](const Ref& a, const Ref& b) {
+      return HitLess(params, numeric, a.key, a.value, b.key, b.value);
+    });
+  }
+
+  // Copied before the lookups, which may expire the keys and remove their documents.
+  res.hits.resize(top);
+  for (size_t i = 0; i < top; ++i) {
+    SearchHit& hit = res.hits[i];
+    hit.key = refs[i].key;
+    hit.distance = refs[i].distance;
+    hit.present = refs[i].value.present;
+    hit.num = refs[i].value.num;
+    hit.str = refs[i].value.str;
+  }
+
+  if (params.no_content)
+    return res;
+
+  DbContext db_cntx{.db_index = 0, .time_now_ms = GetCurrentTimeMs()};
+  unsigned obj_type = index->base().type == DocIndex::HASH ? OBJ_HASH : OBJ_STRING;
+  size_t num_hits = 0;
+  for (size_t i = 0; i < res.hits.size(); ++i) {
+    auto it = shard->db_slice().Find(db_cntx, res.hits[i].key, obj_type);
+    if (!it) {
+      --res.total;
+      continue;
+    }
+
+    SearchHit& hit = res.hits[i];
+    hit.content = index->GetContent((*it)->second, params.return_fields);
+    if (query.knn && params.Returns(query.knn->score))
+      hit.content.emplace(hit.content.begin(), query.knn->score, absl::StrCat(hit.distance));
+    if (num_hits != i)
+      res.hits[num_hits] = std::move(res.hits[i]);
+    ++num_hits;
+  }
+  res.hits.resize(num_hits);
+  return res;
+}
+
+// FT.CREATE index [ON HASH|JSON] [PREFIX count prefix...] SCHEMA field [AS alias] type ...
+void FtCreate(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  auto index = make_shared<DocIndex>();
+
+  size_t i = 2;
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "SCHEMA") {
+      ++i;
+      break;
+    }
+
+    if (arg == "ON" && i + 1 < args.size()) {
+      ToUpper(&args[++i]);
+      string_view type = ArgS(args, i);
+      if (type == "HASH") {
+        index->type = DocIndex::HASH;
+      } else if (type == "JSON") {
+        index->type = DocIndex::JSON;
+      } else {
+        return (*cntx)->SendError(kSyntaxErr);
+      }
+    } else if (arg == "PREFIX" && i + 1 < args.size()) {
+      uint32_t num_prefixes;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &num_prefixes))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (num_prefixes > args.size() - i - 1)
+        return (*cntx)->SendError(kSyntaxErr);
+
+      for (uint32_t j = 0; j < num_prefixes; ++j) {
+        string_view prefix = ArgS(args, ++i);
+        if (!prefix.empty())
+          index->prefixes.emplace_back(prefix);
+      }
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  auto& fields = index->schema.fields;
+  while (i < args.size()) {
+    FieldSchema field;
+    field.identifier = field.alias = ArgS(args, i++);
+
+    if (i + 1 < args.size() && absl::EqualsIgnoreCase(ArgS(args, i), "AS")) {
+      field.alias = ArgS(args, i + 1);
+      i += 2;
+    }
+    if (i >= args.size())
+      return (*cntx)->SendError(kSyntaxErr);
+
+    ToUpper(&args[i]);
+    string_view type = ArgS(args, i++);
+    if (type == "TEXT") {
+      field.type = FieldSchema::TEXT;
+    } else if (type == "NUMERIC") {
+      field.type = FieldSchema::NUMERIC;
+    } else if (type == "TAG") {
+      field.type = FieldSchema::TAG;
+    } else if (type == "VECTOR") {
+      field.type = FieldSchema::VECTOR;
+      string error;
+      if (!ParseVectorParams(args, &i, &field.vector, &error))
+        return (*cntx)->SendError(error);
+    } else {
+      return (*cntx)->SendError(absl::StrCat("Invalid field type for field `", field.alias, "`"));
+    }
+
+    // All the fields can sort the results.
+    if (i < args.size() && absl::EqualsIgnoreCase(ArgS(args, i), "SORTABLE"))
+      ++i;
+
+    if (index->schema.Find(field.alias) >= 0)
+      return (*cntx)->SendError(absl::StrCat("Duplicate field in schema - ", field.alias));
+    if (index->type == DocIndex::JSON && !DocIndex::IsValidJsonPath(field.identifier))
+      return (*cntx)->SendError(absl::StrCat("Invalid JSONPath in field `", field.alias, "`"));
+
+    fields.push_back(std::move(field));
+  }
+
+  if (fields.empty())
+    return (*cntx)->SendError("Fields arguments are missing");
+
+  lock_guard lk(index_mu);
+  if (GetIndexDefinition(name))
+    return (*cntx)->SendError("Index already exists");
+
+  // Every shard indexes its existing keys before it serves the next commands.
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    PrimeTable* table = db_slice.IsDbValid(0) ? db_slice.GetPrimeTable(0) : nullptr;
+    shard->search_indices().InitIndex(name, index, table);
+  });
+  (*cntx)->SendOk();
+}
+
+void FtDropIndex(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+
+  lock_guard lk(index_mu);
+  atomic_uint num_dropped = 0;
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { num_dropped += shard->search_indices().DropIndex(name); });
+
+  if (num_dropped == 0)
+    return (*cntx)->SendError(kUnknownIndexErr);
+  (*cntx)->SendOk();
+}
+
+void FtList(CmdArgList args, ConnectionContext* cntx) {
+  vector<string> names = shard_set->Await(
+      0, [] { return EngineShard::tlocal()->search_indices().GetIndexNames(); });
+  sort(names.begin(), names.end());
+  (*cntx)->SendStringArr(names);
+}
+
+void FtInfo(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  shared_ptr<const DocIndex> index = GetIndexDefinition(name);
+  if (!index)
+    return (*cntx)->SendError(kUnknownIndexErr);
+
+  atomic_size_t num_docs = 0;
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    if (ShardDocIndex* shard_index = shard->search_indices().GetIndex(name))
+      num_docs += shard_index->num_docs();
+  });
+
+  constexpr const char* kTypeNames[] = {"TEXT", "NUMERIC", "TAG", "VECTOR"};
+
+  (*cntx)->StartArray(8);
+  (*cntx)->SendBulkString("index_name");
+  (*cntx)->SendBulkString(name);
+  (*cntx)->SendBulkString("index_definition");
+  (*cntx)->StartArray(4);
+  (*cntx)->SendBulkString("key_type");
+  (*cntx)->SendBulkString(index->type == DocIndex::HASH ? "HASH" : "JSON");
+  (*cntx)->SendBulkString("prefixes");
+  (*cntx)->SendStringArr(index->prefixes);
+  (*cntx)->SendBulkString("attributes");
+  (*cntx)->StartArray(index->schema.fields.size());
+  for (const FieldSchema& field : index->schema.fields) {
+    (*cntx)->StartArray(6);
+    (*cntx)->SendBulkString("identifier");
+    (*cntx)->SendBulkString(field.identifier);
+    (*cntx)->SendBulkString("attribute");
+    (*cntx)->SendBulkString(field.alias);
+    (*cntx)->SendBulkString("type");
+    (*cntx)->SendBulkString(kTypeNames[field.type]);
+  }
+  (*cntx)->SendBulkString("num_docs");
+  (*cntx)->SendLong(num_docs);
+}
+
+// FT.SEARCH index query [NOCONTENT] [RETURN count field...] [SORTBY field [ASC|DESC]]
+//   [LIMIT offset num] [PARAMS count name value...] [DIALECT dialect]
+void FtSearch(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  string_view query_str = ArgS(args, 2);
+
+  shared_ptr<const DocIndex> index = GetIndexDefinition(name);
+  if (!index)
+    return (*cntx)->SendError(kUnknownIndexErr);
+
+  SearchParams params;
+  for (size_t i = 3; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "NOCONTENT") {
+      params.no_content = true;
+    } else if (arg == "LIMIT" && i + 2 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &params.offset) ||
+          !absl::SimpleAtoi(ArgS(args, i + 2), &params.limit)) {
+        return (*cntx)->SendError(kInvalidIntErr);
+      }
+      i += 2;
+    } else if (arg == "SORTBY" && i + 1 < args.size()) {
+      string_view field = ArgS(args, ++i);
+      params.sort_field = index->schema.Find(field);
+      if (params.sort_field < 0)
+        return (*cntx)->SendError(absl::StrCat("Property `", field, "` not loaded nor in schema"));
+      if (index->schema.fields[params.sort_field].type == FieldSchema::VECTOR)
+        return (*cntx)->SendError(absl::StrCat("Property `", field, "` is not sortable"));
+
+      if (i + 1 < args.size()) {
+        ToUpper(&args[i + 1]);
+        string_view order = ArgS(args, i + 1);
+        if (order == "ASC" || order == "DESC") {
+          params.sort_desc = order == "DESC";
+          ++i;
+        }
+      }
+    } else if (arg == "RETURN" && i + 1 < args.size()) {
+      uint32_t num_fields;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &num_fields))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (num_fields > args.size() - i - 1)
+        return (*cntx)->SendError(kSyntaxErr);
+
+      // Like RediSearch, RETURN 0 returns no content.
+      params.no_content |= num_fields == 0;
+      for (uint32_t j = 0; j < num_fields; ++j)
+        params.return_fields.emplace_back(ArgS(args, ++i));
+    } else if (arg == "PARAMS" && i + 1 < args.size()) {
+      uint32_t num_args;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &num_args))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (num_args % 2 != 0 || num_args > args.size() - i - 1)
+        return (*cntx)->SendError(kSyntaxErr);
+
+      for (uint32_t j = 0; j < num_args; j += 2) {
+        string_view param = ArgS(args, i + 1);
+        params.query_params[param] = ArgS(args, i + 2);
+        i += 2;
+      }
+    } else if (arg == "DIALECT" && i + 1 < args.size()) {
+      // The KNN clause is parsed by all the dialects.
+      ++i;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  string error;
+  optional<search::SearchQuery> query =
+      search::ParseSearchQuery(query_str, index->schema, params.query_params, &error);
+  if (!query)
+    return (*cntx)->SendError(error);
+
+  vector<ShardResult> shard_results(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard_results[shard->shard_id()] = SearchShard(shard, name, *index, *query, params);
+  });
+
+  // Every shard returned its first offset + limit documents, the first ones of their union are
+  // the results.
+  size_t total = 0;
+  vector<SearchHit> hits;
+  for (ShardResult& res : shard_results) {
+    total += res.total;
+    move(res.hits.begin(), res.hits.end(), back_inserter(hits));
+  }
+
+  bool numeric = params.sort_field >= 0 &&
+                 index->schema.fields[params.sort_field].type == FieldSchema::NUMERIC;
+  auto hit_less = [&](const SearchHit& a, const SearchHit& b) {
+    return HitLess(params, numeric, a.key, a.value(), b.key, b.value());
+  };
+
+  if (query->knn) {
+    // The k nearest documents of all the shards are the results, ordered by their distance
+    // unless SORTBY orders them.
+    sort(hits.begin(), hits.end(), [](const SearchHit& a, const SearchHit& b) {
+      return a.distance != b.distance ? a.distance < b.distance : a.key < b.key;
+    });
+    hits.resize(min(hits.size(), query->knn->k));
+    total = hits.size();
+    if (params.sort_field >= 0)
+      stable_sort(hits.begin(), hits.end(), hit_less);
+  } else {
+    sort(hits.begin(), hits.end(), hit_less);
+  }
+
+  size_t start = min(params.offset, hits.size());
+  size_t end = min(hits.size(), start + params.limit);
+
+  (*cntx)->StartArray(1 + (end - start) * (params.no_content ? 1 : 2));
+  (*cntx)->SendLong(total);
+  for (size_t i = start; i < end; ++i) {
+    (*cntx)->SendBulkString(hits[i].key);
+    if (params.no_content)
+      continue;
+
+    (*cntx)->StartArray(hits[i].content.size() * 2);
+    for (const auto& [field, value] : hits[i].content) {
+      (*cntx)->SendBulkString(field);
+      (*cntx)->SendBulkString(value);
+    }
+  }
+}
+
+}  // namespace
+
+void SearchFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"FT.CREATE", CO::WRITE | CO::NOSCRIPT, -5, 0, 0, 0}.SetHandler(&FtCreate)
+            << CI{"FT.DROPINDEX", CO::WRITE | CO::NOSCRIPT, 2, 0, 0, 0}.SetHandler(&FtDropIndex)
+            << CI{"FT._LIST", CO::READONLY, 1, 0, 0, 0}.SetHandler(&FtList)
+            << CI{"FT.INFO", CO::READONLY, 2, 0, 0, 0}.SetHandler(&FtInfo)
+            << CI{"FT.SEARCH", CO::READONLY, -3, 0, 0, 0}.SetHandler(&FtSearch);
+}
+
+}  // namespace dfly
@@ -0,0 +1,19 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace dfly {
+
+class CommandRegistry;
+
+// The secondary indices of RediSearch over hashes and json documents: FT.CREATE, FT.SEARCH,
+// FT.INFO, FT.DROPINDEX and FT._LIST. Every shard indexes its own keys, see doc_index.h, and
+// FT.SEARCH merges the top results of the shards.
+class SearchFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
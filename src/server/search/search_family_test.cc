@@ -0,0 +1,234 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/search_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class SearchFamilyTest : public BaseFamilyTest {
+ protected:
+  // The keys of the FT.SEARCH reply, which must be NOCONTENT.
+  static vector<string> Keys(const RespExpr& resp) {
+    vector<string> res;
+    if (resp.type != RespExpr::ARRAY)
+      return res;
+
+    const auto& vec = resp.GetVec();
+    for (size_t i = 1; i < vec.size(); ++i)
+      res.emplace_back(ToSV(vec[i].GetBuf()));
+    return res;
+  }
+};
+
+TEST_F(SearchFamilyTest, CreateDrop) {
+  EXPECT_EQ(Run({"ft.create", "idx", "schema", "title", "text"}), "OK");
+  EXPECT_THAT(Run({"ft.create", "idx", "schema", "title", "text"}), ErrArg("already exists"));
+  EXPECT_EQ(Run({"ft._list"}), "idx");
+
+  EXPECT_THAT(Run({"ft.create", "x", "on", "set", "schema", "a", "text"}), ErrArg("syntax"));
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "a", "geo"}), ErrArg("Invalid field type"));
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "a", "text", "a", "tag"}), ErrArg("Duplicate"));
+  EXPECT_THAT(Run({"ft.create", "x", "on", "json", "schema", "$.[", "text"}),
+              ErrArg("Invalid JSONPath"));
+  EXPECT_THAT(Run({"ft.create", "x", "prefix", "1", "a:", "b"}), ErrArg("syntax"));
+
+  EXPECT_EQ(Run({"ft.dropindex", "idx"}), "OK");
+  EXPECT_THAT(Run({"ft.dropindex", "idx"}), ErrArg("Unknown Index name"));
+  EXPECT_THAT(Run({"ft.search", "idx", "*"}), ErrArg("Unknown Index name"));
+}
+
+TEST_F(SearchFamilyTest, Hashes) {
+  Run({"hset", "book:1", "title", "The Hobbit", "year", "1937", "genre", "fantasy,adventure"});
+  Run({"hset", "book:2", "title", "Dune", "year", "1965", "genre", "scifi"});
+  Run({"hset", "other:1", "title", "The Hobbit"});
+
+  // The existing keys are indexed by FT.CREATE.
+  EXPECT_EQ(Run({"ft.create", "books", "on", "hash", "prefix", "1", "book:", "schema", "title",
+                 "text", "year", "numeric", "genre", "tag"}),
+            "OK");
+  Run({"hset", "book:3", "title", "The Lord of the Rings", "year", "1954", "genre", "fantasy"});
+
+  auto resp = Run({"ft.search", "books", "hobbit"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(1));
+  EXPECT_EQ(resp.GetVec()[1], "book:1");
+  ASSERT_THAT(resp.GetVec()[2], ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("title", "The Hobbit", "year", "1937",
+                                                     "genre", "fantasy,adventure"));
+
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "the", "nocontent"})),
+              ElementsAre("book:1", "book:3"));
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "@genre:{fantasy}", "nocontent"})),
+              ElementsAre("book:1", "book:3"));
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "@year:[1950 +inf] -dune", "nocontent"})),
+              ElementsAre("book:3"));
+
+  // The documents follow the updates and the deletions of their keys.
+  Run({"hset", "book:1", "title", "There and Back Again"});
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "hobbit", "nocontent"})), IsEmpty());
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "back", "nocontent"})), ElementsAre("book:1"));
+  Run({"del", "book:3"});
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "@genre:{fantasy}", "nocontent"})),
+              ElementsAre("book:1"));
+  Run({"set", "book:2", "not a hash"});
+  EXPECT_THAT(Keys(Run({"ft.search", "books", "*", "nocontent"})), ElementsAre("book:1"));
+
+  resp = Run({"ft.search", "books", "*", "return", "1", "year"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("year", "1937"));
+
+  EXPECT_THAT(Run({"ft.search", "books", "@foo:bar"}), ErrArg("Unknown field"));
+  EXPECT_THAT(Run({"ft.search", "books", "(hobbit"}), ErrArg("Syntax error"));
+  EXPECT_THAT(Run({"ft.search", "books", "*", "foo"}), ErrArg("syntax error"));
+
+  Run({"flushall"});
+  EXPECT_THAT(Run({"ft.search", "books", "*"}), IntArg(0));
+}
+
+TEST_F(SearchFamilyTest, SortLimit) {
+  EXPECT_EQ(Run({"ft.create", "idx", "prefix", "1", "doc:", "schema", "n", "numeric"}), "OK");
+  for (unsigned i = 0; i < 100; ++i)
+    Run({"hset", StrCat("doc:", i), "n", StrCat(i % 10)});
+
+  // The documents are spread over the shards, the results merge their top ones.
+  auto resp = Run({"ft.search", "idx", "@n:[7 +inf]", "nocontent", "limit", "0", "3"});
+  ASSERT_THAT(resp, ArrLen(4));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(30));
+  EXPECT_THAT(Keys(resp), ElementsAre("doc:17", "doc:18", "doc:19"));
+
+  // The ties are ordered by key.
+  resp = Run({"ft.search", "idx", "*", "nocontent", "sortby", "n", "desc", "limit", "5", "3"});
+  EXPECT_THAT(resp.GetVec()[0], IntArg(100));
+  EXPECT_THAT(Keys(resp), ElementsAre("doc:69", "doc:79", "doc:89"));
+
+  resp = Run({"ft.search", "idx", "*", "nocontent", "sortby", "n", "limit", "0", "2"});
+  EXPECT_THAT(Keys(resp), ElementsAre("doc:0", "doc:10"));
+
+  resp = Run({"ft.search", "idx", "*", "limit", "0", "0"});
+  EXPECT_THAT(resp, IntArg(100));
+}
+
+TEST_F(SearchFamilyTest, Json) {
+  EXPECT_EQ(Run({"ft.create", "idx", "on", "json", "prefix", "1", "j:", "schema", "$.name", "as",
+                 "name", "text", "$.age", "as", "age", "numeric", "$.tags", "as", "tags", "tag"}),
+            "OK");
+  Run({"set", "j:1", R"({"name": "John Doe", "age": 30, "tags": ["admin", "dev"]})"});
+  Run({"set", "j:2", R"({"name": "Jane Doe", "age": 25, "tags": ["dev"]})"});
+  Run({"set", "j:3", "not json"});
+
+  EXPECT_THAT(Keys(Run({"ft.search", "idx", "doe", "nocontent"})), ElementsAre("j:1", "j:2"));
+  EXPECT_THAT(Keys(Run({"ft.search", "idx", "@age:[26 40]", "nocontent"})), ElementsAre("j:1"));
+  EXPECT_THAT(Keys(Run({"ft.search", "idx", "@tags:{admin}", "nocontent"})), ElementsAre("j:1"));
+
+  auto resp = Run({"ft.search", "idx", "jane"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[2].GetVec(),
+              ElementsAre("$", R"({"name": "Jane Doe", "age": 25, "tags": ["dev"]})"));
+
+  resp = Run({"ft.search", "idx", "jane", "return", "1", "age"});
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("age", "25"));
+
+  Run({"set", "j:2", R"({"name": "Jane Roe"})"});
+  EXPECT_THAT(Keys(Run({"ft.search", "idx", "doe", "nocontent"})), ElementsAre("j:1"));
+
+  resp = Run({"ft.info", "idx"});
+  ASSERT_THAT(resp, ArrLen(8));
+  EXPECT_THAT(resp.GetVec()[7], IntArg(2));
+}
+
+TEST_F(SearchFamilyTest, Vectors) {
+  auto blob = [](vector<float> vec) {
+    return string(reinterpret_cast<const char*>(vec.data()), vec.size() * sizeof(float));
+  };
+
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "v", "vector", "flat", "2", "dim", "2"}),
+              ErrArg("Missing mandatory parameters"));
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "v", "vector", "flat", "4", "type", "float64",
+                   "dim", "2"}),
+              ErrArg("Unsupported vector type"));
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "v", "vector", "ivf", "0"}),
+              ErrArg("Bad arguments"));
+  EXPECT_THAT(Run({"ft.create", "x", "schema", "v", "vector", "flat", "3", "dim"}),
+              ErrArg("syntax"));
+
+  for (string_view algorithm : {"flat", "hnsw"}) {
+    string name = StrCat("idx_", algorithm);
+    EXPECT_EQ(Run({"ft.create", name, "prefix", "1", "doc:", "schema", "color", "tag", "v",
+                   "vector", algorithm, "6", "type", "float32", "dim", "2", "distance_metric",
+                   "l2"}),
+              "OK");
+  }
+
+  // The documents, spread over the shards, lie on a line.
+  for (unsigned i = 0; i < 50; ++i) {
+    Run({"hset", StrCat("doc:", i), "color", i % 2 ? "red" : "blue", "v", blob({float(i), 0})});
+  }
+  Run({"hset", "doc:bad", "color", "red", "v", "not a vector"});
+
+  for (string name : {"idx_flat", "idx_hnsw"}) {
+    auto resp = Run({"ft.search", name, "*=>[KNN 3 @v $vec]", "params", "2", "vec",
+                     blob({20.25, 0}), "return", "1", "__v_score", "dialect", "2"});
+    ASSERT_THAT(resp, ArrLen(7)) << name;
+    EXPECT_THAT(resp.GetVec()[0], IntArg(3));
+    EXPECT_EQ(resp.GetVec()[1], "doc:20");
+    EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("__v_score", "0.0625"));
+    EXPECT_EQ(resp.GetVec()[3], "doc:21");
+    EXPECT_EQ(resp.GetVec()[5], "doc:19");
+
+    // Only among the documents of the filter.
+    resp = Run({"ft.search", name, "@color:{red}=>[KNN $k @v $vec AS dist]", "params", "4", "k",
+                "2", "vec", blob({20.25, 0}), "nocontent"});
+    EXPECT_THAT(Keys(resp), ElementsAre("doc:21", "doc:19"));
+
+    // SORTBY orders the nearest documents.
+    resp = Run({"ft.search", name, "*=>[KNN 4 @v $vec]", "params", "2", "vec", blob({0, 0}),
+                "sortby", "color", "desc", "nocontent"});
+    EXPECT_THAT(Keys(resp), ElementsAre("doc:1", "doc:3", "doc:0", "doc:2"));
+
+    EXPECT_THAT(Run({"ft.search", name, "*=>[KNN 3 @v $vec]", "params", "2", "vec", "short"}),
+                ErrArg("float32"));
+    EXPECT_THAT(Run({"ft.search", name, "*=>[KNN 3 @v $v]"}), ErrArg("No such parameter"));
+    EXPECT_THAT(Run({"ft.search", name, "*", "sortby", "v"}), ErrArg("not sortable"));
+  }
+
+  Run({"del", "doc:20"});
+  auto resp = Run({"ft.search", "idx_hnsw", "*=>[KNN 1 @v $vec]", "params", "2", "vec",
+                   blob({20.25, 0}), "nocontent"});
+  EXPECT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[1], "doc:21");
+}
+
+TEST_F(SearchFamilyTest, JsonVectors) {
+  EXPECT_EQ(Run({"ft.create", "idx", "on", "json", "schema", "$.v", "as", "v", "vector", "hnsw",
+                 "6", "type", "float32", "dim", "3", "distance_metric", "cosine"}),
+            "OK");
+  Run({"set", "j:1", R"({"v": [1, 0, 0]})"});
+  Run({"set", "j:2", R"({"v": [0.1, 1, 0]})"});
+  Run({"set", "j:3", R"({"v": [1, "a", 0]})"});
+
+  vector<float> query = {2, 0.1, 0};
+  string blob(reinterpret_cast<const char*>(query.data()), query.size() * sizeof(float));
+  auto resp = Run({"ft.search", "idx", "*=>[KNN 5 @v $q]", "params", "2", "q", blob, "return",
+                   "1", "v"});
+  ASSERT_THAT(resp, ArrLen(5));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(2));
+  EXPECT_EQ(resp.GetVec()[1], "j:1");
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("v", "[1,0,0]"));
+  EXPECT_EQ(resp.GetVec()[3], "j:2");
+}
+
+}  // namespace dfly
@@ -0,0 +1,299 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <gmock/gmock.h>
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "server/search/index.h"
+#include "server/search/query.h"
+#include "server/search/vector_index.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+
+namespace search {
+
+class SearchTest : public Test {
+ protected:
+  SearchTest() : indices_(schema_) {
+  }
+
+  static Schema MakeSchema() {
+    Schema schema;
+    schema.fields = {{"title", "title", FieldSchema::TEXT},
+                     {"body", "body", FieldSchema::TEXT},
+                     {"price", "price", FieldSchema::NUMERIC},
+                     {"tags", "tags", FieldSchema::TAG}};
+    return schema;
+  }
+
+  void Add(DocId doc, DocFields fields) {
+    indices_.Add(doc, fields);
+    docs_.emplace_back(doc, std::move(fields));
+  }
+
+  // The documents that match query, or the parse error.
+  DocIds Query(string_view query) {
+    string error;
+    optional<AstNode> ast = ParseQuery(query, schema_, &error);
+    if (!ast) {
+      ADD_FAILURE() << query << ": " << error;
+      return {};
+    }
+    return Evaluate(*ast, indices_);
+  }
+
+  string ParseError(string_view query) {
+    string error;
+    EXPECT_FALSE(ParseQuery(query, schema_, &error)) << query;
+    return error;
+  }
+
+  void AddDocs() {
+    Add(0, {"Hello World", "The quick brown fox", "10", "red,Blue"});
+    Add(1, {"Goodbye World", "jumps over the lazy dog", "20.5", "green"});
+    Add(2, {"hello there", nullopt, "-3", "blue, yellow"});
+    Add(3, {nullopt, "quick-silver", nullopt, nullopt});
+  }
+
+  Schema schema_ = MakeSchema();
+  FieldIndices indices_;
+  vector<pair<DocId, DocFields>> docs_;
+};
+
+TEST_F(SearchTest, Tokenize) {
+  EXPECT_THAT(Tokenize("Hello, World! foo_bar 42"), ElementsAre("hello", "world", "foo_bar", "42"));
+  EXPECT_THAT(Tokenize("  "), IsEmpty());
+  EXPECT_THAT(SplitTags(" Red, blue ,,green"), ElementsAre("red", "blue", "green"));
+}
+
+TEST_F(SearchTest, Terms) {
+  AddDocs();
+  EXPECT_THAT(Query("*"), ElementsAre(0, 1, 2, 3));
+  EXPECT_THAT(Query("hello"), ElementsAre(0, 2));
+  EXPECT_THAT(Query("HELLO world"), ElementsAre(0));
+  EXPECT_THAT(Query("hello | goodbye"), ElementsAre(0, 1, 2));
+  EXPECT_THAT(Query("world -hello"), ElementsAre(1));
+  EXPECT_THAT(Query("-world"), ElementsAre(2, 3));
+  EXPECT_THAT(Query("(hello | goodbye) world"), ElementsAre(0, 1));
+  EXPECT_THAT(Query("quick"), ElementsAre(0, 3));
+  EXPECT_THAT(Query("qu*"), ElementsAre(0, 3));
+  EXPECT_THAT(Query("\"quick brown\""), ElementsAre(0));
+  EXPECT_THAT(Query("missing"), IsEmpty());
+}
+
+TEST_F(SearchTest, Fields) {
+  AddDocs();
+  EXPECT_THAT(Query("@title:world"), ElementsAre(0, 1));
+  EXPECT_THAT(Query("@body:world"), IsEmpty());
+  EXPECT_THAT(Query("@title:(hello | goodbye) @body:quick"), ElementsAre(0));
+
+  EXPECT_THAT(Query("@price:[0 20.5]"), ElementsAre(0, 1));
+  EXPECT_THAT(Query("@price:[0 (20.5]"), ElementsAre(0));
+  EXPECT_THAT(Query("@price:[(10 +inf]"), ElementsAre(1));
+  EXPECT_THAT(Query("@price:[-inf 0]"), ElementsAre(2));
+  EXPECT_THAT(Query("-@price:[-inf +inf]"), ElementsAre(3));
+
+  EXPECT_THAT(Query("@tags:{blue}"), ElementsAre(0, 2));
+  EXPECT_THAT(Query("@tags:{RED | green}"), ElementsAre(0, 1));
+  EXPECT_THAT(Query("@tags:{blue} hello @price:[0 100]"), ElementsAre(0));
+}
+
+TEST_F(SearchTest, Remove) {
+  AddDocs();
+  indices_.Remove(0, docs_[0].second);
+  EXPECT_THAT(Query("*"), ElementsAre(1, 2, 3));
+  EXPECT_THAT(Query("hello"), ElementsAre(2));
+  EXPECT_THAT(Query("@price:[0 100]"), ElementsAre(1));
+  EXPECT_THAT(Query("@tags:{blue}"), ElementsAre(2));
+
+  // The id is reused by an other document.
+  Add(0, {"bonjour", nullopt, "5", nullopt});
+  EXPECT_THAT(Query("bonjour"), ElementsAre(0));
+  EXPECT_THAT(Query("@price:[0 10]"), ElementsAre(0));
+
+  indices_.Clear();
+  EXPECT_THAT(Query("*"), IsEmpty());
+  EXPECT_THAT(Query("bonjour"), IsEmpty());
+}
+
+TEST_F(SearchTest, ParseErrors) {
+  EXPECT_THAT(ParseError(""), HasSubstr("empty"));
+  EXPECT_THAT(ParseError("(hello"), HasSubstr("expected ')'"));
+  EXPECT_THAT(ParseError("hello)"), HasSubstr("unexpected"));
+  EXPECT_THAT(ParseError("@foo:bar"), HasSubstr("Unknown field foo"));
+  EXPECT_THAT(ParseError("@price:[1]"), HasSubstr("range"));
+  EXPECT_THAT(ParseError("@price:[a 2]"), HasSubstr("range"));
+  EXPECT_THAT(ParseError("@tags:{red"), HasSubstr("expected '}'"));
+  EXPECT_THAT(ParseError("@tags:red"), HasSubstr("expected '{'"));
+  EXPECT_THAT(ParseError("\"hello"), HasSubstr("quote"));
+}
+
+string VectorBlob(const vector<float>& vec) {
+  return string(reinterpret_cast<const char*>(vec.data()), vec.size() * sizeof(float));
+}
+
+TEST_F(SearchTest, KnnQuery) {
+  Schema schema;
+  schema.fields = {{"title", "title", FieldSchema::TEXT}, {"vec", "v", FieldSchema::VECTOR}};
+  schema.fields[1].vector.dim = 2;
+
+  string error;
+  QueryParams params{{"blob", VectorBlob({1, 2})}, {"k", "5"}};
+  optional<SearchQuery> query =
+      ParseSearchQuery("hello=>[KNN $k @v $blob]", schema, params, &error);
+  ASSERT_TRUE(query) << error;
+  EXPECT_EQ(AstNode::TERM, query->filter.kind);
+  ASSERT_TRUE(query->knn);
+  EXPECT_EQ(1, query->knn->field);
+  EXPECT_EQ(5u, query->knn->k);
+  EXPECT_EQ(params["blob"], query->knn->blob);
+  EXPECT_EQ("__v_score", query->knn->score);
+
+  query = ParseSearchQuery("* => [knn 3 @v $blob AS dist]", schema, params, &error);
+  ASSERT_TRUE(query) << error;
+  EXPECT_EQ(AstNode::STAR, query->filter.kind);
+  EXPECT_EQ("dist", query->knn->score);
+
+  EXPECT_FALSE(ParseSearchQuery("*=>[KNN 3 @v $missing]", schema, params, &error));
+  EXPECT_THAT(error, HasSubstr("No such parameter"));
+  EXPECT_FALSE(ParseSearchQuery("*=>[KNN 3 @title $blob]", schema, params, &error));
+  EXPECT_THAT(error, HasSubstr("not a vector field"));
+  params["blob"] = VectorBlob({1, 2, 3});
+  EXPECT_FALSE(ParseSearchQuery("*=>[KNN 3 @v $blob]", schema, params, &error));
+  EXPECT_THAT(error, HasSubstr("2 float32"));
+  EXPECT_FALSE(ParseSearchQuery("*=>[KNN 3 @v]", schema, params, &error));
+  EXPECT_FALSE(ParseSearchQuery("@v:foo", schema, params, &error));
+  EXPECT_THAT(error, HasSubstr("KNN"));
+}
+
+class VectorIndexTest : public TestWithParam<VectorParams::Algorithm> {
+ protected:
+  unique_ptr<VectorIndex> MakeIndex(uint32_t dim, VectorParams::Metric metric) {
+    VectorParams params;
+    params.algorithm = GetParam();
+    params.metric = metric;
+    params.dim = dim;
+    params.ef_construction = 64;
+    params.ef_runtime = 64;
+    return VectorIndex::Create(params);
+  }
+
+  vector<float> RandomVector(size_t dim) {
+    uniform_real_distribution<float> dist(-1, 1);
+    vector<float> res(dim);
+    for (float& val : res)
+      val = dist(gen_);
+    return res;
+  }
+
+  static vector<DocId> Docs(const vector<KnnHit>& hits) {
+    vector<DocId> res;
+    for (const auto& hit : hits)
+      res.push_back(hit.second);
+    return res;
+  }
+
+  mt19937 gen_{7};
+};
+
+TEST_P(VectorIndexTest, Metrics) {
+  auto l2 = MakeIndex(2, VectorParams::L2);
+  auto ip = MakeIndex(2, VectorParams::IP);
+  auto cosine = MakeIndex(2, VectorParams::COSINE);
+  vector<vector<float>> vecs = {{1, 0}, {0, 1}, {3, 3}, {-1, -1}};
+  for (DocId doc = 0; doc < vecs.size(); ++doc) {
+    for (auto* index : {l2.get(), ip.get(), cosine.get()})
+      EXPECT_TRUE(index->Add(doc, VectorBlob(vecs[doc])));
+  }
+
+  string query = VectorBlob({1, 1});
+  vector<KnnHit> hits = l2->Knn(query, 4, nullptr);
+  EXPECT_THAT(Docs(hits), ElementsAre(0, 1, 2, 3));
+  EXPECT_FLOAT_EQ(1, hits[0].first);
+  EXPECT_FLOAT_EQ(8, hits[2].first);
+
+  EXPECT_THAT(Docs(ip->Knn(query, 2, nullptr)), ElementsAre(2, 0));
+  hits = cosine->Knn(query, 4, nullptr);
+  EXPECT_THAT(Docs(hits), ElementsAre(2, 0, 1, 3));
+  EXPECT_NEAR(0, hits[0].first, 1e-6);
+  EXPECT_NEAR(2, hits[3].first, 1e-6);
+
+  // The malformed vectors are not indexed.
+  EXPECT_FALSE(l2->Add(0, "abc"));
+  EXPECT_EQ(3u, l2->size());
+  EXPECT_THAT(l2->Knn("abc", 4, nullptr), IsEmpty());
+}
+
+TEST_P(VectorIndexTest, RemoveAndFilter) {
+  auto index = MakeIndex(1, VectorParams::L2);
+  for (DocId doc = 0; doc < 100; ++doc)
+    index->Add(doc, VectorBlob({float(doc)}));
+
+  EXPECT_THAT(Docs(index->Knn(VectorBlob({10.2}), 3, nullptr)), ElementsAre(10, 11, 9));
+  index->Remove(10);
+  index->Add(11, VectorBlob({50.5}));
+  EXPECT_THAT(Docs(index->Knn(VectorBlob({10.2}), 3, nullptr)), ElementsAre(9, 12, 8));
+
+  DocIds filter = {1, 2, 10, 50, 99};
+  EXPECT_THAT(Docs(index->Knn(VectorBlob({49}), 3, &filter)), ElementsAre(50, 2, 1));
+
+  index->Clear();
+  EXPECT_EQ(0u, index->size());
+  EXPECT_THAT(index->Knn(VectorBlob({1}), 3, nullptr), IsEmpty());
+}
+
+// Compares the results with the exact nearest documents, which HNSW approximates.
+TEST_P(VectorIndexTest, Recall) {
+  constexpr uint32_t kDim = 16, kNumDocs = 3000, kNumQueries = 50, kK = 10;
+  auto index = MakeIndex(kDim, VectorParams::L2);
+  vector<vector<float>> vecs;
+  for (DocId doc = 0; doc < kNumDocs; ++doc) {
+    vecs.push_back(RandomVector(kDim));
+    index->Add(doc, VectorBlob(vecs.back()));
+  }
+
+  // The removed documents are replaced, which rebuilds the graph of HNSW.
+  for (DocId doc = 0; doc < 2000; ++doc)
+    index->Remove(doc);
+  for (DocId doc = 0; doc < 2000; doc += 2)
+    index->Add(doc, VectorBlob(vecs[doc]));
+
+  size_t found = 0;
+  for (unsigned i = 0; i < kNumQueries; ++i) {
+    vector<float> query = RandomVector(kDim);
+    vector<pair<float, DocId>> exact;
+    for (DocId doc = 0; doc < kNumDocs; ++doc) {
+      if (doc >= 2000 || doc % 2 == 0) {
+        float dist = 0;
+        for (unsigned j = 0; j < kDim; ++j)
+          dist += (query[j] - vecs[doc][j]) * (query[j] - vecs[doc][j]);
+        exact.emplace_back(dist, doc);
+      }
+    }
+    partial_sort(exact.begin(), exact.begin() + kK, exact.end());
+
+    vector<KnnHit> hits = index->Knn(VectorBlob(query), kK, nullptr);
+    ASSERT_EQ(kK, hits.size());
+    for (unsigned j = 0; j < kK; ++j) {
+      auto pred = [&](const KnnHit& hit) { return hit.second == exact[j].second; };
+      found += any_of(hits.begin(), hits.end(), pred);
+    }
+  }
+
+  double recall = double(found) / (kNumQueries * kK);
+  EXPECT_GE(recall, GetParam() == VectorParams::FLAT ? 1.0 : 0.9);
+}
+
+INSTANTIATE_TEST_SUITE_P(Algorithms, VectorIndexTest,
+                         Values(VectorParams::FLAT, VectorParams::HNSW));
+
+}  // namespace search
+
+}  // namespace dfly
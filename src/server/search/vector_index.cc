@@ -0,0 +1,467 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search/vector_index.h"
+
+#include <absl/container/flat_hash_map.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <random>
+
+#include "base/logging.h"
+#include "core/vector_distance.h"
+
+namespace dfly {
+
+namespace search {
+
+using namespace std;
+
+namespace {
+
+// Larger filters are searched in the graph of a HNSW index instead of being scanned.
+constexpr size_t kMaxScanSize = 2048;
+
+// The k nearest of the pushed documents.
+class TopK {
+ public:
+  explicit TopK(size_t k) : k_(k) {
+  }
+
+  void Push(float dist, DocId doc) {
+    if (heap_.size() < k_) {
+      heap_.emplace(dist, doc);
+    } else if (k_ > 0 && KnnHit{dist, doc} < heap_.top()) {
+      heap_.pop();
+      heap_.emplace(dist, doc);
+    }
+  }
+
+  // Nearest first.
+  vector<KnnHit> Take() {
+    vector<KnnHit> res(heap_.size());
+    for (size_t i = res.size(); i > 0; --i) {
+      res[i - 1] = heap_.top();
+      heap_.pop();
+    }
+    return res;
+  }
+
+ private:
+  size_t k_;
+  priority_queue<KnnHit> heap_;  // The farthest on top.
+};
+
+}  // namespace
+
+template <typename Get>
+vector<KnnHit> VectorIndex::ScanFilter(const float* query, size_t k, const DocIds& filter,
+                                       Get&& get) const {
+  TopK top(k);
+  for (DocId doc : filter) {
+    if (const float* vec = get(doc))
+      top.Push(Distance(query, vec), doc);
+  }
+  return top.Take();
+}
+
+optional<vector<float>> VectorIndex::ParseVector(string_view blob) const {
+  if (blob.size() != size_t(params_.dim) * sizeof(float))
+    return nullopt;
+
+  vector<float> res(params_.dim);
+  memcpy(res.data(), blob.data(), blob.size());
+  if (params_.metric == VectorParams::COSINE)
+    NormalizeVector(res.data(), res.size());
+  return res;
+}
+
+bool VectorIndex::Add(DocId doc, string_view blob) {
+  optional<vector<float>> vec = ParseVector(blob);
+  if (!vec) {
+    Remove(doc);
+    return false;
+  }
+
+  AddVector(doc, vec->data());
+  return true;
+}
+
+vector<KnnHit> VectorIndex::Knn(string_view blob, size_t k, const DocIds* filter) const {
+  optional<vector<float>> query = ParseVector(blob);
+  if (!query || k == 0)
+    return {};
+  return Search(query->data(), k, filter);
+}
+
+float VectorIndex::Distance(const float* a, const float* b) const {
+  if (params_.metric == VectorParams::L2)
+    return L2DistanceSquared(a, b, params_.dim);
+  return 1 - InnerProduct(a, b, params_.dim);
+}
+
+namespace {
+
+// Brute force search over vectors that are stored contiguously, by slot.
+class FlatIndex : public VectorIndex {
+ public:
+  explicit FlatIndex(const VectorParams& params) : VectorIndex(params) {
+  }
+
+  void Remove(DocId doc) final;
+  void Clear() final;
+
+  size_t size() const final {
+    return docs_.size();
+  }
+
+ protected:
+  void AddVector(DocId doc, const float* vec) final;
+  vector<KnnHit> Search(const float* query, size_t k, const DocIds* filter) const final;
+
+ private:
+  const float* VectorOf(uint32_t slot) const {
+    return data_.data() + size_t(slot) * params_.dim;
+  }
+
+  vector<float> data_;
+  vector<DocId> docs_;  // By slot.
+  absl::flat_hash_map<DocId, uint32_t> slots_;
+};
+
+void FlatIndex::AddVector(DocId doc, const float* vec) {
+  auto [it, added] = slots_.emplace(doc, docs_.size());
+  if (added) {
+    docs_.push_back(doc);
+    data_.insert(data_.end(), vec, vec + params_.dim);
+  } else {
+    copy(vec, vec + params_.dim, data_.begin() + size_t(it->second) * params_.dim);
+  }
+}
+
+void FlatIndex::Remove(DocId doc) {
+  auto it = slots_.find(doc);
+  if (it == slots_.end())
+    return;
+
+  // The last vector fills the hole.
+  uint32_t slot = it->second, last = docs_.size() - 1;
+  slots_.erase(it);
+  if (slot != last) {
+    copy(VectorOf(last), VectorOf(last) + params_.dim, data_.begin() + size_t(slot) * params_.dim);
+    docs_[slot] = docs_[last];
+    slots_[docs_[slot]] = slot;
+  }
+  docs_.pop_back();
+  data_.resize(size_t(last) * params_.dim);
+}
+
+void FlatIndex::Clear() {
+  data_.clear();
+  docs_.clear();
+  slots_.clear();
+}
+
+vector<KnnHit> FlatIndex::Search(const float* query, size_t k, const DocIds* filter) const {
+  if (filter) {
+    return ScanFilter(query, k, *filter, [this](DocId doc) -> const float* {
+      auto it = slots_.find(doc);
+      return it == slots_.end() ? nullptr : VectorOf(it->second);
+    });
+  }
+
+  TopK top(k);
+  for (uint32_t slot = 0; slot < docs_.size(); ++slot)
+    top.Push(Distance(query, VectorOf(slot)), docs_[slot]);
+  return top.Take();
+}
+
+// A hierarchical navigable small world graph (Malkov & Yashunin). The removed documents stay in
+// the graph as tombstones, which are still traversed but never returned, until they outnumber
+// the live ones and the graph is rebuilt.
+class HnswIndex : public VectorIndex {
+ public:
+  explicit HnswIndex(const VectorParams& params)
+      : VectorIndex(params), level_mult_(1 / log(max<double>(params.m, 2))) {
+  }
+
+  void Remove(DocId doc) final;
+  void Clear() final;
+
+  size_t size() const final {
+    return ids_.size();
+  }
+
+ protected:
+  void AddVector(DocId doc, const float* vec) final;
+  vector<KnnHit> Search(const float* query, size_t k, const DocIds* filter) const final;
+
+ private:
+  using Candidate = pair<float, uint32_t>;  // The distance and the node.
+
+  struct Node {
+    DocId doc;
+    bool deleted = false;
+    vector<vector<uint32_t>> links;  // The neighbors by layer.
+  };
+
+  const float* VectorOf(uint32_t node) const {
+    return data_.data() + size_t(node) * params_.dim;
+  }
+
+  int RandomLevel();
+  void Insert(uint32_t node);
+  void Rebuild();
+
+  // Moves ep to the node of the layer that is the nearest to vec, greedily.
+  void Greedy(const float* vec, int layer, uint32_t* ep, float* ep_dist) const;
+
+  // The ef nearest nodes of the layer for which accept(node) is true, nearest first.
+  template <typename Accept>
+  vector<Candidate> SearchLayer(const float* vec, uint32_t ep, float ep_dist, size_t ef, int layer,
+                                Accept&& accept) const;
+
+  // Keeps up to m of the candidates, nearest first, that are nearer to vec than to the kept
+  // ones, so that the links spread in all the directions.
+  vector<uint32_t> SelectNeighbors(const vector<Candidate>& candidates, size_t m) const;
+
+  void Connect(uint32_t from, uint32_t to, int layer);
+
+  vector<float> data_;  // By node.
+  vector<Node> nodes_;
+  absl::flat_hash_map<DocId, uint32_t> ids_;  // The live nodes.
+
+  uint32_t entry_ = 0;
+  int max_level_ = -1;
+  size_t num_deleted_ = 0;
+
+  mt19937 gen_;
+  double level_mult_;
+
+  // The marks of the visited nodes of a search, which equal visit_tag_. The searches run in the
+  // thread of the shard only.
+  mutable vector<uint32_t> visited_;
+  mutable uint32_t visit_tag_ = 0;
+};
+
+int HnswIndex::RandomLevel() {
+  uniform_real_distribution<double> dist(0, 1);
+  return min(static_cast<int>(-log(1 - dist(gen_)) * level_mult_), 16);
+}
+
+void HnswIndex::AddVector(DocId doc, const float* vec) {
+  Remove(doc);
+
+  uint32_t node = nodes_.size();
+  nodes_.push_back(Node{doc});
+  data_.insert(data_.end(), vec, vec + params_.dim);
+  ids_[doc] = node;
+  Insert(node);
+}
+
+void HnswIndex::Remove(DocId doc) {
+  auto it = ids_.find(doc);
+  if (it == ids_.end())
+    return;
+
+  nodes_[it->second].deleted = true;
+  ids_.erase(it);
+  ++num_deleted_;
+
+  if (num_deleted_ > 1024 && num_deleted_ > ids_.size())
+    Rebuild();
+}
+
+void HnswIndex::Clear() {
+  data_.clear();
+  nodes_.clear();
+  ids_.clear();
+  entry_ = 0;
+  max_level_ = -1;
+  num_deleted_ = 0;
+  visited_.clear();
+}
+
+void HnswIndex::Rebuild() {
+  vector<pair<uint32_t, DocId>> live;
+  live.reserve(ids_.size());
+  for (const auto& [doc, node] : ids_)
+    live.emplace_back(node, doc);
+  sort(live.begin(), live.end());
+
+  vector<float> data = std::move(data_);
+  Clear();
+  for (const auto& [node, doc] : live)
+    AddVector(doc, data.data() + size_t(node) * params_.dim);
+}
+
+void HnswIndex::Greedy(const float* vec, int layer, uint32_t* ep, float* ep_dist) const {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (uint32_t neighbor : nodes_[*ep].links[layer]) {
+      float dist = Distance(vec, VectorOf(neighbor));
+      if (dist < *ep_dist) {
+        *ep = neighbor;
+        *ep_dist = dist;
+        changed = true;
+      }
+    }
+  }
+}
+
+template <typename Accept>
+auto HnswIndex::SearchLayer(const float* vec, uint32_t ep, float ep_dist, size_t ef, int layer,
+                            Accept&& accept) const -> vector<Candidate> {
+  visited_.resize(nodes_.size());
+  if (++visit_tag_ == 0) {
+    fill(visited_.begin(), visited_.end(), 0);
+    visit_tag_ = 1;
+  }
+
+  priority_queue<Candidate, vector<Candidate>, greater<Candidate>> candidates;  // Nearest on top.
+  priority_queue<Candidate> results;                                           // Farthest on top.
+
+  visited_[ep] = visit_tag_;
+  candidates.emplace(ep_dist, ep);
+  if (accept(ep))
+    results.emplace(ep_dist, ep);
+
+  while (!candidates.empty()) {
+    auto [dist, node] = candidates.top();
+    if (results.size() >= ef && dist > results.top().first)
+      break;
+    candidates.pop();
+
+    for (uint32_t neighbor : nodes_[node].links[layer]) {
+      if (visited_[neighbor] == visit_tag_)
+        continue;
+      visited_[neighbor] = visit_tag_;
+
+      float neighbor_dist = Distance(vec, VectorOf(neighbor));
+      if (results.size() < ef || neighbor_dist < results.top().first) {
+        candidates.emplace(neighbor_dist, neighbor);
+        if (accept(neighbor)) {
+          results.emplace(neighbor_dist, neighbor);
+          if (results.size() > ef)
+            results.pop();
+        }
+      }
+    }
+  }
+
+  vector<Candidate> res(results.size());
+  for (size_t i = res.size(); i > 0; --i) {
+    res[i - 1] = results.top();
+    results.pop();
+  }
+  return res;
+}
+
+vector<uint32_t> HnswIndex::SelectNeighbors(const vector<Candidate>& candidates, size_t m) const {
+  vector<uint32_t> res;
+  for (const auto& [dist, node] : candidates) {
+    if (res.size() >= m)
+      break;
+
+    bool diverse = all_of(res.begin(), res.end(), [&, node = node, dist = dist](uint32_t kept) {
+      return Distance(VectorOf(node), VectorOf(kept)) >= dist;
+    });
+    if (diverse)
+      res.push_back(node);
+  }
+  return res;
+}
+
+void HnswIndex::Connect(uint32_t from, uint32_t to, int layer) {
+  vector<uint32_t>& links = nodes_[from].links[layer];
+  size_t max_links = layer == 0 ? 2 * params_.m : params_.m;
+  if (links.size() < max_links) {
+    links.push_back(to);
+    return;
+  }
+
+  // Prunes the links of from, which may drop the new one.
+  vector<Candidate> candidates;
+  candidates.reserve(links.size() + 1);
+  for (uint32_t node : links)
+    candidates.emplace_back(Distance(VectorOf(from), VectorOf(node)), node);
+  candidates.emplace_back(Distance(VectorOf(from), VectorOf(to)), to);
+  sort(candidates.begin(), candidates.end());
+  links = SelectNeighbors(candidates, max_links);
+}
+
+void HnswIndex::Insert(uint32_t node) {
+  int level = RandomLevel();
+  nodes_[node].links.resize(level + 1);
+  if (max_level_ < 0) {
+    entry_ = node;
+    max_level_ = level;
+    return;
+  }
+
+  const float* vec = VectorOf(node);
+  uint32_t ep = entry_;
+  float ep_dist = Distance(vec, VectorOf(ep));
+  for (int layer = max_level_; layer > level; --layer)
+    Greedy(vec, layer, &ep, &ep_dist);
+
+  // The tombstones are linked too, they keep the graph connected.
+  for (int layer = min(level, max_level_); layer >= 0; --layer) {
+    vector<Candidate> candidates = SearchLayer(vec, ep, ep_dist, params_.ef_construction, layer,
+                                               [](uint32_t) { return true; });
+    nodes_[node].links[layer] = SelectNeighbors(candidates, params_.m);
+    for (uint32_t neighbor : nodes_[node].links[layer])
+      Connect(neighbor, node, layer);
+    tie(ep_dist, ep) = candidates.front();
+  }
+
+  if (level > max_level_) {
+    entry_ = node;
+    max_level_ = level;
+  }
+}
+
+vector<KnnHit> HnswIndex::Search(const float* query, size_t k, const DocIds* filter) const {
+  if (filter && filter->size() <= kMaxScanSize) {
+    return ScanFilter(query, k, *filter, [this](DocId doc) -> const float* {
+      auto it = ids_.find(doc);
+      return it == ids_.end() ? nullptr : VectorOf(it->second);
+    });
+  }
+
+  if (ids_.empty())
+    return {};
+
+  uint32_t ep = entry_;
+  float ep_dist = Distance(query, VectorOf(ep));
+  for (int layer = max_level_; layer > 0; --layer)
+    Greedy(query, layer, &ep, &ep_dist);
+
+  auto accept = [&](uint32_t node) {
+    const Node& n = nodes_[node];
+    return !n.deleted && (!filter || binary_search(filter->begin(), filter->end(), n.doc));
+  };
+  size_t ef = max<size_t>(params_.ef_runtime, k);
+  vector<Candidate> candidates = SearchLayer(query, ep, ep_dist, ef, 0, accept);
+
+  vector<KnnHit> res;
+  for (size_t i = 0; i < min(k, candidates.size()); ++i)
+    res.emplace_back(candidates[i].first, nodes_[candidates[i].second].doc);
+  return res;
+}
+
+}  // namespace
+
+unique_ptr<VectorIndex> VectorIndex::Create(const VectorParams& params) {
+  if (params.algorithm == VectorParams::HNSW)
+    return make_unique<HnswIndex>(params);
+  return make_unique<FlatIndex>(params);
+}
+
+}  // namespace search
+
+}  // namespace dfly
@@ -0,0 +1,68 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "server/search/index.h"
+
+namespace dfly {
+
+namespace search {
+
+// The index of a vector field of the documents of a shard. The distances are the squared
+// euclidean distance for L2, and 1 - the dot product for IP and COSINE, whose vectors are
+// normalized when they are added, so that the smaller distances are the nearer documents for all
+// the metrics.
+class VectorIndex {
+ public:
+  static std::unique_ptr<VectorIndex> Create(const VectorParams& params);
+
+  virtual ~VectorIndex() = default;
+
+  // Adds or replaces the vector of doc. Returns false, and removes the vector of doc, if blob is
+  // not an array of dim float32 numbers.
+  bool Add(DocId doc, std::string_view blob);
+
+  virtual void Remove(DocId doc) = 0;
+  virtual void Clear() = 0;
+
+  // The k documents nearest to the vector blob, nearest first, only among the documents of filter
+  // if it is set.
+  std::vector<KnnHit> Knn(std::string_view blob, size_t k, const DocIds* filter) const;
+
+  virtual size_t size() const = 0;
+
+  const VectorParams& params() const {
+    return params_;
+  }
+
+  // The vector of a blob, normalized for COSINE, or nullopt if blob has the wrong size.
+  std::optional<std::vector<float>> ParseVector(std::string_view blob) const;
+
+ protected:
+  explicit VectorIndex(const VectorParams& params) : params_(params) {
+  }
+
+  virtual void AddVector(DocId doc, const float* vec) = 0;
+  virtual std::vector<KnnHit> Search(const float* query, size_t k, const DocIds* filter) const = 0;
+
+  float Distance(const float* a, const float* b) const;
+
+  // Scans the vectors of the documents of filter, which is cheaper than a graph search for the
+  // small filters. get(doc) returns the vector of doc, or null.
+  template <typename Get>
+  std::vector<KnnHit> ScanFilter(const float* query, size_t k, const DocIds& filter,
+                                 Get&& get) const;
+
+  VectorParams params_;
+};
+
+}  // namespace search
+
+}  // namespace dfly
@@ -6,14 +6,18 @@
 
 #include <absl/cleanup/cleanup.h>
 #include <absl/random/random.h>  // for master_id_ generation.
+#include <absl/strings/ascii.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_join.h>
 #include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
 #include <sys/resource.h>
 
 #include <algorithm>
 #include <chrono>
 #include <filesystem>
+#include <map>
 #include <optional>
 
 extern "C" {
@@ -23,6 +27,8 @@ extern "C" {
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
+#include "facade/numa.h"
+#include "io/file.h"
 #include "io/file_util.h"
 #include "io/proc_reader.h"
 #include "server/command_registry.h"
@@ -32,13 +38,16 @@ extern "C" {
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/journal/journal.h"
+#include "server/keyspace_events.h"
 #include "server/main_service.h"
 #include "server/memory_cmd.h"
 #include "server/rdb_load.h"
 #include "server/rdb_save.h"
 #include "server/replica.h"
+#include "server/s3_storage.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
+#include "server/snapshot.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "server/version.h"
@@ -54,6 +63,27 @@ ABSL_FLAG(string, dbfilename, "dump", "the filename to save/load the DB");
 ABSL_FLAG(string, requirepass, "", "password for AUTH authentication");
 ABSL_FLAG(string, save_schedule, "",
           "glob spec for the UTC time to save a snapshot which matches HH:MM 24h time");
+ABSL_FLAG(bool, delta_snapshots, false,
+          "If true, the keys deleted after every snapshot are tracked, so that SAVE DELTA can "
+          "store only the changes since the last snapshot. Costs memory per deleted key");
+ABSL_FLAG(bool, persistent_journal, false,
+          "If true, the changes are appended to journal files in --dir, which are replayed on top "
+          "of the last snapshot on startup. Requires io_uring, see also --journal_fsync");
+ABSL_FLAG(bool, serve_while_loading, false,
+          "If true, the commands on keys run while a snapshot is loaded. The loader skips the "
+          "keys they write and the keys it did not load yet are missing, as in a cold cache. "
+          "Ignored with --persistent_journal, whose replay needs the loaded dataset");
+ABSL_FLAG(string, pubsub_output_buffer_limit, "32mb 8mb 60",
+          "'<hard> <soft> <seconds>' limits of the pubsub messages queued to a connection, as "
+          "in client-output-buffer-limit pubsub. 0 disables a limit");
+ABSL_FLAG(string, pubsub_overflow_policy, "disconnect",
+          "What happens to a subscriber over pubsub_output_buffer_limit: disconnect, "
+          "drop-oldest to drop its oldest messages, or coalesce to keep only the latest message "
+          "of each channel before dropping the oldest ones");
+ABSL_FLAG(uint32_t, info_max_age_ms, 0,
+          "INFO and /metrics reuse the stats gathered from the threads while they are at most "
+          "that old, and the calls that arrive during a gathering share it. Saves the hops of "
+          "frequent polling. 0 gathers the stats on every call");
 
 ABSL_DECLARE_FLAG(uint32_t, port);
 ABSL_DECLARE_FLAG(bool, cache_mode);
@@ -108,6 +138,22 @@ string InferLoadFile(fs::path data_dir) {
     return string{};
 
   fs::path fl_path = data_dir.append(dbname);
+  if (IsS3Path(fl_path.generic_string())) {
+    io::Result<vector<string>> keys = ListS3Objects(fl_path.generic_string());
+    if (!keys) {
+      LOG(WARNING) << "Could not list " << fl_path << ", error " << keys.error().message();
+      return string{};
+    }
+
+    bool exact = fl_path.has_extension();
+    auto it = std::find_if(keys->rbegin(), keys->rend(), [&](const string& key) {
+      if (exact)
+        return key == fl_path.generic_string();
+      return absl::EndsWith(key, ".rdb") || absl::EndsWith(key, "summary.dfs");
+    });
+    return it != keys->rend() ? *it : string{};
+  }
+
   if (fs::exists(fl_path))
     return fl_path.generic_string();
 
@@ -128,6 +174,45 @@ string InferLoadFile(fs::path data_dir) {
   return string{};
 }
 
+// Returns the snapshot that path is a delta of followed by the deltas up to path, see SAVE DELTA.
+// Returns {path} if path is a full snapshot.
+io::Result<vector<string>> ResolveDeltaChain(const string& path) {
+  constexpr size_t kMaxChainLen = 1024;  // Guards against cycles.
+  vector<string> chain{path};
+
+  while (absl::EndsWith(chain.back(), ".rdb")) {
+    unique_ptr<io::Source> src;
+    if (IsS3Path(chain.back())) {
+      io::Result<S3ReadFile*> file = S3ReadFile::Open(chain.back());
+      if (!file)
+        return nonstd::make_unexpected(file.error());
+      src.reset(*file);
+    } else {
+      auto file = io::OpenRead(chain.back(), io::ReadonlyFile::Options{});
+      if (!file)
+        return nonstd::make_unexpected(file.error());
+      src.reset(new io::FileSource(*file));
+    }
+
+    io::Result<string> base = RdbLoader::ReadDeltaBase(src.get());
+    if (!base)
+      return nonstd::make_unexpected(base.error());
+    if (base->empty())
+      break;
+
+    if (chain.size() >= kMaxChainLen)
+      return nonstd::make_unexpected(make_error_code(errc::too_many_links));
+
+    // Snapshots are usually moved together, so the base is looked up next to the delta first.
+    fs::path sibling = fs::path(chain.back()).parent_path() / fs::path(*base).filename();
+    bool use_sibling = !IsS3Path(chain.back()) && fs::exists(sibling);
+    chain.push_back(use_sibling ? sibling.generic_string() : std::move(*base));
+  }
+
+  reverse(chain.begin(), chain.end());
+  return chain;
+}
+
 bool IsValidSaveScheduleNibble(string_view time, unsigned int max) {
   /*
    * a nibble is valid iff there exists one time that matches the pattern
@@ -175,7 +260,8 @@ class RdbSnapshot {
   RdbSnapshot(FiberQueueThreadPool* fq_tp) : fq_tp_(fq_tp) {
   }
 
-  error_code Start(SaveMode save_mode, const std::string& path, const StringVec& lua_scripts);
+  error_code Start(SaveMode save_mode, const std::string& path, const StringVec& lua_scripts,
+                   const RdbSaver::KeyCounts& key_counts);
   void StartInShard(EngineShard* shard);
 
   error_code SaveBody();
@@ -189,9 +275,32 @@ class RdbSnapshot {
     return started_ || (saver_ && saver_->Mode() == SaveMode::SUMMARY);
   }
 
+  // Must be called before Start, see RdbSaver::SetDeltaBase.
+  void SetDeltaBase(std::string base_file) {
+    delta_base_ = std::move(base_file);
+  }
+
+  void CommitDeltaBase(EngineShard* shard) {
+    saver_->CommitDeltaBase(shard);
+  }
+
+  // Must be called before Start, see RdbSaver::SetJournalGeneration.
+  void SetJournalGeneration(uint64_t generation) {
+    journal_generation_ = generation;
+  }
+
+  // Must be called before Start, see RdbSaver::SetReplOffset.
+  void SetReplOffset(ReplOffset offset) {
+    repl_offset_ = std::move(offset);
+  }
+
  private:
   bool started_ = false;
+  std::string delta_base_;
+  uint64_t journal_generation_ = 0;
+  std::optional<ReplOffset> repl_offset_;
   FiberQueueThreadPool* fq_tp_;
+  bool is_s3_ = false;
   std::unique_ptr<io::Sink> io_sink_;
   std::unique_ptr<RdbSaver> saver_;
   RdbTypeFreqMap freq_map_;
@@ -209,9 +318,15 @@ io::Result<size_t> LinuxWriteWrapper::WriteSome(const iovec* v, uint32_t len) {
 }
 
 error_code RdbSnapshot::Start(SaveMode save_mode, const std::string& path,
-                              const StringVec& lua_scripts) {
+                              const StringVec& lua_scripts, const RdbSaver::KeyCounts& key_counts) {
   bool is_direct = false;
-  if (fq_tp_) {  // EPOLL
+  if (IsS3Path(path)) {
+    auto res = S3WriteFile::Open(path);
+    if (!res)
+      return res.error();
+    io_sink_.reset(*res);
+    is_s3_ = true;
+  } else if (fq_tp_) {  // EPOLL
     auto res = util::OpenFiberWriteFile(path, fq_tp_);
     if (!res)
       return res.error();
@@ -226,8 +341,20 @@ error_code RdbSnapshot::Start(SaveMode save_mode, const std::string& path,
   }
 
   saver_.reset(new RdbSaver(io_sink_.get(), save_mode, is_direct));
+  if (save_mode != SaveMode::SUMMARY && TieredStorage::KeepsExternalInSnapshots()) {
+    saver_->KeepExternalValues();
+  }
+  if (!delta_base_.empty()) {
+    saver_->SetDeltaBase(delta_base_);
+  }
+  if (journal_generation_) {
+    saver_->SetJournalGeneration(journal_generation_);
+  }
+  if (repl_offset_) {
+    saver_->SetReplOffset(*repl_offset_);
+  }
 
-  return saver_->SaveHeader(lua_scripts);
+  return saver_->SaveHeader(lua_scripts, key_counts);
 }
 
 error_code RdbSnapshot::SaveBody() {
@@ -236,6 +363,9 @@ error_code RdbSnapshot::SaveBody() {
 
 error_code RdbSnapshot::Close() {
   // TODO: to solve it in a more elegant way.
+  if (is_s3_) {
+    return static_cast<S3WriteFile*>(io_sink_.get())->Close();
+  }
   if (fq_tp_) {
     return static_cast<io::WriteFile*>(io_sink_.get())->Close();
   }
@@ -267,6 +397,155 @@ void ExtendFilenameWithShard(absl::Time now, int shard, fs::path* filename) {
   }
 }
 
+// Deltas are numbered along their chain, so that a delta never overwrites its base even when
+// both are saved within the same second.
+void ExtendDeltaFilename(absl::Time now, string_view delta_base, fs::path* filename) {
+  string base_name = fs::path(delta_base).filename().string();
+  unsigned seq = 0;
+  size_t pos = base_name.rfind("-delta");
+  if (pos != string::npos && absl::EndsWith(base_name, ".rdb")) {
+    string_view digits = string_view{base_name}.substr(pos + 6);
+    digits.remove_suffix(4);
+    if (!absl::SimpleAtoi(digits, &seq))
+      seq = 0;
+  }
+
+  filename->replace_extension();
+  *filename += StrCat("-", FormatTs(now), "-delta", seq + 1, ".rdb");
+}
+
+// Applies the complete transactions of a journal file, skipping a torn tail.
+error_code ReplayJournalFile(const string& path) {
+  // A file without entries holds only the magic header.
+  error_code ec;
+  if (fs::file_size(path, ec) <= 9 || ec)
+    return ec;
+
+  io::ReadonlyFileOrError res = uring::OpenRead(path);
+  if (!res)
+    return res.error();
+
+  io::FileSource src(*res);
+  RdbLoader loader(nullptr);
+  loader.SetJournalMode();
+  ec = loader.Load(&src);
+  if (!ec) {
+    VLOG(1) << "Replayed " << path << ", keys: " << loader.keys_loaded();
+  }
+
+  return ec;
+}
+
+// Removes the journal files of the generations before before_gen.
+void RemoveJournalFiles(const string& dir, uint64_t before_gen) {
+  error_code ec;
+  for (const auto& entry : fs::directory_iterator(dir, ec)) {
+    unsigned shard;
+    uint64_t gen;
+    string name = entry.path().filename().string();
+    if (journal::ParseFileName(name, &shard, &gen) && gen < before_gen) {
+      error_code rm_ec;
+      fs::remove(entry.path(), rm_ec);
+      LOG_IF(WARNING, rm_ec) << "Could not remove " << entry.path() << " " << rm_ec.message();
+    }
+  }
+  LOG_IF(WARNING, ec) << "Could not list the journal files " << ec.message();
+}
+
+// Parses the optional ASYNC|SYNC argument of FLUSHDB and FLUSHALL. Returns false on a syntax
+// error.
+bool ParseFlushMode(CmdArgList args, bool* sync) {
+  *sync = false;
+  if (args.size() == 1)
+    return true;
+  if (args.size() > 2)
+    return false;
+
+  ToUpper(&args[1]);
+  string_view mode = ArgS(args, 1);
+  if (mode == "SYNC") {
+    *sync = true;
+    return true;
+  }
+  return mode == "ASYNC";
+}
+
+// Parses the "<hard> <soft> <seconds>" limits of client-output-buffer-limit.
+bool ParsePubSubLimits(string_view hard, string_view soft, string_view secs,
+                       Connection::PubSubLimits* limits) {
+  // ParseHumanReadableBytes expects the number to be followed by its unit or the end.
+  int64_t hard_bytes, soft_bytes;
+  if (!ParseHumanReadableBytes(string(hard), &hard_bytes) ||
+      !ParseHumanReadableBytes(string(soft), &soft_bytes) || hard_bytes < 0 || soft_bytes < 0 ||
+      !absl::SimpleAtoi(secs, &limits->soft_seconds)) {
+    return false;
+  }
+  limits->hard_limit = hard_bytes;
+  limits->soft_limit = soft_bytes;
+  return true;
+}
+
+bool ParsePubSubLimits(string_view spec, Connection::PubSubLimits* limits) {
+  vector<string_view> parts = absl::StrSplit(spec, ' ', absl::SkipEmpty());
+  return parts.size() == 3 && ParsePubSubLimits(parts[0], parts[1], parts[2], limits);
+}
+
+bool ParseOverflowPolicy(string_view name, Connection::OverflowPolicy* policy) {
+  if (absl::EqualsIgnoreCase(name, "disconnect")) {
+    *policy = Connection::OverflowPolicy::DISCONNECT;
+  } else if (absl::EqualsIgnoreCase(name, "drop-oldest")) {
+    *policy = Connection::OverflowPolicy::DROP_OLDEST;
+  } else if (absl::EqualsIgnoreCase(name, "coalesce")) {
+    *policy = Connection::OverflowPolicy::COALESCE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+string_view OverflowPolicyName(Connection::OverflowPolicy policy) {
+  switch (policy) {
+    case Connection::OverflowPolicy::DISCONNECT:
+      return "disconnect";
+    case Connection::OverflowPolicy::DROP_OLDEST:
+      return "drop-oldest";
+    case Connection::OverflowPolicy::COALESCE:
+      return "coalesce";
+  }
+  return "";
+}
+
+string PubSubLimitsStr(const Connection::PubSubLimits& limits) {
+  return absl::StrCat("pubsub ", limits.hard_limit, " ", limits.soft_limit, " ",
+                      limits.soft_seconds);
+}
+
+// Waits until the shards free their flushed tables, i.e. for FLUSHALL SYNC. The new tables are
+// available during the wait.
+void AwaitFlushedTables() {
+  while (true) {
+    atomic_bool pending{false};
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      if (shard->db_slice().lazyfree_tables() > 0)
+        pending.store(true, memory_order_relaxed);
+    });
+    if (!pending.load(memory_order_relaxed))
+      return;
+    ::boost::this_fiber::sleep_for(1ms);
+  }
+}
+
+// The ratio of the highest value across the shards to their mean, 1 if they are balanced.
+template <typename F> double ShardImbalance(const vector<EngineShard::LoadStats>& load, F&& get) {
+  double sum = 0, max_val = 0;
+  for (const auto& stats : load) {
+    double val = get(stats);
+    sum += val;
+    max_val = max(max_val, val);
+  }
+  return sum > 0 ? max_val * load.size() / sum : 1;
+}
+
 }  // namespace
 
 std::optional<SnapshotSpec> ParseSaveSchedule(string_view time) {
@@ -341,6 +620,19 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
   main_listener_ = main_listener;
   dfly_cmd_.reset(new DflyCmd(main_listener, this));
 
+  Connection::PubSubLimits pubsub_limits;
+  Connection::OverflowPolicy overflow_policy;
+  if (!ParsePubSubLimits(GetFlag(FLAGS_pubsub_output_buffer_limit), &pubsub_limits)) {
+    LOG(ERROR) << "Invalid pubsub_output_buffer_limit "
+               << GetFlag(FLAGS_pubsub_output_buffer_limit);
+    exit(1);
+  }
+  if (!ParseOverflowPolicy(GetFlag(FLAGS_pubsub_overflow_policy), &overflow_policy)) {
+    LOG(ERROR) << "Invalid pubsub_overflow_policy " << GetFlag(FLAGS_pubsub_overflow_policy);
+    exit(1);
+  }
+  Connection::SetPubSubLimits(pubsub_limits, overflow_policy);
+
   pb_task_ = shard_set->pool()->GetNextProactor();
   if (pb_task_->GetKind() == ProactorBase::EPOLL) {
     fq_threadpool_.reset(new FiberQueueThreadPool());
@@ -370,15 +662,37 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
   const auto& dir = GetFlag(FLAGS_dir);
 
   error_code file_ec;
-  if (!dir.empty()) {
+  if (IsS3Path(dir)) {
+    data_folder = dir;
+  } else if (!dir.empty()) {
     data_folder = fs::canonical(dir, file_ec);
   }
 
   if (!file_ec) {
     LOG(INFO) << "Data directory is " << data_folder;
-    string load_path = InferLoadFile(data_folder);
+
+    if (GetFlag(FLAGS_persistent_journal)) {
+      if (IsS3Path(dir)) {
+        LOG(ERROR) << "Persistent journal is not supported on object storage, disabled";
+      } else {
+        journal_dir_ = data_folder.generic_string();
+      }
+    }
+
+    // Object storage is accessed with fiber sockets.
+    string load_path = IsS3Path(dir) ? pb_task_->Await([&] { return InferLoadFile(data_folder); })
+                                     : InferLoadFile(data_folder);
     if (!load_path.empty()) {
       load_result_ = Load(load_path);
+    } else if (!journal_dir_.empty()) {
+      // Without a snapshot the journal holds all the data, if any.
+      service_.SwitchState(GlobalState::ACTIVE, GlobalState::LOADING);
+      error_code ec = pb_task_->Await([this] { return RecoverJournal(nullopt); });
+      service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
+      if (ec) {
+        LOG(ERROR) << "Journal recovery failed, persistent journal disabled: " << ec.message();
+        journal_dir_.clear();
+      }
     }
   } else {
     LOG(ERROR) << "Data directory error: " << file_ec.message();
@@ -429,11 +743,47 @@ void ServerFamily::Shutdown() {
 fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path) {
   CHECK(absl::EndsWith(load_path, ".rdb") || absl::EndsWith(load_path, "summary.dfs"));
 
-  vector<std::string> paths{{load_path}};
+  // Object storage is accessed with fiber sockets.
+  if (IsS3Path(load_path) && !ProactorBase::me()) {
+    return pb_task_->Await([&] { return Load(load_path); });
+  }
+
+  // Deltas are applied on top of their base once it is loaded.
+  io::Result<vector<string>> chain = ResolveDeltaChain(load_path);
+  if (!chain) {
+    LOG(ERROR) << "Error loading " << load_path << " " << chain.error().message();
+    fibers::promise<std::error_code> ec_promise;
+    ec_promise.set_value(chain.error());
+    return ec_promise.get_future();
+  }
+
+  const string& base_path = chain->front();
+  vector<std::string> paths{{base_path}};
+  vector<std::string> deltas(chain->begin() + 1, chain->end());
 
   // Collect all other files in case we're loading dfs.
-  if (absl::EndsWith(load_path, "summary.dfs")) {
-    std::string glob = absl::StrReplaceAll(load_path, {{"summary", "????"}});
+  if (IsS3Path(base_path) && absl::EndsWith(base_path, "summary.dfs")) {
+    string_view prefix = absl::StripSuffix(base_path, "summary.dfs");
+    io::Result<vector<string>> keys = ListS3Objects(prefix);
+    if (!keys) {
+      fibers::promise<std::error_code> ec_promise;
+      ec_promise.set_value(keys.error());
+      return ec_promise.get_future();
+    }
+
+    // The shard files differ from the summary in the 4 digits of the shard id.
+    for (auto& key : *keys) {
+      if (key.size() == base_path.size() && key != base_path && absl::EndsWith(key, ".dfs"))
+        paths.push_back(std::move(key));
+    }
+
+    if (paths.size() == 1) {
+      fibers::promise<std::error_code> ec_promise;
+      ec_promise.set_value(make_error_code(errc::no_such_file_or_directory));
+      return ec_promise.get_future();
+    }
+  } else if (absl::EndsWith(base_path, "summary.dfs")) {
+    std::string glob = absl::StrReplaceAll(base_path, {{"summary", "????"}});
     io::Result<io::StatShortVec> files = io::StatFiles(glob);
 
     if (files && files->size() == 0) {
@@ -449,6 +799,9 @@ fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path)
 
   // Check all paths are valid.
   for (const auto& path : paths) {
+    if (IsS3Path(path))  // Checked by the listing.
+      continue;
+
     error_code ec;
     fs::canonical(path, ec);
     if (ec) {
@@ -479,6 +832,21 @@ fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path)
 
   auto& pool = service_.proactor_pool();
 
+  // The loaded positions describe the dataset only until something writes to it.
+  {
+    lock_guard lk(load_mu_);
+    loaded_repl_offsets_.clear();
+  }
+  pool.AwaitFiberOnAll([](auto*) { ServerState::tlocal()->dataset_modified = false; });
+
+  // The shards record the written keys before the commands are let in.
+  bool serve = GetFlag(FLAGS_serve_while_loading) && journal_dir_.empty();
+  if (serve) {
+    shard_set->RunBriefInParallel(
+        [](EngineShard* shard) { shard->db_slice().TrackLoadingWrites(true); });
+    pool.AwaitFiberOnAll([](auto*) { ServerState::tlocal()->serve_while_loading = true; });
+  }
+
   std::vector<::boost::fibers::fiber> load_fibers;
   load_fibers.reserve(paths.size());
 
@@ -504,14 +872,41 @@ fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path)
   boost::fibers::future<std::error_code> ec_future = ec_promise.get_future();
 
   // Run fiber that empties the channel and sets ec_promise.
-  auto load_join_fiber = [this, first_error, load_fibers = std::move(load_fibers),
-                          ec_promise = std::move(ec_promise)]() mutable {
+  auto load_join_fiber = [this, first_error, serve, load_fibers = std::move(load_fibers),
+                          deltas = std::move(deltas), ec_promise = std::move(ec_promise)]() mutable {
     for (auto& fiber : load_fibers) {
       fiber.join();
     }
 
+    // Each delta overwrites the entries of the previous ones, so they are loaded in order.
+    for (const string& delta : deltas) {
+      if (**first_error)
+        break;
+      *first_error = LoadRdb(delta);
+    }
+
+    // The journal is replayed on top of the snapshot and its deltas. It is not opened if they
+    // failed to load, since its entries would not describe the changes of an empty database.
+    if (!journal_dir_.empty() && journal_generation_ == 0) {
+      error_code ec = **first_error;
+      if (!ec) {
+        ec = RecoverJournal(loaded_journal_generation_.load(memory_order_relaxed));
+        *first_error = ec;
+      }
+      if (ec) {
+        LOG(ERROR) << "Persistent journal disabled: " << ec.message();
+        journal_dir_.clear();
+      }
+    }
+
     VLOG(1) << "Load finished";
     service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
+    if (serve) {
+      auto& pool = service_.proactor_pool();
+      pool.AwaitFiberOnAll([](auto*) { ServerState::tlocal()->serve_while_loading = false; });
+      shard_set->RunBriefInParallel(
+          [](EngineShard* shard) { shard->db_slice().TrackLoadingWrites(false); });
+    }
     ec_promise.set_value(**first_error);
   };
   pool.GetNextProactor()->Dispatch(std::move(load_join_fiber));
@@ -556,36 +951,115 @@ void ServerFamily::SnapshotScheduling(const SnapshotSpec& spec) {
 }
 
 error_code ServerFamily::LoadRdb(const std::string& rdb_file) {
-  error_code ec;
-  io::ReadonlyFileOrError res;
+  unique_ptr<io::Source> src;
 
-  if (fq_threadpool_) {
-    res = util::OpenFiberReadFile(rdb_file, fq_threadpool_.get());
+  if (IsS3Path(rdb_file)) {
+    io::Result<S3ReadFile*> res = S3ReadFile::Open(rdb_file);
+    if (!res)
+      return res.error();
+    src.reset(*res);
   } else {
-    res = uring::OpenRead(rdb_file);
+    io::ReadonlyFileOrError res;
+    if (fq_threadpool_) {
+      res = util::OpenFiberReadFile(rdb_file, fq_threadpool_.get());
+    } else {
+      res = uring::OpenRead(rdb_file);
+    }
+    if (!res)
+      return res.error();
+    src.reset(new io::FileSource(*res));
   }
 
-  if (res) {
-    io::FileSource fs(*res);
+  RdbLoader loader(script_mgr());
+  error_code ec = loader.Load(src.get());
+  if (!ec) {
+    if (loader.journal_generation()) {
+      loaded_journal_generation_.store(loader.journal_generation(), memory_order_relaxed);
+    }
+    if (auto offset = loader.repl_offset(); offset) {
+      lock_guard lk(load_mu_);
+      loaded_repl_offsets_.push_back(std::move(*offset));
+    }
+    LOG(INFO) << "Done loading RDB, keys loaded: " << loader.keys_loaded();
+    if (size_t skipped = loader.keys_skipped(); skipped)
+      LOG(INFO) << "Skipped " << skipped << " entries whose keys were written during the load";
+    LOG(INFO) << "Loading finished after "
+              << strings::HumanReadableElapsedTime(loader.load_time());
+  }
 
-    RdbLoader loader(script_mgr());
-    ec = loader.Load(&fs);
-    if (!ec) {
-      LOG(INFO) << "Done loading RDB, keys loaded: " << loader.keys_loaded();
-      LOG(INFO) << "Loading finished after "
-                << strings::HumanReadableElapsedTime(loader.load_time());
+  return ec;
+}
+
+error_code ServerFamily::RecoverJournal(optional<uint64_t> snapshot_gen) {
+  map<uint64_t, vector<string>> files;
+  error_code ec;
+  for (const auto& entry : fs::directory_iterator(journal_dir_, ec)) {
+    unsigned shard;
+    uint64_t gen;
+    if (journal::ParseFileName(entry.path().filename().string(), &shard, &gen)) {
+      files[gen].push_back(entry.path().generic_string());
     }
-  } else {
-    ec = res.error();
   }
+  if (ec)
+    return ec;
 
-  service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
+  uint64_t max_gen = files.empty() ? 0 : files.rbegin()->first;
+  uint64_t from_gen = snapshot_gen.value_or(0);
+  if (snapshot_gen && *snapshot_gen == 0 && !files.empty()) {
+    // The snapshot was saved without the journal, so its files describe an unknown state.
+    LOG(WARNING) << "Snapshot does not reference the journal, ignoring its files";
+    from_gen = max_gen + 1;
+  }
 
-  return ec;
+  auto& pool = service_.proactor_pool();
+  for (auto it = files.lower_bound(from_gen); it != files.end(); ++it) {
+    // Every transaction is journaled by each of the shards it touches, so a generation without
+    // a file per shard can not be replayed consistently.
+    if (it->second.size() != shard_count()) {
+      LOG(ERROR) << "Journal generation " << it->first << " has " << it->second.size()
+                 << " files, expected " << shard_count();
+      return make_error_code(errc::invalid_argument);
+    }
+
+    LOG(INFO) << "Replaying journal generation " << it->first;
+
+    AggregateError first_error;
+    vector<fibers::fiber> fibers;
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      const string& path = it->second[i];
+      fibers.push_back(pool.at(i % pool.size())->LaunchFiber([&first_error, &path] {
+        first_error = ReplayJournalFile(path);
+      }));
+    }
+    for (auto& fb : fibers)
+      fb.join();
+
+    if (*first_error)
+      return *first_error;
+  }
+
+  RemoveJournalFiles(journal_dir_, from_gen);
+
+  uint64_t new_gen = max(max_gen + 1, from_gen);
+  AggregateError open_error;
+  shard_set->pool()->AwaitFiberOnAll(
+      [&](auto*) { open_error = journal_->OpenInThread(true, journal_dir_, new_gen); });
+  if (*open_error)
+    return *open_error;
+
+  journal_generation_ = new_gen;
+  LOG(INFO) << "Opened journal generation " << new_gen;
+
+  return error_code{};
 }
 
 enum MetricType { COUNTER, GAUGE, SUMMARY, HISTOGRAM };
 
+// The upper bounds of the buckets of the latency histograms exported to Prometheus.
+constexpr uint64_t kLatencyBucketsUsec[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000};
+
 const char* MetricTypeName(MetricType type) {
   switch (type) {
     case MetricType::COUNTER:
@@ -694,6 +1168,96 @@ void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
 
   absl::StrAppend(&resp->body(), db_key_metrics);
   absl::StrAppend(&resp->body(), db_key_expire_metrics);
+
+  // Only the slots with keys, so that the idle slots do not bloat the scrapes.
+  if (!m.slot_stats.empty()) {
+    string slot_key_metrics;
+    string slot_memory_metrics;
+
+    AppendMetricHeader("slot_keys", "Number of keys by cluster slot", MetricType::GAUGE,
+                       &slot_key_metrics);
+    AppendMetricHeader("slot_memory_bytes", "Object memory by cluster slot", MetricType::GAUGE,
+                       &slot_memory_metrics);
+
+    for (size_t i = 0; i < m.slot_stats.size(); ++i) {
+      const auto& stats = m.slot_stats[i];
+      if (stats.key_count == 0)
+        continue;
+      string slot = absl::StrCat(i);
+      AppendMetricValue("slot_keys", stats.key_count, {"slot"}, {slot}, &slot_key_metrics);
+      AppendMetricValue("slot_memory_bytes", stats.memory_bytes, {"slot"}, {slot},
+                        &slot_memory_metrics);
+    }
+
+    absl::StrAppend(&resp->body(), slot_key_metrics);
+    absl::StrAppend(&resp->body(), slot_memory_metrics);
+  }
+
+  string cmd_alloc_metrics;
+  string cmd_free_metrics;
+
+  AppendMetricHeader("commands_allocated_bytes_total",
+                     "Bytes allocated on the shard heap by command", MetricType::COUNTER,
+                     &cmd_alloc_metrics);
+  AppendMetricHeader("commands_freed_bytes_total", "Bytes freed on the shard heap by command",
+                     MetricType::COUNTER, &cmd_free_metrics);
+
+  for (const auto& k_v : m.cmd_mem_stats) {
+    AppendMetricValue("commands_allocated_bytes_total", k_v.second.allocated, {"cmd"},
+                      {k_v.first}, &cmd_alloc_metrics);
+    AppendMetricValue("commands_freed_bytes_total", k_v.second.freed, {"cmd"}, {k_v.first},
+                      &cmd_free_metrics);
+  }
+
+  absl::StrAppend(&resp->body(), cmd_alloc_metrics);
+  absl::StrAppend(&resp->body(), cmd_free_metrics);
+
+  string cmd_latency_metrics;
+  AppendMetricHeader("commands_duration_seconds", "Latency of the commands",
+                     MetricType::HISTOGRAM, &cmd_latency_metrics);
+
+  for (const auto& [name, hist] : m.cmd_latency) {
+    for (uint64_t le : kLatencyBucketsUsec) {
+      AppendMetricValue("commands_duration_seconds_bucket", hist.CountAtMost(le), {"cmd", "le"},
+                        {name, absl::StrCat(le * 1e-6)}, &cmd_latency_metrics);
+    }
+    AppendMetricValue("commands_duration_seconds_bucket", hist.count(), {"cmd", "le"},
+                      {name, "+Inf"}, &cmd_latency_metrics);
+    AppendMetricValue("commands_duration_seconds_sum", hist.sum() * 1e-6, {"cmd"}, {name},
+                      &cmd_latency_metrics);
+    AppendMetricValue("commands_duration_seconds_count", hist.count(), {"cmd"}, {name},
+                      &cmd_latency_metrics);
+  }
+
+  absl::StrAppend(&resp->body(), cmd_latency_metrics);
+
+  // Per shard, to expose the skew of the keys and hashtags across the shards.
+  auto append_shard_metric = [&](string_view name, string_view help, MetricType type,
+                                 auto get) {
+    AppendMetricHeader(name, help, type, &resp->body());
+    for (size_t sid = 0; sid < m.shard_load.size(); ++sid) {
+      AppendMetricValue(name, get(m.shard_load[sid]), {"shard"}, {absl::StrCat(sid)},
+                        &resp->body());
+    }
+  };
+
+  using LoadStats = EngineShard::LoadStats;
+  append_shard_metric("shard_txq_length", "Transactions queued in the shard", MetricType::GAUGE,
+                      [](const LoadStats& l) { return l.txq_len; });
+  append_shard_metric("shard_hops_per_sec", "Shard callbacks run per second", MetricType::GAUGE,
+                      [](const LoadStats& l) { return l.hops_per_sec; });
+  append_shard_metric("shard_busy_ratio", "Share of the time the shard runs transactions",
+                      MetricType::GAUGE, [](const LoadStats& l) { return l.busy_ratio; });
+  append_shard_metric("shard_hops_total", "Shard callbacks run", MetricType::COUNTER,
+                      [](const LoadStats& l) { return l.hops; });
+  append_shard_metric("shard_cross_shard_hops_total",
+                      "Shard callbacks of multi-shard transactions", MetricType::COUNTER,
+                      [](const LoadStats& l) { return l.cross_shard_hops; });
+  append_shard_metric("shard_blocked_transactions",
+                      "Blocking commands waiting on the keys of the shard", MetricType::GAUGE,
+                      [](const LoadStats& l) { return l.blocked_transactions; });
+  append_shard_metric("shard_heap_bytes", "Memory used by the shard heap", MetricType::GAUGE,
+                      [](const LoadStats& l) { return l.heap_bytes; });
 }
 
 void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
@@ -702,7 +1266,7 @@ void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
 
   auto cb = [this](const util::http::QueryArgs& args, util::HttpContext* send) {
     StringResponse resp = util::http::MakeStringResponse(boost::beast::http::status::ok);
-    PrintPrometheusMetrics(this->GetMetrics(), &resp);
+    PrintPrometheusMetrics(*this->GetCachedMetrics(), &resp);
 
     return send->Invoke(std::move(resp));
   };
@@ -721,6 +1285,97 @@ void ServerFamily::PauseReplication(bool pause) {
   }
 }
 
+vector<LSN> ServerFamily::TakeLoadedReplOffsets(string* master_id) {
+  vector<ReplOffset> offsets;
+  {
+    lock_guard lk(load_mu_);
+    offsets.swap(loaded_repl_offsets_);
+  }
+  if (offsets.empty())
+    return {};
+
+  atomic_bool modified{false};
+  shard_set->pool()->AwaitFiberOnAll([&](auto*) {
+    if (ServerState::tlocal()->dataset_modified)
+      modified.store(true, memory_order_relaxed);
+  });
+  if (modified.load(memory_order_relaxed)) {
+    LOG(INFO) << "The dataset changed since the snapshot was loaded, replicating from scratch";
+    return {};
+  }
+
+  // Every shard of the master must be covered by a file of the same snapshot.
+  const ReplOffset& first = offsets.front();
+  vector<optional<LSN>> lsns(first.shard_count);
+  for (const ReplOffset& offset : offsets) {
+    if (offset.master_id != first.master_id || offset.shard_count != first.shard_count ||
+        offset.shard >= lsns.size() || lsns[offset.shard]) {
+      return {};
+    }
+    lsns[offset.shard] = offset.lsn;
+  }
+  if (!all_of(lsns.begin(), lsns.end(), [](const auto& lsn) { return lsn.has_value(); }))
+    return {};
+
+  *master_id = first.master_id;
+  vector<LSN> res;
+  for (const auto& lsn : lsns)
+    res.push_back(*lsn);
+  return res;
+}
+
+uint64_t ServerFamily::ReplicaStalenessMs() const {
+  // Safe for the same reason as in Info(), replica_ outlives the replica mode of the threads.
+  DCHECK(!ServerState::tlocal()->is_master);
+  auto replica_ptr = replica_;
+  return replica_ptr ? replica_ptr->StalenessMs() : UINT64_MAX;
+}
+
+void ServerFamily::RecordPromotion(const Replica& replica) {
+  promotion_.reset();
+
+  Promotion promotion;
+  if (!replica.GetMasterOffsets(&promotion.master_id, &promotion.master_lsns))
+    return;
+
+  shard_set->pool()->AwaitFiberOnAll([this](auto*) {
+    if (!ServerState::tlocal()->journal())
+      CHECK(!journal_->OpenInThread(false, ""sv));  // can only fail in persistent mode.
+  });
+
+  promotion.lsns.resize(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    promotion.lsns[shard->shard_id()] = journal_->GetLsn() - 1;
+  });
+  promotion_ = std::move(promotion);
+}
+
+void ServerFamily::OnMasterFullSync() {
+  dfly_cmd_->CancelAllReplicas();
+  shard_set->RunBriefInParallel([this](EngineShard* shard) {
+    if (shard->journal())
+      journal_->DropBacklog();
+  });
+}
+
+optional<vector<LSN>> ServerFamily::GetPromotionOffsets(string_view master_id,
+                                                        absl::Span<const LSN> shard_lsns) {
+  lock_guard lk(replicaof_mu_);
+  if (!promotion_ || promotion_->master_id != master_id ||
+      shard_lsns.size() > promotion_->master_lsns.size()) {
+    return nullopt;
+  }
+
+  // The flows of a shard receive its entries in order and may be ahead of the last one, since
+  // the positions they start from include the LSNs that were not streamed at all. An entry the
+  // master streamed after the promotion has an LSN beyond any position the flow got.
+  for (size_t i = 0; i < shard_lsns.size(); ++i) {
+    if (promotion_->master_lsns[i] < shard_lsns[i])
+      return nullopt;
+  }
+  return promotion_->lsns;
+}
+
 void ServerFamily::OnClose(ConnectionContext* cntx) {
   dfly_cmd_->OnClose(cntx);
 }
@@ -744,7 +1399,8 @@ void ServerFamily::StatsMC(std::string_view section, facade::ConnectionContext*
   double utime = dbl_time(ru.ru_utime);
   double systime = dbl_time(ru.ru_stime);
 
-  Metrics m = GetMetrics();
+  shared_ptr<const Metrics> metrics_ptr = GetCachedMetrics();
+  const Metrics& m = *metrics_ptr;
 
   ADD_LINE(pid, getpid());
   ADD_LINE(uptime, m.uptime);
@@ -787,7 +1443,8 @@ using PartialSaveOpts =
 // Start saving a single snapshot of a multi-file dfly snapshot.
 // If shard is null, then this is the summary file.
 error_code DoPartialSave(PartialSaveOpts opts, const dfly::StringVec& scripts,
-                         RdbSnapshot* snapshot, EngineShard* shard) {
+                         const RdbSaver::KeyCounts& key_counts, RdbSnapshot* snapshot,
+                         EngineShard* shard) {
   auto [filename, path, now] = opts;
   // Construct resulting filename.
   fs::path file = filename, abs_path = path;
@@ -801,7 +1458,8 @@ error_code DoPartialSave(PartialSaveOpts opts, const dfly::StringVec& scripts,
 
   // Start rdb saving.
   SaveMode mode = shard == nullptr ? SaveMode::SUMMARY : SaveMode::SINGLE_SHARD;
-  std::error_code local_ec = snapshot->Start(mode, abs_path.generic_string(), scripts);
+  std::error_code local_ec =
+      snapshot->Start(mode, abs_path.generic_string(), scripts, key_counts);
 
   if (!local_ec && mode == SaveMode::SINGLE_SHARD) {
     snapshot->StartInShard(shard);
@@ -810,12 +1468,12 @@ error_code DoPartialSave(PartialSaveOpts opts, const dfly::StringVec& scripts,
   return local_ec;
 }
 
-GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
+GenericError ServerFamily::DoSave(bool new_version, Transaction* trans, string_view delta_base) {
   fs::path dir_path(GetFlag(FLAGS_dir));
   AggregateGenericError ec;
 
-  // Check directory.
-  if (!dir_path.empty()) {
+  // Check directory. Object storage has no directories.
+  if (!dir_path.empty() && !IsS3Path(dir_path.generic_string())) {
     if (auto local_ec = CreateDirs(dir_path); local_ec) {
       return {local_ec, "create-dir"};
     }
@@ -861,6 +1519,14 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     }
   };
 
+  // Every file carries the size of the whole dataset, so that the files can be loaded in
+  // parallel, each of them presizing the tables of all the shards.
+  const RdbSaver::KeyCounts key_counts = RdbSaver::GetKeyCounts();
+
+  // The journal switches to a new generation at the point in time of the snapshot, so the
+  // snapshot together with the new generation describes the current state.
+  const uint64_t journal_gen = journal_generation_ ? journal_generation_ + 1 : 0;
+
   // Start snapshots.
   if (new_version) {
     auto file_opts = make_tuple(cref(filename), cref(path), start);
@@ -874,7 +1540,9 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
       const auto scripts = script_mgr_->GetLuaScripts();
       auto& snapshot = snapshots[shard_set->size()];
       snapshot.reset(new RdbSnapshot(fq_threadpool_.get()));
-      if (auto local_ec = DoPartialSave(file_opts, scripts, snapshot.get(), nullptr); local_ec) {
+      snapshot->SetJournalGeneration(journal_gen);
+      if (auto local_ec = DoPartialSave(file_opts, scripts, key_counts, snapshot.get(), nullptr);
+          local_ec) {
         ec = local_ec;
         snapshot.reset();
       }
@@ -884,7 +1552,19 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     auto cb = [&](Transaction* t, EngineShard* shard) {
       auto& snapshot = snapshots[shard->shard_id()];
       snapshot.reset(new RdbSnapshot(fq_threadpool_.get()));
-      if (auto local_ec = DoPartialSave(file_opts, {}, snapshot.get(), shard); local_ec) {
+      snapshot->SetJournalGeneration(journal_gen);
+      if (journal_gen) {
+        ec = journal_->RotateInThread(journal_gen);
+      }
+
+      // A journal that is open now logs all the changes after this point, so replicas that load
+      // the snapshot can resume from its backlog, see TakeLoadedReplOffsets.
+      if (shard->journal() && ServerState::tlocal()->is_master) {
+        snapshot->SetReplOffset(
+            ReplOffset{master_id_, shard->shard_id(), shard_set->size(), journal_->GetLsn() - 1});
+      }
+      if (auto local_ec = DoPartialSave(file_opts, {}, key_counts, snapshot.get(), shard);
+          local_ec) {
         ec = local_ec;
         snapshot.reset();
       }
@@ -895,16 +1575,32 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
   } else {
     snapshots.resize(1);
 
-    ExtendFilenameWithShard(start, -1, &filename);
+    if (delta_base.empty()) {
+      ExtendFilenameWithShard(start, -1, &filename);
+    } else {
+      ExtendDeltaFilename(start, delta_base, &filename);
+    }
     path /= filename;  // use / operator to concatenate paths.
     VLOG(1) << "Saving to " << path;
 
     snapshots[0].reset(new RdbSnapshot(fq_threadpool_.get()));
+    if (!delta_base.empty()) {
+      snapshots[0]->SetDeltaBase(string(delta_base));
+    }
+    snapshots[0]->SetJournalGeneration(journal_gen);
     const auto lua_scripts = script_mgr_->GetLuaScripts();
-    ec = snapshots[0]->Start(SaveMode::RDB, path.generic_string(), lua_scripts);
+    ec = snapshots[0]->Start(SaveMode::RDB, path.generic_string(), lua_scripts, key_counts);
 
     if (!ec) {
       auto cb = [&](Transaction* t, EngineShard* shard) {
+        // A flush since the base drops the tombstones, the delta would miss deletions.
+        if (!delta_base.empty() && shard->db_slice().delta_base_version() == 0) {
+          ec = GenericError{make_error_code(errc::operation_not_permitted),
+                            "database was flushed since the base snapshot, save a full one"};
+        }
+        if (journal_gen) {
+          ec = journal_->RotateInThread(journal_gen);
+        }
         snapshots[0]->StartInShard(shard);
         return OpStatus::OK;
       };
@@ -915,6 +1611,10 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     }
   }
 
+  if (journal_gen) {
+    journal_generation_ = journal_gen;
+  }
+
   is_saving_.store(true, memory_order_relaxed);
 
   // Perform snapshot serialization, block the current fiber until it completes.
@@ -938,6 +1638,33 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
               << strings::HumanReadableElapsedTime(seconds);
   }
 
+  // The snapshot references the external values, so their ranges in the backing files are kept
+  // until the snapshot is complete.
+  if (!ec && TieredStorage::KeepsExternalInSnapshots()) {
+    shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+      if (shard->tiered_storage()) {
+        ec = shard->tiered_storage()->OnSnapshotSaved();
+      }
+    });
+  }
+
+  if (!delta_base.empty() && ec) {
+    error_code rm_ec;
+    fs::remove(path, rm_ec);  // An incomplete delta must not be picked up by the loader.
+  }
+
+  if (!ec && GetFlag(FLAGS_delta_snapshots)) {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      auto& snapshot = new_version ? snapshots[shard->shard_id()] : snapshots[0];
+      snapshot->CommitDeltaBase(shard);
+    });
+  }
+
+  // The older generations are covered by the snapshot.
+  if (!ec && journal_gen) {
+    RemoveJournalFiles(journal_dir_, journal_gen);
+  }
+
   // Populate LastSaveInfo.
   if (!ec) {
     save_info = make_shared<LastSaveInfo>();
@@ -965,6 +1692,14 @@ error_code ServerFamily::Drakarys(Transaction* transaction, DbIndex db_ind) {
   transaction->Execute(
       [db_ind](Transaction* t, EngineShard* shard) {
         shard->db_slice().FlushDb(db_ind);
+
+        // A flush that precedes a load, i.e. of DEBUG LOAD, is not journaled as the loaded
+        // entries are not either. The reply does not wait for journal_fsync=always, the next
+        // write in the shard does.
+        if (shard->journal() && ServerState::tlocal()->gstate() != GlobalState::LOADING) {
+          journal::Entry entry{journal::Op::FLUSH, db_ind, t->txid(), {}};
+          shard->journal()->PersistEntry(entry);
+        }
         return OpStatus::OK;
       },
       true);
@@ -994,20 +1729,33 @@ void ServerFamily::BreakOnShutdown() {
   dfly_cmd_->BreakOnShutdown();
 }
 
+// The flushed tables are swapped with empty ones and freed in the background by default, so the
+// database is available at once. SYNC replies once their memory is freed.
 void ServerFamily::FlushDb(CmdArgList args, ConnectionContext* cntx) {
+  bool sync = false;
+  if (!ParseFlushMode(args, &sync)) {
+    (*cntx)->SendError(kSyntaxErr);
+    return;
+  }
+
   DCHECK(cntx->transaction);
   Drakarys(cntx->transaction, cntx->transaction->db_index());
+  if (sync)
+    AwaitFlushedTables();
   cntx->reply_builder()->SendOk();
 }
 
 void ServerFamily::FlushAll(CmdArgList args, ConnectionContext* cntx) {
-  if (args.size() > 1) {
+  bool sync = false;
+  if (!ParseFlushMode(args, &sync)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   DCHECK(cntx->transaction);
   Drakarys(cntx->transaction, DbSlice::kDbAll);
+  if (sync)
+    AwaitFlushedTables();
   (*cntx)->SendOk();
 }
 
@@ -1069,6 +1817,60 @@ void ServerFamily::Client(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendBulkString(result);
   }
 
+  // The share of the connection in the dispatch turns of its thread, in percent.
+  if (sub_cmd == "WEIGHT" && args.size() <= 3) {
+    if (args.size() == 2)
+      return (*cntx)->SendLong(cntx->owner()->GetDispatchWeight());
+
+    unsigned weight;
+    if (!absl::SimpleAtoi(ArgS(args, 2), &weight) || weight == 0 || weight > 10000)
+      return (*cntx)->SendError("weight must be between 1 and 10000");
+
+    cntx->owner()->SetDispatchWeight(weight);
+    return (*cntx)->SendOk();
+  }
+
+  // Reads on a replica fail once its data is older than the bound, see Replica::StalenessMs.
+  if (sub_cmd == "READONLY_STALENESS" && args.size() == 3) {
+    uint64_t max_ms;
+    if (!absl::SimpleAtoi(ArgS(args, 2), &max_ms))
+      return (*cntx)->SendError(kInvalidIntErr);
+
+    cntx->conn_state.max_staleness_ms = max_ms;
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd == "TRACKING" && args.size() >= 3) {
+    ToUpper(&args[2]);
+    string_view mode = ArgS(args, 2);
+    if (mode != "ON" && mode != "OFF")
+      return (*cntx)->SendError(kSyntaxErr);
+
+    bool bcast = false;
+    StringVec prefixes;
+    for (size_t i = 3; i < args.size(); ++i) {
+      ToUpper(&args[i]);
+      string_view opt = ArgS(args, i);
+      if (opt == "BCAST") {
+        bcast = true;
+      } else if (opt == "PREFIX" && i + 1 < args.size()) {
+        prefixes.emplace_back(ArgS(args, ++i));
+      } else {
+        return (*cntx)->SendError(absl::StrCat("Unsupported CLIENT TRACKING option ", opt));
+      }
+    }
+
+    if (!prefixes.empty() && !bcast)
+      return (*cntx)->SendError("PREFIX option requires BCAST mode to be enabled");
+
+    // Invalidation messages are pushed on the same connection, which requires RESP3.
+    if (mode == "ON" && !(*cntx)->IsResp3())
+      return (*cntx)->SendError("CLIENT TRACKING requires RESP3 protocol, use HELLO 3");
+
+    cntx->ChangeTracking(mode == "ON", bcast, std::move(prefixes));
+    return (*cntx)->SendOk();
+  }
+
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
   return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "CLIENT"), kSyntaxErrType);
 }
@@ -1078,10 +1880,75 @@ void ServerFamily::Config(CmdArgList args, ConnectionContext* cntx) {
   string_view sub_cmd = ArgS(args, 1);
 
   if (sub_cmd == "SET") {
+    if (args.size() == 4 && absl::EqualsIgnoreCase(ArgS(args, 2), "notify-keyspace-events")) {
+      uint32_t flags = 0;
+      if (!KeyspaceEvents::ParseFlags(ArgS(args, 3), &flags)) {
+        return (*cntx)->SendError(absl::StrCat("Invalid argument '", ArgS(args, 3),
+                                               "' for CONFIG SET 'notify-keyspace-events'"));
+      }
+      KeyspaceEvents::SetFlags(flags);
+    } else if (args.size() == 4 &&
+               absl::EqualsIgnoreCase(ArgS(args, 2), "client-output-buffer-limit")) {
+      // Groups of "<class> <hard> <soft> <seconds>", of which only the pubsub one applies.
+      vector<string_view> parts = absl::StrSplit(ArgS(args, 3), ' ', absl::SkipEmpty());
+      optional<Connection::PubSubLimits> pubsub_limits;
+      bool valid = !parts.empty() && parts.size() % 4 == 0;
+      for (size_t i = 0; valid && i < parts.size(); i += 4) {
+        Connection::PubSubLimits limits;
+        valid = ParsePubSubLimits(parts[i + 1], parts[i + 2], parts[i + 3], &limits);
+        if (absl::EqualsIgnoreCase(parts[i], "pubsub")) {
+          pubsub_limits = limits;
+        } else if (!absl::EqualsIgnoreCase(parts[i], "normal") &&
+                   !absl::EqualsIgnoreCase(parts[i], "slave") &&
+                   !absl::EqualsIgnoreCase(parts[i], "replica")) {
+          valid = false;
+        }
+      }
+      if (!valid) {
+        return (*cntx)->SendError(absl::StrCat("Invalid argument '", ArgS(args, 3),
+                                               "' for CONFIG SET 'client-output-buffer-limit'"));
+      }
+      if (pubsub_limits)
+        Connection::SetPubSubLimits(*pubsub_limits, Connection::GetOverflowPolicy());
+    } else if (args.size() == 4 &&
+               absl::EqualsIgnoreCase(ArgS(args, 2), "slowlog-log-slower-than")) {
+      int64_t usec;
+      if (!absl::SimpleAtoi(ArgS(args, 3), &usec)) {
+        return (*cntx)->SendError(absl::StrCat("Invalid argument '", ArgS(args, 3),
+                                               "' for CONFIG SET 'slowlog-log-slower-than'"));
+      }
+      SlowLog::SetThreshold(usec);
+    } else if (args.size() == 4 && absl::EqualsIgnoreCase(ArgS(args, 2), "slowlog-max-len")) {
+      uint32_t len;
+      if (!absl::SimpleAtoi(ArgS(args, 3), &len)) {
+        return (*cntx)->SendError(absl::StrCat("Invalid argument '", ArgS(args, 3),
+                                               "' for CONFIG SET 'slowlog-max-len'"));
+      }
+      SlowLog::SetMaxLen(len);
+    } else if (args.size() == 4 &&
+               absl::EqualsIgnoreCase(ArgS(args, 2), "pubsub-overflow-policy")) {
+      Connection::OverflowPolicy policy;
+      if (!ParseOverflowPolicy(ArgS(args, 3), &policy)) {
+        return (*cntx)->SendError(absl::StrCat("Invalid argument '", ArgS(args, 3),
+                                               "' for CONFIG SET 'pubsub-overflow-policy'"));
+      }
+      Connection::SetPubSubLimits(Connection::GetPubSubLimits(), policy);
+    }
     return (*cntx)->SendOk();
   } else if (sub_cmd == "GET" && args.size() == 3) {
     string_view param = ArgS(args, 2);
-    string_view res[2] = {param, "tbd"};
+    string value = "tbd";
+    if (absl::EqualsIgnoreCase(param, "notify-keyspace-events"))
+      value = KeyspaceEvents::FlagsToString(KeyspaceEvents::GetFlags());
+    else if (absl::EqualsIgnoreCase(param, "client-output-buffer-limit"))
+      value = PubSubLimitsStr(Connection::GetPubSubLimits());
+    else if (absl::EqualsIgnoreCase(param, "pubsub-overflow-policy"))
+      value = OverflowPolicyName(Connection::GetOverflowPolicy());
+    else if (absl::EqualsIgnoreCase(param, "slowlog-log-slower-than"))
+      value = absl::StrCat(SlowLog::threshold());
+    else if (absl::EqualsIgnoreCase(param, "slowlog-max-len"))
+      value = absl::StrCat(SlowLog::max_len());
+    string_view res[2] = {param, value};
 
     return (*cntx)->SendStringArr(res);
   } else if (sub_cmd == "RESETSTAT") {
@@ -1091,6 +1958,8 @@ void ServerFamily::Config(CmdArgList args, ConnectionContext* cntx) {
       stats->err_count_map.clear();
       stats->command_cnt = 0;
       stats->async_writes_cnt = 0;
+      ServerState::tlocal()->cmd_latency.clear();
+      TxTrace::Reset();
     });
     return (*cntx)->SendOk();
   } else {
@@ -1114,24 +1983,45 @@ void ServerFamily::Memory(CmdArgList args, ConnectionContext* cntx) {
   return mem_cmd.Run(args);
 }
 
+// SAVE [DF | DELTA <base>]
 void ServerFamily::Save(CmdArgList args, ConnectionContext* cntx) {
   string err_detail;
   bool new_version = false;
-  if (args.size() > 2) {
+  string_view delta_base;
+  if (args.size() > 3) {
     return (*cntx)->SendError(kSyntaxErr);
   }
 
-  if (args.size() == 2) {
+  if (args.size() >= 2) {
     ToUpper(&args[1]);
     string_view sub_cmd = ArgS(args, 1);
-    if (sub_cmd == "DF") {
+    if (sub_cmd == "DF" && args.size() == 2) {
       new_version = true;
+    } else if (sub_cmd == "DELTA" && args.size() == 3) {
+      delta_base = ArgS(args, 2);
     } else {
       return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "SAVE"), kSyntaxErrType);
     }
   }
 
-  GenericError ec = DoSave(new_version, cntx->transaction);
+  if (args.size() == 3) {
+    if (!GetFlag(FLAGS_delta_snapshots)) {
+      return (*cntx)->SendError("delta snapshots are disabled, see --delta_snapshots");
+    }
+
+    // Only the deletions since the last snapshot are tracked.
+    string last_file;
+    {
+      lock_guard lk(save_mu_);
+      last_file = last_save_info_->file_name;
+    }
+    if (delta_base.empty() || delta_base != last_file) {
+      return (*cntx)->SendError(absl::StrCat("delta base must be the last snapshot '", last_file,
+                                             "'"));
+    }
+  }
+
+  GenericError ec = DoSave(new_version, cntx->transaction, delta_base);
   if (ec) {
     (*cntx)->SendError(ec.Format());
   } else {
@@ -1148,12 +2038,30 @@ static void MergeInto(const DbSlice::Stats& src, Metrics* dest) {
 
   dest->events += src.events;
   dest->small_string_bytes += src.small_string_bytes;
+  dest->lazyfree_pending_objects += src.lazyfree_pending;
+  dest->lazyfree_pending_memory += src.lazyfree_pending_memory;
+}
+
+shared_ptr<const Metrics> ServerFamily::GetCachedMetrics() const {
+  uint32_t max_age_ms = GetFlag(FLAGS_info_max_age_ms);
+  if (max_age_ms == 0)
+    return make_shared<const Metrics>(GetMetrics());
+
+  // The callers that wait for the lock find the metrics that the holder gathered.
+  lock_guard lk(metrics_mu_);
+  uint64_t now_ms = absl::GetCurrentTimeNanos() / 1000000;
+  if (!cached_metrics_ || now_ms >= cached_metrics_ms_ + max_age_ms) {
+    cached_metrics_ = make_shared<const Metrics>(GetMetrics());
+    cached_metrics_ms_ = absl::GetCurrentTimeNanos() / 1000000;
+  }
+  return cached_metrics_;
 }
 
 Metrics ServerFamily::GetMetrics() const {
   Metrics result;
 
   fibers::mutex mu;
+  result.shard_load.resize(shard_set->size());
 
   auto cb = [&](ProactorBase* pb) {
     EngineShard* shard = EngineShard::tlocal();
@@ -1164,15 +2072,27 @@ Metrics ServerFamily::GetMetrics() const {
     result.uptime = time(NULL) - this->start_time_;
     result.conn_stats += ss->connection_stats;
     result.qps += uint64_t(ss->MovingSum6());
+    result.lua_memory += ss->GetInterpreterManager().used_bytes();
+    if (ss->busy_poller)
+      result.busy_poll += ss->busy_poller->stats();
+    for (const auto& [name, hist] : ss->cmd_latency)
+      result.cmd_latency[name].Merge(hist);
 
     if (shard) {
+      result.shard_load[shard->shard_id()] = shard->GetLoadStats();
       MergeInto(shard->db_slice().GetStats(), &result);
+      shard->db_slice().MergeSlotStats(0, &result.slot_stats);
 
       result.heap_used_bytes += shard->UsedMemory();
       if (shard->tiered_storage()) {
         result.tiered_stats += shard->tiered_storage()->GetStats();
       }
       result.shard_stats += shard->stats();
+      for (const auto& k_v : shard->cmd_mem_stats()) {
+        auto& dest = result.cmd_mem_stats[k_v.first];
+        dest.allocated += k_v.second.allocated;
+        dest.freed += k_v.second.freed;
+      }
       result.traverse_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_TRAVERSE);
       result.delete_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_DELETE);
     }
@@ -1213,7 +2133,14 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
   };
 
 #define ADD_HEADER(x) absl::StrAppend(&info, x "\r\n")
-  Metrics m = GetMetrics();
+  // The sections that do not need the stats of the threads skip gathering them.
+  shared_ptr<const Metrics> metrics_ptr;
+  if (section == "SERVER" || section == "CPU") {
+    metrics_ptr = make_shared<const Metrics>();
+  } else {
+    metrics_ptr = GetCachedMetrics();
+  }
+  const Metrics& m = *metrics_ptr;
 
   if (should_enter("SERVER")) {
     ProactorBase::ProactorKind kind = ProactorBase::me()->GetKind();
@@ -1227,7 +2154,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("multiplexing_api", multiplex_api);
     append("tcp_port", GetFlag(FLAGS_port));
 
-    size_t uptime = m.uptime;
+    size_t uptime = time(NULL) - start_time_;
     append("uptime_in_seconds", uptime);
     append("uptime_in_days", uptime / (3600 * 24));
   }
@@ -1244,6 +2171,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("connected_clients", m.conn_stats.num_conns);
     append("client_read_buf_capacity", m.conn_stats.read_buf_capacity);
     append("blocked_clients", m.conn_stats.num_blocked_clients);
+    append("stalled_clients", m.conn_stats.num_stalled_clients);
   }
 
   if (should_enter("MEMORY")) {
@@ -1253,6 +2181,9 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("used_memory_human", HumanReadableNumBytes(m.heap_used_bytes));
     append("used_memory_peak", used_mem_peak.load(memory_order_relaxed));
 
+    append("used_memory_lua", m.lua_memory);
+    append("used_memory_lua_human", HumanReadableNumBytes(m.lua_memory));
+
     append("comitted_memory", GetMallocCurrentCommitted());
 
     if (sdata_res.has_value()) {
@@ -1276,10 +2207,20 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("updateval_amount", total.update_value_amount);
     append("listpack_blobs", total.listpack_blob_cnt);
     append("listpack_bytes", total.listpack_bytes);
+    append("listpack_conversions", total.listpack_conversions);
+    append("listpack_early_conversions", total.listpack_early_conversions);
     append("small_string_bytes", m.small_string_bytes);
+    // Keys that passed their deadline but were not deleted yet, and the memory they hold.
+    append("expired_pending_keys", total.expired_pending_count);
+    append("expired_pending_memory", total.expired_pending_memory);
+    append("expire_wheel_memory", total.expire_wheel_memory);
+    append("lazyfree_pending_objects", m.lazyfree_pending_objects);
+    append("lazyfree_pending_memory", m.lazyfree_pending_memory);
     append("maxmemory", max_memory_limit);
     append("maxmemory_human", HumanReadableNumBytes(max_memory_limit));
     append("cache_mode", GetFlag(FLAGS_cache_mode) ? "cache" : "store");
+    if (EvictionPolicy policy; GetFlagEvictionPolicy(&policy))
+      append("maxmemory_policy", EvictionPolicyName(policy));
   }
 
   if (should_enter("STATS")) {
@@ -1300,6 +2241,11 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("garbage_collected", m.events.garbage_collected);
     append("bump_ups", m.events.bumpups);
     append("stash_unloaded", m.events.stash_unloaded);
+    append("admission_hits", m.events.admission_hits);
+    append("admission_admitted", m.events.admission_admitted);
+    append("admission_rejected", m.events.admission_rejected);
+    append("db_quota_rejections", m.events.quota_rejections);
+    append("db_quota_evictions", m.events.quota_evictions);
     append("traverse_ttl_sec", m.traverse_ttl_per_sec);
     append("delete_ttl_sec", m.delete_ttl_per_sec);
     append("keyspace_hits", -1);
@@ -1307,7 +2253,39 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("total_reads_processed", m.conn_stats.io_read_cnt);
     append("total_writes_processed", m.conn_stats.io_write_cnt);
     append("async_writes_count", m.conn_stats.async_writes_cnt);
+    append("pubsub_queue_bytes", m.conn_stats.pubsub_queue_bytes);
+    append("pubsub_dropped_messages", m.conn_stats.pubsub_dropped_cnt);
+    append("pubsub_coalesced_messages", m.conn_stats.pubsub_coalesced_cnt);
+    append("pubsub_overflow_disconnects", m.conn_stats.pubsub_overflow_disconnects);
+    append("monitor_dropped_messages", m.conn_stats.monitor_dropped_cnt);
+    append("dispatch_yields", m.conn_stats.dispatch_yields);
+    append("pipeline_queue_commands", m.conn_stats.pipeline_queue_cmds);
+    append("pipeline_queue_bytes", m.conn_stats.pipeline_queue_bytes);
+    append("pipeline_read_stalls", m.conn_stats.pipeline_read_stalls);
     append("parser_err_count", m.conn_stats.parser_err_cnt);
+    append("tx_quick_runs", m.shard_stats.quick_runs);
+    append("tx_ooo_runs", m.shard_stats.ooo_runs);
+    append("tx_ooo_queue_runs", m.shard_stats.ooo_queue_runs);
+    append("tx_fast_lane_runs", m.shard_stats.fast_lane_runs);
+    append("tx_heavy_slices", m.shard_stats.heavy_slices);
+    append("defrag_scans", m.shard_stats.defrag_scans);
+    append("defrag_realloc_total", m.shard_stats.defrag_realloc);
+    append("list_compressed_nodes_total", m.shard_stats.list_compressed_nodes);
+    append("list_compress_saved_bytes", m.shard_stats.list_compress_saved_bytes);
+    append("tx_hops", m.shard_stats.tx_hops);
+    append("tx_cross_shard_hops", m.shard_stats.tx_cross_shard_hops);
+    append("heartbeats", m.shard_stats.heartbeats);
+    append("heartbeat_skips", m.shard_stats.heartbeat_skips);
+    append("heartbeat_stats_usec", m.shard_stats.heartbeat_stats_ns / 1000);
+    append("heartbeat_expire_usec", m.shard_stats.heartbeat_expire_ns / 1000);
+    append("heartbeat_evict_usec", m.shard_stats.heartbeat_evict_ns / 1000);
+    append("heartbeat_maintenance_usec", m.shard_stats.heartbeat_maintenance_ns / 1000);
+    append("busy_poll_usec", m.busy_poll.poll_ns / 1000);
+    append("busy_poll_sleep_usec", m.busy_poll.sleep_ns / 1000);
+    append("shard_hops_imbalance",
+           ShardImbalance(m.shard_load, [](const auto& l) { return l.hops_per_sec; }));
+    append("shard_memory_imbalance",
+           ShardImbalance(m.shard_load, [](const auto& l) { return l.heap_bytes; }));
   }
 
   if (should_enter("TIERED", true)) {
@@ -1316,8 +2294,23 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("external_bytes", total.external_size);
     append("external_reads", m.tiered_stats.external_reads);
     append("external_writes", m.tiered_stats.external_writes);
+    append("external_coalesced_reads", m.tiered_stats.external_coalesced_reads);
+    append("external_promotions", m.tiered_stats.external_promotions);
+    append("external_demotions", m.tiered_stats.external_demotions);
+    append("external_relocations", m.tiered_stats.external_relocations);
+    append("external_punched_bytes", m.tiered_stats.external_punched_bytes);
+    append("external_pressure_offloads", m.tiered_stats.external_pressure_offloads);
+    append("external_throttled_steps", m.tiered_stats.external_throttled_steps);
+    append("external_eviction_offloads", m.tiered_stats.external_eviction_offloads);
     append("external_reserved", m.tiered_stats.storage_reserved);
     append("external_capacity", m.tiered_stats.storage_capacity);
+    append("external_free", m.tiered_stats.storage_free);
+
+    // 0 if the free storage is one range, close to 1 if it is scattered in small ranges.
+    const TieredStats& ts = m.tiered_stats;
+    double fragmentation =
+        ts.storage_free ? 1.0 - double(ts.storage_max_free_range) / ts.storage_free : 0.0;
+    append("external_fragmentation", fragmentation);
   }
 
   if (should_enter("PERSISTENCE", true)) {
@@ -1327,10 +2320,15 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       lock_guard lk(save_mu_);
       save_info = last_save_info_;
     }
+    append("loading", int(ServerState::tlocal()->gstate() == GlobalState::LOADING));
+
     // when when last save
     append("last_save", save_info->save_time);
     append("last_save_duration_sec", save_info->duration_sec);
     append("last_save_file", save_info->file_name);
+    append("snapshot_lag_usec", m.shard_stats.snapshot_lag_usec);
+    append("snapshot_buffer_bytes", SliceSnapshot::BufferedBytes());
+    append("snapshot_spill_bytes", m.shard_stats.snapshot_spill_bytes);
 
     for (const auto& k_v : save_info->freq_map) {
       append(StrCat("rdb_", k_v.first), k_v.second);
@@ -1344,8 +2342,6 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
 
     if (etl.is_master) {
       append("role", "master");
-      append("connected_slaves", m.conn_stats.num_replicas);
-      append("master_replid", master_id_);
     } else {
       append("role", "slave");
 
@@ -1361,7 +2357,31 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       append("master_link_status", link);
       append("master_last_io_seconds_ago", rinfo.master_last_io_sec);
       append("master_sync_in_progress", rinfo.sync_in_progress);
+      append("slave_applied_lsns", absl::StrJoin(rinfo.flow_lsns, ","));
+      if (rinfo.staleness_ms != UINT64_MAX)
+        append("slave_staleness_ms", rinfo.staleness_ms);
     }
+
+    // Replicas serve their own replicas as well, see DflyCmd.
+    append("connected_slaves", m.conn_stats.num_replicas);
+    append("master_replid", master_id_);
+
+    DflyCmd::ReplicationStats stats = dfly_cmd_->GetReplicationStats();
+    append("repl_stream_raw_bytes", stats.stream_raw_bytes);
+    append("repl_stream_wire_bytes", stats.stream_wire_bytes);
+    double ratio =
+        stats.stream_wire_bytes ? double(stats.stream_raw_bytes) / stats.stream_wire_bytes : 1.0;
+    append("repl_stream_compression_ratio", ratio);
+    append("sync_full", stats.full_syncs);
+    append("sync_partial_ok", stats.partial_syncs);
+
+    // The LSNs replicas report in slave_applied_lsns, in the same order.
+    vector<LSN> lsns(shard_set->pool()->size());
+    shard_set->pool()->AwaitFiberOnAll([&](unsigned index, auto*) {
+      if (EngineShard::tlocal() && journal_)
+        lsns[index] = journal_->GetStreamedLsn();
+    });
+    append("repl_journal_lsns", absl::StrJoin(lsns, ","));
   }
 
   if (should_enter("COMMANDSTATS", true)) {
@@ -1376,6 +2396,59 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     for (const auto& k_v : m.conn_stats.cmd_count_map) {
       append(StrCat("cmd_", k_v.first), k_v.second);
     }
+
+    for (const auto& k_v : m.cmd_mem_stats) {
+      append(StrCat("cmd_mem_", k_v.first),
+             StrCat("allocated=", k_v.second.allocated, ",freed=", k_v.second.freed));
+    }
+  }
+
+  if (should_enter("LATENCYSTATS", true)) {
+    ADD_HEADER("# Latencystats");
+    for (const auto& [name, hist] : m.cmd_latency) {
+      append(StrCat("latency_percentiles_usec_", absl::AsciiStrToLower(name)),
+             StrCat("p50=", hist.Percentile(50), ",p99=", hist.Percentile(99),
+                    ",p99.9=", hist.Percentile(99.9)));
+    }
+  }
+
+  if (should_enter("SHARDS", true)) {
+    ADD_HEADER("# Shards");
+    for (size_t sid = 0; sid < m.shard_load.size(); ++sid) {
+      const auto& load = m.shard_load[sid];
+      append(StrCat("shard_", sid),
+             StrCat("txq_len=", load.txq_len, ",hops_per_sec=", load.hops_per_sec,
+                    ",busy_ratio=", load.busy_ratio, ",hops=", load.hops,
+                    ",cross_shard_hops=", load.cross_shard_hops,
+                    ",blocked=", load.blocked_transactions, ",heap_bytes=", load.heap_bytes,
+                    ",numa_node=", load.numa_node));
+    }
+  }
+
+  if (should_enter("NUMA", true)) {
+    ADD_HEADER("# Numa");
+    struct NodeStats {
+      unsigned shards = 0;
+      uint64_t hops_per_sec = 0;
+      uint64_t hops = 0;
+      size_t heap_bytes = 0;
+    };
+
+    map<int, NodeStats> nodes;  // -1 for the shards of an unknown node.
+    for (const auto& load : m.shard_load) {
+      NodeStats& node = nodes[load.numa_node];
+      ++node.shards;
+      node.hops_per_sec += load.hops_per_sec;
+      node.hops += load.hops;
+      node.heap_bytes += load.heap_bytes;
+    }
+
+    append("numa_nodes", facade::NumaTopology::Get().num_nodes());
+    for (const auto& [id, node] : nodes) {
+      append(StrCat("numa_node_", id),
+             StrCat("shards=", node.shards, ",hops_per_sec=", node.hops_per_sec,
+                    ",hops=", node.hops, ",heap_bytes=", node.heap_bytes));
+    }
   }
 
   if (should_enter("ERRORSTATS", true)) {
@@ -1398,6 +2471,16 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     }
   }
 
+  if (should_enter("SLOTS", true)) {
+    ADD_HEADER("# Slots");
+    for (size_t i = 0; i < m.slot_stats.size(); ++i) {
+      const auto& stats = m.slot_stats[i];
+      if (stats.key_count > 0) {
+        append(StrCat("slot", i), StrCat("keys=", stats.key_count, ",memory=", stats.memory_bytes));
+      }
+    }
+  }
+
   if (should_enter("CPU")) {
     ADD_HEADER("# CPU");
     struct rusage ru, cu, tu;
@@ -1416,27 +2499,26 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void ServerFamily::Hello(CmdArgList args, ConnectionContext* cntx) {
-  // Allow calling this commands with no arguments or protover=2
-  // technically that is all that is supported at the moment.
+  // Allow calling this commands with no arguments or protover=2|3.
   // For all other cases degrade to 'unknown command' so that clients
-  // checking for the existence of the command to detect if RESP3 is
-  // supported or whether authentication can be performed using HELLO
-  // will gracefully fallback to RESP2 and using the AUTH command explicitly.
+  // checking whether authentication can be performed using HELLO
+  // will gracefully fallback to using the AUTH command explicitly.
   if (args.size() > 1) {
     string_view proto_version = ArgS(args, 1);
-    if (proto_version != "2" || args.size() > 2) {
+    if ((proto_version != "2" && proto_version != "3") || args.size() > 2) {
       (*cntx)->SendError(UnknownCmd("HELLO", args.subspan(1)));
       return;
     }
+    (*cntx)->SetResp3(proto_version == "3");
   }
 
-  (*cntx)->StartArray(12);
+  (*cntx)->StartCollection(6, RedisReplyBuilder::MAP);
   (*cntx)->SendBulkString("server");
   (*cntx)->SendBulkString("redis");
   (*cntx)->SendBulkString("version");
   (*cntx)->SendBulkString(GetVersion());
   (*cntx)->SendBulkString("proto");
-  (*cntx)->SendLong(2);
+  (*cntx)->SendLong((*cntx)->IsResp3() ? 3 : 2);
   (*cntx)->SendBulkString("id");
   (*cntx)->SendLong(cntx->owner()->GetClientId());
   (*cntx)->SendBulkString("mode");
@@ -1454,14 +2536,17 @@ void ServerFamily::ReplicaOf(CmdArgList args, ConnectionContext* cntx) {
     // use this lock as critical section to prevent concurrent replicaof commands running.
     unique_lock lk(replicaof_mu_);
 
-    // Switch to primary mode.
+    // Switch to primary mode. The replica stops before the writes are let in, so the dataset
+    // is still the one of its positions in the journal of the master, which the master can
+    // resume from when it follows this instance in turn.
     if (!ServerState::tlocal()->is_master) {
       auto repl_ptr = replica_;
       CHECK(repl_ptr);
 
+      replica_->Stop();
+      RecordPromotion(*replica_);
       pool.AwaitFiberOnAll(
           [&](util::ProactorBase* pb) { ServerState::tlocal()->is_master = true; });
-      replica_->Stop();
       replica_.reset();
     }
 
@@ -1478,6 +2563,18 @@ void ServerFamily::ReplicaOf(CmdArgList args, ConnectionContext* cntx) {
   auto new_replica = make_shared<Replica>(string(host), port, &service_);
 
   unique_lock lk(replicaof_mu_);
+
+  // A replica that starts from a snapshot of its master keeps the loaded data and asks only for
+  // the journal entries after it.
+  string bootstrap_id;
+  vector<LSN> bootstrap_lsns;
+  if (!replica_)
+    bootstrap_lsns = TakeLoadedReplOffsets(&bootstrap_id);
+  if (!bootstrap_lsns.empty())
+    new_replica->SetBootstrapOffsets(bootstrap_id, std::move(bootstrap_lsns));
+
+  bool was_master = !replica_;
+  promotion_.reset();
   if (replica_) {
     replica_->Stop();  // NOTE: consider introducing update API flow.
   } else {
@@ -1494,12 +2591,35 @@ void ServerFamily::ReplicaOf(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  // Flushing all the data after we marked this instance as replica.
   Transaction* transaction = cntx->transaction;
   transaction->Schedule();
 
-  auto cb = [](Transaction* t, EngineShard* shard) {
-    shard->db_slice().FlushDb(DbSlice::kDbAll);
+  // A master that steps down keeps its dataset at the positions of its journal, in case the new
+  // master was promoted from a replica of it that got all the entries. The write commands
+  // that are still running conclude before this hop, since it locks all the shards.
+  if (was_master && !replica_->HasBootstrapOffsets()) {
+    vector<LSN> shard_lsns(shard_set->size());
+    atomic_bool journaled{true};
+    transaction->Execute(
+        [&](Transaction* t, EngineShard* shard) {
+          if (shard->journal())
+            shard_lsns[shard->shard_id()] = journal_->GetStreamedLsn();
+          else
+            journaled.store(false, memory_order_relaxed);
+          return OpStatus::OK;
+        },
+        false);
+
+    if (journaled.load(memory_order_relaxed))
+      replica_->SetBootstrapOffsets(master_id_, std::move(shard_lsns));
+  }
+
+  // Flushing all the data after we marked this instance as replica. The data of a bootstrap is
+  // flushed by the replica if it needs a full sync after all.
+  bool flush = !replica_->HasBootstrapOffsets();
+  auto cb = [flush](Transaction* t, EngineShard* shard) {
+    if (flush)
+      shard->db_slice().FlushDb(DbSlice::kDbAll);
     return OpStatus::OK;
   };
   transaction->Execute(std::move(cb), true);
@@ -1589,10 +2709,116 @@ void ServerFamily::Latency(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendEmptyArray();
   }
 
+  // LATENCY HISTOGRAM [command ...], with the cumulative counts at the powers of 2 as in Redis.
+  if (sub_cmd == "HISTOGRAM") {
+    absl::flat_hash_map<string_view, LatencyHistogram> latency;
+    fibers::mutex mu;
+    service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+      lock_guard<fibers::mutex> lk(mu);
+      for (const auto& [name, hist] : ServerState::tlocal()->cmd_latency)
+        latency[name].Merge(hist);
+    });
+
+    vector<pair<string_view, const LatencyHistogram*>> selected;
+    for (size_t i = 2; i < args.size(); ++i) {
+      ToUpper(&args[i]);
+      auto it = latency.find(ArgS(args, i));
+      if (it != latency.end())
+        selected.emplace_back(it->first, &it->second);
+    }
+    if (args.size() == 2) {
+      for (const auto& [name, hist] : latency)
+        selected.emplace_back(name, &hist);
+    }
+
+    (*cntx)->StartCollection(selected.size(), RedisReplyBuilder::MAP);
+    for (const auto& [name, hist] : selected) {
+      (*cntx)->SendBulkString(absl::AsciiStrToLower(name));
+      (*cntx)->StartCollection(2, RedisReplyBuilder::MAP);
+      (*cntx)->SendBulkString("calls");
+      (*cntx)->SendLong(hist->count());
+      (*cntx)->SendBulkString("histogram_usec");
+
+      vector<pair<uint64_t, uint64_t>> buckets;
+      for (uint64_t le = 1, prev = 0; prev < hist->count(); le *= 2) {
+        uint64_t count = hist->CountAtMost(le);
+        if (count > prev)
+          buckets.emplace_back(le, count);
+        prev = count;
+      }
+      (*cntx)->StartCollection(buckets.size(), RedisReplyBuilder::MAP);
+      for (const auto& [le, count] : buckets) {
+        (*cntx)->SendLong(le);
+        (*cntx)->SendLong(count);
+      }
+    }
+    return;
+  }
+
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
   (*cntx)->SendError(kSyntaxErr);
 }
 
+// SLOWLOG GET [count] | LEN | RESET. The entries of GET carry the time the command ran in the
+// shards and the shards it spanned, after the fields of Redis.
+void ServerFamily::SlowLogCmd(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+  auto& pool = service_.proactor_pool();
+
+  if (sub_cmd == "LEN" && args.size() == 2) {
+    atomic_size_t len{0};
+    pool.Await([&](auto*) {
+      len.fetch_add(ServerState::tlocal()->slowlog.entries().size(), memory_order_relaxed);
+    });
+    return (*cntx)->SendLong(len.load(memory_order_relaxed));
+  }
+
+  if (sub_cmd == "RESET" && args.size() == 2) {
+    pool.Await([](auto*) { ServerState::tlocal()->slowlog.Reset(); });
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd != "GET" || args.size() > 3) {
+    return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "SLOWLOG"), kSyntaxErrType);
+  }
+
+  int64_t count = 10;
+  if (args.size() == 3 && (!absl::SimpleAtoi(ArgS(args, 2), &count) || count < -1)) {
+    return (*cntx)->SendError("count should be greater than or equal to -1");
+  }
+  size_t limit = count == -1 ? SIZE_MAX : size_t(count);
+
+  vector<vector<SlowLog::Entry>> thread_entries(pool.size());
+  pool.Await([&](auto*) {
+    const auto& entries = ServerState::tlocal()->slowlog.entries();
+    size_t n = min(limit, entries.size());
+    thread_entries[ProactorBase::GetIndex()].assign(entries.begin(), entries.begin() + n);
+  });
+
+  vector<SlowLog::Entry> entries;
+  for (auto& te : thread_entries) {
+    move(te.begin(), te.end(), back_inserter(entries));
+  }
+  sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.id > b.id; });
+  entries.resize(min(limit, entries.size()));
+
+  (*cntx)->StartArray(entries.size());
+  for (const auto& entry : entries) {
+    (*cntx)->StartArray(8);
+    (*cntx)->SendLong(entry.id);
+    (*cntx)->SendLong(entry.unix_ts);
+    (*cntx)->SendLong(entry.duration_usec);
+    (*cntx)->SendStringArr(entry.args);
+    (*cntx)->SendBulkString(entry.client_addr);
+    (*cntx)->SendBulkString(entry.client_name);
+    (*cntx)->SendLong(entry.exec_usec);
+    (*cntx)->StartArray(entry.shards.size());
+    for (ShardId sid : entry.shards)
+      (*cntx)->SendLong(sid);
+  }
+}
+
 void ServerFamily::_Shutdown(CmdArgList args, ConnectionContext* cntx) {
   CHECK_NOTNULL(acceptor_)->Stop();
   (*cntx)->SendOk();
@@ -1628,7 +2854,7 @@ void ServerFamily::Register(CommandRegistry* registry) {
             << CI{"CONFIG", CO::ADMIN, -2, 0, 0, 0}.HFUNC(Config)
             << CI{"DBSIZE", CO::READONLY | CO::FAST | CO::LOADING, 1, 0, 0, 0}.HFUNC(DbSize)
             << CI{"DEBUG", CO::ADMIN | CO::LOADING, -2, 0, 0, 0}.HFUNC(Debug)
-            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(FlushDb)
+            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushDb)
             << CI{"FLUSHALL", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushAll)
             << CI{"INFO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Info)
             << CI{"HELLO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Hello)
@@ -1636,6 +2862,7 @@ void ServerFamily::Register(CommandRegistry* registry) {
             << CI{"LATENCY", CO::NOSCRIPT | CO::LOADING | CO::FAST, -2, 0, 0, 0}.HFUNC(Latency)
             << CI{"MEMORY", kMemOpts, -2, 0, 0, 0}.HFUNC(Memory)
             << CI{"SAVE", CO::ADMIN | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(Save)
+            << CI{"SLOWLOG", CO::ADMIN | CO::FAST | CO::LOADING, -2, 0, 0, 0}.HFUNC(SlowLogCmd)
             << CI{"SHUTDOWN", CO::ADMIN | CO::NOSCRIPT | CO::LOADING, 1, 0, 0, 0}.HFUNC(_Shutdown)
             << CI{"SLAVEOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
             << CI{"REPLICAOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
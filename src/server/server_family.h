@@ -6,8 +6,10 @@
 
 #include <boost/fiber/future.hpp>
 
+#include "core/latency_histogram.h"
 #include "facade/conn_context.h"
 #include "facade/redis_parser.h"
+#include "server/busy_poll.h"
 #include "server/engine_shard_set.h"
 #include "util/proactor_pool.h"
 
@@ -35,12 +37,20 @@ struct Metrics {
   SliceEvents events;
   TieredStats tiered_stats;
   EngineShard::Stats shard_stats;
+  EngineShard::CmdMemStatsMap cmd_mem_stats;
+  absl::flat_hash_map<std::string_view, LatencyHistogram> cmd_latency;
+  std::vector<SlotStats> slot_stats;  // in cluster mode, indexed by slot.
+  std::vector<EngineShard::LoadStats> shard_load;  // indexed by shard id.
+  BusyPoller::Stats busy_poll;
 
   size_t uptime = 0;
   size_t qps = 0;
   size_t heap_used_bytes = 0;
   size_t heap_comitted_bytes = 0;
   size_t small_string_bytes = 0;
+  size_t lazyfree_pending_objects = 0;
+  size_t lazyfree_pending_memory = 0;
+  size_t lua_memory = 0;
   uint32_t traverse_ttl_per_sec = 0;
   uint32_t delete_ttl_per_sec = 0;
 
@@ -74,6 +84,9 @@ class ServerFamily {
 
   Metrics GetMetrics() const;
 
+  // Returns the metrics gathered at most info_max_age_ms ago.
+  std::shared_ptr<const Metrics> GetCachedMetrics() const;
+
   ScriptMgr* script_mgr() {
     return script_mgr_.get();
   }
@@ -81,7 +94,9 @@ class ServerFamily {
   void StatsMC(std::string_view section, facade::ConnectionContext* cntx);
 
   // if new_version is true, saves DF specific, non redis compatible snapshot.
-  GenericError DoSave(bool new_version, Transaction* transaction);
+  // if delta_base is set, saves only the changes since that snapshot, see SAVE DELTA.
+  GenericError DoSave(bool new_version, Transaction* transaction,
+                      std::string_view delta_base = {});
 
   // Burns down and destroy all the data from the database.
   // if kDbAll is passed, burns all the databases to the ground.
@@ -102,6 +117,20 @@ class ServerFamily {
 
   void PauseReplication(bool pause);
 
+  // See Replica::StalenessMs. Must be called only while this instance is a replica.
+  uint64_t ReplicaStalenessMs() const;
+
+  // Called by the replica before it replaces the dataset with a full sync of its master. The
+  // replicas of this instance can not follow the load, which is not journaled, so they are
+  // disconnected and can not resume from the journal backlog.
+  void OnMasterFullSync();
+
+  // Returns the positions in the journals of the threads of this instance to resume from, if
+  // it was promoted from a replica of master_id after it had applied all the entries of its
+  // shards up to shard_lsns, so that a dataset with these positions matches the one taken over.
+  std::optional<std::vector<LSN>> GetPromotionOffsets(std::string_view master_id,
+                                                      absl::Span<const LSN> shard_lsns);
+
   const std::string& master_id() const {
     return master_id_;
   }
@@ -110,6 +139,11 @@ class ServerFamily {
     return journal_.get();
   }
 
+  // Whether the journal persists the changes, see --persistent_journal.
+  bool IsJournalPersistent() const {
+    return journal_generation_ != 0;
+  }
+
   void OnClose(ConnectionContext* cntx);
 
   void BreakOnShutdown();
@@ -132,6 +166,7 @@ class ServerFamily {
   void Hello(CmdArgList args, ConnectionContext* cntx);
   void LastSave(CmdArgList args, ConnectionContext* cntx);
   void Latency(CmdArgList args, ConnectionContext* cntx);
+  void SlowLogCmd(CmdArgList args, ConnectionContext* cntx);
   void Psync(CmdArgList args, ConnectionContext* cntx);
   void ReplicaOf(CmdArgList args, ConnectionContext* cntx);
   void ReplConf(CmdArgList args, ConnectionContext* cntx);
@@ -146,8 +181,20 @@ class ServerFamily {
 
   std::error_code LoadRdb(const std::string& rdb_file);
 
+  // Replays the persistent journal on top of the loaded data and opens it for the changes from
+  // now on. snapshot_gen is the journal generation of the loaded snapshot, if there is one.
+  std::error_code RecoverJournal(std::optional<uint64_t> snapshot_gen);
+
+  // Returns the positions of the shards in the journal of master_id if the loaded snapshot has
+  // them for all the shards and no write changed the dataset since. They are handed out once.
+  std::vector<LSN> TakeLoadedReplOffsets(std::string* master_id);
+
   void SnapshotScheduling(const SnapshotSpec& time);
 
+  // Records where the stopped replica took over from its master, see GetPromotionOffsets.
+  // Opens the journal, so that it keeps the writes that follow for the former master.
+  void RecordPromotion(const Replica& replica);
+
   boost::fibers::fiber snapshot_fiber_;
   boost::fibers::future<std::error_code> load_result_;
 
@@ -158,9 +205,17 @@ class ServerFamily {
   util::ListenerInterface* main_listener_ = nullptr;
   util::ProactorBase* pb_task_ = nullptr;
 
-  mutable ::boost::fibers::mutex replicaof_mu_, save_mu_;
+  mutable ::boost::fibers::mutex replicaof_mu_, save_mu_, load_mu_;
   std::shared_ptr<Replica> replica_;  // protected by replica_of_mu_
 
+  // Set by REPLICAOF NO ONE if the replica was streaming from a Dragonfly master.
+  struct Promotion {
+    std::string master_id;
+    std::vector<LSN> master_lsns;  // the applied journal of the master, by flow
+    std::vector<LSN> lsns;         // the own journal at the promotion, by shard
+  };
+  std::optional<Promotion> promotion_;  // protected by replica_of_mu_
+
   std::unique_ptr<ScriptMgr> script_mgr_;
   std::unique_ptr<journal::Journal> journal_;
   std::unique_ptr<DflyCmd> dfly_cmd_;
@@ -168,9 +223,21 @@ class ServerFamily {
 
   time_t start_time_ = 0;  // in seconds, epoch time.
 
+  mutable ::boost::fibers::mutex metrics_mu_;
+  mutable std::shared_ptr<const Metrics> cached_metrics_;  // protected by metrics_mu_
+  mutable uint64_t cached_metrics_ms_ = 0;
+
   std::shared_ptr<LastSaveInfo> last_save_info_;  // protected by save_mu_;
   std::atomic_bool is_saving_{false};
 
+  // Directory of the persistent journal, empty if it is disabled.
+  std::string journal_dir_;
+
+  // Generation of the journal files that receive the changes, 0 until the journal is open.
+  uint64_t journal_generation_ = 0;
+  std::atomic_uint64_t loaded_journal_generation_{0};
+  std::vector<ReplOffset> loaded_repl_offsets_;  // protected by load_mu_
+
   util::fibers_ext::Done is_snapshot_done_;
   std::unique_ptr<util::fibers_ext::FiberQueueThreadPool> fq_threadpool_;
 };
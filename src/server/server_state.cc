@@ -4,8 +4,12 @@
 
 #include "server/server_state.h"
 
+#include <absl/random/distributions.h>
+#include <absl/random/random.h>
+
 #include "base/logging.h"
 #include "server/conn_context.h"
+#include "server/engine_shard_set.h"
 
 namespace dfly {
 
@@ -17,16 +21,6 @@ void MonitorsRepo::Add(ConnectionContext* connection) {
   monitors_.push_back(connection);
 }
 
-void MonitorsRepo::Send(const std::string& msg) {
-  if (!monitors_.empty()) {
-    VLOG(1) << "thread " << util::ProactorBase::GetIndex() << " sending monitor message '" << msg
-            << "' for " << monitors_.size();
-    for (auto monitor_conn : monitors_) {
-      monitor_conn->SendMonitorMsg(msg);
-    }
-  }
-}
-
 void MonitorsRepo::Remove(const ConnectionContext* conn) {
   auto it = std::find_if(monitors_.begin(), monitors_.end(),
                          [&conn](const auto& val) { return val == conn; });
@@ -39,13 +33,81 @@ void MonitorsRepo::Remove(const ConnectionContext* conn) {
   }
 }
 
-void MonitorsRepo::NotifyChangeCount(bool added) {
-  if (added) {
-    ++global_count_;
-  } else {
-    DCHECK(global_count_ > 0);
-    --global_count_;
+void MonitorsRepo::AddFilter(std::shared_ptr<const MonitorFilter> filter) {
+  RemoveFilter(filter->conn);
+  filters_.push_back(std::move(filter));
+}
+
+void MonitorsRepo::RemoveFilter(const ConnectionContext* conn) {
+  auto it = std::find_if(filters_.begin(), filters_.end(),
+                         [conn](const auto& filter) { return filter->conn == conn; });
+  if (it != filters_.end())
+    filters_.erase(it);
+}
+
+void MonitorsRepo::Dispatch(DbIndex db_index, CmdArgList args,
+                            absl::FunctionRef<std::string()> make_msg) {
+  thread_local absl::InsecureBitGen bitgen;
+
+  std::optional<std::string> msg;
+  for (const auto& filter : filters_) {
+    if (!filter->Matches(db_index, args))
+      continue;
+    if (filter->sample_ratio < 1 && !absl::Bernoulli(bitgen, filter->sample_ratio))
+      continue;
+
+    if (!msg)
+      msg = make_msg();
+    if (pending_.size() <= filter->thread)
+      pending_.resize(shard_set->pool()->size());
+    pending_[filter->thread].emplace_back(filter->conn, *msg);
   }
+
+  // The messages of this event loop turn go to each thread in one dispatch.
+  if (msg && !flush_scheduled_) {
+    flush_scheduled_ = true;
+    util::ProactorBase::me()->DispatchBrief([this] { Flush(); });
+  }
+}
+
+void MonitorsRepo::Flush() {
+  flush_scheduled_ = false;
+  for (unsigned i = 0; i < pending_.size(); ++i) {
+    if (pending_[i].empty())
+      continue;
+    shard_set->pool()->at(i)->DispatchBrief([batch = std::move(pending_[i])]() mutable {
+      ServerState::tlocal()->Monitors().Send(std::move(batch));
+    });
+    pending_[i] = {};
+  }
+}
+
+void MonitorsRepo::Send(MonitorBatch batch) {
+  VLOG(1) << "thread " << util::ProactorBase::GetIndex() << " sending " << batch.size()
+          << " monitor messages";
+  for (auto& [conn, msg] : batch) {
+    if (std::find(monitors_.begin(), monitors_.end(), conn) != monitors_.end())
+      conn->SendMonitorMsg(std::move(msg));
+  }
+}
+
+MonitorFilter::MonitorFilter(ConnectionContext* conn, double sample_ratio, std::string pattern,
+                             std::optional<DbIndex> db)
+    : conn(conn),
+      thread(util::ProactorBase::GetIndex()),
+      sample_ratio(sample_ratio),
+      pattern(std::move(pattern)),
+      db(db) {
+  if (!this->pattern.empty())
+    matcher.emplace(this->pattern);
+}
+
+bool MonitorFilter::Matches(DbIndex db_index, CmdArgList args) const {
+  if (db && *db != db_index)
+    return false;
+  if (!matcher)
+    return true;
+  return args.size() > 1 && matcher->Matches(facade::ArgS(args, 1));
 }
 
 }  // end of namespace dfly
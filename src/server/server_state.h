@@ -4,15 +4,30 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/functional/function_ref.h>
+
+#include <memory>
 #include <optional>
 #include <vector>
 
+#include "core/glob_matcher.h"
 #include "core/interpreter.h"
+#include "core/latency_histogram.h"
+#include "core/token_bucket.h"
+#include "server/busy_poll.h"
+#include "server/cluster/cluster_config.h"
 #include "server/common.h"
+#include "server/slowlog.h"
+#include "util/fibers/event_count.h"
 #include "util/sliding_counter.h"
 
 typedef struct mi_heap_s mi_heap_t;
 
+namespace facade {
+class Connection;
+}  // namespace facade
+
 namespace dfly {
 
 class ConnectionContext;
@@ -20,13 +35,34 @@ namespace journal {
 class Journal;
 }  // namespace journal
 
+// The options of MONITOR SAMPLE. A command is sent to the monitor if it runs in db (any db
+// if unset), its first argument matches pattern (any command if empty) and it is picked
+// with probability sample_ratio. The filters are shared by all the threads, hence immutable.
+struct MonitorFilter {
+  MonitorFilter(ConnectionContext* conn, double sample_ratio, std::string pattern,
+                std::optional<DbIndex> db);
+
+  MonitorFilter(const MonitorFilter&) = delete;
+  void operator=(const MonitorFilter&) = delete;
+
+  // Checks the db and the pattern, not the sampling.
+  bool Matches(DbIndex db_index, CmdArgList args) const;
+
+  ConnectionContext* conn;
+  unsigned thread;  // of conn.
+  double sample_ratio;
+  std::string pattern;
+  std::optional<GlobMatcher> matcher;  // refers to pattern.
+  std::optional<DbIndex> db;
+};
+
 // This would be used as a thread local storage of sending
 // monitor messages.
 // Each thread will have its own list of all the connections that are
-// used for monitoring. When a connection is set to monitor it would register
-// itself to this list on all i/o threads. When a new command is dispatched,
-// and this list is not empty, it would send in the same thread context as then
-// thread that registered here the command.
+// used for monitoring, and the filters of the monitors of all the threads.
+// When a new command is dispatched, it is checked against the filters before its message
+// is formatted, and the messages for the monitors of each thread are batched into one
+// dispatch to that thread per event loop turn.
 // Note about performance: we are assuming that we would not have many connections
 // that are registered here. This is not pub sub where it must be high performance
 // and may support many to many with tens or more of connections. It is assumed that
@@ -40,37 +76,46 @@ class MonitorsRepo {
   // thread context
   void Add(ConnectionContext* info);
 
-  // Note that this is accepted by value for lifetime reasons
-  // we want to have our own copy since we are assuming that
-  // 1. there will be not to many connections that we in monitor state
-  // 2. we need to have for each of them each own copy for thread safe reasons
-  void Send(const std::string& msg);
-
   // This function remove a connection what was monitored. This function only removes
   // a connection that belong to this thread! Must not be called outside of this
   // thread context
   void Remove(const ConnectionContext* conn);
 
-  // We have for each thread the total number of monitors in the application.
+  // These functions are run on all threads to add or remove the filter of a monitor - the
+  // latter must be called as part of removing a monitor (for example when a connection
+  // is closed). Adding a filter replaces the previous one of its connection.
+  void AddFilter(std::shared_ptr<const MonitorFilter> filter);
+  void RemoveFilter(const ConnectionContext* conn);
+
+  // Queues the message of a command for the monitors whose filters pick it. make_msg is
+  // called at most once, only if some monitor picked the command.
+  void Dispatch(DbIndex db_index, CmdArgList args, absl::FunctionRef<std::string()> make_msg);
+
+  // We have for each thread the filters of all the monitors in the application.
   // So this call is thread safe since we hold a copy of this for each thread.
   // If this return true, then we don't need to run the monitor operation at all.
   bool Empty() const {
-    return global_count_ == 0u;
+    return filters_.empty();
   }
 
-  // This function is run on all threads to either increment or decrement the "shared" counter
-  // of the monitors - it must be called as part of removing a monitor (for example
-  // when a connection is closed).
-  void NotifyChangeCount(bool added);
-
   std::size_t Size() const {
     return monitors_.size();
   }
 
  private:
   using MonitorVec = std::vector<ConnectionContext*>;
-  MonitorVec monitors_;            // save connections belonging to this thread only!
-  unsigned int global_count_ = 0;  // by global its means that we count the monitor for all threads
+  using MonitorBatch = std::vector<std::pair<ConnectionContext*, std::string>>;
+
+  // Sends the batches queued by Dispatch to the threads of their monitors.
+  void Flush();
+
+  // Runs in the thread of the monitors. Skips the ones that stopped monitoring meanwhile.
+  void Send(MonitorBatch batch);
+
+  MonitorVec monitors_;  // save connections belonging to this thread only!
+  std::vector<std::shared_ptr<const MonitorFilter>> filters_;  // of the monitors of all threads.
+  std::vector<MonitorBatch> pending_;                            // per thread of the monitors.
+  bool flush_scheduled_ = false;
 };
 
 // Present in every server thread. This class differs from EngineShard. The latter manages
@@ -100,8 +145,29 @@ class ServerState {  // public struct - to allow initialization.
 
   bool is_master = true;
 
+  // Whether a write command ran in this thread since the last load, see
+  // ServerFamily::TakeLoadedReplOffsets.
+  bool dataset_modified = false;
+
+  // Whether the keyed commands run during LOADING, see --serve_while_loading.
+  bool serve_while_loading = false;
+
+  // Set with --busy_poll_usec.
+  std::unique_ptr<BusyPoller> busy_poller;
+
+  // Per-database buckets of the commands per second, the share of db_max_ops of this thread.
+  // Empty if no limits are set.
+  std::vector<TokenBucket> db_ops_limits;
+
   facade::ConnectionStats connection_stats;
 
+  // Latencies of the commands of this thread by their name, which is the static one of
+  // CommandId. Merged by ServerFamily::GetMetrics.
+  absl::flat_hash_map<std::string_view, LatencyHistogram> cmd_latency;
+
+  // The slow commands of this thread, see ServerFamily::SlowLogCmd.
+  SlowLog slowlog;
+
   void TxCountInc() {
     ++live_transactions_;
   }
@@ -122,7 +188,8 @@ class ServerState {  // public struct - to allow initialization.
     gstate_ = s;
   }
 
-  Interpreter& GetInterpreter();
+  // Returns the pool of the lua interpreters of this thread.
+  InterpreterManager& GetInterpreterManager();
 
   // Returns sum of all requests in the last 6 seconds
   // (not including the current one).
@@ -152,12 +219,24 @@ class ServerState {  // public struct - to allow initialization.
     return monitors_;
   }
 
+  // CLIENT TRACKING connections of this thread by their client id. The shards deliver the
+  // invalidation messages only to the connections that are still registered here.
+  absl::flat_hash_map<uint32_t, facade::Connection*> tracking_clients;
+
+  // The slots this node serves in cluster mode, null until a config is set. See ClusterFamily.
+  std::shared_ptr<const ClusterConfig> cluster_config;
+
+  // The slots whose writes wait while they move to another node, see DflyCmd::SlotsPause.
+  // slots_unpaused is notified when they are released.
+  std::shared_ptr<const SlotSet> paused_slots;
+  util::fibers_ext::EventCount slots_unpaused;
+
  private:
   int64_t live_transactions_ = 0;
   mi_heap_t* data_heap_;
   journal::Journal* journal_ = nullptr;
 
-  std::optional<Interpreter> interpreter_;
+  std::optional<InterpreterManager> interpreter_mgr_;
   GlobalState gstate_ = GlobalState::ACTIVE;
 
   using Counter = util::SlidingCounter<7>;
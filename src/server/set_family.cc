@@ -4,6 +4,8 @@
 
 #include "server/set_family.h"
 
+#include <absl/random/random.h>
+
 extern "C" {
 #include "redis/intset.h"
 #include "redis/object.h"
@@ -22,6 +24,8 @@ extern "C" {
 #include "server/error.h"
 #include "server/transaction.h"
 
+ABSL_FLAG(uint32_t, set_max_intset_entries, 1024,
+          "Maximum number of members of an integer set before it is converted to a string set");
 ABSL_DECLARE_FLAG(bool, use_set2);
 
 namespace dfly {
@@ -36,13 +40,10 @@ using SetType = pair<void*, unsigned>;
 
 namespace {
 
-constexpr uint32_t kMaxIntSetEntries = 256;
-
-// I use relative time from Oct 1, 2022
-constexpr uint64_t kNowBase = 1664582400ULL;
 
-uint32_t TimeNowSecRel(uint64_t now_ms) {
-  return (now_ms / 1000) - kNowBase;
+absl::BitGenRef BitGen() {
+  thread_local absl::InsecureBitGen bitgen;
+  return bitgen;
 }
 
 bool IsDenseEncoding(const CompactObj& co) {
@@ -65,7 +66,7 @@ intset* IntsetAddSafe(string_view val, intset* is, bool* success, bool* added) {
   is = intsetAdd(is, llval, &inserted);
   if (inserted) {
     *added = true;
-    *success = intsetLen(is) <= kMaxIntSetEntries;
+    *success = intsetLen(is) <= SetFamily::MaxIntsetEntries();
   } else {
     *added = false;
     *success = true;
@@ -129,7 +130,7 @@ unsigned AddStrSet(const DbContext& db_context, ArgSlice vals, uint32_t ttl_sec,
 
   if (IsDenseEncoding(*dest)) {
     StringSet* ss = (StringSet*)dest->RObjPtr();
-    uint32_t time_now = TimeNowSecRel(db_context.time_now_ms);
+    uint32_t time_now = MemberTimeSeconds(db_context.time_now_ms);
 
     ss->set_time(time_now);
 
@@ -185,7 +186,7 @@ pair<unsigned, bool> RemoveSet(const DbContext& db_context, ArgSlice vals, Compa
     isempty = (intsetLen(is) == 0);
     set->SetRObjPtr(is);
   } else {
-    return RemoveStrSet(TimeNowSecRel(db_context.time_now_ms), vals, set);
+    return RemoveStrSet(MemberTimeSeconds(db_context.time_now_ms), vals, set);
   }
   return make_pair(removed, isempty);
 }
@@ -216,7 +217,7 @@ uint64_t ScanStrSet(const DbContext& db_context, const CompactObj& co, uint64_t
 
   if (IsDenseEncoding(co)) {
     StringSet* set = (StringSet*)co.RObjPtr();
-    set->set_time(TimeNowSecRel(db_context.time_now_ms));
+    set->set_time(MemberTimeSeconds(db_context.time_now_ms));
 
     do {
       auto scan_callback = [&](const sds ptr) {
@@ -262,7 +263,7 @@ uint32_t SetTypeLen(const DbContext& db_context, const SetType& set) {
 
   if (IsDenseEncoding(set)) {
     StringSet* ss = (StringSet*)set.first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
     return ss->Size();
   }
 
@@ -280,7 +281,7 @@ bool IsInSet(const DbContext& db_context, const SetType& st, int64_t val) {
 
   if (IsDenseEncoding(st)) {
     StringSet* ss = (StringSet*)st.first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
     return ss->Contains(str);
   }
 
@@ -299,7 +300,7 @@ bool IsInSet(const DbContext& db_context, const SetType& st, string_view member)
 
   if (IsDenseEncoding(st)) {
     StringSet* ss = (StringSet*)st.first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
 
     return ss->Contains(member);
   } else {
@@ -321,7 +322,7 @@ void DiffStrSet(const DbContext& db_context, const SetType& st,
                 absl::flat_hash_set<string>* result) {
   if (IsDenseEncoding(st)) {
     StringSet* ss = (StringSet*)st.first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
     for (sds ptr : *ss) {
       result->erase(string_view{ptr, sdslen(ptr)});
     }
@@ -338,11 +339,16 @@ void DiffStrSet(const DbContext& db_context, const SetType& st,
   }
 }
 
-void InterStrSet(const DbContext& db_context, const vector<SetType>& vec, StringVec* result) {
+// Stops after limit members.
+void InterStrSet(const DbContext& db_context, const vector<SetType>& vec, size_t limit,
+                 StringVec* result) {
   if (IsDenseEncoding(vec.front())) {
     StringSet* ss = (StringSet*)vec.front().first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
     for (const sds ptr : *ss) {
+      if (result->size() >= limit)
+        break;
+
       std::string_view str{ptr, sdslen(ptr)};
       size_t j = 1;
       for (j = 1; j < vec.size(); ++j) {
@@ -360,7 +366,7 @@ void InterStrSet(const DbContext& db_context, const vector<SetType>& vec, String
     dict* ds = (dict*)vec.front().first;
     dictIterator* di = dictGetIterator(ds);
     dictEntry* de = nullptr;
-    while ((de = dictNext(di))) {
+    while (result->size() < limit && (de = dictNext(di))) {
       size_t j = 1;
       sds key = (sds)de->key;
       string_view member{key, sdslen(key)};
@@ -384,11 +390,14 @@ StringVec PopStrSet(const DbContext& db_context, unsigned count, const SetType&
 
   if (IsDenseEncoding(st)) {
     StringSet* ss = (StringSet*)st.first;
-    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
-
-    // TODO: this loop is inefficient because Pop searches again and again an occupied bucket.
-    for (unsigned i = 0; i < count && !ss->Empty(); ++i) {
-      result.push_back(ss->Pop().value());
+    ss->set_time(MemberTimeSeconds(db_context.time_now_ms));
+
+    for (unsigned i = 0; i < count; ++i) {
+      sds member = ss->PopRandom(BitGen());
+      if (!member)
+        break;  // the rest of the members expired.
+      result.emplace_back(member, sdslen(member));
+      sdsfree(member);
     }
   } else {
     DCHECK_EQ(st.second, kEncodingStrMap);
@@ -465,55 +474,6 @@ ResultSetView DiffResultVec(const ResultStringVec& result_vec, ShardId src_shard
   return uniques;
 }
 
-OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned required_shard_cnt) {
-  absl::flat_hash_map<std::string_view, unsigned> uniques;
-
-  for (const auto& res : result_vec) {
-    if (!res && !base::_in(res.status(), {OpStatus::SKIPPED, OpStatus::KEY_NOTFOUND}))
-      return res.status();
-  }
-
-  for (const auto& res : result_vec) {
-    if (res.status() == OpStatus::KEY_NOTFOUND)
-      return OpStatus::OK;  // empty set.
-  }
-
-  bool first = true;
-  for (const auto& res : result_vec) {
-    if (res.status() == OpStatus::SKIPPED)
-      continue;
-
-    DCHECK(res);  // we handled it above.
-
-    // I use this awkward 'first' condition instead of table[s]++ deliberately.
-    // I do not want to add keys that I know will not stay in the set.
-    if (first) {
-      for (const string& s : res.value()) {
-        uniques.emplace(s, 1);
-      }
-      first = false;
-    } else {
-      for (const string& s : res.value()) {
-        auto it = uniques.find(s);
-        if (it != uniques.end()) {
-          ++it->second;
-        }
-      }
-    }
-  }
-
-  SvArray result;
-  result.reserve(uniques.size());
-
-  for (const auto& k_v : uniques) {
-    if (k_v.second == required_shard_cnt) {
-      result.push_back(k_v.first);
-    }
-  }
-
-  return result;
-}
-
 SvArray ToSvArray(const absl::flat_hash_set<std::string_view>& set) {
   SvArray result;
   result.reserve(set.size());
@@ -535,7 +495,7 @@ OpResult<uint32_t> OpAdd(const OpArgs& op_args, std::string_view key, ArgSlice v
   // to overwrite the key. However, if the set is empty it means we should delete the
   // key if it exists.
   if (overwrite && vals.empty()) {
-    auto it = db_slice.FindExt(op_args.db_cntx, key).first;
+    auto it = db_slice.FindExt(op_args.db_cntx, key);
     db_slice.Del(op_args.db_cntx.db_index, it);
 
     return 0;
@@ -612,6 +572,57 @@ OpResult<uint32_t> OpAdd(const OpArgs& op_args, std::string_view key, ArgSlice v
   return res;
 }
 
+// Stores the members of results, unique within each result, into the set at key, discarding its
+// previous value. The members are added in batches and the results are released as soon as they
+// are stored, so that no other full copy of the members is built. Skips the members in exclude.
+// Returns the size of the stored set.
+OpResult<uint32_t> OpStoreResults(const OpArgs& op_args, string_view key, ResultStringVec* results,
+                                  const absl::flat_hash_set<string_view>& exclude) {
+  constexpr size_t kBatchSize = 1024;
+
+  SvArray batch;
+  bool overwrite = true;
+  uint32_t stored = 0;
+  auto flush = [&]() -> OpStatus {
+    OpResult<uint32_t> res = OpAdd(op_args, key, batch, overwrite);
+    batch.clear();
+    overwrite = false;
+    if (!res)
+      return res.status();
+    stored += *res;  // the members that are already in the set are not counted.
+    return OpStatus::OK;
+  };
+
+  for (auto& res : *results) {
+    if (!res)
+      continue;
+
+    for (const string& member : res.value()) {
+      if (exclude.contains(member))
+        continue;
+      batch.push_back(member);
+      if (batch.size() == kBatchSize) {
+        if (OpStatus st = flush(); st != OpStatus::OK)
+          return st;
+      }
+    }
+
+    if (!batch.empty()) {
+      if (OpStatus st = flush(); st != OpStatus::OK)
+        return st;
+    }
+    StringVec{}.swap(res.value());
+  }
+
+  // Deletes the key if there was nothing to store.
+  if (overwrite) {
+    if (OpStatus st = flush(); st != OpStatus::OK)
+      return st;
+  }
+
+  return stored;
+}
+
 OpResult<uint32_t> OpAddEx(const OpArgs& op_args, string_view key, uint32_t ttl_sec,
                            ArgSlice vals) {
   auto* es = op_args.shard;
@@ -767,6 +778,48 @@ OpResult<unsigned> Mover::Commit(Transaction* t) {
   return res;
 }
 
+// Intersects intsets, the smallest first, by merging them since their members are sorted.
+// Stops after limit members.
+void InterIntSets(const vector<SetType>& sets, size_t limit, StringVec* result) {
+  intset* smallest = (intset*)sets.front().first;
+  vector<uint32_t> cursors(sets.size(), 0);
+  int64_t intele;
+
+  for (uint32_t ii = 0; result->size() < limit && intsetGet(smallest, ii, &intele); ++ii) {
+    size_t j = 1;
+    for (; j < sets.size(); ++j) {
+      intset* is = (intset*)sets[j].first;
+      if (!intsetGallop(is, cursors[j], intele, &cursors[j])) {
+        if (cursors[j] == intsetLen(is))
+          return;  // no larger members left in this set.
+        break;
+      }
+    }
+
+    if (j == sets.size())
+      result->push_back(absl::StrCat(intele));
+  }
+}
+
+// Returns the members of src that are in none of the others, by merging the intsets.
+StringVec DiffIntSets(intset* src, const vector<intset*>& others) {
+  vector<uint32_t> cursors(others.size(), 0);
+  StringVec result;
+  int64_t intele;
+
+  for (uint32_t ii = 0; intsetGet(src, ii, &intele); ++ii) {
+    bool found = false;
+    for (size_t j = 0; j < others.size() && !found; ++j) {
+      found = intsetGallop(others[j], cursors[j], intele, &cursors[j]);
+    }
+
+    if (!found)
+      result.push_back(absl::StrCat(intele));
+  }
+
+  return result;
+}
+
 // Read-only OpUnion op on sets.
 OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
   DCHECK(!keys.empty());
@@ -779,7 +832,7 @@ OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
       PrimeValue& pv = find_res.value()->second;
       if (IsDenseEncoding(pv)) {
         StringSet* ss = (StringSet*)pv.RObjPtr();
-        ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+        ss->set_time(MemberTimeSeconds(op_args.db_cntx.time_now_ms));
       }
       container_utils::IterateSet(pv, [&uniques](container_utils::ContainerEntry ce) {
         uniques.emplace(ce.ToString());
@@ -809,9 +862,31 @@ OpResult<StringVec> OpDiff(const OpArgs& op_args, ArgSlice keys) {
 
   absl::flat_hash_set<string> uniques;
   PrimeValue& pv = find_res.value()->second;
+  if (pv.Encoding() == kEncodingIntSet) {
+    vector<intset*> others;
+    bool all_intsets = true;
+    for (size_t i = 1; i < keys.size(); ++i) {
+      OpResult<PrimeIterator> diff_res = es->db_slice().Find(op_args.db_cntx, keys[i], OBJ_SET);
+      if (!diff_res) {
+        if (diff_res.status() == OpStatus::WRONG_TYPE)
+          return OpStatus::WRONG_TYPE;
+        continue;
+      }
+      const PrimeValue& diff_pv = diff_res.value()->second;
+      if (diff_pv.Encoding() != kEncodingIntSet) {
+        all_intsets = false;
+        break;
+      }
+      others.push_back((intset*)diff_pv.RObjPtr());
+    }
+
+    if (all_intsets)
+      return DiffIntSets((intset*)pv.RObjPtr(), others);
+  }
+
   if (IsDenseEncoding(pv)) {
     StringSet* ss = (StringSet*)pv.RObjPtr();
-    ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+    ss->set_time(MemberTimeSeconds(op_args.db_cntx.time_now_ms));
   }
 
   container_utils::IterateSet(pv, [&uniques](container_utils::ContainerEntry ce) {
@@ -849,8 +924,9 @@ OpResult<StringVec> OpDiff(const OpArgs& op_args, ArgSlice keys) {
   return ToVec(std::move(uniques));
 }
 
-// Read-only OpInter op on sets.
-OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_first) {
+// Read-only OpInter op on sets. Stops after limit members.
+OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_first,
+                            size_t limit = SIZE_MAX) {
   ArgSlice keys = t->ShardArgsInShard(es->shard_id());
   if (remove_first) {
     keys.remove_prefix(1);
@@ -866,13 +942,13 @@ OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_f
     PrimeValue& pv = find_res.value()->second;
     if (IsDenseEncoding(pv)) {
       StringSet* ss = (StringSet*)pv.RObjPtr();
-      ss->set_time(TimeNowSecRel(t->db_context().time_now_ms));
+      ss->set_time(MemberTimeSeconds(t->db_context().time_now_ms));
     }
 
     container_utils::IterateSet(find_res.value()->second,
-                                [&result](container_utils::ContainerEntry ce) {
+                                [&result, limit](container_utils::ContainerEntry ce) {
                                   result.push_back(ce.ToString());
-                                  return true;
+                                  return result.size() < limit;
                                 });
     return result;
   }
@@ -905,13 +981,17 @@ OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_f
 
   std::sort(sets.begin(), sets.end(), comp);
 
+  bool all_intsets = all_of(sets.begin(), sets.end(),
+                            [](const SetType& st) { return st.second == kEncodingIntSet; });
   int encoding = sets.front().second;
-  if (encoding == kEncodingIntSet) {
+  if (all_intsets) {
+    InterIntSets(sets, limit, &result);
+  } else if (encoding == kEncodingIntSet) {
     int ii = 0;
     intset* is = (intset*)sets.front().first;
     int64_t intele;
 
-    while (intsetGet(is, ii++, &intele)) {
+    while (result.size() < limit && intsetGet(is, ii++, &intele)) {
       size_t j = 1;
       for (j = 1; j < sets.size(); j++) {
         if (sets[j].first != is && !IsInSet(t->db_context(), sets[j], intele))
@@ -924,12 +1004,159 @@ OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_f
       }
     }
   } else {
-    InterStrSet(t->db_context(), sets, &result);
+    InterStrSet(t->db_context(), sets, limit, &result);
   }
 
   return result;
 }
 
+// Intersects the sets of keys that span several shards, without moving whole sets between
+// the shards. The first hop gathers the cardinalities of the sets. Then the shard of the
+// smallest one intersects its sets into candidates, which the other shards filter by membership
+// in their sets, in batches of kInterProbeBatch when limit is set. Stops after limit members.
+// The sets of dest_shard do not include its first key, the destination of SINTERSTORE.
+// Runs non-concluding hops.
+OpResult<StringVec> InterAcrossShards(Transaction* trans, ShardId dest_shard, size_t limit) {
+  constexpr size_t kInterProbeBatch = 1024;
+  auto inter_keys = [dest_shard](const Transaction* t, ShardId sid) {
+    ArgSlice keys = t->ShardArgsInShard(sid);
+    if (sid == dest_shard)
+      keys.remove_prefix(1);
+    return keys;
+  };
+
+  // The length of the smallest set of every shard.
+  vector<OpResult<uint32_t>> min_lens(shard_set->size(), OpStatus::SKIPPED);
+  auto card_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    ArgSlice keys = inter_keys(t, sid);
+    if (keys.empty())
+      return OpStatus::OK;
+
+    OpStatus status = OpStatus::OK;
+    uint32_t min_len = UINT32_MAX;
+    for (string_view key : keys) {
+      OpResult<PrimeIterator> find_res = shard->db_slice().Find(t->db_context(), key, OBJ_SET);
+      if (!find_res) {
+        if (status != OpStatus::WRONG_TYPE)
+          status = find_res.status();
+        continue;
+      }
+      const PrimeValue& pv = find_res.value()->second;
+      min_len = min(min_len, SetTypeLen(t->db_context(), SetType{pv.RObjPtr(), pv.Encoding()}));
+    }
+
+    if (status == OpStatus::OK)
+      min_lens[sid] = min_len;
+    else
+      min_lens[sid] = status;
+    return OpStatus::OK;
+  };
+  trans->Execute(std::move(card_cb), false);
+
+  ShardId smallest = kInvalidSid;
+  bool empty = false;
+  for (ShardId sid = 0; sid < min_lens.size(); ++sid) {
+    OpStatus status = min_lens[sid].status();
+    if (status == OpStatus::SKIPPED)
+      continue;
+    if (status == OpStatus::KEY_NOTFOUND) {
+      empty = true;
+      continue;
+    }
+    if (status != OpStatus::OK)
+      return status;
+
+    if (smallest == kInvalidSid || *min_lens[sid] < *min_lens[smallest])
+      smallest = sid;
+  }
+
+  if (empty || smallest == kInvalidSid || *min_lens[smallest] == 0)
+    return StringVec{};
+
+  StringVec candidates;
+  auto inter_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == smallest) {
+      OpResult<StringVec> res = OpInter(t, shard, smallest == dest_shard);
+      if (res)
+        candidates = std::move(res.value());
+    }
+    return OpStatus::OK;
+  };
+  trans->Execute(std::move(inter_cb), false);
+
+  // Whether every candidate of the batch is in all the sets of each probed shard.
+  vector<vector<uint8_t>> matches(shard_set->size());
+  StringVec result;
+  size_t start = 0;
+  while (start < candidates.size() && result.size() < limit) {
+    size_t batch = candidates.size() - start;
+    if (limit != SIZE_MAX)
+      batch = min(batch, kInterProbeBatch);
+
+    auto probe_cb = [&](Transaction* t, EngineShard* shard) {
+      ShardId sid = shard->shard_id();
+      if (sid == smallest || min_lens[sid].status() == OpStatus::SKIPPED)
+        return OpStatus::OK;
+
+      vector<SetType> sets;
+      for (string_view key : inter_keys(t, sid)) {
+        OpResult<PrimeIterator> find_res = shard->db_slice().Find(t->db_context(), key, OBJ_SET);
+        if (!find_res) {  // expired since the first hop.
+          matches[sid].assign(batch, 0);
+          return OpStatus::OK;
+        }
+        const PrimeValue& pv = find_res.value()->second;
+        sets.emplace_back(pv.RObjPtr(), pv.Encoding());
+      }
+
+      matches[sid].assign(batch, 1);
+      for (size_t i = 0; i < batch; ++i) {
+        for (const SetType& st : sets) {
+          if (!IsInSet(t->db_context(), st, candidates[start + i])) {
+            matches[sid][i] = 0;
+            break;
+          }
+        }
+      }
+      return OpStatus::OK;
+    };
+    trans->Execute(std::move(probe_cb), false);
+
+    for (size_t i = 0; i < batch && result.size() < limit; ++i) {
+      bool in_all = true;
+      for (const auto& shard_matches : matches) {
+        if (!shard_matches.empty() && !shard_matches[i]) {
+          in_all = false;
+          break;
+        }
+      }
+      if (in_all)
+        result.push_back(std::move(candidates[start + i]));
+    }
+    start += batch;
+  }
+
+  return result;
+}
+
+// Intersects the sets of the keys. Runs non-concluding hops, see InterAcrossShards.
+OpResult<StringVec> InterSets(Transaction* trans, ShardId dest_shard, size_t limit) {
+  if (trans->unique_shard_cnt() > 1)
+    return InterAcrossShards(trans, dest_shard, limit);
+
+  OpResult<StringVec> result;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    result = OpInter(t, shard, shard->shard_id() == dest_shard, limit);
+    return OpStatus::OK;
+  };
+  trans->Execute(std::move(cb), false);
+
+  if (result.status() == OpStatus::KEY_NOTFOUND)
+    return StringVec{};
+  return result;
+}
+
 // count - how many elements to pop.
 OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, unsigned count) {
   auto& db_slice = op_args.shard->db_slice();
@@ -951,7 +1178,7 @@ OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, unsigned count
     PrimeValue& pv = it->second;
     if (IsDenseEncoding(pv)) {
       StringSet* ss = (StringSet*)pv.RObjPtr();
-      ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+      ss->set_time(MemberTimeSeconds(op_args.db_cntx.time_now_ms));
     }
 
     container_utils::IterateSet(it->second, [&result](container_utils::ContainerEntry ce) {
@@ -968,22 +1195,98 @@ OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, unsigned count
       intset* is = (intset*)st.first;
       int64_t val = 0;
 
-      // copy last count values.
-      for (uint32_t i = slen - count; i < slen; ++i) {
-        intsetGet(is, i, &val);
+      for (unsigned i = 0; i < count; ++i) {
+        intsetGet(is, absl::Uniform(BitGen(), 0u, intsetLen(is)), &val);
         result.push_back(absl::StrCat(val));
+        int removed = 0;
+        is = intsetRemove(is, val, &removed);
       }
-
-      is = intsetTrimTail(is, count);  // now remove last count items
       it->second.SetRObjPtr(is);
     } else {
       result = PopStrSet(op_args.db_cntx, count, st);
     }
     db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
   }
+
+  // The popped members are random, so the replicas remove the same ones.
+  if (op_args.shard->journal() && !result.empty()) {
+    vector<string_view> srem_args{key};
+    srem_args.insert(srem_args.end(), result.begin(), result.end());
+    RecordJournal(op_args, "SREM", srem_args);
+  }
+
   return result;
 }
 
+// Returns count random members, distinct ones when count is positive and possibly repeated ones
+// when it is negative.
+OpResult<StringVec> OpRandMember(const OpArgs& op_args, string_view key, int64_t count) {
+  OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
+  if (!find_res)
+    return find_res.status();
+
+  PrimeValue& pv = find_res.value()->second;
+  if (IsDenseEncoding(pv)) {
+    StringSet* ss = (StringSet*)pv.RObjPtr();
+    ss->set_time(MemberTimeSeconds(op_args.db_cntx.time_now_ms));
+  }
+
+  StringVec result;
+  size_t slen = pv.Size();
+  if (count > 0 && (size_t(count) >= slen || size_t(count) * 3 > slen)) {
+    container_utils::IterateSet(pv, [&result](container_utils::ContainerEntry ce) {
+      result.push_back(ce.ToString());
+      return true;
+    });
+
+    // A partial shuffle when most of the members are requested, cheaper than sampling them.
+    size_t len = min(result.size(), size_t(count));
+    for (size_t i = 0; i < len; ++i) {
+      swap(result[i], result[absl::Uniform(BitGen(), i, result.size())]);
+    }
+    result.resize(len);
+    return result;
+  }
+
+  // Returns false when all the members expired.
+  auto pick = [&](string* dest) {
+    if (pv.Encoding() == kEncodingIntSet) {
+      intset* is = (intset*)pv.RObjPtr();
+      int64_t val = 0;
+      intsetGet(is, absl::Uniform(BitGen(), 0u, intsetLen(is)), &val);
+      *dest = absl::StrCat(val);
+    } else if (IsDenseEncoding(pv)) {
+      sds member = ((StringSet*)pv.RObjPtr())->GetRandomMember(BitGen());
+      if (!member)
+        return false;
+      dest->assign(member, sdslen(member));
+    } else {
+      sds member = (sds)dictGetFairRandomKey((dict*)pv.RObjPtr())->key;
+      dest->assign(member, sdslen(member));
+    }
+    return true;
+  };
+
+  if (count < 0) {
+    result.resize(-count);
+    for (string& dest : result) {
+      if (!pick(&dest))
+        return StringVec{};
+    }
+    return result;
+  }
+
+  // Few distinct members of a large set, so that sampling rarely repeats.
+  absl::flat_hash_set<string> picked;
+  string member;
+  while (picked.size() < size_t(count)) {
+    if (!pick(&member))
+      break;
+    picked.insert(std::move(member));
+  }
+  return ToVec(std::move(picked));
+}
+
 OpResult<StringVec> OpScan(const OpArgs& op_args, string_view key, uint64_t* cursor,
                            const ScanOpts& scan_op) {
   OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
@@ -1171,7 +1474,7 @@ void SPop(CmdArgList args, ConnectionContext* cntx) {
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
   if (result || result.status() == OpStatus::KEY_NOTFOUND) {
     if (args.size() == 2) {  // SPOP key
-      if (result.status() == OpStatus::KEY_NOTFOUND) {
+      if (result.status() == OpStatus::KEY_NOTFOUND || result->empty()) {
         (*cntx)->SendNull();
       } else {
         DCHECK_EQ(1u, result.value().size());
@@ -1186,6 +1489,37 @@ void SPop(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendError(result.status());
 }
 
+// SRANDMEMBER key [count]
+void SRandMember(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() > 3) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  string_view key = ArgS(args, 1);
+  bool with_count = args.size() == 3;
+  int64_t count = 1;
+  if (with_count && (!absl::SimpleAtoi(ArgS(args, 2), &count) || count == INT64_MIN)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRandMember(t->GetOpArgs(shard), key, count);
+  };
+
+  OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result && result.status() != OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (with_count) {
+    (*cntx)->SendStringArr(result ? *result : StringVec{});
+  } else if (result && !result->empty()) {
+    (*cntx)->SendBulkString(result->front());
+  } else {
+    (*cntx)->SendNull();
+  }
+}
+
 void SDiff(CmdArgList args, ConnectionContext* cntx) {
   ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
   string_view src_key = ArgS(args, 1);
@@ -1251,30 +1585,131 @@ void SDiffStore(CmdArgList args, ConnectionContext* cntx) {
 
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(diff_cb), false);
-  ResultSetView rsv = DiffResultVec(result_set, src_shard);
-  if (!rsv) {
-    cntx->transaction->Execute(NoOpCb, true);
-    (*cntx)->SendError(rsv.status());
-    return;
+  for (const auto& res : result_set) {
+    if (res.status() == OpStatus::WRONG_TYPE) {
+      cntx->transaction->Execute(NoOpCb, true);
+      return (*cntx)->SendError(kWrongTypeErr);
+    }
   }
 
-  SvArray result = ToSvArray(rsv.value());
+  // The destination shard builds the set right from the results of the shards.
+  OpResult<uint32_t> result;
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
-    if (shard->shard_id() == dest_shard) {
-      OpAdd(t->GetOpArgs(shard), dest_key, result, true);
+    if (shard->shard_id() != dest_shard)
+      return OpStatus::OK;
+
+    absl::flat_hash_set<string_view> exclude;
+    for (unsigned i = 0; i < result_set.size(); ++i) {
+      if (i != src_shard && result_set[i])
+        exclude.insert(result_set[i].value().begin(), result_set[i].value().end());
     }
 
+    ResultStringVec src_result(1);
+    src_result[0] = std::move(result_set[src_shard]);
+    result = OpStoreResults(t->GetOpArgs(shard), dest_key, &src_result, exclude);
     return OpStatus::OK;
   };
 
   cntx->transaction->Execute(std::move(store_cb), true);
-  (*cntx)->SendLong(result.size());
+  if (!result)
+    return (*cntx)->SendError(result.status());
+  (*cntx)->SendLong(*result);
+}
+
+bool IsBatchReplyable(const PrimeValue& pv) {
+  return IsDenseEncoding(pv) && container_utils::IsBatchReplyable(*(StringSet*)pv.RObjPtr());
+}
+
+// Sends the members of a big set in batches of kReplyBatchSize, one hop per batch, so that
+// the shard never holds a copy of the whole set. The hops run on a transaction of their own
+// that keeps the key locked until the last batch is sent.
+void SMembersInBatches(string_view key, ConnectionContext* cntx) {
+  auto trans = cntx->transaction->CloneUnscheduled();
+  trans->Schedule();
+
+  ScanOpts scan_op;
+  scan_op.limit = container_utils::kReplyBatchSize;
+
+  OpStatus status = OpStatus::OK;
+  size_t total = 0;
+  uint64_t cursor = 0;
+  bool first_hop = true;
+  StringVec batch;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    if (first_hop) {
+      first_hop = false;
+      OpResult<PrimeIterator> find_res = shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
+      if (!find_res) {
+        status = find_res.status();
+        return OpStatus::OK;
+      }
+
+      const PrimeValue& pv = find_res.value()->second;
+      if (!IsBatchReplyable(pv)) {  // The set changed since the first transaction.
+        OpResult<StringVec> res = OpInter(t, shard, false);
+        status = res.status();
+        if (res) {
+          batch = std::move(res.value());
+          total = batch.size();
+        }
+        return OpStatus::OK;
+      }
+      total = ((StringSet*)pv.RObjPtr())->Size();
+    }
+
+    OpResult<StringVec> res = OpScan(op_args, key, &cursor, scan_op);
+    status = res.status();
+    if (res)
+      batch = std::move(res.value());
+    return OpStatus::OK;
+  };
+
+  trans->Execute(cb, false);
+  if (status != OpStatus::OK) {
+    trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+    if (status == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->StartCollection(0, facade::RedisReplyBuilder::SET);
+    return (*cntx)->SendError(status);
+  }
+
+  (*cntx)->StartCollection(total, facade::RedisReplyBuilder::SET);
+  size_t sent = 0;
+  while (true) {
+    for (size_t i = 0; i < batch.size() && sent < total; ++i, ++sent) {
+      (*cntx)->SendBulkString(batch[i]);
+    }
+    if (cursor == 0 || status != OpStatus::OK)
+      break;
+    trans->Execute(cb, false);
+  }
+  trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+
+  LOG_IF(DFATAL, sent < total) << "Sent " << sent << " members of " << total;
+  for (; sent < total; ++sent) {
+    (*cntx)->SendBulkString("");
+  }
 }
 
 void SMembers(CmdArgList args, ConnectionContext* cntx) {
-  auto cb = [](Transaction* t, EngineShard* shard) { return OpInter(t, shard, false); };
+  string_view key = ArgS(args, 1);
+  bool in_batches = false;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringVec> {
+    if (!t->IsMulti() && !cntx->conn_state.script_info) {
+      auto find_res = shard->db_slice().Find(t->GetOpArgs(shard).db_cntx, key, OBJ_SET);
+      if (find_res && IsBatchReplyable(find_res.value()->second)) {
+        in_batches = true;
+        return StringVec{};
+      }
+    }
+    return OpInter(t, shard, false);
+  };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (in_batches)
+    return SMembersInBatches(key, cntx);
 
   if (result || result.status() == OpStatus::KEY_NOTFOUND) {
     StringVec& svec = result.value();
@@ -1282,25 +1717,29 @@ void SMembers(CmdArgList args, ConnectionContext* cntx) {
     if (cntx->conn_state.script_info) {  // sort under script
       sort(svec.begin(), svec.end());
     }
-    (*cntx)->SendStringArr(*result);
+    (*cntx)->SendStringCollection(*result, facade::RedisReplyBuilder::SET);
   } else {
     (*cntx)->SendError(result.status());
   }
 }
 
 void SInter(CmdArgList args, ConnectionContext* cntx) {
-  ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    result_set[shard->shard_id()] = OpInter(t, shard, false);
-
-    return OpStatus::OK;
-  };
+  Transaction* trans = cntx->transaction;
+  OpResult<StringVec> result;
+
+  if (trans->unique_shard_cnt() == 1) {
+    auto cb = [&](Transaction* t, EngineShard* shard) { return OpInter(t, shard, false); };
+    result = trans->ScheduleSingleHopT(std::move(cb));
+    if (result.status() == OpStatus::KEY_NOTFOUND)
+      result = StringVec{};
+  } else {
+    trans->Schedule();
+    result = InterAcrossShards(trans, kInvalidSid, SIZE_MAX);
+    trans->Execute(NoOpCb, true);
+  }
 
-  cntx->transaction->ScheduleSingleHop(std::move(cb));
-  OpResult<SvArray> result = InterResultVec(result_set, cntx->transaction->unique_shard_cnt());
   if (result) {
-    SvArray arr = std::move(*result);
+    StringVec& arr = *result;
     if (cntx->conn_state.script_info) {  // sort under script
       sort(arr.begin(), arr.end());
     }
@@ -1311,36 +1750,21 @@ void SInter(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void SInterStore(CmdArgList args, ConnectionContext* cntx) {
-  ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
   string_view dest_key = ArgS(args, 1);
-  ShardId dest_shard = Shard(dest_key, result_set.size());
-  atomic_uint32_t inter_shard_cnt{0};
-
-  auto inter_cb = [&](Transaction* t, EngineShard* shard) {
-    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
-    if (shard->shard_id() == dest_shard) {
-      CHECK_EQ(largs.front(), dest_key);
-      if (largs.size() == 1)
-        return OpStatus::OK;
-    }
-    inter_shard_cnt.fetch_add(1, memory_order_relaxed);
-    result_set[shard->shard_id()] = OpInter(t, shard, shard->shard_id() == dest_shard);
-    return OpStatus::OK;
-  };
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
 
   cntx->transaction->Schedule();
-  cntx->transaction->Execute(std::move(inter_cb), false);
-
-  OpResult<SvArray> result = InterResultVec(result_set, inter_shard_cnt.load(memory_order_relaxed));
+  OpResult<StringVec> result = InterSets(cntx->transaction, dest_shard, SIZE_MAX);
   if (!result) {
     cntx->transaction->Execute(NoOpCb, true);
     (*cntx)->SendError(result.status());
     return;
   }
 
+  SvArray members(result->begin(), result->end());
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
     if (shard->shard_id() == dest_shard) {
-      OpAdd(t->GetOpArgs(shard), dest_key, result.value(), true);
+      OpAdd(t->GetOpArgs(shard), dest_key, members, true);
     }
 
     return OpStatus::OK;
@@ -1350,6 +1774,37 @@ void SInterStore(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendLong(result->size());
 }
 
+// SINTERCARD numkeys key [key ...] [LIMIT limit]
+void SInterCard(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t num_keys;
+  if (!absl::SimpleAtoi(ArgS(args, 1), &num_keys) || num_keys == 0) {
+    return (*cntx)->SendError("numkeys should be greater than 0");
+  }
+
+  size_t limit = SIZE_MAX;
+  size_t opt = num_keys + 2;
+  if (opt < args.size()) {
+    ToUpper(&args[opt]);
+    if (ArgS(args, opt) != "LIMIT" || opt + 2 != args.size())
+      return (*cntx)->SendError(kSyntaxErr);
+
+    int64_t val;
+    if (!absl::SimpleAtoi(ArgS(args, opt + 1), &val) || val < 0)
+      return (*cntx)->SendError("LIMIT can't be negative");
+    if (val > 0)
+      limit = val;
+  }
+
+  cntx->transaction->Schedule();
+  OpResult<StringVec> result = InterSets(cntx->transaction, kInvalidSid, limit);
+  cntx->transaction->Execute(NoOpCb, true);
+
+  if (result)
+    (*cntx)->SendLong(result->size());
+  else
+    (*cntx)->SendError(result.status());
+}
+
 void SUnion(CmdArgList args, ConnectionContext* cntx) {
   ResultStringVec result_set(shard_set->size());
 
@@ -1393,25 +1848,26 @@ void SUnionStore(CmdArgList args, ConnectionContext* cntx) {
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(union_cb), false);
 
-  ResultSetView unionset = UnionResultVec(result_set);
-  if (!unionset) {
-    cntx->transaction->Execute(NoOpCb, true);
-    (*cntx)->SendError(unionset.status());
-    return;
+  for (const auto& res : result_set) {
+    if (!res && res.status() != OpStatus::SKIPPED && res.status() != OpStatus::KEY_NOTFOUND) {
+      cntx->transaction->Execute(NoOpCb, true);
+      return (*cntx)->SendError(res.status());
+    }
   }
 
-  SvArray result = ToSvArray(unionset.value());
-
+  // The destination shard builds the set right from the results of the shards, the set dedupes
+  // the members that are found on multiple shards.
+  OpResult<uint32_t> result;
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
-    if (shard->shard_id() == dest_shard) {
-      OpAdd(t->GetOpArgs(shard), dest_key, result, true);
-    }
-
+    if (shard->shard_id() == dest_shard)
+      result = OpStoreResults(t->GetOpArgs(shard), dest_key, &result_set, {});
     return OpStatus::OK;
   };
 
   cntx->transaction->Execute(std::move(store_cb), true);
-  (*cntx)->SendLong(result.size());
+  if (!result)
+    return (*cntx)->SendError(result.status());
+  (*cntx)->SendLong(*result);
 }
 
 void SScan(CmdArgList args, ConnectionContext* cntx) {
@@ -1539,13 +1995,15 @@ void SetFamily::Register(CommandRegistry* registry) {
             << CI{"SDIFFSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SDiffStore)
             << CI{"SINTER", CO::READONLY, -2, 1, -1, 1}.HFUNC(SInter)
             << CI{"SINTERSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SInterStore)
+            << CI{"SINTERCARD", CO::READONLY | CO::VARIADIC_KEYS, -3, 2, 2, 1}.HFUNC(SInterCard)
             << CI{"SMEMBERS", CO::READONLY, 2, 1, 1, 1}.HFUNC(SMembers)
             << CI{"SISMEMBER", CO::FAST | CO::READONLY, 3, 1, 1, 1}.HFUNC(SIsMember)
             << CI{"SMISMEMBER", CO::READONLY, -3, 1, 1, 1}.HFUNC(SMIsMember)
             << CI{"SMOVE", CO::FAST | CO::WRITE, 4, 1, 2, 1}.HFUNC(SMove)
             << CI{"SREM", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(SRem)
             << CI{"SCARD", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(SCard)
-            << CI{"SPOP", CO::WRITE | CO::FAST, -2, 1, 1, 1}.HFUNC(SPop)
+            << CI{"SPOP", CO::WRITE | CO::FAST | CO::NO_AUTOJOURNAL, -2, 1, 1, 1}.HFUNC(SPop)
+            << CI{"SRANDMEMBER", CO::READONLY, -2, 1, 1, 1}.HFUNC(SRandMember)
             << CI{"SUNION", CO::READONLY, -2, 1, -1, 1}.HFUNC(SUnion)
             << CI{"SUNIONSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SUnionStore)
             << CI{"SSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(SScan);
@@ -1556,7 +2014,7 @@ void SetFamily::Register(CommandRegistry* registry) {
 }
 
 uint32_t SetFamily::MaxIntsetEntries() {
-  return kMaxIntSetEntries;
+  return GetFlag(FLAGS_set_max_intset_entries);
 }
 
 void SetFamily::ConvertTo(const intset* src, dict* dest) {
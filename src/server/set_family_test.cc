@@ -56,6 +56,37 @@ TEST_F(SetFamilyTest, SUnionStore) {
   EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("11", "10", "1", "2", "3"));
 }
 
+TEST_F(SetFamilyTest, SUnionStoreLarge) {
+  // Overlapping sets on all the shards, larger than a batch of stored members, and with
+  // integer members first so that the stored set is converted from an intset.
+  vector<string> keys, members;
+  for (unsigned k = 0; k < 8; ++k) {
+    keys.push_back(absl::StrCat("src", k));
+    members.clear();
+    for (unsigned i = k * 500; i < k * 500 + 1000; ++i)
+      members.push_back(k < 4 ? absl::StrCat(i) : absl::StrCat("m", i));
+
+    vector<string_view> cmd{"sadd", keys.back()};
+    cmd.insert(cmd.end(), members.begin(), members.end());
+    Run(cmd);
+  }
+
+  vector<string_view> cmd{"sunionstore", "dest"};
+  cmd.insert(cmd.end(), keys.begin(), keys.end());
+  EXPECT_THAT(Run(cmd), IntArg(2500 + 2500));
+  EXPECT_THAT(Run({"scard", "dest"}), IntArg(5000));
+
+  // The destination is deleted if the union is empty.
+  EXPECT_THAT(Run({"sunionstore", "dest", "missing"}), IntArg(0));
+  EXPECT_THAT(Run({"exists", "dest"}), IntArg(0));
+
+  EXPECT_THAT(Run({"sdiffstore", "dest", "src0", "src1"}), IntArg(500));
+  EXPECT_THAT(Run({"sismember", "dest", "0"}), IntArg(1));
+  EXPECT_THAT(Run({"sismember", "dest", "500"}), IntArg(0));
+  EXPECT_THAT(Run({"sdiffstore", "dest", "missing", "src1"}), IntArg(0));
+  EXPECT_THAT(Run({"exists", "dest"}), IntArg(0));
+}
+
 TEST_F(SetFamilyTest, SDiff) {
   auto resp = Run({"sadd", "b", "1", "2", "3"});
   Run({"sadd", "c", "10", "11"});
@@ -94,6 +125,85 @@ TEST_F(SetFamilyTest, SInter) {
   EXPECT_THAT(resp, IntArg(0));
 }
 
+TEST_F(SetFamilyTest, SInterAcrossShards) {
+  vector<string> members;
+  for (unsigned i = 0; i < 2000; ++i)
+    members.push_back(absl::StrCat(i));
+
+  vector<string_view> args{"sadd", "big"};
+  args.insert(args.end(), members.begin(), members.end());
+  Run(ArgSlice{args.data(), args.size()});
+  Run({"sadd", "small", "5", "7", "3000"});
+  Run({"sadd", "mid", "5", "6", "7", "8"});
+
+  auto resp = Run({"sinter", "big", "small", "mid"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("5", "7"));
+
+  EXPECT_THAT(Run({"sinterstore", "small", "big", "small"}), IntArg(2));
+  EXPECT_THAT(Run({"smembers", "small"}).GetVec(), UnorderedElementsAre("5", "7"));
+  EXPECT_THAT(Run({"sinter", "big", "none", "mid"}), ArrLen(0));
+}
+
+TEST_F(SetFamilyTest, SInterCard) {
+  vector<string> members;
+  for (unsigned i = 0; i < 6000; ++i)
+    members.push_back(absl::StrCat(i));
+
+  // a holds 0..2999 and b the even numbers up to 5998.
+  vector<string_view> a{"sadd", "a"}, b{"sadd", "b"};
+  for (unsigned i = 0; i < 6000; ++i) {
+    if (i < 3000)
+      a.push_back(members[i]);
+    if (i % 2 == 0)
+      b.push_back(members[i]);
+  }
+  Run(ArgSlice{a.data(), a.size()});
+  Run(ArgSlice{b.data(), b.size()});
+
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b"}), IntArg(1500));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "LIMIT", "10"}), IntArg(10));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "limit", "0"}), IntArg(1500));
+  EXPECT_THAT(Run({"sintercard", "1", "a"}), IntArg(3000));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "none"}), IntArg(0));
+
+  EXPECT_THAT(Run({"sintercard", "0", "a"}), ErrArg("numkeys should be greater than 0"));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "LIMIT", "-1"}), ErrArg("can't be negative"));
+  EXPECT_THAT(Run({"sintercard", "1", "a", "b"}), ErrArg("syntax error"));
+}
+
+TEST_F(SetFamilyTest, IntSetOps) {
+  vector<string> members;
+  for (int i = -500; i < 1000; i++)
+    members.push_back(absl::StrCat(i));
+
+  // a holds -500..999, b the multiples of 3 and c the multiples of 5 in the same range.
+  vector<string_view> a{"sadd", "a"}, b{"sadd", "b"}, c{"sadd", "c"};
+  for (size_t i = 0; i < members.size(); ++i) {
+    int val = int(i) - 500;
+    a.push_back(members[i]);
+    if (val % 3 == 0)
+      b.push_back(members[i]);
+    if (val % 5 == 0)
+      c.push_back(members[i]);
+  }
+  Run(ArgSlice{a.data(), a.size()});
+  Run(ArgSlice{b.data(), b.size()});
+  Run(ArgSlice{c.data(), c.size()});
+
+  // -495, -480, ..., 990
+  EXPECT_EQ(100, CheckedInt({"sinterstore", "d", "a", "b", "c"}));
+  EXPECT_EQ(1, CheckedInt({"sismember", "d", "-495"}));
+  EXPECT_EQ(1, CheckedInt({"sismember", "d", "990"}));
+  EXPECT_EQ(0, CheckedInt({"sismember", "d", "5"}));
+
+  // 1500 - 500 - 300 + 100
+  EXPECT_EQ(800, CheckedInt({"sdiffstore", "e", "a", "b", "c"}));
+  EXPECT_EQ(1, CheckedInt({"sismember", "e", "-499"}));
+  EXPECT_EQ(0, CheckedInt({"sismember", "e", "10"}));
+  EXPECT_THAT(Run({"sdiff", "b", "a"}), ArrLen(0));
+}
+
 TEST_F(SetFamilyTest, SMove) {
   auto resp = Run({"sadd", "a", "1", "2", "3", "4"});
   Run({"sadd", "b", "3", "5", "6", "2"});
@@ -132,6 +242,39 @@ TEST_F(SetFamilyTest, SPop) {
   EXPECT_THAT(resp.GetVec(), IsSubsetOf({"a", "b", "c"}));
 }
 
+TEST_F(SetFamilyTest, SRandMember) {
+  EXPECT_THAT(Run({"srandmember", "x"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"srandmember", "x", "5"}), ArrLen(0));
+
+  Run({"sadd", "x", "a", "b", "c"});
+  EXPECT_THAT(Run({"srandmember", "x"}), testing::AnyOf("a", "b", "c"));
+
+  auto resp = Run({"srandmember", "x", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  auto vec = StrArray(resp);
+  EXPECT_THAT(vec, IsSubsetOf({"a", "b", "c"}));
+  EXPECT_NE(vec[0], vec[1]);
+
+  resp = Run({"srandmember", "x", "10"});
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("a", "b", "c"));
+
+  // Negative counts may repeat members.
+  resp = Run({"srandmember", "x", "-10"});
+  ASSERT_THAT(resp, ArrLen(10));
+  EXPECT_THAT(StrArray(resp), Each(testing::AnyOf("a", "b", "c")));
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"sadd", "y", absl::StrCat("member", i)});
+  }
+  resp = Run({"srandmember", "y", "20"});
+  ASSERT_THAT(resp, ArrLen(20));
+  vec = StrArray(resp);
+  EXPECT_EQ(20u, absl::flat_hash_set<string>(vec.begin(), vec.end()).size());
+  EXPECT_EQ(1000, CheckedInt({"scard", "y"}));
+
+  EXPECT_THAT(Run({"srandmember", "y", "a"}), ErrArg("value is not an integer"));
+}
+
 TEST_F(SetFamilyTest, SMIsMember) {
   Run({"sadd", "foo", "a"});
   Run({"sadd", "foo", "b"});
@@ -207,4 +350,21 @@ TEST_F(SetFamilyTest, SScan) {
   EXPECT_THAT(vec.size(), 0);
 }
 
+TEST_F(SetFamilyTest, SMembersInBatches) {
+  // Big enough to be sent in several batches.
+  vector<string> members;
+  for (int i = 0; i < 10000; i++) {
+    members.push_back(absl::StrCat("member-", i));
+  }
+
+  vector<string_view> args{"sadd", "x"};
+  args.insert(args.end(), members.begin(), members.end());
+  Run(ArgSlice{args.data(), args.size()});
+
+  auto resp = Run({"smembers", "x"});
+  ASSERT_THAT(resp, ArrLen(10000));
+  EXPECT_THAT(StrArray(resp), UnorderedElementsAreArray(members));
+  EXPECT_FALSE(service_->IsLocked(0, "x"));
+}
+
 }  // namespace dfly
@@ -0,0 +1,639 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/sketch_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include <memory>
+#include <optional>
+
+#include "base/logging.h"
+#include "core/frequency_sketch.h"
+#include "server/command_registry.h"
+#include "server/common.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+using CI = CommandId;
+
+// Keep the allocations reasonable, like the filters of the BF commands. The increments of TOPK
+// are limited like in RedisBloom, since every unit of them may decay a bucket.
+constexpr size_t kMaxSketchSize = 1ULL << 30;
+constexpr uint32_t kMaxTopK = 100000;
+constexpr uint32_t kMaxTopKIncrement = 100000;
+
+// The error prefixes of RedisBloom.
+constexpr char kCmsPrefix[] = "CMS: ";
+constexpr char kTopKPrefix[] = "TopK: ";
+
+// The accessors of CompactObj for every type of sketch.
+template <typename Sketch> struct SketchTraits;
+
+template <> struct SketchTraits<CmsSketch> {
+  static CmsSketch* Get(const PrimeValue& pv) {
+    return pv.GetCmsSketch();
+  }
+
+  static CmsSketch* Init(PrimeValue* pv) {
+    return pv->InitCmsSketch();
+  }
+};
+
+template <> struct SketchTraits<TopKSketch> {
+  static TopKSketch* Get(const PrimeValue& pv) {
+    return pv.GetTopKSketch();
+  }
+
+  static TopKSketch* Init(PrimeValue* pv) {
+    return pv->InitTopKSketch();
+  }
+};
+
+// The result of the first hop of CMS.MERGE in a shard.
+struct MergeShard {
+  OpStatus status = OpStatus::OK;
+  bool has_dest = false;
+  uint32_t width = 0, depth = 0;  // of the sketches in the shard, if any.
+  vector<int64_t> sums;           // of the weighted sources in the shard, if any.
+};
+
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
+}
+
+string GetString(EngineShard* shard, const PrimeValue& pv) {
+  string res;
+  if (pv.IsExternal()) {
+    auto [offset, size] = pv.GetExternalPtr();
+    res.resize(size);
+
+    error_code ec = shard->tiered_storage()->Read(offset, size, res.data());
+    CHECK(!ec) << "TBD: " << ec;
+  } else {
+    pv.GetString(&res);
+  }
+  return res;
+}
+
+// Returns the sketch of pv, or nullptr if pv is not a sketch of that type. A sketch that was
+// loaded as a plain string, e.g. from an RDB file or by a full sync, is parsed into tmp, and the
+// next write stores the parsed sketch in place of the string.
+template <typename Sketch>
+const Sketch* ReadSketch(EngineShard* shard, const PrimeValue& pv, unique_ptr<Sketch>* tmp) {
+  if (const Sketch* sketch = SketchTraits<Sketch>::Get(pv))
+    return sketch;
+
+  string raw = GetString(shard, pv);
+  if (!Sketch::HasMagic(raw))
+    return nullptr;
+
+  *tmp = make_unique<Sketch>(CompactObj::memory_resource());
+  return (*tmp)->Parse(raw) ? tmp->get() : nullptr;
+}
+
+template <typename Sketch>
+OpResult<const Sketch*> FindSketch(const OpArgs& op_args, string_view key,
+                                   unique_ptr<Sketch>* tmp) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  const Sketch* sketch = ReadSketch(op_args.shard, it_res.value()->second, tmp);
+  if (!sketch)
+    return OpStatus::WRONG_TYPE;
+  return sketch;
+}
+
+// Returns the sketch of key for an update, after the PreUpdate of its entry it, which the caller
+// follows with its PostUpdate. Unlike the filters of BF.ADD, the sketches are not created by
+// their updates.
+template <typename Sketch>
+OpResult<Sketch*> OpenSketch(const OpArgs& op_args, string_view key, PrimeIterator* it) {
+  auto& db_slice = op_args.shard->db_slice();
+  DbIndex db_index = op_args.db_cntx.db_index;
+  auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+  *it = it_res.value();
+
+  PrimeValue& pv = (*it)->second;
+  if (Sketch* sketch = SketchTraits<Sketch>::Get(pv)) {
+    db_slice.PreUpdate(db_index, *it);
+    return sketch;
+  }
+
+  // Replaces the plain string of the sketch with the parsed one.
+  string raw = GetString(op_args.shard, pv);
+  if (!Sketch::HasMagic(raw))
+    return OpStatus::WRONG_TYPE;
+
+  db_slice.PreUpdate(db_index, *it);
+  Sketch* sketch = SketchTraits<Sketch>::Init(&pv);
+  if (!sketch->Parse(raw)) {
+    pv.SetString(raw);
+    db_slice.PostUpdate(db_index, *it, key);
+    return OpStatus::WRONG_TYPE;
+  }
+  return sketch;
+}
+
+// Creates the sketch of key and initializes it with init, or fails with KEY_EXISTS if the key
+// exists.
+template <typename Sketch, typename InitFn>
+OpStatus OpCreate(const OpArgs& op_args, string_view key, InitFn init) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  auto [it, added] = add_res;
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  init(SketchTraits<Sketch>::Init(&it->second));
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
+  return OpStatus::OK;
+}
+
+template <typename Sketch, typename T>
+OpStatus OpIncrBy(const OpArgs& op_args, string_view key, ArgSlice items, const uint32_t* incr,
+                  T* res) {
+  PrimeIterator it;
+  OpResult<Sketch*> sketch = OpenSketch<Sketch>(op_args, key, &it);
+  if (!sketch)
+    return sketch.status();
+
+  (*sketch)->IncrBy(items, incr, res);
+  op_args.shard->db_slice().PostUpdate(op_args.db_cntx.db_index, it, key);
+  return OpStatus::OK;
+}
+
+// Merges the sources of CMS.MERGE in the shard with their weights.
+void OpMergeSources(Transaction* t, EngineShard* shard, const vector<int64_t>& weights,
+                    MergeShard* res) {
+  ShardId sid = shard->shard_id();
+  ArgSlice keys = t->ShardArgsInShard(sid);
+  const OpArgs op_args = t->GetOpArgs(shard);
+  for (size_t j = 0; j < keys.size(); ++j) {
+    unique_ptr<CmsSketch> tmp;
+    OpResult<const CmsSketch*> cms = FindSketch(op_args, keys[j], &tmp);
+    if (!cms) {
+      res->status = cms.status();
+      return;
+    }
+
+    const CmsSketch* sketch = *cms;
+    if (res->width == 0) {
+      res->width = sketch->width();
+      res->depth = sketch->depth();
+    } else if (res->width != sketch->width() || res->depth != sketch->depth()) {
+      res->status = OpStatus::INVALID_VALUE;
+      return;
+    }
+
+    // The index of the key among the arguments after the command name: the destination
+    // precedes numkeys, and the sources follow it.
+    size_t index = t->ReverseArgIndex(sid, j);
+    if (index == 0) {
+      res->has_dest = true;
+      continue;
+    }
+
+    res->sums.resize(size_t(res->width) * res->depth + 1);
+    sketch->AddWeighted(weights[index - 2], absl::MakeSpan(res->sums));
+  }
+}
+
+OpStatus OpStoreMerge(const OpArgs& op_args, string_view key, const vector<int64_t>& sums) {
+  PrimeIterator it;
+  OpResult<CmsSketch*> cms = OpenSketch<CmsSketch>(op_args, key, &it);
+  if (!cms)
+    return cms.status();
+
+  (*cms)->Assign(sums);
+  op_args.shard->db_slice().PostUpdate(op_args.db_cntx.db_index, it, key);
+  return OpStatus::OK;
+}
+
+void SendError(OpStatus status, string_view prefix, ConnectionContext* cntx) {
+  switch (status) {
+    case OpStatus::KEY_NOTFOUND:
+      return (*cntx)->SendError(absl::StrCat(prefix, "key does not exist"));
+    case OpStatus::KEY_EXISTS:
+      return (*cntx)->SendError(absl::StrCat(prefix, "key already exists"));
+    default:
+      return (*cntx)->SendError(status);
+  }
+}
+
+// Parses the item/increment pairs from args[2] on.
+bool ParseIncrements(CmdArgList args, uint32_t min_incr, uint32_t max_incr,
+                     vector<string_view>* items, vector<uint32_t>* incr) {
+  for (size_t i = 2; i < args.size(); i += 2) {
+    uint32_t val;
+    if (!absl::SimpleAtoi(ArgS(args, i + 1), &val) || val < min_incr || val > max_incr)
+      return false;
+    items->push_back(ArgS(args, i));
+    incr->push_back(val);
+  }
+  return true;
+}
+
+void SendCmsIncrBy(string_view key, vector<string_view> items, vector<uint32_t> incr,
+                   ConnectionContext* cntx) {
+  vector<uint64_t> res(items.size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpIncrBy<CmsSketch>(t->GetOpArgs(shard), key, items, incr.data(), res.data());
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kCmsPrefix, cntx);
+
+  (*cntx)->StartArray(res.size());
+  for (uint64_t count : res)
+    (*cntx)->SendLong(count);
+}
+
+void SendTopKIncrBy(string_view key, vector<string_view> items, vector<uint32_t> incr,
+                    ConnectionContext* cntx) {
+  vector<optional<string>> expelled(items.size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpIncrBy<TopKSketch>(t->GetOpArgs(shard), key, items, incr.data(), expelled.data());
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kTopKPrefix, cntx);
+
+  (*cntx)->StartArray(expelled.size());
+  for (const optional<string>& item : expelled) {
+    if (item)
+      (*cntx)->SendBulkString(*item);
+    else
+      (*cntx)->SendNull();
+  }
+}
+
+void CmsInit(string_view key, uint32_t width, uint32_t depth, ConnectionContext* cntx) {
+  if (CmsSketch::CountersSize(width, depth) > kMaxSketchSize)
+    return (*cntx)->SendError("CMS: sketch would be larger than 1GB");
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpCreate<CmsSketch>(t->GetOpArgs(shard), key,
+                               [&](CmsSketch* cms) { cms->Init(width, depth); });
+  };
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kCmsPrefix, cntx);
+  (*cntx)->SendOk();
+}
+
+void CmsInitByDim(CmdArgList args, ConnectionContext* cntx) {
+  // CMS.INITBYDIM key width depth
+  uint32_t width, depth;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &width) || width == 0)
+    return (*cntx)->SendError("CMS: invalid width");
+  if (!absl::SimpleAtoi(ArgS(args, 3), &depth) || depth == 0)
+    return (*cntx)->SendError("CMS: invalid depth");
+  CmsInit(ArgS(args, 1), width, depth, cntx);
+}
+
+void CmsInitByProb(CmdArgList args, ConnectionContext* cntx) {
+  // CMS.INITBYPROB key error probability
+  double error, probability;
+  if (!absl::SimpleAtod(ArgS(args, 2), &error) || !(error > 0 && error < 1))
+    return (*cntx)->SendError("CMS: invalid overestimation value");
+  if (!absl::SimpleAtod(ArgS(args, 3), &probability) || !(probability > 0 && probability < 1))
+    return (*cntx)->SendError("CMS: invalid prob value");
+
+  auto [width, depth] = CmsSketch::Dimensions(error, probability);
+  CmsInit(ArgS(args, 1), width, depth, cntx);
+}
+
+void CmsIncrBy(CmdArgList args, ConnectionContext* cntx) {
+  // CMS.INCRBY key item increment [item increment ...]
+  if (args.size() % 2 != 0)
+    return (*cntx)->SendError(WrongNumArgsError("cms.incrby"), kSyntaxErrType);
+
+  vector<string_view> items;
+  vector<uint32_t> incr;
+  if (!ParseIncrements(args, 0, UINT32_MAX, &items, &incr))
+    return (*cntx)->SendError("CMS: Cannot parse number");
+  SendCmsIncrBy(ArgS(args, 1), std::move(items), std::move(incr), cntx);
+}
+
+void CmsQuery(CmdArgList args, ConnectionContext* cntx) {
+  // CMS.QUERY key item [item ...]
+  string_view key = ArgS(args, 1);
+  vector<string_view> items(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i)
+    items[i - 2] = ArgS(args, i);
+
+  vector<uint64_t> res(items.size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    unique_ptr<CmsSketch> tmp;
+    OpResult<const CmsSketch*> cms = FindSketch(t->GetOpArgs(shard), key, &tmp);
+    if (!cms)
+      return cms.status();
+    (*cms)->Query(items, res.data());
+    return OpStatus::OK;
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kCmsPrefix, cntx);
+
+  (*cntx)->StartArray(res.size());
+  for (uint64_t count : res)
+    (*cntx)->SendLong(count);
+}
+
+void CmsMerge(CmdArgList args, ConnectionContext* cntx) {
+  // CMS.MERGE destination numKeys source [source ...] [WEIGHTS weight [weight ...]]
+  // The transaction has validated numKeys already.
+  string_view dest_key = ArgS(args, 1);
+  unsigned num_keys;
+  CHECK(absl::SimpleAtoi(ArgS(args, 2), &num_keys));
+
+  if (num_keys == 0)
+    return (*cntx)->SendError("CMS: invalid numkeys");
+
+  vector<int64_t> weights(num_keys, 1);
+  size_t weights_pos = num_keys + 3;
+  if (weights_pos < args.size()) {
+    ToUpper(&args[weights_pos]);
+    if (ArgS(args, weights_pos) != "WEIGHTS" || args.size() != weights_pos + 1 + num_keys)
+      return (*cntx)->SendError(kSyntaxErr);
+    for (size_t i = 0; i < num_keys; ++i) {
+      if (!absl::SimpleAtoi(ArgS(args, weights_pos + 1 + i), &weights[i]))
+        return (*cntx)->SendError(kInvalidIntErr);
+    }
+  }
+
+  vector<MergeShard> shards(shard_set->size());
+  auto merge_cb = [&](Transaction* t, EngineShard* shard) {
+    OpMergeSources(t, shard, weights, &shards[shard->shard_id()]);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Schedule();
+  cntx->transaction->Execute(std::move(merge_cb), false);
+
+  // Sums the weighted sources of all the shards, which must match the dimensions of dest.
+  OpStatus status = OpStatus::OK;
+  vector<int64_t> sums;
+  uint32_t width = 0, depth = 0;
+  bool has_dest = false;
+  for (const MergeShard& shard_res : shards) {
+    if (shard_res.status != OpStatus::OK) {
+      status = shard_res.status;
+      break;
+    }
+    has_dest |= shard_res.has_dest;
+    if (shard_res.width == 0)
+      continue;
+    if (width == 0) {
+      width = shard_res.width;
+      depth = shard_res.depth;
+      sums.resize(size_t(width) * depth + 1);
+    } else if (width != shard_res.width || depth != shard_res.depth) {
+      status = OpStatus::INVALID_VALUE;
+      break;
+    }
+
+    for (size_t i = 0; i < shard_res.sums.size(); ++i) {
+      if (__builtin_add_overflow(sums[i], shard_res.sums[i], &sums[i]))
+        sums[i] = shard_res.sums[i] > 0 ? INT64_MAX : INT64_MIN;
+    }
+  }
+
+  if (status == OpStatus::OK && !has_dest)
+    status = OpStatus::KEY_NOTFOUND;
+  if (status != OpStatus::OK) {
+    cntx->transaction->Execute(NoOpCb, true);
+    if (status == OpStatus::INVALID_VALUE)
+      return (*cntx)->SendError("CMS: width/depth is not equal");
+    return SendError(status, kCmsPrefix, cntx);
+  }
+
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
+  OpStatus store_status = OpStatus::OK;
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == dest_shard)
+      store_status = OpStoreMerge(t->GetOpArgs(shard), dest_key, sums);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Execute(std::move(store_cb), true);
+  if (store_status != OpStatus::OK)
+    return SendError(store_status, kCmsPrefix, cntx);
+  (*cntx)->SendOk();
+}
+
+void CmsInfo(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  uint32_t width = 0, depth = 0;
+  uint64_t count = 0;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    unique_ptr<CmsSketch> tmp;
+    OpResult<const CmsSketch*> cms = FindSketch(t->GetOpArgs(shard), key, &tmp);
+    if (!cms)
+      return cms.status();
+    width = (*cms)->width();
+    depth = (*cms)->depth();
+    count = (*cms)->count();
+    return OpStatus::OK;
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kCmsPrefix, cntx);
+
+  (*cntx)->StartArray(6);
+  (*cntx)->SendBulkString("width");
+  (*cntx)->SendLong(width);
+  (*cntx)->SendBulkString("depth");
+  (*cntx)->SendLong(depth);
+  (*cntx)->SendBulkString("count");
+  (*cntx)->SendLong(count);
+}
+
+void TopKReserve(CmdArgList args, ConnectionContext* cntx) {
+  // TOPK.RESERVE key topk [width depth decay]
+  if (args.size() != 3 && args.size() != 6)
+    return (*cntx)->SendError(WrongNumArgsError("topk.reserve"), kSyntaxErrType);
+
+  uint32_t k, width = TopKSketch::kDefaultWidth, depth = TopKSketch::kDefaultDepth;
+  double decay = TopKSketch::kDefaultDecay;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &k) || k == 0 || k > kMaxTopK)
+    return (*cntx)->SendError("TopK: invalid k");
+  if (args.size() == 6) {
+    if (!absl::SimpleAtoi(ArgS(args, 3), &width) || width == 0)
+      return (*cntx)->SendError("TopK: invalid width");
+    if (!absl::SimpleAtoi(ArgS(args, 4), &depth) || depth == 0)
+      return (*cntx)->SendError("TopK: invalid depth");
+    if (!absl::SimpleAtod(ArgS(args, 5), &decay) || !(decay > 0 && decay <= 1))
+      return (*cntx)->SendError("TopK: invalid decay value. must be '<= 1' & '> 0'");
+  }
+  if (TopKSketch::BucketsSize(width, depth) > kMaxSketchSize)
+    return (*cntx)->SendError("TopK: sketch would be larger than 1GB");
+
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpCreate<TopKSketch>(t->GetOpArgs(shard), key,
+                                [&](TopKSketch* topk) { topk->Init(k, width, depth, decay); });
+  };
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, kTopKPrefix, cntx);
+  (*cntx)->SendOk();
+}
+
+void TopKAdd(CmdArgList args, ConnectionContext* cntx) {
+  // TOPK.ADD key item [item ...]
+  vector<string_view> items(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i)
+    items[i - 2] = ArgS(args, i);
+  vector<uint32_t> incr(items.size(), 1);
+  SendTopKIncrBy(ArgS(args, 1), std::move(items), std::move(incr), cntx);
+}
+
+void TopKIncrBy(CmdArgList args, ConnectionContext* cntx) {
+  // TOPK.INCRBY key item increment [item increment ...]
+  if (args.size() % 2 != 0)
+    return (*cntx)->SendError(WrongNumArgsError("topk.incrby"), kSyntaxErrType);
+
+  vector<string_view> items;
+  vector<uint32_t> incr;
+  if (!ParseIncrements(args, 1, kMaxTopKIncrement, &items, &incr))
+    return (*cntx)->SendError("TopK: increment must be an integer between 1 and 100000");
+  SendTopKIncrBy(ArgS(args, 1), std::move(items), std::move(incr), cntx);
+}
+
+// Runs cb with the sketch of the key of args and replies with an error if it fails.
+template <typename Cb> bool ReadTopK(CmdArgList args, ConnectionContext* cntx, Cb cb) {
+  string_view key = ArgS(args, 1);
+  auto read_cb = [&](Transaction* t, EngineShard* shard) {
+    unique_ptr<TopKSketch> tmp;
+    OpResult<const TopKSketch*> topk = FindSketch(t->GetOpArgs(shard), key, &tmp);
+    if (!topk)
+      return topk.status();
+    cb(**topk);
+    return OpStatus::OK;
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(read_cb));
+  if (status != OpStatus::OK) {
+    SendError(status, kTopKPrefix, cntx);
+    return false;
+  }
+  return true;
+}
+
+void TopKQuery(CmdArgList args, ConnectionContext* cntx) {
+  // TOPK.QUERY key item [item ...]
+  size_t num_items = args.size() - 2;
+  unique_ptr<bool[]> res(new bool[num_items]);
+  auto cb = [&](const TopKSketch& topk) {
+    for (size_t i = 0; i < num_items; ++i)
+      res[i] = topk.Contains(ArgS(args, i + 2));
+  };
+  if (!ReadTopK(args, cntx, cb))
+    return;
+
+  (*cntx)->StartArray(num_items);
+  for (size_t i = 0; i < num_items; ++i)
+    (*cntx)->SendLong(res[i]);
+}
+
+void TopKList(CmdArgList args, ConnectionContext* cntx) {
+  // TOPK.LIST key [WITHCOUNT]
+  bool with_count = false;
+  if (args.size() > 3)
+    return (*cntx)->SendError(WrongNumArgsError("topk.list"), kSyntaxErrType);
+  if (args.size() == 3) {
+    ToUpper(&args[2]);
+    if (ArgS(args, 2) != "WITHCOUNT")
+      return (*cntx)->SendError(kSyntaxErr);
+    with_count = true;
+  }
+
+  vector<TopKeys::Entry> entries;
+  if (!ReadTopK(args, cntx, [&](const TopKSketch& topk) { entries = topk.List(); }))
+    return;
+
+  (*cntx)->StartArray(entries.size() * (with_count ? 2 : 1));
+  for (const TopKeys::Entry& entry : entries) {
+    (*cntx)->SendBulkString(entry.key);
+    if (with_count)
+      (*cntx)->SendLong(entry.count);
+  }
+}
+
+void TopKInfo(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t k = 0, width = 0, depth = 0;
+  double decay = 0;
+  auto cb = [&](const TopKSketch& topk) {
+    k = topk.k();
+    width = topk.width();
+    depth = topk.depth();
+    decay = topk.decay();
+  };
+  if (!ReadTopK(args, cntx, cb))
+    return;
+
+  (*cntx)->StartArray(8);
+  (*cntx)->SendBulkString("k");
+  (*cntx)->SendLong(k);
+  (*cntx)->SendBulkString("width");
+  (*cntx)->SendLong(width);
+  (*cntx)->SendBulkString("depth");
+  (*cntx)->SendLong(depth);
+  (*cntx)->SendBulkString("decay");
+  (*cntx)->SendDouble(decay);
+}
+
+}  // namespace
+
+void SketchFamily::Register(CommandRegistry* registry) {
+  constexpr uint32_t kWriteMask = CO::WRITE | CO::DENYOOM | CO::FAST;
+  constexpr uint32_t kMergeMask =
+      CO::WRITE | CO::DENYOOM | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING;
+
+  *registry << CI{"CMS.INITBYDIM", CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.SetHandler(&CmsInitByDim)
+            << CI{"CMS.INITBYPROB", CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.SetHandler(
+                   &CmsInitByProb)
+            << CI{"CMS.INCRBY", kWriteMask, -4, 1, 1, 1}.SetHandler(&CmsIncrBy)
+            << CI{"CMS.QUERY", CO::READONLY | CO::FAST, -3, 1, 1, 1}.SetHandler(&CmsQuery)
+            << CI{"CMS.MERGE", kMergeMask, -4, 3, 3, 1}.SetHandler(&CmsMerge)
+            << CI{"CMS.INFO", CO::READONLY | CO::FAST, 2, 1, 1, 1}.SetHandler(&CmsInfo)
+            << CI{"TOPK.RESERVE", CO::WRITE | CO::DENYOOM, -3, 1, 1, 1}.SetHandler(&TopKReserve)
+            << CI{"TOPK.ADD", kWriteMask, -3, 1, 1, 1}.SetHandler(&TopKAdd)
+            << CI{"TOPK.INCRBY", kWriteMask, -4, 1, 1, 1}.SetHandler(&TopKIncrBy)
+            << CI{"TOPK.QUERY", CO::READONLY | CO::FAST, -3, 1, 1, 1}.SetHandler(&TopKQuery)
+            << CI{"TOPK.LIST", CO::READONLY, -2, 1, 1, 1}.SetHandler(&TopKList)
+            << CI{"TOPK.INFO", CO::READONLY | CO::FAST, 2, 1, 1, 1}.SetHandler(&TopKInfo);
+}
+
+}  // namespace dfly
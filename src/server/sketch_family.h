@@ -0,0 +1,19 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace dfly {
+
+class CommandRegistry;
+
+// The count-min sketch and top-k commands of RedisBloom: CMS.INITBYDIM, CMS.INITBYPROB,
+// CMS.INCRBY, CMS.QUERY, CMS.MERGE, CMS.INFO, TOPK.RESERVE, TOPK.ADD, TOPK.INCRBY, TOPK.QUERY,
+// TOPK.LIST and TOPK.INFO. The sketches are string values, see core/frequency_sketch.h.
+class SketchFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
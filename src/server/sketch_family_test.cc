@@ -0,0 +1,160 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/sketch_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class SketchFamilyTest : public BaseFamilyTest {
+ protected:
+};
+
+TEST_F(SketchFamilyTest, Cms) {
+  EXPECT_EQ(Run({"cms.initbydim", "cms", "1000", "5"}), "OK");
+  EXPECT_THAT(Run({"cms.initbydim", "cms", "10", "5"}), ErrArg("CMS: key already exists"));
+
+  auto resp = Run({"cms.incrby", "cms", "a", "5", "b", "2", "a", "3"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(5), IntArg(2), IntArg(8)));
+
+  resp = Run({"cms.query", "cms", "a", "b", "c"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(8), IntArg(2), IntArg(0)));
+
+  resp = Run({"cms.info", "cms"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("width", IntArg(1000), "depth", IntArg(5), "count",
+                                         IntArg(10)));
+
+  EXPECT_EQ(Run({"cms.initbyprob", "prob", "0.001", "0.01"}), "OK");
+  resp = Run({"cms.info", "prob"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("width", IntArg(2000), "depth", IntArg(7), "count",
+                                         IntArg(0)));
+  EXPECT_EQ(Run({"type", "cms"}), "string");
+
+  EXPECT_THAT(Run({"cms.incrby", "missing", "a", "1"}), ErrArg("CMS: key does not exist"));
+  EXPECT_THAT(Run({"cms.query", "missing", "a"}), ErrArg("CMS: key does not exist"));
+  EXPECT_THAT(Run({"cms.incrby", "cms", "a"}), ErrArg("wrong number of arguments"));
+  EXPECT_THAT(Run({"cms.incrby", "cms", "a", "-1"}), ErrArg("CMS: Cannot parse number"));
+  EXPECT_THAT(Run({"cms.initbydim", "x", "0", "5"}), ErrArg("CMS: invalid width"));
+  EXPECT_THAT(Run({"cms.initbyprob", "x", "0.01", "1"}), ErrArg("CMS: invalid prob value"));
+  EXPECT_THAT(Run({"cms.initbydim", "x", "1000000000", "1000"}), ErrArg("larger than"));
+}
+
+TEST_F(SketchFamilyTest, CmsMerge) {
+  // The keys are spread over the shards.
+  for (string_view key : {"a", "b", "c"})
+    Run({"cms.initbydim", key, "100", "4"});
+  Run({"cms.initbydim", "other", "50", "4"});
+  Run({"cms.incrby", "a", "x", "5", "y", "1"});
+  Run({"cms.incrby", "b", "x", "2"});
+
+  EXPECT_EQ(Run({"cms.merge", "c", "2", "a", "b"}), "OK");
+  auto resp = Run({"cms.query", "c", "x", "y"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(7), IntArg(1)));
+
+  // The destination is overwritten, and it may be one of the sources.
+  EXPECT_EQ(Run({"cms.merge", "c", "2", "c", "a", "WEIGHTS", "2", "-1"}), "OK");
+  resp = Run({"cms.query", "c", "x", "y"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(9), IntArg(1)));
+  EXPECT_THAT(Run({"cms.info", "c"}).GetVec()[5], IntArg(10));
+
+  EXPECT_THAT(Run({"cms.merge", "c", "2", "a", "other"}), ErrArg("CMS: width/depth is not equal"));
+  EXPECT_THAT(Run({"cms.merge", "c", "2", "a", "missing"}), ErrArg("CMS: key does not exist"));
+  EXPECT_THAT(Run({"cms.merge", "new", "1", "a"}), ErrArg("CMS: key does not exist"));
+  EXPECT_THAT(Run({"cms.merge", "c", "1", "a", "WEIGHTS"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"cms.merge", "c", "1", "a", "WEIGHTS", "x"}), ErrArg("not an integer"));
+}
+
+TEST_F(SketchFamilyTest, TopK) {
+  EXPECT_EQ(Run({"topk.reserve", "topk", "2"}), "OK");
+  EXPECT_THAT(Run({"topk.reserve", "topk", "2"}), ErrArg("TopK: key already exists"));
+
+  auto resp = Run({"topk.add", "topk", "a", "b", "a"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(ArgType(RespExpr::NIL), ArgType(RespExpr::NIL),
+                                         ArgType(RespExpr::NIL)));
+
+  // c overtakes b, which is expelled.
+  resp = Run({"topk.incrby", "topk", "c", "5"});
+  EXPECT_EQ(resp, "b");
+
+  resp = Run({"topk.list", "topk", "withcount"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("c", IntArg(5), "a", IntArg(2)));
+  resp = Run({"topk.query", "topk", "a", "b", "c"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0), IntArg(1)));
+
+  resp = Run({"topk.info", "topk"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  ASSERT_EQ(8u, resp.GetVec().size());
+  EXPECT_THAT(resp.GetVec()[1], IntArg(2));
+  EXPECT_THAT(resp.GetVec()[3], IntArg(8));
+
+  EXPECT_THAT(Run({"topk.add", "missing", "a"}), ErrArg("TopK: key does not exist"));
+  EXPECT_THAT(Run({"topk.list", "missing"}), ErrArg("TopK: key does not exist"));
+  EXPECT_THAT(Run({"topk.incrby", "topk", "a", "0"}), ErrArg("increment must be"));
+  EXPECT_THAT(Run({"topk.incrby", "topk", "a", "100001"}), ErrArg("increment must be"));
+  EXPECT_THAT(Run({"topk.reserve", "x", "0"}), ErrArg("TopK: invalid k"));
+  EXPECT_THAT(Run({"topk.reserve", "x", "3", "8", "7"}), ErrArg("wrong number of arguments"));
+  EXPECT_THAT(Run({"topk.reserve", "x", "3", "8", "7", "1.5"}), ErrArg("invalid decay"));
+  EXPECT_THAT(Run({"topk.list", "topk", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(SketchFamilyTest, Reload) {
+  Run({"cms.initbydim", "cms", "100", "3"});
+  Run({"topk.reserve", "topk", "3", "16", "4", "0.9"});
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"cms.incrby", "cms", StrCat("item:", i % 10), "1"});
+    Run({"topk.add", "topk", StrCat("item:", i % 5 == 0 ? 0 : i % 17)});
+  }
+  auto list = Run({"topk.list", "topk", "withcount"});
+  ASSERT_THAT(list, ArgType(RespExpr::ARRAY));
+
+  // The sketches are saved as their serialized strings and parsed back by the next command.
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+  EXPECT_THAT(Run({"cms.query", "cms", "item:3"}), IntArg(10));
+  auto resp = Run({"topk.list", "topk", "withcount"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(list.GetVec(), resp.GetVec());
+  EXPECT_THAT(resp.GetVec()[0], "item:0");
+
+  resp = Run({"cms.incrby", "cms", "item:3", "1"});
+  EXPECT_THAT(resp, IntArg(11));
+  EXPECT_THAT(Run({"topk.add", "topk", "item:0"}), ArgType(RespExpr::NIL));
+}
+
+TEST_F(SketchFamilyTest, WrongType) {
+  Run({"set", "str", "foo"});
+  Run({"lpush", "list", "a"});
+  Run({"cms.initbydim", "cms", "10", "2"});
+  Run({"topk.reserve", "topk", "3"});
+
+  EXPECT_THAT(Run({"cms.incrby", "str", "a", "1"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"cms.query", "list", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"cms.query", "topk", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"topk.add", "cms", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"topk.list", "str"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"cms.initbydim", "str", "10", "2"}), ErrArg("CMS: key already exists"));
+  EXPECT_EQ(Run({"get", "str"}), "foo");
+}
+
+}  // namespace dfly
@@ -0,0 +1,51 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/slowlog.h"
+
+#include <atomic>
+
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+atomic_int64_t slowlog_threshold{10000};
+atomic_uint32_t slowlog_max_len{128};
+atomic_uint64_t next_entry_id{0};
+
+}  // namespace
+
+void SlowLog::SetThreshold(int64_t usec) {
+  slowlog_threshold.store(usec, memory_order_relaxed);
+
+  // The split of the duration of the transactions is only needed for the log.
+  Transaction::SetExecTiming(usec >= 0);
+}
+
+int64_t SlowLog::threshold() {
+  return slowlog_threshold.load(memory_order_relaxed);
+}
+
+void SlowLog::SetMaxLen(uint32_t len) {
+  slowlog_max_len.store(len, memory_order_relaxed);
+}
+
+uint32_t SlowLog::max_len() {
+  return slowlog_max_len.load(memory_order_relaxed);
+}
+
+void SlowLog::Add(Entry entry) {
+  entry.id = next_entry_id.fetch_add(1, memory_order_relaxed);
+  entries_.push_front(std::move(entry));
+
+  size_t len = max_len();
+  while (entries_.size() > len)
+    entries_.pop_back();
+}
+
+}  // namespace dfly
@@ -0,0 +1,68 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// The commands that ran longer than a threshold, as in the SLOWLOG of Redis. Every thread logs
+// the commands it dispatches into its own ring, so logging takes no locks, and SLOWLOG merges
+// the rings by the ids of the entries, which are unique across the threads.
+class SlowLog {
+ public:
+  // As in Redis, the arguments of an entry are truncated.
+  static constexpr size_t kMaxArgs = 32;
+  static constexpr size_t kMaxArgLen = 128;
+
+  struct Entry {
+    uint64_t id = 0;
+    time_t unix_ts = 0;
+    uint64_t duration_usec = 0;
+
+    // Of the transaction: the time its callbacks ran in the shards, summed over the shards,
+    // and the shards it spans. The rest of the duration went to scheduling, to waiting in the
+    // tx queues and to the hops between the threads.
+    uint64_t exec_usec = 0;
+    std::vector<ShardId> shards;
+
+    std::vector<std::string> args;
+    std::string client_addr;
+    std::string client_name;
+  };
+
+  // A negative threshold disables the log, 0 logs every command.
+  static void SetThreshold(int64_t usec);
+  static int64_t threshold();
+
+  static void SetMaxLen(uint32_t len);
+  static uint32_t max_len();
+
+  static bool IsSlow(uint64_t duration_usec) {
+    int64_t thresh = threshold();
+    return thresh >= 0 && duration_usec >= uint64_t(thresh);
+  }
+
+  // Assigns the id of the entry, and drops the oldest ones above max_len.
+  void Add(Entry entry);
+
+  // The newest first.
+  const std::deque<Entry>& entries() const {
+    return entries_;
+  }
+
+  void Reset() {
+    entries_.clear();
+  }
+
+ private:
+  std::deque<Entry> entries_;
+};
+
+}  // namespace dfly
@@ -8,10 +8,18 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/cleanup/cleanup.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/time/clock.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <filesystem>
+
+#include "base/flags.h"
 #include "base/logging.h"
+#include "facade/fault_injection.h"
 #include "server/db_slice.h"
 #include "server/engine_shard_set.h"
 #include "server/journal/journal.h"
@@ -19,6 +27,22 @@ extern "C" {
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(uint32_t, snapshot_cpu_share, 100,
+          "Maximal percentage of the shard thread time that snapshotting takes while "
+          "transactions are queued in the shard. Saving slows down accordingly. "
+          "100 - do not throttle");
+ABSL_FLAG(uint32_t, snapshot_max_burst_usec, 500,
+          "Target duration of a serialization burst between two yields of the snapshot fiber. "
+          "The number of entries per burst adapts to it. 0 - fixed bursts");
+ABSL_FLAG(uint64_t, snapshot_buffer_bytes, 32ULL << 20,
+          "Serialized data that waits in memory for the consumer of a snapshot, e.g. a replica "
+          "in full sync over a slow link. The snapshot pauses once it is reached. 0 - unbounded");
+ABSL_FLAG(uint64_t, snapshot_spill_bytes, 64ULL << 20,
+          "Changes that a shard serializes while its snapshot is paused, before they are "
+          "spilled into a temporary file in --dir. 0 - keep them in memory");
+
+ABSL_DECLARE_FLAG(std::string, dir);
+
 namespace dfly {
 
 using namespace std;
@@ -26,8 +50,27 @@ using namespace util;
 using namespace chrono_literals;
 namespace this_fiber = ::boost::this_fiber;
 using boost::fibers::fiber;
+namespace fs = std::filesystem;
+
+namespace {
+
+// Compression works better on larger blobs.
+size_t MinBlobSize(bool compressed) {
+  return compressed ? 32768 : 4096;
+}
+
+atomic_size_t buffered_bytes{0};
 
-SliceSnapshot::SliceSnapshot(DbSlice* slice, RecordChannel* dest) : db_slice_(slice), dest_(dest) {
+}  // namespace
+
+void SliceSnapshot::ChannelBudget::Release(size_t size) {
+  bytes.fetch_sub(size, memory_order_relaxed);
+  buffered_bytes.fetch_sub(size, memory_order_relaxed);
+  ec.notify();
+}
+
+SliceSnapshot::SliceSnapshot(DbSlice* slice, RecordChannel* dest, ChannelBudget* budget)
+    : db_slice_(slice), dest_(dest), budget_(budget) {
   db_array_ = slice->databases();
 }
 
@@ -53,20 +96,40 @@ void SliceSnapshot::Start(bool stream_journal, const Cancellation* cll) {
 
   sfile_.reset(new io::StringFile);
   rdb_serializer_.reset(new RdbSerializer(sfile_.get()));
+  rdb_serializer_->set_keep_external(keep_external_);
+  rdb_serializer_->set_native_encoding(native_encoding_);
+  compressor_ = compression_ ? BlobCompressor::Create(*compression_) : BlobCompressor::Create();
+  cll_ = cll;
 
   snapshot_fb_ = fiber([this, stream_journal, cll] {
     SerializeEntriesFb(cll);
+    db_slice_->UnregisterOnChange(snapshot_version_);
     if (cll->IsCancelled()) {
       Cancel();
-    } else if (!stream_journal) {
+      return;
+    }
+
+    if (!stream_journal) {
       CloseRecordChannel();
+      return;
+    }
+
+    // The journal changes keep coming until Stop, flush them as they accumulate instead of
+    // holding them all in memory.
+    size_t min_size = MinBlobSize(bool(compressor_));
+    while (!stopping_ && !cll->IsCancelled()) {
+      flush_ec_.await_until([&] { return stopping_ || PendingBytes() >= min_size; },
+                            chrono::steady_clock::now() + 100ms);
+      if (!stopping_)
+        FlushSfile(true);
     }
-    db_slice_->UnregisterOnChange(snapshot_version_);
   });
 }
 
 void SliceSnapshot::Stop() {
   // Wait for serialization to finish in any case.
+  stopping_ = true;
+  flush_ec_.notify();
   Join();
 
   if (journal_cb_id_) {
@@ -108,29 +171,43 @@ void SliceSnapshot::SerializeEntriesFb(const Cancellation* cll) {
     VLOG(1) << "Start traversing " << pt->size() << " items";
 
     uint64_t last_yield = 0;
+    uint64_t burst_start = absl::GetCurrentTimeNanos();
     mu_.lock();
     savecb_current_db_ = db_indx;
     mu_.unlock();
 
+    if (delta_base_)
+      SerializeTombstones(db_indx);
+
+    if (slots_) {
+      SerializeSlots(db_indx, cll);
+      FlushSfile(true);
+      continue;
+    }
+
     do {
       if (cll->IsCancelled())
         return;
 
+      uint64_t traverse_start = SnapshotStages::Start();
       PrimeTable::Cursor next = pt->Traverse(cursor, [this](auto it) { this->SaveCb(move(it)); });
+      SnapshotStages::Finish(SnapshotStages::TRAVERSE, traverse_start);
+      facade::InjectFault(facade::FaultPoint::SNAPSHOT_SERIALIZE);
 
       cursor = next;
 
       // Flush if needed.
       FlushSfile(false);
-      if (serialized_ >= last_yield + 100) {
+      if (serialized_ >= last_yield + burst_budget_) {
         DVLOG(2) << "Before sleep " << this_fiber::properties<FiberProps>().name();
-        this_fiber::yield();
+        Throttle(absl::GetCurrentTimeNanos() - burst_start);
         last_yield = serialized_;
         DVLOG(2) << "After sleep";
 
         // flush in case other fibers (writes commands that pushed previous values)
         // filled the buffer.
         FlushSfile(false);
+        burst_start = absl::GetCurrentTimeNanos();
       }
     } while (cursor);
 
@@ -150,6 +227,89 @@ void SliceSnapshot::SerializeEntriesFb(const Cancellation* cll) {
           << side_saved_ << "/" << savecb_calls_;
 }
 
+void SliceSnapshot::SerializeSlots(DbIndex db_index, const Cancellation* cll) {
+  DbTable* table = db_array_[db_index].get();
+  if (table->slot_keys.empty())  // Not in cluster mode.
+    return;
+
+  uint64_t last_yield = 0;
+  uint64_t burst_start = absl::GetCurrentTimeNanos();
+  vector<string> keys;
+  for (size_t slot = 0; slot < table->slot_keys.size(); ++slot) {
+    if (!slots_->test(slot))
+      continue;
+
+    // The index changes while we yield, hence the copy of the keys.
+    keys.assign(table->slot_keys[slot].begin(), table->slot_keys[slot].end());
+    for (const string& key : keys) {
+      if (cll->IsCancelled())
+        return;
+
+      // The keys that were deleted meanwhile are streamed by OnJournalEntry.
+      PrimeIterator it = table->prime.Find(key);
+      if (IsValid(it))
+        SaveCb(it);
+
+      FlushSfile(false);
+      if (serialized_ >= last_yield + burst_budget_) {
+        Throttle(absl::GetCurrentTimeNanos() - burst_start);
+        last_yield = serialized_;
+        FlushSfile(false);
+        burst_start = absl::GetCurrentTimeNanos();
+      }
+    }
+  }
+  VLOG(1) << "Saved " << slots_->count() << " slots of db " << db_index;
+}
+
+// A tombstone is written only if the key is absent when the snapshot starts, so tombstones and
+// entries of the same key never meet in a delta and their relative order does not matter.
+void SliceSnapshot::SerializeTombstones(DbIndex db_index) {
+  vector<string> keys;
+  for (const auto& [key, tombstone] : db_array_[db_index]->tombstones) {
+    if (tombstone.deleted < snapshot_version_ &&
+        (tombstone.readded == 0 || tombstone.readded > snapshot_version_)) {
+      keys.push_back(key);
+    }
+  }
+
+  // The table may change while we flush, hence the copy of the keys.
+  for (const string& key : keys) {
+    error_code ec = rdb_serializer_->SaveDeletedKey(key);
+    CHECK(!ec);  // we write to StringFile.
+    ++num_records_in_blob_;
+    FlushSfile(false);
+  }
+  VLOG(1) << "Saved " << keys.size() << " tombstones of db " << db_index;
+}
+
+void SliceSnapshot::Throttle(uint64_t burst_ns) {
+  constexpr uint32_t kMinBurst = 8, kMaxBurst = 4096;
+
+  uint64_t max_burst_ns = uint64_t(absl::GetFlag(FLAGS_snapshot_max_burst_usec)) * 1000;
+  if (max_burst_ns) {
+    if (burst_ns > max_burst_ns)
+      burst_budget_ = max(burst_budget_ / 2, kMinBurst);
+    else if (burst_ns < max_burst_ns / 2)
+      burst_budget_ = min(burst_budget_ + burst_budget_ / 4, kMaxBurst);
+  }
+
+  EngineShard* shard = db_slice_->shard_owner();
+  uint32_t share = absl::GetFlag(FLAGS_snapshot_cpu_share);
+  bool contended = !shard->txq()->Empty() || !shard->GetTaskQueue()->Empty();
+
+  if (share == 0 || share >= 100 || !contended) {
+    this_fiber::yield();
+    return;
+  }
+
+  // Give the queued work (100 - share)% of the thread. Bound the pause in case the burst was
+  // long because pushing into the channel blocked.
+  uint64_t pause_ns = min<uint64_t>(burst_ns * (100 - share) / share, 50'000'000);
+  this_fiber::sleep_for(chrono::nanoseconds(pause_ns));
+  shard->AddSnapshotLag(pause_ns / 1000);
+}
+
 void SliceSnapshot::CloseRecordChannel() {
   // stupid barrier to make sure that SerializePhysicalBucket finished.
   // Can not think of anything more elegant.
@@ -167,15 +327,12 @@ void SliceSnapshot::CloseRecordChannel() {
 // from SerializePhysicalBucket which should execute atomically.
 void SliceSnapshot::SerializeSingleEntry(DbIndex db_indx, const PrimeKey& pk, const PrimeValue& pv,
                                          RdbSerializer* serializer) {
-  time_t expire_time = 0;
-
-  if (pv.HasExpire()) {
-    auto eit = db_array_[db_indx]->expire.Find(pk);
-    expire_time = db_slice_->ExpireTime(eit);
-  }
+  time_t expire_time = pv.HasExpire() ? db_slice_->ExpireTime(pv.expire_period()) : 0;
 
+  uint64_t start = SnapshotStages::Start();
   io::Result<uint8_t> res = serializer->SaveEntry(pk, pv, expire_time);
   CHECK(res);  // we write to StringFile.
+  SnapshotStages::Finish(SnapshotStages::SERIALIZE, start);
   ++type_freq_map_[*res];
 }
 
@@ -186,7 +343,7 @@ bool SliceSnapshot::FlushSfile(bool force) {
     if (sfile_->val.empty())
       return false;
   } else {
-    if (sfile_->val.size() < 4096) {
+    if (sfile_->val.size() < MinBlobSize(bool(compressor_))) {
       return false;
     }
 
@@ -199,11 +356,148 @@ bool SliceSnapshot::FlushSfile(bool force) {
 
   DbRecord rec = GetDbRecord(savecb_current_db_, std::move(sfile_->val), num_records_in_blob_);
   num_records_in_blob_ = 0;  // We can not move this line after the push, because Push is blocking.
-  dest_->Push(std::move(rec));
+  PushRecord(std::move(rec));
 
   return true;
 }
 
+void SliceSnapshot::PushRecord(DbRecord rec) {
+  uint64_t start = SnapshotStages::Start();
+  absl::Cleanup finish = [start, size = rec.value.size()] {
+    SnapshotStages::Finish(SnapshotStages::CHANNEL_PUSH, start, size);
+  };
+  optional<DbRecord> pending{std::move(rec)};
+  uint64_t spill_limit = absl::GetFlag(FLAGS_snapshot_spill_bytes);
+
+  while (true) {
+    DrainSpill();
+
+    if (cll_->IsCancelled()) {
+      for (const auto& item : spilled_) {
+        if (item.size == 0)
+          buffered_bytes.fetch_sub(item.rec.value.size(), memory_order_relaxed);
+      }
+      spilled_.clear();
+      DrainSpill();  // Closes the file.
+      return;
+    }
+
+    if (spilled_.empty() && !BudgetExceeded()) {
+      if (pending)
+        PushToChannel(std::move(*pending));
+      return;
+    }
+
+    // Transactions keep running while we wait, and the callbacks keep serializing their changes.
+    if (spill_limit && PendingBytes() > spill_limit) {
+      Spill(std::move(pending));
+      pending.reset();
+    }
+
+    budget_->ec.await_until([this] { return !BudgetExceeded() || cll_->IsCancelled(); },
+                            chrono::steady_clock::now() + 10ms);
+  }
+}
+
+void SliceSnapshot::PushToChannel(DbRecord rec) {
+  size_t size = rec.value.size();
+  budget_->bytes.fetch_add(size, memory_order_relaxed);
+  buffered_bytes.fetch_add(size, memory_order_relaxed);
+  dest_->Push(std::move(rec));
+}
+
+void SliceSnapshot::Spill(optional<DbRecord> rec) {
+  vector<DbRecord> recs;
+  if (rec)
+    recs.push_back(std::move(*rec));
+
+  if (PendingBytes() > 0) {
+    auto ec = rdb_serializer_->FlushMem();
+    CHECK(!ec);
+    recs.push_back(GetDbRecord(savecb_current_db_, std::move(sfile_->val), num_records_in_blob_));
+    sfile_->val.clear();
+    num_records_in_blob_ = 0;
+  }
+
+  if (!spill_file_ && !spill_failed_) {
+    fs::path path = absl::GetFlag(FLAGS_dir);
+    path.append(absl::StrCat("snapshot-spill-", db_slice_->shard_id(), "-", snapshot_version_));
+
+    auto res = uring::OpenLinux(path.generic_string(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC,
+                                0600);
+    if (res) {
+      // The file is only reachable through the descriptor, so it disappears with the process.
+      unlink(path.c_str());
+      spill_file_ = std::move(*res);
+    } else {
+      LOG(WARNING) << "Could not open spill file " << path << ", " << res.error().message();
+      spill_failed_ = true;
+    }
+  }
+
+  for (DbRecord& r : recs) {
+    SpilledRecord& item = spilled_.emplace_back();
+    if (spill_file_ && !spill_failed_) {
+      error_code ec = spill_file_->Write(io::Buffer(r.value), spill_offset_, 0);
+      if (!ec) {
+        item.offset = spill_offset_;
+        item.size = r.value.size();
+        spill_offset_ += item.size;
+        db_slice_->shard_owner()->AddSnapshotSpill(item.size);
+        r.value = string{};
+      } else {
+        LOG(WARNING) << "Could not spill snapshot data, " << ec.message();
+        spill_failed_ = true;
+      }
+    }
+
+    if (item.size == 0) {
+      buffered_bytes.fetch_add(r.value.size(), memory_order_relaxed);
+    }
+    item.rec = std::move(r);
+  }
+}
+
+void SliceSnapshot::DrainSpill() {
+  while (!spilled_.empty() && !BudgetExceeded()) {
+    SpilledRecord item = std::move(spilled_.front());
+    spilled_.pop_front();
+
+    if (item.size > 0) {
+      item.rec.value.resize(item.size);
+      iovec v{.iov_base = item.rec.value.data(), .iov_len = item.size};
+      error_code ec = spill_file_->Read(&v, 1, item.offset, 0);
+      CHECK(!ec) << "Could not read the snapshot spill file, " << ec.message();
+    } else {
+      buffered_bytes.fetch_sub(item.rec.value.size(), memory_order_relaxed);
+    }
+    PushToChannel(std::move(item.rec));
+  }
+
+  // The next spill starts with a new file.
+  if (spilled_.empty()) {
+    if (spill_file_) {
+      spill_file_->Close();
+      spill_file_.reset();
+    }
+    spill_offset_ = 0;
+    spill_failed_ = false;
+  }
+}
+
+bool SliceSnapshot::BudgetExceeded() const {
+  uint64_t max_bytes = absl::GetFlag(FLAGS_snapshot_buffer_bytes);
+  return max_bytes && budget_->bytes.load(memory_order_relaxed) >= max_bytes;
+}
+
+size_t SliceSnapshot::PendingBytes() const {
+  return rdb_serializer_->SerializedLen() + sfile_->val.size();
+}
+
+size_t SliceSnapshot::BufferedBytes() {
+  return buffered_bytes.load(memory_order_relaxed);
+}
+
 // The algorithm is to go over all the buckets and serialize those with
 // version < snapshot_version_. In order to serialize each physical bucket exactly once we update
 // bucket version to snapshot_version_ once it has been serialized.
@@ -226,8 +520,9 @@ bool SliceSnapshot::SaveCb(PrimeIterator it) {
   ++savecb_calls_;
 
   uint64_t v = it.GetVersion();
-  if (v >= snapshot_version_) {
-    // either has been already serialized or added after snapshotting started.
+  if (v >= snapshot_version_ || v <= delta_base_) {
+    // either has been already serialized, added after snapshotting started or did not change
+    // since the base of the delta.
     DVLOG(3) << "Skipped " << it.segment_id() << ":" << it.bucket_id() << ":" << it.slot_id()
              << " at " << v;
     ++skipped_;
@@ -240,43 +535,64 @@ bool SliceSnapshot::SaveCb(PrimeIterator it) {
 }
 
 void SliceSnapshot::OnDbChange(DbIndex db_index, const DbSlice::ChangeReq& req) {
-  PrimeTable* table = db_slice_->GetTables(db_index).first;
+  PrimeTable* table = db_slice_->GetPrimeTable(db_index);
 
   if (const PrimeTable::bucket_iterator* bit = req.update()) {
-    if (bit->GetVersion() < snapshot_version_) {
+    uint64_t v = bit->GetVersion();
+    if (v < snapshot_version_ && v > delta_base_) {
       side_saved_ += SerializePhysicalBucket(db_index, *bit);
     }
   } else {
     string_view key = get<string_view>(req.change);
     table->CVCUponInsert(snapshot_version_, key, [this, db_index](PrimeTable::bucket_iterator it) {
       DCHECK_LT(it.GetVersion(), snapshot_version_);
-      side_saved_ += SerializePhysicalBucket(db_index, it);
+      if (it.GetVersion() > delta_base_)
+        side_saved_ += SerializePhysicalBucket(db_index, it);
     });
   }
 }
 
 void SliceSnapshot::OnJournalEntry(const journal::Entry& entry) {
-  CHECK(journal::Op::VAL == entry.opcode);
-
-  PrimeKey pkey{entry.key};
-
-  if (entry.db_ind == savecb_current_db_) {
-    ++num_records_in_blob_;
-    io::Result<uint8_t> res = rdb_serializer_->SaveEntry(pkey, *entry.pval_ptr, entry.expire_ms);
-    CHECK(res);  // we write to StringFile.
-  } else {
-    io::StringFile sfile;
-    RdbSerializer tmp_serializer(&sfile);
+  // Transactions also journal their scheduling, which changes nothing.
+  if (entry.opcode != journal::Op::COMMAND)
+    return;
+
+  // The snapshot carries the values after the command, so the changed keys are serialized with
+  // their current state.
+  io::StringFile sfile;
+  RdbSerializer tmp_serializer(&sfile);
+  bool current_db = entry.db_ind == savecb_current_db_;
+  RdbSerializer* serializer = current_db ? rdb_serializer_.get() : &tmp_serializer;
+
+  DbContext db_cntx{.db_index = entry.db_ind, .time_now_ms = GetCurrentTimeMs()};
+  unsigned num_records = 0;
+  for (size_t i = 0; i < entry.shard_args.size(); i += entry.key_step) {
+    string_view key = entry.shard_args[i];
+    if (!InSlots(key))
+      continue;
 
-    io::Result<uint8_t> res = tmp_serializer.SaveEntry(pkey, *entry.pval_ptr, entry.expire_ms);
-    CHECK(res);  // we write to StringFile.
+    PrimeIterator it = db_slice_->FindExt(db_cntx, key);
+    if (IsValid(it)) {
+      uint64_t expire_ms = db_slice_->ExpireTime(it);
+      io::Result<uint8_t> res = serializer->SaveEntry(it->first, it->second, expire_ms);
+      CHECK(res);  // we write to StringFile.
+    } else {
+      CHECK(!serializer->SaveDeletedKey(key));
+    }
+    ++num_records;
+  }
 
+  if (current_db) {
+    num_records_in_blob_ += num_records;
+    if (PendingBytes() >= MinBlobSize(bool(compressor_)))
+      flush_ec_.notify();
+  } else if (num_records > 0) {
     error_code ec = tmp_serializer.FlushMem();
     CHECK(!ec && !sfile.val.empty());
 
-    DbRecord rec = GetDbRecord(entry.db_ind, std::move(sfile.val), 1);
+    DbRecord rec = GetDbRecord(entry.db_ind, std::move(sfile.val), num_records);
 
-    dest_->Push(std::move(rec));
+    PushToChannel(std::move(rec));
   }
 }
 
@@ -289,32 +605,48 @@ unsigned SliceSnapshot::SerializePhysicalBucket(DbIndex db_index, PrimeTable::bu
 
   lock_guard lk(mu_);
 
+  // A bucket holds the keys of any slot, save only those of slots_.
+  string scratch;
+  auto in_slots = [&](const PrimeKey& pk) { return !slots_ || InSlots(pk.GetSlice(&scratch)); };
+
   if (db_index == savecb_current_db_) {
-    while (!it.is_done()) {
+    for (; !it.is_done(); ++it) {
+      if (!in_slots(it->first))
+        continue;
       ++result;
       SerializeSingleEntry(db_index, it->first, it->second, rdb_serializer_.get());
-      ++it;
     }
     num_records_in_blob_ += result;
   } else {
     io::StringFile sfile;
     RdbSerializer tmp_serializer(&sfile);
 
-    while (!it.is_done()) {
+    for (; !it.is_done(); ++it) {
+      if (!in_slots(it->first))
+        continue;
       ++result;
       SerializeSingleEntry(db_index, it->first, it->second, &tmp_serializer);
-      ++it;
     }
+    if (result == 0)
+      return 0;
+
     error_code ec = tmp_serializer.FlushMem();
     CHECK(!ec && !sfile.val.empty());
 
-    dest_->Push(GetDbRecord(db_index, std::move(sfile.val), result));
+    PushToChannel(GetDbRecord(db_index, std::move(sfile.val), result));
   }
   return result;
 }
 
 auto SliceSnapshot::GetDbRecord(DbIndex db_index, std::string value, unsigned num_records)
     -> DbRecord {
+  if (compressor_) {
+    uint64_t start = SnapshotStages::Start();
+    size_t size = value.size();
+    compressor_->Compress(&value);
+    SnapshotStages::Finish(SnapshotStages::COMPRESS, start, size);
+  }
+
   channel_bytes_ += value.size();
   auto id = rec_id_++;
   DVLOG(2) << "Pushed " << id;
@@ -6,11 +6,16 @@
 
 #include <atomic>
 #include <bitset>
+#include <deque>
+#include <optional>
 
 #include "io/file.h"
+#include "server/cluster/cluster_config.h"
 #include "server/db_slice.h"
 #include "server/table.h"
+#include "util/fibers/event_count.h"
 #include "util/fibers/simple_channel.h"
+#include "util/uring/uring_file.h"
 
 namespace dfly {
 
@@ -18,6 +23,7 @@ namespace journal {
 struct Entry;
 }  // namespace journal
 
+class BlobCompressor;
 class RdbSerializer;
 
 class SliceSnapshot {
@@ -34,9 +40,47 @@ class SliceSnapshot {
   using RecordChannel =
       ::util::fibers_ext::SimpleChannel<DbRecord, base::mpmc_bounded_queue<DbRecord>>;
 
-  SliceSnapshot(DbSlice* slice, RecordChannel* dest);
+  // The bytes of the records that wait in a RecordChannel. The snapshot fiber pauses while they
+  // exceed snapshot_buffer_bytes, so a slow consumer does not make the channel grow without
+  // bounds. The consumer releases every record it pops. Thread-safe.
+  struct ChannelBudget {
+    std::atomic_size_t bytes{0};
+    util::fibers_ext::EventCount ec;
+
+    void Release(size_t size);
+  };
+
+  SliceSnapshot(DbSlice* slice, RecordChannel* dest, ChannelBudget* budget);
   ~SliceSnapshot();
 
+  // Makes the serializer write references to the offloaded values. Must be called before Start.
+  void KeepExternalValues() {
+    keep_external_ = true;
+  }
+
+  // Makes the serializer store listpacks verbatim. Must be called before Start.
+  void UseNativeEncoding() {
+    native_encoding_ = true;
+  }
+
+  // Makes the snapshot a delta of the snapshot that started at base_version: only the buckets
+  // changed after it and the tombstones of the keys deleted after it are saved.
+  // Must be called before Start.
+  void SetDeltaBase(uint64_t base_version) {
+    delta_base_ = base_version;
+  }
+
+  // Overrides snapshot_compression. Must be called before Start.
+  void SetCompression(std::string mode) {
+    compression_ = std::move(mode);
+  }
+
+  // Restricts the snapshot to the keys of the slots, which are found through the slot index of
+  // cluster mode instead of traversing the tables. Must be called before Start.
+  void SetSlots(std::shared_ptr<const SlotSet> slots) {
+    slots_ = std::move(slots);
+  }
+
   void Start(bool stream_journal, const Cancellation* cll);
 
   void Stop();  // only needs to be called in journal streaming mode.
@@ -61,15 +105,59 @@ class SliceSnapshot {
     return type_freq_map_;
   }
 
+  // The bytes that all the snapshots of the process hold in their channels and spill queues.
+  static size_t BufferedBytes();
+
  private:
+  // A record that waits in the spill file, or in memory if it could not be written.
+  struct SpilledRecord {
+    DbRecord rec;
+    size_t offset = 0;
+    size_t size = 0;  // 0 if the record stays in memory.
+  };
+
   void CloseRecordChannel();
 
   void SerializeEntriesFb(const Cancellation* cll);
 
+  // Serializes the buckets of the keys of slots_ in db_index, by their slot index.
+  void SerializeSlots(DbIndex db_index, const Cancellation* cll);
+
+  bool InSlots(std::string_view key) const {
+    return !slots_ || slots_->test(ClusterConfig::KeySlot(key));
+  }
+
+  // Writes the tombstones of the keys of db_index that are absent at snapshot_version_.
+  void SerializeTombstones(DbIndex db_index);
+
   void SerializeSingleEntry(DbIndex db_index, const PrimeKey& pk, const PrimeValue& pv,
                             RdbSerializer* serializer);
 
   bool FlushSfile(bool force);
+
+  // Pushes rec into the channel once the consumer has room for it. While it waits, the changes
+  // that the callbacks serialize meanwhile are spilled to disk when they exceed
+  // snapshot_spill_bytes. Returns after the spilled records were pushed as well, preserving
+  // their order. Must run in the snapshot fiber or in Stop.
+  void PushRecord(DbRecord rec);
+
+  // Pushes without waiting, for the callbacks that must not preempt.
+  void PushToChannel(DbRecord rec);
+
+  // Moves the pending serialized changes, preceded by rec if it is set, into the spill queue.
+  void Spill(std::optional<DbRecord> rec);
+
+  // Pushes the spilled records into the channel while the budget allows it.
+  void DrainSpill();
+
+  bool BudgetExceeded() const;
+
+  // Serialized data that the callbacks added since the last flush.
+  size_t PendingBytes() const;
+
+  // Called between serialization bursts. Adapts the size of the next burst to its measured
+  // duration and pauses when the shard has queued work, see snapshot_cpu_share.
+  void Throttle(uint64_t burst_ns);
   bool SaveCb(PrimeIterator it);
 
   void OnDbChange(DbIndex db_index, const DbSlice::ChangeReq& req);
@@ -86,23 +174,43 @@ class SliceSnapshot {
 
   std::unique_ptr<io::StringFile> sfile_;
   std::unique_ptr<RdbSerializer> rdb_serializer_;
+  std::optional<std::string> compression_;
+  std::shared_ptr<const SlotSet> slots_;  // Saves only these slots if set.
+  std::unique_ptr<BlobCompressor> compressor_;
   RecordChannel* dest_;
+  ChannelBudget* budget_;
+  const Cancellation* cll_ = nullptr;
+
+  // Records that wait for the channel, in order. Written to spill_file_ unless it failed.
+  std::deque<SpilledRecord> spilled_;
+  std::unique_ptr<util::uring::LinuxFile> spill_file_;
+  size_t spill_offset_ = 0;
+  bool spill_failed_ = false;  // Keeps the records in memory until spilled_ is drained.
+
+  // Wakes the snapshot fiber that flushes the journal changes after the traversal.
+  util::fibers_ext::EventCount flush_ec_;
+  bool stopping_ = false;
 
   boost::fibers::mutex mu_;
   // version upper bound for entries that should be saved (not included).
   uint64_t snapshot_version_ = 0;
+  // Delta snapshots skip the buckets with versions up to delta_base_ (included).
+  uint64_t delta_base_ = 0;
   DbIndex savecb_current_db_;  // used by SaveCb
 
   size_t channel_bytes_ = 0;
   size_t serialized_ = 0, skipped_ = 0, side_saved_ = 0, savecb_calls_ = 0;
   uint64_t rec_id_ = 0;
   uint32_t num_records_in_blob_ = 0;
+  uint32_t burst_budget_ = 100;  // Entries serialized between two yields.
 
   uint32_t journal_cb_id_ = 0;
 
   ::boost::fibers::fiber snapshot_fb_;
 
   std::atomic_bool closed_chan_{false};
+  bool keep_external_ = false;
+  bool native_encoding_ = false;
 };
 
 }  // namespace dfly
@@ -4,18 +4,24 @@
 
 #include "server/stream_family.h"
 
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/str_cat.h>
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/redis_aux.h"
 #include "redis/stream.h"
 }
 
 #include "base/logging.h"
 #include "facade/error.h"
+#include "io/io.h"
+#include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
+#include "server/journal/journal.h"
+#include "server/server_state.h"
 #include "server/transaction.h"
 
 namespace dfly {
@@ -43,10 +49,18 @@ struct RangeId {
   bool exclude = false;
 };
 
+// The MAXLEN and MINID options of XADD and XTRIM.
+struct TrimOpts {
+  int strategy = TRIM_STRATEGY_NONE;
+  uint32_t max_len = kuint32max;
+  streamID min_id{0, 0};
+  bool approx = false;
+  int64_t limit = -1;  // the default of the strategy if negative.
+};
+
 struct AddOpts {
   ParsedStreamId parsed_id;
-  uint32_t max_limit = kuint32max;
-  bool max_limit_approx = false;
+  TrimOpts trim_opts;
 };
 
 struct GroupInfo {
@@ -63,6 +77,58 @@ struct RangeOpts {
   uint32_t count = kuint32max;
 };
 
+// The position that XREAD and XREADGROUP read a stream from.
+struct ReadId {
+  streamID val{0, 0};        // the read returns the entries after it.
+  bool last = false;         // "$" of XREAD, the entries added after the read starts.
+  bool undelivered = false;  // ">" of XREADGROUP, the entries not delivered to the group.
+};
+
+struct ReadOpts {
+  string_view group;
+  string_view consumer;
+  vector<ReadId> ids;  // in the order of the streams.
+  uint32_t count = kuint32max;
+  int64_t timeout_ms = -1;   // -1 if the read does not block, 0 to block forever.
+  unsigned streams_arg = 0;  // the argument index of the first stream.
+  bool noack = false;
+};
+
+struct PendingOpts {
+  string_view group;
+  string_view consumer;  // the entries of all the consumers if empty.
+  streamID start{0, 0};
+  streamID end{UINT64_MAX, UINT64_MAX};
+  int64_t min_idle = 0;
+  uint32_t count = 0;
+};
+
+struct PendingSummary {
+  uint64_t count = 0;
+  streamID min_id, max_id;
+  vector<pair<string, uint64_t>> consumers;  // the consumers with pending entries.
+};
+
+struct PendingEntry {
+  streamID id;
+  string consumer;
+  int64_t idle;
+  uint64_t delivery_count;
+};
+
+struct ClaimOpts {
+  string_view group;
+  string_view consumer;
+  int64_t min_idle = 0;
+  int64_t delivery_time = -1;  // set by IDLE or TIME, the current time if negative.
+  int64_t retry_count = -1;
+  streamID last_id{0, 0};
+  bool force = false;
+  bool justid = false;
+};
+
+constexpr streamID kMaxStreamId{UINT64_MAX, UINT64_MAX};
+
 const char kInvalidStreamId[] = "Invalid stream ID specified as stream command argument";
 const char kXGroupKeyNotFound[] =
     "The XGROUP subcommand requires the key to exist. "
@@ -77,6 +143,10 @@ inline string NoGroupError(string_view key, string_view cgroup) {
   return absl::StrCat("-NOGROUP No such consumer group '", cgroup, "' for key name '", key, "'");
 }
 
+inline string NoGroupOrKeyError(string_view key, string_view cgroup, string_view suffix = "") {
+  return absl::StrCat("-NOGROUP No such key '", key, "' or consumer group '", cgroup, "'", suffix);
+}
+
 bool ParseID(string_view strid, bool strict, uint64_t missing_seq, ParsedStreamId* dest) {
   if (strid.empty() || strid.size() > 127)
     return false;
@@ -138,6 +208,73 @@ bool ParseRangeId(string_view id, RangeId* dest) {
   return ParseID(id, dest->exclude, 0, &dest->parsed_id);
 }
 
+// Parses the trimming option at args[*indx], MAXLEN|MINID [=|~] threshold or LIMIT count, and
+// moves *indx to its last argument.
+OpStatus ParseTrimOption(CmdArgList args, size_t* indx, TrimOpts* opts) {
+  size_t i = *indx;
+  string_view arg = ArgS(args, i);
+  if (i + 1 >= args.size())
+    return OpStatus::SYNTAX_ERR;
+
+  if (arg == "LIMIT") {
+    if (!absl::SimpleAtoi(ArgS(args, ++i), &opts->limit) || opts->limit < 0)
+      return OpStatus::INVALID_INT;
+    *indx = i;
+    return OpStatus::OK;
+  }
+
+  if (opts->strategy != TRIM_STRATEGY_NONE)
+    return OpStatus::SYNTAX_ERR;
+
+  string_view modifier = ArgS(args, i + 1);
+  if (modifier == "~" || modifier == "=") {
+    opts->approx = modifier == "~";
+    if (++i + 1 >= args.size())
+      return OpStatus::SYNTAX_ERR;
+  }
+
+  string_view threshold = ArgS(args, ++i);
+  if (arg == "MAXLEN") {
+    opts->strategy = TRIM_STRATEGY_MAXLEN;
+    if (!absl::SimpleAtoi(threshold, &opts->max_len))
+      return OpStatus::INVALID_INT;
+  } else {
+    opts->strategy = TRIM_STRATEGY_MINID;
+    ParsedStreamId parsed_id;
+    if (!ParseID(threshold, true, 0, &parsed_id) || !parsed_id.id_given)
+      return OpStatus::SYNTAX_ERR;
+    opts->min_id = parsed_id.val;
+  }
+
+  *indx = i;
+  return OpStatus::OK;
+}
+
+inline bool IsTrimOption(string_view arg) {
+  return arg == "MAXLEN" || arg == "MINID" || arg == "LIMIT";
+}
+
+// Whole listpack nodes are dropped by checking their last ID, so trimming costs O(nodes) and
+// only the node at the trim point is scanned entry by entry. Approximate trimming skips even that.
+int64_t TrimStream(stream* s, const TrimOpts& opts) {
+  if (opts.strategy == TRIM_STRATEGY_NONE)
+    return 0;
+
+  streamAddTrimArgs args = {};
+  args.trim_strategy = opts.strategy;
+  args.approx_trim = opts.approx;
+  args.maxlen = opts.max_len;
+  args.minid = opts.min_id;
+  if (opts.limit >= 0) {
+    args.limit = opts.limit;
+  } else {
+    // Bounds the work of approximate trimming like redis does.
+    args.limit = opts.approx ? 100 * server.stream_node_max_entries : 0;
+  }
+
+  return streamTrim(s, &args);
+}
+
 OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts& opts,
                          CmdArgList args) {
   DCHECK(!args.empty() && args.size() % 2 == 0);
@@ -166,21 +303,19 @@ OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts&
 
   stream* stream_inst = (stream*)it->second.RObjPtr();
 
-  // we should really get rid of this monstrousity and rewrite streamAppendItem ourselves here.
-  unique_ptr<robj*[]> objs(new robj*[args.size()]);
+  // The fields and values are appended to the listpack directly from the arguments.
+  absl::InlinedVector<unsigned char*, 16> fv(args.size());
+  absl::InlinedVector<size_t, 16> fv_len(args.size());
   for (size_t i = 0; i < args.size(); ++i) {
-    objs[i] = createStringObject(args[i].data(), args[i].size());
+    fv[i] = reinterpret_cast<unsigned char*>(args[i].data());
+    fv_len[i] = args[i].size();
   }
 
   streamID result_id;
   const auto& parsed_id = opts.parsed_id;
   streamID passed_id = parsed_id.val;
-  int res = streamAppendItem(stream_inst, objs.get(), args.size() / 2, &result_id,
-                             parsed_id.id_given ? &passed_id : nullptr, parsed_id.has_seq);
-
-  for (size_t i = 0; i < args.size(); ++i) {
-    decrRefCount(objs[i]);
-  }
+  int res = streamAppendItemRaw(stream_inst, fv.data(), fv_len.data(), args.size() / 2, &result_id,
+                                parsed_id.id_given ? &passed_id : nullptr, parsed_id.has_seq);
 
   if (res != C_OK) {
     if (errno == ERANGE)
@@ -191,33 +326,26 @@ OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts&
     return OpStatus::OUT_OF_MEMORY;
   }
 
-  if (opts.max_limit < kuint32max) {
-    /* Notify xtrim event if needed. */
-    streamTrimByLength(stream_inst, opts.max_limit, opts.max_limit_approx);
-    // TODO: when replicating, we should propagate it as exact limit in case of trimming.
+  TrimStream(stream_inst, opts.trim_opts);
+
+  // Awakes the readers that block on the stream, they continue from their last IDs.
+  if (op_args.shard->blocking_controller()) {
+    op_args.shard->blocking_controller()->AwakeWatched(op_args.db_cntx.db_index, key);
   }
+
   return result_id;
 }
 
-OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts) {
-  auto& db_slice = op_args.shard->db_slice();
-  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
-  if (!res_it)
-    return res_it.status();
-
+RecordVec ReadRange(stream* s, streamID start, streamID end, bool is_rev, uint32_t count) {
   RecordVec result;
-
-  if (opts.count == 0)
+  if (count == 0)
     return result;
 
   streamIterator si;
   int64_t numfields;
   streamID id;
-  CompactObj& cobj = (*res_it)->second;
-  stream* s = (stream*)cobj.RObjPtr();
-  streamID sstart = opts.start.val, send = opts.end.val;
 
-  streamIteratorStart(&si, s, &sstart, &send, opts.is_rev);
+  streamIteratorStart(&si, s, &start, &end, is_rev);
   while (streamIteratorGetID(&si, &id, &numfields)) {
     Record rec;
     rec.id = id;
@@ -236,7 +364,7 @@ OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeO
 
     result.push_back(move(rec));
 
-    if (opts.count == result.size())
+    if (count == result.size())
       break;
   }
 
@@ -245,6 +373,86 @@ OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeO
   return result;
 }
 
+OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  CompactObj& cobj = (*res_it)->second;
+  stream* s = (stream*)cobj.RObjPtr();
+
+  return ReadRange(s, opts.start.val, opts.end.val, opts.is_rev, opts.count);
+}
+
+// The reply of a range read, serialized in the shard.
+struct SerializedRange {
+  uint32_t count = 0;  // the number of entries in body.
+  string body;         // the entries without the array header.
+};
+
+// Same as OpRange, but serializes the entries into the reply straight from the listpacks of the
+// stream, without copying them into records first.
+OpResult<SerializedRange> OpRangeSerialized(const OpArgs& op_args, string_view key,
+                                            const RangeOpts& opts, bool resp3) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  stream* s = (stream*)(*res_it)->second.RObjPtr();
+  SerializedRange result;
+  if (opts.count == 0)
+    return result;
+
+  ::io::StringSink sink;
+  RedisReplyBuilder rb{&sink};
+  rb.SetResp3(resp3);
+
+  streamIterator si;
+  int64_t numfields;
+  streamID id;
+  streamID start = opts.start.val, end = opts.end.val;
+
+  streamIteratorStart(&si, s, &start, &end, opts.is_rev);
+  while (streamIteratorGetID(&si, &id, &numfields)) {
+    rb.StartArray(2);
+    rb.SendBulkString(StreamIdRepr(id));
+    if (numfields == 0) {
+      rb.SendNullArray();
+    } else {
+      rb.StartArray(numfields * 2);
+    }
+
+    while (numfields--) {
+      unsigned char *field, *value;
+      int64_t field_len, value_len;
+      streamIteratorGetField(&si, &field, &value, &field_len, &value_len);
+      rb.SendBulkString({reinterpret_cast<char*>(field), size_t(field_len)});
+      rb.SendBulkString({reinterpret_cast<char*>(value), size_t(value_len)});
+    }
+
+    if (++result.count == opts.count)
+      break;
+  }
+  streamIteratorStop(&si);
+
+  result.body = sink.str();
+  return result;
+}
+
+OpResult<int64_t> OpTrim(const OpArgs& op_args, string_view key, const TrimOpts& opts) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  CompactObj& cobj = (*res_it)->second;
+  stream* s = (stream*)cobj.RObjPtr();
+
+  return TrimStream(s, opts);
+}
+
 OpResult<uint32_t> OpLen(const OpArgs& op_args, string_view key) {
   auto& db_slice = op_args.shard->db_slice();
   OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
@@ -486,6 +694,341 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, absl::Span<stre
   return deleted;
 }
 
+// XREAD, returns the entries after the id. Resolves "$" to the last ID of the stream.
+OpResult<RecordVec> OpRead(const OpArgs& op_args, string_view key, uint32_t count, ReadId* id) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it) {
+    // A stream that is created later is read from its first entry.
+    id->last = false;
+    return res_it.status();
+  }
+
+  stream* s = (stream*)(*res_it)->second.RObjPtr();
+  if (id->last) {
+    id->val = s->last_id;
+    id->last = false;
+    return RecordVec{};
+  }
+
+  streamID start = id->val;
+  if (streamIncrID(&start) != C_OK)
+    return RecordVec{};
+
+  return ReadRange(s, start, kMaxStreamId, false, count);
+}
+
+// Adds the entry to the pending entries lists of the group and the consumer. The entry may be
+// pending for another consumer if the group was moved back by XGROUP SETID.
+void AddPending(streamCG* cg, streamConsumer* consumer, streamID id) {
+  unsigned char buf[sizeof(streamID)];
+  streamEncodeID(buf, &id);
+
+  streamNACK* nack = streamCreateNACK(consumer);
+  if (raxTryInsert(cg->pel, buf, sizeof(buf), nack, nullptr)) {
+    CHECK(raxTryInsert(consumer->pel, buf, sizeof(buf), nack, nullptr));
+    return;
+  }
+
+  streamFreeNACK(nack);
+  nack = (streamNACK*)raxFind(cg->pel, buf, sizeof(buf));
+  raxRemove(nack->consumer->pel, buf, sizeof(buf), nullptr);
+  nack->consumer = consumer;
+  nack->delivery_time = GetCurrentTimeMs();
+  nack->delivery_count = 1;
+  raxInsert(consumer->pel, buf, sizeof(buf), nack, nullptr);
+}
+
+// Returns the entries after the id in the pending entries list of the consumer. The entries that
+// were deleted from the stream since their delivery have no fields.
+RecordVec ReadPending(stream* s, streamConsumer* consumer, streamID id, uint32_t count) {
+  RecordVec result;
+  if (streamIncrID(&id) != C_OK)
+    return result;
+
+  unsigned char start_key[sizeof(streamID)];
+  streamEncodeID(start_key, &id);
+  uint64_t now = GetCurrentTimeMs();
+
+  raxIterator ri;
+  raxStart(&ri, consumer->pel);
+  raxSeek(&ri, ">=", start_key, sizeof(start_key));
+  while (result.size() < count && raxNext(&ri)) {
+    streamID pending_id;
+    streamDecodeID(ri.key, &pending_id);
+
+    RecordVec entry = ReadRange(s, pending_id, pending_id, false, 1);
+    if (entry.empty()) {
+      result.push_back(Record{pending_id, {}});
+      continue;
+    }
+
+    streamNACK* nack = (streamNACK*)ri.data;
+    nack->delivery_time = now;
+    nack->delivery_count++;
+    result.push_back(move(entry.front()));
+  }
+  raxStop(&ri);
+
+  return result;
+}
+
+// Replicas replay the delivery of new entries as XCLAIM, so that they build the same pending
+// entries lists, or as XGROUP SETID for NOACK reads.
+void JournalGroupRead(const OpArgs& op_args, string_view key, const ReadOpts& opts,
+                      const RecordVec& records) {
+  journal::Journal* journal = op_args.shard->journal();
+  if (!journal)
+    return;
+
+  string last_id = StreamIdRepr(records.back().id);
+  vector<string> ids;
+  vector<string_view> args;
+  if (opts.noack) {
+    args = {"SETID", key, opts.group, last_id};
+  } else {
+    ids.reserve(records.size());
+    args = {key, opts.group, opts.consumer, "0"};
+    for (const auto& rec : records) {
+      args.push_back(ids.emplace_back(StreamIdRepr(rec.id)));
+    }
+    args.insert(args.end(), {"FORCE", "JUSTID", "LASTID", last_id});
+  }
+
+  journal::Entry entry{op_args.txid, op_args.db_cntx.db_index,
+                       {opts.noack ? "XGROUP" : "XCLAIM", ArgSlice{args}}, 1};
+  entry.shard_args = ArgSlice{&key, 1};
+  journal->RecordEntry(entry);
+}
+
+streamConsumer* FindOrCreateConsumer(EngineShard* shard, streamCG* cg, string_view name) {
+  shard->tmp_str1 = sdscpylen(shard->tmp_str1, name.data(), name.size());
+  streamConsumer* consumer = streamLookupConsumer(cg, shard->tmp_str1, 0);
+  if (!consumer)
+    consumer = streamCreateConsumer(cg, shard->tmp_str1, nullptr, 0, 0);
+  return consumer;
+}
+
+// XREADGROUP, returns the entries that were not delivered to the group for ">", or the
+// pending entries of the consumer after the id otherwise.
+OpResult<RecordVec> OpReadGroup(const OpArgs& op_args, string_view key, const ReadOpts& opts,
+                                const ReadId& id) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, opts.group);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  auto [s, cg] = *cgr_res;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  streamConsumer* consumer = FindOrCreateConsumer(op_args.shard, cg, opts.consumer);
+  if (!id.undelivered)
+    return ReadPending(s, consumer, id.val, opts.count);
+
+  streamID start = cg->last_id;
+  if (streamIncrID(&start) != C_OK)
+    return RecordVec{};
+
+  RecordVec result = ReadRange(s, start, kMaxStreamId, false, opts.count);
+  if (result.empty())
+    return result;
+
+  cg->last_id = result.back().id;
+  cg->entries_read = streamEstimateDistanceFromFirstEverEntry(s, &cg->last_id);
+  if (!opts.noack) {
+    for (const auto& rec : result) {
+      AddPending(cg, consumer, rec.id);
+    }
+  }
+  JournalGroupRead(op_args, key, opts, result);
+
+  return result;
+}
+
+OpResult<uint32_t> OpAck(const OpArgs& op_args, string_view key, string_view gname,
+                         absl::Span<streamID> ids) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, gname);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  streamCG* cg = cgr_res->second;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  uint32_t acked = 0;
+  for (streamID& id : ids) {
+    unsigned char buf[sizeof(streamID)];
+    streamEncodeID(buf, &id);
+
+    void* res = raxFind(cg->pel, buf, sizeof(buf));
+    if (res == raxNotFound)
+      continue;
+
+    streamNACK* nack = (streamNACK*)res;
+    raxRemove(cg->pel, buf, sizeof(buf), nullptr);
+    raxRemove(nack->consumer->pel, buf, sizeof(buf), nullptr);
+    streamFreeNACK(nack);
+    ++acked;
+  }
+
+  return acked;
+}
+
+OpResult<PendingSummary> OpPendingSummary(const OpArgs& op_args, string_view key,
+                                          string_view gname) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, gname);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  streamCG* cg = cgr_res->second;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  PendingSummary result;
+  result.count = raxSize(cg->pel);
+  if (result.count == 0)
+    return result;
+
+  raxIterator ri;
+  raxStart(&ri, cg->pel);
+  raxSeek(&ri, "^", nullptr, 0);
+  raxNext(&ri);
+  streamDecodeID(ri.key, &result.min_id);
+  raxSeek(&ri, "$", nullptr, 0);
+  raxNext(&ri);
+  streamDecodeID(ri.key, &result.max_id);
+  raxStop(&ri);
+
+  raxStart(&ri, cg->consumers);
+  raxSeek(&ri, "^", nullptr, 0);
+  while (raxNext(&ri)) {
+    streamConsumer* consumer = (streamConsumer*)ri.data;
+    if (uint64_t pending = raxSize(consumer->pel); pending > 0) {
+      result.consumers.emplace_back(string(reinterpret_cast<char*>(ri.key), ri.key_len), pending);
+    }
+  }
+  raxStop(&ri);
+
+  return result;
+}
+
+OpResult<vector<PendingEntry>> OpPendingRange(const OpArgs& op_args, string_view key,
+                                              const PendingOpts& opts) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, opts.group);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  streamCG* cg = cgr_res->second;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  rax* pel = cg->pel;
+  vector<PendingEntry> result;
+  if (!opts.consumer.empty()) {
+    auto* shard = op_args.shard;
+    shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.consumer.data(), opts.consumer.size());
+    streamConsumer* consumer = streamLookupConsumer(cg, shard->tmp_str1, SLC_NO_REFRESH);
+    if (consumer == nullptr)
+      return result;
+    pel = consumer->pel;
+  }
+
+  unsigned char start_key[sizeof(streamID)];
+  streamID start = opts.start, end = opts.end;
+  streamEncodeID(start_key, &start);
+  int64_t now = GetCurrentTimeMs();
+
+  raxIterator ri;
+  raxStart(&ri, pel);
+  raxSeek(&ri, ">=", start_key, sizeof(start_key));
+  while (result.size() < opts.count && raxNext(&ri)) {
+    PendingEntry entry;
+    streamDecodeID(ri.key, &entry.id);
+    if (streamCompareID(&entry.id, &end) > 0)
+      break;
+
+    streamNACK* nack = (streamNACK*)ri.data;
+    entry.idle = max<int64_t>(0, now - nack->delivery_time);
+    if (entry.idle < opts.min_idle)
+      continue;
+
+    entry.consumer.assign(nack->consumer->name, sdslen(nack->consumer->name));
+    entry.delivery_count = nack->delivery_count;
+    result.push_back(move(entry));
+  }
+  raxStop(&ri);
+
+  return result;
+}
+
+// XCLAIM, transfers the pending entries to the consumer. Returns the claimed entries, without
+// their fields for JUSTID.
+OpResult<RecordVec> OpClaim(const OpArgs& op_args, string_view key, const ClaimOpts& opts,
+                            absl::Span<streamID> ids) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, opts.group);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  auto [s, cg] = *cgr_res;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  streamID last_id = opts.last_id;
+  if (streamCompareID(&last_id, &cg->last_id) > 0)
+    cg->last_id = last_id;
+
+  int64_t now = GetCurrentTimeMs();
+  int64_t delivery_time = opts.delivery_time >= 0 ? opts.delivery_time : now;
+  streamConsumer* consumer = nullptr;
+  RecordVec result;
+
+  for (streamID& id : ids) {
+    unsigned char buf[sizeof(streamID)];
+    streamEncodeID(buf, &id);
+
+    RecordVec entry = ReadRange(s, id, id, false, 1);
+    streamNACK* nack = (streamNACK*)raxFind(cg->pel, buf, sizeof(buf));
+    if (nack == raxNotFound) {
+      if (!opts.force || entry.empty())
+        continue;
+      nack = streamCreateNACK(nullptr);
+      raxInsert(cg->pel, buf, sizeof(buf), nack, nullptr);
+    } else {
+      if (opts.min_idle > 0 && now - nack->delivery_time < opts.min_idle)
+        continue;
+
+      // The entry was deleted from the stream, so it can not be claimed anymore.
+      if (entry.empty()) {
+        raxRemove(cg->pel, buf, sizeof(buf), nullptr);
+        raxRemove(nack->consumer->pel, buf, sizeof(buf), nullptr);
+        streamFreeNACK(nack);
+        continue;
+      }
+    }
+
+    if (consumer == nullptr)
+      consumer = FindOrCreateConsumer(op_args.shard, cg, opts.consumer);
+
+    if (nack->consumer != consumer) {
+      if (nack->consumer)
+        raxRemove(nack->consumer->pel, buf, sizeof(buf), nullptr);
+      nack->consumer = consumer;
+      raxInsert(consumer->pel, buf, sizeof(buf), nack, nullptr);
+    }
+
+    nack->delivery_time = delivery_time;
+    if (opts.retry_count >= 0) {
+      nack->delivery_count = opts.retry_count;
+    } else if (!opts.justid) {
+      nack->delivery_count++;
+    }
+
+    result.push_back(opts.justid ? Record{id, {}} : move(entry.front()));
+  }
+
+  return result;
+}
+
 void CreateGroup(CmdArgList args, string_view key, ConnectionContext* cntx) {
   if (args.size() < 2)
     return (*cntx)->SendError(UnknownSubCmd("CREATE", "XGROUP"));
@@ -563,34 +1106,87 @@ void SetId(string_view key, string_view gname, CmdArgList args, ConnectionContex
   }
 }
 
+// Sends the entries as [id, [field, value, ...]] pairs, with null fields for the pending
+// entries that were deleted from the stream.
+void SendRecords(const RecordVec& records, ConnectionContext* cntx) {
+  (*cntx)->StartArray(records.size());
+  for (const auto& item : records) {
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString(StreamIdRepr(item.id));
+    if (item.kv_arr.empty()) {
+      (*cntx)->SendNullArray();
+      continue;
+    }
+
+    (*cntx)->StartArray(item.kv_arr.size() * 2);
+    for (const auto& k_v : item.kv_arr) {
+      (*cntx)->SendBulkString(k_v.first);
+      (*cntx)->SendBulkString(k_v.second);
+    }
+  }
+}
+
+// Whether the reply of the stream includes it even if it has no entries. XREADGROUP always
+// replies with the history of the consumer.
+inline bool AlwaysReplied(const ReadId& id, bool read_group) {
+  return read_group && !id.undelivered;
+}
+
 }  // namespace
 
+void StreamFamily::XAck(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view gname = ArgS(args, 2);
+  args.remove_prefix(3);
+
+  absl::InlinedVector<streamID, 8> ids(args.size());
+  for (size_t i = 0; i < args.size(); ++i) {
+    ParsedStreamId parsed_id;
+    if (!ParseID(ArgS(args, i), true, 0, &parsed_id)) {
+      return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+    }
+    ids[i] = parsed_id.val;
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAck(t->GetOpArgs(shard), key, gname, absl::Span{ids.data(), ids.size()});
+  };
+
+  OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result) {
+    return (*cntx)->SendLong(*result);
+  }
+
+  switch (result.status()) {
+    case OpStatus::KEY_NOTFOUND:
+    case OpStatus::SKIPPED:
+      return (*cntx)->SendLong(0);
+    default:
+      return (*cntx)->SendError(result.status());
+  }
+}
+
 void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
-  unsigned id_indx = 2;
+  size_t id_indx = 2;
   AddOpts add_opts;
 
   for (; id_indx < args.size(); ++id_indx) {
     ToUpper(&args[id_indx]);
     string_view arg = ArgS(args, id_indx);
-    if (arg == "MAXLEN") {
-      if (id_indx + 2 >= args.size()) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
-      ++id_indx;
-      if (ArgS(args, id_indx) == "~") {
-        add_opts.max_limit_approx = true;
-        ++id_indx;
-      }
-      arg = ArgS(args, id_indx);
-      if (!absl::SimpleAtoi(arg, &add_opts.max_limit)) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
-    } else {
+    if (!IsTrimOption(arg))
       break;
+
+    OpStatus status = ParseTrimOption(args, &id_indx, &add_opts.trim_opts);
+    if (status != OpStatus::OK) {
+      return (*cntx)->SendError(status);
     }
   }
 
+  if (add_opts.trim_opts.limit >= 0 && !add_opts.trim_opts.approx) {
+    return (*cntx)->SendError("syntax error, LIMIT cannot be used without the special ~ option");
+  }
+
   args.remove_prefix(id_indx);
   if (args.size() < 3 || args.size() % 2 == 0) {
     return (*cntx)->SendError(WrongNumArgsError("XADD"), kSyntaxErrType);
@@ -621,6 +1217,83 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(add_result.status());
 }
 
+void StreamFamily::XClaim(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  ClaimOpts opts;
+  opts.group = ArgS(args, 2);
+  opts.consumer = ArgS(args, 3);
+
+  if (!absl::SimpleAtoi(ArgS(args, 4), &opts.min_idle)) {
+    return (*cntx)->SendError("Invalid min-idle-time argument for XCLAIM");
+  }
+  opts.min_idle = max<int64_t>(opts.min_idle, 0);
+
+  // The IDs come first, the options after them.
+  absl::InlinedVector<streamID, 8> ids;
+  size_t i = 5;
+  for (; i < args.size(); ++i) {
+    ParsedStreamId parsed_id;
+    if (!ParseID(ArgS(args, i), true, 0, &parsed_id))
+      break;
+    ids.push_back(parsed_id.val);
+  }
+  if (ids.empty()) {
+    return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+  }
+
+  int64_t now = GetCurrentTimeMs();
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    bool has_value = i + 1 < args.size();
+    if (arg == "FORCE") {
+      opts.force = true;
+    } else if (arg == "JUSTID") {
+      opts.justid = true;
+    } else if (arg == "IDLE" && has_value) {
+      int64_t idle;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &idle))
+        return (*cntx)->SendError(kInvalidIntErr);
+      opts.delivery_time = now - idle;
+    } else if (arg == "TIME" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.delivery_time))
+        return (*cntx)->SendError(kInvalidIntErr);
+    } else if (arg == "RETRYCOUNT" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.retry_count))
+        return (*cntx)->SendError(kInvalidIntErr);
+    } else if (arg == "LASTID" && has_value) {
+      ParsedStreamId parsed_id;
+      if (!ParseID(ArgS(args, ++i), true, 0, &parsed_id))
+        return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+      opts.last_id = parsed_id.val;
+    } else {
+      return (*cntx)->SendError(absl::StrCat("Unrecognized XCLAIM option '", arg, "'"));
+    }
+  }
+  // Delivery times in the future would make the entries idle only later.
+  opts.delivery_time = min(opts.delivery_time, now);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpClaim(t->GetOpArgs(shard), key, opts, absl::Span{ids.data(), ids.size()});
+  };
+
+  OpResult<RecordVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    if (result.status() == OpStatus::KEY_NOTFOUND || result.status() == OpStatus::SKIPPED)
+      return (*cntx)->SendError(NoGroupOrKeyError(key, opts.group));
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (!opts.justid) {
+    return SendRecords(*result, cntx);
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& item : *result) {
+    (*cntx)->SendBulkString(StreamIdRepr(item.id));
+  }
+}
+
 void StreamFamily::XDel(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   args.remove_prefix(2);
@@ -756,10 +1429,111 @@ void StreamFamily::XLen(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(result.status());
 }
 
+void StreamFamily::XPending(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  PendingOpts opts;
+  opts.group = ArgS(args, 2);
+
+  if (args.size() == 3) {
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      return OpPendingSummary(t->GetOpArgs(shard), key, opts.group);
+    };
+
+    OpResult<PendingSummary> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+    if (!result) {
+      if (result.status() == OpStatus::KEY_NOTFOUND || result.status() == OpStatus::SKIPPED)
+        return (*cntx)->SendError(NoGroupOrKeyError(key, opts.group));
+      return (*cntx)->SendError(result.status());
+    }
+
+    (*cntx)->StartArray(4);
+    (*cntx)->SendLong(result->count);
+    if (result->count == 0) {
+      (*cntx)->SendNull();
+      (*cntx)->SendNull();
+      return (*cntx)->SendNullArray();
+    }
+
+    (*cntx)->SendBulkString(StreamIdRepr(result->min_id));
+    (*cntx)->SendBulkString(StreamIdRepr(result->max_id));
+    (*cntx)->StartArray(result->consumers.size());
+    for (const auto& [name, pending] : result->consumers) {
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(name);
+      (*cntx)->SendBulkString(absl::StrCat(pending));
+    }
+    return;
+  }
+
+  // XPENDING key group [IDLE min-idle-time] start end count [consumer]
+  size_t i = 3;
+  ToUpper(&args[i]);
+  if (ArgS(args, i) == "IDLE" && args.size() > 5) {
+    if (!absl::SimpleAtoi(ArgS(args, i + 1), &opts.min_idle)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+    i += 2;
+  }
+
+  if (args.size() - i != 3 && args.size() - i != 4) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  RangeId rs, re;
+  if (!ParseRangeId(ArgS(args, i), &rs) || !ParseRangeId(ArgS(args, i + 1), &re)) {
+    return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+  }
+  if (rs.exclude && streamIncrID(&rs.parsed_id.val) != C_OK) {
+    return (*cntx)->SendError("invalid start ID for the interval", kSyntaxErrType);
+  }
+  if (re.exclude && streamDecrID(&re.parsed_id.val) != C_OK) {
+    return (*cntx)->SendError("invalid end ID for the interval", kSyntaxErrType);
+  }
+  opts.start = rs.parsed_id.val;
+  opts.end = re.parsed_id.val;
+
+  int64_t count;
+  if (!absl::SimpleAtoi(ArgS(args, i + 2), &count)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  opts.count = clamp<int64_t>(count, 0, kuint32max);
+  if (args.size() - i == 4) {
+    opts.consumer = ArgS(args, i + 3);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpPendingRange(t->GetOpArgs(shard), key, opts);
+  };
+
+  OpResult<vector<PendingEntry>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    if (result.status() == OpStatus::KEY_NOTFOUND || result.status() == OpStatus::SKIPPED)
+      return (*cntx)->SendError(NoGroupOrKeyError(key, opts.group));
+    return (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& entry : *result) {
+    (*cntx)->StartArray(4);
+    (*cntx)->SendBulkString(StreamIdRepr(entry.id));
+    (*cntx)->SendBulkString(entry.consumer);
+    (*cntx)->SendLong(entry.idle);
+    (*cntx)->SendLong(entry.delivery_count);
+  }
+}
+
 void StreamFamily::XRange(CmdArgList args, ConnectionContext* cntx) {
   XRangeGeneric(std::move(args), false, cntx);
 }
 
+void StreamFamily::XRead(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), false, cntx);
+}
+
+void StreamFamily::XReadGroup(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), true, cntx);
+}
+
 void StreamFamily::XRevRange(CmdArgList args, ConnectionContext* cntx) {
   XRangeGeneric(std::move(args), true, cntx);
 }
@@ -791,6 +1565,41 @@ void StreamFamily::XSetId(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void StreamFamily::XTrim(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  TrimOpts trim_opts;
+
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (!IsTrimOption(ArgS(args, i))) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    OpStatus status = ParseTrimOption(args, &i, &trim_opts);
+    if (status != OpStatus::OK) {
+      return (*cntx)->SendError(status);
+    }
+  }
+
+  if (trim_opts.strategy == TRIM_STRATEGY_NONE) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+  if (trim_opts.limit >= 0 && !trim_opts.approx) {
+    return (*cntx)->SendError("syntax error, LIMIT cannot be used without the special ~ option");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpTrim(t->GetOpArgs(shard), key, trim_opts);
+  };
+
+  OpResult<int64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result || result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendLong(result.value_or(0));
+  }
+
+  return (*cntx)->SendError(result.status());
+}
+
 void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view start = ArgS(args, 2);
@@ -826,6 +1635,25 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   range_opts.end = re.parsed_id;
   range_opts.is_rev = is_rev;
 
+  // Scripts read the reply item by item, otherwise it is serialized in the shard.
+  if (!cntx->conn_state.script_info) {
+    bool resp3 = (*cntx)->IsResp3();
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      return OpRangeSerialized(t->GetOpArgs(shard), key, range_opts, resp3);
+    };
+
+    OpResult<SerializedRange> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+    if (result) {
+      (*cntx)->StartArray(result->count);
+      return (*cntx)->SendRaw(result->body);
+    }
+
+    if (result.status() == OpStatus::KEY_NOTFOUND) {
+      return (*cntx)->SendEmptyArray();
+    }
+    return (*cntx)->SendError(result.status());
+  }
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
     return OpRange(t->GetOpArgs(shard), key, range_opts);
   };
@@ -833,17 +1661,7 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   OpResult<RecordVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
 
   if (result) {
-    (*cntx)->StartArray(result->size());
-    for (const auto& item : *result) {
-      (*cntx)->StartArray(2);
-      (*cntx)->SendBulkString(StreamIdRepr(item.id));
-      (*cntx)->StartArray(item.kv_arr.size() * 2);
-      for (const auto& k_v : item.kv_arr) {
-        (*cntx)->SendBulkString(k_v.first);
-        (*cntx)->SendBulkString(k_v.second);
-      }
-    }
-    return;
+    return SendRecords(*result, cntx);
   }
 
   if (result.status() == OpStatus::KEY_NOTFOUND) {
@@ -852,19 +1670,187 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   return (*cntx)->SendError(result.status());
 }
 
+// X<READ|READGROUP> [GROUP group consumer] [COUNT count] [BLOCK ms] [NOACK] STREAMS key ... id ...
+void StreamFamily::XReadGeneric(CmdArgList args, bool read_group, ConnectionContext* cntx) {
+  ReadOpts opts;
+  size_t i = 1;
+  if (read_group) {
+    ToUpper(&args[1]);
+    if (ArgS(args, 1) != "GROUP") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    opts.group = ArgS(args, 2);
+    opts.consumer = ArgS(args, 3);
+    i = 4;
+  }
+
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    bool has_value = i + 1 < args.size();
+    if (arg == "STREAMS") {
+      break;
+    } else if (arg == "COUNT" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.count)) {
+        return (*cntx)->SendError(kInvalidIntErr);
+      }
+      if (opts.count == 0)
+        opts.count = kuint32max;
+    } else if (arg == "BLOCK" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.timeout_ms) || opts.timeout_ms < 0) {
+        return (*cntx)->SendError("timeout is not an integer or out of range");
+      }
+    } else if (arg == "NOACK" && read_group) {
+      opts.noack = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  // DetermineKeys verified that the keys and the IDs follow STREAMS.
+  DCHECK_LT(i, args.size());
+  size_t num_streams = (args.size() - i - 1) / 2;
+  opts.streams_arg = i + 1;
+  opts.ids.resize(num_streams);
+
+  bool can_block = opts.timeout_ms >= 0 && !cntx->transaction->IsMulti();
+  for (size_t k = 0; k < num_streams; ++k) {
+    string_view id = ArgS(args, opts.streams_arg + num_streams + k);
+    ReadId& read_id = opts.ids[k];
+    if (id == "$" && !read_group) {
+      read_id.last = true;
+    } else if (id == ">" && read_group) {
+      read_id.undelivered = true;
+    } else {
+      ParsedStreamId parsed_id;
+      if (!ParseID(id, true, 0, &parsed_id)) {
+        return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+      }
+      read_id.val = parsed_id.val;
+
+      // The history of the consumer is returned right away.
+      can_block &= !read_group;
+    }
+  }
+
+  vector<OpResult<RecordVec>> results(num_streams, OpStatus::KEY_NOTFOUND);
+  auto read_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    ArgSlice keys = t->ShardArgsInShard(sid);
+    for (size_t j = 0; j < keys.size(); ++j) {
+      // The transaction arguments do not include the command name.
+      size_t pos = t->ReverseArgIndex(sid, j) + 1 - opts.streams_arg;
+      if (read_group) {
+        results[pos] = OpReadGroup(t->GetOpArgs(shard), keys[j], opts, opts.ids[pos]);
+      } else {
+        results[pos] = OpRead(t->GetOpArgs(shard), keys[j], opts.count, &opts.ids[pos]);
+      }
+    }
+    return OpStatus::OK;
+  };
+
+  // Returns the position of the first failed read, or num_streams. Sets has_entries if there is
+  // anything to reply with.
+  bool has_entries = false;
+  auto check_results = [&] {
+    has_entries = false;
+    for (size_t k = 0; k < num_streams; ++k) {
+      const auto& res = results[k];
+      if (res) {
+        has_entries |= !res->empty() || AlwaysReplied(opts.ids[k], read_group);
+      } else if (read_group || res.status() != OpStatus::KEY_NOTFOUND) {
+        return k;
+      }
+    }
+    return num_streams;
+  };
+
+  auto send_reply = [&] {
+    size_t failed = check_results();
+    if (failed < num_streams) {
+      OpStatus status = results[failed].status();
+      if (status == OpStatus::KEY_NOTFOUND || status == OpStatus::SKIPPED) {
+        string_view key = ArgS(args, opts.streams_arg + failed);
+        return (*cntx)->SendError(
+            NoGroupOrKeyError(key, opts.group, " in XREADGROUP with GROUP option"));
+      }
+      return (*cntx)->SendError(status);
+    }
+
+    if (!has_entries) {
+      return (*cntx)->SendNullArray();
+    }
+
+    size_t num_replied = 0;
+    for (size_t k = 0; k < num_streams; ++k) {
+      num_replied += results[k] && (!results[k]->empty() || AlwaysReplied(opts.ids[k], read_group));
+    }
+
+    (*cntx)->StartArray(num_replied);
+    for (size_t k = 0; k < num_streams; ++k) {
+      if (!results[k] || (results[k]->empty() && !AlwaysReplied(opts.ids[k], read_group)))
+        continue;
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(ArgS(args, opts.streams_arg + k));
+      SendRecords(*results[k], cntx);
+    }
+  };
+
+  Transaction* trans = cntx->transaction;
+  if (!can_block) {
+    trans->ScheduleSingleHop(std::move(read_cb));
+    return send_reply();
+  }
+
+  // The first hop reads what is there already, and resolves "$" for the reads after the wait.
+  trans->Schedule();
+  trans->Execute(read_cb, false);
+  if (check_results() < num_streams || has_entries) {
+    trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+    return send_reply();
+  }
+
+  using time_point = Transaction::time_point;
+  time_point tp = opts.timeout_ms
+                      ? chrono::steady_clock::now() + chrono::milliseconds(opts.timeout_ms)
+                      : time_point::max();
+
+  auto* stats = ServerState::tl_connection_stats();
+  ++stats->num_blocked_clients;
+  bool wait_succeeded = trans->WaitOnWatch(tp);
+  --stats->num_blocked_clients;
+
+  if (!wait_succeeded) {
+    return (*cntx)->SendNullArray();
+  }
+
+  // XADD awakes all the readers of the stream, a group reader may find that the other consumers
+  // of its group got the new entries.
+  trans->Execute(std::move(read_cb), true);
+  send_reply();
+}
+
 #define HFUNC(x) SetHandler(&StreamFamily::x)
 
 void StreamFamily::Register(CommandRegistry* registry) {
   using CI = CommandId;
 
-  *registry << CI{"XADD", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(XAdd)
+  *registry << CI{"XACK", CO::WRITE | CO::FAST, -4, 1, 1, 1}.HFUNC(XAck)
+            << CI{"XADD", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(XAdd)
+            << CI{"XCLAIM", CO::WRITE | CO::FAST, -6, 1, 1, 1}.HFUNC(XClaim)
             << CI{"XDEL", CO::WRITE | CO::FAST, -3, 1, 1, 1}.HFUNC(XDel)
             << CI{"XGROUP", CO::WRITE | CO::DENYOOM, -2, 2, 2, 1}.HFUNC(XGroup)
             << CI{"XINFO", CO::READONLY | CO::NOSCRIPT, -2, 0, 0, 0}.HFUNC(XInfo)
             << CI{"XLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(XLen)
+            << CI{"XPENDING", CO::READONLY, -3, 1, 1, 1}.HFUNC(XPending)
             << CI{"XRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRange)
+            << CI{"XREAD", CO::READONLY | CO::NOSCRIPT | CO::BLOCKING, -4, 3, 3, 1}.HFUNC(XRead)
+            << CI{"XREADGROUP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::NO_AUTOJOURNAL, -7,
+                  6, 6, 1}
+                   .HFUNC(XReadGroup)
             << CI{"XREVRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRevRange)
-            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId);
+            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId)
+            << CI{"XTRIM", CO::WRITE | CO::FAST, -4, 1, 1, 1}.HFUNC(XTrim);
 }
 
 }  // namespace dfly
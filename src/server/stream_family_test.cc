@@ -84,4 +84,163 @@ TEST_F(StreamFamilyTest, Range) {
   EXPECT_THAT(sub1, ElementsAre("1-0", ArrLen(2)));
 }
 
+TEST_F(StreamFamilyTest, RangeCount) {
+  // Spans several stream nodes, with entries that differ from the master fields.
+  for (unsigned i = 1; i <= 300; ++i) {
+    if (i % 3 == 0) {
+      Run({"xadd", "s", absl::StrCat(i, "-0"), "g", absl::StrCat(i), "h", "v"});
+    } else {
+      Run({"xadd", "s", absl::StrCat(i, "-0"), "f", absl::StrCat("v", i)});
+    }
+  }
+
+  auto resp = Run({"xrange", "s", "-", "+", "count", "250"});
+  ASSERT_THAT(resp, ArrLen(250));
+  auto records = resp.GetVec();
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("1-0", ArrLen(2)));
+  EXPECT_THAT(records[0].GetVec()[1].GetVec(), ElementsAre("f", "v1"));
+  EXPECT_THAT(records[149].GetVec()[1].GetVec(), ElementsAre("g", "150", "h", "v"));
+  EXPECT_THAT(records[249].GetVec(), ElementsAre("250-0", ArrLen(2)));
+
+  resp = Run({"xrevrange", "s", "(298-0", "+", "count", "5"});
+  records = resp.GetVec();
+  ASSERT_THAT(records, ElementsAre(ArrLen(2), ArrLen(2)));
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("300-0", ArrLen(4)));
+  EXPECT_THAT(records[1].GetVec()[1].GetVec(), ElementsAre("f", "v299"));
+
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "0"}), ArrLen(0));
+
+  // More fields than fit on the stack of the append.
+  vector<string> args = {"xadd", "wide", "*"};
+  for (unsigned i = 0; i < 20; ++i) {
+    args.push_back(absl::StrCat("f", i));
+    args.push_back(absl::StrCat("v", i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  Run(absl::MakeSpan(sv_args));
+  resp = Run({"xrange", "wide", "-", "+"});
+  ASSERT_THAT(resp, ArrLen(2));
+  auto kv = resp.GetVec()[1].GetVec();
+  ASSERT_EQ(40u, kv.size());
+  EXPECT_EQ("f19", kv[38]);
+  EXPECT_EQ("v19", kv[39]);
+}
+
+TEST_F(StreamFamilyTest, Trim) {
+  for (unsigned i = 1; i <= 5; ++i) {
+    Run({"xadd", "s", absl::StrCat(i, "-0"), "f", "v"});
+  }
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "3"}), IntArg(2));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "=", "5"}), IntArg(2));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(1));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "0"}), IntArg(0));
+  EXPECT_THAT(Run({"xtrim", "none", "maxlen", "0"}), IntArg(0));
+
+  EXPECT_EQ(Run({"xadd", "s", "minid", "10", "10-0", "f", "v"}), "10-0");
+  EXPECT_THAT(Run({"xrange", "s", "-", "+"}), ElementsAre("10-0", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xtrim", "s", "limit", "10", "maxlen", "0"}), ErrArg("LIMIT cannot be used"));
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "1", "minid", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"xtrim", "s", "limit", "1"}), ErrArg("syntax error"));
+
+  // A stream node holds 100 entries, so approximate trimming drops the first two nodes.
+  Run({"del", "s"});
+  for (unsigned i = 1; i <= 1000; ++i) {
+    Run({"xadd", "s", absl::StrCat(i, "-0"), "f", "v"});
+  }
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "~", "250"}), IntArg(200));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "250"}), IntArg(49));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(751));
+  // The third node has 51 entries left, which still fits the limit.
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "~", "0", "limit", "100"}), IntArg(51));
+}
+
+TEST_F(StreamFamilyTest, Read) {
+  Run({"xadd", "s1", "1-0", "f", "v1"});
+  Run({"xadd", "s1", "2-0", "f", "v2"});
+  Run({"xadd", "s2", "5-0", "f", "v3"});
+
+  auto resp = Run({"xread", "streams", "s1", "s2", "0", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  auto streams = resp.GetVec();
+  EXPECT_THAT(streams[0].GetVec(), ElementsAre("s1", ArrLen(2)));
+  EXPECT_THAT(streams[1].GetVec(), ElementsAre("s2", ArrLen(1)));
+
+  // s2 has nothing after 5-0 and is left out of the reply.
+  resp = Run({"xread", "count", "1", "streams", "s1", "s2", "1-0", "5-0"});
+  ASSERT_THAT(resp.GetVec(), ElementsAre("s1", ArrLen(1)));
+  auto records = resp.GetVec()[1].GetVec();
+  EXPECT_THAT(records, ElementsAre(ArrLen(2)));
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xread", "streams", "s1", "none", "$", "0"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"xread", "streams", "s1"}), ErrArg("syntax error"));
+}
+
+TEST_F(StreamFamilyTest, ReadBlocking) {
+  Run({"xadd", "s1", "1-0", "f", "v1"});
+  EXPECT_THAT(Run({"xread", "block", "10", "streams", "s1", "$"}),
+              ArgType(RespExpr::NIL_ARRAY));
+
+  RespExpr resp0, resp1;
+  auto fb0 = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp0 = Run({"xread", "block", "0", "streams", "s1", "$"});
+  });
+  auto fb1 = pp_->at(2)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp1 = Run("B2", {"xread", "block", "0", "streams", "s2", "s1", "$", "$"});
+  });
+
+  WaitUntilLocked(0, "s1");
+  this_fiber::sleep_for(30ms);
+  pp_->at(1)->Await([&] { Run("B1", {"xadd", "s1", "2-0", "f", "v2"}); });
+  fb0.join();
+  fb1.join();
+
+  // Both readers are woken by a single entry.
+  for (const auto& resp : {resp0, resp1}) {
+    auto stream = resp.GetVec();
+    ASSERT_THAT(stream, ElementsAre("s1", ArrLen(1)));
+    EXPECT_THAT(stream[1].GetVec()[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+  }
+}
+
+TEST_F(StreamFamilyTest, ReadGroup) {
+  Run({"xadd", "s", "1-0", "f", "v1"});
+  Run({"xadd", "s", "2-0", "f", "v2"});
+  EXPECT_EQ(Run({"xgroup", "create", "s", "g", "0"}), "OK");
+
+  auto resp = Run({"xreadgroup", "group", "g", "alice", "count", "1", "streams", "s", ">"});
+  ASSERT_THAT(resp.GetVec(), ElementsAre("s", ArrLen(1)));
+  auto records = resp.GetVec()[1].GetVec();
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("1-0", ArrLen(2)));
+
+  resp = Run({"xreadgroup", "group", "g", "bob", "streams", "s", ">"});
+  records = resp.GetVec()[1].GetVec();
+  EXPECT_THAT(records, ElementsAre(ArrLen(2)));
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "bob", "streams", "s", ">"}),
+              ArgType(RespExpr::NIL_ARRAY));
+
+  // The history of a consumer holds its pending entries.
+  resp = Run({"xreadgroup", "group", "g", "alice", "streams", "s", "0"});
+  records = resp.GetVec()[1].GetVec();
+  EXPECT_THAT(records, ElementsAre(ArrLen(2)));
+  EXPECT_THAT(records[0].GetVec(), ElementsAre("1-0", ArrLen(2)));
+
+  resp = Run({"xpending", "s", "g"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), "1-0", "2-0", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xack", "s", "g", "1-0", "3-0"}), IntArg(1));
+  resp = Run({"xpending", "s", "g", "-", "+", "10"});
+  ASSERT_THAT(resp, ArrLen(4));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("2-0", "bob", _, IntArg(1)));
+
+  EXPECT_EQ(Run({"xclaim", "s", "g", "alice", "0", "2-0", "justid"}), "2-0");
+  resp = Run({"xpending", "s", "g", "-", "+", "10", "alice"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("2-0", "alice", _, IntArg(1)));
+
+  EXPECT_THAT(Run({"xreadgroup", "group", "nogroup", "bob", "streams", "s", ">"}),
+              ErrArg("No such key"));
+}
+
 }  // namespace dfly
@@ -13,6 +13,7 @@ extern "C" {
 
 #include <chrono>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "redis/util.h"
 #include "server/command_registry.h"
@@ -20,11 +21,20 @@ extern "C" {
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/io_mgr.h"
-#include "server/journal/journal.h"
+#include "server/keyspace_events.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "util/varz.h"
 
+ABSL_FLAG(uint32_t, get_zero_copy_min_size, 0,
+          "If positive, GET replies with values of at least this size are sent directly from "
+          "the stored value while the key stays pinned, instead of copying the value first. "
+          "Writers of the key wait until the reply is sent. 0 disables it");
+ABSL_FLAG(bool, mget_non_atomic, false,
+          "If true, an MGET of keys on multiple shards reads the shards concurrently without "
+          "scheduling a transaction, unless its keys are locked. Such an MGET may observe a part "
+          "of the writes of a concurrent multi-key transaction only");
+
 namespace dfly {
 
 namespace {
@@ -34,6 +44,7 @@ using namespace facade;
 using namespace double_conversion;
 
 using CI = CommandId;
+using absl::GetFlag;
 DEFINE_VARZ(VarzQps, set_qps);
 DEFINE_VARZ(VarzQps, get_qps);
 
@@ -64,13 +75,6 @@ string_view GetSlice(EngineShard* shard, const PrimeValue& pv, string* tmp) {
   return pv.GetSlice(tmp);
 }
 
-inline void RecordJournal(const OpArgs& op_args, string_view key, const PrimeKey& pvalue) {
-  if (op_args.shard->journal()) {
-    journal::Entry entry{op_args.db_cntx.db_index, op_args.txid, key, pvalue};
-    op_args.shard->journal()->RecordEntry(entry);
-  }
-}
-
 OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t start,
                               string_view value) {
   auto& db_slice = op_args.shard->db_slice();
@@ -87,25 +91,23 @@ OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t sta
 
   auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
 
-  string s;
-
-  if (added) {
-    s.resize(range_len);
-  } else {
+  if (!added) {
     if (it->second.ObjType() != OBJ_STRING)
       return OpStatus::WRONG_TYPE;
 
-    s = GetString(op_args.shard, it->second);
-    if (s.size() < range_len)
-      s.resize(range_len);
+    // PreUpdate drops an offloaded value, so it is read back first.
+    string external;
+    if (it->second.IsExternal())
+      external = GetString(op_args.shard, it->second);
 
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    if (!external.empty())
+      it->second.SetString(external);
   }
 
-  memcpy(s.data() + start, value.data(), value.size());
-  it->second.SetString(s);
+  // Large values are updated in place rather than copied.
+  it->second.SetRange(start, value);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
-  RecordJournal(op_args, key, it->second);
 
   return it->second.Size();
 }
@@ -136,27 +138,44 @@ OpResult<string> OpGetRange(const OpArgs& op_args, string_view key, int32_t star
   if (size_t(end) >= strlen)
     end = strlen - 1;
 
-  string tmp;
-  string_view slice = GetSlice(op_args.shard, co, &tmp);
+  size_t len = end - start + 1;
+
+  // Reads only the range of an offloaded value.
+  if (co.IsExternal()) {
+    auto [offset, size] = co.GetExternalPtr();
+    string res(len, '\0');
+    error_code ec = op_args.shard->tiered_storage()->Read(offset + start, len, res.data());
+    CHECK(!ec) << "TBD: " << ec;
+    return res;
+  }
 
-  return string(slice.substr(start, end - start + 1));
+  string tmp;
+  return string(co.GetSlice(start, len, &tmp));
 };
 
 size_t ExtendExisting(const OpArgs& op_args, PrimeIterator it, string_view key, string_view val,
                       bool prepend) {
-  string tmp, new_val;
   auto* shard = op_args.shard;
+  auto& db_slice = shard->db_slice();
+
+  // Appends to large values take amortized constant time, see CompactObj::SetRange.
+  if (!prepend && !it->second.IsExternal()) {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    it->second.AppendString(val);
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
+    return it->second.Size();
+  }
+
+  string tmp, new_val;
   string_view slice = GetSlice(shard, it->second, &tmp);
   if (prepend)
     new_val = absl::StrCat(val, slice);
   else
     new_val = absl::StrCat(slice, val);
 
-  auto& db_slice = shard->db_slice();
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   it->second.SetString(new_val);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
-  RecordJournal(op_args, key, it->second);
 
   return new_val.size();
 }
@@ -170,7 +189,6 @@ OpResult<uint32_t> ExtendOrSet(const OpArgs& op_args, string_view key, string_vi
   if (inserted) {
     it->second.SetString(val);
     db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
-    RecordJournal(op_args, key, it->second);
 
     return val.size();
   }
@@ -193,8 +211,7 @@ OpResult<bool> ExtendOrSkip(const OpArgs& op_args, string_view key, string_view
 
 OpResult<string> OpGet(const OpArgs& op_args, string_view key, bool del_hit = false,
                        const DbSlice::ExpireParams& exp_params = {}) {
-  /*Get primeIterator and ExpireIterator at the same time*/
-  auto [it, it_expire] = op_args.shard->db_slice().FindExt(op_args.db_cntx, key);
+  PrimeIterator it = op_args.shard->db_slice().FindExt(op_args.db_cntx, key);
 
   if (!IsValid(it))
     return OpStatus::KEY_NOTFOUND;
@@ -221,7 +238,7 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, bool del_hit = fa
   if (exp_params.IsDefined()) {
     DVLOG(1) << "Expire: " << key;
     auto& db_slice = op_args.shard->db_slice();
-    OpStatus status = db_slice.UpdateExpire(op_args.db_cntx, it, it_expire, exp_params);
+    OpStatus status = db_slice.UpdateExpire(op_args.db_cntx, it, exp_params);
     if (status != OpStatus::OK)
       return status;
   }
@@ -239,7 +256,6 @@ OpResult<double> OpIncrFloat(const OpArgs& op_args, string_view key, double val)
     char* str = RedisReplyBuilder::FormatDouble(val, buf, sizeof(buf));
     it->second.SetString(str);
     db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
-    RecordJournal(op_args, key, it->second);
 
     return val;
   }
@@ -271,18 +287,46 @@ OpResult<double> OpIncrFloat(const OpArgs& op_args, string_view key, double val)
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   it->second.SetString(str);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
-  RecordJournal(op_args, key, it->second);
 
   return base;
 }
 
+OpResult<int64_t> IncrExisting(const OpArgs& op_args, PrimeIterator it, string_view key,
+                               int64_t incr) {
+  if (it->second.ObjType() != OBJ_STRING) {
+    return OpStatus::WRONG_TYPE;
+  }
+
+  auto opt_prev = it->second.TryGetInt();
+  if (!opt_prev) {
+    return OpStatus::INVALID_VALUE;
+  }
+
+  long long prev = *opt_prev;
+  if ((incr < 0 && prev < 0 && incr < (LLONG_MIN - prev)) ||
+      (incr > 0 && prev > 0 && incr > (LLONG_MAX - prev))) {
+    return OpStatus::OUT_OF_RANGE;
+  }
+
+  int64_t new_val = prev + incr;
+  DCHECK(!it->second.IsExternal());
+
+  // Integers are updated in place.
+  auto& db_slice = op_args.shard->db_slice();
+  db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  it->second.SetInt(new_val);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
+
+  return new_val;
+}
+
 // if skip_on_missing - returns KEY_NOTFOUND.
 OpResult<int64_t> OpIncrBy(const OpArgs& op_args, string_view key, int64_t incr,
                            bool skip_on_missing) {
   auto& db_slice = op_args.shard->db_slice();
 
   // we avoid using AddOrFind because of skip_on_missing option for memcache.
-  auto [it, expire_it] = db_slice.FindExt(op_args.db_cntx, key);
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
 
   if (!IsValid(it)) {
     if (skip_on_missing)
@@ -298,34 +342,41 @@ OpResult<int64_t> OpIncrBy(const OpArgs& op_args, string_view key, int64_t incr,
       return OpStatus::OUT_OF_MEMORY;
     }
 
-    RecordJournal(op_args, key, it->second);
-
     return incr;
   }
 
-  if (it->second.ObjType() != OBJ_STRING) {
-    return OpStatus::WRONG_TYPE;
-  }
+  return IncrExisting(op_args, it, key, incr);
+}
 
-  auto opt_prev = it->second.TryGetInt();
-  if (!opt_prev) {
-    return OpStatus::INVALID_VALUE;
-  }
+// args are the (key, delta) pairs of the shard. Returns the result of every pair.
+vector<OpResult<int64_t>> OpMIncrBy(const OpArgs& op_args, ArgSlice args) {
+  DCHECK(!args.empty() && args.size() % 2 == 0);
 
-  long long prev = *opt_prev;
-  if ((incr < 0 && prev < 0 && incr < (LLONG_MIN - prev)) ||
-      (incr > 0 && prev > 0 && incr > (LLONG_MAX - prev))) {
-    return OpStatus::OUT_OF_RANGE;
+  size_t num_keys = args.size() / 2;
+  vector<string_view> keys(num_keys);
+  vector<int64_t> deltas(num_keys);
+  for (size_t i = 0; i < num_keys; ++i) {
+    keys[i] = args[2 * i];
+    CHECK(absl::SimpleAtoi(args[2 * i + 1], &deltas[i]));  // validated by MIncrBy.
   }
 
-  int64_t new_val = prev + incr;
-  DCHECK(!it->second.IsExternal());
-  db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  it->second.SetInt(new_val);
-  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
-  RecordJournal(op_args, key, it->second);
+  // The lookups of the batch are prefetched together. Adding keys invalidates the iterators,
+  // so the missing keys are added only after the existing ones are updated.
+  auto& db_slice = op_args.shard->db_slice();
+  vector<OpResult<int64_t>> res(num_keys);
+  vector<unsigned> missing;
+  db_slice.FindMany(op_args.db_cntx, keys, [&](unsigned i, PrimeIterator it) {
+    if (IsValid(it))
+      res[i] = IncrExisting(op_args, it, keys[i], deltas[i]);
+    else
+      missing.push_back(i);
+  });
 
-  return new_val;
+  for (unsigned i : missing) {
+    res[i] = OpIncrBy(op_args, keys[i], deltas[i], false);
+  }
+
+  return res;
 }
 
 int64_t CalculateAbsTime(int64_t unix_time, bool as_milli) {
@@ -370,6 +421,298 @@ OpResult<void> SetGeneric(ConnectionContext* cntx, const SetCmd::SetParams& spar
   return cntx->transaction->ScheduleSingleHop(std::move(cb));
 }
 
+
+using MP = MemcacheParser;
+
+// The fields of an item that the meta commands may return.
+struct MetaItem {
+  string value;
+  uint32_t mc_flag = 0;
+  uint64_t cas = 0;
+  int64_t ttl = -1;  // in seconds, -1 if the item does not expire.
+  uint8_t mc_state = 0;
+  bool win = false;  // the client got the win token and should recache the item.
+};
+
+void FillMetaItem(const OpArgs& op_args, PrimeIterator it, MetaItem* item) {
+  auto& db_slice = op_args.shard->db_slice();
+  item->mc_flag = db_slice.GetMCFlag(op_args.db_cntx.db_index, it->first);
+  item->cas = it.GetVersion();
+
+  if (!it->second.HasExpire())
+    return;
+
+  int64_t ttl_ms = db_slice.ExpireTime(it) - op_args.db_cntx.time_now_ms;
+  item->ttl = std::max<int64_t>(ttl_ms / 1000, 0);
+}
+
+// Sets the TTL of the item in seconds, 0 removes the expiry.
+void SetMetaTtl(const OpArgs& op_args, PrimeIterator it, int64_t ttl) {
+  auto& db_slice = op_args.shard->db_slice();
+  if (ttl == 0) {
+    db_slice.UpdateExpire(op_args.db_cntx.db_index, it, 0);
+    return;
+  }
+
+  DbSlice::ExpireParams params;
+  params.value = ttl;
+  db_slice.UpdateExpire(op_args.db_cntx, it, params);
+}
+
+// Formats the return flags of a meta command reply.
+string MetaReplyFlags(const MP::Command& cmd, const MetaItem& item) {
+  const MP::MetaFlags& meta = cmd.meta;
+  string res;
+
+  if (meta.return_flags)
+    absl::StrAppend(&res, " f", item.mc_flag);
+  if (meta.return_ttl)
+    absl::StrAppend(&res, " t", item.ttl);
+  if (meta.return_cas)
+    absl::StrAppend(&res, " c", item.cas);
+  if (meta.return_key)
+    absl::StrAppend(&res, " k", cmd.key);
+  if (meta.return_size)
+    absl::StrAppend(&res, " s", item.value.size());
+  if (!meta.opaque.empty())
+    absl::StrAppend(&res, " O", meta.opaque);
+
+  if (item.win)
+    res.append(" W");
+  if (item.mc_state & DbSlice::MC_STALE)
+    res.append(" X");
+  if ((item.mc_state & DbSlice::MC_WIN_SENT) && !item.win)
+    res.append(" Z");
+
+  return res;
+}
+
+void SendMetaError(OpStatus status, MCReplyBuilder* builder) {
+  switch (status) {
+    case OpStatus::OUT_OF_MEMORY:
+      return builder->SendSimpleString("SERVER_ERROR out of memory");
+    case OpStatus::WRONG_TYPE:
+      return builder->SendClientError("wrong type of value");
+    case OpStatus::INVALID_VALUE:
+      return builder->SendClientError("cannot increment or decrement non-numeric value");
+    case OpStatus::SYNTAX_ERR:
+      return builder->SendClientError("invalid mode switch");
+    default:
+      return builder->SendError(DebugString(status));
+  }
+}
+
+// Returns the reply builder of a meta command, or null if the command arrived over a protocol
+// other than memcache.
+MCReplyBuilder* MetaBuilder(ConnectionContext* cntx) {
+  if (!cntx->conn_state.mc_command) {
+    cntx->reply_builder()->SendError("meta commands are supported only by memcache protocol");
+    return nullptr;
+  }
+  return static_cast<MCReplyBuilder*>(cntx->reply_builder());
+}
+
+OpResult<MetaItem> OpMetaGet(const OpArgs& op_args, string_view key, const MP::MetaFlags& meta) {
+  auto& db_slice = op_args.shard->db_slice();
+  DbIndex db_index = op_args.db_cntx.db_index;
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
+  MetaItem item;
+
+  if (!IsValid(it)) {
+    db_slice.SetMCState(db_index, key, 0);  // could be left by an item that was deleted.
+    if (meta.vivify_ttl < 0)
+      return OpStatus::KEY_NOTFOUND;
+
+    // The first client that misses recaches the item, the others get the empty item meanwhile.
+    try {
+      it = db_slice.AddOrFind(op_args.db_cntx, key).first;
+    } catch (bad_alloc&) {
+      return OpStatus::OUT_OF_MEMORY;
+    }
+
+    it->second.SetString("");
+    db_slice.PostUpdate(db_index, it, key, false);
+    SetMetaTtl(op_args, it, meta.vivify_ttl);
+
+    db_slice.SetMCState(db_index, key, DbSlice::MC_WIN_SENT);
+    item.win = true;
+    FillMetaItem(op_args, it, &item);
+    return item;
+  }
+
+  if (it->second.ObjType() != OBJ_STRING)
+    return OpStatus::WRONG_TYPE;
+
+  item.mc_state = db_slice.GetMCState(db_index, key);
+  if (!(item.mc_state & DbSlice::MC_WIN_SENT)) {
+    bool recache = item.mc_state & DbSlice::MC_STALE;
+    if (meta.recache_ttl >= 0 && it->second.HasExpire()) {
+      int64_t ttl_ms = db_slice.ExpireTime(it) - op_args.db_cntx.time_now_ms;
+      recache |= ttl_ms < meta.recache_ttl * 1000;
+    }
+
+    if (recache) {
+      item.win = true;
+      db_slice.SetMCState(db_index, key, item.mc_state | DbSlice::MC_WIN_SENT);
+    }
+  }
+
+  if (meta.new_ttl >= 0)
+    SetMetaTtl(op_args, it, meta.new_ttl);
+
+  if (meta.return_value || meta.return_size)
+    item.value = GetString(op_args.shard, it->second);
+
+  FillMetaItem(op_args, it, &item);
+  return item;
+}
+
+OpResult<MetaItem> OpMetaSet(const OpArgs& op_args, const MP::Command& cmd, string_view value) {
+  auto& db_slice = op_args.shard->db_slice();
+  string_view key = cmd.key;
+  const MP::MetaFlags& meta = cmd.meta;
+
+  if (cmd.cas_unique) {
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
+    if (!IsValid(it))
+      return OpStatus::KEY_NOTFOUND;
+    if (it.GetVersion() != cmd.cas_unique)
+      return OpStatus::KEY_EXISTS;
+  }
+
+  SetCmd::SetParams params;
+  params.memcache_flags = cmd.flags;
+  if (meta.new_ttl > 0)
+    params.expire_after_ms = meta.new_ttl * 1000;
+  else if (cmd.type == MP::CAS && cmd.expire_ts)
+    params.expire_after_ms = uint64_t(cmd.expire_ts) * 1000;
+
+  OpStatus status = OpStatus::OK;
+  switch (meta.mode) {
+    case 0:
+    case 'S':
+      break;
+    case 'E':
+      params.flags |= SetCmd::SET_IF_NOTEXIST;
+      break;
+    case 'R':
+      params.flags |= SetCmd::SET_IF_EXISTS;
+      break;
+    case 'A':
+    case 'P': {
+      OpResult<bool> res = ExtendOrSkip(op_args, key, value, meta.mode == 'P');
+      status = !res ? res.status() : (*res ? OpStatus::OK : OpStatus::SKIPPED);
+      break;
+    }
+    default:
+      return OpStatus::SYNTAX_ERR;
+  }
+
+  if (meta.mode != 'A' && meta.mode != 'P') {
+    SetCmd sg(op_args);
+    status = sg.Set(params, key, value);
+  }
+
+  if (status != OpStatus::OK)
+    return status;
+
+  MetaItem item;
+  if (meta.return_cas) {
+    PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
+    if (IsValid(it))
+      item.cas = it.GetVersion();
+  }
+
+  return item;
+}
+
+OpStatus OpMetaDel(const OpArgs& op_args, const MP::Command& cmd) {
+  auto& db_slice = op_args.shard->db_slice();
+  DbIndex db_index = op_args.db_cntx.db_index;
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, cmd.key);
+
+  if (!IsValid(it))
+    return OpStatus::KEY_NOTFOUND;
+
+  if (cmd.cas_unique && it.GetVersion() != cmd.cas_unique)
+    return OpStatus::KEY_EXISTS;
+
+  if (cmd.meta.invalidate) {
+    // The stale item is served until one of its readers recaches it.
+    db_slice.SetMCState(db_index, cmd.key, DbSlice::MC_STALE);
+    if (cmd.meta.new_ttl >= 0)
+      SetMetaTtl(op_args, it, cmd.meta.new_ttl);
+    return OpStatus::OK;
+  }
+
+  db_slice.Del(db_index, it);
+  db_slice.SetMCState(db_index, cmd.key, 0);
+  return OpStatus::OK;
+}
+
+OpResult<MetaItem> OpMetaArithm(const OpArgs& op_args, const MP::Command& cmd) {
+  auto& db_slice = op_args.shard->db_slice();
+  DbIndex db_index = op_args.db_cntx.db_index;
+  string_view key = cmd.key;
+  const MP::MetaFlags& meta = cmd.meta;
+  PrimeIterator it = db_slice.FindExt(op_args.db_cntx, key);
+  MetaItem item;
+
+  if (!IsValid(it)) {
+    if (meta.vivify_ttl < 0)
+      return OpStatus::KEY_NOTFOUND;
+
+    // Auto-vivified counters start from the initial value.
+    try {
+      it = db_slice.AddOrFind(op_args.db_cntx, key).first;
+    } catch (bad_alloc&) {
+      return OpStatus::OUT_OF_MEMORY;
+    }
+
+    item.value = absl::StrCat(meta.initial);
+    it->second.SetString(item.value);
+    db_slice.PostUpdate(db_index, it, key, false);
+    SetMetaTtl(op_args, it, meta.vivify_ttl);
+
+    FillMetaItem(op_args, it, &item);
+    return item;
+  }
+
+  if (it->second.ObjType() != OBJ_STRING)
+    return OpStatus::WRONG_TYPE;
+
+  uint64_t num;
+  if (!absl::SimpleAtoi(GetString(op_args.shard, it->second), &num))
+    return OpStatus::INVALID_VALUE;
+
+  // Memcache counters are unsigned: increments wrap around and decrements stop at 0.
+  switch (meta.mode) {
+    case 0:
+    case 'I':
+    case 'i':
+    case '+':
+      num += cmd.delta;
+      break;
+    case 'D':
+    case 'd':
+    case '-':
+      num = num > cmd.delta ? num - cmd.delta : 0;
+      break;
+    default:
+      return OpStatus::SYNTAX_ERR;
+  }
+
+  item.value = absl::StrCat(num);
+  db_slice.PreUpdate(db_index, it);
+  it->second.SetString(item.value);
+  db_slice.PostUpdate(db_index, it, key);
+  if (meta.new_ttl >= 0)
+    SetMetaTtl(op_args, it, meta.new_ttl);
+
+  FillMetaItem(op_args, it, &item);
+  return item;
+}
+
 }  // namespace
 
 OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value) {
@@ -381,11 +724,11 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
   VLOG(2) << "Set " << key << "(" << db_slice.shard_id() << ") ";
 
   if (params.IsConditionalSet()) {
-    const auto [it, expire_it] = db_slice.FindExt(op_args_.db_cntx, key);
+    PrimeIterator it = db_slice.FindExt(op_args_.db_cntx, key);
     // Make sure that we have this key, and only add it if it does exists
     if (params.flags & SET_IF_EXISTS) {
       if (IsValid(it)) {
-        return SetExisting(params, it, expire_it, key, value);
+        return SetExisting(params, it, key, value);
       } else {
         return OpStatus::SKIPPED;
       }
@@ -398,16 +741,16 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
   // At this point we either need to add missing entry, or we
   // will override an existing one
   // Trying to add a new entry.
-  tuple<PrimeIterator, ExpireIterator, bool> add_res;
+  pair<PrimeIterator, bool> add_res;
   try {
-    add_res = db_slice.AddOrFind2(op_args_.db_cntx, key);
+    add_res = db_slice.AddOrFind(op_args_.db_cntx, key);
   } catch (bad_alloc& e) {
     return OpStatus::OUT_OF_MEMORY;
   }
 
-  PrimeIterator it = get<0>(add_res);
-  if (!get<2>(add_res)) {  // Existing.
-    return SetExisting(params, it, get<1>(add_res), key, value);
+  PrimeIterator it = add_res.first;
+  if (!add_res.second) {  // Existing.
+    return SetExisting(params, it, key, value);
   }
 
   // Adding new value.
@@ -432,12 +775,12 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
     }
   }
 
-  RecordJournal(op_args_, key, it->second);
+  KeyspaceEvents::Notify(op_args_.db_cntx.db_index, key, KeyspaceEvent::SET);
   return OpStatus::OK;
 }
 
-OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIterator e_it,
-                             string_view key, string_view value) {
+OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, string_view key,
+                             string_view value) {
   if (params.flags & SET_IF_NOTEXIST)
     return OpStatus::SKIPPED;
 
@@ -455,13 +798,11 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
   DbSlice& db_slice = shard->db_slice();
   uint64_t at_ms =
       params.expire_after_ms ? params.expire_after_ms + op_args_.db_cntx.time_now_ms : 0;
-  if (IsValid(e_it) && at_ms) {
-    e_it->second = db_slice.FromAbsoluteTime(at_ms);
+  if (prime_value.HasExpire() && at_ms) {
+    db_slice.SetExpireTime(op_args_.db_cntx.db_index, it, at_ms);
   } else if (!(params.flags & SET_KEEP_EXPIRE)) {
-    // We need to update expiry, or maybe erase the object if it was expired.
-    bool changed = db_slice.UpdateExpire(op_args_.db_cntx.db_index, it, at_ms);
-    if (changed && at_ms == 0)  // erased.
-      return OpStatus::OK;      // TODO: to update journal with deletion.
+    // Adds the expiry or removes the existing one. The value is overwritten in both cases.
+    db_slice.UpdateExpire(op_args_.db_cntx.db_index, it, at_ms);
   }
 
   db_slice.PreUpdate(op_args_.db_cntx.db_index, it);
@@ -487,7 +828,7 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
   }
 
   db_slice.PostUpdate(op_args_.db_cntx.db_index, it, key);
-  RecordJournal(op_args_, key, it->second);
+  KeyspaceEvents::Notify(op_args_.db_cntx.db_index, key, KeyspaceEvent::SET);
 
   return OpStatus::OK;
 }
@@ -608,13 +949,55 @@ void StringFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   get_qps.Inc();
 
   string_view key = ArgS(args, 1);
+  Transaction* trans = cntx->transaction;
+
+  uint32_t zero_copy_min_size = GetFlag(FLAGS_get_zero_copy_min_size);
+  if (zero_copy_min_size > 0 && !trans->IsMulti()) {
+    return GetZeroCopy(key, zero_copy_min_size, cntx);
+  }
+
+  // External values are read asynchronously: the hop only issues the read, so the shard queue
+  // does not stall on the disk. The tiered storage keeps the page until the read finishes.
+  util::fibers_ext::Done read_done;
+  error_code read_ec;
+  string external_val;
+  bool is_external = false;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<string> {
+    auto it_res = shard->db_slice().Find(t->db_context(), key, OBJ_STRING);
+    if (!it_res)
+      return it_res.status();
 
-  auto cb = [&](Transaction* t, EngineShard* shard) { return OpGet(t->GetOpArgs(shard), key); };
+    const PrimeValue& pv = (*it_res)->second;
+    if (!pv.IsExternal())
+      return GetString(shard, pv);
+
+    is_external = true;
+    auto [offset, size] = pv.GetExternalPtr();
+    TieredStorage* tiered = shard->tiered_storage();
+    DbIndex db_index = t->db_context().db_index;
+
+    auto read_cb = [&, tiered, db_index, offset = offset, read_done](error_code ec,
+                                                                     string_view data) mutable {
+      read_ec = ec;
+      external_val.assign(data);
+      if (!ec)
+        tiered->TryPromote(db_index, key, offset, data);
+      read_done.Notify();
+    };
+    tiered->ReadAsync(offset, size, std::move(read_cb));
+    return string{};
+  };
 
   DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
-  Transaction* trans = cntx->transaction;
   OpResult<string> result = trans->ScheduleSingleHopT(std::move(cb));
 
+  if (is_external) {
+    read_done.Wait();
+    CHECK(!read_ec) << "TBD: " << read_ec;
+    result = std::move(external_val);
+  }
+
   if (result) {
     DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << result.value();
     (*cntx)->SendBulkString(*result);
@@ -630,6 +1013,60 @@ void StringFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+// Large values are sent straight from the prime table. The transaction concludes in its single
+// hop, but the key stays pinned, which holds a shared intent lock on it and protects it from
+// expiry and eviction: the writers of the key wait until it's unpinned, while the shard keeps
+// running the other transactions. Once the reply has been written, an async hop unpins the key.
+void StringFamily::GetZeroCopy(string_view key, uint32_t min_size, ConnectionContext* cntx) {
+  Transaction* trans = cntx->transaction;
+
+  string copy;
+  string_view value;
+  ShardId pinned_sid = kInvalidSid;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpStatus {
+    auto& db_slice = shard->db_slice();
+    auto it_res = db_slice.Find(t->db_context(), key, OBJ_STRING);
+    if (!it_res)
+      return it_res.status();
+
+    const PrimeValue& pv = (*it_res)->second;
+
+    // External values are read into a buffer anyway and the tiered storage may offload the value
+    // from under us, so we copy.
+    if (pv.IsExternal() || shard->tiered_storage() || pv.Size() < min_size) {
+      copy = GetString(shard, pv);
+      value = copy;
+      return OpStatus::OK;
+    }
+
+    value = pv.GetSlice(&copy);
+    db_slice.PinKey(t->db_context().db_index, key);
+    pinned_sid = shard->shard_id();
+    return OpStatus::OK;
+  };
+
+  OpStatus status = trans->ScheduleSingleHop(std::move(cb));
+
+  if (status == OpStatus::OK) {
+    (*cntx)->SendBulkString(value);
+  } else if (status == OpStatus::WRONG_TYPE) {
+    (*cntx)->SendError(kWrongTypeErr);
+  } else {
+    (*cntx)->SendNull();
+  }
+
+  if (pinned_sid == kInvalidSid)
+    return;
+
+  // The writers of the key may wait at the head of the tx-queue, hence we poll it afterwards.
+  shard_set->Add(pinned_sid, [db_index = cntx->db_index(), key = string(key)] {
+    EngineShard* shard = EngineShard::tlocal();
+    shard->db_slice().UnpinKey(db_index, key);
+    shard->PollExecution("unpin", nullptr);
+  });
+}
+
 void StringFamily::GetDel(CmdArgList args, ConnectionContext* cntx) {
   get_qps.Inc();
 
@@ -770,6 +1207,58 @@ void StringFamily::IncrBy(CmdArgList args, ConnectionContext* cntx) {
   return IncrByGeneric(key, val, cntx);
 }
 
+void StringFamily::MIncrBy(CmdArgList args, ConnectionContext* cntx) {
+  for (size_t i = 2; i < args.size(); i += 2) {
+    int64_t val;
+    if (!absl::SimpleAtoi(ArgS(args, i), &val)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+  }
+
+  Transaction* transaction = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  vector<vector<OpResult<int64_t>>> shard_res(shard_count);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    shard_res[sid] = OpMIncrBy(t->GetOpArgs(shard), t->ShardArgsInShard(sid));
+    return OpStatus::OK;
+  };
+
+  OpStatus status = transaction->ScheduleSingleHop(std::move(cb));
+  CHECK_EQ(OpStatus::OK, status);
+
+  // Reorders the results back to the order of their keys.
+  vector<OpResult<int64_t>> res((args.size() - 1) / 2);
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    for (size_t j = 0; j < shard_res[sid].size(); ++j) {
+      uint32_t indx = transaction->ReverseArgIndex(sid, 2 * j);
+      res[indx / 2] = shard_res[sid][j];
+    }
+  }
+
+  (*cntx)->StartArray(res.size());
+  for (const auto& val : res) {
+    switch (val.status()) {
+      case OpStatus::OK:
+        (*cntx)->SendLong(val.value());
+        break;
+      case OpStatus::INVALID_VALUE:
+        (*cntx)->SendError(kInvalidIntErr);
+        break;
+      case OpStatus::OUT_OF_RANGE:
+        (*cntx)->SendError(kIncrOverflow);
+        break;
+      default:
+        (*cntx)->SendError(val.status());
+        break;
+    }
+  }
+}
+
 void StringFamily::IncrByFloat(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view sval = ArgS(args, 2);
@@ -927,17 +1416,54 @@ void StringFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
   bool fetch_mcver =
       fetch_mcflag && (dfly_cntx->conn_state.memcache_flag & ConnectionState::FETCH_CAS_VER);
 
+  // The non atomic mode skips the scheduling, the shards check the locks of their keys
+  // instead. A shard gives up if a key is locked or offloaded and then the MGET runs as a
+  // regular transaction.
+  bool done = false;
+  if (GetFlag(FLAGS_mget_non_atomic) && !transaction->IsMulti() &&
+      transaction->unique_shard_cnt() > 1) {
+    atomic_bool aborted{false};
+    util::fibers_ext::BlockingCounter bc{0};
+    for (ShardId sid = 0; sid < shard_count; ++sid) {
+      if (!transaction->IsActive(sid))
+        continue;
+
+      bc.Add(1);
+      shard_set->Add(sid, [&, sid, bc]() mutable {
+        EngineShard* shard = EngineShard::tlocal();
+        ArgSlice keys = transaction->ShardArgsInShard(sid);
+        KeyLockArgs lock_args{transaction->db_index(), keys, 1};
+        bool offloaded = false;
+        if (shard->shard_lock()->Check(IntentLock::SHARED) &&
+            shard->db_slice().CheckLock(IntentLock::SHARED, lock_args)) {
+          DbContext db_cntx{transaction->db_index(), GetCurrentTimeMs()};
+          mget_resp[sid] = OpMGet(fetch_mcflag, fetch_mcver, keys, db_cntx, shard, &offloaded);
+        } else {
+          offloaded = true;
+        }
+        if (offloaded)
+          aborted.store(true, memory_order_relaxed);
+        bc.Dec();
+      });
+    }
+    bc.Wait();
+    done = !aborted.load(memory_order_relaxed);
+  }
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
     ShardId sid = shard->shard_id();
-    mget_resp[sid] = OpMGet(fetch_mcflag, fetch_mcver, t, shard);
+    mget_resp[sid] = OpMGet(fetch_mcflag, fetch_mcver, t->ShardArgsInShard(sid),
+                            t->db_context(), shard);
     return OpStatus::OK;
   };
 
   // MGet requires locking as well. For example, if coordinator A applied W(x) and then W(y)
   // it necessarily means that whoever observed y, must observe x.
   // Without locking, mget x y could read stale x but latest y.
-  OpStatus result = transaction->ScheduleSingleHop(std::move(cb));
-  CHECK_EQ(OpStatus::OK, result);
+  if (!done) {
+    OpStatus result = transaction->ScheduleSingleHop(std::move(cb));
+    CHECK_EQ(OpStatus::OK, result);
+  }
 
   // reorder the responses back according to the order of their corresponding keys.
   vector<SinkReplyBuilder::OptResp> res(args.size() - 1);
@@ -1004,7 +1530,7 @@ void StringFamily::MSetNx(CmdArgList args, ConnectionContext* cntx) {
   auto cb = [&](Transaction* t, EngineShard* es) {
     auto args = t->ShardArgsInShard(es->shard_id());
     for (size_t i = 0; i < args.size(); i += 2) {
-      auto it = es->db_slice().FindExt(t->db_context(), args[i]).first;
+      auto it = es->db_slice().FindExt(t->db_context(), args[i]);
       if (IsValid(it)) {
         exists.store(true, memory_order_relaxed);
         break;
@@ -1112,34 +1638,176 @@ void StringFamily::PSetEx(CmdArgList args, ConnectionContext* cntx) {
   SetExGeneric(false, std::move(args), cntx);
 }
 
-auto StringFamily::OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction* t,
-                          EngineShard* shard) -> MGetResponse {
-  auto args = t->ShardArgsInShard(shard->shard_id());
+auto StringFamily::OpMGet(bool fetch_mcflag, bool fetch_mcver, ArgSlice args,
+                          const DbContext& db_cntx, EngineShard* shard, bool* offloaded)
+    -> MGetResponse {
   DCHECK(!args.empty());
 
   MGetResponse response(args.size());
 
   auto& db_slice = shard->db_slice();
-  for (size_t i = 0; i < args.size(); ++i) {
-    OpResult<PrimeIterator> it_res = db_slice.Find(t->db_context(), args[i], OBJ_STRING);
-    if (!it_res)
-      continue;
+  if (!db_slice.IsDbValid(db_cntx.db_index))
+    return response;
+
+  db_slice.FindMany(db_cntx, args, [&](unsigned i, PrimeIterator it) {
+    if (!IsValid(it) || it->second.ObjType() != OBJ_STRING)
+      return;
+
+    // The caller retries the whole lookup, so the remaining keys are skipped.
+    if (offloaded && (*offloaded || it->second.IsExternal())) {
+      *offloaded = true;
+      return;
+    }
 
-    const PrimeIterator& it = *it_res;
     auto& dest = response[i].emplace();
 
     dest.value = GetString(shard, it->second);
     if (fetch_mcflag) {
-      dest.mc_flag = db_slice.GetMCFlag(t->db_index(), it->first);
+      dest.mc_flag = db_slice.GetMCFlag(db_cntx.db_index, it->first);
       if (fetch_mcver) {
         dest.mc_ver = it.GetVersion();
       }
     }
-  }
+  });
 
   return response;
 }
 
+void StringFamily::MetaGet(CmdArgList args, ConnectionContext* cntx) {
+  MCReplyBuilder* builder = MetaBuilder(cntx);
+  if (!builder)
+    return;
+
+  get_qps.Inc();
+
+  const MP::Command& cmd = *cntx->conn_state.mc_command;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMetaGet(t->GetOpArgs(shard), cmd.key, cmd.meta);
+  };
+
+  OpResult<MetaItem> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (res.status() == OpStatus::KEY_NOTFOUND) {
+    if (!cmd.no_reply)
+      builder->SendMeta("EN", "");
+    return;
+  }
+
+  if (!res)
+    return SendMetaError(res.status(), builder);
+
+  string flags = MetaReplyFlags(cmd, *res);
+  if (cmd.meta.return_value) {
+    builder->SendMetaValue(res->value, flags);
+  } else if (!cmd.no_reply) {
+    builder->SendMeta("HD", flags);
+  }
+}
+
+void StringFamily::MetaSet(CmdArgList args, ConnectionContext* cntx) {
+  MCReplyBuilder* builder = MetaBuilder(cntx);
+  if (!builder)
+    return;
+
+  set_qps.Inc();
+
+  const MP::Command& cmd = *cntx->conn_state.mc_command;
+  string_view value = ArgS(args, 2);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMetaSet(t->GetOpArgs(shard), cmd, value);
+  };
+
+  OpResult<MetaItem> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+
+  // The classic cas command shares the tokens of the meta commands, i.e. the bucket versions,
+  // and differs only in its replies.
+  if (cmd.type == MP::CAS) {
+    if (cmd.no_reply)
+      return;
+    switch (res.status()) {
+      case OpStatus::OK:
+        return builder->SendStored();
+      case OpStatus::KEY_EXISTS:
+        return builder->SendExists();
+      case OpStatus::KEY_NOTFOUND:
+        return builder->SendNotFound();
+      default:
+        return SendMetaError(res.status(), builder);
+    }
+  }
+
+  switch (res.status()) {
+    case OpStatus::OK:
+      if (!cmd.no_reply)
+        builder->SendMeta("HD", MetaReplyFlags(cmd, *res));
+      break;
+    case OpStatus::SKIPPED:
+      builder->SendMeta("NS", "");
+      break;
+    case OpStatus::KEY_EXISTS:
+      builder->SendMeta("EX", "");
+      break;
+    case OpStatus::KEY_NOTFOUND:
+      builder->SendMeta("NF", "");
+      break;
+    default:
+      SendMetaError(res.status(), builder);
+  }
+}
+
+void StringFamily::MetaDel(CmdArgList args, ConnectionContext* cntx) {
+  MCReplyBuilder* builder = MetaBuilder(cntx);
+  if (!builder)
+    return;
+
+  const MP::Command& cmd = *cntx->conn_state.mc_command;
+  auto cb = [&](Transaction* t, EngineShard* shard) { return OpMetaDel(t->GetOpArgs(shard), cmd); };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  switch (status) {
+    case OpStatus::OK:
+      if (!cmd.no_reply)
+        builder->SendMeta("HD", MetaReplyFlags(cmd, MetaItem{}));
+      break;
+    case OpStatus::KEY_NOTFOUND:
+      if (!cmd.no_reply)
+        builder->SendMeta("NF", "");
+      break;
+    case OpStatus::KEY_EXISTS:
+      builder->SendMeta("EX", "");
+      break;
+    default:
+      SendMetaError(status, builder);
+  }
+}
+
+void StringFamily::MetaArithm(CmdArgList args, ConnectionContext* cntx) {
+  MCReplyBuilder* builder = MetaBuilder(cntx);
+  if (!builder)
+    return;
+
+  const MP::Command& cmd = *cntx->conn_state.mc_command;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMetaArithm(t->GetOpArgs(shard), cmd);
+  };
+
+  OpResult<MetaItem> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (res.status() == OpStatus::KEY_NOTFOUND) {
+    if (!cmd.no_reply)
+      builder->SendMeta("NF", "");
+    return;
+  }
+
+  if (!res)
+    return SendMetaError(res.status(), builder);
+
+  string flags = MetaReplyFlags(cmd, *res);
+  if (cmd.meta.return_value) {
+    builder->SendMetaValue(res->value, flags);
+  } else if (!cmd.no_reply) {
+    builder->SendMeta("HD", flags);
+  }
+}
+
 void StringFamily::Init(util::ProactorPool* pp) {
   set_qps.Init(pp);
   get_qps.Init(pp);
@@ -1162,6 +1830,9 @@ void StringFamily::Register(CommandRegistry* registry) {
             << CI{"INCR", CO::WRITE | CO::DENYOOM | CO::FAST, 2, 1, 1, 1}.HFUNC(Incr)
             << CI{"DECR", CO::WRITE | CO::DENYOOM | CO::FAST, 2, 1, 1, 1}.HFUNC(Decr)
             << CI{"INCRBY", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(IncrBy)
+            << CI{"MINCRBY", CO::WRITE | CO::DENYOOM | CO::REVERSE_MAPPING | CO::SPLIT_JOURNAL, -3,
+                  1, -1, 2}
+                   .HFUNC(MIncrBy)
             << CI{"INCRBYFLOAT", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(IncrByFloat)
             << CI{"DECRBY", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(DecrBy)
             << CI{"GET", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(Get)
@@ -1169,13 +1840,21 @@ void StringFamily::Register(CommandRegistry* registry) {
             << CI{"GETEX", CO::WRITE | CO::DENYOOM | CO::FAST, -1, 1, 1, 1}.HFUNC(GetEx)
             << CI{"GETSET", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(GetSet)
             << CI{"MGET", CO::READONLY | CO::FAST | CO::REVERSE_MAPPING, -2, 1, -1, 1}.HFUNC(MGet)
-            << CI{"MSET", CO::WRITE | CO::DENYOOM, -3, 1, -1, 2}.HFUNC(MSet)
+            << CI{"MSET", CO::WRITE | CO::DENYOOM | CO::SPLIT_JOURNAL, -3, 1, -1, 2}.HFUNC(MSet)
             << CI{"MSETNX", CO::WRITE | CO::DENYOOM, -3, 1, -1, 2}.HFUNC(MSetNx)
             << CI{"STRLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(StrLen)
             << CI{"GETRANGE", CO::READONLY | CO::FAST, 4, 1, 1, 1}.HFUNC(GetRange)
             << CI{"SUBSTR", CO::READONLY | CO::FAST, 4, 1, 1, 1}.HFUNC(
                    GetRange)  // Alias for GetRange
-            << CI{"SETRANGE", CO::WRITE | CO::FAST | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetRange);
+            << CI{"SETRANGE", CO::WRITE | CO::FAST | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetRange)
+            // Memcache meta commands, dispatched only by the memcache protocol.
+            // MG is a write command because it may create the item or hand out a win token.
+            << CI{"MG", CO::WRITE | CO::DENYOOM | CO::FAST | CO::NOSCRIPT, 2, 1, 1, 1}.HFUNC(
+                   MetaGet)
+            << CI{"MS", CO::WRITE | CO::DENYOOM | CO::NOSCRIPT, 3, 1, 1, 1}.HFUNC(MetaSet)
+            << CI{"MD", CO::WRITE | CO::FAST | CO::NOSCRIPT, 2, 1, 1, 1}.HFUNC(MetaDel)
+            << CI{"MA", CO::WRITE | CO::DENYOOM | CO::FAST | CO::NOSCRIPT, 2, 1, 1, 1}.HFUNC(
+                   MetaArithm);
 }
 
 }  // namespace dfly
@@ -46,8 +46,8 @@ class SetCmd {
   OpStatus Set(const SetParams& params, std::string_view key, std::string_view value);
 
  private:
-  OpStatus SetExisting(const SetParams& params, PrimeIterator it, ExpireIterator e_it,
-                       std::string_view key, std::string_view value);
+  OpStatus SetExisting(const SetParams& params, PrimeIterator it, std::string_view key,
+                       std::string_view value);
 };
 
 class StringFamily {
@@ -63,12 +63,14 @@ class StringFamily {
   static void DecrBy(CmdArgList args, ConnectionContext* cntx);
   static void Get(CmdArgList args, ConnectionContext* cntx);
   static void GetDel(CmdArgList args, ConnectionContext* cntx);
+  static void GetZeroCopy(std::string_view key, uint32_t min_size, ConnectionContext* cntx);
   static void GetRange(CmdArgList args, ConnectionContext* cntx);
   static void GetSet(CmdArgList args, ConnectionContext* cntx);
   static void GetEx(CmdArgList args, ConnectionContext* cntx);
   static void Incr(CmdArgList args, ConnectionContext* cntx);
   static void IncrBy(CmdArgList args, ConnectionContext* cntx);
   static void IncrByFloat(CmdArgList args, ConnectionContext* cntx);
+  static void MIncrBy(CmdArgList args, ConnectionContext* cntx);
   static void MGet(CmdArgList args, ConnectionContext* cntx);
   static void MSet(CmdArgList args, ConnectionContext* cntx);
   static void MSetNx(CmdArgList args, ConnectionContext* cntx);
@@ -81,6 +83,12 @@ class StringFamily {
   static void Prepend(CmdArgList args, ConnectionContext* cntx);
   static void PSetEx(CmdArgList args, ConnectionContext* cntx);
 
+  // Memcache meta commands: mg, ms, md and ma.
+  static void MetaGet(CmdArgList args, ConnectionContext* cntx);
+  static void MetaSet(CmdArgList args, ConnectionContext* cntx);
+  static void MetaDel(CmdArgList args, ConnectionContext* cntx);
+  static void MetaArithm(CmdArgList args, ConnectionContext* cntx);
+
   // These functions are used internally, they do not implement any specific command
   static void IncrByGeneric(std::string_view key, int64_t val, ConnectionContext* cntx);
   static void ExtendGeneric(CmdArgList args, bool prepend, ConnectionContext* cntx);
@@ -93,8 +101,11 @@ class StringFamily {
   };
 
   using MGetResponse = std::vector<std::optional<GetResp>>;
-  static MGetResponse OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction* t,
-                             EngineShard* shard);
+
+  // If offloaded is set, stops and sets it at the first offloaded value instead of reading it.
+  static MGetResponse OpMGet(bool fetch_mcflag, bool fetch_mcver, ArgSlice args,
+                             const DbContext& db_cntx, EngineShard* shard,
+                             bool* offloaded = nullptr);
 };
 
 }  // namespace dfly
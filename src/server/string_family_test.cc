@@ -17,8 +17,12 @@
 using namespace testing;
 using namespace std;
 using namespace util;
+using absl::SetFlag;
 using absl::StrCat;
 
+ABSL_DECLARE_FLAG(uint32_t, get_zero_copy_min_size);
+ABSL_DECLARE_FLAG(bool, mget_non_atomic);
+
 namespace dfly {
 
 class StringFamilyTest : public BaseFamilyTest {
@@ -75,6 +79,22 @@ TEST_F(StringFamilyTest, Append) {
   EXPECT_THAT(Run({"ttl", "key"}), IntArg(100));
 }
 
+TEST_F(StringFamilyTest, AppendLarge) {
+  string expected(5000, 'x');
+  Run({"set", "key", expected});
+  for (unsigned i = 0; i < 100; ++i) {
+    string chunk(100, 'a' + i % 26);
+    expected.append(chunk);
+    EXPECT_THAT(Run({"append", "key", chunk}), IntArg(expected.size()));
+  }
+  EXPECT_EQ(Run({"get", "key"}), expected);
+
+  Run({"setrange", "key", "10", "hello"});
+  expected.replace(10, 5, "hello");
+  EXPECT_EQ(Run({"getrange", "key", "0", "19"}), expected.substr(0, 20));
+  EXPECT_EQ(Run({"get", "key"}), expected);
+}
+
 TEST_F(StringFamilyTest, Expire) {
   ASSERT_EQ(Run({"set", "key", "val", "PX", "20"}), "OK");
 
@@ -94,7 +114,8 @@ TEST_F(StringFamilyTest, Expire) {
 
 TEST_F(StringFamilyTest, Keepttl) {
   ASSERT_EQ(Run({"set", "key", "val", "EX", "100"}), "OK");
-  ASSERT_EQ(Run({"set", "key", "val"}), "OK");
+  ASSERT_EQ(Run({"set", "key", "val2"}), "OK");
+  EXPECT_EQ(Run({"get", "key"}), "val2");
   auto resp = Run({"ttl", "key"});
   auto actual = get<int64_t>(resp.u);
   ASSERT_EQ(actual, -1);
@@ -227,6 +248,69 @@ TEST_F(StringFamilyTest, MGetSet) {
   set_fb.join();
 }
 
+TEST_F(StringFamilyTest, MGetNonAtomic) {
+  SetFlag(&FLAGS_mget_non_atomic, true);
+  Run({"mset", "x", "1", "b", "2", "c", "3"});
+  Run({"hset", "h", "f", "v"});
+  Run({"set", "e", "4", "px", "10"});
+  AdvanceTime(20);
+
+  auto resp = Run({"mget", "x", "b", "missing", "h", "e", "c"});
+  ASSERT_THAT(resp, ArrLen(6));
+  const auto& vec = resp.GetVec();
+  EXPECT_EQ(vec[0], "1");
+  EXPECT_EQ(vec[1], "2");
+  EXPECT_THAT(vec[2], ArgType(RespExpr::NIL));
+  EXPECT_THAT(vec[3], ArgType(RespExpr::NIL));
+  EXPECT_THAT(vec[4], ArgType(RespExpr::NIL));
+  EXPECT_EQ(vec[5], "3");
+
+  // The reads of a shard are still ordered after the writes of the shard that completed.
+  auto mget_fb = pp_->at(0)->LaunchFiber([&] {
+    int64_t last = 0;
+    for (size_t i = 0; i < 1000; ++i) {
+      RespExpr resp = Run({"mget", "x", "b"});
+      ASSERT_EQ(RespExpr::ARRAY, resp.type);
+      auto ivec = ToIntArr(resp);
+      ASSERT_GE(ivec[0], last);
+      last = ivec[0];
+    }
+  });
+
+  auto set_fb = pp_->at(1)->LaunchFiber([&] {
+    for (size_t i = 2; i < 2000; ++i) {
+      Run({"mset", "x", StrCat(i), "b", StrCat(i)});
+    }
+  });
+
+  mget_fb.join();
+  set_fb.join();
+  SetFlag(&FLAGS_mget_non_atomic, false);
+}
+
+TEST_F(StringFamilyTest, MIncrBy) {
+  Run({"set", "a", "10"});
+  Run({"set", "s", "str"});
+
+  auto resp =
+      Run({"mincrby", "a", "5", "b", "-3", "s", "1", "a", "1", "c", "9223372036854775807"});
+  ASSERT_THAT(resp, ArrLen(5));
+  const auto& vec = resp.GetVec();
+  EXPECT_THAT(vec[0], IntArg(15));
+  EXPECT_THAT(vec[1], IntArg(-3));
+  EXPECT_THAT(vec[2], ErrArg("ERR value is not an integer"));
+  EXPECT_THAT(vec[3], IntArg(16));
+  EXPECT_THAT(vec[4], IntArg(INT64_MAX));
+
+  EXPECT_EQ(Run({"get", "a"}), "16");
+  EXPECT_EQ(Run({"get", "s"}), "str");
+  resp = Run({"mincrby", "c", "1", "a", "1"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0], ErrArg("overflow"));
+  EXPECT_THAT(Run({"mincrby", "a", "x"}), ErrArg("ERR value is not an integer"));
+  EXPECT_THAT(Run({"mincrby", "a", "1", "b"}), ErrArg("wrong number of arguments"));
+}
+
 TEST_F(StringFamilyTest, MSetGet) {
   Run({"mset", "x", "0", "y", "0", "a", "0", "b", "0"});
   ASSERT_EQ(2, GetDebugInfo().shards_count);
@@ -384,6 +468,13 @@ TEST_F(StringFamilyTest, Range) {
   EXPECT_EQ(Run({"getrange", "key3", "3", "3"}), "");
   EXPECT_EQ(Run({"getrange", "key3", "4", "5"}), "");
 
+  string large;
+  for (unsigned i = 0; i < 50000; ++i)
+    large.push_back('a' + i % 26);
+  Run({"set", "large", large});
+  EXPECT_EQ(Run({"getrange", "large", "4093", "4200"}), large.substr(4093, 108));
+  EXPECT_EQ(Run({"getrange", "large", "-5", "-1"}), large.substr(49995));
+
   Run({"SET", "num", "1234"});
   EXPECT_EQ(Run({"getrange", "num", "3", "5000"}), "4");
   EXPECT_EQ(Run({"getrange", "num", "-5000", "10000"}), "1234");
@@ -471,6 +562,36 @@ TEST_F(StringFamilyTest, GetDel) {
   ASSERT_THAT(resp, ArgType(RespExpr::NIL));
 }
 
+TEST_F(StringFamilyTest, GetZeroCopy) {
+  SetFlag(&FLAGS_get_zero_copy_min_size, 1024);
+
+  string big(100000, 'x');
+  big[5000] = 'y';
+  EXPECT_EQ(Run({"set", "big", big, "PX", "100"}), "OK");
+  EXPECT_EQ(Run({"set", "small", "bar"}), "OK");
+  Run({"lpush", "list", "a"});
+
+  EXPECT_EQ(Run({"get", "big"}), big);
+  EXPECT_EQ(Run({"get", "small"}), "bar");
+
+  // Writers of the key proceed once the async hop unpins it.
+  string big2(2000, 'z');
+  EXPECT_EQ(Run({"set", "big2", big2}), "OK");
+  EXPECT_EQ(Run({"get", "big2"}), big2);
+  EXPECT_THAT(Run({"append", "big2", "a"}), IntArg(2001));
+  EXPECT_EQ(Run({"get", "big2"}), big2 + "a");
+
+  EXPECT_THAT(Run({"get", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"get", "list"}), ErrArg("WRONGTYPE"));
+
+  // The pin is released after the reply so the key still expires.
+  AdvanceTime(200);
+  EXPECT_THAT(Run({"get", "big"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(0, CheckedInt({"exists", "big"}));
+
+  SetFlag(&FLAGS_get_zero_copy_min_size, 0);
+}
+
 TEST_F(StringFamilyTest, GetEx) {
   auto resp = Run({"set", "foo", "bar"});
   EXPECT_THAT(resp, "OK");
@@ -5,6 +5,7 @@
 #include "server/table.h"
 
 #include "base/logging.h"
+#include "server/cluster/cluster_config.h"
 
 namespace dfly {
 
@@ -15,7 +16,7 @@ unsigned kInitSegmentLog = 3;
 
 DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
   constexpr size_t kDbSz = sizeof(DbTableStats);
-  static_assert(kDbSz == 64);
+  static_assert(kDbSz == 80);
 
   ADD(inline_keys);
   ADD(obj_memory_usage);
@@ -23,6 +24,8 @@ DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
   ADD(update_value_amount);
   ADD(listpack_blob_cnt);
   ADD(listpack_bytes);
+  ADD(listpack_conversions);
+  ADD(listpack_early_conversions);
   ADD(external_entries);
   ADD(external_size);
 
@@ -31,8 +34,11 @@ DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
 
 DbTable::DbTable(std::pmr::memory_resource* mr)
     : prime(kInitSegmentLog, detail::PrimeTablePolicy{}, mr),
-      expire(0, detail::ExpireTablePolicy{}, mr),
-      mcflag(0, detail::ExpireTablePolicy{}, mr) {
+      mcflag(0, detail::McFlagTablePolicy{}, mr) {
+  if (ClusterConfig::IsEnabled()) {
+    slot_keys.resize(kMaxSlotNum + 1);
+    slot_stats.resize(kMaxSlotNum + 1);
+  }
 }
 
 DbTable::~DbTable() {
@@ -41,15 +47,22 @@ DbTable::~DbTable() {
 void DbTable::Clear() {
   prime.size();
   prime.Clear();
-  expire.Clear();
+  expire_count = 0;
+  expire_wheel = ExpireWheel{};
+  expire_rebase_pending = false;
+  expire_rebase_cursor = PrimeTable::Cursor{};
   mcflag.Clear();
+  for (auto& keys : slot_keys)
+    keys.clear();
+  for (auto& slot : slot_stats)
+    slot = SlotStats{};
   stats = DbTableStats{};
 }
 
 void DbTable::Release(IntentLock::Mode mode, std::string_view key, unsigned count) {
   DVLOG(1) << "Release " << IntentLock::ModeName(mode) << " " << count << " for " << key;
 
-  auto it = trans_locks.find(key);
+  auto it = trans_locks.find(LockFingerprint(key));
   CHECK(it != trans_locks.end()) << key;
   it->second.Release(mode, count);
   if (it->second.IsFree()) {
@@ -5,11 +5,13 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
 #include "core/expire_period.h"
+#include "core/expire_wheel.h"
 #include "core/intent_lock.h"
 #include "server/conn_context.h"
 #include "server/detail/table.h"
@@ -20,21 +22,15 @@ using PrimeKey = detail::PrimeKey;
 using PrimeValue = detail::PrimeValue;
 
 using PrimeTable = DashTable<PrimeKey, PrimeValue, detail::PrimeTablePolicy>;
-using ExpireTable = DashTable<PrimeKey, ExpirePeriod, detail::ExpireTablePolicy>;
 
 /// Iterators are invalidated when new keys are added to the table or some entries are deleted.
 /// Iterators are still valid  if a different entry in the table was mutated.
 using PrimeIterator = PrimeTable::iterator;
-using ExpireIterator = ExpireTable::iterator;
 
 inline bool IsValid(PrimeIterator it) {
   return !it.is_done();
 }
 
-inline bool IsValid(ExpireIterator it) {
-  return !it.is_done();
-}
-
 struct DbTableStats {
   // Number of inline keys.
   uint64_t inline_keys = 0;
@@ -48,29 +44,95 @@ struct DbTableStats {
   ssize_t update_value_amount = 0;
   size_t listpack_blob_cnt = 0;
   size_t listpack_bytes = 0;
+
+  // Hashes and sorted sets converted from listpack by their writes, and those of them that were
+  // converted below the static limits because they were write-hot.
+  size_t listpack_conversions = 0;
+  size_t listpack_early_conversions = 0;
   size_t external_entries = 0;
   size_t external_size = 0;
 
   DbTableStats& operator+=(const DbTableStats& o);
 };
 
-using LockTable = absl::flat_hash_map<std::string, IntentLock>;
+// The keys and the object memory of a hash slot in cluster mode, maintained along DbTableStats.
+struct SlotStats {
+  uint64_t key_count = 0;
+  ssize_t memory_bytes = 0;
+
+  SlotStats& operator+=(const SlotStats& o) {
+    key_count += o.key_count;
+    memory_bytes += o.memory_bytes;
+    return *this;
+  }
+};
+
+// Transaction locks are keyed by the fingerprint of the key, so that locking does not copy keys.
+// Keys with colliding fingerprints share the same lock, which can only cause false conflicts.
+using LockFp = uint64_t;
+using LockTable = absl::flat_hash_map<LockFp, IntentLock>;
+
+inline LockFp LockFingerprint(std::string_view key) {
+  return CompactObj::HashCode(key);
+}
 
 // A single Db table that represents a table that can be chosen with "SELECT" command.
 struct DbTable : boost::intrusive_ref_counter<DbTable, boost::thread_unsafe_counter> {
   PrimeTable prime;
-  ExpireTable expire;
-  DashTable<PrimeKey, uint32_t, detail::ExpireTablePolicy> mcflag;
+  DashTable<PrimeKey, uint32_t, detail::McFlagTablePolicy> mcflag;
+
+  // Number of the keys with a deadline, which their values keep.
+  size_t expire_count = 0;
 
   // Contains transaction locks
   LockTable trans_locks;
 
-  // Stores a list of dependant connections for each watched key.
-  absl::flat_hash_map<std::string, std::vector<ConnectionState::ExecInfo*>> watched_keys;
+  // Keys whose values are referenced outside of the shard thread, with their pin counts.
+  // Pinned keys are not expired or evicted until they are unpinned.
+  absl::flat_hash_map<std::string, unsigned> pinned_keys;
+
+  // Memcache meta protocol state of the keys that were invalidated or handed a win token,
+  // see DbSlice::McState. Cleared when the key is updated.
+  absl::flat_hash_map<std::string, uint8_t> mc_state;
+
+  // Keys deleted after the base of the next delta snapshot, see DbSlice::SetDeltaBase.
+  // readded is the version at which a deleted key was added again, 0 if it is still absent.
+  struct Tombstone {
+    uint64_t deleted;
+    uint64_t readded = 0;
+  };
+  absl::flat_hash_map<std::string, Tombstone> tombstones;
+
+  // Keys written by the clients while a snapshot is being loaded, which the loader does not
+  // overwrite, see DbSlice::TrackLoadingWrites.
+  absl::flat_hash_set<std::string> loading_writes;
+
+  // The keys of every hash slot in cluster mode and empty otherwise, see ClusterConfig.
+  // Lets the cluster commands reach the keys of a slot without scanning the table.
+  std::vector<absl::flat_hash_set<std::string>> slot_keys;
+  std::vector<SlotStats> slot_stats;
 
   mutable DbTableStats stats;
-  ExpireTable::Cursor expire_cursor;
+
+  // The hashes of the keys with a deadline, by deadline, see DbSlice::ExpireWheelStep.
+  ExpireWheel expire_wheel;
+  PrimeTable::Cursor expire_cursor;
+
+  // Set while the deadlines of the previous expire generation are moved to the current expire
+  // base, see DbSlice::RebaseExpireStep.
+  bool expire_rebase_pending = false;
+  PrimeTable::Cursor expire_rebase_cursor;
+
   PrimeTable::Cursor prime_cursor;
+  PrimeTable::Cursor freq_decay_cursor;
+  uint64_t freq_pass_start_ms = 0;  // when the current pass of freq_decay_cursor started.
+  uint64_t freq_pass_ms = 0;        // duration of the previous pass.
+  PrimeTable::Cursor eviction_cursor;  // see DbSlice::EvictSampled.
+  PrimeTable::Cursor member_expire_cursor;
+  PrimeTable::Cursor ts_trim_cursor;
+
+  // Directory cursor of the incremental table shrinking.
+  size_t prime_shrink_cursor = 0;
 
   explicit DbTable(std::pmr::memory_resource* mr);
   ~DbTable();
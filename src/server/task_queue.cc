@@ -0,0 +1,119 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/task_queue.h"
+
+#include <absl/numeric/bits.h>
+
+#include "base/logging.h"
+#include "facade/fault_injection.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// How many tasks we run before letting other fibers of the shard thread to progress.
+constexpr unsigned kMaxBatch = 64;
+
+}  // namespace
+
+// The cells implement Dmitry Vyukov's bounded queue: a cell with seq == pos is free for the
+// producer that claims position pos, and seq == pos + 1 marks it as ready for the consumer.
+TaskQueue::TaskQueue(unsigned capacity) {
+  CHECK_GT(capacity, 0u);
+
+  uint64_t sz = absl::bit_ceil(uint64_t(capacity));
+  cells_.reset(new Cell[sz]);
+  mask_ = sz - 1;
+
+  for (uint64_t i = 0; i < sz; ++i) {
+    cells_[i].seq.store(i, memory_order_relaxed);
+  }
+}
+
+TaskQueue::~TaskQueue() {
+  DCHECK(!HasReady());
+}
+
+auto TaskQueue::Reserve() -> Cell* {
+  uint64_t pos = tail_.load(memory_order_relaxed);
+
+  while (true) {
+    Cell* cell = &cells_[pos & mask_];
+    uint64_t seq = cell->seq.load(memory_order_acquire);
+    int64_t diff = int64_t(seq) - int64_t(pos);
+
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+        return cell;
+    } else if (diff < 0) {
+      return nullptr;  // The consumer has not freed the cell yet - the queue is full.
+    } else {
+      pos = tail_.load(memory_order_relaxed);
+    }
+  }
+}
+
+void TaskQueue::Commit(Cell* cell) {
+  uint64_t pos = cell->seq.load(memory_order_relaxed);
+  cell->seq.store(pos + 1, memory_order_release);
+
+  // Does not cost much if the consumer is busy draining the queue.
+  pull_ec_.notify();
+}
+
+bool TaskQueue::HasReady() const {
+  const Cell& cell = cells_[head_ & mask_];
+  return cell.seq.load(memory_order_acquire) == head_ + 1;
+}
+
+unsigned TaskQueue::Drain() {
+  unsigned cnt = 0;
+
+  while (cnt < kMaxBatch && HasReady()) {
+    Cell& cell = cells_[head_ & mask_];
+    facade::InjectFault(facade::FaultPoint::SHARD_QUEUE);
+    cell.run_fn(cell.storage);
+
+    // Frees the cell for the producer that will claim position head_ + capacity.
+    cell.seq.store(head_ + mask_ + 1, memory_order_release);
+    ++head_;
+    ++cnt;
+  }
+
+  return cnt;
+}
+
+void TaskQueue::Run() {
+  while (true) {
+    unsigned cnt = Drain();
+
+    if (cnt > 0) {
+      push_ec_.notifyAll();
+
+      if (cnt == kMaxBatch) {
+        boost::this_fiber::yield();
+        continue;
+      }
+    }
+
+    bool is_closing = false;
+    pull_ec_.await([&] {
+      is_closing = is_closing_.load(memory_order_acquire);
+      return is_closing || HasReady();
+    });
+
+    if (is_closing && !HasReady())
+      break;
+  }
+}
+
+void TaskQueue::Shutdown() {
+  is_closing_.store(true, memory_order_release);
+  pull_ec_.notifyAll();
+}
+
+}  // namespace dfly
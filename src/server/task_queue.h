@@ -0,0 +1,145 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+#include "util/fibers/event_count.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace dfly {
+
+// Bounded multi-producer single-consumer queue of tasks, used to dispatch transaction hops
+// into a shard thread.
+// Unlike FiberQueue, tasks are stored in preallocated cells with inline storage, so enqueuing a
+// small callback does not allocate. Larger callbacks fall back to the heap.
+// The consumer drains all the ready tasks in one go before it goes to sleep, so producers that
+// push while the queue is being drained do not need to wake it up again.
+class TaskQueue {
+ public:
+  // capacity is rounded up to a power of 2.
+  explicit TaskQueue(unsigned capacity);
+  ~TaskQueue();
+
+  TaskQueue(const TaskQueue&) = delete;
+  void operator=(const TaskQueue&) = delete;
+
+  // Enqueues f. Thread-safe. Blocks the calling fiber while the queue is full.
+  template <typename F> void Add(F&& f) {
+    using Fn = std::decay_t<F>;
+
+    if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t)) {
+      Fn fn{std::forward<F>(f)};
+      if (TryPush(fn))
+        return;
+
+      push_ec_.await([&] { return TryPush(fn); });
+    } else {
+      Add([ptr = new Fn(std::forward<F>(f))] {
+        std::unique_ptr<Fn> guard{ptr};
+        (*guard)();
+      });
+    }
+  }
+
+  // Enqueues f unless the queue is full. Thread-safe, never blocks. f must fit the inline storage.
+  template <typename F> bool TryAdd(F&& f) {
+    using Fn = std::decay_t<F>;
+    static_assert(sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t));
+
+    Fn fn{std::forward<F>(f)};
+    return TryPush(fn);
+  }
+
+  // Enqueues f and waits for it to finish. Returns the result of f.
+  template <typename F> auto Await(F&& f) -> decltype(f()) {
+    using ResultType = decltype(f());
+    util::fibers_ext::Done done;
+
+    if constexpr (std::is_void_v<ResultType>) {
+      Add([&f, done]() mutable {
+        f();
+        done.Notify();
+      });
+      done.Wait();
+    } else {
+      std::optional<ResultType> res;
+      Add([&f, &res, done]() mutable {
+        res.emplace(f());
+        done.Notify();
+      });
+      done.Wait();
+      return std::move(*res);
+    }
+  }
+
+  // Returns true if no task is waiting to run. Must be called from the consumer thread.
+  bool Empty() const {
+    return !HasReady();
+  }
+
+  // Runs the tasks until Shutdown() is called. Should run in a dedicated consumer fiber.
+  void Run();
+
+  // Makes Run() exit once the tasks that were already added are processed.
+  void Shutdown();
+
+ private:
+  static constexpr size_t kInlineSize = 48;
+
+  struct alignas(64) Cell {
+    std::atomic_uint64_t seq;
+
+    // Runs and destroys the task stored in storage.
+    void (*run_fn)(void* storage);
+
+    alignas(std::max_align_t) char storage[kInlineSize];
+  };
+
+  // Returns false if the queue is full. Moves fn into the queue on success.
+  template <typename Fn> bool TryPush(Fn& fn) {
+    Cell* cell = Reserve();
+    if (!cell)
+      return false;
+
+    new (cell->storage) Fn(std::move(fn));
+    cell->run_fn = [](void* storage) {
+      Fn* f = reinterpret_cast<Fn*>(storage);
+      (*f)();
+      f->~Fn();
+    };
+    Commit(cell);
+    return true;
+  }
+
+  // Claims the next free cell or returns nullptr if there are none.
+  Cell* Reserve();
+
+  // Publishes a cell claimed by Reserve() to the consumer.
+  void Commit(Cell* cell);
+
+  bool HasReady() const;
+
+  // Runs all the ready tasks. Returns the number of tasks that ran.
+  unsigned Drain();
+
+  std::unique_ptr<Cell[]> cells_;
+  uint64_t mask_;
+
+  // Producers' position. Only the consumer fiber accesses head_.
+  alignas(64) std::atomic_uint64_t tail_{0};
+  alignas(64) uint64_t head_ = 0;
+
+  std::atomic_bool is_closing_{false};
+
+  util::fibers_ext::EventCount pull_ec_;
+  util::fibers_ext::EventCount push_ec_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,102 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/task_queue.h"
+
+#include <gmock/gmock.h>
+
+#include <array>
+#include <numeric>
+
+#include "base/logging.h"
+#include "util/uring/uring_pool.h"
+
+namespace dfly {
+
+using namespace util;
+using namespace std;
+using namespace testing;
+
+class TaskQueueTest : public Test {
+ protected:
+  void SetUp() override {
+    pp_.reset(new uring::UringPool(16, kNumThreads));
+    pp_->Run();
+  }
+
+  void TearDown() override {
+    pp_->Stop();
+    pp_.reset();
+  }
+
+  static constexpr unsigned kNumThreads = 3;
+  unique_ptr<ProactorPool> pp_;
+};
+
+TEST_F(TaskQueueTest, Basic) {
+  TaskQueue queue{4};
+  auto consumer = pp_->at(0)->LaunchFiber([&] { queue.Run(); });
+
+  EXPECT_EQ(42, pp_->at(1)->Await([&] { return queue.Await([] { return 42; }); }));
+
+  // Does not fit into the inline storage of a cell.
+  array<uint64_t, 32> big;
+  big.fill(1);
+  uint64_t sum = pp_->at(1)->Await([&] {
+    return queue.Await([big] { return accumulate(big.begin(), big.end(), uint64_t(0)); });
+  });
+  EXPECT_EQ(32u, sum);
+
+  pp_->at(0)->Await([&] { queue.Shutdown(); });
+  consumer.join();
+}
+
+TEST_F(TaskQueueTest, TryAdd) {
+  TaskQueue queue{2};
+
+  // Nothing consumes the queue yet.
+  unsigned ran = 0;
+  EXPECT_TRUE(queue.TryAdd([&] { ++ran; }));
+  EXPECT_TRUE(queue.TryAdd([&] { ++ran; }));
+  EXPECT_FALSE(queue.TryAdd([&] { ++ran; }));
+
+  auto consumer = pp_->at(0)->LaunchFiber([&] { queue.Run(); });
+  pp_->at(1)->Await([&] { queue.Await([] {}); });
+  EXPECT_EQ(2u, ran);
+
+  pp_->at(0)->Await([&] { queue.Shutdown(); });
+  consumer.join();
+}
+
+TEST_F(TaskQueueTest, MultipleProducers) {
+  constexpr unsigned kNumTasks = 10000;
+
+  // Smaller than the number of concurrent tasks, so that the producers block on a full queue.
+  TaskQueue queue{8};
+  auto consumer = pp_->at(0)->LaunchFiber([&] { queue.Run(); });
+
+  // The consumer is the only one that accesses these.
+  vector<unsigned> next(kNumThreads, 0);
+  unsigned total = 0;
+  bool in_order = true;
+
+  pp_->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    for (unsigned i = 0; i < kNumTasks; ++i) {
+      queue.Add([&, index, i] {
+        in_order &= (next[index] == i);
+        next[index] = i + 1;
+        ++total;
+      });
+    }
+  });
+
+  pp_->at(1)->Await([&] { queue.Await([] {}); });
+  EXPECT_EQ(kNumTasks * kNumThreads, total);
+  EXPECT_TRUE(in_order);
+
+  pp_->at(0)->Await([&] { queue.Shutdown(); });
+  consumer.join();
+}
+
+}  // namespace dfly
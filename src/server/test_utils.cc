@@ -51,8 +51,9 @@ void TestConnection::SendMsgVecAsync(const PubMessage& pmsg) {
   PubMessage dest;
   dest.channel = *backing_str_.back();
 
-  backing_str_.emplace_back(new string(*pmsg.message));
   dest.message = pmsg.message;
+  dest.invalidate = pmsg.invalidate;
+  dest.sharded = pmsg.sharded;
 
   if (!pmsg.pattern.empty()) {
     backing_str_.emplace_back(new string(pmsg.pattern));
@@ -198,6 +199,29 @@ RespExpr BaseFamilyTest::Run(std::string_view id, ArgSlice slice) {
   return e;
 }
 
+vector<string> BaseFamilyTest::RunPipeline(const vector<vector<string>>& cmds) {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunPipeline(cmds); });
+  }
+
+  TestConnWrapper* conn_wrapper = AddFindConn(Protocol::REDIS, GetId());
+  auto* context = conn_wrapper->cmd_cntx();
+
+  vector<CmdArgVec> args_vec;
+  for (const auto& cmd : cmds) {
+    vector<string_view> slice(cmd.begin(), cmd.end());
+    args_vec.push_back(conn_wrapper->Args(ArgSlice{slice.data(), slice.size()}));
+  }
+
+  vector<CmdArgList> args_list;
+  for (auto& args : args_vec) {
+    args_list.emplace_back(args.data(), args.size());
+  }
+
+  service_->DispatchManyCommands(absl::MakeSpan(args_list), context);
+  return conn_wrapper->SplitLines();
+}
+
 auto BaseFamilyTest::RunMC(MP::CmdType cmd_type, string_view key, string_view value, uint32_t flags,
                            chrono::seconds ttl) -> MCResponse {
   if (!ProactorBase::IsProactorThread()) {
@@ -267,6 +291,23 @@ auto BaseFamilyTest::GetMC(MP::CmdType cmd_type, std::initializer_list<std::stri
   return conn->SplitLines();
 }
 
+auto BaseFamilyTest::RunMeta(string_view line, string_view value) -> MCResponse {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunMeta(line, value); });
+  }
+
+  string buf = absl::StrCat(line, "\r\n");
+  MemcacheParser parser;
+  MP::Command cmd;
+  uint32_t consumed = 0;
+  CHECK_EQ(MemcacheParser::OK, parser.Parse(buf, &consumed, &cmd)) << line;
+
+  TestConnWrapper* conn = AddFindConn(Protocol::MEMCACHE, GetId());
+  service_->DispatchMC(cmd, value, conn->cmd_cntx());
+
+  return conn->SplitLines();
+}
+
 int64_t BaseFamilyTest::CheckedInt(std::initializer_list<std::string_view> list) {
   RespExpr resp = Run(list);
   if (resp.type == RespExpr::INT64) {
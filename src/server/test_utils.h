@@ -50,12 +50,18 @@ class BaseFamilyTest : public ::testing::Test {
 
   RespExpr Run(std::string_view id, ArgSlice list);
 
+  // Dispatches cmds together, as a pipelined batch. Returns the lines of all the replies.
+  std::vector<std::string> RunPipeline(const std::vector<std::vector<std::string>>& cmds);
+
   using MCResponse = std::vector<std::string>;
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key, std::string_view value,
                    uint32_t flags = 0, std::chrono::seconds ttl = std::chrono::seconds{});
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key = std::string_view{});
   MCResponse GetMC(MemcacheParser::CmdType cmd_type, std::initializer_list<std::string_view> list);
 
+  // Parses and dispatches a memcache command line, e.g. "mg foo v t".
+  MCResponse RunMeta(std::string_view line, std::string_view value = std::string_view{});
+
   int64_t CheckedInt(std::initializer_list<std::string_view> list);
 
   bool IsLocked(DbIndex db_index, std::string_view key) const;
@@ -5,7 +5,10 @@
 #include "server/tiered_storage.h"
 
 extern "C" {
+#include "redis/intset.h"
+#include "redis/listpack.h"
 #include "redis/object.h"
+#include "redis/zmalloc.h"
 }
 
 #include <mimalloc.h>
@@ -13,10 +16,38 @@ extern "C" {
 #include "base/flags.h"
 #include "base/logging.h"
 #include "server/db_slice.h"
+#include "util/fibers/fibers_ext.h"
 #include "util/proactor_base.h"
 
 ABSL_FLAG(uint32_t, tiered_storage_max_pending_writes, 32,
           "Maximal number of pending writes per thread");
+ABSL_FLAG(uint32_t, tiered_promote_reads, 4,
+          "Number of recent reads after which an external value is moved back to memory. "
+          "0 - never promote");
+ABSL_FLAG(uint32_t, tiered_compact_interval_ms, 1000,
+          "How often the backing file is checked for sparse pages. 0 - never compact");
+ABSL_FLAG(double, tiered_compact_page_util, 0.25,
+          "Pages of the backing file with smaller ratio of live blocks are compacted");
+ABSL_FLAG(uint32_t, tiered_container_min_size, 4096,
+          "Listpack hashes and zsets and intsets of at least this many bytes are offloaded "
+          "when they are not accessed between two scans. 0 - keep containers in memory");
+ABSL_FLAG(bool, tiered_reuse_backing_file, false,
+          "If true, snapshots reference the offloaded values in the backing files instead of "
+          "storing them, and the backing files are not truncated on startup, so the restart "
+          "loads only the in-memory values. Requires the same backing_prefix and number of "
+          "threads across restarts");
+ABSL_FLAG(double, tiered_offload_watermark, 0.8,
+          "Once the used memory of a shard crosses this fraction of its maxmemory share, cold "
+          "values are offloaded from the heartbeat. 0 - offload only on writes");
+ABSL_FLAG(uint32_t, tiered_offload_max_freq, 1,
+          "Keys with higher access frequency are not offloaded by the memory pressure scan");
+ABSL_FLAG(uint32_t, tiered_offload_max_latency_usec, 2000,
+          "The memory pressure scan slows down proportionally when the average disk write "
+          "latency is above this value. 0 - do not throttle");
+ABSL_FLAG(uint64_t, tiered_max_file_size, 0,
+          "The backing file of a shard does not grow beyond this many bytes. In cache mode the "
+          "evicted values are offloaded until the file is full and deleted afterwards. "
+          "0 - unlimited");
 
 namespace dfly {
 using namespace std;
@@ -56,6 +87,56 @@ struct EntryHash {
 const size_t kBatchSize = 4096;
 const size_t kPageAlignment = 4096;
 
+// Items are packed into 4k batches from the start of the page, while the page index grows
+// backwards from its end. We need to support migration of keys to other pages, for that the
+// index stores the hash id of each serialized entry (8 bytes) as a back reference to it in the
+// PrimeTable. A page is released once all its items are freed.
+constexpr size_t kIndexEntrySize = 8;
+constexpr size_t kMaxItemLen = kBatchSize - kIndexEntrySize;
+
+// Every that many reads the hit counters are halved, so a value must stay hot to be promoted
+// and a value that was hot yesterday does not get promoted by a single read today.
+constexpr uint32_t kAgingPeriod = 1024;
+
+constexpr unsigned kMaxCompactPages = 4;
+
+// Number of buckets the compaction traverses before it relocates the values it found.
+constexpr unsigned kCompactBucketsPerStep = 64;
+
+// Number of buckets the container scan visits every interval.
+constexpr unsigned kOffloadBucketsPerStep = 256;
+
+// Number of buckets the memory pressure scan visits every heartbeat, at the watermark and at
+// the memory limit.
+constexpr unsigned kMinPressureBuckets = 16;
+constexpr unsigned kMaxPressureBuckets = 1024;
+
+// Returns the contiguous blob of a container that can be written as is, or an empty span.
+io::Bytes ContainerBlob(const PrimeValue& pv) {
+  if (pv.IsExternal() || !pv.RObjPtr())
+    return {};
+
+  unsigned type = pv.ObjType();
+  unsigned encoding = pv.Encoding();
+  if ((type == OBJ_HASH && encoding == kEncodingListPack) ||
+      (type == OBJ_ZSET && encoding == OBJ_ENCODING_LISTPACK)) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    return io::Bytes{lp, lpBytes(lp)};
+  }
+
+  if (type == OBJ_SET && encoding == kEncodingIntSet) {
+    intset* is = (intset*)pv.RObjPtr();
+    return io::Bytes{reinterpret_cast<uint8_t*>(is), intsetBlobLen(is)};
+  }
+
+  return {};
+}
+
+constexpr inline size_t alignup(size_t num, size_t align) {
+  size_t amask = align - 1;
+  return (num + amask) & (~amask);
+}
+
 struct TieredStorage::ActiveIoRequest {
   size_t file_offset;
 
@@ -67,56 +148,82 @@ struct TieredStorage::ActiveIoRequest {
                       mi_stl_allocator<std::pair<const IndexKey, size_t>>>*/
   absl::flat_hash_map<IndexKey, size_t, EntryHash, std::equal_to<>> entries;
 
-  explicit ActiveIoRequest(size_t file_offs) : file_offset(file_offs), batch_offs(0) {
-    block_ptr = (char*)mi_malloc_aligned(kBatchSize, kPageAlignment);
+  IoMgr* io_mgr;
+
+  // The block is serialized right into a registered io buffer, so the write needs no copy.
+  ActiveIoRequest(size_t file_offs, IoMgr* mgr)
+      : file_offset(file_offs), batch_offs(0), io_mgr(mgr) {
+    block_ptr = (char*)io_mgr->AllocBuffer(kBatchSize);
     DCHECK_EQ(0u, intptr_t(block_ptr) % kPageAlignment);
   }
 
   ~ActiveIoRequest() {
-    mi_free(block_ptr);
+    io_mgr->FreeBuffer(reinterpret_cast<uint8_t*>(block_ptr), kBatchSize);
   }
 
   bool CanAccommodate(size_t length) const {
-    return batch_offs + length <= kBatchSize;
+    return batch_offs + length + (entries.size() + 1) * kIndexEntrySize <= kBatchSize;
   }
 
   void Serialize(IndexKey ikey, const CompactObj& co);
 };
 
-// we need to support migration of keys to other pages.
-// for that we store hash id of each serialized entry (8 bytes) as a back reference to
-// it in the PrimeTable.
-// Each 4k batch will contain at most 56 entries (56*64 + 56*8 = 4032).
-// we will need 56*8=448 bytes header for hash entries.
-constexpr size_t kHeaderSize = 448;
+// Reads whole pages, so that it can serve all the items of a multi-item batch.
+struct TieredStorage::PendingRead {
+  struct Waiter {
+    size_t offset;
+    size_t len;
+    ReadCb cb;
+  };
+
+  size_t read_offs;
+  size_t read_len;
+  uint8_t* buf;
+
+  std::vector<Waiter> waiters;
+
+  // Frees of ranges in the page that arrived while the read was in flight.
+  std::vector<std::pair<size_t, size_t>> deferred_frees;
+
+  IoMgr* io_mgr;
+
+  PendingRead(size_t offs, size_t len, IoMgr* mgr) : read_offs(offs), read_len(len), io_mgr(mgr) {
+    buf = io_mgr->AllocBuffer(len);
+  }
+
+  ~PendingRead() {
+    io_mgr->FreeBuffer(buf, read_len);
+  }
+
+  bool Covers(size_t offset, size_t len) const {
+    return offset >= read_offs && offset + len <= read_offs + read_len;
+  }
+
+  bool Overlaps(size_t offset, size_t len) const {
+    return offset < read_offs + read_len && read_offs < offset + len;
+  }
+};
+
+struct TieredStorage::Relocation {
+  DbIndex db_index;
+  std::string key;
+  size_t offset;
+  size_t len;
+};
 
 void TieredStorage::ActiveIoRequest::Serialize(IndexKey ikey, const CompactObj& co) {
   DCHECK(!co.HasIoPending());
 
   size_t item_size = co.Size();
-  DCHECK_LE(item_size + batch_offs, kBatchSize);
-  bool single_item = false;
-  if (batch_offs == 0) {
-    DCHECK_EQ(0u, file_offset % 4096);
-
-    if (item_size < kBatchSize / 2) {
-      batch_offs = kHeaderSize;
-    } else {
-      single_item = true;
-    }
-  }
+  DCHECK(CanAccommodate(item_size));
   co.GetString(block_ptr + batch_offs);
 
   bool added = entries.emplace(move(ikey), file_offset + batch_offs).second;
   CHECK(added);
-  if (single_item) {
-    batch_offs = kBatchSize;
-  } else {
-    uint64_t hc = co.HashCode();
-    unsigned entry_index = entries.size() - 1;
-    absl::little_endian::Store64(block_ptr + entry_index * 8, hc);
-    batch_offs += item_size;  // saved into opened block.
-  }
+
+  uint64_t hc = co.HashCode();
+  absl::little_endian::Store64(block_ptr + kBatchSize - entries.size() * kIndexEntrySize, hc);
+  batch_offs += item_size;  // saved into opened block.
 }
 
 TieredStorage::TieredStorage(DbSlice* db_slice) : db_slice_(*db_slice), pending_req_(256) {
@@ -125,54 +232,573 @@ TieredStorage::TieredStorage(DbSlice* db_slice) : db_slice_(*db_slice), pending_
 TieredStorage::~TieredStorage() {
   for (auto* db : db_arr_)
     delete db;
+  DCHECK(pending_reads_.empty());
 }
 
 error_code TieredStorage::Open(const string& path) {
-  error_code ec = io_mgr_.Open(path);
+  bool reuse = GetFlag(FLAGS_tiered_reuse_backing_file);
+  error_code ec = io_mgr_.Open(path, reuse);
   if (!ec) {
+    // The snapshot that we are going to load may reference any range of the file.
+    hold_frees_ = reuse;
+
     if (io_mgr_.Span()) {  // Add initial storage.
       alloc_.AddStorage(0, io_mgr_.Span());
     }
+
+    if (GetFlag(FLAGS_tiered_compact_interval_ms)) {
+      background_fb_ = util::ProactorBase::me()->LaunchFiber([this] { BackgroundFiber(); });
+    }
   }
   return ec;
 }
 
 std::error_code TieredStorage::Read(size_t offset, size_t len, char* dest) {
+  error_code ec;
+  util::fibers_ext::Done done;
+
+  ReadAsync(offset, len, [&](error_code res, string_view data) {
+    ec = res;
+    if (!ec)
+      memcpy(dest, data.data(), len);
+    done.Notify();
+  });
+  done.Wait();
+
+  return ec;
+}
+
+void TieredStorage::ReadAsync(size_t offset, size_t len, ReadCb cb) {
+  DCHECK_GT(len, 0u);
   stats_.external_reads++;
 
-  return io_mgr_.Read(offset, io::MutableBytes{reinterpret_cast<uint8_t*>(dest), len});
+  uint32_t page = offset / kPageAlignment;
+  auto it = pending_reads_.find(page);
+  if (it != pending_reads_.end()) {
+    // A range that goes past the read in flight is read once it finishes, see FinishRead.
+    it->second->waiters.push_back({offset, len, move(cb)});
+    if (it->second->Covers(offset, len))
+      stats_.external_coalesced_reads++;
+    return;
+  }
+
+  size_t read_offs = size_t(page) * kPageAlignment;
+  size_t read_len = alignup(offset + len, kPageAlignment) - read_offs;
+  PendingRead* pr = new PendingRead(read_offs, read_len, &io_mgr_);
+  pr->waiters.push_back({offset, len, move(cb)});
+  pending_reads_.emplace(page, pr);
+
+  error_code ec = io_mgr_.ReadAsync(read_offs, io::MutableBytes{pr->buf, read_len},
+                                    [this, page](int io_res) { FinishRead(page, io_res); });
+  if (ec) {
+    FinishRead(page, -ec.value());
+  }
+}
+
+void TieredStorage::FinishRead(uint32_t page, int io_res) {
+  auto it = pending_reads_.find(page);
+  CHECK(it != pending_reads_.end());
+
+  // Erase before running the callbacks, so that they can issue reads of their own.
+  unique_ptr<PendingRead> pr{it->second};
+  pending_reads_.erase(it);
+
+  error_code ec;
+  if (io_res < 0) {
+    LOG(ERROR) << "Error reading from ssd file: " << util::detail::SafeErrorMessage(-io_res);
+    ec = error_code{-io_res, system_category()};
+  } else if (size_t(io_res) < pr->read_len) {
+    ec = make_error_code(errc::io_error);
+  }
+
+  for (auto& waiter : pr->waiters) {
+    if (!ec && !pr->Covers(waiter.offset, waiter.len)) {
+      ReadAsync(waiter.offset, waiter.len, move(waiter.cb));
+      continue;
+    }
+
+    string_view data;
+    if (!ec) {
+      data = string_view{reinterpret_cast<char*>(pr->buf) + waiter.offset - pr->read_offs,
+                         waiter.len};
+    }
+    waiter.cb(ec, data);
+  }
+
+  for (auto [offset, len] : pr->deferred_frees) {
+    FreeAfterReads(offset, len);
+  }
+}
+
+bool TieredStorage::TryPromote(DbIndex db_index, string_view key, size_t offset,
+                               string_view value) {
+  unsigned threshold = GetFlag(FLAGS_tiered_promote_reads);
+  if (threshold == 0)
+    return false;
+
+  AgeReadHits();
+
+  uint8_t& hits = read_hits_[offset];
+  if (hits < UINT8_MAX)
+    ++hits;
+  if (hits < threshold)
+    return false;
+
+  if (LoadBack(db_index, key, offset, value).is_done())
+    return false;
+
+  ++stats_.external_promotions;
+  return true;
+}
+
+PrimeIterator TieredStorage::LoadBack(DbIndex db_index, string_view key, size_t offset,
+                                      string_view value) {
+  // The database could have been flushed since the value was read.
+  if (!db_slice_.IsDbValid(db_index))
+    return PrimeIterator{};
+
+  PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+  PrimeIterator it = pt->Find(key);
+
+  // The value could have been changed since it was read.
+  if (it.is_done() || !it->second.IsExternal() || it->second.GetExternalPtr().first != offset)
+    return PrimeIterator{};
+
+  // Do not change the value under transactions that hold the key.
+  string_view key_arr[1] = {key};
+  if (!db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{db_index, key_arr, 1}))
+    return PrimeIterator{};
+
+  PrimeValue& pv = it->second;
+  size_t len = pv.GetExternalPtr().second;
+  DCHECK_EQ(len, value.size());
+
+  pv.SetString(value);
+
+  auto* stats = db_slice_.MutableStats(db_index);
+  size_t heap_size = pv.MallocUsed();
+  stats->obj_memory_usage += heap_size;
+  stats->strval_memory_usage += heap_size;
+  db_slice_.AccountSlotMemory(db_index, it->first, heap_size);
+
+  Free(db_index, offset, len);
+
+  return it;
+}
+
+void TieredStorage::AgeReadHits() {
+  if (++reads_since_aging_ < kAgingPeriod)
+    return;
+
+  reads_since_aging_ = 0;
+  for (auto it = read_hits_.begin(); it != read_hits_.end();) {
+    it->second >>= 1;
+    if (it->second == 0) {
+      read_hits_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
 }
 
 void TieredStorage::Free(DbIndex db_indx, size_t offset, size_t len) {
-  if (offset % 4096 == 0) {
-    alloc_.Free(offset, len);
+  auto* stats = db_slice_.MutableStats(db_indx);
+  stats->external_entries -= 1;
+  stats->external_size -= len;
+  read_hits_.erase(offset);
+
+  FreeAfterReads(offset, len);
+}
+
+void TieredStorage::FreeAfterReads(size_t offset, size_t len) {
+  // Reads of the range are in flight - do not let a write reuse it until they finish.
+  // Range reads may start in any page of the item, see OpGetRange.
+  for (const auto& [page, pr] : pending_reads_) {
+    if (pr->Overlaps(offset, len)) {
+      pr->deferred_frees.emplace_back(offset, len);
+      return;
+    }
+  }
+
+  FreeRange(offset, len);
+}
+
+void TieredStorage::FreeRange(size_t offset, size_t len) {
+  if (hold_frees_) {
+    held_frees_.emplace_back(offset, len);
+    return;
+  }
+
+  ReleaseRange(offset, len);
+}
+
+void TieredStorage::ReleaseRange(size_t offset, size_t len) {
+  size_t page_size = 0;
+  size_t offs_page = offset / kBatchSize;
+  auto it = multi_cnt_.find(offs_page);
+
+  if (it == multi_cnt_.end()) {
+    // A blob that was written on its own, i.e. a container.
+    page_size = alloc_.Free(offset, len);
   } else {
-    size_t offs_page = offset / 4096;
-    auto it = multi_cnt_.find(offs_page);
-    CHECK(it != multi_cnt_.end()) << offs_page;
     MultiBatch& mb = it->second;
-    CHECK_GE(mb.used, len);
-    mb.used -= len;
-    if (mb.used == 0) {
-      alloc_.Free(offs_page * 4096, ExternalAllocator::kMinBlockSize);
+    CHECK_GT(mb.refs, 0u);
+    if (--mb.refs == 0) {
+      page_size = alloc_.Free(offs_page * kBatchSize, kBatchSize);
       VLOG(1) << "multi_cnt_ erase " << it->first;
       multi_cnt_.erase(it);
     }
   }
 
-  auto* stats = db_slice_.MutableStats(db_indx);
-  stats->external_entries -= 1;
-  stats->external_size -= len;
+  // The allocator page became unused - return its space to the file system. A large blob has
+  // a range of its own.
+  if (page_size) {
+    bool large = detail::ClassFromSize(len) == detail::LARGE_P;
+    io_mgr_.PunchHoleAsync(large ? offset : offset & ~(page_size - 1), page_size);
+    stats_.external_punched_bytes += page_size;
+  }
+}
+
+bool TieredStorage::KeepsExternalInSnapshots() {
+  return GetFlag(FLAGS_tiered_reuse_backing_file);
+}
+
+error_code TieredStorage::Adopt(DbIndex db_index, const PrimeValue& pv) {
+  DCHECK(pv.IsExternal());
+  auto [offset, len] = pv.GetExternalPtr();
+
+  bool claimed = true;
+  if (pv.ObjType() == OBJ_STRING) {
+    // Strings share their pages, see FinishIoRequest. The page is claimed by its first item.
+    uint32_t page = offset / kBatchSize;
+    auto [it, inserted] = multi_cnt_.try_emplace(page, 0);
+    if (inserted) {
+      claimed = alloc_.Claim(size_t(page) * kBatchSize, kBatchSize);
+      if (!claimed)
+        multi_cnt_.erase(it);
+    }
+    if (claimed)
+      ++it->second.refs;
+  } else {
+    claimed = alloc_.Claim(offset, len);
+  }
+
+  if (!claimed) {
+    LOG(ERROR) << "External value at " << offset << "/" << len
+               << " does not match the backing file";
+    return make_error_code(errc::invalid_argument);
+  }
+
+  auto* stats = db_slice_.MutableStats(db_index);
+  stats->external_entries += 1;
+  stats->external_size += len;
+
+  return error_code{};
+}
+
+void TieredStorage::OnSnapshotStart() {
+  hold_frees_ = true;
+  snapshot_frees_.insert(snapshot_frees_.end(), held_frees_.begin(), held_frees_.end());
+  held_frees_.clear();
+}
+
+error_code TieredStorage::OnSnapshotSaved() {
+  // The snapshot must not reference data that is lost on a crash.
+  error_code ec = io_mgr_.Fsync();
+  if (ec)
+    return ec;
+
+  vector<pair<size_t, size_t>> frees = std::move(snapshot_frees_);
+  snapshot_frees_.clear();
+  for (auto [offset, len] : frees) {
+    ReleaseRange(offset, len);
+  }
+
+  return ec;
 }
 
 void TieredStorage::Shutdown() {
+  is_shutting_down_ = true;
+  compaction_done_.Notify();
+  if (background_fb_.joinable()) {
+    background_fb_.join();
+  }
+
   io_mgr_.Shutdown();
 }
 
+void TieredStorage::BackgroundFiber() {
+  auto interval = chrono::milliseconds(GetFlag(FLAGS_tiered_compact_interval_ms));
+
+  while (!compaction_done_.WaitFor(interval)) {
+    if (GetFlag(FLAGS_tiered_container_min_size)) {
+      OffloadContainersStep();
+    }
+
+    auto pages = alloc_.GetSparsePages(GetFlag(FLAGS_tiered_compact_page_util), kMaxCompactPages);
+    if (!pages.empty()) {
+      CompactPages(pages);
+    }
+  }
+}
+
+error_code TieredStorage::LoadExternal(const PrimeValue& pv, PrimeValue* dest) {
+  auto [offset, len] = pv.GetExternalPtr();
+  unsigned type = pv.ObjType();
+  unsigned encoding = pv.Encoding();
+
+  if (type == OBJ_STRING) {
+    string tmp(len, '\0');
+    error_code ec = Read(offset, len, tmp.data());
+    if (!ec)
+      dest->SetString(tmp);
+    return ec;
+  }
+
+  // Containers were written as their raw blobs, so reading them back restores the object.
+  char* blob = (char*)zmalloc(len);
+  error_code ec = Read(offset, len, blob);
+  if (ec) {
+    zfree(blob);
+    return ec;
+  }
+
+  dest->InitRobj(type, encoding, blob);
+  return ec;
+}
+
+error_code TieredStorage::FaultIn(DbIndex db_index, PrimeIterator it) {
+  PrimeValue& pv = it->second;
+  DCHECK(pv.IsExternal());
+  DCHECK_NE(OBJ_STRING, pv.ObjType());
+
+  auto [offset, len] = pv.GetExternalPtr();
+  PrimeValue loaded;
+  error_code ec = LoadExternal(pv, &loaded);
+  if (ec)
+    return ec;
+
+  // InitRobj resets the mask bits, so we carry over the ones that describe the entry.
+  bool has_expire = pv.HasExpire(), has_flag = pv.HasFlag(), sticky = pv.IsSticky();
+  ExpirePeriod period = pv.expire_period();
+  pv = std::move(loaded);
+  pv.set_expire_period(period);
+  pv.SetExpire(has_expire);
+  pv.SetFlag(has_flag);
+  pv.SetSticky(sticky);
+  pv.SetTouched(true);
+
+  auto* stats = db_slice_.MutableStats(db_index);
+  stats->obj_memory_usage += pv.MallocUsed();
+  db_slice_.AccountSlotMemory(db_index, it->first, pv.MallocUsed());
+  Free(db_index, offset, len);
+  ++stats_.external_promotions;
+
+  return ec;
+}
+
+void TieredStorage::OffloadContainersStep() {
+  size_t min_size = GetFlag(FLAGS_tiered_container_min_size);
+  unsigned max_requests = GetFlag(FLAGS_tiered_storage_max_pending_writes);
+
+  if (offload_db_ >= db_slice_.db_array_size())
+    offload_db_ = 0;
+  if (!db_slice_.IsDbValid(offload_db_)) {
+    ++offload_db_;
+    offload_cursor_ = 0;
+    return;
+  }
+
+  DbIndex db_index = offload_db_;
+  PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+
+  // Each container gets a second chance: a scan clears its touched bit and the next scan
+  // offloads it unless it was looked up in between.
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (pv.ObjType() == OBJ_STRING || pv.IsExternal() || pv.HasIoPending())
+      return;
+
+    if (pv.IsTouched()) {
+      pv.SetTouched(false);
+      return;
+    }
+
+    io::Bytes blob = ContainerBlob(pv);
+    if (blob.size() < min_size || num_active_requests_ >= max_requests)
+      return;
+
+    string key = it->first.ToString();
+    string_view key_arr[1] = {key};
+    if (!db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{db_index, key_arr, 1}))
+      return;
+
+    UnloadContainer(db_index, std::move(key), it, blob);
+  };
+
+  for (unsigned i = 0; i < kOffloadBucketsPerStep; ++i) {
+    offload_cursor_ = pt->Traverse(offload_cursor_, cb);
+    if (!offload_cursor_) {
+      ++offload_db_;
+      break;
+    }
+  }
+}
+
+bool TieredStorage::UnloadContainer(DbIndex db_index, string key, PrimeIterator it,
+                                    io::Bytes blob) {
+  int64_t res = alloc_.Malloc(blob.size());
+  if (res < 0) {
+    InitiateGrow(-res);
+    return false;
+  }
+
+  size_t offset = res;
+  size_t buf_len = alignup(blob.size(), kPageAlignment);
+  char* buf = (char*)io_mgr_.AllocBuffer(buf_len);
+  memcpy(buf, blob.data(), blob.size());
+  memset(buf + blob.size(), 0, buf_len - blob.size());
+
+  // Any change of the container until the write finishes resets the bit, see DbSlice::PreUpdate.
+  it->second.SetIoPending(true);
+
+  uint64_t start_ns = util::ProactorBase::GetMonotonicTimeNs();
+  auto cb = [this, db_index, key = std::move(key), offset, len = blob.size(), buf,
+             start_ns](int io_res) {
+    RecordWriteLatency(start_ns);
+    FinishContainerWrite(io_res, db_index, key, offset, len);
+    io_mgr_.FreeBuffer(reinterpret_cast<uint8_t*>(buf), alignup(len, kPageAlignment));
+  };
+
+  ++num_active_requests_;
+  io_mgr_.WriteAsync(offset, string_view{buf, buf_len}, std::move(cb));
+  ++stats_.external_writes;
+  return true;
+}
+
+void TieredStorage::FinishContainerWrite(int io_res, DbIndex db_index, string_view key,
+                                         size_t offset, size_t len) {
+  --num_active_requests_;
+  if (num_active_requests_ == GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
+    active_req_sem_.notifyAll();
+  }
+
+  PrimeIterator it;
+  if (db_slice_.IsDbValid(db_index)) {
+    it = db_slice_.GetPrimeTable(db_index)->Find(key);
+  }
+
+  bool is_valid = (io_res >= 0) && !it.is_done() && it->second.HasIoPending();
+  if (is_valid) {
+    string_view key_arr[1] = {key};
+    is_valid = db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{db_index, key_arr, 1});
+  }
+
+  if (!is_valid) {
+    // The container was changed, deleted or is being used - the written copy is dropped.
+    LOG_IF(ERROR, io_res < 0) << "Error writing into ssd file: "
+                              << util::detail::SafeErrorMessage(-io_res);
+    if (!it.is_done())
+      it->second.SetIoPending(false);
+    FreeRange(offset, len);
+    return;
+  }
+
+  PrimeValue& pv = it->second;
+  pv.SetIoPending(false);
+
+  auto* stats = db_slice_.MutableStats(db_index);
+  stats->obj_memory_usage -= pv.MallocUsed();
+  db_slice_.AccountSlotMemory(db_index, it->first, -ssize_t(pv.MallocUsed()));
+
+  pv.SetExternal(offset, len, pv.ObjType(), pv.Encoding());
+  stats->external_entries += 1;
+  stats->external_size += len;
+  ++stats_.external_demotions;
+}
+
+// The live values of the pages are moved back to memory and their buckets are queued for
+// unloading, so FlushPending packs them into fresh pages using the regular batched writes.
+// The sparse pages are not used for new allocations, and once their last block is freed,
+// FreeRange punches them out of the file.
+void TieredStorage::CompactPages(const vector<pair<size_t, size_t>>& pages) {
+  auto in_pages = [&](size_t offset) {
+    for (auto [start, len] : pages) {
+      if (offset >= start && offset < start + len)
+        return true;
+    }
+    return false;
+  };
+
+  vector<Relocation> relocations;
+
+  for (DbIndex db_index = 0; db_index < db_slice_.db_array_size(); ++db_index) {
+    PrimeTable::Cursor cursor;
+
+    do {
+      // The database could have been flushed while we waited for the reads.
+      if (!db_slice_.IsDbValid(db_index))
+        break;
+
+      PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+      auto cb = [&](PrimeIterator it) {
+        const PrimeValue& pv = it->second;
+        if (pv.IsExternal() && in_pages(pv.GetExternalPtr().first)) {
+          auto [offset, len] = pv.GetExternalPtr();
+          relocations.push_back({db_index, it->first.ToString(), offset, len});
+        }
+      };
+
+      for (unsigned i = 0; i < kCompactBucketsPerStep; ++i) {
+        cursor = pt->Traverse(cursor, cb);
+        if (!cursor)
+          break;
+      }
+
+      Relocate(&relocations);
+      if (is_shutting_down_)
+        return;
+    } while (cursor);
+  }
+}
+
+void TieredStorage::Relocate(vector<Relocation>* relocations) {
+  if (relocations->empty()) {
+    ::boost::this_fiber::yield();
+    return;
+  }
+
+  util::fibers_ext::BlockingCounter bc(relocations->size());
+
+  for (const Relocation& rel : *relocations) {
+    auto cb = [this, &rel, bc](error_code ec, string_view data) mutable {
+      if (!ec) {
+        PrimeIterator it = LoadBack(rel.db_index, rel.key, rel.offset, data);
+        if (!it.is_done()) {
+          pending_req_.EmplaceOrOverride(PendingReq{it.bucket_cursor().value(), rel.db_index});
+          ++stats_.external_relocations;
+        }
+      }
+      bc.Dec();
+    };
+    ReadAsync(rel.offset, rel.len, std::move(cb));
+  }
+
+  bc.Wait();
+  relocations->clear();
+
+  if (!pending_req_.empty() && !io_mgr_.grow_pending() &&
+      num_active_requests_ < GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
+    FlushPending();
+  }
+}
+
 TieredStats TieredStorage::GetStats() const {
   TieredStats res = stats_;
   res.storage_capacity = alloc_.capacity();
   res.storage_reserved = alloc_.allocated_bytes();
+  res.storage_free = alloc_.free_range_bytes();
+  res.storage_max_free_range = alloc_.max_free_range();
 
   return res;
 }
@@ -186,7 +812,11 @@ void TieredStorage::SendIoRequest(ActiveIoRequest* req) {
   active_req_sem_.await(
       [this] { return num_active_requests_ <= GetFlag(FLAGS_tiered_storage_max_pending_writes); });
 
-  auto cb = [this, req](int res) { FinishIoRequest(res, req); };
+  uint64_t start_ns = util::ProactorBase::GetMonotonicTimeNs();
+  auto cb = [this, req, start_ns](int res) {
+    RecordWriteLatency(start_ns);
+    FinishIoRequest(res, req);
+  };
   ++num_active_requests_;
   io_mgr_.WriteAsync(req->file_offset, sv, move(cb));
   ++stats_.external_writes;
@@ -197,38 +827,37 @@ void TieredStorage::SendIoRequest(ActiveIoRequest* req) {
 }
 
 void TieredStorage::FinishIoRequest(int io_res, ActiveIoRequest* req) {
-  if (io_res < 0) {
-    LOG(ERROR) << "Error writing into ssd file: " << util::detail::SafeErrorMessage(-io_res);
-    for (const auto& k_v : req->entries) {
-      const IndexKey& ikey = k_v.first;
-      PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
-      PrimeIterator it = pt->Find(ikey.key);
-      CHECK(it->second.HasIoPending());
-      it->second.SetIoPending(false);
-    }
-  } else {
-    uint16_t used_total = 0;
-
-    for (const auto& k_v : req->entries) {
-      const IndexKey& ikey = k_v.first;
-
-      size_t item_offset = k_v.second;
-      CHECK_EQ(item_offset / 4096, req->file_offset / 4096);
-      PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
-      PrimeIterator it = pt->Find(ikey.key);
-      CHECK(!it.is_done()) << "TBD";
-      CHECK(it->second.HasIoPending());
-
-      it->second.SetIoPending(false);
-      size_t item_size = it->second.Size();
-      SetExternal(ikey.db_indx, item_offset, &it->second);
-      used_total += item_size;
-    }
+  LOG_IF(ERROR, io_res < 0) << "Error writing into ssd file: "
+                            << util::detail::SafeErrorMessage(-io_res);
+  uint16_t refs = 0;
+
+  for (const auto& k_v : req->entries) {
+    const IndexKey& ikey = k_v.first;
+    if (!db_slice_.IsDbValid(ikey.db_indx))
+      continue;
+
+    PrimeTable* pt = db_slice_.GetPrimeTable(ikey.db_indx);
+    PrimeIterator it = pt->Find(ikey.key);
+
+    // The entry could have been deleted while the write was in flight.
+    if (it.is_done() || !it->second.HasIoPending())
+      continue;
+
+    it->second.SetIoPending(false);
+    if (io_res < 0)
+      continue;
+
+    size_t item_offset = k_v.second;
+    CHECK_EQ(item_offset / kBatchSize, req->file_offset / kBatchSize);
+    SetExternal(ikey.db_indx, item_offset, it);
+    ++refs;
+  }
 
-    CHECK_GT(req->entries.size(), 1u);  // multi-item batch
-    MultiBatch mb{used_total};
-    VLOG(1) << "multi_cnt_ emplace " << req->file_offset / 4096;
-    multi_cnt_.emplace(req->file_offset / 4096, mb);
+  if (refs) {
+    VLOG(1) << "multi_cnt_ emplace " << req->file_offset / kBatchSize;
+    multi_cnt_.emplace(req->file_offset / kBatchSize, MultiBatch{refs});
+  } else {
+    alloc_.Free(req->file_offset, kBatchSize);
   }
 
   delete req;
@@ -240,16 +869,19 @@ void TieredStorage::FinishIoRequest(int io_res, ActiveIoRequest* req) {
   VLOG_IF(1, num_active_requests_ == 0) << "Finished active requests";
 }
 
-void TieredStorage::SetExternal(DbIndex db_index, size_t item_offset, PrimeValue* dest) {
+void TieredStorage::SetExternal(DbIndex db_index, size_t item_offset, PrimeIterator it) {
   auto* stats = db_slice_.MutableStats(db_index);
+  PrimeValue* dest = &it->second;
 
   size_t heap_size = dest->MallocUsed();
   size_t item_size = dest->Size();
 
   stats->obj_memory_usage -= heap_size;
   stats->strval_memory_usage -= heap_size;
+  db_slice_.AccountSlotMemory(db_index, it->first, -ssize_t(heap_size));
 
   dest->SetExternal(item_offset, item_size);
+  ++stats_.external_demotions;
 
   stats->external_entries += 1;
   stats->external_size += item_size;
@@ -265,10 +897,10 @@ bool TieredStorage::ShouldFlush() {
 error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
   CHECK_EQ(OBJ_STRING, it->second.ObjType());
 
+  // Larger values do not fit into a page and stay in memory.
   size_t blob_len = it->second.Size();
-  if (blob_len >= kBatchSize / 2 &&
-      num_active_requests_ < GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
-    LOG(FATAL) << "TBD";
+  if (blob_len > kMaxItemLen) {
+    return make_error_code(errc::value_too_large);
   }
   error_code ec;
 
@@ -290,7 +922,12 @@ error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
 }
 
 bool IsObjFitToUnload(const PrimeValue& pv) {
-  return pv.ObjType() == OBJ_STRING && !pv.IsExternal() && pv.Size() >= 64 && !pv.HasIoPending();
+  // Sparse bitmaps are already compact, and their raw form may be much larger. Bloom filters
+  // and sketches are probed on every access and time series are appended to, so they stay in
+  // memory.
+  return pv.ObjType() == OBJ_STRING && !pv.IsExternal() && !pv.GetSparseBitmap() &&
+         !pv.GetBloomFilter() && !pv.GetTimeSeries() && !pv.GetCmsSketch() &&
+         !pv.GetTopKSketch() && pv.Size() >= 64 && pv.Size() <= kMaxItemLen && !pv.HasIoPending();
 };
 
 void TieredStorage::FlushPending() {
@@ -311,76 +948,208 @@ void TieredStorage::FlushPending() {
     canonic_req.resize(it - canonic_req.begin());
   }
 
-  // TODO: we could add item size and sort from largest to smallest before
-  // the aggregation.
-  constexpr size_t kMaxBatchLen = 64;
-  PrimeTable::iterator single_batch[kMaxBatchLen];
-  unsigned batch_len = 0;
-
-  auto tr_cb = [&](PrimeTable::iterator it) {
-    if (IsObjFitToUnload(it->second)) {
-      CHECK_LT(batch_len, kMaxBatchLen);
-      single_batch[batch_len++] = it;
-    }
+  struct Candidate {
+    DbIndex db_ind;
+    PrimeIterator it;
+    size_t size;
   };
+  vector<Candidate> candidates;
 
-  ActiveIoRequest* active_req = nullptr;
-
-  for (size_t i = 0; i < canonic_req.size(); ++i) {
-    DbIndex db_ind = canonic_req[i].first;
-    uint64_t cursor_val = canonic_req[i].second;
+  for (auto [db_ind, cursor_val] : canonic_req) {
     PrimeTable::Cursor curs(cursor_val);
-    db_slice_.GetTables(db_ind).first->Traverse(curs, tr_cb);
+    db_slice_.GetPrimeTable(db_ind)->Traverse(curs, [&, db_ind = db_ind](PrimeIterator it) {
+      if (IsObjFitToUnload(it->second))
+        candidates.push_back({db_ind, it, it->second.Size()});
+    });
+  }
 
-    for (unsigned j = 0; j < batch_len; ++j) {
-      PrimeIterator it = single_batch[j];
-      size_t item_size = it->second.Size();
-      DCHECK_GT(item_size, 0u);
+  // First-fit decreasing: the largest items open the pages and the smaller ones fill their gaps.
+  sort(candidates.begin(), candidates.end(),
+       [](const Candidate& a, const Candidate& b) { return a.size > b.size; });
 
-      if (!active_req || !active_req->CanAccommodate(item_size)) {
-        if (active_req) {  // need to close
-          // save the block asynchronously.
-          ++submitted_io_writes_;
-          submitted_io_write_size_ += kBatchSize;
+  vector<ActiveIoRequest*> batches;
+  for (const Candidate& c : candidates) {
+    if (c.it->second.HasIoPending())  // traversals of adjacent cursors may overlap.
+      continue;
 
-          SendIoRequest(active_req);
-          active_req = nullptr;
-        }
+    ActiveIoRequest* req = nullptr;
+    for (ActiveIoRequest* batch : batches) {
+      if (batch->CanAccommodate(c.size)) {
+        req = batch;
+        break;
+      }
+    }
 
-        int64_t res = alloc_.Malloc(item_size);
-        if (res < 0) {
-          InitiateGrow(-res);
-          return;
-        }
+    if (!req) {
+      int64_t res = alloc_.Malloc(kBatchSize);
+      if (res < 0) {
+        InitiateGrow(-res);
+        break;
+      }
+      req = new ActiveIoRequest(res, &io_mgr_);
+      batches.push_back(req);
+    }
 
-        size_t batch_size = ExternalAllocator::GoodSize(item_size);
-        DCHECK_EQ(batch_size, ExternalAllocator::GoodSize(batch_size));
+    req->Serialize(IndexKey{c.db_ind, c.it->first.AsRef()}, c.it->second);
+    c.it->second.SetIoPending(true);
+  }
 
-        active_req = new ActiveIoRequest(res);
-      }
+  // The iterators are not used below, since SendIoRequest may block the fiber.
+  for (ActiveIoRequest* req : batches) {
+    if (req->batch_offs >= kBatchSize / 2) {
+      ++submitted_io_writes_;
+      submitted_io_write_size_ += kBatchSize;
+      SendIoRequest(req);
+      continue;
+    }
 
-      active_req->Serialize(IndexKey{db_ind, it->first.AsRef()}, it->second);
-      it->second.SetIoPending(true);
+    // not enough data to fill the page.
+    // rollback the pending bit.
+    for (auto& k_v : req->entries) {
+      const IndexKey& ikey = k_v.first;
+      PrimeTable* pt = db_slice_.GetPrimeTable(ikey.db_indx);
+      PrimeIterator it = pt->Find(ikey.key);
+      it->second.SetIoPending(false);
+      // TODO: we could enqueue those back to pending_req.
     }
-    batch_len = 0;
+    alloc_.Free(req->file_offset, kBatchSize);
+    delete req;
   }
+}
 
-  if (active_req) {
-    if (active_req->batch_offs >= kBatchSize / 2) {
-      SendIoRequest(active_req);
-    } else {
-      // not enough data to fill the page.
-      // rollback the pending bit.
-      for (auto& k_v : active_req->entries) {
-        const IndexKey& ikey = k_v.first;
-        PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
-        PrimeIterator it = pt->Find(ikey.key);
-        it->second.SetIoPending(false);
-        // TODO: we could enqueue those back to pending_req.
-      }
-      delete active_req;
+void TieredStorage::OffloadStep(size_t used_mem, size_t mem_limit) {
+  double watermark_ratio = GetFlag(FLAGS_tiered_offload_watermark);
+  if (watermark_ratio <= 0 || mem_limit == 0 || is_shutting_down_)
+    return;
+
+  size_t watermark = mem_limit * watermark_ratio;
+  if (used_mem <= watermark)
+    return;
+
+  // Without free space there is nothing to write into, the grow is already on its way.
+  if (alloc_.allocated_bytes() > size_t(alloc_.capacity() * 0.85)) {
+    InitiateGrow(1ULL << 28);
+  }
+  if (io_mgr_.grow_pending())
+    return;
+
+  unsigned max_freq = GetFlag(FLAGS_tiered_offload_max_freq);
+  unsigned max_requests = GetFlag(FLAGS_tiered_storage_max_pending_writes);
+  unsigned budget = OffloadBudget(used_mem, mem_limit, watermark);
+
+  if (pressure_db_ >= db_slice_.db_array_size())
+    pressure_db_ = 0;
+  if (!db_slice_.IsDbValid(pressure_db_)) {
+    ++pressure_db_;
+    pressure_cursor_ = 0;
+    return;
+  }
+
+  DbIndex db_index = pressure_db_;
+
+  auto cb = [&](PrimeIterator it) {
+    if (it->first.GetFreq() > max_freq || num_active_requests_ >= max_requests)
+      return;
+
+    // The containers that were looked up since the last scan stay in memory.
+    if (it->second.ObjType() != OBJ_STRING && it->second.IsTouched())
+      return;
+
+    if (QueueOffload(db_index, it))
+      ++stats_.external_pressure_offloads;
+  };
+
+  for (unsigned i = 0; i < budget && num_active_requests_ < max_requests; ++i) {
+    // FlushPending may suspend the fiber, the database could have been flushed meanwhile.
+    if (!db_slice_.IsDbValid(db_index))
+      return;
+
+    PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+    pressure_cursor_ = pt->Traverse(pressure_cursor_, cb);
+    if (ShouldFlush() && !io_mgr_.grow_pending()) {
+      FlushPending();
+    }
+
+    if (!pressure_cursor_) {
+      ++pressure_db_;
+      break;
     }
   }
+
+  if (!pending_req_.empty() && !io_mgr_.grow_pending() && num_active_requests_ < max_requests) {
+    FlushPending();
+  }
+}
+
+bool TieredStorage::QueueOffload(DbIndex db_index, PrimeIterator it) {
+  // Strings are queued by their buckets, so FlushPending packs them into pages together with
+  // the values queued by the writes. Containers are written on their own.
+  PrimeValue& pv = it->second;
+  if (pv.ObjType() == OBJ_STRING) {
+    if (!IsObjFitToUnload(pv))
+      return false;
+    pending_req_.EmplaceOrOverride(PendingReq{it.bucket_cursor().value(), db_index});
+    return true;
+  }
+
+  if (pv.IsExternal() || pv.HasIoPending())
+    return false;
+
+  io::Bytes blob = ContainerBlob(pv);
+  if (blob.size() < kMinBlobLen)
+    return false;
+
+  string key = it->first.ToString();
+  string_view key_arr[1] = {key};
+  if (!db_slice_.CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{db_index, key_arr, 1}))
+    return false;
+
+  return UnloadContainer(db_index, std::move(key), it, blob);
+}
+
+bool TieredStorage::HasRoom() const {
+  if (alloc_.allocated_bytes() + kBatchSize <= alloc_.capacity())
+    return true;
+
+  uint64_t max_size = GetFlag(FLAGS_tiered_max_file_size);
+  return max_size == 0 || io_mgr_.Span() < max_size;
+}
+
+bool TieredStorage::Demote(DbIndex db_index, PrimeIterator it) {
+  unsigned max_requests = GetFlag(FLAGS_tiered_storage_max_pending_writes);
+  if (is_shutting_down_ || num_active_requests_ >= max_requests || !HasRoom())
+    return false;
+
+  if (!QueueOffload(db_index, it))
+    return false;
+
+  ++stats_.external_eviction_offloads;
+  return true;
+}
+
+unsigned TieredStorage::OffloadBudget(size_t used_mem, size_t mem_limit, size_t watermark) {
+  // Grows linearly from the watermark to the memory limit.
+  double pressure = 1;
+  if (used_mem < mem_limit) {
+    pressure = double(used_mem - watermark) / (mem_limit - watermark);
+  }
+  unsigned budget =
+      kMinPressureBuckets + unsigned((kMaxPressureBuckets - kMinPressureBuckets) * pressure);
+
+  // The disk does not keep up - write less so that the reads of the external values
+  // do not suffer.
+  uint32_t max_latency = GetFlag(FLAGS_tiered_offload_max_latency_usec);
+  if (max_latency && write_latency_usec_ > max_latency) {
+    budget = std::max<unsigned>(1, budget * max_latency / write_latency_usec_);
+    ++stats_.external_throttled_steps;
+  }
+
+  return budget;
+}
+
+void TieredStorage::RecordWriteLatency(uint64_t start_ns) {
+  uint64_t usec = (util::ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000;
+  write_latency_usec_ = (write_latency_usec_ * 7 + usec) / 8;
 }
 
 void TieredStorage::InitiateGrow(size_t grow_size) {
@@ -389,6 +1158,11 @@ void TieredStorage::InitiateGrow(size_t grow_size) {
   DCHECK_GT(grow_size, 0u);
 
   size_t start = io_mgr_.Span();
+  uint64_t max_size = GetFlag(FLAGS_tiered_max_file_size);
+  if (max_size && start + grow_size > max_size) {
+    LOG_FIRST_N(INFO, 1) << "The backing file reached tiered_max_file_size of " << max_size;
+    return;
+  }
 
   auto cb = [start, grow_size, this](int io_res) {
     if (io_res == 0) {
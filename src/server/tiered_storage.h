@@ -11,6 +11,7 @@
 #include "server/io_mgr.h"
 #include "server/table.h"
 #include "util/fibers/event_count.h"
+#include "util/fibers/fibers_ext.h"
 
 namespace dfly {
 
@@ -20,14 +21,62 @@ class TieredStorage {
  public:
   enum : uint16_t { kMinBlobLen = 64 };
 
+  // The data is valid only during the call.
+  using ReadCb = std::function<void(std::error_code, std::string_view)>;
+
   explicit TieredStorage(DbSlice* db_slice);
   ~TieredStorage();
 
   std::error_code Open(const std::string& path);
 
+  // Blocks the calling fiber until the data is read.
   std::error_code Read(size_t offset, size_t len, char* dest);
 
+  // Issues the read and returns immediately, cb is called in the shard thread once the data
+  // arrives. Concurrent reads of the same page share a single io request, and the page
+  // is not reused until all its reads finish, so the caller may release its locks right away.
+  void ReadAsync(size_t offset, size_t len, ReadCb cb);
+
+  // Records a read of the external value of key and moves the value back to memory once it was
+  // read often enough recently. value is the data that was read.
+  // Returns true if the value was promoted.
+  bool TryPromote(DbIndex db_index, std::string_view key, size_t offset, std::string_view value);
+
+  // Reads the external value pv into dest. Blocks the calling fiber.
+  std::error_code LoadExternal(const PrimeValue& pv, PrimeValue* dest);
+
+  // Loads the offloaded container of the entry back to memory. Blocks the calling fiber.
+  std::error_code FaultIn(DbIndex db_index, PrimeIterator it);
+
   std::error_code UnloadItem(DbIndex db_index, PrimeIterator it);
+
+  // With tiered_reuse_backing_file, snapshots reference the external values by their offsets
+  // instead of storing them. Restores the allocation of such a value that was loaded from
+  // a snapshot into the backing file that was kept from the previous run.
+  std::error_code Adopt(DbIndex db_index, const PrimeValue& pv);
+
+  // A snapshot that references the external values is taken. The ranges that are freed from
+  // now on are not reused until the following OnSnapshotSaved, and those that were freed
+  // since the previous snapshot started are held until then as well, so the offsets in the
+  // last complete snapshot stay valid even if this one fails.
+  void OnSnapshotStart();
+
+  // The snapshot was written successfully. Flushes the backing file and releases the ranges
+  // that were freed before the snapshot started.
+  std::error_code OnSnapshotSaved();
+
+  static bool KeepsExternalInSnapshots();
+
+  // Called from the shard heartbeat. Once used_mem crosses the offload watermark of mem_limit,
+  // scans the tables for cold values and offloads them. The further above the watermark we are,
+  // the more buckets are scanned, and the scan slows down when the disk writes are slow.
+  void OffloadStep(size_t used_mem, size_t mem_limit);
+
+  // Offloads the value of it in the background instead of evicting the entry in cache mode, see
+  // DbSlice::EvictObjects. The memory of the value is freed once the write finishes.
+  // Returns false if the value can not be offloaded or the backing file is full, and then the
+  // entry should be deleted.
+  bool Demote(DbIndex db_index, PrimeIterator it);
   void Free(DbIndex db_indx, size_t offset, size_t len);
 
   void Shutdown();
@@ -36,6 +85,8 @@ class TieredStorage {
 
  private:
   struct ActiveIoRequest;
+  struct PendingRead;
+  struct Relocation;
 
   bool ShouldFlush();
 
@@ -43,7 +94,39 @@ class TieredStorage {
   void InitiateGrow(size_t size);
   void SendIoRequest(ActiveIoRequest* req);
   void FinishIoRequest(int io_res, ActiveIoRequest* req);
-  void SetExternal(DbIndex db_index, size_t item_offset, PrimeValue* dest);
+  void FinishRead(uint32_t page, int io_res);
+  // Frees the range once the reads that overlap it finish.
+  void FreeAfterReads(size_t offset, size_t len);
+  void FreeRange(size_t offset, size_t len);
+  void ReleaseRange(size_t offset, size_t len);
+  void AgeReadHits();
+
+  // Moves the external value of key back to memory if it is still stored at offset and is not
+  // locked. Returns the entry on success or a done iterator otherwise.
+  PrimeIterator LoadBack(DbIndex db_index, std::string_view key, size_t offset,
+                         std::string_view value);
+
+  // Offloads the cold containers and compacts the backing file.
+  void BackgroundFiber();
+  void CompactPages(const std::vector<std::pair<size_t, size_t>>& pages);
+  void Relocate(std::vector<Relocation>* relocations);
+
+  void OffloadContainersStep();
+  // Returns false if there was no room for the container in the backing file.
+  bool UnloadContainer(DbIndex db_index, std::string key, PrimeIterator it, io::Bytes blob);
+
+  // Queues the string value or writes the container value of it if they fit to be offloaded.
+  bool QueueOffload(DbIndex db_index, PrimeIterator it);
+
+  // Whether the backing file has free space or can still grow, see tiered_max_file_size.
+  bool HasRoom() const;
+  void FinishContainerWrite(int io_res, DbIndex db_index, std::string_view key, size_t offset,
+                            size_t len);
+  void SetExternal(DbIndex db_index, size_t item_offset, PrimeIterator it);
+
+  // Number of buckets the next OffloadStep scans.
+  unsigned OffloadBudget(size_t used_mem, size_t mem_limit, size_t watermark);
+  void RecordWriteLatency(uint64_t start_ns);
 
   DbSlice& db_slice_;
   IoMgr io_mgr_;
@@ -66,6 +149,32 @@ class TieredStorage {
 
   std::vector<PerDb*> db_arr_;
 
+  // first page of the read range -> in-flight read.
+  absl::flat_hash_map<uint32_t, PendingRead*> pending_reads_;
+
+  // external offset -> number of recent reads. Halved periodically by AgeReadHits().
+  absl::flat_hash_map<size_t, uint8_t> read_hits_;
+  uint32_t reads_since_aging_ = 0;
+
+  DbIndex offload_db_ = 0;
+  PrimeTable::Cursor offload_cursor_;
+
+  DbIndex pressure_db_ = 0;
+  PrimeTable::Cursor pressure_cursor_;
+
+  // Exponential moving average of the write latency.
+  uint64_t write_latency_usec_ = 0;
+
+  // See OnSnapshotStart. held_frees_ are the ranges freed since the last snapshot started,
+  // snapshot_frees_ are those that were freed before it.
+  bool hold_frees_ = false;
+  std::vector<std::pair<size_t, size_t>> held_frees_;
+  std::vector<std::pair<size_t, size_t>> snapshot_frees_;
+
+  ::boost::fibers::fiber background_fb_;
+  util::fibers_ext::Done compaction_done_;
+  bool is_shutting_down_ = false;
+
   struct PendingReq {
     uint64_t cursor;
     DbIndex db_indx = kInvalidDbId;
@@ -78,13 +187,12 @@ class TieredStorage {
 
   // multi_cnt_ - counts how many unloaded items exists in the batch at specified page offset.
   // here multi_cnt_.first is (file_offset in 4k pages) and
-  // multi_cnt_.second is MultiBatch object storing number of allocated records in the batch
-  // and its capacity (/ 4k).
+  // multi_cnt_.second is MultiBatch object storing the number of live items in the batch.
+  // The page is freed when the count drops to zero.
   struct MultiBatch {
-    uint16_t used;      // number of used bytes
-    uint16_t reserved;  // in 4k pages.
+    uint16_t refs;
 
-    MultiBatch(uint16_t mem_used) : used(mem_used) {
+    MultiBatch(uint16_t num_refs) : refs(num_refs) {
     }
   };
   absl::flat_hash_map<uint32_t, MultiBatch> multi_cnt_;
@@ -0,0 +1,838 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/timeseries_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include "base/logging.h"
+#include "core/time_series.h"
+#include "server/command_registry.h"
+#include "server/common.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+using CI = CommandId;
+using Sample = TimeSeries::Sample;
+using AddResult = TimeSeries::AddResult;
+using Aggregator = TimeSeriesAggregator;
+
+constexpr char kNoKeyErr[] = "TSDB: the key does not exist";
+constexpr char kKeyExistsErr[] = "TSDB: key already exists";
+constexpr char kInvalidTsErr[] = "TSDB: invalid timestamp";
+constexpr char kInvalidValueErr[] = "TSDB: invalid value";
+constexpr char kTooOldErr[] = "TSDB: Timestamp is older than retention";
+constexpr char kDuplicateErr[] =
+    "TSDB: Error at upsert, update is not supported when DUPLICATE_POLICY is set to BLOCK mode";
+constexpr char kChunkSizeErr[] =
+    "TSDB: CHUNK_SIZE value must be a multiple of 8 in the range [48 .. 1048576]";
+
+// Like in RedisTimeSeries.
+constexpr uint32_t kMinChunkSize = 48;
+constexpr uint32_t kMaxChunkSize = 1 << 20;
+
+struct CreateParams {
+  optional<uint64_t> retention_ms;
+  optional<uint32_t> chunk_size;
+  optional<TimeSeries::DuplicatePolicy> policy;
+  optional<TimeSeries::DuplicatePolicy> on_duplicate;  // TS.ADD only.
+  TimeSeries::Labels labels;
+};
+
+struct RangeParams {
+  int64_t from = 0;
+  int64_t to = numeric_limits<int64_t>::max();
+  bool reverse = false;
+  uint64_t count = numeric_limits<uint64_t>::max();
+
+  optional<Aggregator::Type> agg;
+  int64_t bucket_ms = 0;
+  string_view align;  // Resolved by ResolveAlign, since it may refer to the bounds.
+  int64_t align_ts = 0;
+};
+
+// A FILTER expression of TS.MRANGE. Matches the series whose label is one of the values, or
+// that do not have the label if there are none, or the opposite if negate is set.
+struct LabelMatcher {
+  string name;
+  vector<string> values;
+  bool negate = false;
+
+  bool Matches(const TimeSeries& ts) const {
+    const string* value = ts.Label(name);
+    bool matched;
+    if (values.empty())
+      matched = !value || value->empty();
+    else
+      matched = value && find(values.begin(), values.end(), *value) != values.end();
+    return matched != negate;
+  }
+};
+
+struct MRangeParams {
+  RangeParams range;
+  bool with_labels = false;
+  vector<LabelMatcher> matchers;
+};
+
+struct SeriesRange {
+  string key;
+  TimeSeries::Labels labels;
+  vector<Sample> samples;
+};
+
+struct SeriesInfo {
+  size_t num_samples = 0;
+  size_t memory = 0;
+  optional<Sample> first, last;
+  uint64_t retention_ms = 0;
+  size_t num_chunks = 0;
+  uint32_t chunk_size = 0;
+  TimeSeries::DuplicatePolicy policy = TimeSeries::BLOCK;
+  TimeSeries::Labels labels;
+};
+
+string GetString(EngineShard* shard, const PrimeValue& pv) {
+  string res;
+  if (pv.IsExternal()) {
+    auto [offset, size] = pv.GetExternalPtr();
+    res.resize(size);
+
+    error_code ec = shard->tiered_storage()->Read(offset, size, res.data());
+    CHECK(!ec) << "TBD: " << ec;
+  } else {
+    pv.GetString(&res);
+  }
+  return res;
+}
+
+// Returns the series of pv, or nullptr if pv is not a series. A series that was loaded as a
+// plain string, e.g. from an RDB file or by a full sync, is parsed into tmp, and the next write
+// stores the parsed series in place of the string.
+const TimeSeries* ReadSeries(EngineShard* shard, const PrimeValue& pv,
+                             unique_ptr<TimeSeries>* tmp) {
+  if (const TimeSeries* ts = pv.GetTimeSeries())
+    return ts;
+
+  string raw = GetString(shard, pv);
+  if (!TimeSeries::HasMagic(raw))
+    return nullptr;
+
+  *tmp = make_unique<TimeSeries>(CompactObj::memory_resource());
+  return (*tmp)->Parse(raw) ? tmp->get() : nullptr;
+}
+
+OpResult<const TimeSeries*> FindSeries(const OpArgs& op_args, string_view key,
+                                       unique_ptr<TimeSeries>* tmp) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  const TimeSeries* ts = ReadSeries(op_args.shard, it_res.value()->second, tmp);
+  if (!ts)
+    return OpStatus::WRONG_TYPE;
+  return ts;
+}
+
+void InitSeries(const CreateParams& params, TimeSeries* ts) {
+  ts->Init(params.retention_ms.value_or(0),
+           params.chunk_size.value_or(TimeSeries::kDefaultChunkSize),
+           params.policy.value_or(TimeSeries::BLOCK));
+  ts->SetLabels(params.labels);
+}
+
+// Returns the series of key for an update, after the PreUpdate of its entry it, which the caller
+// follows with its PostUpdate. A missing key is created with params, or is not found if params
+// is null.
+OpResult<TimeSeries*> OpenSeries(const OpArgs& op_args, string_view key,
+                                 const CreateParams* params, PrimeIterator* it, bool* added) {
+  auto& db_slice = op_args.shard->db_slice();
+  DbIndex db_index = op_args.db_cntx.db_index;
+  *added = false;
+  if (params) {
+    try {
+      tie(*it, *added) = db_slice.AddOrFind(op_args.db_cntx, key);
+    } catch (bad_alloc&) {
+      return OpStatus::OUT_OF_MEMORY;
+    }
+  } else {
+    auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+    if (!it_res)
+      return it_res.status();
+    *it = it_res.value();
+  }
+
+  PrimeValue& pv = (*it)->second;
+  if (*added) {
+    TimeSeries* ts = pv.InitTimeSeries();
+    InitSeries(*params, ts);
+    return ts;
+  }
+
+  if (pv.ObjType() != OBJ_STRING)
+    return OpStatus::WRONG_TYPE;
+
+  if (TimeSeries* ts = pv.GetTimeSeries()) {
+    db_slice.PreUpdate(db_index, *it);
+    return ts;
+  }
+
+  // Replaces the plain string of the series with the parsed one.
+  string raw = GetString(op_args.shard, pv);
+  if (!TimeSeries::HasMagic(raw))
+    return OpStatus::WRONG_TYPE;
+
+  db_slice.PreUpdate(db_index, *it);
+  TimeSeries* ts = pv.InitTimeSeries();
+  if (!ts->Parse(raw)) {
+    pv.SetString(raw);
+    db_slice.PostUpdate(db_index, *it, key);
+    return OpStatus::WRONG_TYPE;
+  }
+  return ts;
+}
+
+OpStatus OpCreate(const OpArgs& op_args, string_view key, const CreateParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  pair<PrimeIterator, bool> add_res;
+  try {
+    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+  } catch (bad_alloc&) {
+    return OpStatus::OUT_OF_MEMORY;
+  }
+
+  auto [it, added] = add_res;
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  InitSeries(params, it->second.InitTimeSeries());
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
+  return OpStatus::OK;
+}
+
+// Adds the sample to the series of key, which is created with params if it is missing, unless
+// params is null.
+OpStatus OpAdd(const OpArgs& op_args, string_view key, Sample sample, const CreateParams* params,
+               AddResult* res) {
+  PrimeIterator it;
+  bool added;
+  OpResult<TimeSeries*> ts = OpenSeries(op_args, key, params, &it, &added);
+  if (!ts)
+    return ts.status();
+
+  TimeSeries::DuplicatePolicy policy =
+      params && params->on_duplicate ? *params->on_duplicate : (*ts)->policy();
+  *res = (*ts)->Add(sample.ts, sample.value, policy);
+  op_args.shard->db_slice().PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+  return OpStatus::OK;
+}
+
+OpResult<size_t> OpDel(const OpArgs& op_args, string_view key, int64_t from, int64_t to) {
+  PrimeIterator it;
+  bool added;
+  OpResult<TimeSeries*> ts = OpenSeries(op_args, key, nullptr, &it, &added);
+  if (!ts)
+    return ts.status();
+
+  size_t res = (*ts)->DeleteRange(from, to);
+  op_args.shard->db_slice().PostUpdate(op_args.db_cntx.db_index, it, key);
+  return res;
+}
+
+// The samples of the range of ts, downsampled by the aggregation of params if set.
+vector<Sample> RangeSamples(const TimeSeries& ts, const RangeParams& params) {
+  vector<Sample> res;
+
+  // Without the reversal, the range stops once it has count results.
+  if (!params.agg) {
+    ts.Range(params.from, params.to, [&](const Sample& sample) {
+      res.push_back(sample);
+      return params.reverse || res.size() < params.count;
+    });
+  } else {
+    Aggregator agg(*params.agg, params.bucket_ms, params.align_ts);
+    ts.Range(params.from, params.to, [&](const Sample& sample) {
+      agg.Add(sample, &res);
+      return params.reverse || res.size() < params.count;
+    });
+    if (res.size() < params.count || params.reverse)
+      agg.Finish(&res);
+  }
+
+  if (params.reverse) {
+    reverse(res.begin(), res.end());
+    if (res.size() > params.count)
+      res.resize(params.count);
+  }
+  return res;
+}
+
+OpResult<vector<Sample>> OpRange(const OpArgs& op_args, string_view key,
+                                 const RangeParams& params) {
+  unique_ptr<TimeSeries> tmp;
+  OpResult<const TimeSeries*> ts = FindSeries(op_args, key, &tmp);
+  if (!ts)
+    return ts.status();
+  return RangeSamples(**ts, params);
+}
+
+OpResult<SeriesInfo> OpInfo(const OpArgs& op_args, string_view key) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  const PrimeValue& pv = it_res.value()->second;
+  unique_ptr<TimeSeries> tmp;
+  const TimeSeries* ts = ReadSeries(op_args.shard, pv, &tmp);
+  if (!ts)
+    return OpStatus::WRONG_TYPE;
+
+  SeriesInfo res;
+  res.num_samples = ts->num_samples();
+  res.memory = pv.MallocUsed();
+  res.first = ts->First();
+  res.last = ts->Last();
+  res.retention_ms = ts->retention_ms();
+  res.num_chunks = ts->num_chunks();
+  res.chunk_size = ts->chunk_size();
+  res.policy = ts->policy();
+  res.labels = ts->labels();
+  return res;
+}
+
+// The ranges of the series of the shard in db_index that match all the matchers.
+vector<SeriesRange> MRangeShard(EngineShard* shard, DbIndex db_index, const MRangeParams& params) {
+  vector<SeriesRange> res;
+  auto& db_slice = shard->db_slice();
+  if (!db_slice.IsDbValid(db_index))
+    return res;
+
+  uint64_t now_ms = GetCurrentTimeMs();
+  string scratch;
+  auto cb = [&](PrimeIterator it) {
+    const PrimeValue& pv = it->second;
+    if (pv.ObjType() != OBJ_STRING || (pv.HasExpire() && db_slice.ExpireTime(it) <= now_ms))
+      return;
+
+    // The series that are plain strings are parsed only if they are in memory, since the
+    // lookups of the offloaded values would block the shard.
+    unique_ptr<TimeSeries> tmp;
+    const TimeSeries* ts = pv.GetTimeSeries();
+    if (!ts) {
+      if (pv.IsExternal() || pv.Size() < TimeSeries::kHeaderSize ||
+          !TimeSeries::HasMagic(pv.GetSlice(0, TimeSeries::kHeaderSize, &scratch))) {
+        return;
+      }
+      tmp = make_unique<TimeSeries>(CompactObj::memory_resource());
+      if (!tmp->Parse(pv.GetSlice(&scratch)))
+        return;
+      ts = tmp.get();
+    }
+
+    for (const LabelMatcher& matcher : params.matchers) {
+      if (!matcher.Matches(*ts))
+        return;
+    }
+
+    SeriesRange& range = res.emplace_back();
+    range.key = it->first.ToString();
+    if (params.with_labels)
+      range.labels = ts->labels();
+    range.samples = RangeSamples(*ts, params.range);
+  };
+
+  PrimeTable* table = db_slice.GetPrimeTable(db_index);
+  PrimeTable::Cursor cursor;
+  do {
+    cursor = table->Traverse(cursor, cb);
+  } while (cursor);
+
+  return res;
+}
+
+void SendStatus(OpStatus status, ConnectionContext* cntx) {
+  if (status == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->SendError(kNoKeyErr);
+  (*cntx)->SendError(status);
+}
+
+void SendSample(const Sample& sample, ConnectionContext* cntx) {
+  (*cntx)->StartArray(2);
+  (*cntx)->SendLong(sample.ts);
+  (*cntx)->SendDouble(sample.value);
+}
+
+void SendSamples(const vector<Sample>& samples, ConnectionContext* cntx) {
+  (*cntx)->StartArray(samples.size());
+  for (const Sample& sample : samples)
+    SendSample(sample, cntx);
+}
+
+void SendLabels(const TimeSeries::Labels& labels, ConnectionContext* cntx) {
+  (*cntx)->StartArray(labels.size());
+  for (const auto& [name, value] : labels) {
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString(name);
+    (*cntx)->SendBulkString(value);
+  }
+}
+
+// A non negative timestamp in ms, or the current time for '*'.
+bool ParseTimestamp(string_view str, int64_t* ts) {
+  if (str == "*") {
+    *ts = GetCurrentTimeMs();
+    return true;
+  }
+  return absl::SimpleAtoi(str, ts) && *ts >= 0;
+}
+
+// A bound of a range, where '-' is the first timestamp and '+' the last one.
+bool ParseBound(string_view str, int64_t* ts) {
+  if (str == "-") {
+    *ts = 0;
+  } else if (str == "+") {
+    *ts = numeric_limits<int64_t>::max();
+  } else {
+    return absl::SimpleAtoi(str, ts);
+  }
+  return true;
+}
+
+bool ParseValue(string_view str, double* value) {
+  return absl::SimpleAtod(str, value) && !isnan(*value);
+}
+
+// Parses the options of TS.CREATE, and of TS.ADD if is_add, from args[start]. Returns the error
+// or an empty string.
+string_view ParseCreateParams(CmdArgList args, size_t start, bool is_add, CreateParams* params) {
+  for (size_t i = start; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    bool has_value = i + 1 < args.size();
+
+    if (arg == "RETENTION" && has_value) {
+      uint64_t retention_ms;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &retention_ms))
+        return "TSDB: Couldn't parse RETENTION";
+      params->retention_ms = retention_ms;
+    } else if (arg == "CHUNK_SIZE" && has_value) {
+      uint32_t chunk_size;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &chunk_size) || chunk_size < kMinChunkSize ||
+          chunk_size > kMaxChunkSize || chunk_size % 8 != 0) {
+        return kChunkSizeErr;
+      }
+      params->chunk_size = chunk_size;
+    } else if ((arg == "DUPLICATE_POLICY" || (is_add && arg == "ON_DUPLICATE")) && has_value) {
+      auto policy = TimeSeries::ParsePolicy(ArgS(args, ++i));
+      if (!policy)
+        return "TSDB: Unknown DUPLICATE_POLICY";
+      (arg == "DUPLICATE_POLICY" ? params->policy : params->on_duplicate) = policy;
+    } else if (arg == "ENCODING" && has_value) {
+      // The samples are always compressed.
+      ++i;
+    } else if (arg == "LABELS") {
+      // Like in RedisTimeSeries, the labels are the last option.
+      if ((args.size() - i - 1) % 2 != 0)
+        return kSyntaxErr;
+      for (size_t j = i + 1; j < args.size(); j += 2)
+        params->labels.emplace_back(ArgS(args, j), ArgS(args, j + 1));
+      break;
+    } else {
+      return kSyntaxErr;
+    }
+  }
+  return {};
+}
+
+// Parses the range option at args[*i] and moves *i to its last argument. Returns the error or an
+// empty string.
+string_view ParseRangeOption(CmdArgList args, size_t* i, RangeParams* params) {
+  string_view arg = ArgS(args, *i);
+  if (arg == "COUNT" && *i + 1 < args.size()) {
+    if (!absl::SimpleAtoi(ArgS(args, ++*i), &params->count))
+      return "TSDB: Couldn't parse COUNT";
+  } else if (arg == "ALIGN" && *i + 1 < args.size()) {
+    params->align = ArgS(args, ++*i);
+  } else if (arg == "AGGREGATION" && *i + 2 < args.size()) {
+    params->agg = Aggregator::ParseType(ArgS(args, ++*i));
+    if (!params->agg)
+      return "TSDB: Unknown aggregation type";
+    if (!absl::SimpleAtoi(ArgS(args, ++*i), &params->bucket_ms) || params->bucket_ms <= 0)
+      return "TSDB: bucketDuration must be greater than zero";
+  } else {
+    return kSyntaxErr;
+  }
+  return {};
+}
+
+// ALIGN is a timestamp, or start or end for the bounds of the range.
+string_view ResolveAlign(RangeParams* params) {
+  string_view align = params->align;
+  if (align.empty()) {
+    params->align_ts = 0;
+  } else if (align == "-" || absl::EqualsIgnoreCase(align, "start")) {
+    params->align_ts = params->from;
+  } else if (align == "+" || absl::EqualsIgnoreCase(align, "end")) {
+    params->align_ts = params->to;
+  } else if (!absl::SimpleAtoi(align, &params->align_ts)) {
+    return "TSDB: unknown ALIGN parameter";
+  }
+
+  if (!align.empty() && !params->agg)
+    return "TSDB: ALIGN parameter can only be used with AGGREGATION";
+  return {};
+}
+
+optional<LabelMatcher> ParseMatcher(string_view expr) {
+  size_t pos = expr.find('=');
+  if (pos == string_view::npos || pos == 0)
+    return nullopt;
+
+  LabelMatcher res;
+  res.negate = expr[pos - 1] == '!';
+  res.name = expr.substr(0, pos - res.negate);
+  if (res.name.empty())
+    return nullopt;
+
+  string_view value = expr.substr(pos + 1);
+  if (value.size() >= 2 && value.front() == '(' && value.back() == ')') {
+    for (string_view v : absl::StrSplit(value.substr(1, value.size() - 2), ','))
+      res.values.emplace_back(absl::StripAsciiWhitespace(v));
+  } else if (!value.empty()) {
+    res.values.emplace_back(value);
+  }
+  return res;
+}
+
+void TsCreate(CmdArgList args, ConnectionContext* cntx) {
+  // TS.CREATE key [RETENTION ms] [CHUNK_SIZE size] [DUPLICATE_POLICY policy] [LABELS l v ...]
+  string_view key = ArgS(args, 1);
+  CreateParams params;
+  if (string_view error = ParseCreateParams(args, 2, false, &params); !error.empty())
+    return (*cntx)->SendError(error);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpCreate(t->GetOpArgs(shard), key, params);
+  };
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status == OpStatus::KEY_EXISTS)
+    return (*cntx)->SendError(kKeyExistsErr);
+  (*cntx)->SendError(status);
+}
+
+void SendAddResult(OpResult<AddResult> res, int64_t ts, ConnectionContext* cntx) {
+  if (!res)
+    return SendStatus(res.status(), cntx);
+  if (*res == TimeSeries::BLOCKED)
+    return (*cntx)->SendError(kDuplicateErr);
+  if (*res == TimeSeries::TOO_OLD)
+    return (*cntx)->SendError(kTooOldErr);
+  (*cntx)->SendLong(ts);
+}
+
+void TsAdd(CmdArgList args, ConnectionContext* cntx) {
+  // TS.ADD key timestamp value [options of TS.CREATE] [ON_DUPLICATE policy]
+  string_view key = ArgS(args, 1);
+  Sample sample;
+  if (!ParseTimestamp(ArgS(args, 2), &sample.ts))
+    return (*cntx)->SendError(kInvalidTsErr);
+  if (!ParseValue(ArgS(args, 3), &sample.value))
+    return (*cntx)->SendError(kInvalidValueErr);
+
+  CreateParams params;
+  if (string_view error = ParseCreateParams(args, 4, true, &params); !error.empty())
+    return (*cntx)->SendError(error);
+
+  AddResult res;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpStatus status = OpAdd(op_args, key, sample, &params, &res);
+    if (status == OpStatus::OK && res == TimeSeries::ADDED) {
+      // '*' is journaled as the timestamp, so that the replicas add the same sample.
+      string ts_str = absl::StrCat(sample.ts);
+      vector<string_view> journal_args(args.size() - 1);
+      for (size_t i = 1; i < args.size(); ++i)
+        journal_args[i - 1] = i == 2 ? string_view{ts_str} : ArgS(args, i);
+      RecordJournal(op_args, "TS.ADD", journal_args);
+    }
+    return status;
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendStatus(status, cntx);
+  SendAddResult(res, sample.ts, cntx);
+}
+
+void TsMAdd(CmdArgList args, ConnectionContext* cntx) {
+  // TS.MADD key timestamp value [key timestamp value ...]
+  size_t num_samples = (args.size() - 1) / 3;
+  vector<Sample> samples(num_samples);
+  for (size_t i = 0; i < num_samples; ++i) {
+    if (!ParseTimestamp(ArgS(args, 3 * i + 2), &samples[i].ts))
+      return (*cntx)->SendError(kInvalidTsErr);
+    if (!ParseValue(ArgS(args, 3 * i + 3), &samples[i].value))
+      return (*cntx)->SendError(kInvalidValueErr);
+  }
+
+  Transaction* transaction = cntx->transaction;
+  vector<vector<OpResult<AddResult>>> shard_res(shard_set->size());
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    OpArgs op_args = t->GetOpArgs(shard);
+    ArgSlice shard_args = t->ShardArgsInShard(sid);
+
+    // Every shard journals the samples it added, with their timestamps in place of '*'.
+    vector<string> ts_strs;
+    ts_strs.reserve(shard_args.size() / 3);
+    vector<string_view> journal_args;
+
+    for (size_t j = 0; j < shard_args.size(); j += 3) {
+      const Sample& sample = samples[t->ReverseArgIndex(sid, j) / 3];
+      AddResult res;
+      OpStatus status = OpAdd(op_args, shard_args[j], sample, nullptr, &res);
+      if (status != OpStatus::OK) {
+        shard_res[sid].emplace_back(status);
+        continue;
+      }
+
+      shard_res[sid].emplace_back(res);
+      if (res == TimeSeries::ADDED) {
+        ts_strs.push_back(absl::StrCat(sample.ts));
+        journal_args.insert(journal_args.end(), {shard_args[j], ts_strs.back(), shard_args[j + 2]});
+      }
+    }
+
+    if (!journal_args.empty())
+      RecordJournal(op_args, "TS.MADD", journal_args);
+    return OpStatus::OK;
+  };
+
+  OpStatus status = transaction->ScheduleSingleHop(std::move(cb));
+  CHECK_EQ(OpStatus::OK, status);
+
+  // Reorders the results back to the order of their keys.
+  vector<OpResult<AddResult>> res(num_samples);
+  for (ShardId sid = 0; sid < shard_res.size(); ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    for (size_t j = 0; j < shard_res[sid].size(); ++j) {
+      uint32_t indx = transaction->ReverseArgIndex(sid, 3 * j);
+      res[indx / 3] = shard_res[sid][j];
+    }
+  }
+
+  (*cntx)->StartArray(num_samples);
+  for (size_t i = 0; i < num_samples; ++i)
+    SendAddResult(res[i], samples[i].ts, cntx);
+}
+
+void TsGet(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<optional<Sample>> {
+    unique_ptr<TimeSeries> tmp;
+    OpResult<const TimeSeries*> ts = FindSeries(t->GetOpArgs(shard), key, &tmp);
+    if (!ts)
+      return ts.status();
+    return (*ts)->Last();
+  };
+
+  OpResult<optional<Sample>> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return SendStatus(res.status(), cntx);
+  if (!*res)
+    return (*cntx)->SendEmptyArray();
+  SendSample(**res, cntx);
+}
+
+void RangeGeneric(CmdArgList args, bool reverse, ConnectionContext* cntx) {
+  // TS.RANGE key from to [COUNT count] [ALIGN align] [AGGREGATION type bucket_ms]
+  string_view key = ArgS(args, 1);
+  RangeParams params;
+  params.reverse = reverse;
+  if (!ParseBound(ArgS(args, 2), &params.from) || !ParseBound(ArgS(args, 3), &params.to))
+    return (*cntx)->SendError(kInvalidTsErr);
+
+  for (size_t i = 4; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (string_view error = ParseRangeOption(args, &i, &params); !error.empty())
+      return (*cntx)->SendError(error);
+  }
+  if (string_view error = ResolveAlign(&params); !error.empty())
+    return (*cntx)->SendError(error);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRange(t->GetOpArgs(shard), key, params);
+  };
+  OpResult<vector<Sample>> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return SendStatus(res.status(), cntx);
+  SendSamples(*res, cntx);
+}
+
+void TsRange(CmdArgList args, ConnectionContext* cntx) {
+  RangeGeneric(args, false, cntx);
+}
+
+void TsRevRange(CmdArgList args, ConnectionContext* cntx) {
+  RangeGeneric(args, true, cntx);
+}
+
+// The series are matched by scanning the keyspace of every shard, which keeps no index of the
+// labels.
+void MRangeGeneric(CmdArgList args, bool reverse, ConnectionContext* cntx) {
+  // TS.MRANGE from to [WITHLABELS] [COUNT count] [ALIGN align] [AGGREGATION type bucket_ms]
+  //   FILTER filter...
+  MRangeParams params;
+  params.range.reverse = reverse;
+  if (!ParseBound(ArgS(args, 1), &params.range.from) ||
+      !ParseBound(ArgS(args, 2), &params.range.to)) {
+    return (*cntx)->SendError(kInvalidTsErr);
+  }
+
+  for (size_t i = 3; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "WITHLABELS") {
+      params.with_labels = true;
+    } else if (arg == "FILTER") {
+      // The filters are the last option.
+      for (++i; i < args.size(); ++i) {
+        optional<LabelMatcher> matcher = ParseMatcher(ArgS(args, i));
+        if (!matcher)
+          return (*cntx)->SendError("TSDB: failed parsing labels");
+        params.matchers.push_back(std::move(*matcher));
+      }
+    } else if (string_view error = ParseRangeOption(args, &i, &params.range); !error.empty()) {
+      return (*cntx)->SendError(error);
+    }
+  }
+  if (string_view error = ResolveAlign(&params.range); !error.empty())
+    return (*cntx)->SendError(error);
+
+  // Like in RedisTimeSeries, a filter must select the series of a label value, so that the
+  // query does not match every series.
+  bool has_value_matcher = any_of(params.matchers.begin(), params.matchers.end(),
+                                  [](const auto& m) { return !m.negate && !m.values.empty(); });
+  if (!has_value_matcher)
+    return (*cntx)->SendError("TSDB: please provide at least one matcher");
+
+  DbIndex db_index = cntx->conn_state.db_index;
+  vector<vector<SeriesRange>> shard_results(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard_results[shard->shard_id()] = MRangeShard(shard, db_index, params);
+  });
+
+  vector<SeriesRange> series;
+  for (vector<SeriesRange>& res : shard_results)
+    move(res.begin(), res.end(), back_inserter(series));
+  sort(series.begin(), series.end(), [](const auto& a, const auto& b) { return a.key < b.key; });
+
+  (*cntx)->StartArray(series.size());
+  for (const SeriesRange& range : series) {
+    (*cntx)->StartArray(3);
+    (*cntx)->SendBulkString(range.key);
+    SendLabels(range.labels, cntx);
+    SendSamples(range.samples, cntx);
+  }
+}
+
+void TsMRange(CmdArgList args, ConnectionContext* cntx) {
+  MRangeGeneric(args, false, cntx);
+}
+
+void TsMRevRange(CmdArgList args, ConnectionContext* cntx) {
+  MRangeGeneric(args, true, cntx);
+}
+
+void TsDel(CmdArgList args, ConnectionContext* cntx) {
+  // TS.DEL key from to
+  string_view key = ArgS(args, 1);
+  int64_t from, to;
+  if (!ParseBound(ArgS(args, 2), &from) || !ParseBound(ArgS(args, 3), &to))
+    return (*cntx)->SendError(kInvalidTsErr);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpDel(t->GetOpArgs(shard), key, from, to);
+  };
+  OpResult<size_t> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return SendStatus(res.status(), cntx);
+  (*cntx)->SendLong(*res);
+}
+
+void TsInfo(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) { return OpInfo(t->GetOpArgs(shard), key); };
+
+  OpResult<SeriesInfo> res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!res)
+    return SendStatus(res.status(), cntx);
+
+  const SeriesInfo& info = *res;
+  (*cntx)->StartArray(18);
+  (*cntx)->SendBulkString("totalSamples");
+  (*cntx)->SendLong(info.num_samples);
+  (*cntx)->SendBulkString("memoryUsage");
+  (*cntx)->SendLong(info.memory);
+  (*cntx)->SendBulkString("firstTimestamp");
+  (*cntx)->SendLong(info.first ? info.first->ts : 0);
+  (*cntx)->SendBulkString("lastTimestamp");
+  (*cntx)->SendLong(info.last ? info.last->ts : 0);
+  (*cntx)->SendBulkString("retentionTime");
+  (*cntx)->SendLong(info.retention_ms);
+  (*cntx)->SendBulkString("chunkCount");
+  (*cntx)->SendLong(info.num_chunks);
+  (*cntx)->SendBulkString("chunkSize");
+  (*cntx)->SendLong(info.chunk_size);
+  (*cntx)->SendBulkString("duplicatePolicy");
+  (*cntx)->SendBulkString(absl::AsciiStrToLower(TimeSeries::PolicyName(info.policy)));
+  (*cntx)->SendBulkString("labels");
+  SendLabels(info.labels, cntx);
+}
+
+}  // namespace
+
+void TimeSeriesFamily::Register(CommandRegistry* registry) {
+  // The timestamps of '*' are journaled by the commands themselves.
+  constexpr uint32_t kAddMask = CO::WRITE | CO::DENYOOM | CO::NO_AUTOJOURNAL;
+
+  *registry << CI{"TS.CREATE", CO::WRITE | CO::DENYOOM, -2, 1, 1, 1}.SetHandler(&TsCreate)
+            << CI{"TS.ADD", kAddMask | CO::FAST, -4, 1, 1, 1}.SetHandler(&TsAdd)
+            << CI{"TS.MADD", kAddMask | CO::REVERSE_MAPPING, -4, 1, -1, 3}.SetHandler(&TsMAdd)
+            << CI{"TS.GET", CO::READONLY | CO::FAST, 2, 1, 1, 1}.SetHandler(&TsGet)
+            << CI{"TS.RANGE", CO::READONLY, -4, 1, 1, 1}.SetHandler(&TsRange)
+            << CI{"TS.REVRANGE", CO::READONLY, -4, 1, 1, 1}.SetHandler(&TsRevRange)
+            << CI{"TS.MRANGE", CO::READONLY, -5, 0, 0, 0}.SetHandler(&TsMRange)
+            << CI{"TS.MREVRANGE", CO::READONLY, -5, 0, 0, 0}.SetHandler(&TsMRevRange)
+            << CI{"TS.DEL", CO::WRITE, 4, 1, 1, 1}.SetHandler(&TsDel)
+            << CI{"TS.INFO", CO::READONLY | CO::FAST, 2, 1, 1, 1}.SetHandler(&TsInfo);
+}
+
+}  // namespace dfly
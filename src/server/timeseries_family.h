@@ -0,0 +1,19 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace dfly {
+
+class CommandRegistry;
+
+// The time series commands of RedisTimeSeries: TS.CREATE, TS.ADD, TS.MADD, TS.GET, TS.RANGE,
+// TS.REVRANGE, TS.MRANGE, TS.MREVRANGE, TS.DEL and TS.INFO. The series are string values, see
+// core/time_series.h, and the downsampling of the ranges runs in the shards.
+class TimeSeriesFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
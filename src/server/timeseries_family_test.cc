@@ -0,0 +1,240 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/timeseries_family.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class TimeSeriesFamilyTest : public BaseFamilyTest {
+ protected:
+  // Renders a reply of samples as "ts=value ...".
+  static string Samples(const RespExpr& resp) {
+    if (resp.type != RespExpr::ARRAY)
+      return StrCat("not an array: ", RespExpr::TypeName(resp.type));
+
+    vector<string> res;
+    for (const RespExpr& sample : resp.GetVec()) {
+      const RespVec& vec = sample.GetVec();
+      res.push_back(StrCat(get<int64_t>(vec[0].u), "=", ToSV(vec[1].GetBuf())));
+    }
+    return absl::StrJoin(res, " ");
+  }
+
+  // Adds the samples of ts, 1000 * i for i in [0, n), with the value i.
+  void AddSamples(string_view key, unsigned n) {
+    for (unsigned i = 0; i < n; ++i)
+      ASSERT_EQ(int64_t(1000 * i), CheckedInt({"ts.add", key, StrCat(1000 * i), StrCat(i)}));
+  }
+};
+
+TEST_F(TimeSeriesFamilyTest, CreateAddGet) {
+  EXPECT_EQ(Run({"ts.create", "ts", "LABELS", "sensor", "a"}), "OK");
+  EXPECT_THAT(Run({"ts.create", "ts"}), ErrArg("key already exists"));
+  EXPECT_THAT(Run({"ts.get", "ts"}), ArrLen(0));
+
+  EXPECT_EQ(1000, CheckedInt({"ts.add", "ts", "1000", "1.5"}));
+  EXPECT_THAT(Run({"ts.add", "ts", "1000", "2"}), ErrArg("DUPLICATE_POLICY"));
+  EXPECT_EQ(1000, CheckedInt({"ts.add", "ts", "1000", "2", "ON_DUPLICATE", "sum"}));
+  EXPECT_EQ("1000=3.5", Samples(Run({"ts.range", "ts", "-", "+"})));
+
+  auto resp = Run({"ts.get", "ts"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1000), "3.5"));
+
+  // '*' is the current time.
+  EXPECT_EQ(int64_t(TEST_current_time_ms), CheckedInt({"ts.add", "ts", "*", "1"}));
+
+  // TS.ADD creates the missing series with its options.
+  EXPECT_EQ(5, CheckedInt({"ts.add", "new", "5", "1", "DUPLICATE_POLICY", "last"}));
+  EXPECT_EQ(5, CheckedInt({"ts.add", "new", "5", "2"}));
+  EXPECT_EQ("5=2", Samples(Run({"ts.range", "new", "0", "10"})));
+
+  EXPECT_THAT(Run({"ts.get", "missing"}), ErrArg("the key does not exist"));
+  EXPECT_THAT(Run({"ts.range", "missing", "-", "+"}), ErrArg("the key does not exist"));
+  EXPECT_EQ(Run({"type", "ts"}), "string");
+}
+
+TEST_F(TimeSeriesFamilyTest, Range) {
+  Run({"ts.create", "ts"});
+  AddSamples("ts", 10);
+
+  EXPECT_EQ("3000=3 4000=4", Samples(Run({"ts.range", "ts", "2500", "4000"})));
+  EXPECT_EQ("0=0 1000=1 2000=2", Samples(Run({"ts.range", "ts", "-", "+", "COUNT", "3"})));
+  EXPECT_EQ("9000=9 8000=8", Samples(Run({"ts.revrange", "ts", "-", "+", "COUNT", "2"})));
+
+  // The buckets are downsampled in the shard.
+  EXPECT_EQ("0=2 5000=7", Samples(Run({"ts.range", "ts", "-", "+", "AGGREGATION", "avg", "5000"})));
+  EXPECT_EQ("-4000=0 1000=3 6000=7.5", Samples(Run({"ts.range", "ts", "-", "+", "ALIGN", "1000",
+                                                    "AGGREGATION", "avg", "5000"})));
+  EXPECT_EQ("1000=3 6000=7.5", Samples(Run({"ts.range", "ts", "1000", "+", "ALIGN", "start",
+                                             "AGGREGATION", "avg", "5000"})));
+  EXPECT_EQ("5000=9", Samples(Run({"ts.revrange", "ts", "-", "+", "COUNT", "1", "AGGREGATION",
+                                   "max", "5000"})));
+  EXPECT_EQ("0=5 5000=5", Samples(Run({"ts.range", "ts", "-", "+", "AGGREGATION", "count",
+                                       "5000"})));
+
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "AGGREGATION", "median", "10"}),
+              ErrArg("Unknown aggregation"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "AGGREGATION", "avg", "0"}),
+              ErrArg("bucketDuration"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "ALIGN", "0"}), ErrArg("ALIGN"));
+  EXPECT_THAT(Run({"ts.range", "ts", "a", "+"}), ErrArg("invalid timestamp"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(TimeSeriesFamilyTest, MAdd) {
+  Run({"ts.create", "a"});
+  Run({"ts.create", "b"});
+
+  auto resp = Run({"ts.madd", "a", "1", "10", "b", "1", "20", "missing", "1", "5", "a", "1", "30",
+                   "b", "2", "40"});
+  ASSERT_THAT(resp, ArrLen(5));
+  const auto& vec = resp.GetVec();
+  EXPECT_THAT(vec[0], IntArg(1));
+  EXPECT_THAT(vec[1], IntArg(1));
+  EXPECT_THAT(vec[2], ErrArg("the key does not exist"));
+  EXPECT_THAT(vec[3], ErrArg("DUPLICATE_POLICY"));
+  EXPECT_THAT(vec[4], IntArg(2));
+
+  EXPECT_EQ("1=10", Samples(Run({"ts.range", "a", "-", "+"})));
+  EXPECT_EQ("1=20 2=40", Samples(Run({"ts.range", "b", "-", "+"})));
+  EXPECT_THAT(Run({"ts.madd", "a", "1"}), ErrArg("wrong number"));
+  EXPECT_THAT(Run({"ts.madd", "a", "1", "2", "b"}), ErrArg("wrong number"));
+}
+
+TEST_F(TimeSeriesFamilyTest, DelInfo) {
+  Run({"ts.create", "ts", "RETENTION", "60000", "CHUNK_SIZE", "128", "DUPLICATE_POLICY", "max",
+       "LABELS", "room", "a"});
+  AddSamples("ts", 10);
+
+  EXPECT_EQ(3, CheckedInt({"ts.del", "ts", "2000", "4000"}));
+  EXPECT_EQ("1000=1 5000=5", Samples(Run({"ts.range", "ts", "1000", "5000"})));
+  EXPECT_THAT(Run({"ts.del", "missing", "0", "1"}), ErrArg("the key does not exist"));
+
+  auto resp = Run({"ts.info", "ts"});
+  ASSERT_THAT(resp, ArrLen(18));
+  const auto& vec = resp.GetVec();
+  EXPECT_EQ(vec[0], "totalSamples");
+  EXPECT_THAT(vec[1], IntArg(7));
+  EXPECT_THAT(vec[5], IntArg(0));
+  EXPECT_THAT(vec[7], IntArg(9000));
+  EXPECT_THAT(vec[9], IntArg(60000));
+  EXPECT_THAT(vec[13], IntArg(128));
+  EXPECT_EQ(vec[15], "max");
+  ASSERT_THAT(vec[17], ArrLen(1));
+  EXPECT_THAT(vec[17].GetVec()[0].GetVec(), ElementsAre("room", "a"));
+}
+
+TEST_F(TimeSeriesFamilyTest, Retention) {
+  Run({"ts.create", "ts", "RETENTION", "100", "CHUNK_SIZE", "48"});
+  for (unsigned i = 0; i < 100; ++i)
+    Run({"ts.add", "ts", StrCat(i * 10), StrCat(i)});
+
+  EXPECT_THAT(Run({"ts.add", "ts", "100", "1"}), ErrArg("older than retention"));
+  EXPECT_EQ(11u, Run({"ts.range", "ts", "-", "+"}).GetVec().size());
+
+  // The expired chunks are trimmed in the background.
+  atomic_size_t trimmed = 0;
+  for (unsigned i = 0; i < 1000 && trimmed == 0; ++i) {
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* shard) { trimmed += shard->db_slice().TrimTimeSeriesStep(0); });
+  }
+  EXPECT_GT(trimmed.load(), 0u);
+
+  auto resp = Run({"ts.info", "ts"});
+  ASSERT_THAT(resp, ArrLen(18));
+  EXPECT_THAT(resp.GetVec()[1], IntArg(100 - trimmed.load()));
+  EXPECT_EQ(11u, Run({"ts.range", "ts", "-", "+"}).GetVec().size());
+}
+
+TEST_F(TimeSeriesFamilyTest, MRange) {
+  Run({"ts.create", "s1", "LABELS", "type", "temp", "room", "a"});
+  Run({"ts.create", "s2", "LABELS", "type", "temp", "room", "b"});
+  Run({"ts.create", "s3", "LABELS", "type", "hum", "room", "a"});
+  Run({"set", "str", "foo"});
+  AddSamples("s1", 3);
+  AddSamples("s2", 4);
+  AddSamples("s3", 5);
+
+  auto resp = Run({"ts.mrange", "-", "+", "FILTER", "type=temp"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& s1 = resp.GetVec()[0].GetVec();
+  EXPECT_EQ(s1[0], "s1");
+  EXPECT_THAT(s1[1], ArrLen(0));
+  EXPECT_EQ("0=0 1000=1 2000=2", Samples(s1[2]));
+  EXPECT_EQ(resp.GetVec()[1].GetVec()[0], "s2");
+
+  resp = Run({"ts.mrange", "1000", "+", "WITHLABELS", "AGGREGATION", "sum", "2000", "FILTER",
+              "room=a"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& s3 = resp.GetVec()[1].GetVec();
+  EXPECT_EQ(s3[0], "s3");
+  ASSERT_THAT(s3[1], ArrLen(2));
+  EXPECT_THAT(s3[1].GetVec()[0].GetVec(), ElementsAre("type", "hum"));
+  EXPECT_EQ("0=1 2000=5 4000=4", Samples(s3[2]));
+
+  resp = Run({"ts.mrevrange", "-", "+", "COUNT", "1", "FILTER", "room=(a,b)", "type!=hum"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ("2000=2", Samples(resp.GetVec()[0].GetVec()[2]));
+  EXPECT_EQ("3000=3", Samples(resp.GetVec()[1].GetVec()[2]));
+
+  // A missing label matches an empty value.
+  resp = Run({"ts.mrange", "-", "+", "FILTER", "type=hum", "floor="});
+  ASSERT_THAT(resp, ArrLen(1));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[0], "s3");
+
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "FILTER", "type=none"}), ArrLen(0));
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "FILTER", "type!=hum"}), ErrArg("matcher"));
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "FILTER", "type"}), ErrArg("failed parsing"));
+}
+
+TEST_F(TimeSeriesFamilyTest, Reload) {
+  Run({"ts.create", "ts", "RETENTION", "100000", "LABELS", "room", "a"});
+  AddSamples("ts", 50);
+  string before = Samples(Run({"ts.range", "ts", "-", "+"}));
+
+  // The series is saved as its serialized string and parsed back by the commands.
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+  EXPECT_EQ(before, Samples(Run({"ts.range", "ts", "-", "+"})));
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "FILTER", "room=a"}), ArrLen(1));
+  EXPECT_EQ(50000, CheckedInt({"ts.add", "ts", "50000", "50"}));
+  EXPECT_EQ("49000=49 50000=50", Samples(Run({"ts.range", "ts", "49000", "+"})));
+}
+
+TEST_F(TimeSeriesFamilyTest, Errors) {
+  Run({"set", "str", "foo"});
+  Run({"lpush", "list", "a"});
+
+  EXPECT_THAT(Run({"ts.add", "str", "1", "1"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"ts.range", "str", "-", "+"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"ts.get", "list"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"ts.create", "str"}), ErrArg("key already exists"));
+  EXPECT_EQ(Run({"get", "str"}), "foo");
+
+  EXPECT_THAT(Run({"ts.add", "ts", "abc", "1"}), ErrArg("invalid timestamp"));
+  EXPECT_THAT(Run({"ts.add", "ts", "-1", "1"}), ErrArg("invalid timestamp"));
+  EXPECT_THAT(Run({"ts.add", "ts", "1", "nan"}), ErrArg("invalid value"));
+  EXPECT_THAT(Run({"ts.create", "ts", "CHUNK_SIZE", "10"}), ErrArg("CHUNK_SIZE"));
+  EXPECT_THAT(Run({"ts.create", "ts", "RETENTION", "x"}), ErrArg("RETENTION"));
+  EXPECT_THAT(Run({"ts.create", "ts", "DUPLICATE_POLICY", "x"}), ErrArg("DUPLICATE_POLICY"));
+  EXPECT_THAT(Run({"ts.create", "ts", "LABELS", "a"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"ts.create", "ts", "ON_DUPLICATE", "sum"}), ErrArg("syntax error"));
+  EXPECT_EQ(0, CheckedInt({"exists", "ts"}));
+}
+
+}  // namespace dfly
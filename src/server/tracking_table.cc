@@ -0,0 +1,128 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tracking_table.h"
+
+#include <absl/flags/flag.h>
+#include <absl/strings/match.h>
+#include <xxhash.h>
+
+#include "base/logging.h"
+#include "server/engine_shard_set.h"
+
+ABSL_FLAG(uint32_t, tracking_table_max_keys, 1u << 20,
+          "Maximal number of keys tracked for CLIENT TRACKING per shard. When the table is full, "
+          "clients of the evicted keys get their whole cache invalidated");
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+TrackingTable::NotifyFn notify_fn = nullptr;
+
+inline uint64_t KeyHash(string_view key) {
+  return XXH3_64bits(key.data(), key.size());
+}
+
+}  // namespace
+
+void TrackingTable::SetNotifyFn(NotifyFn fn) {
+  notify_fn = fn;
+}
+
+void TrackingTable::Track(string_view key, ClientRef client) {
+  auto [it, added] = keys_.try_emplace(KeyHash(key));
+  ClientList& clients = it->second;
+
+  if (find(clients.begin(), clients.end(), client) == clients.end())
+    clients.push_back(client);
+
+  if (added && keys_.size() > absl::GetFlag(FLAGS_tracking_table_max_keys)) {
+    // We do not know the key of an arbitrary entry, so its clients drop everything.
+    auto victim = keys_.begin();
+    if (victim == it)
+      ++victim;
+    Notify(victim->second, nullptr);
+    keys_.erase(victim);
+  }
+}
+
+void TrackingTable::AddPrefix(string_view prefix, ClientRef client) {
+  for (const auto& [p, c] : prefixes_) {
+    if (c == client && p == prefix)
+      return;
+  }
+  prefixes_.emplace_back(prefix, client);
+}
+
+void TrackingTable::RemovePrefixes(ClientRef client) {
+  auto it = remove_if(prefixes_.begin(), prefixes_.end(),
+                      [client](const auto& p) { return p.second == client; });
+  prefixes_.erase(it, prefixes_.end());
+}
+
+void TrackingTable::OnChange(string_view key) {
+  if (Empty())
+    return;
+
+  ClientList clients;
+  if (!keys_.empty()) {
+    auto it = keys_.find(KeyHash(key));
+    if (it != keys_.end()) {
+      clients = std::move(it->second);
+      keys_.erase(it);  // Clients track the key again once they read it.
+    }
+  }
+
+  for (const auto& [prefix, client] : prefixes_) {
+    if (!absl::StartsWith(key, prefix))
+      continue;
+    if (find(clients.begin(), clients.end(), client) == clients.end())
+      clients.push_back(client);
+  }
+
+  if (!clients.empty())
+    Notify(clients, make_shared<const string>(key));
+}
+
+void TrackingTable::OnFlush() {
+  ClientList clients;
+  for (const auto& [hash, list] : keys_) {
+    for (ClientRef client : list) {
+      if (find(clients.begin(), clients.end(), client) == clients.end())
+        clients.push_back(client);
+    }
+  }
+
+  for (const auto& [prefix, client] : prefixes_) {
+    if (find(clients.begin(), clients.end(), client) == clients.end())
+      clients.push_back(client);
+  }
+
+  keys_.clear();
+  if (!clients.empty())
+    Notify(clients, nullptr);
+}
+
+void TrackingTable::Notify(const ClientList& clients, shared_ptr<const string> key) {
+  DCHECK(notify_fn);
+
+  ClientList sorted = clients;
+  sort(sorted.begin(), sorted.end());
+
+  for (size_t i = 0; i < sorted.size();) {
+    uint32_t thread_id = sorted[i] >> 32;
+    vector<uint32_t> ids;
+    for (; i < sorted.size() && (sorted[i] >> 32) == thread_id; ++i) {
+      ids.push_back(uint32_t(sorted[i]));
+    }
+
+    shard_set->pool()->at(thread_id)->DispatchBrief(
+        [ids = std::move(ids), key] { notify_fn(ids, key); });
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,67 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Per-shard table of the keys that CLIENT TRACKING connections may have cached.
+// Keys are kept as 64-bit hashes, so tracking does not copy them. A hash collision may cause a
+// spurious invalidation, which is harmless for a client side cache.
+class TrackingTable {
+ public:
+  // Identifies a tracking connection by its io thread and client id.
+  using ClientRef = uint64_t;
+
+  static ClientRef MakeRef(uint32_t thread_id, uint32_t client_id) {
+    return (uint64_t(thread_id) << 32) | client_id;
+  }
+
+  // Runs in the io thread of the clients. A null key means that all their keys are invalidated.
+  using NotifyFn = void (*)(const std::vector<uint32_t>& client_ids,
+                            std::shared_ptr<const std::string> key);
+
+  // Set once by the service before the shards start.
+  static void SetNotifyFn(NotifyFn fn);
+
+  bool Empty() const {
+    return keys_.empty() && prefixes_.empty();
+  }
+
+  size_t TrackedKeys() const {
+    return keys_.size();
+  }
+
+  // Default mode: client is notified once upon the next change of key.
+  void Track(std::string_view key, ClientRef client);
+
+  // BCAST mode: client is notified about every change of the keys starting with prefix.
+  void AddPrefix(std::string_view prefix, ClientRef client);
+  void RemovePrefixes(ClientRef client);
+
+  // Called for each key that was modified, deleted, expired or evicted.
+  void OnChange(std::string_view key);
+
+  // Called when the databases are flushed. Invalidates the keys of all tracking clients.
+  void OnFlush();
+
+ private:
+  using ClientList = absl::InlinedVector<ClientRef, 2>;
+
+  // Groups the clients by thread and dispatches the notifications.
+  static void Notify(const ClientList& clients, std::shared_ptr<const std::string> key);
+
+  absl::flat_hash_map<uint64_t, ClientList> keys_;
+  std::vector<std::pair<std::string, ClientRef>> prefixes_;
+};
+
+}  // namespace dfly
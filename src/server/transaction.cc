@@ -13,6 +13,7 @@
 #include "server/engine_shard_set.h"
 #include "server/journal/journal.h"
 #include "server/server_state.h"
+#include "util/proactor_base.h"
 
 namespace dfly {
 
@@ -24,13 +25,50 @@ thread_local Transaction::TLTmpSpace Transaction::tmp_space;
 
 namespace {
 
+// Enough for the commands that a thread coordinates at once under a typical load, the rest of
+// the transactions are freed.
+constexpr size_t kMaxPooledTransactions = 64;
+
+bool IsMultiCommand(string_view cmd_name) {
+  return cmd_name == "EXEC" || cmd_name == "EVAL" || cmd_name == "EVALSHA";
+}
+
+atomic_bool exec_timing{false};
+
+// Returns the start of the measured run of a callback, 0 if the runs are not measured.
+uint64_t StartExecTiming() {
+  return exec_timing.load(memory_order_relaxed) ? ProactorBase::GetMonotonicTimeNs() : 0;
+}
+
+}  // namespace
+
+namespace {
+
 atomic_uint64_t op_seq{1};
 
+// Marks the shard callback as running while it is in scope, see DbSlice::ShrinkTablesStep.
+class RunningCbMark {
+ public:
+  explicit RunningCbMark(DbSlice* db_slice) : db_slice_(db_slice) {
+    db_slice_->OnCbStart();
+  }
+
+  ~RunningCbMark() {
+    db_slice_->OnCbFinish();
+  }
+
+ private:
+  DbSlice* db_slice_;
+};
+
 [[maybe_unused]] constexpr size_t kTransSize = sizeof(Transaction);
 
 }  // namespace
 
 IntentLock::Mode Transaction::Mode() const {
+  if (multi_ && multi_->read_only)
+    return IntentLock::SHARED;
+
   return (cid_->opt_mask() & CO::READONLY) ? IntentLock::SHARED : IntentLock::EXCLUSIVE;
 }
 
@@ -41,9 +79,9 @@ IntentLock::Mode Transaction::Mode() const {
  * @param ess
  * @param cs
  */
-Transaction::Transaction(const CommandId* cid) : cid_(cid) {
+Transaction::Transaction(const CommandId* cid) : trace_(TxTrace::Sample()), cid_(cid) {
   string_view cmd_name(cid_->name());
-  if (cmd_name == "EXEC" || cmd_name == "EVAL" || cmd_name == "EVALSHA") {
+  if (IsMultiCommand(cmd_name)) {
     multi_.reset(new Multi);
     multi_->multi_opts = cid->opt_mask();
 
@@ -58,6 +96,63 @@ Transaction::~Transaction() {
            << " destroyed";
 }
 
+Transaction::TLTmpSpace::~TLTmpSpace() {
+  for (Transaction* trans : pool)
+    delete trans;
+}
+
+boost::intrusive_ptr<Transaction> Transaction::New(const CommandId* cid) {
+  auto& pool = tmp_space.pool;
+  if (pool.empty() || IsMultiCommand(cid->name()))
+    return boost::intrusive_ptr<Transaction>{new Transaction{cid}};
+
+  Transaction* trans = pool.back();
+  pool.pop_back();
+  trans->Reset(cid);
+
+  // Nothing else references a pooled transaction, so we take the reference without an atomic
+  // read-modify-write.
+  trans->use_count_.store(1, memory_order_relaxed);
+  return boost::intrusive_ptr<Transaction>{trans, false};
+}
+
+void Transaction::Recycle(boost::intrusive_ptr<Transaction> trans) {
+  // The shard callbacks and the blocking queues drop their references with a release, hence
+  // once we see the last reference here, they do not access the transaction anymore.
+  if (trans->multi_ || trans->use_count_.load(memory_order_acquire) != 1 ||
+      tmp_space.pool.size() >= kMaxPooledTransactions) {
+    return;
+  }
+
+  Transaction* ptr = trans.detach();
+  ptr->use_count_.store(0, memory_order_relaxed);
+  tmp_space.pool.push_back(ptr);
+}
+
+void Transaction::Reset(const CommandId* cid) {
+  DCHECK(!multi_);
+  DCHECK_EQ(0u, run_count_.load(memory_order_relaxed));
+
+  // resize() rather than clear(), which frees the heap storage of inlined vectors.
+  shard_data_.resize(0);
+  args_.resize(0);
+  reverse_index_.clear();
+  cmd_with_full_args_ = {};
+  cb_ptr_ = nullptr;
+  trace_ = TxTrace::Sample();
+
+  cid_ = cid;
+  txid_ = 0;
+  time_now_ms_ = 0;
+  notify_txid_.store(kuint64max, memory_order_relaxed);
+  exec_ns_.store(0, memory_order_relaxed);
+  unique_shard_cnt_ = 0;
+  unique_shard_id_ = kInvalidSid;
+  tracking_ref_ = 0;
+  local_result_ = OpStatus::OK;
+  coordinator_state_ = 0;
+}
+
 /**
  *
  * There are 4 options that we consider here:
@@ -80,6 +175,7 @@ Transaction::~Transaction() {
 
 OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
   db_index_ = index;
+  cmd_with_full_args_ = args;
 
   if (IsGlobal()) {
     unique_shard_cnt_ = shard_set->size();
@@ -134,8 +230,8 @@ OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
 
   // Our shard_data is not sparse, so we must allocate for all threads :(
   shard_data_.resize(shard_set->size());
-  CHECK(key_index.step == 1 || key_index.step == 2);
-  DCHECK(key_index.step == 1 || (args.size() % 2) == 1);
+  CHECK_GT(key_index.step, 0u);
+  DCHECK_EQ(0u, (key_index.end - key_index.start) % key_index.step);
 
   // Reuse thread-local temporary storage. Since this code is atomic we can use it here.
   auto& shard_index = tmp_space.shard_cache;
@@ -186,7 +282,8 @@ OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
       }
     };
 
-    if (key_index.step == 2) {  // value
+    // The values that follow the key, e.g. of MSET or TS.MADD.
+    for (unsigned j = 1; j < key_index.step; ++j) {
       ++i;
 
       string_view val = ArgS(args, i);
@@ -276,9 +373,20 @@ OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
   return OpStatus::OK;
 }
 
+boost::intrusive_ptr<Transaction> Transaction::CloneUnscheduled() const {
+  DCHECK(!multi_);
+
+  boost::intrusive_ptr<Transaction> res{new Transaction{cid_}};
+  OpStatus status = res->InitByArgs(db_index_, cmd_with_full_args_);
+  CHECK_EQ(OpStatus::OK, status);
+  res->tracking_ref_ = tracking_ref_;
+
+  return res;
+}
+
 void Transaction::SetExecCmd(const CommandId* cid) {
   DCHECK(multi_);
-  DCHECK(!cb_);
+  DCHECK(!cb_ptr_);
 
   // The order is important, we call Schedule for multi transaction before overriding cid_.
   // TODO: The flow is ugly. Consider introducing a proper interface for Multi transactions
@@ -291,7 +399,7 @@ void Transaction::SetExecCmd(const CommandId* cid) {
   unique_shard_cnt_ = 0;
   args_.clear();
   cid_ = cid;
-  cb_ = nullptr;
+  cb_ptr_ = nullptr;
 }
 
 string Transaction::DebugId() const {
@@ -303,7 +411,7 @@ string Transaction::DebugId() const {
 // Runs in the dbslice thread. Returns true if transaction needs to be kept in the queue.
 bool Transaction::RunInShard(EngineShard* shard) {
   DCHECK_GT(run_count_.load(memory_order_relaxed), 0u);
-  CHECK(cb_) << DebugId();
+  CHECK(cb_ptr_) << DebugId();
   DCHECK_GT(txid_, 0u);
 
   // Unlike with regular transactions we do not acquire locks upon scheduling
@@ -312,6 +420,8 @@ bool Transaction::RunInShard(EngineShard* shard) {
 
   VLOG(2) << "RunInShard: " << DebugId() << " sid:" << shard->shard_id();
 
+  shard->RecordHop(unique_shard_cnt_ > 1);
+
   unsigned idx = SidToId(shard->shard_id());
   auto& sd = shard_data_[idx];
 
@@ -349,11 +459,29 @@ bool Transaction::RunInShard(EngineShard* shard) {
     OpStatus status = OpStatus::OK;
 
     if (!was_suspended) {
-      status = cb_(this, shard);
+      if (trace_)
+        trace_->StartRun(idx, shard->shard_id());
+      uint64_t exec_start_ns = StartExecTiming();
+      EngineShard::HeapCounters heap_snapshot = shard->GetHeapCounters();
+      {
+        RunningCbMark mark(&shard->db_slice());
+        status = (*cb_ptr_)(this, shard);
+      }
+      shard->RecordCmdMemory(Name(), heap_snapshot);
+      TrackKeys(shard);
+      RecordLoadingWrites(shard);
+      JournalKeys(shard);
+      LogAutoJournal(shard);
+      if (exec_start_ns) {
+        exec_ns_.fetch_add(ProactorBase::GetMonotonicTimeNs() - exec_start_ns,
+                           memory_order_relaxed);
+      }
+      if (trace_)
+        trace_->EndRun(idx);
     }
 
     if (unique_shard_cnt_ == 1) {
-      cb_ = nullptr;  // We can do it because only a single thread runs the callback.
+      cb_ptr_ = nullptr;  // We can do it because only a single thread runs the callback.
       local_result_ = status;
     } else {
       if (status == OpStatus::OUT_OF_MEMORY) {
@@ -430,6 +558,9 @@ void Transaction::ScheduleInternal() {
   bool span_all = IsGlobal();
   bool single_hop = (coordinator_state_ & COORD_EXEC_CONCLUDING);
 
+  if (trace_)
+    trace_->StartSchedule();
+
   uint32_t num_shards;
   std::function<bool(uint32_t)> is_active;
 
@@ -532,6 +663,9 @@ void Transaction::ScheduleInternal() {
       sd.local_mask |= OUT_OF_ORDER;
     }
   }
+
+  if (trace_)
+    trace_->EndSchedule();
 }
 
 void Transaction::LockMulti() {
@@ -548,9 +682,9 @@ void Transaction::LockMulti() {
 // transactions like set/mset/mget etc. Does not apply for more complicated cases like RENAME or
 // BLPOP where a data must be read from multiple shards before performing another hop.
 OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
-  DCHECK(!cb_);
+  DCHECK(!cb_ptr_);
 
-  cb_ = std::move(cb);
+  cb_ptr_ = &cb;
 
   // single hop -> concluding.
   coordinator_state_ |= (COORD_EXEC | COORD_EXEC_CONCLUDING);
@@ -565,6 +699,8 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
     DCHECK_EQ(1u, shard_data_.size());
 
     shard_data_[0].local_mask |= ARMED;
+    if (trace_)
+      trace_->StartHop(1);
 
     // memory_order_release because we do not want it to be reordered with shard_data writes
     // above.
@@ -588,7 +724,16 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
       }
     };
 
-    shard_set->Add(unique_shard_id_, std::move(schedule_cb));  // serves as a barrier.
+    // A coordinator in the thread of the shard runs the hop as a local call. Callbacks that
+    // may preempt, i.e. with tiered storage or journaling, still go through the shard queue,
+    // which runs them one by one.
+    EngineShard* local_shard = EngineShard::tlocal();
+    if (local_shard && local_shard->shard_id() == unique_shard_id_ &&
+        !local_shard->tiered_storage() && !local_shard->journal()) {
+      schedule_cb();
+    } else {
+      shard_set->Add(unique_shard_id_, std::move(schedule_cb));  // serves as a barrier.
+    }
   } else {
     // Transaction spans multiple shards or it's global (like flushdb) or multi.
     // Note that the logic here is a bit different from the public Schedule() function.
@@ -605,8 +750,11 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
   DVLOG(1) << "ScheduleSingleHop before Wait " << DebugId() << " " << run_count_.load();
   WaitForShardCallbacks();
   DVLOG(1) << "ScheduleSingleHop after Wait " << DebugId();
+  AwaitJournal();
+  if (trace_)
+    trace_->EndHop(Name(), txid_);
 
-  cb_ = nullptr;
+  cb_ptr_ = nullptr;
 
   return local_result_;
 }
@@ -627,11 +775,27 @@ void Transaction::UnlockMulti() {
     sharded_keys[sid].push_back(k_v);
   }
 
-  uint32_t prev = run_count_.fetch_add(shard_data_.size(), memory_order_relaxed);
+  if (multi_->is_inline) {
+    run_count_.store(1, memory_order_relaxed);
+    UnlockMultiShardCb(sharded_keys, EngineShard::tlocal());
+    return;
+  }
+
+  // Unless the transaction is global, it was scheduled only in the shards of its keys.
+  bool is_global = multi_->multi_opts & CO::GLOBAL_TRANS;
+  auto is_active = [&](ShardId sid) { return is_global || !sharded_keys[sid].empty(); };
+
+  uint32_t num_active = 0;
+  for (ShardId i = 0; i < shard_data_.size(); ++i) {
+    num_active += is_active(i);
+  }
+
+  uint32_t prev = run_count_.fetch_add(num_active, memory_order_relaxed);
   DCHECK_EQ(prev, 0u);
 
   for (ShardId i = 0; i < shard_data_.size(); ++i) {
-    shard_set->Add(i, [&] { UnlockMultiShardCb(sharded_keys, EngineShard::tlocal()); });
+    if (is_active(i))
+      shard_set->Add(i, [&] { UnlockMultiShardCb(sharded_keys, EngineShard::tlocal()); });
   }
   WaitForShardCallbacks();
   DCHECK_GE(use_count(), 1u);
@@ -639,7 +803,82 @@ void Transaction::UnlockMulti() {
   VLOG(1) << "UnlockMultiEnd " << DebugId();
 }
 
+void Transaction::SetMultiKeys(DbIndex db_index, ShardId sid, ArgSlice keys) {
+  DCHECK(multi_ && multi_->is_expanding);
+  DCHECK_EQ(0u, txid_);
+  DCHECK(!keys.empty());
+
+  multi_->is_expanding = false;
+  multi_->keys_only = true;
+  multi_->multi_opts &= ~CO::GLOBAL_TRANS;
+  db_index_ = db_index;
+
+  IntentLock::Mode mode = Mode();
+  args_.clear();
+  for (string_view key : keys) {
+    auto [it, inserted] = multi_->locks.try_emplace(key);
+    if (inserted) {
+      it->second.cnt[int(mode)] = 1;
+      args_.push_back(key);
+    }
+  }
+  multi_->locks_recorded = true;
+
+  shard_data_.resize(shard_set->size());
+  shard_data_[sid].arg_start = 0;
+  shard_data_[sid].arg_count = args_.size();
+  unique_shard_cnt_ = 1;
+  unique_shard_id_ = sid;
+}
+
+void Transaction::SetMultiReadOnly() {
+  DCHECK(multi_ && !multi_->is_expanding);
+  DCHECK_EQ(0u, txid_);
+
+  multi_->read_only = true;
+  for (auto& k_v : multi_->locks) {
+    LockCnt& cnt = k_v.second;
+    cnt.cnt[IntentLock::SHARED] += cnt.cnt[IntentLock::EXCLUSIVE];
+    cnt.cnt[IntentLock::EXCLUSIVE] = 0;
+  }
+}
+
+bool Transaction::ScheduleInline(EngineShard* shard) {
+  DCHECK(multi_ && !multi_->is_expanding);
+  DCHECK_EQ(0u, txid_);
+  DCHECK_EQ(1u, unique_shard_cnt_);
+
+  ShardId sid = shard->shard_id();
+  DCHECK_EQ(sid, unique_shard_id_);
+
+  // Same conditions as for RunQuickie, except that the transaction stays as the continuation
+  // transaction of the shard until it unlocks.
+  IntentLock::Mode mode = Mode();
+  KeyLockArgs lock_args = GetLockArgs(sid);
+  bool has_awaked = shard->blocking_controller() &&
+                    shard->blocking_controller()->HasAwakedTransaction();
+  if (has_awaked || !shard->shard_lock()->Check(mode) ||
+      !shard->db_slice().CheckLock(mode, lock_args) || !shard->TrySetContinuation(this)) {
+    return false;
+  }
+
+  txid_ = op_seq.fetch_add(1, memory_order_relaxed);
+  time_now_ms_ = GetCurrentTimeMs();
+  coordinator_state_ |= COORD_SCHED;
+  multi_->is_inline = true;
+
+  auto& sd = shard_data_[SidToId(sid)];
+  shard->db_slice().Acquire(mode, lock_args);
+  sd.local_mask |= KEYLOCK_ACQUIRED;
+
+  return true;
+}
+
 void Transaction::Schedule() {
+  // Commands of a script are scheduled together with the script.
+  if (multi_ && !multi_->is_expanding && txid_ != 0)
+    return;
+
   if (multi_ && multi_->is_expanding) {
     LockMulti();
   } else {
@@ -651,7 +890,7 @@ void Transaction::Schedule() {
 void Transaction::Execute(RunnableType cb, bool conclude) {
   DCHECK(coordinator_state_ & COORD_SCHED);
 
-  cb_ = std::move(cb);
+  cb_ptr_ = &cb;
   coordinator_state_ |= COORD_EXEC;
 
   if (conclude) {
@@ -665,8 +904,11 @@ void Transaction::Execute(RunnableType cb, bool conclude) {
   DVLOG(1) << "Wait on Exec " << DebugId();
   WaitForShardCallbacks();
   DVLOG(1) << "Wait on Exec " << DebugId() << " completed";
+  AwaitJournal();
+  if (trace_)
+    trace_->EndHop(Name(), txid_);
 
-  cb_ = nullptr;
+  cb_ptr_ = nullptr;
 }
 
 // Runs in coordinator thread.
@@ -676,11 +918,25 @@ void Transaction::ExecuteAsync() {
   DCHECK_GT(unique_shard_cnt_, 0u);
   DCHECK_GT(use_count_.load(memory_order_relaxed), 0u);
 
+  if (trace_)
+    trace_->StartHop(shard_data_.size());
+
   // We do not necessarily Execute this transaction in 'cb' below. It well may be that it will be
   // executed by the engine shard once it has been armed and coordinator thread will finish the
   // transaction before engine shard thread stops accessing it. Therefore, we increase reference
   // by number of callbacks accessesing 'this' to allow callbacks to execute shard->Execute(this);
   // safely.
+  if (multi_ && multi_->is_inline) {
+    EngineShard* shard = EngineShard::tlocal();
+    DCHECK(shard && shard->shard_id() == unique_shard_id_);
+    DCHECK_EQ(1u, unique_shard_cnt_);
+
+    shard_data_[SidToId(unique_shard_id_)].local_mask |= ARMED;
+    run_count_.store(1, memory_order_relaxed);
+    RunInShard(shard);
+    return;
+  }
+
   use_count_.fetch_add(unique_shard_cnt_, memory_order_relaxed);
 
   bool is_global = IsGlobal();
@@ -748,22 +1004,84 @@ void Transaction::ExecuteAsync() {
   }
 }
 
+bool Transaction::IsReadyOutOfOrder(EngineShard* shard, bool allow_multi_shard) const {
+  ShardId sid = shard->shard_id();
+
+  // Multi transactions may lock more keys as they progress, hence we can not reason about them
+  // unless all their keys were locked up-front.
+  if ((multi_ && !multi_->keys_only) || IsGlobal() || !IsArmedInShard(sid))
+    return false;
+
+  if (unique_shard_cnt_ > 1 && !allow_multi_shard)
+    return false;
+
+  // We do not reorder intermediate hops, since the transaction would need to stay
+  // as the continuation transaction of the shard afterwards.
+  if ((coordinator_state_ & COORD_EXEC_CONCLUDING) == 0)
+    return false;
+
+  const auto& sd = shard_data_[SidToId(sid)];
+  if (sd.local_mask & (SUSPENDED_Q | AWAKED_Q))
+    return false;
+
+  DCHECK(sd.local_mask & KEYLOCK_ACQUIRED);
+  IntentLock::Mode mode = Mode();
+
+  return shard->shard_lock()->Check(mode) &&
+         shard->db_slice().CheckLockGranted(mode, GetLockArgs(sid));
+}
+
+bool Transaction::WritesPinnedKeys(EngineShard* shard) const {
+  if (Mode() != IntentLock::EXCLUSIVE)
+    return false;
+
+  const DbSlice& db_slice = shard->db_slice();
+  if (IsGlobal() || multi_)
+    return db_slice.HasPinnedKeys();
+
+  KeyLockArgs lock_args = GetLockArgs(shard->shard_id());
+  for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
+    if (db_slice.IsPinned(lock_args.db_index, lock_args.args[i]))
+      return true;
+  }
+  return false;
+}
+
 void Transaction::RunQuickie(EngineShard* shard) {
   DCHECK(!multi_);
   DCHECK_EQ(1u, shard_data_.size());
   DCHECK_EQ(0u, txid_);
 
   shard->IncQuickRun();
+  shard->RecordHop(false);
 
   auto& sd = shard_data_[0];
   DCHECK_EQ(0, sd.local_mask & (KEYLOCK_ACQUIRED | OUT_OF_ORDER));
 
   DVLOG(1) << "RunQuickSingle " << DebugId() << " " << shard->shard_id() << " " << args_[0];
-  CHECK(cb_) << DebugId() << " " << shard->shard_id() << " " << args_[0];
+  CHECK(cb_ptr_) << DebugId() << " " << shard->shard_id() << " " << args_[0];
 
   // Calling the callback in somewhat safe way
   try {
-    local_result_ = cb_(this, shard);
+    if (trace_)
+      trace_->StartRun(0, shard->shard_id());
+    uint64_t exec_start_ns = StartExecTiming();
+    EngineShard::HeapCounters heap_snapshot = shard->GetHeapCounters();
+    {
+      RunningCbMark mark(&shard->db_slice());
+      local_result_ = (*cb_ptr_)(this, shard);
+    }
+    shard->RecordCmdMemory(Name(), heap_snapshot);
+    TrackKeys(shard);
+    RecordLoadingWrites(shard);
+    JournalKeys(shard);
+    LogAutoJournal(shard);
+    if (exec_start_ns) {
+      exec_ns_.fetch_add(ProactorBase::GetMonotonicTimeNs() - exec_start_ns,
+                         memory_order_relaxed);
+    }
+    if (trace_)
+      trace_->EndRun(0);
   } catch (std::bad_alloc&) {
     LOG_FIRST_N(ERROR, 16) << " out of memory";
     local_result_ = OpStatus::OUT_OF_MEMORY;
@@ -772,7 +1090,128 @@ void Transaction::RunQuickie(EngineShard* shard) {
   }
 
   sd.local_mask &= ~ARMED;
-  cb_ = nullptr;  // We can do it because only a single shard runs the callback.
+  cb_ptr_ = nullptr;  // We can do it because only a single shard runs the callback.
+}
+
+void Transaction::TrackKeys(EngineShard* shard) {
+  if (tracking_ref_ == 0 || IsGlobal() || (cid_->opt_mask() & CO::READONLY) == 0)
+    return;
+
+  ArgSlice args = ShardArgsInShard(shard->shard_id());
+  unsigned step = cid_->key_arg_step();
+  for (size_t i = 0; i < args.size(); i += step) {
+    shard->tracking_table().Track(args[i], tracking_ref_);
+  }
+}
+
+void Transaction::RecordLoadingWrites(EngineShard* shard) {
+  DbSlice& db_slice = shard->db_slice();
+  if (!db_slice.tracks_loading_writes() || IsGlobal() || (cid_->opt_mask() & CO::WRITE) == 0)
+    return;
+
+  ArgSlice args = ShardArgsInShard(shard->shard_id());
+  unsigned step = cid_->key_arg_step();
+  for (size_t i = 0; i < args.size(); i += step) {
+    db_slice.RecordLoadingWrite(db_index_, args[i]);
+  }
+}
+
+void Transaction::PersistFields(EngineShard* shard, string_view key, CmdArgList set_fields,
+                                CmdArgList removed_fields) {
+  journal::Journal* journal = shard->journal();
+  if (!journal)
+    return;
+
+  auto& sd = shard_data_[SidToId(shard->shard_id())];
+  sd.local_mask |= FIELDS_PERSISTED;
+  if (set_fields.empty() && removed_fields.empty())
+    return;
+
+  journal::Entry entry{journal::Op::FIELDS, db_index_, txid_, key};
+  entry.fields_set = set_fields;
+  entry.fields_removed = removed_fields;
+  if (LSN lsn = journal->PersistEntry(entry); lsn)
+    sd.journal_lsn = lsn;
+}
+
+void Transaction::JournalKeys(EngineShard* shard) {
+  journal::Journal* journal = shard->journal();
+  auto& sd = shard_data_[SidToId(shard->shard_id())];
+  bool fields_persisted = sd.local_mask & FIELDS_PERSISTED;
+  sd.local_mask &= ~FIELDS_PERSISTED;
+
+  if (!journal || IsGlobal() || (cid_->opt_mask() & CO::READONLY) ||
+      (coordinator_state_ & COORD_EXEC_CONCLUDING) == 0 || fields_persisted)
+    return;
+
+  // Keys are journaled with their state after the command, regardless of what it did to them.
+  DbSlice& db_slice = shard->db_slice();
+  DbContext db_cntx = db_context();
+
+  ArgSlice args = ShardArgsInShard(shard->shard_id());
+  unsigned step = cid_->key_arg_step();
+  for (size_t i = 0; i < args.size(); i += step) {
+    PrimeIterator it = db_slice.FindExt(db_cntx, args[i]);
+    journal::Entry entry{journal::Op::DEL, db_index_, txid_, args[i]};
+    if (IsValid(it)) {
+      entry.opcode = journal::Op::VAL;
+      entry.pval_ptr = &it->second;
+      entry.expire_ms = db_slice.ExpireTime(it);
+    }
+
+    if (LSN lsn = journal->PersistEntry(entry); lsn)
+      sd.journal_lsn = lsn;
+  }
+}
+
+void Transaction::LogAutoJournal(EngineShard* shard) {
+  journal::Journal* journal = shard->journal();
+  uint32_t opt_mask = cid_->opt_mask();
+  if (!journal || IsGlobal() || (opt_mask & CO::WRITE) == 0 || (opt_mask & CO::NO_AUTOJOURNAL) ||
+      (coordinator_state_ & COORD_EXEC_CONCLUDING) == 0 || cmd_with_full_args_.empty())
+    return;
+
+  ShardId sid = shard->shard_id();
+  CmdArgList full_args = cmd_with_full_args_.subspan(1);
+  journal::Entry entry{txid_, db_index_, {cid_->name(), full_args}, unique_shard_cnt_};
+  entry.shard_args = ShardArgsInShard(sid);
+  entry.key_step = cid_->key_arg_step();
+
+  if (unique_shard_cnt_ > 1) {
+    if (opt_mask & CO::SPLIT_JOURNAL) {
+      // Every shard journals only its part of the arguments.
+      entry.payload.second = entry.shard_args;
+    } else {
+      // The whole command is journaled once, by the first shard it spans. The other shards
+      // report their changed keys, and mark their part in the transaction for the replicas.
+      bool is_first = true;
+      for (ShardId i = 0; i < sid && is_first; ++i) {
+        is_first = shard_data_[i].arg_count == 0;
+      }
+      if (!is_first)
+        entry.payload.first = {};
+    }
+  }
+
+  journal->RecordEntry(entry);
+}
+
+void Transaction::AwaitJournal() {
+  if ((coordinator_state_ & COORD_EXEC_CONCLUDING) == 0)
+    return;
+
+  journal::Journal* journal = ServerState::tlocal()->journal();
+  if (!journal)
+    return;
+
+  for (size_t i = 0; i < shard_data_.size(); ++i) {
+    auto& sd = shard_data_[i];
+    if (sd.journal_lsn == 0)
+      continue;
+
+    journal->AwaitDurable(shard_data_.size() == 1 ? unique_shard_id_ : i, sd.journal_lsn);
+    sd.journal_lsn = 0;
+  }
 }
 
 // runs in coordinator thread.
@@ -804,14 +1243,44 @@ void Transaction::ExpireBlocking() {
   DVLOG(1) << "ExpireBlocking finished " << DebugId();
 }
 
+vector<ShardId> Transaction::GetActiveShards() const {
+  vector<ShardId> res;
+  if (IsGlobal()) {
+    for (ShardId sid = 0; sid < shard_set->size(); ++sid)
+      res.push_back(sid);
+  } else if (unique_shard_cnt_ == 1) {
+    res.push_back(unique_shard_id_);
+  } else {
+    for (ShardId sid = 0; sid < shard_data_.size(); ++sid) {
+      if (shard_data_[sid].arg_count > 0)
+        res.push_back(sid);
+    }
+  }
+  return res;
+}
+
+void Transaction::SetExecTiming(bool enable) {
+  exec_timing.store(enable, memory_order_relaxed);
+}
+
 const char* Transaction::Name() const {
   return cid_->name();
 }
 
+bool Transaction::IsFastCmd() const {
+  return cid_->opt_mask() & CO::FAST;
+}
+
 KeyLockArgs Transaction::GetLockArgs(ShardId sid) const {
   KeyLockArgs res;
   res.db_index = db_index_;
   res.key_step = cid_->key_arg_step();
+
+  // Keys set by SetMultiKeys are locked while cid_ is still the keyless EXEC command.
+  if (res.key_step == 0) {
+    DCHECK(multi_ && multi_->keys_only);
+    res.key_step = 1;
+  }
   res.args = ShardArgsInShard(sid);
 
   return res;
@@ -973,12 +1442,15 @@ size_t Transaction::ReverseArgIndex(ShardId shard_id, size_t arg_index) const {
   return reverse_index_[sd.arg_start + arg_index];
 }
 
-bool Transaction::WaitOnWatch(const time_point& tp) {
+bool Transaction::WaitOnWatch(const time_point& tp, ArgSlice watch_keys) {
   // Assumes that transaction is pending and scheduled. TODO: To verify it with state machine.
   VLOG(2) << "WaitOnWatch Start use_count(" << use_count() << ")";
   using namespace chrono;
 
-  Execute([](Transaction* t, EngineShard* shard) { return t->AddToWatchedShardCb(shard); }, true);
+  auto cb = [watch_keys](Transaction* t, EngineShard* shard) {
+    return t->AddToWatchedShardCb(shard, watch_keys);
+  };
+  Execute(std::move(cb), true);
 
   coordinator_state_ |= COORD_BLOCKED;
 
@@ -1039,14 +1511,25 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
 }
 
 // Runs only in the shard thread.
-OpStatus Transaction::AddToWatchedShardCb(EngineShard* shard) {
+OpStatus Transaction::AddToWatchedShardCb(EngineShard* shard, ArgSlice watch_keys) {
   ShardId idx = SidToId(shard->shard_id());
 
   auto& sd = shard_data_[idx];
   CHECK_EQ(0, sd.local_mask & SUSPENDED_Q);
   DCHECK_EQ(0, sd.local_mask & ARMED);
 
-  shard->AddBlocked(this);
+  // The shard is suspended even if it does not watch any of its keys, like the shard of the
+  // destination of BLMOVE, so that it runs the hops of the awakened transaction.
+  ArgSlice args = ShardArgsInShard(shard->shard_id());
+  vector<string_view> keys;
+  if (!watch_keys.empty()) {
+    for (string_view key : args) {
+      if (find(watch_keys.begin(), watch_keys.end(), key) != watch_keys.end())
+        keys.push_back(key);
+    }
+    args = keys;
+  }
+  shard->AddBlocked(this, args);
   sd.local_mask |= SUSPENDED_Q;
   DVLOG(1) << "AddWatched " << DebugId() << " local_mask:" << sd.local_mask;
 
@@ -1096,13 +1579,13 @@ void Transaction::UnlockMultiShardCb(const std::vector<KeyList>& sharded_keys, E
   // Hence it could stay in the tx queue. We perform the necessary cleanup and remove it from
   // there.
   if (sd.pq_pos != TxQueue::kEnd) {
-    DVLOG(1) << "unlockmulti: TxPopFront " << DebugId();
+    DVLOG(1) << "unlockmulti: TxRemove " << DebugId();
 
+    // Global transactions are at the front of the queue, but transactions that lock only their
+    // keys could have been scheduled behind others.
     TxQueue* txq = shard->txq();
-    DCHECK(!txq->Empty());
-    Transaction* trans = absl::get<Transaction*>(txq->Front());
-    DCHECK(trans == this);
-    txq->PopFront();
+    DCHECK(multi_->keys_only || absl::get<Transaction*>(txq->Front()) == this);
+    txq->Remove(sd.pq_pos);
     sd.pq_pos = TxQueue::kEnd;
   }
 
@@ -1152,6 +1635,10 @@ inline uint32_t Transaction::DecreaseRunCnt() {
 }
 
 bool Transaction::IsGlobal() const {
+  // The commands of a multi transaction with keys set up-front are not global, unlike EXEC.
+  if (multi_ && multi_->keys_only)
+    return false;
+
   return (cid_->opt_mask() & CO::GLOBAL_TRANS) != 0;
 }
 
@@ -1208,21 +1695,46 @@ OpResult<KeyIndex> DetermineKeys(const CommandId* cid, CmdArgList args) {
 
   int num_custom_keys = -1;
 
+  string_view name{cid->name()};
+  if (name == "XREAD" || name == "XREADGROUP") {
+    // X<READ|READGROUP> [GROUP group consumer] [COUNT count] [BLOCK ms] [NOACK]
+    //   STREAMS key ... id ...
+    for (size_t i = 1; i < args.size(); ++i) {
+      string_view arg = ArgS(args, i);
+      if (absl::EqualsIgnoreCase(arg, "GROUP")) {
+        i += 2;
+      } else if (absl::EqualsIgnoreCase(arg, "COUNT") || absl::EqualsIgnoreCase(arg, "BLOCK")) {
+        ++i;
+      } else if (absl::EqualsIgnoreCase(arg, "STREAMS")) {
+        size_t num_left = args.size() - i - 1;
+        if (num_left == 0 || num_left % 2 != 0)
+          return OpStatus::SYNTAX_ERR;
+
+        key_index.start = i + 1;
+        key_index.end = key_index.start + num_left / 2;
+        key_index.step = 1;
+        return key_index;
+      }
+    }
+    return OpStatus::SYNTAX_ERR;
+  }
+
   if (cid->opt_mask() & CO::VARIADIC_KEYS) {
     if (args.size() < 3) {
       return OpStatus::SYNTAX_ERR;
     }
 
-    string_view name{cid->name()};
-
-    if (!absl::StartsWith(name, "EVAL")) {
-      key_index.bonus = 1;  // Z<xxx>STORE commands
+    if (absl::EndsWith(name, "STORE") || name == "CMS.MERGE") {
+      key_index.bonus = 1;  // Z<xxx>STORE commands and CMS.MERGE, whose first key is the dest.
     }
-    string_view num(ArgS(args, 2));
+
+    // numkeys precedes the first key, e.g. ZUNION numkeys key ... or EVAL script numkeys key ...
+    unsigned num_pos = cid->first_key_pos() - 1;
+    string_view num(ArgS(args, num_pos));
     if (!absl::SimpleAtoi(num, &num_custom_keys) || num_custom_keys < 0)
       return OpStatus::INVALID_INT;
 
-    if (size_t(num_custom_keys) + 3 > args.size())
+    if (size_t(num_custom_keys) + num_pos + 1 > args.size())
       return OpStatus::SYNTAX_ERR;
   }
 
@@ -1244,4 +1756,15 @@ OpResult<KeyIndex> DetermineKeys(const CommandId* cid, CmdArgList args) {
   return key_index;
 }
 
+void RecordJournal(const OpArgs& op_args, string_view cmd, ArgSlice args) {
+  journal::Journal* journal = op_args.shard->journal();
+  if (!journal)
+    return;
+
+  journal::Entry entry{op_args.txid, op_args.db_cntx.db_index, {cmd, args}, 1};
+  entry.shard_args = args;
+  entry.key_step = args.size();
+  journal->RecordEntry(entry);
+}
+
 }  // namespace dfly
@@ -7,7 +7,9 @@
 #include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
 #include <absl/container/inlined_vector.h>
+#include <absl/functional/function_ref.h>
 
+#include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <string_view>
 #include <variant>
 #include <vector>
@@ -17,6 +19,7 @@
 #include "facade/op_status.h"
 #include "server/common.h"
 #include "server/table.h"
+#include "server/tx_trace.h"
 #include "util/fibers/fibers_ext.h"
 
 namespace dfly {
@@ -48,7 +51,9 @@ class Transaction {
   }
 
  public:
-  using RunnableType = std::function<OpStatus(Transaction* t, EngineShard*)>;
+  // The callbacks of the hops are referenced rather than copied, since the coordinator waits for
+  // them to run, which saves allocating their captures in every hop.
+  using RunnableType = absl::FunctionRef<OpStatus(Transaction* t, EngineShard*)>;
   using time_point = ::std::chrono::steady_clock::time_point;
 
   enum LocalMask : uint16_t {
@@ -58,12 +63,25 @@ class Transaction {
     SUSPENDED_Q = 0x10,  // added by the coordination flow (via WaitBlocked()).
     AWAKED_Q = 0x20,     // awaked by condition (lpush etc)
     EXPIRED_Q = 0x40,    // timed-out and should be garbage collected from the blocking queue.
+    FIELDS_PERSISTED = 0x80,  // the hop persisted the changed fields instead of the keys.
   };
 
   explicit Transaction(const CommandId* cid);
 
+  // Returns a transaction for cid, reusing one that was recycled on this thread when possible.
+  static boost::intrusive_ptr<Transaction> New(const CommandId* cid);
+
+  // Keeps the transaction for the next New of this thread if trans holds its only reference.
+  // Reused transactions keep the capacity of their shard data and argument vectors.
+  static void Recycle(boost::intrusive_ptr<Transaction> trans);
+
   OpStatus InitByArgs(DbIndex index, CmdArgList args);
 
+  // Returns a new transaction of the same command and arguments, which is not scheduled yet.
+  // Used by commands that complete most calls in a quick single hop and fall back to a
+  // multi-hop transaction otherwise, like the replies streamed in batches. Not for multi.
+  boost::intrusive_ptr<Transaction> CloneUnscheduled() const;
+
   void SetExecCmd(const CommandId* cid);
 
   std::string DebugId() const;
@@ -115,7 +133,7 @@ class Transaction {
   template <typename F> auto ScheduleSingleHopT(F&& f) -> decltype(f(this, nullptr)) {
     decltype(f(this, nullptr)) res;
 
-    ScheduleSingleHop([&res, f = std::forward<F>(f)](Transaction* t, EngineShard* shard) {
+    ScheduleSingleHop([&res, &f](Transaction* t, EngineShard* shard) {
       res = f(t, shard);
       return res.status();
     });
@@ -124,6 +142,28 @@ class Transaction {
 
   void UnlockMulti();
 
+  // Runs in the coordinator thread. Makes a multi transaction that was not scheduled yet lock
+  // just the keys, which all belong to shard sid, instead of locking all the shards.
+  // The keys are locked all at once when the transaction is scheduled, and the commands
+  // of the transaction may not touch other keys.
+  void SetMultiKeys(DbIndex db_index, ShardId sid, ArgSlice keys);
+
+  // Runs in the coordinator thread. Makes a script transaction that was not scheduled yet
+  // take shared locks on its keys. The commands of the script may not write.
+  void SetMultiReadOnly();
+
+  // Runs in the shard thread of all the keys of a script transaction that was not scheduled yet.
+  // If the keys are free, locks them and makes the transaction run its hops directly in the
+  // calling fiber until UnlockMulti() is called. Otherwise returns false, with the
+  // transaction left intact.
+  bool ScheduleInline(EngineShard* shard);
+
+  // Runs in the coordinator thread. The keys read by the transaction will be tracked for
+  // the CLIENT TRACKING connection identified by ref (see TrackingTable::MakeRef).
+  void SetTrackingClient(uint64_t ref) {
+    tracking_ref_ = ref;
+  }
+
   TxId txid() const {
     return txid_;
   }
@@ -133,10 +173,31 @@ class Transaction {
 
   const char* Name() const;
 
+  // Whether the command of the transaction is marked with CO::FAST.
+  bool IsFastCmd() const;
+
   uint32_t unique_shard_cnt() const {
     return unique_shard_cnt_;
   }
 
+  // Returns the shard of a transaction that spans a single shard.
+  ShardId GetUniqueShard() const {
+    DCHECK_EQ(1u, unique_shard_cnt_);
+    return unique_shard_id_;
+  }
+
+  // Runs in the coordinator thread.
+  std::vector<ShardId> GetActiveShards() const;
+
+  // Whether the transactions measure the time their callbacks run in the shards, see exec_ns.
+  static void SetExecTiming(bool enable);
+
+  // The time the callbacks of the transaction ran in the shards, summed over the shards. Read
+  // by the coordinator between the hops.
+  uint64_t exec_ns() const {
+    return exec_ns_.load(std::memory_order_relaxed);
+  }
+
   TxId notify_txid() const {
     return notify_txid_.load(std::memory_order_relaxed);
   }
@@ -151,11 +212,23 @@ class Transaction {
     return coordinator_state_ & COORD_OOO;
   }
 
+  // Runs in the shard thread. Returns true if the transaction is armed in this shard and can run
+  // ahead of the transactions before it in the tx-queue, because none of them holds a
+  // conflicting lock. Multi-shard transactions are considered only if allow_multi_shard is true.
+  // Multi transactions qualify only if their keys were set by SetMultiKeys.
+  bool IsReadyOutOfOrder(EngineShard* shard, bool allow_multi_shard) const;
+
+  // Runs in the shard thread. Returns true if the transaction may write keys of the shard that
+  // are pinned by replies still being sent, see DbSlice::PinKey. Global and multi transactions
+  // qualify if any key of the shard is pinned.
+  bool WritesPinnedKeys(EngineShard* shard) const;
+
   // Registers transaction into watched queue and blocks until a) either notification is received.
   // or b) tp is reached. If tp is time_point::max() then waits indefinitely.
   // Expects that the transaction had been scheduled before, and uses Execute(.., true) to register.
   // Returns false if timeout occurred, true if was notified by one of the keys.
-  bool WaitOnWatch(const time_point& tp);
+  // If watch_keys is not empty, only these keys of the transaction are watched.
+  bool WaitOnWatch(const time_point& tp, ArgSlice watch_keys = {});
 
   // Returns true if transaction is awaked, false if it's timed-out and can be removed from the
   // blocking queue. NotifySuspended may be called from (multiple) shard threads and
@@ -177,6 +250,12 @@ class Transaction {
     return OpArgs{shard, txid_, db_context()};
   }
 
+  // Persists the fields that the callback set, interleaved with their values, and the fields
+  // it removed, instead of the whole hash at key. Then the hop does not persist its keys.
+  // Runs in the shard thread, from the callback of a single key hash command.
+  void PersistFields(EngineShard* shard, std::string_view key, CmdArgList set_fields,
+                     CmdArgList removed_fields);
+
   DbContext db_context() const {
     return DbContext{.db_index = db_index_, .time_now_ms = time_now_ms_};
   }
@@ -196,6 +275,9 @@ class Transaction {
     return sid < shard_data_.size() ? sid : 0;
   }
 
+  // Prepares a recycled transaction to run cid, as if it was constructed for it.
+  void Reset(const CommandId* cid);
+
   void ScheduleInternal();
   void LockMulti();
 
@@ -218,7 +300,7 @@ class Transaction {
   bool CancelShardCb(EngineShard* shard);
 
   // Shard callbacks used within Execute calls
-  OpStatus AddToWatchedShardCb(EngineShard* shard);
+  OpStatus AddToWatchedShardCb(EngineShard* shard, ArgSlice watch_keys);
 
   void ExpireShardCb(EngineShard* shard);
   void UnlockMultiShardCb(const std::vector<KeyList>& sharded_keys, EngineShard* shard);
@@ -234,6 +316,25 @@ class Transaction {
   // Returns the previous value of run count.
   uint32_t DecreaseRunCnt();
 
+  // Registers the keys of the shard in its tracking table, if the transaction tracks them.
+  void TrackKeys(EngineShard* shard);
+
+  // Records the keys of the shard of a write command that runs while a snapshot is being
+  // loaded, see DbSlice::TrackLoadingWrites.
+  void RecordLoadingWrites(EngineShard* shard);
+
+  // Persists the keys of the shard after the concluding hop of a write command, if the journal
+  // is persistent.
+  void JournalKeys(EngineShard* shard);
+
+  // Records the command in the journal after its concluding hop, see CO::NO_AUTOJOURNAL and
+  // CO::SPLIT_JOURNAL.
+  void LogAutoJournal(EngineShard* shard);
+
+  // Blocks the coordinator until the keys journaled by the concluding hop are on disk,
+  // see journal_fsync.
+  void AwaitJournal();
+
   uint32_t use_count() const {
     return use_count_.load(std::memory_order_relaxed);
   }
@@ -250,6 +351,9 @@ class Transaction {
     // tx queue.
     uint32_t pq_pos = TxQueue::kEnd;
 
+    // LSN of the last entry that the concluding hop persisted with journal_fsync=always.
+    uint64_t journal_lsn = 0;
+
     PerShardData(PerShardData&&) noexcept {
     }
 
@@ -266,6 +370,15 @@ class Transaction {
     // Whether this transaction can lock more keys during its progress.
     bool is_expanding = true;
     bool locks_recorded = false;
+
+    // Whether its keys were set up-front with SetMultiKeys.
+    bool keys_only = false;
+
+    // Set by SetMultiReadOnly.
+    bool read_only = false;
+
+    // Set by ScheduleInline.
+    bool is_inline = false;
   };
 
   util::fibers_ext::EventCount blocking_ec_;  // used to wake blocking transactions.
@@ -281,12 +394,16 @@ class Transaction {
   //! Stores arguments of the transaction (i.e. keys + values) partitioned by shards.
   absl::InlinedVector<std::string_view, 4> args_;
 
+  // The command name followed by all its arguments, valid while the command runs.
+  CmdArgList cmd_with_full_args_;
+
   // Reverse argument mapping. Allows to reconstruct responses according to the original order of
   // keys.
   std::vector<uint32_t> reverse_index_;
 
-  RunnableType cb_;
+  RunnableType* cb_ptr_ = nullptr;  // The callback of the current hop.
   std::unique_ptr<Multi> multi_;  // Initialized when the transaction is multi/exec.
+  std::unique_ptr<TxTrace> trace_;  // Initialized when the transaction is sampled for tracing.
 
   const CommandId* cid_;
 
@@ -294,6 +411,7 @@ class Transaction {
   uint64_t time_now_ms_{0};
   std::atomic<TxId> notify_txid_{kuint64max};
   std::atomic_uint32_t use_count_{0}, run_count_{0}, seqlock_{0};
+  std::atomic_uint64_t exec_ns_{0};
 
   // unique_shard_cnt_ and unique_shard_id_ is accessed only by coordinator thread.
   uint32_t unique_shard_cnt_{0};  // number of unique shards span by args_
@@ -301,6 +419,9 @@ class Transaction {
   ShardId unique_shard_id_{kInvalidSid};
   DbIndex db_index_;
 
+  // 0 if the keys are not tracked. Client ids start from 1, so no valid ref is 0.
+  uint64_t tracking_ref_ = 0;
+
   // Used for single-hop transactions with unique_shards_ == 1, hence no data-race.
   OpStatus local_result_ = OpStatus::OK;
 
@@ -334,6 +455,11 @@ class Transaction {
   struct TLTmpSpace {
     std::vector<PerShardCache> shard_cache;
     absl::flat_hash_set<std::string_view> uniq_keys;
+
+    // The recycled transactions, which nothing references.
+    std::vector<Transaction*> pool;
+
+    ~TLTmpSpace();
   };
 
   static thread_local TLTmpSpace tmp_space;
@@ -345,4 +471,8 @@ inline uint16_t trans_id(const Transaction* ptr) {
 
 OpResult<KeyIndex> DetermineKeys(const CommandId* cid, CmdArgList args);
 
+// Journals cmd with args as the change of the shard. Used by the commands that can not be
+// replayed the way they were called, see CO::NO_AUTOJOURNAL. The first of args is the key.
+void RecordJournal(const OpArgs& op_args, std::string_view cmd, ArgSlice args);
+
 }  // namespace dfly
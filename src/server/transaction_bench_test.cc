@@ -0,0 +1,292 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Benchmarks of the transaction framework over an in-process EngineShardSet, without the
+// connections and the commands of the full service, so that they measure the scheduling and
+// the coordination of the shards alone. Run with --bench, e.g.
+//   transaction_bench_test --bench --benchmark_filter=BM_MultiHop
+// The arguments are the number of the shards and the number of the fibers that run
+// transactions concurrently on every thread. Besides the throughput, every benchmark reports
+// the percentiles of the hop latency and of the time a transaction waited in the tx-queues
+// before its first callback ran, in usec.
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "core/latency_histogram.h"
+#include "server/command_registry.h"
+#include "server/engine_shard_set.h"
+#include "server/transaction.h"
+#include "util/uring/uring_pool.h"
+
+namespace dfly {
+
+using namespace util;
+using namespace std;
+using absl::StrCat;
+namespace fibers = ::boost::fibers;
+
+namespace {
+
+enum TxKind {
+  kSingleHop = 0,  // single key, runs as a quickie when uncontended.
+  kMultiHop,       // two keys on different shards, scheduled and then executed in two hops.
+  kMultiExec,      // MULTI/EXEC with two commands on different shards.
+  kBlocking,       // a blocking pop that watches its key and times out at once.
+  kOOO,            // single hop on two shards with keys free of other transactions.
+  kContended,      // like kOOO, but all the fibers use the same keys.
+};
+
+constexpr unsigned kTxPerFiber = 64;
+constexpr unsigned kKeysPerFiber = 16;
+
+// The stats of the transactions of a thread, which its fibers share.
+struct TxStats {
+  uint64_t txs = 0;
+  LatencyHistogram hop_ns;
+  LatencyHistogram queue_wait_ns;
+
+  void Merge(const TxStats& o) {
+    txs += o.txs;
+    hop_ns.Merge(o.hop_ns);
+    queue_wait_ns.Merge(o.queue_wait_ns);
+  }
+};
+
+class TxBenchEnv {
+ public:
+  explicit TxBenchEnv(unsigned num_shards);
+  ~TxBenchEnv();
+
+  // Runs kTxPerFiber transactions of kind from num_fibers fibers on every thread. Returns the
+  // stats merged over the threads.
+  TxStats RunRound(TxKind kind, unsigned num_fibers);
+
+  // The sums of the ooo_runs and the quick_runs of the shards.
+  pair<uint64_t, uint64_t> ShardRuns() const;
+
+ private:
+  // The keys of a fiber, in pairs of keys that belong to different shards if there are several.
+  StringVec MakeKeys(string_view prefix) const;
+
+  void RunFiber(TxKind kind, const StringVec& keys, TxStats* stats);
+
+  unsigned num_shards_;
+  unique_ptr<ProactorPool> pp_;
+
+  CommandId get_cid_{"get", CO::READONLY | CO::FAST, 2, 1, 1, 1};
+  CommandId set_cid_{"set", CO::WRITE | CO::DENYOOM, -3, 1, 1, 1};
+  CommandId rename_cid_{"rename", CO::WRITE, 3, 1, 2, 1};
+  CommandId mset_cid_{"mset", CO::WRITE | CO::DENYOOM, -3, 1, -1, 2};
+  CommandId blpop_cid_{"blpop", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1};
+  CommandId exec_cid_{"exec", CO::LOADING | CO::NOSCRIPT, 1, 0, 0, 0};
+};
+
+TxBenchEnv::TxBenchEnv(unsigned num_shards) : num_shards_(num_shards) {
+  pp_.reset(new uring::UringPool(16, num_shards));
+  pp_->Run();
+  shard_set = new EngineShardSet(pp_.get());
+  shard_set->Init(num_shards, false);
+}
+
+TxBenchEnv::~TxBenchEnv() {
+  shard_set->Shutdown();
+  delete shard_set;
+  shard_set = nullptr;
+
+  pp_->Stop();
+}
+
+StringVec TxBenchEnv::MakeKeys(string_view prefix) const {
+  StringVec res;
+  for (unsigned i = 0; res.size() < kKeysPerFiber * 2; ++i) {
+    string key = StrCat(prefix, i);
+    if (res.size() % 2 == 1 && num_shards_ > 1 &&
+        Shard(key, num_shards_) == Shard(res.back(), num_shards_))
+      continue;
+    res.push_back(std::move(key));
+  }
+  return res;
+}
+
+TxStats TxBenchEnv::RunRound(TxKind kind, unsigned num_fibers) {
+  vector<TxStats> stats(pp_->size());
+
+  pp_->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    vector<StringVec> keys(num_fibers);
+    for (unsigned i = 0; i < num_fibers; ++i) {
+      keys[i] = MakeKeys(kind == kContended ? "key" : StrCat("key:", index, ":", i, ":"));
+    }
+
+    vector<fibers::fiber> fbs;
+    for (unsigned i = 0; i < num_fibers; ++i) {
+      fbs.emplace_back([&, i] { RunFiber(kind, keys[i], &stats[index]); });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+  });
+
+  TxStats res;
+  for (const auto& s : stats)
+    res.Merge(s);
+  return res;
+}
+
+void TxBenchEnv::RunFiber(TxKind kind, const StringVec& keys, TxStats* stats) {
+  auto noop = [](Transaction*, EngineShard*) { return OpStatus::OK; };
+
+  for (unsigned i = 0; i < kTxPerFiber; ++i) {
+    const string& key1 = keys[(i % kKeysPerFiber) * 2];
+    const string& key2 = keys[(i % kKeysPerFiber) * 2 + 1];
+
+    // The time the first callback of the transaction started to run.
+    atomic_uint64_t first_run_ns{0};
+    auto cb = [&](Transaction*, EngineShard*) {
+      uint64_t expected = 0;
+      first_run_ns.compare_exchange_strong(expected, ProactorBase::GetMonotonicTimeNs(),
+                                           memory_order_relaxed);
+      return OpStatus::OK;
+    };
+
+    StringVec strs;
+    CmdArgVec args;
+    auto make_trans = [&](const CommandId* cid, initializer_list<string_view> list) {
+      strs.assign(list.begin(), list.end());
+      args.clear();
+      for (auto& s : strs)
+        args.emplace_back(s);
+      boost::intrusive_ptr<Transaction> trans(new Transaction{cid});
+      CHECK(trans->InitByArgs(0, {args.data(), args.size()}) == OpStatus::OK);
+      return trans;
+    };
+
+    uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+    uint64_t hop_start_ns = start_ns;
+    auto end_hop = [&] {
+      uint64_t now = ProactorBase::GetMonotonicTimeNs();
+      stats->hop_ns.Add(now - hop_start_ns);
+      hop_start_ns = now;
+    };
+
+    switch (kind) {
+      case kSingleHop:
+        make_trans(&get_cid_, {"get", key1})->ScheduleSingleHop(cb);
+        end_hop();
+        break;
+      case kMultiHop: {
+        auto trans = make_trans(&rename_cid_, {"rename", key1, key2});
+        trans->Schedule();
+        trans->Execute(cb, false);
+        end_hop();
+        trans->Execute(noop, true);
+        end_hop();
+        break;
+      }
+      case kMultiExec: {
+        boost::intrusive_ptr<Transaction> trans(new Transaction{&exec_cid_});
+        StringVec cmd_strs;
+        CmdArgVec cmd_args;
+        for (const string& key : {key1, key2}) {
+          cmd_strs.assign({"set", key, "v"});
+          cmd_args.clear();
+          for (auto& s : cmd_strs)
+            cmd_args.emplace_back(s);
+          trans->SetExecCmd(&set_cid_);
+          CHECK(trans->InitByArgs(0, {cmd_args.data(), cmd_args.size()}) == OpStatus::OK);
+          trans->ScheduleSingleHop(cb);
+          end_hop();
+        }
+        trans->UnlockMulti();
+        break;
+      }
+      case kBlocking: {
+        // The queue wait is the time it took to schedule, since no callback of ours runs.
+        auto trans = make_trans(&blpop_cid_, {"blpop", key1, "0"});
+        trans->Schedule();
+        first_run_ns.store(ProactorBase::GetMonotonicTimeNs(), memory_order_relaxed);
+        string_view watch_key = key1;
+        trans->WaitOnWatch(chrono::steady_clock::now(), ArgSlice{&watch_key, 1});
+        end_hop();
+        break;
+      }
+      case kOOO:
+      case kContended:
+        make_trans(&mset_cid_, {"mset", key1, "v", key2, "v"})->ScheduleSingleHop(cb);
+        end_hop();
+        break;
+    }
+
+    uint64_t first_ns = first_run_ns.load(memory_order_relaxed);
+    if (first_ns >= start_ns)
+      stats->queue_wait_ns.Add(first_ns - start_ns);
+    ++stats->txs;
+  }
+}
+
+pair<uint64_t, uint64_t> TxBenchEnv::ShardRuns() const {
+  atomic_uint64_t ooo_runs{0}, quick_runs{0};
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    ooo_runs.fetch_add(shard->stats().ooo_runs, memory_order_relaxed);
+    quick_runs.fetch_add(shard->stats().quick_runs, memory_order_relaxed);
+  });
+  return {ooo_runs.load(), quick_runs.load()};
+}
+
+void BM_Transaction(benchmark::State& state, TxKind kind) {
+  TxBenchEnv env(state.range(0));
+  unsigned num_fibers = state.range(1);
+
+  auto [ooo_before, quick_before] = env.ShardRuns();
+  TxStats total;
+  for (auto _ : state) {
+    total.Merge(env.RunRound(kind, num_fibers));
+  }
+  auto [ooo_after, quick_after] = env.ShardRuns();
+
+  double txs = max<uint64_t>(total.txs, 1);
+  state.counters["hop_p50_usec"] = total.hop_ns.Percentile(50) / 1000.0;
+  state.counters["hop_p99_usec"] = total.hop_ns.Percentile(99) / 1000.0;
+  state.counters["queue_wait_p50_usec"] = total.queue_wait_ns.Percentile(50) / 1000.0;
+  state.counters["queue_wait_p99_usec"] = total.queue_wait_ns.Percentile(99) / 1000.0;
+  state.counters["ooo_per_tx"] = (ooo_after - ooo_before) / txs;
+  state.counters["quick_per_tx"] = (quick_after - quick_before) / txs;
+  state.SetItemsProcessed(total.txs);
+}
+
+#define TX_BENCHMARK(name, kind)                                                               \
+  BENCHMARK_CAPTURE(BM_Transaction, name, kind)                                                \
+      ->Args({1, 1})                                                                           \
+      ->Args({2, 16})                                                                          \
+      ->Args({4, 16})                                                                          \
+      ->Args({8, 16})                                                                          \
+      ->Args({8, 64})                                                                          \
+      ->UseRealTime()
+
+TX_BENCHMARK(SingleHop, kSingleHop);
+TX_BENCHMARK(MultiHop, kMultiHop);
+TX_BENCHMARK(MultiExec, kMultiExec);
+TX_BENCHMARK(Blocking, kBlocking);
+TX_BENCHMARK(OOO, kOOO);
+TX_BENCHMARK(Contended, kContended);
+
+}  // namespace
+
+TEST(TransactionBenchTest, Round) {
+  // Every kind of transaction completes, with a hop per shard callback round.
+  TxBenchEnv env(3);
+  for (TxKind kind : {kSingleHop, kMultiHop, kMultiExec, kBlocking, kOOO, kContended}) {
+    TxStats stats = env.RunRound(kind, 4);
+    EXPECT_EQ(3u * 4 * kTxPerFiber, stats.txs) << kind;
+    unsigned hops = kind == kMultiHop || kind == kMultiExec ? 2 : 1;
+    EXPECT_EQ(stats.txs * hops, stats.hop_ns.count()) << kind;
+  }
+
+  // The uncontended single-key transactions run as quickies, and those of kOOO out of order.
+  auto [ooo_runs, quick_runs] = env.ShardRuns();
+  EXPECT_GT(quick_runs, 0u);
+  EXPECT_GT(ooo_runs, 0u);
+}
+
+}  // namespace dfly
@@ -0,0 +1,177 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tx_trace.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <atomic>
+#include <deque>
+
+#include "util/proactor_base.h"
+
+namespace dfly {
+
+using namespace std;
+using util::ProactorBase;
+
+namespace {
+
+// The latest events of the thread kept for the timeline, about 200KB.
+constexpr size_t kMaxTimelineEvents = 4096;
+
+struct TimelineEvent {
+  string_view cmd;
+  TxId txid;
+  ShardId sid;  // kInvalidSid for the phases of the coordinator.
+  TxTrace::Phase phase;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+atomic_uint32_t sample_rate{0};
+
+thread_local uint32_t tl_sample_counter = 0;
+thread_local TxTrace::StatsMap tl_stats;
+thread_local deque<TimelineEvent> tl_timeline;
+
+uint64_t Now() {
+  return ProactorBase::GetMonotonicTimeNs();
+}
+
+// Microseconds with a fraction, since the doubles of StrCat keep only 6 digits.
+string Micros(uint64_t ns) {
+  return absl::StrCat(ns / 1000, ".", absl::Dec(ns % 1000, absl::kZeroPad3));
+}
+
+}  // namespace
+
+auto TxTrace::PhaseStats::operator+=(const PhaseStats& o) -> PhaseStats& {
+  hops += o.hops;
+  for (unsigned i = 0; i < NUM_PHASES; ++i) {
+    total_ns[i] += o.total_ns[i];
+    max_ns[i] = max(max_ns[i], o.max_ns[i]);
+  }
+  return *this;
+}
+
+const char* TxTrace::PhaseName(Phase phase) {
+  switch (phase) {
+    case SCHEDULE:
+      return "schedule";
+    case QUEUE:
+      return "queue";
+    case RUN:
+      return "run";
+    case CONCLUDE:
+      return "conclude";
+    case NUM_PHASES:
+      break;
+  }
+  return "unknown";
+}
+
+void TxTrace::SetSampleRate(uint32_t rate) {
+  sample_rate.store(rate, memory_order_relaxed);
+}
+
+unique_ptr<TxTrace> TxTrace::Sample() {
+  uint32_t rate = sample_rate.load(memory_order_relaxed);
+  if (rate == 0 || ++tl_sample_counter < rate)
+    return nullptr;
+
+  tl_sample_counter = 0;
+  return make_unique<TxTrace>();
+}
+
+void TxTrace::StartSchedule() {
+  schedule_start_ns_ = Now();
+}
+
+void TxTrace::EndSchedule() {
+  schedule_end_ns_ = Now();
+}
+
+void TxTrace::StartHop(size_t num_shards) {
+  runs_.assign(num_shards, ShardRun{});
+  hop_start_ns_ = Now();
+}
+
+void TxTrace::StartRun(unsigned idx, ShardId sid) {
+  // The callbacks that do not belong to a hop, e.g. of the blocking commands, are not traced.
+  if (idx >= runs_.size())
+    return;
+  ShardRun& run = runs_[idx];
+  run.sid = sid;
+  run.start_ns = Now();
+}
+
+void TxTrace::EndRun(unsigned idx) {
+  if (idx < runs_.size())
+    runs_[idx].end_ns = Now();
+}
+
+void TxTrace::EndHop(string_view cmd, TxId txid) {
+  uint64_t now = Now();
+  uint64_t schedule_ns = schedule_end_ns_ - schedule_start_ns_;
+
+  auto add_event = [&](ShardId sid, Phase phase, uint64_t start_ns, uint64_t duration_ns) {
+    if (tl_timeline.size() >= kMaxTimelineEvents)
+      tl_timeline.pop_front();
+    tl_timeline.push_back(TimelineEvent{cmd, txid, sid, phase, start_ns, duration_ns});
+  };
+
+  if (schedule_ns > 0)
+    add_event(kInvalidSid, SCHEDULE, schedule_start_ns_, schedule_ns);
+
+  uint64_t last_end_ns = hop_start_ns_;
+  for (const ShardRun& run : runs_) {
+    if (run.sid == kInvalidSid || run.end_ns == 0)
+      continue;
+
+    // min() guards against the clocks of the threads going slightly apart.
+    uint64_t phases[NUM_PHASES] = {schedule_ns, run.start_ns - min(run.start_ns, hop_start_ns_),
+                                   run.end_ns - run.start_ns, now - run.end_ns};
+    PhaseStats& stats = tl_stats[{cmd, run.sid}];
+    ++stats.hops;
+    for (unsigned i = 0; i < NUM_PHASES; ++i) {
+      stats.total_ns[i] += phases[i];
+      stats.max_ns[i] = max(stats.max_ns[i], phases[i]);
+    }
+
+    add_event(run.sid, QUEUE, run.start_ns - phases[QUEUE], phases[QUEUE]);
+    add_event(run.sid, RUN, run.start_ns, phases[RUN]);
+    last_end_ns = max(last_end_ns, run.end_ns);
+  }
+  add_event(kInvalidSid, CONCLUDE, last_end_ns, now - last_end_ns);
+
+  // Only the first hop is scheduled.
+  schedule_start_ns_ = schedule_end_ns_ = 0;
+  runs_.clear();
+}
+
+void TxTrace::MergeStats(StatsMap* dest) {
+  for (const auto& [key, stats] : tl_stats)
+    (*dest)[key] += stats;
+}
+
+// The shards and the coordinators are the threads of two processes in the viewer, with the
+// timestamps in microseconds.
+void TxTrace::AppendTimeline(unsigned thread_index, string* dest) {
+  for (const TimelineEvent& ev : tl_timeline) {
+    bool coordinator = ev.sid == kInvalidSid;
+    absl::StrAppend(dest, dest->empty() ? "" : ",\n", "{\"name\":\"", PhaseName(ev.phase),
+                    "\",\"cat\":\"", ev.cmd, "\",\"ph\":\"X\",\"ts\":", Micros(ev.start_ns),
+                    ",\"dur\":", Micros(ev.duration_ns), ",\"pid\":", coordinator ? 1 : 0,
+                    ",\"tid\":", coordinator ? thread_index : ev.sid,
+                    ",\"args\":{\"txid\":", ev.txid, "}}");
+  }
+}
+
+void TxTrace::Reset() {
+  tl_stats.clear();
+  tl_timeline.clear();
+}
+
+}  // namespace dfly
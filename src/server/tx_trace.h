@@ -0,0 +1,80 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// Timings of the phases of a sampled transaction, see --tx_trace_sample. Every hop goes through:
+//   schedule - the coordinator places the transaction into the tx queues of its shards, only
+//              for the first hop,
+//   queue - the hop waits in the shard for the transactions ahead of it and for its locks,
+//   run - the shard runs the callback of the hop,
+//   conclude - the coordinator wakes up once all the shards ran the hop.
+// The coordinator folds the timings of every hop into the stats of its thread, by command and
+// shard, and keeps the latest ones as a timeline that /txz?trace dumps in Chrome trace format.
+class TxTrace {
+ public:
+  enum Phase : uint8_t { SCHEDULE, QUEUE, RUN, CONCLUDE, NUM_PHASES };
+
+  struct PhaseStats {
+    uint64_t hops = 0;
+    uint64_t total_ns[NUM_PHASES] = {};
+    uint64_t max_ns[NUM_PHASES] = {};
+
+    PhaseStats& operator+=(const PhaseStats& o);
+  };
+
+  // By the command name, which is the static one of CommandId, and the shard.
+  using StatsMap = absl::flat_hash_map<std::pair<std::string_view, ShardId>, PhaseStats>;
+
+  static const char* PhaseName(Phase phase);
+
+  // 1 in rate transactions is traced, 0 disables the tracing.
+  static void SetSampleRate(uint32_t rate);
+
+  // Returns the trace of a new transaction of this thread if it is sampled, or null.
+  static std::unique_ptr<TxTrace> Sample();
+
+  // Called by the coordinator.
+  void StartSchedule();
+  void EndSchedule();
+  void StartHop(size_t num_shards);
+  void EndHop(std::string_view cmd, TxId txid);
+
+  // Called by the shard thread of the idx-th shard data of the transaction, during the hop.
+  void StartRun(unsigned idx, ShardId sid);
+  void EndRun(unsigned idx);
+
+  // Merge the stats of this thread into dest, or append its timeline to dest as comma separated
+  // events of the Chrome trace format, where the coordinator events belong to thread_index.
+  static void MergeStats(StatsMap* dest);
+  static void AppendTimeline(unsigned thread_index, std::string* dest);
+
+  // Clears the stats and the timeline of this thread.
+  static void Reset();
+
+ private:
+  struct ShardRun {
+    ShardId sid = kInvalidSid;
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+  };
+
+  uint64_t schedule_start_ns_ = 0;
+  uint64_t schedule_end_ns_ = 0;
+  uint64_t hop_start_ns_ = 0;
+  std::vector<ShardRun> runs_;  // of the current hop, by the index of the shard data.
+};
+
+}  // namespace dfly
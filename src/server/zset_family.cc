@@ -4,15 +4,22 @@
 
 #include "server/zset_family.h"
 
+#include <absl/strings/match.h>
+#include <absl/strings/str_format.h>
+
+#include <queue>
+
 extern "C" {
 #include "redis/listpack.h"
 #include "redis/object.h"
+#include "redis/redis_aux.h"
 #include "redis/util.h"
 #include "redis/zset.h"
 }
 
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "core/geohash.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
@@ -81,6 +88,7 @@ struct ZParams {
   unsigned flags = 0;  // mask of ZADD_IN_ macros.
   bool ch = false;     // Corresponds to CH option.
   bool override = false;
+  uint32_t cap = 0;  // Corresponds to CAP option, 0 if the set is not capped.
 };
 
 OpResult<PrimeIterator> FindZEntry(const ZParams& zparams, const OpArgs& op_args, string_view key,
@@ -122,6 +130,59 @@ OpResult<PrimeIterator> FindZEntry(const ZParams& zparams, const OpArgs& op_args
   return it;
 }
 
+// The members of a listpack sorted set, for binary searches over their scores. Skipping a
+// listpack entry only reads its header, while a score that is not an integer is a string to
+// parse, so the searches index the members first and then parse O(log n) scores instead of all
+// of those before the range. The index is built on the stack for one operation, so the encoding
+// and the memory of the listpack stay as they are.
+class ListpackIndex {
+ public:
+  explicit ListpackIndex(uint8_t* zl) : zl_(zl) {
+    for (uint8_t* p = lpFirst(zl); p; p = lpNext(zl, lpNext(zl, p)))
+      members_.push_back(p);
+  }
+
+  unsigned size() const {
+    return members_.size();
+  }
+
+  uint8_t* Member(unsigned i) const {
+    return members_[i];
+  }
+
+  double Score(unsigned i) const {
+    return zzlGetScore(lpNext(zl_, members_[i]));
+  }
+
+  // Returns the index of the first member whose score is not below the minimum of range.
+  unsigned LowerBound(const zrangespec& range) const {
+    return PartitionPoint([&](double score) { return !zslValueGteMin(score, &range); });
+  }
+
+  // Returns the index of the first member whose score is above the maximum of range.
+  unsigned UpperBound(const zrangespec& range) const {
+    return PartitionPoint([&](double score) { return zslValueLteMax(score, &range); });
+  }
+
+ private:
+  // Returns the index of the first member for which pred is false. pred holds for a prefix of
+  // the members, since they are sorted by score.
+  template <typename Pred> unsigned PartitionPoint(Pred pred) const {
+    unsigned lo = 0, hi = size();
+    while (lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (pred(Score(mid)))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  uint8_t* zl_;
+  absl::InlinedVector<uint8_t*, 128> members_;
+};
+
 enum class Action { RANGE = 0, REMOVE = 1, POP = 2 };
 
 class IntervalVisitor {
@@ -308,11 +369,14 @@ void IntervalVisitor::ActionRem(unsigned start, unsigned end) {
 
 void IntervalVisitor::ActionRem(const zrangespec& range) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
+    // The members in range are deleted with a single move of the tail of the listpack.
     uint8_t* zl = (uint8_t*)zobj_->ptr;
-    unsigned long deleted = 0;
-    zl = zzlDeleteRangeByScore(zl, &range, &deleted);
-    zobj_->ptr = zl;
-    removed_ = deleted;
+    ListpackIndex index(zl);
+    unsigned first = index.LowerBound(range);
+    unsigned last = index.UpperBound(range);
+    removed_ = first < last ? last - first : 0;
+    if (removed_)
+      zobj_->ptr = lpDeleteRange(zl, 2 * first, 2 * removed_);
   } else {
     CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
     zset* zs = (zset*)zobj_->ptr;
@@ -344,46 +408,19 @@ void IntervalVisitor::ActionPop(ZSetFamily::TopNScored sc) {
 }
 
 void IntervalVisitor::ExtractListPack(const zrangespec& range) {
-  uint8_t* zl = (uint8_t*)zobj_->ptr;
-  uint8_t *eptr, *sptr;
-  uint8_t* vstr;
-  unsigned int vlen = 0;
-  long long vlong = 0;
-  unsigned offset = params_.offset;
-  unsigned limit = params_.limit;
-
-  /* If reversed, get the last node in range as starting point. */
-  if (params_.reverse) {
-    eptr = zzlLastInRange(zl, &range);
-  } else {
-    eptr = zzlFirstInRange(zl, &range);
-  }
-
-  /* Get score pointer for the first element. */
-  if (eptr)
-    sptr = lpNext(zl, eptr);
-
-  /* If there is an offset, just traverse the number of elements without
-   * checking the score because that is done in the next loop. */
-  while (eptr && offset--) {
-    Next(zl, &eptr, &sptr);
-  }
-
-  while (eptr && limit--) {
-    double score = zzlGetScore(sptr);
-
-    /* Abort when the node is no longer in range. */
-    if (!IsUnder(score, range))
-      break;
-
-    /* We know the element exists, so lpGetValue should always
-     * succeed */
-    vstr = lpGetValue(eptr, &vlen, &vlong);
-
-    AddResult(vstr, vlen, vlong, score);
+  ListpackIndex index((uint8_t*)zobj_->ptr);
+  unsigned first = index.LowerBound(range);
+  unsigned last = index.UpperBound(range);  // exclusive
+  if (first >= last || params_.offset >= last - first)
+    return;
 
-    /* Move to next node */
-    Next(zl, &eptr, &sptr);
+  unsigned count = min(last - first - params_.offset, params_.limit);
+  for (unsigned i = 0; i < count; ++i) {
+    unsigned pos = params_.reverse ? last - 1 - params_.offset - i : first + params_.offset + i;
+    unsigned int vlen = 0;
+    long long vlong = 0;
+    uint8_t* vstr = lpGetValue(index.Member(pos), &vlen, &vlong);
+    AddResult(vstr, vlen, vlong, index.Score(pos));
   }
 }
 
@@ -615,23 +652,24 @@ void SendAtLeastOneKeyError(ConnectionContext* cntx) {
 }
 
 enum class AggType : uint8_t { SUM, MIN, MAX };
-using ScoredMap = absl::flat_hash_map<std::string, double>;
 
-ScoredMap FromObject(const CompactObj& co, double weight) {
+// Members sorted by member, with their weighted scores. The set operations merge the runs of
+// the sorted sets, first in their shards and then across the shards, instead of hashing the
+// members into maps.
+using ScoredRun = ZSetFamily::ScoredArray;
+
+ScoredRun FromObject(const CompactObj& co, double weight) {
   robj* obj = co.AsRObj();
   ZSetFamily::RangeParams params;
   params.with_scores = true;
   IntervalVisitor vis(Action::RANGE, params, obj);
   vis(ZSetFamily::IndexInterval(0, -1));
 
-  ZSetFamily::ScoredArray arr = vis.PopResult();
-  ScoredMap res;
-  res.reserve(arr.size());
-
-  for (auto& elem : arr) {
+  ScoredRun res = vis.PopResult();
+  for (auto& elem : res) {
     elem.second *= weight;
-    res.emplace(move(elem));
   }
+  sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
 
   return res;
 }
@@ -648,143 +686,158 @@ double Aggregate(double v1, double v2, AggType atype) {
   return 0;
 }
 
-// the result is in the destination.
-void UnionScoredMap(ScoredMap* dest, ScoredMap* src, AggType agg_type) {
-  ScoredMap* target = dest;
-  ScoredMap* iter = src;
-
-  if (iter->size() > target->size())
-    swap(target, iter);
+// K-way merge of the runs, aggregating the scores of the same member. Keeps only the members
+// that are in all the runs if inter is set. Consumes the runs.
+ScoredRun MergeRuns(vector<ScoredRun>* runs, bool inter, AggType agg_type) {
+  if (runs->empty())
+    return {};
+  if (runs->size() == 1)
+    return std::move(runs->front());
 
-  for (const auto& elem : *iter) {
-    auto [it, inserted] = target->emplace(elem);
-    if (!inserted) {
-      it->second = Aggregate(it->second, elem.second, agg_type);
+  using Cursor = pair<unsigned, size_t>;  // run index and position in it.
+  auto greater = [runs](const Cursor& l, const Cursor& r) {
+    return (*runs)[l.first][l.second].first > (*runs)[r.first][r.second].first;
+  };
+  priority_queue<Cursor, vector<Cursor>, decltype(greater)> heap(greater);
+  for (unsigned i = 0; i < runs->size(); ++i) {
+    if (!(*runs)[i].empty())
+      heap.emplace(i, 0);
+    else if (inter)
+      return {};
+  }
+
+  ScoredRun result;
+  unsigned group_cnt = 0;  // the number of runs that hold result.back().
+  bool exhausted = false;
+  while (!heap.empty()) {
+    auto [ri, pos] = heap.top();
+    heap.pop();
+    ScoredMember& elem = (*runs)[ri][pos];
+
+    if (!result.empty() && result.back().first == elem.first) {
+      result.back().second = Aggregate(result.back().second, elem.second, agg_type);
+      ++group_cnt;
+    } else {
+      if (inter && !result.empty() && group_cnt < runs->size())
+        result.pop_back();
+
+      // The members after an exhausted run can not be in all of the runs.
+      if (inter && exhausted)
+        return result;
+      result.push_back(std::move(elem));
+      group_cnt = 1;
     }
-  }
 
-  if (target != dest)
-    dest->swap(*src);
-}
+    if (pos + 1 < (*runs)[ri].size())
+      heap.emplace(ri, pos + 1);
+    else
+      exhausted = true;
+  }
 
-void InterScoredMap(ScoredMap* dest, ScoredMap* src, AggType agg_type) {
-  ScoredMap* target = dest;
-  ScoredMap* iter = src;
+  if (inter && !result.empty() && group_cnt < runs->size())
+    result.pop_back();
 
-  if (iter->size() > target->size())
-    swap(target, iter);
+  return result;
+}
 
-  auto it = iter->begin();
-  while (it != iter->end()) {
-    auto inter_it = target->find(it->first);
-    if (inter_it == target->end()) {
-      auto copy_it = it++;
-      iter->erase(copy_it);
-    } else {
-      it->second = Aggregate(it->second, inter_it->second, agg_type);
+// Returns the members of src that are not in other.
+ScoredRun DiffRuns(ScoredRun src, const ScoredRun& other) {
+  ScoredRun result;
+  auto it = other.begin();
+  for (auto& elem : src) {
+    while (it != other.end() && it->first < elem.first)
       ++it;
-    }
+    if (it == other.end() || it->first != elem.first)
+      result.push_back(std::move(elem));
   }
+  return result;
+}
 
-  if (iter != dest)
-    dest->swap(*src);
+// Sorts the members like ZRANGE, by score and then by member.
+void SortByScore(ScoredRun* run) {
+  sort(run->begin(), run->end(), [](const auto& l, const auto& r) {
+    return l.second < r.second || (l.second == r.second && l.first < r.first);
+  });
 }
 
-OpResult<ScoredMap> OpUnion(EngineShard* shard, Transaction* t, string_view dest, AggType agg_type,
-                            const vector<double>& weights, bool store) {
+struct StoreArgs {
+  AggType agg_type = AggType::SUM;
+  unsigned num_keys;
+  unsigned num_pos;  // the position of numkeys, 2 for Z<xxx>STORE and 1 otherwise.
+  vector<double> weights;
+  bool with_scores = false;
+};
+
+// Returns the merged run of the sorted sets of the keys in the shard, skipping the destination
+// key of Z<xxx>STORE. SKIPPED when the shard holds no source keys.
+OpResult<ScoredRun> OpSetOpRun(EngineShard* shard, Transaction* t, const StoreArgs& sargs,
+                               std::optional<string_view> dest, bool inter) {
   ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
   DVLOG(1) << "shard:" << shard->shard_id() << ", keys " << vector(keys.begin(), keys.end());
   DCHECK(!keys.empty());
 
   unsigned start = 0;
-
-  if (keys.front() == dest) {
+  if (dest && keys.front() == *dest) {
     ++start;
   }
 
-  auto& db_slice = shard->db_slice();
-  vector<pair<PrimeIterator, double>> it_arr(keys.size() - start);
-  if (it_arr.empty())     // could be when only the dest key is hosted in this shard
-    return OpStatus::OK;  // return empty map
+  if (start == keys.size())  // could be when only the dest key is hosted in this shard
+    return OpStatus::SKIPPED;
 
+  auto& db_slice = shard->db_slice();
+  vector<pair<PrimeIterator, double>> it_arr;
   for (unsigned j = start; j < keys.size(); ++j) {
     auto it_res = db_slice.Find(t->db_context(), keys[j], OBJ_ZSET);
     if (it_res == OpStatus::WRONG_TYPE)  // TODO: support sets with default score 1.
       return it_res.status();
-    if (!it_res)
+    if (!it_res) {
+      if (inter)
+        return ScoredRun{};
       continue;
+    }
 
-    // first global index is 2 after {destkey, numkeys}
-    unsigned src_indx = j - start;
-    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - 2;
-    DCHECK_LT(windex, weights.size());
-    it_arr[src_indx] = {*it_res, weights[windex]};
+    // weights follow the order of the keys, that start after numkeys.
+    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - sargs.num_pos;
+    DCHECK_LT(windex, sargs.weights.size());
+    it_arr.emplace_back(*it_res, sargs.weights[windex]);
   }
 
-  ScoredMap result;
-  for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done())
-      continue;
-
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      UnionScoredMap(&result, &sm, agg_type);
+  vector<ScoredRun> runs;
+  runs.reserve(it_arr.size());
+  for (const auto& [it, weight] : it_arr) {
+    runs.push_back(FromObject(it->second, weight));
   }
 
-  return result;
+  return MergeRuns(&runs, inter, sargs.agg_type);
 }
 
-OpResult<ScoredMap> OpInter(EngineShard* shard, Transaction* t, string_view dest, AggType agg_type,
-                            const vector<double>& weights, bool store) {
-  ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
-  DVLOG(1) << "shard:" << shard->shard_id() << ", keys " << vector(keys.begin(), keys.end());
-  DCHECK(!keys.empty());
-
-  unsigned start = 0;
-
-  if (keys.front() == dest) {
-    ++start;
-  }
-
-  auto& db_slice = shard->db_slice();
-  vector<pair<PrimeIterator, double>> it_arr(keys.size() - start);
-  if (it_arr.empty())          // could be when only the dest key is hosted in this shard
-    return OpStatus::SKIPPED;  // return noop
-
-  for (unsigned j = start; j < keys.size(); ++j) {
-    auto it_res = db_slice.Find(t->db_context(), keys[j], OBJ_ZSET);
-    if (it_res == OpStatus::WRONG_TYPE)  // TODO: support sets with default score 1.
-      return it_res.status();
-
-    if (!it_res)
-      continue;  // we exit in the next loop
+// Runs the shard parts of ZUNION, ZINTER and their STORE variants and merges their runs.
+// Concludes the transaction unless dest is set.
+OpResult<ScoredRun> UnionOrInter(Transaction* trans, const StoreArgs& sargs,
+                                 std::optional<string_view> dest, bool inter) {
+  vector<OpResult<ScoredRun>> shard_runs(shard_set->size(), OpStatus::SKIPPED);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    shard_runs[shard->shard_id()] = OpSetOpRun(shard, t, sargs, dest, inter);
+    return OpStatus::OK;
+  };
 
-    // first global index is 2 after {destkey, numkeys}
-    unsigned src_indx = j - start;
-    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - 2;
-    DCHECK_LT(windex, weights.size());
-    it_arr[src_indx] = {*it_res, weights[windex]};
+  if (dest) {
+    trans->Schedule();
+    trans->Execute(std::move(cb), false);
+  } else {
+    trans->ScheduleSingleHop(std::move(cb));
   }
 
-  ScoredMap result;
-  for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done()) {
-      return ScoredMap{};
-    }
-
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      InterScoredMap(&result, &sm, agg_type);
-
-    if (result.empty())
-      return result;
+  vector<ScoredRun> runs;
+  for (auto& op_res : shard_runs) {
+    if (op_res.status() == OpStatus::SKIPPED)
+      continue;
+    if (!op_res)
+      return op_res.status();
+    runs.push_back(std::move(op_res.value()));
   }
 
-  return result;
+  return MergeRuns(&runs, inter, sargs.agg_type);
 }
 
 using ScoredMemberView = std::pair<double, std::string_view>;
@@ -797,13 +850,25 @@ struct AddResult {
   bool is_nan = false;
 };
 
+// Returns the lowest score of a non-empty sorted set.
+double MinScore(robj* zobj) {
+  if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+    uint8_t* zl = (uint8_t*)zobj->ptr;
+    return zzlGetScore(lpNext(zl, lpSeek(zl, 0)));
+  }
+
+  CHECK_EQ(zobj->encoding, OBJ_ENCODING_SKIPLIST);
+  zskiplist* zsl = ((zset*)zobj->ptr)->zsl;
+  return zsl->header->level[0].forward->score;
+}
+
 OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_view key,
                           ScoredMemberSpan members) {
   DCHECK(!members.empty() || zparams.override);
   auto& db_slice = op_args.shard->db_slice();
 
   if (zparams.override && members.empty()) {
-    auto it = db_slice.FindExt(op_args.db_cntx, key).first;
+    auto it = db_slice.FindExt(op_args.db_cntx, key);
     db_slice.Del(op_args.db_cntx.db_index, it);
     return OpStatus::OK;
   }
@@ -813,7 +878,14 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
   if (!res_it)
     return res_it.status();
 
-  robj* zobj = res_it.value()->second.AsRObj();
+  PrimeValue& pv = res_it.value()->second;
+  robj* zobj = pv.AsRObj();
+
+  bool was_listpack = zobj->encoding == OBJ_ENCODING_LISTPACK;
+  size_t max_lp_entries = server.zset_max_listpack_entries;
+  if (was_listpack) {
+    max_lp_entries = container_utils::ListpackLimit(pv, max_lp_entries);
+  }
 
   unsigned added = 0;
   unsigned updated = 0;
@@ -830,7 +902,14 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
     const auto& m = members[j];
     tmp_str = sdscpylen(tmp_str, m.second.data(), m.second.size());
 
-    int retval = zsetAdd(zobj, m.first, tmp_str, zparams.flags, &retflags, &new_score);
+    // A new member below the lowest score of a full capped set would be trimmed right away.
+    if (zparams.cap && zsetLength(zobj) >= zparams.cap && !(zparams.flags & ZADD_IN_INCR) &&
+        m.first < MinScore(zobj) && zsetScore(zobj, tmp_str, &new_score) != C_OK) {
+      continue;
+    }
+
+    int retval =
+        zsetAddEx(zobj, m.first, tmp_str, zparams.flags, &retflags, &new_score, max_lp_entries);
 
     if (zparams.flags & ZADD_IN_INCR) {
       if (retval == 0) {
@@ -853,9 +932,23 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
       processed++;
   }
 
+  // Trims the lowest ranks of a capped set inline, so that it keeps its top members.
+  unsigned long zlen = zsetLength(zobj);
+  if (zparams.cap && zlen > zparams.cap) {
+    IntervalVisitor iv{Action::REMOVE, ZSetFamily::RangeParams{}, zobj};
+    iv(ZSetFamily::IndexInterval(0, zlen - zparams.cap - 1));
+  }
+
   DVLOG(2) << "ZAdd " << zobj->ptr;
 
-  res_it.value()->second.SyncRObj();
+  if (was_listpack && zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
+    stats->listpack_conversions++;
+    stats->listpack_early_conversions += max_lp_entries < server.zset_max_listpack_entries &&
+                                         zsetLength(zobj) <= server.zset_max_listpack_entries;
+  }
+
+  pv.SyncRObj();
   op_args.shard->db_slice().PostUpdate(op_args.db_cntx.db_index, *res_it, key);
 
   if (zparams.flags & ZADD_IN_INCR) {
@@ -869,22 +962,18 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
   return aresult;
 }
 
-struct StoreArgs {
-  AggType agg_type = AggType::SUM;
-  unsigned num_keys;
-  vector<double> weights;
-};
-
-OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
-  string_view num_str = ArgS(args, 2);
+// Parses the arguments of ZUNION and ZINTER, and of their STORE variants if store is set.
+OpResult<StoreArgs> ParseStoreArgs(CmdArgList args, bool store) {
   StoreArgs store_args;
+  store_args.num_pos = store ? 2 : 1;
+  string_view num_str = ArgS(args, store_args.num_pos);
 
   // we parsed the structure before, when transaction has been initialized.
   CHECK(absl::SimpleAtoi(num_str, &store_args.num_keys));
-  DCHECK_GE(args.size(), 3 + store_args.num_keys);
+  DCHECK_GE(args.size(), store_args.num_pos + 1 + store_args.num_keys);
 
   store_args.weights.resize(store_args.num_keys, 1);
-  for (size_t i = 3 + store_args.num_keys; i < args.size(); ++i) {
+  for (size_t i = store_args.num_pos + 1 + store_args.num_keys; i < args.size(); ++i) {
     ToUpper(&args[i]);
     string_view arg = ArgS(args, i);
     if (arg == "WEIGHTS") {
@@ -900,7 +989,7 @@ OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
       }
       i += store_args.num_keys;
     } else if (arg == "AGGREGATE") {
-      if (i + 2 != args.size()) {
+      if (i + 1 >= args.size()) {
         return OpStatus::SYNTAX_ERR;
       }
 
@@ -916,7 +1005,9 @@ OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
       } else {
         return OpStatus::SYNTAX_ERR;
       }
-      break;
+      ++i;
+    } else if (arg == "WITHSCORES" && !store) {
+      store_args.with_scores = true;
     } else {
       return OpStatus::SYNTAX_ERR;
     }
@@ -925,6 +1016,186 @@ OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
   return store_args;
 };
 
+// Returns the number of members in the ranks of ii, for a sorted set of length llen, and sets
+// *start to the first of them. Negative ranks count from the end, like in IntervalVisitor.
+unsigned RankRangeLength(const ZSetFamily::IndexInterval& ii, unsigned long llen,
+                         int32_t* start) {
+  int64_t first = ii.first < 0 ? int64_t(llen) + ii.first : ii.first;
+  int64_t last = ii.second < 0 ? int64_t(llen) + ii.second : ii.second;
+  first = std::max<int64_t>(first, 0);
+  last = std::min<int64_t>(last, int64_t(llen) - 1);
+
+  *start = first;
+  return first > last ? 0 : last - first + 1;
+}
+
+constexpr char kUnitErr[] = "unsupported unit provided. please use M, KM, FT, MI";
+
+// Returns the meters per unit of the distance unit arg, or 0 if it is not supported.
+double ParseGeoUnit(string_view arg) {
+  if (absl::EqualsIgnoreCase(arg, "m"))
+    return 1;
+  if (absl::EqualsIgnoreCase(arg, "km"))
+    return 1000;
+  if (absl::EqualsIgnoreCase(arg, "ft"))
+    return 0.3048;
+  if (absl::EqualsIgnoreCase(arg, "mi"))
+    return 1609.34;
+  return 0;
+}
+
+// The distances are sent with the precision of Redis.
+string FormatGeoDistance(double meters, double unit) {
+  return absl::StrFormat("%.4f", meters / unit);
+}
+
+struct GeoSearchOpts {
+  bool from_member = false;
+  string_view member;  // The center, with FROMMEMBER.
+  GeoShape shape;
+  double unit = 1;
+  enum Sort : uint8_t { NONE, ASC, DESC } sort = NONE;
+  uint32_t count = 0;  // 0 for all the matches.
+  bool any = false;
+  bool with_coord = false;
+  bool with_dist = false;
+  bool with_hash = false;
+};
+
+struct GeoMatch {
+  string member;
+  double dist;
+  uint64_t hash;
+  GeoPoint point;
+};
+
+// The candidates of a search are decoded in batches, and only the members of the matches are
+// copied out of the sorted set.
+constexpr size_t kGeoBatchSize = 128;
+
+// Scans the members of zobj with scores in the search ranges of opts.shape.
+class GeoSearcher {
+ public:
+  explicit GeoSearcher(const GeoSearchOpts& opts) : opts_(opts) {
+    limit_ = opts.any ? opts.count : SIZE_MAX;
+  }
+
+  vector<GeoMatch> Search(robj* zobj);
+
+ private:
+  struct Candidate {
+    container_utils::ContainerEntry entry;
+    double dist;
+    uint64_t hash;
+    GeoPoint point;
+  };
+
+  // Returns false once the search has enough matches.
+  bool Add(container_utils::ContainerEntry entry, double score);
+  bool Flush();
+
+  const GeoSearchOpts& opts_;
+  size_t limit_;
+  vector<container_utils::ContainerEntry> entries_;
+  uint64_t hashes_[kGeoBatchSize];
+  GeoPoint points_[kGeoBatchSize];
+  vector<Candidate> matches_;
+};
+
+vector<GeoMatch> GeoSearcher::Search(robj* zobj) {
+  GeoHashRange ranges[kMaxGeoHashRanges];
+  unsigned num_ranges = GeoSearchRanges(opts_.shape, ranges);
+  entries_.reserve(kGeoBatchSize);
+
+  optional<ListpackIndex> index;  // Shared by the ranges of a listpack.
+  bool more = true;
+  for (unsigned i = 0; i < num_ranges && more; ++i) {
+    zrangespec range;
+    range.min = ranges[i].min;
+    range.max = ranges[i].max;
+    range.minex = 0;
+    range.maxex = 1;
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+      if (!index)
+        index.emplace((uint8_t*)zobj->ptr);
+      for (unsigned pos = index->LowerBound(range), last = index->UpperBound(range);
+           pos < last && more; ++pos) {
+        unsigned int vlen = 0;
+        long long vlong = 0;
+        uint8_t* vstr = lpGetValue(index->Member(pos), &vlen, &vlong);
+        double score = index->Score(pos);
+        more = vstr ? Add({reinterpret_cast<const char*>(vstr), vlen}, score)
+                    : Add(container_utils::ContainerEntry{vlong}, score);
+      }
+    } else {
+      CHECK_EQ(zobj->encoding, OBJ_ENCODING_SKIPLIST);
+      zskiplist* zsl = ((zset*)zobj->ptr)->zsl;
+      for (zskiplistNode* ln = zslFirstInRange(zsl, &range);
+           ln && more && zslValueLteMax(ln->score, &range); ln = ln->level[0].forward) {
+        more = Add({ln->ele, sdslen(ln->ele)}, ln->score);
+      }
+    }
+  }
+  if (more)
+    Flush();
+
+  // COUNT without ANY returns the nearest matches.
+  auto order = opts_.sort;
+  if (order == GeoSearchOpts::NONE && opts_.count && !opts_.any)
+    order = GeoSearchOpts::ASC;
+  size_t count = opts_.count ? min<size_t>(opts_.count, matches_.size()) : matches_.size();
+  if (order != GeoSearchOpts::NONE) {
+    auto cmp = [order](const Candidate& a, const Candidate& b) {
+      return order == GeoSearchOpts::ASC ? a.dist < b.dist : a.dist > b.dist;
+    };
+    partial_sort(matches_.begin(), matches_.begin() + count, matches_.end(), cmp);
+  }
+
+  vector<GeoMatch> res(count);
+  for (size_t i = 0; i < count; ++i) {
+    Candidate& c = matches_[i];
+    res[i] = {c.entry.ToString(), c.dist, c.hash, c.point};
+  }
+  return res;
+}
+
+bool GeoSearcher::Add(container_utils::ContainerEntry entry, double score) {
+  hashes_[entries_.size()] = uint64_t(score);
+  entries_.push_back(entry);
+  return entries_.size() < kGeoBatchSize || Flush();
+}
+
+bool GeoSearcher::Flush() {
+  GeoHashDecode(hashes_, entries_.size(), points_);
+  for (size_t i = 0; i < entries_.size() && matches_.size() < limit_; ++i) {
+    double dist;
+    if (opts_.shape.Contains(points_[i], &dist))
+      matches_.push_back({entries_[i], dist, hashes_[i], points_[i]});
+  }
+  entries_.clear();
+  return matches_.size() < limit_;
+}
+
+OpResult<vector<GeoMatch>> OpGeoSearch(const OpArgs& op_args, string_view key,
+                                       GeoSearchOpts opts) {
+  OpResult<PrimeIterator> res_it = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_ZSET);
+  if (!res_it)
+    return res_it.status();
+
+  robj* zobj = res_it.value()->second.AsRObj();
+  if (opts.from_member) {
+    sds& tmp_str = op_args.shard->tmp_str1;
+    tmp_str = sdscpylen(tmp_str, opts.member.data(), opts.member.size());
+    double score;
+    if (zsetScore(zobj, tmp_str, &score) != C_OK)
+      return OpStatus::INVALID_VALUE;
+    opts.shape.center = GeoHashDecode(uint64_t(score));
+  }
+
+  return GeoSearcher{opts}.Search(zobj);
+}
+
 }  // namespace
 
 void ZSetFamily::ZAdd(CmdArgList args, ConnectionContext* cntx) {
@@ -949,12 +1220,17 @@ void ZSetFamily::ZAdd(CmdArgList args, ConnectionContext* cntx) {
       zparams.ch = true;
     } else if (cur_arg == "INCR") {
       zparams.flags |= ZADD_IN_INCR;
+    } else if (cur_arg == "CAP") {
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &zparams.cap) || zparams.cap == 0) {
+        return (*cntx)->SendError("CAP must be a positive integer");
+      }
+      ++i;
     } else {
       break;
     }
   }
 
-  if ((args.size() - i) % 2 != 0) {
+  if (i == args.size() || (args.size() - i) % 2 != 0) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
@@ -1067,6 +1343,78 @@ void ZSetFamily::ZCount(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void ZSetFamily::ZDiff(CmdArgList args, ConnectionContext* cntx) {
+  unsigned num_keys;
+
+  // we parsed the structure before, when transaction has been initialized.
+  CHECK(absl::SimpleAtoi(ArgS(args, 1), &num_keys));
+  if (num_keys == 0) {
+    return SendAtLeastOneKeyError(cntx);
+  }
+
+  RangeParams params;
+  for (size_t i = 2 + num_keys; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) != "WITHSCORES") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    params.with_scores = true;
+  }
+
+  // The shard of the first key subtracts its other keys from it, the rest of the shards
+  // return the union of their keys.
+  string_view src_key = ArgS(args, 2);
+  ShardId src_shard = Shard(src_key, shard_set->size());
+  vector<OpResult<ScoredRun>> shard_runs(shard_set->size(), OpStatus::SKIPPED);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    ArgSlice keys = t->ShardArgsInShard(sid);
+    optional<ScoredRun> src;
+    vector<ScoredRun> runs;
+    for (size_t j = 0; j < keys.size(); ++j) {
+      auto it_res = shard->db_slice().Find(t->db_context(), keys[j], OBJ_ZSET);
+      if (it_res == OpStatus::WRONG_TYPE) {
+        shard_runs[sid] = it_res.status();
+        return OpStatus::OK;
+      }
+
+      bool is_src = t->ReverseArgIndex(sid, j) == 1;
+      if (is_src && !it_res) {
+        shard_runs[sid] = ScoredRun{};
+        return OpStatus::OK;
+      }
+
+      if (it_res) {
+        auto& dest = is_src ? src.emplace() : runs.emplace_back();
+        dest = FromObject((*it_res)->second, 1);
+      }
+    }
+
+    ScoredRun others = MergeRuns(&runs, false, AggType::SUM);
+    shard_runs[sid] = sid == src_shard ? DiffRuns(std::move(*src), others) : std::move(others);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  OpResult<ScoredRun> result = std::move(shard_runs[src_shard]);
+  for (ShardId sid = 0; sid < shard_runs.size() && result && !result->empty(); ++sid) {
+    if (sid == src_shard || shard_runs[sid].status() == OpStatus::SKIPPED)
+      continue;
+    if (!shard_runs[sid]) {
+      result = shard_runs[sid].status();
+      break;
+    }
+    result = DiffRuns(std::move(*result), *shard_runs[sid]);
+  }
+
+  if (result) {
+    SortByScore(&result.value());
+  }
+  OutputScoredArrayResult(result, params, cntx);
+}
+
 void ZSetFamily::ZIncrBy(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view score_arg = ArgS(args, 2);
@@ -1106,69 +1454,12 @@ void ZSetFamily::ZIncrBy(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendDouble(add_result->new_score);
 }
 
-void ZSetFamily::ZInterStore(CmdArgList args, ConnectionContext* cntx) {
-  string_view dest_key = ArgS(args, 1);
-  OpResult<StoreArgs> store_args_res = ParseStoreArgs(args);
-
-  if (!store_args_res) {
-    switch (store_args_res.status()) {
-      case OpStatus::INVALID_FLOAT:
-        return (*cntx)->SendError("weight value is not a float", kSyntaxErrType);
-      default:
-        return (*cntx)->SendError(store_args_res.status());
-    }
-  }
-  const auto& store_args = *store_args_res;
-  if (store_args.num_keys == 0) {
-    return SendAtLeastOneKeyError(cntx);
-  }
-
-  vector<OpResult<ScoredMap>> maps(shard_set->size(), OpStatus::SKIPPED);
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    maps[shard->shard_id()] =
-        OpInter(shard, t, dest_key, store_args.agg_type, store_args.weights, false);
-    return OpStatus::OK;
-  };
-
-  cntx->transaction->Schedule();
-  cntx->transaction->Execute(std::move(cb), false);
-
-  ScoredMap result;
-  for (auto& op_res : maps) {
-    if (op_res.status() == OpStatus::SKIPPED)
-      continue;
-
-    if (!op_res)
-      return (*cntx)->SendError(op_res.status());
-
-    if (result.empty())
-      result.swap(op_res.value());
-    else
-      InterScoredMap(&result, &op_res.value(), store_args.agg_type);
-    if (result.empty())
-      break;
-  }
-
-  ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
-  vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
-    smvec.emplace_back(elem.second, elem.first);
-  }
-
-  auto store_cb = [&](Transaction* t, EngineShard* shard) {
-    if (shard->shard_id() == dest_shard) {
-      ZParams zparams;
-      zparams.override = true;
-      add_result = OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec}).value();
-    }
-    return OpStatus::OK;
-  };
-
-  cntx->transaction->Execute(std::move(store_cb), true);
+void ZSetFamily::ZInter(CmdArgList args, ConnectionContext* cntx) {
+  SetOpGeneric(std::move(args), false, true, cntx);
+}
 
-  (*cntx)->SendLong(smvec.size());
+void ZSetFamily::ZInterStore(CmdArgList args, ConnectionContext* cntx) {
+  SetOpGeneric(std::move(args), true, true, cntx);
 }
 
 void ZSetFamily::ZPopMax(CmdArgList args, ConnectionContext* cntx) {
@@ -1455,9 +1746,16 @@ void ZSetFamily::ZScan(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void ZSetFamily::ZUnion(CmdArgList args, ConnectionContext* cntx) {
+  SetOpGeneric(std::move(args), false, false, cntx);
+}
+
 void ZSetFamily::ZUnionStore(CmdArgList args, ConnectionContext* cntx) {
-  string_view dest_key = ArgS(args, 1);
-  OpResult<StoreArgs> store_args_res = ParseStoreArgs(args);
+  SetOpGeneric(std::move(args), true, false, cntx);
+}
+
+void ZSetFamily::SetOpGeneric(CmdArgList args, bool store, bool inter, ConnectionContext* cntx) {
+  OpResult<StoreArgs> store_args_res = ParseStoreArgs(args, store);
 
   if (!store_args_res) {
     switch (store_args_res.status()) {
@@ -1472,28 +1770,28 @@ void ZSetFamily::ZUnionStore(CmdArgList args, ConnectionContext* cntx) {
     return SendAtLeastOneKeyError(cntx);
   }
 
-  vector<OpResult<ScoredMap>> maps(shard_set->size());
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    maps[shard->shard_id()] =
-        OpUnion(shard, t, dest_key, store_args.agg_type, store_args.weights, false);
-    return OpStatus::OK;
-  };
-
-  cntx->transaction->Schedule();
+  if (!store) {
+    OpResult<ScoredRun> result = UnionOrInter(cntx->transaction, store_args, nullopt, inter);
+    if (result) {
+      SortByScore(&result.value());
+    }
 
-  cntx->transaction->Execute(std::move(cb), false);
-  ScoredMap result;
+    RangeParams params;
+    params.with_scores = store_args.with_scores;
+    return OutputScoredArrayResult(result, params, cntx);
+  }
 
-  for (auto& op_res : maps) {
-    if (!op_res)
-      return (*cntx)->SendError(op_res.status());
-    UnionScoredMap(&result, &op_res.value(), store_args.agg_type);
+  string_view dest_key = ArgS(args, 1);
+  OpResult<ScoredRun> result = UnionOrInter(cntx->transaction, store_args, dest_key, inter);
+  if (!result) {
+    cntx->transaction->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+    return (*cntx)->SendError(result.status());
   }
-  ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
+
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
   vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
+  smvec.reserve(result->size());
+  for (const auto& elem : *result) {
     smvec.emplace_back(elem.second, elem.first);
   }
 
@@ -1501,7 +1799,7 @@ void ZSetFamily::ZUnionStore(CmdArgList args, ConnectionContext* cntx) {
     if (shard->shard_id() == dest_shard) {
       ZParams zparams;
       zparams.override = true;
-      add_result = OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec}).value();
+      OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec});
     }
     return OpStatus::OK;
   };
@@ -1530,9 +1828,13 @@ void ZSetFamily::OutputScoredArrayResult(const OpResult<ScoredArray>& result,
   LOG_IF(WARNING, !result && result.status() != OpStatus::KEY_NOTFOUND)
       << "Unexpected status " << result.status();
 
-  (*cntx)->StartArray(result->size() * (params.with_scores ? 2 : 1));
+  // RESP3 clients get (member, score) pairs instead of a flat array.
+  bool with_pairs = params.with_scores && (*cntx)->IsResp3();
+  (*cntx)->StartArray(result->size() * (params.with_scores && !with_pairs ? 2 : 1));
   const ScoredArray& array = result.value();
   for (const auto& p : array) {
+    if (with_pairs)
+      (*cntx)->StartArray(2);
     (*cntx)->SendBulkString(p.first);
 
     if (params.with_scores) {
@@ -1591,14 +1893,107 @@ void ZSetFamily::ZRangeGeneric(CmdArgList args, RangeParams range_params, Connec
     }
   }
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpRange(range_spec, t->GetOpArgs(shard), key);
+  // Only the ranges of ranks are sent in batches, since their length is known upfront.
+  bool can_batch = range_params.interval_type == RangeParams::IntervalType::RANK &&
+                   !cntx->conn_state.script_info && !cntx->transaction->IsMulti();
+  bool in_batches = false;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<ScoredArray> {
+    OpArgs op_args = t->GetOpArgs(shard);
+    if (can_batch) {
+      auto res_it = shard->db_slice().Find(op_args.db_cntx, key, OBJ_ZSET);
+      if (res_it && res_it.value()->second.Encoding() == OBJ_ENCODING_SKIPLIST) {
+        int32_t start;
+        unsigned long llen = zsetLength(res_it.value()->second.AsRObj());
+        const auto& ii = std::get<IndexInterval>(range_spec.interval);
+        if (RankRangeLength(ii, llen, &start) > container_utils::kReplyBatchSize) {
+          in_batches = true;
+          return ScoredArray{};
+        }
+      }
+    }
+    return OpRange(range_spec, op_args, key);
   };
 
   OpResult<ScoredArray> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (in_batches)
+    return ZRangeInBatches(key, range_spec, cntx);
+
   OutputScoredArrayResult(result, range_params, cntx);
 }
 
+// The hops run on a transaction of their own that keeps the key locked until the last batch is
+// sent, so the ranks do not shift between the batches.
+void ZSetFamily::ZRangeInBatches(string_view key, const ZRangeSpec& range_spec,
+                                 ConnectionContext* cntx) {
+  auto trans = cntx->transaction->CloneUnscheduled();
+  trans->Schedule();
+
+  const RangeParams& params = range_spec.params;
+  const IndexInterval& ii = std::get<IndexInterval>(range_spec.interval);
+  OpStatus status = OpStatus::OK;
+  int32_t next = 0;
+  unsigned total = 0, sent = 0;
+  bool first_hop = true;
+  ScoredArray batch;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    if (first_hop) {
+      first_hop = false;
+      auto res_it = shard->db_slice().Find(op_args.db_cntx, key, OBJ_ZSET);
+      if (!res_it) {
+        status = res_it.status();
+        return OpStatus::OK;
+      }
+      total = RankRangeLength(ii, zsetLength(res_it.value()->second.AsRObj()), &next);
+    }
+
+    unsigned len = std::min<unsigned>(total - sent, container_utils::kReplyBatchSize);
+    ZRangeSpec batch_spec{IndexInterval(next, next + len - 1), params};
+    OpResult<ScoredArray> res = OpRange(batch_spec, op_args, key);
+    status = res.status();
+    if (res)
+      batch = std::move(res.value());
+    next += len;
+    return OpStatus::OK;
+  };
+
+  trans->Execute(cb, false);
+  if (status != OpStatus::OK) {
+    trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+    if (status == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->SendEmptyArray();
+    return (*cntx)->SendError(status);
+  }
+
+  // Follows OutputScoredArrayResult.
+  bool with_pairs = params.with_scores && (*cntx)->IsResp3();
+  (*cntx)->StartArray(total * (params.with_scores && !with_pairs ? 2 : 1));
+  while (true) {
+    for (size_t i = 0; i < batch.size() && sent < total; ++i, ++sent) {
+      if (with_pairs)
+        (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(batch[i].first);
+      if (params.with_scores)
+        (*cntx)->SendDouble(batch[i].second);
+    }
+    if (sent == total || batch.empty() || status != OpStatus::OK)
+      break;
+    trans->Execute(cb, false);
+  }
+  trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+
+  LOG_IF(DFATAL, sent < total) << "Sent " << sent << " members of " << total;
+  for (; sent < total; ++sent) {
+    if (with_pairs)
+      (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString("");
+    if (params.with_scores)
+      (*cntx)->SendDouble(0);
+  }
+}
+
 void ZSetFamily::ZRankGeneric(CmdArgList args, bool reverse, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view member = ArgS(args, 2);
@@ -1883,36 +2278,10 @@ OpResult<unsigned> ZSetFamily::OpCount(const OpArgs& op_args, std::string_view k
   unsigned count = 0;
 
   if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
-    uint8_t* zl = (uint8_t*)zobj->ptr;
-    uint8_t *eptr, *sptr;
-    double score;
-
-    /* Use the first element in range as the starting point */
-    eptr = zzlFirstInRange(zl, &range);
-
-    /* No "first" element */
-    if (eptr == NULL) {
-      return 0;
-    }
-
-    /* First element is in range */
-    sptr = lpNext(zl, eptr);
-    score = zzlGetScore(sptr);
-
-    DCHECK(zslValueLteMax(score, &range));
-
-    /* Iterate over elements in range */
-    while (eptr) {
-      score = zzlGetScore(sptr);
-
-      /* Abort when the node is no longer in range. */
-      if (!zslValueLteMax(score, &range)) {
-        break;
-      } else {
-        count++;
-        zzlNext(zl, &eptr, &sptr);
-      }
-    }
+    ListpackIndex index((uint8_t*)zobj->ptr);
+    unsigned first = index.LowerBound(range);
+    unsigned last = index.UpperBound(range);
+    count = first < last ? last - first : 0;
   } else {
     CHECK_EQ(unsigned(OBJ_ENCODING_SKIPLIST), zobj->encoding);
     zset* zs = (zset*)zobj->ptr;
@@ -2006,15 +2375,286 @@ OpResult<unsigned> ZSetFamily::OpLexCount(const OpArgs& op_args, string_view key
   return count;
 }
 
+void ZSetFamily::GeoAdd(CmdArgList args, ConnectionContext* cntx) {
+  // GEOADD key [NX|XX] [CH] longitude latitude member [longitude latitude member ...]
+  string_view key = ArgS(args, 1);
+
+  ZParams zparams;
+  size_t i = 2;
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view cur_arg = ArgS(args, i);
+    if (cur_arg == "XX") {
+      zparams.flags |= ZADD_IN_XX;
+    } else if (cur_arg == "NX") {
+      zparams.flags |= ZADD_IN_NX;
+    } else if (cur_arg == "CH") {
+      zparams.ch = true;
+    } else {
+      break;
+    }
+  }
+
+  if ((zparams.flags & (ZADD_IN_NX | ZADD_IN_XX)) == (ZADD_IN_NX | ZADD_IN_XX))
+    return (*cntx)->SendError(kNxXxErr);
+  if (i == args.size() || (args.size() - i) % 3 != 0)
+    return (*cntx)->SendError(kSyntaxErr);
+
+  size_t num_points = (args.size() - i) / 3;
+  vector<GeoPoint> points(num_points);
+  for (size_t j = 0; j < num_points; ++j) {
+    GeoPoint& p = points[j];
+    if (!ParseDouble(ArgS(args, i + j * 3), &p.lon) ||
+        !ParseDouble(ArgS(args, i + j * 3 + 1), &p.lat)) {
+      return (*cntx)->SendError(kInvalidFloatErr);
+    }
+    if (!IsValidGeoPoint(p)) {
+      return (*cntx)->SendError(
+          absl::StrFormat("invalid longitude,latitude pair %f,%f", p.lon, p.lat));
+    }
+  }
+
+  // The points are encoded in one batch, before the hop.
+  vector<uint64_t> hashes(num_points);
+  GeoHashEncode(points.data(), num_points, hashes.data());
+  absl::InlinedVector<ScoredMemberView, 4> members;
+  for (size_t j = 0; j < num_points; ++j)
+    members.emplace_back(double(hashes[j]), ArgS(args, i + j * 3 + 2));
+
+  absl::Span memb_sp{members.data(), members.size()};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), zparams, key, memb_sp);
+  };
+
+  OpResult<AddResult> add_result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (base::_in(add_result.status(), {OpStatus::WRONG_TYPE, OpStatus::OUT_OF_MEMORY})) {
+    return (*cntx)->SendError(add_result.status());
+  }
+
+  // KEY_NOTFOUND may happen in case of XX flag.
+  if (add_result.status() == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->SendLong(0);
+  (*cntx)->SendLong(add_result->num_updated);
+}
+
+void ZSetFamily::GeoHash(CmdArgList args, ConnectionContext* cntx) {
+  GeoMembersGeneric(args, false, cntx);
+}
+
+void ZSetFamily::GeoPos(CmdArgList args, ConnectionContext* cntx) {
+  GeoMembersGeneric(args, true, cntx);
+}
+
+void ZSetFamily::GeoDist(CmdArgList args, ConnectionContext* cntx) {
+  // GEODIST key member1 member2 [M|KM|FT|MI]
+  if (args.size() > 5)
+    return (*cntx)->SendError(kSyntaxErr);
+
+  double unit = 1;
+  if (args.size() == 5 && (unit = ParseGeoUnit(ArgS(args, 4))) == 0)
+    return (*cntx)->SendError(kUnitErr);
+
+  string_view key = ArgS(args, 1);
+  string_view members[] = {ArgS(args, 2), ArgS(args, 3)};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMScore(t->GetOpArgs(shard), key, members);
+  };
+
+  OpResult<MScoreResponse> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE)
+    return (*cntx)->SendError(kWrongTypeErr);
+  if (!result || !(*result)[0] || !(*result)[1])
+    return (*cntx)->SendNull();
+
+  GeoPoint a = GeoHashDecode(uint64_t(*(*result)[0]));
+  GeoPoint b = GeoHashDecode(uint64_t(*(*result)[1]));
+  (*cntx)->SendBulkString(FormatGeoDistance(GeoDistance(a, b), unit));
+}
+
+void ZSetFamily::GeoSearch(CmdArgList args, ConnectionContext* cntx) {
+  // GEOSEARCH key <FROMMEMBER member | FROMLONLAT longitude latitude>
+  //   <BYRADIUS radius unit | BYBOX width height unit> [ASC|DESC] [COUNT count [ANY]]
+  //   [WITHCOORD] [WITHDIST] [WITHHASH]
+  string_view key = ArgS(args, 1);
+
+  GeoSearchOpts opts;
+  bool has_center = false, has_shape = false;
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view cur_arg = ArgS(args, i);
+    size_t left = args.size() - i - 1;
+
+    if (cur_arg == "FROMMEMBER" || cur_arg == "FROMLONLAT") {
+      bool from_member = cur_arg == "FROMMEMBER";
+      if (has_center) {
+        return (*cntx)->SendError(
+            "exactly one of FROMMEMBER or FROMLONLAT can be specified for GEOSEARCH");
+      }
+      if (left < (from_member ? 1u : 2u))
+        return (*cntx)->SendError(kSyntaxErr);
+
+      has_center = true;
+      if (from_member) {
+        opts.from_member = true;
+        opts.member = ArgS(args, ++i);
+        continue;
+      }
+      GeoPoint& center = opts.shape.center;
+      if (!ParseDouble(ArgS(args, i + 1), &center.lon) ||
+          !ParseDouble(ArgS(args, i + 2), &center.lat)) {
+        return (*cntx)->SendError(kInvalidFloatErr);
+      }
+      if (!IsValidGeoPoint(center)) {
+        return (*cntx)->SendError(
+            absl::StrFormat("invalid longitude,latitude pair %f,%f", center.lon, center.lat));
+      }
+      i += 2;
+    } else if (cur_arg == "BYRADIUS" || cur_arg == "BYBOX") {
+      bool by_radius = cur_arg == "BYRADIUS";
+      if (has_shape) {
+        return (*cntx)->SendError(
+            "exactly one of BYRADIUS and BYBOX can be specified for GEOSEARCH");
+      }
+      size_t num_dims = by_radius ? 1 : 2;
+      if (left < num_dims + 1)
+        return (*cntx)->SendError(kSyntaxErr);
+
+      has_shape = true;
+      double dims[2] = {0, 0};
+      for (size_t j = 0; j < num_dims; ++j) {
+        if (!ParseDouble(ArgS(args, i + 1 + j), &dims[j]))
+          return (*cntx)->SendError(kInvalidFloatErr);
+        if (dims[j] < 0) {
+          return (*cntx)->SendError(by_radius ? "radius cannot be negative"
+                                              : "height or width cannot be negative");
+        }
+      }
+      if ((opts.unit = ParseGeoUnit(ArgS(args, i + 1 + num_dims))) == 0)
+        return (*cntx)->SendError(kUnitErr);
+
+      GeoShape& shape = opts.shape;
+      shape.type = by_radius ? GeoShape::RADIUS : GeoShape::BOX;
+      shape.radius = dims[0] * opts.unit;
+      shape.width = dims[0] * opts.unit;
+      shape.height = dims[1] * opts.unit;
+      i += num_dims + 1;
+    } else if (cur_arg == "ASC") {
+      opts.sort = GeoSearchOpts::ASC;
+    } else if (cur_arg == "DESC") {
+      opts.sort = GeoSearchOpts::DESC;
+    } else if (cur_arg == "COUNT") {
+      if (left < 1)
+        return (*cntx)->SendError(kSyntaxErr);
+      int64_t count;
+      if (!SimpleAtoi(ArgS(args, ++i), &count))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (count <= 0)
+        return (*cntx)->SendError("COUNT must be > 0");
+      opts.count = min<int64_t>(count, UINT32_MAX);
+      if (left > 1 && absl::EqualsIgnoreCase(ArgS(args, i + 1), "ANY")) {
+        opts.any = true;
+        ++i;
+      }
+    } else if (cur_arg == "WITHCOORD") {
+      opts.with_coord = true;
+    } else if (cur_arg == "WITHDIST") {
+      opts.with_dist = true;
+    } else if (cur_arg == "WITHHASH") {
+      opts.with_hash = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!has_center) {
+    return (*cntx)->SendError(
+        "exactly one of FROMMEMBER or FROMLONLAT can be specified for GEOSEARCH");
+  }
+  if (!has_shape) {
+    return (*cntx)->SendError("exactly one of BYRADIUS and BYBOX can be specified for GEOSEARCH");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGeoSearch(t->GetOpArgs(shard), key, opts);
+  };
+
+  OpResult<vector<GeoMatch>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE)
+    return (*cntx)->SendError(kWrongTypeErr);
+  if (result.status() == OpStatus::INVALID_VALUE)
+    return (*cntx)->SendError("could not decode requested zset member");
+  if (!result)
+    return (*cntx)->SendEmptyArray();
+
+  unsigned num_fields = 1 + opts.with_dist + opts.with_hash + opts.with_coord;
+  (*cntx)->StartArray(result->size());
+  for (const GeoMatch& match : *result) {
+    if (num_fields == 1) {
+      (*cntx)->SendBulkString(match.member);
+      continue;
+    }
+
+    (*cntx)->StartArray(num_fields);
+    (*cntx)->SendBulkString(match.member);
+    if (opts.with_dist)
+      (*cntx)->SendBulkString(FormatGeoDistance(match.dist, opts.unit));
+    if (opts.with_hash)
+      (*cntx)->SendLong(match.hash);
+    if (opts.with_coord) {
+      (*cntx)->StartArray(2);
+      (*cntx)->SendDouble(match.point.lon);
+      (*cntx)->SendDouble(match.point.lat);
+    }
+  }
+}
+
+void ZSetFamily::GeoMembersGeneric(CmdArgList args, bool pos, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  absl::InlinedVector<string_view, 8> members(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i)
+    members[i - 2] = ArgS(args, i);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMScore(t->GetOpArgs(shard), key, members);
+  };
+
+  OpResult<MScoreResponse> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE)
+    return (*cntx)->SendError(kWrongTypeErr);
+
+  // A missing key has no members.
+  (*cntx)->StartArray(members.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    optional<double> score;
+    if (result)
+      score = (*result)[i];
+    if (!score && pos) {
+      (*cntx)->SendNullArray();
+    } else if (!score) {
+      (*cntx)->SendNull();
+    } else if (pos) {
+      GeoPoint p = GeoHashDecode(uint64_t(*score));
+      (*cntx)->StartArray(2);
+      (*cntx)->SendDouble(p.lon);
+      (*cntx)->SendDouble(p.lat);
+    } else {
+      (*cntx)->SendBulkString(GeoHashString(uint64_t(*score)));
+    }
+  }
+}
+
 #define HFUNC(x) SetHandler(&ZSetFamily::x)
 
 void ZSetFamily::Register(CommandRegistry* registry) {
   constexpr uint32_t kUnionMask = CO::WRITE | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING;
+  constexpr uint32_t kSetOpMask = CO::READONLY | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING;
 
   *registry << CI{"ZADD", CO::FAST | CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(ZAdd)
             << CI{"ZCARD", CO::FAST | CO::READONLY, 2, 1, 1, 1}.HFUNC(ZCard)
             << CI{"ZCOUNT", CO::FAST | CO::READONLY, 4, 1, 1, 1}.HFUNC(ZCount)
+            << CI{"ZDIFF", kSetOpMask, -3, 2, 2, 1}.HFUNC(ZDiff)
             << CI{"ZINCRBY", CO::FAST | CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(ZIncrBy)
+            << CI{"ZINTER", kSetOpMask, -3, 2, 2, 1}.HFUNC(ZInter)
             << CI{"ZINTERSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZInterStore)
             << CI{"ZLEXCOUNT", CO::READONLY, 4, 1, 1, 1}.HFUNC(ZLexCount)
             << CI{"ZPOPMAX", CO::READONLY, 3, 1, 1, 1}.HFUNC(ZPopMax)
@@ -2034,7 +2674,13 @@ void ZSetFamily::Register(CommandRegistry* registry) {
             << CI{"ZREVRANGEBYSCORE", CO::READONLY, -4, 1, 1, 1}.HFUNC(ZRevRangeByScore)
             << CI{"ZREVRANK", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(ZRevRank)
             << CI{"ZSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(ZScan)
-            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore);
+            << CI{"ZUNION", kSetOpMask, -3, 2, 2, 1}.HFUNC(ZUnion)
+            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore)
+            << CI{"GEOADD", CO::FAST | CO::WRITE | CO::DENYOOM, -5, 1, 1, 1}.HFUNC(GeoAdd)
+            << CI{"GEOHASH", CO::FAST | CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoHash)
+            << CI{"GEOPOS", CO::FAST | CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoPos)
+            << CI{"GEODIST", CO::READONLY, -4, 1, 1, 1}.HFUNC(GeoDist)
+            << CI{"GEOSEARCH", CO::READONLY, -7, 1, 1, 1}.HFUNC(GeoSearch);
 }
 
 }  // namespace dfly
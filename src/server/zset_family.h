@@ -58,7 +58,9 @@ class ZSetFamily {
   static void ZAdd(CmdArgList args, ConnectionContext* cntx);
   static void ZCard(CmdArgList args, ConnectionContext* cntx);
   static void ZCount(CmdArgList args, ConnectionContext* cntx);
+  static void ZDiff(CmdArgList args, ConnectionContext* cntx);
   static void ZIncrBy(CmdArgList args, ConnectionContext* cntx);
+  static void ZInter(CmdArgList args, ConnectionContext* cntx);
   static void ZInterStore(CmdArgList args, ConnectionContext* cntx);
   static void ZLexCount(CmdArgList args, ConnectionContext* cntx);
   static void ZPopMax(CmdArgList args, ConnectionContext* cntx);
@@ -79,7 +81,18 @@ class ZSetFamily {
   static void ZRevRangeByScore(CmdArgList args, ConnectionContext* cntx);
   static void ZRevRank(CmdArgList args, ConnectionContext* cntx);
   static void ZScan(CmdArgList args, ConnectionContext* cntx);
+  static void ZUnion(CmdArgList args, ConnectionContext* cntx);
   static void ZUnionStore(CmdArgList args, ConnectionContext* cntx);
+  static void SetOpGeneric(CmdArgList args, bool store, bool inter, ConnectionContext* cntx);
+
+  // The GEO commands, over sorted sets whose scores are geohashes, see core/geohash.h.
+  static void GeoAdd(CmdArgList args, ConnectionContext* cntx);
+  static void GeoDist(CmdArgList args, ConnectionContext* cntx);
+  static void GeoHash(CmdArgList args, ConnectionContext* cntx);
+  static void GeoPos(CmdArgList args, ConnectionContext* cntx);
+  static void GeoSearch(CmdArgList args, ConnectionContext* cntx);
+  // Replies to GEOPOS if pos is set, and to GEOHASH otherwise.
+  static void GeoMembersGeneric(CmdArgList args, bool pos, ConnectionContext* cntx);
 
   static void ZRangeByScoreInternal(CmdArgList args, bool reverse, ConnectionContext* cntx);
   static void OutputScoredArrayResult(const OpResult<ScoredArray>& arr, const RangeParams& params,
@@ -87,6 +100,9 @@ class ZSetFamily {
   static void ZRemRangeGeneric(std::string_view key, const ZRangeSpec& range_spec,
                                ConnectionContext* cntx);
   static void ZRangeGeneric(CmdArgList args, RangeParams range_params, ConnectionContext* cntx);
+  // Sends a long range of ranks in batches of kReplyBatchSize, one hop per batch.
+  static void ZRangeInBatches(std::string_view key, const ZRangeSpec& range_spec,
+                              ConnectionContext* cntx);
   static void ZRankGeneric(CmdArgList args, bool reverse, ConnectionContext* cntx);
   static bool ParseRangeByScoreParams(CmdArgList args, RangeParams* params);
   static void ZPopMinMax(CmdArgList args, bool reverse, ConnectionContext* cntx);
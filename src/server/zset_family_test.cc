@@ -4,6 +4,8 @@
 
 #include "server/zset_family.h"
 
+#include <absl/strings/match.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -121,6 +123,36 @@ TEST_F(ZSetFamilyTest, ZRemRangeScore) {
   EXPECT_THAT(Run({"zremrangebyscore", "x", "1", "NaN"}), ErrArg("min or max is not a float"));
 }
 
+TEST_F(ZSetFamilyTest, ListpackScoreRanges) {
+  // The score ranges of a small set, with fractional and duplicate scores.
+  Run({"zadd", "x", "1", "a", "1.5", "b", "2", "c", "2", "d", "2", "e", "3.25", "f", "7", "g"});
+  EXPECT_THAT(Run({"zcount", "x", "2", "2"}), IntArg(3));
+  EXPECT_THAT(Run({"zcount", "x", "(1", "(3.25"}), IntArg(4));
+  EXPECT_THAT(Run({"zcount", "x", "-inf", "+inf"}), IntArg(7));
+  EXPECT_THAT(Run({"zcount", "x", "(7", "+inf"}), IntArg(0));
+  EXPECT_THAT(Run({"zcount", "x", "3", "2"}), IntArg(0));
+
+  auto resp = Run({"zrangebyscore", "x", "(1", "3.25"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("b", "c", "d", "e", "f"));
+  resp = Run({"zrangebyscore", "x", "1.5", "+inf", "LIMIT", "1", "3"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("c", "d", "e"));
+  resp = Run({"zrevrangebyscore", "x", "(7", "1.5", "LIMIT", "1", "2"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("e", "d"));
+  resp = Run({"zrevrangebyscore", "x", "+inf", "3", "withscores"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("g", "7", "f", "3.25"));
+  EXPECT_THAT(Run({"zrangebyscore", "x", "1", "7", "LIMIT", "7", "1"}), ArrLen(0));
+
+  EXPECT_THAT(Run({"zremrangebyscore", "x", "(1", "2"}), IntArg(4));
+  resp = Run({"zrange", "x", "0", "-1", "withscores"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "f", "3.25", "g", "7"));
+  EXPECT_THAT(Run({"zremrangebyscore", "x", "4", "5"}), IntArg(0));
+}
+
 TEST_F(ZSetFamilyTest, IncrBy) {
   auto resp = Run({"zadd", "key", "xx", "incr", "2.1", "member"});
   EXPECT_THAT(resp, ArgType(RespExpr::NIL));
@@ -333,6 +365,79 @@ TEST_F(ZSetFamilyTest, ZInterStore) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("b", "4"));
 }
 
+TEST_F(ZSetFamilyTest, ZUnionInter) {
+  EXPECT_EQ(2, CheckedInt({"zadd", "z1", "1", "a", "2", "b"}));
+  EXPECT_EQ(2, CheckedInt({"zadd", "z2", "3", "c", "2", "b"}));
+  EXPECT_EQ(3, CheckedInt({"zadd", "z3", "5", "b", "1", "c", "7", "d"}));
+
+  auto resp = Run({"zunion", "3", "z1", "z2", "z3", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "c", "4", "d", "7", "b", "9"));
+
+  resp = Run({"zunion", "2", "z1", "z2", "aggregate", "max", "weights", "2", "1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "c", "b"));
+
+  resp = Run({"zinter", "3", "z1", "z2", "z3", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("b", "9"));
+  resp = Run({"zinter", "2", "z2", "z3", "aggregate", "min", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("c", "1", "b", "2"));
+  resp = Run({"zinter", "2", "z1", "missing"});
+  EXPECT_THAT(resp, ArrLen(0));
+
+  resp = Run({"zunion", "0", "z1"});
+  EXPECT_THAT(resp, ErrArg("at least 1 input key is needed"));
+  resp = Run({"zunion", "1", "z1", "foo"});
+  EXPECT_THAT(resp, ErrArg("syntax error"));
+  resp = Run({"zunionstore", "dest", "1", "z1", "withscores"});
+  EXPECT_THAT(resp, ErrArg("syntax error"));
+
+  Run({"set", "foo", "bar"});
+  resp = Run({"zunion", "2", "z1", "foo"});
+  EXPECT_THAT(resp, ErrArg("WRONGTYPE"));
+  resp = Run({"zinterstore", "dest", "2", "z1", "foo"});
+  EXPECT_THAT(resp, ErrArg("WRONGTYPE"));
+}
+
+TEST_F(ZSetFamilyTest, ZDiff) {
+  EXPECT_EQ(4, CheckedInt({"zadd", "z1", "1", "a", "2", "b", "3", "c", "4", "d"}));
+  EXPECT_EQ(1, CheckedInt({"zadd", "z2", "5", "b"}));
+  EXPECT_EQ(2, CheckedInt({"zadd", "z3", "1", "d", "1", "e"}));
+
+  auto resp = Run({"zdiff", "3", "z1", "z2", "z3", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "c", "3"));
+  resp = Run({"zdiff", "2", "z1", "missing"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "b", "c", "d"));
+  resp = Run({"zdiff", "2", "missing", "z1"});
+  EXPECT_THAT(resp, ArrLen(0));
+  resp = Run({"zdiff", "2", "z1", "z1"});
+  EXPECT_THAT(resp, ArrLen(0));
+  resp = Run({"zdiff", "1", "z1", "foo"});
+  EXPECT_THAT(resp, ErrArg("syntax error"));
+}
+
+TEST_F(ZSetFamilyTest, ZAddCap) {
+  EXPECT_EQ(3, CheckedInt({"zadd", "key", "cap", "3", "1", "a", "2", "b", "3", "c"}));
+
+  // Trims the lowest scores inline.
+  EXPECT_EQ(2, CheckedInt({"zadd", "key", "cap", "3", "5", "d", "4", "e"}));
+  auto resp = Run({"zrange", "key", "0", "-1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("c", "3", "e", "4", "d", "5"));
+
+  // Rejects the new members below the lowest score of a full set.
+  EXPECT_EQ(0, CheckedInt({"zadd", "key", "cap", "3", "1", "f"}));
+  EXPECT_EQ(0, CheckedInt({"zadd", "key", "cap", "3", "10", "c"}));
+  resp = Run({"zrange", "key", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("e", "d", "c"));
+
+  // Uncapped additions grow the set again.
+  EXPECT_EQ(1, CheckedInt({"zadd", "key", "1", "f"}));
+  EXPECT_EQ(4, CheckedInt({"zcard", "key"}));
+
+  resp = Run({"zadd", "key", "cap", "0", "1", "a"});
+  EXPECT_THAT(resp, ErrArg("CAP must be a positive integer"));
+  resp = Run({"zadd", "key", "cap", "2"});
+  EXPECT_THAT(resp, ErrArg("syntax error"));
+}
+
 TEST_F(ZSetFamilyTest, ZAddBug148) {
   auto resp = Run({"zadd", "key", "1", "9fe9f1eb"});
   EXPECT_THAT(resp, IntArg(1));
@@ -381,4 +486,160 @@ TEST_F(ZSetFamilyTest, ZPopMax) {
   resp = Run({"zpopmax", "key", "1"});
   ASSERT_THAT(resp, ArrLen(0));
 }
+TEST_F(ZSetFamilyTest, ZRangeInBatches) {
+  vector<string> args{"zadd", "key"};
+  for (int i = 0; i < 10000; i++) {
+    args.push_back(absl::StrCat(i));
+    args.push_back(absl::StrCat("m", i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  Run(ArgSlice{sv_args.data(), sv_args.size()});
+
+  auto resp = Run({"zrange", "key", "1", "-2", "WITHSCORES"});
+  ASSERT_THAT(resp, ArrLen(2 * 9998));
+  vector<string> vec = StrArray(resp);
+  for (int i = 1; i < 9999; i++) {
+    ASSERT_EQ(absl::StrCat("m", i), vec[2 * (i - 1)]);
+    ASSERT_EQ(absl::StrCat(i), vec[2 * (i - 1) + 1]);
+  }
+
+  resp = Run({"zrange", "key", "0", "-1", "REV"});
+  ASSERT_THAT(resp, ArrLen(10000));
+  vec = StrArray(resp);
+  EXPECT_EQ("m9999", vec.front());
+  EXPECT_EQ("m0", vec.back());
+  EXPECT_FALSE(service_->IsLocked(0, "key"));
+}
+
+TEST_F(ZSetFamilyTest, GeoAdd) {
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo", "15.087269",
+                   "37.502669", "Catania"}),
+              IntArg(2));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "NX", "13.361389", "38.115556", "Palermo"}), IntArg(0));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "XX", "CH", "13.4", "38.1", "Palermo"}), IntArg(1));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo"}), IntArg(0));
+
+  // The scores are the ones of Redis.
+  EXPECT_EQ(Run({"zscore", "Sicily", "Palermo"}), "3479099956230698");
+  EXPECT_EQ(Run({"zscore", "Sicily", "Catania"}), "3479447370796909");
+
+  auto resp = Run({"geohash", "Sicily", "Palermo", "Catania", "missing"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("sqc8b49rny0", "sqdtr74hyu0", ArgType(RespExpr::NIL)));
+
+  resp = Run({"geopos", "Sicily", "Palermo", "missing"});
+  ASSERT_THAT(resp, ArrLen(2));
+  vector<string> pos = StrArray(resp.GetVec()[0]);
+  ASSERT_EQ(2u, pos.size());
+  EXPECT_TRUE(absl::StartsWith(pos[0], "13.36138933")) << pos[0];
+  EXPECT_TRUE(absl::StartsWith(pos[1], "38.11555639")) << pos[1];
+  EXPECT_THAT(resp.GetVec()[1], ArgType(RespExpr::NIL_ARRAY));
+
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania"}), "166274.1516");
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania", "km"}), "166.2742");
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania", "MI"}), "103.3182");
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "Catania", "yd"}), ErrArg("unsupported unit"));
+
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13", "86", "x"}),
+              ErrArg("invalid longitude,latitude pair 13.000000,86.000000"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13", "38"}), ErrArg("wrong number of arguments"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13", "38", "x", "14"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "a", "38", "x"}), ErrArg("not a valid float"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "NX", "XX", "13", "38", "x"}), ErrArg("not compatible"));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"geoadd", "str", "13", "38", "x"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"geopos", "str", "x"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(ZSetFamilyTest, GeoSearch) {
+  Run({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo", "15.087269", "37.502669",
+       "Catania", "12.758489", "38.788135", "edge1", "17.241510", "38.788135", "edge2"});
+
+  auto resp = Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYRADIUS", "200", "km",
+                   "ASC"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("Catania", "Palermo"));
+
+  resp = Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYBOX", "400", "400", "km",
+              "ASC", "WITHCOORD", "WITHDIST"});
+  ASSERT_THAT(resp, ArrLen(4));
+  vector<string> names;
+  for (const auto& item : resp.GetVec()) {
+    ASSERT_THAT(item, ArrLen(3));
+    names.emplace_back(facade::ToSV(item.GetVec()[0].GetBuf()));
+  }
+  EXPECT_THAT(names, ElementsAre("Catania", "Palermo", "edge2", "edge1"));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[1], "56.4413");
+  EXPECT_EQ(resp.GetVec()[1].GetVec()[1], "190.4424");
+  EXPECT_THAT(resp.GetVec()[0].GetVec()[2], ArrLen(2));
+
+  resp = Run({"geosearch", "Sicily", "FROMMEMBER", "Palermo", "BYRADIUS", "200", "km", "DESC",
+              "WITHHASH"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("Catania", IntArg(3479447370796909)));
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("Palermo", IntArg(3479099956230698)));
+
+  // COUNT returns the nearest ones, unless ANY stops at the first matches.
+  resp = Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYBOX", "400", "400", "km",
+              "COUNT", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("Catania", "Palermo"));
+  resp = Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYBOX", "400", "400", "km",
+              "COUNT", "3", "ANY"});
+  EXPECT_THAT(resp, ArrLen(3));
+
+  resp = Run({"geosearch", "missing", "FROMLONLAT", "15", "37", "BYRADIUS", "200", "km"});
+  EXPECT_THAT(resp, ArrLen(0));
+  resp = Run({"geosearch", "Sicily", "FROMLONLAT", "0", "0", "BYRADIUS", "200", "km"});
+  EXPECT_THAT(resp, ArrLen(0));
+
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMMEMBER", "missing", "BYRADIUS", "2", "km"}),
+              ErrArg("could not decode requested zset member"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMMEMBER", "Palermo", "FROMLONLAT", "15", "37",
+                   "BYRADIUS", "2", "km"}),
+              ErrArg("exactly one of FROMMEMBER or FROMLONLAT"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "ASC", "WITHDIST", "COUNT",
+                   "1"}),
+              ErrArg("exactly one of BYRADIUS and BYBOX"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYRADIUS", "-2", "km"}),
+              ErrArg("radius cannot be negative"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYRADIUS", "2", "yd"}),
+              ErrArg("unsupported unit"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "FROMLONLAT", "15", "37", "BYRADIUS", "2", "km",
+                   "COUNT", "0"}),
+              ErrArg("COUNT must be > 0"));
+}
+
+TEST_F(ZSetFamilyTest, GeoSearchSkipList) {
+  // A grid of points, which converts the sorted set from a listpack to a skiplist.
+  vector<string> args{"geoadd", "grid"};
+  for (int i = 0; i < 50; ++i) {
+    for (int j = 0; j < 50; ++j) {
+      args.push_back(absl::StrCat(10 + i * 0.01));
+      args.push_back(absl::StrCat(50 + j * 0.01));
+      args.push_back(absl::StrCat("p", i, ":", j));
+    }
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  EXPECT_THAT(Run(ArgSlice{sv_args.data(), sv_args.size()}), IntArg(2500));
+
+  // The points are 0.01 degrees apart, and 15 of them are within 2 km of the center.
+  auto resp = Run({"geosearch", "grid", "FROMMEMBER", "p25:25", "BYRADIUS", "2", "km", "ASC"});
+  vector<string> vec = StrArray(resp);
+  ASSERT_EQ(15u, vec.size());
+  EXPECT_EQ("p25:25", vec.front());
+  for (const string& member : vec) {
+    auto dist = Run({"geodist", "grid", "p25:25", member, "km"});
+    double km;
+    ASSERT_TRUE(absl::SimpleAtod(facade::ToSV(dist.GetBuf()), &km));
+    EXPECT_LE(km, 2);
+  }
+
+  resp = Run({"geosearch", "grid", "FROMLONLAT", "10.25", "50.25", "BYBOX", "100", "100", "km",
+              "COUNT", "10", "ANY"});
+  EXPECT_THAT(resp, ArrLen(10));
+  resp = Run({"geosearch", "grid", "FROMLONLAT", "10.25", "50.25", "BYBOX", "100", "100", "km"});
+  EXPECT_THAT(resp, ArrLen(2500));
+}
+
 }  // namespace dfly
@@ -0,0 +1,144 @@
+import pytest
+import redis
+import json
+import aioredis
+import asyncio
+
+from . import dfly_args
+
+BASE_PORT = 30001
+
+
+@dfly_args({"cluster_mode": "emulated"})
+def test_cluster_slots_emulated(client: redis.Redis):
+    slots = client.execute_command("CLUSTER SLOTS")
+    assert len(slots) == 1
+    assert slots[0][0] == 0 and slots[0][1] == 16383
+
+    assert client.execute_command("CLUSTER KEYSLOT foo") == 12182
+    assert b"cluster_state:ok" in client.execute_command("CLUSTER INFO")
+
+    client.set("{user}.a", "1")
+    client.set("{user}.b", "2")
+    assert client.execute_command("CLUSTER COUNTKEYSINSLOT 5474") == 2
+    assert sorted(client.execute_command("CLUSTER GETKEYSINSLOT 5474 10")) == [
+        b"{user}.a", b"{user}.b"]
+
+    slot = client.info("slots")["slot5474"]
+    assert slot["keys"] == 2 and slot["memory"] >= 0
+    client.delete("{user}.a")
+    assert client.execute_command("CLUSTER COUNTKEYSINSLOT 5474") == 1
+
+    with pytest.raises(redis.exceptions.ResponseError, match="CROSSSLOT"):
+        client.mget("foo", "bar")
+
+
+"""
+Test that nodes redirect the commands on the slots of other nodes, and drop the keys of the
+slots they stop serving.
+"""
+
+
+@pytest.mark.asyncio
+async def test_cluster_redirects(df_local_factory):
+    nodes = [df_local_factory.create(port=BASE_PORT+i, cluster_mode="yes") for i in range(2)]
+    for node in nodes:
+        node.start()
+    clients = [aioredis.Redis(port=node.port) for node in nodes]
+    ids = [(await c.execute_command("DFLYCLUSTER MYID")).decode() for c in clients]
+
+    def config(split, migrations=[]):
+        return json.dumps([
+            {"slot_ranges": [{"start": 0, "end": split - 1}],
+             "master": {"id": ids[0], "ip": "localhost", "port": nodes[0].port},
+             "replicas": [], "migrations": migrations},
+            {"slot_ranges": [{"start": split, "end": 16383}],
+             "master": {"id": ids[1], "ip": "localhost", "port": nodes[1].port},
+             "replicas": []},
+        ])
+
+    for c in clients:
+        await c.execute_command("DFLYCLUSTER CONFIG", config(16000))
+
+    # foo is in slot 12182, bar in slot 5061.
+    await clients[0].set("foo", "1")
+    await clients[0].set("bar", "2")
+    with pytest.raises(aioredis.ResponseError, match=f"MOVED 12182 localhost:{nodes[0].port}"):
+        await clients[1].get("foo")
+
+    # While foo migrates to the second node, the first one still serves it.
+    migrating = config(16000, [{"slot": 12182, "node_id": ids[1]}])
+    for c in clients:
+        await c.execute_command("DFLYCLUSTER CONFIG", migrating)
+    assert await clients[0].get("foo") == b"1"
+    await clients[0].delete("foo")
+    with pytest.raises(aioredis.ResponseError, match=f"ASK 12182 localhost:{nodes[1].port}"):
+        await clients[0].get("foo")
+
+    for c in clients:
+        await c.execute_command("DFLYCLUSTER CONFIG", config(6000))
+    with pytest.raises(aioredis.ResponseError, match=f"MOVED 12182 localhost:{nodes[1].port}"):
+        await clients[0].get("foo")
+
+    assert await clients[0].get("bar") == b"2"
+
+    # The first node drops bar once it no longer serves its slot.
+    for c in clients:
+        await c.execute_command("DFLYCLUSTER CONFIG", config(1000))
+    assert await clients[0].execute_command("CLUSTER COUNTKEYSINSLOT 5061") == 0
+
+
+"""
+Test that a node imports slots from another one while they are written, then serves them.
+"""
+
+
+@pytest.mark.asyncio
+async def test_cluster_slot_migration(df_local_factory):
+    nodes = [df_local_factory.create(port=BASE_PORT+i, cluster_mode="yes") for i in range(2)]
+    for node in nodes:
+        node.start()
+    clients = [aioredis.Redis(port=node.port) for node in nodes]
+    ids = [(await c.execute_command("DFLYCLUSTER MYID")).decode() for c in clients]
+
+    config = json.dumps([
+        {"slot_ranges": [{"start": 0, "end": 16383}],
+         "master": {"id": ids[0], "ip": "localhost", "port": nodes[0].port},
+         "replicas": []},
+        {"slot_ranges": [],
+         "master": {"id": ids[1], "ip": "localhost", "port": nodes[1].port},
+         "replicas": []},
+    ])
+    for c in clients:
+        await c.execute_command("DFLYCLUSTER CONFIG", config)
+
+    # foo is in slot 12182, bar in slot 5061.
+    for i in range(1000):
+        await clients[0].set(f"{{foo}}{i}", str(i))
+    await clients[0].set("foo", "0")
+    await clients[0].set("bar", "2")
+
+    # The writes go to the node that serves the slot at the moment.
+    async def set_foo(value):
+        while True:
+            for c in clients:
+                try:
+                    return await c.set("foo", value)
+                except aioredis.ResponseError as e:
+                    assert "MOVED" in str(e)
+            await asyncio.sleep(0.01)
+
+    await clients[1].execute_command("DFLYCLUSTER START-SLOT-MIGRATION", "localhost",
+                                     nodes[0].port, 12000, 16383)
+    value = 0
+    while await clients[1].execute_command("DFLYCLUSTER SLOT-MIGRATION-STATUS") == b"SYNCING":
+        value += 1
+        await set_foo(str(value))
+    assert await clients[1].execute_command("DFLYCLUSTER SLOT-MIGRATION-STATUS") == b"FINISHED"
+
+    assert await clients[1].get("foo") == str(value).encode()
+    assert await clients[1].execute_command("CLUSTER COUNTKEYSINSLOT 12182") == 1001
+    assert await clients[0].execute_command("CLUSTER COUNTKEYSINSLOT 12182") == 0
+    with pytest.raises(aioredis.ResponseError, match=f"MOVED 12182 localhost:{nodes[1].port}"):
+        await clients[0].get("foo")
+    assert await clients[0].get("bar") == b"2"
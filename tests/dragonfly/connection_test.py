@@ -221,3 +221,149 @@ async def test_multi_pubsub(async_client):
     state, message = await run_multi_pubsub(async_client, messages, "my-channel")
 
     assert state, message
+
+
+'''
+Test that connections move to the thread of the shard that serves their commands.
+Connections that start on different threads and use the same key end up on the same
+thread.
+'''
+
+
+@pytest.mark.asyncio
+async def test_migrate_to_hot_shard(df_local_factory):
+    server = df_local_factory.create(
+        port=1111, proactor_threads=4, migrate_connections_threshold=16)
+    server.start()
+
+    threads = []
+    for _ in range(4):
+        client = aioredis.Redis(port=server.port)
+        for _ in range(32):
+            await client.incr("hot")
+        thread, _ = await client.execute_command("DFLY THREAD")
+        threads.append(thread)
+        await client.connection_pool.disconnect()
+
+    assert len(set(threads)) == 1
+
+
+'''
+Test that a subscriber that does not read its messages is disconnected once their queue goes
+over the pubsub output buffer limit.
+'''
+
+
+@pytest.mark.asyncio
+async def test_pubsub_output_buffer_limit(df_local_factory):
+    server = df_local_factory.create(port=1112, pubsub_output_buffer_limit="1mb 0 0")
+    server.start()
+
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"SUBSCRIBE slow\r\n")
+    await writer.drain()
+    await reader.readuntil(b":1\r\n")  # the subscription is confirmed, nothing is read after it.
+
+    publisher = aioredis.Redis(port=server.port)
+    message = "x" * 64 * 1024
+    async with async_timeout.timeout(10):
+        while await publisher.publish("slow", message) > 0:
+            pass
+
+    info = await publisher.info("stats")
+    assert info["pubsub_overflow_disconnects"] == 1
+    assert info["pubsub_queue_bytes"] == 0
+
+    writer.close()
+    await publisher.connection_pool.disconnect()
+
+
+'''
+Test that a pipelining client that does not read its replies stops being read once its queue of
+commands is full, and that it is served to the end once it reads them.
+'''
+
+
+@pytest.mark.asyncio
+async def test_pipeline_queue_limit(df_local_factory):
+    server = df_local_factory.create(port=1113, pipeline_queue_limit=16)
+    server.start()
+
+    num_cmds = 100000
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"INCR counter\r\n" * num_cmds)
+    send_task = asyncio.create_task(writer.drain())
+
+    client = aioredis.Redis(port=server.port)
+    async with async_timeout.timeout(10):
+        while (await client.info("clients"))["stalled_clients"] == 0:
+            await asyncio.sleep(0.05)
+
+    assert (await client.info("stats"))["pipeline_read_stalls"] > 0
+
+    async with async_timeout.timeout(30):
+        for i in range(num_cmds):
+            assert await reader.readline() == f":{i + 1}\r\n".encode()
+        await send_task
+
+    info = await client.info("stats")
+    assert info["pipeline_queue_commands"] == 0
+    assert info["pipeline_queue_bytes"] == 0
+
+    writer.close()
+    await client.connection_pool.disconnect()
+
+
+'''
+Test that MONITOR with MATCH and DB only receives the commands on the matching keys of its db.
+'''
+
+
+@pytest.mark.asyncio
+async def test_monitor_filter(df_local_factory):
+    server = df_local_factory.create(port=1114)
+    server.start()
+
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"MONITOR MATCH user:* DB 1\r\n")
+    await writer.drain()
+    assert await reader.readline() == b"+OK\r\n"
+
+    client = aioredis.Redis(port=server.port, db=1)
+    other_db = aioredis.Redis(port=server.port, db=2)
+    await other_db.set("user:2", "skipped")
+    await client.set("order:1", "skipped")
+    await client.set("user:1", "sent")
+
+    async with async_timeout.timeout(10):
+        line = await reader.readline()
+    assert b'"SET" "user:1" "sent"' in line
+
+    writer.close()
+    await client.connection_pool.disconnect()
+    await other_db.connection_pool.disconnect()
+
+
+'''
+Test that a monitor which does not read its messages drops the new ones once its queue is full.
+'''
+
+
+@pytest.mark.asyncio
+async def test_monitor_queue_limit(df_local_factory):
+    server = df_local_factory.create(port=1115, monitor_queue_limit=16)
+    server.start()
+
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"MONITOR SAMPLE 1\r\n")
+    await writer.drain()
+    assert await reader.readline() == b"+OK\r\n"
+
+    client = aioredis.Redis(port=server.port)
+    value = "x" * 64 * 1024
+    async with async_timeout.timeout(10):
+        while (await client.info("stats"))["monitor_dropped_messages"] == 0:
+            await client.set("key", value)
+
+    writer.close()
+    await client.connection_pool.disconnect()
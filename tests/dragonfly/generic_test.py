@@ -1,4 +1,6 @@
-from . import dfly_multi_test_args
+import time
+
+from . import dfly_args, dfly_multi_test_args
 from .utility import batch_fill_data, gen_test_data
 
 
@@ -11,3 +13,26 @@ class TestKeys:
 
         keys = client.keys()
         assert len(keys) in range(max_keys, max_keys+512)
+
+
+@dfly_args({"backing_prefix": "{DRAGONFLY_TMP}/tiered", "proactor_threads": 2})
+class TestTieredMGet:
+    def test_mget_mixed(self, client):
+        """MGET reads the offloaded values in the shard while the heartbeat expires other keys"""
+        num_keys = 1000
+        for i in range(num_keys):
+            # The large values are offloaded, the small ones stay in memory.
+            client.set(f"key{i}", f"val{i}" * (500 if i % 2 else 1))
+            client.set(f"tmp{i}", "x", px=1)
+
+        for _ in range(100):
+            if int(client.info("TIERED")["external_entries"]) > 0:
+                break
+            time.sleep(0.05)
+        assert int(client.info("TIERED")["external_entries"]) > 0
+
+        keys = [f"key{i}" for i in reversed(range(num_keys))]
+        for _ in range(3):
+            values = client.mget(keys)
+            for i, val in zip(reversed(range(num_keys)), values):
+                assert val == f"val{i}" * (500 if i % 2 else 1)
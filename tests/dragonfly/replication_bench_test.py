@@ -0,0 +1,173 @@
+import pytest
+import asyncio
+import aioredis
+import os
+import time
+
+from .utility import *
+from .replication_test import DropProxy
+
+
+BASE_PORT = 1311
+
+"""
+Benchmarks of replication, skipped unless DRAGONFLY_BENCH is set:
+    DRAGONFLY_BENCH=1 pytest -sv dragonfly/replication_bench_test.py
+They measure the full sync time per GB, the lag of stable sync under a steady write load and the
+time a replica takes to catch up after a pause. The load comes from dfly_bench, next to the
+dragonfly binary unless DFLY_BENCH_PATH is set. The cases sweep the threads of the master, which
+are the flows DflyCmd opens for every replica, and the threads of the replica. The results are
+printed in lines that start with BENCH.
+"""
+
+pytestmark = pytest.mark.skipif(
+    not os.environ.get("DRAGONFLY_BENCH"), reason="replication benchmarks need DRAGONFLY_BENCH")
+
+# 1. Number of master threads, i.e. flows
+# 2. Number of replica threads
+bench_cases = [(1, 1), (2, 2), (4, 4), (8, 8), (8, 2), (2, 8)]
+
+FULL_SYNC_KEYS = int(os.environ.get("DRAGONFLY_BENCH_KEYS", "2000000"))
+VALUE_SIZE = 500
+LOAD_QPS = int(os.environ.get("DRAGONFLY_BENCH_QPS", "50000"))
+LOAD_SECONDS = 10
+
+
+def report(name, **fields):
+    print("BENCH", name, " ".join(f"{k}={v}" for k, v in fields.items()))
+
+
+async def run_load(bench_path, port, qps, seconds):
+    """ Writes to port at qps with dfly_bench for the given seconds """
+    proc = await asyncio.create_subprocess_exec(
+        bench_path, f"--p={port}", f"--qps={qps}", f"--test_time={seconds}", "--ratio=1:0",
+        "--c=4", "--proactor_threads=2", f"--d={VALUE_SIZE}", "--server_info=false",
+        stdout=asyncio.subprocess.DEVNULL)
+    assert await proc.wait() == 0
+
+
+async def lsn_sum(client, field):
+    info = await client.info("replication")
+    return sum(int(lsn) for lsn in str(info[field]).split(","))
+
+
+async def replication_lag(c_master, c_replica):
+    """ The journal entries the master streamed and the replica did not apply yet """
+    master_lsns = await lsn_sum(c_master, "repl_journal_lsns")
+    replica_lsns = await lsn_sum(c_replica, "slave_applied_lsns")
+    return max(master_lsns - replica_lsns, 0)
+
+
+async def wait_full_sync(c_replica):
+    while True:
+        info = await c_replica.info("replication")
+        if info["master_link_status"] == "up" and info["master_sync_in_progress"] == 0:
+            return
+        await asyncio.sleep(0.05)
+
+
+async def wait_caught_up(c_master, c_replica):
+    while await replication_lag(c_master, c_replica) > 0:
+        await asyncio.sleep(0.01)
+
+
+def bench_path(df_local_factory):
+    return os.environ.get("DFLY_BENCH_PATH", os.path.join(
+        os.path.dirname(df_local_factory.path), "dfly_bench"))
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", bench_cases)
+async def test_bench_full_sync(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await c_master.execute_command(f"DEBUG POPULATE {FULL_SYNC_KEYS} key {VALUE_SIZE}")
+    used_memory = (await c_master.info("memory"))["used_memory"]
+
+    start = time.time()
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_full_sync(c_replica)
+    elapsed = time.time() - start
+
+    assert await c_replica.dbsize() == FULL_SYNC_KEYS
+    gb = used_memory / 2**30
+    report("full_sync", master_threads=t_master, replica_threads=t_replica,
+           gb=f"{gb:.3f}", sec=f"{elapsed:.3f}", sec_per_gb=f"{elapsed / gb:.3f}")
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", bench_cases)
+async def test_bench_stable_sync_lag(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_full_sync(c_replica)
+
+    load = asyncio.create_task(
+        run_load(bench_path(df_local_factory), master.port, LOAD_QPS, LOAD_SECONDS))
+    lags, staleness = [], []
+    while not load.done():
+        await asyncio.sleep(0.1)
+        lags.append(await replication_lag(c_master, c_replica))
+        info = await c_replica.info("replication")
+        staleness.append(info.get("slave_staleness_ms", 0))
+    await load
+
+    start = time.time()
+    await wait_caught_up(c_master, c_replica)
+    drain = time.time() - start
+
+    lags.sort()
+    staleness.sort()
+    report("stable_sync_lag", master_threads=t_master, replica_threads=t_replica, qps=LOAD_QPS,
+           lag_entries_p50=lags[len(lags) // 2], lag_entries_max=lags[-1],
+           staleness_ms_p50=staleness[len(staleness) // 2], staleness_ms_max=staleness[-1],
+           drain_sec=f"{drain:.3f}")
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", bench_cases)
+async def test_bench_catch_up(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    proxy = DropProxy(BASE_PORT+2, master.port)
+    await proxy.start()
+
+    await c_replica.execute_command("REPLICAOF localhost " + str(proxy.port))
+    await wait_full_sync(c_replica)
+
+    # The paused replica does not reconnect, so the writes pile up in the journal of the master.
+    await c_replica.execute_command("DEBUG REPLICA PAUSE")
+    proxy.drop()
+    await run_load(bench_path(df_local_factory), master.port, LOAD_QPS, LOAD_SECONDS)
+    behind = await replication_lag(c_master, c_replica)
+
+    start = time.time()
+    await c_replica.execute_command("DEBUG REPLICA RESUME")
+    await wait_full_sync(c_replica)
+    await wait_caught_up(c_master, c_replica)
+    elapsed = time.time() - start
+
+    report("catch_up", master_threads=t_master, replica_threads=t_replica,
+           entries=behind, sec=f"{elapsed:.3f}",
+           entries_per_sec=int(behind / elapsed) if elapsed > 0 else 0)
+
+    proxy.close()
@@ -224,3 +224,330 @@ async def test_disconnect(df_local_factory, t_master, t_crash_fs, t_crash_ss, t_
 
     # Check master survived all disconnects
     assert await c_master.ping()
+
+
+"""
+Test resuming replication after the connections to the master drop. The replica connects through
+a proxy, which closes all the connections while the master keeps receiving writes. The replica
+reconnects and resumes from the journal backlog of the master.
+"""
+
+
+class DropProxy:
+    def __init__(self, port, target_port):
+        self.port = port
+        self.target_port = target_port
+        self.writers = []
+        self.server = None
+
+    async def start(self):
+        self.server = await asyncio.start_server(self.handle, "localhost", self.port)
+
+    async def handle(self, reader, writer):
+        t_reader, t_writer = await asyncio.open_connection("localhost", self.target_port)
+        self.writers += [writer, t_writer]
+
+        async def pipe(src, dst):
+            try:
+                while data := await src.read(4096):
+                    dst.write(data)
+                    await dst.drain()
+            except (ConnectionError, asyncio.CancelledError):
+                pass
+            finally:
+                dst.close()
+
+        await asyncio.gather(pipe(reader, t_writer), pipe(t_reader, writer))
+
+    def drop(self):
+        for writer in self.writers:
+            writer.close()
+        self.writers = []
+
+    def close(self):
+        self.drop()
+        self.server.close()
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", [(4, 4), (4, 2)])
+async def test_resume_after_disconnect(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    proxy = DropProxy(BASE_PORT+2, master.port)
+    await proxy.start()
+
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=1))
+    await c_replica.execute_command("REPLICAOF localhost " + str(proxy.port))
+    await wait_available_async(c_replica)
+
+    # Let the replica reach stable sync before dropping the connections.
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=2))
+    await asyncio.sleep(0.5)
+    proxy.drop()
+
+    # These writes happen while the replica is disconnected.
+    await batch_fill_data_async(c_master, gen_test_data(500, seed=3))
+
+    await asyncio.sleep(1.5)
+    await wait_available_async(c_replica)
+    await batch_fill_data_async(c_master, gen_test_data(100, seed=4))
+    await asyncio.sleep(0.5)
+
+    await batch_check_data_async(c_replica, gen_test_data(100, seed=4))
+    await batch_check_data_async(c_replica, gen_test_data(400, start=100, seed=3))
+    await batch_check_data_async(c_replica, gen_test_data(500, start=500, seed=2))
+
+    proxy.close()
+
+
+"""
+Test that multi-shard transactions apply on the replica in order with the other entries of
+their shards. Every round moves a value through keys of different shards and overwrites the
+keys it leaves, so a reordered RENAME on the replica leaves a different value behind.
+"""
+
+
+@pytest.mark.asyncio
+async def test_multi_shard_order(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    async def rename_chain(chain, n_rounds):
+        for i in range(n_rounds):
+            await c_master.set(f"{chain}-k0", f"v{i}")
+            for j in range(1, 8):
+                await c_master.rename(f"{chain}-k{j-1}", f"{chain}-k{j}")
+                await c_master.set(f"{chain}-k{j-1}", f"left{i}")
+
+    await asyncio.gather(*(rename_chain(c, 50) for c in range(10)))
+    await asyncio.sleep(0.5)
+
+    for c in range(10):
+        keys = [f"{c}-k{j}" for j in range(8)]
+        assert await c_replica.mget(keys) == await c_master.mget(keys)
+
+
+"""
+Test that replicas track their staleness from the heartbeats of the master, and that
+reads with a staleness bound fail once the master is gone.
+"""
+
+
+@pytest.mark.asyncio
+async def test_read_staleness(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    await c_master.set("k", "v")
+    await asyncio.sleep(0.5)
+
+    info = await c_replica.info("replication")
+    assert info["slave_staleness_ms"] < 1000
+
+    await c_replica.execute_command("CLIENT READONLY_STALENESS 1000")
+    assert await c_replica.get("k") == b"v"
+
+    master.stop()
+    await asyncio.sleep(1.5)
+
+    with pytest.raises(aioredis.ResponseError, match="STALE"):
+        await c_replica.get("k")
+
+    # Bounded reads can be disabled again.
+    await c_replica.execute_command("CLIENT READONLY_STALENESS 0")
+    assert await c_replica.get("k") == b"v"
+
+
+"""
+Test full sync with a tiny snapshot buffer, so the snapshots pause and spill the changes that
+stream meanwhile to disk, and the spilled changes still arrive in order.
+"""
+
+
+@pytest.mark.asyncio
+async def test_full_sync_backpressure(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4,
+                                     snapshot_buffer_bytes=16384, snapshot_spill_bytes=16384)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await batch_fill_data_async(c_master, gen_test_data(20000, seed=1))
+
+    async def stream_data():
+        gen = gen_test_data(5000, seed=2)
+        for chunk in grouper(3, gen):
+            await c_master.mset({k: v for k, v in chunk})
+
+    stream_fut = asyncio.create_task(stream_data())
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await stream_fut
+
+    await wait_available_async(c_replica)
+    await asyncio.sleep(0.5)
+    await batch_check_data_async(c_replica, gen_test_data(20000, start=5000, seed=1))
+    await batch_check_data_async(c_replica, gen_test_data(5000, seed=2))
+
+    info = await c_master.info("persistence")
+    assert info["snapshot_buffer_bytes"] == 0
+
+
+"""
+Test that a replica which loaded a snapshot of the master at startup catches up from the journal
+of the master and keeps the changes made after the snapshot.
+"""
+
+
+@pytest.mark.asyncio
+async def test_bootstrap_from_snapshot(df_local_factory, tmp_dir):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4,
+                                     dir=str(tmp_dir), dbfilename="bootstrap")
+    feeder = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+    replica = df_local_factory.create(port=BASE_PORT+2, proactor_threads=2,
+                                      dir=str(tmp_dir), dbfilename="bootstrap")
+
+    master.start()
+    feeder.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_feeder = aioredis.Redis(port=feeder.port)
+
+    # The journal of the master is open while it has a replica.
+    await c_feeder.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_feeder)
+
+    await c_master.mset({f"k{i}": f"v{i}" for i in range(1000)})
+    await c_master.execute_command("SAVE DF")
+    await c_master.mset({f"k{i}": f"w{i}" for i in range(500, 1500)})
+
+    replica.start()
+    c_replica = aioredis.Redis(port=replica.port)
+    assert await c_replica.get("k0") == b"v0"
+
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+    await asyncio.sleep(0.5)
+
+    for i in range(1500):
+        expected = f"v{i}" if i < 500 else f"w{i}"
+        assert await c_replica.get(f"k{i}") == expected.encode()
+
+
+"""
+Test that a replica serves its own replica, which receives both the full sync and the stable
+sync through it, and that the chain follows a full sync of the middle replica.
+"""
+
+
+@pytest.mark.asyncio
+async def test_chained_replication(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=4)
+    sub_replica = df_local_factory.create(port=BASE_PORT+2, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    sub_replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    c_sub_replica = aioredis.Redis(port=sub_replica.port)
+
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=1))
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    await c_sub_replica.execute_command("REPLICAOF localhost " + str(replica.port))
+    await wait_available_async(c_sub_replica)
+    assert (await c_replica.info("replication"))["connected_slaves"] == 1
+
+    await batch_fill_data_async(c_master, gen_test_data(500, seed=2))
+    await asyncio.sleep(0.5)
+    await batch_check_data_async(c_sub_replica, gen_test_data(500, seed=2))
+    await batch_check_data_async(c_sub_replica, gen_test_data(500, start=500, seed=1))
+
+    # The middle replica syncs from scratch, its replica must not miss the new dataset.
+    await c_master.flushall()
+    await batch_fill_data_async(c_master, gen_test_data(200, seed=3))
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+    await asyncio.sleep(1.5)
+    await wait_available_async(c_sub_replica)
+    await asyncio.sleep(0.5)
+
+    assert await c_sub_replica.dbsize() == 200
+    await batch_check_data_async(c_sub_replica, gen_test_data(200, seed=3))
+
+
+"""
+Test that a master resumes from the journal of its replica after the replica was promoted,
+and that it does a full sync if it has writes the replica did not get before the promotion.
+"""
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", [(4, 4), (4, 2)])
+async def test_failover_without_full_sync(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=1))
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+    await batch_fill_data_async(c_master, gen_test_data(500, seed=2))
+    await asyncio.sleep(0.5)
+
+    # The replica takes over with all the writes, the former master follows it.
+    await c_replica.execute_command("REPLICAOF NO ONE")
+    await batch_fill_data_async(c_replica, gen_test_data(100, seed=3))
+    await c_master.execute_command("REPLICAOF localhost " + str(replica.port))
+    await wait_available_async(c_master)
+    await asyncio.sleep(0.5)
+
+    info = await c_replica.info("replication")
+    assert info["sync_full"] == 0
+    assert info["sync_partial_ok"] == 1
+    await batch_check_data_async(c_master, gen_test_data(100, seed=3))
+    await batch_check_data_async(c_master, gen_test_data(400, start=100, seed=2))
+    await batch_check_data_async(c_master, gen_test_data(500, start=500, seed=1))
+
+    # Writes on the former replica after the next promotion diverge, they are dropped.
+    full_syncs = (await c_master.info("replication"))["sync_full"]
+    await c_master.execute_command("REPLICAOF NO ONE")
+    await c_replica.set("diverged", "1")
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+    await asyncio.sleep(0.5)
+
+    assert (await c_master.info("replication"))["sync_full"] == full_syncs + 1
+    assert await c_replica.get("diverged") is None
+    await batch_check_data_async(c_replica, gen_test_data(100, seed=3))
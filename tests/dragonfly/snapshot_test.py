@@ -65,6 +65,28 @@ class TestDflySnapshot(SnapshotTestBase):
         batch_check_data(client, gen_test_data(NUM_KEYS))
 
 
+@dfly_args({**BASIC_ARGS, "dbfilename": "test", "proactor_threads": 4, "num_shards": 2})
+class TestShardCountSnapshot(SnapshotTestBase):
+    """Test that a multi file snapshot has a file per shard rather than per thread"""
+    @pytest.fixture(autouse=True)
+    def setup(self, tmp_dir: Path):
+        self.tmp_dir = tmp_dir
+        files = glob.glob(str(tmp_dir.absolute()) + '/test-*.dfs')
+        for file in files:
+            os.remove(file)
+
+    def test_snapshot(self, client: redis.Redis):
+        batch_fill_data(client, gen_test_data(NUM_KEYS))
+
+        client.execute_command("SAVE DF")
+        files = glob.glob(str(self.tmp_dir.absolute()) + '/test-*.dfs')
+        assert len(files) == 3  # two shards and the summary
+
+        assert client.flushall()
+        client.execute_command("DEBUG LOAD " + super().get_main_file("dfs"))
+        batch_check_data(client, gen_test_data(NUM_KEYS))
+
+
 @dfly_args({**BASIC_ARGS, "dbfilename": "test.rdb", "save_schedule": "*:*"})
 class TestPeriodicSnapshot(SnapshotTestBase):
     """Test periodic snapshotting"""
@@ -78,3 +100,59 @@ class TestPeriodicSnapshot(SnapshotTestBase):
         time.sleep(60)
 
         assert self.rdb_out.exists()
+
+
+def test_journal_recovery(df_local_factory, tmp_dir: Path):
+    """Test that the changes after the last snapshot survive a crash"""
+    journal_dir = tmp_dir / "journal"
+    args = {"port": 1120, "proactor_threads": 2, "dir": str(journal_dir),
+            "dbfilename": "test", "persistent_journal": "true", "journal_fsync": "always"}
+
+    server = df_local_factory.create(**args)
+    server.start()
+    client = redis.Redis(port=server.port)
+    batch_fill_data(client, gen_test_data(NUM_KEYS, seed=1))
+    client.execute_command("SAVE")
+
+    # Written after the snapshot, so they are recovered from the journal only.
+    batch_fill_data(client, gen_test_data(NUM_KEYS, seed=2))
+    client.delete("k-0")
+    server.stop(kill=True)
+
+    server = df_local_factory.create(**args)
+    server.start()
+    client = redis.Redis(port=server.port)
+    batch_check_data(client, gen_test_data(NUM_KEYS, start=1, seed=2))
+    assert client.exists("k-0") == 0
+
+
+def test_journal_hash_fields(df_local_factory, tmp_dir: Path):
+    """Test that the changes of hash fields after the last snapshot are recovered"""
+    journal_dir = tmp_dir / "journal"
+    args = {"port": 1120, "proactor_threads": 2, "dir": str(journal_dir),
+            "dbfilename": "test", "persistent_journal": "true", "journal_fsync": "always"}
+
+    server = df_local_factory.create(**args)
+    server.start()
+    client = redis.Redis(port=server.port)
+    client.hset("h", mapping={f"f{i}": i for i in range(5000)})
+    client.execute_command("SAVE")
+
+    # Every change is journaled as the fields it touches rather than as the whole hash.
+    client.hset("h", "f1", "a")
+    client.hsetnx("h", "f2", "b")
+    client.hsetnx("h", "new", "c")
+    client.hincrby("h", "f3", 10)
+    client.hincrbyfloat("h", "f4", 0.5)
+    client.hdel("h", "f5", "f6", "missing")
+    client.hset("small", "x", "1")
+    client.hdel("small", "x")
+    server.stop(kill=True)
+
+    server = df_local_factory.create(**args)
+    server.start()
+    client = redis.Redis(port=server.port)
+    assert client.hlen("h") == 4999
+    assert client.hmget("h", "f1", "f2", "new", "f3", "f4", "f5") == [
+        b"a", b"2", b"c", b"13", b"4.5", None]
+    assert client.exists("small") == 0